@@ -10,6 +10,10 @@ my $LANG = 'de';
 
 my $BEAM = 2.1;
 my $OUTPUT = 'plf';
+my $THREADS = 1;
+# the segmentations of this many distinct words are remembered, so frequent
+# words are only sent to the decoder once
+my $MAX_CACHE = 1000000;
 my $HELP;
 my $VERBOSE;
 my $PRESERVE_CASE;
@@ -18,6 +22,7 @@ GetOptions("decoder=s" => \$CDEC,
            "language=s" => \$LANG,
            "beam=f" => \$BEAM,
            "output=s" => \$OUTPUT,
+           "threads=i" => \$THREADS,
            "verbose" => \$VERBOSE,
            "preserve_case" => \$PRESERVE_CASE,
            "help" => \$HELP
@@ -45,6 +50,7 @@ if ($OUTPUT eq 'plf') {
   $IS_PLF = 1;
   $CMD .= " --csplit_preserve_full_word --csplit_output_plf --beam_prune $BEAM";
 }
+$CMD .= " --threads $THREADS" if $THREADS > 1;
 $CMD .= $VERBOSE;
 
 print STDERR "Executing: $CMD\n";
@@ -55,7 +61,10 @@ binmode(STDOUT,":utf8");
 binmode(IN,":utf8");
 binmode(OUT,":utf8");
 
+my %cache;    # word => segmentation
+my %pending;  # words of the current line not in %cache
 while(<STDIN>) {
+  %cache = () if scalar(keys %cache) >= $MAX_CACHE;
   chomp;
   s/^\s+//;
   s/\s+$//;
@@ -79,23 +88,28 @@ while(<STDIN>) {
     } else {
       push @casings, guess_casing($words[$i]);
       push @res, undef;
-      push @todo, $word;
+      push @todo, $word unless defined $cache{$word} || $pending{$word}++;
     }
   }
   if (scalar @todo > 0) {
     # print STDERR "TODO: @todo\n";
     my $tasks = join "\n", @todo;
     print IN "$tasks\n";
-    for (my $i = 0; $i < scalar @res; $i++) {
-      if (!defined $res[$i]) {
-        my $seg = <OUT>;
-        chomp $seg;
-        unless ($IS_PLF) {
-          $seg =~ s/^# //o;
-        }
-        if ($PRESERVE_CASE && $casings[$i]) { $seg = recase_words($seg); }
-        $res[$i] = $seg;
+    for my $word (@todo) {
+      my $seg = <OUT>;
+      chomp $seg;
+      unless ($IS_PLF) {
+        $seg =~ s/^# //o;
       }
+      $cache{$word} = $seg;
+    }
+  }
+  %pending = ();
+  for (my $i = 0; $i < scalar @res; $i++) {
+    if (!defined $res[$i]) {
+      my $seg = $cache{lc $words[$i]};
+      if ($PRESERVE_CASE && $casings[$i]) { $seg = recase_words($seg); }
+      $res[$i] = $seg;
     }
   }
   if ($IS_PLF) {
@@ -139,6 +153,7 @@ Usage: $0 [OPTIONS] < file.txt
     --beam NUM            Beam threshold, used with PLF output
                             (probably between 1.5 and 5.0)
     --output plf|1best    Output format, 1best or plf (lattice)
+    --threads NUM         Number of decoder threads
     --preserve_case       Preserve the casing of the input word
                             (model will be scored lowercase)
     --verbose             Show verbose decoder output
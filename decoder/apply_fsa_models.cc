@@ -6,7 +6,9 @@
 #include <stdexcept>
 #include <cassert>
 #include <queue>
+#include <deque>
 #include <stdint.h>
+#include <tr1/unordered_map>
 
 #include "writer.h"
 #include "hg.h"
@@ -26,10 +28,10 @@
 #include "string_to.h"
 
 
-#define DFSA(x) x
+#define DFSA(x)
 //fsa earley chart
 
-#define DPFSA(x) x
+#define DPFSA(x)
 //prefix trie
 
 #define DBUILDTRIE(x)
@@ -42,8 +44,6 @@
 #endif
 // keep backpointers in prefix trie so you can print a meaningful node id
 
-static const unsigned FSA_AGENDA_RESERVE=10; // TODO: increase to 1<<24 (16M)
-
 using namespace std;
 
 //impl details (not exported).  flat namespace for my ease.
@@ -149,10 +149,11 @@ struct PrefixTrieEdge {
   bool is_final() const { return dest==0; }
   best_t p_dest() const;
   WordID w; // for root and and is_final(), this will be (negated) NTHandle.
+  RuleHandle rule; // for is_final(): the best rule with this lhs and rhs (same-rhs rules are merged here)
 
-  // for sorting most probable first in adj; actually >(p)
+  // for sorting most probable first in adj (best_t a<b means a is better)
   inline bool operator <(PrefixTrieEdge const& o) const {
-    return o.p<p;
+    return p<o.p;
   }
   PRINT_SELF(PrefixTrieEdge)
   void print(std::ostream &o) const {
@@ -164,6 +165,7 @@ struct PrefixTrieEdge {
 //note: ending a rule is handled with a special final edge, so that possibility can be explored in best-first order along with the rest (alternative: always finish a final rule by putting it on queue).  this edge has no symbol on it.
 struct PrefixTrieNode {
   best_t p; // viterbi (max prob) of rule this node leads to - when building.  telescope later onto edges for best-first.
+  RuleHandle rule; // the rule p came from.  its hg edge is what the fsa sees when we scan a word after this prefix
 //  bool final; // may also have successors, of course.  we don't really need to track this; a null dest edge in the adj list lets us encounter the fact in best first order.
   void p_delta(int next,best_t &p) const {
     p*=adj[next].p;
@@ -201,7 +203,7 @@ struct PrefixTrieNode {
       return;
     }
     bool first=true;
-    while (i--<=0) {
+    while (i--) {
       if (!first) o<<',';
       first=false;
       WordID w=back[i].w;
@@ -222,7 +224,7 @@ struct PrefixTrieNode {
   IF_PRINT_PREFIX(BP backp;)
 
   enum { ROOT=-1 };
-  explicit PrefixTrieNode(NTHandle lhs=ROOT,best_t p=1) : p(p),lhs(lhs),IF_PRINT_PREFIX(backp()) {
+  explicit PrefixTrieNode(NTHandle lhs=ROOT,best_t p=1,RuleHandle rule=-1) : p(p),rule(rule),lhs(lhs),IF_PRINT_PREFIX(backp()) {
     //final=false;
   }
   bool is_root() const { return lhs==ROOT; } // means adj are the nonneg lhs indices, and we have the index edge_for still available
@@ -321,24 +323,27 @@ public:
   typedef WordID W;
 
   // let's compute p_min so that every rule reachable from the created node has p at least this low.
-  NodeP improve_edge(PrefixTrieEdge const& e,best_t rulep) {
+  NodeP improve_edge(PrefixTrieEdge const& e,best_t rulep,RuleHandle ri) {
     NodeP d=e.dest;
-    maybe_improve(d->p,rulep);
+    if (better(rulep,d->p)) {
+      d->p=rulep;
+      d->rule=ri;
+    }
     return d;
   }
 
-  inline NodeP build(W w,best_t rulep) {
-    return build(lhs,w,rulep);
+  inline NodeP build(W w,best_t rulep,RuleHandle ri) {
+    return build(lhs,w,rulep,ri);
   }
-  inline NodeP build_lhs(NTHandle n,best_t rulep) {
-    return build(n,-n,rulep);
+  inline NodeP build_lhs(NTHandle n,best_t rulep,RuleHandle ri) {
+    return build(n,-n,rulep,ri);
   }
 
-  NodeP build(NTHandle lhs_,W w,best_t rulep) {
+  NodeP build(NTHandle lhs_,W w,best_t rulep,RuleHandle ri) {
     PrefixTrieEdgeFor::iterator i=edge_for.find(w);
     if (i!=edge_for.end())
-      return improve_edge(i->second,rulep);
-    NodeP r=new PrefixTrieNode(lhs_,rulep);
+      return improve_edge(i->second,rulep,ri);
+    NodeP r=new PrefixTrieNode(lhs_,rulep,ri);
     IF_PRINT_PREFIX(r->backp=BP(w,this));
 //    edge_for.insert(i,PrefixTrieEdgeFor::value_type(w,PrefixTrieEdge(w,r)));
     add(edge_for,w,PrefixTrieEdge(w,r));
@@ -346,13 +351,17 @@ public:
     return r;
   }
 
-  void set_final(NTHandle lhs_,best_t pf) {
+  void set_final(NTHandle lhs_,best_t pf,RuleHandle ri) {
     assert(no_adj());
 //    final=true;
+    PrefixTrieEdgeFor::iterator i=edge_for.find(null_wordid);
+    if (i!=edge_for.end() && !better(pf,i->second.p))
+      return; // a rule with the same rhs was at least as good
     PrefixTrieEdge &e=edge_for[null_wordid];
     e.p=pf;
     e.dest=0;
     e.w=lhs_;
+    e.rule=ri;
     maybe_improve(p,pf);
   }
 
@@ -415,15 +424,15 @@ struct PrefixTrie {
     NTHandle lhs=r.lhs;
     best_t p=r.p;
 //    NodeP n=const_cast<PrefixTrieNode&>(root).build_lhs(lhs,p);
-    NodeP n=root.build_lhs(lhs,p);
+    NodeP n=root.build_lhs(lhs,p,ri);
     SHOWM4(DBUILDTRIE,"Prefixtrie rule id, root",ri,root,p,*n);
     for (RHS::const_iterator i=r.rhs.begin(),e=r.rhs.end();;++i) {
       SHOWM2(DBUILDTRIE,"PrefixTrie build or final",i-r.rhs.begin(),*n);
       if (i==e) {
-        n->set_final(lhs,p);
+        n->set_final(lhs,p,ri);
         break;
       }
-      n=n->build(*i,p);
+      n=n->build(*i,p,ri);
       SHOWM2(DBUILDTRIE,"PrefixTrie built",*i,*n);
     }
 //    root.build(lhs,r.p)->build(r.rhs,r.p);
@@ -441,217 +450,395 @@ private:
 
 typedef std::size_t ItemHash;
 
+// fsa states are interned, so that chart items can hold them as ints
+typedef int FsaState;
 
-struct ItemKey {
-  explicit ItemKey(NodeP start,Bytes const& start_state) : dot(start),q(start_state),r(start_state) {  }
-  explicit ItemKey(NodeP dot) : dot(dot) {  }
-  NodeP dot; // dot is a function of the stuff already recognized, and gives a set of suffixes y to complete to finish a rhs for lhs() -> dot y.  for a lhs A -> . *, this will point to lh2[A]
-  Bytes q,r; // (q->r are the fsa states; if r is empty it means
-  bool operator==(ItemKey const& o) const {
-    return dot==o.dot && q==o.q && r==o.r;
+struct FsaStates {
+  explicit FsaStates(int ssz) : ssz(ssz) {  }
+  FsaState intern(void const* st) {
+    uint8_t const* b=(uint8_t const*)st;
+    Bytes s(b,b+ssz);
+    std::pair<Index::iterator,bool> r=index.insert(Index::value_type(s,(FsaState)states.size()));
+    if (r.second)
+      states.push_back(s);
+    return r.first->second;
   }
-  inline ItemHash hash() const {
-    ItemHash h=GOLDEN_MEAN_FRACTION*(ItemHash)(dot-NULL); // i.e. lower order bits of ptr are nonrandom
-    using namespace boost;
-    hash_combine(h,q);
-    hash_combine(h,r);
-    return h;
-  }
-  template<class O>
-  void print(O &o) const {
-    o<<"lhs="<<lhs();
-    if (dot)
-      dot->print_back_str(o);
-    if (print_fsa) {
-      o<<'/';
-      print_fsa->print_state(o,&q[0]);
-      o<<"->";
-      print_fsa->print_state(o,&r[0]);
-    }
+  void const* operator[](FsaState i) const {
+    return states[i].begin();
   }
-  NTHandle lhs() const { return dot->lhs; }
-  PRINT_SELF(ItemKey)
+  int size() const { return states.size(); }
+private:
+  typedef std::tr1::unordered_map<Bytes,FsaState,boost::hash<Bytes> > Index;
+  int ssz;
+  Index index;
+  std::vector<Bytes> states;
+};
+
+// the result of scanning a word (or the end phrase) from some state; cached, since the same (state,word) is scanned by many items
+struct FsaScan {
+  FsaState to;
+  FeatureVector features;
+  best_t p; // exp(weights dot features)
 };
-inline ItemHash hash_value(ItemKey const& x) {
-  return x.hash();
-}
-ItemKey null_item((PrefixTrieNode*)0);
 
 struct Item;
-typedef Item *ItemP;
-
-/* we use a single type of item so it can live in a single best-first queue.  we hold them by pointer so they can have mutable state, e.g. priority/location, but also lists of predictions and kbest completions (i.e. completions[L,r] = L -> * (r,s), by 1best for each possible s.  we may discover more s later.  we could use different subtypes since we hold by pointer, but for now everything will be packed as variants of Item */
-#undef INIT_LOCATION
-#if D_ARY_TRACK_OUT_OF_HEAP
-# define INIT_LOCATION                           , location(D_ARY_HEAP_NULL_INDEX)
-#elif !defined(NDEBUG) || SAFE_VALGRIND
- // avoid spurious valgrind warning - FIXME: still complains???
-# define INIT_LOCATION                           , location()
-#else
-# define INIT_LOCATION
-#endif
+struct Completed;
+
+// how an item was reached: from prev, by scanning w or by completing child
+struct ItemBack {
+  ItemBack(Item const* prev,Completed const* child,WordID w) : prev(prev),child(child),w(w) {  }
+  Item const* prev;
+  Completed const* child; // 0 for a scanned word
+  WordID w;
+};
 
-// these should go in a global best-first queue
-struct ItemPrio {
-  // NOTE: sum = viterbi (max)
-  ItemPrio() : priority(init_0()),inner(init_0()) {  }
-  explicit ItemPrio(best_t priority) : priority(priority),inner(init_0()) {  }
-  best_t priority; // includes inner prob. (forward)
-  /* The forward probability alpha_i(X[k]->x.y) is the sum of the probabilities of all
-     constrained paths of length i that end in state X[k]->x.y*/
-  best_t inner;
-  /* The inner probability beta_i(X[k]->x.y) is the sum of the probabilities of all
-     paths of length i-k that start in state X[k,k]->.xy and end in X[k,i]->x.y, and generate the input symbols x[k,...,i-1] */
+// A -> p . y, with fsa q (before p) -> r (after p).  the prefix p and A are given by the trie node dot.  for A -> . y (predicted), q==r and backs is empty
+struct Item {
+  Item(NodePc dot,FsaState q,FsaState r) : dot(dot),q(q),r(r),inside(init_0()),popped(false) {  }
+  NodePc dot;
+  FsaState q,r;
+  best_t inside; // best so far; final once popped (if the model scores are all <=1)
+  bool popped;
+  typedef std::vector<ItemBack> Backs;
+  Backs backs;
   template<class O>
   void print(O &o) const {
-    o<<priority; // TODO: show/use inner?
+    o<<'['<<dot->lhs<<' ';
+    dot->print_back_str(o);
+    o<<" q="<<q<<" r="<<r<<' '<<inside<<']';
   }
-  typedef ItemPrio self_type;
-  SELF_TYPE_PRINT
+  PRINT_SELF(Item)
 };
 
-#define ITEM_TYPE(X,t)                              \
-  X(t,ADJ,=-1)                                 \
-
-#define ITEM_TYPE_TYPE ItemType
+// A -> * ., with fsa q -> r.  one of these becomes a node of the output forest
+struct Completed {
+  Completed(NTHandle lhs,FsaState q,FsaState r) : lhs(lhs),q(q),r(r),inside(init_0()),popped(false),kept(false),node(-1) {  }
+  NTHandle lhs;
+  FsaState q,r;
+  best_t inside;
+  bool popped;
+  bool kept; // popped within the pop_limit for lhs, so it's in the output
+  int node; // output forest node
+  struct Final {
+    Final(Item const* item,RuleHandle rule) : item(item),rule(rule) {  }
+    Item const* item; // A -> rhs(rule) .
+    RuleHandle rule;
+  };
+  typedef std::vector<Final> Finals;
+  Finals finals; // each is one or more output edges (one per way of reaching item)
+};
 
-DECLARE_NAMED_ENUM(ITEM_TYPE)
-DEFINE_NAMED_ENUM(ITEM_TYPE)
+// a predicted A with left state q: the items waiting on A[q,?] (and which trie edge they advance over), and the A[q,r] completed so far
+struct Predicted {
+  typedef std::pair<Item const*,int> Waiting; // item, index into item->dot->adj
+  std::vector<Waiting> waiting;
+  std::vector<Completed const*> completed;
+};
 
-struct Item : ItemPrio,ItemKey {
-/*  explicit Item(NodeP dot,best_t prio,int next) : ItemPrio(prio),ItemKey(dot),trienext(next),from(0)
-                                        INIT_LOCATION
-                                        {  }*/
-//  ItemType t;
-  // lazy queueing of succesors item:
-  bool is_trie_adj() const {
-    return trienext>=0;
-  }
-  explicit Item(FFState const& state,NodeP dot,best_t prio,int next=0) : ItemPrio(prio),ItemKey(dot,state),trienext(next),from(0)
-                                                             INIT_LOCATION
-  {
-//    t=ADJ;
-//    if (dot->adj.size())
-    dot->p_delta(next,priority);
-//    SHOWM1(DFSA,"Item(state,dot,prio)",prio);
-  }
-  typedef std::queue<ItemP> Predicted;
-//  Predicted predicted; // this is empty, unless this is a predicted L -> .asdf item, or a to-complete L -> asdf .
-  int trienext; // index of dot->adj to complete (if dest==0), or predict (if NT), or scan (if word).  note: we could store pointer inside adj since it and trie are @ fixed addrs.  less pointer arith, more space.
-  ItemP from; //backpointer - 0 for L -> . asdf for the rest; L -> a .sdf, it's the L -> .asdf item.
-  ItemP predicted_from() const {
-    ItemP p=(ItemP)this;
-    while(p->from) p=p->from;
-    return p;
+struct ItemKey {
+  ItemKey(NodePc dot,FsaState q,FsaState r) : dot(dot),q(q),r(r) {  }
+  NodePc dot;
+  FsaState q,r;
+  bool operator==(ItemKey const& o) const {
+    return dot==o.dot && q==o.q && r==o.r;
   }
-  template<class O>
-  void print(O &o) const {
-    o<< '[';
-    o<<this<<": ";
-    ItemKey::print(o);
-    o<<' ';
-    ItemPrio::print(o);
-    o<<" next="<<trienext;
-    o<< ']';
+  friend inline ItemHash hash_value(ItemKey const& x) {
+    ItemHash h=GOLDEN_MEAN_FRACTION*(ItemHash)((char const*)x.dot-(char const*)0); // i.e. lower order bits of ptr are nonrandom
+    boost::hash_combine(h,x.q);
+    boost::hash_combine(h,x.r);
+    return h;
   }
-  PRINT_SELF(Item)
-  unsigned location;
 };
 
-struct GetItemKey {
-  typedef Item argument_type;
-  typedef ItemKey result_type;
-  result_type const& operator()(Item const& i) const { return i; }
-  template <class T>
-  T const& operator()(T const& t) const { return t; }
+struct CompletedKey {
+  CompletedKey(NTHandle lhs,FsaState q,FsaState r) : lhs(lhs),q(q),r(r) {  }
+  NTHandle lhs;
+  FsaState q,r;
+  bool operator==(CompletedKey const& o) const {
+    return lhs==o.lhs && q==o.q && r==o.r;
+  }
+  friend inline ItemHash hash_value(CompletedKey const& x) {
+    ItemHash h=x.lhs;
+    boost::hash_combine(h,x.q);
+    boost::hash_combine(h,x.r);
+    return h;
+  }
 };
 
-/* here's what i imagine (best first):
-   all of these are looked up in a chart which includes the fsa states as part of the identity
-
-   perhaps some items are ephemeral and never reused (e.g. edge items of a cube, where we delay traversing trie based on probabilities), but in all ohter cases we make entirely new objects derived from the original one (memoizing).  let's ignore lazier edge items for now and always push all successors onto heap.
-
-   initial item (predicted): GOAL_NT -> . * (trie root for that lhs), start, start (fsa start states).  has a list of
+// items and completions share one best-first queue.  an entry is stale if its item has since been queued at a better priority
+struct AgendaEntry {
+  AgendaEntry(best_t p,Item *item) : p(p),item(item),completed(0) {  }
+  AgendaEntry(best_t p,Completed *completed) : p(p),item(0),completed(completed) {  }
+  best_t p;
+  Item *item;
+  Completed *completed;
+  // std::priority_queue pops the max, i.e. the best
+  bool operator<(AgendaEntry const& o) const {
+    return better(o.p,p);
+  }
+};
 
-   completing item ( L -> * . needs to queue all the completions immediately.  when predicting before a completion happens, add to prediction list.  after it happens, immediately use the completed bests.  this is confusing to me: the completions for an original NT w/ a given r state may end up in several different ones.  we don't only care about the 1 best cost r item but all the different r.
+/* best-first (Knuth 1977) Earley intersection of the (pushed weight) CFG with an fsa.  an item is expanded over each outgoing trie edge, cheapest first:
 
-   the prediction's left/right uses the predictor's right
+   scan: A -> p . w y, q, r  =>  A -> p w . y, q, fsa(r,w)
+   predict: A -> p . B y, q, r  =>  B -> . *, r, r (once per B,r); and wait on B[r,?]
+   complete: A -> p . B y, q, r and B[r,s]  =>  A -> p B . y, q, s
+   final: A -> p ., q, r  =>  A[q,r]
 
- */
+   because prediction starts at the goal with the fsa start state, only the (NT, left state) pairs that can actually occur are ever built; bottom up, every node would be split by every state its subtree can end in.  with pop_limit>0, only the first pop_limit A[q,r] (the best, if scores are monotone) are kept for each A - plus the first for each q that would otherwise have none - and items for an A that's already full aren't expanded at all.  the output forest has a node per kept A[q,r] and an edge per way of deriving it, with the fsa features of the words it scanned; edges into the goal also score the fsa end phrase. */
 template <class FsaFF=FsaFeatureFunction>
 struct Chart {
-  //typedef HASH_MAP<Item,ItemP,boost::hash<Item> > Items;
-  //typedef Items::iterator FindItem;
-  //typedef std::pair<FindItem,bool> InsertItem;
-//  Items items;
-  CFG &cfg; // TODO: remove this from Chart
+  typedef typename FsaFF::Accum Accum;
+
+  CFG &cfg;
+  Hypergraph const& ih; // cfg rule i is ih edge i
   SentenceMetadata const& smeta;
   FsaFF const& fsa;
+  DenseWeightVector const& weights;
+  int pop_limit;
   NTHandle goal_nt;
   PrefixTrie trie;
-  typedef Agenda<Item,BetterP,GetItemKey> A;
-  A a;
+  FsaStates states;
+  FsaState start;
+  Bytes next_state; // scratch for scans
+
+  std::priority_queue<AgendaEntry> agenda;
+  std::deque<Item> items;
+  std::deque<Completed> completeds;
+  typedef std::tr1::unordered_map<ItemKey,Item*,boost::hash<ItemKey> > ItemIndex;
+  ItemIndex item_index;
+  typedef std::tr1::unordered_map<CompletedKey,Completed*,boost::hash<CompletedKey> > CompletedIndex;
+  CompletedIndex completed_index;
+  typedef std::pair<NTHandle,FsaState> PredictedKey;
+  typedef std::tr1::unordered_map<PredictedKey,Predicted,boost::hash<PredictedKey> > PredictedIndex;
+  PredictedIndex predicted;
+  typedef std::pair<FsaState,WordID> ScanKey;
+  typedef std::tr1::unordered_map<ScanKey,FsaScan,boost::hash<ScanKey> > Scans;
+  Scans scans;
+  typedef std::tr1::unordered_map<FsaState,FsaScan> EndScans;
+  EndScans end_scans;
+  std::vector<int> n_kept; // per lhs
+  std::vector<Completed*> kept; // in pop order, i.e. children before parents
+  unsigned n_pops;
+
+  Chart(CFG &cfg,Hypergraph const& ih,SentenceMetadata const& smeta,FsaFF const& fsa,DenseWeightVector const& weights,int pop_limit)
+    : cfg(cfg),ih(ih),smeta(smeta),fsa(fsa),weights(weights),pop_limit(pop_limit),goal_nt(cfg.goal_nt),trie(cfg),states(fsa.state_bytes()),next_state(fsa.state_bytes()),n_kept(cfg.nts.size()),n_pops(0)
+  {
+    assert(fsa.state_bytes());
+    assert(cfg.rules.size()==ih.edges_.size());
+    print_fsa=&fsa;
+    start=states.intern(fsa.start_state());
+    trie.lhs2_ex(goal_nt);
+    predict(goal_nt,start);
+  }
+
+  FsaScan const& scan(FsaState from,WordID w,RuleHandle rule) {
+    std::pair<Scans::iterator,bool> r=scans.insert(Scans::value_type(ScanKey(from,w),FsaScan()));
+    FsaScan &s=r.first->second;
+    if (r.second) {
+      Accum accum;
+      fsa.ScanAccum(smeta,ih.edges_[rule],w,states[from],next_state.begin(),&accum);
+      s.to=states.intern(next_state.begin());
+      accum.Store(fsa,&s.features);
+      s.p=best_t::exp(s.features.dot(weights));
+    }
+    return s;
+  }
+
+  FsaScan const& scan_end(FsaState from,RuleHandle rule) {
+    std::pair<EndScans::iterator,bool> r=end_scans.insert(EndScans::value_type(from,FsaScan()));
+    FsaScan &s=r.first->second;
+    if (r.second) {
+      Sentence const& ends=fsa.end_phrase();
+      s.to=from;
+      s.p=best_t(init_1());
+      if (!ends.empty()) {
+        Accum accum;
+        fsa.ScanPhraseAccumOnly(smeta,ih.edges_[rule],&ends[0],&ends[0]+ends.size(),states[from],&accum);
+        accum.Store(fsa,&s.features);
+        s.p=best_t::exp(s.features.dot(weights));
+      }
+    }
+    return s;
+  }
 
-  /* had to stop working on this for now - it's garbage/useless in this form - see NOTES.earley */
+  bool is_goal(NTHandle lhs,FsaState q) const {
+    return lhs==goal_nt && q==start;
+  }
+  // lhs has pop_limit output nodes already.  but we never starve a predicted lhs[q,?] that has none yet, or its predictor would be a dead end
+  bool full(NTHandle lhs,FsaState q) {
+    return pop_limit>0 && n_kept[lhs]>=pop_limit && !predicted[PredictedKey(lhs,q)].completed.empty();
+  }
 
-  // p_partial is priority*p(rule) - excluding the FSA model score, and predicted
-  void succ(Item const& from,int adji,best_t p_partial) {
-    PrefixTrieEdge const& te=from.dot->adj[adji];
-    NodeP dest=te.dest;
-    if (te.is_final()) {
-      // complete
-      return;
+  void add_item(NodePc dot,FsaState q,FsaState r,best_t p,ItemBack const& back) {
+    std::pair<ItemIndex::iterator,bool> f=item_index.insert(ItemIndex::value_type(ItemKey(dot,q,r),0));
+    if (f.second) {
+      items.push_back(Item(dot,q,r));
+      f.first->second=&items.back();
+    }
+    Item &x=*f.first->second;
+    x.backs.push_back(back);
+    if (!x.popped && better(p,x.inside)) {
+      x.inside=p;
+      agenda.push(AgendaEntry(p,&x));
     }
-    WordID w=te.w;
-    if (w<0) {
-      NTHandle lhs=-w;
-    } else {
+  }
 
+  void add_completed(NTHandle lhs,FsaState q,FsaState r,best_t p,Completed::Final const& final) {
+    std::pair<CompletedIndex::iterator,bool> f=completed_index.insert(CompletedIndex::value_type(CompletedKey(lhs,q,r),0));
+    if (f.second) {
+      completeds.push_back(Completed(lhs,q,r));
+      f.first->second=&completeds.back();
+    }
+    Completed &c=*f.first->second;
+    c.finals.push_back(final);
+    if (is_goal(lhs,q))
+      p*=scan_end(r,final.rule).p;
+    if (!c.popped && better(p,c.inside)) {
+      c.inside=p;
+      agenda.push(AgendaEntry(p,&c));
+    }
+  }
+
+  Predicted &predict(NTHandle n,FsaState q) {
+    std::pair<PredictedIndex::iterator,bool> f=predicted.insert(PredictedIndex::value_type(PredictedKey(n,q),Predicted()));
+    if (f.second) {
+      NodeP dot=trie.lhs2[n];
+      if (dot) { // there are no rules for n, so nothing will ever complete it
+        items.push_back(Item(dot,q,q));
+        Item &x=items.back();
+        item_index[ItemKey(dot,q,q)]=&x;
+        x.inside=best_t(init_1());
+        agenda.push(AgendaEntry(x.inside,&x));
+      }
     }
+    return f.first->second;
   }
 
-  void extend1() {
-    BetterP better;
-    Item &t=*a.top();
-    best_t tp=t.priority;
-    if (t.is_trie_adj()) {
-      best_t pstop=a.second_best(); // remember; best_t a<b means a better than (higher prob) than b
-//      NodeP d=t.dot;
-      PrefixTrieNode::Adj const& adj=t.dot->adj;
-      int n=t.trienext,m=adj.size();
-      SHOWM3(DFSA,"popped",t,tp,pstop);
-      for (;n<m;++n) { // cube corner
-        PrefixTrieEdge const& te=adj[n];
-        SHOWM3(DFSA,"maybe try trie next",n,te.p,pstop);
-        if (better(te.p,pstop)) { // can get some improvement
-          SHOWM2(DFSA,"trying adj ",m,te);
-        } else {
-          goto done;
+  void expand(Item const& x) {
+    PrefixTrieNode const& dot=*x.dot;
+    PrefixTrieNode::Adj const& adj=dot.adj;
+    for (int i=0,e=adj.size();i<e;++i) {
+      PrefixTrieEdge const& te=adj[i];
+      best_t p=x.inside*te.p;
+      if (te.is_final()) {
+        add_completed(dot.lhs,x.q,x.r,p,Completed::Final(&x,te.rule));
+      } else if (te.w>0) {
+        FsaScan const& s=scan(x.r,te.w,dot.rule);
+        add_item(te.dest,x.q,s.to,p*s.p,ItemBack(&x,0,te.w));
+      } else {
+        Predicted &pr=predict(-te.w,x.r);
+        pr.waiting.push_back(Predicted::Waiting(&x,i));
+        for (unsigned j=0;j<pr.completed.size();++j) {
+          Completed const& c=*pr.completed[j];
+          add_item(te.dest,x.q,c.r,p*c.inside,ItemBack(&x,&c,0));
         }
       }
-      a.pop();
-    done:;
     }
   }
 
-  void best_first(unsigned kbest=1) {
-    assert(kbest==1); //TODO: k-best via best-first requires revisiting best things again and adjusting desc.  tricky.
-    while(!a.empty()) {
-      extend1();
+  void complete(Completed &c) {
+    c.kept=true;
+    ++n_kept[c.lhs];
+    kept.push_back(&c);
+    if (is_goal(c.lhs,c.q)) return;
+    Predicted &pr=predicted[PredictedKey(c.lhs,c.q)];
+    pr.completed.push_back(&c);
+    for (unsigned j=0;j<pr.waiting.size();++j) {
+      Item const& x=*pr.waiting[j].first;
+      PrefixTrieEdge const& te=x.dot->adj[pr.waiting[j].second];
+      add_item(te.dest,x.q,c.r,x.inside*te.p*c.inside,ItemBack(&x,&c,0));
     }
   }
 
-  Chart(CFG &cfg,SentenceMetadata const& smeta,FsaFF const& fsa,unsigned reserve=FSA_AGENDA_RESERVE)
-    : cfg(cfg),smeta(smeta),fsa(fsa),trie(cfg),a(reserve) {
-    assert(fsa.state_bytes());
-    print_fsa=&fsa;
-    goal_nt=cfg.goal_nt;
-    best_t prio=init_1();
-    SHOW1(DFSA,prio);
-    a.add(a.construct(fsa.start,trie.lhs2_ex(goal_nt),prio));
+  void best_first() {
+    while (!agenda.empty()) {
+      if (full(goal_nt,start)) break;
+      AgendaEntry t=agenda.top();
+      agenda.pop();
+      if (t.item) {
+        Item &x=*t.item;
+        if (x.popped || better(x.inside,t.p)) continue;
+        x.popped=true;
+        ++n_pops;
+        SHOWM1(DFSA,"pop",x);
+        if (!full(x.dot->lhs,x.q))
+          expand(x);
+      } else {
+        Completed &c=*t.completed;
+        if (c.popped || better(c.inside,t.p)) continue;
+        c.popped=true;
+        ++n_pops;
+        if (!full(c.lhs,c.q))
+          complete(c);
+      }
+    }
+  }
+
+  // each item reached by more than one back gives more than one edge: enumerate the paths from the final item back to its prediction
+  typedef std::vector<ItemBack const*> Path; // last symbol first
+  void add_edges(Completed const& c,Completed::Final const& f,Item const& x,Path &path,Hypergraph *oh) {
+    if (x.backs.empty()) {
+      add_edge(c,f,x.q,path,oh);
+      return;
+    }
+    for (Item::Backs::const_iterator i=x.backs.begin(),e=x.backs.end();i!=e;++i) {
+      if (i->child && !i->child->kept) continue;
+      path.push_back(&*i);
+      add_edges(c,f,*i->prev,path,oh);
+      path.pop_back();
+    }
   }
-};
 
+  void add_edge(Completed const& c,Completed::Final const& f,FsaState q,Path const& path,Hypergraph *oh) {
+    Hypergraph::Edge const& ie=ih.edges_[f.rule];
+    std::vector<WordID> const& e=ie.rule_->e();
+    Hypergraph::TailNodeVector tails(ie.tail_nodes_.size());
+    FeatureVector fsa_features;
+    FsaState st=q;
+    std::vector<WordID>::const_iterator ei=e.begin();
+    for (Path::const_reverse_iterator i=path.rbegin(),pe=path.rend();i!=pe;++i) {
+      ItemBack const& b=**i;
+      if (b.child) {
+        while (*ei>0) ++ei;
+        tails[-*ei++]=b.child->node; // the cfg rhs has the target nts in order; -w is the tail index
+        st=b.child->r;
+      } else {
+        FsaScan const& s=scan(st,b.w,f.rule);
+        fsa_features+=s.features;
+        st=s.to;
+      }
+    }
+    if (is_goal(c.lhs,c.q))
+      fsa_features+=scan_end(st,f.rule).features;
+    Hypergraph::Edge *oe=oh->AddEdge(ie,tails);
+    oe->feature_values_+=fsa_features;
+    oh->ConnectEdgeToHeadNode(oe,c.node);
+  }
+
+  void forest(Hypergraph *oh) {
+    oh->clear();
+    if (!n_kept[goal_nt]) return;
+    int goal_node=-1;
+    for (unsigned i=0;i<kept.size();++i) {
+      Completed &c=*kept[i];
+      if (!is_goal(c.lhs,c.q))
+        c.node=oh->AddNode(ih.nodes_[c.lhs].cat_)->id_;
+    }
+    goal_node=oh->AddNode(ih.nodes_[goal_nt].cat_)->id_;
+    Path path;
+    for (unsigned i=0;i<kept.size();++i) {
+      Completed &c=*kept[i];
+      if (is_goal(c.lhs,c.q))
+        c.node=goal_node;
+      for (Completed::Finals::const_iterator f=c.finals.begin(),e=c.finals.end();f!=e;++f)
+        add_edges(c,*f,*f->item,path,oh);
+    }
+    oh->TopologicallySortNodesAndEdges(goal_node);
+    oh->Reweight(weights);
+    SHOWM3(DFSA,"earley forest",n_pops,items.size(),completeds.size());
+  }
+};
 
 }//anon ns
 
@@ -708,14 +895,17 @@ void ApplyFsa<F>::ApplyBottomUp()
 template <class F>
 void ApplyFsa<F>::ApplyEarley()
 {
-  hgcfg.GiveCFG(cfg);
+  // the trie is already a left-branching binarization, and the output edges need cfg rule i to be ih edge i
+  if (hgcfg.binarized)
+    hgcfg.InitCFG(cfg);
+  else
+    hgcfg.GiveCFG(cfg);
   print_cfg=&cfg;
   print_fsa=&fsa;
-  Chart<F> chart(cfg,smeta,fsa);
   // don't need to uniq - option to do that already exists in cfg_options
-  //TODO:
+  Chart<F> chart(cfg,hgcfg.ih,smeta,fsa,weights,by.pop_limit);
   chart.best_first();
-  *oh=hgcfg.ih;
+  chart.forest(oh);
 }
 
 
@@ -28,7 +28,7 @@ struct ApplyFsaBy {
   EARLEY,
   N_ALGORITHMS
   };*/
-  int pop_limit; // only applies to BU_FULL so far
+  int pop_limit; // BU_CUBE: cube pruning pop limit.  EARLEY: max output nodes (fsa state splits) per input node, best first; <=0 for no limit
   bool IsBottomUp() const {
     return algorithm==BU_FULL || algorithm==BU_CUBE;
   }
@@ -43,7 +43,7 @@ struct ApplyFsaBy {
   }
   explicit ApplyFsaBy(FsaBy alg, int poplimit=200);
   ApplyFsaBy(std::string const& name, int poplimit=200);
-  ApplyFsaBy(const ApplyFsaBy &o) : algorithm(o.algorithm) {  }
+  ApplyFsaBy(const ApplyFsaBy &o) : pop_limit(o.pop_limit),algorithm(o.algorithm) {  }
   static std::string all_names(); // space separated
 };
 
@@ -1,8 +1,7 @@
 ////TODO: keep model state in forest?
 
-//TODO: (for many nonterminals, or multi-rescoring pass) either global
-//best-first, or group by (NT,span) - use prev forest outside as a (admissable,
-//if models are a subset and weights are same) heuristic
+//TODO: (for many nonterminals) global best-first.  Grouping by span is
+//CELL_CP, the previous pass's outside scores allocate pops by Node::promise
 
 #include "apply_models.h"
 
@@ -12,26 +11,52 @@
 #include <tr1/unordered_set>
 
 #include <boost/functional/hash.hpp>
+#include <boost/pool/pool.hpp>
 
 #include "verbose.h"
+#include "timing_stats.h"
+#include "intern_pool.h"
+#include "d_ary_heap.h"
 #include "hg.h"
 #include "ff.h"
+#include "sentence_metadata.h"
 
 #define NORMAL_CP 1
 #define FAST_CP 2
 #define FAST_CP_2 3
+#define GROWING_CP 4
+#define CELL_CP 5
 
 using namespace std;
 using namespace std::tr1;
 
 struct Candidate;
 typedef SmallVectorInt JVector;
-typedef vector<Candidate*> CandidateHeap;
+// heap entries carry the log of the score they are ordered by, so sifting
+// never has to dereference a Candidate
+typedef keyed_ptr<double, Candidate> KeyedCandidate;
+typedef d_ary_heap<KeyedCandidate, 4, greater<KeyedCandidate> > CandidateHeap;
 typedef vector<Candidate*> CandidateList;
+// all states produced by a ModelSet have the same size, so the cube pruning
+// rescorer keeps them interned in a single buffer and refers to them by handle
+typedef fixed_array_intern_pool<uint8_t> FFStatePool;
+typedef FFStatePool::Handle FFStateHandle;
+typedef vector<FFStateHandle> FFStateHandles;
+
+// reused by all candidates to run the feature functions
+struct CandidateScratch {
+  Hypergraph::Edge edge;
+  FFState state;
+  vector<const uint8_t*> ant_states;
+};
 
 // default vector size (* sizeof string is memory used)
 static const size_t kRESERVE_NUM_NODES = 500000ul;
 
+// how many corners ahead of the one being scored have their feature
+// function lookups prefetched
+static const int kPREFETCH_AHEAD = 8;
+
 // life cycle: candidates are created, placed on the heap
 // and retrieved by their estimated cost, when they're
 // retrieved, they're incorporated into the +LM hypergraph
@@ -47,67 +72,97 @@ struct Candidate {
   int node_index_;                     // -1 until incorporated
                                        // into the +LM forest
   const Hypergraph::Edge* in_edge_;    // in -LM forest
-  Hypergraph::Edge out_edge_;
-  FFState state_;
+  // the +LM edge is only built when the candidate is popped and
+  // incorporated into the +LM forest; until then we keep just the
+  // parts of it that differ from in_edge_
+  Hypergraph::TailNodeVector out_tail_;
+  FeatureVector out_features_;
+  prob_t out_edge_prob_;
+#if USE_INFO_EDGE
+  std::string out_info_;
+#endif
+  FFStateHandle state_;                // in the rescorer's FFStatePool
   const JVector j_;
   prob_t vit_prob_;            // these are fixed until the cand
                                // is popped, then they may be updated
   prob_t est_prob_;
+  prob_t heuristic_prob_;      // cube growing only, see below
 
+  // scratch is used to run the feature functions, its contents
+  // are undefined afterwards
   Candidate(const Hypergraph::Edge& e,
             const JVector& j,
-            const Hypergraph& out_hg,
             const vector<CandidateList>& D,
-            const FFStates& node_states,
+            const FFStateHandles& node_states,
+            FFStatePool* states,
             const SentenceMetadata& smeta,
             const ModelSet& models,
-            bool is_goal) :
+            bool is_goal,
+            CandidateScratch* scratch) :
       node_index_(-1),
       in_edge_(&e),
       j_(j) {
-    InitializeCandidate(out_hg, smeta, D, node_states, models, is_goal);
+    InitializeCandidate(smeta, D, node_states, states, models, is_goal, scratch);
   }
 
   // used to query uniqueness
   Candidate(const Hypergraph::Edge& e,
             const JVector& j) : in_edge_(&e), j_(j) {}
 
+  // used by cube growing, which orders candidates by heuristic and only
+  // calls InitializeCandidate once they are popped
+  Candidate(const Hypergraph::Edge& e,
+            const JVector& j,
+            const prob_t& heuristic) :
+      node_index_(-1),
+      in_edge_(&e),
+      j_(j),
+      heuristic_prob_(heuristic) {}
+
   bool IsIncorporatedIntoHypergraph() const {
     return node_index_ >= 0;
   }
 
-  void InitializeCandidate(const Hypergraph& out_hg,
-                           const SentenceMetadata& smeta,
+  void InitializeCandidate(const SentenceMetadata& smeta,
                            const vector<vector<Candidate*> >& D,
-                           const FFStates& node_states,
+                           const FFStateHandles& node_states,
+                           FFStatePool* states,
                            const ModelSet& models,
-                           const bool is_goal) {
+                           const bool is_goal,
+                           CandidateScratch* scratch) {
     const Hypergraph::Edge& in_edge = *in_edge_;
-    out_edge_.rule_ = in_edge.rule_;
-    out_edge_.feature_values_ = in_edge.feature_values_;
-    out_edge_.i_ = in_edge.i_;
-    out_edge_.j_ = in_edge.j_;
-    out_edge_.prev_i_ = in_edge.prev_i_;
-    out_edge_.prev_j_ = in_edge.prev_j_;
-    Hypergraph::TailNodeVector& tail = out_edge_.tail_nodes_;
-    tail.resize(j_.size());
+    Hypergraph::Edge& out_edge = scratch->edge;
+    out_edge.copy_pod(in_edge);
+    out_edge.feature_values_ = in_edge.feature_values_;
+    out_tail_.resize(j_.size());
     prob_t p = prob_t::One();
     // cerr << "\nEstimating application of " << in_edge.rule_->AsString() << endl;
-    for (int i = 0; i < tail.size(); ++i) {
+    for (int i = 0; i < out_tail_.size(); ++i) {
       const Candidate& ant = *D[in_edge.tail_nodes_[i]][j_[i]];
       assert(ant.IsIncorporatedIntoHypergraph());
-      tail[i] = ant.node_index_;
+      out_tail_[i] = ant.node_index_;
       p *= ant.vit_prob_;
     }
+    out_edge.tail_nodes_ = out_tail_;
     prob_t edge_estimate = prob_t::One();
     if (is_goal) {
-      assert(tail.size() == 1);
-      const FFState& ant_state = node_states[tail.front()];
-      models.AddFinalFeatures(ant_state, &out_edge_, smeta);
+      assert(out_tail_.size() == 1);
+      models.AddFinalFeatures((*states)[node_states[out_tail_.front()]], &out_edge, smeta);
+      state_ = -1;
     } else {
-      models.AddFeaturesToEdge(smeta, out_hg, node_states, &out_edge_, &state_, &edge_estimate);
+      vector<const uint8_t*>& ants = scratch->ant_states;
+      ants.resize(out_tail_.size());
+      for (int i = 0; i < out_tail_.size(); ++i)
+        ants[i] = (*states)[node_states[out_tail_[i]]];
+      models.AddFeaturesToEdge(smeta, ants, &out_edge, &scratch->state, &edge_estimate);
+      state_ = states->intern(scratch->state.begin());
     }
-    vit_prob_ = out_edge_.edge_prob_ * p;
+    out_features_.swap(out_edge.feature_values_);
+    out_edge_prob_ = out_edge.edge_prob_;
+#if USE_INFO_EDGE
+    out_info_ = out_edge.info();
+#endif
+    vit_prob_ = out_edge_prob_ * p;
     est_prob_ = vit_prob_ * edge_estimate;
   }
 };
@@ -125,11 +180,15 @@ ostream& operator<<(ostream& os, const Candidate& cand) {
   return os << ']';
 }
 
-struct HeapCandCompare {
-  bool operator()(const Candidate* l, const Candidate* r) const {
-    return l->est_prob_ < r->est_prob_;
-  }
-};
+// est_prob_ and heuristic_prob_ are never negative, so comparing their logs
+// orders them the same way
+inline KeyedCandidate ByEstimate(Candidate* c) {
+  return KeyedCandidate(log(c->est_prob_), c);
+}
+
+inline KeyedCandidate ByHeuristic(Candidate* c) {
+  return KeyedCandidate(log(c->heuristic_prob_), c);
+}
 
 struct EstProbSorter {
   bool operator()(const Candidate* l, const Candidate* r) const {
@@ -159,7 +218,36 @@ struct CandidateUniquenessEquals {
 };
 
 typedef unordered_set<const Candidate*, CandidateUniquenessHash, CandidateUniquenessEquals> UniqueCandidateSet;
-typedef unordered_map<FFState, Candidate*, boost::hash<FFState> > State2Node;
+typedef unordered_map<FFStateHandle, Candidate*> State2Node;
+
+// what the rescorers report to the profile of the decoding thread
+static const ProfileCounter rescoring_edges("rescoring_edges");
+static const ProfileCounter cube_pops("cube_pops");
+static const ProfileCounter cube_pushes("cube_pushes");
+static const ProfileCounter cube_recombinations("cube_recombinations");
+static const ProfileCounter cube_discarded("cube_discarded");
+static const ProfileCounter cube_states("cube_states");
+static const ProfileCounter cube_heap_peak("cube_heap_peak", ProfileCounter::PEAK);
+static const ProfileCounter deadline_cut_nodes("deadline_cut_nodes");  // popped less for --deadline
+
+// with a deadline, the pop limit is only planned once this many candidates
+// have been scored, so that the cost of one is known
+static const int kMIN_PUSHES_TO_PLAN = 100;
+// and cube pruning plans to leave this share of the time it had left when
+// it started to the stages after it (k-best extraction, output)
+static const double kDEADLINE_RESERVE = 0.2;
+
+// what the search did at one node of the input forest
+struct CubeNodeStats {
+  CubeNodeStats() : pops(), pushes(), recombinations(), discarded(), heap_peak(), states() {}
+  int pops;
+  int pushes;          // candidates put on the heap
+  int recombinations;  // popped candidates whose state was already in the node
+  int discarded;       // candidates left on the heap when the search stopped
+  int heap_peak;
+  int states;          // distinct states, i.e. +LM nodes
+  void NoteHeap(int size) { heap_peak = max(heap_peak, size); }
+};
 
 class CubePruningRescorer {
 
@@ -169,15 +257,23 @@ public:
                       const Hypergraph& i,
                       int pop_limit,
                       Hypergraph* o,
-                      int s = NORMAL_CP ) :
+                      int s = NORMAL_CP,
+                      bool show_node_stats = false) :
       models(m),
       smeta(sm),
       in(i),
       out(*o),
       D(in.nodes_.size()),
       pop_limit_(pop_limit),
-      strategy_(s){
-    if (!SILENT) cerr << "  Applying feature functions (cube pruning, pop_limit = " << pop_limit_ << ')' << endl;
+      strategy_(s),
+      show_node_stats_(show_node_stats),
+      node_stats_(in.nodes_.size()),
+      deadline_(sm.GetDeadline()),
+      cur_pop_limit_(pop_limit),
+      cand_pool_(sizeof(Candidate)),
+      states_(m.NumBytesContext()) {
+    if (!SILENT) cerr << "  Applying feature functions (" << (strategy_ == GROWING_CP ? "cube growing" : strategy_ == CELL_CP ? "cube pruning by chart cell" : "cube pruning")
+                      << ", pop_limit = " << pop_limit_ << ')' << endl;
     node_states_.reserve(kRESERVE_NUM_NODES);
   }
 
@@ -190,12 +286,27 @@ public:
     if (num_nodes > 100) every = 10;
     assert(in.nodes_[pregoal].out_edges_.size() == 1);
     if (!SILENT) cerr << "    ";
+    if (strategy_ == GROWING_CP) {
+      CubeGrow(goal_id);
+      FreeGrowingNodes();
+    }
     int has = 0;
-    for (int i = 0; i < in.nodes_.size(); ++i) {
+    int cell_end = 0;
+    const double start = deadline_ ? Timer::WallTime() : 0;
+    const double target = deadline_ - kDEADLINE_RESERVE * max(0.0, deadline_ - start);
+    int corners_left = 0, corners_done = 0, cut_nodes = 0;
+    CubeNodeStats done;
+    for (int i = 0; deadline_ && i < in.nodes_.size(); ++i)
+      corners_left += in.nodes_[i].in_edges_.size();
+    for (int i = 0; strategy_ != GROWING_CP && i < in.nodes_.size(); ++i) {
       if (!SILENT) {
         int needs = (50 * i / in.nodes_.size());
         while (has < needs) { cerr << '.'; ++has; }
       }
+      if (deadline_) {
+        cur_pop_limit_ = DeadlinePopLimit(start, target, in.nodes_.size() - i, corners_left, corners_done, done);
+        if (cur_pop_limit_ < pop_limit_) ++cut_nodes;
+      }
       if (strategy_==NORMAL_CP){
         KBest(i, i == goal_id);
       }
@@ -205,29 +316,126 @@ public:
       if (strategy_==FAST_CP_2){
         KBestFast2(i, i == goal_id);
       }
+      if (strategy_==CELL_CP && i == cell_end) {
+        cell_end = CellEnd(i);
+        if (cell_end == i + 1)
+          KBest(i, i == goal_id);
+        else
+          KBestCell(i, cell_end);
+      }
+      if (deadline_) {
+        corners_left -= in.nodes_[i].in_edges_.size();
+        corners_done += in.nodes_[i].in_edges_.size();
+        done.pops += node_stats_[i].pops;
+        done.pushes += node_stats_[i].pushes;
+      }
+    }
+    if (cut_nodes) {
+      deadline_cut_nodes.Add(cut_nodes);
+      smeta.SetDegraded();
     }
     if (!SILENT) {
       cerr << endl;
       cerr << "  Best path: " << log(D[goal_id].front()->vit_prob_)
            << "\t" << log(D[goal_id].front()->est_prob_) << endl;
     }
+    rescoring_edges.Add(out.edges_.size());
+    ReportStats();
     out.PruneUnreachable(D[goal_id].front()->node_index_);
     FreeAll();
   }
 
  private:
+  // the pop limit for the next node that gets the search done by target,
+  // given what the candidates scored so far (done) cost.  The
+  // <0,...,0> corners of all in-edges are scored whatever the limit, each pop
+  // scores about as many successors as the pops so far did (at least one, to
+  // err on the safe side), and the time that is left after the corners is
+  // shared equally by the nodes left.  Past target this is 1, which still
+  // gives every node its best corner.
+  int DeadlinePopLimit(double start, double target, int nodes_left, int corners_left, int corners_done,
+                       const CubeNodeStats& done) const {
+    const double now = Timer::WallTime();
+    const double left = target - now;
+    if (left <= 0) return 1;
+    if (done.pushes < kMIN_PUSHES_TO_PLAN) return pop_limit_;
+    const double per_push = (now - start) / done.pushes;
+    const double succ_per_pop = done.pops ? max(1.0, static_cast<double>(done.pushes - corners_done) / done.pops) : 1.0;
+    const double pops = (left / per_push - corners_left) / succ_per_pop;
+    return max(1, static_cast<int>(min<double>(pop_limit_, pops / nodes_left)));
+  }
+
+  void ReportStats() const {
+    CubeNodeStats total;
+    for (int i = 0; i < node_stats_.size(); ++i) {
+      const CubeNodeStats& n = node_stats_[i];
+      total.pops += n.pops;
+      total.pushes += n.pushes;
+      total.recombinations += n.recombinations;
+      total.discarded += n.discarded;
+      total.NoteHeap(n.heap_peak);
+      total.states += n.states;
+      if (show_node_stats_)
+        cerr << "  node " << i << " (" << in.nodes_[i].in_edges_.size() << " in-edges): pops " << n.pops
+             << ", pushes " << n.pushes << ", recombinations " << n.recombinations << ", discarded "
+             << n.discarded << ", heap peak " << n.heap_peak << ", states " << n.states << endl;
+    }
+    cube_pops.Add(total.pops);
+    cube_pushes.Add(total.pushes);
+    cube_recombinations.Add(total.recombinations);
+    cube_discarded.Add(total.discarded);
+    cube_states.Add(total.states);
+    cube_heap_peak.Add(total.heap_peak);
+  }
+
   void FreeAll() {
     for (int i = 0; i < D.size(); ++i) {
       CandidateList& D_i = D[i];
       for (int j = 0; j < D_i.size(); ++j)
-        delete D_i[j];
+        FreeCandidate(D_i[j]);
     }
     D.clear();
   }
 
-  void IncorporateIntoPlusLMForest(Candidate* item, State2Node* s2n, CandidateList* freelist) {
-    Hypergraph::Edge* new_edge = out.AddEdge(item->out_edge_);
-    new_edge->edge_prob_ = item->out_edge_.edge_prob_;
+  // candidates come from cand_pool_, so the memory of the ones that are
+  // discarded at one node is reused at the next, and whatever is left is
+  // released in bulk when the rescorer goes away
+  Candidate* NewCandidate(const Hypergraph::Edge& e, const JVector& j, const bool is_goal) {
+    ++node_stats_[e.head_node_].pushes;
+    return new(cand_pool_.malloc()) Candidate(e, j, D, node_states_, &states_, smeta, models, is_goal, &scratch_);
+  }
+
+  // lets the models start fetching what they will need to score <e, j>
+  void PrefetchCandidate(const Hypergraph::Edge& e, const JVector& j, const bool is_goal) {
+    if (is_goal) return;
+    vector<const uint8_t*>& ants = scratch_.ant_states;
+    ants.resize(j.size());
+    for (int i = 0; i < j.size(); ++i)
+      ants[i] = states_[node_states_[D[e.tail_nodes_[i]][j[i]]->node_index_]];
+    models.PrefetchEdge(smeta, ants, e);
+  }
+
+  // prefetches the <0,...,0> corner of the edge in_edges[i]
+  void PrefetchCorner(const Hypergraph::EdgesVector& in_edges, const int i, const bool is_goal) {
+    if (i >= in_edges.size()) return;
+    const Hypergraph::Edge& edge = in.edges_[in_edges[i]];
+    PrefetchCandidate(edge, JVector(edge.tail_nodes_.size(), 0), is_goal);
+  }
+
+  void FreeCandidate(Candidate* c) {
+    c->~Candidate();
+    cand_pool_.free(c);
+  }
+
+  // returns false if item recombined with a candidate already in s2n
+  bool IncorporateIntoPlusLMForest(Candidate* item, State2Node* s2n, CandidateList* freelist) {
+    Hypergraph::Edge* new_edge = out.AddEdge(item->in_edge_->rule_, item->out_tail_);
+    new_edge->copy_pod(*item->in_edge_);
+    new_edge->feature_values_.swap(item->out_features_);
+    new_edge->edge_prob_ = item->out_edge_prob_;
+#if USE_INFO_EDGE
+    new_edge->set_info(item->out_info_);
+#endif
     Candidate*& o_item = (*s2n)[item->state_];
     if (!o_item) o_item = item;
 
@@ -252,7 +460,10 @@ public:
       o_item->est_prob_ = item->est_prob_;
       o_item->vit_prob_ = item->vit_prob_;
     }
-    if (item != o_item) freelist->push_back(item);
+    if (item == o_item) return true;
+    freelist->push_back(item);
+    ++node_stats_[item->in_edge_->head_node_].recombinations;
+    return false;
   }
 
   void KBest(const int vert_index, const bool is_goal) {
@@ -261,31 +472,40 @@ public:
     assert(D_v.empty());
     const Hypergraph::Node& v = in.nodes_[vert_index];
     // cerr << "  has " << v.in_edges_.size() << " in-coming edges\n";
-    const vector<int>& in_edges = v.in_edges_;
+    const Hypergraph::EdgesVector& in_edges = v.in_edges_;
     CandidateHeap cand;
     CandidateList freelist;
     cand.reserve(in_edges.size());
     UniqueCandidateSet unique_cands;
+    for (int i = 0; i < kPREFETCH_AHEAD; ++i)
+      PrefetchCorner(in_edges, i, is_goal);
     for (int i = 0; i < in_edges.size(); ++i) {
+      PrefetchCorner(in_edges, i + kPREFETCH_AHEAD, is_goal);
       const Hypergraph::Edge& edge = in.edges_[in_edges[i]];
       const JVector j(edge.tail_nodes_.size(), 0);
-      cand.push_back(new Candidate(edge, j, out, D, node_states_, smeta, models, is_goal));
-      assert(unique_cands.insert(cand.back()).second);  // these should all be unique!
+      Candidate* c = NewCandidate(edge, j, is_goal);
+      cand.push_back(ByEstimate(c));
+      assert(unique_cands.insert(c).second);  // these should all be unique!
     }
 //    cerr << "  making heap of " << cand.size() << " candidates\n";
-    make_heap(cand.begin(), cand.end(), HeapCandCompare());
+    cand.heapify();
+    CubeNodeStats& stats = node_stats_[vert_index];
+    stats.NoteHeap(cand.size());
     State2Node state2node;   // "buf" in Figure 2
     int pops = 0;
-    int pop_limit_eff=max(1,int(v.promise*pop_limit_));
+    int pop_limit_eff=max(1,int(v.promise*cur_pop_limit_));
     while(!cand.empty() && pops < pop_limit_eff) {
-      pop_heap(cand.begin(), cand.end(), HeapCandCompare());
-      Candidate* item = cand.back();
-      cand.pop_back();
+      Candidate* item = cand.top().ptr;
+      cand.pop();
       // cerr << "POPPED: " << *item << endl;
       PushSucc(*item, is_goal, &cand, &unique_cands);
+      stats.NoteHeap(cand.size());
       IncorporateIntoPlusLMForest(item, &state2node, &freelist);
       ++pops;
     }
+    stats.pops = pops;
+    stats.discarded = cand.size();
+    stats.states = state2node.size();
     D_v.resize(state2node.size());
     int c = 0;
     for (State2Node::iterator i = state2node.begin(); i != state2node.end(); ++i)
@@ -293,12 +513,105 @@ public:
     sort(D_v.begin(), D_v.end(), EstProbSorter());
     // cerr << "  expanded to " << D_v.size() << " nodes\n";
 
-    for (int i = 0; i < cand.size(); ++i)
-      delete cand[i];
+    for (CandidateHeap::const_iterator it = cand.begin(); it != cand.end(); ++it)
+      FreeCandidate(it->ptr);
     // freelist is necessary since even after an item merged, it still stays in
     // the unique set so it can't be deleted til now
     for (int i = 0; i < freelist.size(); ++i)
-      delete freelist[i];
+      FreeCandidate(freelist[i]);
+  }
+
+  // the nodes from first up to the returned one make a chart cell: they
+  // cover the same span and none of them is a tail of another one (so a
+  // unary rule within a span starts a new cell).  Nodes of forests without
+  // spans, and the goal, are cells of their own.  This relies on the parser
+  // building the nodes of a cell one after the other, as the chart parsers do.
+  int CellEnd(const int first) const {
+    const int goal_id = in.nodes_.size() - 1;
+    const Hypergraph::EdgesVector& first_edges = in.nodes_[first].in_edges_;
+    if (first == goal_id || first_edges.empty()) return first + 1;
+    const Hypergraph::Edge& span = in.edges_[first_edges[0]];
+    if (span.i_ < 0) return first + 1;
+    int end = first;
+    for (bool same = true; same && ++end < goal_id; ) {
+      const Hypergraph::EdgesVector& in_edges = in.nodes_[end].in_edges_;
+      same = !in_edges.empty();
+      for (int i = 0; same && i < in_edges.size(); ++i) {
+        const Hypergraph::Edge& edge = in.edges_[in_edges[i]];
+        same = edge.i_ == span.i_ && edge.j_ == span.j_;
+        for (int k = 0; same && k < edge.tail_nodes_.size(); ++k)
+          same = edge.tail_nodes_[k] < first;
+      }
+    }
+    return end;
+  }
+
+  // cube pruning of a chart cell (nodes first to end-1, none of them the
+  // goal) with one heap for the candidates of all of its nodes and one pop
+  // limit, so with many nonterminals the pops go to the ones that score best
+  // instead of pop_limit to each.  A node that gets no pops still gets its
+  // best candidate, so every node has a derivation for the cells above.
+  void KBestCell(const int first, const int end) {
+    const int n = end - first;
+    CandidateHeap cand;
+    CandidateList freelist;
+    UniqueCandidateSet unique_cands;
+    double promise = 0;
+    for (int v = first; v < end; ++v) {
+      assert(D[v].empty());
+      const Hypergraph::EdgesVector& in_edges = in.nodes_[v].in_edges_;
+      promise = max(promise, in.nodes_[v].promise);
+      for (int i = 0; i < kPREFETCH_AHEAD; ++i)
+        PrefetchCorner(in_edges, i, false);
+      for (int i = 0; i < in_edges.size(); ++i) {
+        PrefetchCorner(in_edges, i + kPREFETCH_AHEAD, false);
+        const Hypergraph::Edge& edge = in.edges_[in_edges[i]];
+        Candidate* c = NewCandidate(edge, JVector(edge.tail_nodes_.size(), 0), false);
+        cand.push_back(ByEstimate(c));
+        unique_cands.insert(c);
+      }
+    }
+    cand.heapify();
+    CubeNodeStats& cell_stats = node_stats_[first];  // the heap is the cell's
+    cell_stats.NoteHeap(cand.size());
+    vector<State2Node> state2node(n);
+    const int pop_limit_eff = max(1, int(promise * cur_pop_limit_));
+    for (int pops = 0; !cand.empty() && pops < pop_limit_eff; ++pops) {
+      Candidate* item = cand.top().ptr;
+      cand.pop();
+      PushSucc(*item, false, &cand, &unique_cands);
+      cell_stats.NoteHeap(cand.size());
+      const int v = item->in_edge_->head_node_;
+      ++node_stats_[v].pops;
+      IncorporateIntoPlusLMForest(item, &state2node[v - first], &freelist);
+    }
+    vector<Candidate*> best(n);
+    for (CandidateHeap::const_iterator it = cand.begin(); it != cand.end(); ++it) {
+      const int k = it->ptr->in_edge_->head_node_ - first;
+      ++node_stats_[first + k].discarded;
+      if (state2node[k].empty() && (!best[k] || it->ptr->est_prob_ > best[k]->est_prob_))
+        best[k] = it->ptr;
+    }
+    for (int k = 0; k < n; ++k) {
+      if (!best[k]) continue;
+      ++node_stats_[first + k].pops;
+      --node_stats_[first + k].discarded;
+      IncorporateIntoPlusLMForest(best[k], &state2node[k], &freelist);
+    }
+    for (int k = 0; k < n; ++k) {
+      CandidateList& D_v = D[first + k];
+      node_stats_[first + k].states = state2node[k].size();
+      D_v.resize(state2node[k].size());
+      int c = 0;
+      for (State2Node::iterator i = state2node[k].begin(); i != state2node[k].end(); ++i)
+        D_v[c++] = i->second;
+      sort(D_v.begin(), D_v.end(), EstProbSorter());
+    }
+    for (CandidateHeap::const_iterator it = cand.begin(); it != cand.end(); ++it)
+      if (best[it->ptr->in_edge_->head_node_ - first] != it->ptr)
+        FreeCandidate(it->ptr);
+    for (int i = 0; i < freelist.size(); ++i)
+      FreeCandidate(freelist[i]);
   }
 
   void KBestFast(const int vert_index, const bool is_goal) {
@@ -307,30 +620,39 @@ public:
 	  assert(D_v.empty());
 	  const Hypergraph::Node& v = in.nodes_[vert_index];
 	  // cerr << " has " << v.in_edges_.size() << " in-coming edges\n";
-	  const vector<int>& in_edges = v.in_edges_;
+	  const Hypergraph::EdgesVector& in_edges = v.in_edges_;
 	  CandidateHeap cand;
 	  CandidateList freelist;
 	  cand.reserve(in_edges.size());
 	  //init with j<0,0> for all rules-edges that lead to node-(NT-span)
+	  for (int i = 0; i < kPREFETCH_AHEAD; ++i)
+		  PrefetchCorner(in_edges, i, is_goal);
 	  for (int i = 0; i < in_edges.size(); ++i) {
+		  PrefetchCorner(in_edges, i + kPREFETCH_AHEAD, is_goal);
 		  const Hypergraph::Edge& edge = in.edges_[in_edges[i]];
 		  const JVector j(edge.tail_nodes_.size(), 0);
-		  cand.push_back(new Candidate(edge, j, out, D, node_states_, smeta, models, is_goal));
+		  cand.push_back(ByEstimate(NewCandidate(edge, j, is_goal)));
 	  }
 	  // cerr << " making heap of " << cand.size() << " candidates\n";
-	  make_heap(cand.begin(), cand.end(), HeapCandCompare());
+	  cand.heapify();
+	  CubeNodeStats& stats = node_stats_[vert_index];
+	  stats.NoteHeap(cand.size());
 	  State2Node state2node; // "buf" in Figure 2
 	  int pops = 0;
-	  while(!cand.empty() && pops < pop_limit_) {
-		  pop_heap(cand.begin(), cand.end(), HeapCandCompare());
-		  Candidate* item = cand.back();
-		  cand.pop_back();
+	  const int pop_limit_eff = max(1, int(v.promise * cur_pop_limit_));
+	  while(!cand.empty() && pops < pop_limit_eff) {
+		  Candidate* item = cand.top().ptr;
+		  cand.pop();
 		  // cerr << "POPPED: " << *item << endl;
 
 		  PushSuccFast(*item, is_goal, &cand);
+		  stats.NoteHeap(cand.size());
 		  IncorporateIntoPlusLMForest(item, &state2node, &freelist);
 		  ++pops;
 	  }
+	  stats.pops = pops;
+	  stats.discarded = cand.size();
+	  stats.states = state2node.size();
 	  D_v.resize(state2node.size());
 	  int c = 0;
 	  for (State2Node::iterator i = state2node.begin(); i != state2node.end(); ++i){
@@ -346,12 +668,12 @@ public:
 
 	  // cerr << " expanded to " << D_v.size() << " nodes\n";
 
-	  for (int i = 0; i < cand.size(); ++i)
-		  delete cand[i];
+	  for (CandidateHeap::const_iterator it = cand.begin(); it != cand.end(); ++it)
+		  FreeCandidate(it->ptr);
 	  // freelist is necessary since even after an item merged, it still stays in
 	  // the unique set so it can't be deleted til now
 	  for (int i = 0; i < freelist.size(); ++i)
-		  delete freelist[i];
+		  FreeCandidate(freelist[i]);
   }
 
   void KBestFast2(const int vert_index, const bool is_goal) {
@@ -360,32 +682,41 @@ public:
 	  assert(D_v.empty());
 	  const Hypergraph::Node& v = in.nodes_[vert_index];
 	  // cerr << " has " << v.in_edges_.size() << " in-coming edges\n";
-	  const vector<int>& in_edges = v.in_edges_;
+	  const Hypergraph::EdgesVector& in_edges = v.in_edges_;
 	  CandidateHeap cand;
 	  CandidateList freelist;
 	  cand.reserve(in_edges.size());
 	  UniqueCandidateSet unique_accepted;
 	  //init with j<0,0> for all rules-edges that lead to node-(NT-span)
+	  for (int i = 0; i < kPREFETCH_AHEAD; ++i)
+		  PrefetchCorner(in_edges, i, is_goal);
 	  for (int i = 0; i < in_edges.size(); ++i) {
+		  PrefetchCorner(in_edges, i + kPREFETCH_AHEAD, is_goal);
 		  const Hypergraph::Edge& edge = in.edges_[in_edges[i]];
 		  const JVector j(edge.tail_nodes_.size(), 0);
-		  cand.push_back(new Candidate(edge, j, out, D, node_states_, smeta, models, is_goal));
+		  cand.push_back(ByEstimate(NewCandidate(edge, j, is_goal)));
 	  }
 	  // cerr << " making heap of " << cand.size() << " candidates\n";
-	  make_heap(cand.begin(), cand.end(), HeapCandCompare());
+	  cand.heapify();
+	  CubeNodeStats& stats = node_stats_[vert_index];
+	  stats.NoteHeap(cand.size());
 	  State2Node state2node; // "buf" in Figure 2
 	  int pops = 0;
-	  while(!cand.empty() && pops < pop_limit_) {
-		  pop_heap(cand.begin(), cand.end(), HeapCandCompare());
-		  Candidate* item = cand.back();
-		  cand.pop_back();
+	  const int pop_limit_eff = max(1, int(v.promise * cur_pop_limit_));
+	  while(!cand.empty() && pops < pop_limit_eff) {
+		  Candidate* item = cand.top().ptr;
+		  cand.pop();
 		  assert(unique_accepted.insert(item).second); // these should all be unique!
 		  // cerr << "POPPED: " << *item << endl;
 
 		  PushSuccFast2(*item, is_goal, &cand, &unique_accepted);
+		  stats.NoteHeap(cand.size());
 		  IncorporateIntoPlusLMForest(item, &state2node, &freelist);
 		  ++pops;
 	  }
+	  stats.pops = pops;
+	  stats.discarded = cand.size();
+	  stats.states = state2node.size();
 	  D_v.resize(state2node.size());
 	  int c = 0;
 	  for (State2Node::iterator i = state2node.begin(); i != state2node.end(); ++i){
@@ -401,25 +732,31 @@ public:
 
 	  // cerr << " expanded to " << D_v.size() << " nodes\n";
 
-	  for (int i = 0; i < cand.size(); ++i)
-		  delete cand[i];
+	  for (CandidateHeap::const_iterator it = cand.begin(); it != cand.end(); ++it)
+		  FreeCandidate(it->ptr);
 	  // freelist is necessary since even after an item merged, it still stays in
 	  // the unique set so it can't be deleted til now
 	  for (int i = 0; i < freelist.size(); ++i)
-		  delete freelist[i];
+		  FreeCandidate(freelist[i]);
   }
 
   void PushSucc(const Candidate& item, const bool is_goal, CandidateHeap* pcand, UniqueCandidateSet* cs) {
     CandidateHeap& cand = *pcand;
+    // start the lookups for all successors before scoring the first one
+    for (int i = 0; item.j_.size() > 1 && i < item.j_.size(); ++i) {
+      JVector j = item.j_;
+      ++j[i];
+      if (j[i] < D[item.in_edge_->tail_nodes_[i]].size())
+        PrefetchCandidate(*item.in_edge_, j, is_goal);
+    }
     for (int i = 0; i < item.j_.size(); ++i) {
       JVector j = item.j_;
       ++j[i];
       if (j[i] < D[item.in_edge_->tail_nodes_[i]].size()) {
         Candidate query_unique(*item.in_edge_, j);
         if (cs->count(&query_unique) == 0) {
-          Candidate* new_cand = new Candidate(*item.in_edge_, j, out, D, node_states_, smeta, models, is_goal);
-          cand.push_back(new_cand);
-          push_heap(cand.begin(), cand.end(), HeapCandCompare());
+          Candidate* new_cand = NewCandidate(*item.in_edge_, j, is_goal);
+          cand.push(ByEstimate(new_cand));
           assert(cs->insert(new_cand).second);  // insert into uniqueness set, sanity check
         }
       }
@@ -433,9 +770,8 @@ public:
 		  JVector j = item.j_;
 		  ++j[i];
 		  if (j[i] < D[item.in_edge_->tail_nodes_[i]].size()) {
-			  Candidate* new_cand = new Candidate(*item.in_edge_, j, out, D, node_states_, smeta, models, is_goal);
-			  cand.push_back(new_cand);
-			  push_heap(cand.begin(), cand.end(), HeapCandCompare());
+			  Candidate* new_cand = NewCandidate(*item.in_edge_, j, is_goal);
+			  cand.push(ByEstimate(new_cand));
 		  }
 		  if(item.j_[i]!=0){
 			  return;
@@ -452,9 +788,8 @@ public:
 		  if (j[i] < D[item.in_edge_->tail_nodes_[i]].size()) {
 			  Candidate query_unique(*item.in_edge_, j);
 			  if (HasAllAncestors(&query_unique,ps)) {
-				  Candidate* new_cand = new Candidate(*item.in_edge_, j, out, D, node_states_, smeta, models, is_goal);
-				  cand.push_back(new_cand);
-				  push_heap(cand.begin(), cand.end(), HeapCandCompare());
+				  Candidate* new_cand = NewCandidate(*item.in_edge_, j, is_goal);
+				  cand.push(ByEstimate(new_cand));
 			  }
 		  }
 	  }
@@ -474,6 +809,167 @@ public:
 	  return true;
   }
 
+  // cube growing (Huang and Chiang, 2007, Section 5) is the lazy, top-down
+  // variant of cube pruning: the +LM derivations of a node are only computed
+  // when a derivation at a higher node (ultimately the goal) asks for them.
+  // The in-edges of a node are fired (their <0,...,0> candidate is added to
+  // the heap) in order of their -LM Viterbi inside score, and candidates are
+  // only scored by the feature functions when they are popped. Until then,
+  // they are ordered by a heuristic: the -LM score for <0,...,0> candidates,
+  // and the estimate of the popped neighbor they were derived from (adjusted
+  // for the antecedent they differ in) for the others. Popped candidates wait
+  // in buf until no better candidate is expected.
+  struct GrowingNode {
+    GrowingNode() : initialized(false), next_edge(0), pops(0) {}
+    bool initialized;
+    vector<pair<prob_t, int> > edges;  // (-LM inside score, in-edge), best first
+    int next_edge;                     // next edge in edges to fire
+    CandidateHeap cand;                // not yet scored, by heuristic
+    CandidateHeap buf;                 // scored, by estimated score
+    UniqueCandidateSet unique_cands;
+    State2Node state2node;
+    CandidateList freelist;
+    int pops;
+  };
+
+  void CubeGrow(const int goal_id) {
+    minus_lm_viterbi_.resize(in.nodes_.size());
+    for (int i = 0; i < in.nodes_.size(); ++i) {
+      const Hypergraph::EdgesVector& in_edges = in.nodes_[i].in_edges_;
+      prob_t best = in_edges.empty() ? prob_t::One() : prob_t::Zero();
+      for (int j = 0; j < in_edges.size(); ++j)
+        best = max(best, MinusLMInside(in.edges_[in_edges[j]]));
+      minus_lm_viterbi_[i] = best;
+    }
+    grow_.resize(in.nodes_.size());
+    goal_id_ = goal_id;
+    LazyKthBest(goal_id, pop_limit_ - 1);
+  }
+
+  void FreeGrowingNodes() {
+    for (int i = 0; i < grow_.size(); ++i) {
+      GrowingNode& s = grow_[i];
+      CubeNodeStats& stats = node_stats_[i];
+      stats.pops = s.pops;
+      stats.discarded = s.cand.size() + s.buf.size();
+      stats.states = D[i].size();
+      for (CandidateHeap::const_iterator it = s.cand.begin(); it != s.cand.end(); ++it) FreeCandidate(it->ptr);
+      for (CandidateHeap::const_iterator it = s.buf.begin(); it != s.buf.end(); ++it) FreeCandidate(it->ptr);
+      for (int j = 0; j < s.freelist.size(); ++j) FreeCandidate(s.freelist[j]);
+    }
+    grow_.clear();
+  }
+
+  prob_t MinusLMInside(const Hypergraph::Edge& edge) const {
+    prob_t p = edge.edge_prob_;
+    for (int i = 0; i < edge.tail_nodes_.size(); ++i)
+      p *= minus_lm_viterbi_[edge.tail_nodes_[i]];
+    return p;
+  }
+
+  // returns the k-th best +LM node in D[v] (NULL if there is none)
+  const Candidate* LazyKthBest(const int v, const int k) {
+    GrowingNode& s = grow_[v];
+    CandidateList& D_v = D[v];
+    if (!s.initialized) {
+      const Hypergraph::EdgesVector& in_edges = in.nodes_[v].in_edges_;
+      for (int i = 0; i < in_edges.size(); ++i) {
+        const int e = in_edges[i];
+        s.edges.push_back(make_pair(MinusLMInside(in.edges_[e]), e));
+      }
+      sort(s.edges.begin(), s.edges.end(), greater<pair<prob_t, int> >());
+      s.initialized = true;
+    }
+    const bool is_goal = (v == goal_id_);
+    const int pop_limit_eff = max(1, int(in.nodes_[v].promise * pop_limit_));
+    while (D_v.size() <= k && s.pops < pop_limit_eff) {
+      // every node gets at least one pop, so the goal has a derivation
+      if (s.pops && PastDeadline()) {
+        smeta.SetDegraded();
+        break;
+      }
+      FireEdges(&s);
+      if (s.cand.empty()) break;
+      Candidate* item = s.cand.top().ptr;
+      s.cand.pop();
+      item->InitializeCandidate(smeta, D, node_states_, &states_, models, is_goal, &scratch_);
+      s.buf.push(ByEstimate(item));
+      ++s.pops;
+      PushSuccLazy(*item, &s);
+      FireEdges(&s);
+      prob_t bound = prob_t::Zero();
+      if (!s.cand.empty()) bound = s.cand.top().ptr->heuristic_prob_;
+      if (s.next_edge < s.edges.size()) bound = max(bound, s.edges[s.next_edge].first);
+      while (!s.buf.empty() && s.buf.top().ptr->est_prob_ >= bound)
+        PopBuffer(&s, &D_v);
+    }
+    // out of candidates or pops, take whatever has been scored
+    if (D_v.size() <= k)
+      while (!s.buf.empty()) PopBuffer(&s, &D_v);
+    return k < D_v.size() ? D_v[k] : NULL;
+  }
+
+  bool PastDeadline() const {
+    return deadline_ && Timer::WallTime() > deadline_;
+  }
+
+  // adds the best scored candidate to the +LM forest, growing D_v
+  // if it does not recombine with a node that is already there
+  void PopBuffer(GrowingNode* s, CandidateList* D_v) {
+    Candidate* item = s->buf.top().ptr;
+    s->buf.pop();
+    if (IncorporateIntoPlusLMForest(item, &s->state2node, &s->freelist))
+      D_v->push_back(item);
+  }
+
+  // fire in-edges while they might beat the best pending candidate. The
+  // heuristic score of a <0,...,0> candidate is the -LM score of its edge
+  // times the +LM scores of its antecedents.
+  void FireEdges(GrowingNode* s) {
+    while (s->next_edge < s->edges.size() &&
+           (s->cand.empty() || s->edges[s->next_edge].first >= s->cand.top().ptr->heuristic_prob_)) {
+      const Hypergraph::Edge& edge = in.edges_[s->edges[s->next_edge++].second];
+      const JVector j(edge.tail_nodes_.size(), 0);
+      if (HasAntecedents(edge, j)) {
+        prob_t h = edge.edge_prob_;
+        for (int i = 0; i < j.size(); ++i)
+          h *= D[edge.tail_nodes_[i]][0]->vit_prob_;
+        AddToHeap(new(cand_pool_.malloc()) Candidate(edge, j, h), s);
+      }
+    }
+  }
+
+  void PushSuccLazy(const Candidate& item, GrowingNode* s) {
+    const Hypergraph::Edge& edge = *item.in_edge_;
+    for (int i = 0; i < item.j_.size(); ++i) {
+      JVector j = item.j_;
+      ++j[i];
+      Candidate query_unique(edge, j);
+      if (s->unique_cands.count(&query_unique) == 0 && HasAntecedents(edge, j)) {
+        // parent's estimate, adjusted for the antecedent we moved along
+        const int t = edge.tail_nodes_[i];
+        const prob_t h = item.est_prob_ * D[t][j[i]]->vit_prob_ / D[t][item.j_[i]]->vit_prob_;
+        AddToHeap(new(cand_pool_.malloc()) Candidate(edge, j, h), s);
+      }
+    }
+  }
+
+  // makes sure the antecedents of <edge,j> exist (computing them if necessary)
+  bool HasAntecedents(const Hypergraph::Edge& edge, const JVector& j) {
+    for (int i = 0; i < j.size(); ++i)
+      if (!LazyKthBest(edge.tail_nodes_[i], j[i])) return false;
+    return true;
+  }
+
+  void AddToHeap(Candidate* c, GrowingNode* s) {
+    s->cand.push(ByHeuristic(c));
+    CubeNodeStats& stats = node_stats_[c->in_edge_->head_node_];
+    ++stats.pushes;
+    stats.NoteHeap(s->cand.size());
+    const bool inserted = s->unique_cands.insert(c).second;
+    assert(inserted);
+  }
+
   const ModelSet& models;
   const SentenceMetadata& smeta;
   const Hypergraph& in;
@@ -482,10 +978,20 @@ public:
   vector<CandidateList> D;   // maps nodes in in-HG to the
                              // equivalent nodes (many due to state
                              // splits) in the out-HG.
-  FFStates node_states_;  // for each node in the out-HG what is
-                             // its q function value?
+  FFStateHandles node_states_;  // for each node in the out-HG what is
+                                // its q function value?
   const int pop_limit_;
  const int strategy_;       //switch Cube Pruning strategy: 1 normal, 2 fast (alg 2), 3 fast_2 (alg 3). (see: Gesmundo A., Henderson J,. Faster Cube Pruning, IWSLT 2010)
+  const bool show_node_stats_;
+  vector<CubeNodeStats> node_stats_;  // by node of the input forest
+  const double deadline_;       // see SentenceMetadata::GetDeadline()
+  int cur_pop_limit_;           // of the node being searched, <= pop_limit_
+  boost::pool<> cand_pool_;
+  FFStatePool states_;          // every state a candidate has produced
+  CandidateScratch scratch_;    // used to score candidates
+  vector<GrowingNode> grow_;    // cube growing only
+  vector<prob_t> minus_lm_viterbi_;
+  int goal_id_;
 };
 
 struct NoPruningRescorer {
@@ -564,6 +1070,7 @@ struct NoPruningRescorer {
       ProcessOneNode(i, i == goal_id);
     }
     if (!SILENT) cerr << endl;
+    rescoring_edges.Add(out.edges_.size());
   }
 
  private:
@@ -589,7 +1096,9 @@ void ApplyModelSet(const Hypergraph& in,
     ma.Apply();
   } else if (config.algorithm == IntersectionConfiguration::CUBE 
              || config.algorithm == IntersectionConfiguration::FAST_CUBE_PRUNING
-             || config.algorithm == IntersectionConfiguration::FAST_CUBE_PRUNING_2) {
+             || config.algorithm == IntersectionConfiguration::FAST_CUBE_PRUNING_2
+             || config.algorithm == IntersectionConfiguration::CUBE_GROWING
+             || config.algorithm == IntersectionConfiguration::CUBE_CELL) {
     int pl = config.pop_limit;
     const int max_pl_for_large=50;
     if (pl > max_pl_for_large && in.nodes_.size() > 80000) {
@@ -597,15 +1106,23 @@ void ApplyModelSet(const Hypergraph& in,
       cerr << "  Note: reducing pop_limit to " << pl << " for very large forest\n";
     }
     if      (config.algorithm == IntersectionConfiguration::CUBE) {
-    	CubePruningRescorer ma(models, smeta, in, pl, out);
+    	CubePruningRescorer ma(models, smeta, in, pl, out, NORMAL_CP, config.show_node_stats);
         ma.Apply();
     }
     else if (config.algorithm == IntersectionConfiguration::FAST_CUBE_PRUNING){
-    	CubePruningRescorer ma(models, smeta, in, pl, out, FAST_CP);
+    	CubePruningRescorer ma(models, smeta, in, pl, out, FAST_CP, config.show_node_stats);
         ma.Apply();
     }
     else if (config.algorithm == IntersectionConfiguration::FAST_CUBE_PRUNING_2){
-    	CubePruningRescorer ma(models, smeta, in, pl, out, FAST_CP_2);
+    	CubePruningRescorer ma(models, smeta, in, pl, out, FAST_CP_2, config.show_node_stats);
+        ma.Apply();
+    }
+    else if (config.algorithm == IntersectionConfiguration::CUBE_GROWING){
+    	CubePruningRescorer ma(models, smeta, in, pl, out, GROWING_CP, config.show_node_stats);
+        ma.Apply();
+    }
+    else if (config.algorithm == IntersectionConfiguration::CUBE_CELL){
+    	CubePruningRescorer ma(models, smeta, in, pl, out, CELL_CP, config.show_node_stats);
         ma.Apply();
     }
 
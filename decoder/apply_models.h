@@ -15,13 +15,20 @@ enum {
   CUBE,
   FAST_CUBE_PRUNING,
   FAST_CUBE_PRUNING_2,
+  CUBE_GROWING,
+  CUBE_CELL,     // cube pruning with one heap per chart cell (span)
   N_ALGORITHMS
 };
 
   const int algorithm; // 0 = full intersection, 1 = cube pruning
   const int pop_limit; // max number of pops off the heap at each node
-  IntersectionConfiguration(int alg, int k) : algorithm(alg), pop_limit(k) {}
-  IntersectionConfiguration(exhaustive_t /* t */) : algorithm(0), pop_limit() {}
+  // cube pruning and growing print what the search did at each node (pops,
+  // pushes, recombinations, ...); the totals are reported to the profile
+  // (see timing_stats.h) in any case
+  const bool show_node_stats;
+  IntersectionConfiguration(int alg, int k, bool node_stats = false) :
+    algorithm(alg), pop_limit(k), show_node_stats(node_stats) {}
+  IntersectionConfiguration(exhaustive_t /* t */) : algorithm(0), pop_limit(), show_node_stats() {}
 };
 
 inline std::ostream& operator<<(std::ostream& os, const IntersectionConfiguration& c) {
@@ -29,7 +36,9 @@ inline std::ostream& operator<<(std::ostream& os, const IntersectionConfiguratio
   else if (c.algorithm == 1) { os << "CUBE:k=" << c.pop_limit; }
   else if (c.algorithm == 2) { os << "FAST_CUBE_PRUNING"; }
   else if (c.algorithm == 3) { os << "FAST_CUBE_PRUNING_2"; }
-  else if (c.algorithm == 4) { os << "N_ALGORITHMS"; }
+  else if (c.algorithm == 4) { os << "CUBE_GROWING:k=" << c.pop_limit; }
+  else if (c.algorithm == 5) { os << "CUBE_CELL:k=" << c.pop_limit; }
+  else if (c.algorithm == 6) { os << "N_ALGORITHMS"; }
   else os << "OTHER";
   return os;
 }
@@ -0,0 +1,657 @@
+#include "binary_grammar.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <map>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/make_shared.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "fdict.h"
+#include "phrasetable_fst.h"
+#include "rule_lexer.h"
+#include "tdict.h"
+
+using namespace std;
+
+static const char kBG_MAGIC[8] = { 'c', 'd', 'e', 'c', 'B', 'G', 'R', 'M' };
+static const uint32_t kBG_VERSION = 2;
+static const uint32_t kBG_BYTE_ORDER = 0x01020304;
+
+struct BGHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t num_words;      // entries in the word vocabulary, including the unused id 0
+  uint32_t num_feats;      // entries in the feature vocabulary, including the unused id 0
+  uint32_t num_nodes;
+  uint32_t num_children;
+  uint64_t num_rules;
+  uint64_t num_unaries;
+  // byte offsets from the start of the file
+  uint64_t words_off;
+  uint64_t feats_off;
+  uint64_t nodes_off;
+  uint64_t children_off;
+  uint64_t rule_index_off;
+  uint64_t rules_off;
+  uint64_t unaries_off;
+  uint64_t targets_off;
+  uint64_t fid_blocks_off;
+  uint64_t file_size;
+};
+
+struct BGNode {
+  uint64_t first_rule;     // index into the rule index
+  uint32_t num_rules;
+  uint32_t first_child;    // index into the children array
+  uint32_t num_children;
+  uint32_t pad;
+};
+
+struct BGChild {
+  int32_t symbol;          // as in TRule::f_, nonterminals are negative
+  uint32_t node;
+};
+
+inline bool operator<(const BGChild& c, int32_t symbol) { return c.symbol < symbol; }
+
+// a rule is a BGRule followed by
+//   int32_t f[f_len], float val[num_feats], int16_t als[2 * num_als]
+// and padding to the next multiple of 4 bytes.  Target sides and the lists
+// of feature ids are interned: many rules share the same e (e.g., "[1] of
+// [2]") and nearly all share the same features, so each distinct one is
+// stored once, in the targets and fid blocks sections, and rules refer to it
+// by its position there
+struct BGRule {
+  int32_t lhs;
+  uint16_t f_len;
+  uint16_t e_len;
+  uint16_t num_feats;
+  uint16_t num_als;
+  int8_t arity;
+  uint8_t pad[3];
+  uint32_t e;              // index of e[0] in the targets section (int32_t)
+  uint32_t fids;           // index of fid[0] in the fid blocks section (uint32_t)
+};
+
+// string tables are uint32_t offsets[n + 1] followed by the characters
+static const char* BGString(const char* table, uint32_t n, uint32_t i, uint32_t* len) {
+  const uint32_t* offsets = reinterpret_cast<const uint32_t*>(table);
+  *len = offsets[i + 1] - offsets[i];
+  return table + (n + 1) * sizeof(uint32_t) + offsets[i];
+}
+
+struct BGNodeIter;
+
+class BGImpl {
+ public:
+  explicit BGImpl(const string& file);
+  ~BGImpl();
+
+  const BGNodeIter* root() const { return root_; }
+  const BGNode& node(uint32_t i) const { return nodes_[i]; }
+  const BGChild* children() const { return children_; }
+
+  // maps a symbol of the current process (see TRule::f_) to the symbol used
+  // in the file (0 if the grammar doesn't contain it)
+  int32_t MapSymbol(int symbol) const {
+    const int w = (symbol < 0 ? -symbol : symbol);
+    if (w >= td2bg_.size()) return 0;
+    return (symbol < 0 ? -td2bg_[w] : td2bg_[w]);
+  }
+
+  // decodes the i-th rule of the rule index
+  TRulePtr GetRule(uint64_t i) const { return DecodeRule(rule_index_[i]); }
+
+  // creates the iterators for the children of n the first time they are needed
+  BGNodeIter* ExpandChildren(const BGNodeIter* n) const;
+
+  void LoadUnaries(Grammar::Cat2Rules* rhs2unaries, vector<TRulePtr>* unaries) const;
+
+ private:
+  WordID MapWord(int32_t w) const { return (w < 0 ? -bg2td_[-w] : bg2td_[w]); }
+  // decodes the rule record at byte offset off of the rules section
+  TRulePtr DecodeRule(uint64_t off) const;
+  static void Fail(const string& file, const string& msg);
+
+  void* data_;
+  size_t size_;
+  const BGHeader* header_;
+  const BGNode* nodes_;
+  const BGChild* children_;
+  const uint64_t* rule_index_;
+  const char* rules_;
+  const int32_t* targets_;
+  const uint32_t* fid_blocks_;
+  vector<WordID> bg2td_;
+  vector<int32_t> td2bg_;
+  vector<int> bg2fd_;
+  BGNodeIter* root_;
+  mutable deque<BGNodeIter*> child_arrays_;
+  mutable boost::mutex mutex_;
+};
+
+// there is one of these for each trie node whose parent has been extended;
+// they are created in bulk for all children of a node, so BGImpl only has to
+// keep track of one array per expanded node
+struct BGNodeIter : public GrammarIter, public RuleBin {
+  BGNodeIter() : g_(NULL), index_(0), children_(NULL) {}
+
+  const GrammarIter* Extend(int symbol) const {
+    const BGNode& n = g_->node(index_);
+    if (n.num_children == 0) return NULL;
+    const int32_t s = g_->MapSymbol(symbol);
+    if (s == 0) return NULL;
+    const BGChild* first = g_->children() + n.first_child;
+    const BGChild* last = first + n.num_children;
+    const BGChild* found = lower_bound(first, last, s);
+    if (found == last || found->symbol != s) return NULL;
+    const BGNodeIter* c = children_;
+    if (!c) c = g_->ExpandChildren(this);
+    return &c[found - first];
+  }
+
+  const RuleBin* GetRules() const {
+    return (g_->node(index_).num_rules ? this : NULL);
+  }
+
+  int GetNumRules() const { return g_->node(index_).num_rules; }
+  TRulePtr GetIthRule(int i) const {
+    return g_->GetRule(g_->node(index_).first_rule + i);
+  }
+  int Arity() const { return GetIthRule(0)->Arity(); }
+
+  const BGImpl* g_;
+  uint32_t index_;
+  mutable const BGNodeIter* volatile children_;
+};
+
+void BGImpl::Fail(const string& file, const string& msg) {
+  cerr << "Bad binary grammar " << file << ": " << msg << endl;
+  abort();
+}
+
+BGImpl::BGImpl(const string& file) : data_(MAP_FAILED), size_(0) {
+  const int fd = open(file.c_str(), O_RDONLY);
+  if (fd < 0) Fail(file, strerror(errno));
+  struct stat st;
+  if (fstat(fd, &st) < 0) Fail(file, strerror(errno));
+  size_ = st.st_size;
+  if (size_ < sizeof(BGHeader)) Fail(file, "file too short");
+  data_ = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data_ == MAP_FAILED) Fail(file, strerror(errno));
+  const char* base = static_cast<const char*>(data_);
+  header_ = reinterpret_cast<const BGHeader*>(base);
+  if (memcmp(header_->magic, kBG_MAGIC, sizeof(kBG_MAGIC)) != 0) Fail(file, "bad magic number");
+  if (header_->version != kBG_VERSION) Fail(file, "unsupported version");
+  if (header_->byte_order != kBG_BYTE_ORDER) Fail(file, "compiled on a machine with a different byte order");
+  if (header_->file_size != size_) Fail(file, "truncated file");
+  nodes_ = reinterpret_cast<const BGNode*>(base + header_->nodes_off);
+  children_ = reinterpret_cast<const BGChild*>(base + header_->children_off);
+  rule_index_ = reinterpret_cast<const uint64_t*>(base + header_->rule_index_off);
+  rules_ = base + header_->rules_off;
+  targets_ = reinterpret_cast<const int32_t*>(base + header_->targets_off);
+  fid_blocks_ = reinterpret_cast<const uint32_t*>(base + header_->fid_blocks_off);
+
+  // the only part of the file that has to be read up front
+  const char* words = base + header_->words_off;
+  bg2td_.resize(header_->num_words, 0);
+  for (uint32_t i = 1; i < header_->num_words; ++i) {
+    uint32_t len;
+    const char* w = BGString(words, header_->num_words, i, &len);
+    bg2td_[i] = TD::Convert(string(w, len));
+  }
+  td2bg_.resize(TD::NumWords() + 1, 0);
+  for (uint32_t i = 1; i < bg2td_.size(); ++i)
+    td2bg_[bg2td_[i]] = i;
+  const char* feats = base + header_->feats_off;
+  bg2fd_.resize(header_->num_feats, 0);
+  for (uint32_t i = 1; i < header_->num_feats; ++i) {
+    uint32_t len;
+    const char* f = BGString(feats, header_->num_feats, i, &len);
+    bg2fd_[i] = FD::Convert(string(f, len));
+  }
+
+  root_ = new BGNodeIter;
+  root_->g_ = this;
+  root_->index_ = 0;
+}
+
+BGImpl::~BGImpl() {
+  for (int i = 0; i < child_arrays_.size(); ++i)
+    delete[] child_arrays_[i];
+  delete root_;
+  if (data_ != MAP_FAILED) munmap(data_, size_);
+}
+
+BGNodeIter* BGImpl::ExpandChildren(const BGNodeIter* n) const {
+  // several decoders may share this grammar, so the children are published
+  // only once they are fully constructed
+  boost::mutex::scoped_lock l(mutex_);
+  if (n->children_) return const_cast<BGNodeIter*>(n->children_);
+  const BGNode& node = nodes_[n->index_];
+  BGNodeIter* c = new BGNodeIter[node.num_children];
+  for (uint32_t i = 0; i < node.num_children; ++i) {
+    c[i].g_ = this;
+    c[i].index_ = children_[node.first_child + i].node;
+  }
+  child_arrays_.push_back(c);
+#ifdef __GNUC__
+  __sync_synchronize();
+#endif
+  n->children_ = c;
+  return c;
+}
+
+TRulePtr BGImpl::DecodeRule(uint64_t off) const {
+  const char* p = rules_ + off;
+  const BGRule& r = *reinterpret_cast<const BGRule*>(p);
+  p += sizeof(BGRule);
+  // rules are decoded every time a bin is visited, so the rule and its
+  // reference count share one allocation
+  TRulePtr rule = boost::make_shared<TRule>();
+  rule->lhs_ = MapWord(r.lhs);
+  rule->arity_ = r.arity;
+  const int32_t* f = reinterpret_cast<const int32_t*>(p);
+  rule->f_.resize(r.f_len);
+  for (int j = 0; j < r.f_len; ++j) rule->f_[j] = MapWord(f[j]);
+  const int32_t* e = targets_ + r.e;
+  rule->e_.resize(r.e_len);
+  for (int j = 0; j < r.e_len; ++j) rule->e_[j] = (e[j] > 0 ? bg2td_[e[j]] : e[j]);
+  const uint32_t* fids = fid_blocks_ + r.fids;
+  const float* vals = reinterpret_cast<const float*>(f + r.f_len);
+  for (int j = 0; j < r.num_feats; ++j)
+    rule->scores_.set_value(bg2fd_[fids[j]], vals[j]);
+  const int16_t* als = reinterpret_cast<const int16_t*>(vals + r.num_feats);
+  rule->a_.resize(r.num_als);
+  for (int j = 0; j < r.num_als; ++j)
+    rule->a_[j] = AlignmentPoint(als[2 * j], als[2 * j + 1]);
+  return rule;
+}
+
+void BGImpl::LoadUnaries(Grammar::Cat2Rules* rhs2unaries, vector<TRulePtr>* unaries) const {
+  const uint64_t* u = reinterpret_cast<const uint64_t*>(static_cast<const char*>(data_) + header_->unaries_off);
+  for (uint64_t i = 0; i < header_->num_unaries; ++i) {
+    TRulePtr rule = DecodeRule(u[i]);
+    (*rhs2unaries)[rule->f().front()].push_back(rule);
+    unaries->push_back(rule);
+  }
+}
+
+BinaryGrammar::BinaryGrammar(const string& file) : max_span_(10), pimpl_(new BGImpl(file)) {
+  pimpl_->LoadUnaries(&rhs2unaries_, &unaries_);
+}
+
+BinaryGrammar::~BinaryGrammar() {}
+
+const GrammarIter* BinaryGrammar::GetRoot() const {
+  return pimpl_->root();
+}
+
+bool BinaryGrammar::HasRuleForSpan(int /* i */, int /* j */, int distance) const {
+  return (max_span_ >= distance);
+}
+
+bool BinaryGrammar::IsBinaryGrammar(const string& file) {
+  ifstream in(file.c_str(), ios::binary);
+  char magic[sizeof(kBG_MAGIC)];
+  if (!in.read(magic, sizeof(magic))) return false;
+  return memcmp(magic, kBG_MAGIC, sizeof(kBG_MAGIC)) == 0;
+}
+
+// builds the trie and the packed rules in memory (using TD and FD ids of the
+// compiling process as the file's symbols) and writes them out breadth first
+struct BGCompiler {
+  struct Node {
+    map<int32_t, uint32_t> children;
+    vector<uint64_t> rules;
+  };
+
+  BGCompiler() : nodes(1), ctf_rules(0) {}
+
+  uint64_t AddRecord(const TRule& rule) {
+    const uint64_t id = rule_index.size();
+    rule_index.push_back(rules.size());
+    BGRule r;
+    memset(&r, 0, sizeof(r));
+    r.lhs = rule.lhs_;
+    r.f_len = rule.f_.size();
+    r.e_len = rule.e_.size();
+    r.num_feats = rule.scores_.size();
+    r.num_als = rule.a_.size();
+    r.arity = rule.arity_;
+    r.e = Intern(rule.e_, &target_index, &targets);
+    fids.clear();
+    vals.clear();
+    for (SparseVector<double>::const_iterator it = rule.scores_.begin(); it != rule.scores_.end(); ++it) {
+      fids.push_back(it->first);
+      vals.push_back(it->second);
+    }
+    r.fids = Intern(fids, &fid_block_index, &fid_blocks);
+    Append(&r, sizeof(r));
+    Append(rule.f_);
+    Append(vals);
+    for (int i = 0; i < rule.a_.size(); ++i) {
+      const int16_t st[2] = { rule.a_[i].s_, rule.a_[i].t_ };
+      Append(st, sizeof(st));
+    }
+    while (rules.size() % 4) rules.push_back(0);
+    return id;
+  }
+
+  // the position of the first copy of v in pool, adding v if it's new
+  template <class T>
+  static uint32_t Intern(const vector<T>& v, map<vector<T>, uint32_t>* index, vector<T>* pool) {
+    const pair<typename map<vector<T>, uint32_t>::iterator, bool> it =
+        index->insert(make_pair(v, static_cast<uint32_t>(pool->size())));
+    if (it.second) pool->insert(pool->end(), v.begin(), v.end());
+    return it.first->second;
+  }
+
+  void Append(const void* p, size_t n) {
+    const char* c = static_cast<const char*>(p);
+    rules.insert(rules.end(), c, c + n);
+  }
+
+  template <class T>
+  void Append(const vector<T>& v) {
+    if (!v.empty()) Append(&v[0], v.size() * sizeof(T));
+  }
+
+  void AddRule(const TRulePtr& rule, const unsigned int ctf_level) {
+    if (ctf_level > 0) { ++ctf_rules; return; }
+    const uint64_t id = AddRecord(*rule);
+    if (rule->IsUnary()) {
+      unaries.push_back(id);
+      return;
+    }
+    uint32_t cur = 0;
+    for (int i = 0; i < rule->f_.size(); ++i) {
+      map<int32_t, uint32_t>::iterator it = nodes[cur].children.find(rule->f_[i]);
+      if (it == nodes[cur].children.end()) {
+        const uint32_t n = nodes.size();
+        nodes[cur].children[rule->f_[i]] = n;
+        nodes.push_back(Node());
+        cur = n;
+      } else {
+        cur = it->second;
+      }
+    }
+    nodes[cur].rules.push_back(id);
+  }
+
+  static void WriteStrings(ostream* out, const vector<string>& strs) {
+    uint32_t off = 0;
+    for (int i = 0; i < strs.size(); ++i) {
+      out->write(reinterpret_cast<const char*>(&off), sizeof(off));
+      off += strs[i].size();
+    }
+    out->write(reinterpret_cast<const char*>(&off), sizeof(off));
+    for (int i = 0; i < strs.size(); ++i)
+      out->write(strs[i].data(), strs[i].size());
+  }
+
+  template <class T>
+  static void Append(ostream* out, const vector<T>& v) {
+    if (!v.empty())
+      out->write(reinterpret_cast<const char*>(&v[0]), v.size() * sizeof(T));
+  }
+
+  static void Pad(ostream* out, int align) {
+    while (out->tellp() % align) out->put(0);
+  }
+
+  bool Write(const string& file) {
+    ofstream out(file.c_str(), ios::binary);
+    if (!out) {
+      cerr << "Can't write " << file << endl;
+      return false;
+    }
+    BGHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, kBG_MAGIC, sizeof(kBG_MAGIC));
+    h.version = kBG_VERSION;
+    h.byte_order = kBG_BYTE_ORDER;
+    out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+
+    vector<string> strs(TD::NumWords() + 1);
+    for (int i = 1; i < strs.size(); ++i) strs[i] = TD::Convert(i);
+    h.num_words = strs.size();
+    h.words_off = out.tellp();
+    WriteStrings(&out, strs);
+    Pad(&out, 8);
+
+    strs.resize(FD::NumFeats());
+    for (int i = 1; i < strs.size(); ++i) strs[i] = FD::Convert(i);
+    h.num_feats = strs.size();
+    h.feats_off = out.tellp();
+    WriteStrings(&out, strs);
+    Pad(&out, 8);
+
+    // number the nodes breadth first so siblings are contiguous
+    vector<uint32_t> order(1, 0);
+    vector<BGChild> children;
+    vector<BGNode> bnodes(nodes.size());
+    uint64_t first_rule = 0;
+    vector<uint64_t> sorted_index;
+    sorted_index.reserve(rule_index.size());
+    for (uint32_t k = 0; k < order.size(); ++k) {
+      const Node& n = nodes[order[k]];
+      BGNode& b = bnodes[k];
+      memset(&b, 0, sizeof(b));
+      b.first_rule = first_rule;
+      b.num_rules = n.rules.size();
+      for (int i = 0; i < n.rules.size(); ++i)
+        sorted_index.push_back(rule_index[n.rules[i]]);
+      first_rule += n.rules.size();
+      b.first_child = children.size();
+      b.num_children = n.children.size();
+      for (map<int32_t, uint32_t>::const_iterator it = n.children.begin(); it != n.children.end(); ++it) {
+        BGChild c;
+        c.symbol = it->first;
+        c.node = order.size();
+        children.push_back(c);
+        order.push_back(it->second);
+      }
+    }
+    h.num_nodes = bnodes.size();
+    h.nodes_off = out.tellp();
+    out.write(reinterpret_cast<const char*>(&bnodes[0]), bnodes.size() * sizeof(BGNode));
+    h.num_children = children.size();
+    h.children_off = out.tellp();
+    if (!children.empty())
+      out.write(reinterpret_cast<const char*>(&children[0]), children.size() * sizeof(BGChild));
+    Pad(&out, 8);
+    h.num_rules = sorted_index.size();
+    h.rule_index_off = out.tellp();
+    if (!sorted_index.empty())
+      out.write(reinterpret_cast<const char*>(&sorted_index[0]), sorted_index.size() * sizeof(uint64_t));
+    h.num_unaries = unaries.size();
+    h.unaries_off = out.tellp();
+    for (int i = 0; i < unaries.size(); ++i) {
+      const uint64_t off = rule_index[unaries[i]];
+      out.write(reinterpret_cast<const char*>(&off), sizeof(off));
+    }
+    h.targets_off = out.tellp();
+    Append(&out, targets);
+    h.fid_blocks_off = out.tellp();
+    Append(&out, fid_blocks);
+    h.rules_off = out.tellp();
+    if (!rules.empty())
+      out.write(&rules[0], rules.size());
+    h.file_size = out.tellp();
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    out.close();
+    if (!out) {
+      cerr << "Error writing " << file << endl;
+      return false;
+    }
+    return true;
+  }
+
+  vector<Node> nodes;
+  vector<char> rules;          // packed BGRule records
+  vector<uint64_t> rule_index; // offset of each record in rules
+  vector<uint64_t> unaries;    // ids of the unary rules
+  vector<int32_t> targets;     // the distinct target sides, end to end
+  map<vector<int32_t>, uint32_t> target_index;
+  vector<uint32_t> fid_blocks; // the distinct lists of feature ids, end to end
+  map<vector<uint32_t>, uint32_t> fid_block_index;
+  vector<uint32_t> fids;       // scratch for AddRecord
+  vector<float> vals;
+  int ctf_rules;
+};
+
+static void CompileRuleHelper(const TRulePtr& new_rule, const unsigned int ctf_level, const TRulePtr& /* coarse_rule */, void* extra) {
+  static_cast<BGCompiler*>(extra)->AddRule(new_rule, ctf_level);
+}
+
+bool CompileBinaryGrammar(istream* in, const string& out_file) {
+  BGCompiler c;
+  RuleLexer::ReadRules(in, &CompileRuleHelper, &c);
+  if (c.ctf_rules) {
+    cerr << "Found " << c.ctf_rules << " coarse-to-fine rules; projected grammars can't be compiled\n";
+    return false;
+  }
+  return c.Write(out_file);
+}
+
+bool CompileBinaryPhrasetable(istream* in, const string& out_file) {
+  BGCompiler c;
+  string line;
+  int lc = 0, errors = 0;
+  while (getline(*in, line)) {
+    ++lc;
+    if (line.empty()) continue;
+    TRulePtr rule(TRule::CreateRulePhrasetable(line));
+    if (!rule) {
+      cerr << "  line " << lc << endl;
+      if (++errors > 2) return false;
+      continue;
+    }
+    c.AddRule(rule, 0);
+  }
+  return c.Write(out_file);
+}
+
+// a phrase table node: a trie node of a binary grammar whose rules all have
+// arity 0.  like BGNodeIter, the children of a node are created together
+// the first time the node is extended, and its rules are decoded the first
+// time they are asked for, so FSTNode pointers are stable for the lifetime
+// of the table
+class BGPhrasetable;
+struct BGFSTNode : public FSTNode, public TargetPhraseSet {
+  BGFSTNode() : pt_(NULL), index_(0), children_(NULL), rules_(NULL) {}
+
+  const TargetPhraseSet* GetTranslations() const { return HasData() ? this : NULL; }
+  bool HasData() const;
+  bool HasOutgoingNonEpsilonEdges() const;
+  const FSTNode* Extend(const WordID& t) const;
+  const vector<TRulePtr>& GetRules() const;
+
+  const BGPhrasetable* pt_;
+  uint32_t index_;
+  mutable const BGFSTNode* volatile children_;
+  mutable const vector<TRulePtr>* volatile rules_;
+};
+
+// the root node, which owns the mapped file and everything created from it
+class BGPhrasetable : public BGFSTNode {
+ public:
+  explicit BGPhrasetable(const string& file) : g_(file) {
+    pt_ = this;
+    index_ = 0;
+  }
+  ~BGPhrasetable() {
+    for (int i = 0; i < child_arrays_.size(); ++i)
+      delete[] child_arrays_[i];
+    for (int i = 0; i < rule_sets_.size(); ++i)
+      delete rule_sets_[i];
+  }
+
+  const BGImpl& g() const { return g_; }
+
+  const BGFSTNode* ExpandChildren(const BGFSTNode* n) const {
+    boost::mutex::scoped_lock l(mutex_);
+    if (n->children_) return n->children_;
+    const BGNode& node = g_.node(n->index_);
+    BGFSTNode* c = new BGFSTNode[node.num_children];
+    for (uint32_t i = 0; i < node.num_children; ++i) {
+      c[i].pt_ = this;
+      c[i].index_ = g_.children()[node.first_child + i].node;
+    }
+    child_arrays_.push_back(c);
+#ifdef __GNUC__
+    __sync_synchronize();
+#endif
+    n->children_ = c;
+    return c;
+  }
+
+  const vector<TRulePtr>* DecodeRules(const BGFSTNode* n) const {
+    boost::mutex::scoped_lock l(mutex_);
+    if (n->rules_) return n->rules_;
+    const BGNode& node = g_.node(n->index_);
+    vector<TRulePtr>* rules = new vector<TRulePtr>(node.num_rules);
+    for (uint32_t i = 0; i < node.num_rules; ++i)
+      (*rules)[i] = g_.GetRule(node.first_rule + i);
+    rule_sets_.push_back(rules);
+#ifdef __GNUC__
+    __sync_synchronize();
+#endif
+    n->rules_ = rules;
+    return rules;
+  }
+
+ private:
+  BGImpl g_;
+  mutable deque<BGFSTNode*> child_arrays_;
+  mutable deque<vector<TRulePtr>*> rule_sets_;
+  mutable boost::mutex mutex_;
+};
+
+bool BGFSTNode::HasData() const {
+  return pt_->g().node(index_).num_rules > 0;
+}
+
+bool BGFSTNode::HasOutgoingNonEpsilonEdges() const {
+  return pt_->g().node(index_).num_children > 0;
+}
+
+const FSTNode* BGFSTNode::Extend(const WordID& t) const {
+  const BGImpl& g = pt_->g();
+  const BGNode& n = g.node(index_);
+  if (n.num_children == 0) return NULL;
+  const int32_t s = g.MapSymbol(t);
+  if (s == 0) return NULL;
+  const BGChild* first = g.children() + n.first_child;
+  const BGChild* last = first + n.num_children;
+  const BGChild* found = lower_bound(first, last, s);
+  if (found == last || found->symbol != s) return NULL;
+  const BGFSTNode* c = children_;
+  if (!c) c = pt_->ExpandChildren(this);
+  return &c[found - first];
+}
+
+const vector<TRulePtr>& BGFSTNode::GetRules() const {
+  const vector<TRulePtr>* r = rules_;
+  if (!r) r = pt_->DecodeRules(this);
+  return *r;
+}
+
+FSTNode* LoadBinaryPhrasetable(const string& file) {
+  return new BGPhrasetable(file);
+}
@@ -0,0 +1,57 @@
+#ifndef BINARY_GRAMMAR_H_
+#define BINARY_GRAMMAR_H_
+
+// BinaryGrammar serves SCFG rules straight out of a memory-mapped file
+// written by CompileBinaryGrammar (see compile_grammar), so loading even a
+// very large grammar only costs mapping the file and translating its
+// vocabulary, and all processes decoding with the same file share one copy
+// of it in the page cache.
+//
+// File layout (native byte order, see BGHeader in binary_grammar.cc):
+//   header | words | features | trie nodes | trie children | rule index |
+//   unary rules | targets | fid blocks | rules
+// The trie is stored breadth first, so the children of each node occupy a
+// contiguous range sorted by symbol and are found by binary search. Rules are
+// packed variable-length records; feature values are stored as floats and
+// feature names as indices into the feature vocabulary. Target sides and
+// lists of feature ids are stored once and shared by all rules using them.
+//
+// Coarse-to-fine (projected) grammars are not supported.
+//
+// Phrase tables are compiled into the same format, as grammars whose rules
+// all have the LHS [X] and no nonterminals; LoadBinaryPhrasetable (see
+// phrasetable_fst.h) maps them for the FST and phrase-based translators.
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include "grammar.h"
+
+class BGImpl;
+struct BinaryGrammar : public Grammar {
+  explicit BinaryGrammar(const std::string& file);
+  ~BinaryGrammar();
+  void SetMaxSpan(int m) { max_span_ = m; }
+
+  virtual const GrammarIter* GetRoot() const;
+  virtual bool HasRuleForSpan(int i, int j, int distance) const;
+
+  // true if file starts with the binary grammar magic number
+  static bool IsBinaryGrammar(const std::string& file);
+
+ private:
+  int max_span_;
+  boost::shared_ptr<BGImpl> pimpl_;
+};
+
+// reads a text grammar from in and writes it in binary format to out_file.
+// returns false (after printing a message) on failure.
+bool CompileBinaryGrammar(std::istream* in, const std::string& out_file);
+
+// the same for a phrase table (source ||| target ||| features per line)
+bool CompileBinaryPhrasetable(std::istream* in, const std::string& out_file);
+
+#endif
@@ -4,9 +4,17 @@
 
 #include "bottom_up_parser.h"
 
+#include <algorithm>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <map>
 
+#include <boost/bind.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "arena.h"
 #include "hg.h"
 #include "array2d.h"
 #include "tdict.h"
@@ -15,12 +23,44 @@
 using namespace std;
 
 class ActiveChart;
+struct AntNode;
+
+// when the cells of one span width are filled in parallel, each cell records
+// the nodes and edges it derives here instead of adding them to the forest.
+// Nodes of the cell are referred to (in chart_, nodemap_ and tails) as
+// LocalNode(k) until PassiveChart::MergeCell adds them to the forest in the
+// same order the serial parser would have.
+struct CellBuffer {
+  struct Edge {
+    TRulePtr rule;
+    Hypergraph::TailNodeVector tail;
+    int head;      // index into cats
+    SparseVector<double> features;
+    void swap(Edge& o) {
+      rule.swap(o.rule);
+      tail.swap(o.tail);
+      std::swap(head, o.head);
+      features.swap(o.features);
+    }
+  };
+  CellBuffer() : goal(-1) {}
+  vector<WordID> cats;
+  vector<Edge> edges;
+  int goal;        // index into cats of the goal node, if derived here
+  vector<double> inside; // Viterbi inside log prob of cats (set by PruneCell)
+};
+
+static inline int LocalNode(int k) { return -1 - k; }
+static inline bool IsLocalNode(int n) { return n < 0; }
+
 class PassiveChart {
  public:
   PassiveChart(const string& goal,
                const vector<GrammarPtr>& grammars,
                const Lattice& input,
-               Hypergraph* forest);
+               Hypergraph* forest,
+               int threads,
+               const ChartCellPruning& pruning);
   ~PassiveChart();
 
   inline const vector<int>& operator()(int i, int j) const { return chart_(i,j); }
@@ -33,16 +73,32 @@ class PassiveChart {
   void ApplyRules(const int i,
                   const int j,
                   const RuleBin* rules,
-                  const Hypergraph::TailNodeVector& tail,
-                  const float lattice_cost);
+                  const AntNode* ants,
+                  const float lattice_cost,
+                  CellBuffer* buf);
 
+  // if buf is not NULL, the edge (and node) are recorded there
   void ApplyRule(const int i,
                  const int j,
                  const TRulePtr& r,
                  const Hypergraph::TailNodeVector& ant_nodes,
-                 const float lattice_cost);
+                 const float lattice_cost,
+                 CellBuffer* buf = NULL);
+
+  void ApplyUnaryRules(const int i, const int j, CellBuffer* buf);
 
-  void ApplyUnaryRules(const int i, const int j);
+  // derives everything spanning (i,j), see CellBuffer
+  void ParseCell(const int i, const int j, CellBuffer* buf);
+  // extends active items with the nodes just proved for (i,j)
+  void FinishCell(const int i, const int j);
+  // drops the edges of buf that pruning_ says to, see ChartCellPruning
+  void PruneCell(CellBuffer* buf) const;
+  // adds what ParseCell(i,j,buf) derived to the forest
+  void MergeCell(const int i, const int j, CellBuffer* buf);
+
+  // fills the cells of width l in parallel
+  void ParseWidth(const int l);
+  void ParseCellsWorker(const int l, vector<CellBuffer>* bufs, bool finish, int* next, boost::mutex* m);
 
   const vector<GrammarPtr>& grammars_;
   const Lattice& input_;
@@ -55,43 +111,68 @@ class PassiveChart {
   TRulePtr goal_rule_;
   int goal_idx_;             // index of goal node, if found
   const int lc_fid_;
+  const int threads_;
+  const ChartCellPruning& pruning_;
+  vector<double> inside_;    // Viterbi inside log prob of each forest node (only if pruning_)
 
   static WordID kGOAL;       // [Goal]
 };
 
 WordID PassiveChart::kGOAL = 0;
 
+// antecedents of active items are stored as a chain of prefix records, each
+// pointing to the record of the item it was extended from, so extending an
+// item by a nonterminal costs one record instead of a copy of all
+// antecedents. Tail vectors are only built when an edge is created.
+struct AntNode {
+  AntNode(int n, const AntNode* p) : node(n), size(p ? p->size + 1 : 1), prev(p) {}
+  const int node;
+  const int size;
+  const AntNode* prev;
+};
+
+static void GetTailNodes(const AntNode* ants, Hypergraph::TailNodeVector* tail) {
+  tail->resize(ants ? ants->size : 0);
+  for (; ants; ants = ants->prev)
+    (*tail)[ants->size - 1] = ants->node;
+}
+
 class ActiveChart {
  public:
   ActiveChart(const Hypergraph* hg, const PassiveChart& psv_chart) :
     hg_(hg),
-    act_chart_(psv_chart.size(), psv_chart.size()), psv_chart_(psv_chart) {}
+    act_chart_(psv_chart.size(), psv_chart.size()), psv_chart_(psv_chart),
+    ant_arenas_(psv_chart.size()) {
+    for (int i = 0; i < ant_arenas_.size(); ++i)
+      ant_arenas_[i] = new MonotonicArena(1 << 16);
+  }
+  ~ActiveChart() {
+    for (int i = 0; i < ant_arenas_.size(); ++i)
+      delete ant_arenas_[i];
+  }
 
   struct ActiveItem {
-    ActiveItem(const GrammarIter* g, const Hypergraph::TailNodeVector& a, float lcost) :
-      gptr_(g), ant_nodes_(a), lattice_cost(lcost) {}
+    ActiveItem(const GrammarIter* g, const AntNode* a, float lcost) :
+      gptr_(g), ants_(a), lattice_cost(lcost) {}
     explicit ActiveItem(const GrammarIter* g) :
-      gptr_(g), ant_nodes_(), lattice_cost(0.0) {}
+      gptr_(g), ants_(NULL), lattice_cost(0.0) {}
 
     void ExtendTerminal(int symbol, float src_cost, vector<ActiveItem>* out_cell) const {
       const GrammarIter* ni = gptr_->Extend(symbol);
       if (ni) {
-        out_cell->push_back(ActiveItem(ni, ant_nodes_, lattice_cost + src_cost));
+        out_cell->push_back(ActiveItem(ni, ants_, lattice_cost + src_cost));
       }
     }
-    void ExtendNonTerminal(const Hypergraph* hg, int node_index, vector<ActiveItem>* out_cell) const {
+    void ExtendNonTerminal(const Hypergraph* hg, int node_index, MonotonicArena* arena, vector<ActiveItem>* out_cell) const {
       int symbol = hg->nodes_[node_index].cat_;
       const GrammarIter* ni = gptr_->Extend(symbol);
       if (!ni) return;
-      Hypergraph::TailNodeVector na(ant_nodes_.size() + 1);
-      for (int i = 0; i < ant_nodes_.size(); ++i)
-        na[i] = ant_nodes_[i];
-      na[ant_nodes_.size()] = node_index;
+      const AntNode* na = new(arena->Allocate(sizeof(AntNode))) AntNode(node_index, ants_);
       out_cell->push_back(ActiveItem(ni, na, lattice_cost));
     }
 
     const GrammarIter* gptr_;
-    Hypergraph::TailNodeVector ant_nodes_;
+    const AntNode* ants_;
     float lattice_cost;  // TODO? use SparseVector<double>
   };
 
@@ -108,10 +189,11 @@ class ActiveChart {
     vector<ActiveItem>& cell = act_chart_(i,j);
     const vector<ActiveItem>& icell = act_chart_(i,k);
     const vector<int>& idxs = psv_chart_(k, j);
+    MonotonicArena* arena = ant_arenas_[i];
     //if (!idxs.empty()) { cerr << "FOUND IN (" << k << "," << j << ")\n"; }
     for (vector<ActiveItem>::const_iterator di = icell.begin(); di != icell.end(); ++di) {
       for (vector<int>::const_iterator ni = idxs.begin(); ni != idxs.end(); ++ni) {
-         di->ExtendNonTerminal(hg_, *ni, &cell);
+         di->ExtendNonTerminal(hg_, *ni, arena, &cell);
       }
     }
   }
@@ -138,12 +220,17 @@ class ActiveChart {
   const Hypergraph* hg_;
   Array2D<vector<ActiveItem> > act_chart_;
   const PassiveChart& psv_chart_;
+  // antecedent records of the items in row i of act_chart_. Only the thread
+  // filling a cell (i,j) extends items into row i, so these need no locking.
+  vector<MonotonicArena*> ant_arenas_;
 };
 
 PassiveChart::PassiveChart(const string& goal,
                            const vector<GrammarPtr>& grammars,
                            const Lattice& input,
-                           Hypergraph* forest) :
+                           Hypergraph* forest,
+                           int threads,
+                           const ChartCellPruning& pruning) :
     grammars_(grammars),
     input_(input),
     forest_(forest),
@@ -152,7 +239,9 @@ PassiveChart::PassiveChart(const string& goal,
     goal_cat_(TD::Convert(goal) * -1),
     goal_rule_(new TRule("[Goal] ||| [" + goal + ",1] ||| [" + goal + ",1]")),
     goal_idx_(-1),
-    lc_fid_(FD::Convert("LatticeCost")) {
+    lc_fid_(FD::Convert("LatticeCost")),
+    threads_(threads),
+    pruning_(pruning) {
   act_chart_.resize(grammars_.size());
   for (int i = 0; i < grammars_.size(); ++i)
     act_chart_[i] = new ActiveChart(forest, *this);
@@ -164,7 +253,33 @@ void PassiveChart::ApplyRule(const int i,
                              const int j,
                              const TRulePtr& r,
                              const Hypergraph::TailNodeVector& ant_nodes,
-                             const float lattice_cost) {
+                             const float lattice_cost,
+                             CellBuffer* buf) {
+  if (buf) {
+    buf->edges.resize(buf->edges.size() + 1);
+    CellBuffer::Edge& e = buf->edges.back();
+    e.rule = r;
+    e.tail = ant_nodes;
+    e.features = r->GetFeatureValues();
+    if (lattice_cost && lc_fid_)
+      e.features.set_value(lc_fid_, lattice_cost);
+    Cat2NodeMap& c2n = nodemap_(i,j);
+    const Cat2NodeMap::iterator ni = c2n.find(r->GetLHS());
+    if (ni == c2n.end()) {
+      e.head = buf->cats.size();
+      buf->cats.push_back(r->GetLHS());
+      c2n[r->GetLHS()] = LocalNode(e.head);
+      if (r->GetLHS() == kGOAL) {
+        assert(buf->goal == -1);
+        buf->goal = e.head;
+      } else {
+        chart_(i,j).push_back(LocalNode(e.head));
+      }
+    } else {
+      e.head = LocalNode(ni->second);
+    }
+    return;
+  }
   Hypergraph::Edge* new_edge = forest_->AddEdge(r, ant_nodes);
   new_edge->prev_i_ = r->prev_i;
   new_edge->prev_j_ = r->prev_j;
@@ -195,24 +310,28 @@ void PassiveChart::ApplyRule(const int i,
 void PassiveChart::ApplyRules(const int i,
                        const int j,
                        const RuleBin* rules,
-                       const Hypergraph::TailNodeVector& tail,
-                       const float lattice_cost) {
+                       const AntNode* ants,
+                       const float lattice_cost,
+                       CellBuffer* buf) {
   const int n = rules->GetNumRules();
+  if (!n) return;
+  Hypergraph::TailNodeVector tail;
+  GetTailNodes(ants, &tail);
   for (int k = 0; k < n; ++k)
-    ApplyRule(i, j, rules->GetIthRule(k), tail, lattice_cost);
+    ApplyRule(i, j, rules->GetIthRule(k), tail, lattice_cost, buf);
 }
 
-void PassiveChart::ApplyUnaryRules(const int i, const int j) {
+void PassiveChart::ApplyUnaryRules(const int i, const int j, CellBuffer* buf) {
   const vector<int>& nodes = chart_(i,j);  // reference is important!
   for (int gi = 0; gi < grammars_.size(); ++gi) {
     if (!grammars_[gi]->HasRuleForSpan(i,j,input_.Distance(i,j))) continue;
     for (int di = 0; di < nodes.size(); ++di) {
-      const WordID& cat = forest_->nodes_[nodes[di]].cat_;
+      const WordID cat = (buf ? buf->cats[LocalNode(nodes[di])] : forest_->nodes_[nodes[di]].cat_);
       const vector<TRulePtr>& unaries = grammars_[gi]->GetUnaryRulesForRHS(cat);
       for (int ri = 0; ri < unaries.size(); ++ri) {
         // cerr << "At (" << i << "," << j << "): applying " << unaries[ri]->AsString() << endl;
         const Hypergraph::TailNodeVector ant(1, nodes[di]);
-        ApplyRule(i, j, unaries[ri], ant, 0);  // may update nodes
+        ApplyRule(i, j, unaries[ri], ant, 0, buf);  // may update nodes
       }
     }
   }
@@ -222,6 +341,8 @@ bool PassiveChart::Parse() {
   size_t in_size_2 = input_.size() * input_.size();
   forest_->nodes_.reserve(in_size_2 * 2);
   size_t res = min(static_cast<size_t>(2000000), static_cast<size_t>(in_size_2 * 1000));
+  if (pruning_.enabled() && pruning_.limit > 0)
+    res = min(res, in_size_2 * pruning_.limit);
   forest_->edges_.reserve(res);
   goal_idx_ = -1;
   for (int gi = 0; gi < grammars_.size(); ++gi)
@@ -230,29 +351,20 @@ bool PassiveChart::Parse() {
   if (!SILENT) cerr << "    ";
   for (int l=1; l<input_.size()+1; ++l) {
     if (!SILENT) cerr << '.';
-    for (int i=0; i<input_.size() + 1 - l; ++i) {
-      int j = i + l;
-      for (int gi = 0; gi < grammars_.size(); ++gi) {
-        const Grammar& g = *grammars_[gi];
-        if (g.HasRuleForSpan(i, j, input_.Distance(i, j))) {
-          act_chart_[gi]->AdvanceDotsForAllItemsInCell(i, j, input_);
-
-          const vector<ActiveChart::ActiveItem>& cell = (*act_chart_[gi])(i,j);
-          for (vector<ActiveChart::ActiveItem>::const_iterator ai = cell.begin();
-               ai != cell.end(); ++ai) {
-            const RuleBin* rules = (ai->gptr_->GetRules());
-            if (!rules) continue;
-            ApplyRules(i, j, rules, ai->ant_nodes_, ai->lattice_cost);
-          }
+    if (threads_ > 1 && l < input_.size()) {
+      ParseWidth(l);
+    } else {
+      for (int i=0; i<input_.size() + 1 - l; ++i) {
+        const int j = i + l;
+        if (pruning_.enabled()) {
+          CellBuffer buf;
+          ParseCell(i, j, &buf);
+          PruneCell(&buf);
+          MergeCell(i, j, &buf);
+        } else {
+          ParseCell(i, j, NULL);
         }
-      }
-      ApplyUnaryRules(i,j);
-
-      for (int gi = 0; gi < grammars_.size(); ++gi) {
-        const Grammar& g = *grammars_[gi];
-          // deal with non-terminals that were just proved
-          if (g.HasRuleForSpan(i, j, input_.Distance(i,j)))
-            act_chart_[gi]->ExtendActiveItems(i, i, j);
+        FinishCell(i, j);
       }
     }
     const vector<int>& dh = chart_(0, input_.size());
@@ -271,6 +383,143 @@ bool PassiveChart::Parse() {
   return GoalFound();
 }
 
+void PassiveChart::ParseCell(const int i, const int j, CellBuffer* buf) {
+  for (int gi = 0; gi < grammars_.size(); ++gi) {
+    const Grammar& g = *grammars_[gi];
+    if (g.HasRuleForSpan(i, j, input_.Distance(i, j))) {
+      act_chart_[gi]->AdvanceDotsForAllItemsInCell(i, j, input_);
+
+      const vector<ActiveChart::ActiveItem>& cell = (*act_chart_[gi])(i,j);
+      for (vector<ActiveChart::ActiveItem>::const_iterator ai = cell.begin();
+           ai != cell.end(); ++ai) {
+        const RuleBin* rules = (ai->gptr_->GetRules());
+        if (!rules) continue;
+        ApplyRules(i, j, rules, ai->ants_, ai->lattice_cost, buf);
+      }
+    }
+  }
+  ApplyUnaryRules(i, j, buf);
+}
+
+void PassiveChart::FinishCell(const int i, const int j) {
+  for (int gi = 0; gi < grammars_.size(); ++gi) {
+    const Grammar& g = *grammars_[gi];
+      // deal with non-terminals that were just proved
+      if (g.HasRuleForSpan(i, j, input_.Distance(i,j)))
+        act_chart_[gi]->ExtendActiveItems(i, i, j);
+  }
+}
+
+void PassiveChart::MergeCell(const int i, const int j, CellBuffer* buf) {
+  const int node_base = forest_->nodes_.size();
+  for (int k = 0; k < buf->cats.size(); ++k)
+    forest_->AddNode(buf->cats[k]);
+  for (int k = 0; k < buf->edges.size(); ++k) {
+    CellBuffer::Edge& e = buf->edges[k];
+    for (int t = 0; t < e.tail.size(); ++t)
+      if (IsLocalNode(e.tail[t])) e.tail[t] = node_base + LocalNode(e.tail[t]);
+    Hypergraph::Edge* new_edge = forest_->AddEdge(e.rule, e.tail);
+    new_edge->prev_i_ = e.rule->prev_i;
+    new_edge->prev_j_ = e.rule->prev_j;
+    new_edge->i_ = i;
+    new_edge->j_ = j;
+    new_edge->feature_values_.swap(e.features);
+    forest_->ConnectEdgeToHeadNode(new_edge->id_, node_base + e.head);
+  }
+  vector<int>& nodes = chart_(i,j);
+  for (int k = 0; k < nodes.size(); ++k)
+    nodes[k] = node_base + LocalNode(nodes[k]);
+  Cat2NodeMap& c2n = nodemap_(i,j);
+  for (Cat2NodeMap::iterator it = c2n.begin(); it != c2n.end(); ++it)
+    it->second = node_base + LocalNode(it->second);
+  if (buf->goal >= 0) {
+    assert(goal_idx_ == -1);
+    goal_idx_ = node_base + buf->goal;
+  }
+  if (pruning_.enabled()) {
+    inside_.resize(forest_->nodes_.size());
+    copy(buf->inside.begin(), buf->inside.end(), inside_.begin() + node_base);
+  }
+}
+
+void PassiveChart::PruneCell(CellBuffer* buf) const {
+  vector<CellBuffer::Edge>& edges = buf->edges;
+  const double kMINUS_INF = -numeric_limits<double>::infinity();
+  buf->inside.assign(buf->cats.size(), kMINUS_INF);
+  vector<int> best_edge(buf->cats.size(), -1);
+  vector<double> score(edges.size());
+  double best = kMINUS_INF;
+  // edges with a tail in this cell (unary rules) come after that tail's
+  // other edges, so one pass in order sees complete inside scores
+  for (int k = 0; k < edges.size(); ++k) {
+    const CellBuffer::Edge& e = edges[k];
+    double s = e.features.dot(*pruning_.weights);
+    for (int t = 0; t < e.tail.size(); ++t)
+      s += IsLocalNode(e.tail[t]) ? buf->inside[LocalNode(e.tail[t])] : inside_[e.tail[t]];
+    score[k] = s;
+    if (s > buf->inside[e.head] || best_edge[e.head] < 0) {
+      buf->inside[e.head] = s;
+      best_edge[e.head] = k;
+    }
+    if (s > best) best = s;
+  }
+  double cutoff = kMINUS_INF;
+  if (pruning_.beam > 0)
+    cutoff = best - pruning_.beam;
+  if (pruning_.limit > 0 && edges.size() > pruning_.limit) {
+    vector<double> sorted(score);
+    nth_element(sorted.begin(), sorted.begin() + pruning_.limit - 1, sorted.end(), greater<double>());
+    cutoff = max(cutoff, sorted[pruning_.limit - 1]);
+  }
+  int c = 0;
+  for (int k = 0; k < edges.size(); ++k) {
+    if (score[k] < cutoff && best_edge[edges[k].head] != k) continue;
+    if (c != k) edges[c].swap(edges[k]);
+    ++c;
+  }
+  edges.resize(c);
+}
+
+// cells (i,i+l) only read cells of smaller widths (and write active items
+// into cells (i,j') whose other writers all have different widths), so they
+// can be filled concurrently if the forest is only touched by MergeCell
+void PassiveChart::ParseWidth(const int l) {
+  const int n = input_.size() + 1 - l;
+  vector<CellBuffer> bufs(n);
+  for (int pass = 0; pass < 2; ++pass) {
+    int next = 0;
+    boost::mutex m;
+    boost::thread_group workers;
+    for (int t = 1; t < threads_ && t < n; ++t)
+      workers.create_thread(boost::bind(&PassiveChart::ParseCellsWorker, this, l, &bufs, pass == 1, &next, &m));
+    ParseCellsWorker(l, &bufs, pass == 1, &next, &m);
+    workers.join_all();
+    if (pass == 0) {
+      for (int i = 0; i < n; ++i)
+        MergeCell(i, i + l, &bufs[i]);
+      vector<CellBuffer>().swap(bufs);
+    }
+  }
+}
+
+void PassiveChart::ParseCellsWorker(const int l, vector<CellBuffer>* bufs, bool finish, int* next, boost::mutex* m) {
+  const int n = input_.size() + 1 - l;
+  while (true) {
+    int i;
+    {
+      boost::mutex::scoped_lock lock(*m);
+      i = (*next)++;
+    }
+    if (i >= n) break;
+    if (finish) {
+      FinishCell(i, i + l);
+    } else {
+      ParseCell(i, i + l, &(*bufs)[i]);
+      if (pruning_.enabled()) PruneCell(&(*bufs)[i]);
+    }
+  }
+}
+
 PassiveChart::~PassiveChart() {
   for (int i = 0; i < act_chart_.size(); ++i)
     delete act_chart_[i];
@@ -278,13 +527,17 @@ PassiveChart::~PassiveChart() {
 
 ExhaustiveBottomUpParser::ExhaustiveBottomUpParser(
     const string& goal_sym,
-    const vector<GrammarPtr>& grammars) :
+    const vector<GrammarPtr>& grammars,
+    int threads,
+    const ChartCellPruning& pruning) :
   goal_sym_(goal_sym),
-  grammars_(grammars) {}
+  grammars_(grammars),
+  threads_(threads),
+  pruning_(pruning) {}
 
 bool ExhaustiveBottomUpParser::Parse(const Lattice& input,
                                      Hypergraph* forest) const {
-  PassiveChart chart(goal_sym_, grammars_, input, forest);
+  PassiveChart chart(goal_sym_, grammars_, input, forest, threads_, pruning_);
   const bool result = chart.Parse();
   return result;
 }
@@ -9,19 +9,42 @@
 
 class Hypergraph;
 
+// prunes each chart cell as it is filled, so the edges pruned are never added
+// to the forest.  Edges are scored by their Viterbi inside log prob under
+// weights (rule features and LatticeCost); all edges of a cell cover the same
+// span, so an outside estimate by span would not change their ranking.
+// Edges more than beam worse than the cell's best, and all but the best limit
+// edges of a cell, are dropped, except that every node keeps its best edge
+// (so nothing the goal could be built from disappears).  beam <= 0 or
+// limit <= 0 turns that part off.
+struct ChartCellPruning {
+  ChartCellPruning() : weights(NULL), beam(0), limit(0) {}
+  const std::vector<double>* weights;
+  double beam;
+  int limit;
+  bool enabled() const { return weights && (beam > 0 || limit > 0); }
+};
+
 class ExhaustiveBottomUpParser {
  public:
+  // if threads > 1, the cells of each span width are filled in parallel;
+  // the resulting forest is identical to the one built by a single thread
   ExhaustiveBottomUpParser(const std::string& goal_sym,
-                           const std::vector<GrammarPtr>& grammars);
+                           const std::vector<GrammarPtr>& grammars,
+                           int threads = 1,
+                           const ChartCellPruning& pruning = ChartCellPruning());
 
   // returns true if goal reached spanning the full input
-  // forest contains the full (i.e., unpruned) parse forest
+  // forest contains the full (i.e., unpruned) parse forest, unless cell
+  // pruning is enabled
   bool Parse(const Lattice& input,
              Hypergraph* forest) const;
 
  private:
   const std::string goal_sym_;
   const std::vector<GrammarPtr> grammars_;
+  const int threads_;
+  const ChartCellPruning pruning_;
 };
 
 #endif
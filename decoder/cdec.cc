@@ -1,18 +1,147 @@
+#include <algorithm>
+#include <deque>
 #include <iostream>
+#include <map>
+#include <sstream>
 
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "bounded_queue.h"
 #include "filelib.h"
 #include "decoder.h"
 #include "ff_register.h"
+#include "null_deleter.h"
+#include "numa.h"
+#include "timing_stats.h"
 #include "verbose.h"
 
 using namespace std;
 
+// decodes on one thread per Decoder, with a reader thread feeding them input
+// lines and a writer thread putting their output back in input order, so
+// reading and writing overlap with decoding instead of holding up a decoding
+// thread.  The stages are joined by bounded queues, and the reader stays at
+// most window sentences ahead of the writer, which bounds the output held
+// back behind a slow sentence.  Each Decoder has its own per-sentence state
+// in the translators and feature functions, but grammars and language models
+// loaded from the same files are shared by all of them.  With --numa the
+// decoding threads are bound to the NUMA nodes round robin.
+struct ParallelDecoding {
+  typedef pair<int, string> Item; // input id, input line or output
+
+  ParallelDecoding(istream* in, unsigned threads, bool numa) :
+    in_(in), inputs_(2 * threads), outputs_(2 * threads),
+    window_(8 * threads), next_id_(0), written_(0), numa_(numa) {}
+
+  void Run(const vector<Decoder*>& decoders) {
+    boost::thread reader(boost::bind(&ParallelDecoding::Read, this));
+    boost::thread writer(boost::bind(&ParallelDecoding::Write, this));
+    boost::thread_group workers;
+    for (unsigned i = 0; i < decoders.size(); ++i)
+      workers.create_thread(boost::bind(&ParallelDecoding::Decode, this, decoders[i], i));
+    reader.join();
+    workers.join_all();
+    outputs_.Close();
+    writer.join();
+  }
+
+ private:
+  void Read() {
+    string buf;
+    while(*in_) {
+      getline(*in_, buf);
+      if (buf.empty()) continue;
+      {
+        boost::mutex::scoped_lock l(window_mutex_);
+        while (next_id_ - written_ >= window_)
+          window_cond_.wait(l);
+      }
+      inputs_.Push(Item(next_id_++, buf));
+    }
+    inputs_.Close();
+  }
+
+  void Decode(Decoder* decoder, unsigned i) {
+    if (numa_) {
+      const vector<NumaNode>& nodes = Numa::Nodes();
+      if (!Numa::BindThread(nodes[i % nodes.size()]))
+        cerr << "Could not bind decoding thread " << (i + 1) << " to NUMA node " << nodes[i % nodes.size()].id << endl;
+    }
+    Item item;
+    while (inputs_.Pop(&item)) {
+      ostringstream out;
+      decoder->SetOutput(&out);
+      decoder->SetId(item.first);
+      decoder->Decode(item.second);
+      item.second = out.str();
+      outputs_.Push(item);
+    }
+    decoder->SetOutput(NULL);
+    // the last input's profile (each Decode summarizes the one before)
+    if (Timer::SamplingMemory()) Timer::Summarize();
+  }
+
+  void Write() {
+    map<int, string> pending;
+    int next_out = 0;
+    Item item;
+    while (outputs_.Pop(&item)) {
+      pending[item.first].swap(item.second);
+      map<int, string>::iterator it;
+      while ((it = pending.find(next_out)) != pending.end()) {
+        cout << it->second << flush;
+        pending.erase(it);
+        ++next_out;
+      }
+      boost::mutex::scoped_lock l(window_mutex_);
+      written_ = next_out;
+      window_cond_.notify_one();
+    }
+  }
+
+  istream* in_;
+  BoundedQueue<Item> inputs_;
+  BoundedQueue<Item> outputs_;
+  const int window_;
+  int next_id_;
+  int written_;
+  boost::mutex window_mutex_;
+  boost::condition_variable window_cond_;
+  const bool numa_;
+};
+
+static void ReportNumaPlacement(int threads) {
+  const vector<NumaNode>& nodes = Numa::Nodes();
+  if (!Numa::Available()) {
+    cerr << "NUMA: single node, nothing to place\n";
+    return;
+  }
+  cerr << "NUMA: " << nodes.size() << " nodes, grammars and language models interleaved over them\n";
+  for (unsigned n = 0; n < nodes.size(); ++n) {
+    cerr << "  node " << nodes[n].id << " (CPUs " << Numa::CpuListString(nodes[n].cpus) << "):";
+    bool any = false;
+    for (int i = n; threads > 1 && i < threads; i += nodes.size()) {
+      cerr << (any ? ", " : " decoding threads ") << (i + 1);
+      any = true;
+    }
+    if (!any) cerr << " no decoding threads";
+    cerr << endl;
+  }
+}
+
 int main(int argc, char** argv) {
   register_feature_functions();
   Decoder decoder(argc, argv);
 
   const string input = decoder.GetConf()["input"].as<string>();
   const bool show_feature_dictionary = decoder.GetConf().count("show_feature_dictionary");
+  const int threads = decoder.GetConf()["threads"].as<int>();
+  const bool numa = decoder.GetConf().count("numa");
+  if (numa && !SILENT) ReportNumaPlacement(threads);
   if (!SILENT) cerr << "Reading input from " << ((input == "-") ? "STDIN" : input.c_str()) << endl;
   ReadFile in_read(input);
   istream *in = in_read.stream();
@@ -22,11 +151,36 @@ int main(int argc, char** argv) {
 #ifdef CP_TIME
     clock_t time_cp(0);//, end_cp;
 #endif
-  while(*in) {
-    getline(*in, buf);
-    if (buf.empty()) continue;
-    decoder.Decode(buf);
+  if (threads > 1) {
+    // these share the models the first one loaded
+    vector<boost::shared_ptr<Decoder> > decoders(1, boost::shared_ptr<Decoder>(&decoder, null_deleter()));
+    for (int i = 1; i < threads; ++i)
+      decoders.push_back(boost::shared_ptr<Decoder>(new Decoder(argc, argv)));
+    if (!SILENT) cerr << "Decoding with " << threads << " threads\n";
+    vector<Decoder*> ds;
+    for (int i = 0; i < threads; ++i)
+      ds.push_back(decoders[i].get());
+    ParallelDecoding pd(in, threads, numa && Numa::Available());
+    pd.Run(ds);
+  } else {
+    // with --grammar_prefetch the next inputs are read ahead, so their
+    // grammars are read while the current one is decoded
+    const unsigned lookahead = max(0, decoder.GetConf()["grammar_prefetch"].as<int>());
+    deque<string> pending;
+    while (true) {
+      while (pending.size() <= lookahead && *in) {
+        getline(*in, buf);
+        if (buf.empty()) continue;
+        decoder.Prefetch(buf);
+        pending.push_back(buf);
+      }
+      if (pending.empty()) break;
+      decoder.Decode(pending.front());
+      pending.pop_front();
+    }
+    if (Timer::SamplingMemory()) Timer::Summarize();
   }
+  if (Timer::SamplingMemory()) Timer::SummarizeTotals();
 #ifdef CP_TIME
     cerr << "Time required for Cube Pruning execution: "
     << CpTime::Get()
@@ -40,4 +194,3 @@ int main(int argc, char** argv) {
   }
   return 0;
 }
-
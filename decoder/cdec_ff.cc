@@ -18,6 +18,9 @@
 #include "ff_charset.h"
 #include "ff_wordset.h"
 #include "ff_dwarf.h"
+#include "ff_static.h"
+#include "tromble_loss.h"
+#include "lm/model.hh"
 
 #ifdef HAVE_GLC
 #include <cdec/ff_glc.h>
@@ -77,8 +80,19 @@ void register_feature_functions() {
   ff_registry.Register("WordPairFeatures", new FFFactory<WordPairFeatures>);
   ff_registry.Register("WordSet", new FFFactory<WordSet>);
   ff_registry.Register("Dwarf", new FFFactory<Dwarf>);
+  ff_registry.Register("TrombleLossComputer", new FFFactory<TrombleLossComputer>);
 #ifdef HAVE_GLC
   ff_registry.Register("ContextCRF", new FFFactory<Model1Features>);
 #endif
+
+  // common fixed feature sets, scored without virtual calls (see ff_static.h);
+  // the order must match the order of the feature_function lines
+  typedef KLanguageModel<lm::ngram::ProbingModel> KLM;
+  RegisterStaticModelSet<KLM>();
+  RegisterStaticModelSet<KLM, WordPenalty>();
+  RegisterStaticModelSet<WordPenalty, KLM>();
+  RegisterStaticModelSet<KLM, WordPenalty, ArityPenalty>();
+  RegisterStaticModelSet<WordPenalty, ArityPenalty, KLM>();
+  RegisterStaticModelSet<KLM, WordPenalty, ArityPenalty, RuleIdentityFeatures, RuleShapeFeatures>();
 }
 
@@ -0,0 +1,468 @@
+#include <iostream>
+#include <map>
+#include <deque>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <cmath>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "decoder.h"
+#include "ff_register.h"
+#include "fdict.h"
+#include "hg.h"
+#include "kbest.h"
+#include "viterbi.h"
+#include "null_deleter.h"
+#include "sentence_metadata.h"
+#include "sparse_vector.h"
+#include "stringlib.h"
+#include "tdict.h"
+#include "verbose.h"
+
+using namespace std;
+
+// a long running decoder: the models are loaded once, then input lines are
+// read from any number of TCP clients and decoded by --threads workers, each
+// with its own Decoder (built from the same command line, so grammars and
+// language models are shared, as with cdec --threads).
+//
+// protocol: the client sends one input per line, in any format cdec reads.
+// for each nonempty line the server sends back what cdec would have written
+// for it (the 1-best translation, k-best list, alignment, ...) followed by an
+// empty line.  a client may send many lines without waiting (a batch); they
+// are decoded in parallel and answered in the order they were sent.  (as
+// with cdec, --quiet also suppresses the 1-best translations.)
+//
+// per request options are attributes of the <seg> tag around the input:
+//   kbest="N"       the N best translations instead of cdec's usual output
+//   unique="1"      with kbest, drop derivations with a repeated yield
+//   weights="F=v G=w ..."
+//                   rescore the translation forest with these feature
+//                   weights (the others keep the value the final pass
+//                   scored it with) before the output is extracted.  the
+//                   search itself (pruning, cube pruning) still uses the
+//                   server's weights.
+// e.g. <seg id="7" kbest="10" weights="LanguageModel=0.8">das haus</seg>
+//
+// lines starting with @ are commands, answered in order like the inputs:
+//   @reconfigure weights=FILE beam_prune2=N ...
+//                   swaps in new weights (weights, weights2, weights3) and
+//                   pruning settings (beam_prune, density_prune,
+//                   beam_prune2, ...) of the passes the server was started
+//                   with; the models stay loaded.  inputs read (from any
+//                   client) after the command use the new settings, those
+//                   read before it the old ones.  the answer is OK or ERROR.
+
+static double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// counts of latencies in power of 2 millisecond buckets: [0,1) [1,2) [2,4) ...
+struct LatencyHistogram {
+  enum { kBuckets = 24 };
+  LatencyHistogram() : n_(0), total_(0), max_(0), counts_(kBuckets) {}
+
+  void Add(double secs) {
+    const double ms = secs * 1000;
+    int b = 0;
+    for (double hi = 1; b + 1 < kBuckets && ms >= hi; hi *= 2) ++b;
+    ++counts_[b];
+    ++n_;
+    total_ += ms;
+    if (ms > max_) max_ = ms;
+  }
+
+  // upper bound (ms) of the bucket that holds the q quantile
+  double Quantile(double q) const {
+    int seen = 0;
+    for (int b = 0; b < kBuckets; ++b) {
+      seen += counts_[b];
+      if (seen >= q * n_) return UpperBound(b);
+    }
+    return max_;
+  }
+
+  void Print(const string& name, ostream& os) const {
+    if (!n_) return;
+    os << name << ": n=" << n_ << " mean=" << total_ / n_ << "ms p50<" << Quantile(0.5)
+       << "ms p90<" << Quantile(0.9) << "ms p99<" << Quantile(0.99) << "ms max=" << max_ << "ms\n";
+    for (int b = 0; b < kBuckets; ++b)
+      if (counts_[b])
+        os << "  [" << (b ? UpperBound(b - 1) : 0) << ',' << UpperBound(b) << ")ms " << counts_[b] << '\n';
+  }
+
+ private:
+  static double UpperBound(int b) { return double(1 << b); }
+  int n_;
+  double total_;
+  double max_;
+  vector<int> counts_;
+};
+
+// one client; its responses are written in the order the inputs arrived.
+// the socket is closed when the client has hung up and the last of its
+// requests has been answered (i.e. when the last reference goes away)
+struct Connection {
+  explicit Connection(int fd) : fd_(fd), next_out_(0), broken_(false) {}
+  ~Connection() { close(fd_); }
+
+  void WriteOutput(int seq, const string& output) {
+    boost::mutex::scoped_lock l(mutex_);
+    pending_[seq] = output;
+    map<int, string>::iterator it;
+    while ((it = pending_.find(next_out_)) != pending_.end()) {
+      Send(it->second);
+      pending_.erase(it);
+      ++next_out_;
+    }
+  }
+
+  const int fd_;
+
+ private:
+  // a client that went away just doesn't get the rest of its responses
+  void Send(const string& s) {
+    const char* p = s.data();
+    size_t left = s.size();
+    while (left && !broken_) {
+      const ssize_t n = send(fd_, p, left, MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        broken_ = true;
+      } else {
+        p += n;
+        left -= n;
+      }
+    }
+  }
+
+  int next_out_;
+  bool broken_;
+  map<int, string> pending_;
+  boost::mutex mutex_;
+};
+
+struct Request {
+  boost::shared_ptr<Connection> conn;
+  int seq;
+  string input;
+  double arrived;
+  boost::shared_ptr<const DecoderSettings> settings;  // current when it was read
+};
+
+// extracts the per request options from the forest, see the top of the file
+struct RequestObserver : public DecoderObserver {
+  RequestObserver() : kbest(0), unique(false) {}
+
+  virtual void NotifyTranslationForest(const SentenceMetadata& smeta, Hypergraph* hg) {
+    if (!weights.empty()) hg->Reweight(weights);
+    if (kbest) {
+      if (unique)
+        WriteKBest<KBest::FilterUnique>(smeta.GetSentenceID(), *hg);
+      else
+        WriteKBest<KBest::NoFilter<vector<WordID> > >(smeta.GetSentenceID(), *hg);
+    }
+  }
+
+  template <class Filter>
+  void WriteKBest(int sent_id, const Hypergraph& hg) {
+    typedef KBest::KBestDerivations<vector<WordID>, ESentenceTraversal, Filter> K;
+    K kb(hg, kbest);
+    for (int i = 0; i < kbest; ++i) {
+      typename K::Derivation* d = kb.LazyKthBest(hg.nodes_.size() - 1, i);
+      if (!d) break;
+      kbest_out << sent_id << " ||| " << TD::GetString(d->yield) << " ||| ";
+      print(kbest_out, d->feature_values);
+      kbest_out << " ||| " << log(d->score) << '\n';
+    }
+  }
+
+  int kbest;
+  bool unique;
+  vector<double> weights;  // empty: the server's
+  ostringstream kbest_out;
+};
+
+struct DecodingServer {
+  // decoder reads the settings of @reconfigure (it and the workers' decoders
+  // are configured identically)
+  DecodingServer(const Decoder& decoder, int report_every) :
+      decoder_(decoder), settings_(decoder.ReadSettings("", NULL, NULL)),
+      report_every_(report_every), next_id_(0), done_(0) {}
+
+  // called by the connection readers
+  void Push(const Request& r) {
+    boost::mutex::scoped_lock l(queue_mutex_);
+    queue_.push_back(r);
+    queue_cond_.notify_one();
+  }
+
+  void Run(Decoder* decoder) {
+    boost::shared_ptr<const DecoderSettings> applied = Settings();
+    Request r;
+    while (true) {
+      {
+        boost::mutex::scoped_lock l(queue_mutex_);
+        while (queue_.empty()) queue_cond_.wait(l);
+        r = queue_.front();
+        queue_.pop_front();
+      }
+      if (r.settings != applied) {
+        decoder->SetSettings(*r.settings);
+        applied = r.settings;
+      }
+      const double started = Now();
+      r.conn->WriteOutput(r.seq, Decode(decoder, r) + "\n");
+      const double finished = Now();
+      Record(r.arrived, started, finished);
+      r.conn.reset();
+    }
+  }
+
+  // reads lines from a client until it hangs up
+  void Read(boost::shared_ptr<Connection> conn) {
+    int seq = 0;
+    string buf;
+    char chunk[1 << 16];
+    ssize_t n;
+    while ((n = recv(conn->fd_, chunk, sizeof(chunk), 0)) != 0) {
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        break;
+      }
+      buf.append(chunk, n);
+      size_t start = 0, nl;
+      while ((nl = buf.find('\n', start)) != string::npos) {
+        Request r;
+        r.input.assign(buf, start, nl - start);
+        start = nl + 1;
+        if (!r.input.empty() && r.input[r.input.size() - 1] == '\r')
+          r.input.resize(r.input.size() - 1);
+        if (r.input.empty()) continue;
+        if (r.input[0] == '@') {
+          conn->WriteOutput(seq++, Command(r.input) + "\n\n");
+          continue;
+        }
+        r.conn = conn;
+        r.seq = seq++;
+        r.arrived = Now();
+        r.settings = Settings();
+        Push(r);
+      }
+      buf.erase(0, start);
+    }
+  }
+
+ private:
+  boost::shared_ptr<const DecoderSettings> Settings() {
+    boost::mutex::scoped_lock l(settings_mutex_);
+    return settings_;
+  }
+
+  string Command(const string& line) {
+    istringstream is(line);
+    string cmd, arg, config;
+    is >> cmd;
+    if (cmd != "@reconfigure") return "ERROR: unknown command " + cmd;
+    while (is >> arg) config += arg + "\n";
+    string error;
+    boost::mutex::scoped_lock l(settings_mutex_);
+    boost::shared_ptr<const DecoderSettings> s = decoder_.ReadSettings(config, settings_.get(), &error);
+    if (!s) return "ERROR: " + error;
+    settings_ = s;
+    if (!SILENT) cerr << "Reconfigured: " << config;
+    return "OK";
+  }
+
+  string Decode(Decoder* decoder, const Request& r) {
+    RequestObserver o;
+    string error;
+    if (!ParseOptions(r.input, r.settings->final_weights(), &o, &error))
+      return "ERROR: " + error + "\n";
+    ostringstream out;
+    decoder->SetOutput(&out);
+    decoder->SetId(NextId());
+    decoder->Decode(r.input, &o);
+    decoder->SetOutput(NULL);
+    return o.kbest ? o.kbest_out.str() : out.str();
+  }
+
+  // value of attribute name of the <seg> tag input starts with.  the case of
+  // the value is kept (ProcessAndStripSGML lowercases it, but feature names
+  // are case sensitive)
+  static bool SegAttribute(const string& input, const string& name, string* val) {
+    const size_t close = input.find('>');
+    if (close == string::npos) return false;
+    const string tag = LowercaseString(input.substr(0, close));
+    size_t i = 4;  // past "<seg"
+    while (true) {
+      while (i < close && tag[i] == ' ') ++i;
+      const size_t nb = i;
+      while (i < close && tag[i] != ' ' && tag[i] != '=') ++i;
+      const size_t ne = i;
+      while (i < close && tag[i] == ' ') ++i;
+      if (nb == ne || i == close || tag[i] != '=') return false;
+      do { ++i; } while (i < close && tag[i] == ' ');
+      size_t vb = i, ve;
+      if (i < close && tag[i] == '"') {
+        ve = tag.find('"', ++vb);
+        if (ve == string::npos) return false;
+        i = ve + 1;
+      } else {
+        while (i < close && tag[i] != ' ') ++i;
+        ve = i;
+      }
+      if (tag.compare(nb, ne - nb, name) == 0) {
+        *val = input.substr(vb, ve - vb);
+        return true;
+      }
+    }
+  }
+
+  bool ParseOptions(const string& input, const vector<double>& weights, RequestObserver* o, string* error) const {
+    if (LowercaseString(input.substr(0, 4)) != "<seg") return true;
+    string val;
+    if (SegAttribute(input, "kbest", &val)) {
+      o->kbest = atoi(val.c_str());
+      if (o->kbest <= 0) {
+        *error = "bad kbest=\"" + val + "\"";
+        return false;
+      }
+    }
+    if (SegAttribute(input, "unique", &val))
+      o->unique = val != "0";
+    if (SegAttribute(input, "weights", &val)) {
+      o->weights = weights;
+      istringstream is(val);
+      string fv;
+      while (is >> fv) {
+        const size_t eq = fv.find('=');
+        char* end = NULL;
+        const double v = eq == string::npos ? 0 : strtod(fv.c_str() + eq + 1, &end);
+        if (eq == string::npos || eq == 0 || *end) {
+          *error = "bad weight '" + fv + "'";
+          return false;
+        }
+        const int fid = FD::Convert(fv.substr(0, eq));
+        if (!fid) continue;  // dictionary frozen: the forest has no such feature
+        if (fid >= o->weights.size()) o->weights.resize(fid + 1);
+        o->weights[fid] = v;
+      }
+    }
+    return true;
+  }
+
+  int NextId() {
+    boost::mutex::scoped_lock l(stats_mutex_);
+    return next_id_++;
+  }
+
+  void Record(double arrived, double started, double finished) {
+    boost::mutex::scoped_lock l(stats_mutex_);
+    queued_.Add(started - arrived);
+    decoding_.Add(finished - started);
+    total_.Add(finished - arrived);
+    if (report_every_ > 0 && ++done_ % report_every_ == 0) {
+      ostringstream os;
+      os << "Latency after " << done_ << " requests\n";
+      queued_.Print("queued", os);
+      decoding_.Print("decoding", os);
+      total_.Print("total", os);
+      cerr << os.str() << flush;
+    }
+  }
+
+  const Decoder& decoder_;
+  boost::shared_ptr<const DecoderSettings> settings_;
+  boost::mutex settings_mutex_;
+  const int report_every_;
+  deque<Request> queue_;
+  boost::mutex queue_mutex_;
+  boost::condition_variable queue_cond_;
+  int next_id_;
+  int done_;
+  LatencyHistogram queued_, decoding_, total_;
+  boost::mutex stats_mutex_;
+};
+
+static void Usage(const char* prog) {
+  cerr << "Usage: " << prog << " --port N [--report_every N] [cdec options]\n"
+       << "  Decodes lines sent to TCP port N with --threads workers.  The latency\n"
+       << "  histograms are written to STDERR every --report_every (default 1000)\n"
+       << "  requests.\n";
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  // the server's own options are taken out; the rest go to the decoders
+  int port = 0;
+  int report_every = 1000;
+  vector<char*> dargv(1, argv[0]);
+  for (int i = 1; i < argc; ++i) {
+    const string a = argv[i];
+    if ((a == "--port" || a == "--report_every") && i + 1 < argc)
+      (a == "--port" ? port : report_every) = atoi(argv[++i]);
+    else if (a == "--help" || a == "-h")
+      Usage(argv[0]);
+    else
+      dargv.push_back(argv[i]);
+  }
+  if (port <= 0) Usage(argv[0]);
+  const int dargc = dargv.size();
+  dargv.push_back(NULL);
+
+  register_feature_functions();
+  Decoder decoder(dargc, &dargv[0]);
+  const int threads = max(1, decoder.GetConf()["threads"].as<int>());
+  vector<boost::shared_ptr<Decoder> > decoders(1, boost::shared_ptr<Decoder>(&decoder, null_deleter()));
+  for (int i = 1; i < threads; ++i)
+    decoders.push_back(boost::shared_ptr<Decoder>(new Decoder(dargc, &dargv[0])));
+
+  signal(SIGPIPE, SIG_IGN);
+  const int s = socket(AF_INET, SOCK_STREAM, 0);
+  if (s < 0) { perror("socket"); return 1; }
+  int one = 1;
+  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_ANY);
+  sin.sin_port = htons(port);
+  if (bind(s, (struct sockaddr*)&sin, sizeof(sin)) < 0) { perror("bind"); return 1; }
+  if (listen(s, SOMAXCONN) < 0) { perror("listen"); return 1; }
+
+  DecodingServer server(decoder, report_every);
+  boost::thread_group workers;
+  for (int i = 0; i < threads; ++i)
+    workers.create_thread(boost::bind(&DecodingServer::Run, &server, decoders[i].get()));
+  if (!SILENT) cerr << "Listening on port " << port << " with " << threads << " decoding threads\n";
+
+  while (true) {
+    const int c = accept(s, NULL, NULL);
+    if (c < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      perror("accept");
+      return 1;
+    }
+    // the reader thread runs on its own; the connection lives as long as
+    // it or an unanswered request refers to it
+    boost::thread(boost::bind(&DecodingServer::Read, &server, boost::shared_ptr<Connection>(new Connection(c))));
+  }
+  return 0;
+}
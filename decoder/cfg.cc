@@ -8,11 +8,11 @@
 #include "fast_lexical_cast.hpp"
 //#include "indices_after.h"
 #include "show.h"
-#include "null_traits.h"
+#include "cfg_rhs_arena.h"
 
-#define DUNIQ(x) x
+#define DUNIQ(x)
 #define DBIN(x)
-#define DSP(x) x
+#define DSP(x)
 //SP:binarize by splitting.
 #define DCFG(x) IF_CFG_DEBUG(x)
 
@@ -168,122 +168,45 @@ void CFG::SortLocalBestFirst(NTHandle ni) {
 /////binarization:
 namespace {
 
-BinRhs null_bin_rhs(std::numeric_limits<int>::min(),std::numeric_limits<int>::min());
+typedef WordID const* WP;
 
 // index i >= N.size()?  then it's in M[i-N.size()]
-//WordID first,WordID second,
-string BinStr(BinRhs const& b,CFG::NTs const& N,CFG::NTs const& M)
+string BinStr(WP b,WP e,CFG::NTs const& N,CFG::NTs const& M)
 {
   int nn=N.size();
   ostringstream o;
-#undef BinNameOWORD
-#define BinNameOWORD(w)                                 \
-  do {                                                  \
-    int n=w; if (n>0) o << TD::Convert(n);              \
-    else {                                              \
-      int i=-n;                                         \
-      if (i<nn) o<<N[i].from<<i; else o<<M[i-nn].from;  \
-    }                                                   \
-  } while(0)
-
-  BinNameOWORD(b.first);
-  o<<'+';
-  BinNameOWORD(b.second);
-  return o.str();
-}
-
-string BinStr(RHS const& r,CFG::NTs const& N,CFG::NTs const& M)
-{
-  int nn=N.size();
-  ostringstream o;
-  for (int i=0,e=r.size();i!=e;++i) {
-    if (i)
+  for (WP i=b;i!=e;++i) {
+    if (i!=b)
       o<<'+';
-    BinNameOWORD(r[i]);
+    int n=*i;
+    if (n>0) o << TD::Convert(n);
+    else {
+      int j=-n;
+      if (j<nn) o<<N[j].from<<j; else o<<M[j-nn].from;
+    }
   }
   return o.str();
 }
 
-
-WordID BinName(BinRhs const& b,CFG::NTs const& N,CFG::NTs const& M)
+WordID BinName(WP b,WP e,CFG::NTs const& N,CFG::NTs const& M)
 {
-  return TD::Convert(BinStr(b,N,M));
+  return TD::Convert(BinStr(b,e,N,M));
 }
 
-WordID BinName(RHS const& b,CFG::NTs const& N,CFG::NTs const& M)
-{
-  return TD::Convert(BinStr(b,N,M));
-}
-
-/*
-template <class Rhs>
-struct null_for;
-
-
-template <>
-struct null_for<BinRhs> {
-  static BinRhs null;
-};
-
-template <>
-struct null_for<RHS> {
-  static RHS null;
-};
-*/
-
-template <>
-BinRhs null_traits<BinRhs>::null(std::numeric_limits<int>::min(),std::numeric_limits<int>::min());
-
-template <>
-RHS null_traits<RHS>::null(1,std::numeric_limits<int>::min());
-
-template <class Rhs>
+// every virtual NT has exactly one rule, whose rhs is hash consed in the arena (entry k of the arena is virtual NT -arena.value(k)).  new NTs and rules are appended at the end (on destruction), so we don't have to worry about iterator invalidation of the originals
 struct add_virtual_rules {
   typedef CFG::RuleHandle RuleHandle;
   typedef CFG::NTHandle NTHandle;
+  typedef CFGRhsArena::Entry Entry;
   CFG::NTs &nts,new_nts;
   CFG::Rules &rules, new_rules;
-// above will be appended at the end, so we don't have to worry about iterator invalidation
-  WordID newnt; //negative of NTHandle, or positive => unary lexical item (not to binarize).  fit for rhs of a rule
+  WordID newnt; //negative of NTHandle of the next virtual NT.  fit for rhs of a rule
   RuleHandle newruleid;
-  typedef HASH_MAP<Rhs,WordID,boost::hash<Rhs> > R2L;
-  R2L rhs2lhs; // an rhs maps to this -virtntid, or original id if length 1
+  CFGRhsArena &arena;
   bool name_nts;
-  add_virtual_rules(CFG &cfg,bool name_nts=false) : nts(cfg.nts),rules(cfg.rules),newnt(-nts.size()),newruleid(rules.size()),name_nts(name_nts) {
-    HASH_MAP_EMPTY(rhs2lhs,null_traits<Rhs>::null);
-  }
-  NTHandle get_virt(Rhs const& r) {
-    NTHandle nt=get_default(rhs2lhs,r,newnt);
-    SHOW(DBIN,newnt) SHOWP(DBIN,"bin="<<BinStr(r,nts,new_nts)<<"=>") SHOW(DBIN,nt);
-    if (newnt==nt) {
-      create(r);
-    }
-    return nt;
-  }
-  inline void set_nt_name(Rhs const& r) {
-    if (name_nts)
-      new_nts.back().from.nt=BinName(r,nts,new_nts);
-  }
-  inline void create_nt(Rhs const& rhs) {
-    new_nts.push_back(CFG::NT(newruleid++));
-    set_nt_name(rhs);
-  }
-  inline void create_rule(Rhs const& rhs) {
-    new_rules.push_back(CFG::Rule(-newnt,rhs));
-    --newnt;
-  }
-  inline void create_adding(Rhs const& rhs) {
-    NTHandle nt=get_default(rhs2lhs,rhs,newnt);
-    assert(nt==newnt);
-    create(rhs);
+  add_virtual_rules(CFG &cfg,CFGRhsArena &arena,bool name_nts=false) : nts(cfg.nts),rules(cfg.rules),newnt(-nts.size()),newruleid(rules.size()),arena(arena),name_nts(name_nts) {
+    arena.Clear();
   }
-  inline void create(Rhs const& rhs) {
-    SHOWP(DSP,"Create ") SHOW3(DSP,newnt,newruleid,BinStr(rhs,nts,new_nts))
-    create_nt(rhs);
-    create_rule(rhs);
-    assert(newruleid==rules.size()+new_rules.size());assert(-newnt==nts.size()+new_nts.size());
-  }
-
   ~add_virtual_rules() {
     append_rules();
   }
@@ -292,27 +215,53 @@ struct add_virtual_rules {
     batched_append_swap(nts,new_nts);
     batched_append_swap(rules,new_rules);
   }
-  inline bool have(Rhs const& rhs,NTHandle &h) const {
-    if (rhs.size()==1) {     // stop creating virtual unary rules.
-      h=rhs[0];
-      return true;
+  inline std::string Str(WP b,WP e) const {
+    return BinStr(b,e,nts,new_nts);
+  }
+
+  // the NT (as rhs word) rewriting as [b,e), creating it if new
+  WordID get_virt(WP b,WP e) {
+    bool added;
+    Entry k=arena.FindOrAdd(b,e,newnt,added);
+    if (added) {
+      --newnt;
+      create(k);
     }
-    typename R2L::const_iterator i=rhs2lhs.find(rhs);
-    if (i==rhs2lhs.end())
-      return false;
-    h=i->second;
-    return true;
+    WordID nt=arena.value(k);
+    SHOWP(DBIN,"bin="<<Str(b,e)<<"=>") SHOW(DBIN,nt);
+    return nt;
   }
-  //HACK: prevent this for instantiating for BinRhs.  we need to use rule index because we'll be adding rules before we can update.
-  // returns 1 per replaced NT (0,1, or 2)
-  inline std::string Str(Rhs const& rhs) const {
-    return BinStr(rhs,nts,new_nts);
+  WordID get_virt(BinRhs const& bin) {
+    WordID r[2]={bin.first,bin.second};
+    return get_virt(r,r+2);
+  }
+  // reserves the next virtual NT for [b,e) (which must be new) without touching the rules, so pointers into a rule's rhs stay valid.  call create() with the result once you're done modifying that rhs
+  inline Entry intern(WP b,WP e) {
+    Entry k=arena.Add(b,e,newnt);
+    --newnt;
+    return k;
+  }
+  inline void create(Entry k) {
+    WordID nt=arena.value(k);
+    WP b=arena.begin(k),e=arena.end(k);
+    SHOWP(DSP,"Create ") SHOW3(DSP,nt,newruleid,Str(b,e))
+    assert(-nt==nts.size()+new_nts.size());
+    new_nts.push_back(CFG::NT(newruleid++));
+    if (name_nts)
+      new_nts.back().from.nt=BinName(b,e,nts,new_nts);
+    new_rules.push_back(CFG::Rule(-nt,RHS(b,e)));
+    assert(newruleid==rules.size()+new_rules.size());
+  }
+  inline bool have(WP b,WP e,WordID &h) const {
+    if (e-b==1) {     // stop creating virtual unary rules.
+      h=*b;
+      return true;
+    }
+    return arena.Find(b,e,h);
   }
 
-  template <class RHSi>
-  int split_rhs(RHSi &rhs,bool only_free=false,bool only_reusing_1=false) {
-    typedef WordID const* WP;
-    //TODO: don't actually build substrings of rhs; define key type that stores ref to rhs in new_nts by index (because it may grow), and also allows an int* [b,e) range to serve as key (i.e. don't insert the latter type of key).
+  // returns 1 per replaced NT (0,1, or 2)
+  int split_rhs(RHS &rhs,bool only_free=false,bool only_reusing_1=false) {
     int n=rhs.size();
     if (n<=2) return 0;
     int longest1=1; // all this other stuff is not uninitialized when used, based on checking this and other things (it's complicated, learn to prove theorems, gcc)
@@ -320,22 +269,19 @@ struct add_virtual_rules {
     int best_k;
     enum {HAVE_L=-1,HAVE_NONE=0,HAVE_R=1};
     int have1=HAVE_NONE; // will mean we already have some >1 length prefix or suffix as a virt. (it's free).  if we have both we use it immediately and return.
-    NTHandle ntr,ntl;
-    NTHandle bestntr,bestntl;
+    WordID ntr,ntl;
+    WordID bestntr,bestntl;
     WP b=&rhs.front(),e=b+n;
     WP wk=b;
-    SHOWM3(DSP,"Split",Str(rhs),only_free,only_reusing_1);
+    SHOWM3(DSP,"Split",Str(b,e),only_free,only_reusing_1);
     int rlen=n;
     for (int k=1;k<n-1;++k) {
-      //TODO: handle length 1 l and r parts without explicitly building Rhs?
       ++wk; assert(k==wk-b);
       --rlen; assert(rlen==n-k);
-      Rhs l(b,wk);
-      if (have(l,ntl)) {
-        if (k>1) { SHOWM3(DSP,"Have l",k,n,Str(l)) }
-        Rhs r(wk,e);
-        if (have(r,ntr)) {
-          SHOWM3(DSP,"Have r too",k,n,Str(r))
+      if (have(b,wk,ntl)) {
+        if (k>1) { SHOWM3(DSP,"Have l",k,n,Str(b,wk)) }
+        if (have(wk,e,ntr)) {
+          SHOWM3(DSP,"Have r too",k,n,Str(wk,e))
           rhs.resize(2);
           rhs[0]=ntl;
           rhs[1]=ntr;
@@ -347,17 +293,14 @@ struct add_virtual_rules {
           best_k=k;
         }
       } else if (rlen>longest1) { // > or >= favors l or r branching, maybe.  who cares.
-        Rhs r(wk,e);
-        if (have(r,ntr)) {
+        if (have(wk,e,ntr)) {
           longest1=rlen;
-          if (rlen>1) { SHOWM3(DSP,"Have r (only) ",k,n,Str(r)) }
+          if (rlen>1) { SHOWM3(DSP,"Have r (only) ",k,n,Str(wk,e)) }
           have1=HAVE_R;
           bestntr=ntr;
           best_k=k;
         }
       }
-      //TODO: swap order of consideration (l first or r?) depending on pre/post midpoint?  one will be useless to check for beating the longest single match so far.  check that second
-
     }
     // now we know how we're going to split the rule; what follows is just doing the actual splitting:
 
@@ -374,67 +317,52 @@ struct add_virtual_rules {
       }
       return 1;
     }
-    /* now we have to add some new virtual rules.
-       some awkward constraints:
-
-       1. can't resize rhs until you save copy of l or r split portion
-
-       2. can't create new rule until you finished modifying rhs (this is why we store newnt then create).  due to vector push_back invalidation.  perhaps we could bypass this by reserving sufficient space first before a splitting pass (# rules and nts created is <= 2 * # of rules being passed over)
-
+    /* now we have to add some new virtual rules.  intern the pieces (copying them into the arena) before resizing rhs, and create the rules only after we're done with rhs, since it may be in new_rules, which create() appends to.
     */
     if (have1==HAVE_NONE) { // default: split down middle.
       DSP(assert(longest1==1));
       WP m=b+mid;
-      if (n%2==0) {
-        WP i=b;
-        WP j=m;
-        for (;i!=m;++i,++j)
-          if (*i!=*j) goto notleqr;
-        // [...mid]==[mid...]!
-        RHS l(b,m); // 1. // this is equal to RHS(m,e).
+      if (n%2==0 && std::equal(b,m,m)) { // [...mid]==[mid...]!
+        Entry l=intern(b,m);
         rhs.resize(2);
-        rhs[0]=rhs[1]=newnt; //2.
-        create_adding(l);
+        rhs[0]=rhs[1]=arena.value(l);
+        create(l);
         return 1; // only had to create 1 total when splitting down middle when l==r
       }
-    notleqr:
       if (only_reusing_1) return 0;
-      best_k=mid; // rounds down
       if (mid==1) {
-        RHS r(m,e); //1.
+        Entry r=intern(m,e);
         rhs.resize(2);
-        rhs[1]=newnt; //2.
-        create_adding(r);
+        rhs[1]=arena.value(r);
+        create(r);
         return 1;
       } else {
-        Rhs l(b,m);
-        Rhs r(m,e); // 1.
+        Entry l=intern(b,m);
+        Entry r=intern(m,e);
         rhs.resize(2);
-        rhs[0]=newnt;
-        rhs[1]=newnt-1; // 2.
-        create_adding(l);
-        create_adding(r);
+        rhs[0]=arena.value(l);
+        rhs[1]=arena.value(r);
+        create(l);
+        create(r);
         return 2;
       }
     }
     WP best_wk=b+best_k;
-    //we build these first because adding rules may invalidate the underlying pointers (we end up binarizing already split virt rules)!.
-    //wow, that decision (not to use index into new_nts instead of pointer to rhs), while adding new nts to it really added some pain.
     if (have1==HAVE_L) {
-      Rhs r(best_wk,e); //1.
+      DSP(assert(best_wk<e-1)); // because we would have returned having both if rhs was singleton
+      Entry r=intern(best_wk,e);
       rhs.resize(2);
       rhs[0]=bestntl;
-      DSP(assert(best_wk<e-1)); // because we would have returned having both if rhs was singleton
-      rhs[1]=newnt; //2.
-      create_adding(r);
+      rhs[1]=arena.value(r);
+      create(r);
     } else {
       DSP(assert(have1==HAVE_R));
       DSP(assert(best_wk>b+1)); // because we would have returned having both if lhs was singleton
-      Rhs l(b,best_wk); //1.
+      Entry l=intern(b,best_wk);
       rhs.resize(2);
-      rhs[0]=newnt; //2.
+      rhs[0]=arena.value(l);
       rhs[1]=bestntr;
-      create_adding(l);
+      create(l);
     }
     return 1;
   }
@@ -442,8 +370,9 @@ struct add_virtual_rules {
 
 }//ns
 
-void CFG::BinarizeSplit(CFGBinarize const& b) {
-  add_virtual_rules<RHS> v(*this,b.bin_name_nts);
+void CFG::BinarizeSplit(CFGBinarize const& b,CFGRhsArena *reuse) {
+  CFGRhsArena local;
+  add_virtual_rules v(*this,reuse?*reuse:local,b.bin_name_nts);
   CFG_FOR_RULES(i,v.split_rhs(rules[i].rhs,false,false));
   Rules &newr=v.new_rules;
 #undef CFG_FOR_VIRT
@@ -468,90 +397,50 @@ void CFG::BinarizeSplit(CFGBinarize const& b) {
 
 }
 
-void CFG::Binarize(CFGBinarize const& b) {
+void CFG::Binarize(CFGBinarize const& b,CFGRhsArena *reuse) {
   if (!b.Binarizing()) return;
   cerr << "Binarizing "<<b<<endl;
   if (b.bin_thresh>0)
     BinarizeThresh(b);
   if (b.bin_split)
-    BinarizeSplit(b);
+    BinarizeSplit(b,reuse);
   if (b.bin_l2r)
-    BinarizeL2R(false,b.bin_name_nts);
+    BinarizeL2R(false,b.bin_name_nts,reuse);
   if (b.bin_topo) //TODO: more efficient (at least for l2r) maintenance of order?
     OrderNTsTopo();
 
 }
 
-namespace {
-}
-
 void CFG::BinarizeThresh(CFGBinarize const& b) {
   throw runtime_error("TODO: some fancy linked list thing - see NOTES.partial.binarize");
 }
 
 
-void CFG::BinarizeL2R(bool bin_unary,bool name) {
-  add_virtual_rules<BinRhs> v(*this,name);
-cerr << "Binarizing left->right " << (bin_unary?"real to unary":"stop at binary") <<endl;
-  HASH_MAP<BinRhs,NTHandle,boost::hash<BinRhs> > bin2lhs; // we're going to hash cons rather than build an explicit trie from right to left.
-  HASH_MAP_EMPTY(bin2lhs,null_bin_rhs);
-  // iterate using indices and not iterators because we'll be adding to both nts and rules list?  we could instead pessimistically reserve space for both, but this is simpler.  also: store original end of nts since we won't need to reprocess newly added ones.
+// we hash cons the binary rhs (pairs) rather than build an explicit trie from right to left, so rules share their common suffixes.
+void CFG::BinarizeL2R(bool bin_unary,bool name,CFGRhsArena *reuse) {
+  CFGRhsArena local;
+  add_virtual_rules v(*this,reuse?*reuse:local,name);
+  cerr << "Binarizing left->right " << (bin_unary?"real to unary":"stop at binary") <<endl;
   int rhsmin=bin_unary?0:1;
-  //NTs new_nts;
-  //Rules new_rules;
-  //TODO: this could be factored easily into in-place (append to new_* like below) and functional (nondestructive copy) versions (copy orig to target and append to target)
-//  int newnt=nts.size(); // we're going to store binary rhs with -nt to keep distinct from words (>=0)
-//  int newruleid=rules.size();
   BinRhs bin;
+  // new rules go to v.new_rules, so only the original ones are visited.  they're always binarized in place
   CFG_FOR_RULES(ruleid,
-/*  for (NTs::const_iterator n=nts.begin(),nn=nts.end();n!=nn;++n) {
-    NT const& nt=*n;
-    for (Ruleids::const_iterator ir=nt.ruleids.begin(),er=nt.ruleids.end();ir!=er;++ir) {
-    RuleHandle ruleid=*ir;*/
-//      SHOW2(DBIN,ruleid,ShowRule(ruleid));
-                Rule & rule=rules[ruleid];
-      RHS &rhs=rule.rhs; // we're going to binarize this while adding newly created rules to new_...
+      RHS &rhs=rules[ruleid].rhs;
       if (rhs.empty()) continue;
       int r=rhs.size()-2; // loop below: [r,r+1) is to be reduced into a (maybe new) binary NT
       if (rhsmin<=r) { // means r>=0 also
         bin.second=rhs[r+1];
-        int bin_to; // the replacement for bin
-//        assert(newruleid==rules.size()+new_rules.size());assert(newnt==nts.size()+new_nts.size());
-        // also true at start/end of loop:
         for (;;) { // pairs from right to left (normally we leave the last pair alone)
           bin.first=rhs[r];
-          bin_to=v.get_virt(bin);
-/*          bin_to=get_default(bin2lhs,bin,v.newnt);
-//          SHOW(DBIN,r) SHOW(DBIN,newnt) SHOWP(DBIN,"bin="<<BinStr(bin,nts,new_nts)<<"=>") SHOW(DBIN,bin_to);
-          if (v.newnt==bin_to) { // it's new!
-            new_nts.push_back(NT(newruleid++));
-            //now newnt is the index of the last (after new_nts is appended) nt.  bin is its rhs.  bin_to is its lhs
-            new_rules.push_back(Rule(newnt,bin));
-            ++newnt;
-            if (name) new_nts.back().from.nt=BinName(bin,nts,new_nts);
-          }
-*/
-          bin.second=bin_to;
+          bin.second=v.get_virt(bin);
           --r;
           if (r<rhsmin) {
-            rhs[rhsmin]=bin_to;
+            rhs[rhsmin]=bin.second;
             rhs.resize(rhsmin+1);
             break;
           }
         }
       })
-                /*
-    }
-  }
-                */
-#if 0
-  // marginally more efficient
-  batched_append_swap(nts,new_nts);
-  batched_append_swap(rules,new_rules);
-//#else
-  batched_append(nts,new_nts);
-  batched_append(rules,new_rules);
-#endif
 }
 
 namespace {
@@ -572,7 +461,7 @@ void CFG::Init(Hypergraph const& hg,bool target_side,bool copy_features,bool pus
   goal_nt=nn-1;
   rules.resize(ne);
   for (int i=0;i<nn;++i) {
-    nts[i].ruleids=hg.nodes_[i].in_edges_;
+    nts[i].ruleids.assign(hg.nodes_[i].in_edges_.begin(),hg.nodes_[i].in_edges_.end());
     hg.SetNodeOrigin(i,nts[i].from);
   }
   for (int i=0;i<ne;++i) {
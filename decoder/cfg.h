@@ -51,6 +51,7 @@
 class Hypergraph;
 class CFGFormat; // #include "cfg_format.h"
 class CFGBinarize; // #include "cfg_binarize.h"
+struct CFGRhsArena; // #include "cfg_rhs_arena.h"
 
 #undef CFG_MUST_EQ
 #define CFG_MUST_EQ(f) if (!(o.f==f)) return false;
@@ -348,9 +349,10 @@ struct CFG {
     ReorderNTs(o);
   }
 
-  void BinarizeL2R(bool bin_unary=false,bool name_nts=false);
-  void Binarize(CFGBinarize const& binarize_options); // see cfg_binarize.h for docs
-  void BinarizeSplit(CFGBinarize const& binarize_options);
+  // reuse: keep the binarizer's hash-consed rhs (see cfg_rhs_arena.h) in this arena, which may be passed again for the next sentence to reuse its memory
+  void BinarizeL2R(bool bin_unary=false,bool name_nts=false,CFGRhsArena *reuse=0);
+  void Binarize(CFGBinarize const& binarize_options,CFGRhsArena *reuse=0); // see cfg_binarize.h for docs
+  void BinarizeSplit(CFGBinarize const& binarize_options,CFGRhsArena *reuse=0);
   void BinarizeThresh(CFGBinarize const& binarize_options); // maybe unbundle opts later
 
   typedef std::vector<NT> NTs;
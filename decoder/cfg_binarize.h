@@ -20,6 +20,7 @@ struct CFGBinarize {
   bool bin_name_nts;
   bool bin_topo;
   bool bin_split;
+  bool bin_reuse;
   int split_passes,split_share1_passes,split_free_passes;
   template <class Opts> // template to support both printable_opts and boost nonprintable
   void AddOptions(Opts *opts) {
@@ -33,6 +34,7 @@ struct CFGBinarize {
       ("cfg_binarize_l2r", defaulted_value(&bin_l2r),"force left to right (a (b (c d))) binarization (ignore _at threshold)")
       ("cfg_binarize_name_nts", defaulted_value(&bin_name_nts),"create named virtual NT tokens e.g. 'A12+the' when binarizing 'B->[A12] the cat'")
       ("cfg_binarize_topo", defaulted_value(&bin_topo),"reorder nonterminals after binarization to maintain definition before use (topological order).  otherwise the virtual NTs will all appear after the regular NTs")
+      ("cfg_binarize_reuse", defaulted_value(&bin_reuse),"keep the binarizer's hash-consed rhs tables (cleared, not freed) from one sentence to the next.  the virtual NTs themselves can't be shared, since they rewrite as forest nodes")
     ;
   }
   void Validate() {
@@ -52,6 +54,7 @@ struct CFGBinarize {
   }
   void set_defaults() {
     bin_split=false;
+    bin_reuse=true;
     bin_topo=false;
     bin_thresh=0;
     bin_unary=0;
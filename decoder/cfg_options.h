@@ -5,6 +5,7 @@
 #include "hg_cfg.h"
 #include "cfg_format.h"
 #include "cfg_binarize.h"
+#include "cfg_rhs_arena.h"
 //#include "program_options.h"
 
 struct CFGOptions {
@@ -12,6 +13,7 @@ struct CFGOptions {
   CFGBinarize binarize;
   std::string out,source_out,unbin_out;
   bool uniq;
+  CFGRhsArena bin_arena; // kept between sentences if binarize.bin_reuse
   void set_defaults() {
     format.set_defaults();
     binarize.set_defaults();
@@ -70,7 +72,7 @@ struct CFGOptions {
   }
   void maybe_binarize(HgCFG &hgcfg) {
     if (hgcfg.binarized) return;
-    hgcfg.GetCFG().Binarize(binarize);
+    hgcfg.GetCFG().Binarize(binarize,binarize.bin_reuse?&bin_arena:0);
     hgcfg.binarized=true;
   }
 };
@@ -0,0 +1,115 @@
+#ifndef CFG_RHS_ARENA_H
+#define CFG_RHS_ARENA_H
+
+/* hash-consed CFG rhs strings (words >0, -NT handles <=0) for binarization, stored end to end in a single vector.  lookups hash a [b,e) range in place, so a binarizer can probe every split point of a rule without building the two pieces.  each entry carries a value (the virtual NT whose rule rewrites as that rhs).
+
+   Clear() keeps the memory, so an arena passed to CFG::Binarize for every sentence (see --cfg_binarize_reuse) stops allocating once it has grown to the largest sentence.
+*/
+
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+#include <boost/functional/hash.hpp>
+#include "hash.h"
+#include "wordid.h"
+
+struct CFGRhsArena {
+  typedef WordID const* WP;
+  typedef int Entry;
+
+  CFGRhsArena() {
+    HASH_MAP_EMPTY(first_,EMPTY_HASH);
+    HASH_MAP_EMPTY(pairs_,Pair(EMPTY_HASH,EMPTY_HASH));
+  }
+  void Clear() {
+    words_.clear();
+    start_.clear();
+    next_.clear();
+    value_.clear();
+    first_.clear();
+    pairs_.clear();
+  }
+  int size() const { return value_.size(); }
+
+  // the entry for [b,e), or -1
+  Entry Find(WP b,WP e) const {
+    if (e-b==2) {
+      Pairs::const_iterator i=pairs_.find(Pair(b[0],b[1]));
+      return i==pairs_.end() ? -1 : i->second;
+    }
+    Index::const_iterator i=first_.find(Hash(b,e));
+    if (i==first_.end()) return -1;
+    for (Entry k=i->second;k>=0;k=next_[k])
+      if (Equal(k,b,e)) return k;
+    return -1;
+  }
+  bool Find(WP b,WP e,WordID &v) const {
+    Entry k=Find(b,e);
+    if (k<0) return false;
+    v=value_[k];
+    return true;
+  }
+  // pre: Find(b,e)<0.  [b,e) is copied, so it may be anything but this arena's own words
+  Entry Add(WP b,WP e,WordID v) {
+    if (e-b==2)
+      return Push(b,e,v,-1,pairs_[Pair(b[0],b[1])]);
+    std::pair<Index::iterator,bool> i=first_.insert(Index::value_type(Hash(b,e),value_.size()));
+    return Push(b,e,v,i.second ? -1 : i.first->second,i.first->second);
+  }
+  // the entry for [b,e), adding it with value v if it's new (then added=true).  one hash lookup either way
+  Entry FindOrAdd(WP b,WP e,WordID v,bool &added) {
+    if (e-b==2) {
+      std::pair<Pairs::iterator,bool> i=pairs_.insert(Pairs::value_type(Pair(b[0],b[1]),value_.size()));
+      added=i.second;
+      return added ? Push(b,e,v,-1,i.first->second) : i.first->second;
+    }
+    std::pair<Index::iterator,bool> i=first_.insert(Index::value_type(Hash(b,e),value_.size()));
+    added=true;
+    if (i.second)
+      return Push(b,e,v,-1,i.first->second);
+    for (Entry k=i.first->second;k>=0;k=next_[k])
+      if (Equal(k,b,e)) {
+        added=false;
+        return k;
+      }
+    return Push(b,e,v,i.first->second,i.first->second);
+  }
+
+  WordID value(Entry k) const { return value_[k]; }
+  // valid until the next Add
+  WP begin(Entry k) const { return &words_[start_[k]]; }
+  WP end(Entry k) const { return &words_[0]+(k+1<size()?start_[k+1]:words_.size()); }
+  int length(Entry k) const { return end(k)-begin(k); }
+
+private:
+  enum { EMPTY_HASH=-1 };
+  static std::size_t Hash(WP b,WP e) {
+    std::size_t h=boost::hash_range(b,e);
+    return h==(std::size_t)EMPTY_HASH ? h-1 : h;
+  }
+  // appends entry [b,e) to the chain of entries with its hash, whose head is first (which is set to it)
+  Entry Push(WP b,WP e,WordID v,Entry next,Entry &first) {
+    Entry k=value_.size();
+    first=k;
+    next_.push_back(next);
+    start_.push_back(words_.size());
+    words_.insert(words_.end(),b,e);
+    value_.push_back(v);
+    return k;
+  }
+  bool Equal(Entry k,WP b,WP e) const {
+    WP kb=begin(k),ke=end(k);
+    return ke-kb==e-b && std::equal(b,e,kb);
+  }
+  typedef HASH_MAP<std::size_t,Entry,boost::hash<std::size_t> > Index; // hash -> most recent entry with that hash; older ones via next_
+  typedef std::pair<WordID,WordID> Pair;
+  typedef HASH_MAP<Pair,Entry,boost::hash<Pair> > Pairs; // length 2 rhs (all of them, for l2r) are compared in the table, not in words_
+  std::vector<WordID> words_;
+  std::vector<int> start_; // of entry k in words_
+  std::vector<Entry> next_; // same hash, or -1
+  std::vector<WordID> value_;
+  Index first_;
+  Pairs pairs_;
+};
+
+#endif
@@ -3,6 +3,7 @@
 #include "cfg.h"
 #include "hg_test.h"
 #include "cfg_options.h"
+#include "cfg_rhs_arena.h"
 #include "show.h"
 
 /* TODO: easiest way to get meaningful confirmations that things work: implement conversion back to hg, and compare viterbi/inside etc. stats for equality to original hg.  or you can define CSHOW_V and see lots of output */
@@ -84,6 +85,26 @@ TEST_P(CFGTest,Binarize) {
   }
 }
 
+TEST_P(CFGTest,BinarizeReusingArena) {
+  CFGRhsArena arena;
+  for (int split=0;split<2;++split) {
+    CFGBinarize b;
+    b.bin_l2r=!split;
+    b.bin_split=split;
+    CFG fresh=cfg;
+    fresh.Binarize(b);
+    for (int again=0;again<2;++again) { // the second time, the arena still has the first's tables
+      CFG reused=cfg;
+      reused.Binarize(b,&arena);
+      EXPECT_EQ(fresh,reused);
+    }
+    for (int i=0,e=fresh.rules.size();i<e;++i)
+      if (!fresh.rules[i].is_null()) {
+        EXPECT_GE(2,fresh.rules[i].rhs.size());
+      }
+  }
+}
+
 INSTANTIATE_TEST_CASE_P(HypergraphsWeights,CFGTest,
                         Values(
                           HgW(perro_json,perro_wts)
@@ -0,0 +1,42 @@
+#include <iostream>
+#include <string>
+
+#include <boost/program_options.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+#include "binary_grammar.h"
+#include "filelib.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
+  po::options_description opts("Configuration options");
+  opts.add_options()
+        ("grammar,g", po::value<string>(), "[REQD] Text SCFG to compile (may be gzipped)")
+        ("output,o", po::value<string>(), "[REQD] Write the binary grammar to this file")
+        ("phrasetable,p", "The input is a phrase table (for the FST and phrase-based translators)")
+        ("help,h", "Help");
+  po::options_description dcmdline_options;
+  dcmdline_options.add(opts);
+  po::store(parse_command_line(argc, argv, dcmdline_options), *conf);
+  if (conf->count("help") || !conf->count("grammar") || !conf->count("output")) {
+    cerr << "Usage: " << argv[0] << " -g grammar.scfg[.gz] -o grammar.bin\n\n"
+         << "Compiles a text SCFG or phrase table into the binary format that cdec\n"
+         << "memory maps (--grammar accepts either format).\n" << dcmdline_options << endl;
+    exit(1);
+  }
+}
+
+int main(int argc, char** argv) {
+  po::variables_map conf;
+  InitCommandLine(argc, argv, &conf);
+  const string output = conf["output"].as<string>();
+  ReadFile rf(conf["grammar"].as<string>());
+  cerr << "Compiling " << conf["grammar"].as<string>() << " to " << output << endl;
+  const bool ok = conf.count("phrasetable") ? CompileBinaryPhrasetable(rf.stream(), output)
+                                            : CompileBinaryGrammar(rf.stream(), output);
+  if (!ok) return 1;
+  cerr << "\nWrote " << output << endl;
+  return 0;
+}
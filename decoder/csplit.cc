@@ -24,22 +24,6 @@ struct CompoundSplitImpl {
     // TODO: use conf to turn fugenelements on and off
   }
 
-  void PasteTogetherStrings(const vector<string>& chars,
-                            const int i,
-                            const int j,
-                            string* yield) {
-    int size = 0;
-    for (int k=i; k<j; ++k)
-      size += chars[k].size();
-    yield->resize(size);
-    int cur = 0;
-    for (int k=i; k<j; ++k) {
-      const string& cs = chars[k];
-      for (int l = 0; l < cs.size(); ++l)
-        (*yield)[cur++] = cs[l];
-    }
-  }
-
   void BuildTrellis(const vector<string>& chars,
                     Hypergraph* forest) {
     vector<int> nodes(chars.size()+1, -1);
@@ -57,10 +41,13 @@ struct CompoundSplitImpl {
     for (int i = 0; i < max_split_; ++i) {
       if (nodes[i] < 0) continue;
       const int start = min(i + min_size_, static_cast<int>(chars.size()));
+      // the yield of [i,j) is extended one character at a time
+      string yield;
+      for (int k = i; k < start; ++k)
+        yield += chars[k];
       for (int j = start; j <= chars.size(); ++j) {
+        if (j > start) yield += chars[j - 1];
         if (nodes[j] < 0) continue;
-        string yield;
-        PasteTogetherStrings(chars, i, j, &yield);
         // cerr << "[" << i << "," << j << "] " << yield << endl;
         TRulePtr rule = TRulePtr(new TRule(*kTEMPLATE_RULE));
         rule->e_[1] = rule->f_[1] = TD::Convert(yield);
@@ -158,7 +145,7 @@ bool CompoundSplit::TranslateImpl(const string& input,
 
 int CompoundSplit::GetFullWordEdgeIndex(const Hypergraph& forest) {
   assert(forest.nodes_.size() > 0);
-  const vector<int> out_edges = forest.nodes_[0].out_edges_;
+  const Hypergraph::EdgesVector out_edges = forest.nodes_[0].out_edges_;
   int max_edge = -1;
   int max_j = -1;
   for (int i = 0; i < out_edges.size(); ++i) {
@@ -1,8 +1,14 @@
 #include "decoder.h"
 
+#include <map>
+#include <cstring>
+#include <sstream>
 #include <tr1/unordered_map>
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/weak_ptr.hpp>
+#include <sys/stat.h>
 
 #include "program_options.h"
 #include "stringlib.h"
@@ -11,6 +17,10 @@
 #include "fdict.h"
 #include "timing_stats.h"
 #include "verbose.h"
+#include "arena.h"
+#include "lru_cache.h"
+#include "numa.h"
+#include "murmur_hash.h"
 
 #include "translator.h"
 #include "phrasebased_translator.h"
@@ -35,8 +45,10 @@
 #include "sentence_metadata.h"
 #include "sampler.h"
 
+#include "forest_cache.h"
 #include "forest_writer.h" // TODO this section should probably be handled by an Observer
 #include "hg_io.h"
+#include "json_parse.h"
 #include "aligner.h"
 
 #undef FSA_RESCORING
@@ -73,6 +85,102 @@ void DecoderObserver::NotifyAlignmentFailure(const SentenceMetadata&) {}
 void DecoderObserver::NotifyAlignmentForest(const SentenceMetadata&, Hypergraph*) {}
 void DecoderObserver::NotifyDecodingComplete(const SentenceMetadata&) {}
 
+static const ProfileCounter parse_edges("parse_edges");
+// --deadline, per input
+static const ProfileCounter deadline_degraded("deadline_degraded");
+static const ProfileCounter deadline_missed("deadline_missed");
+
+// reports how an input with a --deadline fared when it goes out of scope
+struct DeadlineCheck {
+  explicit DeadlineCheck(const SentenceMetadata& smeta) : smeta_(smeta) {}
+  ~DeadlineCheck() {
+    const double deadline = smeta_.GetDeadline();
+    if (!deadline) return;
+    const double late = Timer::WallTime() - deadline;
+    if (smeta_.IsDegraded()) deadline_degraded.Add();
+    if (late > 0) deadline_missed.Add();
+    if (SILENT || (!smeta_.IsDegraded() && late <= 0)) return;
+    cerr << "  DEADLINE: input " << smeta_.GetSentenceId();
+    if (smeta_.IsDegraded()) cerr << " decoded with less search";
+    if (late > 0) cerr << (smeta_.IsDegraded() ? "," : "") << " finished " << late << " secs late";
+    cerr << endl;
+  }
+  const SentenceMetadata& smeta_;
+};
+
+// --cubepruning_search_error, per rescoring pass checked
+static const ProfileCounter search_error_checks("search_error_checks");
+static const ProfileCounter search_errors("search_errors");
+static const ProfileCounter search_error_loss("search_error_loss_x1000");
+
+// --profile_output: one JSON object per line for each input, holding what
+// the Timers and ProfileCounters of the decoding thread recorded for it, and
+// with --profile_memory what each stage did to the memory use of the
+// process. All Decoders of a process that name the same file share it.
+class ProfileOutput {
+ public:
+  static shared_ptr<ProfileOutput> Open(const string& fname) {
+    boost::mutex::scoped_lock l(Mutex());
+    static map<string, boost::weak_ptr<ProfileOutput> > open;
+    shared_ptr<ProfileOutput> p = open[fname].lock();
+    if (!p) {
+      p.reset(new ProfileOutput(fname));
+      open[fname] = p;
+    }
+    return p;
+  }
+
+  void Write(int sent_id, const Profile& p) {
+    ostringstream o;
+    o << "{\"id\":" << sent_id << ",\"timers\":{";
+    for (map<string, TimerInfo>::const_iterator it = p.timers.begin(); it != p.timers.end(); ++it) {
+      if (it != p.timers.begin()) o << ',';
+      JSONParser::WriteEscapedString(it->first, &o);
+      const TimerInfo& t = it->second;
+      o << ":{\"calls\":" << t.calls << ",\"wall\":" << t.total_time << ",\"cpu\":" << t.cpu_time;
+      if (Timer::SamplingMemory())
+        o << ",\"rss_growth\":" << t.rss_growth << ",\"heap_growth\":" << t.heap_growth
+          << ",\"peak_growth\":" << t.peak_growth << ",\"max_rss\":" << t.max_rss;
+      o << '}';
+    }
+    o << "},\"counters\":{";
+    const vector<string>& names = ProfileCounter::Names();
+    bool first = true;
+    for (unsigned i = 0; i < p.counters.size(); ++i) {
+      if (!p.counters[i]) continue;
+      if (!first) o << ',';
+      first = false;
+      JSONParser::WriteEscapedString(names[i], &o);
+      o << ':' << p.counters[i];
+    }
+    o << '}';
+    if (Timer::SamplingMemory()) {
+      const MemoryUsage m = MemoryUsage::Now();
+      o << ",\"memory\":{\"rss\":" << m.rss << ",\"peak_rss\":" << m.peak_rss << ",\"heap\":" << m.heap << '}';
+    }
+    o << "}\n";
+    boost::mutex::scoped_lock l(Mutex());
+    *file_.stream() << o.str() << flush;
+  }
+
+ private:
+  explicit ProfileOutput(const string& fname) : file_(fname) {}
+  static boost::mutex& Mutex() {
+    static boost::mutex m;
+    return m;
+  }
+  WriteFile file_;
+};
+
+// writes the profile of the current input when Decode returns, i.e. after
+// every Timer that was started later has stopped
+struct ProfileScope {
+  ProfileScope(ProfileOutput* out, const int& sent_id) : out_(out), sent_id_(sent_id) {}
+  ~ProfileScope() { if (out_) out_->Write(sent_id_, Timer::ThreadProfile()); }
+  ProfileOutput* out_;
+  const int& sent_id_;
+};
+
 enum SummaryFeature {
   kNODE_RISK = 1,
   kEDGE_RISK,
@@ -155,24 +263,26 @@ inline shared_ptr<FsaFeatureFunction> make_fsa_ff(string const& ffp,bool verbose
 // and then prune the resulting (rescored) hypergraph. All feature values from previous
 // passes are carried over into subsequent passes (where they may have different weights).
 struct RescoringPass {
-  RescoringPass() : fid_summary(), density_prune(), beam_prune() {}
+  RescoringPass() : own_weights(), fid_summary(), density_prune(-1), beam_prune(-1), promise_power() {}
   shared_ptr<ModelSet> models;
   shared_ptr<IntersectionConfiguration> inter_conf;
   vector<const FeatureFunction*> ffs;
-  shared_ptr<Weights> w;      // null == use previous weights
+  bool own_weights;           // false == use previous weights
   vector<double> weight_vector;
   int fid_summary;            // 0 == no summary feature
-  double density_prune;       // 0 == don't density prune
-  double beam_prune;          // 0 == don't beam prune
+  double density_prune;       // <0 == don't density prune
+  double beam_prune;          // <0 == don't beam prune
+  double promise_power;       // 0 == same pop limit at every node
 };
 
 ostream& operator<<(ostream& os, const RescoringPass& rp) {
   os << "[num_fn=" << rp.ffs.size();
   if (rp.inter_conf) { os << " int_alg=" << *rp.inter_conf; }
-  if (rp.w) os << " new_weights";
+  if (rp.own_weights) os << " new_weights";
   if (rp.fid_summary) os << " summary_feature=" << FD::Convert(rp.fid_summary);
-  if (rp.density_prune) os << " density_prune=" << rp.density_prune;
-  if (rp.beam_prune) os << " beam_prune=" << rp.beam_prune;
+  if (rp.density_prune >= 0) os << " density_prune=" << rp.density_prune;
+  if (rp.beam_prune >= 0) os << " beam_prune=" << rp.beam_prune;
+  if (rp.promise_power > 0) os << " promise=" << rp.promise_power;
   os << ']';
   return os;
 }
@@ -180,8 +290,11 @@ ostream& operator<<(ostream& os, const RescoringPass& rp) {
 struct DecoderImpl {
   DecoderImpl(po::variables_map& conf, int argc, char** argv, istream* cfg);
   ~DecoderImpl();
-  bool Decode(const string& input, DecoderObserver*);
+  // observed: the caller gave an observer, so the sentence can't be answered from the cache
+  bool Decode(const string& input, DecoderObserver*, bool observed);
+  bool DecodeSentence(const string& input, DecoderObserver*);
   void SetWeights(const vector<double>& weights) {
+    if (sentence_cache) sentence_cache->Clear();
     init_weights = weights;
     for (int i = 0; i < rescoring_passes.size(); ++i) {
       if (rescoring_passes[i].models)
@@ -189,25 +302,24 @@ struct DecoderImpl {
       rescoring_passes[i].weight_vector = weights;
     }
   }
+  shared_ptr<const DecoderSettings> ReadSettings(const string& config, const DecoderSettings* base, string* error) const;
+  void SetSettings(const DecoderSettings& settings);
   void SetId(int next_sent_id) { sent_id = next_sent_id - 1; }
+  void SetOutput(ostream* o) { out = o ? o : &cout; }
 
   void forest_stats(Hypergraph &forest,string name,bool show_tree,bool show_deriv=false) {
     cerr << viterbi_stats(forest,name,true,show_tree,show_deriv);
     cerr << endl;
   }
 
-  bool beam_param(po::variables_map const& conf,string const& name,double *val,bool scale_srclen=false,double srclen=1) {
-    if (conf.count(name)) {
-      *val=conf[name].as<double>()*(scale_srclen?srclen:1);
-      return true;
-    }
-    return false;
-  }
-
-  void maybe_prune(Hypergraph &forest,po::variables_map const& conf,string nbeam,string ndensity,string forestname,double srclen) {
-    double beam_prune=0,density_prune=0;
-    bool use_beam_prune=beam_param(conf,nbeam,&beam_prune,conf.count("scale_prune_srclen"),srclen);
-    bool use_density_prune=beam_param(conf,ndensity,&density_prune);
+  // beam_prune, density_prune <0: don't
+  // posts: the forest's edge posteriors (and their total z), if they were already computed for this pass
+  void maybe_prune(Hypergraph &forest,po::variables_map const& conf,double beam_prune,double density_prune,string forestname,double srclen,const Hypergraph::EdgeProbs* posts,prob_t z) {
+    const bool use_beam_prune=beam_prune>=0;
+    const bool use_density_prune=density_prune>=0;
+    if (!use_beam_prune) beam_prune=0;
+    else if (conf.count("scale_prune_srclen")) beam_prune*=srclen;
+    if (!use_density_prune) density_prune=0;
     if (use_beam_prune || use_density_prune) {
       double presize=forest.edges_.size();
       vector<bool> preserve_mask,*pm=0;
@@ -216,24 +328,30 @@ struct DecoderImpl {
         preserve_mask[CompoundSplit::GetFullWordEdgeIndex(forest)] = true;
         pm=&preserve_mask;
       }
-      forest.PruneInsideOutside(beam_prune,density_prune,pm,false,1);
+      if (!conf.count("prune_posteriors"))
+        forest.PruneInsideOutside(beam_prune,density_prune,pm,false,1);
+      else if (posts)
+        forest.PruneEdgePosteriors(*posts,z,beam_prune,density_prune,pm);
+      else
+        forest.PruneInsideOutside(beam_prune,density_prune,pm,true,1);
       if (!forestname.empty()) forestname=" "+forestname;
       forest_stats(forest,"  Pruned "+forestname+" forest",false,false);
       cerr << "  Pruned "<<forestname<<" forest portion of edges kept: "<<forest.edges_.size()/presize<<endl;
     }
   }
 
-  void SampleRecurse(const Hypergraph& hg, const vector<SampleSet<prob_t> >& ss, int n, vector<WordID>* out) {
-    const SampleSet<prob_t>& s = ss[n];
-    int i = rng->SelectSample(s);
-    const Hypergraph::Edge& edge = hg.edges_[hg.nodes_[n].in_edges_[i]];
-    vector<vector<WordID> > ants(edge.tail_nodes_.size());
-    for (int j = 0; j < ants.size(); ++j)
-      SampleRecurse(hg, ss, edge.tail_nodes_[j], &ants[j]);
-
-    vector<const vector<WordID>*> pants(ants.size());
-    for (int j = 0; j < ants.size(); ++j) pants[j] = &ants[j];
-    edge.rule_->ESubstitute(pants, out);
+  // draws a derivation of node n top-down and appends its yield to out
+  void SampleRecurse(const Hypergraph& hg, const vector<AliasSampler>& tables, int n, vector<WordID>* out) {
+    const Hypergraph::EdgesVector& in_edges = hg.nodes_[n].in_edges_;
+    if (in_edges.empty()) return;
+    const Hypergraph::Edge& edge = hg.edges_[in_edges[tables[n].Draw(rng.get())]];
+    const vector<WordID>& e = edge.rule_->e();
+    for (int i = 0; i < e.size(); ++i) {
+      if (e[i] > 0)
+        out->push_back(e[i]);
+      else
+        SampleRecurse(hg, tables, edge.tail_nodes_[-e[i]], out);
+    }
   }
 
   struct SampleSort {
@@ -246,18 +364,23 @@ struct DecoderImpl {
   void MaxTranslationSample(Hypergraph* hg, const int samples, const int k) {
     unordered_map<string, int, boost::hash<string> > m;
     hg->PushWeightsToGoal();
+    // the in-edges of a node are drawn from in proportion to their (pushed)
+    // weights; an alias table per node makes each draw O(1)
     const int num_nodes = hg->nodes_.size();
-    vector<SampleSet<prob_t> > ss(num_nodes);
+    vector<AliasSampler> tables(num_nodes);
+    vector<prob_t> w;
     for (int i = 0; i < num_nodes; ++i) {
-      SampleSet<prob_t>& s = ss[i];
-      const vector<int>& in_edges = hg->nodes_[i].in_edges_;
-      for (int j = 0; j < in_edges.size(); ++j) {
-        s.add(hg->edges_[in_edges[j]].edge_prob_);
-      }
+      const Hypergraph::EdgesVector& in_edges = hg->nodes_[i].in_edges_;
+      if (in_edges.empty()) continue;
+      w.resize(in_edges.size());
+      for (int j = 0; j < in_edges.size(); ++j)
+        w[j] = hg->edges_[in_edges[j]].edge_prob_;
+      tables[i].Init(w);
     }
+    vector<WordID> yield;
     for (int i = 0; i < samples; ++i) {
-      vector<WordID> yield;
-      SampleRecurse(*hg, ss, hg->nodes_.size() - 1, &yield);
+      yield.clear();
+      SampleRecurse(*hg, tables, hg->nodes_.size() - 1, &yield);
       const string trans = TD::GetString(yield);
       ++m[trans];
     }
@@ -269,9 +392,9 @@ struct DecoderImpl {
     sort(dist.begin(), dist.end(), SampleSort());
     if (k) {
       for (int i = 0; i < k; ++i)
-        cout << dist[i].first << " ||| " << dist[i].second << endl;
+        *out << dist[i].first << " ||| " << dist[i].second << endl;
     } else {
-      cout << dist[0].second << endl;
+      *out << dist[0].second << endl;
     }
   }
 
@@ -313,7 +436,7 @@ struct DecoderImpl {
   bool aligner_mode;
   bool graphviz; 
   bool joshua_viz;
-  bool encode_b64;
+  string vector_format;
   bool kbest;
   bool unique_kbest;
   bool get_oracle_forest;
@@ -328,23 +451,116 @@ struct DecoderImpl {
   bool write_gradient; // TODO Observer
   bool feature_expectations; // TODO Observer
   bool output_training_vector; // TODO Observer
+  ostream* out; // translations, k-best lists, etc. are written here (default: cout)
+  shared_ptr<ProfileOutput> profile_out; // null unless --profile_output
+  boost::shared_ptr<MonotonicArena> arena; // null unless --hypergraph_arena
+  boost::shared_ptr<AsyncForestWriter> forest_writer; // null unless --forest_output_queue
+
+  // what Decode wrote for an input, and the id it was written under
+  struct CachedOutput {
+    string text;
+    bool result;
+    int id;
+  };
+  boost::shared_ptr<LRUCache<string, CachedOutput> > sentence_cache; // null unless --sentence_cache
+  boost::shared_ptr<ForestCache> forest_cache; // null unless --forest_cache
+  string forest_cache_settings; // the grammar and parser settings that go into every forest cache key
+  string supplemental_grammar_hash; // of the grammar given to SetSupplementalGrammar, if any
+
+  // the settings of the SCFG translator that shape the -LM forest, with the
+  // size and modification time of each grammar file
+  static string ForestCacheSettings(const po::variables_map& conf) {
+    const char* opts[] = { "scfg_max_span_limit", "add_pass_through_rules", "goal", "scfg_default_nt",
+      "scfg_merge_grammars", "per_sentence_grammar_file", "grammar", "scfg_extra_glue_grammar",
+      "scfg_no_hiero_glue_grammar" };
+    ostringstream os;
+    for (int i = 0; i < sizeof(opts) / sizeof(opts[0]); ++i) {
+      if (!conf.count(opts[i])) continue;
+      os << opts[i] << '=';
+      const po::variable_value& v = conf[opts[i]];
+      if (v.value().type() == typeid(int)) {
+        os << v.as<int>();
+      } else if (v.value().type() == typeid(string)) {
+        os << (strcmp(opts[i], "goal") == 0 || strcmp(opts[i], "scfg_default_nt") == 0 ?
+               v.as<string>() : FileStamp(v.as<string>()));
+      } else if (v.value().type() == typeid(vector<string>)) {
+        const vector<string>& files = v.as<vector<string> >();
+        for (int j = 0; j < files.size(); ++j) os << (j ? "," : "") << FileStamp(files[j]);
+      }
+      os << '\n';
+    }
+    return os.str();
+  }
+
+  // "name:size:mtime", so a grammar that is rewritten gets new cache keys
+  static string FileStamp(const string& fname) {
+    ostringstream os;
+    os << fname;
+    struct stat st;
+    if (stat(fname.c_str(), &st) == 0)
+      os << ':' << st.st_size << ':' << st.st_mtime;
+    return os.str();
+  }
+
+  void WriteForest(const Hypergraph& forest) {
+    const string path = str("forest_output",conf);
+    const bool binary = str("forest_format",conf) == "binary";
+    if (forest_writer) {
+      forest_writer->Write(path, sent_id, binary, forest);
+    } else {
+      ForestWriter writer(path, sent_id, binary);
+      bool succeeded = writer.WriteOrUnion(forest);
+      assert(succeeded);
+    }
+  }
+
+  // for every gzstream opened for writing from now on
+  static void SetGzipCompression(int level, const string& strategy) {
+    if (level < 0 || level > 9) {
+      cerr << "--gzip_level must be between 0 and 9\n";
+      exit(1);
+    }
+    gzstreambuf::compression_level = level;
+    if (strategy == "default") gzstreambuf::compression_strategy = 0;
+    else if (strategy == "filtered") gzstreambuf::compression_strategy = 'f';
+    else if (strategy == "huffman") gzstreambuf::compression_strategy = 'h';
+    else if (strategy == "rle") gzstreambuf::compression_strategy = 'R';
+    else {
+      cerr << "Unknown --gzip_strategy " << strategy << endl;
+      exit(1);
+    }
+  }
 
   static void ConvertSV(const SparseVector<prob_t>& src, SparseVector<double>* trg) {
     for (SparseVector<prob_t>::const_iterator it = src.begin(); it != src.end(); ++it)
       trg->set_value(it->first, it->second);
   }
+
+  // "0<TAB>" followed by acc_obj and acc_vec in the --vector_format
+  void WriteTrainingVector(ostream* o) const {
+    *o << "0\t";
+    if (vector_format == "text") {
+      *o << "**OBJ**=" << acc_obj << ';' << acc_vec;
+    } else {
+      SparseVector<double> dav; ConvertSV(acc_vec, &dav);
+      if (vector_format == "binary")
+        BinaryVector::Encode(acc_obj, dav, o);
+      else
+        B64::Encode(acc_obj, dav, o);
+    }
+    *o << endl << flush;
+  }
 };
 
 DecoderImpl::~DecoderImpl() {
+  if (sentence_cache && !SILENT)
+    cerr << "Sentence cache: " << sentence_cache->hits() << " hits, "
+         << sentence_cache->misses() << " misses\n";
+  if (forest_cache && !SILENT)
+    cerr << "Forest cache: " << forest_cache->hits() << " hits, "
+         << forest_cache->misses() << " misses\n";
   if (output_training_vector && !acc_vec.empty()) {
-    if (encode_b64) {
-      cout << "0\t";
-      SparseVector<double> dav; ConvertSV(acc_vec, &dav);
-      B64::Encode(acc_obj, dav, &cout);
-      cout << endl << flush;
-    } else {
-      cout << "0\t**OBJ**=" << acc_obj << ';' << acc_vec << endl << flush;
-    }
+    WriteTrainingVector(&cout);
   }
 }
 
@@ -358,13 +574,14 @@ DecoderImpl::DecoderImpl(po::variables_map& conf, int argc, char** argv, istream
   opts.add_options()
         ("formalism,f",po::value<string>(),"Decoding formalism; values include SCFG, FST, PB, LexTrans (lexical translation model, also disc training), CSplit (compound splitting), Tagger (sequence labeling), LexAlign (alignment only, or EM training)")
         ("input,i",po::value<string>()->default_value("-"),"Source file")
-        ("grammar,g",po::value<vector<string> >()->composing(),"Either SCFG grammar file(s) or phrase tables file(s)")
-        ("per_sentence_grammar_file", po::value<string>(), "Optional (and possibly not implemented) per sentence grammar file enables all per sentence grammars to be stored in a single large file and accessed by offset")
+        ("grammar,g",po::value<vector<string> >()->composing(),"Either SCFG grammar file(s) (text, or binary as written by compile_grammar) or phrase tables file(s)")
+        ("per_sentence_grammar_file", po::value<string>(), "Optional per sentence grammar file: all per sentence grammars stored in a single large file and accessed by offset. For SCFG decoding, the file is written by make_psg_file and the grammar for each sentence id is found through the index FILE.idx")
+        ("grammar_prefetch", po::value<int>()->default_value(0), "(SCFG) Read the per-sentence grammars given with the grammar= SGML attribute on a background thread while the sentences before them are decoded; at most this many of them are held in memory, read but not yet used. cdec reads this many inputs ahead; with --threads > 1 it is ignored. 0 = off")
         ("list_feature_functions,L","List available feature functions")
 
         ("weights,w",po::value<string>(),"Feature weights file (initial forest / pass 1)")
         ("feature_function,F",po::value<vector<string> >()->composing(), "Pass 1 additional feature function(s) (-L for list)")
-        ("intersection_strategy,I",po::value<string>()->default_value("cube_pruning"), "Pass 1 intersection strategy for incorporating finite-state features; values include Cube_pruning, Full, Fast_cube_pruning, Fast_cube_pruning_2")
+        ("intersection_strategy,I",po::value<string>()->default_value("cube_pruning"), "Pass 1 intersection strategy for incorporating finite-state features; values include Cube_pruning, Full, Fast_cube_pruning, Fast_cube_pruning_2, Cube_growing, Cube_pruning_cell (the pop limit is per span instead of per nonterminal and span, for grammars with many nonterminals)")
         ("summary_feature", po::value<string>(), "Compute a 'summary feature' at the end of the pass (before any pruning) with name=arg and value=inside-outside/Z")
         ("summary_feature_type", po::value<string>()->default_value("node_risk"), "Summary feature types: node_risk, edge_risk, edge_prob")
         ("density_prune", po::value<double>(), "Pass 1 pruning: keep no more than this many times the number of edges used in the best derivation tree (>=1.0)")
@@ -392,6 +609,10 @@ DecoderImpl::DecoderImpl(po::variables_map& conf, int argc, char** argv, istream
         ("k_best,k",po::value<int>(),"Extract the k best derivations")
         ("unique_k_best,r", "Unique k-best translation list")
         ("cubepruning_pop_limit,K",po::value<int>()->default_value(200), "Max number of pops from the candidate heap at each node")
+        ("deadline",po::value<double>(), "Wall clock budget in seconds for decoding each input, counted from when its decoding starts. When cube pruning falls behind it lowers the pop limit of the nodes that are left, down to 1 (the best corner of every node); cube growing stops popping once the deadline has passed, and later rescoring passes are skipped. Inputs decoded with less search are reported on STDERR and counted in the profile as deadline_degraded, inputs that still finished late as deadline_missed")
+        ("cubepruning_node_stats", "Show what cube pruning/growing did at each node of the forest (pops, pushes, recombinations, candidates discarded at the pop limit, heap peak, states); the totals per input are always in the profile (see --profile_output)")
+        ("cubepruning_promise",po::value<double>(), "Scale the pop limit of each node in cube pruning/growing by how promising the node was under the previous pass's weights (the parser's in pass 1): its Viterbi max-marginal raised to this power, normalized to mean 1 over the forest. E.g. a coarse LM in pass 1, zeroed in weights2, then guides a finer LM in pass 2. 0.1-0.5 are sensible")
+        ("cubepruning_search_error", "Also rescore the forest of every cube pruning/growing pass by full intersection (which can be very slow) and report how much worse the cube pruning Viterbi score is, as the counters search_error_checks, search_errors and search_error_loss_x1000 (1000 times the log score lost)")
         ("aligner,a", "Run as a word/phrase aligner (src & ref required)")
         ("aligner_use_viterbi", "If run in alignment mode, compute the Viterbi (rather than MAP) alignment")
         ("goal",po::value<string>()->default_value("S"),"Goal symbol (SCFG & FST)")
@@ -401,6 +622,11 @@ DecoderImpl::DecoderImpl(po::variables_map& conf, int argc, char** argv, istream
         ("scfg_no_hiero_glue_grammar,n", "No Hiero glue grammar (nb. by default the SCFG decoder adds Hiero glue rules)")
         ("scfg_default_nt,d",po::value<string>()->default_value("X"),"Default non-terminal symbol in SCFG")
         ("scfg_max_span_limit,S",po::value<int>()->default_value(10),"Maximum non-terminal span limit (except \"glue\" grammar)")
+        ("scfg_merge_grammars", "Load the text grammars given with -g into a single trie, so the parser extends each dotted item once rather than once per grammar. Rules from the k-th file get the feature GrammarFile<k>=1 (k from 0), which has weight 0 unless set. Binary grammars stay separate; ignored with coarse-to-fine pruning")
+        ("scfg_parser_threads",po::value<int>()->default_value(1),"Fill the SCFG chart cells of each span width using this many threads (the forest is the same as with 1)")
+        ("scfg_cell_beam",po::value<double>()->default_value(0),"Prune each SCFG chart cell as it is parsed: drop edges whose Viterbi inside log prob (rule features and LatticeCost, under the first pass weights) is more than this below the cell's best; pruned edges never enter the -LM forest. 0 = off")
+        ("scfg_cell_limit",po::value<int>()->default_value(0),"Prune each SCFG chart cell as it is parsed: keep at most this many edges per cell (plus the best edge of every node). 0 = off")
+        ("scfg_no_rule_feature_cache","Do not precompute the stateless rule features (e.g. WordPenalty, RuleShape) of grammar rules when the grammar is loaded; saves memory on very large grammars")
         ("quiet", "Disable verbose output")
         ("show_config", po::bool_switch(&show_config), "show contents of loaded -c config files.")
         ("show_weights", po::bool_switch(&show_weights), "show effective feature weights")
@@ -416,9 +642,11 @@ DecoderImpl::DecoderImpl(po::variables_map& conf, int argc, char** argv, istream
         ("ctf_num_widenings", po::value<int>()->default_value(2), "Widen coarse beam this many times before backing off to full parse")
         ("ctf_no_exhaustive", "Do not fall back to exhaustive parse if coarse-to-fine parsing fails")
         ("scale_prune_srclen", "scale beams by the input length (in # of tokens; may not be what you want for lattices")
+        ("prune_posteriors", "Beam and density prune by edge posteriors (sum-product inside-outside) instead of Viterbi max-marginals. A pass with a node_risk or edge_risk summary feature then prunes by the posteriors computed for the feature")
         ("lextrans_dynasearch", "'DynaSearch' neighborhood instead of usual partition, as defined by Smith & Eisner (2005)")
         ("lextrans_use_null", "Support source-side null words in lexical translation")
         ("lextrans_align_only", "Only used in alignment mode. Limit target words generated by reference")
+        ("lextrans_word_pair_features", po::value<vector<string> >()->composing(), "Word pair feature table(s) (f ||| e ||| feats, e.g. written by word-aligner/support/generate_word_pair_features.pl) whose features are added to the matching rules of the lexical translation grammar")
         ("tagger_tagset,t", po::value<string>(), "(Tagger) file containing tag set")
         ("csplit_output_plf", "(Compound splitter) Output lattice in PLF format")
         ("csplit_preserve_full_word", "(Compound splitter) Always include the unsegmented form in the output lattice")
@@ -428,12 +656,26 @@ DecoderImpl::DecoderImpl(po::variables_map& conf, int argc, char** argv, istream
         ("max_translation_beam,x", po::value<int>(), "Beam approximation to get max translation from the chart")
         ("max_translation_sample,X", po::value<int>(), "Sample the max translation from the chart")
         ("pb_max_distortion,D", po::value<int>()->default_value(4), "Phrase-based decoder: maximum distortion")
+        ("pb_beam_size", po::value<int>()->default_value(0), "Phrase-based decoder: coverages kept per stack by the beam search, 0 for exhaustive search")
         ("cll_gradient,G","Compute conditional log-likelihood gradient and write to STDOUT (src & ref required)")
         ("get_oracle_forest,o", "Calculate rescored hypregraph using approximate BLEU scoring of rules")
         ("feature_expectations","Write feature expectations for all features in chart (**OBJ** will be the partition)")
-        ("vector_format",po::value<string>()->default_value("b64"), "Sparse vector serialization format for feature expectations or gradients, includes (text or b64)")
+        ("vector_format",po::value<string>()->default_value("b64"), "Sparse vector serialization format for feature expectations or gradients: b64, text, or binary (BinaryVector records; not newline free, so only for readers that take -f binary)")
         ("combine_size,C",po::value<int>()->default_value(1), "When option -G is used, process this many sentence pairs before writing the gradient (1=emit after every sentence pair)")
-        ("forest_output,O",po::value<string>(),"Directory to write forests to");
+        ("sentence_cache",po::value<int>()->default_value(0), "Keep the output of up to this many distinct inputs and write it again, without decoding, when the same input (including any SGML attributes but the id) comes back; k-best and Joshua visualization ids are rewritten. The cache is emptied when the weights or settings change. Only for plain text output: not with -O, -G, -a, -X, -x, --feature_expectations, --graphviz, --show_derivations, --show_cfg_search_space or --extract_rules. 0 = off")
+        ("forest_cache",po::value<string>(), "(SCFG) Directory in which to keep the -LM forest of every input, so that decoding the same input again, in this or a later run (e.g. the next tuning iteration on a dev set), reads the forest instead of parsing. The forests are keyed by the input and its SGML attributes (but the id), the grammar files (name, size and modification time) and the parser settings; they don't depend on the weights. Not with --coarse_to_fine_beam_prune, --scfg_cell_beam or --scfg_cell_limit; --grammar_prefetch is ignored")
+        ("hypergraph_arena", "Allocate per-sentence hypergraph structures from an arena that is released in bulk after each input (DecoderObservers must not keep copies of forests)")
+        ("threads",po::value<int>()->default_value(1), "(cdec only) Decode this many sentences in parallel; grammars and language models are shared by all threads, output is written in input order")
+        ("numa", "On machines with several NUMA nodes, interleave the memory of the grammars and language models over all nodes while loading them, and (cdec only) bind the decoding threads to the nodes round robin, so each one's per-sentence memory is local; the placement is reported at startup")
+        ("forest_output,O",po::value<string>(),"Directory to write forests to")
+        ("forest_format",po::value<string>()->default_value("json"),"Format of forests written with -O: json (N.json.gz) or binary (N.hgb, see HypergraphIO::WriteToBinary)")
+        ("forest_output_queue",po::value<int>()->default_value(0),"Write forests (-O) on a background thread, so decoding goes on while they are serialized and compressed; decoding waits only when this many forests are queued. 0 writes each forest before Decode returns")
+        ("forest_output_threads",po::value<int>()->default_value(1),"Threads serializing and compressing the forests of --forest_output_queue; the queue length applies to each")
+        ("gzip_level",po::value<int>()->default_value(6),"zlib compression level (0-9) of the .gz files written, e.g. forests (-O) and k-best lists; 1 is several times faster than 6 at a slightly larger size, 0 stores the data uncompressed")
+        ("gzip_strategy",po::value<string>()->default_value("default"),"zlib strategy of the .gz files written: default, filtered, huffman (Huffman coding only: the fastest, but the biggest files after level 0) or rle")
+        ("profile_output",po::value<string>(),"Write a JSON line per input to this file with the wall clock and CPU time of each decoding stage (parse, rescoring passes, inside-outside, pruning, k-best) and counts of edges, pops and LM queries")
+        ("profile_memory","Sample resident memory, peak resident memory and malloc statistics before and after each decoding stage; reported per input on STDERR and in --profile_output, and in total at exit")
+        ("profile_features","Time every feature function of the rescoring passes (reported as FF <name> under each pass's Rescoring stage, with the number of calls) and count the state bytes each one writes; reported per input and in total at exit. Feature functions of fused model sets are then called one by one");
 
   // ob.AddOptions(&opts);
 #ifdef FSA_RESCORING
@@ -497,6 +739,8 @@ DecoderImpl::DecoderImpl(po::variables_map& conf, int argc, char** argv, istream
       cerr<<" "<<argv[i];
     cerr << "\n\n";
   }
+  // everything loaded from here on is shared by all decoding threads
+  const bool numa = conf.count("numa") && Numa::InterleaveMemory();
 
   if (conf.count("list_feature_functions")) {
     cerr << "Available feature functions (specify with -F; describe with -u FeatureName):\n";
@@ -528,6 +772,14 @@ DecoderImpl::DecoderImpl(po::variables_map& conf, int argc, char** argv, istream
     cerr << dcmdline_options << endl;
     exit(1);
   }
+  if (str("forest_format",conf) != "json" && str("forest_format",conf) != "binary") {
+    cerr << "Error: --forest_format takes only 'json' or 'binary'\n";
+    exit(1);
+  }
+  if (str("vector_format",conf) != "b64" && str("vector_format",conf) != "text" && str("vector_format",conf) != "binary") {
+    cerr << "Error: --vector_format takes only 'b64', 'text' or 'binary'\n";
+    exit(1);
+  }
 
 
   write_gradient = conf.count("cll_gradient");
@@ -551,6 +803,33 @@ DecoderImpl::DecoderImpl(po::variables_map& conf, int argc, char** argv, istream
     cerr << "--csplit_output_plf should only be used with csplit!\n";
     exit(1);
   }
+  if (conf["sentence_cache"].as<int>() > 0) {
+    // everything these write besides the text output would be lost on a cache hit
+    const char* side_outputs[] = { "forest_output", "cll_gradient", "feature_expectations", "aligner",
+      "max_translation_sample", "max_translation_beam", "graphviz", "show_derivations",
+      "show_cfg_search_space", "extract_rules", "get_oracle_forest" };
+    for (int i = 0; i < sizeof(side_outputs) / sizeof(side_outputs[0]); ++i) {
+      if (conf.count(side_outputs[i])) {
+        cerr << "--sentence_cache can't be used with --" << side_outputs[i] << endl;
+        exit(1);
+      }
+    }
+    sentence_cache.reset(new LRUCache<string, CachedOutput>(conf["sentence_cache"].as<int>()));
+  }
+  if (conf.count("forest_cache")) {
+    if (formalism != "scfg") {
+      cerr << "--forest_cache can only be used with the SCFG formalism\n";
+      exit(1);
+    }
+    // these prune the chart by the weights, so the forest would depend on them
+    if (conf.count("coarse_to_fine_beam_prune") || conf["scfg_cell_beam"].as<double>() > 0 ||
+        conf["scfg_cell_limit"].as<int>() > 0) {
+      cerr << "--forest_cache can't be used with --coarse_to_fine_beam_prune, --scfg_cell_beam or --scfg_cell_limit\n";
+      exit(1);
+    }
+    forest_cache.reset(new ForestCache(str("forest_cache",conf)));
+    forest_cache_settings = ForestCacheSettings(conf);
+  }
 
   // load initial feature weights (and possibly freeze feature set)
   if (conf.count("weights")) {
@@ -577,9 +856,10 @@ DecoderImpl::DecoderImpl(po::variables_map& conf, int argc, char** argv, istream
       RescoringPass& rp = rescoring_passes.back();
       // only configure new weights if pass > 0, otherwise we reuse the initial chart weights
       if (nth_pass_condition && conf.count(ws)) {
-        rp.w.reset(new Weights);
-        rp.w->InitFromFile(str(ws.c_str(), conf));
-        rp.w->InitVector(&rp.weight_vector);
+        Weights w;
+        w.InitFromFile(str(ws.c_str(), conf));
+        w.InitVector(&rp.weight_vector);
+        rp.own_weights = true;
       }
       bool has_stateful = false;
       if (conf.count(ff)) {
@@ -612,7 +892,16 @@ DecoderImpl::DecoderImpl(po::variables_map& conf, int argc, char** argv, istream
         palg = 3;
         cerr << "Using Fast Cube Pruning 2 intersection (see Algorithm 3 described in: Gesmundo A., Henderson J,. Faster Cube Pruning, IWSLT 2010).\n";
       }
-      rp.inter_conf.reset(new IntersectionConfiguration(palg, pop_limit));
+      if (LowercaseString(str(isn.c_str(),conf)) == "cube_growing") {
+        palg = 4;
+        cerr << "Using Cube Growing intersection (see Section 5 of: Huang L., Chiang D., Forest Rescoring: Faster Decoding with Integrated Language Models, ACL 2007).\n";
+      }
+      if (LowercaseString(str(isn.c_str(),conf)) == "cube_pruning_cell") {
+        palg = 5;
+        cerr << "Using Cube Pruning by chart cell (one heap and pop limit for all nonterminals over a span).\n";
+      }
+      rp.inter_conf.reset(new IntersectionConfiguration(palg, pop_limit, conf.count("cubepruning_node_stats")));
+      if (palg != 0 && conf.count("cubepruning_promise")) rp.promise_power = conf["cubepruning_promise"].as<double>();
     } else {
       break;  // TODO alert user if there are any future configurations
     }
@@ -622,10 +911,11 @@ DecoderImpl::DecoderImpl(po::variables_map& conf, int argc, char** argv, istream
   const vector<double>* prev = &init_weights;
   for (int pass = 0; pass < rescoring_passes.size(); ++pass) {
     RescoringPass& rp = rescoring_passes[pass];
-    if (!rp.w) { rp.weight_vector = *prev; } else { prev = &rp.weight_vector; }
+    if (!rp.own_weights) { rp.weight_vector = *prev; } else { prev = &rp.weight_vector; }
     rp.models.reset(new ModelSet(rp.weight_vector, rp.ffs));
     string ps = "Pass1 "; ps[4] += pass;
     if (!SILENT) show_models(conf,*rp.models,ps.c_str());
+    if (!SILENT && rp.models->fused()) cerr << ps << "uses a StaticModelSet for its feature functions\n";
   }
 
   // show configuration of rescoring passes
@@ -663,6 +953,18 @@ DecoderImpl::DecoderImpl(po::variables_map& conf, int argc, char** argv, istream
   else
     assert(!"error");
 
+  // the stateless rule features of every pass are computed once per grammar
+  // rule here instead of once per edge
+  if (formalism == "scfg" && !conf.count("scfg_no_rule_feature_cache")) {
+    for (int pass = 0; pass < rescoring_passes.size(); ++pass) {
+      const ModelSet& models = *rescoring_passes[pass].models;
+      if (models.has_rule_features()) {
+        const int n = static_cast<SCFGTranslator&>(*translator).PrecomputeRuleFeatures(models);
+        if (!SILENT) cerr << "Precomputed rule features of pass " << (pass+1) << " for " << n << " rules\n";
+      }
+    }
+  }
+
 #ifdef FSA_RESCORING
   store_conf(conf,"fsa_feature_function",&fsa_names);
   for (int i=0;i<fsa_names.size();++i)
@@ -690,7 +992,7 @@ DecoderImpl::DecoderImpl(po::variables_map& conf, int argc, char** argv, istream
   aligner_mode = conf.count("aligner");
   graphviz = conf.count("graphviz");
   joshua_viz = conf.count("show_joshua_visualization");
-  encode_b64 = str("vector_format",conf) == "b64";
+  vector_format = str("vector_format",conf);
   kbest = conf.count("k_best");
   unique_kbest = conf.count("unique_k_best");
   get_oracle_forest = conf.count("get_oracle_forest");
@@ -706,6 +1008,19 @@ DecoderImpl::DecoderImpl(po::variables_map& conf, int argc, char** argv, istream
   combine_size = conf["combine_size"].as<int>();
   if (combine_size < 1) combine_size = 1;
   sent_id = -1;
+  out = &cout;
+  if (conf.count("hypergraph_arena"))
+    arena.reset(new MonotonicArena);
+  SetGzipCompression(conf["gzip_level"].as<int>(), str("gzip_strategy",conf));
+  if (conf["forest_output_queue"].as<int>() > 0)
+    forest_writer.reset(new AsyncForestWriter(conf["forest_output_queue"].as<int>(), conf["forest_output_threads"].as<int>()));
+  if (conf.count("profile_output"))
+    profile_out = ProfileOutput::Open(str("profile_output",conf));
+  if (conf.count("profile_memory"))
+    Timer::SampleMemory(true);
+  if (conf.count("profile_features"))
+    ModelSet::ProfileFeatures(true);
+  if (numa) Numa::LocalMemory();
   acc_obj = 0; // accumulate objective
   g_count = 0;    // number of gradient pieces computed
 }
@@ -714,24 +1029,209 @@ Decoder::Decoder(istream* cfg) { pimpl_.reset(new DecoderImpl(conf,0,0,cfg)); }
 Decoder::Decoder(int argc, char** argv) { pimpl_.reset(new DecoderImpl(conf,argc, argv, 0)); }
 Decoder::~Decoder() {}
 void Decoder::SetId(int next_sent_id) { pimpl_->SetId(next_sent_id); }
+void Decoder::SetOutput(ostream* out) { pimpl_->SetOutput(out); }
 bool Decoder::Decode(const string& input, DecoderObserver* o) {
   bool del = false;
   if (!o) { o = new DecoderObserver; del = true; }
-  const bool res = pimpl_->Decode(input, o);
+  const bool res = pimpl_->Decode(input, o, !del);
   if (del) delete o;
   return res;
 }
 void Decoder::SetWeights(const vector<double>& weights) { pimpl_->SetWeights(weights); }
+void Decoder::Prefetch(const string& input) {
+  if (pimpl_->formalism != "scfg" || conf["grammar_prefetch"].as<int>() <= 0) return;
+  // a grammar read ahead for an input whose forest is cached would never be taken
+  if (pimpl_->forest_cache) return;
+  if (input.find("grammar") == string::npos) return;
+  string buf = input;
+  map<string, string> sgml;
+  ProcessAndStripSGML(&buf, &sgml);
+  const map<string, string>::const_iterator it = sgml.find("grammar");
+  if (it != sgml.end())
+    static_cast<SCFGTranslator&>(*pimpl_->translator).PrefetchSentenceGrammar(it->second);
+}
+shared_ptr<const DecoderSettings> Decoder::ReadSettings(const string& config, const DecoderSettings* base, string* error) const {
+  return pimpl_->ReadSettings(config, base, error);
+}
+void Decoder::SetSettings(const DecoderSettings& settings) { pimpl_->SetSettings(settings); }
+
+shared_ptr<const DecoderSettings> DecoderImpl::ReadSettings(const string& config, const DecoderSettings* base, string* error) const {
+  shared_ptr<DecoderSettings> s(new DecoderSettings);
+  if (base) {
+    *s = *base;
+  } else {
+    s->init_weights = init_weights;
+    for (int pass = 0; pass < rescoring_passes.size(); ++pass) {
+      const RescoringPass& rp = rescoring_passes[pass];
+      DecoderSettings::Pass p;
+      p.own_weights = rp.own_weights;
+      p.weights = rp.weight_vector;
+      p.beam_prune = rp.beam_prune;
+      p.density_prune = rp.density_prune;
+      s->passes.push_back(p);
+    }
+  }
+  if (s->passes.size() != rescoring_passes.size()) {
+    if (error) *error = "settings are for a decoder with a different number of passes";
+    return shared_ptr<const DecoderSettings>();
+  }
+
+  const int MAX_PASSES = 3;
+  po::options_description opts;
+  for (int pass = 0; pass < MAX_PASSES; ++pass) {
+    const string suffix = StringSuffixForRescoringPass(pass);
+    opts.add_options()
+      (("weights" + suffix).c_str(), po::value<string>(), "")
+      (("beam_prune" + suffix).c_str(), po::value<double>(), "")
+      (("density_prune" + suffix).c_str(), po::value<double>(), "");
+  }
+  po::variables_map vm;
+  try {
+    istringstream in(config);
+    po::store(po::parse_config_file(in, opts), vm);
+  } catch (std::exception& e) {
+    if (error) *error = e.what();
+    return shared_ptr<const DecoderSettings>();
+  }
+
+  for (int pass = 0; pass < MAX_PASSES; ++pass) {
+    const string suffix = StringSuffixForRescoringPass(pass);
+    const string ws = "weights" + suffix, bp = "beam_prune" + suffix, dp = "density_prune" + suffix;
+    // --weights scores the initial forest; the first pass always uses it
+    const bool set_pass = (pass > 0 && vm.count(ws)) || vm.count(bp) || vm.count(dp);
+    if (set_pass && pass >= s->passes.size()) {
+      if (error) *error = "the decoder has no rescoring pass " + string(1, char('1' + pass));
+      return shared_ptr<const DecoderSettings>();
+    }
+    if (vm.count(ws)) {
+      const string fname = vm[ws].as<string>();
+      if (!FileExists(fname)) {
+        if (error) *error = "can't read " + ws + " file " + fname;
+        return shared_ptr<const DecoderSettings>();
+      }
+      Weights w;
+      w.InitFromFile(fname);
+      vector<double>& v = pass ? s->passes[pass].weights : s->init_weights;
+      w.InitVector(&v);
+      if (!pass) v.resize(FD::NumFeats());
+      if (pass) s->passes[pass].own_weights = true;
+    }
+    // the limits Hypergraph::PruneInsideOutside asserts
+    if (vm.count(bp) && !(vm[bp].as<double>() > 0)) {
+      if (error) *error = bp + " must be > 0";
+      return shared_ptr<const DecoderSettings>();
+    }
+    if (vm.count(dp) && !(vm[dp].as<double>() >= 1)) {
+      if (error) *error = dp + " must be >= 1";
+      return shared_ptr<const DecoderSettings>();
+    }
+    if (vm.count(bp)) s->passes[pass].beam_prune = vm[bp].as<double>();
+    if (vm.count(dp)) s->passes[pass].density_prune = vm[dp].as<double>();
+  }
+
+  // passes without weights of their own inherit the new ones
+  const vector<double>* prev = &s->init_weights;
+  for (int pass = 0; pass < s->passes.size(); ++pass) {
+    DecoderSettings::Pass& p = s->passes[pass];
+    if (!p.own_weights) { p.weights = *prev; } else { prev = &p.weights; }
+  }
+  return s;
+}
+
+void DecoderImpl::SetSettings(const DecoderSettings& s) {
+  assert(s.passes.size() == rescoring_passes.size());
+  if (sentence_cache) sentence_cache->Clear();
+  init_weights = s.init_weights;
+  for (int pass = 0; pass < rescoring_passes.size(); ++pass) {
+    RescoringPass& rp = rescoring_passes[pass];
+    const DecoderSettings::Pass& p = s.passes[pass];
+    rp.own_weights = p.own_weights;
+    rp.weight_vector = p.weights;
+    rp.models->SetWeights(p.weights);
+    rp.beam_prune = p.beam_prune;
+    rp.density_prune = p.density_prune;
+  }
+}
 void Decoder::SetSupplementalGrammar(const std::string& grammar_string) {
   assert(pimpl_->translator->GetDecoderType() == "SCFG");
+  if (pimpl_->sentence_cache) pimpl_->sentence_cache->Clear();
+  if (pimpl_->forest_cache) {
+    ostringstream os;
+    os << hex << MurmurHash64(grammar_string.data(), grammar_string.size());
+    pimpl_->supplemental_grammar_hash = os.str();
+  }
   static_cast<SCFGTranslator&>(*pimpl_->translator).SetSupplementalGrammar(grammar_string);
 }
 
 
-bool DecoderImpl::Decode(const string& input, DecoderObserver* o) {
+// rewrites the leading "old_id ||| " of each line of text
+static string ReplaceLineIds(const string& text, int old_id, int new_id) {
+  ostringstream os;
+  os << old_id << " ||| ";
+  const string from = os.str();
+  os.str("");
+  size_t b = 0;
+  while (b < text.size()) {
+    size_t e = text.find('\n', b);
+    e = (e == string::npos ? text.size() : e + 1);
+    if (text.compare(b, from.size(), from) == 0)
+      os << new_id << " ||| " << text.substr(b + from.size(), e - b - from.size());
+    else
+      os << text.substr(b, e - b);
+    b = e;
+  }
+  return os.str();
+}
+
+bool DecoderImpl::Decode(const string& input, DecoderObserver* o, bool observed) {
+  if (!sentence_cache || observed)
+    return DecodeSentence(input, o);
+
+  // the input as DecodeSentence will see it: stripped of markup, with the
+  // markup (which may carry grammars or other hints) but not the id appended
+  string key = input;
+  map<string, string> sgml;
+  ProcessAndStripSGML(&key, &sgml);
+  int id = sent_id + 1;
+  for (map<string, string>::const_iterator it = sgml.begin(); it != sgml.end(); ++it) {
+    if (it->first == "id")
+      id = atoi(it->second.c_str());
+    else
+      key += "\n" + it->first + "=" + it->second;
+  }
+
+  if (const CachedOutput* c = sentence_cache->Find(key)) {
+    sent_id = id;
+    if (!SILENT) cerr << "\nINPUT: (cached output of id " << c->id << ")\n  id = " << sent_id << endl;
+    if ((kbest || joshua_viz) && c->id != sent_id)
+      *out << ReplaceLineIds(c->text, c->id, sent_id) << flush;
+    else
+      *out << c->text << flush;
+    return c->result;
+  }
+
+  ostream* const real_out = out;
+  ostringstream captured;
+  out = &captured;
+  CachedOutput c;
+  c.result = DecodeSentence(input, o);
+  out = real_out;
+  c.text = captured.str();
+  c.id = sent_id;
+  *out << c.text << flush;
+  sentence_cache->Insert(key, c);
+  return c.result;
+}
+
+bool DecoderImpl::DecodeSentence(const string& input, DecoderObserver* o) {
+  // everything allocated from the arena is released when this returns
+  ArenaScope arena_scope(arena.get());
   string buf = input;
   NgramCache::Clear();   // clear ngram cache for remote LM (if used)
   Timer::Summarize();
+  ProfileScope profile_scope(profile_out.get(), sent_id);
+  const double start = Timer::WallTime();
+  Timer decode_timer("Decode");
   ++sent_id;
   map<string, string> sgml;
   ProcessAndStripSGML(&buf, &sgml);
@@ -756,23 +1256,51 @@ bool DecoderImpl::Decode(const string& input, DecoderObserver* o) {
 //FIXME: should get the avg. or max source length of the input lattice (like Lattice::dist_(start,end)); but this is only used to scale beam parameters (optionally) anyway so fidelity isn't important.
   const bool has_ref = ref.size() > 0;
   SentenceMetadata smeta(sent_id, ref);
+  if (conf.count("deadline")) smeta.SetDeadline(start + conf["deadline"].as<double>());
+  const DeadlineCheck deadline_check(smeta);
   smeta.sgml_.swap(sgml);
   o->NotifyDecodingStart(smeta);
   Hypergraph forest;          // -LM forest
-  translator->ProcessMarkupHints(smeta.sgml_);
-  Timer t("Translation");
-  const bool translation_successful =
-    translator->Translate(to_translate, &smeta, init_weights, &forest);
-  translator->SentenceComplete();
+  bool translation_successful;
+  string forest_key;
+  if (forest_cache) {
+    // a per-sentence grammar file is looked up by the id
+    ostringstream key;
+    key << forest_cache_settings << "supplemental=" << supplemental_grammar_hash << '\n';
+    if (conf.count("per_sentence_grammar_file")) key << "id=" << sent_id << '\n';
+    for (map<string, string>::const_iterator it = smeta.sgml_.begin(); it != smeta.sgml_.end(); ++it) {
+      if (it->first == "id") continue;
+      key << it->first << '=' << (it->first == "grammar" ? FileStamp(it->second) : it->second) << '\n';
+    }
+    key << buf;
+    forest_key = key.str();
+  }
+  if (forest_cache && forest_cache->Load(forest_key, &forest)) {
+    if (!SILENT) cerr << "  Read -LM forest from the forest cache\n";
+    // what the translator would have set up
+    LatticeTools::ConvertTextOrPLF(to_translate, &smeta.src_lattice_);
+    smeta.SetSourceLength(smeta.src_lattice_.size());
+    forest.Reweight(init_weights);
+    translation_successful = true;
+  } else {
+    translator->ProcessMarkupHints(smeta.sgml_);
+    {
+      Timer t("Parse");
+      translation_successful = translator->Translate(to_translate, &smeta, init_weights, &forest);
+      translator->SentenceComplete();
+    }
+    if (forest_cache && translation_successful) forest_cache->Store(forest_key, forest);
+  }
+  parse_edges.Add(forest.edges_.size());
 
   if (!translation_successful) {
     if (!SILENT) { cerr << "  NO PARSE FOUND.\n"; }
     o->NotifySourceParseFailure(smeta);
     o->NotifyDecodingComplete(smeta);
     if (conf.count("show_conditional_prob")) {
-      cout << "-Inf" << endl << flush;
+      *out << "-Inf" << endl << flush;
     } else if (!SILENT) {
-      cout << endl;
+      *out << endl;
     }
     return false;
   }
@@ -801,16 +1329,39 @@ bool DecoderImpl::Decode(const string& input, DecoderObserver* o) {
   for (int pass = 0; pass < rescoring_passes.size(); ++pass) {
     const RescoringPass& rp = rescoring_passes[pass];
     const vector<double>& cur_weights = rp.weight_vector;
+    string passtr = "Pass1"; passtr[4] += pass;
+    if (pass > 0 && smeta.GetDeadline() && Timer::WallTime() > smeta.GetDeadline()) {
+      if (!SILENT) cerr << "  DEADLINE: skipping rescoring passes " << (pass+1) << " to " << rescoring_passes.size() << endl;
+      smeta.SetDegraded();
+      break;
+    }
+    Timer pass_timer(passtr);
     if (!SILENT) cerr << endl << "  RESCORING PASS #" << (pass+1) << " " << rp << endl;
 #ifdef FSA_RESCORING
     cfg_options.maybe_output_source(forest);
 #endif
 
-    string passtr = "Pass1"; passtr[4] += pass;
+    if (rp.promise_power > 0) {
+      // the forest still has the previous pass's weights
+      Timer t("Promise");
+      forest.SetPromise(rp.promise_power);
+    }
     forest.Reweight(cur_weights);
     const bool has_rescoring_models = !rp.models->empty();
+    prob_t full_viterbi = prob_t::Zero();
+    const bool check_search = has_rescoring_models && conf.count("cubepruning_search_error") &&
+        rp.inter_conf->algorithm != IntersectionConfiguration::FULL && !rp.models->stateless();
+    if (check_search) {
+      Timer t("Search error check");
+      rp.models->PrepareForInput(smeta);
+      Hypergraph full_forest;
+      ApplyModelSet(forest, smeta, *rp.models, IntersectionConfiguration(exhaustive_t()), &full_forest);
+      rp.models->FinishInput(smeta);
+      vector<WordID> trans;
+      full_viterbi = ViterbiESentence(full_forest, &trans);
+    }
     if (has_rescoring_models) {
-      Timer t("Forest rescoring:");
+      Timer t("Rescoring");
       rp.models->PrepareForInput(smeta);
       Hypergraph rescored_forest;
 #ifdef CP_TIME
@@ -821,6 +1372,7 @@ bool DecoderImpl::Decode(const string& input, DecoderObserver* o) {
                   *rp.models,
                   *rp.inter_conf,
                   &rescored_forest);
+      rp.models->FinishInput(smeta);
 #ifdef CP_TIME
       CpTime::Add(clock());
 #endif
@@ -828,13 +1380,29 @@ bool DecoderImpl::Decode(const string& input, DecoderObserver* o) {
       forest.Reweight(cur_weights);
       if (!SILENT) forest_stats(forest,"  " + passtr +" forest",show_tree_structure,oracle.show_derivation);
     }
+    if (check_search) {
+      vector<WordID> trans;
+      const double loss = log(full_viterbi) - log(ViterbiESentence(forest, &trans));
+      search_error_checks.Add();
+      if (!SILENT) cerr << "  " << passtr << " search error: " << loss << " below the full intersection Viterbi score " << log(full_viterbi) << endl;
+      // exact up to rounding
+      if (loss > 1e-6 * max(1.0, fabs(log(full_viterbi)))) {
+        search_errors.Add();
+        search_error_loss.Add(static_cast<long long>(loss * 1000 + 0.5));
+      }
+    }
 
     if (conf.count("show_partition")) {
+      Timer t("Inside-outside");
       const prob_t z = Inside<prob_t, EdgeProb>(forest);
       cerr << "  " << passtr << " partition     log(Z): " << log(z) << endl;
     }
 
+    Hypergraph::EdgeProbs posts; // the summary feature's, reused for --prune_posteriors
+    prob_t posts_z;
+    bool have_posts = false;
     if (rp.fid_summary) {
+      Timer t("Inside-outside");
       if (summary_feature_type == kEDGE_PROB) {
         const prob_t z = forest.PushWeightsToGoal(1.0);
         if (!isfinite(log(z)) || isnan(log(z))) {
@@ -853,11 +1421,12 @@ bool DecoderImpl::Decode(const string& input, DecoderObserver* o) {
           forest.Reweight(cur_weights);  // reset weights
         }
       } else if (summary_feature_type == kNODE_RISK) {
-        Hypergraph::EdgeProbs posts;
         const prob_t z = forest.ComputeEdgePosteriors(1.0, &posts);
         if (!isfinite(log(z)) || isnan(log(z))) {
           cerr << "  " << passtr << " !!! Invalid partition detected, abandoning.\n";
         } else {
+          posts_z = z;
+          have_posts = true;
           for (int i = 0; i < forest.nodes_.size(); ++i) {
             const Hypergraph::EdgesVector& in_edges = forest.nodes_[i].in_edges_;
             prob_t node_post = prob_t(0);
@@ -877,11 +1446,12 @@ bool DecoderImpl::Decode(const string& input, DecoderObserver* o) {
           }
         }
       } else if (summary_feature_type == kEDGE_RISK) {
-        Hypergraph::EdgeProbs posts;
         const prob_t z = forest.ComputeEdgePosteriors(1.0, &posts);
         if (!isfinite(log(z)) || isnan(log(z))) {
           cerr << "  " << passtr << " !!! Invalid partition detected, abandoning.\n";
         } else {
+          posts_z = z;
+          have_posts = true;
           assert(posts.size() == forest.edges_.size());
           for (int i = 0; i < posts.size(); ++i) {
             const double log_np = log(posts[i] / z);
@@ -897,16 +1467,17 @@ bool DecoderImpl::Decode(const string& input, DecoderObserver* o) {
       }
     }
 
-    string fullbp = "beam_prune" + StringSuffixForRescoringPass(pass);
-    string fulldp = "density_prune" + StringSuffixForRescoringPass(pass);
-    maybe_prune(forest,conf,fullbp.c_str(),fulldp.c_str(),passtr,srclen);
+    {
+      Timer t("Pruning");
+      maybe_prune(forest,conf,rp.beam_prune,rp.density_prune,passtr,srclen,have_posts ? &posts : NULL,posts_z);
+    }
 
 #ifdef FSA_RESCORING
     HgCFG hgcfg(forest);
     cfg_options.prepare(hgcfg);
 
     if (!fsa_ffs.empty()) {
-      Timer t("Target FSA rescoring:");
+      Timer t("FSA rescoring");
       if (!has_late_models)
         forest.Reweight(pass0_weights);
       Hypergraph fsa_forest;
@@ -937,24 +1508,8 @@ bool DecoderImpl::Decode(const string& input, DecoderObserver* o) {
   o->NotifyTranslationForest(smeta, &forest);
 
   // TODO I think this should probably be handled by an Observer
-  if (conf.count("forest_output") && !has_ref) {
-    ForestWriter writer(str("forest_output",conf), sent_id);
-    if (FileExists(writer.fname_)) {
-      if (!SILENT) cerr << "  Unioning...\n";
-      Hypergraph new_hg;
-      {
-        ReadFile rf(writer.fname_);
-        bool succeeded = HypergraphIO::ReadFromJSON(rf.stream(), &new_hg);
-        assert(succeeded);
-      }
-      new_hg.Union(forest);
-      bool succeeded = writer.Write(new_hg, false);
-      assert(succeeded);
-    } else {
-      bool succeeded = writer.Write(forest, false);
-      assert(succeeded);
-    }
-  }
+  if (conf.count("forest_output") && !has_ref)
+    WriteForest(forest);
 
   // TODO I think this should probably be handled by an Observer
   if (sample_max_trans) {
@@ -963,17 +1518,18 @@ bool DecoderImpl::Decode(const string& input, DecoderObserver* o) {
     if (kbest && !has_ref) {
       //TODO: does this work properly?
       const string deriv_fname = conf.count("show_derivations") ? str("show_derivations",conf) : "-";
-      oracle.DumpKBest(sent_id, forest, conf["k_best"].as<int>(), unique_kbest,"-", deriv_fname);
+      Timer t("K-best");
+      oracle.DumpKBest(sent_id, forest, conf["k_best"].as<int>(), unique_kbest, *out, deriv_fname);
     } else if (csplit_output_plf) {
-      cout << HypergraphIO::AsPLF(forest, false) << endl;
+      *out << HypergraphIO::AsPLF(forest, false) << endl;
     } else {
       if (!graphviz && !has_ref && !joshua_viz && !SILENT) {
         vector<WordID> trans;
         ViterbiESentence(forest, &trans);
-        cout << TD::GetString(trans) << endl << flush;
+        *out << TD::GetString(trans) << endl << flush;
       }
       if (joshua_viz) {
-        cout << sent_id << " ||| " << JoshuaVisualizationString(forest) << " ||| 1.0 ||| " << -1.0 << endl << flush;
+        *out << sent_id << " ||| " << JoshuaVisualizationString(forest) << " ||| 1.0 ||| " << -1.0 << endl << flush;
       }
     }
   }
@@ -1005,7 +1561,12 @@ bool DecoderImpl::Decode(const string& input, DecoderObserver* o) {
   if (conf.count("show_cfg_search_space"))
     HypergraphIO::WriteAsCFG(forest);
   if (has_ref) {
-    if (HG::Intersect(ref, &forest)) {
+    bool constrained;
+    {
+      Timer t("Reference intersection");
+      constrained = HG::Intersect(ref, &forest);
+    }
+    if (constrained) {
 //      if (crf_uniform_empirical) {
 //        if (!SILENT) cerr << "  USING UNIFORM WEIGHTS\n";
 //        for (int i = 0; i < forest.edges_.size(); ++i)
@@ -1018,26 +1579,10 @@ bool DecoderImpl::Decode(const string& input, DecoderObserver* o) {
          cerr << "  Contst. partition  log(Z): " << log(z) << endl;
       }
       o->NotifyAlignmentForest(smeta, &forest);
-      if (conf.count("forest_output")) {
-        ForestWriter writer(str("forest_output",conf), sent_id);
-        if (FileExists(writer.fname_)) {
-          if (!SILENT) cerr << "  Unioning...\n";
-          Hypergraph new_hg;
-          {
-            ReadFile rf(writer.fname_);
-            bool succeeded = HypergraphIO::ReadFromJSON(rf.stream(), &new_hg);
-            assert(succeeded);
-          }
-          new_hg.Union(forest);
-          bool succeeded = writer.Write(new_hg, false);
-          assert(succeeded);
-        } else {
-          bool succeeded = writer.Write(forest, false);
-          assert(succeeded);
-        }
-      }
+      if (conf.count("forest_output"))
+        WriteForest(forest);
       if (aligner_mode && !output_training_vector)
-        AlignerTools::WriteAlignment(smeta.GetSourceLattice(), smeta.GetReference(), forest, &cout, 0 == conf.count("aligner_use_viterbi"), kbest ? conf["k_best"].as<int>() : 0);
+        AlignerTools::WriteAlignment(smeta.GetSourceLattice(), smeta.GetReference(), forest, out, 0 == conf.count("aligner_use_viterbi"), kbest ? conf["k_best"].as<int>() : 0);
       if (write_gradient) {
         const prob_t ref_z = InsideOutside<prob_t, EdgeProb, SparseVector<prob_t>, EdgeFeaturesAndProbWeightFunction>(forest, &ref_exp);
         ref_exp /= ref_z;
@@ -1067,14 +1612,7 @@ bool DecoderImpl::Decode(const string& input, DecoderObserver* o) {
         acc_vec.erase(0);
         ++g_count;
         if (g_count % combine_size == 0) {
-          if (encode_b64) {
-            cout << "0\t";
-            SparseVector<double> dav; ConvertSV(acc_vec, &dav);
-            B64::Encode(acc_obj, dav, &cout);
-            cout << endl << flush;
-          } else {
-            cout << "0\t**OBJ**=" << acc_obj << ';' <<  acc_vec << endl << flush;
-          }
+          WriteTrainingVector(out);
           acc_vec.clear();
           acc_obj = 0;
         }
@@ -1082,20 +1620,21 @@ bool DecoderImpl::Decode(const string& input, DecoderObserver* o) {
       if (conf.count("graphviz")) forest.PrintGraphviz();
       if (kbest) {
         const string deriv_fname = conf.count("show_derivations") ? str("show_derivations",conf) : "-";
-        oracle.DumpKBest(sent_id, forest, conf["k_best"].as<int>(), unique_kbest,"-", deriv_fname);
+        Timer t("K-best");
+        oracle.DumpKBest(sent_id, forest, conf["k_best"].as<int>(), unique_kbest, *out, deriv_fname);
       }
       if (conf.count("show_conditional_prob")) {
         const prob_t ref_z = Inside<prob_t, EdgeProb>(forest);
-        cout << (log(ref_z) - log(first_z)) << endl << flush;
+        *out << (log(ref_z) - log(first_z)) << endl << flush;
       }
     } else {
       o->NotifyAlignmentFailure(smeta);
       if (!SILENT) cerr << "  REFERENCE UNREACHABLE.\n";
       if (write_gradient) {
-        cout << endl << flush;
+        *out << endl << flush;
       }
       if (conf.count("show_conditional_prob")) {
-        cout << "-Inf" << endl << flush;
+        *out << "-Inf" << endl << flush;
       }
     }
   }
@@ -35,15 +35,54 @@ struct DecoderObserver {
   virtual void NotifyDecodingComplete(const SentenceMetadata& smeta);
 };
 
+// the weights and pruning settings of a Decoder's passes: --weights, which
+// scores the initial forest, and the weights (weights2, weights3, else the
+// previous pass's) and pruning (beam_prune, density_prune, beam_prune2, ...)
+// of each rescoring pass.  see Decoder::ReadSettings
+struct DecoderSettings {
+  struct Pass {
+    Pass() : own_weights(false), beam_prune(-1), density_prune(-1) {}
+    bool own_weights;       // else those of the previous pass
+    std::vector<double> weights;
+    double beam_prune;      // <0 == don't beam prune
+    double density_prune;   // <0 == don't density prune
+  };
+  std::vector<double> init_weights;
+  std::vector<Pass> passes;
+
+  // what the final forest is scored with
+  const std::vector<double>& final_weights() const {
+    return passes.empty() ? init_weights : passes.back().weights;
+  }
+};
+
 struct Decoder {
   Decoder(int argc, char** argv);
   Decoder(std::istream* config_file);
   bool Decode(const std::string& input, DecoderObserver* observer = NULL);
   void SetWeights(const std::vector<double>& weights);
+  // input will be decoded soon, after the inputs given before it: with
+  // --grammar_prefetch, starts reading its per-sentence grammar
+  void Prefetch(const std::string& input);
   void SetId(int id);
+  // redirect translation output (1-best, k-best, alignments, gradients)
+  // from STDOUT to out; NULL restores STDOUT
+  void SetOutput(std::ostream* out);
   ~Decoder();
   const boost::program_options::variables_map& GetConf() const { return conf; }
 
+  // reads new weights and pruning settings from config (options weights,
+  // weights2, weights3, beam_prune, density_prune, beam_prune2, ..., in the
+  // config file format).  options that aren't given keep their value in base
+  // (NULL: in this decoder's current settings).  only passes this decoder
+  // was configured with can be changed.  returns NULL, with a message in
+  // *error, if config can't be used
+  boost::shared_ptr<const DecoderSettings> ReadSettings(const std::string& config, const DecoderSettings* base, std::string* error) const;
+  // swaps in settings (from ReadSettings of this or an identically
+  // configured Decoder) between sentences.  the grammars, language models
+  // and other feature functions stay loaded
+  void SetSettings(const DecoderSettings& settings);
+
   // add grammar rules (currently only supported by SCFG decoders)
   // that will be used on subsequent calls to Decode. rules should be in standard
   // text format. This function does NOT read from a file.
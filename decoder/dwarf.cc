@@ -1325,7 +1325,7 @@ double Alignment::ScoreOrientation(const CountTable& table, int offset, int ori,
   if (DEBUG) cerr << "level0 " << count << "/" << total << "=" << prob << endl;
   
   WordID key_id = (table.mode!=1) ? cond1 : TD::Convert(source); 
-  map<WordID,int*>::const_iterator it = table.model.find(key_id);
+  unordered_map<WordID,int*>::const_iterator it = table.model.find(key_id);
   bool stop = (it==table.model.end());
   if (!stop) {
     stop=true;
@@ -2322,7 +2322,7 @@ double Alignment::ScoreDominance(const CountTable& table, int dom, WordID source
   
   string key = _source1 + " " + _source2;
   WordID key_id = TD::Convert(key);
-  map<WordID,int*>::const_iterator it = table.model.find(key_id); 
+  unordered_map<WordID,int*>::const_iterator it = table.model.find(key_id); 
   bool stop = (it==table.model.end());
   if (!stop) {
     stop = true;
@@ -2480,7 +2480,7 @@ WordID Alignment::E2FProjection(int idx, const string& delimiter) {
   }
 }
 void Alignment::computeBorderDominanceSource(const CountTable& table, double *cost, double *bonus, double *state_mono, 
-        double *state_nonmono, TRule &rule, const std::vector<const void*>& ant_contexts, const map<WordID,int>& sfw) {
+        double *state_nonmono, TRule &rule, const std::vector<const void*>& ant_contexts, const FunctionWords& sfw) {
   // HACK: GOAL is assumed to always be "S"
   if (DEBUG) cerr << "computeBorderDominanceSource" << endl;
   std::vector<WordID> f = rule.f();
@@ -2597,7 +2597,7 @@ void Alignment::computeBorderDominanceSource(const CountTable& table, double *co
   if (DEBUG) cerr << "-->>>> cost="<<*cost<<", bonus="<<*bonus<<", state_mono="<<*state_mono<<", state_nonmono="<<*state_nonmono<<endl;
 }
 
-bool Alignment::prepare(TRule& rule, const std::vector<const void*>& ant_contexts, const map<WordID,int>& sfw, const map<WordID,int>& tfw,const Lattice& sourcelattice, int spanstart, int spanend) {  
+bool Alignment::prepare(TRule& rule, const std::vector<const void*>& ant_contexts, const FunctionWords& sfw, const FunctionWords& tfw,const Lattice& sourcelattice, int spanstart, int spanend) {  
   if (DEBUG) cerr << "===Rule===" << rule.AsString() << endl;
   _f = rule.f();
   _e = rule.e();
@@ -2633,7 +2633,7 @@ bool Alignment::prepare(TRule& rule, const std::vector<const void*>& ant_context
   for (int idx=1; idx<=_f.size(); idx++) { // in transformed space
     if (sfw.find(_f[idx-1])!=sfw.end()) {
       SourceFWRuleIdxs[0]++;
-      SourceFWRuleAbsIdxs[++SourceFWRuleAbsIdxs[0]]=GetFWGlobalIdx(idx,sourcelattice,_f,spanstart,spanend,ant_contexts,sfw);
+      SourceFWRuleAbsIdxs[++SourceFWRuleAbsIdxs[0]]=GetFWGlobalIdx(idx,_f,spanstart,spanend,ant_contexts);
       SourceFWRuleIdxs[3*SourceFWRuleIdxs[0]-2]=idx;
       SourceFWRuleIdxs[3*SourceFWRuleIdxs[0]-1]=_f[idx-1];
       SourceFWRuleIdxs[3*SourceFWRuleIdxs[0]]  =F2EProjectionFromExternal(idx-1,rule.a_,"_SEP_");
@@ -2740,7 +2740,7 @@ bool Alignment::prepare(TRule& rule, const std::vector<const void*>& ant_context
     SourceFWAntsAbsIdxs[i_ant][0]=0;
     if (ants[0]>=0) {
       // Given a span, give the index of the first function word
-      int firstfwidx = GetFirstFWIdx(source(span),target(span),sourcelattice,sfw);
+      int firstfwidx = GetFirstFWIdx(source(span),target(span));
       if (DEBUG) cerr << "  firstfwidx = " << firstfwidx << endl;
       int fwcount = 0;
       if (ants[1]>=0) { // one function word
@@ -2765,7 +2765,7 @@ bool Alignment::prepare(TRule& rule, const std::vector<const void*>& ant_context
       for (int i=1; i<=fwcount; i++) SourceFWAntsAbsIdxs[i_ant][i]=firstfwidx++;
     }
     if (ants[3]>=0) {
-      int lastfwidx = GetLastFWIdx(source(span),target(span),sourcelattice,sfw);
+      int lastfwidx = GetLastFWIdx(source(span),target(span));
       if (DEBUG) cerr << "  lastfwidx = " << lastfwidx << endl;
       int fwcount=0;
       if (ants[4]>=0) {
@@ -3066,7 +3066,7 @@ void Alignment::SetCurrAlVector() {
 
 void CountTable::print() const {
   cerr << "+++ Model +++" << endl;
-  for (map<WordID,int*>::const_iterator iter=model.begin(); iter!=model.end(); iter++) {
+  for (unordered_map<WordID,int*>::const_iterator iter=model.begin(); iter!=model.end(); iter++) {
     cerr << TD::Convert(iter->first) << " ";
     for (int i=0; i<numColumn; i++) cerr << iter->second[i] << " ";
     cerr << endl;
@@ -3087,7 +3087,14 @@ void Alignment::ToArrayInt(vector<int>* ret) {
   }
 }
 
-int Alignment::GetFWGlobalIdx(int idx, const Lattice& sourcelattice, vector<WordID>& sources, int spanstart, int spanend, const std::vector<const void*>& ant_contexts, const map<WordID,int>& sfw) {
+void Alignment::setSourceSentence(const Lattice& sourcelattice, const FunctionWords& sfw) {
+  _sfwBefore.resize(sourcelattice.size()+1);
+  _sfwBefore[0] = 0;
+  for (int i=0; i<sourcelattice.size(); i++)
+    _sfwBefore[i+1] = _sfwBefore[i] + (sfw.find(sourcelattice[i][0].label)!=sfw.end() ? 1 : 0);
+}
+
+int Alignment::GetFWGlobalIdx(int idx, vector<WordID>& sources, int spanstart, int spanend, const std::vector<const void*>& ant_contexts) {
   // get the index of the function word in the lattice
   if (DEBUG) cerr << "   GetFWGlobalIdx(" << idx << "," << spanstart << "," << spanend << ")" << endl;
   int curr = spanstart; int i_ant = 0;
@@ -3103,36 +3110,23 @@ int Alignment::GetFWGlobalIdx(int idx, const Lattice& sourcelattice, vector<Word
   }
   if (DEBUG) cerr << "    curr = " << curr << endl;
   //compute the fw index
-  int ret = 1;
-  for (int i=0; i<curr; i++) {
-    if (sfw.find(sourcelattice[i][0].label)!=sfw.end()) ret++;
-  }
+  int ret = 1 + SourceFWsBefore(curr);
   if (DEBUG) cerr << "    ret = " << ret << endl;
   return ret;
 }
 
-int Alignment::GetFirstFWIdx(int spanstart,int spanend, const Lattice& sourcelattice, const map<WordID,int>& sfw) {
+int Alignment::GetFirstFWIdx(int spanstart,int spanend) {
   if (DEBUG) cerr << "   GetFirstFWIdx(" << spanstart << "," << spanend << ")" << endl;  
-  int curr=0;
-  for (int i=0; i<spanend; i++) {
-    if (sfw.find(sourcelattice[i][0].label)!=sfw.end()) {
-      curr++;
-      if (i>=spanstart) return curr;
-    } 
-  }
-//  assert(0);
-  return curr;
+  // the first function word in the span if there is one, otherwise the last
+  // one before it
+  const int before = SourceFWsBefore(spanstart);
+  const int last = SourceFWsBefore(spanend);
+  return (last > before) ? before+1 : last;
 }
 
-int Alignment::GetLastFWIdx(int spanstart,int spanend, const Lattice& sourcelattice, const map<WordID,int>& sfw) {
+int Alignment::GetLastFWIdx(int spanstart,int spanend) {
   if (DEBUG) cerr << "   GetLastFWIdx(" << spanstart << "," << spanend << ")" << endl;
-  int curr=0;
-  for (int i=0; i<spanend; i++) {
-    if (sfw.find(sourcelattice[i][0].label)!=sfw.end()) {
-      curr++;
-    } 
-  }
-  return curr;
+  return SourceFWsBefore(spanend);
 }
 
 WordID Alignment::generalize(WordID original, const map<WordID,WordID>& tags, bool pos) {
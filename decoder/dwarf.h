@@ -10,7 +10,7 @@
 #include "lattice.h"
 #include "trule.h"
 #include "tdict.h"
-#include <boost/functional/hash.hpp>
+#include "hash.h"
 #include <tr1/unordered_map>
 #include <boost/tuple/tuple.hpp>
 
@@ -21,10 +21,13 @@ using namespace boost;
 
 const static bool DEBUG = false;
 
+// function words, looked up for every word of every edge
+typedef unordered_map<WordID,int> FunctionWords;
+
 class CountTable {
 public:
         int* ultimate;
-        map<WordID,int*> model;
+        unordered_map<WordID,int*> model;
         int mode;
         int numColumn;
         void print() const;
@@ -115,7 +118,10 @@ public:
   // Given the current *rule* and its antecedents, construct an alignment space and mark the function word alignments 
   // according *sfw* and *tfw*
   bool prepare(TRule& rule, const std::vector<const void*>& ant_contexts, 
-               const map<WordID,int>& sfw, const map<WordID,int>& tfw, const Lattice& sourcelattice, int spanstart, int spanend);
+               const FunctionWords& sfw, const FunctionWords& tfw, const Lattice& sourcelattice, int spanstart, int spanend);
+  // counts the function words of the source sentence, once per sentence, so
+  // that the function word indexes of a span are found without scanning it
+  void setSourceSentence(const Lattice& sourcelattice, const FunctionWords& sfw);
 
   // Compute orientation model score which parameters are stored in *table* and pass the values accordingly
   // will call Orientation(Source|Target) and ScoreOrientation(Source|Target)
@@ -183,7 +189,7 @@ public:
                               double *bo1, double *bo1_bonus, double *bo2, double *bo2_bonus);
   void computeBorderDominanceSource(const CountTable& table, double *cost, double *bonus, 
         double *state_mono, double *state_nonmono,
-        TRule &rule, const std::vector<const void*>& ant_contexts, const map<WordID,int>& sfw);
+        TRule &rule, const std::vector<const void*>& ant_contexts, const FunctionWords& sfw);
   int DominanceSource(int fw1, int fw2);
   int DominanceTarget(int fw1, int fw2);
   vector<int> DominanceSource4Sampler(int fw1, int fw2);
@@ -221,12 +227,12 @@ public:
   int* neighborRight(int startidx, int endidx, bool* found);
 private:
   // Hash to avoid redundancy
-  unordered_map<vector<int>, int, boost::hash<vector<int> > > oris_hash;
-  unordered_map<vector<int>, int, boost::hash<vector<int> > > orit_hash;
-  unordered_map<vector<int>, int, boost::hash<vector<int> > > doms_hash;
-  unordered_map<vector<int>, int, boost::hash<vector<int> > > domt_hash;
-  unordered_map<vector<int>, vector<int>, boost::hash<vector<int> > > simplify_hash;
-  unordered_map<vector<int>, vector<int>, boost::hash<vector<int> > > prepare_hash;
+  unordered_map<vector<int>, int, murmur_hash_array<vector<int> > > oris_hash;
+  unordered_map<vector<int>, int, murmur_hash_array<vector<int> > > orit_hash;
+  unordered_map<vector<int>, int, murmur_hash_array<vector<int> > > doms_hash;
+  unordered_map<vector<int>, int, murmur_hash_array<vector<int> > > domt_hash;
+  unordered_map<vector<int>, vector<int>, murmur_hash_array<vector<int> > > simplify_hash;
+  unordered_map<vector<int>, vector<int>, murmur_hash_array<vector<int> > > prepare_hash;
  
   int _J; // effective source length;
   int _I; // effective target length;
@@ -277,9 +283,12 @@ private:
   bool MemberOf(int* FWIdxs, int pos1, int pos2); // whether FWIdxs contains pos1 and pos2 consecutively
   // Convert the alignment to vector form, will be used for hashing purposes
   vector<int> curr_al;
-  int GetFWGlobalIdx(int idx, const Lattice& sourcelattice, vector<WordID>& sources, int spanstart, int spanend, const std::vector<const void*>& ant_contexts, const map<WordID,int>& sfw);
-  int GetFirstFWIdx(int spanstart,int spanend, const Lattice& sourcelattice, const map<WordID,int>& sfw);
-  int GetLastFWIdx(int spanstart,int spanend, const Lattice& sourcelattice, const map<WordID,int>& sfw);
+  int GetFWGlobalIdx(int idx, vector<WordID>& sources, int spanstart, int spanend, const std::vector<const void*>& ant_contexts);
+  int GetFirstFWIdx(int spanstart,int spanend);
+  int GetLastFWIdx(int spanstart,int spanend);
+  // number of source function words before position i of the sentence
+  int SourceFWsBefore(int i) const { return _sfwBefore[i < _sfwBefore.size() ? i : _sfwBefore.size()-1]; }
+  std::vector<int> _sfwBefore; // set by setSourceSentence, one more than the sentence length
   WordID generalize(WordID original, const map<WordID,WordID>& tags, bool pos=false);
 };
 
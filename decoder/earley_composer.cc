@@ -4,13 +4,16 @@
 #include <fstream>
 #include <map>
 #include <queue>
+#include <tr1/unordered_map>
 #include <tr1/unordered_set>
 
 #include <boost/shared_ptr.hpp>
+#include <boost/functional/hash.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
 #include "fast_lexical_cast.hpp"
 
+#include "arena.h"
 #include "phrasetable_fst.h"
 #include "sparse_vector.h"
 #include "tdict.h"
@@ -98,7 +101,8 @@ class EGrammarNode {
 };
 typedef map<WordID, EGrammarNode> EGrammar;    // indexed by the rule LHS
 
-// edges are immutable once created
+// edges are immutable once created.  They are allocated from the arena of
+// the EarleyComposerImpl and released all at once when composition ends
 struct Edge {
 #ifdef DEBUG_CHART_PARSER
   static int id_count;
@@ -111,11 +115,17 @@ struct Edge {
   const Edge* const active_parent;    // back pointer, NULL for PREDICT items
   const Edge* const passive_parent;   // back pointer, NULL for SCAN and PREDICT items
   const TargetPhraseSet* const tps;   // translations
-  shared_ptr<SparseVector<double> > features; // features from CFG rule
+  const SparseVector<double>* const features; // features from CFG rule, owned by the grammar
+  // the forest node of the first edge with the same signature (see
+  // UniqueEdgeHash); the parents of an edge always are such edges
+  mutable Hypergraph::Node* node;
+
+  static void* operator new(size_t size, MonotonicArena* arena) { return arena->Allocate(size); }
+  static void operator delete(void*, MonotonicArena*) {}
 
   bool IsPassive() const {
     // when a rule is completed, this value will be set
-    return static_cast<bool>(features);
+    return features != NULL;
   }
   bool IsActive() const { return !IsPassive(); }
   bool IsInitial() const {
@@ -136,12 +146,12 @@ struct Edge {
 #ifdef DEBUG_CHART_PARSER
     id(++id_count),
 #endif
-    cat(c), dot(d), q(q_and_r), r(q_and_r), active_parent(NULL), passive_parent(NULL), tps(NULL) {}
+    cat(c), dot(d), q(q_and_r), r(q_and_r), active_parent(NULL), passive_parent(NULL), tps(NULL), features(NULL), node(NULL) {}
   Edge(WordID c, const EGrammarNode* d, const FSTNode* q_and_r, const Edge* act_parent) :
 #ifdef DEBUG_CHART_PARSER
     id(++id_count),
 #endif
-    cat(c), dot(d), q(q_and_r), r(q_and_r), active_parent(act_parent), passive_parent(NULL), tps(NULL) {}
+    cat(c), dot(d), q(q_and_r), r(q_and_r), active_parent(act_parent), passive_parent(NULL), tps(NULL), features(NULL), node(NULL) {}
 
   // constructors for SCAN
   Edge(WordID c, const EGrammarNode* d, const FSTNode* i, const FSTNode* j,
@@ -149,7 +159,7 @@ struct Edge {
 #ifdef DEBUG_CHART_PARSER
     id(++id_count),
 #endif
-    cat(c), dot(d), q(i), r(j), active_parent(act_par), passive_parent(NULL), tps(translations) {}
+    cat(c), dot(d), q(i), r(j), active_parent(act_par), passive_parent(NULL), tps(translations), features(NULL), node(NULL) {}
 
   Edge(WordID c, const EGrammarNode* d, const FSTNode* i, const FSTNode* j,
        const Edge* act_par, const TargetPhraseSet* translations,
@@ -158,7 +168,7 @@ struct Edge {
     id(++id_count),
 #endif
     cat(c), dot(d), q(i), r(j), active_parent(act_par), passive_parent(NULL), tps(translations),
-    features(new SparseVector<double>(feats)) {}
+    features(&feats), node(NULL) {}
 
   // constructors for COMPLETE
   Edge(WordID c, const EGrammarNode* d, const FSTNode* i, const FSTNode* j,
@@ -166,7 +176,8 @@ struct Edge {
 #ifdef DEBUG_CHART_PARSER
     id(++id_count),
 #endif
-    cat(c), dot(d), q(i), r(j), active_parent(act_par), passive_parent(pas_par), tps(NULL) {
+    cat(c), dot(d), q(i), r(j), active_parent(act_par), passive_parent(pas_par), tps(NULL),
+    features(NULL), node(NULL) {
       assert(pas_par->IsPassive());
       assert(act_par->IsActive());
     }
@@ -177,25 +188,11 @@ struct Edge {
     id(++id_count),
 #endif
     cat(c), dot(d), q(i), r(j), active_parent(act_par), passive_parent(pas_par), tps(NULL),
-    features(new SparseVector<double>(feats)) {
+    features(&feats), node(NULL) {
       assert(pas_par->IsPassive());
       assert(act_par->IsActive());
     }
 
-  // constructor for COMPLETE query
-  Edge(const FSTNode* _r) :
-#ifdef DEBUG_CHART_PARSER
-    id(0),
-#endif
-    cat(0), dot(NULL), q(NULL),
-    r(_r), active_parent(NULL), passive_parent(NULL), tps(NULL) {}
-  // constructor for MERGE quere
-  Edge(const FSTNode* _q, int) :
-#ifdef DEBUG_CHART_PARSER
-    id(0),
-#endif
-    cat(0), dot(NULL), q(_q),
-    r(NULL), active_parent(NULL), passive_parent(NULL), tps(NULL) {}
 };
 #ifdef DEBUG_CHART_PARSER
 int Edge::id_count = 0;
@@ -234,6 +231,8 @@ struct Traversal {
   const Edge* const active;
   const Edge* const passive;
   Traversal(const Edge* me, const Edge* a, const Edge* p) : edge(me), active(a), passive(p) {}
+  static void* operator new(size_t size, MonotonicArena* arena) { return arena->Allocate(size); }
+  static void operator delete(void*, MonotonicArena*) {}
 };
 
 struct UniqueTraversalHash {
@@ -281,33 +280,12 @@ struct UniqueEdgeEquals {
   }
 };
 
-struct REdgeHash {
-  size_t operator()(const Edge* e) const {
-    size_t x = 5381;
-    x = ((x << 5) + x) ^ reinterpret_cast<size_t>(e->r);
-    return x;
-  }
-};
-
-struct REdgeEquals {
-  bool operator()(const Edge* a, const Edge* b) const {
-    return (a->r == b->r);
-  }
-};
-
-struct QEdgeHash {
-  size_t operator()(const Edge* e) const {
-    size_t x = 5381;
-    x = ((x << 5) + x) ^ reinterpret_cast<size_t>(e->q);
-    return x;
-  }
-};
-
-struct QEdgeEquals {
-  bool operator()(const Edge* a, const Edge* b) const {
-    return (a->q == b->q);
-  }
-};
+// an FST state and a nonterminal.  Active edges are indexed by their end
+// state and each nonterminal their dot can be extended with, passive edges
+// by their start state and their category, so that COMPLETE and the merge
+// with passives only visit the edges that combine
+typedef pair<const FSTNode*, WordID> StateCat;
+typedef unordered_map<StateCat, vector<const Edge*>, boost::hash<StateCat> > EdgeIndex;
 
 struct EdgeQueue {
   queue<const Edge*> q;
@@ -320,15 +298,16 @@ struct EdgeQueue {
 
 class EarleyComposerImpl {
  public:
-  EarleyComposerImpl(WordID start_cat, const FSTNode& q_0) : start_cat_(start_cat), q_0_(&q_0) {}
+  EarleyComposerImpl(WordID start_cat, const FSTNode& q_0) : edges_created_(0), start_cat_(start_cat), q_0_(&q_0) {}
 
   // returns false if the intersection is empty
   bool Compose(const EGrammar& g, Hypergraph* forest) {
     goal_node = NULL;
+    edges_created_ = 0;
     EGrammar::const_iterator sit = g.find(start_cat_);
     forest->ReserveNodes(kMAX_NODES);
     assert(sit != g.end());
-    Edge* init = new Edge(start_cat_, &sit->second, q_0_);
+    Edge* init = new(&arena_) Edge(start_cat_, &sit->second, q_0_);
     assert(IncorporateNewEdge(init));
     while (exp_agenda.HasWork() || agenda.HasWork()) {
       while(exp_agenda.HasWork()) {
@@ -361,20 +340,15 @@ class EarleyComposerImpl {
   }
 
   void FreeAll() {
-    for (int i = 0; i < free_list_.size(); ++i)
-      delete free_list_[i];
-    free_list_.clear();
-    for (int i = 0; i < traversal_free_list_.size(); ++i)
-      delete traversal_free_list_[i];
-    traversal_free_list_.clear();
     all_traversals.clear();
     exp_agenda.clear();
     agenda.clear();
     tps2node.clear();
-    edge2node.clear();
     all_edges.clear();
     passive_edges.clear();
     active_edges.clear();
+    // edges and traversals are trivially destructible
+    arena_.Reset();
   }
 
   ~EarleyComposerImpl() {
@@ -383,7 +357,7 @@ class EarleyComposerImpl {
 
   // returns the total number of edges created during composition
   int EdgesCreated() const {
-    return free_list_.size();
+    return edges_created_;
   }
 
  private:
@@ -410,16 +384,16 @@ class EarleyComposerImpl {
       if (next_r->HasOutgoingNonEpsilonEdges()) {     // are there further symbols in the FST?
         const TargetPhraseSet* translations = NULL;
         if (rule_completes)
-          IncorporateNewEdge(new Edge(edge->cat, next_dot, edge->q, next_r, edge, translations, input_features));
+          IncorporateNewEdge(new(&arena_) Edge(edge->cat, next_dot, edge->q, next_r, edge, translations, input_features));
         if (grammar_continues)
-          IncorporateNewEdge(new Edge(edge->cat, next_dot, edge->q, next_r, edge, translations));
+          IncorporateNewEdge(new(&arena_) Edge(edge->cat, next_dot, edge->q, next_r, edge, translations));
       }
       if (next_r->HasData()) {   // indicates a loop back to q_0 in the FST
         const TargetPhraseSet* translations = next_r->GetTranslations();
         if (rule_completes)
-          IncorporateNewEdge(new Edge(edge->cat, next_dot, edge->q, q_0_, edge, translations, input_features));
+          IncorporateNewEdge(new(&arena_) Edge(edge->cat, next_dot, edge->q, q_0_, edge, translations, input_features));
         if (grammar_continues)
-          IncorporateNewEdge(new Edge(edge->cat, next_dot, edge->q, q_0_, edge, translations));
+          IncorporateNewEdge(new(&arena_) Edge(edge->cat, next_dot, edge->q, q_0_, edge, translations));
       }
     }
   }
@@ -439,7 +413,7 @@ class EarleyComposerImpl {
       }
       assert(edge->IsActive());
       const EGrammarNode* new_dot = &egi->second;
-      Edge* new_edge = new Edge(nt_to_predict, new_dot, edge->r, edge);
+      Edge* new_edge = new(&arena_) Edge(nt_to_predict, new_dot, edge->r, edge);
       IncorporateNewEdge(new_edge);
     }
   }
@@ -449,26 +423,22 @@ class EarleyComposerImpl {
     cerr << "  complete: " << *passive << endl;
 #endif
     const WordID completed_nt = passive->cat;
-    const FSTNode* q = passive->q;
     const FSTNode* next_r = passive->r;
-    const Edge query(q);
-    const pair<unordered_multiset<const Edge*, REdgeHash, REdgeEquals>::iterator,
-         unordered_multiset<const Edge*, REdgeHash, REdgeEquals>::iterator > p =
-      active_edges.equal_range(&query);
-    for (unordered_multiset<const Edge*, REdgeHash, REdgeEquals>::iterator it = p.first;
-         it != p.second; ++it) {
-      const Edge* active = *it;
+    EdgeIndex::const_iterator p = active_edges.find(StateCat(passive->q, completed_nt));
+    if (p == active_edges.end()) return;
+    const vector<const Edge*>& actives = p->second;
+    for (int i = 0; i < actives.size(); ++i) {
+      const Edge* active = actives[i];
 #ifdef DEBUG_CHART_PARSER
       cerr << "    pos: " << *active << endl;
 #endif
       const EGrammarNode* next_dot = active->dot->Extend(completed_nt);
-      if (!next_dot) continue;
       const SparseVector<double>& input_features = next_dot->GetCFGProductionFeatures();
       // add up to 2 rules
       if (next_dot->RuleCompletes())
-        IncorporateNewEdge(new Edge(active->cat, next_dot, active->q, next_r, active, passive, input_features));
+        IncorporateNewEdge(new(&arena_) Edge(active->cat, next_dot, active->q, next_r, active, passive, input_features));
       if (next_dot->GrammarContinues())
-        IncorporateNewEdge(new Edge(active->cat, next_dot, active->q, next_r, active, passive));
+        IncorporateNewEdge(new(&arena_) Edge(active->cat, next_dot, active->q, next_r, active, passive));
     }
   }
 
@@ -479,63 +449,67 @@ class EarleyComposerImpl {
 #ifdef DEBUG_CHART_PARSER
     cerr << "  merge active with passives: ACT=" << *active << endl;
 #endif
-    const Edge query(active->r, 1);
-    const pair<unordered_multiset<const Edge*, QEdgeHash, QEdgeEquals>::iterator,
-         unordered_multiset<const Edge*, QEdgeHash, QEdgeEquals>::iterator > p =
-      passive_edges.equal_range(&query);
-    for (unordered_multiset<const Edge*, QEdgeHash, QEdgeEquals>::iterator it = p.first;
-         it != p.second; ++it) {
-      const Edge* passive = *it;
-      const EGrammarNode* next_dot = active->dot->Extend(passive->cat);
-      if (!next_dot) continue;
-      const FSTNode* next_r = passive->r;
+    const map<WordID, EGrammarNode>& non_terms = active->dot->GetNonTerminals();
+    for (map<WordID, EGrammarNode>::const_iterator git = non_terms.begin();
+         git != non_terms.end(); ++git) {
+      EdgeIndex::const_iterator p = passive_edges.find(StateCat(active->r, git->first));
+      if (p == passive_edges.end()) continue;
+      const EGrammarNode* next_dot = &git->second;
       const SparseVector<double>& input_features = next_dot->GetCFGProductionFeatures();
-      if (next_dot->RuleCompletes())
-        IncorporateNewEdge(new Edge(active->cat, next_dot, active->q, next_r, active, passive, input_features));
-      if (next_dot->GrammarContinues())
-        IncorporateNewEdge(new Edge(active->cat, next_dot, active->q, next_r, active, passive));
+      const vector<const Edge*>& passives = p->second;
+      for (int i = 0; i < passives.size(); ++i) {
+        const Edge* passive = passives[i];
+        const FSTNode* next_r = passive->r;
+        if (next_dot->RuleCompletes())
+          IncorporateNewEdge(new(&arena_) Edge(active->cat, next_dot, active->q, next_r, active, passive, input_features));
+        if (next_dot->GrammarContinues())
+          IncorporateNewEdge(new(&arena_) Edge(active->cat, next_dot, active->q, next_r, active, passive));
+      }
     }
   }
 
-  // take ownership of edge memory, add to various indexes, etc
+  // add to various indexes, etc
   // returns true if this edge is new
   bool IncorporateNewEdge(Edge* edge) {
-    free_list_.push_back(edge);
+    ++edges_created_;
     if (edge->passive_parent && edge->active_parent) {
-      Traversal* t = new Traversal(edge, edge->active_parent, edge->passive_parent);
-      traversal_free_list_.push_back(t);
-      if (all_traversals.find(t) != all_traversals.end()) {
+      const Traversal query(edge, edge->active_parent, edge->passive_parent);
+      if (all_traversals.find(&query) != all_traversals.end())
         return false;
-      } else {
-        all_traversals.insert(t);
-      }
+      all_traversals.insert(new(&arena_) Traversal(query));
     }
     exp_agenda.AddEdge(edge);
     return true;
   }
 
   bool FinishEdge(const Edge* edge, Hypergraph* hg) {
-    bool is_new = false;
-    if (all_edges.find(edge) == all_edges.end()) {
+    const pair<unordered_set<const Edge*, UniqueEdgeHash, UniqueEdgeEquals>::iterator, bool> ins =
+      all_edges.insert(edge);
+    if (ins.second) {
 #ifdef DEBUG_CHART_PARSER
       cerr << *edge << " is NEW\n";
 #endif
-      all_edges.insert(edge);
-      is_new = true;
-      if (edge->IsPassive()) passive_edges.insert(edge);
-      if (edge->IsActive()) active_edges.insert(edge);
+      if (edge->IsPassive()) {
+        passive_edges[StateCat(edge->q, edge->cat)].push_back(edge);
+      } else {
+        const map<WordID, EGrammarNode>& non_terms = edge->dot->GetNonTerminals();
+        for (map<WordID, EGrammarNode>::const_iterator git = non_terms.begin();
+             git != non_terms.end(); ++git)
+          active_edges[StateCat(edge->r, git->first)].push_back(edge);
+      }
       agenda.AddEdge(edge);
     } else {
 #ifdef DEBUG_CHART_PARSER
       cerr << *edge << " is NOT NEW.\n";
 #endif
     }
-    AddEdgeToTranslationForest(edge, hg);
-    return is_new;
+    AddEdgeToTranslationForest(edge, *ins.first, hg);
+    return ins.second;
   }
 
   // build the translation forest
-  void AddEdgeToTranslationForest(const Edge* edge, Hypergraph* hg) {
+  // first is the edge with edge's signature that was finished first
+  void AddEdgeToTranslationForest(const Edge* edge, const Edge* first, Hypergraph* hg) {
     assert(hg->nodes_.size() < kMAX_NODES);
     Hypergraph::Node* tps = NULL;
     // first add any target language rules
@@ -553,7 +527,7 @@ class EarleyComposerImpl {
       }
       tps = node;
     }
-    Hypergraph::Node*& head_node = edge2node[edge];
+    Hypergraph::Node*& head_node = first->node;
     if (!head_node)
       head_node = hg->AddNode(kPHRASE);
     if (edge->cat == start_cat_ && edge->q == q_0_ && edge->r == q_0_ && edge->IsPassive()) {
@@ -565,14 +539,14 @@ class EarleyComposerImpl {
     if (edge->IsCreatedByPredict()) {
       // extra.set_value(FD::Convert("predict"), 1);
     } else if (edge->IsCreatedByScan()) {
-      tail.push_back(edge2node[edge->active_parent]->id_);
+      tail.push_back(edge->active_parent->node->id_);
       if (tps) {
         tail.push_back(tps->id_);
       }
       //extra.set_value(FD::Convert("scan"), 1);
     } else if (edge->IsCreatedByComplete()) {
-      tail.push_back(edge2node[edge->active_parent]->id_);
-      tail.push_back(edge2node[edge->passive_parent]->id_);
+      tail.push_back(edge->active_parent->node->id_);
+      tail.push_back(edge->passive_parent->node->id_);
       //extra.set_value(FD::Convert("complete"), 1);
     } else {
       assert(!"unexpected edge type!");
@@ -606,13 +580,12 @@ class EarleyComposerImpl {
   EdgeQueue exp_agenda;
   EdgeQueue agenda;
   unordered_map<size_t, Hypergraph::Node*> tps2node;
-  unordered_map<const Edge*, Hypergraph::Node*, UniqueEdgeHash, UniqueEdgeEquals> edge2node;
   unordered_set<const Traversal*, UniqueTraversalHash, UniqueTraversalEquals> all_traversals;
   unordered_set<const Edge*, UniqueEdgeHash, UniqueEdgeEquals> all_edges;
-  unordered_multiset<const Edge*, QEdgeHash, QEdgeEquals> passive_edges;
-  unordered_multiset<const Edge*, REdgeHash, REdgeEquals> active_edges;
-  vector<Edge*> free_list_;
-  vector<Traversal*> traversal_free_list_;
+  EdgeIndex passive_edges;
+  EdgeIndex active_edges;
+  MonotonicArena arena_;  // edges and traversals
+  int edges_created_;
   const WordID start_cat_;
   const FSTNode* const q_0_;
 };
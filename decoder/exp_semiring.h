@@ -10,6 +10,7 @@
 //   RType * RType ==> RType
 //   PType * PType ==> PType
 //   RType * PType ==> RType
+//   RType *= PType
 // good examples:
 //   PType scalar, RType vector
 // BAD examples:
@@ -26,8 +27,11 @@ struct PRPair {
     r += o.r;
     return *this;
   }
+  // r = o.r * p + o.p * r, scaling r in place (PType commutes with RType)
+  // so that only one RType temporary is made
   PRPair& operator*=(const PRPair& o) {
-    r = (o.r * p) + (o.p * r);
+    r *= o.p;
+    r += o.r * p;
     p *= o.p;
     return *this;
   }
@@ -56,6 +60,7 @@ const PRPair<P,R> operator*(const PRPair<P,R>& a, const PRPair<P,R>& b) {
 
 template <class P, class PWeightFunction, class R, class RWeightFunction>
 struct PRWeightFunction {
+  typedef PRPair<P,R> Weight;
   explicit PRWeightFunction(const PWeightFunction& pwf = PWeightFunction(),
                             const RWeightFunction& rwf = RWeightFunction()) :
     pweight(pwf), rweight(rwf) {}
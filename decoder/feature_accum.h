@@ -7,15 +7,16 @@
 
 struct SparseFeatureAccumulator : public FeatureVector {
   typedef FeatureVector State;
-  SparseFeatureAccumulator() { assert(!"this code is disabled");  }
+  SparseFeatureAccumulator() {  }
   template <class FF>
   FeatureVector const& describe(FF const& ) { return *this; }
   void Store(FeatureVector *fv) const {
-//NO    fv->set_from(*this);
+    for (const_iterator i=begin(),e=end();i!=e;++i)
+      fv->set_value(i->first,i->second);
   }
   template <class FF>
   void Store(FF const& /* ff */,FeatureVector *fv) const {
-//NO    fv->set_from(*this);
+    Store(fv);
   }
   template <class FF>
   void Add(FF const& /* ff */,FeatureVector const& fv) {
@@ -32,11 +33,12 @@ struct SparseFeatureAccumulator : public FeatureVector {
     *this += fv;
   }
   */
+  // i is a feature id (FsaFeatureFunctionBase::Add passes its fid_)
   void Add(int i,Featval v) {
-//NO    (*this)[i]+=v;
+    add_value(i,v);
   }
   void Add(Features const& fids,int i,Featval v) {
-//NO    (*this)[i]+=v;
+    add_value(fids[i],v);
   }
 };
 
@@ -1,20 +1,28 @@
 //TODO: non-sparse vector for all feature functions?  modelset applymodels keeps track of who has what features?  it's nice having FF that could generate a handful out of 10000 possible feats, though.
 
-//TODO: actually score rule_feature()==true features once only, hash keyed on rule or modify TRule directly?  need to keep clear in forest which features come from models vs. rules; then rescoring could drop all the old models features at once
-
 #include "fast_lexical_cast.hpp"
 #include <stdexcept>
+#include <map>
+#include <boost/thread/mutex.hpp>
 #include "ff.h"
+#include "ff_factory.h"
 
 #include "tdict.h"
 #include "hg.h"
+#include "sentence_metadata.h"
+#include "null_deleter.h"
+#include "timing_stats.h"
 
 using namespace std;
 
 FeatureFunction::~FeatureFunction() {}
 
+FusedModelSet::~FusedModelSet() {}
+
 void FeatureFunction::PrepareForInput(const SentenceMetadata&) {}
 
+void FeatureFunction::FinishInput(const SentenceMetadata&) {}
+
 void FeatureFunction::FinalTraversalFeatures(const void* /* ant_state */,
                                              SparseVector<double>* /* features */) const {
 }
@@ -153,15 +161,77 @@ void ArityPenalty::TraversalFeaturesImpl(const SentenceMetadata& smeta,
   features->set_value(a<fids_.size()?fids_[a]:0, value_);
 }
 
+static bool profile_features = false;
+
+void ModelSet::ProfileFeatures(bool profile) {
+  profile_features = profile;
+}
+
+bool ModelSet::ProfilingFeatures() {
+  return profile_features;
+}
+
+// RuleFeatureCache keys by rule feature configuration
+static boost::mutex rule_ff_keys_mutex;
+static map<string, int> rule_ff_keys;
+static int next_rule_ff_key = 0;
+
 ModelSet::ModelSet(const vector<double>& w, const vector<const FeatureFunction*>& models) :
     models_(models),
     weights_(w),
+    costs_(models.size()),
     state_size_(0),
-    model_state_pos_(models.size()) {
+    model_state_pos_(models.size()),
+    rule_ff_key_(0) {
+  // ModelSets whose rule feature models were all configured the same (e.g.
+  // those of the decoders of several threads) share one cache per rule; a
+  // model the factory didn't make can't be compared, so gets a key of its own
+  string config;
+  bool comparable = true;
+  bool has_rule_ff = false;
   for (int i = 0; i < models_.size(); ++i) {
     model_state_pos_[i] = state_size_;
     state_size_ += models_[i]->NumBytesContext();
+    if (!models_[i]->rule_feature()) continue;
+    has_rule_ff = true;
+    if (models_[i]->config_.empty()) comparable = false;
+    config += models_[i]->config_;
+    config += '\n';
+  }
+  if (has_rule_ff) {
+    boost::mutex::scoped_lock lock(rule_ff_keys_mutex);
+    if (!comparable) {
+      rule_ff_key_ = ++next_rule_ff_key;
+    } else {
+      int& key = rule_ff_keys[config];
+      if (!key) key = ++next_rule_ff_key;
+      rule_ff_key_ = key;
+    }
+  }
+  fused_.reset(fused_ms_registry.Create(models_, model_state_pos_));
+}
+
+void ModelSet::PrecomputeRuleFeatures(TRule* rule) const {
+  if (!rule_ff_key_ || RuleFeatureCache::Find(rule->rule_ff_.get(), rule_ff_key_)) return;
+  static const Lattice no_ref;
+  static const SentenceMetadata no_smeta(-1, no_ref);
+  Hypergraph::Edge edge;
+  edge.rule_.reset(rule, null_deleter());
+  edge.tail_nodes_.resize(rule->Arity());
+  const vector<const void*> ants(rule->Arity(), static_cast<const void*>(NULL));
+  RuleFeatureCache* cache = new RuleFeatureCache;
+  cache->key = rule_ff_key_;
+  SparseVector<double> vals, est_vals;
+  for (int i = 0; i < models_.size(); ++i) {
+    if (!models_[i]->rule_feature()) continue;
+    vals.clear();
+    models_[i]->TraversalFeatures(no_smeta, edge, ants, &vals, &est_vals, NULL);
+    for (SparseVector<double>::const_iterator it = vals.begin(); it != vals.end(); ++it)
+      cache->values.push_back(*it);
+    cache->ends.push_back(cache->values.size());
   }
+  cache->next = rule->rule_ff_;
+  rule->rule_ff_.reset(cache);
 }
 
 void ModelSet::PrepareForInput(const SentenceMetadata& smeta) {
@@ -169,39 +239,127 @@ void ModelSet::PrepareForInput(const SentenceMetadata& smeta) {
     const_cast<FeatureFunction*>(models_[i])->PrepareForInput(smeta);
 }
 
+void ModelSet::FinishInput(const SentenceMetadata& smeta) {
+  for (int i = 0; i < models_.size(); ++i)
+    const_cast<FeatureFunction*>(models_[i])->FinishInput(smeta);
+  if (profile_features) ReportCosts();
+}
+
+void ModelSet::ReportCosts() const {
+  for (int i = 0; i < models_.size(); ++i) {
+    ModelCost& c = costs_[i];
+    if (!c.edges && !c.finals) continue;
+    const string& name = models_[i]->name_;
+    // the models run on the decoding thread without blocking, so its wall
+    // clock time is its CPU time too (reading the thread's CPU clock on
+    // every call would cost more than many models do)
+    Timer::Add("FF " + name, c.edges + c.finals, c.secs, c.secs);
+    const int bytes = models_[i]->NumBytesContext();
+    if (bytes) ProfileCounter(("FF state bytes " + name).c_str()).Add(c.edges * bytes);
+    c = ModelCost();
+  }
+}
+
 void ModelSet::AddFeaturesToEdge(const SentenceMetadata& smeta,
                                  const Hypergraph& /* hg */,
                                  const FFStates& node_states,
                                  Hypergraph::Edge* edge,
                                  FFState* context,
                                  prob_t* combination_cost_estimate) const {
+  vector<const uint8_t*> ant_states(edge->tail_nodes_.size());
+  if (state_size_ > 0) {
+    for (int i = 0; i < ant_states.size(); ++i)
+      ant_states[i] = &node_states[edge->tail_nodes_[i]][0];
+  }
+  AddFeaturesToEdge(smeta, ant_states, edge, context, combination_cost_estimate);
+}
+
+void ModelSet::AddFeaturesToEdge(const SentenceMetadata& smeta,
+                                 const vector<const uint8_t*>& ant_states,
+                                 Hypergraph::Edge* edge,
+                                 FFState* context,
+                                 prob_t* combination_cost_estimate) const {
   edge->reset_info();
-  context->resize(state_size_);
+  if (context->size() != state_size_) context->resize(state_size_);
   if (state_size_ > 0) {
     memset(&(*context)[0], 0, state_size_);
   }
   SparseVector<double> est_vals;  // only computed if combination_cost_estimate is non-NULL
   if (combination_cost_estimate) *combination_cost_estimate = prob_t::One();
+  const RuleFeatureCache* cache = NULL;
+  if (rule_ff_key_ && edge->rule_)
+    cache = RuleFeatureCache::Find(edge->rule_->rule_ff_.get(), rule_ff_key_);
+  if (fused_ && !profile_features) {
+    fused_->TraversalFeatures(smeta, ant_states, edge, state_size_ ? &(*context)[0] : NULL, &est_vals, cache);
+  } else {
+    AddFeaturesToEdgeDynamic(smeta, ant_states, edge, context, &est_vals, cache);
+  }
+  if (combination_cost_estimate)
+    combination_cost_estimate->logeq(est_vals.dot(weights_));
+  edge->edge_prob_.logeq(edge->feature_values_.dot(weights_));
+}
+
+void ModelSet::AddFeaturesToEdgeDynamic(const SentenceMetadata& smeta,
+                                        const vector<const uint8_t*>& ant_states,
+                                        Hypergraph::Edge* edge,
+                                        FFState* context,
+                                        SparseVector<double>* est_vals,
+                                        const RuleFeatureCache* cache) const {
+  vector<const void*> ants(edge->tail_nodes_.size());
+  unsigned next_rule_ff = 0, next_val = 0;
+  double start = profile_features ? Timer::WallTime() : 0;
   for (int i = 0; i < models_.size(); ++i) {
     const FeatureFunction& ff = *models_[i];
+    if (profile_features && i > 0) {
+      const double now = Timer::WallTime();
+      ++costs_[i - 1].edges;
+      costs_[i - 1].secs += now - start;
+      start = now;
+    }
+    if (cache && ff.rule_feature()) {
+      // replay in the model's position, so edges get the same feature vectors
+      ReplayRuleFeatures(*cache, &next_rule_ff, &next_val, &edge->feature_values_);
+      continue;
+    }
     void* cur_ff_context = NULL;
-    vector<const void*> ants(edge->tail_nodes_.size());
     bool has_context = ff.NumBytesContext() > 0;
     if (has_context) {
       int spos = model_state_pos_[i];
       cur_ff_context = &(*context)[spos];
       for (int i = 0; i < ants.size(); ++i) {
-        ants[i] = &node_states[edge->tail_nodes_[i]][spos];
+        ants[i] = ant_states[i] + spos;
       }
+    } else {
+      fill(ants.begin(), ants.end(), static_cast<const void*>(NULL));
+    }
+    ff.TraversalFeatures(smeta, *edge, ants, &edge->feature_values_, est_vals, cur_ff_context);
+  }
+  if (profile_features && !models_.empty()) {
+    ++costs_.back().edges;
+    costs_.back().secs += Timer::WallTime() - start;
+  }
+}
+
+void ModelSet::PrefetchEdge(const SentenceMetadata& smeta,
+                            const vector<const uint8_t*>& ant_states,
+                            const Hypergraph::Edge& edge) const {
+  vector<const void*> ants(ant_states.size());
+  for (int i = 0; i < models_.size(); ++i) {
+    const FeatureFunction& ff = *models_[i];
+    if (ff.NumBytesContext() > 0) {
+      const int spos = model_state_pos_[i];
+      for (int j = 0; j < ants.size(); ++j)
+        ants[j] = ant_states[j] + spos;
+      ff.PrefetchTraversal(smeta, edge, ants);
     }
-    ff.TraversalFeatures(smeta, *edge, ants, &edge->feature_values_, &est_vals, cur_ff_context);
   }
-  if (combination_cost_estimate)
-    combination_cost_estimate->logeq(est_vals.dot(weights_));
-  edge->edge_prob_.logeq(edge->feature_values_.dot(weights_));
 }
 
 void ModelSet::AddFinalFeatures(const FFState& state, Hypergraph::Edge* edge,SentenceMetadata const& smeta) const {
+  AddFinalFeatures(state.begin(), edge, smeta);
+}
+
+void ModelSet::AddFinalFeatures(const uint8_t* state, Hypergraph::Edge* edge,SentenceMetadata const& smeta) const {
   assert(1 == edge->rule_->Arity());
   edge->reset_info();
   for (int i = 0; i < models_.size(); ++i) {
@@ -210,9 +368,14 @@ void ModelSet::AddFinalFeatures(const FFState& state, Hypergraph::Edge* edge,Sen
     bool has_context = ff.NumBytesContext() > 0;
     if (has_context) {
       int spos = model_state_pos_[i];
-      ant_state = &state[spos];
+      ant_state = state + spos;
     }
+    const double start = profile_features ? Timer::WallTime() : 0;
     ff.FinalTraversalFeatures(smeta, *edge, ant_state, &edge->feature_values_);
+    if (profile_features) {
+      ++costs_[i].finals;
+      costs_[i].secs += Timer::WallTime() - start;
+    }
   }
   edge->edge_prob_.logeq(edge->feature_values_.dot(weights_));
 }
@@ -16,9 +16,11 @@
 #include "hg.h"
 #include "feature_vector.h"
 #include "value_array.h"
+#include "inline_bytes.h"
 
 class SentenceMetadata;
 class FeatureFunction;  // see definition below
+template <class FF> struct StaticFF;  // see ff_static.h
 
 typedef std::vector<WordID> Features; // set of features ids
 
@@ -29,6 +31,7 @@ typedef std::vector<WordID> Features; // set of features ids
 class FeatureFunction {
  public:
   std::string name_; // set by FF factory using usage()
+  std::string config_; // set by FF factory: name and parameters; empty if the FF wasn't made by the factory
   bool debug_; // also set by FF factory checking param for immediate initial "debug"
   //called after constructor, but before name_ and debug_ have been set
   virtual void Init() { DBGINIT("default FF::Init name="<<name_); }
@@ -57,6 +60,10 @@ public:
   // used to initialize sentence-specific data structures
   virtual void PrepareForInput(const SentenceMetadata& smeta);
 
+  // called once, per input, after the last feature call of a rescoring pass;
+  // can be used to report sentence-level statistics
+  virtual void FinishInput(const SentenceMetadata& smeta);
+
   //OVERRIDE THIS:
   virtual Features features() const { return single_feature(FD::Convert(name_)); }
   // returns the number of bytes of context that this feature function will
@@ -82,6 +89,15 @@ public:
     // barrier between the blocks reserved for the residual contexts
   }
 
+  // hint that TraversalFeatures will soon be called for edge with these
+  // antecedent contexts, so that features with expensive lookups (e.g., the
+  // language model) can start fetching what they will need.  Rescorers call
+  // this for several edges before scoring any of them.  By default, does
+  // nothing.
+  virtual void PrefetchTraversal(const SentenceMetadata& /* smeta */,
+                                 const Hypergraph::Edge& /* edge */,
+                                 const std::vector<const void*>& /* ant_contexts */) const {}
+
   // if there's some state left when you transition to the goal state, score
   // it here.  For example, the language model computes the cost of adding
   // <s> and </s>.
@@ -146,6 +162,7 @@ class WordPenalty : public FeatureFunction {
     return usage_helper("WordPenalty","","number of target words (local feature)",p,d);
   }
   bool rule_feature() const { return true; }
+  friend struct StaticFF<WordPenalty>;
  protected:
   virtual void TraversalFeaturesImpl(const SentenceMetadata& smeta,
                                      const Hypergraph::Edge& edge,
@@ -166,6 +183,7 @@ class SourceWordPenalty : public FeatureFunction {
   static std::string usage(bool p,bool d) {
     return usage_helper("SourceWordPenalty","","number of source words (local feature, and meaningless except when input has non-constant number of source words, e.g. segmentation/morphology/speech recognition lattice)",p,d);
   }
+  friend struct StaticFF<SourceWordPenalty>;
  protected:
   virtual void TraversalFeaturesImpl(const SentenceMetadata& smeta,
                                      const Hypergraph::Edge& edge,
@@ -192,6 +210,7 @@ class ArityPenalty : public FeatureFunction {
     return usage_helper("ArityPenalty","[MaxArity(default " DEFAULT_MAX_ARITY_STR ")]","Indicator feature Arity_N=1 for rule of arity N (local feature).  0<=N<=MaxArity(default " DEFAULT_MAX_ARITY_STR ")",p,d);
   }
 
+  friend struct StaticFF<ArityPenalty>;
  protected:
   virtual void TraversalFeaturesImpl(const SentenceMetadata& smeta,
                                      const Hypergraph::Edge& edge,
@@ -249,17 +268,43 @@ void show_all_features(std::vector<FFp> const& models_,DenseWeightVector &weight
   return show_features(all_features(models_,weights_,&warn,warn_fid_0),weights_,out,warn,warn_zero_wt);
 }
 
-typedef ValueArray<uint8_t> FFState; // this is about 10% faster than string.
+// states of up to FF_STATE_INLINE_BYTES (a KenLM 5-gram state is 62) are
+// stored without a heap allocation and compared/hashed a word at a time.
+#ifndef FF_STATE_INLINE_BYTES
+# define FF_STATE_INLINE_BYTES 64
+#endif
+typedef InlineBytes<FF_STATE_INLINE_BYTES> FFState;
+//typedef ValueArray<uint8_t> FFState; // this is about 10% faster than string.
 //typedef std::string FFState;
 
-//FIXME: only context.data() is required to be contiguous, and it becomes invalid after next string operation.  use ValueArray instead? (higher performance perhaps, save a word due to fixed size)
 typedef std::vector<FFState> FFStates;
 
+// copies the cached values of the next rule_feature() model onto features
+inline void ReplayRuleFeatures(const RuleFeatureCache& cache,
+                               unsigned* next_rule_ff,
+                               unsigned* next_val,
+                               FeatureVector* features) {
+  for (const unsigned end = cache.ends[(*next_rule_ff)++]; *next_val < end; ++*next_val)
+    features->set_value(cache.values[*next_val].first, cache.values[*next_val].second);
+}
+
+// replaces the per-model loop of ModelSet::AddFeaturesToEdge for a fixed
+// sequence of feature function types, see StaticModelSet in ff_static.h
+struct FusedModelSet {
+  virtual ~FusedModelSet();
+  virtual void TraversalFeatures(const SentenceMetadata& smeta,
+                                 const std::vector<const uint8_t*>& ant_states,
+                                 Hypergraph::Edge* edge,
+                                 uint8_t* context,
+                                 FeatureVector* estimated_features,
+                                 const RuleFeatureCache* cache) const = 0;
+};
+
 // this class is a set of FeatureFunctions that can be used to score, rescore,
 // etc. a (translation?) forest
 class ModelSet {
  public:
-  ModelSet() : state_size_(0) {}
+  ModelSet() : state_size_(0), rule_ff_key_(0) {}
 
   ModelSet(const std::vector<double>& weights,
            const std::vector<const FeatureFunction*>& models);
@@ -277,26 +322,85 @@ class ModelSet {
                          FFState* residual_context,
                          prob_t* combination_cost_estimate = NULL) const;
 
+  // as above, but ant_states[i] points to the state of edge->tail_nodes_[i]
+  // (e.g. one that was interned in a fixed_array_intern_pool)
+  void AddFeaturesToEdge(const SentenceMetadata& smeta,
+                         const std::vector<const uint8_t*>& ant_states,
+                         Hypergraph::Edge* edge,
+                         FFState* residual_context,
+                         prob_t* combination_cost_estimate = NULL) const;
+
+  // evaluates the rule_feature() models on rule and caches the result on it,
+  // so AddFeaturesToEdge can reuse it instead of calling those models on every
+  // edge built from rule.  Meant to be called when the grammar is loaded, once
+  // for each ModelSet with rule features: their caches are chained on the rule.
+  void PrecomputeRuleFeatures(TRule* rule) const;
+  bool has_rule_features() const { return rule_ff_key_ != 0; }
+
+  // calls PrefetchTraversal on the stateful models, see FeatureFunction
+  void PrefetchEdge(const SentenceMetadata& smeta,
+                    const std::vector<const uint8_t*>& ant_states,
+                    const Hypergraph::Edge& edge) const;
+
   //this is called INSTEAD of above when result of edge is goal (must be a unary rule - i.e. one variable, but typically it's assumed that there are no target terminals either (e.g. for LM))
   void AddFinalFeatures(const FFState& residual_context,
                         Hypergraph::Edge* edge,
                         SentenceMetadata const& smeta) const;
+  void AddFinalFeatures(const uint8_t* residual_context,
+                        Hypergraph::Edge* edge,
+                        SentenceMetadata const& smeta) const;
 
   // this is called once before any feature functions apply to a hypergraph
   // it can be used to initialize sentence-specific data structures
   void PrepareForInput(const SentenceMetadata& smeta);
+  // with ProfileFeatures(true), also reports what each model cost since the
+  // last FinishInput to the profile of the calling thread: a timer
+  // "FF <name>" nested under the running Timer and a counter
+  // "FF state bytes <name>" of the state the model wrote
+  void FinishInput(const SentenceMetadata& smeta);
+
+  // time the calls of every model (off by default; set it before decoding).
+  // Fused model sets call the models one by one instead while it is on, so
+  // each one's cost can be told apart.
+  static void ProfileFeatures(bool profile);
+  static bool ProfilingFeatures();
 
   bool empty() const { return models_.empty(); }
 
   bool stateless() const { return !state_size_; }
+  // true if the models matched a StaticModelSet registered with
+  // fused_ms_registry, which then computes their features
+  bool fused() const { return fused_.get() != NULL; }
+  // size of the residual contexts (states) produced by AddFeaturesToEdge
+  int NumBytesContext() const { return state_size_; }
   Features all_features(std::ostream *warnings=0,bool warn_fid_zero=false); // this will warn about duplicate features as well (one function overwrites the feature of another).  also resizes weights_ so it is large enough to hold the (0) weight for the largest reported feature id.  since 0 is a NULL feature id, it's never included.  if warn_fid_zero, then even the first 0 id is
   void show_features(std::ostream &out,std::ostream &warn,bool warn_zero_wt=true);
 
  private:
+  void AddFeaturesToEdgeDynamic(const SentenceMetadata& smeta,
+                                const std::vector<const uint8_t*>& ant_states,
+                                Hypergraph::Edge* edge,
+                                FFState* context,
+                                FeatureVector* estimated_features,
+                                const RuleFeatureCache* cache) const;
+
+  void ReportCosts() const;
+
+  // per model, with ProfileFeatures(true)
+  struct ModelCost {
+    ModelCost() : edges(), finals(), secs() {}
+    long long edges, finals;  // calls of TraversalFeatures, FinalTraversalFeatures
+    double secs;
+  };
+
   std::vector<const FeatureFunction*> models_;
   std::vector<double> weights_;
+  mutable std::vector<ModelCost> costs_;
   int state_size_;
   std::vector<int> model_state_pos_;
+  int rule_ff_key_;  // see RuleFeatureCache::key, 0 if no model is a rule_feature();
+                     // the same for every ModelSet with the same rule feature configuration
+  boost::shared_ptr<const FusedModelSet> fused_;
 };
 
 #endif
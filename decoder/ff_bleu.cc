@@ -42,9 +42,6 @@ class BLEUModelImpl {
     *(static_cast<char*>(state) + state_size_) = size;
   }
 
-  void GetRefToNgram()
-  {}
-
   string DebugStateToString(const void* state) const {
     int len = StateSize(state);
     const int* astate = reinterpret_cast<const int*>(state);
@@ -57,67 +54,12 @@ class BLEUModelImpl {
     return res;
   }
 
-  inline double ProbNoRemnant(int i, int len) {
-    int edge = len;
-    bool flag = true;
-    double sum = 0.0;
-    while (i >= 0) {
-      if (buffer_[i] == kSTAR) {
-        edge = i;
-        flag = false;
-      } else if (buffer_[i] <= 0) {
-        edge = i;
-        flag = true;
-      } else {
-        if ((edge-i >= order_) || (flag && !(i == (len-1) && buffer_[i] == kSTART)))
-	  {          //sum += LookupProbForBufferContents(i);
-	    //cerr << "FT";
-	    CalcPhrase(buffer_[i], &buffer_[i+1]);
-	  }
-      }
-      --i;
-    }
-    return sum;
-  }
-
-  double FinalTraversalCost(const void* state) {
-    int slen = StateSize(state);
-    int len = slen + 2;
-    // cerr << "residual len: " << len << endl;
-    buffer_.resize(len + 1);
-    buffer_[len] = kNONE;
-    buffer_[len-1] = kSTART;
-    const int* astate = reinterpret_cast<const int*>(state);
-    int i = len - 2;
-    for (int j = 0; j < slen; ++j,--i)
-      buffer_[i] = astate[j];
-    buffer_[i] = kSTOP;
-    assert(i == 0);
-    return ProbNoRemnant(len - 1, len);
-  }
-
-  vector<WordID> CalcPhrase(int word, int* context) {
-     int i = order_;
-    vector<WordID> vs;
-    int c = 1;
-    vs.push_back(word);
-    // while (i > 1 && *context > 0) {
-     while (*context > 0) {
-      --i;
-      vs.push_back(*context);
-      ++context;
-      ++c;
-    }
-     if(false){	cerr << "VS1( ";
-	vector<WordID>::reverse_iterator rit;
-	for ( rit=vs.rbegin() ; rit != vs.rend(); ++rit )
-	  cerr << " " << TD::Convert(*rit);
-	cerr << ")\n";}
-
-    return vs;
+  // all of the approximate BLEU is scored on the edges; nothing is left
+  // for the goal
+  double FinalTraversalCost(const void* /* state */) const {
+    return 0.0;
   }
 
-
   double LookupWords(const TRule& rule, const vector<const void*>& ant_states, void* vstate, const SentenceMetadata& smeta) {
 
     int len = rule.ELength() - rule.Arity();
@@ -156,36 +98,20 @@ class BLEUModelImpl {
     i = len - 1;
     int edge = len;
 
-
-    vector<WordID> vs;
     while (i >= 0) {
-      vs = CalcPhrase(buffer_[i],&buffer_[i+1]);
-      if (buffer_[i] == kSTAR) {
+      if (buffer_[i] == kSTAR)
         edge = i;
-      } else if (edge-i >= order_) {
-
-	vs = CalcPhrase(buffer_[i],&buffer_[i+1]);
-
-      } else if (edge == len && remnant) {
+      else if (edge == len && edge-i < order_ && remnant)
         remnant[j++] = buffer_[i];
-      }
       --i;
     }
 
-    //calculate Bvector here
-    /* cerr << "VS1( ";
-    vector<WordID>::reverse_iterator rit;
-    for ( rit=vs.rbegin() ; rit != vs.rend(); ++rit )
-      cerr << " " << TD::Convert(*rit);
-    cerr << ")\n";
-    */
-
-    ScoreP node_score_p = smeta.GetDocScorer()[smeta.GetSentenceID()]->ScoreCCandidate(vs);
+    // the candidate is the whole buffer (stars included), as the n-gram
+    // scan over it always ended at kNONE
+    vs_.assign(buffer_.begin(), buffer_.begin() + len);
+    ScoreP node_score_p = smeta.GetDocScorer()[smeta.GetSentenceID()]->ScoreCCandidate(vs_);
     Score *node_score=node_score_p.get();
-    string details;
-    node_score->ScoreDetails(&details);
     const Score *base_score= &smeta.GetScore();
-    //cerr << "SWBASE : " << base_score->ComputeScore() << details << " ";
 
     int src_length = smeta.GetSourceLength();
     node_score->PlusPartialEquals(*base_score, rule.EWords(), rule.FWords(), src_length );
@@ -218,6 +144,7 @@ class BLEUModelImpl {
 
  protected:
   vector<WordID> buffer_;
+  vector<WordID> vs_;  // candidate scored for the current edge
   const int order_;
   const int state_size_;
   const double floor_;
@@ -1,5 +1,7 @@
 #include "ff_charset.h"
 
+#include <algorithm>
+
 #include "fdict.h"
 #include "stringlib.h"
 
@@ -26,15 +28,13 @@ void NonLatinCount::TraversalFeaturesImpl(const SentenceMetadata& smeta,
   const vector<WordID>& e = edge.rule_->e();
   int count = 0;
   for (int i = 0; i < e.size(); ++i) {
-    if (e[i] > 0) {
-      map<WordID, bool>::iterator it = is_non_latin_.find(e[i]);
-      if (it == is_non_latin_.end()) {
-        if ((is_non_latin_[e[i]] = ContainsNonLatin(TD::Convert(e[i]))))
-          ++count;
-      } else {
-        if (it->second)
-          ++count;
-      }
+    const WordID w = e[i];
+    if (w > 0) {
+      if (w >= is_non_latin_.size())
+        is_non_latin_.resize(max<size_t>(w + 1, TD::NumWords() + 1), 0);
+      char& c = is_non_latin_[w];
+      if (!c) c = ContainsNonLatin(TD::Convert(w)) ? 2 : 1;
+      if (c == 2) ++count;
     }
   }
   if (count) features->set_value(fid_, count);
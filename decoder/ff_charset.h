@@ -2,7 +2,7 @@
 #define _FFCHARSET_H_
 
 #include <string>
-#include <map>
+#include <vector>
 #include "ff.h"
 #include "hg.h"
 
@@ -11,6 +11,7 @@ class SentenceMetadata;
 class NonLatinCount : public FeatureFunction {
  public:
   NonLatinCount(const std::string& param);
+  bool rule_feature() const { return true; }
  protected:
   virtual void TraversalFeaturesImpl(const SentenceMetadata& smeta,
                                      const Hypergraph::Edge& edge,
@@ -19,7 +20,8 @@ class NonLatinCount : public FeatureFunction {
                                      FeatureVector* estimated_features,
                                      void* context) const;
  private:
-  mutable std::map<WordID, bool> is_non_latin_;
+  // WordID -> 0 if not classified yet, 1 if all Latin, 2 if not
+  mutable std::vector<char> is_non_latin_;
   const int fid_;
 };
 
@@ -2,6 +2,7 @@
 
 #include <set>
 #include <cstring>
+#include <tr1/unordered_map>
 
 #include "klm/lm/model.hh"
 
@@ -56,6 +57,15 @@ struct BasicCSplitFeaturesImpl {
                              const int src_word_size,
                              SparseVector<double>* features) const;
 
+  // the properties of a (sub)word the features depend on
+  struct WordInfo {
+    int chars;      // roughly the number of phonemes
+    float freq;     // 99 if not in the dictionary
+    bool in_dict;
+    bool bad;
+  };
+  const WordInfo& LookUp(const WordID word) const;
+
   const int word_count_;
   const int letters_sq_;
   const int letters_sqrt_;
@@ -74,20 +84,20 @@ struct BasicCSplitFeaturesImpl {
   const int bad_;
   FreqDict freq_dict_;
   set<WordID> bad_words_;
+  // the same subwords come up in many words, so their properties are
+  // remembered (until there are kMAX_CACHED_WORDS of them)
+  mutable std::tr1::unordered_map<WordID, WordInfo> word_info_;
+  static const unsigned kMAX_CACHED_WORDS = 1000000;
 };
 
 BasicCSplitFeatures::BasicCSplitFeatures(const string& param) :
   pimpl_(new BasicCSplitFeaturesImpl(param)) {}
 
-void BasicCSplitFeaturesImpl::TraversalFeaturesImpl(
-                                     const Hypergraph::Edge& edge,
-                                     const int src_word_length,
-                                     SparseVector<double>* features) const {
-  const bool subword = (edge.i_ > 0) || (edge.j_ < src_word_length);
-  features->set_value(word_count_, 1.0);
-  features->set_value(letters_sq_, (edge.j_ - edge.i_) * (edge.j_ - edge.i_));
-  features->set_value(letters_sqrt_, sqrt(edge.j_ - edge.i_));
-  const WordID word = edge.rule_->e_[1];
+const BasicCSplitFeaturesImpl::WordInfo& BasicCSplitFeaturesImpl::LookUp(const WordID word) const {
+  std::tr1::unordered_map<WordID, WordInfo>::iterator it = word_info_.find(word);
+  if (it != word_info_.end()) return it->second;
+  if (word_info_.size() >= kMAX_CACHED_WORDS) word_info_.clear();
+  WordInfo& info = word_info_[word];
   const char* sword = TD::Convert(word);
   const int len = strlen(sword);
   int cur = 0;
@@ -109,18 +119,35 @@ void BasicCSplitFeaturesImpl::TraversalFeaturesImpl(
   if (has_ch) --chars;
   if (has_ie) --chars;
   if (has_zw) --chars;
+  info.chars = chars;
+
+  info.freq = freq_dict_.LookUp(word);
+  info.in_dict = info.freq;
+  if (!info.in_dict) info.freq = 99.0f;
+  info.bad = bad_words_.count(word) != 0;
+  return info;
+}
 
-  float freq = freq_dict_.LookUp(word);
-  if (freq) {
+void BasicCSplitFeaturesImpl::TraversalFeaturesImpl(
+                                     const Hypergraph::Edge& edge,
+                                     const int src_word_length,
+                                     SparseVector<double>* features) const {
+  const bool subword = (edge.i_ > 0) || (edge.j_ < src_word_length);
+  features->set_value(word_count_, 1.0);
+  features->set_value(letters_sq_, (edge.j_ - edge.i_) * (edge.j_ - edge.i_));
+  features->set_value(letters_sqrt_, sqrt(edge.j_ - edge.i_));
+  const WordInfo& info = LookUp(edge.rule_->e_[1]);
+  const int chars = info.chars;
+  const float freq = info.freq;
+  if (info.in_dict) {
     features->set_value(freq_, freq);
     features->set_value(in_dict_, 1.0);
     if (subword) features->set_value(in_dict_sub_word_, 1.0);
   } else {
     features->set_value(oov_, 1.0);
     if (subword) features->set_value(oov_sub_word_, 1.0);
-    freq = 99.0f;
   }
-  if (bad_words_.count(word) != 0)
+  if (info.bad)
     features->set_value(bad_, 1.0);
   if (chars < 5)
     features->set_value(short_, 1.0);
@@ -180,12 +207,22 @@ struct ReverseCharLMCSplitFeatureImpl {
     kEOS = MapWord(TD::Convert("</s>"));
     assert(kEOS > 0);
   }
+  // forgets the probabilities of the previous word
+  void Reset() { left_probs_.clear(); }
   lm::WordIndex MapWord(const WordID w) const {
     if (w < cdec2klm_map_.size()) return cdec2klm_map_[w];
     return 0;
   }
 
+  // the same for all edges starting at start, so it's computed once per word
   double LeftPhonotacticProb(const Lattice& inword, const int start) {
+    if (left_probs_.size() <= start) left_probs_.resize(start + 1, kUNKNOWN);
+    double& p = left_probs_[start];
+    if (p == kUNKNOWN) p = ComputeLeftPhonotacticProb(inword, start);
+    return p;
+  }
+ private:
+  double ComputeLeftPhonotacticProb(const Lattice& inword, const int start) const {
     const int end = inword.size();
     lm::ngram::State state = ngram_->BeginSentenceState();
     int sp = min(end - start, order_ - 1);
@@ -201,17 +238,26 @@ struct ReverseCharLMCSplitFeatureImpl {
     const double startprob = ngram_->Score(scopy, kEOS, state);
     return startprob;
   }
- private:
+
+  static const double kUNKNOWN;
   Model* ngram_;
   int order_;
   vector<lm::WordIndex> cdec2klm_map_;
   lm::WordIndex kEOS;
+  vector<double> left_probs_;  // by start position, kUNKNOWN if not computed yet
 };
 
+template<class Model> const double ReverseCharLMCSplitFeatureImpl<Model>::kUNKNOWN = 1.0;  // log probs are <= 0
+
 ReverseCharLMCSplitFeature::ReverseCharLMCSplitFeature(const string& param) :
   pimpl_(new ReverseCharLMCSplitFeatureImpl<lm::ngram::ProbingModel>(param)),
   fid_(FD::Convert("RevCharLM")) {}
 
+void ReverseCharLMCSplitFeature::PrepareForInput(const SentenceMetadata& smeta) {
+  (void) smeta;
+  pimpl_->Reset();
+}
+
 void ReverseCharLMCSplitFeature::TraversalFeaturesImpl(
                                      const SentenceMetadata& smeta,
                                      const Hypergraph::Edge& edge,
@@ -24,11 +24,7 @@ Dwarf::Dwarf(const std::string& param) {
   kSOS=TD::Convert(sSOS);
   kEOS=TD::Convert(sEOS);
   kGOAL=TD::Convert("S")*-1;
-  _sent_id = (int *)malloc(sizeof(int));
-  *_sent_id = -1;
-  if (DEBUG) cerr << "here = " << *_sent_id << endl;
-  _fwcount = (int *)malloc(sizeof(int));
-  *_fwcount = -1;
+  _fwcount = -1;
   cerr << "initializing dwarf" << endl;
   flag_oris=false; flag_orit=false; flag_doms=false; flag_domt=false; flag_tfw_count=false;
   flag_bdoms=false; flag_porislr=false, flag_porisrl=false, flag_goris=false; flag_pgorislr=false, flag_pgorisrl=false;
@@ -219,11 +215,41 @@ Dwarf::Dwarf(const std::string& param) {
       }
     }  
   }
-  for (map<WordID,int>::const_iterator it=sfw.begin(); it!=sfw.end() && DEBUG; it++) {
+  for (FunctionWords::const_iterator it=sfw.begin(); it!=sfw.end() && DEBUG; it++) {
     cerr << "   FW:" << TD::Convert(it->first) << endl;
   }
 }
 
+void Dwarf::PrepareForInput(const SentenceMetadata& smeta) {
+  const Lattice& l = smeta.GetSourceLattice();
+  als->setSourceSentence(l,sfw);
+  _fwcount=0;
+  _lsfw.resize(l.size()+1);
+  _lsfw[0]=kSOS;
+  for (int i=0; i<l.size(); i++) {
+    const bool isfw = sfw.find(l[i][0].label)!=sfw.end();
+    if (isfw) _fwcount++;
+    _lsfw[i+1] = isfw ? l[i][0].label : _lsfw[i];
+  }
+  _rsfw.resize(l.size()+1);
+  _rsfw[l.size()]=kEOS;
+  for (int i=l.size()-1; i>=0; i--)
+    _rsfw[i] = (sfw.find(l[i][0].label)!=sfw.end()) ? l[i][0].label : _rsfw[i+1];
+  if (DEBUG) cerr << "new sentence[" << smeta.GetSentenceID() << "]="<<_fwcount<<endl;
+  _ltfw.clear(); _rtfw.clear();
+  if (flag_domt && smeta.HasReference()) {
+    const Lattice& r = smeta.GetReference();
+    _ltfw.resize(r.size()+1);
+    _rtfw.resize(r.size()+1);
+    _ltfw[0]=-1;
+    for (int i=0; i<r.size(); i++)
+      _ltfw[i+1] = (r[i].size()>0 && tfw.find(r[i][0].label)!=tfw.end()) ? r[i][0].label : _ltfw[i];
+    _rtfw[r.size()]=-1;
+    for (int i=r.size()-1; i>=0; i--)
+      _rtfw[i] = (r[i].size()>0 && tfw.find(r[i][0].label)!=tfw.end()) ? r[i][0].label : _rtfw[i+1];
+  }
+}
+
 void Dwarf::TraversalFeaturesImpl(const SentenceMetadata& smeta,
                                      const Hypergraph::Edge& edge,
                                      const std::vector<const void*>& ant_contexts,
@@ -233,21 +259,9 @@ void Dwarf::TraversalFeaturesImpl(const SentenceMetadata& smeta,
   if (DEBUG) cerr << "TraversalFeaturesImpl" << endl;
   double cost, bonus, bo1, bo2, bo1_bonus, bo2_bonus;
   double bdoms_state_mono= 0; double bdoms_state_nonmono = 0;
-  TRule r = *edge.rule_;
-  if (DEBUG) cerr << " sent_id=" << *_sent_id << ", " << smeta.GetSentenceID() << endl;
+  const TRule& r = *edge.rule_;
   if (DEBUG) cerr << "rule = " << r.AsString() << endl; 
   if (DEBUG) cerr << "rule[i,j] = " << edge.i_ << "," << edge.j_ << endl;
-  if (*_sent_id != smeta.GetSentenceID()) { //new sentence
-    *_sent_id = smeta.GetSentenceID();
-    const Lattice l = smeta.GetSourceLattice();
-    *_fwcount=0;
-    for (int i=0; i<smeta.GetSourceLength(); i++) {
-      if (sfw.find(l[i][0].label)!=sfw.end()) {
-        *_fwcount+=1;
-      }
-    }
-    if (DEBUG) cerr << "new sentence[" << *_sent_id << "]="<<*_fwcount<<endl;
-  }
   bool nofw = als->prepare(*edge.rule_, ant_contexts, sfw, tfw,smeta.GetSourceLattice(),edge.i_,edge.j_); 
   bool isFinal = (edge.i_==0 && edge.j_==smeta.GetSourceLength() && r.GetLHS()==kGOAL);
   // prepare *nofw* outputs whether the resulting alignment, contains function words or not
@@ -277,7 +291,7 @@ void Dwarf::TraversalFeaturesImpl(const SentenceMetadata& smeta,
   if (flag_porislr) {
     cost=0; bonus=0; bo1=0; bo2=0; bo1_bonus=0; bo2_bonus=0;
     if (!nofw) 
-      als->computeOrientationSourcePos(tporislr,&cost,&bonus,&bo1,&bo1_bonus,&bo2,&bo2_bonus,*_fwcount,poris_nlr,0);
+      als->computeOrientationSourcePos(tporislr,&cost,&bonus,&bo1,&bo1_bonus,&bo2,&bo2_bonus,_fwcount,poris_nlr,0);
     if (isFinal&&!explicit_soseos) {
       cost += bonus;
       bonus = 0;
@@ -288,7 +302,7 @@ void Dwarf::TraversalFeaturesImpl(const SentenceMetadata& smeta,
   if (flag_porisrl) {
     cost=0; bonus=0; bo1=0; bo2=0; bo1_bonus=0; bo2_bonus=0;
     if (!nofw)
-      als->computeOrientationSourcePos(tporisrl,&cost,&bonus,&bo1,&bo1_bonus,&bo2,&bo2_bonus,*_fwcount,0,poris_nrl);
+      als->computeOrientationSourcePos(tporisrl,&cost,&bonus,&bo1,&bo1_bonus,&bo2,&bo2_bonus,_fwcount,0,poris_nrl);
     if (isFinal&&!explicit_soseos) {
       cost += bonus;
       bonus = 0;
@@ -299,7 +313,7 @@ void Dwarf::TraversalFeaturesImpl(const SentenceMetadata& smeta,
   if (flag_pgorislr) {
     cost=0; bonus=0; bo1=0; bo2=0; bo1_bonus=0; bo2_bonus=0;
     if (!nofw)
-      als->computeOrientationSourcePos(tpgorislr,&cost,&bonus,&bo1,&bo1_bonus,&bo2,&bo2_bonus,*_fwcount,pgoris_nlr,0);
+      als->computeOrientationSourcePos(tpgorislr,&cost,&bonus,&bo1,&bo1_bonus,&bo2,&bo2_bonus,_fwcount,pgoris_nlr,0);
     if (isFinal&&!explicit_soseos) {
       cost += bonus;
       bonus = 0;
@@ -310,7 +324,7 @@ void Dwarf::TraversalFeaturesImpl(const SentenceMetadata& smeta,
   if (flag_pgorisrl) {
     cost=0; bonus=0; bo1=0; bo2=0; bo1_bonus=0; bo2_bonus=0;
     if (!nofw)
-      als->computeOrientationSourcePos(tpgorisrl,&cost,&bonus,&bo1,&bo1_bonus,&bo2,&bo2_bonus,*_fwcount,0,pgoris_nrl);
+      als->computeOrientationSourcePos(tpgorisrl,&cost,&bonus,&bo1,&bo1_bonus,&bo2,&bo2_bonus,_fwcount,0,pgoris_nrl);
     if (isFinal&&!explicit_soseos) {
       cost += bonus;
       bonus = 0;
@@ -342,25 +356,8 @@ void Dwarf::TraversalFeaturesImpl(const SentenceMetadata& smeta,
   WordID _lfw = kSOS;
   WordID _rfw = kEOS; 
   if (flag_doms || flag_pdomslr || flag_pdomsrl || flag_pgdomslr || flag_pgdomsrl) {
-    if (DEBUG) cerr << "   seeking lfw and rfw" << endl;
-    int start = edge.i_;
-    int end   = edge.j_;
-    if (DEBUG) cerr << "   start=" << start << ", end=" << end << endl;
-    const Lattice l = smeta.GetSourceLattice();
-    for (int idx=start-1; idx>=0; idx--) {
-      if (DEBUG) cerr << "  checking idx=" << idx << ", label=" << l[idx][0].label << "-" << TD::Convert(l[idx][0].label) << endl;
-      if (sfw.find(l[idx][0].label) !=sfw.end()) {
-        if (DEBUG) cerr << "+";
-        _lfw=l[idx][0].label; break;
-      }
-    }
-    for (int idx=end; idx<l.size(); idx++) { // end or end+1
-      if (DEBUG) cerr << "  checking idx=" << idx << ", label=" << l[idx][0].label << "-" << TD::Convert(l[idx][0].label) << endl;
-      if (sfw.find(l[idx][0].label)!=sfw.end()) {
-        if (DEBUG) cerr << ".";
-        _rfw=l[idx][0].label; break;
-      }
-    }
+    _lfw = _lsfw[edge.i_];
+    _rfw = _rsfw[edge.j_];
     if (isFinal&&!explicit_soseos) {
       _lfw=kSOS; _rfw=kEOS;
     }
@@ -384,7 +381,7 @@ void Dwarf::TraversalFeaturesImpl(const SentenceMetadata& smeta,
    if (DEBUG) cerr << "   kSOS=" << kSOS << ", kEOS=" << kEOS << endl;
     cost=0; bonus=0; bo1=0; bo2=0; bo1_bonus=0; bo2_bonus=0;
     if (!nofw) als->computeDominanceSourcePos(tpdomslr,_lfw,_rfw,&cost,&bonus,
-                                           &bo1,&bo1_bonus,&bo2,&bo2_bonus,*_fwcount,pdoms_nlr,0);
+                                           &bo1,&bo1_bonus,&bo2,&bo2_bonus,_fwcount,pdoms_nlr,0);
     if (isFinal&&!explicit_soseos) {
       cost += bonus;
       bonus = 0;
@@ -395,7 +392,7 @@ void Dwarf::TraversalFeaturesImpl(const SentenceMetadata& smeta,
   if (flag_pdomsrl) {
     cost=0; bonus=0; bo1=0; bo2=0; bo1_bonus=0; bo2_bonus=0;
     if (!nofw) als->computeDominanceSourcePos(tpdomsrl,_lfw,_rfw,&cost,&bonus,
-                                           &bo1,&bo1_bonus,&bo2,&bo2_bonus,*_fwcount,0,pdoms_nrl);
+                                           &bo1,&bo1_bonus,&bo2,&bo2_bonus,_fwcount,0,pdoms_nrl);
     if (isFinal&&!explicit_soseos) {
       cost += bonus;
       bonus = 0;
@@ -406,7 +403,7 @@ void Dwarf::TraversalFeaturesImpl(const SentenceMetadata& smeta,
   if (flag_pgdomslr) {
     cost=0; bonus=0; bo1=0; bo2=0; bo1_bonus=0; bo2_bonus=0;
     if (!nofw) als->computeDominanceSourcePos(tpgdomslr,_lfw,_rfw,&cost,&bonus,
-                                           &bo1,&bo1_bonus,&bo2,&bo2_bonus,*_fwcount,pgdoms_nlr,0);
+                                           &bo1,&bo1_bonus,&bo2,&bo2_bonus,_fwcount,pgdoms_nlr,0);
     if (isFinal&&!explicit_soseos) {
       cost += bonus;
       bonus = 0;
@@ -416,7 +413,7 @@ void Dwarf::TraversalFeaturesImpl(const SentenceMetadata& smeta,
   }
   if (flag_pgdomsrl) {    cost=0; bonus=0; bo1=0; bo2=0; bo1_bonus=0; bo2_bonus=0;
     if (!nofw) als->computeDominanceSourcePos(tpgdomsrl,_lfw,_rfw,&cost,&bonus,
-                                           &bo1,&bo1_bonus,&bo2,&bo2_bonus,*_fwcount,0,pgdoms_nrl);
+                                           &bo1,&bo1_bonus,&bo2,&bo2_bonus,_fwcount,0,pgdoms_nrl);
     if (isFinal&&!explicit_soseos) {
       cost += bonus;
       bonus = 0;
@@ -453,22 +450,12 @@ void Dwarf::TraversalFeaturesImpl(const SentenceMetadata& smeta,
   }
   if (flag_domt) {
     cost=0; bonus=0; bo1=0; bo2=0; bo1_bonus=0; bo2_bonus=0;
-    WordID _lfw=-1; int start = edge.i_;
-    WordID _rfw=-1; int end   = edge.j_;
-    if (smeta.HasReference()) {
-      const Lattice l = smeta.GetReference();
-      for (int idx=start-1; idx>=0; idx--) {
-        if (l.size()>0)
-          if (tfw.find(l[idx][0].label) !=tfw.end()) {
-            _lfw=l[idx][0].label; break;
-          }
-      }
-      for (int idx=end; idx<l.size(); idx++) { // end or end+1
-        if (l[idx].size()>0)
-          if (tfw.find(l[idx][0].label)!=tfw.end()) {
-            _rfw=l[idx][0].label; break;
-          }
-      }
+    WordID _lfw=-1;
+    WordID _rfw=-1;
+    if (!_ltfw.empty()) {
+      const int last = _ltfw.size()-1;
+      _lfw = _ltfw[edge.i_<last ? edge.i_ : last];
+      if (edge.j_<last) _rfw = _rtfw[edge.j_];
     }
     //neighboringFWs(smeta.GetReference(),edge.i_,edge.j_,tfw,&_lfw,&_rfw);
     if (!nofw) als->computeDominanceTarget(tdomt,_lfw,_rfw,&cost,&bonus,
@@ -513,7 +500,7 @@ double Dwarf::IntegerToDouble(int val) {
   return (double)*pd;
 }
 
-void Dwarf::neighboringFWs(const Lattice& l, const int& i, const int& j, const map<WordID,int>& fw_hash, int* lfw, int* rfw) {
+void Dwarf::neighboringFWs(const Lattice& l, const int& i, const int& j, const FunctionWords& fw_hash, int* lfw, int* rfw) {
   *lfw=0; *rfw=0;
   int idx=i-l[i][0].dist2next;
   while (idx>=0) {
@@ -535,7 +522,7 @@ void Dwarf::neighboringFWs(const Lattice& l, const int& i, const int& j, const m
   }
 }
 
-bool Dwarf::readOrientation(CountTable* table, const std::string& filename, std::map<WordID,int> *fw, bool pos) {
+bool Dwarf::readOrientation(CountTable* table, const std::string& filename, FunctionWords* fw, bool pos) {
   // the input format is
   // source target 0 1 2 3 4 0 1 2 3 4
   // 0 -> MA, 1 -> RA, 2 -> MG, 3 -> RG, 4 -> NO_NEIGHBOR
@@ -630,7 +617,7 @@ bool Dwarf::readOrientation(CountTable* table, const std::string& filename, std:
   return true;    
 }
 
-bool Dwarf::readList(const std::string& filename, std::map<WordID,int>* fw) {
+bool Dwarf::readList(const std::string& filename, FunctionWords* fw) {
   ReadFile rf(filename);
   istream& in = *rf.stream();
   while (in) {
@@ -641,7 +628,7 @@ bool Dwarf::readList(const std::string& filename, std::map<WordID,int>* fw) {
   return true;
 }
 
-bool Dwarf::readDominance(CountTable* table, const std::string& filename, std::map<WordID,int>* fw, bool pos) {
+bool Dwarf::readDominance(CountTable* table, const std::string& filename, FunctionWords* fw, bool pos) {
   // the input format is 
   // source1 source2 target1 target2 0 1 2 3
   // 0 -> dontcase 1->leftfirst 2->rightfirst 3->neither 
@@ -734,7 +721,7 @@ bool Dwarf::readTags(const std::string& filename, std::map<WordID,WordID>* tags)
 
 bool Dwarf::generalizeOrientation(CountTable* table, const std::map<WordID,WordID>& tags, bool pos) {
   map<string,int*> generalized;
-  for (map<WordID,int*>::iterator it=table->model.begin(); it!=table->model.end(); it++) {
+  for (unordered_map<WordID,int*>::iterator it=table->model.begin(); it!=table->model.end(); it++) {
     string source, target;
     istringstream tokenizer(TD::Convert(it->first));
     tokenizer >> source >> target;
@@ -763,7 +750,7 @@ bool Dwarf::generalizeOrientation(CountTable* table, const std::map<WordID,WordI
       }
     }
   }
-  for (map<WordID,int*>::iterator it=table->model.begin(); it!=table->model.end(); it++) {
+  for (unordered_map<WordID,int*>::iterator it=table->model.begin(); it!=table->model.end(); it++) {
     string source, target;
     istringstream tokenizer(TD::Convert(it->first));
     tokenizer >> source >> target;
@@ -795,7 +782,7 @@ bool Dwarf::generalizeOrientation(CountTable* table, const std::map<WordID,WordI
 bool Dwarf::generalizeDominance(CountTable* table, const std::map<WordID,WordID>& tags, bool pos) {
   map<string,int*> generalized;
   ostringstream oss;
-  for (map<WordID,int*>::iterator it=table->model.begin(); it!=table->model.end(); it++) {
+  for (unordered_map<WordID,int*>::iterator it=table->model.begin(); it!=table->model.end(); it++) {
     string source1, source2, target1, target2;
     string idx1 = ""; string idx2 = "";
     istringstream tokenizer(TD::Convert(it->first));
@@ -845,7 +832,7 @@ bool Dwarf::generalizeDominance(CountTable* table, const std::map<WordID,WordID>
     }
   }
 
-  for (map<WordID,int*>::iterator it=table->model.begin(); it!=table->model.end(); it++) {
+  for (unordered_map<WordID,int*>::iterator it=table->model.begin(); it!=table->model.end(); it++) {
     string source1, source2, target1, target2;
     string idx1 = ""; string idx2 = "";
     istringstream tokenizer(TD::Convert(it->first));
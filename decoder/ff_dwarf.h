@@ -20,10 +20,10 @@ class Dwarf : public FeatureFunction {
   static const int IMPOSSIBLY_LARGE_POS = 9999999;
   static const int MAXIMUM_ALIGNMENTS=37;
   /* Read from file the Orientation(Source|Target model parameter. */ 
-  static bool readOrientation(CountTable* table, const std::string& filename, std::map<WordID,int> *fw, bool pos=false);
+  static bool readOrientation(CountTable* table, const std::string& filename, FunctionWords* fw, bool pos=false);
   /* Read from file the Dominance(Source|Target) model parameter. */ 
-  static bool readDominance(CountTable* table, const std::string& filename, std::map<WordID,int> *fw, bool pos=false);
-  static bool readList(const std::string& filename, std::map<WordID,int>* fw);     
+  static bool readDominance(CountTable* table, const std::string& filename, FunctionWords* fw, bool pos=false);
+  static bool readList(const std::string& filename, FunctionWords* fw);     
   static double IntegerToDouble(int val);
   static int DoubleToInteger(double val);
   bool readTags(const std::string& filename, std::map<WordID,WordID>* tags);
@@ -61,6 +61,7 @@ class Dwarf : public FeatureFunction {
                                      SparseVector<double>* features,
                                      SparseVector<double>* estimated_features,
                                      void* context) const;
+  virtual void PrepareForInput(const SentenceMetadata& smeta);
  private:
   Alignment* als;
   /* Feature IDs set by calling FD::Convert(model's string) */
@@ -76,8 +77,12 @@ class Dwarf : public FeatureFunction {
   int pgoris_nlr, pgoris_nrl;
   int pdoms_nlr, pdoms_nrl;
   int pgdoms_nlr, pgdoms_nrl;
-  int* _sent_id;
-  int* _fwcount;
+  /* set by PrepareForInput for the sentence being decoded */
+  int _fwcount; // the number of source function words
+  std::vector<WordID> _lsfw; // _lsfw[i] is the last source function word before i, kSOS if none
+  std::vector<WordID> _rsfw; // _rsfw[j] is the first source function word at or after j, kEOS if none
+  std::vector<WordID> _ltfw; // idem for the target function words of the reference, -1 if none
+  std::vector<WordID> _rtfw;
   WordID kSOS;
   WordID kEOS;
   string sSOS;
@@ -89,12 +94,12 @@ class Dwarf : public FeatureFunction {
   bool explicit_soseos;
   bool flag_pdomslr, flag_pdomsrl, flag_pgdomslr, flag_pgdomsrl, flag_gdoms;
   /* a collection of Source function words (sfw) and Target function words (tfw) */
-  std::map<WordID,int> sfw;
-  std::map<WordID,int> tfw;
+  FunctionWords sfw;
+  FunctionWords tfw;
   std::map<WordID,WordID> tags;
   /* a collection of model's parameter */
   CountTable toris, torit, tdoms, tbdoms, tdomt, tporislr, tporisrl, tgoris, tpgorislr, tpgorisrl;
   CountTable tpdomslr, tpdomsrl, tpgdomslr, tpgdomsrl;
-  void neighboringFWs(const Lattice& l, const int& i, const int& j, const map<WordID,int>& fw_hash, int* lfw, int* rfw);
+  void neighboringFWs(const Lattice& l, const int& i, const int& j, const FunctionWords& fw_hash, int* lfw, int* rfw);
 };
 
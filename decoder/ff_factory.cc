@@ -67,6 +67,21 @@ mr_vest_generate_mapper_input.o:/nfs/topaz/graehl/ws10smt/vest/mr_vest_generate_
 */
 FsaFFRegistry fsa_ff_registry;
 FFRegistry ff_registry;
+FusedModelSetRegistry fused_ms_registry;
+
+FusedModelSetFactory::~FusedModelSetFactory() {}
+
+void FusedModelSetRegistry::Register(FusedModelSetFactory* factory) {
+  reg_.push_back(boost::shared_ptr<FusedModelSetFactory>(factory));
+}
+
+FusedModelSet* FusedModelSetRegistry::Create(const vector<const FeatureFunction*>& models,
+                                             const vector<int>& state_pos) const {
+  for (unsigned i = 0; i < reg_.size(); ++i)
+    if (FusedModelSet* fused = reg_[i]->Create(models, state_pos))
+      return fused;
+  return NULL;
+}
 
 /*
 #include "null_deleter.h"
@@ -16,6 +16,7 @@
 #include <iostream>
 #include <string>
 #include <map>
+#include <vector>
 #include <stdexcept>
 
 #include <boost/shared_ptr.hpp>
@@ -23,9 +24,14 @@
 #include "ff_fsa_dynamic.h"
 
 class FeatureFunction;
+struct FusedModelSet;
 
 class FsaFeatureFunction;
 
+// what a feature function was created from, see FeatureFunction::config_
+inline void SetFFConfig(FeatureFunction* ff, const std::string& config) { ff->config_ = config; }
+inline void SetFFConfig(FsaFeatureFunction*, const std::string&) {}
+
 
 struct UntypedFactory {
   virtual ~UntypedFactory();
@@ -101,6 +107,7 @@ struct FactoryRegistry : public UntypedFactoryRegistry {
       cerr<<"debug enabled for "<<ffname<< " - remaining options: '"<<param<<"'\n";
     FP res = dynamic_cast<FB const&>(*it->second).Create(param);
     res->init_name_debug(ffname,debug);
+    SetFFConfig(res.get(), ffname + " " + param);
     // could add a res->Init() here instead of in Create if we wanted feature id to potentially differ based on the registered name rather than static usage() - of course, specific feature ids can be computed on the basis of feature param as well; this only affects the default single feature id=name
     return res;
   }
@@ -116,6 +123,29 @@ inline FFRegistry & global_ff_registry() { return ff_registry; }
 
 void ff_usage(std::string const& name,std::ostream &out=std::cout);
 
+// a StaticModelSet is a FusedModelSet for one fixed sequence of feature
+// function types (see ff_static.h).  Create returns NULL unless models are
+// exactly those types, in that order; state_pos are the ModelSet's offsets
+// of the models' states
+struct FusedModelSetFactory {
+  virtual ~FusedModelSetFactory();
+  virtual FusedModelSet* Create(const std::vector<const FeatureFunction*>& models,
+                                const std::vector<int>& state_pos) const = 0;
+};
+
+// ModelSet asks this for a fused implementation of its models, and uses the
+// per-model virtual calls if no registered factory matches
+struct FusedModelSetRegistry {
+  void Register(FusedModelSetFactory* factory);
+  FusedModelSet* Create(const std::vector<const FeatureFunction*>& models,
+                        const std::vector<int>& state_pos) const;
+  void clear() { reg_.clear(); }
+ private:
+  std::vector<boost::shared_ptr<FusedModelSetFactory> > reg_;
+};
+
+extern FusedModelSetRegistry fused_ms_registry;
+
 /*
 extern boost::shared_ptr<FsaFFRegistry> global_fsa_ff_registry;
 extern boost::shared_ptr<FFRegistry> global_ff_registry;
@@ -1,6 +1,8 @@
 #ifndef FF_FROM_FSA_H
 #define FF_FROM_FSA_H
 
+#include <string>
+#include <tr1/unordered_map>
 #include "ff_fsa.h"
 
 #ifndef TD__none
@@ -25,6 +27,12 @@
 
    usage:
    typedef FeatureFunctionFromFsa<LanguageModelFsa> LanguageModelFromFsa;
+
+   if Impl::memoize_scans, the end state and score of scanning some words
+   from some state are remembered, so the same rule words (or child left
+   words) scanned from the same state again, e.g. by the many uses of a rule
+   on top of items with the same right state, are looked up instead of
+   scanned.
 */
 
 template <class Impl>
@@ -127,11 +135,11 @@ public:
           left_out=(W)left_full;
           // heuristic known now
           fsa.reset(ff.heuristic_start_state());
-          fsa.scan(left_begin,left_full,&h_accum); // save heuristic (happens once only)
-          fsa.scan(al+ntofill,ale,&accum); // because of markov order, fully filled left words scored starting at h_start put us in the right state to score the extra words (which are forgotten)
+          scan(fsa,left_begin,left_full,&h_accum); // save heuristic (happens once only)
+          scan(fsa,al+ntofill,ale,&accum); // because of markov order, fully filled left words scored starting at h_start put us in the right state to score the extra words (which are forgotten)
           al+=ntofill; // we used up the first ntofill words of al to end up in some known state via exactly M words total (M-ntofill were there beforehand).  now we can scan the remaining al words of this child
         } else { // more to score / state to update (left already full)
-          fsa.scan(al,ale,&accum);
+          scan(fsa,al,ale,&accum);
         }
         if (anw==M)
           fsa.reset(fsa_state(a));
@@ -144,17 +152,17 @@ public:
           *left_out++=ew;
           if (left_out==left_full) { // handle heuristic, once only, establish state
             fsa.reset(ff.heuristic_start_state());
-            fsa.scan(left_begin,left_full,&h_accum); // save heuristic (happens only once)
+            scan(fsa,left_begin,left_full,&h_accum); // save heuristic (happens only once)
           }
         } else {
-          if (Impl::simple_phrase_score) {
+          if (Impl::simple_phrase_score && !Impl::memoize_scans) {
             fsa.scan(ew,&accum); // single word scan isn't optimal if phrase is different
             FSAFFDBG(edge,' '<<TD::Convert(ew));
           } else {
             int k=j;
             while(k<ee) if (!RHS_WORD(++k)) break;
             FSAFFDBG(edge," rule-phrase["<<TD::GetString(&e[j],&e[k])<<']');
-            fsa.scan(&e[j],&e[k],&accum);
+            scan(fsa,&e[j],&e[k],&accum);
             if (k==ee) goto s_rhs_done;
             j=k;
             goto s_rhs_next;
@@ -171,7 +179,7 @@ public:
       do { *left_out++=TD__none; } while(left_out<left_full); // none-terminate so left_end(out_state) will know how many words
       ff.state_zero(out_fsa_state); // so we compare / hash correctly. don't know state yet because left context isn't full
     } else // or else store final right-state.  heuristic was already assigned
-      ff.state_copy(out_fsa_state,fsa.cs);
+      ff.state_copy(out_fsa_state,fsa.state());
     accum.Store(ff,features);
     h_accum.Store(ff,estimated_features);
     FSAFFDBG(edge," = " << describe_state(out_state)<<" "<<name<<"="<<accum.describe(ff)<<" h="<<h_accum.describe(ff)<<")");
@@ -260,6 +268,39 @@ public:
 private:
   Impl ff;
   int M; // markov order (ctx len)
+
+  // Impl::memoize_scans: state bytes followed by the words -> result of scanning them
+  struct Scanned {
+    Bytes to;
+    typename Impl::Accum accum;
+  };
+  typedef std::tr1::unordered_map<std::string,Scanned> Memo;
+  static const unsigned MAX_MEMO=1<<20; // entries; forgotten all at once when full
+  mutable Memo memo_;
+  mutable std::string memo_key_;
+
+  template <class Accum>
+  void scan(FsaScanner<Impl> &fsa,WP i,WP end,Accum *a) const {
+    if (!Impl::memoize_scans || i==end) {
+      fsa.scan(i,end,a);
+      return;
+    }
+    memo_key_.assign((char const*)fsa.state(),ssz);
+    memo_key_.append((char const*)i,(char const*)end);
+    typename Memo::iterator it=memo_.find(memo_key_);
+    if (it==memo_.end()) {
+      if (memo_.size()>=MAX_MEMO) {
+        fsa.own(); // it may be looking at a memo entry
+        memo_.clear();
+      }
+      Scanned s;
+      fsa.scan(i,end,&s.accum);
+      s.to=Bytes((uint8_t const*)fsa.state(),(uint8_t const*)fsa.state()+ssz);
+      it=memo_.insert(typename Memo::value_type(memo_key_,s)).first;
+    } else
+      fsa.reset(it->second.to.begin());
+    *a+=it->second.accum;
+  }
   FeatureFunctionFromFsa(); // not allowed.
 
   int state_offset; // NOTE: in bytes (add to char* only). store left-words first, then fsa state
@@ -196,6 +196,9 @@ public:
   }
 
 
+  // set this true if scanning depends on nothing but the state and the words (not on the edge or sentence), so that ff_from_fsa may reuse the result of scanning the same words from the same state
+  static const bool memoize_scans=false;
+
   static const bool simple_phrase_score=true; // if d().simple_phrase_score_, then you should expect different Phrase scores for phrase length > M.  so, set this false if you provide ScanPhraseAccum (SCAN_PHRASE_ACCUM_OVERRIDE macro does this)
 
   // override this (and use SCAN_PHRASE_ACCUM_OVERRIDE  ) if you want e.g. maximum possible order ngram scores with markov_order < n-1.  in the future SparseFeatureAccumulator will probably be the only option for type-erased FSA ffs.
@@ -355,13 +358,15 @@ template <class FF>
 struct FsaScanner {
 //  enum {ALIGN=8};
   static const int ALIGN=8;
+  static const int INLINE_BYTES=64; // states up to this size are kept in the scanner itself rather than on the heap
   FF const& ff;
   SentenceMetadata const& smeta;
   int ssz;
-  Bytes states; // first is at begin, second is at (char*)begin+stride
+  uint64_t inline_states[2*INLINE_BYTES/sizeof(uint64_t)];
+  Bytes states; // if the state is too big for inline_states
   void *st0; // states
   void *st1; // states+stride
-  void *cs; // initially st0, alternates between st0 and st1
+  void const* cs; // the current state: st0, st1, or the state last passed to reset
   inline void *nexts() const {
     return (cs==st0)?st1:st0;
   }
@@ -370,14 +375,30 @@ struct FsaScanner {
   {
     ssz=ff.state_bytes();
     int stride=((ssz+ALIGN-1)/ALIGN)*ALIGN; // round up to multiple of ALIGN
-    states.resize(stride+ssz);
-    st0=states.begin();
+    if (stride+ssz<=(int)sizeof(inline_states))
+      st0=inline_states;
+    else {
+      states.resize(stride+ssz);
+      st0=states.begin();
+    }
     st1=(char*)st0+stride;
+    cs=st0;
 //    for (int i=0;i<2;++i) st[i]=cs+(i*stride);
   }
+  // no copy: state is only read until a phrase scan would overwrite it (see own), so it must stay valid until then
   void reset(void const* state) {
-    cs=st0;
-    std::memcpy(st0,state,ssz);
+    cs=state;
+  }
+  void const* state() const {
+    return cs;
+  }
+  // copies the current state into our buffers if it isn't there already
+  void *own() {
+    if (cs!=st0 && cs!=st1) {
+      std::memcpy(st0,cs,ssz);
+      cs=st0;
+    }
+    return (void*)cs;
   }
   template <class Accum>
   void scan(WordID w,Accum *a) {
@@ -387,8 +408,9 @@ struct FsaScanner {
   }
   template <class Accum>
   void scan(WordID const* i,WordID const* end,Accum *a) {
-    // faster. and allows greater-order excursions
-    cs=ff.ScanPhraseAccumBounce(smeta,edge,i,end,cs,nexts(),a);
+    // faster. and allows greater-order excursions.  bounces between both buffers, so the current state must be ours
+    void *c=own();
+    cs=ff.ScanPhraseAccumBounce(smeta,edge,i,end,c,nexts(),a);
   }
 };
 
@@ -12,6 +12,7 @@ struct SentenceMetadata;
 //FIXME: diamond inheritance problem.  make a copy of the fixed data?  or else make the dynamic version not wrap but rather be templated CRTP base (yuck)
 struct FsaFeatureFunction : public FsaFeatureFunctionData {
   static const bool simple_phrase_score=false;
+  static const bool memoize_scans=false;
   virtual int markov_order() const = 0;
 
   // see ff_fsa.h - FsaFeatureFunctionBase<Impl> gives you reasonable impls of these if you override just ScanAccum
@@ -57,6 +58,7 @@ struct FsaFeatureFunction : public FsaFeatureFunctionData {
 template <class Impl>
 struct FsaFeatureFunctionDynamic : public FsaFeatureFunction {
   static const bool simple_phrase_score=Impl::simple_phrase_score;
+  static const bool memoize_scans=Impl::memoize_scans;
   Impl& d() { return impl;//static_cast<Impl&>(*this);
   }
   Impl const& d() const { return impl;
@@ -129,6 +131,7 @@ template <class Impl>
 struct FsaFeatureFunctionPimpl : public FsaFeatureFunctionData {
   typedef boost::shared_ptr<Impl const> Pimpl;
   static const bool simple_phrase_score=Impl::simple_phrase_score;
+  static const bool memoize_scans=Impl::memoize_scans;
   Impl const& d() const { return *p_; }
   int markov_order() const { return d().markov_order(); }
 
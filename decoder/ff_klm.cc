@@ -1,14 +1,22 @@
 #include "ff_klm.h"
 
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <map>
 
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
 
 #include "filelib.h"
 #include "stringlib.h"
 #include "hg.h"
+#include "sentence_metadata.h"
 #include "tdict.h"
+#include "timing_stats.h"
+#include "verbose.h"
 #include "lm/model.hh"
 #include "lm/enumerate_vocab.hh"
 
@@ -18,13 +26,24 @@ static const unsigned char HAS_FULL_CONTEXT = 1;
 static const unsigned char HAS_EOS_ON_RIGHT = 2;
 static const unsigned char MASK             = 7;
 
+static const ProfileCounter lm_queries("lm_queries");
+
 // -x : rules include <s> and </s>
 // -n NAME : feature id is NAME
-bool ParseLMArgs(string const& in, string* filename, string* mapfile, bool* explicit_markers, string* featname) {
+// -c N : memoize up to N (rounded up to a power of 2) n-gram scores per sentence
+// -l lazy|populate|read : how a binary LM is brought into memory (default populate)
+// -H : ask for huge pages for a binary LM
+// -W : madvise(MADV_WILLNEED) a binary LM (with -l lazy, starts readahead)
+// -o N : use only the n-grams up to order N, e.g. for a coarse pass with the
+//        fine pass's LM; of a binary LM only those are loaded
+// A filename shm:NAME loads a binary LM that build_binary wrote to shared
+// memory; all processes share its pages unless -l read copies them.
+bool ParseLMArgs(string const& in, string* filename, string* mapfile, bool* explicit_markers, string* featname, int* cache_size, lm::ngram::Config* conf) {
   vector<string> const& argv=SplitOnWhitespace(in);
   *explicit_markers = false;
   *featname="LanguageModel";
   *mapfile = "";
+  *cache_size = 0;
 #define LMSPEC_NEXTARG if (i==argv.end()) {            \
     cerr << "Missing argument for "<<*last<<". "; goto usage; \
     } else { ++i; }
@@ -43,6 +62,30 @@ bool ParseLMArgs(string const& in, string* filename, string* mapfile, bool* expl
       case 'n':
         LMSPEC_NEXTARG; *featname=*i;
         break;
+      case 'c':
+        LMSPEC_NEXTARG; *cache_size=atoi(i->c_str());
+        if (*cache_size < 0) goto fail;
+        break;
+      case 'l':
+        LMSPEC_NEXTARG;
+        if (*i == "lazy") conf->load_method = util::LAZY;
+        else if (*i == "populate") conf->load_method = util::POPULATE_OR_READ;
+        else if (*i == "read") conf->load_method = util::READ;
+        else goto fail;
+        break;
+      case 'H':
+        conf->load_advice.huge_pages = true;
+        break;
+      case 'W':
+        conf->load_advice.will_need = true;
+        break;
+      case 'o': {
+        LMSPEC_NEXTARG;
+        const int order = atoi(i->c_str());
+        if (order < 2 || order > 255) goto fail;
+        conf->max_order = order;
+        break;
+      }
 #undef LMSPEC_NEXTARG
       default:
       fail:
@@ -70,16 +113,123 @@ string KLanguageModel<Model>::usage(bool /*param*/,bool /*verbose*/) {
   return "KLanguageModel";
 }
 
+// collects the LM vocabulary as it is enumerated and converts all of it
+// to cdec ids at once in Finish(), rather than taking the TD lock and
+// copying each word into a std::string one by one
 struct VMapper : public lm::ngram::EnumerateVocab {
   VMapper(vector<lm::WordIndex>* out) : out_(out), kLM_UNKNOWN_TOKEN(0) { out_->clear(); }
   void Add(lm::WordIndex index, const StringPiece &str) {
-    const WordID cdec_id = TD::Convert(str.as_string());
-    if (cdec_id >= out_->size())
-      out_->resize(cdec_id + 1, kLM_UNKNOWN_TOKEN);
-    (*out_)[cdec_id] = index;
+    words_.append(str.data(), str.size());
+    ends_.push_back(words_.size());
+    indices_.push_back(index);
+  }
+  void Finish() {
+    vector<WordID> cdec_ids;
+    TD::ConvertMany(words_, ends_, &cdec_ids);
+    const WordID max_id = cdec_ids.empty() ? 0 : *max_element(cdec_ids.begin(), cdec_ids.end());
+    out_->resize(max_id + 1, kLM_UNKNOWN_TOKEN);
+    for (unsigned i = 0; i < cdec_ids.size(); ++i)
+      (*out_)[cdec_ids[i]] = indices_[i];
   }
   vector<lm::WordIndex>* out_;
   const lm::WordIndex kLM_UNKNOWN_TOKEN;
+  string words_;
+  vector<unsigned> ends_;
+  vector<lm::WordIndex> indices_;
+};
+
+// KenLM models are immutable once loaded, so every KLanguageModel instance
+// in the process that names the same file (e.g., the per-thread decoders
+// created by cdec --threads) with the same -o shares one copy of the model
+// and vocab map
+template <class Model>
+struct SharedKLM {
+  boost::shared_ptr<Model> model;
+  boost::shared_ptr<const vector<lm::WordIndex> > cdec2klm_map;
+};
+
+template <class Model>
+static SharedKLM<Model> LoadSharedKLM(const string& filename, const lm::ngram::Config& load_conf) {
+  typedef pair<boost::weak_ptr<Model>, boost::weak_ptr<const vector<lm::WordIndex> > > Entry;
+  static map<pair<string, unsigned char>, Entry> cache;
+  Entry& cached = cache[make_pair(filename, load_conf.max_order)];
+  SharedKLM<Model> res;
+  res.model = cached.first.lock();
+  res.cdec2klm_map = cached.second.lock();
+  if (!res.model || !res.cdec2klm_map) {
+    vector<lm::WordIndex>* cdec2klm_map = new vector<lm::WordIndex>;
+    res.cdec2klm_map.reset(cdec2klm_map);
+    VMapper vm(cdec2klm_map);
+    lm::ngram::Config conf(load_conf);
+    conf.enumerate_vocab = &vm;
+    res.model.reset(new Model(filename.c_str(), conf));
+    vm.Finish();
+    cached.first = res.model;
+    cached.second = res.cdec2klm_map;
+  } else {
+    cerr << "Sharing previously loaded KLM " << filename << endl;
+  }
+  return res;
+}
+
+// direct-mapped memo of Score(in, word) keyed on (context state, word).  It
+// is emptied in O(1) at the start of each sentence by bumping the generation
+// number; entries left over from earlier generations never match.
+struct KLMScoreCache {
+  struct Entry {
+    Entry() : word(0), generation(0), prob(0) {}
+    lm::ngram::State in;
+    lm::ngram::State out;
+    lm::WordIndex word;
+    unsigned generation;
+    float prob;
+  };
+
+  KLMScoreCache() : generation_(0), queries_(0), hits_(0) {}
+
+  bool enabled() const { return !entries_.empty(); }
+
+  void Resize(int size) {
+    int n = 1;
+    while (n < size) n <<= 1;
+    entries_.clear();
+    if (size > 0) entries_.resize(n);
+    generation_ = 1;
+  }
+
+  void Reset() {
+    ++generation_;
+    queries_ = hits_ = 0;
+    if (generation_ == 0) {  // wrapped around
+      for (int i = 0; i < entries_.size(); ++i) entries_[i].generation = 0;
+      generation_ = 1;
+    }
+  }
+
+  // returns the entry for (in, word); *hit is true if it holds its score
+  Entry& Find(const lm::ngram::State& in, lm::WordIndex word, bool* hit) {
+    ++queries_;
+    const size_t h = lm::ngram::hash_value(in) * 0x9e3779b1u + word;
+    Entry& e = entries_[h & (entries_.size() - 1)];
+    *hit = (e.generation == generation_ && e.word == word && e.in == in);
+    if (*hit) {
+      ++hits_;
+    } else {
+      e.in = in;
+      e.word = word;
+      e.generation = generation_;
+    }
+    return e;
+  }
+
+  size_t queries() const { return queries_; }
+  size_t hits() const { return hits_; }
+
+ private:
+  vector<Entry> entries_;
+  unsigned generation_;
+  size_t queries_;
+  size_t hits_;
 };
 
 template <class Model>
@@ -94,14 +244,27 @@ class KLanguageModelImpl {
     *(static_cast<char*>(state) + unscored_size_offset_) = size;
   }
 
-  static inline const lm::ngram::State& RemnantLMState(const void* state) {
-    return *static_cast<const lm::ngram::State*>(state);
+  // The remnant LM state is stored packed: valid_length_, then order-1
+  // history words and order-1 backoffs.  lm::ngram::State has room for
+  // kMaxOrder-1 of each, most of which a lower order model never uses, and
+  // the smaller state is cheaper to copy, hash and compare.
+  inline lm::ngram::State RemnantLMState(const void* state) const {
+    const char* mem = static_cast<const char*>(state);
+    lm::ngram::State lmstate;
+    lmstate.valid_length_ = *mem;
+    memcpy(lmstate.history_, mem + 1, (order_ - 1) * sizeof(lm::WordIndex));
+    memcpy(lmstate.backoff_, mem + 1 + (order_ - 1) * sizeof(lm::WordIndex), (order_ - 1) * sizeof(float));
+    lmstate.ZeroRemaining();
+    return lmstate;
   }
 
+  // lmstate must have had ZeroRemaining() called so the packed bytes only
+  // depend on the valid history
   inline void SetRemnantLMState(const lm::ngram::State& lmstate, void* state) const {
-    // if we were clever, we could use the memory pointed to by state to do all
-    // the work, avoiding this copy
-    memcpy(state, &lmstate, ngram_->StateSize());
+    char* mem = static_cast<char*>(state);
+    *mem = lmstate.valid_length_;
+    memcpy(mem + 1, lmstate.history_, (order_ - 1) * sizeof(lm::WordIndex));
+    memcpy(mem + 1 + (order_ - 1) * sizeof(lm::WordIndex), lmstate.backoff_, (order_ - 1) * sizeof(float));
   }
 
   lm::WordIndex IthUnscoredWord(int i, const void* state) const {
@@ -165,7 +328,7 @@ class KLanguageModelImpl {
             }
           } else {
             const lm::ngram::State scopy(state);
-            p = ngram_->Score(scopy, cur_word, state);
+            p = Score(scopy, cur_word, &state);
             if (saw_eos) { p = -100; }
             saw_eos = (cur_word == kEOS_);
           }
@@ -206,7 +369,7 @@ class KLanguageModelImpl {
           }
         } else {
           const lm::ngram::State scopy(state);
-          p = ngram_->Score(scopy, cur_word, state);
+          p = Score(scopy, cur_word, &state);
           if (saw_eos) { p = -100; }
           saw_eos = (cur_word == kEOS_);
         }
@@ -238,6 +401,54 @@ class KLanguageModelImpl {
     return sum;
   }
 
+  // ngram_->Score, going through the cache if there is one
+  double Score(const lm::ngram::State& in, const lm::WordIndex word, lm::ngram::State* out) {
+    ++queries_;
+    if (!cache_.enabled()) return ngram_->Score(in, word, *out);
+    bool hit;
+    KLMScoreCache::Entry& e = cache_.Find(in, word, &hit);
+    if (!hit) e.prob = ngram_->Score(in, word, e.out);
+    *out = e.out;
+    return e.prob;
+  }
+
+  // prefetches the n-gram probes LookupWords(rule, ant_states, ...) is going
+  // to make.  Each word is assumed to see the longest context it can have,
+  // so this may also fetch some entries the lookups end up not needing.
+  void PrefetchWords(const TRule& rule, const vector<const void*>& ant_states) const {
+    lm::WordIndex context[lm::ngram::kMaxOrder];  // most recent word first
+    int context_len = 0;
+    const vector<WordID>& e = rule.e();
+    for (int j = 0; j < e.size(); ++j) {
+      if (e[j] < 1) {
+        const void* astate = (ant_states[-e[j]]);
+        const int unscored_ant_len = UnscoredSize(astate);
+        for (int k = 0; k < unscored_ant_len; ++k)
+          PrefetchWord(IthUnscoredWord(k, astate), context, &context_len);
+        if (HasFullContext(astate)) {
+          const lm::ngram::State remnant = RemnantLMState(astate);
+          context_len = remnant.valid_length_;
+          copy(remnant.history_, remnant.history_ + context_len, context);
+        }
+      } else {
+        PrefetchWord(MapWord(ClassifyWordIfNecessary(e[j])), context, &context_len);
+      }
+    }
+  }
+
+  void PrefetchWord(const lm::WordIndex word, lm::WordIndex* context, int* context_len) const {
+    if (word == kSOS_) {
+      context[0] = kSOS_;
+      *context_len = 1;
+      return;
+    }
+    ngram_->Prefetch(context, context + *context_len, word);
+    const int len = min(*context_len + 1, order_ - 1);
+    copy_backward(context, context + len - 1, context + len);
+    context[0] = word;
+    *context_len = len;
+  }
+
   // this assumes no target words on final unary -> goal rule.  is that ok?
   // for <s> (n-1 left words) and (n-1 right words) </s>
   double FinalTraversalCost(const void* state, double* oovs) {
@@ -273,26 +484,27 @@ class KLanguageModelImpl {
 
   // converts to cdec word id's to KenLM's id space, OOVs and <unk> end up at 0
   lm::WordIndex MapWord(WordID w) const {
-    if (w >= cdec2klm_map_.size())
+    if (w >= cdec2klm_map_->size())
       return 0;
     else
-      return cdec2klm_map_[w];
+      return (*cdec2klm_map_)[w];
   }
 
  public:
-  KLanguageModelImpl(const string& filename, const string& mapfile, bool explicit_markers) :
+  KLanguageModelImpl(const string& filename, const string& mapfile, bool explicit_markers, int cache_size, const lm::ngram::Config& load_conf) :
       kCDEC_UNK(TD::Convert("<unk>")) ,
-      add_sos_eos_(!explicit_markers) {
+      add_sos_eos_(!explicit_markers),
+      queries_(0) {
     {
-      VMapper vm(&cdec2klm_map_);
-      lm::ngram::Config conf;
-      conf.enumerate_vocab = &vm;
-      ngram_ = new Model(filename.c_str(), conf);
+      SharedKLM<Model> shared = LoadSharedKLM<Model>(filename, load_conf);
+      ngram_ = shared.model;
+      cdec2klm_map_ = shared.cdec2klm_map;
     }
     order_ = ngram_->Order();
-    cerr << "Loaded " << order_ << "-gram KLM from " << filename << " (MapSize=" << cdec2klm_map_.size() << ")\n";
-    state_size_ = ngram_->StateSize() + 2 + (order_ - 1) * sizeof(lm::WordIndex);
-    unscored_size_offset_ = ngram_->StateSize();
+    cerr << "Loaded " << order_ << "-gram KLM from " << filename << " (MapSize=" << cdec2klm_map_->size() << ")\n";
+    const int remnant_size = 1 + (order_ - 1) * (sizeof(lm::WordIndex) + sizeof(float));
+    state_size_ = remnant_size + 2 + (order_ - 1) * sizeof(lm::WordIndex);
+    unscored_size_offset_ = remnant_size;
     is_complete_offset_ = unscored_size_offset_ + 1;
     unscored_words_offset_ = is_complete_offset_ + 1;
 
@@ -311,6 +523,21 @@ class KLanguageModelImpl {
     // handle class-based LMs (unambiguous word->class mapping reqd.)
     if (mapfile.size())
       LoadWordClasses(mapfile);
+
+    cache_.Resize(cache_size);
+  }
+
+  void ResetCache() { cache_.Reset(); queries_ = 0; }
+
+  // calls to Score() since ResetCache(), whether or not the cache answered
+  size_t queries() const { return queries_; }
+
+  void ReportCache(int sent_id) const {
+    if (!cache_.enabled() || SILENT) return;
+    const size_t q = cache_.queries();
+    cerr << "  KLM cache (sentence " << sent_id << "): " << cache_.hits() << '/' << q << " hits";
+    if (q) cerr << " (" << (100.0 * cache_.hits() / q) << "%)";
+    cerr << endl;
   }
 
   void LoadWordClasses(const string& file) {
@@ -349,7 +576,6 @@ class KLanguageModelImpl {
   }
 
   ~KLanguageModelImpl() {
-    delete ngram_;
     delete[] dummy_state_;
   }
 
@@ -359,7 +585,7 @@ class KLanguageModelImpl {
   const WordID kCDEC_UNK;
   lm::WordIndex kSOS_;  // <s> - requires special handling.
   lm::WordIndex kEOS_;  // </s>
-  Model* ngram_;
+  boost::shared_ptr<Model> ngram_;
   const bool add_sos_eos_; // flag indicating whether the hypergraph produces <s> and </s>
                      // if this is true, FinalTransitionFeatures will "add" <s> and </s>
                      // if false, FinalTransitionFeatures will score anything with the
@@ -373,20 +599,24 @@ class KLanguageModelImpl {
   int unscored_words_offset_;
   char* dummy_state_;
   vector<const void*> dummy_ants_;
-  vector<lm::WordIndex> cdec2klm_map_;
+  boost::shared_ptr<const vector<lm::WordIndex> > cdec2klm_map_;
   vector<WordID> word2class_map_;        // if this is a class-based LM, this is the word->class mapping
   TRulePtr dummy_rule_;
+  KLMScoreCache cache_;
+  size_t queries_;
 };
 
 template <class Model>
 KLanguageModel<Model>::KLanguageModel(const string& param) {
   string filename, mapfile, featname;
   bool explicit_markers;
-  if (!ParseLMArgs(param, &filename, &mapfile, &explicit_markers, &featname)) {
+  int cache_size;
+  lm::ngram::Config load_conf;
+  if (!ParseLMArgs(param, &filename, &mapfile, &explicit_markers, &featname, &cache_size, &load_conf)) {
     abort();
   }
   try {
-    pimpl_ = new KLanguageModelImpl<Model>(filename, mapfile, explicit_markers);
+    pimpl_ = new KLanguageModelImpl<Model>(filename, mapfile, explicit_markers, cache_size, load_conf);
   } catch (std::exception &e) {
     std::cerr << e.what() << std::endl;
     abort();
@@ -407,6 +637,17 @@ KLanguageModel<Model>::~KLanguageModel() {
   delete pimpl_;
 }
 
+template <class Model>
+void KLanguageModel<Model>::PrepareForInput(const SentenceMetadata& /* smeta */) {
+  pimpl_->ResetCache();
+}
+
+template <class Model>
+void KLanguageModel<Model>::FinishInput(const SentenceMetadata& smeta) {
+  pimpl_->ReportCache(smeta.GetSentenceID());
+  lm_queries.Add(pimpl_->queries());
+}
+
 template <class Model>
 void KLanguageModel<Model>::TraversalFeaturesImpl(const SentenceMetadata& /* smeta */,
                                           const Hypergraph::Edge& edge,
@@ -425,6 +666,13 @@ void KLanguageModel<Model>::TraversalFeaturesImpl(const SentenceMetadata& /* sme
   }
 }
 
+template <class Model>
+void KLanguageModel<Model>::PrefetchTraversal(const SentenceMetadata& /* smeta */,
+                                              const Hypergraph::Edge& edge,
+                                              const vector<const void*>& ant_states) const {
+  pimpl_->PrefetchWords(*edge.rule_, ant_states);
+}
+
 template <class Model>
 void KLanguageModel<Model>::FinalTraversalFeatures(const void* ant_state,
                                            SparseVector<double>* features) const {
@@ -446,13 +694,17 @@ boost::shared_ptr<FeatureFunction> KLanguageModelFactory::Create(std::string par
   std::string filename, ignored_map;
   bool ignored_markers;
   std::string ignored_featname;
-  ParseLMArgs(param, &filename, &ignored_map, &ignored_markers, &ignored_featname);
+  int ignored_cache_size;
+  Config ignored_conf;
+  ParseLMArgs(param, &filename, &ignored_map, &ignored_markers, &ignored_featname, &ignored_cache_size, &ignored_conf);
   ModelType m;
   if (!RecognizeBinary(filename.c_str(), m)) m = HASH_PROBING;
 
   switch (m) {
     case HASH_PROBING:
       return CreateModel<ProbingModel>(param);
+    case HASH_GROUP_PROBING:
+      return CreateModel<GroupProbingModel>(param);
     case TRIE_SORTED:
       return CreateModel<TrieModel>(param);
     case ARRAY_TRIE_SORTED:
@@ -14,13 +14,19 @@ template <class Model> struct KLanguageModelImpl;
 template <class Model>
 class KLanguageModel : public FeatureFunction {
  public:
-  // param = "filename.lm [-o n]"
+  // param = "filename.lm [-x] [-m classes] [-n name] [-c cache_size]"
   KLanguageModel(const std::string& param);
   ~KLanguageModel();
   virtual void FinalTraversalFeatures(const void* context,
                                       SparseVector<double>* features) const;
   static std::string usage(bool param,bool verbose);
   Features features() const;
+  virtual void PrepareForInput(const SentenceMetadata& smeta);
+  virtual void FinishInput(const SentenceMetadata& smeta);
+  virtual void PrefetchTraversal(const SentenceMetadata& smeta,
+                                 const Hypergraph::Edge& edge,
+                                 const std::vector<const void*>& ant_contexts) const;
+  friend struct StaticFF<KLanguageModel>;
  protected:
   virtual void TraversalFeaturesImpl(const SentenceMetadata& smeta,
                                      const Hypergraph::Edge& edge,
@@ -36,6 +36,7 @@ struct LanguageModelFsa : public FsaFeatureFunctionBase<LanguageModelFsa> {
 
   // overrides; implementations in ff_lm.cc
   typedef SingleFeatureAccumulator Accum;
+  static const bool memoize_scans=true; // scores depend only on the context and the words
   static std::string usage(bool,bool);
   LanguageModelFsa(std::string const& param);
   int markov_order() const { return ctxlen_; }
@@ -2,47 +2,60 @@
 
 #include <cstring>
 #include <iostream>
+#include <sstream>
 
+#include <tr1/unordered_map>
 #include <boost/scoped_ptr.hpp>
 
 #include "filelib.h"
+#include "hash.h"
 #include "stringlib.h"
 #include "hg.h"
 #include "tdict.h"
 
 using namespace std;
+using namespace std::tr1;
 
 static const unsigned char HAS_FULL_CONTEXT = 1;
 static const unsigned char HAS_EOS_ON_RIGHT = 2;
 static const unsigned char MASK             = 7;
 
 namespace {
-template <unsigned MAX_ORDER = 5>
+// the last ORDER - 1 words of a hypothesis.  the order is a template
+// parameter so that copying and shifting a state are fixed-length loops
+template <int ORDER>
 struct State {
-  explicit State() {
-    memset(state, 0, sizeof(state));
+  enum { kCONTEXT = ORDER - 1, kWORDS = ORDER > 1 ? ORDER - 1 : 1 };
+  State() {
+    for (int i = 0; i < kWORDS; ++i) state[i] = 0;
   }
-  explicit State(int order) {
-    memset(state, 0, (order - 1) * sizeof(WordID));
+  explicit State(const WordID* mem) {
+    for (int i = 0; i < kWORDS; ++i) state[i] = i < kCONTEXT ? mem[i] : 0;
   }
-  State<MAX_ORDER>(char order, const WordID* mem) {
-    memcpy(state, mem, (order - 1) * sizeof(WordID));
-  }
-  State(const State<MAX_ORDER>& other) {
-    memcpy(state, other.state, sizeof(state));
-  }
-  const State& operator=(const State<MAX_ORDER>& other) {
-    memcpy(state, other.state, sizeof(state));
-  }
-  explicit State(const State<MAX_ORDER>& other, unsigned order, WordID extend) {
-    char om1 = order - 1;
-    assert(om1 > 0);
-    for (char i = 1; i < om1; ++i) state[i - 1]= other.state[i];
-    state[om1 - 1] = extend;
+  // other shifted left by one word, with extend as the last word
+  State(const State<ORDER>& other, WordID extend) {
+    for (int i = 1; i < kCONTEXT; ++i) state[i - 1] = other.state[i];
+    if (kCONTEXT > 0) state[kCONTEXT - 1] = extend;
   }
   const WordID& operator[](size_t i) const { return state[i]; }
   WordID& operator[](size_t i) { return state[i]; }
-  WordID state[MAX_ORDER];
+  WordID state[kWORDS];
+};
+
+// an n-gram of at most N words, most recent word first, padded with 0s
+template <int N>
+struct Ngram {
+  bool operator==(const Ngram& o) const {
+    for (int i = 0; i < N; ++i)
+      if (w[i] != o.w[i]) return false;
+    return true;
+  }
+  WordID w[N];
+};
+
+template <int N>
+struct NgramHash {
+  size_t operator()(const Ngram<N>& n) const { return hash_pod_array(n.w, n.w + N); }
 };
 }
 
@@ -57,7 +70,38 @@ namespace {
   }
 }
 
+// the parts of the detector that don't depend on the order
 class NgramDetectorImpl {
+ public:
+  virtual ~NgramDetectorImpl() {
+    delete[] dummy_state_;
+  }
+  virtual void LookupWords(const TRule& rule, const vector<const void*>& ant_states, SparseVector<double>* feats, SparseVector<double>* est_feats, void* remnant) = 0;
+  virtual void FinalTraversal(const void* state, SparseVector<double>* feats) = 0;
+  // forgets the n-gram feature ids looked up for the last sentence
+  virtual void ClearCache() = 0;
+  int ReserveStateSize() const { return state_size_; }
+
+ protected:
+  NgramDetectorImpl(int order, bool explicit_markers) :
+      kCDEC_UNK(TD::Convert("<unk>")) ,
+      add_sos_eos_(!explicit_markers),
+      order_(order) {
+    state_size_ = (order_ - 1) * sizeof(WordID) + 2 + (order_ - 1) * sizeof(WordID);
+    unscored_size_offset_ = (order_ - 1) * sizeof(WordID);
+    is_complete_offset_ = unscored_size_offset_ + 1;
+    unscored_words_offset_ = is_complete_offset_ + 1;
+
+    // special handling of beginning / ending sentence markers
+    dummy_state_ = new char[state_size_];
+    memset(dummy_state_, 0, state_size_);
+    dummy_ants_.push_back(dummy_state_);
+    dummy_ants_.push_back(NULL);
+    dummy_rule_.reset(new TRule("[DUMMY] ||| [BOS] [DUMMY] ||| [1] [2] </s> ||| X=0"));
+    kSOS_ = TD::Convert("<s>");
+    kEOS_ = TD::Convert("</s>");
+    kMALFORMED_ = FD::Convert("Malformed");
+  }
 
   // returns the number of unscored words at the left edge of a span
   inline int UnscoredSize(const void* state) const {
@@ -68,22 +112,6 @@ class NgramDetectorImpl {
     *(static_cast<char*>(state) + unscored_size_offset_) = size;
   }
 
-  inline State<5> RemnantLMState(const void* cstate) const {
-    return State<5>(order_, static_cast<const WordID*>(cstate));
-  }
-
-  inline const State<5> BeginSentenceState() const {
-    State<5> state(order_);
-    state.state[0] = kSOS_;
-    return state;
-  }
-
-  inline void SetRemnantLMState(const State<5>& lmstate, void* state) const {
-    // if we were clever, we could use the memory pointed to by state to do all
-    // the work, avoiding this copy
-    memcpy(state, lmstate.state, (order_-1) * sizeof(WordID));
-  }
-
   WordID IthUnscoredWord(int i, const void* state) const {
     const WordID* const mem = reinterpret_cast<const WordID*>(static_cast<const char*>(state) + unscored_words_offset_);
     return mem[i];
@@ -114,47 +142,92 @@ class NgramDetectorImpl {
     SetFlag(flag, HAS_FULL_CONTEXT, state);
   }
 
-  void FireFeatures(const State<5>& state, WordID cur, SparseVector<double>* feats) {
-    FidTree* ft = &fidroot_;
-    int n = 0;
-    WordID buf[10];
-    int ci = order_ - 1;
-    WordID curword = cur;
-    while(curword) {
-      buf[n] = curword;
-      int& fid = ft->fids[curword];
-      ++n;
-      if (!fid) {
-        const char* code="_UBT456789"; // prefix code (unigram, bigram, etc.)
-        ostringstream os;
-        os << code[n] << ':';
-        for (int i = n-1; i >= 0; --i) {
-          os << (i != n-1 ? "_" : "");
-          const string& tok = TD::Convert(buf[i]);
-          if (tok.find('=') == string::npos)
-            os << tok;
-          else
-            os << Escape(tok);
-        }
-        fid = FD::Convert(os.str());
-      }
+  // the feature name of the n words of ngram, most recent word first
+  static string FeatureName(const WordID* ngram, int n) {
+    const char* code="_UBT456789"; // prefix code (unigram, bigram, etc.)
+    ostringstream os;
+    os << code[n] << ':';
+    for (int i = n-1; i >= 0; --i) {
+      os << (i != n-1 ? "_" : "");
+      const string& tok = TD::Convert(ngram[i]);
+      if (tok.find('=') == string::npos)
+        os << tok;
+      else
+        os << Escape(tok);
+    }
+    return os.str();
+  }
+
+  const WordID kCDEC_UNK;
+  WordID kSOS_;  // <s> - requires special handling.
+  WordID kEOS_;  // </s>
+  int kMALFORMED_;
+  const bool add_sos_eos_; // flag indicating whether the hypergraph produces <s> and </s>
+                     // if this is true, FinalTransitionFeatures will "add" <s> and </s>
+                     // if false, FinalTransitionFeatures will score anything with the
+                     // markers in the right place (i.e., the beginning and end of
+                     // the sentence) with 0, and anything else with -100
+
+  const int order_;
+  int state_size_;
+  int unscored_size_offset_;
+  int is_complete_offset_;
+  int unscored_words_offset_;
+  char* dummy_state_;
+  vector<const void*> dummy_ants_;
+  TRulePtr dummy_rule_;
+};
+
+template <int ORDER>
+class FixedOrderNgramDetector : public NgramDetectorImpl {
+  typedef State<ORDER> LMState;
+  typedef unordered_map<Ngram<ORDER>, int, NgramHash<ORDER> > NgramFids;
+
+  inline LMState RemnantLMState(const void* cstate) const {
+    return LMState(static_cast<const WordID*>(cstate));
+  }
+
+  inline const LMState BeginSentenceState() const {
+    LMState state;
+    state.state[0] = kSOS_;
+    return state;
+  }
+
+  inline void SetRemnantLMState(const LMState& lmstate, void* state) const {
+    // if we were clever, we could use the memory pointed to by state to do all
+    // the work, avoiding this copy
+    memcpy(state, lmstate.state, (ORDER - 1) * sizeof(WordID));
+  }
+
+  // fires the n-grams ending in cur, up to the order or the first missing
+  // context word.  feature ids are cached by n-gram for the sentence
+  void FireFeatures(const LMState& state, WordID cur, SparseVector<double>* feats) {
+    Ngram<ORDER> ngram;
+    for (int i = 0; i < ORDER; ++i) ngram.w[i] = 0;
+    ngram.w[0] = cur;
+    for (int n = 1; ; ++n) {
+      int& fid = fids_[ngram];
+      if (!fid) fid = FD::Convert(FeatureName(ngram.w, n));
       feats->set_value(fid, 1);
-      ft = &ft->levels[curword];
-      --ci;
-      if (ci < 0) break;
-      curword = state[ci];
+      if (n == ORDER) break;
+      const WordID prev = state[ORDER - 1 - n];
+      if (!prev) break;
+      ngram.w[n] = prev;
     }
   }
 
  public:
+  explicit FixedOrderNgramDetector(bool explicit_markers) :
+      NgramDetectorImpl(ORDER, explicit_markers) {}
+
+  void ClearCache() { NgramFids().swap(fids_); }
+
   void LookupWords(const TRule& rule, const vector<const void*>& ant_states, SparseVector<double>* feats, SparseVector<double>* est_feats, void* remnant) {
-    double sum = 0.0;
-    double est_sum = 0.0;
-    int num_scored = 0;
-    int num_estimated = 0;
     bool saw_eos = false;
     bool has_some_history = false;
-    State<5> state;
+    int num_scored = 0;
+    int num_estimated = 0;
+    LMState state;
     const vector<WordID>& e = rule.e();
     bool context_complete = false;
     for (int j = 0; j < e.size(); ++j) {
@@ -163,21 +236,19 @@ class NgramDetectorImpl {
         int unscored_ant_len = UnscoredSize(astate);
         for (int k = 0; k < unscored_ant_len; ++k) {
           const WordID cur_word = IthUnscoredWord(k, astate);
-          const bool is_oov = (cur_word == 0);
           SparseVector<double> p;
           if (cur_word == kSOS_) {
             state = BeginSentenceState();
             if (has_some_history) {  // this is immediately fully scored, and bad
-              p.set_value(FD::Convert("Malformed"), 1.0);
+              p.set_value(kMALFORMED_, 1.0);
               context_complete = true;
             } else {  // this might be a real <s>
               num_scored = max(0, order_ - 2);
             }
           } else {
             FireFeatures(state, cur_word, &p);
-            const State<5> scopy = State<5>(state, order_, cur_word);
-            state = scopy;
-            if (saw_eos) { p.set_value(FD::Convert("Malformed"), 1.0); }
+            state = LMState(state, cur_word);
+            if (saw_eos) { p.set_value(kMALFORMED_, 1.0); }
             saw_eos = (cur_word == kEOS_);
           }
           has_some_history = true;
@@ -205,16 +276,15 @@ class NgramDetectorImpl {
         if (cur_word == kSOS_) {
           state = BeginSentenceState();
           if (has_some_history) {  // this is immediately fully scored, and bad
-            p.set_value(FD::Convert("Malformed"), -100);
+            p.set_value(kMALFORMED_, -100);
             context_complete = true;
           } else {  // this might be a real <s>
             num_scored = max(0, order_ - 2);
           }
         } else {
           FireFeatures(state, cur_word, &p);
-          const State<5> scopy = State<5>(state, order_, cur_word);
-          state = scopy;
-          if (saw_eos) { p.set_value(FD::Convert("Malformed"), 1.0); }
+          state = LMState(state, cur_word);
+          if (saw_eos) { p.set_value(kMALFORMED_, 1.0); }
           saw_eos = (cur_word == kEOS_);
         }
         has_some_history = true;
@@ -263,61 +333,35 @@ class NgramDetectorImpl {
     }
   }
 
- public:
-  explicit NgramDetectorImpl(bool explicit_markers) :
-      kCDEC_UNK(TD::Convert("<unk>")) ,
-      add_sos_eos_(!explicit_markers) {
-    order_ = 3;
-    state_size_ = (order_ - 1) * sizeof(WordID) + 2 + (order_ - 1) * sizeof(WordID);
-    unscored_size_offset_ = (order_ - 1) * sizeof(WordID);
-    is_complete_offset_ = unscored_size_offset_ + 1;
-    unscored_words_offset_ = is_complete_offset_ + 1;
-
-    // special handling of beginning / ending sentence markers
-    dummy_state_ = new char[state_size_];
-    memset(dummy_state_, 0, state_size_);
-    dummy_ants_.push_back(dummy_state_);
-    dummy_ants_.push_back(NULL);
-    dummy_rule_.reset(new TRule("[DUMMY] ||| [BOS] [DUMMY] ||| [1] [2] </s> ||| X=0"));
-    kSOS_ = TD::Convert("<s>");
-    kEOS_ = TD::Convert("</s>");
-  }
-
-  ~NgramDetectorImpl() {
-    delete[] dummy_state_;
-  }
-
-  int ReserveStateSize() const { return state_size_; }
-
  private:
-  const WordID kCDEC_UNK;
-  WordID kSOS_;  // <s> - requires special handling.
-  WordID kEOS_;  // </s>
-  const bool add_sos_eos_; // flag indicating whether the hypergraph produces <s> and </s>
-                     // if this is true, FinalTransitionFeatures will "add" <s> and </s>
-                     // if false, FinalTransitionFeatures will score anything with the
-                     // markers in the right place (i.e., the beginning and end of
-                     // the sentence) with 0, and anything else with -100
-
-  int order_;
-  int state_size_;
-  int unscored_size_offset_;
-  int is_complete_offset_;
-  int unscored_words_offset_;
-  char* dummy_state_;
-  vector<const void*> dummy_ants_;
-  TRulePtr dummy_rule_;
-  struct FidTree {
-    map<WordID, int> fids;
-    map<WordID, FidTree> levels;
-  };
-  mutable FidTree fidroot_;
+  NgramFids fids_;
 };
 
 NgramDetector::NgramDetector(const string& param) {
-  string filename, mapfile, featname;
-  bool explicit_markers = (param == "-x");
-  pimpl_ = new NgramDetectorImpl(explicit_markers);
+  bool explicit_markers = false;
+  int order = 3;
+  vector<string> argv;
+  SplitOnWhitespace(param, &argv);
+  for (int i = 0; i < argv.size(); ++i) {
+    if (argv[i] == "-x") {
+      explicit_markers = true;
+    } else if (argv[i] == "-o" && i + 1 < argv.size()) {
+      order = atoi(argv[++i].c_str());
+    } else {
+      cerr << "NgramFeatures: unknown parameter " << argv[i] << "\n  expected [-x] [-o n]\n";
+      abort();
+    }
+  }
+  switch (order) {
+    case 1: pimpl_ = new FixedOrderNgramDetector<1>(explicit_markers); break;
+    case 2: pimpl_ = new FixedOrderNgramDetector<2>(explicit_markers); break;
+    case 3: pimpl_ = new FixedOrderNgramDetector<3>(explicit_markers); break;
+    case 4: pimpl_ = new FixedOrderNgramDetector<4>(explicit_markers); break;
+    case 5: pimpl_ = new FixedOrderNgramDetector<5>(explicit_markers); break;
+    default:
+      cerr << "NgramFeatures: order must be between 1 and 5, got " << order << endl;
+      abort();
+  }
   SetStateSize(pimpl_->ReserveStateSize());
 }
 
@@ -325,6 +369,10 @@ NgramDetector::~NgramDetector() {
   delete pimpl_;
 }
 
+void NgramDetector::PrepareForInput(const SentenceMetadata& /* smeta */) {
+  pimpl_->ClearCache();
+}
+
 void NgramDetector::TraversalFeaturesImpl(const SentenceMetadata& /* smeta */,
                                           const Hypergraph::Edge& edge,
                                           const vector<const void*>& ant_states,
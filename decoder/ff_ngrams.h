@@ -7,12 +7,14 @@
 
 #include "ff.h"
 
-struct NgramDetectorImpl;
+class NgramDetectorImpl;
 class NgramDetector : public FeatureFunction {
  public:
-  // param = "filename.lm [-o n]"
+  // param = "[-x] [-o n]": -x if the rules produce <s> and </s> themselves,
+  // and the longest n-grams to fire (1 to 5, default 3)
   NgramDetector(const std::string& param);
   ~NgramDetector();
+  virtual void PrepareForInput(const SentenceMetadata& smeta);
   virtual void FinalTraversalFeatures(const void* context,
                                       SparseVector<double>* features) const;
  protected:
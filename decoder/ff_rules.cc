@@ -38,7 +38,7 @@ void RuleIdentityFeatures::TraversalFeaturesImpl(const SentenceMetadata& smeta,
                                          SparseVector<double>* features,
                                          SparseVector<double>* estimated_features,
                                          void* context) const {
-  map<const TRule*, int>::iterator it = rule2_fid_.find(edge.rule_.get());
+  std::tr1::unordered_map<const TRule*, int>::iterator it = rule2_fid_.find(edge.rule_.get());
   if (it == rule2_fid_.end()) {
     const TRule& rule = *edge.rule_;
     ostringstream os;
@@ -66,12 +66,23 @@ void RuleIdentityFeatures::TraversalFeaturesImpl(const SentenceMetadata& smeta,
   features->add_value(it->second, 1);
 }
 
-RuleNgramFeatures::RuleNgramFeatures(const std::string& param) {
+RuleNgramFeatures::RuleNgramFeatures(const std::string& param) :
+    kSOR_(TD::Convert("<r>")), kEOR_(TD::Convert("</r>")) {
 }
 
 void RuleNgramFeatures::PrepareForInput(const SentenceMetadata& smeta) {
-//  std::map<const TRule*, SparseVector<double> >
-  rule2_feats_.clear();
+  rule2_fids_.clear();
+}
+
+int RuleNgramFeatures::BigramFid(WordID prev, WordID cur) const {
+  const uint64_t key = (static_cast<uint64_t>(prev) << 32) | static_cast<uint32_t>(cur);
+  std::tr1::unordered_map<uint64_t, int>::iterator it = bigram2_fid_.find(key);
+  if (it == bigram2_fid_.end()) {
+    ostringstream os;
+    os << "RB:" << TD::Convert(prev) << '_' << TD::Convert(cur);
+    it = bigram2_fid_.insert(make_pair(key, FD::Convert(Escape(os.str())))).first;
+  }
+  return it->second;
 }
 
 void RuleNgramFeatures::TraversalFeaturesImpl(const SentenceMetadata& smeta,
@@ -80,28 +91,26 @@ void RuleNgramFeatures::TraversalFeaturesImpl(const SentenceMetadata& smeta,
                                          SparseVector<double>* features,
                                          SparseVector<double>* estimated_features,
                                          void* context) const {
-  map<const TRule*, SparseVector<double> >::iterator it = rule2_feats_.find(edge.rule_.get());
-  if (it == rule2_feats_.end()) {
+  std::tr1::unordered_map<const TRule*, vector<int> >::iterator it = rule2_fids_.find(edge.rule_.get());
+  if (it == rule2_fids_.end()) {
     const TRule& rule = *edge.rule_;
-    it = rule2_feats_.insert(make_pair(&rule, SparseVector<double>())).first;
-    SparseVector<double>& f = it->second;
-    string prev = "<r>";
-    for (int i = 0; i < rule.f_.size(); ++i) {
-      WordID w = rule.f_[i];
-      if (w < 0) w = -w;
-      assert(w > 0);
-      const string& cur = TD::Convert(w);
-      ostringstream os;
-      os << "RB:" << prev << '_' << cur;
-      const int fid = FD::Convert(Escape(os.str()));
-      if (fid <= 0) return;
-      f.add_value(fid, 1.0);
+    it = rule2_fids_.insert(make_pair(&rule, vector<int>())).first;
+    vector<int>& fids = it->second;
+    fids.reserve(rule.f_.size() + 1);
+    WordID prev = kSOR_;
+    for (int i = 0; i <= rule.f_.size(); ++i) {
+      WordID cur = kEOR_;
+      if (i < rule.f_.size()) {
+        cur = rule.f_[i];
+        if (cur < 0) cur = -cur;
+        assert(cur > 0);
+      }
+      const int fid = BigramFid(prev, cur);
+      if (fid > 0) fids.push_back(fid);  // 0 if the dictionary is frozen
       prev = cur;
     }
-    ostringstream os;
-    os << "RB:" << prev << '_' << "</r>";
-    f.set_value(FD::Convert(Escape(os.str())), 1.0);
   }
-  (*features) += it->second;
+  const vector<int>& fids = it->second;
+  for (int i = 0; i < fids.size(); ++i)
+    features->add_value(fids[i], 1.0);
 }
-
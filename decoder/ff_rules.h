@@ -2,14 +2,19 @@
 #define _FF_RULES_H_
 
 #include <vector>
-#include <map>
+#include <tr1/unordered_map>
 #include "ff.h"
 #include "array2d.h"
 #include "wordid.h"
 
+// fires R:lhs:src:trg on every rule.  This is a rule_feature(), so the decoder
+// normally computes it once per grammar rule (see RuleFeatureCache); rules
+// made for the sentence at hand are looked up by address in rule2_fid_
 class RuleIdentityFeatures : public FeatureFunction {
  public:
   RuleIdentityFeatures(const std::string& param);
+  bool rule_feature() const { return true; }
+  friend struct StaticFF<RuleIdentityFeatures>;
  protected:
   virtual void TraversalFeaturesImpl(const SentenceMetadata& smeta,
                                      const Hypergraph::Edge& edge,
@@ -19,12 +24,17 @@ class RuleIdentityFeatures : public FeatureFunction {
                                      void* context) const;
   virtual void PrepareForInput(const SentenceMetadata& smeta);
  private:
-  mutable std::map<const TRule*, int> rule2_fid_;
+  mutable std::tr1::unordered_map<const TRule*, int> rule2_fid_;
 };
 
+// fires RB:prev_cur for the source side bigrams of every rule, including
+// <r> and </r> at its ends.  Like RuleIdentityFeatures it depends only on
+// the rule
 class RuleNgramFeatures : public FeatureFunction {
  public:
   RuleNgramFeatures(const std::string& param);
+  bool rule_feature() const { return true; }
+  friend struct StaticFF<RuleNgramFeatures>;
  protected:
   virtual void TraversalFeaturesImpl(const SentenceMetadata& smeta,
                                      const Hypergraph::Edge& edge,
@@ -34,7 +44,14 @@ class RuleNgramFeatures : public FeatureFunction {
                                      void* context) const;
   virtual void PrepareForInput(const SentenceMetadata& smeta);
  private:
-  mutable std::map<const TRule*, SparseVector<double> > rule2_feats_;
+  // fid of the bigram (prev, cur), WordIDs packed as prev << 32 | cur.
+  // feature ids never change, so this is kept across sentences
+  int BigramFid(WordID prev, WordID cur) const;
+  const WordID kSOR_;
+  const WordID kEOR_;
+  mutable std::tr1::unordered_map<uint64_t, int> bigram2_fid_;
+  // bigram fids of the rules of this sentence; a fid fires once per entry
+  mutable std::tr1::unordered_map<const TRule*, std::vector<int> > rule2_fids_;
 };
 
 #endif
@@ -7,6 +7,8 @@
 class RuleShapeFeatures : public FeatureFunction {
  public:
   RuleShapeFeatures(const std::string& param);
+  bool rule_feature() const { return true; }
+  friend struct StaticFF<RuleShapeFeatures>;
  protected:
   virtual void TraversalFeaturesImpl(const SentenceMetadata& smeta,
                                      const Hypergraph::Edge& edge,
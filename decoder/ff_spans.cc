@@ -57,11 +57,18 @@ SpanFeatures::SpanFeatures(const string& param) :
         cerr << "Error reading line " << lc << ": " << line << endl;
         abort();
       }
+      if (word2class_.size() <= v[0])
+        word2class_.resize(v[0] + 1, 0);
       word2class_[v[0]] = v[1];
     }
-    word2class_[TD::Convert("BOS")] = TD::Convert("BOS");
-    word2class_[TD::Convert("EOS")] = TD::Convert("EOS");
+    const WordID bos = TD::Convert("BOS"), eos = TD::Convert("EOS");
+    if (word2class_.size() <= max(bos, eos))
+      word2class_.resize(max(bos, eos) + 1, 0);
+    word2class_[bos] = bos;
+    word2class_[eos] = eos;
     oov_ = TD::Convert("OOV");
+    for (int i = 0; i < word2class_.size(); ++i)
+      if (!word2class_[i]) word2class_[i] = oov_;
   }
 
   if (valfile.size() > 0) {
@@ -81,7 +88,7 @@ SpanFeatures::SpanFeatures(const string& param) :
       string feat_name;
       double weight;
       in >> feat_name >> weight;
-      feat2val_[feat_name] = weight;
+      fid2val_[FD::Convert(feat_name)] = weight;
     }
   }
 }
@@ -120,77 +127,95 @@ void SpanFeatures::TraversalFeaturesImpl(const SentenceMetadata& smeta,
 
 WordID SpanFeatures::MapIfNecessary(const WordID& w) const {
   if (word2class_.empty()) return w;
-  map<WordID,WordID>::const_iterator it = word2class_.find(w);
-  if (it == word2class_.end()) return oov_;
-  return it->second;
+  if (w >= word2class_.size()) return oov_;
+  return word2class_[w];
 }
 
+int SpanFeatures::WordFid(const char* prefix, WordID w, vector<int>* ids) {
+  if (ids->size() <= w) ids->resize(w + 1, 0);
+  int& fid = (*ids)[w];
+  if (!fid) fid = FD::Convert(Escape(prefix + string(TD::Convert(w))));
+  return fid;
+}
+
+const SpanFeatures::PairFids& SpanFeatures::GetPairFids(WordID bword, WordID word) {
+  const uint64_t key = (static_cast<uint64_t>(bword) << 32) | static_cast<uint32_t>(word);
+  PairFidMap::iterator it = pair_fids_.find(key);
+  if (it != pair_fids_.end()) return it->second;
+  const string pair = string(TD::Convert(bword)) + "_" + TD::Convert(word);
+  PairFids& f = pair_fids_[key];
+  f.end_bigram = FD::Convert(Escape("EBI:" + pair));
+  f.beg_bigram = FD::Convert(Escape("BBI:" + pair));
+  f.span.first = FD::Convert(Escape("S:" + pair));
+  f.span.second = FD::Convert(Escape("S_S:" + pair));
+  return f;
+}
+
+const pair<int,int>& SpanFeatures::GetLenSpanFids(int len_bucket, WordID bword, WordID word) {
+  if (len_span_fids_.size() <= len_bucket) len_span_fids_.resize(len_bucket + 1);
+  LenSpanFidMap& m = len_span_fids_[len_bucket];
+  const uint64_t key = (static_cast<uint64_t>(bword) << 32) | static_cast<uint32_t>(word);
+  LenSpanFidMap::iterator it = m.find(key);
+  if (it != m.end()) return it->second;
+  ostringstream lf;
+  lf << "LS:" << len_bucket << "_" << TD::Convert(bword) << "_" << TD::Convert(word);
+  pair<int,int>& f = m[key];
+  f.first = FD::Convert(Escape(lf.str()));
+  f.second = FD::Convert(Escape("S_" + lf.str()));
+  return f;
+}
+
+double SpanFeatures::CollapsedValue(int fid) const {
+  tr1::unordered_map<int, double>::const_iterator it = fid2val_.find(fid);
+  return it == fid2val_.end() ? 0.0 : it->second;
+}
+
+// all names are built once per word, word pair or (length, word pair) and
+// then only looked up, so a sentence costs O(n^2) hash lookups
 void SpanFeatures::PrepareForInput(const SentenceMetadata& smeta) {
   const Lattice& lattice = smeta.GetSourceLattice();
-  const WordID eos = TD::Convert("EOS");  // right of the last source word
-  const WordID bos = TD::Convert("BOS");  // left of the first source word
-  beg_span_ids_.resize(lattice.size() + 1);
-  end_span_ids_.resize(lattice.size() + 1);
-  span_feats_.resize(lattice.size() + 1, lattice.size() + 1);
-  beg_bigram_ids_.resize(lattice.size() + 1);
-  end_bigram_ids_.resize(lattice.size() + 1);
-  len_span_feats_.resize(lattice.size() + 1, lattice.size() + 1);
+  const int n = lattice.size();
+  beg_span_ids_.resize(n + 1);
+  end_span_ids_.resize(n + 1);
+  span_feats_.resize(n + 1, n + 1);
+  beg_bigram_ids_.resize(n + 1);
+  end_bigram_ids_.resize(n + 1);
+  len_span_feats_.resize(n + 1, n + 1);
   if (use_collapsed_features_) {
-    beg_span_vals_.resize(lattice.size() + 1);
-    end_span_vals_.resize(lattice.size() + 1);
-    span_vals_.resize(lattice.size() + 1, lattice.size() + 1);
+    beg_span_vals_.resize(n + 1);
+    end_span_vals_.resize(n + 1);
+    span_vals_.resize(n + 1, n + 1);
   }
-  for (int i = 0; i <= lattice.size(); ++i) {
-    WordID word = eos;
-    WordID bword = bos;
-    if (i > 0)
-      bword = lattice[i-1][0].label;
-    bword = MapIfNecessary(bword);
-    if (i < lattice.size())
-      word = lattice[i][0].label;  // rather arbitrary for lattices
-    word = MapIfNecessary(word);
-    ostringstream sfid;
-    sfid << "ES:" << TD::Convert(word);
-    end_span_ids_[i] = FD::Convert(Escape(sfid.str()));
-    ostringstream esbiid;
-    esbiid << "EBI:" << TD::Convert(bword) << "_" << TD::Convert(word);
-    end_bigram_ids_[i] = FD::Convert(Escape(esbiid.str()));
-    ostringstream bsbiid;
-    bsbiid << "BBI:" << TD::Convert(bword) << "_" << TD::Convert(word);
-    beg_bigram_ids_[i] = FD::Convert(Escape(bsbiid.str()));
-    ostringstream bfid;
-    bfid << "BS:" << TD::Convert(bword);
-    beg_span_ids_[i] = FD::Convert(Escape(bfid.str()));
+  // word[i] is the (projected) word right of position i, bword[i] the one left of it
+  vector<WordID> word(n + 1), bword(n + 1);
+  for (int i = 0; i <= n; ++i) {
+    bword[i] = MapIfNecessary(i > 0 ? lattice[i-1][0].label : TD::Convert("BOS"));
+    word[i] = MapIfNecessary(i < n ? lattice[i][0].label : TD::Convert("EOS"));  // rather arbitrary for lattices
+  }
+  for (int i = 0; i <= n; ++i) {
+    end_span_ids_[i] = WordFid("ES:", word[i], &es_fids_);
+    beg_span_ids_[i] = WordFid("BS:", bword[i], &bs_fids_);
+    const PairFids& p = GetPairFids(bword[i], word[i]);
+    end_bigram_ids_[i] = p.end_bigram;
+    beg_bigram_ids_[i] = p.beg_bigram;
     if (use_collapsed_features_) {
-      end_span_vals_[i] = feat2val_[Escape(sfid.str())] + feat2val_[Escape(esbiid.str())];
-      beg_span_vals_[i] = feat2val_[Escape(bfid.str())] + feat2val_[Escape(bsbiid.str())];
+      end_span_vals_[i] = CollapsedValue(end_span_ids_[i]) + CollapsedValue(p.end_bigram);
+      beg_span_vals_[i] = CollapsedValue(beg_span_ids_[i]) + CollapsedValue(p.beg_bigram);
     }
   }
-  for (int i = 0; i <= lattice.size(); ++i) {
-    WordID bword = bos;
-    if (i > 0)
-      bword = lattice[i-1][0].label;
-    bword = MapIfNecessary(bword);
-    for (int j = 0; j <= lattice.size(); ++j) {
-      WordID word = eos;
-      if (j < lattice.size())
-        word = lattice[j][0].label;
-      word = MapIfNecessary(word);
-      ostringstream pf;
-      pf << "S:" << TD::Convert(bword) << "_" << TD::Convert(word);
-      span_feats_(i,j).first = FD::Convert(Escape(pf.str()));
-      span_feats_(i,j).second = FD::Convert(Escape("S_" + pf.str()));
-      ostringstream lf;
+  for (int i = 0; i <= n; ++i) {
+    for (int j = 0; j <= n; ++j) {
       const unsigned span_size = (i < j ? j - i : i - j);
-      lf << "LS:" << SpanSizeTransform(span_size) << "_" << TD::Convert(bword) << "_" << TD::Convert(word);
-      len_span_feats_(i,j).first = FD::Convert(Escape(lf.str()));
-      len_span_feats_(i,j).second = FD::Convert(Escape("S_" + lf.str()));
+      const pair<int,int>& pf = GetPairFids(bword[i], word[j]).span;
+      const pair<int,int>& lf = GetLenSpanFids(SpanSizeTransform(span_size), bword[i], word[j]);
+      span_feats_(i,j) = pf;
+      len_span_feats_(i,j) = lf;
       if (use_collapsed_features_) {
-        span_vals_(i,j).first = feat2val_[Escape(pf.str())] + feat2val_[Escape(lf.str())];
-        span_vals_(i,j).second = feat2val_[Escape("S_" + pf.str())] + feat2val_[Escape("S_" + lf.str())];
+        span_vals_(i,j).first = CollapsedValue(pf.first) + CollapsedValue(lf.first);
+        span_vals_(i,j).second = CollapsedValue(pf.second) + CollapsedValue(lf.second);
       }
     }
-  } 
+  }
 }
 
 inline bool IsArity2RuleReordered(const TRule& rule) {
@@ -212,18 +237,35 @@ CMR2008ReorderingFeatures::CMR2008ReorderingFeatures(const std::string& param) :
   } else {
     unconditioned_fids_.first = FD::Convert("CMRMono");
     unconditioned_fids_.second = FD::Convert("CMRReorder");
-    fids_.resize(16); fids_[0].first = fids_[0].second = -1;
+    fids_.resize(1); fids_[0].first = fids_[0].second = -1;
     // since I use a log transform, I go a bit higher than David, who bins everything > 10
-    for (int span_size = 1; span_size <= 15; ++span_size) {
+    GrowFids(15);
+  }
+}
+
+// fills fids_ up to span size max_span; the names only depend on the
+// length bucket, so each is built once
+void CMR2008ReorderingFeatures::GrowFids(int max_span) {
+  vector<pair<int,int> > buckets;
+  for (int span_size = fids_.size(); span_size <= max_span; ++span_size) {
+    const int b = SpanSizeTransform(span_size);
+    if (b >= buckets.size()) buckets.resize(b + 1, make_pair(0, 0));
+    if (!buckets[b].first) {
       ostringstream m, r;
-      m << "CMRMono_" << SpanSizeTransform(span_size);
-      fids_[span_size].first = FD::Convert(m.str());
-      r << "CMRReorder_" << SpanSizeTransform(span_size);
-      fids_[span_size].second = FD::Convert(r.str());
+      m << "CMRMono_" << b;
+      buckets[b].first = FD::Convert(m.str());
+      r << "CMRReorder_" << b;
+      buckets[b].second = FD::Convert(r.str());
     }
+    fids_.push_back(buckets[b]);
   }
 }
 
+void CMR2008ReorderingFeatures::PrepareForInput(const SentenceMetadata& smeta) {
+  if (!use_collapsed_features_)
+    GrowFids(smeta.GetSourceLattice().size());
+}
+
 void CMR2008ReorderingFeatures::TraversalFeaturesImpl(const SentenceMetadata& smeta,
                                          const Hypergraph::Edge& edge,
                                          const vector<const void*>& ant_contexts,
@@ -3,6 +3,9 @@
 
 #include <vector>
 #include <map>
+#include <string>
+#include <tr1/unordered_map>
+#include <stdint.h>
 #include "ff.h"
 #include "array2d.h"
 #include "wordid.h"
@@ -20,6 +23,17 @@ class SpanFeatures : public FeatureFunction {
   virtual void PrepareForInput(const SentenceMetadata& smeta);
  private:
   WordID MapIfNecessary(const WordID& w) const;
+  // the ids of prefix + w, cached in ids by w
+  int WordFid(const char* prefix, WordID w, std::vector<int>* ids);
+  // the ids of the features of a span from after bword to before word,
+  // cached by word pair (and by length bucket for the LS: features)
+  struct PairFids {
+    int end_bigram, beg_bigram;
+    std::pair<int,int> span;  // first for X, second for S
+  };
+  const PairFids& GetPairFids(WordID bword, WordID word);
+  const std::pair<int,int>& GetLenSpanFids(int len_bucket, WordID bword, WordID word);
+  double CollapsedValue(int fid) const;
   const int kS;
   const int kX;
   Array2D<std::pair<int,int> > span_feats_; // first for X, second for S
@@ -28,7 +42,16 @@ class SpanFeatures : public FeatureFunction {
   std::vector<int> end_bigram_ids_;
   std::vector<int> beg_span_ids_;
   std::vector<int> beg_bigram_ids_;
-  std::map<WordID, WordID> word2class_;  // optional projection to coarser class
+  std::vector<WordID> word2class_;  // optional projection to coarser class, by WordID
+
+  // feature ids depend only on the (projected) words around a span and its
+  // length, so they are kept across sentences
+  typedef std::tr1::unordered_map<uint64_t, PairFids> PairFidMap;
+  typedef std::tr1::unordered_map<uint64_t, std::pair<int,int> > LenSpanFidMap;
+  std::vector<int> es_fids_;
+  std::vector<int> bs_fids_;
+  PairFidMap pair_fids_;
+  std::vector<LenSpanFidMap> len_span_fids_;  // by length bucket
 
   // collapsed feature values
   bool use_collapsed_features_;
@@ -36,7 +59,7 @@ class SpanFeatures : public FeatureFunction {
   int fid_end_;
   int fid_span_s_;
   int fid_span_;
-  std::map<std::string, double> feat2val_;
+  std::tr1::unordered_map<int, double> fid2val_;
   std::vector<double> end_span_vals_;
   std::vector<double> beg_span_vals_;
   Array2D<std::pair<double,double> > span_vals_;
@@ -54,11 +77,13 @@ class CMR2008ReorderingFeatures : public FeatureFunction {
                                      SparseVector<double>* features,
                                      SparseVector<double>* estimated_features,
                                      void* context) const;
+  virtual void PrepareForInput(const SentenceMetadata& smeta);
  private:
+  void GrowFids(int max_span);
   const int kS;
   std::pair<int, int> unconditioned_fids_;  // first = monotone
                                             // second = inverse
-  std::vector<std::pair<int, int> > fids_;  // index=(j-i)
+  std::vector<std::pair<int, int> > fids_;  // index=(j-i), grown to the longest input
 
   // collapsed feature values
   bool use_collapsed_features_;
@@ -0,0 +1,155 @@
+#ifndef _FF_STATIC_H_
+#define _FF_STATIC_H_
+
+// StaticModelSet<FF1, ..., FF6> computes the features of a fixed sequence of
+// feature function types without any virtual calls: the loop over models in
+// ModelSet::AddFeaturesToEdge is unrolled at compile time, the models' state
+// offsets are fixed when it is built, and each TraversalFeaturesImpl is
+// called directly, so the compiler can inline it.
+//
+// Register the feature configurations used in production with
+// RegisterStaticModelSet<...>() (see cdec_ff.cc).  A ModelSet whose models
+// are exactly those types, in that order, uses the static version; any other
+// ModelSet keeps the dynamic loop.  A feature function type must declare
+// StaticFF<itself> a friend to be used here.
+
+#include <algorithm>
+#include <typeinfo>
+#include <vector>
+#include "ff.h"
+#include "ff_factory.h"
+
+// calls FF's implementation of TraversalFeaturesImpl non-virtually
+template <class FF>
+struct StaticFF {
+  static inline void TraversalFeatures(const FF& ff,
+                                       const SentenceMetadata& smeta,
+                                       const Hypergraph::Edge& edge,
+                                       const std::vector<const void*>& ant_contexts,
+                                       FeatureVector* features,
+                                       FeatureVector* estimated_features,
+                                       void* context) {
+    ff.FF::TraversalFeaturesImpl(smeta, edge, ant_contexts, features, estimated_features, context);
+  }
+};
+
+struct NoFF {};  // unused StaticModelSet parameter
+
+// one link per model; StaticChain<NoFF, ...> ends the chain
+template <class FF, class Rest>
+struct StaticChain {
+  static bool Matches(const std::vector<const FeatureFunction*>& models, unsigned i) {
+    return i < models.size() && typeid(*models[i]) == typeid(FF) && Rest::Matches(models, i + 1);
+  }
+
+  void Init(const std::vector<const FeatureFunction*>& models, const std::vector<int>& state_pos, unsigned i) {
+    ff_ = static_cast<const FF*>(models[i]);
+    spos_ = state_pos[i];
+    has_context_ = ff_->NumBytesContext() > 0;
+    rule_feature_ = ff_->rule_feature();
+    rest_.Init(models, state_pos, i + 1);
+  }
+
+  inline void TraversalFeatures(const SentenceMetadata& smeta,
+                                const std::vector<const uint8_t*>& ant_states,
+                                Hypergraph::Edge* edge,
+                                uint8_t* context,
+                                FeatureVector* estimated_features,
+                                const RuleFeatureCache* cache,
+                                unsigned next_rule_ff,
+                                unsigned next_val,
+                                std::vector<const void*>* ants) const {
+    if (cache && rule_feature_) {
+      ReplayRuleFeatures(*cache, &next_rule_ff, &next_val, &edge->feature_values_);
+    } else {
+      void* cur_ff_context = NULL;
+      if (has_context_) {
+        cur_ff_context = context + spos_;
+        for (unsigned i = 0; i < ants->size(); ++i)
+          (*ants)[i] = ant_states[i] + spos_;
+      } else {
+        std::fill(ants->begin(), ants->end(), static_cast<const void*>(NULL));
+      }
+      StaticFF<FF>::TraversalFeatures(*ff_, smeta, *edge, *ants, &edge->feature_values_, estimated_features, cur_ff_context);
+    }
+    rest_.TraversalFeatures(smeta, ant_states, edge, context, estimated_features, cache, next_rule_ff, next_val, ants);
+  }
+
+  const FF* ff_;
+  int spos_;
+  bool has_context_;
+  bool rule_feature_;
+  Rest rest_;
+};
+
+template <class Rest>
+struct StaticChain<NoFF, Rest> {
+  static bool Matches(const std::vector<const FeatureFunction*>& models, unsigned i) {
+    return i == models.size();
+  }
+  void Init(const std::vector<const FeatureFunction*>&, const std::vector<int>&, unsigned) {}
+  inline void TraversalFeatures(const SentenceMetadata&,
+                                const std::vector<const uint8_t*>&,
+                                Hypergraph::Edge*,
+                                uint8_t*,
+                                FeatureVector*,
+                                const RuleFeatureCache*,
+                                unsigned,
+                                unsigned,
+                                std::vector<const void*>*) const {}
+};
+
+template <class FF1, class FF2 = NoFF, class FF3 = NoFF, class FF4 = NoFF, class FF5 = NoFF, class FF6 = NoFF>
+class StaticModelSet : public FusedModelSet {
+  typedef StaticChain<FF1, StaticChain<FF2, StaticChain<FF3, StaticChain<FF4,
+          StaticChain<FF5, StaticChain<FF6, StaticChain<NoFF, NoFF> > > > > > > Chain;
+ public:
+  // true if models are exactly FF1, FF2, ... in this order
+  static bool Matches(const std::vector<const FeatureFunction*>& models) {
+    return Chain::Matches(models, 0);
+  }
+
+  StaticModelSet(const std::vector<const FeatureFunction*>& models, const std::vector<int>& state_pos) {
+    chain_.Init(models, state_pos, 0);
+  }
+
+  void TraversalFeatures(const SentenceMetadata& smeta,
+                         const std::vector<const uint8_t*>& ant_states,
+                         Hypergraph::Edge* edge,
+                         uint8_t* context,
+                         FeatureVector* estimated_features,
+                         const RuleFeatureCache* cache) const {
+    std::vector<const void*> ants(edge->tail_nodes_.size());
+    chain_.TraversalFeatures(smeta, ant_states, edge, context, estimated_features, cache, 0, 0, &ants);
+  }
+
+ private:
+  Chain chain_;
+};
+
+template <class FF1, class FF2, class FF3, class FF4, class FF5, class FF6>
+struct StaticModelSetFactory : public FusedModelSetFactory {
+  typedef StaticModelSet<FF1, FF2, FF3, FF4, FF5, FF6> SMS;
+  FusedModelSet* Create(const std::vector<const FeatureFunction*>& models,
+                        const std::vector<int>& state_pos) const {
+    return SMS::Matches(models) ? new SMS(models, state_pos) : NULL;
+  }
+};
+
+template <class FF1, class FF2, class FF3, class FF4, class FF5, class FF6>
+inline void RegisterStaticModelSet() {
+  fused_ms_registry.Register(new StaticModelSetFactory<FF1, FF2, FF3, FF4, FF5, FF6>);
+}
+
+template <class FF1>
+inline void RegisterStaticModelSet() { RegisterStaticModelSet<FF1, NoFF, NoFF, NoFF, NoFF, NoFF>(); }
+template <class FF1, class FF2>
+inline void RegisterStaticModelSet() { RegisterStaticModelSet<FF1, FF2, NoFF, NoFF, NoFF, NoFF>(); }
+template <class FF1, class FF2, class FF3>
+inline void RegisterStaticModelSet() { RegisterStaticModelSet<FF1, FF2, FF3, NoFF, NoFF, NoFF>(); }
+template <class FF1, class FF2, class FF3, class FF4>
+inline void RegisterStaticModelSet() { RegisterStaticModelSet<FF1, FF2, FF3, FF4, NoFF, NoFF>(); }
+template <class FF1, class FF2, class FF3, class FF4, class FF5>
+inline void RegisterStaticModelSet() { RegisterStaticModelSet<FF1, FF2, FF3, FF4, FF5, NoFF>(); }
+
+#endif
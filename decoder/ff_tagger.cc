@@ -9,15 +9,27 @@
 using namespace std;
 
 Tagger_BigramIndicator::Tagger_BigramIndicator(const std::string& param) :
-  FeatureFunction(sizeof(WordID)) {
+  FeatureFunction(sizeof(WordID)), num_tags_(0) {
    no_uni_ = (LowercaseString(param) == "no_uni");
 }
 
+int Tagger_BigramIndicator::TagIndex(const WordID& tag) const {
+  const int k = tag + 1;
+  if (k >= tag_index_.size()) tag_index_.resize(k + 1, -1);
+  int& index = tag_index_[k];
+  if (index < 0) index = num_tags_++;
+  return index;
+}
+
 void Tagger_BigramIndicator::FireFeature(const WordID& left,
                                  const WordID& right,
                                  SparseVector<double>* features) const {
   if (no_uni_ && right == 0) return;
-  int& fid = fmap_[left][right];
+  const int l = TagIndex(left), r = TagIndex(right);
+  if (l >= fids_.size()) fids_.resize(l + 1);
+  vector<int>& row = fids_[l];
+  if (r >= row.size()) row.resize(r + 1, 0);
+  int& fid = row[r];
   if (!fid) {
     ostringstream os;
     if (right == 0) {
@@ -62,6 +74,9 @@ void Tagger_BigramIndicator::TraversalFeaturesImpl(const SentenceMetadata& smeta
 
 void LexicalPairIndicator::PrepareForInput(const SentenceMetadata& smeta) {
   lexmap_->PrepareForInput(smeta);
+  src_fids_.resize(smeta.GetSourceLength());
+  for (int i = 0; i < src_fids_.size(); ++i)
+    src_fids_[i] = &fmap_[lexmap_->SourceWordAtPosition(i)];
 }
 
 LexicalPairIndicator::LexicalPairIndicator(const std::string& param) {
@@ -86,7 +101,14 @@ LexicalPairIndicator::LexicalPairIndicator(const std::string& param) {
 void LexicalPairIndicator::FireFeature(WordID src,
                                       WordID trg,
                                       SparseVector<double>* features) const {
-  int& fid = fmap_[src][trg];
+  FireFeature(src, trg, &fmap_[src], features);
+}
+
+void LexicalPairIndicator::FireFeature(WordID src,
+                                      WordID trg,
+                                      Class2FID* src_fids,
+                                      SparseVector<double>* features) const {
+  int& fid = (*src_fids)[trg];
   if (!fid) {
     ostringstream os;
     os << name_ << ':' << TD::Convert(src) << ':' << TD::Convert(trg);
@@ -108,7 +130,10 @@ void LexicalPairIndicator::TraversalFeaturesImpl(const SentenceMetadata& smeta,
     const vector<WordID>& ew = edge.rule_->e_;
     assert(ew.size() == 1);
     const WordID trg = lexmap_->CoarsenedTargetWordForTarget(ew[0]);
-    FireFeature(src, trg, features);
+    if (edge.i_ >= 0 && edge.i_ < src_fids_.size())
+      FireFeature(src, trg, src_fids_[edge.i_], features);
+    else
+      FireFeature(src, trg, features);
   }
 }
 
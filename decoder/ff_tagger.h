@@ -2,6 +2,7 @@
 #define _FF_TAGGER_H_
 
 #include <map>
+#include <vector>
 #include <boost/scoped_ptr.hpp>
 #include "ff.h"
 #include "factored_lexicon_helper.h"
@@ -12,7 +13,8 @@ typedef std::map<WordID, Class2FID> Class2Class2FID;
 // the reason this is a "tagger" feature is that it assumes that
 // the sequence unfolds from left to right, which means it doesn't
 // have to split states based on left context.
-// fires unigram features as well
+// fires unigram features as well.  The feature ids are kept in a dense
+// (left tag, right tag) matrix, tags being numbered as they are first seen.
 class Tagger_BigramIndicator : public FeatureFunction {
  public:
   Tagger_BigramIndicator(const std::string& param);
@@ -27,12 +29,17 @@ class Tagger_BigramIndicator : public FeatureFunction {
   void FireFeature(const WordID& left,
                    const WordID& right,
                    SparseVector<double>* features) const;
-  mutable Class2Class2FID fmap_;
+  int TagIndex(const WordID& tag) const;
+  mutable std::vector<int> tag_index_; // by tag + 1 (BOS/EOS are -1, "no tag" 0)
+  mutable int num_tags_;
+  mutable std::vector<std::vector<int> > fids_; // [left index][right index]
   bool no_uni_;
 };
 
 // for each pair of symbols cooccuring in a lexicalized rule, fire
-// a feature (mostly used for tagging, but could be used for any model)
+// a feature (mostly used for tagging, but could be used for any model).
+// The source word's row of feature ids is looked up once per position
+// per sentence.
 class LexicalPairIndicator : public FeatureFunction {
  public:
   LexicalPairIndicator(const std::string& param);
@@ -48,9 +55,14 @@ class LexicalPairIndicator : public FeatureFunction {
   void FireFeature(WordID src,
                    WordID trg,
                    SparseVector<double>* features) const;
+  void FireFeature(WordID src,
+                   WordID trg,
+                   Class2FID* src_fids,
+                   SparseVector<double>* features) const;
   std::string name_;  // used to construct feature string
   boost::scoped_ptr<FactoredLexiconHelper> lexmap_; // different view (stemmed, etc) of source/target
   mutable Class2Class2FID fmap_; // feature ideas
+  std::vector<Class2FID*> src_fids_; // fmap_ row of the source word at each position
 };
 
 
@@ -1,13 +1,25 @@
 #include <cassert>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <vector>
+#include <algorithm>
 #include <gtest/gtest.h>
 #include "hg.h"
 #include "ff_lm.h"
 #include "ff.h"
 #include "trule.h"
 #include "sentence_metadata.h"
+#include "grammar.h"
+#include "ff_rules.h"
+#include "ff_ruleshape.h"
+#include "ff_klm.h"
+#include "ff_static.h"
+#include "ff_charset.h"
+#include "ff_wordset.h"
+#include "tromble_loss.h"
+#include "timing_stats.h"
+#include "lm/model.hh"
 
 using namespace std;
 
@@ -30,6 +42,283 @@ class FFTest : public testing::Test {
   SentenceMetadata smeta;
 };
        
+static void CollectRule(const TRulePtr& rule, void* extra) {
+  static_cast<vector<TRulePtr>*>(extra)->push_back(rule);
+}
+
+TEST(ModelSetTest, PrecomputedRuleFeatures) {
+  istringstream in("[X] ||| [X,1] a ||| [X,1] two ||| F=1.0\n"
+                   "[X] ||| x y ||| one ||| F=2.0\n"
+                   "[X] ||| b [X,1] c [X,2] ||| [X,2] [X,1] three ||| WordPenalty=3\n"
+                   "[X] ||| a ||| one\n");
+  TextGrammar g(&in);
+  vector<TRulePtr> rules;
+  g.ForEachRule(&CollectRule, &rules);
+  EXPECT_EQ(4, rules.size());
+  WordPenalty wp("");
+  ArityPenalty ap("");
+  RuleIdentityFeatures rid("");
+  RuleShapeFeatures rs("");
+  vector<const FeatureFunction*> ffs;
+  ffs.push_back(&wp);
+  ffs.push_back(&ap);
+  ffs.push_back(&rid);
+  ffs.push_back(&rs);
+  vector<double> w(FD::NumFeats() + 1000, 0.5);
+  ModelSet models(w, ffs);
+  EXPECT_TRUE(models.has_rule_features());
+  SentenceMetadata smeta(0, Lattice());
+  vector<SparseVector<double> > live(rules.size());
+  vector<prob_t> live_probs(rules.size());
+  FFState state;
+  for (int i = 0; i < rules.size(); ++i) {
+    Hypergraph::Edge edge;
+    edge.rule_ = rules[i];
+    edge.tail_nodes_.resize(rules[i]->Arity());
+    edge.feature_values_ = rules[i]->GetFeatureValues();
+    const vector<const uint8_t*> ants(rules[i]->Arity());
+    models.AddFeaturesToEdge(smeta, ants, &edge, &state);
+    live[i] = edge.feature_values_;
+    live_probs[i] = edge.edge_prob_;
+  }
+  for (int i = 0; i < rules.size(); ++i)
+    models.PrecomputeRuleFeatures(rules[i].get());
+  for (int i = 0; i < rules.size(); ++i) {
+    EXPECT_TRUE(rules[i]->rule_ff_);
+    Hypergraph::Edge edge;
+    edge.rule_ = rules[i];
+    edge.tail_nodes_.resize(rules[i]->Arity());
+    edge.feature_values_ = rules[i]->GetFeatureValues();
+    const vector<const uint8_t*> ants(rules[i]->Arity());
+    models.AddFeaturesToEdge(smeta, ants, &edge, &state);
+    EXPECT_TRUE(live[i] == edge.feature_values_);
+    EXPECT_FLOAT_EQ(log(live_probs[i]), log(edge.edge_prob_));
+  }
+}
+
+TEST(ModelSetTest, PrecomputedRuleFeaturesOfTwoPasses) {
+  istringstream in("[X] ||| [X,1] a ||| [X,1] two ||| F=1.0\n"
+                   "[X] ||| x y x y ||| one ||| F=2.0\n");
+  TextGrammar g(&in);
+  vector<TRulePtr> rules;
+  g.ForEachRule(&CollectRule, &rules);
+  WordPenalty wp("");
+  RuleIdentityFeatures rid("");
+  RuleNgramFeatures rng("");
+  vector<const FeatureFunction*> ffs1, ffs2;
+  ffs1.push_back(&wp);
+  ffs1.push_back(&rid);
+  ffs2.push_back(&rng);
+  vector<double> w(FD::NumFeats() + 1000, 0.5);
+  ModelSet pass1(w, ffs1), pass2(w, ffs2);
+  SentenceMetadata smeta(0, Lattice());
+  FFState state;
+  vector<SparseVector<double> > live1, live2;
+  for (int i = 0; i < rules.size(); ++i) {
+    Hypergraph::Edge edge;
+    edge.rule_ = rules[i];
+    edge.tail_nodes_.resize(rules[i]->Arity());
+    const vector<const uint8_t*> ants(rules[i]->Arity());
+    pass1.AddFeaturesToEdge(smeta, ants, &edge, &state);
+    live1.push_back(edge.feature_values_);
+    pass2.AddFeaturesToEdge(smeta, ants, &edge, &state);
+    live2.push_back(edge.feature_values_);
+  }
+  EXPECT_FLOAT_EQ(2.0, live2[1].value(FD::Convert("RB:x_y")));
+  for (int i = 0; i < rules.size(); ++i) {
+    pass1.PrecomputeRuleFeatures(rules[i].get());
+    pass2.PrecomputeRuleFeatures(rules[i].get());
+    pass2.PrecomputeRuleFeatures(rules[i].get());  // no-op
+    ASSERT_TRUE(rules[i]->rule_ff_);
+    ASSERT_TRUE(rules[i]->rule_ff_->next);
+    EXPECT_FALSE(rules[i]->rule_ff_->next->next);
+  }
+  for (int i = 0; i < rules.size(); ++i) {
+    Hypergraph::Edge edge;
+    edge.rule_ = rules[i];
+    edge.tail_nodes_.resize(rules[i]->Arity());
+    const vector<const uint8_t*> ants(rules[i]->Arity());
+    pass1.AddFeaturesToEdge(smeta, ants, &edge, &state);
+    EXPECT_TRUE(live1[i] == edge.feature_values_);
+    pass2.AddFeaturesToEdge(smeta, ants, &edge, &state);
+    EXPECT_TRUE(live2[i] == edge.feature_values_);
+  }
+}
+
+TEST(ModelSetTest, SharedRuleFeatureCache) {
+  istringstream in("[X] ||| [X,1] a ||| [X,1] two ||| F=1.0\n"
+                   "[X] ||| x y ||| one ||| F=2.0\n");
+  TextGrammar g(&in);
+  vector<TRulePtr> rules;
+  g.ForEachRule(&CollectRule, &rules);
+  // as the registry makes them for the decoders of two threads, and one
+  // configured differently
+  WordPenalty wp1(""), wp2(""), wp3("");
+  wp1.config_ = wp2.config_ = "WordPenalty ";
+  wp3.config_ = "WordPenalty debug";
+  vector<const FeatureFunction*> ffs1(1, &wp1), ffs2(1, &wp2), ffs3(1, &wp3);
+  vector<double> w(FD::NumFeats() + 1000, 0.5);
+  ModelSet ms1(w, ffs1), ms2(w, ffs2), ms3(w, ffs3);
+  SentenceMetadata smeta(0, Lattice());
+  FFState state;
+  for (int i = 0; i < rules.size(); ++i) {
+    ms1.PrecomputeRuleFeatures(rules[i].get());
+    ms2.PrecomputeRuleFeatures(rules[i].get());  // no-op
+    ASSERT_TRUE(rules[i]->rule_ff_);
+    EXPECT_FALSE(rules[i]->rule_ff_->next);
+    ms3.PrecomputeRuleFeatures(rules[i].get());
+    EXPECT_TRUE(rules[i]->rule_ff_->next);
+
+    Hypergraph::Edge edge;
+    edge.rule_ = rules[i];
+    edge.tail_nodes_.resize(rules[i]->Arity());
+    const vector<const uint8_t*> ants(rules[i]->Arity());
+    ms3.AddFeaturesToEdge(smeta, ants, &edge, &state);
+    const SparseVector<double> live = edge.feature_values_;
+    ms2.AddFeaturesToEdge(smeta, ants, &edge, &state);
+    EXPECT_TRUE(live == edge.feature_values_);
+    EXPECT_NE(0.0, edge.feature_values_.value(FD::Convert("WordPenalty")));
+  }
+}
+
+TEST(ModelSetTest, WordClassRuleFeatures) {
+  istringstream in("[X] ||| [X,1] a ||| [X,1] дом house ||| F=1.0\n"
+                   "[X] ||| b ||| блок блок green\n");
+  TextGrammar g(&in);
+  vector<TRulePtr> rules;
+  g.ForEachRule(&CollectRule, &rules);
+  NonLatinCount nl("");
+  WordSet ws("-v ./test_data/wordset.vocab -N InVocab");
+  WordSet oov("-v ./test_data/wordset.vocab -N OOV --oov");
+  vector<const FeatureFunction*> ffs;
+  ffs.push_back(&nl);
+  ffs.push_back(&ws);
+  ffs.push_back(&oov);
+  vector<double> w(FD::NumFeats() + 100, 0.5);
+  ModelSet models(w, ffs);
+  EXPECT_TRUE(models.has_rule_features());
+  SentenceMetadata smeta(0, Lattice());
+  FFState state;
+  vector<SparseVector<double> > live;
+  for (int i = 0; i < rules.size(); ++i) {
+    Hypergraph::Edge edge;
+    edge.rule_ = rules[i];
+    edge.tail_nodes_.resize(rules[i]->Arity());
+    const vector<const uint8_t*> ants(rules[i]->Arity());
+    models.AddFeaturesToEdge(smeta, ants, &edge, &state);
+    live.push_back(edge.feature_values_);
+  }
+  const int fnl = FD::Convert("NonLatinCount"), fin = FD::Convert("InVocab"), foov = FD::Convert("OOV");
+  const int a = rules[0]->Arity() ? 0 : 1;  // the rule with the nonterminal
+  EXPECT_FLOAT_EQ(1.0, live[a].value(fnl));
+  EXPECT_FLOAT_EQ(1.0, live[a].value(fin));
+  EXPECT_FLOAT_EQ(2.0, live[a].value(foov));  // the nonterminal is not in the vocabulary
+  EXPECT_FLOAT_EQ(2.0, live[1 - a].value(fnl));
+  EXPECT_FLOAT_EQ(2.0, live[1 - a].value(fin));
+  EXPECT_FLOAT_EQ(1.0, live[1 - a].value(foov));
+  for (int i = 0; i < rules.size(); ++i) {
+    models.PrecomputeRuleFeatures(rules[i].get());
+    EXPECT_TRUE(rules[i]->rule_ff_);
+    Hypergraph::Edge edge;
+    edge.rule_ = rules[i];
+    edge.tail_nodes_.resize(rules[i]->Arity());
+    const vector<const uint8_t*> ants(rules[i]->Arity());
+    models.AddFeaturesToEdge(smeta, ants, &edge, &state);
+    EXPECT_TRUE(live[i] == edge.feature_values_);
+  }
+}
+
+TEST(ModelSetTest, StaticModelSetMatchesDynamic) {
+  typedef KLanguageModel<lm::ngram::ProbingModel> KLM;
+  boost::shared_ptr<FeatureFunction> lm = KLanguageModelFactory().Create("./test_data/dummy.3gram.lm");
+  ASSERT_TRUE(typeid(*lm) == typeid(KLM));
+  WordPenalty wp("");
+  ArityPenalty ap("");
+  vector<const FeatureFunction*> ffs;
+  ffs.push_back(lm.get());
+  ffs.push_back(&wp);
+  ffs.push_back(&ap);
+  vector<double> w(FD::NumFeats() + 100, 0.0);
+  for (int i = 0; i < w.size(); ++i) w[i] = 0.1 * (i % 7) - 0.3;
+  ModelSet dynamic_models(w, ffs);
+  EXPECT_FALSE(dynamic_models.fused());
+  RegisterStaticModelSet<KLM, WordPenalty, ArityPenalty>();
+  ModelSet static_models(w, ffs);
+  ffs.pop_back();
+  ModelSet unmatched_models(w, ffs);
+  fused_ms_registry.clear();
+  EXPECT_TRUE(static_models.fused());
+  EXPECT_FALSE(unmatched_models.fused());
+
+  TRulePtr r0(new TRule("[X] ||| a b ||| one two ||| F=1"));
+  TRulePtr r1(new TRule("[X] ||| [X,1] c ||| zero [X,1] two ||| F=2"));
+  SentenceMetadata smeta(0, Lattice());
+  const ModelSet* models[] = { &dynamic_models, &static_models };
+  FFState state0[2], state1[2];
+  SparseVector<double> feats[2];
+  prob_t probs[2], est[2];
+  for (int k = 0; k < 2; ++k) {
+    Hypergraph::Edge e0;
+    e0.rule_ = r0;
+    models[k]->AddFeaturesToEdge(smeta, vector<const uint8_t*>(), &e0, &state0[k]);
+    Hypergraph::Edge e1;
+    e1.rule_ = r1;
+    e1.tail_nodes_.resize(1);
+    models[k]->AddFeaturesToEdge(smeta, vector<const uint8_t*>(1, state0[k].begin()), &e1, &state1[k], &est[k]);
+    feats[k] = e1.feature_values_;
+    probs[k] = e1.edge_prob_;
+  }
+  EXPECT_TRUE(state0[0] == state0[1]);
+  EXPECT_TRUE(state1[0] == state1[1]);
+  EXPECT_TRUE(feats[0] == feats[1]);
+  EXPECT_EQ(log(probs[0]), log(probs[1]));
+  EXPECT_EQ(log(est[0]), log(est[1]));
+}
+
+TEST(ModelSetTest, ProfileFeatures) {
+  typedef KLanguageModel<lm::ngram::ProbingModel> KLM;
+  boost::shared_ptr<FeatureFunction> lm = KLanguageModelFactory().Create("./test_data/dummy.3gram.lm");
+  WordPenalty wp("");
+  wp.init_name_debug("WordPenalty", false);  // as the registry does
+  vector<const FeatureFunction*> ffs;
+  ffs.push_back(lm.get());
+  ffs.push_back(&wp);
+  vector<double> w(FD::NumFeats() + 100, 0.1);
+  RegisterStaticModelSet<KLM, WordPenalty>();
+  ModelSet models(w, ffs);
+  fused_ms_registry.clear();
+  EXPECT_TRUE(models.fused());
+
+  Timer::Summarize();
+  ModelSet::ProfileFeatures(true);
+  TRulePtr r0(new TRule("[X] ||| a b ||| one two ||| F=1"));
+  SentenceMetadata smeta(0, Lattice());
+  FFState state;
+  for (int i = 0; i < 3; ++i) {
+    Hypergraph::Edge e0;
+    e0.rule_ = r0;
+    models.AddFeaturesToEdge(smeta, vector<const uint8_t*>(), &e0, &state);
+  }
+  {
+    Timer t("Rescoring");
+    models.FinishInput(smeta);
+  }
+  ModelSet::ProfileFeatures(false);
+  const Profile& p = Timer::ThreadProfile();
+  const string lm_timer = "Rescoring/FF " + lm->name_;
+  ASSERT_EQ(1, p.timers.count(lm_timer));
+  EXPECT_EQ(3, p.timers.find(lm_timer)->second.calls);
+  ASSERT_EQ(1, p.timers.count("Rescoring/FF WordPenalty"));
+  EXPECT_EQ(3, p.timers.find("Rescoring/FF WordPenalty")->second.calls);
+  const ProfileCounter lm_bytes(("FF state bytes " + lm->name_).c_str());
+  ASSERT_LT(lm_bytes.id, p.counters.size());
+  EXPECT_EQ(3 * lm->NumBytesContext(), p.counters[lm_bytes.id]);
+  // stateless models write no state
+  const vector<string>& names = ProfileCounter::Names();
+  EXPECT_TRUE(find(names.begin(), names.end(), "FF state bytes WordPenalty") == names.end());
+  Timer::Summarize();
+}
+
 TEST_F(FFTest, LM3) {
   int x = lm3_->NumBytesContext();
   Hypergraph::Edge edge1;
@@ -58,6 +347,43 @@ TEST_F(FFTest, LM3) {
   EXPECT_EQ("[ zero one <{STAR}> one two ]", lm3_->DebugStateToString((const void*)&state3[0]));
 }
 
+TEST(TrombleLossTest, ClippedMatches) {
+  // one reference, "a b c d e f", unigram to trigram weights of 1
+  SentenceMetadata smeta(0, Lattice());
+  TrombleLossComputer tl("./test_data/tromble.refs 1 1 1 1");
+  tl.PrepareForInput(smeta);
+  const int x = tl.NumBytesContext();
+  const int fid = FD::Convert("TrombleLossComputer");
+  Hypergraph::Edge abc, def, whole, abab;
+  abc.rule_.reset(new TRule("[X] ||| x ||| a b c"));
+  def.rule_.reset(new TRule("[X] ||| y ||| d e f"));
+  whole.rule_.reset(new TRule("[X] ||| x y ||| a b c d e f"));
+  abab.rule_.reset(new TRule("[X] ||| [X,1] [X,2] ||| [X,1] [X,2]"));
+  vector<const void*> ants;
+  SparseVector<double> feats, est;
+  string s1(x, '\0'), s2(x, '\0'), s3(x, '\0'), s4(x, '\0');
+  tl.TraversalFeatures(smeta, abc, ants, &feats, &est, (void *)&s1[0]);
+  EXPECT_FLOAT_EQ(3.0, feats.value(fid));
+  tl.TraversalFeatures(smeta, def, ants, &feats, &est, (void *)&s2[0]);
+  ants.push_back(&s1[0]);
+  ants.push_back(&s2[0]);
+  // n-grams across the two constituents are found
+  feats.clear();
+  tl.TraversalFeatures(smeta, abab, ants, &feats, &est, (void *)&s3[0]);
+  EXPECT_FLOAT_EQ(3.0, feats.value(fid));
+  // and the state is the same as if the words came from one rule
+  feats.clear();
+  tl.TraversalFeatures(smeta, whole, vector<const void*>(), &feats, &est, (void *)&s4[0]);
+  EXPECT_FLOAT_EQ(3.0, feats.value(fid));
+  EXPECT_EQ(s4, s3);
+  // repeated n-grams are clipped to their count in the reference:
+  // a b c a b c matches 3 of 6 unigrams, 2 of 5 bigrams, 1 of 4 trigrams
+  ants[1] = &s1[0];
+  feats.clear();
+  tl.TraversalFeatures(smeta, abab, ants, &feats, &est, (void *)&s3[0]);
+  EXPECT_FLOAT_EQ(3.0 / 6 + 2.0 / 5 + 1.0 / 4, feats.value(fid));
+}
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -60,6 +60,18 @@ RelativeSentencePosition::RelativeSentencePosition(const string& param) :
   }
 }
 
+void RelativeSentencePosition::PrepareForInput(const SentenceMetadata& smeta) {
+  if (!condition_on_fclass_) return;
+  assert(smeta.GetSentenceID() < pos_.size());
+  const vector<WordID>& classes = pos_[smeta.GetSentenceID()];
+  cur_fids_.resize(classes.size());
+  for (int i = 0; i < classes.size(); ++i) {
+    std::map<WordID, int>::const_iterator fidit = fids_.find(classes[i]);
+    assert(fidit != fids_.end());
+    cur_fids_[i] = fidit->second;
+  }
+}
+
 void RelativeSentencePosition::TraversalFeaturesImpl(const SentenceMetadata& smeta,
                                                      const Hypergraph::Edge& edge,
                                                      const vector<const void*>& // ant_states
@@ -79,12 +91,8 @@ void RelativeSentencePosition::TraversalFeaturesImpl(const SentenceMetadata& sme
                           static_cast<double>(edge.prev_i_) / smeta.GetTargetLength());
   features->set_value(fid_, val);
   if (condition_on_fclass_) {
-    assert(smeta.GetSentenceID() < pos_.size());
-    const WordID cur_fclass = pos_[smeta.GetSentenceID()][edge.i_];
-    std::map<WordID, int>::const_iterator fidit = fids_.find(cur_fclass);
-    assert(fidit != fids_.end());
-    const int fid = fidit->second;
-    features->set_value(fid, val);
+    assert(edge.i_ < cur_fids_.size());
+    features->set_value(cur_fids_[edge.i_], val);
   }
 //  cerr << f_len_ << " " << e_len_ << " [" << edge.i_ << "," << edge.j_ << "|" << edge.prev_i_ << "," << edge.prev_j_ << "]\t" << edge.rule_->AsString() << "\tVAL=" << val << endl;
 }
@@ -131,7 +139,8 @@ void LexNullJump::TraversalFeaturesImpl(const SentenceMetadata& smeta,
 NewJump::NewJump(const string& param) :
     FeatureFunction(1),
     kBOS_(TD::Convert("BOS")),
-    kEOS_(TD::Convert("EOS")) {
+    kEOS_(TD::Convert("EOS")),
+    cur_flen_(0) {
   cerr << "    NewJump";
   vector<string> argv;
   set<string> permitted;
@@ -195,6 +204,12 @@ NewJump::NewJump(const string& param) :
   if (fprev_) fid_str_ += "P";
 }
 
+void NewJump::PrepareForInput(const SentenceMetadata& smeta) {
+  // jumps go from -1 (BOS) .. flen-1 to 0 .. flen (EOS)
+  cur_flen_ = smeta.GetSourceLength();
+  cur_fids_.assign((cur_flen_ + 1) * (cur_flen_ + 1), 0);
+}
+
 // do a log transform on the length (of a sentence, a jump, etc)
 // this basically means that large distances that are close to each other
 // are put into the same bin
@@ -226,6 +241,14 @@ void NewJump::FireFeature(const SentenceMetadata& smeta,
                           const int prev_src_index,
                           const int cur_src_index,
                           SparseVector<double>* features) const {
+  assert(smeta.GetSourceLength() == cur_flen_);
+  assert(prev_src_index >= -1 && prev_src_index < cur_flen_);
+  assert(cur_src_index >= 0 && cur_src_index <= cur_flen_);
+  int& cur_fid = cur_fids_[(prev_src_index + 1) * (cur_flen_ + 1) + cur_src_index];
+  if (cur_fid) {
+    features->set_value(cur_fid, 1.0);
+    return;
+  }
   const int id = smeta.GetSentenceID();
   const int src_len = smeta.GetSourceLength();
   const int raw_jump = cur_src_index - prev_src_index;
@@ -263,6 +286,7 @@ void NewJump::FireFeature(const SentenceMetadata& smeta,
     if (fprev_) os << ':' << TD::Convert(get<7>(key));    
     fid = FD::Convert(os.str());
   }
+  cur_fid = fid;
   features->set_value(fid, 1.0);
 }
 
@@ -313,7 +337,7 @@ void NewJump::TraversalFeaturesImpl(const SentenceMetadata& smeta,
 }
 
 SourceBigram::SourceBigram(const std::string& param) :
-    FeatureFunction(sizeof(WordID) + sizeof(int)) {
+    FeatureFunction(2 * sizeof(int)) {
   fid_str_ = "SB:";
   if (param.size() > 0) {
     vector<string> argv;
@@ -331,32 +355,49 @@ SourceBigram::SourceBigram(const std::string& param) :
 
 void SourceBigram::PrepareForInput(const SentenceMetadata& smeta) {
   lexmap_->PrepareForInput(smeta);
+  const int flen = smeta.GetSourceLength();
+  cur_words_.clear();
+  cur_word_index_.resize(flen + 1);
+  for (int i = -1; i < flen; ++i) {
+    const WordID w = lexmap_->SourceWordAtPosition(i);
+    const vector<WordID>::iterator it = find(cur_words_.begin(), cur_words_.end(), w);
+    cur_word_index_[i + 1] = it - cur_words_.begin();
+    if (it == cur_words_.end()) cur_words_.push_back(w);
+  }
+  const int n = cur_words_.size() + 1;
+  cur_fids_.assign(n * n, 0);
 }
 
 void SourceBigram::FinalTraversalFeatures(const void* context,
                                       SparseVector<double>* features) const {
-  WordID left = *static_cast<const WordID*>(context);
+  int left = *static_cast<const int*>(context);
   int left_wc = *(static_cast<const int*>(context) + 1);
   if (left_wc == 1)
     FireFeature(-1, left, features);
   FireFeature(left, -1, features);
 }
 
-void SourceBigram::FireFeature(WordID left,
-                   WordID right,
+void SourceBigram::FireFeature(int left,
+                   int right,
                    SparseVector<double>* features) const {
-  int& fid = fmap_[left][right];
-  // TODO important important !!! escape strings !!!
-  if (!fid) {
-    ostringstream os;
-    os << fid_str_;
-    if (left < 0) { os << "BOS"; } else { os << TD::Convert(left); }
-    os << '_';
-    if (right < 0) { os << "EOS"; } else { os << TD::Convert(right); }
-    fid = FD::Convert(os.str());
-    if (fid == 0) fid = -1;
+  int& cur_fid = cur_fids_[(left + 1) * (cur_words_.size() + 1) + right + 1];
+  if (!cur_fid) {
+    const WordID lw = left < 0 ? -1 : cur_words_[left];
+    const WordID rw = right < 0 ? -1 : cur_words_[right];
+    int& fid = fmap_[lw][rw];
+    // TODO important important !!! escape strings !!!
+    if (!fid) {
+      ostringstream os;
+      os << fid_str_;
+      if (lw < 0) { os << "BOS"; } else { os << TD::Convert(lw); }
+      os << '_';
+      if (rw < 0) { os << "EOS"; } else { os << TD::Convert(rw); }
+      fid = FD::Convert(os.str());
+      if (fid == 0) fid = -1;
+    }
+    cur_fid = fid;
   }
-  if (fid > 0) features->set_value(fid, 1.0);
+  if (cur_fid > 0) features->set_value(cur_fid, 1.0);
 }
 
 void SourceBigram::TraversalFeaturesImpl(const SentenceMetadata& smeta,
@@ -365,22 +406,23 @@ void SourceBigram::TraversalFeaturesImpl(const SentenceMetadata& smeta,
                                      SparseVector<double>* features,
                                             SparseVector<double>* /* estimated_features */,
                                      void* context) const {
-  WordID& out_context = *static_cast<WordID*>(context);
+  int& out_context = *static_cast<int*>(context);
   int& out_word_count = *(static_cast<int*>(context) + 1);
   const int arity = edge.Arity();
   if (arity == 0) {
-    out_context = lexmap_->SourceWordAtPosition(edge.i_);
+    assert(edge.i_ + 1 < cur_word_index_.size());
+    out_context = cur_word_index_[edge.i_ + 1];
     out_word_count = edge.rule_->EWords();
     assert(out_word_count == 1); // this is only defined for lex translation!
     // revisit this if you want to translate into null words
   } else if (arity == 1) {
-    WordID left = *static_cast<const WordID*>(ant_contexts[0]);
+    int left = *static_cast<const int*>(ant_contexts[0]);
     int left_wc = *(static_cast<const int*>(ant_contexts[0]) + 1);
     out_context = left;
     out_word_count = left_wc;
   } else if (arity == 2) {
-    WordID left = *static_cast<const WordID*>(ant_contexts[0]);
-    WordID right = *static_cast<const WordID*>(ant_contexts[1]);
+    int left = *static_cast<const int*>(ant_contexts[0]);
+    int right = *static_cast<const int*>(ant_contexts[1]);
     int left_wc = *(static_cast<const int*>(ant_contexts[0]) + 1);
     int right_wc = *(static_cast<const int*>(ant_contexts[0]) + 1);
     if (left_wc == 1 && right_wc == 1)
@@ -605,43 +647,17 @@ void InputIndicator::TraversalFeaturesImpl(const SentenceMetadata& smeta,
   }
 }
 
-WordPairFeatures::WordPairFeatures(const string& param) {
+WordPairFeatures::WordPairFeatures(const string& param) : pairs_(~static_cast<uint64_t>(0)) {
   vector<string> argv;
   int argc = SplitOnWhitespace(param, &argv); 
   if (argc != 1) {
     cerr << "WordPairFeature /path/to/feature_values.table\n";
     abort();
   }
-  set<WordID> all_srcs;
-  {
-    ReadFile rf(argv[0]);
-    istream& in = *rf.stream();
-    string buf;
-    while (in) {
-      getline(in, buf);
-      if (buf.empty()) continue;
-      int start = 0;
-      while(start < buf.size() && buf[start] == ' ') ++start;
-      int end = start;
-      while(end < buf.size() && buf[end] != ' ') ++end;
-      const WordID src = TD::Convert(buf.substr(start, end - start));
-      all_srcs.insert(src);
-    }
-  }
-  if (all_srcs.empty()) {
-    cerr << "WordPairFeature " << param << " loaded empty file!\n";
-    return;
-  }
-  fkeys_.reserve(all_srcs.size());
-  copy(all_srcs.begin(), all_srcs.end(), back_inserter(fkeys_));
-  values_.resize(all_srcs.size());
-  if (!SILENT) { cerr << "WordPairFeature: " << all_srcs.size() << " sources\n"; }
   ReadFile rf(argv[0]);
   istream& in = *rf.stream();
   string buf;
   double val = 0;
-  WordID cur_src = 0;
-  map<WordID, SparseVector<float> > *pv = NULL;
   const WordID kBARRIER = TD::Convert("|||");
   while (in) {
     getline(in, buf);
@@ -651,11 +667,8 @@ WordPairFeatures::WordPairFeatures(const string& param) {
     int end = start;
     while(end < buf.size() && buf[end] != ' ') ++end;
     const WordID src = TD::Convert(buf.substr(start, end - start));
-    if (cur_src != src) {
-      cur_src = src;
-      size_t ind = distance(fkeys_.begin(), lower_bound(fkeys_.begin(), fkeys_.end(), cur_src));
-      pv = &values_[ind];
-    }
+    if (fkeys_.empty() || fkeys_.back() != src)
+      fkeys_.push_back(src);
     end += 1;
     start = end;
     while(end < buf.size() && buf[end] != ' ') ++end;
@@ -682,7 +695,9 @@ WordPairFeatures::WordPairFeatures(const string& param) {
     }
     start = end + 1;
 
-    SparseVector<float>& v = (*pv)[trg];
+    const int ind = *pairs_.Insert(PairKey(src, trg), values_.size()).first;
+    if (ind == values_.size()) values_.push_back(SparseVector<float>());
+    SparseVector<float>& v = values_[ind];
     while(start < buf.size()) {
       end = start + 1;
       while(end < buf.size() && buf[end] != '=' && buf[end] != ' ') ++end;
@@ -699,6 +714,13 @@ WordPairFeatures::WordPairFeatures(const string& param) {
       start = end + 1;
     }
   }
+  sort(fkeys_.begin(), fkeys_.end());
+  fkeys_.erase(unique(fkeys_.begin(), fkeys_.end()), fkeys_.end());
+  if (fkeys_.empty()) {
+    cerr << "WordPairFeature " << param << " loaded empty file!\n";
+    return;
+  }
+  if (!SILENT) { cerr << "WordPairFeature: " << fkeys_.size() << " sources\n"; }
 }
 
 void WordPairFeatures::TraversalFeaturesImpl(const SentenceMetadata& smeta,
@@ -712,15 +734,16 @@ void WordPairFeatures::TraversalFeaturesImpl(const SentenceMetadata& smeta,
     assert(edge.rule_->FWords() == 1);
     const WordID trg = edge.rule_->e()[0]; 
     const WordID src = edge.rule_->f()[0];
-    size_t ind = distance(fkeys_.begin(), lower_bound(fkeys_.begin(), fkeys_.end(), src));
-    if (ind == fkeys_.size() || fkeys_[ind] != src) {
+    const int* ind = pairs_.Find(PairKey(src, trg));
+    if (ind) {
+      (*features) += values_[*ind];
+      return;
+    }
+    if (!binary_search(fkeys_.begin(), fkeys_.end(), src)) {
       cerr << "WordPairFeatures no source entries for " << TD::Convert(src) << endl;
       abort();
     }
-    const map<WordID, SparseVector<float> >::const_iterator it = values_[ind].find(trg);
     // TODO optional strict flag to make sure there are features for all pairs?
-    if (it != values_[ind].end())
-      (*features) += it->second;
   }
 }
 
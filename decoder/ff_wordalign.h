@@ -4,6 +4,7 @@
 #include "ff.h"
 #include "array2d.h"
 #include "factored_lexicon_helper.h"
+#include "int_map.h"
 
 #include <boost/scoped_ptr.hpp>
 #include <boost/multi_array.hpp>
@@ -11,6 +12,7 @@
 class RelativeSentencePosition : public FeatureFunction {
  public:
   RelativeSentencePosition(const std::string& param);
+  void PrepareForInput(const SentenceMetadata& smeta);
  protected:
   virtual void TraversalFeaturesImpl(const SentenceMetadata& smeta,
                                      const Hypergraph::Edge& edge,
@@ -23,6 +25,7 @@ class RelativeSentencePosition : public FeatureFunction {
   bool condition_on_fclass_;
   std::vector<std::vector<WordID> > pos_;
   std::map<WordID, int> fids_;  // fclass -> fid
+  std::vector<int> cur_fids_;  // source position -> fid of its class
 };
 
 typedef std::map<WordID, int> Class2FID;
@@ -42,12 +45,19 @@ class SourceBigram : public FeatureFunction {
                                      SparseVector<double>* estimated_features,
                                      void* context) const;
  private:
-  void FireFeature(WordID src,
-                   WordID trg,
+  // left and right are indices into cur_words_, -1 for BOS and EOS
+  void FireFeature(int left,
+                   int right,
                    SparseVector<double>* features) const;
   std::string fid_str_;
   mutable Class2Class2FID fmap_;
   boost::scoped_ptr<FactoredLexiconHelper> lexmap_; // different view (stemmed, etc) of source
+  // the distinct (mapped) source words of the current sentence, NULL first;
+  // states hold indices into it rather than WordIDs
+  std::vector<WordID> cur_words_;
+  std::vector<int> cur_word_index_;  // source position + 1 -> index
+  // (left + 1, right + 1) -> fid, filled in as the bigrams are seen
+  mutable std::vector<int> cur_fids_;
 };
 
 class LexNullJump : public FeatureFunction {
@@ -70,6 +80,7 @@ class LexNullJump : public FeatureFunction {
 class NewJump : public FeatureFunction {
  public:
   NewJump(const std::string& param);
+  void PrepareForInput(const SentenceMetadata& smeta);
  protected:
   virtual void TraversalFeaturesImpl(const SentenceMetadata& smeta,
                                      const Hypergraph::Edge& edge,
@@ -102,6 +113,10 @@ class NewJump : public FeatureFunction {
   bool fprev_;
   std::vector<std::vector<WordID> > src_;
   std::string fid_str_;  // identifies configuration uniquely
+  // (previous source index + 1, current source index) -> fid for the
+  // current sentence, filled in as the jumps are seen
+  mutable std::vector<int> cur_fids_;
+  int cur_flen_;
 };
 
 class LexicalTranslationTrigger : public FeatureFunction {
@@ -125,8 +140,8 @@ class LexicalTranslationTrigger : public FeatureFunction {
 };
 
 #include <tr1/unordered_map>
-#include <boost/functional/hash.hpp>
 #include <cassert>
+#include "hash.h"
 class BlunsomSynchronousParseHack : public FeatureFunction {
  public:
   BlunsomSynchronousParseHack(const std::string& param);
@@ -196,7 +211,7 @@ class BlunsomSynchronousParseHack : public FeatureFunction {
 
   const int fid_;
   mutable int cur_sent_;
-  typedef std::tr1::unordered_map<std::vector<WordID>, int, boost::hash<std::vector<WordID> > > Vec2Int;
+  typedef std::tr1::unordered_map<std::vector<WordID>, int, murmur_hash_array<std::vector<WordID> > > Vec2Int;
   mutable Vec2Int cur_map_;
   const std::vector<WordID> mutable * cur_ref_;
   mutable std::vector<std::vector<WordID> > refs_;
@@ -216,8 +231,12 @@ class WordPairFeatures : public FeatureFunction {
                                      void* context) const;
 
  private:
-  std::vector<WordID> fkeys_;  // parallel to values_
-  std::vector<std::map<WordID, SparseVector<float> > > values_;  // fkeys_index -> e -> value
+  static uint64_t PairKey(WordID f, WordID e) {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(f)) << 32) | static_cast<uint32_t>(e);
+  }
+  std::vector<WordID> fkeys_;  // sorted sources with entries
+  IntMap<uint64_t, int> pairs_;  // (f,e) -> index in values_
+  std::vector<SparseVector<float> > values_;
 };
 
 // fires when a len(word) >= length_min_ is translated as itself and then a self-transition is made
@@ -16,7 +16,7 @@ void WordSet::TraversalFeaturesImpl(const SentenceMetadata& /*smeta*/ ,
   double addScore = 0.0;
   for(std::vector<WordID>::const_iterator it = edge.rule_->e_.begin(); it != edge.rule_->e_.end(); ++it) {
     
-    bool inVocab = (vocab_.find(*it) != vocab_.end());
+    const bool inVocab = *it >= 0 && *it < vocab_.size() && vocab_[*it];
     if(oovMode_ && !inVocab) {
       addScore += 1.0;
     } else if(!oovMode_ && inVocab) {
@@ -3,7 +3,6 @@
 
 #include "ff.h"
 
-#include <boost/unordered/unordered_set.hpp>
 #include <boost/algorithm/string.hpp>
 
 #include <vector>
@@ -33,6 +32,7 @@ class WordSet : public FeatureFunction {
   }
 
   Features features() const { return single_feature(fid_); }
+  bool rule_feature() const { return true; }
 
  protected:
   virtual void TraversalFeaturesImpl(const SentenceMetadata& smeta,
@@ -43,7 +43,8 @@ class WordSet : public FeatureFunction {
                                      void* context) const;
  private:
 
-  static void loadVocab(const std::string& vocabFile, boost::unordered_set<WordID>* vocab) {
+  // vocab is indexed by WordID
+  static void loadVocab(const std::string& vocabFile, std::vector<bool>* vocab) {
 
       std::ifstream file;
       std::string line;
@@ -60,7 +61,8 @@ class WordSet : public FeatureFunction {
 	  }
 	  
 	  WordID vocabId = TD::Convert(line);
-	  vocab->insert(vocabId);
+	  if (vocabId >= vocab->size()) vocab->resize(vocabId + 1);
+	  (*vocab)[vocabId] = true;
 	}
 	file.close();
       } else {
@@ -105,7 +107,7 @@ class WordSet : public FeatureFunction {
 
   int fid_;
   bool oovMode_;
-  boost::unordered_set<WordID> vocab_;
+  std::vector<bool> vocab_;
 };
 
 #endif
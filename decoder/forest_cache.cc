@@ -0,0 +1,108 @@
+#include "forest_cache.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdint.h>
+#include <boost/thread/mutex.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "filelib.h"
+#include "hg.h"
+#include "hg_io.h"
+#include "murmur_hash.h"
+
+using namespace std;
+
+// numbers the temporary files of this process
+static boost::mutex tmp_mutex;
+static unsigned next_tmp = 0;
+
+// file: magic, uint64_t key length, key, binary forest
+static const char kFC_MAGIC[8] = { 'c', 'd', 'e', 'c', 'F', 'C', 'K', '1' };
+
+ForestCache::ForestCache(const string& dir) : dir_(dir), hits_(), misses_() {
+  MkDirP(dir_);
+}
+
+string ForestCache::FileName(const string& key) const {
+  char buf[17];
+  sprintf(buf, "%016llx", (unsigned long long) MurmurHash64(key.data(), key.size()));
+  return dir_ + "/" + buf;
+}
+
+bool ForestCache::Load(const string& key, Hypergraph* forest) {
+  const string fname = FileName(key);
+  const int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0) {
+    ++misses_;
+    return false;
+  }
+  struct stat st;
+  const size_t head = sizeof(kFC_MAGIC) + sizeof(uint64_t);
+  void* data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t) st.st_size > head + key.size())
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  bool res = false;
+  if (data != MAP_FAILED) {
+    const char* p = static_cast<const char*>(data);
+    uint64_t len;
+    memcpy(&len, p + sizeof(kFC_MAGIC), sizeof(len));
+    // anything else (another key with the same hash) is a miss
+    if (memcmp(p, kFC_MAGIC, sizeof(kFC_MAGIC)) == 0 && len == key.size() &&
+        memcmp(p + head, key.data(), len) == 0) {
+      res = HypergraphIO::ReadFromBinary(p + head + len, st.st_size - head - len, forest);
+      if (!res) cerr << "  (in forest cache file " << fname << ")\n";
+    }
+    munmap(data, st.st_size);
+  }
+  if (res) ++hits_; else ++misses_;
+  return res;
+}
+
+void ForestCache::Store(const string& key, const Hypergraph& forest) {
+  ostringstream data;
+  const uint64_t len = key.size();
+  data.write(kFC_MAGIC, sizeof(kFC_MAGIC));
+  data.write(reinterpret_cast<const char*>(&len), sizeof(len));
+  data.write(key.data(), len);
+  HypergraphIO::WriteToBinary(forest, false, &data);
+  const string buf = data.str();
+
+  // a file of its own, even when other threads of this process store the
+  // same key at the same time
+  ostringstream tmp;
+  {
+    boost::mutex::scoped_lock lock(tmp_mutex);
+    tmp << FileName(key) << ".tmp." << getpid() << '.' << next_tmp++;
+  }
+  const string tname = tmp.str();
+  const int fd = open(tname.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+  if (fd < 0) {
+    cerr << "Can't create " << tname << ": " << strerror(errno) << endl;
+    return;
+  }
+  size_t done = 0;
+  while (done < buf.size()) {
+    const ssize_t n = write(fd, buf.data() + done, buf.size() - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    done += n;
+  }
+  if (close(fd) != 0 || done < buf.size()) {
+    cerr << "Can't write forest cache file " << tname << endl;
+    unlink(tname.c_str());
+    return;
+  }
+  if (rename(tname.c_str(), FileName(key).c_str()) != 0) {
+    cerr << "Can't rename " << tname << ": " << strerror(errno) << endl;
+    unlink(tname.c_str());
+  }
+}
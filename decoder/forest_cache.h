@@ -0,0 +1,38 @@
+#ifndef _FOREST_CACHE_H_
+#define _FOREST_CACHE_H_
+
+#include <string>
+
+class Hypergraph;
+
+// the -LM forests of inputs translated before, kept in files under dir so
+// that later runs (e.g. the next iteration of MERT, PRO or MIRA on the same
+// dev set) can skip parsing.  The caller's key must name everything the
+// forest depends on: the input, its markup and the grammar and formalism
+// settings.  A file is named by a hash of its key and starts with the key,
+// so a collision is just a miss; the forest follows in the binary format of
+// HypergraphIO::WriteToBinary and is read from a memory map.  Each Store
+// writes a temporary file of its own and renames it, so readers only see
+// whole files and the decoders of several threads or processes can share
+// dir (when two store the same key, the last rename wins).  The hit and miss
+// counts aren't synchronized, so each thread needs its own ForestCache.
+class ForestCache {
+ public:
+  explicit ForestCache(const std::string& dir);
+
+  // true, with the forest in *forest, if key's forest is in the cache
+  bool Load(const std::string& key, Hypergraph* forest);
+  void Store(const std::string& key, const Hypergraph& forest);
+
+  unsigned hits() const { return hits_; }
+  unsigned misses() const { return misses_; }
+
+ private:
+  std::string FileName(const std::string& key) const;
+
+  const std::string dir_;
+  unsigned hits_;
+  unsigned misses_;
+};
+
+#endif
@@ -2,22 +2,79 @@
 
 #include <iostream>
 
+#include <boost/bind.hpp>
+
 #include "fast_lexical_cast.hpp"
 
 #include "filelib.h"
 #include "hg_io.h"
 #include "hg.h"
+#include "arena.h"
+#include "verbose.h"
 
 using namespace std;
 
-ForestWriter::ForestWriter(const std::string& path, int num) :
-  fname_(path + '/' + boost::lexical_cast<string>(num) + ".json.gz"), used_(false) {}
+ForestWriter::ForestWriter(const std::string& path, int num, bool binary) :
+  binary_(binary),
+  fname_(path + '/' + boost::lexical_cast<string>(num) + (binary ? ".hgb" : ".json.gz")),
+  used_(false) {}
 
 bool ForestWriter::Write(const Hypergraph& forest, bool minimal_rules) {
   assert(!used_);
   used_ = true;
   cerr << "  Writing forest to " << fname_ << endl;
   WriteFile wf(fname_);
+  if (binary_)
+    return HypergraphIO::WriteToBinary(forest, minimal_rules, wf.stream());
   return HypergraphIO::WriteToJSON(forest, minimal_rules, wf.stream());
 }
 
+bool ForestWriter::WriteOrUnion(const Hypergraph& forest) {
+  if (!FileExists(fname_))
+    return Write(forest, false);
+  if (!SILENT) cerr << "  Unioning...\n";
+  Hypergraph new_hg;
+  if (!HypergraphIO::ReadFromFile(fname_, &new_hg))
+    return false;
+  new_hg.Union(forest);
+  return Write(new_hg, false);
+}
+
+AsyncForestWriter::AsyncForestWriter(unsigned max_pending, unsigned threads) {
+  if (!threads) threads = 1;
+  for (unsigned i = 0; i < threads; ++i) {
+    queues_.push_back(boost::shared_ptr<BoundedQueue<Job> >(new BoundedQueue<Job>(max_pending)));
+    threads_.create_thread(boost::bind(&AsyncForestWriter::Run, this, queues_.back().get()));
+  }
+}
+
+AsyncForestWriter::~AsyncForestWriter() {
+  for (unsigned i = 0; i < queues_.size(); ++i)
+    queues_[i]->Close();
+  threads_.join_all();
+}
+
+void AsyncForestWriter::Write(const string& path, int num, bool binary, const Hypergraph& forest) {
+  Job job;
+  job.path = path;
+  job.num = num;
+  job.binary = binary;
+  {
+    // the copy outlives the caller's arena (if any)
+    ArenaScope heap(NULL);
+    job.forest.reset(new Hypergraph(forest));
+  }
+  // a file is only ever written by one thread, so unions see the forests
+  // queued before them
+  queues_[static_cast<unsigned>(num) % queues_.size()]->Push(job);
+}
+
+void AsyncForestWriter::Run(BoundedQueue<Job>* queue) {
+  Job job;
+  while (queue->Pop(&job)) {
+    ForestWriter writer(job.path, job.num, job.binary);
+    bool succeeded = writer.WriteOrUnion(*job.forest);
+    assert(succeeded);
+    job.forest.reset();
+  }
+}
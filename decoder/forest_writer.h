@@ -2,15 +2,50 @@
 #define _FOREST_WRITER_H_
 
 #include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "bounded_queue.h"
 
 class Hypergraph;
 
+// writes forests to path/num.json.gz, or to path/num.hgb if binary is set
+// (see HypergraphIO::WriteToBinary)
 struct ForestWriter {
-  ForestWriter(const std::string& path, int num);
+  ForestWriter(const std::string& path, int num, bool binary = false);
   bool Write(const Hypergraph& forest, bool minimal_rules);
+  // if the file is already there, writes the union of forest and the forest
+  // read from it instead
+  bool WriteOrUnion(const Hypergraph& forest);
 
+  const bool binary_;
   const std::string fname_;
   bool used_;
 };
 
+// does ForestWriter::WriteOrUnion on background threads, so the decoder
+// doesn't wait for serialization and compression.  forests with the same num
+// go to the same thread and are written in the order they are queued.  Write
+// copies the forest and blocks only when max_pending forests are already
+// waiting for that thread.  the destructor writes whatever is left.
+class AsyncForestWriter {
+ public:
+  explicit AsyncForestWriter(unsigned max_pending, unsigned threads = 1);
+  ~AsyncForestWriter();
+  void Write(const std::string& path, int num, bool binary, const Hypergraph& forest);
+
+ private:
+  struct Job {
+    std::string path;
+    int num;
+    bool binary;
+    boost::shared_ptr<Hypergraph> forest;
+  };
+  void Run(BoundedQueue<Job>* queue);
+
+  std::vector<boost::shared_ptr<BoundedQueue<Job> > > queues_;
+  boost::thread_group threads_;
+};
+
 #endif
@@ -1,7 +1,7 @@
 #ifndef _FREQDICT_H_
 #define _FREQDICT_H_
 
-#include <map>
+#include <tr1/unordered_map>
 #include <string>
 #include "wordid.h"
 
@@ -9,12 +9,12 @@ class FreqDict {
  public:
   void Load(const std::string& fname);
   float LookUp(const WordID& word) const {
-    std::map<WordID,float>::const_iterator i = counts_.find(word);
+    std::tr1::unordered_map<WordID,float>::const_iterator i = counts_.find(word);
     if (i == counts_.end()) return 0;
     return i->second;
   }
  private:
-  std::map<WordID, float> counts_;
+  std::tr1::unordered_map<WordID, float> counts_;
 };
 
 #endif
@@ -19,14 +19,15 @@ struct FSTTranslatorImpl {
       kGOAL_RULE(new TRule("[Goal] ||| [" + goal_sym + ",1] ||| [1]")),
       kGOAL(TD::Convert("Goal") * -1),
       add_pass_through_rules(conf.count("add_pass_through_rules")) {
-    fst.reset(LoadTextPhrasetable(conf["grammar"].as<vector<string> >()));
-    ec.reset(new EarleyComposer(fst.get()));
+    fst.reset(LoadPhrasetable(conf["grammar"].as<vector<string> >()));
   }
 
   bool Translate(const string& input,
                  const vector<double>& weights,
                  Hypergraph* forest) {
     bool composed = false;
+    PassThroughFST q_0(fst.get());
+    EarleyComposer ec(&q_0);
     if (input.find("{\"rules\"") == 0) {
       istringstream is(input);
       Hypergraph src_cfg_hg;
@@ -38,12 +39,12 @@ struct FSTTranslatorImpl {
           const vector<WordID>& f = src_cfg_hg.edges_[i].rule_->f_;
           for (int j = 0; j < f.size(); ++j) {
             if (f[j] > 0) {
-              fst->AddPassThroughTranslation(f[j], feats);
+              q_0.AddPassThroughTranslation(f[j], feats);
             }
           }
         }
       }
-      composed = ec->Compose(src_cfg_hg, forest);
+      composed = ec.Compose(src_cfg_hg, forest);
     } else {
       const string dummy_grammar("[" + goal_sym + "] ||| " + input + " ||| TOP=1");
       cerr << "  Dummy grammar: " << dummy_grammar << endl;
@@ -54,9 +55,9 @@ struct FSTTranslatorImpl {
         SparseVector<double> feats;
         feats.set_value(FD::Convert("PassThrough"), 1);
         for (int i = 0; i < words.size(); ++i)
-          fst->AddPassThroughTranslation(words[i], feats);
+          q_0.AddPassThroughTranslation(words[i], feats);
       }
-      composed = ec->Compose(&is, forest);
+      composed = ec.Compose(&is, forest);
     }
     if (composed) {
       Hypergraph::TailNodeVector tail(1, forest->nodes_.size() - 1);
@@ -65,8 +66,6 @@ struct FSTTranslatorImpl {
       forest->ConnectEdgeToHeadNode(hg_edge, goal);
       forest->Reweight(weights);
     }
-    if (add_pass_through_rules)
-      fst->ClearPassThroughTranslations();
     return composed;
   }
 
@@ -74,8 +73,7 @@ struct FSTTranslatorImpl {
   const TRulePtr kGOAL_RULE;
   const WordID kGOAL;
   const bool add_pass_through_rules;
-  boost::shared_ptr<EarleyComposer> ec;
-  boost::shared_ptr<FSTNode> fst;
+  boost::shared_ptr<const FSTNode> fst;
 };
 
 FSTTranslator::FSTTranslator(const boost::program_options::variables_map& conf) :
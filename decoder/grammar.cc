@@ -3,6 +3,9 @@
 #include <algorithm>
 #include <utility>
 #include <map>
+#include <tr1/unordered_map>
+
+#include <boost/thread/mutex.hpp>
 
 #include "rule_lexer.h"
 #include "filelib.h"
@@ -23,6 +26,18 @@ bool Grammar::HasRuleForSpan(int i, int j, int distance) const {
   return true;  // always true by default
 }
 
+static void VisitRule(const TRulePtr& rule, Grammar::RuleCallback f, void* extra) {
+  f(rule, extra);
+  if (rule->fine_rules_)
+    for (unsigned i = 0; i < rule->fine_rules_->size(); ++i)
+      VisitRule((*rule->fine_rules_)[i], f, extra);
+}
+
+void Grammar::ForEachRule(RuleCallback f, void* extra) const {
+  for (unsigned i = 0; i < unaries_.size(); ++i)
+    VisitRule(unaries_[i], f, extra);
+}
+
 struct TextRuleBin : public RuleBin {
   int GetNumRules() const {
     return rules_.size();
@@ -66,8 +81,112 @@ struct TextGrammarNode : public GrammarIter {
   TextRuleBin* rb_;
 };
 
+// after loading, the trie is frozen into FrozenGrammarNodes stored
+// contiguously in breadth first order, so the children of a node are a range
+// of nodes_ and the symbols labeling them the same range of syms_
+struct FrozenGrammarTrie;
+struct FrozenGrammarNode : public GrammarIter {
+  FrozenGrammarNode() : trie_(NULL), first_child_(0), num_children_(0), rb_(NULL) {}
+  inline const GrammarIter* Extend(int symbol) const;
+  const RuleBin* GetRules() const { return rb_; }
+
+  const FrozenGrammarTrie* trie_;
+  unsigned first_child_;
+  unsigned num_children_;
+  TextRuleBin* rb_;
+};
+
+struct FrozenGrammarTrie {
+  ~FrozenGrammarTrie() {
+    for (int i = 0; i < nodes_.size(); ++i)
+      delete nodes_[i].rb_;
+  }
+  std::vector<WordID> syms_;
+  std::vector<FrozenGrammarNode> nodes_;
+};
+
+inline const GrammarIter* FrozenGrammarNode::Extend(int symbol) const {
+  if (!num_children_) return NULL;
+  const WordID* first = &trie_->syms_[first_child_];
+  const WordID* last = first + num_children_;
+  const WordID* i = lower_bound(first, last, symbol);
+  if (i == last || *i != symbol) return NULL;
+  return &trie_->nodes_[first_child_ + (i - first)];
+}
+
 struct TGImpl {
+  // moves the rules from root_ into frozen_ and releases root_'s nodes
+  void Freeze() {
+    if (frozen_) return;
+    FrozenGrammarTrie* f = new FrozenGrammarTrie;
+    vector<TextGrammarNode*> order(1, &root_);
+    f->syms_.push_back(0);
+    for (unsigned k = 0; k < order.size(); ++k) {
+      TextGrammarNode* n = order[k];
+      for (map<WordID, TextGrammarNode>::iterator i = n->tree_.begin(); i != n->tree_.end(); ++i) {
+        f->syms_.push_back(i->first);
+        order.push_back(&i->second);
+      }
+    }
+    f->nodes_.resize(order.size());
+    unsigned next_child = 1;
+    for (unsigned k = 0; k < order.size(); ++k) {
+      FrozenGrammarNode& fn = f->nodes_[k];
+      fn.trie_ = f;
+      fn.first_child_ = next_child;
+      fn.num_children_ = order[k]->tree_.size();
+      next_child += fn.num_children_;
+      fn.rb_ = order[k]->rb_;
+      order[k]->rb_ = NULL;
+    }
+    root_.tree_.clear();
+    frozen_.reset(f);
+  }
+
+  void ForEachRule(Grammar::RuleCallback f, void* extra) const {
+    if (frozen_) {
+      for (unsigned k = 0; k < frozen_->nodes_.size(); ++k)
+        VisitRules(frozen_->nodes_[k].rb_, f, extra);
+    } else {
+      ForEachRule(root_, f, extra);
+    }
+  }
+
+  // turns the frozen trie back into root_ so more rules can be added
+  void Thaw() {
+    if (!frozen_) return;
+    Thaw(0, &root_);
+    frozen_.reset();
+  }
+
+  const GrammarIter* GetRoot() {
+    Freeze();
+    return &frozen_->nodes_[0];
+  }
+
   TextGrammarNode root_;
+  boost::shared_ptr<FrozenGrammarTrie> frozen_;
+
+ private:
+  static void VisitRules(const TextRuleBin* rb, Grammar::RuleCallback f, void* extra) {
+    if (!rb) return;
+    for (int i = 0; i < rb->GetNumRules(); ++i)
+      VisitRule(rb->GetIthRule(i), f, extra);
+  }
+
+  static void ForEachRule(const TextGrammarNode& n, Grammar::RuleCallback f, void* extra) {
+    VisitRules(n.rb_, f, extra);
+    for (map<WordID, TextGrammarNode>::const_iterator i = n.tree_.begin(); i != n.tree_.end(); ++i)
+      ForEachRule(i->second, f, extra);
+  }
+
+  void Thaw(unsigned k, TextGrammarNode* n) {
+    FrozenGrammarNode& fn = frozen_->nodes_[k];
+    n->rb_ = fn.rb_;
+    fn.rb_ = NULL;
+    for (unsigned c = fn.first_child_; c < fn.first_child_ + fn.num_children_; ++c)
+      Thaw(c, &n->tree_[frozen_->syms_[c]]);
+  }
 };
 
 TextGrammar::TextGrammar() : max_span_(10), pimpl_(new TGImpl) {}
@@ -83,8 +202,15 @@ TextGrammar::TextGrammar(istream* in) :
   ReadFromStream(in);
 }
 
+// rules are usually all added before the first call, but if not, the trie
+// is rebuilt by AddRule and frozen again here
 const GrammarIter* TextGrammar::GetRoot() const {
-  return &pimpl_->root_;
+  return pimpl_->GetRoot();
+}
+
+void TextGrammar::ForEachRule(RuleCallback f, void* extra) const {
+  Grammar::ForEachRule(f, extra);
+  pimpl_->ForEachRule(f, extra);
 }
 
 void TextGrammar::AddRule(const TRulePtr& rule, const unsigned int ctf_level, const TRulePtr& coarse_rule) {
@@ -98,6 +224,7 @@ void TextGrammar::AddRule(const TRulePtr& rule, const unsigned int ctf_level, co
     rhs2unaries_[rule->f().front()].push_back(rule);
     unaries_.push_back(rule);
   } else {
+    pimpl_->Thaw();
     TextGrammarNode* cur = &pimpl_->root_;
     for (int i = 0; i < rule->f_.size(); ++i)
       cur = &cur->tree_[rule->f_[i]];
@@ -118,6 +245,9 @@ void TextGrammar::ReadFromFile(const string& filename) {
 
 void TextGrammar::ReadFromStream(istream* in) {
   RuleLexer::ReadRules(in, &AddRuleHelper, this);
+  // freeze now, since grammars read from files may be shared by several
+  // decoding threads which will all call GetRoot()
+  pimpl_->Freeze();
 }
 
 bool TextGrammar::HasRuleForSpan(int /* i */, int /* j */, int distance) const {
@@ -148,6 +278,25 @@ bool GlueGrammar::HasRuleForSpan(int i, int /* j */, int /* distance */) const {
   return (i == 0);
 }
 
+// pass-through rules depend only on the word, the category and the number of
+// coarse-to-fine levels, so they are made once per process and shared by
+// the PassThroughGrammars of all later inputs (and decoders)
+static boost::mutex pass_through_mutex;
+
+static TRulePtr PassThroughRule(WordID w, const string& cat, const unsigned int ctf_level) {
+  typedef std::tr1::unordered_map<WordID, TRulePtr> Word2Rule;
+  static map<pair<string, unsigned>, Word2Rule> memo;
+  boost::mutex::scoped_lock l(pass_through_mutex);
+  TRulePtr& pt = memo[make_pair(cat, ctf_level)][w];
+  if (!pt) {
+    const string& src = TD::Convert(w);
+    pt.reset(new TRule("[" + cat + "] ||| " + src + " ||| " + src + " ||| PassThrough=1"));
+    pt->a_.push_back(AlignmentPoint(0,0));
+    RefineRule(pt, ctf_level);
+  }
+  return pt;
+}
+
 PassThroughGrammar::PassThroughGrammar(const Lattice& input, const string& cat, const unsigned int ctf_level) :
     has_rule_(input.size() + 1) {
   for (int i = 0; i < input.size(); ++i) {
@@ -155,11 +304,7 @@ PassThroughGrammar::PassThroughGrammar(const Lattice& input, const string& cat,
     for (int k = 0; k < alts.size(); ++k) {
       const int j = alts[k].dist2next + i;
       has_rule_[i].insert(j);
-      const string& src = TD::Convert(alts[k].label);
-      TRulePtr pt(new TRule("[" + cat + "] ||| " + src + " ||| " + src + " ||| PassThrough=1"));
-      pt->a_.push_back(AlignmentPoint(0,0));
-      AddRule(pt);
-      RefineRule(pt, ctf_level);
+      AddRule(PassThroughRule(alts[k].label, cat, ctf_level));
     }
   }
 }
@@ -35,6 +35,12 @@ struct Grammar {
   virtual ~Grammar();
   virtual const GrammarIter* GetRoot() const = 0;
   virtual bool HasRuleForSpan(int i, int j, int distance) const;
+  // calls f(rule, extra) once for every rule stored in the grammar, including
+  // the finer rules of coarse-to-fine grammars.  The default visits only the
+  // unary rules; grammars that create rules on demand (e.g., BinaryGrammar)
+  // cannot enumerate the others.
+  typedef void (*RuleCallback)(const TRulePtr& rule, void* extra);
+  virtual void ForEachRule(RuleCallback f, void* extra) const;
   const std::string GetGrammarName(){return grammar_name_;}
   unsigned int GetCTFLevels(){ return ctf_levels_; }
   void SetGrammarName(std::string n) {grammar_name_ = n; }
@@ -73,6 +79,7 @@ struct TextGrammar : public Grammar {
   void ReadFromFile(const std::string& filename);
   void ReadFromStream(std::istream* in);
   virtual bool HasRuleForSpan(int i, int j, int distance) const;
+  virtual void ForEachRule(RuleCallback f, void* extra) const;
   const std::vector<TRulePtr>& GetUnaryRules(const WordID& cat) const;
 
  private:
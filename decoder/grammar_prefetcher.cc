@@ -0,0 +1,65 @@
+#include "grammar_prefetcher.h"
+
+#include <cassert>
+#include <boost/bind.hpp>
+
+#include "arena.h"
+#include "grammar.h"
+
+using namespace std;
+
+GrammarPrefetcher::GrammarPrefetcher(unsigned max_loaded) :
+    max_loaded_(max_loaded), next_(0), stop_(false) {
+  assert(max_loaded > 0);
+  thread_ = boost::thread(boost::bind(&GrammarPrefetcher::Run, this));
+}
+
+GrammarPrefetcher::~GrammarPrefetcher() {
+  {
+    boost::mutex::scoped_lock l(mutex_);
+    stop_ = true;
+    work_.notify_one();
+  }
+  thread_.join();
+}
+
+void GrammarPrefetcher::Request(const string& fname) {
+  boost::mutex::scoped_lock l(mutex_);
+  entries_.push_back(boost::shared_ptr<Entry>(new Entry(fname)));
+  work_.notify_one();
+}
+
+boost::shared_ptr<TextGrammar> GrammarPrefetcher::Take(const string& fname) {
+  boost::mutex::scoped_lock l(mutex_);
+  unsigned k = 0;
+  while (k < entries_.size() && entries_[k]->fname != fname) ++k;
+  if (k == entries_.size()) return boost::shared_ptr<TextGrammar>();
+  // the ones before were skipped; if one is being read, Run drops it after
+  entries_.erase(entries_.begin(), entries_.begin() + k);
+  next_ = next_ > k ? next_ - k : 0;
+  work_.notify_one();
+  const boost::shared_ptr<Entry> e = entries_.front();
+  while (!e->done) done_.wait(l);
+  entries_.pop_front();
+  --next_;
+  work_.notify_one();
+  return e->grammar;
+}
+
+void GrammarPrefetcher::Run() {
+  // the grammars outlive any sentence, so they don't go in an arena
+  ArenaScope heap(NULL);
+  boost::mutex::scoped_lock l(mutex_);
+  while (true) {
+    while (!stop_ && (next_ == entries_.size() || next_ >= max_loaded_))
+      work_.wait(l);
+    if (stop_) return;
+    const boost::shared_ptr<Entry> e = entries_[next_++];
+    l.unlock();
+    boost::shared_ptr<TextGrammar> g(new TextGrammar(e->fname));
+    l.lock();
+    e->grammar.swap(g);
+    e->done = true;
+    done_.notify_all();
+  }
+}
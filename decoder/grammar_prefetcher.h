@@ -0,0 +1,52 @@
+#ifndef _GRAMMAR_PREFETCHER_H_
+#define _GRAMMAR_PREFETCHER_H_
+
+#include <deque>
+#include <string>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+struct TextGrammar;
+
+// reads the per-sentence grammars of the next inputs (the grammar= SGML
+// attribute, see SCFGTranslator) on a background thread, so opening,
+// decompressing and parsing them overlaps with decoding the sentences before
+// them.  Grammars are requested and taken in input order.  Take waits for a
+// grammar that is still being read; the grammars requested before it were
+// for inputs that didn't need theirs (e.g. answered from the sentence cache)
+// and are dropped.  At most max_loaded grammars are read and not taken yet,
+// which bounds the memory held ahead: the thread waits for Take to make room.
+class GrammarPrefetcher {
+ public:
+  explicit GrammarPrefetcher(unsigned max_loaded);
+  ~GrammarPrefetcher();
+
+  void Request(const std::string& fname);
+  // the grammar read from fname; NULL if it wasn't requested, in which case
+  // the caller reads it itself
+  boost::shared_ptr<TextGrammar> Take(const std::string& fname);
+
+ private:
+  struct Entry {
+    Entry(const std::string& f) : fname(f), done(false) {}
+    const std::string fname;
+    boost::shared_ptr<TextGrammar> grammar;
+    bool done;
+  };
+  void Run();
+
+  const unsigned max_loaded_;
+  // requested and not taken, in input order; entries_[0, next_) are read or
+  // being read
+  std::deque<boost::shared_ptr<Entry> > entries_;
+  unsigned next_;
+  bool stop_;
+  boost::mutex mutex_;
+  boost::condition_variable work_;  // for Run: a request, room or stop_
+  boost::condition_variable done_;  // for Take: a grammar was read
+  boost::thread thread_;
+};
+
+#endif
@@ -1,11 +1,18 @@
 #include <cassert>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <vector>
+#include <unistd.h>
 #include <gtest/gtest.h>
 #include "trule.h"
 #include "tdict.h"
 #include "grammar.h"
+#include "binary_grammar.h"
+#include "phrasetable_fst.h"
+#include "sentence_grammar_file.h"
+#include "grammar_prefetcher.h"
+#include "filelib.h"
 #include "bottom_up_parser.h"
 #include "ff.h"
 #include "weights.h"
@@ -36,6 +43,20 @@ TEST_F(GrammarTest,TestTextGrammar) {
   g.AddRule(r1);
   g.AddRule(r2);
   g.AddRule(r3);
+  const GrammarIter* abc = g.GetRoot()->Extend(TD::Convert("a"))->Extend(TD::Convert("b"))->Extend(TD::Convert("c"));
+  ASSERT_TRUE(abc);
+  EXPECT_EQ(2, abc->GetRules()->GetNumRules());
+  EXPECT_EQ(1, abc->Extend(TD::Convert("d"))->GetRules()->GetNumRules());
+  EXPECT_EQ(NULL, g.GetRoot()->Extend(TD::Convert("b")));
+
+  // adding rules after the trie was frozen
+  g.AddRule(TRulePtr(new TRule("[X] ||| b ||| B ||| 0.1", true)));
+  g.AddRule(TRulePtr(new TRule("[X] ||| a b c ||| C B A ||| 0.1", true)));
+  ASSERT_TRUE(g.GetRoot()->Extend(TD::Convert("b")));
+  EXPECT_EQ(1, g.GetRoot()->Extend(TD::Convert("b"))->GetRules()->GetNumRules());
+  abc = g.GetRoot()->Extend(TD::Convert("a"))->Extend(TD::Convert("b"))->Extend(TD::Convert("c"));
+  EXPECT_EQ(3, abc->GetRules()->GetNumRules());
+  EXPECT_EQ(1, abc->Extend(TD::Convert("d"))->GetRules()->GetNumRules());
 }
 
 TEST_F(GrammarTest,TestTextGrammarFile) {
@@ -53,6 +74,200 @@ TEST_F(GrammarTest,TestTextGrammarFile) {
   forest.PrintGraphviz();
 }
 
+static vector<string> RuleStrings(const GrammarIter* it) {
+  vector<string> res;
+  const RuleBin* rb = it ? it->GetRules() : NULL;
+  for (int i = 0; rb && i < rb->GetNumRules(); ++i)
+    res.push_back(rb->GetIthRule(i)->AsString());
+  sort(res.begin(), res.end());
+  return res;
+}
+
+TEST_F(GrammarTest,TestBinaryGrammar) {
+  const string bin = "grammar_test.bin";
+  {
+    ReadFile rf("./test_data/grammar.prune");
+    ASSERT_TRUE(CompileBinaryGrammar(rf.stream(), bin));
+  }
+  EXPECT_TRUE(BinaryGrammar::IsBinaryGrammar(bin));
+  EXPECT_FALSE(BinaryGrammar::IsBinaryGrammar("./test_data/grammar.prune"));
+  TextGrammar tg("./test_data/grammar.prune");
+  BinaryGrammar bg(bin);
+  unlink(bin.c_str());
+
+  // every source side of the text grammar finds the same rules in both
+  ReadFile rf("./test_data/grammar.prune");
+  string line;
+  int checked = 0;
+  while (getline(*rf.stream(), line)) {
+    TRule r(line);
+    const GrammarIter* ti = tg.GetRoot();
+    const GrammarIter* bi = bg.GetRoot();
+    for (int i = 0; ti && i < r.f_.size(); ++i) {
+      ti = ti->Extend(r.f_[i]);
+      bi = bi->Extend(r.f_[i]);
+      ASSERT_EQ(ti == NULL, bi == NULL);
+    }
+    if (!ti) continue;  // unary rules aren't stored in the trie
+    EXPECT_EQ(RuleStrings(ti), RuleStrings(bi));
+    ++checked;
+  }
+  EXPECT_GT(checked, 0);
+  EXPECT_EQ(NULL, bg.GetRoot()->Extend(TD::Convert("not_in_the_grammar")));
+  ASSERT_EQ(tg.GetAllUnaryRules().size(), bg.GetAllUnaryRules().size());
+  for (int i = 0; i < tg.GetAllUnaryRules().size(); ++i)
+    EXPECT_EQ(tg.GetAllUnaryRules()[i]->AsString(), bg.GetAllUnaryRules()[i]->AsString());
+}
+
+static string PhraseStrings(const FSTNode* q) {
+  ostringstream res;
+  const vector<TRulePtr>& rules = q->GetTranslations()->GetRules();
+  for (int i = 0; i < rules.size(); ++i)
+    res << TD::GetString(rules[i]->e_) << " ||| " << rules[i]->scores_ << "\n";
+  return res.str();
+}
+
+TEST_F(GrammarTest,TestBinaryPhrasetable) {
+  const string pt = "grammar_test.pt";
+  const string bin = "grammar_test.pt.bin";
+  {
+    ofstream out(pt.c_str());
+    out << "el ||| the ||| P=0.5\n"
+        << "el perro ||| the dog ||| P=0.25\n"
+        << "el perro ||| the hound ||| P=0.125\n"
+        << "perro negro ||| black dog ||| P=1\n";
+  }
+  {
+    ReadFile rf(pt);
+    ASSERT_TRUE(CompileBinaryPhrasetable(rf.stream(), bin));
+  }
+  EXPECT_TRUE(BinaryGrammar::IsBinaryGrammar(bin));
+  boost::shared_ptr<FSTNode> text(LoadPhrasetable(vector<string>(1, pt)));
+  boost::shared_ptr<FSTNode> binary(LoadPhrasetable(vector<string>(1, bin)));
+  unlink(pt.c_str());
+  unlink(bin.c_str());
+
+  const WordID el = TD::Convert("el"), perro = TD::Convert("perro"), negro = TD::Convert("negro");
+  const FSTNode* t = text->Extend(el);
+  const FSTNode* b = binary->Extend(el);
+  ASSERT_TRUE(t && b);
+  EXPECT_EQ(b, binary->Extend(el));  // states are stable
+  EXPECT_EQ(PhraseStrings(t), PhraseStrings(b));
+  t = t->Extend(perro);
+  b = b->Extend(perro);
+  ASSERT_TRUE(t && b);
+  EXPECT_EQ(PhraseStrings(t), PhraseStrings(b));
+  EXPECT_FALSE(b->HasOutgoingNonEpsilonEdges());
+  b = binary->Extend(perro);
+  ASSERT_TRUE(b);
+  EXPECT_FALSE(b->HasData());
+  EXPECT_TRUE(b->Extend(negro)->HasData());
+  EXPECT_EQ(NULL, binary->Extend(negro));
+
+  // pass-through rules go to an overlay, and only for words the table
+  // can't translate on their own
+  SparseVector<double> feats;
+  feats.set_value(FD::Convert("PassThrough"), 1);
+  PassThroughFST q_0(binary.get());
+  q_0.AddPassThroughTranslation(el, feats);
+  q_0.AddPassThroughTranslation(perro, feats);
+  q_0.AddPassThroughTranslation(negro, feats);
+  EXPECT_EQ(binary->Extend(el), q_0.Extend(el));
+  ASSERT_TRUE(q_0.Extend(perro)->HasData());
+  EXPECT_EQ("perro ||| PassThrough=1\n", PhraseStrings(q_0.Extend(perro)));
+  EXPECT_EQ(binary->Extend(perro)->Extend(negro), q_0.Extend(perro)->Extend(negro));
+  EXPECT_EQ("negro ||| PassThrough=1\n", PhraseStrings(q_0.Extend(negro)));
+  EXPECT_EQ(NULL, binary->Extend(negro));
+}
+
+TEST_F(GrammarTest,TestSentenceGrammarFile) {
+  const string psg = "grammar_test.psg";
+  {
+    SentenceGrammarFileWriter w(psg);
+    w.AddGrammar(3, "[X] ||| a b ||| A B ||| 0.5\n[X] ||| a ||| A ||| 0.1");
+    w.AddGrammarFile(7, "./test_data/grammar.prune");
+    EXPECT_TRUE(w.Close());
+  }
+  SentenceGrammarFile f(psg);
+  unlink(psg.c_str());
+  unlink(SentenceGrammarFile::IndexFileName(psg).c_str());
+  EXPECT_TRUE(f.HasGrammar(3));
+  EXPECT_TRUE(f.HasGrammar(7));
+  EXPECT_FALSE(f.HasGrammar(0));
+  EXPECT_EQ(NULL, f.ReadGrammar(0));
+
+  boost::shared_ptr<TextGrammar> g3(f.ReadGrammar(3));
+  ASSERT_TRUE(g3);
+  const GrammarIter* a = g3->GetRoot()->Extend(TD::Convert("a"));
+  ASSERT_TRUE(a);
+  ASSERT_TRUE(a->GetRules());
+  EXPECT_EQ(1, a->GetRules()->GetNumRules());
+  const GrammarIter* ab = a->Extend(TD::Convert("b"));
+  ASSERT_TRUE(ab);
+  EXPECT_EQ(1, ab->GetRules()->GetNumRules());
+  EXPECT_EQ(NULL, g3->GetRoot()->Extend(TD::Convert("haus")));
+
+  // the second block is parsed exactly like the file it came from
+  boost::shared_ptr<TextGrammar> g7(f.ReadGrammar(7));
+  TextGrammar tg("./test_data/grammar.prune");
+  const WordID haus = TD::Convert("haus");
+  ASSERT_TRUE(g7->GetRoot()->Extend(haus));
+  EXPECT_EQ(RuleStrings(tg.GetRoot()->Extend(haus)), RuleStrings(g7->GetRoot()->Extend(haus)));
+  EXPECT_EQ(tg.GetAllUnaryRules().size(), g7->GetAllUnaryRules().size());
+}
+
+TEST_F(GrammarTest,TestGrammarPrefetcher) {
+  const string a = "grammar_test.a", b = "grammar_test.b";
+  {
+    ofstream out(a.c_str());
+    out << "[X] ||| a ||| A ||| 0.1\n";
+  }
+  {
+    ofstream out(b.c_str());
+    out << "[X] ||| b ||| B ||| 0.2\n[X] ||| b c ||| B C ||| 0.3\n";
+  }
+  const WordID bw = TD::Convert("b");
+  {
+    GrammarPrefetcher p(1);
+    p.Request(a);
+    p.Request(b);
+    p.Request(a);
+    EXPECT_FALSE(p.Take("grammar_test.none"));
+    // the first a was skipped
+    boost::shared_ptr<TextGrammar> gb = p.Take(b);
+    ASSERT_TRUE(gb);
+    ASSERT_TRUE(gb->GetRoot()->Extend(bw));
+    EXPECT_EQ(1, gb->GetRoot()->Extend(bw)->GetRules()->GetNumRules());
+    boost::shared_ptr<TextGrammar> ga = p.Take(a);
+    ASSERT_TRUE(ga);
+    EXPECT_TRUE(ga->GetRoot()->Extend(TD::Convert("a")));
+    EXPECT_FALSE(ga->GetRoot()->Extend(bw));
+    EXPECT_FALSE(p.Take(a));
+    // requests that are never taken are dropped with the prefetcher
+    p.Request(b);
+  }
+  unlink(a.c_str());
+  unlink(b.c_str());
+}
+
+TEST_F(GrammarTest,TestPassThroughGrammar) {
+  Lattice l1, l2;
+  LatticeTools::ConvertTextToLattice("el perro", &l1);
+  LatticeTools::ConvertTextToLattice("perro negro", &l2);
+  PassThroughGrammar g1(l1, "X"), g2(l2, "X");
+  const WordID perro = TD::Convert("perro");
+  const RuleBin* r1 = g1.GetRoot()->Extend(perro)->GetRules();
+  const RuleBin* r2 = g2.GetRoot()->Extend(perro)->GetRules();
+  ASSERT_EQ(1, r1->GetNumRules());
+  ASSERT_EQ(1, r2->GetNumRules());
+  EXPECT_EQ("[X] ||| perro ||| perro ||| PassThrough=1 ||| 0-0", r1->GetIthRule(0)->AsString());
+  // made once and shared by the grammars of later inputs
+  EXPECT_EQ(r1->GetIthRule(0).get(), r2->GetIthRule(0).get());
+  EXPECT_TRUE(g1.HasRuleForSpan(1, 2, 1));
+  EXPECT_FALSE(g1.HasRuleForSpan(0, 2, 2));
+  EXPECT_EQ(NULL, g1.GetRoot()->Extend(TD::Convert("negro")));
+}
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
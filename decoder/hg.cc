@@ -8,6 +8,7 @@
 #include <set>
 #include <map>
 #include <iostream>
+#include <limits>
 #include <sstream>
 
 #include "viterbi.h"
@@ -319,6 +320,39 @@ V nth_greatest(int n,vector<V> vs) {
 }
 
 bool Hypergraph::PruneInsideOutside(double alpha,double density,const EdgeMask* preserve_mask,const bool use_sum_prod_semiring, const double scale,bool safe_inside)
+{
+  return PruneMarginals(alpha,density,preserve_mask,use_sum_prod_semiring,scale,safe_inside,NULL);
+}
+
+void Hypergraph::SetPromise(double power, double max_promise) {
+  assert(power >= 0);
+  if (nodes_.empty()) return;
+  InsideOutsides<prob_t> io;
+  OutsideNormalize<prob_t> norm;
+  io.compute(*this,norm,ViterbiWeightFunction());  // best derivation through each node / best overall
+  vector<double> w(nodes_.size());
+  double sum = 0;
+  for (int i = 0; i < nodes_.size(); ++i) {
+    const prob_t m = io.inside[i] * io.outside[i];
+    if (m == prob_t::Zero()) continue;
+    w[i] = exp(power * log(m));
+    sum += w[i];
+  }
+  const double scale = sum > 0 ? nodes_.size() / sum : 0;
+  for (int i = 0; i < nodes_.size(); ++i)
+    nodes_[i].promise = min(max_promise, w[i] * scale);
+}
+
+bool Hypergraph::PruneEdgePosteriors(EdgeProbs const& posts,prob_t z,double alpha,double density,const EdgeMask* preserve_mask,bool safe_inside)
+{
+  assert(posts.size()==edges_.size());
+  EdgeProbs mm(posts.size());
+  for (int i = 0; i < posts.size(); ++i)
+    mm[i] = posts[i] / z;
+  return PruneMarginals(alpha,density,preserve_mask,true,1,safe_inside,&mm);
+}
+
+bool Hypergraph::PruneMarginals(double alpha,double density,const EdgeMask* preserve_mask,const bool use_sum_prod_semiring, const double scale,bool safe_inside,EdgeProbs const* given)
 {
   bool use_density=density!=0;
   bool use_beam=alpha!=0;
@@ -339,14 +373,18 @@ bool Hypergraph::PruneInsideOutside(double alpha,double density,const EdgeMask*
     }
   }
   assert(use_density||use_beam);
-  InsideOutsides<prob_t> io;
-  OutsideNormalize<prob_t> norm;
-  if (use_sum_prod_semiring)
-    io.compute(*this,norm,ScaledEdgeProb(scale));
-  else
-    io.compute(*this,norm,ViterbiWeightFunction());  // the storage gets cast to Tropical from prob_t, scary - e.g. w/ specialized static allocator differences it could break.
-  vector<prob_t> mm;
-  io.compute_edge_marginals(*this,mm,EdgeProb()); // should be normalized to 1 for best edges in viterbi.  in sum, best is less than 1.
+  vector<prob_t> computed;
+  if (!given) {
+    InsideOutsides<prob_t> io;
+    OutsideNormalize<prob_t> norm;
+    if (use_sum_prod_semiring)
+      io.compute(*this,norm,ScaledEdgeProb(scale));
+    else
+      io.compute(*this,norm,ViterbiWeightFunction());  // the storage gets cast to Tropical from prob_t, scary - e.g. w/ specialized static allocator differences it could break.
+    io.compute_edge_marginals(*this,computed,EdgeProb()); // should be normalized to 1 for best edges in viterbi.  in sum, best is less than 1.
+    given=&computed;
+  }
+  const vector<prob_t>& mm=*given;
 
   prob_t cutoff=prob_t::One(); // we'll destroy everything smaller than this (note: nothing is bigger than 1).  so bigger cutoff = more pruning.
   bool density_won=false;
@@ -412,28 +450,40 @@ void Hypergraph::PrintGraphviz() const {
 }
 
 void Hypergraph::Union(const Hypergraph& other) {
-  if (&other == this) return;
+  if (&other == this || other.nodes_.empty()) return;
   if (nodes_.empty()) { nodes_ = other.nodes_; edges_ = other.edges_; return; }
-  int noff = nodes_.size();
-  int eoff = edges_.size();
-  int ogoal = other.nodes_.size() - 1;
-  int cgoal = noff - 1;
-  // keep a single goal node, so add nodes.size - 1
-  nodes_.resize(nodes_.size() + ogoal);
+  // the nodes of this forest but the goal, then those of other but the goal,
+  // then the common goal: if both are topologically sorted with the goal
+  // last, so is the union, and the sort below only drops what isn't reached
+  const int noff = nodes_.size() - 1;  // other's node i is noff + i
+  const int eoff = edges_.size();
+  const int ogoal = other.nodes_.size() - 1;
+  const int cgoal = noff + ogoal;
+  nodes_.resize(cgoal + 1);
+  if (cgoal != noff) {
+    nodes_[noff].swap(nodes_[cgoal]);
+    nodes_[noff].id_ = noff;
+    nodes_[cgoal].id_ = cgoal;
+    Node& goal = nodes_[cgoal];
+    for (int j = 0; j < goal.in_edges_.size(); ++j)
+      edges_[goal.in_edges_[j]].head_node_ = cgoal;
+    for (int j = 0; j < goal.out_edges_.size(); ++j) {
+      TailNodeVector& tails = edges_[goal.out_edges_[j]].tail_nodes_;
+      for (int k = 0; k < tails.size(); ++k)
+        if (tails[k] == noff) tails[k] = cgoal;
+    }
+  }
   // add all edges
   edges_.resize(edges_.size() + other.edges_.size());
 
-  for (int i = 0; i < ogoal; ++i) {
+  for (int i = 0; i <= ogoal; ++i) {
     const Node& on = other.nodes_[i];
     Node& cn = nodes_[i + noff];
     cn.id_ = i + noff;
-    cn.in_edges_.resize(on.in_edges_.size());
     for (int j = 0; j < on.in_edges_.size(); ++j)
-      cn.in_edges_[j] = on.in_edges_[j] + eoff;
-
-    cn.out_edges_.resize(on.out_edges_.size());
+      cn.in_edges_.push_back(on.in_edges_[j] + eoff);
     for (int j = 0; j < on.out_edges_.size(); ++j)
-      cn.out_edges_[j] = on.out_edges_[j] + eoff;
+      cn.out_edges_.push_back(on.out_edges_[j] + eoff);
   }
 
   for (int i = 0; i < other.edges_.size(); ++i) {
@@ -442,12 +492,7 @@ void Hypergraph::Union(const Hypergraph& other) {
     ce.id_ = i + eoff;
     ce.rule_ = oe.rule_;
     ce.feature_values_ = oe.feature_values_;
-    if (oe.head_node_ == ogoal) {
-      ce.head_node_ = cgoal;
-      nodes_[cgoal].in_edges_.push_back(ce.id_);
-    } else {
-      ce.head_node_ = oe.head_node_ + noff;
-    }
+    ce.head_node_ = oe.head_node_ + noff;
     ce.tail_nodes_.resize(oe.tail_nodes_.size());
     for (int j = 0; j < oe.tail_nodes_.size(); ++j)
       ce.tail_nodes_[j] = oe.tail_nodes_[j] + noff;
@@ -479,30 +524,113 @@ struct DFSContext {
 
 enum ColorType { WHITE, GRAY, BLACK };
 
+// moves each v[i] to v[reloc[i]] and drops those with reloc[i]<0, leaving
+// v.size()==n.  elements are exchanged with T::swap (never copied), and
+// each exchange puts one of them in its final place.
 template <class T>
-struct BadId {
-  bool operator()(const T& obj) const { return obj.id_ == -1; }
-};
-
-template <class T>
-struct IdCompare {
-  bool operator()(const T& a, const T& b) { return a.id_ < b.id_; }
-};
+static void Relocate(vector<T>& v, vector<int> reloc, int n) {
+  for (int i = 0; i < v.size(); ++i) {
+    int j;
+    while ((j = reloc[i]) >= 0 && j != i) {
+      v[i].swap(v[j]);
+      swap(reloc[i], reloc[j]);
+    }
+  }
+  v.resize(n);
+}
 
 // this keeps the nodes' edge indices and edges' node indices in sync.  or do nodes not get removed when you prune_edges?  seems like they get reordered.
 //TODO: if you had parallel arrays associating data w/ each node or edge, you'd want access to reloc_node and reloc_edge - expose in stateful object?
 void Hypergraph::TopologicallySortNodesAndEdges(int goal_index,
                                                 const vector<bool>* prune_edges) {
   edges_topo_=true;
-  // figure out which nodes are reachable from the goal
   vector<int> reloc_node(nodes_.size(), -1);
   vector<int> reloc_edge(edges_.size(), -1);
+  int node_count = 0;
+  int edge_count = 0;
+  if (!nodes_.empty() && goal_index == nodes_.size() - 1 && IsTopologicallySorted()) {
+    // keep the order we have, and just drop what the goal doesn't reach
+    // (through unpruned edges): one sweep down from the goal
+    vector<bool> reached(nodes_.size(), false);
+    reached[goal_index] = true;
+    for (int i = goal_index; i >= 0; --i) {
+      if (!reached[i]) continue;
+      const EdgesVector& in = nodes_[i].in_edges_;
+      for (int j = 0; j < in.size(); ++j) {
+        if (prune_edges && (*prune_edges)[in[j]]) continue;
+        const TailNodeVector& tails = edges_[in[j]].tail_nodes_;
+        for (int k = 0; k < tails.size(); ++k)
+          reached[tails[k]] = true;
+      }
+    }
+    for (int i = 0; i < nodes_.size(); ++i)
+      if (reached[i]) reloc_node[i] = node_count++;
+    for (int i = 0; i < edges_.size(); ++i)
+      if (reached[edges_[i].head_node_] && !(prune_edges && (*prune_edges)[i]))
+        reloc_edge[i] = edge_count++;
+  } else {
+    TopologicallySortedOrder(goal_index, prune_edges, &reloc_node, &reloc_edge, &node_count, &edge_count);
+  }
+  bool no_op = true;
+  for (int i = 0; i < reloc_node.size() && no_op; ++i)
+    if (reloc_node[i] != i) no_op = false;
+  for (int i = 0; i < reloc_edge.size() && no_op; ++i)
+    if (reloc_edge[i] != i) no_op = false;
+  if (no_op) return;
+  for (int i = 0; i < reloc_node.size(); ++i) {
+    Node& node = nodes_[i];
+    node.id_ = reloc_node[i];
+    int c = 0;
+    for (int j = 0; j < node.in_edges_.size(); ++j) {
+      const int new_index = reloc_edge[node.in_edges_[j]];
+      if (new_index >= 0)
+        node.in_edges_[c++] = new_index;
+    }
+    node.in_edges_.resize(c);
+    c = 0;
+    for (int j = 0; j < node.out_edges_.size(); ++j) {
+      const int new_index = reloc_edge[node.out_edges_[j]];
+      if (new_index >= 0)
+        node.out_edges_[c++] = new_index;
+    }
+    node.out_edges_.resize(c);
+  }
+  for (int i = 0; i < reloc_edge.size(); ++i) {
+    Edge& edge = edges_[i];
+    edge.id_ = reloc_edge[i];
+    edge.head_node_ = reloc_node[edge.head_node_];
+    for (int j = 0; j < edge.tail_nodes_.size(); ++j)
+      edge.tail_nodes_[j] = reloc_node[edge.tail_nodes_[j]];
+  }
+  Relocate(edges_, reloc_edge, edge_count);
+  Relocate(nodes_, reloc_node, node_count);
+}
+
+bool Hypergraph::IsTopologicallySorted() const {
+  for (int i = 0; i < edges_.size(); ++i) {
+    const Edge& edge = edges_[i];
+    for (int j = 0; j < edge.tail_nodes_.size(); ++j)
+      if (edge.tail_nodes_[j] >= edge.head_node_) return false;
+  }
+  return true;
+}
+
+// DFS from the goal: reloc_node gets each reachable node's position in a
+// topological order, reloc_edge each kept edge's new index
+void Hypergraph::TopologicallySortedOrder(int goal_index,
+                                          const vector<bool>* prune_edges,
+                                          vector<int>* preloc_node,
+                                          vector<int>* preloc_edge,
+                                          int* pnode_count,
+                                          int* pedge_count) const {
+  vector<int>& reloc_node = *preloc_node;
+  vector<int>& reloc_edge = *preloc_edge;
+  int& node_count = *pnode_count;
+  int& edge_count = *pedge_count;
   vector<ColorType> color(nodes_.size(), WHITE);
   vector<DFSContext> stack;
   stack.reserve(nodes_.size());
   stack.push_back(DFSContext(goal_index, 0, 0));
-  int node_count = 0;
-  int edge_count = 0;
   while(!stack.empty()) {
     const DFSContext& p = stack.back();
     int cur_ni = p.node;
@@ -564,54 +692,6 @@ void Hypergraph::TopologicallySortNodesAndEdges(int goal_index,
     if (cp >= 0) { cp = ec++; }
   }
 #endif
-
-#if 0
-  cerr << "TOPO:";
-  for (int i = 0; i < reloc_node.size(); ++i)
-    cerr << " " << reloc_node[i];
-  cerr << endl;
-  cerr << "EDGE:";
-  for (int i = 0; i < reloc_edge.size(); ++i)
-    cerr << " " << reloc_edge[i];
-  cerr << endl;
-#endif
-  bool no_op = true;
-  for (int i = 0; i < reloc_node.size() && no_op; ++i)
-    if (reloc_node[i] != i) no_op = false;
-  for (int i = 0; i < reloc_edge.size() && no_op; ++i)
-    if (reloc_edge[i] != i) no_op = false;
-  if (no_op) return;
-  for (int i = 0; i < reloc_node.size(); ++i) {
-    Node& node = nodes_[i];
-    node.id_ = reloc_node[i];
-    int c = 0;
-    for (int j = 0; j < node.in_edges_.size(); ++j) {
-      const int new_index = reloc_edge[node.in_edges_[j]];
-      if (new_index >= 0)
-        node.in_edges_[c++] = new_index;
-    }
-    node.in_edges_.resize(c);
-    c = 0;
-    for (int j = 0; j < node.out_edges_.size(); ++j) {
-      const int new_index = reloc_edge[node.out_edges_[j]];
-      if (new_index >= 0)
-        node.out_edges_[c++] = new_index;
-    }
-    node.out_edges_.resize(c);
-  }
-  for (int i = 0; i < reloc_edge.size(); ++i) {
-    Edge& edge = edges_[i];
-    edge.id_ = reloc_edge[i];
-    edge.head_node_ = reloc_node[edge.head_node_];
-    for (int j = 0; j < edge.tail_nodes_.size(); ++j)
-      edge.tail_nodes_[j] = reloc_node[edge.tail_nodes_[j]];
-  }
-  edges_.erase(remove_if(edges_.begin(), edges_.end(), BadId<Edge>()), edges_.end());
-  nodes_.erase(remove_if(nodes_.begin(), nodes_.end(), BadId<Node>()), nodes_.end());
-  sort(nodes_.begin(), nodes_.end(), IdCompare<Node>());
-#ifndef HG_EDGES_TOPO_SORTED
-  sort(edges_.begin(), edges_.end(), IdCompare<Edge>());
-#endif
 }
 
 TRulePtr Hypergraph::kEPSRule;
@@ -787,7 +867,7 @@ HypergraphP Hypergraph::CreateViterbiHypergraph(const vector<bool>* edges) const
     assert(edges->size() == edges_.size());
     Viterbi(*this, &vit_edges, ViterbiPathTraversal(), EdgeSelectEdgeWeightFunction(*edges));
   } else {
-    Viterbi(*this, &vit_edges, ViterbiPathTraversal() ,EdgeProb());
+    Viterbi(*this, &vit_edges, ViterbiPathTraversal());
   }
 #if 1
 # if 1
@@ -838,3 +918,101 @@ HypergraphP Hypergraph::CreateViterbiHypergraph(const vector<bool>* edges) const
 #endif
 }
 
+void PackedEdgeFeatures::Init(const Hypergraph& hg) {
+  const int num_edges = hg.edges_.size();
+  begin_.resize(num_edges + 1);
+  unsigned n = 0;
+  for (int i = 0; i < num_edges; ++i) {
+    begin_[i] = n;
+    n += hg.edges_[i].feature_values_.size();
+  }
+  begin_[num_edges] = n;
+  fids_.resize(n);
+  vals_.resize(n);
+  max_fid_ = 0;
+  vector<pair<int, double> > feats;
+  for (int i = 0; i < num_edges; ++i) {
+    const SparseVector<double>& fv = hg.edges_[i].feature_values_;
+    feats.clear();
+    for (SparseVector<double>::const_iterator it = fv.begin(); it != fv.end(); ++it)
+      feats.push_back(make_pair(it->first, it->second));
+    sort(feats.begin(), feats.end());
+    for (int k = 0, b = begin_[i]; k < feats.size(); ++k) {
+      fids_[b + k] = feats[k].first;
+      vals_[b + k] = feats[k].second;
+      if (feats[k].first > max_fid_) max_fid_ = feats[k].first;
+    }
+  }
+}
+
+void PackedEdgeFeatures::Reweight(const vector<double>& weights, Hypergraph* hg) const {
+  assert(hg->edges_.size() == num_edges());
+  const vector<double>* w = &weights;
+  vector<double> padded;
+  if (weights.size() <= max_fid_) {
+    padded = weights;
+    PadWeights(&padded);
+    w = &padded;
+  }
+  for (int i = 0; i < hg->edges_.size(); ++i)
+    hg->edges_[i].edge_prob_.logeq(Dot(i, *w));
+}
+
+void HypergraphTopology::Init(const Hypergraph& hg) {
+  const int num_nodes = hg.nodes_.size();
+  const int num_edges = hg.edges_.size();
+  first_.resize(num_nodes + 1);
+  edges_.resize(num_edges);
+  tail_begin_.resize(num_edges + 1);
+  tails_.clear();
+  int k = 0;
+  for (int i = 0; i < num_nodes; ++i) {
+    first_[i] = k;
+    const Hypergraph::EdgesVector& in = hg.nodes_[i].in_edges_;
+    for (int j = 0; j < in.size(); ++j, ++k) {
+      edges_[k] = in[j];
+      tail_begin_[k] = tails_.size();
+      const Hypergraph::TailNodeVector& t = hg.edges_[in[j]].tail_nodes_;
+      tails_.insert(tails_.end(), t.begin(), t.end());
+    }
+  }
+  first_[num_nodes] = k;
+  edges_.resize(k);  // edges that are no node's in-edge are left out
+  tail_begin_.resize(k + 1);
+  tail_begin_[k] = tails_.size();
+  tails_.push_back(-1);  // so &tails_[0] is valid if no edge has tails
+  SetWeights(hg);
+}
+
+void HypergraphTopology::SetWeights(const Hypergraph& hg) {
+  w_.resize(edges_.size());
+  nonnegative_ = true;
+  for (int k = 0; k < edges_.size(); ++k) {
+    const prob_t& p = hg.edges_[edges_[k]].edge_prob_;
+    if (p.s_) nonnegative_ = false;
+    w_[k] = p.v_;
+  }
+}
+
+double HypergraphTopology::Viterbi(vector<double>* node_score, vector<int>* best_slot) const {
+  const int num_nodes = this->num_nodes();
+  node_score->resize(num_nodes);
+  best_slot->resize(num_nodes);
+  vector<double>& score = *node_score;
+  for (int i = 0; i < num_nodes; ++i) {
+    const int b = first_[i], e = first_[i + 1];
+    (*best_slot)[i] = b < e ? b : -1;
+    double best = 0;
+    for (int k = b; k < e; ++k) {
+      double s = w_[k];
+      for (int t = tail_begin_[k]; t < tail_begin_[k + 1]; ++t)
+        s += score[tails_[t]];
+      if (k == b || best < s) {
+        best = s;
+        (*best_slot)[i] = k;
+      }
+    }
+    score[i] = best;
+  }
+  return num_nodes ? score.back() : -numeric_limits<double>::infinity();
+}
@@ -19,6 +19,7 @@
 #include <vector>
 #include <boost/shared_ptr.hpp>
 
+#include "arena.h"
 #include "feature_vector.h"
 #include "small_vector.h"
 #include "wordid.h"
@@ -42,9 +43,13 @@ class Hypergraph {
 public:
   Hypergraph() : is_linear_chain_(false) {}
 
-  // SmallVector is a fast, small vector<int> implementation for sizes <= 2
-  typedef SmallVectorInt TailNodeVector; // indices in nodes_
-  typedef std::vector<int> EdgesVector; // indices in edges_
+  // indices in nodes_, inline for up to 2 tails: that covers every edge
+  // built from a Hiero grammar, and an int SmallVector grows from 16 to 24
+  // bytes at 3.  Raise it for grammars with more nonterminals per rule.
+  typedef SmallVector<int, 2> TailNodeVector;
+  // indices in edges_; allocated from the per-sentence arena if the decoder
+  // installed one (see arena.h), otherwise from the heap
+  typedef std::vector<int, ArenaAllocator<int> > EdgesVector;
 
   // TODO get rid of cat_?
   // TODO keep cat_ and add span and/or state? :)
@@ -55,7 +60,7 @@ public:
     WordID NT() const { return -cat_; }
     EdgesVector in_edges_;   // an in edge is an edge with this node as its head.  (in edges come from the bottom up to us)  indices in edges_
     EdgesVector out_edges_;  // an out edge is an edge with this node as its tail.  (out edges leave us up toward the top/goal). indices in edges_
-    double promise; // set in global pruning; in [0,infty) so that mean is 1.  use: e.g. scale cube poplimit.  //TODO: appears to be useless, compile without this?  on the other hand, pretty cheap.
+    double promise; // set by SetPromise; in [0,infty) so that mean is 1.  cube pruning and growing scale the pop limit of the node by it
     void copy_fixed(Node const& o) { // nonstructural fields only - structural ones are managed by sorting/pruning/subsetting
       cat_=o.cat_;
       promise=o.promise;
@@ -66,6 +71,13 @@ public:
       e2.reindex_push_back(o.in_edges_,in_edges_);
       e2.reindex_push_back(o.out_edges_,out_edges_);
     }
+    void swap(Node& o) { // no edge lists are copied
+      std::swap(id_,o.id_);
+      std::swap(cat_,o.cat_);
+      in_edges_.swap(o.in_edges_);
+      out_edges_.swap(o.out_edges_);
+      std::swap(promise,o.promise);
+    }
   };
 
 
@@ -126,6 +138,21 @@ public:
       id_=e2[o.id_];
       n2.reindex_push_back(o.tail_nodes_,tail_nodes_);
     }
+    void swap(Edge& o) { // no features or tails are copied
+      std::swap(head_node_,o.head_node_);
+      tail_nodes_.swap(o.tail_nodes_);
+      rule_.swap(o.rule_);
+      feature_values_.swap(o.feature_values_);
+      std::swap(edge_prob_,o.edge_prob_);
+      std::swap(id_,o.id_);
+      std::swap(i_,o.i_); std::swap(j_,o.j_);
+      std::swap(prev_i_,o.prev_i_); std::swap(prev_j_,o.prev_j_);
+#if USE_INFO_EDGE
+      std::string const i=info();
+      set_info(o.info());
+      o.set_info(i);
+#endif
+    }
 
 #if USE_INFO_EDGE
     std::ostringstream info_;
@@ -477,6 +504,19 @@ public:
   // returns true if density pruning was tighter than beam
   // safe_inside would be a redundant anti-rounding error second bottom-up reachability before actually removing edges, to prevent stranded edges.  shouldn't be needed - if the hyperedges occur in defined-before-use (all edges with head h occur before h is used as a tail) order, then a grace margin for keeping edges that starts leniently and becomes more forbidding will make it impossible for this to occur, i.e. safe_inside=true is not needed.
   bool PruneInsideOutside(double beam_alpha,double density,const EdgeMask* preserve_mask = NULL,const bool use_sum_prod_semiring=false, const double scale=1,bool safe_inside=false);
+  // PruneInsideOutside by the sum-product semiring with scale 1, using the
+  // edge posteriors that ComputeEdgePosteriors(1, &posts) returned z for
+  // (e.g. for a summary feature) instead of running inside-outside again
+  bool PruneEdgePosteriors(EdgeProbs const& posts,prob_t z,double beam_alpha,double density,const EdgeMask* preserve_mask = NULL,bool safe_inside=false);
+
+  // sets Node::promise from the Viterbi max-marginals under the current edge
+  // weights: the score of the best derivation through the node relative to
+  // the best overall, raised to power and scaled so that the mean is 1, then
+  // capped at max_promise.  Nodes not on any derivation get 0, power=0 gives
+  // every reachable node the same promise.  Called on the forest of the
+  // previous pass before it is reweighted, the next pass's cube search
+  // spends its pops where the previous pass's outside estimates were good.
+  void SetPromise(double power, double max_promise = 10);
 
   // legacy:
   void DensityPruneInsideOutside(const double scale, const bool use_sum_prod_semiring, const double density,const EdgeMask* preserve_mask = NULL) {
@@ -532,7 +572,12 @@ public:
 
   // reorder nodes_ so they are in topological order
   // source nodes at 0 sink nodes at size-1
+  // (if the nodes are already in a topological order with the goal last,
+  // that order is kept; unreachable and pruned nodes and edges are dropped
+  // in place, without copying the others)
   void TopologicallySortNodesAndEdges(int goal_idx, const EdgeMask* prune_edges = NULL);
+  // every edge's tails come before its head
+  bool IsTopologicallySorted() const;
 
   void set_ids(); // resync edge,node .id_
   void check_ids() const; // assert that .id_ have been kept in sync
@@ -540,6 +585,14 @@ public:
 private:
   Hypergraph(int num_nodes, int num_edges, bool is_lc) : is_linear_chain_(is_lc), nodes_(num_nodes), edges_(num_edges),edges_topo_(true) {}
 
+  // the DFS behind TopologicallySortNodesAndEdges: new positions (or -1) of
+  // the nodes and edges, and how many of each are kept
+  void TopologicallySortedOrder(int goal_idx, const EdgeMask* prune_edges,
+                                std::vector<int>* reloc_node, std::vector<int>* reloc_edge,
+                                int* node_count, int* edge_count) const;
+  // PruneInsideOutside, by the normalized edge marginals given if not NULL
+  bool PruneMarginals(double beam_alpha,double density,const EdgeMask* preserve_mask,const bool use_sum_prod_semiring,const double scale,bool safe_inside,EdgeProbs const* given);
+
   static TRulePtr kEPSRule;
   static TRulePtr kUnaryRule;
 };
@@ -589,4 +642,77 @@ struct TransitionCountWeightFunction {
   inline double operator()(const Hypergraph::Edge& e) const { (void)e; return 1.0; }
 };
 
+// snapshot of the structure of a forest in flat arrays: the in-edges of
+// every node, node by node, with their tails and log weights.  Edges carry
+// their rule, features, spans and info along with the few fields a sweep
+// over the forest needs, so Viterbi or inside over the snapshot reads a few
+// contiguous arrays instead of pulling every Edge through the cache.  The
+// in-edges of node i are the slots [first(i), first(i+1)).  Like
+// PackedEdgeFeatures this is not updated when the forest changes;
+// SetWeights picks up new edge weights after a Reweight.
+class HypergraphTopology {
+ public:
+  HypergraphTopology() : first_(1), nonnegative_(true) {}
+  explicit HypergraphTopology(const Hypergraph& hg) { Init(hg); }
+  void Init(const Hypergraph& hg);
+  void SetWeights(const Hypergraph& hg);
+
+  int num_nodes() const { return first_.size() - 1; }
+  int first(int node) const { return first_[node]; }
+  int edge(int slot) const { return edges_[slot]; }  // id in hg.edges_
+  double log_weight(int slot) const { return w_[slot]; }
+  const int* tails_begin(int slot) const { return &tails_[0] + tail_begin_[slot]; }
+  const int* tails_end(int slot) const { return &tails_[0] + tail_begin_[slot + 1]; }
+  // false if an edge weight is negative, which log_weight can't represent
+  bool nonnegative() const { return nonnegative_; }
+
+  // the log score of the best derivation of each node and the slot of its
+  // best in-edge (-1 for nodes without in-edges, which score log 1); ties go
+  // to the first in-edge, as in Viterbi().  Returns the goal's score.
+  double Viterbi(std::vector<double>* node_score, std::vector<int>* best_slot) const;
+
+ private:
+  std::vector<int> first_;
+  std::vector<int> edges_;
+  std::vector<double> w_;
+  std::vector<int> tail_begin_;  // tails of slot k are [tail_begin_[k], tail_begin_[k+1])
+  std::vector<int> tails_;
+  bool nonnegative_;
+};
+
+// snapshot of the feature vectors of all edges of a forest in flat arrays
+// (feature ids sorted and values, edge by edge), for forests that are scored
+// with many different weight vectors, e.g. by the line search. Dot products
+// with dense weights become a tight gather-multiply over contiguous memory.
+// The snapshot is not updated if the edges or their features change.
+class PackedEdgeFeatures {
+ public:
+  PackedEdgeFeatures() : max_fid_(0) {}
+  explicit PackedEdgeFeatures(const Hypergraph& hg) { Init(hg); }
+  void Init(const Hypergraph& hg);
+
+  // weights.size() must be > max_fid(), see PadWeights
+  inline double Dot(int edge_id, const std::vector<double>& weights) const {
+    double res = 0;
+    for (unsigned k = begin_[edge_id], end = begin_[edge_id + 1]; k < end; ++k)
+      res += vals_[k] * weights[fids_[k]];
+    return res;
+  }
+  // resizes weights so it can be used with Dot
+  void PadWeights(std::vector<double>* weights) const {
+    if (weights->size() <= max_fid_) weights->resize(max_fid_ + 1);
+  }
+  // same as hg->Reweight(weights); hg must be the forest that was packed
+  void Reweight(const std::vector<double>& weights, Hypergraph* hg) const;
+
+  int max_fid() const { return max_fid_; }
+  int num_edges() const { return begin_.size() - 1; }
+
+ private:
+  std::vector<unsigned> begin_;  // features of edge e are [begin_[e], begin_[e+1])
+  std::vector<int> fids_;
+  std::vector<double> vals_;
+  int max_fid_;
+};
+
 #endif
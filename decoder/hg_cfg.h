@@ -36,14 +36,11 @@ struct HgCFG {
     if (!have_cfg)
       InitCFG(to);
     else {
-      cfg.VisitRuleIds(*this);
       have_cfg=false;
       to.Clear();
       swap(to,cfg);
     }
   }
-  void operator()(int ri) const {
-  }
   CFG const& GetCFG() const {
     assert(have_cfg);
     return cfg;
@@ -16,38 +16,77 @@ using boost::lexical_cast;
 using namespace std::tr1;
 using namespace std;
 
-struct RuleFilter {
-  unordered_map<vector<WordID>, bool, boost::hash<vector<WordID> > > exists_;
-  bool true_lattice;
-  RuleFilter(const Lattice& target, int max_phrase_size) {
-    true_lattice = false;
-    for (int i = 0; i < target.size(); ++i) {
-      vector<WordID> phrase;
-      int lim = min(static_cast<int>(target.size()), i + max_phrase_size);
-      for (int j = i; j < lim; ++j) {
-        if (target[j].size() > 1) { true_lattice = true; break; }
-        phrase.push_back(target[j][0].label);
-        exists_[phrase] = true;
-      }
-    }
-    vector<WordID> sos(1, TD::Convert("<s>"));
-    exists_[sos] = true;
+// Picks out the edges whose target side can't be matched in the target
+// lattice before it is parsed.  The lattice arcs are indexed by label, and
+// each run of terminals in a rule's target side is matched left to right
+// through the arcs, starting no earlier than the earliest lattice node
+// where the previous run can end (nonterminals can cover any span, so
+// this is only a necessary condition, but an exact one for single runs).
+class RuleFilter {
+ public:
+  explicit RuleFilter(const Lattice& target) :
+      kSOS(TD::Convert("<s>")),
+      at_(target.size() + 1) {
+    for (int i = 0; i < target.size(); ++i)
+      for (int j = 0; j < target[i].size(); ++j)
+        arcs_[target[i][j].label].push_back(make_pair(i, i + target[i][j].dist2next));
   }
+
+  // true if r can't be used in the intersection
   bool operator()(const TRule& r) const {
-    // TODO do some smarter filtering for lattices
-    if (true_lattice) return false;  // don't filter "true lattice" input
     const vector<WordID>& e = r.e();
-    for (int i = 0; i < e.size(); ++i) {
-      if (e[i] <= 0) continue;
-      vector<WordID> phrase;
-      for (int j = i; j < e.size(); ++j) {
-        if (e[j] <= 0) break;
-        phrase.push_back(e[j]);
-        if (exists_.count(phrase) == 0) return true;
+    int min_start = 0;
+    for (int i = 0; i < e.size(); ) {
+      if (e[i] <= 0) { ++i; continue; }
+      int j = i;
+      while (j < e.size() && e[j] > 0) ++j;
+      if (!(j == i + 1 && e[i] == kSOS)) {  // a lone <s> is always allowed
+        min_start = MatchRun(&e[i], &e[j], min_start);
+        if (min_start < 0) return true;
       }
+      i = j;
     }
     return false;
   }
+
+ private:
+  typedef vector<pair<int, int> > Arcs;  // (from, to) lattice nodes
+
+  // returns the earliest lattice node where the words in [begin, end) can
+  // end when starting from a node >= min_start, -1 if they can't be matched
+  int MatchRun(const WordID* begin, const WordID* end, int min_start) const {
+    vector<int>& cur = cur_;
+    vector<int>& next = next_;
+    cur.clear();
+    for (const WordID* w = begin; w != end; ++w) {
+      const unordered_map<WordID, Arcs>::const_iterator it = arcs_.find(*w);
+      next.clear();
+      if (it != arcs_.end()) {
+        const Arcs& arcs = it->second;
+        for (int k = 0; k < arcs.size(); ++k) {
+          const bool from_ok = (w == begin) ? arcs[k].first >= min_start : at_[arcs[k].first];
+          if (from_ok) next.push_back(arcs[k].second);
+        }
+      }
+      for (int k = 0; k < cur.size(); ++k) at_[cur[k]] = 0;
+      cur.clear();
+      for (int k = 0; k < next.size(); ++k)
+        if (!at_[next[k]]) { at_[next[k]] = 1; cur.push_back(next[k]); }
+      if (cur.empty()) return -1;
+    }
+    int earliest = cur[0];
+    for (int k = 0; k < cur.size(); ++k) {
+      earliest = min(earliest, cur[k]);
+      at_[cur[k]] = 0;
+    }
+    return earliest;
+  }
+
+  const WordID kSOS;
+  unordered_map<WordID, Arcs> arcs_;
+  // scratch space for MatchRun: the nodes reached so far, marked in at_
+  mutable vector<int> cur_, next_;
+  mutable vector<char> at_;
 };
 
 static bool FastLinearIntersect(const Lattice& target, Hypergraph* hg) {
@@ -86,9 +125,17 @@ bool HG::Intersect(const Lattice& target, Hypergraph* hg) {
     return FastLinearIntersect(target, hg);
 
   vector<bool> rem(hg->edges_.size(), false);
-  const RuleFilter filter(target, 15);   // TODO make configurable
-  for (int i = 0; i < rem.size(); ++i)
-    rem[i] = filter(*hg->edges_[i].rule_);
+  const RuleFilter filter(target);
+  // edges sharing a rule share the answer
+  unordered_map<const TRule*, bool> filtered;
+  int nrem = 0;
+  for (int i = 0; i < rem.size(); ++i) {
+    const TRule* r = hg->edges_[i].rule_.get();
+    const pair<unordered_map<const TRule*, bool>::iterator, bool> ins = filtered.insert(make_pair(r, false));
+    if (ins.second) ins.first->second = filter(*r);
+    if ((rem[i] = ins.first->second)) ++nrem;
+  }
+  if (!SILENT) cerr << "  Removing " << nrem << " of " << rem.size() << " edges not matching the target\n";
   hg->PruneEdges(rem, true);
 
   const int nedges = hg->edges_.size();
@@ -2,11 +2,22 @@
 
 #include <sstream>
 #include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "fast_lexical_cast.hpp"
 
+#include "filelib.h"
 #include "tdict.h"
 #include "json_parse.h"
+#include "writer.h"
 #include "hg.h"
 
 using namespace std;
@@ -27,7 +38,7 @@ struct HGReader : public JSONParser {
       hg.ConnectEdgeToHeadNode(&hg.edges_[in_edges[i]], node);
     }
   }
-  void CreateEdge(const TRulePtr& rule, FeatureVector* feats, const SmallVectorInt& tail) {
+  void CreateEdge(const TRulePtr& rule, FeatureVector* feats, const Hypergraph::TailNodeVector& tail) {
     Hypergraph::Edge* edge = hg.AddEdge(rule, tail);
     feats->swap(edge->feature_values_);
     edge->i_ = spans[0];
@@ -228,7 +239,7 @@ struct HGReader : public JSONParser {
   }
   string rp;
   string cat;
-  SmallVectorInt tail;
+  Hypergraph::TailNodeVector tail;
   vector<int> in_edges;
   TRulePtr cur_rule;
   map<int, TRulePtr> rules;
@@ -254,14 +265,14 @@ bool HypergraphIO::ReadFromJSON(istream* in, Hypergraph* hg) {
   return reader.Parse(in);
 }
 
-static void WriteRule(const TRule& r, ostream* out) {
+static void WriteRule(const TRule& r, BufferedWriter* out) {
   if (!r.lhs_) { (*out) << "[X] ||| "; }
   JSONParser::WriteEscapedString(r.AsString(), out);
 }
 
 bool HypergraphIO::WriteToJSON(const Hypergraph& hg, bool remove_rules, ostream* out) {
   map<const TRule*, int> rid;
-  ostream& o = *out;
+  BufferedWriter o(out);
   rid[NULL] = 0;
   o << '{';
   if (!remove_rules) {
@@ -344,25 +355,294 @@ bool HypergraphIO::WriteToJSON(const Hypergraph& hg, bool remove_rules, ostream*
   return true;
 }
 
-bool needs_escape[128];
-void InitEscapes() {
-  memset(needs_escape, false, 128);
-  needs_escape[static_cast<size_t>('\'')] = true;
-  needs_escape[static_cast<size_t>('\\')] = true;
+static const char kBINARY_MAGIC[8] = { 'c', 'd', 'e', 'c', 'H', 'G', 'B', '1' };
+
+static void WriteVarint(uint64_t v, string* out) {
+  while (v >= 0x80) {
+    out->push_back(static_cast<char>((v & 0x7f) | 0x80));
+    v >>= 7;
+  }
+  out->push_back(static_cast<char>(v));
+}
+
+// spans may be -1
+static inline void WriteSignedVarint(int v, string* out) {
+  WriteVarint((static_cast<uint32_t>(v) << 1) ^ static_cast<uint32_t>(v >> 31), out);
+}
+
+// feature values are written with the smallest of these encodings that
+// represents them exactly; the type goes into the low bits of the feature index
+enum { kDOUBLE_VALUE = 0, kFLOAT_VALUE = 1, kINT_VALUE = 2 };
+
+static void WriteFeature(int fidx, double v, string* out) {
+  const float f = static_cast<float>(v);
+  if (v > -(1 << 20) && v < (1 << 20) && v == static_cast<int>(v)) {
+    WriteVarint((fidx << 2) | kINT_VALUE, out);
+    WriteSignedVarint(static_cast<int>(v), out);
+  } else if (static_cast<double>(f) == v) {
+    WriteVarint((fidx << 2) | kFLOAT_VALUE, out);
+    out->append(reinterpret_cast<const char*>(&f), sizeof(float));
+  } else {
+    WriteVarint((fidx << 2) | kDOUBLE_VALUE, out);
+    out->append(reinterpret_cast<const char*>(&v), sizeof(double));
+  }
+}
+
+static void WriteBinaryString(const string& s, string* out) {
+  WriteVarint(s.size(), out);
+  out->append(s);
+}
+
+struct BinaryHGReader {
+  BinaryHGReader(const char* data, size_t size) : p(data), end(data + size) {}
+
+  bool Varint(uint64_t* v) {
+    *v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+      const unsigned char c = *p++;
+      *v |= static_cast<uint64_t>(c & 0x7f) << shift;
+      if (!(c & 0x80)) return true;
+    }
+    return false;
+  }
+  bool Int(int* v) {
+    uint64_t x;
+    if (!Varint(&x) || x > 0x7fffffff) return false;
+    *v = x;
+    return true;
+  }
+  bool SignedInt(int* v) {
+    uint64_t x;
+    if (!Varint(&x) || x > 0xffffffff) return false;
+    const uint32_t u = x;
+    *v = static_cast<int>(u >> 1) ^ -static_cast<int>(u & 1);
+    return true;
+  }
+  bool Value(int type, double* v) {
+    if (type == kINT_VALUE) {
+      int i;
+      if (!SignedInt(&i)) return false;
+      *v = i;
+    } else if (type == kFLOAT_VALUE) {
+      float f;
+      if (end - p < static_cast<ptrdiff_t>(sizeof(float))) return false;
+      memcpy(&f, p, sizeof(float));
+      p += sizeof(float);
+      *v = f;
+    } else {
+      if (end - p < static_cast<ptrdiff_t>(sizeof(double))) return false;
+      memcpy(v, p, sizeof(double));
+      p += sizeof(double);
+    }
+    return true;
+  }
+  bool String(string* s) {
+    uint64_t len;
+    if (!Varint(&len) || static_cast<uint64_t>(end - p) < len) return false;
+    s->assign(p, len);
+    p += len;
+    return true;
+  }
+
+  bool Read(Hypergraph* hg);
+
+  const char* p;
+  const char* const end;
+};
+
+bool BinaryHGReader::Read(Hypergraph* hg) {
+  if (end - p < 8 || memcmp(p, kBINARY_MAGIC, 8) != 0) {
+    cerr << "Binary forest: bad magic number\n";
+    return false;
+  }
+  p += 8;
+  string s;
+  int n;
+  if (!Int(&n)) return false;
+  vector<TRulePtr> rules(n + 1);
+  for (int i = 1; i <= n; ++i) {
+    if (!String(&s)) return false;
+    rules[i].reset(new TRule(s));
+  }
+  if (!Int(&n)) return false;
+  vector<int> fids(n);
+  for (int i = 0; i < n; ++i) {
+    if (!String(&s)) return false;
+    fids[i] = FD::Convert(s);
+  }
+  if (!Int(&n)) return false;
+  vector<WordID> cats(n + 1, TD::Convert("X") * -1);
+  for (int i = 1; i <= n; ++i) {
+    if (!String(&s)) return false;
+    cats[i] = TD::Convert(s) * -1;
+  }
+  int num_nodes, num_edges;
+  if (!Int(&num_nodes) || !Int(&num_edges)) return false;
+  hg->nodes_.reserve(num_nodes);
+  hg->edges_.reserve(num_edges);
+  Hypergraph::TailNodeVector tail;
+  for (int i = 0; i < num_nodes; ++i) {
+    int in_edges;
+    if (!Int(&in_edges)) return false;
+    const int first_edge = hg->edges_.size();
+    for (int j = 0; j < in_edges; ++j) {
+      int rule, arity;
+      if (!Int(&rule) || rule >= rules.size() || !Int(&arity)) return false;
+      tail.resize(arity);
+      for (int k = 0; k < arity; ++k)
+        if (!Int(&tail[k]) || tail[k] >= i) return false;
+      Hypergraph::Edge* edge = hg->AddEdge(rules[rule], tail);
+      int spans[4];
+      for (int k = 0; k < 4; ++k)
+        if (!SignedInt(&spans[k])) return false;
+      edge->i_ = spans[0];
+      edge->j_ = spans[1];
+      edge->prev_i_ = spans[2];
+      edge->prev_j_ = spans[3];
+      int num_feats;
+      if (!Int(&num_feats)) return false;
+      for (int k = 0; k < num_feats; ++k) {
+        int f;
+        double v;
+        if (!Int(&f) || (f >> 2) >= fids.size() || !Value(f & 3, &v)) return false;
+        edge->feature_values_.set_value(fids[f >> 2], v);
+      }
+    }
+    int cat;
+    if (!Int(&cat) || cat >= cats.size()) return false;
+    Hypergraph::Node* node = hg->AddNode(cats[cat]);
+    for (int j = first_edge; j < hg->edges_.size(); ++j)
+      hg->ConnectEdgeToHeadNode(&hg->edges_[j], node);
+  }
+  if (hg->edges_.size() != num_edges) return false;
+  return true;
+}
+
+bool HypergraphIO::WriteToBinary(const Hypergraph& hg, bool remove_rules, ostream* out) {
+  string buf(kBINARY_MAGIC, 8);
+
+  // rule, feature and category tables
+  map<const TRule*, int> rid;
+  vector<const TRule*> rules;
+  vector<int> fid2idx(FD::NumFeats(), -1);
+  vector<int> fids;
+  map<WordID, int> cid;
+  vector<WordID> cats;
+  for (int i = 0; i < hg.edges_.size(); ++i) {
+    const Hypergraph::Edge& edge = hg.edges_[i];
+    if (!remove_rules && edge.rule_) {
+      int& id = rid[edge.rule_.get()];
+      if (!id) { rules.push_back(edge.rule_.get()); id = rules.size(); }
+    }
+    for (SparseVector<double>::const_iterator it = edge.feature_values_.begin(); it != edge.feature_values_.end(); ++it) {
+      if (!it->second || !it->first) continue;
+      if (fid2idx[it->first] < 0) { fid2idx[it->first] = fids.size(); fids.push_back(it->first); }
+    }
+  }
+  for (int i = 0; i < hg.nodes_.size(); ++i) {
+    const WordID cat = hg.nodes_[i].cat_;
+    if (cat >= 0) continue;
+    int& id = cid[cat];
+    if (!id) { cats.push_back(cat); id = cats.size(); }
+  }
+  WriteVarint(rules.size(), &buf);
+  for (int i = 0; i < rules.size(); ++i)
+    WriteBinaryString((rules[i]->lhs_ ? "" : "[X] ||| ") + rules[i]->AsString(), &buf);
+  WriteVarint(fids.size(), &buf);
+  for (int i = 0; i < fids.size(); ++i)
+    WriteBinaryString(FD::Convert(fids[i]), &buf);
+  WriteVarint(cats.size(), &buf);
+  for (int i = 0; i < cats.size(); ++i)
+    WriteBinaryString(TD::Convert(cats[i] * -1), &buf);
+
+  WriteVarint(hg.nodes_.size(), &buf);
+  WriteVarint(hg.edges_.size(), &buf);
+  for (int i = 0; i < hg.nodes_.size(); ++i) {
+    const Hypergraph::Node& node = hg.nodes_[i];
+    WriteVarint(node.in_edges_.size(), &buf);
+    for (int j = 0; j < node.in_edges_.size(); ++j) {
+      const Hypergraph::Edge& edge = hg.edges_[node.in_edges_[j]];
+      WriteVarint((remove_rules || !edge.rule_) ? 0 : rid[edge.rule_.get()], &buf);
+      WriteVarint(edge.tail_nodes_.size(), &buf);
+      for (int k = 0; k < edge.tail_nodes_.size(); ++k)
+        WriteVarint(edge.tail_nodes_[k], &buf);
+      WriteSignedVarint(edge.i_, &buf);
+      WriteSignedVarint(edge.j_, &buf);
+      WriteSignedVarint(edge.prev_i_, &buf);
+      WriteSignedVarint(edge.prev_j_, &buf);
+      int num_feats = 0;
+      for (SparseVector<double>::const_iterator it = edge.feature_values_.begin(); it != edge.feature_values_.end(); ++it)
+        if (it->second && it->first) ++num_feats;
+      WriteVarint(num_feats, &buf);
+      for (SparseVector<double>::const_iterator it = edge.feature_values_.begin(); it != edge.feature_values_.end(); ++it) {
+        if (!it->second || !it->first) continue;
+        WriteFeature(fid2idx[it->first], it->second, &buf);
+      }
+    }
+    WriteVarint(node.cat_ < 0 ? cid[node.cat_] : 0, &buf);
+    // keep the buffer small for large forests
+    if (buf.size() > (1 << 20)) { out->write(buf.data(), buf.size()); buf.clear(); }
+  }
+  out->write(buf.data(), buf.size());
+  return *out;
+}
+
+bool HypergraphIO::ReadFromBinary(const char* data, size_t size, Hypergraph* hg) {
+  hg->clear();
+  BinaryHGReader reader(data, size);
+  if (reader.Read(hg)) return true;
+  cerr << "Binary forest is truncated or corrupt\n";
+  return false;
+}
+
+bool HypergraphIO::ReadFromBinary(istream* in, Hypergraph* hg) {
+  ostringstream os;
+  os << in->rdbuf();
+  const string data = os.str();
+  return ReadFromBinary(data.data(), data.size(), hg);
+}
+
+bool HypergraphIO::Read(istream* in, Hypergraph* hg) {
+  if (in->peek() == kBINARY_MAGIC[0])
+    return ReadFromBinary(in, hg);
+  return ReadFromJSON(in, hg);
+}
+
+bool HypergraphIO::ReadFromFile(const string& fname, Hypergraph* hg) {
+  const int fd = open(fname.c_str(), O_RDONLY);
+  char magic[8];
+  struct stat st;
+  if (fd >= 0 && read(fd, magic, 8) == 8 && memcmp(magic, kBINARY_MAGIC, 8) == 0 &&
+      fstat(fd, &st) == 0) {
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      cerr << "Can't map " << fname << ": " << strerror(errno) << endl;
+      return false;
+    }
+    const bool res = ReadFromBinary(static_cast<const char*>(data), st.st_size, hg);
+    munmap(data, st.st_size);
+    return res;
+  }
+  if (fd >= 0) close(fd);
+  ReadFile rf(fname);
+  return Read(rf.stream(), hg);
+}
+
+inline bool NeedsEscape(unsigned char c) {
+  return c == '\'' || c == '\\';
 }
 
 string HypergraphIO::Escape(const string& s) {
   size_t len = s.size();
-  for (int i = 0; i < s.size(); ++i) {
-    unsigned char c = s[i];
-    if (c < 128 && needs_escape[c]) ++len;
-  }
+  for (int i = 0; i < s.size(); ++i)
+    if (NeedsEscape(s[i])) ++len;
   if (len == s.size()) return s;
   string res(len, ' ');
   size_t o = 0;
   for (int i = 0; i < s.size(); ++i) {
     unsigned char c = s[i];
-    if (c < 128 && needs_escape[c])
+    if (NeedsEscape(c))
       res[o++] = '\\';
     res[o++] = c;
   }
@@ -371,8 +651,6 @@ string HypergraphIO::Escape(const string& s) {
 }
 
 string HypergraphIO::AsPLF(const Hypergraph& hg, bool include_global_parentheses) {
-  static bool first = true;
-  if (first) { InitEscapes(); first = false; }
   if (hg.nodes_.empty()) return "()";
   ostringstream os;
   if (include_global_parentheses) os << '(';
@@ -401,6 +679,24 @@ string HypergraphIO::AsPLF(const Hypergraph& hg, bool include_global_parentheses
   return os.str();
 }
 
+string HypergraphIO::AsPLF(const Lattice& l, bool include_global_parentheses) {
+  ostringstream os;
+  if (include_global_parentheses) os << '(';
+  for (int i = 0; i < l.size(); ++i) {
+    os << '(';
+    for (int j = 0; j < l[i].size(); ++j) {
+      const LatticeArc& arc = l[i][j];
+      double cost = arc.cost;
+      if (isinf(cost)) { cost = -9e20; }
+      if (isnan(cost)) { cost = 0; }
+      os << "('" << Escape(TD::Convert(arc.label)) << "'," << cost << "," << arc.dist2next << "),";
+    }
+    os << "),";
+  }
+  if (include_global_parentheses) os << ')';
+  return os.str();
+}
+
 namespace PLF {
 
 const string chars = "'\\";
@@ -418,37 +714,46 @@ inline void eatws(const std::string& in, int& c) {
   while (get(in,c) == ' ') { c++; }
 }
 
-// from 'foo' return foo
-std::string getEscapedString(const std::string& in, int &c)
+// from 'foo' read foo into *res (reusing its buffer)
+void getEscapedString(const std::string& in, int &c, std::string* res)
 {
+  res->clear();
   eatws(in,c);
-  if (get(in,c++) != quote) return "ERROR";
-  std::string res;
+  if (get(in,c++) != quote) { *res = "ERROR"; return; }
   char cur = 0;
   do {
     cur = get(in,c++);
-    if (cur == slash) { res += get(in,c++); }
-    else if (cur != quote) { res += cur; }
+    if (cur == slash) { *res += get(in,c++); }
+    else if (cur != quote) { *res += cur; }
   } while (get(in,c) != quote && (c < (int)in.size()));
   c++;
   eatws(in,c);
+}
+
+// from 'foo' return foo
+std::string getEscapedString(const std::string& in, int &c)
+{
+  std::string res;
+  getEscapedString(in, c, &res);
   return res;
 }
 
-// basically atof
+// basically atof.  none of the delimiters can be part of a number, so
+// strtod stops where the token does and no copy of it is needed
 float getFloat(const std::string& in, int &c)
 {
-  std::string tmp;
   eatws(in,c);
-  while (c < (int)in.size() && get(in,c) != ' ' && get(in,c) != ')' && get(in,c) != ',') {
-    tmp += get(in,c++);
-  }
-  eatws(in,c);
-  if (tmp.empty()) {
+  const int start = c;
+  while (c < (int)in.size() && get(in,c) != ' ' && get(in,c) != ')' && get(in,c) != ',')
+    ++c;
+  if (c == start) {
+    eatws(in,c);
     cerr << "Syntax error while reading number! col=" << c << endl;
     abort();
   }
-  return atof(tmp.c_str());
+  const float res = strtod(in.c_str() + start, NULL);
+  eatws(in,c);
+  return res;
 }
 
 // basically atoi
@@ -526,6 +831,66 @@ void ReadPLFNode(const std::string& in, int &c, int cur_node, int line, Hypergra
   }
 }
 
+// parse ('foo', 0.23) as a lattice arc leaving column cur_node; word and
+// probs are scratch buffers, reused across arcs. The arc's cost is its first
+// value, or the dot product of its values and weights if there are weights
+void ReadPLFArc(const std::string& in, int &c, int cur_node, const std::vector<double>* weights,
+                std::string* word, std::vector<float>* probs, Lattice* pl) {
+  if (get(in,c++) != '(') { assert(!"PCN/PLF parse error: expected ( at start of cn alt block\n"); }
+  getEscapedString(in,c,word);
+  if (get(in,c++) != ',') { cerr << in << endl; assert(!"PCN/PLF parse error: expected , after string\n"); }
+  size_t cnNext = 1;
+  probs->clear();
+  probs->push_back(getFloat(in,c));
+  while (get(in,c) == ',') {
+    c++;
+    probs->push_back(getFloat(in,c));
+  }
+  //if we read more than one prob, this was a lattice, last item was column increment
+  if (probs->size()>1) {
+    cnNext = static_cast<size_t>(probs->back());
+    if (cnNext < 1) { cerr << cnNext << endl;
+             assert(!"PCN/PLF parse error: bad link length at last element of cn alt block\n"); }
+  }
+  if (get(in,c++) != ')') { assert(!"PCN/PLF parse error: expected ) at end of cn alt block\n"); }
+  eatws(in,c);
+  const int head_node = cur_node + cnNext;
+  assert(head_node < MAX_NODES);  // prevent malicious PLFs from using all the memory
+  Lattice& l = *pl;
+  if (l.size() < head_node) l.resize(head_node);
+  double cost = probs->front();
+  if (weights) {
+    cost = 0;
+    const int num_feats = probs->size() > 1 ? probs->size() - 1 : 1;
+    for (int i = 0; i < num_feats && i < weights->size(); ++i)
+      cost += (*weights)[i] * (*probs)[i];
+  }
+  l[cur_node].push_back(LatticeArc(TD::Convert(*word), cost, cnNext));
+}
+
+// parse (('foo', 0.23), ('bar', 0.77)) as the arcs leaving column cur_node
+void ReadPLFColumn(const std::string& in, int &c, int cur_node, const std::vector<double>* weights,
+                   std::string* word, std::vector<float>* probs, Lattice* pl) {
+  if (pl->size() < (cur_node + 1)) { pl->resize(cur_node + 1); }
+  if (get(in,c++) != '(') { cerr << "PLF: Syntax error 1\n"; abort(); }
+  eatws(in,c);
+  while (1) {
+    if (c > (int)in.size()) { break; }
+    if (get(in,c) == ')') {
+      c++;
+      eatws(in,c);
+      break;
+    }
+    if (get(in,c) == ',' && get(in,c+1) == ')') {
+      c+=2;
+      eatws(in,c);
+      break;
+    }
+    if (get(in,c) == ',') { c++; eatws(in,c); }
+    ReadPLFArc(in, c, cur_node, weights, word, probs, pl);
+  }
+}
+
 } // namespace PLF
 
 void HypergraphIO::ReadFromPLF(const std::string& in, Hypergraph* hg, int line) {
@@ -552,25 +917,33 @@ void HypergraphIO::ReadFromPLF(const std::string& in, Hypergraph* hg, int line)
   assert(cur_node == hg->nodes_.size() - 1);
 }
 
-void HypergraphIO::PLFtoLattice(const string& plf, Lattice* pl) {
+// reads the PLF straight into the lattice's arcs (rather than by way of a
+// Hypergraph of single-word rules), so no rules or feature names are built
+void HypergraphIO::PLFtoLattice(const string& plf, Lattice* pl, const vector<double>* feature_weights) {
   Lattice& l = *pl;
-  Hypergraph g;
-  ReadFromPLF(plf, &g, 0);
-  const int num_nodes = g.nodes_.size() - 1;
-  l.resize(num_nodes);
-  int fid0=FD::Convert("Feature_0");
-  for (int i = 0; i < num_nodes; ++i) {
-    vector<LatticeArc>& alts = l[i];
-    const Hypergraph::Node& node = g.nodes_[i];
-    const int num_alts = node.out_edges_.size();
-    alts.resize(num_alts);
-    for (int j = 0; j < num_alts; ++j) {
-      const Hypergraph::Edge& edge = g.edges_[node.out_edges_[j]];
-      alts[j].label = edge.rule_->e_[1];
-      alts[j].cost = edge.feature_values_.get(fid0);
-      alts[j].dist2next = edge.head_node_ - node.id_;
+  l.clear();
+  string word;
+  vector<float> probs;
+  int c = 0;
+  int cur_node = 0;
+  if (plf[c++] != '(') { cerr << "PLF: Syntax error!\n"; abort(); }
+  while (1) {
+    if (c > (int)plf.size()) { break; }
+    if (PLF::get(plf,c) == ')') {
+      c++;
+      PLF::eatws(plf,c);
+      break;
     }
+    if (PLF::get(plf,c) == ',' && PLF::get(plf,c+1) == ')') {
+      c+=2;
+      PLF::eatws(plf,c);
+      break;
+    }
+    if (PLF::get(plf,c) == ',') { c++; PLF::eatws(plf,c); }
+    PLF::ReadPLFColumn(plf, c, cur_node, feature_weights, &word, &probs, &l);
+    ++cur_node;
   }
+  assert(cur_node == l.size());
 }
 
 void HypergraphIO::WriteAsCFG(const Hypergraph& hg) {
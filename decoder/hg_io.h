@@ -2,6 +2,8 @@
 #define _HG_IO_H_
 
 #include <iostream>
+#include <string>
+#include <vector>
 #include "lattice.h"
 
 class Hypergraph;
@@ -21,13 +23,32 @@ struct HypergraphIO {
   // (so it only contains structure and feature information)
   static bool WriteToJSON(const Hypergraph& hg, bool remove_rules, std::ostream* out);
 
+  // compact binary format: the rule, feature and category names used by the
+  // forest are written once, followed by varint coded nodes and edges in the
+  // same (topological) order as the JSON format. Feature values are stored
+  // exactly, in native byte order.
+  static bool WriteToBinary(const Hypergraph& hg, bool remove_rules, std::ostream* out);
+  static bool ReadFromBinary(const char* data, size_t size, Hypergraph* out);
+  static bool ReadFromBinary(std::istream* in, Hypergraph* out);
+
+  // reads a forest in either format from in
+  static bool Read(std::istream* in, Hypergraph* out);
+  // reads a forest in either format from fname; uncompressed binary forests
+  // are memory-mapped instead of being read through a stream
+  static bool ReadFromFile(const std::string& fname, Hypergraph* out);
+
   static void WriteAsCFG(const Hypergraph& hg);
 
   // serialization utils
   static void ReadFromPLF(const std::string& in, Hypergraph* out, int line = 0);
   // return PLF string representation (undefined behavior on non-lattices)
   static std::string AsPLF(const Hypergraph& hg, bool include_global_parentheses = true);
-  static void PLFtoLattice(const std::string& plf, Lattice* pl);
+  // the same for a lattice, with one value (the cost) per arc
+  static std::string AsPLF(const Lattice& l, bool include_global_parentheses = true);
+  // arc costs are the first value of each arc, or if feature_weights are
+  // given, the dot product of its values with them
+  static void PLFtoLattice(const std::string& plf, Lattice* pl,
+                           const std::vector<double>* feature_weights = NULL);
   static std::string Escape(const std::string& s);  // PLF helper
 };
 
@@ -1,6 +1,10 @@
 #include <iostream>
 #include <fstream>
+#include <set>
 #include <vector>
+#include <boost/lexical_cast.hpp>
+#include <dirent.h>
+#include <unistd.h>
 #include "tdict.h"
 
 #include "json_parse.h"
@@ -8,6 +12,11 @@
 #include "viterbi.h"
 #include "kbest.h"
 #include "inside_outside.h"
+#include "apply_fsa_models.h"
+#include "ff_fsa_dynamic.h"
+#include "ff_sample_fsa.h"
+#include "sentence_metadata.h"
+#include "forest_cache.h"
 
 #include "hg_test.h"
 
@@ -52,7 +61,16 @@ TEST_F(HGTest,Union) {
   int l2 = ViterbiPathLength(hg2);
   cerr << c1 << "\t" << TD::GetString(t1) << endl;
   cerr << c2 << "\t" << TD::GetString(t2) << endl;
+  const int n1 = hg1.nodes_.size(), n2 = hg2.nodes_.size();
   hg1.Union(hg2);
+  // both are sorted with the goal last, so the union is too, and all their
+  // nodes but one goal are kept
+  EXPECT_TRUE(hg1.IsTopologicallySorted());
+  EXPECT_EQ(n1 + n2 - 1, hg1.nodes_.size());
+  for (int i = 0; i < hg1.nodes_.size(); ++i)
+    EXPECT_EQ(i, hg1.nodes_[i].id_);
+  for (int i = 0; i < hg1.edges_.size(); ++i)
+    EXPECT_EQ(i, hg1.edges_[i].id_);
   hg1.Reweight(wts);
   c3 = ViterbiESentence(hg1, &t3);
   int l3 = ViterbiPathLength(hg1);
@@ -147,6 +165,28 @@ TEST_F(HGTest,PruneInsideOutside) {
   hg.PrintGraphviz();
 }
 
+TEST_F(HGTest,SetPromise) {
+  SparseVector<double> wts;
+  wts.set_value(FD::Convert("Feature_1"), 1.0);
+  Hypergraph hg;
+  CreateLatticeHG(&hg);
+  hg.Reweight(wts);
+  hg.SetPromise(0);
+  for (int i = 0; i < hg.nodes_.size(); ++i)
+    EXPECT_FLOAT_EQ(1.0, hg.nodes_[i].promise);
+  hg.SetPromise(1.0);
+  double sum = 0, best = 0, worst = 100;
+  for (int i = 0; i < hg.nodes_.size(); ++i) {
+    sum += hg.nodes_[i].promise;
+    best = max(best, hg.nodes_[i].promise);
+    worst = min(worst, hg.nodes_[i].promise);
+  }
+  EXPECT_NEAR(hg.nodes_.size(), sum, 1e-6);
+  // the goal is on the best derivation, and some node is not
+  EXPECT_FLOAT_EQ(best, hg.nodes_.back().promise);
+  EXPECT_LT(worst, best);
+}
+
 TEST_F(HGTest,TestPruneEdges) {
   Hypergraph hg;
   CreateLatticeHG(&hg);
@@ -161,6 +201,60 @@ TEST_F(HGTest,TestPruneEdges) {
   hg.PrintGraphviz();
 }
 
+// pruning a forest whose nodes are already in topological order keeps that
+// order, and keeps every surviving edge's tails and features
+TEST_F(HGTest,TestPruneEdgesInPlace) {
+  Hypergraph hg;
+  CreateHG(&hg);
+  SparseVector<double> wts;
+  wts.set_value(FD::Convert("f1"), 1.0);
+  hg.Reweight(wts);
+  ASSERT_TRUE(hg.IsTopologicallySorted());
+  const Hypergraph orig = hg;
+  vector<WordID> trans, pruned_trans;
+  const prob_t best = ViterbiESentence(hg, &trans);
+  vector<prob_t> through;
+  hg.ComputeBestPathThroughEdges(&through);
+  vector<bool> prune(hg.edges_.size(), false);
+  for (int i = 0; i < hg.edges_.size(); ++i)
+    prune[i] = through[i] < best * prob_t::exp(-0.1);
+  hg.PruneEdges(prune, true);
+  EXPECT_LT(hg.edges_.size(), orig.edges_.size());
+  EXPECT_TRUE(hg.IsTopologicallySorted());
+  EXPECT_EQ(hg.nodes_.size() - 1, hg.nodes_.back().id_);
+  for (int i = 0; i < hg.edges_.size(); ++i) EXPECT_EQ(i, hg.edges_[i].id_);
+  for (int i = 0; i < hg.nodes_.size(); ++i) EXPECT_EQ(i, hg.nodes_[i].id_);
+  EXPECT_EQ(best, ViterbiESentence(hg, &pruned_trans));
+  EXPECT_EQ(trans, pruned_trans);
+  // the kept edges are the unpruned ones, in their original order
+  int j = 0;
+  for (int i = 0; i < orig.edges_.size() && j < hg.edges_.size(); ++i) {
+    if (prune[i] || orig.edges_[i].rule_ != hg.edges_[j].rule_) continue;
+    EXPECT_EQ(orig.edges_[i].feature_values_, hg.edges_[j].feature_values_);
+    EXPECT_EQ(orig.edges_[i].tail_nodes_.size(), hg.edges_[j].tail_nodes_.size());
+    ++j;
+  }
+  EXPECT_EQ(hg.edges_.size(), j);
+}
+
+TEST_F(HGTest,TestPruneEdgePosteriors) {
+  Hypergraph a;
+  CreateHG(&a);
+  SparseVector<double> wts;
+  wts.set_value(FD::Convert("f1"), 1.0);
+  a.Reweight(wts);
+  Hypergraph b = a;
+  a.PruneInsideOutside(0.5, 0, NULL, true, 1);
+  Hypergraph::EdgeProbs posts;
+  const prob_t z = b.ComputeEdgePosteriors(1.0, &posts);
+  b.PruneEdgePosteriors(posts, z, 0.5, 0);
+  EXPECT_EQ(a.nodes_.size(), b.nodes_.size());
+  EXPECT_EQ(a.edges_.size(), b.edges_.size());
+  vector<WordID> ta, tb;
+  EXPECT_EQ(ViterbiESentence(a, &ta), ViterbiESentence(b, &tb));
+  EXPECT_EQ(ta, tb);
+}
+
 TEST_F(HGTest,TestIntersect) {
   Hypergraph hg;
   CreateHG_int(&hg);
@@ -187,6 +281,34 @@ TEST_F(HGTest,TestIntersect) {
   hg.PrintGraphviz();
 }
 
+// the rule filter must keep every edge of the derivations of the target,
+// also when it is one path through a lattice
+TEST_F(HGTest,IntersectWithFilter) {
+  Hypergraph hg;
+  JsonTestFile(&hg, urdu_json);
+  SparseVector<double> wts;
+  istringstream ws(urdu_wts);
+  string f;
+  double w;
+  while (ws >> f >> w) wts.set_value(FD::Convert(f), w);
+  hg.Reweight(wts);
+  vector<WordID> trans;
+  ViterbiESentence(hg, &trans);
+  Lattice sent(trans.size()), lat(trans.size());
+  for (int i = 0; i < trans.size(); ++i) {
+    sent[i].push_back(LatticeArc(trans[i], 0.0, 1));
+    lat[i].push_back(LatticeArc(TD::Convert("the"), 0.0, 1));
+    lat[i].push_back(LatticeArc(trans[i], 0.0, 1));
+    if (i + 2 <= trans.size()) lat[i].push_back(LatticeArc(TD::Convert("of"), 0.0, 2));
+  }
+  Hypergraph shg = hg, lhg = hg;
+  ASSERT_TRUE(HG::Intersect(sent, &shg));
+  ASSERT_TRUE(HG::Intersect(lat, &lhg));
+  EXPECT_LE(shg.edges_.size(), lhg.edges_.size());
+  sent[0][0].label = TD::Convert("no_such_word");
+  EXPECT_FALSE(HG::Intersect(sent, &hg));
+}
+
 TEST_F(HGTest,TestPrune2) {
   Hypergraph hg;
   CreateHG_int(&hg);
@@ -229,6 +351,39 @@ TEST_F(HGTest,PLF) {
   EXPECT_EQ(inplf,outplf);
 }
 
+TEST_F(HGTest,PLFtoLattice) {
+  string inplf = "((('haupt',-2.06655,1),('hauptgrund',-5.71033,2),),(('grund',-1.78709,1),),(('für\\'',0.1,1),),)";
+  Lattice l;
+  LatticeTools::ConvertTextOrPLF(inplf, &l);
+  ASSERT_EQ(3, l.size());
+  ASSERT_EQ(2, l[0].size());
+  EXPECT_EQ("hauptgrund", string(TD::Convert(l[0][1].label)));
+  EXPECT_EQ(2, l[0][1].dist2next);
+  EXPECT_FLOAT_EQ(-5.71033, l[0][1].cost);
+  EXPECT_EQ("für'", string(TD::Convert(l[2][0].label)));
+  EXPECT_FALSE(l.IsSentence());
+  EXPECT_EQ(1, l.Distance(0, 2));
+  EXPECT_EQ(2, l.Distance(0, 3));
+  EXPECT_EQ(1, l.Distance(1, 2));
+  EXPECT_EQ(2, l.Distance(1, 3));
+}
+
+TEST_F(HGTest,WeightedPLFtoLatticeAsPLF) {
+  string inplf = "((('a',-1,-2,1),('b\\'c',-0.5,0,2),),(('d',-3,1,1),),)";
+  vector<double> w(2); w[0] = 1; w[1] = 0.5;
+  Lattice l;
+  HypergraphIO::PLFtoLattice(inplf, &l, &w);
+  ASSERT_EQ(2, l.size());
+  EXPECT_FLOAT_EQ(-2, l[0][0].cost);
+  EXPECT_FLOAT_EQ(-0.5, l[0][1].cost);
+  EXPECT_FLOAT_EQ(-2.5, l[1][0].cost);
+  EXPECT_EQ("((('a',-2,1),('b\\'c',-0.5,2),),(('d',-2.5,1),),)", HypergraphIO::AsPLF(l));
+  Hypergraph hg;
+  HypergraphIO::ReadFromPLF(HypergraphIO::AsPLF(l), &hg);
+  hg.Reweight(vector<double>(FD::NumFeats(), 1.0));
+  EXPECT_EQ(HypergraphIO::AsPLF(l), HypergraphIO::AsPLF(hg));
+}
+
 TEST_F(HGTest,PushWeightsToGoal) {
   Hypergraph hg;
   CreateHG(&hg);
@@ -355,6 +510,238 @@ TEST_F(HGTest, Small) {
   EXPECT_FLOAT_EQ(2.1431036, log(c2));
 }
 
+TEST_F(HGTest, InsideOutsideMatchesGeneric) {
+  Hypergraph hg;
+  JsonTestFile(&hg, urdu_json);
+  SparseVector<double> wts;
+  istringstream ws(urdu_wts);
+  string f;
+  double w;
+  while (ws >> f >> w) wts.set_value(FD::Convert(f), w);
+  hg.Reweight(wts);
+  // ScaledEdgeProb(1) computes the same weights with the generic code
+  vector<prob_t> inside, inside2, outside, outside2;
+  const prob_t z = Inside<prob_t, EdgeProb>(hg, &inside);
+  const prob_t z2 = Inside<prob_t, ScaledEdgeProb>(hg, &inside2, ScaledEdgeProb(1.0));
+  EXPECT_NEAR(log(z2), log(z), 1e-9);
+  Outside<prob_t, EdgeProb>(hg, inside, &outside);
+  Outside<prob_t, ScaledEdgeProb>(hg, inside2, &outside2, ScaledEdgeProb(1.0));
+  ASSERT_EQ(inside2.size(), inside.size());
+  ASSERT_EQ(outside2.size(), outside.size());
+  for (int i = 0; i < hg.nodes_.size(); ++i) {
+    EXPECT_NEAR(log(inside2[i]), log(inside[i]), 1e-9);
+    EXPECT_NEAR(log(outside2[i]), log(outside[i]), 1e-9);
+  }
+}
+
+TEST_F(HGTest, TopologyViterbiMatchesGeneric) {
+  Hypergraph hg;
+  JsonTestFile(&hg, urdu_json);
+  SparseVector<double> wts;
+  istringstream ws(urdu_wts);
+  string f;
+  double w;
+  while (ws >> f >> w) wts.set_value(FD::Convert(f), w);
+  hg.Reweight(wts);
+  HypergraphTopology top(hg);
+  ASSERT_EQ(hg.nodes_.size(), top.num_nodes());
+  EXPECT_TRUE(top.nonnegative());
+  // the EdgeProb specialization uses the topology
+  vector<WordID> trans, trans2;
+  const prob_t p = Viterbi(hg, &trans, ESentenceTraversal());
+  const prob_t p2 = Viterbi(hg, &trans2, ESentenceTraversal(), EdgeProb());
+  EXPECT_EQ(log(p2), log(p));
+  EXPECT_EQ(TD::GetString(trans2), TD::GetString(trans));
+  Hypergraph::NodeProbs nv;
+  hg.ComputeNodeViterbi(&nv);
+  vector<double> score;
+  vector<int> best;
+  top.Viterbi(&score, &best);
+  for (int i = 0; i < hg.nodes_.size(); ++i) {
+    EXPECT_NEAR(log(nv[i]), score[i], 1e-6);
+    if (best[i] >= 0) {
+      EXPECT_GE(best[i], top.first(i));
+      EXPECT_LT(best[i], top.first(i + 1));
+      EXPECT_EQ(i, hg.edges_[top.edge(best[i])].head_node_);
+    }
+  }
+  // new weights without a new topology
+  wts.set_value(FD::Convert("LanguageModel"), 0);
+  hg.Reweight(wts);
+  top.SetWeights(hg);
+  EXPECT_EQ(log(ViterbiESentence(hg, &trans)), top.Viterbi(&score, &best));
+}
+
+TEST_F(HGTest, ViterbiYieldsMatchTraversals) {
+  Hypergraph hg;
+  JsonTestFile(&hg, urdu_json);
+  SparseVector<double> wts;
+  istringstream ws(urdu_wts);
+  string f;
+  double w;
+  while (ws >> f >> w) wts.set_value(FD::Convert(f), w);
+  hg.Reweight(wts);
+  // the four-argument Viterbi runs the traversals at every node
+  vector<WordID> e, e2, fs, fs2, et, ft;
+  const prob_t p = ViterbiESentence(hg, &e);
+  EXPECT_EQ(log(Viterbi(hg, &e2, ESentenceTraversal(), EdgeProb())), log(p));
+  EXPECT_EQ(TD::GetString(e2), TD::GetString(e));
+  EXPECT_EQ(log(p), log(ViterbiFSentence(hg, &fs)));
+  Viterbi(hg, &fs2, FSentenceTraversal(), EdgeProb());
+  EXPECT_EQ(TD::GetString(fs2), TD::GetString(fs));
+  Viterbi(hg, &et, ETreeTraversal(), EdgeProb());
+  EXPECT_EQ(TD::GetString(et), ViterbiETree(hg));
+  Viterbi(hg, &ft, FTreeTraversal(), EdgeProb());
+  EXPECT_EQ(TD::GetString(ft), ViterbiFTree(hg));
+  cerr << ViterbiETree(hg) << endl;
+}
+
+// same as EdgeFeaturesAndProbWeightFunction, but uses the generic InsideOutside
+struct GenericFeatureExpectations : public EdgeFeaturesAndProbWeightFunction {};
+
+TEST_F(HGTest, FeatureExpectationsMatchGeneric) {
+  Hypergraph hg;
+  JsonTestFile(&hg, urdu_json);
+  SparseVector<double> wts;
+  istringstream ws(urdu_wts);
+  string f;
+  double w;
+  while (ws >> f >> w) wts.set_value(FD::Convert(f), w);
+  hg.Reweight(wts);
+  SparseVector<prob_t> exps, exps2;
+  const prob_t z = InsideOutside<prob_t, EdgeProb,
+                  SparseVector<prob_t>, EdgeFeaturesAndProbWeightFunction>(hg, &exps);
+  const prob_t z2 = InsideOutside<prob_t, EdgeProb,
+                  SparseVector<prob_t>, GenericFeatureExpectations>(hg, &exps2);
+  EXPECT_NEAR(log(z2), log(z), 1e-9);
+  EXPECT_EQ(exps2.size(), exps.size());
+  for (SparseVector<prob_t>::const_iterator it = exps2.begin(); it != exps2.end(); ++it)
+    EXPECT_NEAR(it->second / z2, exps.value(it->first) / z, 1e-9) << FD::Convert(it->first);
+  // the accumulator must be clean for the next forest
+  SparseVector<prob_t> exps3;
+  InsideOutside<prob_t, EdgeProb,
+                SparseVector<prob_t>, EdgeFeaturesAndProbWeightFunction>(hg, &exps3);
+  EXPECT_TRUE(exps3 == exps);
+}
+
+// against sums over the derivations enumerated by k-best, with the edge
+// values r taken from feature f2 so r(d) is the derivation's f2
+TEST_F(HGTest, SecondOrderExpectations) {
+  Hypergraph hg;
+  CreateHG(&hg);
+  SparseVector<double> wts;
+  wts.set_value(FD::Convert("f1"), 0.4);
+  wts.set_value(FD::Convert("f2"), -0.7);
+  hg.Reweight(wts);
+  const int f2 = FD::Convert("f2");
+  vector<double> edge_r(hg.edges_.size());
+  for (int i = 0; i < hg.edges_.size(); ++i)
+    edge_r[i] = hg.edges_[i].feature_values_.value(f2);
+  prob_t r;
+  SparseVector<prob_t> s, t;
+  const prob_t z = SecondOrderExpectations(hg, edge_r, &r, &s, &t);
+
+  prob_t z2, r2;
+  SparseVector<prob_t> s2, t2;
+  KBest::KBestDerivations<vector<WordID>, ESentenceTraversal> kbest(hg, 1000);
+  int n = 0;
+  for (; ; ++n) {
+    const KBest::KBestDerivations<vector<WordID>, ESentenceTraversal>::Derivation* d =
+      kbest.LazyKthBest(hg.nodes_.size() - 1, n);
+    if (!d) break;
+    z2 += d->score;
+    const prob_t rd(d->feature_values.value(f2));
+    r2 += rd * d->score;
+    for (SparseVector<double>::const_iterator it = d->feature_values.begin();
+         it != d->feature_values.end(); ++it) {
+      s2.add_value(it->first, prob_t(it->second) * d->score);
+      t2.add_value(it->first, prob_t(it->second) * rd * d->score);
+    }
+  }
+  EXPECT_LT(1, n);
+  EXPECT_NEAR(log(z2), log(z), 1e-9);
+  EXPECT_NEAR((r2 / z2).as_float(), (r / z).as_float(), 1e-9);
+  EXPECT_EQ(s2.size(), s.size());
+  EXPECT_EQ(t2.size(), t.size());
+  for (SparseVector<prob_t>::const_iterator it = s2.begin(); it != s2.end(); ++it) {
+    EXPECT_NEAR((it->second / z2).as_float(), (s.value(it->first) / z).as_float(), 1e-9);
+    EXPECT_NEAR((t2.value(it->first) / z2).as_float(), (t.value(it->first) / z).as_float(), 1e-9);
+  }
+}
+
+// a LexicalTrans-shaped forest: a node per target word with a lexical edge
+// for each source word, joined left to right by binary edges
+TEST_F(HGTest, LinearChainFeatureExpectationsMatchGeneric) {
+  const int e_len = 4, f_len = 3;
+  const WordID kX = TD::Convert("X") * -1;
+  TRulePtr kBINARY(new TRule("[X] ||| [X,1] [X,2] ||| [1] [2]"));
+  TRulePtr kGOAL(new TRule("[Goal] ||| [X,1] ||| [1]"));
+  Hypergraph hg;
+  int prev = -1;
+  for (int i = 0; i < e_len; ++i) {
+    const int node = hg.AddNode(kX)->id_;
+    for (int j = 0; j < f_len; ++j) {
+      TRulePtr rule(TRule::CreateLexicalRule(TD::Convert("f" + boost::lexical_cast<string>(j)),
+                                             TD::Convert("e" + boost::lexical_cast<string>(i))));
+      Hypergraph::Edge* edge = hg.AddEdge(rule, Hypergraph::TailNodeVector());
+      edge->feature_values_.set_value(FD::Convert("LCLex_" + boost::lexical_cast<string>(i * f_len + j)), 1.0);
+      edge->feature_values_.set_value(FD::Convert("LCDiag"), -abs(i - j));
+      hg.ConnectEdgeToHeadNode(edge, node);
+    }
+    if (prev < 0) { prev = node; continue; }
+    const int comb = hg.AddNode(kX)->id_;
+    Hypergraph::TailNodeVector tail(2, prev);
+    tail[1] = node;
+    Hypergraph::Edge* edge = hg.AddEdge(kBINARY, tail);
+    edge->feature_values_.set_value(FD::Convert("LCGlue"), 1.0);
+    hg.ConnectEdgeToHeadNode(edge, comb);
+    prev = comb;
+  }
+  Hypergraph::Edge* goal = hg.AddEdge(kGOAL, Hypergraph::TailNodeVector(1, prev));
+  hg.ConnectEdgeToHeadNode(goal, hg.AddNode(TD::Convert("Goal") * -1));
+  SparseVector<double> wts;
+  wts.set_value(FD::Convert("LCDiag"), 0.7);
+  wts.set_value(FD::Convert("LCGlue"), -0.2);
+  for (int k = 0; k < e_len * f_len; ++k)
+    wts.set_value(FD::Convert("LCLex_" + boost::lexical_cast<string>(k)), 0.1 * (k % 5) - 0.2);
+  hg.Reweight(wts);
+
+  SparseVector<prob_t> exps, exps2;
+  hg.is_linear_chain_ = true;
+  const prob_t z = InsideOutside<prob_t, EdgeProb,
+                  SparseVector<prob_t>, EdgeFeaturesAndProbWeightFunction>(hg, &exps);
+  const prob_t z2 = InsideOutside<prob_t, EdgeProb,
+                  SparseVector<prob_t>, GenericFeatureExpectations>(hg, &exps2);
+  EXPECT_NEAR(log(z2), log(z), 1e-9);
+  EXPECT_NEAR(log(z2), log(Inside<prob_t, EdgeProb>(hg)), 1e-9);
+  EXPECT_EQ(exps2.size(), exps.size());
+  for (SparseVector<prob_t>::const_iterator it = exps2.begin(); it != exps2.end(); ++it)
+    EXPECT_NEAR(it->second / z2, exps.value(it->first) / z, 1e-9) << FD::Convert(it->first);
+  // every derivation uses e_len - 1 glue edges
+  EXPECT_NEAR(e_len - 1, (exps.value(FD::Convert("LCGlue")) / z).as_float(), 1e-9);
+}
+
+TEST_F(HGTest, PackedEdgeFeatures) {
+  Hypergraph hg;
+  JsonTestFile(&hg, urdu_json);
+  SparseVector<double> wts;
+  istringstream ws(urdu_wts);
+  string f;
+  double w;
+  while (ws >> f >> w) wts.set_value(FD::Convert(f), w);
+  vector<double> dense;
+  wts.init_vector(&dense);
+  hg.Reweight(dense);
+  vector<prob_t> probs(hg.edges_.size());
+  for (int i = 0; i < hg.edges_.size(); ++i) probs[i] = hg.edges_[i].edge_prob_;
+  hg.Reweight(vector<double>());
+  PackedEdgeFeatures packed(hg);
+  EXPECT_EQ(hg.edges_.size(), packed.num_edges());
+  packed.Reweight(dense, &hg);  // dense may be shorter than max_fid()
+  for (int i = 0; i < hg.edges_.size(); ++i)
+    EXPECT_NEAR(log(probs[i]), log(hg.edges_[i].edge_prob_), 1e-12);
+}
+
 TEST_F(HGTest, JSONTest) {
   ostringstream os;
   JSONParser::WriteEscapedString("\"I don't know\", she said.", &os);
@@ -386,6 +773,49 @@ TEST_F(HGTest, TestGenericKBest) {
   }
 }
 
+TEST_F(HGTest, TestUniqueKBest) {
+  // two ways to say a (both "x"), b as "y" or "z", in either order
+  Hypergraph hg;
+  const char* words[] = { "[X] ||| a ||| x", "[X] ||| a ||| x", "[X] ||| b ||| y", "[X] ||| b ||| z" };
+  Hypergraph::TailNodeVector tail;
+  for (int i = 0; i < 4; i += 2) {
+    Hypergraph::Node* node = hg.AddNode(-TD::Convert("X"));
+    for (int j = i; j < i + 2; ++j) {
+      Hypergraph::Edge* e = hg.AddEdge(TRulePtr(new TRule(words[j])), Hypergraph::TailNodeVector());
+      e->feature_values_.set_value(FD::Convert("f1"), j);
+      hg.ConnectEdgeToHeadNode(e, node);
+    }
+    tail.push_back(node->id_);
+  }
+  Hypergraph::Node* goal = hg.AddNode(-TD::Convert("Goal"));
+  hg.ConnectEdgeToHeadNode(hg.AddEdge(TRulePtr(new TRule("[Goal] ||| [X,1] [X,2] ||| [1] [2]")), tail), goal);
+  hg.ConnectEdgeToHeadNode(hg.AddEdge(TRulePtr(new TRule("[Goal] ||| [X,1] [X,2] ||| [2] [1]")), tail), goal);
+  SparseVector<double> w;
+  w.set_value(FD::Convert("f1"), 0.5);
+  hg.Reweight(w);
+  typedef KBest::KBestDerivations<vector<WordID>, ESentenceTraversal> K;
+  typedef KBest::KBestDerivations<vector<WordID>, ESentenceTraversal, KBest::FilterUnique> U;
+  K all(hg, 100000);
+  set<vector<WordID> > yields;
+  int n = 0;
+  for (const K::Derivation* d; (d = all.LazyKthBest(hg.nodes_.size() - 1, n)); ++n) {
+    yields.insert(d->yield);
+    EXPECT_FLOAT_EQ(d->feature_values.dot(w), log(d->score));
+  }
+  EXPECT_EQ(8, n);
+  EXPECT_EQ(4, yields.size());
+
+  U unique(hg, 100000);
+  set<vector<WordID> > seen;
+  for (int i = 0; ; ++i) {
+    const U::Derivation* d = unique.LazyKthBest(hg.nodes_.size() - 1, i);
+    if (!d) break;
+    EXPECT_TRUE(seen.insert(d->yield).second);
+    EXPECT_FLOAT_EQ(d->feature_values.dot(w), log(d->score));
+  }
+  EXPECT_TRUE(seen == yields);
+}
+
 TEST_F(HGTest, TestReadWriteHG) {
   Hypergraph hg,hg2;
   CreateHG(&hg);
@@ -400,6 +830,92 @@ TEST_F(HGTest, TestReadWriteHG) {
   EXPECT_EQ(hg2.edges_.back().prev_i_, 99);
 }
 
+TEST_F(HGTest,ApplyFsaEarley) {
+  Hypergraph hg;
+  CreateHG(&hg);
+  // full intersection wants the usual unary goal edge on top
+  Hypergraph::TailNodeVector tail(1,hg.nodes_.size()-1);
+  Hypergraph::Edge* goal=hg.AddEdge(TRulePtr(new TRule("[Goal] ||| [X,1] ||| [1]")),tail);
+  hg.ConnectEdgeToHeadNode(goal,hg.AddNode(-TD::Convert("Goal")));
+  FsaFeatureFunctionDynamic<ShorterThanPrev> fsa("");
+  vector<double> w(FD::NumFeats()+1);
+  w[0]=0.4; w[1]=0.8; w[fsa.features()[0]]=-0.5;
+  hg.Reweight(w);
+  Lattice lat;
+  SentenceMetadata smeta(0,lat);
+  Hypergraph full,earley,limited;
+  ApplyFsaModels(hg,smeta,fsa,w,ApplyFsaBy(BU_FULL),&full);
+  ApplyFsaModels(hg,smeta,fsa,w,ApplyFsaBy(EARLEY,0),&earley);
+  ApplyFsaModels(hg,smeta,fsa,w,ApplyFsaBy(EARLEY,1),&limited);
+  vector<WordID> tfull,tearley,tlimited;
+  prob_t pfull=ViterbiESentence(full,&tfull);
+  prob_t pearley=ViterbiESentence(earley,&tearley);
+  cerr << TD::GetString(tearley) << " " << log(pearley) << endl;
+  EXPECT_FLOAT_EQ(log(pfull),log(pearley));
+  EXPECT_EQ(TD::GetString(tfull),TD::GetString(tearley));
+  // exact: every input derivation is still there, once
+  EXPECT_EQ(hg.NumberOfPaths(),earley.NumberOfPaths());
+  ViterbiESentence(limited,&tlimited);
+  EXPECT_GT(limited.NumberOfPaths(),0);
+  EXPECT_LE(limited.nodes_.size(),earley.nodes_.size());
+}
+
+TEST_F(HGTest, TestReadWriteBinaryHG) {
+  Hypergraph hg,hg2,hg3;
+  CreateHG(&hg);
+  hg.edges_.front().j_ = 23;
+  ostringstream os;
+  ASSERT_TRUE(HypergraphIO::WriteToBinary(hg, false, &os));
+  istringstream is(os.str());
+  ASSERT_TRUE(HypergraphIO::Read(&is, &hg2));
+  ASSERT_EQ(hg.nodes_.size(), hg2.nodes_.size());
+  ASSERT_EQ(hg.edges_.size(), hg2.edges_.size());
+  EXPECT_EQ(hg2.NumberOfPaths(), hg.NumberOfPaths());
+  EXPECT_EQ(hg2.edges_.front().j_, 23);
+  for (int i = 0; i < hg.nodes_.size(); ++i)
+    EXPECT_EQ(hg.nodes_[i].cat_, hg2.nodes_[i].cat_);
+  for (int i = 0; i < hg.edges_.size(); ++i) {
+    EXPECT_EQ(hg.edges_[i].rule_->AsString(), hg2.edges_[i].rule_->AsString());
+    EXPECT_TRUE(hg.edges_[i].tail_nodes_ == hg2.edges_[i].tail_nodes_);
+    EXPECT_EQ(hg.edges_[i].prev_i_, hg2.edges_[i].prev_i_);
+    EXPECT_TRUE(hg.edges_[i].feature_values_ == hg2.edges_[i].feature_values_);
+  }
+  const string data = os.str();
+  EXPECT_FALSE(HypergraphIO::ReadFromBinary(data.data(), data.size() - 1, &hg3));
+}
+
+TEST_F(HGTest, ForestCache) {
+  char dir[] = "/tmp/hg_test.XXXXXX";
+  ASSERT_TRUE(mkdtemp(dir) != NULL);
+  Hypergraph hg, hg2;
+  CreateHG(&hg);
+  {
+    ForestCache cache(dir);
+    EXPECT_FALSE(cache.Load("a b c", &hg2));
+    cache.Store("a b c", hg);
+    EXPECT_EQ(0u, cache.hits());
+    EXPECT_EQ(1u, cache.misses());
+  }
+  // as a later run would see it
+  ForestCache cache(dir);
+  EXPECT_FALSE(cache.Load("a b d", &hg2));
+  ASSERT_TRUE(cache.Load("a b c", &hg2));
+  EXPECT_EQ(1u, cache.hits());
+  EXPECT_EQ(1u, cache.misses());
+  ASSERT_EQ(hg.nodes_.size(), hg2.nodes_.size());
+  ASSERT_EQ(hg.edges_.size(), hg2.edges_.size());
+  for (int i = 0; i < hg.edges_.size(); ++i) {
+    EXPECT_EQ(hg.edges_[i].rule_->AsString(), hg2.edges_[i].rule_->AsString());
+    EXPECT_TRUE(hg.edges_[i].feature_values_ == hg2.edges_[i].feature_values_);
+  }
+
+  DIR* d = opendir(dir);
+  while (dirent* e = readdir(d))
+    if (e->d_name[0] != '.') unlink((string(dir) + "/" + e->d_name).c_str());
+  closedir(d);
+  rmdir(dir);
+}
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
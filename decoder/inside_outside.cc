@@ -0,0 +1,359 @@
+#include "inside_outside.h"
+
+#include <cmath>
+#include <limits>
+
+#include <boost/thread/tss.hpp>
+
+#include "exp_semiring.h"
+#include "fdict.h"
+
+using namespace std;
+
+namespace {
+
+// same weights as EdgeProb, but does not pick up the specializations below
+struct GenericEdgeProb {
+  typedef prob_t Weight;
+  inline const prob_t& operator()(const Hypergraph::Edge& e) const { return e.edge_prob_; }
+};
+
+const double kLOG0 = -numeric_limits<double>::infinity();
+
+// a log-domain sum kept as max + log(sum), so adding a term costs a single
+// exp (LogVal::operator+= needs an exp and a log1p) and the log is only
+// taken once at the end
+inline void LogAdd(double x, double* max, double* sum) {
+  if (x <= *max) {
+    if (x != kLOG0) *sum += std::exp(x - *max);
+  } else {
+    *sum = *sum * std::exp(*max - x) + 1.0;
+    *max = x;
+  }
+}
+
+inline double LogSum(double max, double sum) {
+  return sum ? max + std::log(sum) : kLOG0;
+}
+
+inline bool HasNegativeEdge(const Hypergraph& hg) {
+  for (int i = 0; i < hg.edges_.size(); ++i)
+    if (hg.edges_[i].edge_prob_.s_) return true;
+  return false;
+}
+
+// dense accumulator for feature expectations. Values are accumulated as
+// plain doubles relative to the partition function, i.e. each edge adds its
+// features scaled by its posterior. It is kept (per thread) from one forest
+// to the next, so only the features that were touched need to be cleared.
+struct DenseExpectations {
+  void Add(int fid, double v) {
+    if (fid >= seen.size()) {
+      const int n = max(static_cast<int>(FD::NumFeats()), fid + 1);
+      values.resize(n);
+      seen.resize(n);
+    }
+    if (!seen[fid]) { seen[fid] = 1; touched.push_back(fid); }
+    values[fid] += v;
+  }
+  // moves the accumulated values (times z) to out and resets the accumulator
+  void Flush(const prob_t& z, SparseVector<prob_t>* out) {
+    out->clear();
+    for (int i = 0; i < touched.size(); ++i) {
+      const int fid = touched[i];
+      out->set_value(fid, prob_t(values[fid]) * z);
+      values[fid] = 0;
+      seen[fid] = 0;
+    }
+    touched.clear();
+  }
+  vector<double> values;
+  vector<char> seen;
+  vector<int> touched;
+};
+
+boost::thread_specific_ptr<DenseExpectations> dense_expectations;
+boost::thread_specific_ptr<DenseExpectations> dense_products;  // t in SecondOrderExpectations
+
+// the r values of SecondOrderExpectations
+struct EdgeValues {
+  explicit EdgeValues(const vector<double>& v) : v_(&v) {}
+  prob_t operator()(const Hypergraph::Edge& e) const { return prob_t((*v_)[e.id_]); }
+  const vector<double>* v_;
+};
+
+// Linear-chain forests (LexicalTrans, LexicalAlign, Tagger) are a spine of
+// binary edges over one node per position, each with an arity-0 edge per
+// lexical choice.  Their log weights and tails are copied once, in node
+// order, into flat arrays, and inside, outside and the edge posteriors are
+// then loops over contiguous doubles: a node's sum is a max pass and an exp
+// pass over its in-edges instead of a LogAdd per edge.  Kept per thread
+// like the accumulator so the arrays are reused from one forest to the next.
+struct LinearChain {
+  // false if the forest has an edge with more than two tails or a negative
+  // weight; the general code handles those
+  bool Init(const Hypergraph& hg) {
+    const int num_nodes = hg.nodes_.size();
+    first.resize(num_nodes + 1);
+    edges.clear();
+    w.clear();
+    tail0.clear();
+    tail1.clear();
+    for (int i = 0; i < num_nodes; ++i) {
+      first[i] = edges.size();
+      const Hypergraph::EdgesVector& in = hg.nodes_[i].in_edges_;
+      for (int j = 0; j < in.size(); ++j) {
+        const Hypergraph::Edge& edge = hg.edges_[in[j]];
+        const int arity = edge.tail_nodes_.size();
+        if (arity > 2 || edge.edge_prob_.s_) return false;
+        edges.push_back(in[j]);
+        w.push_back(edge.edge_prob_.v_);
+        // a missing tail points at node num_nodes, whose inside score is log 1
+        tail0.push_back(arity > 0 ? edge.tail_nodes_[0] : num_nodes);
+        tail1.push_back(arity > 1 ? edge.tail_nodes_[1] : num_nodes);
+      }
+    }
+    first[num_nodes] = edges.size();
+    return true;
+  }
+
+  // log of the inside score of the goal.  Edge k's weight times the inside
+  // scores of its tails is left in scores[k], as its ratio to node_max of
+  // its head, so the posteriors only need an exp per node
+  double Inside() {
+    const int num_nodes = first.size() - 1;
+    ins.resize(num_nodes + 1);
+    ins[num_nodes] = 0;
+    node_max.resize(num_nodes);
+    scores.resize(edges.size());
+    for (int i = 0; i < num_nodes; ++i) {
+      const int b = first[i], e = first[i + 1];
+      node_max[i] = kLOG0;
+      if (b == e) { ins[i] = 0; continue; }
+      double max = kLOG0;
+      for (int k = b; k < e; ++k) {
+        scores[k] = w[k] + ins[tail0[k]] + ins[tail1[k]];
+        if (scores[k] > max) max = scores[k];
+      }
+      if (max == kLOG0) { ins[i] = kLOG0; continue; }
+      double sum = 0;
+      for (int k = b; k < e; ++k) {
+        scores[k] = std::exp(scores[k] - max);
+        sum += scores[k];
+      }
+      node_max[i] = max;
+      ins[i] = max + std::log(sum);
+    }
+    return num_nodes ? ins[num_nodes - 1] : kLOG0;
+  }
+
+  void Outside() {
+    const int num_nodes = first.size() - 1;
+    outs.resize(num_nodes);
+    out_max.assign(num_nodes + 1, kLOG0);
+    out_sum.assign(num_nodes + 1, 0.0);
+    if (num_nodes) { out_max[num_nodes - 1] = 0; out_sum[num_nodes - 1] = 1; }
+    for (int i = num_nodes - 1; i >= 0; --i) {
+      outs[i] = LogSum(out_max[i], out_sum[i]);
+      if (outs[i] == kLOG0) continue;
+      for (int k = first[i]; k < first[i + 1]; ++k) {
+        const int t0 = tail0[k], t1 = tail1[k];
+        if (t0 == num_nodes) continue;  // arity 0
+        const double head_and_edge = outs[i] + w[k];
+        // (as in the general code, a tail's own inside score is left out
+        // of its update, both times if the edge has the same tail twice)
+        LogAdd(head_and_edge + (t1 == t0 ? 0 : ins[t1]), &out_max[t0], &out_sum[t0]);
+        if (t1 != num_nodes)
+          LogAdd(head_and_edge + (t1 == t0 ? 0 : ins[t0]), &out_max[t1], &out_sum[t1]);
+      }
+    }
+  }
+
+  // adds each edge's features times its posterior to acc
+  void AddExpectations(const Hypergraph& hg, double log_z, DenseExpectations* acc) const {
+    const int num_nodes = first.size() - 1;
+    for (int i = 0; i < num_nodes; ++i) {
+      if (outs[i] == kLOG0 || node_max[i] == kLOG0) continue;
+      const double scale = std::exp(node_max[i] + outs[i] - log_z);
+      for (int k = first[i]; k < first[i + 1]; ++k) {
+        const double posterior = scores[k] * scale;
+        const SparseVector<double>& fv = hg.edges_[edges[k]].feature_values_;
+        for (SparseVector<double>::const_iterator it = fv.begin(); it != fv.end(); ++it)
+          acc->Add(it->first, it->second * posterior);
+      }
+    }
+  }
+
+  vector<int> first;  // the in-edges of node i are [first[i], first[i+1])
+  vector<int> edges;  // ids in hg.edges_
+  vector<double> w;   // log edge weights
+  vector<int> tail0, tail1;
+  vector<double> scores, node_max, ins, outs;
+  vector<double> out_max, out_sum;  // LogAdd accumulators for outs
+};
+
+boost::thread_specific_ptr<LinearChain> linear_chains;
+
+}  // namespace
+
+template<>
+prob_t Inside<prob_t, EdgeProb>(const Hypergraph& hg,
+                                vector<prob_t>* result,
+                                const EdgeProb&) {
+  if (HasNegativeEdge(hg))
+    return Inside<prob_t, GenericEdgeProb>(hg, result);
+  const int num_nodes = hg.nodes_.size();
+  vector<double> ins(num_nodes);
+  for (int i = 0; i < num_nodes; ++i) {
+    const Hypergraph::EdgesVector& in = hg.nodes_[i].in_edges_;
+    if (in.empty()) { ins[i] = 0; continue; }
+    double max = kLOG0, sum = 0;
+    for (int j = 0; j < in.size(); ++j) {
+      const Hypergraph::Edge& edge = hg.edges_[in[j]];
+      double s = edge.edge_prob_.v_;
+      for (int k = 0; k < edge.tail_nodes_.size(); ++k)
+        s += ins[edge.tail_nodes_[k]];
+      LogAdd(s, &max, &sum);
+    }
+    ins[i] = LogSum(max, sum);
+  }
+  if (result) {
+    result->resize(num_nodes);
+    for (int i = 0; i < num_nodes; ++i)
+      (*result)[i] = prob_t(ins[i], init_lnx());
+  }
+  return ins.empty() ? prob_t(0) : prob_t(ins.back(), init_lnx());
+}
+
+template<>
+void Outside<prob_t, EdgeProb>(const Hypergraph& hg,
+                               vector<prob_t>& inside_score,
+                               vector<prob_t>* result,
+                               const EdgeProb&,
+                               prob_t scale_outside) {
+  assert(result);
+  const int num_nodes = hg.nodes_.size();
+  assert(inside_score.size() == num_nodes);
+  bool negative = scale_outside.s_ || HasNegativeEdge(hg);
+  for (int i = 0; !negative && i < num_nodes; ++i)
+    negative = inside_score[i].s_;
+  if (negative) {
+    Outside<prob_t, GenericEdgeProb>(hg, inside_score, result, GenericEdgeProb(), scale_outside);
+    return;
+  }
+  // the outside score of node i is complete once all nodes after it (the
+  // heads of its out-edges) have been visited
+  vector<double> max(num_nodes, kLOG0), sum(num_nodes, 0.0);
+  if (num_nodes) { max.back() = scale_outside.v_; sum.back() = 1; }
+  result->resize(num_nodes);
+  for (int i = num_nodes - 1; i >= 0; --i) {
+    const double head_outside = LogSum(max[i], sum[i]);
+    (*result)[i] = prob_t(head_outside, init_lnx());
+    if (head_outside == kLOG0) continue;
+    const Hypergraph::EdgesVector& in = hg.nodes_[i].in_edges_;
+    for (int j = 0; j < in.size(); ++j) {
+      const Hypergraph::Edge& edge = hg.edges_[in[j]];
+      const double head_and_edge = edge.edge_prob_.v_ + head_outside;
+      const int num_tail_nodes = edge.tail_nodes_.size();
+      for (int k = 0; k < num_tail_nodes; ++k) {
+        const int t = edge.tail_nodes_[k];
+        double s = head_and_edge;
+        for (int l = 0; l < num_tail_nodes; ++l)
+          if (edge.tail_nodes_[l] != t) s += inside_score[edge.tail_nodes_[l]].v_;
+        LogAdd(s, &max[t], &sum[t]);
+      }
+    }
+  }
+}
+
+template<>
+prob_t InsideOutside<prob_t, EdgeProb, SparseVector<prob_t>, EdgeFeaturesAndProbWeightFunction>(
+    const Hypergraph& hg,
+    SparseVector<prob_t>* result_x,
+    const EdgeProb& kwf,
+    const EdgeFeaturesAndProbWeightFunction&) {
+  if (hg.IsLinearChain()) {
+    if (!linear_chains.get()) linear_chains.reset(new LinearChain);
+    LinearChain& lc = *linear_chains;
+    if (lc.Init(hg)) {
+      const double log_z = lc.Inside();
+      if (log_z != kLOG0) {
+        lc.Outside();
+        if (!dense_expectations.get()) dense_expectations.reset(new DenseExpectations);
+        lc.AddExpectations(hg, log_z, dense_expectations.get());
+        const prob_t z(log_z, init_lnx());
+        dense_expectations->Flush(z, result_x);
+        return z;
+      }
+    }
+  }
+  InsideOutsides<prob_t> io;
+  io.compute(hg, kwf);
+  const prob_t z = io.root_inside();
+  if (z.is_0()) {
+    *result_x = io.expect(hg, EdgeFeaturesAndProbWeightFunction());
+    return z;
+  }
+  if (!dense_expectations.get()) dense_expectations.reset(new DenseExpectations);
+  DenseExpectations& acc = *dense_expectations;
+  for (int i = 0, num_nodes = hg.nodes_.size(); i < num_nodes; ++i) {
+    const Hypergraph::EdgesVector& in = hg.nodes_[i].in_edges_;
+    for (int j = 0; j < in.size(); ++j) {
+      const Hypergraph::Edge& edge = hg.edges_[in[j]];
+      // outside * edge * inside / z
+      prob_t kbar_e = io.outside[i] * edge.edge_prob_;
+      for (int k = 0; k < edge.tail_nodes_.size(); ++k)
+        kbar_e *= io.inside[edge.tail_nodes_[k]];
+      const double posterior = (kbar_e / z).as_float();
+      for (SparseVector<double>::const_iterator it = edge.feature_values_.begin();
+           it != edge.feature_values_.end(); ++it)
+        acc.Add(it->first, it->second * posterior);
+    }
+  }
+  acc.Flush(z, result_x);
+  return z;
+}
+
+prob_t SecondOrderExpectations(const Hypergraph& hg,
+                               const vector<double>& edge_r,
+                               prob_t* r,
+                               SparseVector<prob_t>* s,
+                               SparseVector<prob_t>* t) {
+  typedef PRPair<prob_t, prob_t> PR;
+  typedef PRWeightFunction<prob_t, GenericEdgeProb, prob_t, EdgeValues> PRWeights;
+  assert(edge_r.size() == hg.edges_.size());
+  const PRWeights kwf((GenericEdgeProb()), EdgeValues(edge_r));
+  vector<PR> inside, outside;
+  const PR goal = Inside<PR, PRWeights>(hg, &inside, kwf);
+  const prob_t z = goal.p;
+  *r = goal.r;
+  s->clear();
+  t->clear();
+  if (z.is_0()) return z;
+  Outside<PR, PRWeights>(hg, inside, &outside, kwf);
+  if (!dense_expectations.get()) dense_expectations.reset(new DenseExpectations);
+  if (!dense_products.get()) dense_products.reset(new DenseExpectations);
+  DenseExpectations& acc_s = *dense_expectations;
+  DenseExpectations& acc_t = *dense_products;
+  for (int i = 0, num_nodes = hg.nodes_.size(); i < num_nodes; ++i) {
+    const Hypergraph::EdgesVector& in = hg.nodes_[i].in_edges_;
+    for (int j = 0; j < in.size(); ++j) {
+      const Hypergraph::Edge& edge = hg.edges_[in[j]];
+      // (p, p r) of the derivations through edge, but for the edge itself
+      PR kbar = outside[i];
+      for (int k = 0; k < edge.tail_nodes_.size(); ++k)
+        kbar *= inside[edge.tail_nodes_[k]];
+      const prob_t pz = edge.edge_prob_ / z;
+      const double ws = (kbar.p * pz).as_float();
+      const double wt = ((kbar.p * prob_t(edge_r[in[j]]) + kbar.r) * pz).as_float();
+      for (SparseVector<double>::const_iterator it = edge.feature_values_.begin();
+           it != edge.feature_values_.end(); ++it) {
+        acc_s.Add(it->first, it->second * ws);
+        acc_t.Add(it->first, it->second * wt);
+      }
+    }
+  }
+  acc_s.Flush(z, s);
+  acc_t.Flush(z, t);
+  return z;
+}
@@ -91,13 +91,27 @@ void Outside(const Hypergraph& hg,
           if (update_tail_node_index != other_tail_node_index)
             inside_contribution *= inside_score[other_tail_node_index];
         }
-        inside_contribution *= head_and_edge_weight;
-        *tail_outside_score += inside_contribution;
+        add_product(tail_outside_score, inside_contribution, head_and_edge_weight);
       }
     }
   }
 }
 
+// prob_t inside/outside with EdgeProb weights (by far the most common case)
+// is specialized in inside_outside.cc to keep the per-node sums in flat
+// log-sum-exp accumulators, which costs one exp per edge instead of the
+// exp and log1p of a LogVal addition.
+template<>
+prob_t Inside<prob_t, EdgeProb>(const Hypergraph& hg,
+                                std::vector<prob_t>* result,
+                                const EdgeProb& weight);
+template<>
+void Outside<prob_t, EdgeProb>(const Hypergraph& hg,
+                               std::vector<prob_t>& inside_score,
+                               std::vector<prob_t>* result,
+                               const EdgeProb& weight,
+                               prob_t scale_outside);
+
 template <class K> // obviously not all semirings have a multiplicative inverse
 struct OutsideNormalize {
   bool enable;
@@ -190,4 +204,31 @@ KType InsideOutside(const Hypergraph& hg,
   return io.root_inside();
 }
 
+// feature expectations (for the CLL gradient etc.) are accumulated in a
+// dense per-thread array indexed by feature id instead of adding up a
+// SparseVector per edge, and linear-chain forests (Hypergraph::IsLinearChain)
+// take a flattened forward-backward path, see inside_outside.cc
+template<>
+prob_t InsideOutside<prob_t, EdgeProb, SparseVector<prob_t>, EdgeFeaturesAndProbWeightFunction>(
+    const Hypergraph& hg,
+    SparseVector<prob_t>* result_x,
+    const EdgeProb& kwf,
+    const EdgeFeaturesAndProbWeightFunction& xwf);
+
+// second-order expectations (Li & Eisner 2009) of a scalar edge value r
+// (e.g. a loss, edge_r is indexed by edge id) and of the edge features s,
+// both summed over the edges of a derivation d.  Returns Z = sum_d p(d) and
+// sets *r = sum_d p(d) r(d), *s = sum_d p(d) s(d) and
+// *t = sum_d p(d) r(d) s(d), so the gradient of the expected r is
+// t/Z - r s/Z^2.  Only the scalar pairs (p, p r) of the first-order
+// expectation semiring go through inside/outside; s and t are accumulated
+// densely from each edge's features and outside-inside weight and only made
+// sparse at the end, rather than running inside over PRPairs with
+// SparseVector payloads.
+prob_t SecondOrderExpectations(const Hypergraph& hg,
+                               const std::vector<double>& edge_r,
+                               prob_t* r,
+                               SparseVector<prob_t>* s,
+                               SparseVector<prob_t>* t);
+
 #endif
@@ -3,11 +3,14 @@
 #include <string>
 #include <iostream>
 
+#include "writer.h"
+
 using namespace std;
 
 static const char *json_hex_chars = "0123456789abcdef";
 
-void JSONParser::WriteEscapedString(const string& in, ostream* out) {
+template <class O>
+static void WriteEscaped(const string& in, O* out) {
   int pos = 0;
   int start_offset = 0;
   unsigned char c = 0;
@@ -23,7 +26,7 @@ void JSONParser::WriteEscapedString(const string& in, ostream* out) {
     case '\\':
     case '/':
       if(pos - start_offset > 0)
-	(*out) << in.substr(start_offset, pos - start_offset);
+	out->write(&in[start_offset], pos - start_offset);
       if(c == '\b') (*out) << "\\b";
       else if(c == '\n') (*out) << "\\n";
       else if(c == '\r') (*out) << "\\r";
@@ -37,14 +40,21 @@ void JSONParser::WriteEscapedString(const string& in, ostream* out) {
       if(c < ' ') {
         cerr << "Warning, bad character (" << static_cast<int>(c) << ") in string\n";
 	if(pos - start_offset > 0)
-	  (*out) << in.substr(start_offset, pos - start_offset);
+	  out->write(&in[start_offset], pos - start_offset);
 	(*out) << "\\u00" << json_hex_chars[c >> 4] << json_hex_chars[c & 0xf];
 	start_offset = ++pos;
       } else pos++;
     }
   }
   if(pos - start_offset > 0)
-    (*out) << in.substr(start_offset, pos - start_offset);
+    out->write(&in[start_offset], pos - start_offset);
   (*out) << '"';
 }
 
+void JSONParser::WriteEscapedString(const string& in, ostream* out) {
+  WriteEscaped(in, out);
+}
+
+void JSONParser::WriteEscapedString(const string& in, BufferedWriter* out) {
+  WriteEscaped(in, out);
+}
@@ -5,6 +5,8 @@
 #include <cassert>
 #include "JSON_parser.h"
 
+class BufferedWriter;
+
 class JSONParser {
  public:
   JSONParser() {
@@ -39,6 +41,7 @@ class JSONParser {
     return true;
   }
   static void WriteEscapedString(const std::string& in, std::ostream* out);
+  static void WriteEscapedString(const std::string& in, BufferedWriter* out);
  protected:
   virtual bool HandleJSONEvent(int type, const JSON_value* value) = 0;
  private:
@@ -1,35 +1,84 @@
 #ifndef _HG_KBEST_H_
 #define _HG_KBEST_H_
 
+#include <new>
 #include <vector>
 #include <utility>
 #include <tr1/unordered_set>
+#include <stdint.h>
 
 #include <boost/shared_ptr.hpp>
+#include <boost/functional/hash.hpp>
 
 #include "wordid.h"
+#include "d_ary_heap.h"
+#include "arena.h"
 #include "hg.h"
 
 namespace KBest {
+  // a DerivationFilter sees the derivations of a node in the order they are
+  // found (best first) and drops those for which it returns true.  it judges
+  // a derivation by its Key, which MakeKey builds from the edge and the keys
+  // of the antecedent derivations (so the yield needn't be built to filter)
+
   // default, don't filter any derivations from the k-best list
   template<typename Dummy>
   struct NoFilter {
-    bool operator()(const Dummy&) {
+    struct Key {};
+    static void MakeKey(const Hypergraph::Edge&, const std::vector<const Key*>&, Key*) {}
+    bool operator()(const Key&) {
       return false;
     }
   };
 
-  // optional, filter unique yield strings
+  // optional, filter unique target (ESentenceTraversal) yield strings.  they
+  // are compared by a 64 bit polynomial hash (and length) that is composed
+  // from the hashes of the antecedents' yields, so the yields are only built
+  // for derivations that are returned.  distinct strings with equal hashes
+  // would be merged, but at 64 bits that is improbable in any k-best list
   struct FilterUnique {
-    std::tr1::unordered_set<std::vector<WordID>, boost::hash<std::vector<WordID> > > unique;
+    struct Key {
+      Key() : hash(0), pow(1), len(0) {}
+      uint64_t hash;  // sum of w_i * kBASE^(len-1-i) over the (mixed) words w_i
+      uint64_t pow;   // kBASE^len
+      unsigned len;
+    };
+
+    static void MakeKey(const Hypergraph::Edge& edge, const std::vector<const Key*>& ants, Key* key) {
+      const std::vector<WordID>& e = edge.rule_->e();
+      for (std::vector<WordID>::const_iterator i = e.begin(); i != e.end(); ++i) {
+        if (*i < 1) {
+          const Key& a = *ants[-*i];
+          key->hash = key->hash * a.pow + a.hash;
+          key->pow *= a.pow;
+          key->len += a.len;
+        } else {
+          key->hash = key->hash * kBASE + Mix(*i);
+          key->pow *= kBASE;
+          ++key->len;
+        }
+      }
+    }
 
-    bool operator()(const std::vector<WordID>& yield) {
-      return !unique.insert(yield).second;
+    bool operator()(const Key& key) {
+      return !unique.insert(std::make_pair(key.hash, key.len)).second;
     }
+
+   private:
+    static const uint64_t kBASE = 0x9E3779B97F4A7C15ULL;
+    // spreads out the (small, dense) word ids; never 0
+    static uint64_t Mix(WordID w) {
+      uint64_t x = static_cast<uint64_t>(w) * 0xBF58476D1CE4E5B9ULL;
+      return (x ^ (x >> 31)) | 1;
+    }
+    std::tr1::unordered_set<std::pair<uint64_t, unsigned>, boost::hash<std::pair<uint64_t, unsigned> > > unique;
   };
 
   // utility class to lazily create the k-best derivations from a forest, uses
-  // the lazy k-best algorithm (Algorithm 3) from Huang and Chiang (IWPT 2005)
+  // the lazy k-best algorithm (Algorithm 3) from Huang and Chiang (IWPT 2005).
+  // only the scores (and filter keys) of candidates are computed as the
+  // search goes; the yield and feature_values of a derivation are filled in
+  // when LazyKthBest returns it (along with those of its subderivations)
   template<typename T,  // yield type (returned by Traversal)
            typename Traversal,
            typename DerivationFilter = NoFilter<T>,
@@ -40,37 +89,35 @@ namespace KBest {
                      const size_t k,
                      const Traversal& tf = Traversal(),
                      const WeightFunction& wf = WeightFunction()) :
-      traverse(tf), w(wf), g(hg), nds(g.nodes_.size()), k_prime(k) {}
+      traverse(tf), w(wf), g(hg), nds(g.nodes_.size()), k_prime(k), pool(1 << 16) {}
 
     ~KBestDerivations() {
-      for (int i = 0; i < freelist.size(); ++i)
-        delete freelist[i];
+      for (int i = 0; i < derivations.size(); ++i)
+        derivations[i]->~Derivation();
     }
 
+    typedef typename DerivationFilter::Key Key;
+
     struct Derivation {
       Derivation(const Hypergraph::Edge& e,
                  const SmallVectorInt& jv,
-                 const WeightType& w,
-                 const SparseVector<double>& f) :
+                 const WeightType& w) :
         edge(&e),
         j(jv),
         score(w),
-        feature_values(f) {}
+        complete(false) {}
 
       // dummy constructor, just for query
       Derivation(const Hypergraph::Edge& e,
-                 const SmallVectorInt& jv) : edge(&e), j(jv) {}
+                 const SmallVectorInt& jv) : edge(&e), j(jv), complete(false) {}
 
-      T yield;
+      T yield;  // set once LazyKthBest has returned this derivation
       const Hypergraph::Edge* const edge;
       const SmallVectorInt j;
       const WeightType score;
-      const SparseVector<double> feature_values;
-    };
-    struct HeapCompare {
-      bool operator()(const Derivation* a, const Derivation* b) const {
-        return a->score < b->score;
-      }
+      SparseVector<double> feature_values;  // set with yield
+      Key key;  // for the filter
+      bool complete;  // yield and feature_values are set
     };
     struct DerivationCompare {
       bool operator()(const Derivation* a, const Derivation* b) const {
@@ -108,7 +155,12 @@ namespace KBest {
         return (a->edge == b->edge) && (a->j == b->j);
       }
     };
-    typedef std::vector<Derivation*> CandidateHeap;
+    // entries carry a copy of the score, so sifting doesn't dereference
+    // them.  This stays a std::push_heap/pop_heap binary heap rather than a
+    // d_ary_heap: derivations with equal scores are listed in the order the
+    // heap happens to pop them, and existing k-best lists depend on it.
+    typedef keyed_ptr<WeightType, Derivation> KeyedDerivation;
+    typedef std::vector<KeyedDerivation> CandidateHeap;
     typedef std::vector<Derivation*> DerivationList;
     typedef std::tr1::unordered_set<
        const Derivation*, DerivationUniquenessHash, DerivationUniquenessEquals> UniqueDerivationSet;
@@ -121,7 +173,17 @@ namespace KBest {
       explicit NodeDerivationState(const DerivationFilter& f = DerivationFilter()) : filter(f) {}
     };
 
+    // the k-th best derivation of node v (counting from 0), or NULL if
+    // there are no more
     Derivation* LazyKthBest(int v, int k) {
+      Derivation* d = KthBest(v, k);
+      if (d) Complete(d);
+      return d;
+    }
+
+  private:
+    // as LazyKthBest, but without the yield and feature_values
+    Derivation* KthBest(int v, int k) {
       NodeDerivationState& s = GetCandidates(v);
       CandidateHeap& cand = s.cand;
       DerivationList& D = s.D;
@@ -135,14 +197,14 @@ namespace KBest {
         add_next = false;
 
         if (cand.size() > 0) {
-          std::pop_heap(cand.begin(), cand.end(), HeapCompare());
-          Derivation* d = cand.back();
+          std::pop_heap(cand.begin(), cand.end());
+          Derivation* d = cand.back().ptr;
           cand.pop_back();
-          std::vector<const T*> ants(d->edge->Arity());
+          std::vector<const Key*> ants(d->edge->Arity());
           for (int j = 0; j < ants.size(); ++j)
-            ants[j] = &LazyKthBest(d->edge->tail_nodes_[j], d->j[j])->yield;
-          traverse(*d->edge, ants, &d->yield);
-          if (!filter(d->yield)) {
+            ants[j] = &KthBest(d->edge->tail_nodes_[j], d->j[j])->key;
+          DerivationFilter::MakeKey(*d->edge, ants, &d->key);
+          if (!filter(d->key)) {
             D.push_back(d);
             add_next = true;
           }
@@ -153,22 +215,37 @@ namespace KBest {
       if (k < D.size()) return D[k]; else return NULL;
     }
 
-  private:
-    // creates a derivation object with all fields set but the yield
-    // the yield is computed in LazyKthBest before the derivation is added to D
+    // sets the yield and feature_values of d (a derivation in some node's D)
+    // and, first, of its subderivations
+    void Complete(Derivation* d) {
+      if (d->complete) return;
+      const Hypergraph::Edge& e = *d->edge;
+      std::vector<const T*> ants(e.Arity());
+      d->feature_values = e.feature_values_;
+      for (int i = 0; i < ants.size(); ++i) {
+        Derivation* ant = KthBest(e.tail_nodes_[i], d->j[i]);
+        Complete(ant);
+        ants[i] = &ant->yield;
+        d->feature_values += ant->feature_values;
+      }
+      traverse(e, ants, &d->yield);
+      d->complete = true;
+    }
+
+    // creates a derivation object with its score (the yield and features
+    // are set by Complete, and the key before the derivation is added to D)
     // returns NULL if j refers to derivation numbers larger than the
     // antecedent structure define
     Derivation* CreateDerivation(const Hypergraph::Edge& e, const SmallVectorInt& j) {
       WeightType score = w(e);
-      SparseVector<double> feats = e.feature_values_;
       for (int i = 0; i < e.Arity(); ++i) {
-        const Derivation* ant = LazyKthBest(e.tail_nodes_[i], j[i]);
+        const Derivation* ant = KthBest(e.tail_nodes_[i], j[i]);
         if (!ant) { return NULL; }
         score *= ant->score;
-        feats += ant->feature_values;
       }
-      freelist.push_back(new Derivation(e, j, score, feats));
-      return freelist.back();
+      Derivation* d = new (pool.Allocate(sizeof(Derivation))) Derivation(e, j, score);
+      derivations.push_back(d);
+      return d;
     }
 
     NodeDerivationState& GetCandidates(int v) {
@@ -176,19 +253,22 @@ namespace KBest {
       if (!s.D.empty() || !s.cand.empty()) return s;
 
       const Hypergraph::Node& node = g.nodes_[v];
+      DerivationList cand;
       for (int i = 0; i < node.in_edges_.size(); ++i) {
         const Hypergraph::Edge& edge = g.edges_[node.in_edges_[i]];
         SmallVectorInt jv(edge.Arity(), 0);
         Derivation* d = CreateDerivation(edge, jv);
         assert(d);
-        s.cand.push_back(d);
+        cand.push_back(d);
       }
 
-      const int effective_k = std::min(k_prime, s.cand.size());
-      const typename CandidateHeap::iterator kth = s.cand.begin() + effective_k;
-      std::nth_element(s.cand.begin(), kth, s.cand.end(), DerivationCompare());
-      s.cand.resize(effective_k);
-      std::make_heap(s.cand.begin(), s.cand.end(), HeapCompare());
+      const int effective_k = std::min(k_prime, cand.size());
+      const typename DerivationList::iterator kth = cand.begin() + effective_k;
+      std::nth_element(cand.begin(), kth, cand.end(), DerivationCompare());
+      s.cand.reserve(effective_k);
+      for (int i = 0; i < effective_k; ++i)
+        s.cand.push_back(KeyedDerivation(cand[i]->score, cand[i]));
+      std::make_heap(s.cand.begin(), s.cand.end());
 
       return s;
     }
@@ -197,14 +277,14 @@ namespace KBest {
       for (int i = 0; i < d->j.size(); ++i) {
         SmallVectorInt j = d->j;
         ++j[i];
-        const Derivation* ant = LazyKthBest(d->edge->tail_nodes_[i], j[i]);
+        const Derivation* ant = KthBest(d->edge->tail_nodes_[i], j[i]);
         if (ant) {
           Derivation query_unique(*d->edge, j);
           if (ds->count(&query_unique) == 0) {
             Derivation* new_d = CreateDerivation(*d->edge, j);
             if (new_d) {
-              cand->push_back(new_d);
-              std::push_heap(cand->begin(), cand->end(), HeapCompare());
+              cand->push_back(KeyedDerivation(new_d->score, new_d));
+              std::push_heap(cand->begin(), cand->end());
               bool inserted = ds->insert(new_d).second;  // insert into uniqueness set
               assert(inserted);
             }
@@ -217,8 +297,9 @@ namespace KBest {
     const WeightFunction w;
     const Hypergraph& g;
     std::vector<NodeDerivationState> nds;
-    std::vector<Derivation*> freelist;
     const size_t k_prime;
+    MonotonicArena pool;  // the derivations (destroyed by ~KBestDerivations)
+    std::vector<Derivation*> derivations;
   };
 }
 
@@ -9,18 +9,19 @@ static const int kUNREACHABLE = 99999999;
 
 void Lattice::ComputeDistances() {
   const int n = this->size() + 1;
+  dist_.clear();
   dist_.resize(n, n, kUNREACHABLE);
-  for (int i = 0; i < this->size(); ++i) {
-    const vector<LatticeArc>& alts = (*this)[i];
-    for (int j = 0; j < alts.size(); ++j)
-      dist_(i, i + alts[j].dist2next) = 1;
-  }
-  for (int k = 0; k < n; ++k) {
-    for (int i = 0; i < n; ++i) {
-      for (int j = 0; j < n; ++j) {
-        const int dp = dist_(i,k) + dist_(k,j);
-        if (dist_(i,j) > dp)
-          dist_(i,j) = dp;
+  // arcs only go forward, so positions are in topological order: the
+  // shortest distances from i are final by the time each position k>i is
+  // reached, and relaxing the arcs leaving it in turn costs O(arcs) per i
+  for (int i = 0; i < n; ++i) {
+    for (int k = i; k < this->size(); ++k) {
+      const int dk = (k == i) ? 0 : dist_(i, k);
+      if (dk == kUNREACHABLE) continue;
+      const vector<LatticeArc>& alts = (*this)[k];
+      for (int j = 0; j < alts.size(); ++j) {
+        int& d = dist_(i, k + alts[j].dist2next);
+        if (d > dk + 1) d = dk + 1;
       }
     }
   }
@@ -53,10 +54,15 @@ void LatticeTools::ConvertTextToLattice(const string& text, Lattice* pl) {
 }
 
 void LatticeTools::ConvertTextOrPLF(const string& text_or_plf, Lattice* pl) {
-  if (LooksLikePLF(text_or_plf))
+  if (LooksLikePLF(text_or_plf)) {
     HypergraphIO::PLFtoLattice(text_or_plf, pl);
-  else
+    pl->is_sentence_ = false;
+    pl->ComputeDistances();
+  } else {
+    // the distance between positions of a sentence is just j-i, which is
+    // what Distance returns without a table
     ConvertTextToLattice(text_or_plf, pl);
-  pl->ComputeDistances();
+    pl->dist_.clear();
+  }
 }
 
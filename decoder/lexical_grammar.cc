@@ -0,0 +1,180 @@
+#include "lexical_grammar.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <tr1/unordered_map>
+
+#include "filelib.h"
+#include "int_map.h"
+#include "lru_cache.h"
+#include "tdict.h"
+
+using namespace std;
+using namespace std::tr1;
+
+// rules are kept for this many of the most recently used source words
+static const unsigned kRULE_CACHE = 5000;
+
+namespace {
+
+struct LexEntry {
+  LexEntry(WordID e, const SparseVector<double>& feats) : e_(e), feats_(feats) {}
+  WordID e_;
+  SparseVector<double> feats_;
+};
+
+typedef boost::shared_ptr<vector<TRulePtr> > RulesPtr;
+
+struct LexRuleBin : public RuleBin {
+  int GetNumRules() const { return rules_.size(); }
+  TRulePtr GetIthRule(int i) const { return rules_[i]; }
+  int Arity() const { return 0; }
+  vector<TRulePtr> rules_;
+};
+
+struct LexGrammarNode : public GrammarIter {
+  const RuleBin* GetRules() const { return &rb_; }
+  const GrammarIter* Extend(int) const { return NULL; }
+  LexRuleBin rb_;
+};
+
+struct LexGrammarRoot : public GrammarIter {
+  const RuleBin* GetRules() const { return NULL; }
+  const GrammarIter* Extend(int symbol) const {
+    const unordered_map<WordID, LexGrammarNode>::const_iterator it = nodes_.find(symbol);
+    if (it == nodes_.end()) return NULL;
+    return &it->second;
+  }
+  unordered_map<WordID, LexGrammarNode> nodes_;
+};
+
+inline uint64_t PairKey(WordID f, WordID e) {
+  return (static_cast<uint64_t>(static_cast<uint32_t>(f)) << 32) | static_cast<uint32_t>(e);
+}
+
+}
+
+class LGImpl {
+ public:
+  LGImpl(const string& file, const vector<string>& pair_feature_files) :
+      kX(TD::Convert("X") * -1),
+      kNULL(TD::Convert("<eps>")),
+      rules_(kRULE_CACHE) {
+    // (f, e) -> index in entries_[f], only needed to find the entries the
+    // pair features belong to.  WordIDs are positive, so no key is 0
+    IntMap<uint64_t, unsigned> index(0);
+    int lc = 0, dups = 0;
+    bool flag = false;
+    ReadFile rf(file);
+    istream& in = *rf.stream();
+    string line;
+    while(getline(in, line)) {
+      if (line.empty()) continue;
+      ++lc;
+      TRulePtr r(ParseRule(line, file));
+      LexEntries& es = entries_[r->f_[0]];
+      if (!index.Insert(PairKey(r->f_[0], r->e_[0]), es.size()).second) {
+        ++dups;
+        continue;
+      }
+      es.push_back(LexEntry(r->e_[0], r->scores_));
+      if (lc %   50000 == 0) { cerr << '.'; flag = true; }
+      if (lc % 2000000 == 0) { cerr << " [" << lc << "]\n"; flag = false; }
+    }
+    if (flag) cerr << endl;
+    cerr << "Loaded " << lc << " rules for " << entries_.size() << " source words\n";
+    if (dups) cerr << "  skipped " << dups << " duplicate rules\n";
+
+    for (unsigned i = 0; i < pair_feature_files.size(); ++i) {
+      const string& pfile = pair_feature_files[i];
+      ReadFile pf(pfile);
+      istream& pin = *pf.stream();
+      int pc = 0, used = 0;
+      while(getline(pin, line)) {
+        if (line.empty()) continue;
+        ++pc;
+        TRulePtr r(ParseRule(line, pfile));
+        const unsigned* slot = index.Find(PairKey(r->f_[0], r->e_[0]));
+        if (!slot) continue;  // no rule for this pair
+        ++used;
+        // values are stored as floats in the table, as by WordPairFeatures
+        SparseVector<float> feats;
+        for (SparseVector<double>::const_iterator fit = r->scores_.begin(); fit != r->scores_.end(); ++fit)
+          feats.set_value(fit->first, static_cast<float>(fit->second));
+        entries_[r->f_[0]][*slot].feats_ += feats;
+      }
+      cerr << "Loaded " << pc << " word pair feature entries from " << pfile
+           << " (" << used << " for grammar rules)\n";
+    }
+  }
+
+  void SetSentencePair(const vector<WordID>& src, const set<WordID>* trg) {
+    root_.nodes_.clear();
+    AddSourceWord(kNULL, trg);
+    for (unsigned i = 0; i < src.size(); ++i)
+      AddSourceWord(src[i], trg);
+  }
+
+  const GrammarIter* GetRoot() const { return &root_; }
+
+ private:
+  typedef vector<LexEntry> LexEntries;
+
+  TRule* ParseRule(const string& line, const string& file) const {
+    TRule* r = TRule::CreateRulePhrasetable(line);
+    if (!r || r->f_.size() != 1 || r->e_.size() != 1) {
+      cerr << file << ": lexical rules must translate one word into one word:\n  " << line << endl;
+      abort();
+    }
+    return r;
+  }
+
+  void AddSourceWord(WordID f, const set<WordID>* trg) {
+    if (root_.nodes_.count(f)) return;
+    const RulesPtr rules = Rules(f);
+    if (!rules) return;
+    vector<TRulePtr>& bin = root_.nodes_[f].rb_.rules_;
+    for (unsigned i = 0; i < rules->size(); ++i)
+      if (!trg || trg->count((*rules)[i]->e_[0]))
+        bin.push_back((*rules)[i]);
+  }
+
+  // NULL if f has no translations
+  RulesPtr Rules(WordID f) {
+    const RulesPtr* cached = rules_.Find(f);
+    if (cached) return *cached;
+    const unordered_map<WordID, LexEntries>::const_iterator it = entries_.find(f);
+    if (it == entries_.end()) return RulesPtr();
+    const LexEntries& es = it->second;
+    RulesPtr rules(new vector<TRulePtr>(es.size()));
+    for (unsigned i = 0; i < es.size(); ++i) {
+      TRule* r = TRule::CreateLexicalRule(f, es[i].e_);
+      r->lhs_ = kX;
+      r->scores_ = es[i].feats_;
+      (*rules)[i].reset(r);
+    }
+    rules_.Insert(f, rules);
+    return rules;
+  }
+
+  const WordID kX;
+  const WordID kNULL;
+  unordered_map<WordID, LexEntries> entries_;
+  LRUCache<WordID, RulesPtr> rules_;
+  LexGrammarRoot root_;
+};
+
+LexicalGrammar::LexicalGrammar(const string& file, const vector<string>& pair_feature_files) :
+    pimpl_(new LGImpl(file, pair_feature_files)) {}
+
+void LexicalGrammar::SetSentencePair(const vector<WordID>& src, const set<WordID>* trg) {
+  pimpl_->SetSentencePair(src, trg);
+}
+
+const GrammarIter* LexicalGrammar::GetRoot() const {
+  return pimpl_->GetRoot();
+}
+
+bool LexicalGrammar::HasRuleForSpan(int, int, int distance) const {
+  return distance == 1;
+}
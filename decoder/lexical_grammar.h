@@ -0,0 +1,37 @@
+#ifndef LEXICAL_GRAMMAR_H_
+#define LEXICAL_GRAMMAR_H_
+
+// LexicalGrammar holds a word-to-word translation table (f ||| e ||| feats
+// lines, one source and one target word each, as written by the word
+// aligner's make_lex_grammar.pl) as compact per source word entries, with
+// the features of any word pair feature tables (the same format, as written
+// by generate_word_pair_features.pl) merged into the entries they match.
+// Rules are only created for the sentence pair being decoded: SetSentencePair
+// makes GetRoot() serve the rules for the source words (and <eps>), limited
+// to the given target words if there are any. Rules for recently used source
+// words are cached between sentences.
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include "grammar.h"
+
+class LGImpl;
+struct LexicalGrammar : public Grammar {
+  explicit LexicalGrammar(const std::string& file,
+                          const std::vector<std::string>& pair_feature_files = std::vector<std::string>());
+
+  // trg may be NULL, otherwise rules translating into other words are left out
+  void SetSentencePair(const std::vector<WordID>& src, const std::set<WordID>* trg);
+
+  virtual const GrammarIter* GetRoot() const;
+  virtual bool HasRuleForSpan(int i, int j, int distance) const;
+
+ private:
+  boost::shared_ptr<LGImpl> pimpl_;
+};
+
+#endif
@@ -6,7 +6,7 @@
 #include "filelib.h"
 #include "hg.h"
 #include "tdict.h"
-#include "grammar.h"
+#include "lexical_grammar.h"
 #include "sentence_metadata.h"
 
 using namespace std;
@@ -16,51 +16,28 @@ struct LexicalTransImpl {
       use_null(conf.count("lextrans_use_null") > 0),
       align_only_(conf.count("lextrans_align_only") > 0),
       dyna_search_(conf.count("lextrans_dynasearch") > 0),
-      psg_file_(),
       kXCAT(TD::Convert("X")*-1),
       kNULL(TD::Convert("<eps>")),
       kUNARY(new TRule("[X] ||| [X,1] ||| [1]")),
       kBINARY(new TRule("[X] ||| [X,1] [X,2] ||| [1] [2]")),
       kGOAL_RULE(new TRule("[Goal] ||| [X,1] ||| [1]")) {
     if (conf.count("per_sentence_grammar_file")) {
-      psg_file_ = new ifstream(conf["per_sentence_grammar_file"].as<string>().c_str());
+      cerr << "LexicalTrans builds the grammar for each sentence from --grammar, per_sentence_grammar_file isn't supported\n";
+      abort();
     }
     vector<string> gfiles = conf["grammar"].as<vector<string> >();
     assert(gfiles.size() == 1);
-    ReadFile rf(gfiles.front());
-    TextGrammar *tg = new TextGrammar;
-    grammar.reset(tg);
-    istream* in = rf.stream();
-    int lc = 0;
-    bool flag = false;
-    string line;
-    while(*in) {
-      getline(*in, line);
-      if (!*in) continue;
-      ++lc;
-      TRulePtr r(TRule::CreateRulePhrasetable(line));
-      tg->AddRule(r);
-      if (lc %   50000 == 0) { cerr << '.'; flag = true; }
-      if (lc % 2000000 == 0) { cerr << " [" << lc << "]\n"; flag = false; }
-    }
-    if (flag) cerr << endl;
-    cerr << "Loaded " << lc << " rules\n";
+    vector<string> pair_feature_files;
+    if (conf.count("lextrans_word_pair_features"))
+      pair_feature_files = conf["lextrans_word_pair_features"].as<vector<string> >();
+    grammar.reset(new LexicalGrammar(gfiles.front(), pair_feature_files));
   }
 
-  void LoadSentenceGrammar(const string& s_offset) {
-    const unsigned long long int offset = strtoull(s_offset.c_str(), NULL, 10);
-    psg_file_->seekg(offset, ios::beg);
-    TextGrammar *tg = new TextGrammar;
-    sup_grammar.reset(tg);
-    const string kEND_MARKER = "###EOS###";
-    string line;
-    while(true) {
-      assert(*psg_file_);
-      getline(*psg_file_, line);
-      if (line == kEND_MARKER) break;
-      TRulePtr r(TRule::CreateRulePhrasetable(line));
-      tg->AddRule(r);
-    }
+  static vector<WordID> SourceWords(const Lattice& lattice) {
+    vector<WordID> src(lattice.size());
+    for (int j = 0; j < lattice.size(); ++j)
+      src[j] = lattice[j][0].label;
+    return src;
   }
 
   void CreateEdgeHelper(int label_node, int src, int dest, Hypergraph* forest, map<int,int>* nl2node) {
@@ -99,6 +76,8 @@ struct LexicalTransImpl {
         words[word] = forest->AddNode(kXCAT)->id_;
       }
     }
+    const set<WordID> target_vocab(ref_sent.begin(), ref_sent.end());
+    grammar->SetSentencePair(SourceWords(lattice), &target_vocab);
 
     // create zero-arity rules representing edge contents
     for (int j = 0; j < f_len; ++j) { // for each word in the source
@@ -160,14 +139,6 @@ struct LexicalTransImpl {
       return BuildDynaSearchTrellis(lattice, smeta, forest);
     }
     forest->is_linear_chain_ = true;
-    if (psg_file_) {
-      const string offset = smeta.GetSGMLValue("psg");
-      if (offset.size() < 2 || offset[0] != '@') {
-        cerr << "per_sentence_grammar_file given but sentence id=" << smeta.GetSentenceID() << " doesn't have grammar info!\n";
-        abort();
-      }
-      LoadSentenceGrammar(offset.substr(1));
-    }
     const int e_len = smeta.GetTargetLength();
     assert(e_len > 0);
     const int f_len = lattice.size();
@@ -179,6 +150,7 @@ struct LexicalTransImpl {
     for (int i = 0; i < ref.size(); ++i) {
       target_vocab.insert(ref[i][0].label);
     }
+    grammar->SetSentencePair(SourceWords(lattice), align_only_ ? &target_vocab : NULL);
     bool all_sources_to_all_targets_ = false; // TODO configure this
     set<WordID> trgs_used;
     for (int i = 0; i < e_len; ++i) {  // for each word in the *target*
@@ -188,12 +160,8 @@ struct LexicalTransImpl {
         const WordID src_sym = (j < 0 ? kNULL : lattice[j][0].label);
         const GrammarIter* gi = grammar->GetRoot()->Extend(src_sym);
         if (!gi) {
-          if (psg_file_)
-            gi = sup_grammar->GetRoot()->Extend(src_sym);
-          if (!gi) {
-            cerr << "No translations found for: " << TD::Convert(src_sym) << "\n";
-            return false;
-          }
+          cerr << "No translations found for: " << TD::Convert(src_sym) << "\n";
+          return false;
         }
         const RuleBin* rb = gi->GetRules();
         assert(rb);
@@ -252,14 +220,12 @@ struct LexicalTransImpl {
   const bool use_null;
   const bool align_only_;
   const bool dyna_search_;
-  ifstream* psg_file_;
   const WordID kXCAT;
   const WordID kNULL;
   const TRulePtr kUNARY;
   const TRulePtr kBINARY;
   const TRulePtr kGOAL_RULE;
-  GrammarPtr grammar;
-  GrammarPtr sup_grammar;
+  boost::shared_ptr<LexicalGrammar> grammar;
 };
 
 LexicalTrans::LexicalTrans(const boost::program_options::variables_map& conf) :
@@ -0,0 +1,59 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include <boost/program_options.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+#include "filelib.h"
+#include "sentence_grammar_file.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
+  po::options_description opts("Configuration options");
+  opts.add_options()
+        ("grammar_list,i", po::value<string>()->default_value("-"), "List of grammar files, one per line, either PATH (sentence ids are assigned 0, 1, ...) or ID PATH")
+        ("output,o", po::value<string>(), "[REQD] Write the per sentence grammar file here (and its index to OUTPUT.idx)")
+        ("help,h", "Help");
+  po::options_description dcmdline_options;
+  dcmdline_options.add(opts);
+  po::store(parse_command_line(argc, argv, dcmdline_options), *conf);
+  if (conf->count("help") || !conf->count("output")) {
+    cerr << "Usage: " << argv[0] << " -o grammars.psg < list\n\n"
+         << "Concatenates sentence-specific grammars into a file for cdec's\n"
+         << "--per_sentence_grammar_file option.\n" << dcmdline_options << endl;
+    exit(1);
+  }
+}
+
+int main(int argc, char** argv) {
+  po::variables_map conf;
+  InitCommandLine(argc, argv, &conf);
+  ReadFile rf(conf["grammar_list"].as<string>());
+  istream& in = *rf.stream();
+  SentenceGrammarFileWriter writer(conf["output"].as<string>());
+  string line;
+  int lc = 0;
+  while (getline(in, line)) {
+    if (line.empty()) continue;
+    istringstream is(line);
+    string a, b;
+    is >> a >> b;
+    int id = lc;
+    string path = a;
+    if (!b.empty()) {
+      id = atoi(a.c_str());
+      path = b;
+    }
+    writer.AddGrammarFile(id, path);
+    ++lc;
+  }
+  if (!writer.Close()) {
+    cerr << "Error writing " << conf["output"].as<string>() << endl;
+    return 1;
+  }
+  cerr << "Wrote " << lc << " grammars to " << conf["output"].as<string>() << endl;
+  return 0;
+}
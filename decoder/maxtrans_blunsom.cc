@@ -6,8 +6,8 @@
 #include <tr1/unordered_set>
 
 #include <boost/tuple/tuple.hpp>
-#include <boost/functional/hash.hpp>
 
+#include "hash.h"
 #include "tdict.h"
 #include "hg.h"
 #include "ff.h"
@@ -140,7 +140,7 @@ struct CandidateUniquenessEquals {
 };
 
 typedef unordered_set<const Candidate*, CandidateUniquenessHash, CandidateUniquenessEquals> UniqueCandidateSet;
-typedef unordered_map<vector<WordID>, Candidate*, boost::hash<vector<WordID> > > State2Node;
+typedef unordered_map<vector<WordID>, Candidate*, murmur_hash_array<vector<WordID> > > State2Node;
 
 class MaxTransBeamSearch {
 
@@ -211,7 +211,7 @@ public:
     assert(D_v.empty());
     const Hypergraph::Node& v = in.nodes_[vert_index];
     // cerr << "  has " << v.in_edges_.size() << " in-coming edges\n";
-    const vector<int>& in_edges = v.in_edges_;
+    const Hypergraph::EdgesVector& in_edges = v.in_edges_;
     CandidateHeap cand;
     CandidateList freelist;
     cand.reserve(in_edges.size());
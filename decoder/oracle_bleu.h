@@ -20,6 +20,7 @@
 #include "kbest.h"
 #include "timing_stats.h"
 #include "sentences.h"
+#include "writer.h"
 
 //TODO: put function impls into .cc
 //TODO: move Translation into its own .h and use in cdec
@@ -259,25 +260,36 @@ struct OracleBleu {
     K kbest(forest,k);
     //add length (f side) src length of this sentence to the psuedo-doc src length count
     float curr_src_length = doc_src_length + tmp_src_length;
+    // the list is written in blocks; each line used to be flushed on its own
+    BufferedWriter kout(&kbest_out);
     for (int i = 0; i < k; ++i) {
       typename K::Derivation *d = kbest.LazyKthBest(forest.nodes_.size() - 1, i);
       if (!d) break;
-      kbest_out << sent_id << " ||| " << TD::GetString(d->yield) << " ||| "
-                << d->feature_values << " ||| " << log(d->score);
+      kout << sent_id << " ||| ";
+      for (int j = 0; j < d->yield.size(); ++j) {
+        if (j) kout << ' ';
+        kout << TD::Convert(d->yield[j]);
+      }
+      kout << " ||| ";
+      print(kout, d->feature_values);
+      kout << " ||| " << log(d->score);
       if (!refs.empty()) {
         ScoreP sentscore = GetScore(d->yield,sent_id);
         sentscore->PlusEquals(*doc_score,float(1));
         float bleu = curr_src_length * sentscore->ComputeScore();
-        kbest_out << " ||| " << bleu;
+        kout << " ||| " << bleu;
       }
-      kbest_out<<endl<<flush;
+      kout << '\n';
       if (show_derivation) {
+        kout.flush();
         deriv_out<<"\nsent_id="<<sent_id<<"."<<i<<" ||| "; //where i is candidate #/k
         deriv_out<<log(d->score)<<"\n";
         deriv_out<<kbest.derivation_tree(*d,true);
         deriv_out<<"\n"<<flush;
       }
     }
+    kout.flush();
+    kbest_out<<flush;
   }
 
 // TODO decoder output should probably be moved to another file - how about oracle_bleu.h
@@ -285,6 +297,11 @@ struct OracleBleu {
 
     WriteFile ko(kbest_out_filename_);
     std::cerr << "Output kbest to " << kbest_out_filename_ <<std::endl;
+    DumpKBest(sent_id, forest, k, unique, ko.get(), deriv_out_filename_);
+  }
+
+  // writes the k-best list to an already open stream (e.g., a per-sentence buffer)
+  void DumpKBest(const int sent_id, const Hypergraph& forest, const int k, const bool unique, std::ostream &kbest_out, std::string const &deriv_out_filename_) {
     std::ostringstream sderiv;
     sderiv << deriv_out_filename_;
     if (show_derivation) {
@@ -294,9 +311,9 @@ struct OracleBleu {
     WriteFile oderiv(sderiv.str());
 
     if (!unique)
-      kbest<KBest::NoFilter<std::vector<WordID> > >(sent_id,forest,k,ko.get(),oderiv.get());
+      kbest<KBest::NoFilter<std::vector<WordID> > >(sent_id,forest,k,kbest_out,oderiv.get());
     else {
-      kbest<KBest::FilterUnique>(sent_id,forest,k,ko.get(),oderiv.get());
+      kbest<KBest::FilterUnique>(sent_id,forest,k,kbest_out,oderiv.get());
     }
   }
 
@@ -7,6 +7,8 @@
 #include "trule.h"
 #include "bottom_up_parser.h"
 #include "tdict.h"
+#include "grammar.h"
+#include "viterbi.h"
 
 using namespace std;
 
@@ -29,6 +31,72 @@ TEST_F(ChartTest,LanguageModel) {
   parser.Parse(lattice, &forest);
 }
 
+TEST_F(ChartTest,ParallelParseMatchesSerial) {
+  vector<WordID> words;
+  TD::ConvertSentence("das ist ein kleines haus es gibt eine kleine maus das haus ist gelb", &words);
+  Lattice lattice(words.size());
+  for (int i = 0; i < words.size(); ++i)
+    lattice[i].push_back(LatticeArc(words[i], 0.0, 1));
+  vector<GrammarPtr> grammars;
+  grammars.push_back(GrammarPtr(new TextGrammar("./test_data/grammar.prune")));
+  grammars.push_back(GrammarPtr(new GlueGrammar("S", "PHRASE")));
+  grammars.push_back(GrammarPtr(new PassThroughGrammar(lattice, "PHRASE")));
+  Hypergraph serial, parallel;
+  ASSERT_TRUE(ExhaustiveBottomUpParser("S", grammars).Parse(lattice, &serial));
+  ASSERT_TRUE(ExhaustiveBottomUpParser("S", grammars, 4).Parse(lattice, &parallel));
+  ASSERT_EQ(serial.nodes_.size(), parallel.nodes_.size());
+  ASSERT_EQ(serial.edges_.size(), parallel.edges_.size());
+  for (int i = 0; i < serial.nodes_.size(); ++i) {
+    EXPECT_EQ(serial.nodes_[i].cat_, parallel.nodes_[i].cat_);
+    EXPECT_TRUE(serial.nodes_[i].in_edges_ == parallel.nodes_[i].in_edges_);
+  }
+  for (int i = 0; i < serial.edges_.size(); ++i) {
+    const Hypergraph::Edge& a = serial.edges_[i];
+    const Hypergraph::Edge& b = parallel.edges_[i];
+    EXPECT_EQ(a.rule_->AsString(), b.rule_->AsString());  // each chart has its own goal rule
+    EXPECT_EQ(a.head_node_, b.head_node_);
+    EXPECT_TRUE(a.tail_nodes_ == b.tail_nodes_);
+    EXPECT_EQ(a.i_, b.i_);
+    EXPECT_EQ(a.j_, b.j_);
+    EXPECT_TRUE(a.feature_values_ == b.feature_values_);
+  }
+}
+
+TEST_F(ChartTest,CellPruningKeepsViterbi) {
+  vector<WordID> words;
+  TD::ConvertSentence("das ist ein kleines haus es gibt eine kleine maus das haus ist gelb", &words);
+  Lattice lattice(words.size());
+  for (int i = 0; i < words.size(); ++i)
+    lattice[i].push_back(LatticeArc(words[i], 0.0, 1));
+  vector<GrammarPtr> grammars;
+  grammars.push_back(GrammarPtr(new TextGrammar("./test_data/grammar.prune")));
+  grammars.push_back(GrammarPtr(new GlueGrammar("S", "PHRASE")));
+  grammars.push_back(GrammarPtr(new PassThroughGrammar(lattice, "PHRASE")));
+  vector<double> weights;
+  SparseVector<double> w;
+  w.set_value(FD::Convert("Glue"), -1.0);
+  w.set_value(FD::Convert("PassThrough"), -2.0);
+  w.set_value(FD::Convert("PhraseModel_0"), -1.0);
+  w.set_value(FD::Convert("PhraseModel_1"), -0.5);
+  w.set_value(FD::Convert("PhraseModel_3"), -0.5);
+  w.init_vector(&weights);
+  Hypergraph full, pruned, pruned_parallel;
+  ASSERT_TRUE(ExhaustiveBottomUpParser("S", grammars).Parse(lattice, &full));
+  ChartCellPruning pruning;
+  pruning.weights = &weights;
+  pruning.limit = 1;
+  ASSERT_TRUE(ExhaustiveBottomUpParser("S", grammars, 1, pruning).Parse(lattice, &pruned));
+  ASSERT_TRUE(ExhaustiveBottomUpParser("S", grammars, 4, pruning).Parse(lattice, &pruned_parallel));
+  EXPECT_LT(pruned.edges_.size(), full.edges_.size());
+  EXPECT_EQ(pruned.edges_.size(), pruned_parallel.edges_.size());
+  full.Reweight(weights);
+  pruned.Reweight(weights);
+  // every node keeps its best edge, so the best derivation survives
+  vector<WordID> full_trans, pruned_trans;
+  EXPECT_FLOAT_EQ(log(ViterbiESentence(full, &full_trans)), log(ViterbiESentence(pruned, &pruned_trans)));
+  EXPECT_EQ(full_trans, pruned_trans);
+}
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
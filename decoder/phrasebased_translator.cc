@@ -1,17 +1,19 @@
 #include "phrasebased_translator.h"
 
 #include <queue>
+#include <limits>
+#include <algorithm>
 #include <iostream>
 #include <tr1/unordered_map>
 #include <tr1/unordered_set>
 
 #include <boost/tuple/tuple.hpp>
-#include <boost/functional/hash.hpp>
 
 #include "sentence_metadata.h"
 #include "tdict.h"
 #include "hg.h"
 #include "filelib.h"
+#include "hash.h"
 #include "lattice.h"
 #include "phrasetable_fst.h"
 #include "array2d.h"
@@ -20,39 +22,82 @@ using namespace std;
 using namespace std::tr1;
 using namespace boost::tuples;
 
-struct Coverage : public vector<bool> {
-  explicit Coverage(int n, bool v = false) : vector<bool>(n, v), first_gap() {}
+// the source positions a hypothesis has covered, as a bitset.  a span is
+// covered or tested with a mask per word, so Cover and Collides take
+// constant time for spans within a 64-bit word; inputs of up to 128 words
+// do not allocate
+class Coverage {
+ public:
+  explicit Coverage(int n, bool v = false) :
+      size_(n), words_((n + 63) / 64), first_gap_(v ? n : 0) {
+    if (words_ > kINLINE) more_.resize(words_);
+    fill(inline_, inline_ + kINLINE, uint64_t(0));
+    if (v) {
+      uint64_t* w = bits();
+      fill(w, w + words_, ~uint64_t(0));
+      if (n % 64) w[words_ - 1] = Mask(0, n % 64);
+    }
+  }
   void Cover(int i, int j) {
-    vector<bool>::iterator it = this->begin() + i;
-    vector<bool>::iterator end = this->begin() + j;
-    while (it != end)
-      *it++ = true;
-    if (first_gap == i) {
-      first_gap = j;
-      it = end;
-      while (*it && it != this->end()) {
-        ++it;
-        ++first_gap;
-      }
+    const int b = i;
+    uint64_t* w = bits();
+    for (int k = i / 64; i < j; ++k) {
+      const int e = min(j, (k + 1) * 64);
+      w[k] |= Mask(i % 64, e - k * 64);
+      i = e;
     }
+    if (first_gap_ == b) first_gap_ = NextGap(j);
   }
   bool Collides(int i, int j) const {
-    vector<bool>::const_iterator it = this->begin() + i;
-    vector<bool>::const_iterator end = this->begin() + j;
-    while (it != end)
-      if (*it++) return true;
+    const uint64_t* w = bits();
+    for (int k = i / 64; i < j; ++k) {
+      const int e = min(j, (k + 1) * 64);
+      if (w[k] & Mask(i % 64, e - k * 64)) return true;
+      i = e;
+    }
     return false;
   }
-  int GetFirstGap() const { return first_gap; }
+  bool operator[](int i) const { return (bits()[i / 64] >> (i % 64)) & 1; }
+  bool operator==(const Coverage& o) const {
+    return size_ == o.size_ && equal(bits(), bits() + words_, o.bits());
+  }
+  int size() const { return size_; }
+  // number of covered positions
+  int Count() const {
+    int c = 0;
+    for (int k = 0; k < words_; ++k) c += __builtin_popcountll(bits()[k]);
+    return c;
+  }
+  int GetFirstGap() const { return first_gap_; }
+  size_t Hash() const { return hash_pod_array(bits(), bits() + words_); }
  private:
-  int first_gap;
+  static const int kINLINE = 2;
+  // bits [b, e) of a word, 0 <= b < e <= 64
+  static uint64_t Mask(int b, int e) {
+    const uint64_t hi = (e == 64) ? ~uint64_t(0) : ((uint64_t(1) << e) - 1);
+    return hi & ~((uint64_t(1) << b) - 1);
+  }
+  // the first uncovered position at or after i, or size_
+  int NextGap(int i) const {
+    const uint64_t* w = bits();
+    for (int k = i / 64; k < words_; ++k) {
+      uint64_t free = ~w[k];
+      if (k == i / 64) free &= ~((uint64_t(1) << (i % 64)) - 1);
+      if (free) return min(size_, k * 64 + __builtin_ctzll(free));
+    }
+    return size_;
+  }
+  uint64_t* bits() { return words_ > kINLINE ? &more_[0] : inline_; }
+  const uint64_t* bits() const { return words_ > kINLINE ? &more_[0] : inline_; }
+
+  int size_;
+  int words_;
+  int first_gap_;
+  uint64_t inline_[kINLINE];
+  vector<uint64_t> more_;
 };
 struct CoverageHash {
-  size_t operator()(const Coverage& cov) const {
-    return hasher_(static_cast<const vector<bool>&>(cov));
-  }
- private:
-  boost::hash<vector<bool> > hasher_;
+  size_t operator()(const Coverage& cov) const { return cov.Hash(); }
 };
 ostream& operator<<(ostream& os, const Coverage& cov) {
   os << '[';
@@ -68,14 +113,15 @@ struct PhraseBasedTranslatorImpl {
   PhraseBasedTranslatorImpl(const boost::program_options::variables_map& conf) :
       add_pass_through_rules(conf.count("add_pass_through_rules")),
       max_distortion(conf["pb_max_distortion"].as<int>()),
+      beam_size(conf["pb_beam_size"].as<int>()),
       kCONCAT_RULE(new TRule("[X] ||| [X,1] [X,2] ||| [X,1] [X,2]", true)),
       kNT_TYPE(TD::Convert("X") * -1) {
     assert(max_distortion >= 0);
+    assert(beam_size >= 0);
     vector<string> gfiles = conf["grammar"].as<vector<string> >();
     assert(gfiles.size() == 1);
     cerr << "Reading phrasetable from " << gfiles.front() << endl;
-    ReadFile in(gfiles.front());
-    fst.reset(LoadTextPhrasetable(in.stream()));
+    fst.reset(LoadPhrasetable(gfiles));
   }
 
   struct State {
@@ -90,42 +136,124 @@ struct PhraseBasedTranslatorImpl {
   // we keep track of unique coverages that have been extended since it's
   // possible to "extend" the same coverage twice, e.g. translate "a b c"
   // with phrases "a" "b" "a b" and "c".  There are two ways to cover "a b"
-  void EnqueuePossibleContinuations(const Coverage& coverage, queue<State>* q, UniqueCoverageSet* ucs) {
+  void EnqueuePossibleContinuations(const Coverage& coverage, const FSTNode* q_0,
+                                    queue<State>* q, UniqueCoverageSet* ucs) {
     if (ucs->insert(coverage).second) {
       const int gap = coverage.GetFirstGap();
       const int end = min(static_cast<int>(coverage.size()), gap + max_distortion + 1);
       for (int i = gap; i < end; ++i)
-        if (!coverage[i]) q->push(State(coverage, i, i, fst.get()));
+        if (!coverage[i]) q->push(State(coverage, i, i, q_0));
     }
   }
 
-  bool Translate(const std::string& input,
-                 SentenceMetadata* smeta,
-                 const std::vector<double>& weights,
-                 Hypergraph* minus_lm_forest) {
-    Lattice lattice;
-    LatticeTools::ConvertTextOrPLF(input, &lattice);
-    smeta->SetSourceLength(lattice.size());
-    size_t est_nodes = lattice.size() * lattice.size() * (1 << max_distortion);
-    minus_lm_forest->ReserveNodes(est_nodes, est_nodes * 100);
-    if (add_pass_through_rules) {
-      SparseVector<double> feats;
-      feats.set_value(FD::Convert("PassThrough"), 1);
-      for (int i = 0; i < lattice.size(); ++i) {
-        const vector<LatticeArc>& arcs = lattice[i];
-        for (int j = 0; j < arcs.size(); ++j) {
-          fst->AddPassThroughTranslation(arcs[j].label, feats);
-          // TODO handle lattice edge features
+  // a source span [i,j) with a phrase table entry, and the model score of
+  // its best translation
+  struct Option {
+    Option(int _j, const FSTNode* q, double s) : j(_j), fst(q), score(s) {}
+    int j;
+    const FSTNode* fst;
+    double score;
+  };
+  typedef vector<vector<Option> > OptionsByStart;
+
+  // walks the phrase table along the lattice from each position
+  void CollectOptions(const Lattice& lattice, const FSTNode* q_0, const vector<double>& weights,
+                      OptionsByStart* opts) const {
+    const int n = lattice.size();
+    opts->resize(n);
+    for (int i = 0; i < n; ++i) {
+      vector<pair<int, const FSTNode*> > agenda(1, make_pair(i, q_0));
+      while (!agenda.empty()) {
+        const int j = agenda.back().first;
+        const FSTNode* q = agenda.back().second;
+        agenda.pop_back();
+        if (j > i && q->HasData()) {
+          const vector<TRulePtr>& phrases = q->GetTranslations()->GetRules();
+          double best = -numeric_limits<double>::infinity();
+          for (int k = 0; k < phrases.size(); ++k)
+            best = max(best, phrases[k]->scores_.dot(weights));
+          (*opts)[i].push_back(Option(j, q, best));
+        }
+        if (j == n) continue;
+        const vector<LatticeArc>& arcs = lattice[j];
+        for (int l = 0; l < arcs.size(); ++l) {
+          const FSTNode* next = q->Extend(arcs[l].label);
+          if (next) agenda.push_back(make_pair(j + arcs[l].dist2next, next));
         }
       }
     }
-    CoverageNodeMap c;
+  }
+
+  // future[i][j] is the best score of any monotone segmentation of [i,j)
+  // into options, -inf where there is none
+  static void ComputeFutureCosts(const OptionsByStart& opts, Array2D<double>* future) {
+    const int n = opts.size();
+    const double kNONE = -numeric_limits<double>::infinity();
+    future->resize(n + 1, n + 1, kNONE);
+    for (int i = 0; i <= n; ++i) (*future)(i, i) = 0;
+    for (int i = 0; i < n; ++i)
+      for (int k = 0; k < opts[i].size(); ++k) {
+        double& f = (*future)(i, opts[i][k].j);
+        f = max(f, opts[i][k].score);
+      }
+    for (int len = 2; len <= n; ++len)
+      for (int i = 0; i + len <= n; ++i) {
+        const int j = i + len;
+        double& f = (*future)(i, j);
+        for (int k = i + 1; k < j; ++k)
+          f = max(f, (*future)(i, k) + (*future)(k, j));
+      }
+  }
+
+  // sum of the future costs of the uncovered runs of cov
+  static double FutureCost(const Coverage& cov, const Array2D<double>& future) {
+    double fc = 0;
+    const int n = cov.size();
+    for (int i = cov.GetFirstGap(); i < n; ) {
+      int j = i + 1;
+      while (j < n && !cov[j]) ++j;
+      fc += future(i, j);
+      while (j < n && cov[j]) ++j;
+      i = j;
+    }
+    return fc;
+  }
+
+  // adds the phrase node for translating [i,j) with the rules at q after
+  // the coverage at node tail_node_plus1 - 1 (0 for the empty coverage),
+  // and connects it to the node of new_cov
+  void AddPhrase(int i, int j, const FSTNode* q, int tail_node_plus1, const Coverage& new_cov,
+                 CoverageNodeMap* c, Hypergraph* minus_lm_forest) const {
+    const vector<TRulePtr>& phrases = q->GetTranslations()->GetRules();
+    const int phrase_head_index = minus_lm_forest->AddNode(kNT_TYPE)->id_;
+    for (int k = 0; k < phrases.size(); ++k) {
+      Hypergraph::Edge* edge = minus_lm_forest->AddEdge(phrases[k], Hypergraph::TailNodeVector());
+      edge->feature_values_ = edge->rule_->scores_;
+      edge->i_ = i;
+      edge->j_ = j;
+      minus_lm_forest->ConnectEdgeToHeadNode(edge->id_, phrase_head_index);
+    }
+    if (tail_node_plus1 == 0) {  // left edge
+      (*c)[new_cov] = phrase_head_index + 1;
+    } else { // not left edge
+      int& head_node_plus1 = (*c)[new_cov];
+      if (!head_node_plus1)
+        head_node_plus1 = minus_lm_forest->AddNode(kNT_TYPE)->id_ + 1;
+      Hypergraph::TailNodeVector tail(2, tail_node_plus1 - 1);
+      tail[1] = phrase_head_index;
+      const int concat_edge = minus_lm_forest->AddEdge(kCONCAT_RULE, tail)->id_;
+      minus_lm_forest->ConnectEdgeToHeadNode(concat_edge, head_node_plus1 - 1);
+    }
+  }
+
+  // all coverages reachable within the distortion limit, breadth first
+  void ExhaustiveSearch(const Lattice& lattice, const FSTNode* q_0,
+                        CoverageNodeMap* c, Hypergraph* minus_lm_forest) {
     queue<State> q;
     UniqueCoverageSet ucs;
     const Coverage empty_cov(lattice.size(), false);
-    const Coverage goal_cov(lattice.size(), true);
-    EnqueuePossibleContinuations(empty_cov, &q, &ucs);
-    c[empty_cov] = 0;   // have to handle the left edge specially
+    EnqueuePossibleContinuations(empty_cov, q_0, &q, &ucs);
+    (*c)[empty_cov] = 0;   // have to handle the left edge specially
     while(!q.empty()) {
       const State s = q.front();
       q.pop();
@@ -134,30 +262,10 @@ struct PhraseBasedTranslatorImpl {
       if (s.fst->HasData()) {
         Coverage new_cov = s.coverage;
         new_cov.Cover(s.i, s.j);
-        EnqueuePossibleContinuations(new_cov, &q, &ucs);
-        const vector<TRulePtr>& phrases = s.fst->GetTranslations()->GetRules();
-        const int phrase_head_index = minus_lm_forest->AddNode(kNT_TYPE)->id_;
-        for (int i = 0; i < phrases.size(); ++i) {
-          Hypergraph::Edge* edge = minus_lm_forest->AddEdge(phrases[i], Hypergraph::TailNodeVector());
-          edge->feature_values_ = edge->rule_->scores_;
-          edge->i_ = s.i;
-          edge->j_ = s.j;
-          minus_lm_forest->ConnectEdgeToHeadNode(edge->id_, phrase_head_index);
-        }
-        CoverageNodeMap::iterator cit = c.find(s.coverage);
-        assert(cit != c.end());
-        const int tail_node_plus1 = cit->second;
-        if (tail_node_plus1 == 0) {  // left edge
-          c[new_cov] = phrase_head_index + 1;
-        } else { // not left edge
-          int& head_node_plus1 = c[new_cov];
-          if (!head_node_plus1)
-            head_node_plus1 = minus_lm_forest->AddNode(kNT_TYPE)->id_ + 1;
-          Hypergraph::TailNodeVector tail(2, tail_node_plus1 - 1);
-          tail[1] = phrase_head_index;
-          const int concat_edge = minus_lm_forest->AddEdge(kCONCAT_RULE, tail)->id_;
-          minus_lm_forest->ConnectEdgeToHeadNode(concat_edge, head_node_plus1 - 1);
-        }
+        EnqueuePossibleContinuations(new_cov, q_0, &q, &ucs);
+        CoverageNodeMap::iterator cit = c->find(s.coverage);
+        assert(cit != c->end());
+        AddPhrase(s.i, s.j, s.fst, cit->second, new_cov, c, minus_lm_forest);
       }
       if (s.j == lattice.size()) continue;
       for (int l = 0; l < arcs.size(); ++l) {
@@ -171,8 +279,97 @@ struct PhraseBasedTranslatorImpl {
         }
       }
     }
-    if (add_pass_through_rules)
-      fst->ClearPassThroughTranslations();
+  }
+
+  // stack decoding: coverages are grouped by the number of covered
+  // positions, and only the beam_size best of each stack, by inside score
+  // plus future cost, are extended.  coverages that fall off the beam keep
+  // their nodes, which are removed once the goal is known
+  void BeamSearch(const Lattice& lattice, const FSTNode* q_0, const vector<double>& weights,
+                  CoverageNodeMap* c, Hypergraph* minus_lm_forest) {
+    typedef unordered_map<Coverage, double, CoverageHash> Stack;
+    const int n = lattice.size();
+    OptionsByStart opts;
+    CollectOptions(lattice, q_0, weights, &opts);
+    Array2D<double> future;
+    ComputeFutureCosts(opts, &future);
+    vector<Stack> stacks(n + 1);
+    const Coverage empty_cov(n, false);
+    stacks[0][empty_cov] = 0;
+    (*c)[empty_cov] = 0;   // have to handle the left edge specially
+    vector<pair<double, const Coverage*> > ranked;
+    for (int k = 0; k < n; ++k) {
+      ranked.clear();
+      for (Stack::const_iterator it = stacks[k].begin(); it != stacks[k].end(); ++it) {
+        const double fc = FutureCost(it->first, future);
+        if (fc > -numeric_limits<double>::infinity())
+          ranked.push_back(make_pair(it->second + fc, &it->first));
+      }
+      if (ranked.size() > beam_size) {
+        nth_element(ranked.begin(), ranked.begin() + beam_size, ranked.end(),
+                    greater<pair<double, const Coverage*> >());
+        ranked.resize(beam_size);
+      }
+      for (int r = 0; r < ranked.size(); ++r) {
+        const Coverage& cov = *ranked[r].second;
+        const double inside = stacks[k][cov];
+        const int tail_node_plus1 = (*c)[cov];
+        const int gap = cov.GetFirstGap();
+        const int end = min(n, gap + max_distortion + 1);
+        for (int i = gap; i < end; ++i) {
+          if (cov[i]) continue;
+          for (int o = 0; o < opts[i].size(); ++o) {
+            const Option& opt = opts[i][o];
+            if (cov.Collides(i, opt.j)) continue;
+            Coverage new_cov = cov;
+            new_cov.Cover(i, opt.j);
+            AddPhrase(i, opt.j, opt.fst, tail_node_plus1, new_cov, c, minus_lm_forest);
+            const double score = inside + opt.score;
+            Stack& next = stacks[new_cov.Count()];
+            Stack::iterator it = next.find(new_cov);
+            if (it == next.end())
+              next.insert(make_pair(new_cov, score));
+            else if (score > it->second)
+              it->second = score;
+          }
+        }
+      }
+      Stack().swap(stacks[k]);
+    }
+  }
+
+  bool Translate(const std::string& input,
+                 SentenceMetadata* smeta,
+                 const std::vector<double>& weights,
+                 Hypergraph* minus_lm_forest) {
+    Lattice lattice;
+    LatticeTools::ConvertTextOrPLF(input, &lattice);
+    smeta->SetSourceLength(lattice.size());
+    // the exhaustive search can build up to n^2 2^max_distortion nodes; a
+    // beam bounds the coverages extended per stack
+    const size_t n = lattice.size();
+    size_t est_nodes = beam_size ? n * beam_size * (max_distortion + 1)
+                                 : n * n * (size_t(1) << min(max_distortion, 16));
+    est_nodes = min(est_nodes, size_t(100000));
+    minus_lm_forest->ReserveNodes(est_nodes, est_nodes * 100);
+    PassThroughFST q_0(fst.get());
+    if (add_pass_through_rules) {
+      SparseVector<double> feats;
+      feats.set_value(FD::Convert("PassThrough"), 1);
+      for (int i = 0; i < lattice.size(); ++i) {
+        const vector<LatticeArc>& arcs = lattice[i];
+        for (int j = 0; j < arcs.size(); ++j) {
+          q_0.AddPassThroughTranslation(arcs[j].label, feats);
+          // TODO handle lattice edge features
+        }
+      }
+    }
+    CoverageNodeMap c;
+    const Coverage goal_cov(lattice.size(), true);
+    if (beam_size)
+      BeamSearch(lattice, &q_0, weights, &c, minus_lm_forest);
+    else
+      ExhaustiveSearch(lattice, &q_0, &c, minus_lm_forest);
     int pregoal_plus1 = c[goal_cov];
     if (pregoal_plus1 > 0) {
       TRulePtr kGOAL_RULE(new TRule("[Goal] ||| [X,1] ||| [X,1]"));
@@ -190,9 +387,10 @@ struct PhraseBasedTranslatorImpl {
 
   const bool add_pass_through_rules;
   const int max_distortion;
+  const int beam_size;
   const TRulePtr kCONCAT_RULE;
   const WordID kNT_TYPE;
-  boost::shared_ptr<FSTNode> fst;
+  boost::shared_ptr<const FSTNode> fst;
 };
 
 PhraseBasedTranslator::PhraseBasedTranslator(const boost::program_options::variables_map& conf) :
@@ -6,6 +6,7 @@
 
 #include <boost/shared_ptr.hpp>
 
+#include "binary_grammar.h"
 #include "filelib.h"
 #include "tdict.h"
 
@@ -42,10 +43,7 @@ class TextFSTNode : public FSTNode {
 
   void AddPhrase(const string& phrase);
 
-  void AddPassThroughTranslation(const WordID& w, const SparseVector<double>& feats);
-  void ClearPassThroughTranslations();
  private:
-  vector<WordID> passthroughs;
   shared_ptr<TargetPhraseSet> data;
   map<WordID, TextFSTNode> ptr;
 };
@@ -77,29 +75,50 @@ void TextFSTNode::AddPhrase(const string& phrase) {
   static_cast<TextTargetPhraseSet*>(fsa->data.get())->AddRule(rule);
 }
 
-void TextFSTNode::AddPassThroughTranslation(const WordID& w, const SparseVector<double>& feats) {
-  TextFSTNode* next = &ptr[w];
-  // current, rules are only added if the symbol is completely missing as a
-  // word starting the phrase.  As a result, it is possible that some sentences
-  // won't parse.  If this becomes a problem, fix it here.
-  if (!next->data) {
-    TextTargetPhraseSet* tps = new TextTargetPhraseSet;
-    next->data.reset(tps);
+// the one-word phrase w translated as itself; the rest of the trie below w,
+// if any, is that of the table
+class PassThroughFSTNode : public FSTNode {
+ public:
+  PassThroughFSTNode(const WordID& w, const SparseVector<double>& feats, const FSTNode* next) : next_(next) {
     TRule* rule = new TRule;
     rule->e_.resize(1, w);
     rule->f_.resize(1, w);
     rule->lhs_ = TD::Convert("___PHRASE") * -1;
     rule->scores_ = feats;
     rule->arity_ = 0;
-    tps->AddRule(TRulePtr(rule));
-    passthroughs.push_back(w); 
+    data_.AddRule(TRulePtr(rule));
+  }
+  const TargetPhraseSet* GetTranslations() const { return &data_; }
+  bool HasData() const { return true; }
+  bool HasOutgoingNonEpsilonEdges() const { return next_ && next_->HasOutgoingNonEpsilonEdges(); }
+  const FSTNode* Extend(const WordID& t) const { return next_ ? next_->Extend(t) : NULL; }
+
+ private:
+  TextTargetPhraseSet data_;
+  const FSTNode* const next_;
+};
+
+PassThroughFST::~PassThroughFST() {
+  for (map<WordID, FSTNode*>::iterator it = words_.begin(); it != words_.end(); ++it)
+    delete it->second;
+}
+
+const FSTNode* PassThroughFST::Extend(const WordID& t) const {
+  if (!words_.empty()) {
+    map<WordID, FSTNode*>::const_iterator it = words_.find(t);
+    if (it != words_.end()) return it->second;
   }
+  return q_0_->Extend(t);
 }
 
-void TextFSTNode::ClearPassThroughTranslations() {
-  for (int i = 0; i < passthroughs.size(); ++i)
-    ptr.erase(passthroughs[i]);
-  passthroughs.clear();
+void PassThroughFST::AddPassThroughTranslation(const WordID& w, const SparseVector<double>& feats) {
+  // current, rules are only added if the symbol is completely missing as a
+  // word starting the phrase.  As a result, it is possible that some sentences
+  // won't parse.  If this becomes a problem, fix it here.
+  if (words_.count(w)) return;
+  const FSTNode* next = q_0_->Extend(w);
+  if (next && next->HasData()) return;
+  words_[w] = new PassThroughFSTNode(w, feats, next);
 }
 
 static void AddPhrasetableToFST(istream* in, TextFSTNode* fst) {
@@ -134,8 +153,10 @@ FSTNode* LoadTextPhrasetable(const vector<string>& filenames) {
   return fst;
 }
 
-FSTNode* LoadBinaryPhrasetable(const string& fname_prefix) {
-  (void) fname_prefix;
-  assert(!"not implemented yet");
+FSTNode* LoadPhrasetable(const vector<string>& filenames) {
+  if (filenames.size() == 1 && BinaryGrammar::IsBinaryGrammar(filenames.front())) {
+    cerr << "Mapping binary phrase table from " << filenames.front() << endl;
+    return LoadBinaryPhrasetable(filenames.front());
+  }
+  return LoadTextPhrasetable(filenames);
 }
-
@@ -1,6 +1,7 @@
 #ifndef _PHRASETABLE_FST_H_
 #define _PHRASETABLE_FST_H_
 
+#include <map>
 #include <vector>
 #include <string>
 
@@ -20,15 +21,38 @@ class FSTNode {
   virtual bool HasData() const = 0;
   virtual bool HasOutgoingNonEpsilonEdges() const = 0;
   virtual const FSTNode* Extend(const WordID& t) const = 0;
+};
+
+// the start state of a phrase table plus pass-through translations for the
+// words of one sentence.  the shared table is never modified, so several
+// sentences can be translated with it at once; make one of these per
+// sentence and use it as q_0 in place of the table's start state
+class PassThroughFST : public FSTNode {
+ public:
+  explicit PassThroughFST(const FSTNode* q_0) : q_0_(q_0) {}
+  ~PassThroughFST();
+  const TargetPhraseSet* GetTranslations() const { return q_0_->GetTranslations(); }
+  bool HasData() const { return q_0_->HasData(); }
+  bool HasOutgoingNonEpsilonEdges() const {
+    return !words_.empty() || q_0_->HasOutgoingNonEpsilonEdges();
+  }
+  const FSTNode* Extend(const WordID& t) const;
+
+  // adds a rule translating w as itself, unless the table already has a
+  // translation of the one-word phrase w
+  void AddPassThroughTranslation(const WordID& w, const SparseVector<double>& feats);
 
-  // these should only be called on q_0:
-  virtual void AddPassThroughTranslation(const WordID& w, const SparseVector<double>& feats) = 0;
-  virtual void ClearPassThroughTranslations() = 0;
+ private:
+  const FSTNode* const q_0_;
+  std::map<WordID, FSTNode*> words_;
 };
 
 // attn caller: you own the memory
 FSTNode* LoadTextPhrasetable(const std::vector<std::string>& filenames);
 FSTNode* LoadTextPhrasetable(std::istream* in);
-FSTNode* LoadBinaryPhrasetable(const std::string& fname_prefix);
+// maps a phrase table written by CompileBinaryPhrasetable (binary_grammar.h)
+FSTNode* LoadBinaryPhrasetable(const std::string& fname);
+// a single compiled file is mapped, anything else is read as text
+FSTNode* LoadPhrasetable(const std::vector<std::string>& filenames);
 
 #endif
@@ -5,41 +5,145 @@
 #include "hash.h"
 #include "translator.h"
 #include <algorithm>
+#include <map>
+#include <sstream>
 #include <vector>
 #include <boost/foreach.hpp>
 #include <boost/functional/hash.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/weak_ptr.hpp>
 #include "hg.h"
 #include "grammar.h"
+#include "binary_grammar.h"
+#include "sentence_grammar_file.h"
+#include "grammar_prefetcher.h"
 #include "bottom_up_parser.h"
 #include "sentence_metadata.h"
 #include "tdict.h"
+#include "fdict.h"
 #include "viterbi.h"
 #include "verbose.h"
+#include "ff.h"
 
 #define foreach         BOOST_FOREACH
 #define reverse_foreach BOOST_REVERSE_FOREACH
 
 using namespace std;
-static bool usingSentenceGrammar = false;
 static bool printGrammarsUsed = false;
 
+// grammars loaded from files are read-only once constructed, so several
+// decoders in one process (e.g., cdec --threads) can share a single copy.
+// files written by compile_grammar are memory mapped instead of parsed.
+static GrammarPtr LoadSharedGrammar(const string& fname, int max_span_limit) {
+  typedef map<pair<string, int>, boost::weak_ptr<Grammar> > GrammarCache;
+  static GrammarCache cache;
+  boost::weak_ptr<Grammar>& cached = cache[make_pair(fname, max_span_limit)];
+  GrammarPtr g = cached.lock();
+  if (!g) {
+    if (BinaryGrammar::IsBinaryGrammar(fname)) {
+      if (!SILENT) cerr << "Mapping binary SCFG grammar from " << fname << endl;
+      BinaryGrammar* bg = new BinaryGrammar(fname);
+      bg->SetMaxSpan(max_span_limit);
+      g.reset(bg);
+    } else {
+      if (!SILENT) cerr << "Reading SCFG grammar from " << fname << endl;
+      TextGrammar* tg = new TextGrammar(fname);
+      tg->SetMaxSpan(max_span_limit);
+      g.reset(tg);
+    }
+    g->SetGrammarName(fname);
+    cached = g;
+  } else {
+    if (!SILENT) cerr << "Sharing previously loaded SCFG grammar " << fname << endl;
+  }
+  return g;
+}
+
+// with several -g grammars the parser keeps an active chart per grammar and
+// extends every dotted item in each, so text grammars (which all share the
+// same span limit) are put into one trie instead.  Every rule gets the
+// feature GrammarFile<k>=1, k being the position of its file in the -g list,
+// so the rules of different files can still be told apart and weighted.
+// Binary grammars and coarse-to-fine grammars are kept as they are.
+struct MergeInfo {
+  TextGrammar* merged;
+  int fid;
+};
+
+static void AddToMerged(const TRulePtr& rule, void* extra) {
+  MergeInfo& mi = *static_cast<MergeInfo*>(extra);
+  rule->scores_.set_value(mi.fid, 1.0);
+  mi.merged->AddRule(rule);
+}
+
+static vector<GrammarPtr> LoadMergedGrammars(const vector<string>& fnames, int max_span_limit) {
+  typedef map<pair<string, int>, boost::weak_ptr<Grammar> > GrammarCache;
+  static GrammarCache cache;
+  string key;
+  for (unsigned i = 0; i < fnames.size(); ++i) key += fnames[i] + '\n';
+  boost::weak_ptr<Grammar>& cached = cache[make_pair(key, max_span_limit)];
+  GrammarPtr merged = cached.lock();
+  const bool share = merged.get() != NULL;
+  if (share && !SILENT) cerr << "Sharing previously merged SCFG grammars\n";
+  vector<GrammarPtr> res;
+  int nmerged = 0;
+  MergeInfo mi;
+  for (unsigned i = 0; i < fnames.size(); ++i) {
+    if (BinaryGrammar::IsBinaryGrammar(fnames[i])) {
+      res.push_back(LoadSharedGrammar(fnames[i], max_span_limit));
+      continue;
+    }
+    if (!merged) {
+      TextGrammar* tg = new TextGrammar;
+      tg->SetMaxSpan(max_span_limit);
+      tg->SetGrammarName("MergedGrammar");
+      merged.reset(tg);
+      cached = merged;
+    }
+    if (!nmerged++) res.push_back(merged);
+    if (share) continue;
+    if (!SILENT) cerr << "Reading SCFG grammar from " << fnames[i] << " into the merged grammar" << endl;
+    TextGrammar g(fnames[i]);
+    if (g.GetCTFLevels() > 0) {
+      cerr << "Grammar " << fnames[i] << " has coarse-to-fine levels and can't be merged\n";
+      abort();
+    }
+    ostringstream fname;
+    fname << "GrammarFile" << i;
+    mi.merged = static_cast<TextGrammar*>(merged.get());
+    mi.fid = FD::Convert(fname.str());
+    g.ForEachRule(AddToMerged, &mi);
+  }
+  return res;
+}
+
 struct SCFGTranslatorImpl {
   SCFGTranslatorImpl(const boost::program_options::variables_map& conf) :
       max_span_limit(conf["scfg_max_span_limit"].as<int>()),
+      parser_threads(conf["scfg_parser_threads"].as<int>()),
+      cell_beam(conf["scfg_cell_beam"].as<double>()),
+      cell_limit(conf["scfg_cell_limit"].as<int>()),
       add_pass_through_rules(conf.count("add_pass_through_rules")),
       goal(conf["goal"].as<string>()),
       default_nt(conf["scfg_default_nt"].as<string>()),
-      use_ctf_(conf.count("coarse_to_fine_beam_prune"))
+      use_ctf_(conf.count("coarse_to_fine_beam_prune")),
+      merge_grammars_(conf.count("scfg_merge_grammars") && !use_ctf_),
+      using_sentence_grammar_(false)
   {
+    if (conf.count("per_sentence_grammar_file")) {
+      const string psg = conf["per_sentence_grammar_file"].as<string>();
+      if (!SILENT) cerr << "Per sentence grammars from " << psg << endl;
+      psg_file_.reset(new SentenceGrammarFile(psg));
+    }
+    if (conf.count("grammar_prefetch") && conf["grammar_prefetch"].as<int>() > 0)
+      prefetcher_.reset(new GrammarPrefetcher(conf["grammar_prefetch"].as<int>()));
     if(conf.count("grammar")){
       vector<string> gfiles = conf["grammar"].as<vector<string> >();
-      for (int i = 0; i < gfiles.size(); ++i) {
-        if (!SILENT) cerr << "Reading SCFG grammar from " << gfiles[i] << endl;
-        TextGrammar* g = new TextGrammar(gfiles[i]);
-        g->SetMaxSpan(max_span_limit);
-        g->SetGrammarName(gfiles[i]);
-        grammars.push_back(GrammarPtr(g));
-      }
+      if (merge_grammars_ && gfiles.size() > 1)
+        grammars = LoadMergedGrammars(gfiles, max_span_limit);
+      else
+        for (int i = 0; i < gfiles.size(); ++i)
+          grammars.push_back(LoadSharedGrammar(gfiles[i], max_span_limit));
       if (!SILENT) cerr << endl;
     }
     if (conf.count("scfg_extra_glue_grammar")) {
@@ -80,10 +184,15 @@ struct SCFGTranslatorImpl {
  }
 
   const int max_span_limit;
+  const int parser_threads;
+  const double cell_beam;
+  const int cell_limit;
   const bool add_pass_through_rules;
   const string goal;
   const string default_nt;
   const bool use_ctf_;
+  const bool merge_grammars_;
+  bool using_sentence_grammar_;
   double ctf_alpha_;
   double ctf_wide_alpha_;
   int ctf_num_widenings_;
@@ -92,6 +201,8 @@ struct SCFGTranslatorImpl {
   unsigned int ctf_iterations_;
   vector<GrammarPtr> grammars;
   GrammarPtr sup_grammar_;
+  boost::shared_ptr<SentenceGrammarFile> psg_file_;
+  boost::scoped_ptr<GrammarPrefetcher> prefetcher_;
 
   struct Equals { Equals(const GrammarPtr& v) : v_(v) {}
                   bool operator()(const GrammarPtr& x) const { return x == v_; } const GrammarPtr& v_; };
@@ -111,6 +222,16 @@ struct SCFGTranslatorImpl {
     Lattice& lattice = smeta->src_lattice_;
     LatticeTools::ConvertTextOrPLF(input, &lattice);
     smeta->SetSourceLength(lattice.size());
+    if (psg_file_) {
+      TextGrammar* g = psg_file_->ReadGrammar(smeta->GetSentenceID());
+      if (!g) {
+        cerr << "per_sentence_grammar_file given but sentence id=" << smeta->GetSentenceID() << " doesn't have a grammar!\n";
+        abort();
+      }
+      g->SetMaxSpan(max_span_limit);
+      g->SetGrammarName("PerSentenceGrammar");
+      glist.push_back(GrammarPtr(g));
+    }
     if (add_pass_through_rules){
       if (!SILENT) cerr << "Adding pass through grammar" << endl;
       PassThroughGrammar* g = new PassThroughGrammar(lattice, default_nt, ctf_iterations_);
@@ -122,7 +243,11 @@ struct SCFGTranslatorImpl {
         cerr << "Using grammar::" << glist[gi]->GetGrammarName() << endl;
     }
     if (!SILENT) cerr << "First pass parse... " << endl;
-    ExhaustiveBottomUpParser parser(goal, glist);
+    ChartCellPruning pruning;
+    pruning.weights = &weights;
+    pruning.beam = cell_beam;
+    pruning.limit = cell_limit;
+    ExhaustiveBottomUpParser parser(goal, glist, parser_threads, pruning);
     if (!parser.Parse(lattice, forest)){
       if (!SILENT) cerr << "  parse failed." << endl;
       return false;
@@ -269,6 +394,19 @@ Called once from cdec.cc to setup the initial SCFG translation structure backend
 SCFGTranslator::SCFGTranslator(const boost::program_options::variables_map& conf) :
   pimpl_(new SCFGTranslatorImpl(conf)) {}
 
+static void PrecomputeRuleFeaturesHelper(const TRulePtr& rule, void* extra) {
+  pair<const ModelSet*, int>* p = static_cast<pair<const ModelSet*, int>*>(extra);
+  p->first->PrecomputeRuleFeatures(rule.get());
+  ++p->second;
+}
+
+int SCFGTranslator::PrecomputeRuleFeatures(const ModelSet& models) {
+  pair<const ModelSet*, int> extra(&models, 0);
+  for (int i = 0; i < pimpl_->grammars.size(); ++i)
+    pimpl_->grammars[i]->ForEachRule(&PrecomputeRuleFeaturesHelper, &extra);
+  return extra.second;
+}
+
 /*
 Called for each sentence to perform translation using the SCFG backend
 */
@@ -288,16 +426,24 @@ void SCFGTranslator::ProcessMarkupHintsImpl(const map<string, string>& kv) {
 
 
   if (it == kv.end()) {
-    usingSentenceGrammar= false;
+    pimpl_->using_sentence_grammar_ = false;
     return;
   }
   //Create sentence specific grammar from specified file name and load grammar into list of grammars
-  usingSentenceGrammar = true;
-  TextGrammar* sentGrammar = new TextGrammar(it->second);
+  pimpl_->using_sentence_grammar_ = true;
+  boost::shared_ptr<TextGrammar> sentGrammar;
+  if (pimpl_->prefetcher_)
+    sentGrammar = pimpl_->prefetcher_->Take(it->second);
+  if (!sentGrammar)
+    sentGrammar.reset(new TextGrammar(it->second));
   sentGrammar->SetMaxSpan(pimpl_->max_span_limit);
   sentGrammar->SetGrammarName(it->second);
-  pimpl_->grammars.push_back(GrammarPtr(sentGrammar));
+  pimpl_->grammars.push_back(sentGrammar);
+
+}
 
+void SCFGTranslator::PrefetchSentenceGrammar(const string& fname) {
+  if (pimpl_->prefetcher_) pimpl_->prefetcher_->Request(fname);
 }
 
 void SCFGTranslator::SetSupplementalGrammar(const std::string& grammar) {
@@ -306,7 +452,7 @@ void SCFGTranslator::SetSupplementalGrammar(const std::string& grammar) {
 
 void SCFGTranslator::SentenceCompleteImpl() {
 
-  if(usingSentenceGrammar)      // Drop the last sentence grammar from the list of grammars
+  if(pimpl_->using_sentence_grammar_)      // Drop the last sentence grammar from the list of grammars
     {
       pimpl_->grammars.pop_back();
     }
@@ -0,0 +1,114 @@
+#include "sentence_grammar_file.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <streambuf>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "filelib.h"
+#include "grammar.h"
+
+using namespace std;
+
+// an istream over a block of the mapped file, so rules are parsed without
+// copying the block
+struct MemoryBuf : public streambuf {
+  MemoryBuf(const char* begin, size_t size) {
+    char* b = const_cast<char*>(begin);
+    setg(b, b, b + size);
+  }
+};
+
+SentenceGrammarFile::SentenceGrammarFile(const string& file) :
+    file_(file), data_(MAP_FAILED), size_(0) {
+  const string idx = IndexFileName(file);
+  ReadFile rf(idx);
+  istream& in = *rf.stream();
+  int id;
+  uint64_t offset, length;
+  while (in >> id >> offset >> length)
+    index_[id] = make_pair(offset, length);
+  if (!in.eof()) {
+    cerr << "Format error in " << idx << endl;
+    abort();
+  }
+
+  const int fd = open(file.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    cerr << "Can't open per sentence grammar file " << file << ": " << strerror(errno) << endl;
+    abort();
+  }
+  size_ = st.st_size;
+  if (size_ > 0) data_ = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (size_ > 0 && data_ == MAP_FAILED) {
+    cerr << "Can't map per sentence grammar file " << file << ": " << strerror(errno) << endl;
+    abort();
+  }
+  for (Index::const_iterator it = index_.begin(); it != index_.end(); ++it) {
+    if (it->second.first + it->second.second > size_) {
+      cerr << "Index " << idx << " points past the end of " << file << " for sentence " << it->first << endl;
+      abort();
+    }
+  }
+}
+
+SentenceGrammarFile::~SentenceGrammarFile() {
+  if (data_ != MAP_FAILED) munmap(data_, size_);
+}
+
+TextGrammar* SentenceGrammarFile::ReadGrammar(int sent_id) const {
+  Index::const_iterator it = index_.find(sent_id);
+  if (it == index_.end()) return NULL;
+  if (it->second.second == 0) return new TextGrammar;
+  MemoryBuf buf(static_cast<const char*>(data_) + it->second.first, it->second.second);
+  istream in(&buf);
+  return new TextGrammar(&in);
+}
+
+SentenceGrammarFileWriter::SentenceGrammarFileWriter(const string& file) :
+    file_(file), out_(file.c_str(), ios::binary), pos_(0), closed_(false) {
+  if (!out_) {
+    cerr << "Can't write " << file << endl;
+    abort();
+  }
+}
+
+SentenceGrammarFileWriter::~SentenceGrammarFileWriter() {
+  if (!closed_) Close();
+}
+
+void SentenceGrammarFileWriter::AddGrammarFile(int sent_id, const string& grammar) {
+  ReadFile rf(grammar);
+  ostringstream os;
+  os << rf.stream()->rdbuf();
+  AddGrammar(sent_id, os.str());
+}
+
+void SentenceGrammarFileWriter::AddGrammar(int sent_id, const string& rules) {
+  assert(!closed_);
+  string block = rules;
+  if (!block.empty() && block[block.size() - 1] != '\n') block += '\n';
+  out_.write(block.data(), block.size());
+  index_.push_back(Entry(sent_id, pos_, block.size()));
+  pos_ += block.size();
+}
+
+bool SentenceGrammarFileWriter::Close() {
+  closed_ = true;
+  out_.close();
+  ofstream idx(SentenceGrammarFile::IndexFileName(file_).c_str());
+  for (int i = 0; i < index_.size(); ++i)
+    idx << index_[i].id << ' ' << index_[i].offset << ' ' << index_[i].length << '\n';
+  idx.close();
+  return out_ && idx;
+}
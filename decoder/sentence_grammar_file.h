@@ -0,0 +1,70 @@
+#ifndef SENTENCE_GRAMMAR_FILE_H_
+#define SENTENCE_GRAMMAR_FILE_H_
+
+// A per sentence grammar file is the uncompressed concatenation of many
+// sentence-specific text grammars with a sidecar index (FILE.idx) holding one
+// "sentence_id offset length" line per block. The whole file is memory mapped,
+// and the grammar for a sentence is parsed directly from its block, so a
+// tuning run opens two files instead of one per sentence.
+// Use make_psg_file (or SentenceGrammarFileWriter) to build one.
+
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+class TextGrammar;
+
+class SentenceGrammarFile {
+ public:
+  explicit SentenceGrammarFile(const std::string& file);
+  ~SentenceGrammarFile();
+
+  bool HasGrammar(int sent_id) const { return index_.count(sent_id) > 0; }
+
+  // returns a new grammar for sent_id (NULL if there is none)
+  TextGrammar* ReadGrammar(int sent_id) const;
+
+  static std::string IndexFileName(const std::string& file) { return file + ".idx"; }
+
+ private:
+  typedef std::map<int, std::pair<uint64_t, uint64_t> > Index;  // id -> (offset, length)
+  const std::string file_;
+  Index index_;
+  void* data_;
+  size_t size_;
+
+  SentenceGrammarFile(const SentenceGrammarFile&);
+  void operator=(const SentenceGrammarFile&);
+};
+
+// appends grammars to a per sentence grammar file and writes its index
+class SentenceGrammarFileWriter {
+ public:
+  explicit SentenceGrammarFileWriter(const std::string& file);
+  ~SentenceGrammarFileWriter();
+
+  // copies the grammar in file grammar (uncompressing it if needed)
+  void AddGrammarFile(int sent_id, const std::string& grammar);
+  void AddGrammar(int sent_id, const std::string& rules);
+  // writes the index; returns false if anything failed to write.
+  // called by the destructor if needed.
+  bool Close();
+
+ private:
+  struct Entry {
+    Entry(int i, uint64_t o, uint64_t l) : id(i), offset(o), length(l) {}
+    int id;
+    uint64_t offset;
+    uint64_t length;
+  };
+  const std::string file_;
+  std::ofstream out_;
+  uint64_t pos_;
+  std::vector<Entry> index_;
+  bool closed_;
+};
+
+#endif
@@ -14,7 +14,9 @@ struct SentenceMetadata {
     src_len_(-1),
     has_reference_(ref.size() > 0),
     trg_len_(ref.size()),
-    ref_(has_reference_ ? &ref : NULL) {}
+    ref_(has_reference_ ? &ref : NULL),
+    deadline_(0),
+    degraded_(false) {}
 
   int GetSentenceId() const { return sent_id_; }
 
@@ -45,6 +47,14 @@ struct SentenceMetadata {
   const DocScorer& GetDocScorer() const { return *ds; }
   double GetDocLen() const {return doc_len;}
 
+  // --deadline: the wall clock time (see Timer::WallTime()) by which
+  // decoding should be done, 0 if there is none.  Searches that cut their
+  // work short to meet it say so with SetDegraded().
+  void SetDeadline(double t) { deadline_ = t; }
+  double GetDeadline() const { return deadline_; }
+  void SetDegraded() const { degraded_ = true; }
+  bool IsDegraded() const { return degraded_; }
+
   std::string GetSGMLValue(const std::string& key) const {
     std::map<std::string, std::string>::const_iterator it = sgml_.find(key);
     if (it == sgml_.end()) return "";
@@ -67,6 +77,8 @@ struct SentenceMetadata {
   const bool has_reference_;
   int trg_len_;
   const Lattice* const ref_;
+  double deadline_;
+  mutable bool degraded_;
 };
 
 #endif
@@ -6,6 +6,7 @@
 #include "hg.h"
 #include "wordid.h"
 #include "sentence_metadata.h"
+#include "lru_cache.h"
 
 using namespace std;
 
@@ -21,6 +22,14 @@ using namespace std;
 // Things to do if you want to make this a "real" tagger:
 // - support dictionaries (for each word, limit the tags considered)
 // - add latent variables - this is really easy to do
+//
+// The (word, tag) emission rules are built once per word and shared by the
+// sentences it occurs in (the most recently used kEMISSION_CACHE words are
+// kept).  The forest is flagged as a linear chain, so the feature
+// expectations for training are computed by the flattened forward-backward
+// in inside_outside.cc.
+
+static const unsigned kEMISSION_CACHE = 5000;
 
 static void ReadTagset(const string& file, vector<WordID>* tags) {
   ReadFile rf(file);
@@ -39,7 +48,8 @@ struct TaggerImpl {
       kXCAT(TD::Convert("X")*-1),
       kNULL(TD::Convert("<eps>")),
       kBINARY(new TRule("[X] ||| [X,1] [X,2] ||| [1] [2]")),
-      kGOAL_RULE(new TRule("[Goal] ||| [X,1] ||| [1]")) {
+      kGOAL_RULE(new TRule("[Goal] ||| [X,1] ||| [1]")),
+      emissions_(kEMISSION_CACHE) {
     if (conf.count("tagger_tagset") == 0) {
       cerr << "Tagger requires --tagger_tagset FILE!\n";
       exit(1);
@@ -47,14 +57,25 @@ struct TaggerImpl {
     ReadTagset(conf["tagger_tagset"].as<string>(), &tagset_);
   }
 
+  // src -> tagset_[k] for each k
+  const vector<TRulePtr>& EmissionRules(const WordID src) {
+    const vector<TRulePtr>* cached = emissions_.Find(src);
+    if (cached) return *cached;
+    vector<TRulePtr> rules(tagset_.size());
+    for (int k = 0; k < tagset_.size(); ++k)
+      rules[k].reset(TRule::CreateLexicalRule(src, tagset_[k]));
+    emissions_.Insert(src, rules);
+    return *emissions_.Find(src);
+  }
+
   void BuildTrellis(const vector<WordID>& seq, Hypergraph* forest) {
     int prev_node_id = -1;
     for (int i = 0; i < seq.size(); ++i) {
       const WordID& src = seq[i];
       const int new_node_id = forest->AddNode(kXCAT)->id_;
+      const vector<TRulePtr>& rules = EmissionRules(src);
       for (int k = 0; k < tagset_.size(); ++k) {
-        TRulePtr rule(TRule::CreateLexicalRule(src, tagset_[k]));
-        Hypergraph::Edge* edge = forest->AddEdge(rule, Hypergraph::TailNodeVector());
+        Hypergraph::Edge* edge = forest->AddEdge(rules[k], Hypergraph::TailNodeVector());
         edge->i_ = i;
         edge->j_ = i+1;
         edge->prev_i_ = i;    // we set these for FastLinearIntersect
@@ -86,6 +107,7 @@ struct TaggerImpl {
   const WordID kNULL;
   const TRulePtr kBINARY;
   const TRulePtr kGOAL_RULE;
+  LRUCache<WordID, vector<TRulePtr> > emissions_;
 };
 
 Tagger::Tagger(const boost::program_options::variables_map& conf) :
@@ -9,6 +9,7 @@
 
 class Hypergraph;
 class SentenceMetadata;
+class ModelSet;
 
 // Workflow: for each sentence to be translated
 //   1) call ProcessMarkupHints(markup)
@@ -57,6 +58,12 @@ class SCFGTranslator : public Translator {
  public:
   SCFGTranslator(const boost::program_options::variables_map& conf);
   void SetSupplementalGrammar(const std::string& grammar);
+  // caches the rule features of models on the rules of the grammars loaded
+  // so far (see ModelSet::PrecomputeRuleFeatures), returns the number of rules
+  int PrecomputeRuleFeatures(const ModelSet& models);
+  // starts reading the grammar of a later input (its grammar= attribute) in
+  // the background, if --grammar_prefetch is on
+  void PrefetchSentenceGrammar(const std::string& fname);
   virtual std::string GetDecoderType() const;
  protected:
   bool TranslateImpl(const std::string& src,
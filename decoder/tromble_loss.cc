@@ -1,17 +1,16 @@
 #include "tromble_loss.h"
 #include "fast_lexical_cast.hpp"
 
-#include <boost/algorithm/string/predicate.hpp>
 #include <boost/circular_buffer.hpp>
-#include <boost/functional/hash.hpp>
-#include <boost/range/iterator_range.hpp>
 #include <boost/tokenizer.hpp>
-#include <boost/unordered_map.hpp>
 
 #include <cmath>
+#include <cstring>
 #include <fstream>
 #include <vector>
+#include <stdint.h>
 
+#include "int_map.h"
 #include "sentence_metadata.h"
 #include "trule.h"
 #include "tdict.h"
@@ -24,95 +23,93 @@ typedef unsigned char GramCount;
 
 struct RefCounts {
   GramCount max;
-  std::vector<GramCount> refs;
   size_t length;
 };
 
-typedef boost::unordered_map<std::vector<WordID>, size_t, boost::hash<std::vector<WordID> > > NGramMap;
+// the n-grams (up to order n) of the references of one sentence, numbered
+// as a trie of the reversed n-grams: the n-gram that extends the one
+// numbered p (-1 for the empty n-gram) by the word w on its left is
+// numbered Child(p, w).  So the n-grams that end at a word are matched
+// shortest first, each with one lookup that extends the previous match.
+// Building it again for the next sentence reuses the storage.
+class RefNGrams {
+ public:
+  RefNGrams() : ids_(~static_cast<uint64_t>(0)) {}
 
-// Take all the n-grams in the references and stuff them into ngrams.
-void MakeNGramMapFromReferences(const vector<vector<WordID> > &references,
-                                int n,
-                                vector<RefCounts> *counts,
-                                NGramMap *ngrams) {
-  ngrams->clear();
-  std::pair<vector<WordID>, size_t> insert_me;
-  vector<WordID> &ngram = insert_me.first;
-  ngram.reserve(n);
-  size_t &id = insert_me.second;
-  id = 0;
-  for (int refi = 0; refi < references.size(); ++refi) {
-    const vector<WordID>& ref = references[refi];
-    const int s = ref.size();
-    for (int j=0; j<s; ++j) {
-      const int remaining = s-j;
-      const int k = (n < remaining ? n : remaining);
-      ngram.clear();
-      for (unsigned int i = 0; i < k; ++i) {
-        ngram.push_back(ref[j + i]);
-        std::pair<NGramMap::iterator, bool> ret(ngrams->insert(insert_me));
-        if (ret.second) {
-          counts->resize(id + 1);
-          RefCounts &ref_counts = counts->back();
-          ref_counts.max = 1;
-          ref_counts.refs.resize(references.size());
-          ref_counts.refs[refi] = 1;
-          ref_counts.length = ngram.size();
-          ++id;
-        } else {
-          RefCounts &ref_counts = (*counts)[ret.first->second];
-          ref_counts.max = std::max(ref_counts.max, ++ref_counts.refs[refi]);
+  void Build(const vector<vector<WordID> > &references, int n) {
+    ids_.Clear();
+    counts_.clear();
+    per_ref_.clear();
+    num_refs_ = references.size();
+    for (int refi = 0; refi < references.size(); ++refi) {
+      const vector<WordID> &ref = references[refi];
+      for (int j = 0; j < ref.size(); ++j) {
+        int p = -1;
+        for (int len = 1; len <= n && len <= j + 1; ++len) {
+          std::pair<int*, bool> r = ids_.Insert(Key(p, ref[j + 1 - len]), counts_.size());
+          p = *r.first;
+          if (r.second) {
+            RefCounts c;
+            c.max = 0;
+            c.length = len;
+            counts_.push_back(c);
+            per_ref_.resize(per_ref_.size() + num_refs_, 0);
+          }
+          GramCount &in_ref = per_ref_[p * num_refs_ + refi];
+          counts_[p].max = std::max(counts_[p].max, ++in_ref);
         }
       }
     }
   }
-}
 
+  // -1 if the n-gram isn't in a reference
+  int Child(int p, WordID w) const {
+    const int *id = ids_.Find(Key(p, w));
+    return id ? *id : -1;
+  }
+  size_t size() const { return counts_.size(); }
+  const RefCounts &Counts(int id) const { return counts_[id]; }
+  // the number of times n-gram id is in reference refi
+  GramCount InRef(int id, int refi) const { return per_ref_[id * num_refs_ + refi]; }
+
+ private:
+  static uint64_t Key(int p, WordID w) {
+    return (static_cast<uint64_t>(p + 1) << 32) | static_cast<uint32_t>(w);
+  }
+
+  IntMap<uint64_t, int> ids_;
+  std::vector<RefCounts> counts_;
+  std::vector<GramCount> per_ref_;
+  int num_refs_;
+};
+
+// length, then the first and the last n-1 words, then the count of each
+// reference n-gram
 struct MutableState {
-  MutableState(void *from, size_t n) : length(reinterpret_cast<size_t*>(from)), left(reinterpret_cast<WordID *>(length + 1)), right(left + n - 1), counts(reinterpret_cast<GramCount *>(right + n - 1)) {}
-  size_t *length;
+  MutableState(void *from, size_t n) : length(reinterpret_cast<uint32_t*>(from)), left(reinterpret_cast<WordID *>(length + 1)), right(left + n - 1), counts(reinterpret_cast<GramCount *>(right + n - 1)) {}
+  uint32_t *length;
   WordID *left, *right;
   GramCount *counts;
-  static size_t Size(size_t n, size_t bound_ngram_id) { return sizeof(size_t) + (n - 1) * 2 * sizeof(WordID) + bound_ngram_id * sizeof(GramCount); }
+  static size_t Size(size_t n, size_t bound_ngram_id) { return sizeof(uint32_t) + (n - 1) * 2 * sizeof(WordID) + bound_ngram_id * sizeof(GramCount); }
 };
 
 struct ConstState {
-  ConstState(const void *from, size_t n) : length(reinterpret_cast<const size_t*>(from)), left(reinterpret_cast<const WordID *>(length + 1)), right(left + n - 1), counts(reinterpret_cast<const GramCount *>(right + n - 1)) {}
-  const size_t *length;
+  ConstState(const void *from, size_t n) : length(reinterpret_cast<const uint32_t*>(from)), left(reinterpret_cast<const WordID *>(length + 1)), right(left + n - 1), counts(reinterpret_cast<const GramCount *>(right + n - 1)) {}
+  const uint32_t *length;
   const WordID *left, *right;
   const GramCount *counts;
-  static size_t Size(size_t n, size_t bound_ngram_id) { return sizeof(size_t) + (n - 1) * 2 * sizeof(WordID) + bound_ngram_id * sizeof(GramCount); }
-};
-
-template <class T> struct CompatibleHashRange : public std::unary_function<const boost::iterator_range<T> &, size_t> {
-  size_t operator()(const boost::iterator_range<T> &range) const {
-    return boost::hash_range(range.begin(), range.end());
-  }
 };
 
-template <class T> struct CompatibleEqualsRange : public std::binary_function<const boost::iterator_range<T> &, const std::vector<WordID> &, size_t> {
-  size_t operator()(const boost::iterator_range<T> &range, const std::vector<WordID> &vec) const {
-    return boost::algorithm::equals(range, vec);
-  }
-  size_t operator()(const std::vector<WordID> &vec, const boost::iterator_range<T> &range) const {
-    return boost::algorithm::equals(range, vec);
-  }
-};
-
-void AddWord(const boost::circular_buffer<WordID> &segment, size_t min_length, const NGramMap &ref_grams, GramCount *counters) {
-  typedef boost::circular_buffer<WordID>::const_iterator BufferIt;
-  typedef boost::iterator_range<BufferIt> SegmentRange;
+// counts the reference n-grams that end at the last word of segment and
+// are at least min_length words long
+void AddWord(const boost::circular_buffer<WordID> &segment, size_t min_length, const RefNGrams &ref_grams, GramCount *counters) {
   if (segment.size() < min_length) return;
-#if 0
-  CompatibleHashRange<BufferIt> hasher;
-  CompatibleEqualsRange<BufferIt> equals;
-  for (BufferIt seg_start(segment.end() - min_length); ; --seg_start) {
-    NGramMap::const_iterator found = ref_grams.find(SegmentRange(seg_start, segment.end()));
-    if (found == ref_grams.end()) break;
-    ++counters[found->second];
-    if (seg_start == segment.begin()) break;
+  int p = -1;
+  for (size_t len = 1; len <= segment.size(); ++len) {
+    p = ref_grams.Child(p, segment[segment.size() - len]);
+    if (p < 0) break;
+    if (len >= min_length) ++counters[p];
   }
-#endif
 }
 
 } // namespace
@@ -149,6 +146,8 @@ class TrombleLossComputerImpl {
       std::cerr << "Could not open TrombleLossComputer file " << ref_file_name << std::endl;
       exit(1);
     }
+    // the n-grams of each sentence's references are only counted here, for
+    // the size of the state; PrepareForInput indexes them
     std::string ref;
     vector<vector<WordID> > references(num_refs_);
     bound_ngram_id_ = 0;
@@ -161,11 +160,22 @@ class TrombleLossComputerImpl {
         }
         TD::ConvertSentence(ref, &references[refidx]);
       }
-      ref_ids_.resize(sentence + 1);
-      ref_counts_.resize(sentence + 1);
-      MakeNGramMapFromReferences(references, thetas_.size(), &ref_counts_.back(), &ref_ids_.back());
-      bound_ngram_id_ = std::max(bound_ngram_id_, ref_ids_.back().size());
+      if (!ref_file && references[0].empty()) break;
+      refs_.push_back(references);
+      ngrams_.Build(references, thetas_.size());
+      bound_ngram_id_ = std::max(bound_ngram_id_, ngrams_.size());
     }
+    prepared_ = -1;
+  }
+
+  void PrepareForInput(int sentence_id) {
+    if (sentence_id == prepared_) return;
+    if (sentence_id < 0 || sentence_id >= refs_.size()) {
+      std::cerr << "Sentence ID " << sentence_id << " doesn't have references; there are only " << refs_.size() << " references." << std::endl;
+      exit(1);
+    }
+    ngrams_.Build(refs_[sentence_id], thetas_.size());
+    prepared_ = sentence_id;
   }
 
   size_t StateSize() const {
@@ -181,11 +191,11 @@ class TrombleLossComputerImpl {
       void *out_context) const {
     // TODO: get refs from sentence metadata.
     // This will require resizable features.
-    if (smeta.GetSentenceID() >= ref_ids_.size()) {
-      std::cerr << "Sentence ID " << smeta.GetSentenceID() << " doesn't have references; there are only " << ref_ids_.size() << " references." << std::endl;
-      exit(1);
+    if (smeta.GetSentenceID() != prepared_) {
+      std::cerr << "TrombleLossComputer: sentence " << smeta.GetSentenceID() << " wasn't prepared" << std::endl;
+      abort();
     }
-    const NGramMap &ngrams = ref_ids_[smeta.GetSentenceID()];
+    const RefNGrams &ngrams = ngrams_;
     MutableState out_state(out_context, thetas_.size());
     memset(out_state.counts, 0, bound_ngram_id_ * sizeof(GramCount));
     boost::circular_buffer<WordID> history(thetas_.size());
@@ -244,30 +254,29 @@ class TrombleLossComputerImpl {
         *i = star_;
       }
       std::copy(out_state.left, out_state.left + keep, out_state.right);
-    } else if(pushed == keep) {
-      std::copy(history.begin(), history.end(), out_state.right);
-    } else if ((pushed > keep) && !history.empty()) {
-      std::copy(history.begin() + 1, history.end(), out_state.right);
+    } else {
+      // the last keep words: after a long constituent history holds only its
+      // right words, so it isn't always full
+      std::copy(history.end() - keep, history.end(), out_state.right);
     }
-    std::vector<RefCounts>::const_iterator ref_info = ref_counts_[smeta.GetSentenceID()].begin();
     // Clip the counts and count matches.
     // Indexed by reference then by length.
-    std::vector<std::vector<unsigned int> > matches(num_refs_, std::vector<unsigned int>(thetas_.size()));
-    for (GramCount *c = out_state.counts; c != out_state.counts + ngrams.size(); ++c, ++ref_info) {
-      *c = std::min(*c, ref_info->max);
-      if (*c) {
-        for (unsigned int refidx = 0; refidx < num_refs_; ++refidx) {
-          assert(ref_info->length >= 1);
-          assert(ref_info->length - 1 < thetas_.size());
-          matches[refidx][ref_info->length - 1] += std::min(*c, ref_info->refs[refidx]);
-        }
-      }
+    std::vector<unsigned int> matches(num_refs_ * thetas_.size());
+    for (int id = 0; id < ngrams.size(); ++id) {
+      GramCount &c = out_state.counts[id];
+      if (!c) continue;
+      const RefCounts &ref_info = ngrams.Counts(id);
+      c = std::min(c, ref_info.max);
+      assert(ref_info.length >= 1);
+      assert(ref_info.length - 1 < thetas_.size());
+      for (unsigned int refidx = 0; refidx < num_refs_; ++refidx)
+        matches[refidx * thetas_.size() + ref_info.length - 1] += std::min(c, ngrams.InRef(id, refidx));
     }
     double best_score = 0.0;
     for (unsigned int refidx = 0; refidx < num_refs_; ++refidx) {
       double score = 0.0;
-      for (unsigned int j = 0; j < std::min(*out_state.length, thetas_.size()); ++j) {
-        score += thetas_[j] * static_cast<double>(matches[refidx][j]) / static_cast<double>(*out_state.length - j);
+      for (unsigned int j = 0; j < std::min<size_t>(*out_state.length, thetas_.size()); ++j) {
+        score += thetas_[j] * static_cast<double>(matches[refidx * thetas_.size() + j]) / static_cast<double>(*out_state.length - j);
       }
       best_score = std::max(best_score, score);
     }
@@ -277,14 +286,15 @@ class TrombleLossComputerImpl {
  private:
   unsigned int num_refs_;
   // Indexed by sentence id.
-  std::vector<NGramMap> ref_ids_;
-  // Then by id from ref_ids_.
-  std::vector<std::vector<RefCounts> > ref_counts_;
+  std::vector<std::vector<std::vector<WordID> > > refs_;
+  // the n-grams of the references of sentence prepared_
+  RefNGrams ngrams_;
+  int prepared_;
 
   // thetas_[0] is the weight for 1-grams
   std::vector<double> thetas_;
 
-  // All ngram ids in ref_ids_ are < this value.
+  // All ngram ids of every sentence are < this value.
   size_t bound_ngram_id_;
 
   const WordID star_;
@@ -297,6 +307,10 @@ TrombleLossComputer::TrombleLossComputer(const std::string &params) :
 
 TrombleLossComputer::~TrombleLossComputer() {}
 
+void TrombleLossComputer::PrepareForInput(const SentenceMetadata& smeta) {
+  boost::base_from_member<PImpl>::member->PrepareForInput(smeta.GetSentenceID());
+}
+
 void TrombleLossComputer::TraversalFeaturesImpl(const SentenceMetadata& smeta,
                                      const Hypergraph::Edge& edge,
                                      const vector<const void*>& ant_contexts,
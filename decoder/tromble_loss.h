@@ -26,6 +26,9 @@ class TrombleLossComputer : private boost::base_from_member<boost::scoped_ptr<Tr
 
   ~TrombleLossComputer();
 
+  // indexes the n-grams of the sentence's references
+  virtual void PrepareForInput(const SentenceMetadata& smeta);
+
  protected:
   virtual void TraversalFeaturesImpl(const SentenceMetadata& smeta,
                                      const Hypergraph::Edge& edge,
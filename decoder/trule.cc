@@ -1,5 +1,7 @@
 #include "trule.h"
 
+#include <algorithm>
+#include <cctype>
 #include <sstream>
 
 #include "stringlib.h"
@@ -17,7 +19,7 @@ bool TRule::IsGoal() const {
   return GetLHS() == kGOAL;
 }
 
-static WordID ConvertTrgString(const string& w) {
+static WordID ConvertTrgString(const StringPiece& w) {
   int len = w.size();
   WordID id = 0;
   // [X,0] or [0]
@@ -32,7 +34,7 @@ static WordID ConvertTrgString(const string& w) {
   return id;
 }
 
-static WordID ConvertSrcString(const string& w, bool mono = false) {
+static WordID ConvertSrcString(const StringPiece& w, bool mono = false) {
   int len = w.size();
   // [X,0]
   // for source rules, we keep the category and ignore the index (source rules are
@@ -45,24 +47,24 @@ static WordID ConvertSrcString(const string& w, bool mono = false) {
         exit(1);
       }
       // TODO check that source indices go 1,2,3,etc.
-      return TD::Convert(w.substr(1, len-2)) * -1;
+      return TD::Convert(StringPiece(w.data() + 1, len-2)) * -1;
     } else {
       return TD::Convert(w);
     }
   } else {
     if (len > 4 && w[0]=='[' && w[len-1]==']' && w[len-3] == ',' && w[len-2] > '0' && w[len-2] <= '9') {
-      return TD::Convert(w.substr(1, len-4)) * -1;
+      return TD::Convert(StringPiece(w.data() + 1, len-4)) * -1;
     } else {
       return TD::Convert(w);
     }
   }
 }
 
-static WordID ConvertLHS(const string& w) {
+static WordID ConvertLHS(const StringPiece& w) {
   if (w[0] == '[') {
     int len = w.size();
     if (len < 3) { cerr << "Format error: " << w << endl; exit(1); }
-    return TD::Convert(w.substr(1, len-2)) * -1;
+    return TD::Convert(StringPiece(w.data() + 1, len-2)) * -1;
   } else {
     return TD::Convert(w) * -1;
   }
@@ -97,6 +99,40 @@ TRule* TRule::CreateRuleMonolingual(const string& rule) {
 }
 
 namespace {
+// the id of PhraseModel_i, for unnamed features
+int PhraseModelFid(int i) {
+  static int fids[10];
+  if (!fids[i]) {
+    string fname = "PhraseModel_X";
+    fname[12] = '0' + i;
+    fids[i] = FD::Convert(fname);
+  }
+  return fids[i];
+}
+
+// whitespace separated tokens of a line, as istream >> string would read
+// them, but as pieces of the line rather than copies
+class LineTokens {
+ public:
+  explicit LineTokens(const string& line) : p_(line.data()), end_(p_ + line.size()), ok_(true) {}
+  // false once the line is exhausted, and from then on
+  bool Next(StringPiece* w) {
+    while (p_ != end_ && isspace(static_cast<unsigned char>(*p_))) ++p_;
+    if (p_ == end_) return ok_ = false;
+    const char* b = p_;
+    while (p_ != end_ && !isspace(static_cast<unsigned char>(*p_))) ++p_;
+    w->set(b, p_ - b);
+    return true;
+  }
+  // the last Next succeeded, like testing the stream
+  operator bool() const { return ok_; }
+  const char* rest() const { return p_; }
+ private:
+  const char* p_;
+  const char* const end_;
+  bool ok_;
+};
+
 // callback for lexer
 int n_assigned=0;
 void assign_trule(const TRulePtr& new_rule, const unsigned int ctf_level, const TRulePtr& coarse_rule, void* extra) {
@@ -125,28 +161,28 @@ bool TRule::ReadFromString(const string& line, bool strict, bool mono) {
   f_.clear();
   scores_.clear();
 
-  string w;
-  istringstream is(line);
+  StringPiece w;
+  LineTokens is(line);
   int format = CountSubstrings(line, "|||");
   if (strict && format < 2) {
     cerr << "Bad rule format in strict mode:\n" << line << endl;
     return false;
   }
   if (format >= 2 || (mono && format == 1)) {
-    while(is>>w && w!="|||") { lhs_ = ConvertLHS(w); }
-    while(is>>w && w!="|||") { f_.push_back(ConvertSrcString(w, mono)); }
+    while(is.Next(&w) && w!="|||") { lhs_ = ConvertLHS(w); }
+    while(is.Next(&w) && w!="|||") { f_.push_back(ConvertSrcString(w, mono)); }
     if (!mono) {
-      while(is>>w && w!="|||") { e_.push_back(ConvertTrgString(w)); }
+      while(is.Next(&w) && w!="|||") { e_.push_back(ConvertTrgString(w)); }
     }
     int fv = 0;
     if (is) {
-      string ss;
-      getline(is, ss);
-      //cerr << "L: " << ss << endl;
+      // the rest of the line, as getline would read it, up to any alignments
+      const char* const line_end = line.c_str() + line.size();
+      const char* const ss = is.rest();
+      const char* const rest_end = std::find(ss, line_end, '\n');
+      static const char kSEP[] = " |||";
+      const int len = std::search(ss, rest_end, kSEP, kSEP + 4) - ss;
       int start = 0;
-      int len = ss.size();
-      const size_t ppos = ss.find(" |||");
-      if (ppos != string::npos) { len = ppos; }
       while (start < len) {
         while(start < len && (ss[start] == ' ' || ss[start] == ';'))
           ++start;
@@ -155,37 +191,30 @@ bool TRule::ReadFromString(const string& line, bool strict, bool mono) {
         while(end < len && (ss[end] != '=' && ss[end] != ' ' && ss[end] != ';'))
           ++end;
         if (end == len || ss[end] == ' ' || ss[end] == ';') {
-          //cerr << "PROC: '" << ss.substr(start, end - start) << "'\n";
           // non-named features
-          if (end != len) { ss[end] = 0; }
-          string fname = "PhraseModel_X";
           if (fv > 9) { cerr << "Too many phrasetable scores - used named format\n"; abort(); }
-          fname[12]='0' + fv;
-          ++fv;
           // if the feature set is frozen, this may return zero, indicating an
           // undefined feature
-          const int fid = FD::Convert(fname);
+          const int fid = PhraseModelFid(fv);
+          ++fv;
           if (fid)
-            scores_.set_value(fid, atof(&ss[start]));
-          //cerr << "F: " << fname << " VAL=" << scores_.value(FD::Convert(fname)) << endl;
+            scores_.set_value(fid, ParseDouble(ss + start, ss + end));
         } else {
-          const int fid = FD::Convert(ss.substr(start, end - start));
+          const int fid = FD::Convert(StringPiece(ss + start, end - start));
           start = end + 1;
           end = start + 1;
           while(end < len && (ss[end] != ' ' && ss[end] != ';'))
             ++end;
-          if (end < len) { ss[end] = 0; }
-	  assert(start < len);
+          assert(start < len);
           if (fid)
-            scores_.set_value(fid, atof(&ss[start]));
-          //cerr << "F: " << FD::Convert(fid) << " VAL=" << scores_.value(fid) << endl;
+            scores_.set_value(fid, ParseDouble(ss + start, ss + std::max(start, std::min(end, len))));
         }
         start = end + 1;
       }
     }
   } else if (format == 1) {
-    while(is>>w && w!="|||") { lhs_ = ConvertLHS(w); }
-    while(is>>w && w!="|||") { e_.push_back(ConvertTrgString(w)); }
+    while(is.Next(&w) && w!="|||") { lhs_ = ConvertLHS(w); }
+    while(is.Next(&w) && w!="|||") { e_.push_back(ConvertTrgString(w)); }
     f_ = e_;
     int x = ConvertLHS("[X]");
     for (int i = 0; i < f_.size(); ++i)
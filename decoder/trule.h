@@ -26,6 +26,24 @@ inline std::ostream& operator<<(std::ostream& os, const AlignmentPoint& p) {
   return os << static_cast<int>(p.s_) << '-' << static_cast<int>(p.t_);
 }
 
+// feature values the rule_feature() models of a ModelSet produced for a rule,
+// in the order they produced them, so they can be replayed onto edges.
+// A rule holds one cache per ModelSet (rescoring pass) that precomputed its
+// features, chained through next
+struct RuleFeatureCache {
+  int key;  // identifies the rule feature models of a ModelSet, by their configuration
+  std::vector<std::pair<int, double> > values;
+  std::vector<unsigned> ends;  // the i-th rule feature model's values end at values[ends[i]]
+  boost::shared_ptr<const RuleFeatureCache> next;
+
+  // the cache of the ModelSet identified by key in the chain starting at c,
+  // NULL if there is none
+  static const RuleFeatureCache* Find(const RuleFeatureCache* c, int key) {
+    for (; c; c = c->next.get())
+      if (c->key == key) return c;
+    return NULL;
+  }
+};
 
 // Translation rule
 class TRule {
@@ -157,6 +175,10 @@ class TRule {
   // only for coarse-to-fine decoding
   boost::shared_ptr<std::vector<TRulePtr> > fine_rules_;
 
+  // stateless rule features of one ModelSet, computed once when the grammar
+  // is loaded (see ModelSet::PrecomputeRuleFeatures); NULL if not computed
+  boost::shared_ptr<const RuleFeatureCache> rule_ff_;
+
  private:
   TRule(const WordID& src, const WordID& trg) : e_(1, trg), f_(1, src), lhs_(), arity_(), prev_i(), prev_j() {}
   bool SanityCheck() const;
@@ -58,6 +58,20 @@ TEST_F(TRuleTest,TestRuleR) {
   EXPECT_EQ(t6.e_[3], 0);
 }
 
+TEST_F(TRuleTest,TestFeatureValues) {
+  TRule t("[X] ||| a ||| b ||| A=0.25;B=-1.5e-3 C=7 D=-0.1 E=inf ||| 0-0", true);
+  EXPECT_EQ(0.25, t.scores_.value(FD::Convert("A")));
+  EXPECT_EQ(strtod("-1.5e-3", NULL), t.scores_.value(FD::Convert("B")));
+  EXPECT_EQ(7, t.scores_.value(FD::Convert("C")));
+  EXPECT_EQ(strtod("-0.1", NULL), t.scores_.value(FD::Convert("D")));
+  EXPECT_EQ(strtod("inf", NULL), t.scores_.value(FD::Convert("E")));
+  EXPECT_EQ(5, t.scores_.size());
+  TRule u("[X] ||| a ||| b ||| 0.3 -2 .5", true);
+  EXPECT_EQ(strtod("0.3", NULL), u.scores_.value(FD::Convert("PhraseModel_0")));
+  EXPECT_EQ(-2, u.scores_.value(FD::Convert("PhraseModel_1")));
+  EXPECT_EQ(0.5, u.scores_.value(FD::Convert("PhraseModel_2")));
+}
+
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -1,6 +1,7 @@
 #include "fast_lexical_cast.hpp"
 #include "viterbi.h"
 
+#include <cstring>
 #include <sstream>
 #include <vector>
 #include "hg.h"
@@ -37,24 +38,150 @@ std::string viterbi_stats(Hypergraph const& hg, std::string const& name, bool es
 }
 
 
+namespace {
+
+// the best in-edge (id in hg.edges_) of every node, -1 for nodes without
+// in-edges; false for an empty forest or one with negative edge weights,
+// which the generic Viterbi handles
+bool BestEdges(const Hypergraph& hg, vector<int>* best_edge, prob_t* score) {
+  if (hg.nodes_.empty()) return false;
+  const HypergraphTopology top(hg);
+  if (!top.nonnegative()) return false;
+  vector<double> node_score;
+  vector<int> best;
+  *score = prob_t(top.Viterbi(&node_score, &best), init_lnx());
+  best_edge->resize(best.size());
+  for (int i = 0; i < best.size(); ++i)
+    (*best_edge)[i] = best[i] < 0 ? -1 : top.edge(best[i]);
+  return true;
+}
+
+struct DerivationFrame {
+  explicit DerivationFrame(const Hypergraph::Edge* e) : edge(e), pos(), var() {}
+  const Hypergraph::Edge* edge;
+  int pos;  // next symbol of the rule
+  int var;  // next tail, on the source side
+};
+
+// walks the best derivation of node top-down, left to right on the target
+// (or source) side of the rules, calling sink->Word for the terminals and
+// sink->Open / sink->Close around each edge.  The yields come out in one
+// pass, with no vector per node as the bottom-up traversals need.
+template <class Sink>
+void WalkDerivation(const Hypergraph& hg, const vector<int>& best_edge, int node,
+                    bool source, Sink* sink) {
+  if (best_edge[node] < 0) return;
+  vector<DerivationFrame> stack;
+  stack.push_back(DerivationFrame(&hg.edges_[best_edge[node]]));
+  sink->Open(*stack.back().edge);
+  while (!stack.empty()) {
+    DerivationFrame& f = stack.back();
+    const vector<WordID>& rhs = source ? f.edge->rule_->f() : f.edge->rule_->e();
+    if (f.pos == rhs.size()) {
+      sink->Close(*f.edge);
+      stack.pop_back();
+      continue;
+    }
+    const WordID c = rhs[f.pos++];
+    if (c > 0) {
+      sink->Word(c);
+      continue;
+    }
+    const int tail = f.edge->tail_nodes_[source ? f.var++ : -c];
+    if (best_edge[tail] < 0) continue;
+    stack.push_back(DerivationFrame(&hg.edges_[best_edge[tail]]));
+    sink->Open(*stack.back().edge);
+  }
+}
+
+// the yield, as ESentenceTraversal / FSentenceTraversal
+struct YieldSink {
+  explicit YieldSink(vector<WordID>* o) : out(o) {}
+  void Word(WordID w) { out->push_back(w); }
+  void Open(const Hypergraph::Edge&) {}
+  void Close(const Hypergraph::Edge&) {}
+  vector<WordID>* out;
+};
+
+// (S (X the man) (X said (X he (X would (X go))))), as ETreeTraversal /
+// FTreeTraversal and TD::GetString of their result
+struct TreeSink {
+  explicit TreeSink(string* o) : out(o) {}
+  void Space() { if (!out->empty()) *out += ' '; }
+  void Word(WordID w) {
+    Space();
+    *out += TD::Convert(w);
+  }
+  void Open(const Hypergraph::Edge& e) {
+    const char* cat = TD::Convert(e.rule_->GetLHS() * -1);
+    if (!strcmp(cat, "Goal")) {
+      opened.push_back(string::npos);
+    } else {
+      Space();
+      *out += '(';
+      *out += cat;
+      opened.push_back(out->size());
+    }
+  }
+  void Close(const Hypergraph::Edge&) {
+    const size_t o = opened.back();
+    opened.pop_back();
+    if (o != string::npos) *out += (out->size() == o ? " )" : ")");
+  }
+  string* out;
+  vector<size_t> opened;  // size of out after each open bracket
+};
+
+}
+
 string ViterbiETree(const Hypergraph& hg) {
-  vector<WordID> tmp;
-  Viterbi<ETreeTraversal>(hg, &tmp);
-  return TD::GetString(tmp);
+  vector<int> best;
+  prob_t score;
+  if (!BestEdges(hg, &best, &score)) {
+    vector<WordID> tmp;
+    Viterbi<ETreeTraversal>(hg, &tmp);
+    return TD::GetString(tmp);
+  }
+  string tree;
+  TreeSink sink(&tree);
+  WalkDerivation(hg, best, hg.nodes_.size() - 1, false, &sink);
+  return tree;
 }
 
 string ViterbiFTree(const Hypergraph& hg) {
-  vector<WordID> tmp;
-  Viterbi<FTreeTraversal>(hg, &tmp);
-  return TD::GetString(tmp);
+  vector<int> best;
+  prob_t score;
+  if (!BestEdges(hg, &best, &score)) {
+    vector<WordID> tmp;
+    Viterbi<FTreeTraversal>(hg, &tmp);
+    return TD::GetString(tmp);
+  }
+  string tree;
+  TreeSink sink(&tree);
+  WalkDerivation(hg, best, hg.nodes_.size() - 1, true, &sink);
+  return tree;
 }
 
 prob_t ViterbiESentence(const Hypergraph& hg, vector<WordID>* result) {
-  return Viterbi<ESentenceTraversal>(hg, result);
+  vector<int> best;
+  prob_t score;
+  if (!BestEdges(hg, &best, &score))
+    return Viterbi<ESentenceTraversal>(hg, result);
+  result->clear();
+  YieldSink sink(result);
+  WalkDerivation(hg, best, hg.nodes_.size() - 1, false, &sink);
+  return score;
 }
 
 prob_t ViterbiFSentence(const Hypergraph& hg, vector<WordID>* result) {
-  return Viterbi<FSentenceTraversal>(hg, result);
+  vector<int> best;
+  prob_t score;
+  if (!BestEdges(hg, &best, &score))
+    return Viterbi<FSentenceTraversal>(hg, result);
+  result->clear();
+  YieldSink sink(result);
+  WalkDerivation(hg, best, hg.nodes_.size() - 1, true, &sink);
+  return score;
 }
 
 int ViterbiELength(const Hypergraph& hg) {
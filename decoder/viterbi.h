@@ -83,15 +83,41 @@ typename WeightFunction::Weight Viterbi(const Hypergraph& hg,
 }
 */
 
-//spec for EdgeProb
+//spec for EdgeProb: the best in-edges are found on a HypergraphTopology and
+//the traversal only runs on the nodes of the best derivation
 template<class Traversal>
 prob_t Viterbi(const Hypergraph& hg,
                    typename Traversal::Result* result,
                    Traversal const& traverse=Traversal()
   )
 {
-  EdgeProb weight;
-  return Viterbi(hg,result,traverse,weight);
+  typedef typename Traversal::Result T;
+  const HypergraphTopology top(hg);
+  const int num_nodes = hg.nodes_.size();
+  if (!num_nodes || !top.nonnegative())
+    return Viterbi(hg,result,traverse,EdgeProb());
+  std::vector<double> score;
+  std::vector<int> best;
+  const double goal_score = top.Viterbi(&score, &best);
+  // tails come before their heads
+  std::vector<char> used(num_nodes);
+  used.back() = 1;
+  for (int i = num_nodes - 1; i >= 0; --i)
+    if (used[i] && best[i] >= 0)
+      for (const int* t = top.tails_begin(best[i]); t != top.tails_end(best[i]); ++t)
+        used[*t] = 1;
+  std::vector<T> vit_result(num_nodes);
+  std::vector<const T*> ants;
+  for (int i = 0; i < num_nodes; ++i) {
+    if (!used[i] || best[i] < 0) continue;
+    const Hypergraph::Edge& edge = hg.edges_[top.edge(best[i])];
+    ants.resize(edge.tail_nodes_.size());
+    for (int k = 0; k < ants.size(); ++k)
+      ants[k] = &vit_result[edge.tail_nodes_[k]];
+    traverse(edge, ants, &vit_result[i]);
+  }
+  std::swap(*result, vit_result.back());
+  return prob_t(goal_score, init_lnx());
 }
 
 struct PathLengthTraversal {
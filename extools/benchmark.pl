@@ -0,0 +1,279 @@
+#!/usr/bin/perl -w
+use strict;
+
+# Measures the throughput of the grammar building pipeline on a synthetic
+# aligned corpus:
+#
+#   extractor | mr_stripe_rule_reduce | filter_grammar | featurize_grammar
+#
+# Each stage runs on its own, from and to files in the work directory, once
+# per thread count for the stages that take -j.  For every run it reports
+# the wall time, the rules written per second, the input bytes read per
+# second, the peak resident memory and the speedup over the first thread
+# count.  The corpus is generated from a fixed seed, so runs on the same
+# machine are comparable across revisions.
+
+my $SCRIPT_DIR; BEGIN { use Cwd qw/ abs_path /; use File::Basename; $SCRIPT_DIR = dirname(abs_path($0)); }
+
+use Getopt::Long "GetOptions";
+use POSIX ":sys_wait_h";
+use Time::HiRes qw/ time sleep /;
+
+my $BIN_DIR = $SCRIPT_DIR;
+my $WORK_DIR = "benchmark.$$";
+$| = 1;
+my $SENTENCES = 20000;
+my $TEST_SENTENCES = 200;
+my $VOCAB = 5000;
+my $MAX_LEN = 30;
+my $THREADS = "1,2,4";
+my $SEED = 1;
+my $BINARY;
+my $KEEP;
+my %first_time;  # of each stage with the first thread count
+my @cdf;         # of the Zipfian word distribution
+
+usage() unless &GetOptions('bindir=s' => \$BIN_DIR,
+                           'workdir=s' => \$WORK_DIR,
+                           'sentences=i' => \$SENTENCES,
+                           'test_sentences=i' => \$TEST_SENTENCES,
+                           'vocab=i' => \$VOCAB,
+                           'max_len=i' => \$MAX_LEN,
+                           'threads=s' => \$THREADS,
+                           'seed=i' => \$SEED,
+                           'binary' => \$BINARY,
+                           'keep' => \$KEEP);
+
+my $EXTRACTOR = "$BIN_DIR/extractor";
+my $REDUCER = "$BIN_DIR/mr_stripe_rule_reduce";
+my $FILTER = "$BIN_DIR/filter_grammar";
+my $FEATURIZE = "$BIN_DIR/featurize_grammar";
+assert_exec($EXTRACTOR, $REDUCER, $FILTER, $FEATURIZE);
+my @threads = split /,/, $THREADS;
+die "Bad --threads $THREADS" unless @threads && !grep { !/^\d+$/ || $_ < 1 } @threads;
+
+mkdir $WORK_DIR or die "Can't create $WORK_DIR: $!" unless -d $WORK_DIR;
+my $CORPUS = "$WORK_DIR/corpus.fr-en-al";
+my $TEST = "$WORK_DIR/test.fr";
+print STDERR "Generating $SENTENCES sentence pairs in $WORK_DIR...\n";
+make_corpus($CORPUS, $TEST);
+
+my $EXTRACTED = "$WORK_DIR/extracted";
+my $UNFILTERED = "$WORK_DIR/unfiltered";
+my $FILTERED = "$WORK_DIR/filtered";
+my $FEATURIZED = "$WORK_DIR/featurized";
+
+printf "%-28s %7s %9s %12s %10s %9s %8s\n", 'stage', 'threads', 'seconds', 'rules/s', 'MB/s', 'peak MB', 'speedup';
+# one shard keeps the extractor's output sorted by key, as the reducer needs
+my $B = $BINARY ? ' --binary' : '';
+for my $t (@threads) {
+  run_stage('extractor', $t, "$EXTRACTOR -i $CORPUS -d X -c 0 -j $t --shards 1 --silent$B", undef, $EXTRACTED);
+}
+run_stage('mr_stripe_rule_reduce', 1, "$REDUCER$B", $EXTRACTED, $UNFILTERED);
+for my $t (@threads) {
+  run_stage('filter_grammar', $t, "$FILTER -t $TEST -j $t$B", $UNFILTERED, $FILTERED);
+}
+for my $t (@threads) {
+  run_stage('featurize_grammar', $t, "$FEATURIZE -c $CORPUS -g $FILTERED -f LexProb -f LogRuleCount -f RulePenalty -f XFeatures -j $t", $UNFILTERED, $FEATURIZED);
+}
+
+if ($KEEP) {
+  print STDERR "Inputs and outputs are in $WORK_DIR\n";
+} else {
+  unlink $CORPUS, $TEST, $EXTRACTED, $UNFILTERED, $FILTERED, $FEATURIZED, "$WORK_DIR/stderr";
+  rmdir $WORK_DIR;
+}
+exit 0;
+
+# runs cmd with stdin from in and stdout to out, and reports the run
+sub run_stage {
+  my ($stage, $threads, $cmd, $in, $out) = @_;
+  my $full = "exec $cmd" . ($in ? " < $in" : "") . " > $out 2> $WORK_DIR/stderr";
+  my $start = time;
+  my $pid = fork();
+  die "Can't fork: $!" unless defined $pid;
+  if ($pid == 0) { exec '/bin/sh', '-c', $full or die "Can't exec: $!"; }
+  # the shell execs the command, so its peak memory is that of pid
+  my $peak_kb = 0;
+  while (waitpid($pid, WNOHANG) == 0) {
+    my $kb = peak_kb($pid);
+    $peak_kb = $kb if $kb > $peak_kb;
+    sleep 0.05;
+  }
+  my $status = $?;
+  my $secs = time - $start;
+  if ($status) {
+    system("cat $WORK_DIR/stderr 1>&2");
+    die "$stage failed (exit status $status): $cmd\n";
+  }
+  my $rules = count_rules($out);
+  my $bytes = -s ($in ? $in : $CORPUS);
+  $first_time{$stage} = $secs unless defined $first_time{$stage};
+  printf "%-28s %7d %9.2f %12.0f %10.2f %9s %8.2f\n", $stage, $threads, $secs,
+         $rules / $secs, $bytes / $secs / 1048576,
+         ($peak_kb ? sprintf("%.1f", $peak_kb / 1024) : 'n/a'),
+         $first_time{$stage} / $secs;
+}
+
+# VmHWM of a running process, 0 where /proc does not have it
+sub peak_kb {
+  my $pid = shift;
+  open my $st, '<', "/proc/$pid/status" or return 0;
+  while (<$st>) {
+    return $1 if /^VmHWM:\s+(\d+)/;
+  }
+  return 0;
+}
+
+# rules in a striped grammar (a target side and its statistics per rule) or
+# in a featurized grammar (a rule per line)
+sub count_rules {
+  my $file = shift;
+  my $rules = 0;
+  open my $f, '<', $file or die "Can't read $file: $!";
+  binmode $f;
+  my $magic = '';
+  read($f, $magic, 5);
+  if ($magic eq "\0SGB1") {
+    $rules = count_binary_rules($f);
+    close $f;
+    return $rules;
+  }
+  seek $f, 0, 0;
+  while (<$f>) {
+    if (/\t/) {
+      my $fields = () = / \|\|\| /g;
+      $rules += ($fields + 1) / 2;
+    } else {
+      $rules++;
+    }
+  }
+  close $f;
+  return $rules;
+}
+
+# rules in binary stripes (see StripeWriter in striped_grammar.h): the
+# number of values of each 'S' record, which follows its key
+sub count_binary_rules {
+  my $f = shift;
+  my $rules = 0;
+  while (read($f, my $tag, 1)) {
+    if ($tag eq "\0") { my $magic; read($f, $magic, 4); next; }
+    my $size = read_varint($f);
+    read($f, my $rec, $size) == $size or die "Truncated binary stripe\n";
+    next unless $tag eq 'S';
+    my $pos = 0;
+    my $n = get_varint(\$rec, \$pos);
+    get_varint(\$rec, \$pos) for 1..$n;
+    $rules += get_varint(\$rec, \$pos);
+  }
+  return $rules;
+}
+
+sub read_varint {
+  my $f = shift;
+  my ($x, $shift) = (0, 0);
+  while (read($f, my $c, 1)) {
+    $c = ord($c);
+    $x |= ($c & 0x7f) << $shift;
+    return $x unless $c & 0x80;
+    $shift += 7;
+  }
+  die "Truncated binary stripe\n";
+}
+
+sub get_varint {
+  my ($rec, $pos) = @_;
+  my ($x, $shift) = (0, 0);
+  while ($$pos < length $$rec) {
+    my $c = ord(substr($$rec, $$pos++, 1));
+    $x |= ($c & 0x7f) << $shift;
+    return $x unless $c & 0x80;
+    $shift += 7;
+  }
+  die "Truncated binary stripe\n";
+}
+
+# a word from a Zipfian distribution over the vocabulary
+sub zipf_word {
+  unless (@cdf) {
+    my $z = 0;
+    for my $r (1..$VOCAB) { $z += 1 / $r; push @cdf, $z; }
+    $_ /= $z for @cdf;
+  }
+  my $u = rand();
+  my ($lo, $hi) = (0, $#cdf);
+  while ($lo < $hi) {
+    my $mid = int(($lo + $hi) / 2);
+    if ($cdf[$mid] < $u) { $lo = $mid + 1; } else { $hi = $mid; }
+  }
+  return $lo;
+}
+
+# the training corpus, with English "translations" that reorder adjacent
+# words and drop or insert words now and then, and the source side of
+# held out sentences as the test set
+sub make_corpus {
+  my ($corpus, $test) = @_;
+  srand($SEED);
+  open my $c, '>', $corpus or die "Can't write $corpus: $!";
+  open my $t, '>', $test or die "Can't write $test: $!";
+  for my $n (1..($SENTENCES + $TEST_SENTENCES)) {
+    my $len = 1 + int(rand($MAX_LEN));
+    my @f = map { zipf_word() } 1..$len;
+    if ($n > $SENTENCES) {
+      print $t join(' ', map { "f$_" } @f), "\n";
+      next;
+    }
+    my @e;
+    my @al;
+    for (my $i = 0; $i < $len; $i++) {
+      my $r = rand();
+      if ($r < 0.05) { next; }  # unaligned source word
+      if ($r < 0.15 && $i + 1 < $len) {  # swap with the next word
+        push @al, ($i + 1) . '-' . scalar(@e); push @e, "e$f[$i+1]";
+        push @al, "$i-" . scalar(@e); push @e, "e$f[$i]";
+        $i++;
+        next;
+      }
+      push @al, "$i-" . scalar(@e); push @e, "e$f[$i]";
+      push @e, "e" . zipf_word() if rand() < 0.05;  # unaligned target word
+    }
+    @e = ('e0') unless @e;
+    print $c join(' ', map { "f$_" } @f), ' ||| ', join(' ', @e), ' ||| ', join(' ', @al), "\n";
+  }
+  close $c;
+  close $t;
+}
+
+sub assert_exec {
+  my @files = @_;
+  for my $file (@files) {
+    die "Can't find $file - did you run make?\n" unless -e $file;
+    die "Can't execute $file" unless -x $file;
+  }
+}
+
+sub usage {
+  print <<EOT;
+
+Usage: $0 [OPTIONS]
+
+Generates a synthetic aligned corpus and measures each stage of the
+grammar building pipeline on it.
+
+Options:
+  --bindir DIR           Directory with the extools binaries (default: $SCRIPT_DIR)
+  --workdir DIR          Directory for the corpus and the grammars (default: benchmark.PID)
+  --sentences N          Training sentence pairs (default: $SENTENCES)
+  --test_sentences N     Test sentences to filter for (default: $TEST_SENTENCES)
+  --vocab N              Source vocabulary size (default: $VOCAB)
+  --max_len N            Maximum sentence length (default: $MAX_LEN)
+  --threads LIST         Thread counts to run the threaded stages with (default: $THREADS)
+  --seed N               Random seed for the corpus (default: $SEED)
+  --binary               Pass binary stripes between the stages
+  --keep                 Keep the corpus and the grammars
+
+EOT
+  exit 1;
+}
@@ -1,9 +1,14 @@
 #include <iostream>
 #include <vector>
 #include <utility>
+#include <algorithm>
 #include <tr1/unordered_map>
 
+#include <boost/bind.hpp>
 #include <boost/functional/hash.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
 #include <boost/lexical_cast.hpp>
@@ -39,6 +44,11 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
         ("context_language", po::value<string>()->default_value("target"), "Extract context strings in source, target or both languages")
         ("bidir,b", "Extract bidirectional rules (for computing p(f|e) in addition to p(e|f))")
         ("combiner_size,c", po::value<size_t>()->default_value(800000), "Number of unique items to store in cache before writing rule counts. Set to 1 to disable cache. Set to 0 for no limit.")
+        ("combiner_memory,m", po::value<size_t>()->default_value(0), "Limit the cache to about this many MB instead of --combiner_size items. 0 to use --combiner_size")
+        ("threads,j", po::value<int>()->default_value(1), "Extract rules on this many threads")
+        ("shards", po::value<int>(), "Partition the combiner into this many shards by key (default: one per thread)")
+        ("shard_output", po::value<string>(), "Write combiner shard i to SHARD_OUTPUT.i instead of stdout")
+        ("binary", "Write binary stripes (see striped_grammar.h) instead of text")
         ("silent", "Write nothing to stderr except errors")
         ("phrase_context,C", "Write base phrase contexts")
         ("phrase_context_size,S", po::value<int>()->default_value(2), "Use this many words of context on left and write when writing base phrase contexts")
@@ -91,51 +101,352 @@ void WriteBasePhraseSpans(const AnnotatedParallelSentence& sentence,
   cout << endl;
 }
 
-struct CountCombiner {
-  CountCombiner(const size_t& csize) : combiner_size(csize) {
-    if (csize == 0) { cerr << "Using unlimited combiner cache.\n"; }
+typedef unordered_map<vector<WordID>, RuleStatistics, boost::hash<vector<WordID> > > Vec2PhraseCount;
+typedef unordered_map<vector<WordID>, Vec2PhraseCount, boost::hash<vector<WordID> > > CountCache;
+
+// estimates of the heap memory the caches take, including the allocator's
+// and the hash tables' overhead, so that caches can be sized by memory
+static const size_t kALLOC_OVERHEAD = 16;
+static const size_t kSTRIPE_BUCKETS = 11;  // initial buckets of a Vec2PhraseCount
+
+inline size_t HeapBytes(size_t n) { return n ? n + kALLOC_OVERHEAD : 0; }
+
+// a hash table entry, with its share of the bucket array
+template <class Map>
+inline size_t EntryBytes() {
+  return HeapBytes(sizeof(typename Map::value_type) + sizeof(void*)) + sizeof(void*);
+}
+
+// a new stripe, not counting the words of its key
+template <class Map>
+inline size_t StripeBytes() {
+  return EntryBytes<Map>() + HeapBytes(kSTRIPE_BUCKETS * sizeof(void*));
+}
+
+inline size_t AlignBytes(const vector<pair<short,short> >& aligns) {
+  return HeapBytes(aligns.size() * sizeof(pair<short,short>));
+}
+
+inline size_t RuleBytes(const vector<WordID>& val, const vector<pair<short,short> >& aligns) {
+  return EntryBytes<Vec2PhraseCount>() + HeapBytes(val.size() * sizeof(WordID)) + AlignBytes(aligns);
+}
+
+// counts val in stripe.  returns the bytes it added to the stripe, and
+// sets *hit if val was already in it
+inline size_t AddToStripe(const vector<WordID>& val,
+                          const int count_type,
+                          const vector<pair<short,short> >& aligns,
+                          Vec2PhraseCount* stripe,
+                          bool* hit) {
+  Vec2PhraseCount::iterator it = stripe->find(val);
+  *hit = (it != stripe->end());
+  size_t bytes = 0;
+  if (!*hit) {
+    it = stripe->insert(make_pair(val, RuleStatistics())).first;
+    bytes = RuleBytes(val, it->second.aligns);
+  }
+  RuleStatistics& v = it->second;
+  float newcount = v.counts.add_value(count_type, 1.0f);
+  // hack for adding alignments
+  if (newcount < 7.0f && aligns.size() > v.aligns.size()) {
+    bytes += AlignBytes(aligns) - AlignBytes(v.aligns);
+    v.aligns = aligns;
   }
-  ~CountCombiner() {
-    if (!cache.empty()) WriteAndClearCache();
+  return bytes;
+}
+
+// adds the counts of src to stripe, as AddToStripe
+inline size_t MergeStripe(const Vec2PhraseCount& src, Vec2PhraseCount* stripe, size_t* hits) {
+  size_t bytes = 0;
+  for (Vec2PhraseCount::const_iterator vi = src.begin(); vi != src.end(); ++vi) {
+    Vec2PhraseCount::iterator it = stripe->find(vi->first);
+    if (it == stripe->end()) {
+      it = stripe->insert(make_pair(vi->first, RuleStatistics())).first;
+      bytes += RuleBytes(vi->first, it->second.aligns);
+    } else {
+      ++*hits;
+    }
+    RuleStatistics& d = it->second;
+    d += vi->second;
+    if (d.aligns.size() < vi->second.aligns.size()) {
+      bytes += AlignBytes(vi->second.aligns) - AlignBytes(d.aligns);
+      d.aligns = vi->second.aligns;
+    }
+  }
+  return bytes;
+}
+
+// returns the bytes the count added to cache
+inline size_t AddCount(const vector<WordID>& key,
+                       const vector<WordID>& val,
+                       const int count_type,
+                       const vector<pair<short,short> >& aligns,
+                       CountCache* cache) {
+  size_t bytes = 0;
+  CountCache::iterator it = cache->find(key);
+  if (it == cache->end()) {
+    it = cache->insert(make_pair(key, Vec2PhraseCount())).first;
+    bytes = StripeBytes<CountCache>() + HeapBytes(key.size() * sizeof(WordID));
+  }
+  bool hit;
+  return bytes + AddToStripe(val, count_type, aligns, &it->second, &hit);
+}
+
+// receives each (key, value) pair the extractor observes
+struct RuleCounter {
+  virtual void Count(const vector<WordID>& key,
+                     const vector<WordID>& val,
+                     const int count_type,
+                     const vector<pair<short,short> >& aligns) = 0;
+  virtual ~RuleCounter() {}
+};
+
+// the keys of a shard's cache, stored end to end in one array.  a key is
+// the offset of its length in the array, followed by its words, which
+// saves the allocation and the header of a vector per key
+typedef vector<WordID> KeyArena;
+
+struct ArenaKeyHash {
+  explicit ArenaKeyHash(const KeyArena* a) : arena(a) {}
+  size_t operator()(size_t off) const {
+    const WordID* k = &(*arena)[off];
+    return boost::hash_range(k + 1, k + 1 + k[0]);
+  }
+  const KeyArena* arena;
+};
+
+struct ArenaKeyEq {
+  explicit ArenaKeyEq(const KeyArena* a) : arena(a) {}
+  bool operator()(size_t a, size_t b) const {
+    const WordID* ka = &(*arena)[a];
+    const WordID* kb = &(*arena)[b];
+    return ka[0] == kb[0] && equal(ka + 1, ka + 1 + ka[0], kb + 1);
+  }
+  const KeyArena* arena;
+};
+
+typedef unordered_map<size_t, Vec2PhraseCount, ArenaKeyHash, ArenaKeyEq> ArenaCountCache;
+
+// caches counts before writing them, until a shard holds more than its
+// share of combiner_size unique keys or, with a memory budget, of
+// combiner_bytes bytes.  keys are hash partitioned over num_shards
+// shards, each with its own lock and its own share of the cache, and a
+// full shard is spilled: written out as a run sorted by key.  with a
+// shard prefix, shard i goes to PREFIX.i: shards have disjoint keys, so
+// with an unlimited cache each file can go straight to its own
+// mr_stripe_rule_reduce.  otherwise all shards write to stdout.
+// Count and Merge are thread safe.
+class CountCombiner : public RuleCounter {
+ public:
+  CountCombiner(const size_t& csize, int num_shards = 1, const string& shard_prefix = "", bool binary = false, size_t cbytes = 0) :
+      combiner_size(csize),
+      shard_size(csize > 1 ? max<size_t>(csize / num_shards, 2) : csize),
+      combiner_bytes(cbytes),
+      shard_bytes(cbytes / num_shards),
+      shards(num_shards) {
+    if (cbytes) { cerr << "Using a combiner cache of " << (cbytes >> 20) << "MB.\n"; }
+    else if (csize == 0) { cerr << "Using unlimited combiner cache.\n"; }
+    shared_out = shard_prefix.empty() && num_shards > 1;
+    for (int i = 0; i < num_shards; ++i) {
+      shards[i].reset(new Shard);
+      if (shard_prefix.empty()) {
+        if (i == 0) shards[i]->writer.reset(new StripeWriter(&cout, binary));
+        else shards[i]->writer = shards[0]->writer;
+      } else {
+        shards[i]->file.Init(shard_prefix + "." + boost::lexical_cast<string>(i));
+        shards[i]->writer.reset(new StripeWriter(shards[i]->file.stream(), binary));
+      }
+    }
   }
+  ~CountCombiner() { Flush(); }
+
+  // the item limit: 1 means no cache, 0 no limit
+  size_t size() const { return combiner_size; }
+  // the memory budget, 0 if the cache is limited by size()
+  size_t bytes() const { return combiner_bytes; }
 
   void Count(const vector<WordID>& key,
              const vector<WordID>& val,
              const int count_type,
              const vector<pair<short,short> >& aligns) {
-    if (combiner_size != 1) {
-      RuleStatistics& v = cache[key][val];
-      float newcount = v.counts.add_value(count_type, 1.0f);
-      // hack for adding alignments
-      if (newcount < 7.0f && aligns.size() > v.aligns.size())
-        v.aligns = aligns;
-      if (combiner_size > 1 && cache.size() > combiner_size)
-        WriteAndClearCache();
+    Shard& s = *shards[ShardOf(key)];
+    boost::mutex::scoped_lock l(s.mutex);
+    ++s.items;
+    if (combiner_size != 1 || combiner_bytes) {
+      bool hit;
+      s.bytes += AddToStripe(val, count_type, aligns, s.Stripe(key), &hit);
+      if (hit) ++s.hits;
+      if (Full(s)) WriteAndClearCache(&s);
     } else {
-      cout << TD::GetString(key) << '\t' << TD::GetString(val) << " ||| ";
-      cout << RuleStatistics(count_type, 1.0f, aligns) << endl;
+      Vec2PhraseCount v;
+      v[val] = RuleStatistics(count_type, 1.0f, aligns);
+      boost::mutex::scoped_lock ol(out_mutex, boost::defer_lock);
+      if (shared_out) ol.lock();
+      s.writer->Write(key, v);
     }
   }
 
- private:
-  void WriteAndClearCache() {
-    for (unordered_map<vector<WordID>, Vec2PhraseCount, boost::hash<vector<WordID> > >::iterator it = cache.begin();
-         it != cache.end(); ++it) {
-      cout << TD::GetString(it->first) << '\t';
-      const Vec2PhraseCount& vals = it->second;
-      bool needdiv = false;
-      for (Vec2PhraseCount::const_iterator vi = vals.begin(); vi != vals.end(); ++vi) {
-        if (needdiv) cout << " ||| "; else needdiv = true;
-        cout << TD::GetString(vi->first) << " ||| " << vi->second;
+  // adds the counts in local to the shards, locking each shard once, and
+  // clears local
+  void Merge(CountCache* local) {
+    vector<vector<CountCache::iterator> > by_shard(shards.size());
+    for (CountCache::iterator it = local->begin(); it != local->end(); ++it)
+      by_shard[ShardOf(it->first)].push_back(it);
+    for (int i = 0; i < shards.size(); ++i) {
+      if (by_shard[i].empty()) continue;
+      Shard& s = *shards[i];
+      boost::mutex::scoped_lock l(s.mutex);
+      for (int j = 0; j < by_shard[i].size(); ++j) {
+        const Vec2PhraseCount& vals = by_shard[i][j]->second;
+        s.items += vals.size();
+        s.bytes += MergeStripe(vals, s.Stripe(by_shard[i][j]->first), &s.hits);
       }
-      cout << endl;
+      if (Full(s)) WriteAndClearCache(&s);
+    }
+    local->clear();
+  }
+
+  // writes out everything in the cache
+  void Flush() {
+    for (int i = 0; i < shards.size(); ++i) {
+      boost::mutex::scoped_lock l(shards[i]->mutex);
+      if (!shards[i]->cache.empty()) WriteAndClearCache(shards[i].get());
+    }
+  }
+
+  // writes the number of spills, the fraction of counted rules that were
+  // already cached, and the most memory a shard's cache took
+  void ReportStats(ostream* out) {
+    size_t items = 0, hits = 0, spills = 0, peak = 0;
+    for (int i = 0; i < shards.size(); ++i) {
+      boost::mutex::scoped_lock l(shards[i]->mutex);
+      items += shards[i]->items;
+      hits += shards[i]->hits;
+      spills += shards[i]->spills;
+      peak = max(peak, shards[i]->peak_bytes);
     }
-    cache.clear();
+    if (!items) return;
+    *out << "Combiner: " << spills << " spills, hit rate "
+         << (items ? 100.0 * hits / items : 0.0) << "% of " << items
+         << " rules, largest shard cache " << (peak >> 20) << "MB\n";
+  }
+
+ private:
+  struct Shard {
+    Shard() : cache(10, ArenaKeyHash(&arena), ArenaKeyEq(&arena)),
+              bytes(), peak_bytes(), items(), hits(), spills() {}
+
+    // the stripe of key, added if there is none
+    Vec2PhraseCount* Stripe(const vector<WordID>& key) {
+      // append key to the arena to look it up, and take it back off if it
+      // is there already
+      const size_t off = arena.size();
+      const size_t cap = arena.capacity();
+      arena.push_back(key.size());
+      arena.insert(arena.end(), key.begin(), key.end());
+      pair<ArenaCountCache::iterator, bool> r = cache.insert(make_pair(off, Vec2PhraseCount()));
+      if (r.second)
+        bytes += StripeBytes<ArenaCountCache>();
+      else
+        arena.resize(off);
+      bytes += (arena.capacity() - cap) * sizeof(WordID);
+      return &r.first->second;
+    }
+
+    boost::mutex mutex;
+    KeyArena arena;
+    ArenaCountCache cache;
+    size_t bytes;
+    size_t peak_bytes;
+    size_t items;
+    size_t hits;
+    size_t spills;
+    WriteFile file;
+    boost::shared_ptr<StripeWriter> writer;
+  };
+
+  struct KeyStringLess {
+    bool operator()(const pair<string, ArenaCountCache::const_iterator>& a,
+                    const pair<string, ArenaCountCache::const_iterator>& b) const {
+      return a.first < b.first;
+    }
+  };
+
+  int ShardOf(const vector<WordID>& key) const {
+    return boost::hash_range(key.begin(), key.end()) % shards.size();
+  }
+
+  bool Full(const Shard& s) const {
+    if (combiner_bytes) return s.bytes > shard_bytes;
+    return shard_size > 1 && s.cache.size() > shard_size;
+  }
+
+  // the caller holds s->mutex
+  void WriteAndClearCache(Shard* s) {
+    // sorted as LC_ALL=C sort would sort the lines
+    vector<pair<string, ArenaCountCache::const_iterator> > keys;
+    keys.reserve(s->cache.size());
+    vector<WordID> key;
+    for (ArenaCountCache::const_iterator it = s->cache.begin(); it != s->cache.end(); ++it) {
+      const WordID* k = &s->arena[it->first];
+      key.assign(k + 1, k + 1 + k[0]);
+      keys.push_back(make_pair(TD::GetString(key), it));
+    }
+    sort(keys.begin(), keys.end(), KeyStringLess());
+    boost::mutex::scoped_lock ol(out_mutex, boost::defer_lock);
+    if (shared_out) ol.lock();
+    for (int i = 0; i < keys.size(); ++i) {
+      const WordID* k = &s->arena[keys[i].second->first];
+      key.assign(k + 1, k + 1 + k[0]);
+      s->writer->Write(key, keys[i].second->second);
+    }
+    s->cache.clear();
+    KeyArena().swap(s->arena);
+    s->peak_bytes = max(s->peak_bytes, s->bytes);
+    s->bytes = 0;
+    ++s->spills;
   }
 
   const size_t combiner_size;
-  typedef unordered_map<vector<WordID>, RuleStatistics, boost::hash<vector<WordID> > > Vec2PhraseCount;
-  unordered_map<vector<WordID>, Vec2PhraseCount, boost::hash<vector<WordID> > > cache;
+  const size_t shard_size;
+  const size_t combiner_bytes;
+  const size_t shard_bytes;
+  vector<boost::shared_ptr<Shard> > shards;
+  bool shared_out;
+  boost::mutex out_mutex;
+};
+
+// one extraction thread's counts, added to the shared CountCombiner when
+// more than limit unique keys (or, with a memory budget, limit bytes) are
+// cached and when the thread is done, so that the threads rarely wait for
+// a shard's lock
+class ThreadCombiner : public RuleCounter {
+ public:
+  ThreadCombiner(CountCombiner* cc, size_t limit) : cc_(*cc), limit_(limit), bytes_() {}
+  ~ThreadCombiner() { Flush(); }
+
+  void Count(const vector<WordID>& key,
+             const vector<WordID>& val,
+             const int count_type,
+             const vector<pair<short,short> >& aligns) {
+    if (cc_.size() == 1 && !cc_.bytes()) {
+      cc_.Count(key, val, count_type, aligns);
+      return;
+    }
+    bytes_ += AddCount(key, val, count_type, aligns, &cache_);
+    if ((cc_.bytes() ? bytes_ : cache_.size()) > limit_) Flush();
+  }
+
+  void Flush() {
+    if (!cache_.empty()) cc_.Merge(&cache_);
+    bytes_ = 0;
+  }
+
+ private:
+  CountCombiner& cc_;
+  const size_t limit_;
+  size_t bytes_;
+  CountCache cache_;
 };
 
 // TODO optional source context
@@ -145,7 +456,7 @@ void WritePhraseContexts(const AnnotatedParallelSentence& sentence,
                          const int ctx_size,
                          bool phrase_s, bool phrase_t,
                          bool context_s, bool context_t,
-                         CountCombiner* o) {
+                         RuleCounter* o) {
   vector<WordID> context, context_f;
   if (context_t)
   {
@@ -235,7 +546,7 @@ struct SimpleRuleWriter : public Extract::RuleObserver {
 };
 
 struct HadoopStreamingRuleObserver : public Extract::RuleObserver {
-  HadoopStreamingRuleObserver(CountCombiner* cc, bool bidir_flag) :
+  HadoopStreamingRuleObserver(RuleCounter* cc, bool bidir_flag) :
      bidir(bidir_flag),
      kF(TD::Convert("F")),
      kE(TD::Convert("E")),
@@ -327,7 +638,7 @@ struct HadoopStreamingRuleObserver : public Extract::RuleObserver {
   const bool bidir;
   const WordID kF, kE, kDIVIDER;
   const string kLB, kRB;
-  CountCombiner& combiner;
+  RuleCounter& combiner;
   const vector<pair<short,short> > kEMPTY;
   const int kCFE;
   map<WordID, map<int, WordID> > cat2ind2sym;
@@ -335,6 +646,85 @@ struct HadoopStreamingRuleObserver : public Extract::RuleObserver {
   vector<WordID> emajor_key, emajor_val, fmajor_key, fmajor_val;
 };
 
+// everything extracting a sentence needs besides the sentence
+struct ExtractionOptions {
+  WordID default_cat;
+  int max_base_phrase_size;
+  bool write_phrase_contexts;
+  bool write_base_phrases;
+  bool write_base_phrase_spans;
+  bool loose_phrases;
+  bool x_cdyer_pos;
+  int max_syms;
+  int max_vars;
+  int ctx_size;
+  bool permit_adjacent_nonterminals;
+  bool require_aligned_terminal;
+  bool phrase_s, phrase_t, context_s, context_t;
+};
+
+// the scratch space of one extraction thread
+struct ExtractionWorker {
+  ExtractionWorker(const ExtractionOptions& o, RuleCounter* c, bool bidir, const vector<WordID>& cats) :
+      opts(o), counter(c), observer(c, bidir), all_cats(cats) {}
+
+  void ExtractSentence(const char* buf, int line) {
+    sentence.ParseInputLine(buf);
+    if (opts.x_cdyer_pos) {
+      sentence.e = sentence.f;
+      sentence.AllocateForAlignment();
+      for (int i = 0; i < sentence.e.size(); ++i) sentence.Align(i,i);
+    }
+    phrases.clear();
+    Extract::ExtractBasePhrases(opts.max_base_phrase_size, sentence, &phrases);
+    if (opts.loose_phrases)
+      Extract::LoosenPhraseBounds(sentence, opts.max_base_phrase_size, &phrases);
+    if (phrases.empty()) {
+      cerr << "WARNING no phrases extracted line: " << line << endl;
+      return;
+    }
+    if (opts.write_phrase_contexts) {
+      WritePhraseContexts(sentence, phrases, opts.ctx_size, opts.phrase_s, opts.phrase_t, opts.context_s, opts.context_t, counter);
+      return;
+    }
+    if (opts.write_base_phrases) {
+      WriteBasePhrases(sentence, phrases);
+      return;
+    }
+    if (opts.write_base_phrase_spans) {
+      WriteBasePhraseSpans(sentence, phrases);
+      return;
+    }
+    Extract::AnnotatePhrasesWithCategoryTypes(opts.default_cat, sentence.span_types, &phrases);
+    Extract::ExtractConsistentRules(sentence, phrases, opts.max_vars, opts.max_syms, opts.permit_adjacent_nonterminals, opts.require_aligned_terminal, &observer, &all_cats);
+  }
+
+  // extract every stride'th line of lines, starting with the first'th
+  void ExtractLines(const vector<string>* lines, const vector<int>* line_nos, int first, int stride) {
+    for (int i = first; i < lines->size(); i += stride)
+      ExtractSentence((*lines)[i].c_str(), (*line_nos)[i]);
+  }
+
+  const ExtractionOptions& opts;
+  RuleCounter* counter;
+  HadoopStreamingRuleObserver observer;
+  AnnotatedParallelSentence sentence;
+  vector<ParallelSpan> phrases;
+  vector<WordID> all_cats;
+};
+
+// extracts a block of lines with one thread per worker, then empties it
+void ExtractBlock(const vector<boost::shared_ptr<ExtractionWorker> >& workers,
+                  vector<string>* block,
+                  vector<int>* line_nos) {
+  boost::thread_group group;
+  for (int i = 0; i < workers.size(); ++i)
+    group.create_thread(boost::bind(&ExtractionWorker::ExtractLines, workers[i].get(), block, line_nos, i, workers.size()));
+  group.join_all();
+  block->clear();
+  line_nos->clear();
+}
+
 int main(int argc, char** argv) {
   po::variables_map conf;
   InitCommandLine(argc, argv, &conf);
@@ -345,54 +735,88 @@ int main(int argc, char** argv) {
   kCOUNT = FD::Convert("C");
   kSPLIT = TD::Convert("<SPLIT>");
 
-  WordID default_cat = 0;  // 0 means no default- extraction will
-                           // fail if a phrase is extracted without a
-                           // category
+  ExtractionOptions opts;
+  opts.default_cat = 0;  // 0 means no default- extraction will
+                         // fail if a phrase is extracted without a
+                         // category
   const bool backoff = (conf.count("backoff") ? true : false);
   if (conf.count("default_category")) {
     string sdefault_cat = conf["default_category"].as<string>();
-    default_cat = -TD::Convert(sdefault_cat);
+    opts.default_cat = -TD::Convert(sdefault_cat);
     cerr << "Default category: " << sdefault_cat << endl;
   }
   ReadFile rf(conf["input"].as<string>());
   istream& in = *rf.stream();
 
   char buf[MAX_LINE_LENGTH];
-  AnnotatedParallelSentence sentence;
-  vector<ParallelSpan> phrases;
   vector<WordID> all_cats;
-  int max_base_phrase_size = conf["max_base_phrase_size"].as<int>();
-  bool write_phrase_contexts = conf.count("phrase_context") > 0;
-  const bool write_base_phrases = conf.count("base_phrase") > 0;
-  const bool write_base_phrase_spans = conf.count("base_phrase_spans") > 0;
-  const bool loose_phrases = conf.count("loose") > 0;
+  opts.max_base_phrase_size = conf["max_base_phrase_size"].as<int>();
+  opts.write_phrase_contexts = conf.count("phrase_context") > 0;
+  opts.write_base_phrases = conf.count("base_phrase") > 0;
+  opts.write_base_phrase_spans = conf.count("base_phrase_spans") > 0;
+  opts.loose_phrases = conf.count("loose") > 0;
   const bool silent = conf.count("silent") > 0;
-  const int max_syms = conf["max_syms"].as<int>();
-  const int max_vars = conf["max_vars"].as<int>();
-  const int ctx_size = conf["phrase_context_size"].as<int>();
+  opts.max_syms = conf["max_syms"].as<int>();
+  opts.max_vars = conf["max_vars"].as<int>();
+  opts.ctx_size = conf["phrase_context_size"].as<int>();
   const int num_categories = conf["topics"].as<int>();
-  const bool permit_adjacent_nonterminals = conf.count("permit_adjacent_nonterminals") > 0;
-  const bool require_aligned_terminal = conf.count("no_required_aligned_terminal") == 0;
+  opts.permit_adjacent_nonterminals = conf.count("permit_adjacent_nonterminals") > 0;
+  opts.require_aligned_terminal = conf.count("no_required_aligned_terminal") == 0;
   const string ps = conf["phrase_language"].as<string>();
-  const bool phrase_s = ps == "source" || ps == "both";
-  const bool phrase_t = ps == "target" || ps == "both";
+  opts.phrase_s = ps == "source" || ps == "both";
+  opts.phrase_t = ps == "target" || ps == "both";
   const string cs = conf["context_language"].as<string>();
-  const bool context_s = cs == "source" || cs == "both";
-  const bool context_t = cs == "target" || cs == "both";
-  const bool x_cdyer_pos = conf.count("x_cdyer_pos");
+  opts.context_s = cs == "source" || cs == "both";
+  opts.context_t = cs == "target" || cs == "both";
+  opts.x_cdyer_pos = conf.count("x_cdyer_pos");
+  if (opts.x_cdyer_pos) {
+    opts.max_base_phrase_size = 1;
+    opts.write_phrase_contexts = true;
+  }
+  const int threads = max(conf["threads"].as<int>(), 1);
+  if (threads > 1 && !opts.write_phrase_contexts && (opts.write_base_phrases || opts.write_base_phrase_spans)) {
+    cerr << "--threads is only supported when extracting rules or phrase contexts\n";
+    return 1;
+  }
+  const int num_shards = conf.count("shards") ? max(conf["shards"].as<int>(), 1) : threads;
   int line = 0;
-  CountCombiner cc(conf["combiner_size"].as<size_t>());
-  HadoopStreamingRuleObserver o(&cc,
-                                conf.count("bidir") > 0);
+  // with a memory budget, an eighth of it goes to the threads' own caches
+  const size_t budget = conf["combiner_memory"].as<size_t>() << 20;
+  const size_t thread_budget = threads > 1 ? budget / 8 : 0;
+  CountCombiner cc(conf["combiner_size"].as<size_t>(),
+                   num_shards,
+                   conf.count("shard_output") ? conf["shard_output"].as<string>() : "",
+                   conf.count("binary") > 0,
+                   budget - thread_budget);
 
-  assert(phrase_s || phrase_t);
-  assert(context_s || context_t);
+  assert(opts.phrase_s || opts.phrase_t);
+  assert(opts.context_s || opts.context_t);
 
   if(backoff) {
     for (int i=0;i < num_categories;++i)
         all_cats.push_back(TD::Convert("X"+boost::lexical_cast<string>(i)));
   }
 
+  // with one thread, count straight into the combiner; otherwise, each
+  // thread extracts an interleaved slice of a block of lines into its own
+  // cache, which it adds to the combiner's shards when it is full
+  size_t cache_limit = cc.size() > 1 ? max<size_t>(cc.size() / threads, 1) : 100000;
+  if (budget) cache_limit = max<size_t>(thread_budget / threads, 1);
+  vector<boost::shared_ptr<ThreadCombiner> > tcs;
+  vector<boost::shared_ptr<ExtractionWorker> > workers;
+  for (int i = 0; i < threads; ++i) {
+    RuleCounter* c = &cc;
+    if (threads > 1) {
+      tcs.push_back(boost::shared_ptr<ThreadCombiner>(new ThreadCombiner(&cc, cache_limit)));
+      c = tcs.back().get();
+    }
+    workers.push_back(boost::shared_ptr<ExtractionWorker>(
+        new ExtractionWorker(opts, c, conf.count("bidir") > 0, all_cats)));
+  }
+  const int kBLOCK = 2000 * threads;
+  vector<string> block;
+  vector<int> block_line_nos;
+
   //SimpleRuleWriter o;
   while(in) {
     ++line;
@@ -403,37 +827,23 @@ int main(int argc, char** argv) {
       if (line % 200 == 0) cerr << '.';
       if (line % 8000 == 0) cerr << " [" << line << "]\n" << flush;
     }
-    sentence.ParseInputLine(buf);
-    if (x_cdyer_pos) {
-      sentence.e = sentence.f;
-      sentence.AllocateForAlignment();
-      for (int i = 0; i < sentence.e.size(); ++i) sentence.Align(i,i);
-      max_base_phrase_size = 1;
-      write_phrase_contexts = true;
-    }
-    phrases.clear();
-    Extract::ExtractBasePhrases(max_base_phrase_size, sentence, &phrases);
-    if (loose_phrases)
-      Extract::LoosenPhraseBounds(sentence, max_base_phrase_size, &phrases);
-    if (phrases.empty()) {
-      cerr << "WARNING no phrases extracted line: " << line << endl;
-      continue;
-    }
-    if (write_phrase_contexts) {
-      WritePhraseContexts(sentence, phrases, ctx_size, phrase_s, phrase_t, context_s, context_t, &cc);
+    if (threads == 1) {
+      workers[0]->ExtractSentence(buf, line);
       continue;
     }
-    if (write_base_phrases) {
-      WriteBasePhrases(sentence, phrases);
-      continue;
-    }
-    if (write_base_phrase_spans) {
-      WriteBasePhraseSpans(sentence, phrases);
-      continue;
-    }
-    Extract::AnnotatePhrasesWithCategoryTypes(default_cat, sentence.span_types, &phrases);
-    Extract::ExtractConsistentRules(sentence, phrases, max_vars, max_syms, permit_adjacent_nonterminals, require_aligned_terminal, &o, &all_cats);
+    block.push_back(buf);
+    block_line_nos.push_back(line);
+    if (block.size() == kBLOCK)
+      ExtractBlock(workers, &block, &block_line_nos);
+  }
+  if (!block.empty())
+    ExtractBlock(workers, &block, &block_line_nos);
+  for (int i = 0; i < tcs.size(); ++i)
+    tcs[i]->Flush();
+  cc.Flush();
+  if (!silent) {
+    cerr << endl;
+    cc.ReportStats(&cerr);
   }
-  if (!silent) cerr << endl;
   return 0;
 }
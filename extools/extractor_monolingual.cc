@@ -1,9 +1,15 @@
 #include <iostream>
+#include <sstream>
 #include <vector>
 #include <utility>
+#include <algorithm>
 #include <tr1/unordered_map>
+#include <stdint.h>
 
+#include <boost/bind.hpp>
 #include <boost/functional/hash.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
 #include <boost/lexical_cast.hpp>
@@ -29,6 +35,8 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
         ("phrase_context_size,S", po::value<int>()->default_value(2), "Use this many words of context on left and write when writing base phrase contexts")
         ("combiner_size,c", po::value<size_t>()->default_value(30000), "Number of unique items to store in cache before writing rule counts. Set to 1 to disable cache. Set to 0 for no limit.")
         ("prune", po::value<size_t>()->default_value(0), "Prune items with count less than threshold; applies each time the cache is dumped.")
+        ("aggregate,a", "Count everything in memory and write the final counts of each phrase once, sorted by phrase, as contexts_corpus reads them")
+        ("threads,j", po::value<int>()->default_value(1), "Extract contexts on this many threads (with --aggregate)")
         ("silent", "Write nothing to stderr except errors")
         ("help,h", "Print this help message and exit");
   po::options_description clo("Command line options");
@@ -47,7 +55,7 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
 
 struct TrieNode
 {
-  TrieNode(int l) : finish(false), length(l) {};
+  TrieNode(int l) : finish(false), length(l), id(-1) {};
   ~TrieNode()
   {
     for (unordered_map<int, TrieNode*>::iterator
@@ -66,15 +74,18 @@ struct TrieNode
       return 0;
   }
 
-  void insert(const vector<int> &tokens)
+  // returns the node that finishes tokens
+  TrieNode *insert(const vector<int> &tokens)
   {
-    insert(tokens.begin(), tokens.end());
+    return insert(tokens.begin(), tokens.end());
   }
 
-  void insert(vector<int>::const_iterator begin, vector<int>::const_iterator end)
+  TrieNode *insert(vector<int>::const_iterator begin, vector<int>::const_iterator end)
   {
-    if (begin == end)
+    if (begin == end) {
       finish = true;
+      return this;
+    }
     else
     {
       int token = *begin;
@@ -83,12 +94,13 @@ struct TrieNode
       if (nit == next.end())
         nit = next.insert(make_pair(token, new TrieNode(length+1))).first;
       ++begin;
-      nit->second->insert(begin, end);
+      return nit->second->insert(begin, end);
     }
   }
 
   bool finish;
   int length;
+  int id;  // index of the phrase this node finishes, -1 if none
   unordered_map<int, TrieNode*> next;
 };
 
@@ -144,21 +156,50 @@ struct CountCombiner {
   unordered_map<vector<WordID>, Vec2PhraseCount, boost::hash<vector<WordID> > > cache;
 };
 
+void GetContext(const vector<int>& sentence, int start, int end, int ctx_size, vector<WordID>* context)
+{
+  context->clear();
+  for (int i = ctx_size; i > 0; --i)
+    context->push_back(sentence[start-i]);
+  context->push_back(kGAP);
+  for (int i = 0; i < ctx_size; ++i)
+    context->push_back(sentence[end+i]);
+}
+
 void WriteContext(const vector<int>& sentence, int start, int end, int ctx_size, CountCombiner &combiner) 
 {
   vector<WordID> phrase, context;
   for (int i = start; i < end; ++i)
       phrase.push_back(sentence[i]);
-
-  for (int i = ctx_size; i > 0; --i)
-    context.push_back(sentence[start-i]);
-  context.push_back(kGAP);
-  for (int i = 0; i < ctx_size; ++i)
-    context.push_back(sentence[end+i]);
-
+  GetContext(sentence, start, end, ctx_size, &context);
   combiner.Count(phrase, context, 1);
 }
 
+// sets *matches to the (phrase node, start) of every occurrence of a
+// phrase of the trie in a sentence padded with ctx_size words
+void MatchPhrases(const vector<int>& sentence, int ctx_size, TrieNode* phrase_trie,
+                  vector<pair<const TrieNode*, int> >* matches)
+{
+  matches->clear();
+  vector<TrieNode*> tries;
+  for (int i = ctx_size; i < (int)sentence.size() - ctx_size; ++i)
+  {
+    vector<TrieNode*> tries_prime;
+    tries.push_back(phrase_trie);
+    for (vector<TrieNode*>::iterator tit = tries.begin(); tit != tries.end(); ++tit)
+    {
+      TrieNode* next = (*tit)->follow(sentence[i]);
+      if (next != 0)
+      {
+        if (next->finish)
+          matches->push_back(make_pair(next, i + 1 - next->length));
+        tries_prime.push_back(next);
+      }
+    }
+    swap(tries, tries_prime);
+  }
+}
+
 inline bool IsWhitespace(char c) { 
     return c == ' ' || c == '\t'; 
 }
@@ -192,6 +233,122 @@ vector<int> ReadSentence(const char *buf, int padding)
   return sentence;
 }
 
+// counts of (phrase, context) pairs for --aggregate.  each thread has its
+// own contexts, numbered as it first sees them, and counts each pair under
+// a 64-bit key packing the phrase id with its context id, so extraction
+// takes no locks.  the counts are split into shards by phrase id; when all
+// lines are read, each shard is reduced on its own thread, joining the
+// threads' counts of its phrases, and the phrases of all shards are
+// written sorted by phrase, each with its contexts sorted.
+class ContextCounter {
+ public:
+  ContextCounter(TrieNode* trie, const vector<vector<WordID> >& phrases, int ctx_size, int threads, size_t prune) :
+      trie_(trie), phrases_(phrases), ctx_size_(ctx_size), threads_(threads), prune_(prune), workers_(threads) {
+    for (int t = 0; t < threads; ++t)
+      workers_[t].reset(new Worker(threads));
+  }
+
+  // extracts every stride'th line of lines, starting with the first'th
+  void ExtractLines(const vector<string>* lines, int first) {
+    Worker& w = *workers_[first];
+    for (int i = first; i < lines->size(); i += threads_) {
+      const vector<int> sentence = ReadSentence((*lines)[i].c_str(), ctx_size_);
+      MatchPhrases(sentence, ctx_size_, trie_, &w.matches);
+      for (int m = 0; m < w.matches.size(); ++m) {
+        const TrieNode* n = w.matches[m].first;
+        const int start = w.matches[m].second;
+        GetContext(sentence, start, start + n->length, ctx_size_, &w.context);
+        Context2ID::iterator it = w.ids.find(w.context);
+        if (it == w.ids.end()) {
+          it = w.ids.insert(make_pair(w.context, w.contexts.size())).first;
+          w.contexts.push_back(w.context);
+        }
+        const uint64_t key = (static_cast<uint64_t>(n->id) << 32) | it->second;
+        ++w.counts[n->id % threads_][key];
+      }
+    }
+  }
+
+  // extracts a block of lines with one thread per worker, then empties it
+  void ExtractBlock(vector<string>* block) {
+    boost::thread_group group;
+    for (int t = 0; t < threads_; ++t)
+      group.create_thread(boost::bind(&ContextCounter::ExtractLines, this, block, t));
+    group.join_all();
+    block->clear();
+  }
+
+  void Write(ostream* out) {
+    vector<vector<pair<string, string> > > lines(threads_);
+    boost::thread_group group;
+    for (int s = 0; s < threads_; ++s)
+      group.create_thread(boost::bind(&ContextCounter::ReduceShard, this, s, &lines[s]));
+    group.join_all();
+    vector<const pair<string, string>*> sorted;
+    for (int s = 0; s < threads_; ++s)
+      for (int i = 0; i < lines[s].size(); ++i)
+        sorted.push_back(&lines[s][i]);
+    sort(sorted.begin(), sorted.end(), PhraseLess());
+    for (int i = 0; i < sorted.size(); ++i)
+      *out << sorted[i]->first << '\t' << sorted[i]->second << '\n';
+    *out << flush;
+  }
+
+ private:
+  typedef unordered_map<vector<WordID>, uint32_t, boost::hash<vector<WordID> > > Context2ID;
+  typedef unordered_map<uint64_t, int> PackedCounts;
+
+  struct Worker {
+    explicit Worker(int shards) : counts(shards) {}
+    Context2ID ids;
+    vector<vector<WordID> > contexts;
+    vector<PackedCounts> counts;  // by shard
+    vector<pair<const TrieNode*, int> > matches;
+    vector<WordID> context;
+  };
+
+  struct PhraseLess {
+    bool operator()(const pair<string, string>* a, const pair<string, string>* b) const {
+      return a->first < b->first;
+    }
+  };
+
+  // sets *lines to the (phrase, contexts) of the phrases of shard s
+  void ReduceShard(int s, vector<pair<string, string> >* lines) const {
+    typedef unordered_map<vector<WordID>, int, boost::hash<vector<WordID> > > ContextCounts;
+    unordered_map<int, ContextCounts> by_phrase;
+    for (int t = 0; t < workers_.size(); ++t) {
+      const Worker& w = *workers_[t];
+      const PackedCounts& c = w.counts[s];
+      for (PackedCounts::const_iterator it = c.begin(); it != c.end(); ++it)
+        by_phrase[it->first >> 32][w.contexts[it->first & 0xffffffff]] += it->second;
+    }
+    vector<pair<string, int> > contexts;
+    ostringstream os;
+    for (unordered_map<int, ContextCounts>::const_iterator pi = by_phrase.begin(); pi != by_phrase.end(); ++pi) {
+      contexts.clear();
+      for (ContextCounts::const_iterator ci = pi->second.begin(); ci != pi->second.end(); ++ci)
+        if (prune_ <= 1 || ci->second >= prune_)
+          contexts.push_back(make_pair(TD::GetString(ci->first), ci->second));
+      if (contexts.empty()) continue;
+      sort(contexts.begin(), contexts.end());
+      os.str("");
+      for (int i = 0; i < contexts.size(); ++i) {
+        if (i) os << " ||| ";
+        os << contexts[i].first << " ||| C=" << contexts[i].second;
+      }
+      lines->push_back(make_pair(TD::GetString(phrases_[pi->first]), os.str()));
+    }
+  }
+
+  TrieNode* trie_;
+  const vector<vector<WordID> >& phrases_;
+  const int ctx_size_;
+  const int threads_;
+  const size_t prune_;
+  vector<boost::shared_ptr<Worker> > workers_;
+};
+
 int main(int argc, char** argv) 
 {
   po::variables_map conf;
@@ -204,17 +361,38 @@ int main(int argc, char** argv)
 
   bool silent = conf.count("silent") > 0;
   const int ctx_size = conf["phrase_context_size"].as<int>();
-  CountCombiner cc(conf["combiner_size"].as<size_t>(), conf["prune"].as<size_t>());
+  const bool aggregate = conf.count("aggregate") > 0;
+  const int threads = max(conf["threads"].as<int>(), 1);
+  if (threads > 1 && !aggregate) {
+    cerr << "--threads requires --aggregate\n";
+    return 1;
+  }
 
   char buf[MAX_LINE_LENGTH];
   TrieNode phrase_trie(0);
+  vector<vector<WordID> > phrases;
   ReadFile rpf(conf["phrases"].as<string>());
   istream& pin = *rpf.stream();
   while (pin) {
       pin.getline(buf, MAX_LINE_LENGTH);
-      phrase_trie.insert(ReadSentence(buf, 0));
+      const vector<int> phrase = ReadSentence(buf, 0);
+      TrieNode* n = phrase_trie.insert(phrase);
+      if (n->id < 0) {
+        n->id = phrases.size();
+        phrases.push_back(phrase);
+      }
   }
 
+  boost::shared_ptr<CountCombiner> cc;
+  boost::shared_ptr<ContextCounter> counter;
+  if (aggregate)
+    counter.reset(new ContextCounter(&phrase_trie, phrases, ctx_size, threads, conf["prune"].as<size_t>()));
+  else
+    cc.reset(new CountCombiner(conf["combiner_size"].as<size_t>(), conf["prune"].as<size_t>()));
+  const int kBLOCK = 2000 * threads;
+  vector<string> block;
+  vector<pair<const TrieNode*, int> > matches;
+
   ReadFile rif(conf["input"].as<string>());
   istream &iin = *rif.stream();
   int line = 0;
@@ -227,29 +405,21 @@ int main(int argc, char** argv)
       if (line % 200 == 0) cerr << '.';
       if (line % 8000 == 0) cerr << " [" << line << "]\n" << flush;
     }
+    if (aggregate) {
+      block.push_back(buf);
+      if (block.size() == kBLOCK) counter->ExtractBlock(&block);
+      continue;
+    }
 
     vector<int> sentence = ReadSentence(buf, ctx_size);
     //cout << "sentence: " << TD::GetString(sentence) << endl;
-    vector<TrieNode*> tries;
-    for (int i = ctx_size; i < (int)sentence.size() - ctx_size; ++i)
-    {
-      //cout << "i: " << i << " token: " << TD::Convert(sentence[i]) << " tries: " << tries.size() << endl;
-      vector<TrieNode*> tries_prime;
-      tries.push_back(&phrase_trie);
-      for (vector<TrieNode*>::iterator tit = tries.begin(); tit != tries.end(); ++tit)
-      {
-        TrieNode* next = (*tit)->follow(sentence[i]);
-        if (next != 0)
-        {
-          //cout << "\tfollowed edge: " << next->finish << endl;
-          if (next->finish)
-            WriteContext(sentence, i + 1 - next->length, i + 1, ctx_size, cc);
-          tries_prime.push_back(next);
-        }
-      }
-      swap(tries, tries_prime);
-    }
-    //cout << "/sentence" << endl;
+    MatchPhrases(sentence, ctx_size, &phrase_trie, &matches);
+    for (int m = 0; m < matches.size(); ++m)
+      WriteContext(sentence, matches[m].second, matches[m].second + matches[m].first->length, ctx_size, *cc);
+  }
+  if (aggregate) {
+    if (!block.empty()) counter->ExtractBlock(&block);
+    counter->Write(&cout);
   }
   if (!silent) cerr << endl;
   return 0;
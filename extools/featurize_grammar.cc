@@ -6,8 +6,13 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <deque>
 #include <utility>
+#include <algorithm>
+#include <cstdio>
 #include <cstdlib>
+#include <fstream>
+#include <unistd.h>
 #include <tr1/unordered_map>
 
 #include "lex_trans_tbl.h"
@@ -21,6 +26,8 @@
 
 #include <boost/tuple/tuple.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
 #include <boost/functional/hash.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
@@ -31,7 +38,7 @@ using boost::shared_ptr;
 namespace po = boost::program_options;
 
 static string aligned_corpus;
-static const size_t MAX_LINE_LENGTH = 64000000;
+static string lex_table;
 
 // Data structures for indexing and counting rules
 //typedef boost::tuple< WordID, vector<WordID>, vector<WordID> > RuleTuple;
@@ -184,6 +191,10 @@ void InitCommandLine(const FERegistry& r, int argc, char** argv, po::variables_m
         ("list_features,L", "List extractable features")
         ("feature,f", po::value<vector<string> >()->composing(), feats.str().c_str())
         ("aligned_corpus,c", po::value<string>(), "Aligned corpus (single line format)")
+        ("lex_table,T", po::value<string>(), "Binary lexical table for LexProb. Mapped if the file exists, otherwise computed from the aligned corpus and saved there")
+        ("unfiltered_grammar,u", po::value<string>()->default_value("-"), "Unfiltered grammar (default: standard input)")
+        ("threads,j", po::value<int>()->default_value(1), "Featurize on this many threads")
+        ("max_rules_in_memory,M", po::value<size_t>()->default_value(0), "Featurize the filtered grammar in chunks of about this many rules, reading the unfiltered grammar once per chunk. 0 for no limit")
         ("help,h", "Print this help message and exit");
   po::options_description clo("Command line options");
   po::options_description dcmdline_options;
@@ -192,8 +203,11 @@ void InitCommandLine(const FERegistry& r, int argc, char** argv, po::variables_m
   po::store(parse_command_line(argc, argv, dcmdline_options), *conf);
   po::notify(*conf);
 
-  if (conf->count("help") || conf->count("aligned_corpus")==0 || conf->count("feature") == 0) {
+  if (conf->count("help") || (conf->count("aligned_corpus")==0 && conf->count("lex_table")==0) || conf->count("feature") == 0) {
     cerr << "\nUsage: featurize_grammar -g FILTERED-GRAMMAR.gz -c ALIGNED_CORPUS.fr-en-al -f Feat1 -f Feat2 ... < UNFILTERED-GRAMMAR\n";
+    cerr << "Without a limit on the rules held in memory, all rules of the\n";
+    cerr << "filtered grammar and the statistics the features need about them are\n";
+    cerr << "kept in memory at once.\n";
     cerr << dcmdline_options << endl;
     exit(1);
   }
@@ -201,46 +215,6 @@ void InitCommandLine(const FERegistry& r, int argc, char** argv, po::variables_m
 
 static const bool DEBUG = false;
 
-void LexTranslationTable::createTTable(const char* buf){
-  AnnotatedParallelSentence sent;
-  sent.ParseInputLine(buf);
-
-  //iterate over the alignment to compute aligned words
-
-  for(int i =0;i<sent.aligned.width();i++)
-    {
-      for (int j=0;j<sent.aligned.height();j++)
-        {
-          if (DEBUG) cerr << sent.aligned(i,j) << " ";
-          if( sent.aligned(i,j))
-            {
-              if (DEBUG) cerr << TD::Convert(sent.f[i])  << " aligned to " << TD::Convert(sent.e[j]);
-              ++word_translation[pair<WordID,WordID> (sent.f[i], sent.e[j])];
-              ++total_foreign[sent.f[i]];
-              ++total_english[sent.e[j]];
-            }
-        }
-      if (DEBUG)  cerr << endl;
-    }
-  if (DEBUG) cerr << endl;
-
-  const WordID NULL_ = TD::Convert("NULL");
-  //handle unaligned words - align them to null
-  for (int j =0; j < sent.e_len; j++) {
-    if (sent.e_aligned[j]) continue;
-    ++word_translation[pair<WordID,WordID> (NULL_, sent.e[j])];
-    ++total_foreign[NULL_];
-    ++total_english[sent.e[j]];
-  }
-
-  for (int i =0; i < sent.f_len; i++) {
-    if (sent.f_aligned[i]) continue;
-    ++word_translation[pair<WordID,WordID> (sent.f[i], NULL_)];
-    ++total_english[NULL_];
-    ++total_foreign[sent.f[i]];
-  }
-}
-
 inline float safenlog(float v) {
   if (v == 1.0f) return 0.0f;
   float res = -log(v);
@@ -535,18 +509,16 @@ struct LabellingShape: public FeatureExtractor {
 // in BOTH directions.
 struct LexProbExtractor : public FeatureExtractor {
   LexProbExtractor() :
-      e2f_(FD::Convert("LexE2F")), f2e_(FD::Convert("LexF2E")) {
-    ReadFile rf(aligned_corpus);
-    //create lexical translation table
-    cerr << "Computing lexical translation probabilities from " << aligned_corpus << "..." << endl;
-    char* buf = new char[MAX_LINE_LENGTH];
-    istream& alignment = *rf.stream();
-    while(alignment) {
-      alignment.getline(buf, MAX_LINE_LENGTH);
-      if (buf[0] == 0) continue;
-      table.createTTable(buf);
-    }
-    delete[] buf;
+      e2f_(FD::Convert("LexE2F")), f2e_(FD::Convert("LexF2E")), NULL_(TD::Convert("NULL")), table(Table()) {}
+
+  // extractors are created again for each chunk of the filtered grammar,
+  // but the table is computed (or mapped) only once
+  static LexTranslationTable& Table() {
+    static LexTranslationTable* t = NULL;
+    if (t) return *t;
+    t = new LexTranslationTable;
+    t->Load(aligned_corpus, lex_table);
+    return *t;
   }
 
   virtual void ExtractFeatures(const WordID /*lhs*/,
@@ -567,12 +539,14 @@ struct LexProbExtractor : public FeatureExtractor {
             }
 
             //Lookup this alignment probability in the table
-            int temp = table.word_translation[pair<WordID,WordID> (src[ita->first],trg[ita->second])];
+            int temp = table.Count(src[ita->first],trg[ita->second]);
             float f2e=0, e2f=0;
-            if ( table.total_foreign[src[ita->first]] != 0)
-              f2e = (float) temp / table.total_foreign[src[ita->first]];
-            if ( table.total_english[trg[ita->second]] !=0 )
-              e2f = (float) temp / table.total_english[trg[ita->second]];
+            const int total_f = table.TotalForeign(src[ita->first]);
+            const int total_e = table.TotalEnglish(trg[ita->second]);
+            if (total_f != 0)
+              f2e = (float) temp / total_f;
+            if (total_e != 0)
+              e2f = (float) temp / total_e;
             if (DEBUG) printf (" %d %E %E\n", temp, f2e, e2f);
 
             //local counts to keep track of which things haven't been aligned, to later compute their null alignment
@@ -592,11 +566,10 @@ struct LexProbExtractor : public FeatureExtractor {
           }
 
           float final_lex_f2e=1, final_lex_e2f=1;
-          static const WordID NULL_ = TD::Convert("NULL");
 
           //compute lexical weight P(F|E) and include unaligned foreign words
            for(int i=0;i<src.size(); i++) {
-               if (!table.total_foreign.count(src[i])) continue;      //if we dont have it in the translation table, we won't know its lexical weight
+               if (!table.TotalForeign(src[i])) continue;      //if we dont have it in the translation table, we won't know its lexical weight
 
                if (foreign_aligned.count(src[i]))
                  {
@@ -605,8 +578,8 @@ struct LexProbExtractor : public FeatureExtractor {
                  }
                else //dealing with null alignment
                  {
-                   int temp_count = table.word_translation[pair<WordID,WordID> (src[i],NULL_)];
-                   float temp_e2f = (float) temp_count / table.total_english[NULL_];
+                   int temp_count = table.Count(src[i],NULL_);
+                   float temp_e2f = (float) temp_count / table.TotalEnglish(NULL_);
                    final_lex_e2f *= temp_e2f;
                  }
 
@@ -614,7 +587,7 @@ struct LexProbExtractor : public FeatureExtractor {
 
            //compute P(E|F) unaligned english words
            for(int j=0; j< trg.size(); j++) {
-               if (!table.total_english.count(trg[j])) continue;
+               if (!table.TotalEnglish(trg[j])) continue;
 
                if (english_aligned.count(trg[j]))
                  {
@@ -623,8 +596,8 @@ struct LexProbExtractor : public FeatureExtractor {
                  }
                else //dealing with null
                  {
-                   int temp_count = table.word_translation[pair<WordID,WordID> (NULL_,trg[j])];
-                   float temp_f2e = (float) temp_count / table.total_foreign[NULL_];
+                   int temp_count = table.Count(NULL_,trg[j]);
+                   float temp_f2e = (float) temp_count / table.TotalForeign(NULL_);
                    final_lex_f2e *= temp_f2e;
                  }
            }
@@ -632,40 +605,157 @@ struct LexProbExtractor : public FeatureExtractor {
      result->set_value(f2e_, safenlog(final_lex_f2e));
   }
   const int e2f_, f2e_;
-  mutable LexTranslationTable table;
+  const WordID NULL_;
+  const LexTranslationTable& table;
 };
 
+// the filtered grammar is featurized in chunks of consecutive stripes.
+// the extractors only keep statistics about the rules of one chunk, which
+// bounds the memory they need by the chunk size, and the unfiltered grammar
+// is read once per chunk to collect them.
+//
+// with more than one thread, stripes of the unfiltered and the filtered
+// grammar are buffered in blocks.  a block of the unfiltered grammar is
+// observed by all threads at once, each thread feeding a fixed subset of
+// the extractors, since an extractor's statistics belong to it alone.  the
+// rules of a block of the filtered grammar are split over the threads,
+// since ExtractFeatures only reads the statistics, and the lines are
+// written in the original order
 struct Featurizer {
-  Featurizer(const vector<boost::shared_ptr<FeatureExtractor> >& ex) : extractors(ex) {
-  }
+  Featurizer(const vector<boost::shared_ptr<FeatureExtractor> >& ex, size_t first_stripe, size_t max_rules, int threads) :
+      extractors(ex), max_rules_(max_rules), threads_(threads), first_(first_stripe), end_(first_stripe),
+      cur_(), rules_(), more_(false), block_rules_() {}
   void Callback1(WordID lhs, const vector<WordID>& src, const ID2RuleStatistics& trgs) {
+    const size_t stripe = cur_++;
+    if (stripe < first_) return;
+    if (stripe > end_ || (max_rules_ && rules_ >= max_rules_)) {
+      more_ = true;
+      return;
+    }
+    ++end_;
+    rules_ += trgs.size();
     for (ID2RuleStatistics::const_iterator it = trgs.begin(); it != trgs.end(); ++it) {
       for (int i = 0; i < extractors.size(); ++i)
         extractors[i]->ObserveFilteredRule(lhs, src, it->first);
     }
   }
   void Callback2(WordID lhs, const vector<WordID>& src, const ID2RuleStatistics& trgs) {
+    if (threads_ > 1) {
+      if (Buffer(lhs, src, trgs)) ObserveBlock();
+      return;
+    }
     for (ID2RuleStatistics::const_iterator it = trgs.begin(); it != trgs.end(); ++it) {
       for (int i = 0; i < extractors.size(); ++i)
         extractors[i]->ObserveUnfilteredRule(lhs, src, it->first, it->second);
     }
   }
   void Callback3(WordID lhs, const vector<WordID>& src, const ID2RuleStatistics& trgs) {
-    for (ID2RuleStatistics::const_iterator it = trgs.begin(); it != trgs.end(); ++it) {
-      SparseVector<float> feats;
-      for (int i = 0; i < extractors.size(); ++i)
-        extractors[i]->ExtractFeatures(lhs, src, it->first, it->second, &feats);
-      cout << '[' << TD::Convert(-lhs) << "] ||| ";
-      WriteNamed(src, &cout);
-      cout << " ||| ";
-      WriteAnonymous(it->first, &cout);
-      cout << " ||| ";
-      print(cout,feats,"=");
-      cout << endl;
+    const size_t stripe = cur_++;
+    if (stripe < first_ || stripe >= end_) return;
+    if (threads_ > 1) {
+      if (Buffer(lhs, src, trgs)) FeaturizeBlock();
+      return;
     }
-  }
+    for (ID2RuleStatistics::const_iterator it = trgs.begin(); it != trgs.end(); ++it)
+      WriteRule(lhs, src, it, &cout);
+  }
+  // call after reading the unfiltered grammar (2) or the filtered one (3)
+  void Finish2() { if (!block_.empty()) ObserveBlock(); }
+  void Finish3() { if (!block_.empty()) FeaturizeBlock(); }
+  // call before reading the filtered grammar again
+  void Rewind() { cur_ = 0; }
+
+  // the chunk is stripes [first(), end()) of the filtered grammar
+  size_t first() const { return first_; }
+  size_t end() const { return end_; }
+  size_t rules() const { return rules_; }
+  // true if stripes follow the chunk
+  bool more() const { return more_; }
+
  private:
+  struct Stripe {
+    WordID lhs;
+    vector<WordID> src;
+    ID2RuleStatistics trgs;
+  };
+  enum { kBLOCK_RULES = 50000 };
+
+  void WriteRule(WordID lhs, const vector<WordID>& src, ID2RuleStatistics::const_iterator it, ostream* out) const {
+    SparseVector<float> feats;
+    for (int i = 0; i < extractors.size(); ++i)
+      extractors[i]->ExtractFeatures(lhs, src, it->first, it->second, &feats);
+    *out << '[' << TD::Convert(-lhs) << "] ||| ";
+    WriteNamed(src, out);
+    *out << " ||| ";
+    WriteAnonymous(it->first, out);
+    *out << " ||| ";
+    print(*out,feats,"=");
+    *out << '\n';
+  }
+
+  // returns true when the block is full
+  bool Buffer(WordID lhs, const vector<WordID>& src, const ID2RuleStatistics& trgs) {
+    block_.resize(block_.size() + 1);
+    Stripe& s = block_.back();
+    s.lhs = lhs;
+    s.src = src;
+    s.trgs = trgs;
+    block_rules_ += trgs.size();
+    return block_rules_ >= kBLOCK_RULES;
+  }
+
+  void ObserveWith(int t) {
+    for (int j = 0; j < block_.size(); ++j) {
+      const Stripe& s = block_[j];
+      for (ID2RuleStatistics::const_iterator it = s.trgs.begin(); it != s.trgs.end(); ++it)
+        for (int i = t; i < extractors.size(); i += threads_)
+          extractors[i]->ObserveUnfilteredRule(s.lhs, s.src, it->first, it->second);
+    }
+  }
+
+  void ObserveBlock() {
+    boost::thread_group workers;
+    for (int t = 0; t < threads_ && t < extractors.size(); ++t)
+      workers.create_thread(boost::bind(&Featurizer::ObserveWith, this, t));
+    workers.join_all();
+    block_.clear();
+    block_rules_ = 0;
+  }
+
+  void FeaturizeStripes(int t, vector<string>* out) const {
+    ostringstream os;
+    for (int j = t; j < block_.size(); j += threads_) {
+      os.str("");
+      const Stripe& s = block_[j];
+      for (ID2RuleStatistics::const_iterator it = s.trgs.begin(); it != s.trgs.end(); ++it)
+        WriteRule(s.lhs, s.src, it, &os);
+      (*out)[j] = os.str();
+    }
+  }
+
+  void FeaturizeBlock() {
+    vector<string> out(block_.size());
+    boost::thread_group workers;
+    for (int t = 0; t < threads_; ++t)
+      workers.create_thread(boost::bind(&Featurizer::FeaturizeStripes, this, t, &out));
+    workers.join_all();
+    for (int j = 0; j < out.size(); ++j)
+      cout << out[j];
+    cout << flush;
+    block_.clear();
+    block_rules_ = 0;
+  }
+
   vector<boost::shared_ptr<FeatureExtractor> > extractors;
+  const size_t max_rules_;
+  const int threads_;
+  const size_t first_;
+  size_t end_;
+  size_t cur_;
+  size_t rules_;
+  bool more_;
+  deque<Stripe> block_;  // not a vector, which would copy the stripes as it grows
+  size_t block_rules_;
 };
 
 void cb1(WordID lhs, const vector<WordID>& src_rhs, const ID2RuleStatistics& rules, void* extra) {
@@ -680,6 +770,32 @@ void cb3(WordID lhs, const vector<WordID>& src_rhs, const ID2RuleStatistics& rul
   static_cast<Featurizer*>(extra)->Callback3(lhs, src_rhs, rules);
 }
 
+// copies standard input to a temporary file so that it can be read more
+// than once.  the file is unlinked when it is closed
+struct SpooledInput {
+  SpooledInput() {
+    const char* tmpdir = getenv("TMPDIR");
+    string tmpl = string(tmpdir ? tmpdir : "/tmp") + "/featurize_grammar.XXXXXX";
+    vector<char> name(tmpl.begin(), tmpl.end());
+    name.push_back(0);
+    const int fd = mkstemp(&name[0]);
+    if (fd < 0) {
+      cerr << "Failed to create a temporary file in " << (tmpdir ? tmpdir : "/tmp") << endl;
+      exit(1);
+    }
+    close(fd);
+    filename = &name[0];
+    ofstream out(filename.c_str());
+    out << cin.rdbuf();
+    if (!out) {
+      cerr << "Failed to copy the unfiltered grammar to " << filename << endl;
+      exit(1);
+    }
+  }
+  ~SpooledInput() { unlink(filename.c_str()); }
+  string filename;
+};
+
 int main(int argc, char** argv){
   FERegistry reg;
   reg.Register("LogRuleCount", new FEFactory<LogRuleCount>);
@@ -692,25 +808,47 @@ int main(int argc, char** argv){
   reg.Register("GenerativeProb", new FEFactory<GenerativeProb>);
   po::variables_map conf;
   InitCommandLine(reg, argc, argv, &conf);
-  aligned_corpus = conf["aligned_corpus"].as<string>();  // GLOBAL VAR
-  ReadFile fg1(conf["filtered_grammar"].as<string>());
+  if (conf.count("aligned_corpus")) aligned_corpus = conf["aligned_corpus"].as<string>();  // GLOBAL VAR
+  if (conf.count("lex_table")) lex_table = conf["lex_table"].as<string>();  // GLOBAL VAR
+  const string filtered_grammar = conf["filtered_grammar"].as<string>();
+  string unfiltered_grammar = conf["unfiltered_grammar"].as<string>();
+  const size_t max_rules = conf["max_rules_in_memory"].as<size_t>();
+  const int threads = max(conf["threads"].as<int>(), 1);
+  boost::shared_ptr<SpooledInput> spool;
 
   vector<string> feats = conf["feature"].as<vector<string> >();
-  vector<boost::shared_ptr<FeatureExtractor> > extractors(feats.size());
-  for (int i = 0; i < feats.size(); ++i)
-    extractors[i] = reg.Create(feats[i]);
-  Featurizer fizer(extractors);
-
-  cerr << "Reading filtered grammar to detect keys..." << endl;
-  StripedGrammarLexer::ReadStripedGrammar(fg1.stream(), cb1, &fizer);
+  size_t first = 0;
+  for (int chunk = 0; ; ++chunk) {
+    vector<boost::shared_ptr<FeatureExtractor> > extractors(feats.size());
+    for (int i = 0; i < feats.size(); ++i)
+      extractors[i] = reg.Create(feats[i]);
+    Featurizer fizer(extractors, first, max_rules, threads);
+
+    cerr << "Reading filtered grammar to detect keys..." << endl;
+    ReadFile fg1(filtered_grammar);
+    StripedGrammarLexer::ReadStripedGrammar(fg1.stream(), cb1, &fizer);
+    if (fizer.more() || chunk > 0)
+      cerr << "Chunk " << chunk << ": stripes " << fizer.first() << " to " << fizer.end()
+           << ", " << fizer.rules() << " rules" << endl;
+    if (fizer.more() && !spool && unfiltered_grammar == "-") {
+      cerr << "Copying the unfiltered grammar to a temporary file..." << endl;
+      spool.reset(new SpooledInput);
+      unfiltered_grammar = spool->filename;
+    }
 
-  cerr << "Reading unfiltered grammar..." << endl;
-  StripedGrammarLexer::ReadStripedGrammar(&cin, cb2, &fizer);
+    cerr << "Reading unfiltered grammar..." << endl;
+    ReadFile ug(unfiltered_grammar);
+    StripedGrammarLexer::ReadStripedGrammar(ug.stream(), cb2, &fizer);
+    fizer.Finish2();
 
-  ReadFile fg2(conf["filtered_grammar"].as<string>());
-  cerr << "Reading filtered grammar and adding features..." << endl;
-  StripedGrammarLexer::ReadStripedGrammar(fg2.stream(), cb3, &fizer);
+    ReadFile fg2(filtered_grammar);
+    cerr << "Reading filtered grammar and adding features..." << endl;
+    fizer.Rewind();
+    StripedGrammarLexer::ReadStripedGrammar(fg2.stream(), cb3, &fizer);
+    fizer.Finish3();
+    if (!fizer.more()) break;
+    first = fizer.end();
+  }
 
   return 0;
 }
-
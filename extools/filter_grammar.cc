@@ -5,10 +5,11 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <deque>
 #include <utility>
+#include <algorithm>
 #include <tr1/unordered_map>
 
-#include "suffix_tree.h"
 #include "sparse_vector.h"
 #include "sentence_pair.h"
 #include "extract.h"
@@ -18,6 +19,8 @@
 #include "striped_grammar.h"
 
 #include <boost/shared_ptr.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
 #include <boost/functional/hash.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
@@ -33,6 +36,8 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   opts.add_options()
         ("test_set,t", po::value<string>(), "Filter for this test set")
         ("top_e_given_f,n", po::value<size_t>()->default_value(30), "Keep top N rules, according to p(e|f). 0 for all")
+        ("threads,j", po::value<int>()->default_value(1), "Filter on this many threads")
+        ("binary", "Write binary stripes (see striped_grammar.h) instead of text")
         ("help,h", "Print this help message and exit");
   po::options_description clo("Command line options");
   po::options_description dcmdline_options;
@@ -54,17 +59,30 @@ struct SourceFilter {
   virtual ~SourceFilter() {}
 };
 
-struct DumbSuffixTreeFilter : SourceFilter {
-  DumbSuffixTreeFilter(const string& corpus) {
-    cerr << "Build suffix tree from test set in " << corpus << endl;
+// index of the test set for matching rule sources.  a trie holds every
+// n-gram of the test set of up to kMAX_NGRAM words, and each trie node the
+// sorted list of (sentence, position) pairs at which its n-gram occurs.
+// once built, the trie is frozen into flat arrays: the children of a node
+// are a contiguous range of edges sorted by word, found by binary search,
+// and its occurrences a contiguous range of one position array.
+//
+// a rule source is a sequence of terminal runs separated by nonterminals,
+// each of which covers at least one word.  the runs are matched left to
+// right, intersecting the occurrences of each run with the sentences in
+// which the runs before it fit, and keeping for each such sentence the
+// earliest position at which the next run may start.  a rule is kept only
+// if all its runs occur in one test sentence, in order and with room for
+// its nonterminals (the suffix tree filter used before checked each run
+// on its own, anywhere in the test set).
+class TestSetIndex : public SourceFilter {
+ public:
+  explicit TestSetIndex(const string& corpus) : max_len_() {
+    cerr << "Build n-gram index from test set in " << corpus << endl;
     assert(FileExists(corpus));
     ReadFile rfts(corpus);
     istream& testSet = *rfts.stream();
     char* buf = new char[MAX_LINE_LENGTH];
     AnnotatedParallelSentence sent;
-
-    /* process the data set to build suffix tree
-     */
     while(!testSet.eof()) {
       testSet.getline(buf, MAX_LINE_LENGTH);
       if (buf[0] == 0) continue;
@@ -72,64 +90,254 @@ struct DumbSuffixTreeFilter : SourceFilter {
       //hack to read in the test set using AnnotatedParallelSentence
       strcat(buf," ||| fake ||| 0-0");
       sent.ParseInputLine(buf);
-
-      //add each successive suffix to the tree
-      for(int i=0; i<sent.f_len; i++)
-        root.InsertPath(sent.f, i, sent.f_len - 1);
+      sents_.push_back(sent.f);
+      max_len_ = max(max_len_, sent.f_len);
     }
     delete[] buf;
+    Build();
+    cerr << "  " << sents_.size() << " sentences, " << (edge_begin_.size() - 1) << " n-grams\n";
+  }
+
+  virtual bool Matches(const vector<WordID>& src) const {
+    // (sentence, earliest start of the next run) for the sentences the
+    // runs matched so far fit into, sorted by sentence
+    vector<Occurrence> live, next, occs;
+    bool first = true;
+    int gap = 0;  // nonterminals since the last run
+    int i = 0;
+    while (i < src.size()) {
+      if (src[i] <= 0) { ++gap; ++i; continue; }
+      int j = i + 1;
+      while (j < src.size() && src[j] > 0) ++j;
+      const int len = j - i;
+      FindRun(&src[i], len, &occs);
+      next.clear();
+      vector<Occurrence>::const_iterator l = live.begin();
+      for (vector<Occurrence>::const_iterator it = occs.begin(); it != occs.end(); ++it) {
+        const int s = it->first;
+        if (!next.empty() && next.back().first == s) continue;  // already at its earliest
+        int earliest = gap;
+        if (!first) {
+          while (l != live.end() && l->first < s) ++l;
+          if (l == live.end()) break;
+          if (l->first != s) continue;
+          earliest += l->second;
+        }
+        if (it->second >= earliest) next.push_back(make_pair(s, it->second + len));
+      }
+      live.swap(next);
+      if (live.empty()) return false;
+      first = false;
+      gap = 0;
+      i = j;
+    }
+    if (first) return gap <= max_len_;  // no terminals
+    for (vector<Occurrence>::const_iterator l = live.begin(); l != live.end(); ++l)
+      if (l->second + gap <= sents_[l->first].size()) return true;
+    return false;
   }
-  virtual bool Matches(const vector<WordID>& src_rhs) const {
-    const Node<int>* curnode = &root;
-    for(int i=0; i < src_rhs.size(); i++) {
-      if (src_rhs[i] <= 0) {
-        curnode = &root;
-      } else if (curnode) {
-        curnode = curnode->Extend(src_rhs[i]);
-        if (!curnode) return false;
+
+ private:
+  typedef pair<int, int> Occurrence;  // (sentence, position)
+  enum { kMAX_NGRAM = 5 };
+
+  struct BuildNode {
+    map<WordID, int> children;
+    vector<Occurrence> occs;
+  };
+
+  void Build() {
+    vector<BuildNode> tmp(1);
+    for (int s = 0; s < sents_.size(); ++s) {
+      const vector<WordID>& sent = sents_[s];
+      for (int i = 0; i < sent.size(); ++i) {
+        int node = 0;
+        for (int k = i; k < sent.size() && k < i + kMAX_NGRAM; ++k) {
+          map<WordID, int>::iterator it = tmp[node].children.find(sent[k]);
+          if (it == tmp[node].children.end()) {
+            it = tmp[node].children.insert(make_pair(sent[k], tmp.size())).first;
+            tmp.push_back(BuildNode());
+          }
+          node = it->second;
+          tmp[node].occs.push_back(make_pair(s, i));
+        }
       }
     }
-    return true;
+    // number the nodes breadth first, so the children of each node are
+    // numbered consecutively
+    vector<int> order(1, 0);
+    for (int n = 0; n < order.size(); ++n) {
+      const BuildNode& b = tmp[order[n]];
+      edge_begin_.push_back(edge_word_.size());
+      occ_begin_.push_back(occs_.size());
+      occs_.insert(occs_.end(), b.occs.begin(), b.occs.end());
+      for (map<WordID, int>::const_iterator it = b.children.begin(); it != b.children.end(); ++it) {
+        edge_word_.push_back(it->first);
+        edge_child_.push_back(order.size());
+        order.push_back(it->second);
+      }
+    }
+    edge_begin_.push_back(edge_word_.size());
+    occ_begin_.push_back(occs_.size());
+  }
+
+  // returns the child of node for word w, or -1
+  int Child(int node, WordID w) const {
+    const vector<WordID>::const_iterator b = edge_word_.begin() + edge_begin_[node];
+    const vector<WordID>::const_iterator e = edge_word_.begin() + edge_begin_[node + 1];
+    const vector<WordID>::const_iterator it = lower_bound(b, e, w);
+    if (it == e || *it != w) return -1;
+    return edge_child_[it - edge_word_.begin()];
+  }
+
+  // sets *occs to the occurrences of run[0..len).  runs longer than the
+  // n-grams in the trie are checked word by word past the first kMAX_NGRAM
+  void FindRun(const WordID* run, int len, vector<Occurrence>* occs) const {
+    occs->clear();
+    int node = 0;
+    for (int k = 0; k < len && k < kMAX_NGRAM; ++k) {
+      node = Child(node, run[k]);
+      if (node < 0) return;
+    }
+    for (int o = occ_begin_[node]; o < occ_begin_[node + 1]; ++o) {
+      const vector<WordID>& sent = sents_[occs_[o].first];
+      const int pos = occs_[o].second;
+      bool match = pos + len <= sent.size();
+      for (int k = kMAX_NGRAM; match && k < len; ++k)
+        match = (sent[pos + k] == run[k]);
+      if (match) occs->push_back(occs_[o]);
+    }
+  }
+
+  vector<vector<WordID> > sents_;
+  int max_len_;
+  // node n has edges [edge_begin_[n], edge_begin_[n+1]) and occurrences
+  // [occ_begin_[n], occ_begin_[n+1]). node 0 is the root
+  vector<int> edge_begin_;
+  vector<WordID> edge_word_;
+  vector<int> edge_child_;
+  vector<int> occ_begin_;
+  vector<Occurrence> occs_;
+};
+
+// orders the options of a stripe by descending count, and options with
+// the same count by their order in the stripe
+struct ByCount {
+  bool operator()(const pair<float, int>& a, const pair<float, int>& b) const {
+    return a.first > b.first || (a.first == b.first && a.second < b.second);
   }
-  Node<int> root;
 };
 
-boost::shared_ptr<SourceFilter> filter;
-multimap<float, ID2RuleStatistics::const_iterator> options;
-int kCOUNT;
-int max_options;
+// filters the stripes of a grammar and keeps the top max_options of each.
+// with more than one thread, the stripes that match are buffered in
+// blocks whose stripes are split over the threads to select their top
+// options, and written in the original order.  matching stays on the
+// reading thread: it is cheaper than copying the stripe it would save,
+// and most stripes of an unfiltered grammar do not match
 
-void cb(WordID lhs, const vector<WordID>& src_rhs, const ID2RuleStatistics& rules, void*) {
-  options.clear();
-  if (!filter || filter->Matches(src_rhs)) {
-    for (ID2RuleStatistics::const_iterator it = rules.begin(); it != rules.end(); ++it) {
-      options.insert(make_pair(-it->second.counts.get(kCOUNT), it));
+struct Filterer {
+  Filterer(const SourceFilter* f, StripeWriter* w, size_t max_options, int threads) :
+      filter_(f), writer_(w), max_options_(max_options), threads_(threads), block_rules_() {}
+
+  void Callback(WordID lhs, const vector<WordID>& src, const ID2RuleStatistics& rules) {
+    if (filter_ && !filter_->Matches(src)) return;
+    if (threads_ > 1) {
+      block_.resize(block_.size() + 1);
+      Stripe& s = block_.back();
+      s.lhs = lhs;
+      s.src = src;
+      s.rules = rules;
+      block_rules_ += rules.size();
+      if (block_rules_ >= kBLOCK_RULES) FilterBlock();
+      return;
     }
-    int ocount = 0;
-    cout << '[' << TD::Convert(-lhs) << ']' << " ||| ";
-    WriteNamed(src_rhs, &cout);
-    cout << '\t';
-    bool first = true;
-    for (multimap<float,ID2RuleStatistics::const_iterator>::iterator it = options.begin(); it != options.end(); ++it) {
-      if (first) { first = false; } else { cout << " ||| "; }
-      WriteAnonymous(it->second->first, &cout);
-      cout << " ||| " << it->second->second;
-      ++ocount;
-      if (ocount == max_options) break;
+    vector<ID2RuleStatistics::const_iterator> vals;
+    SelectOptions(rules, &vals);
+    Write(lhs, src, vals);
+  }
+
+  // call after reading the grammar
+  void Finish() { if (!block_.empty()) FilterBlock(); }
+
+ private:
+  struct Stripe {
+    WordID lhs;
+    vector<WordID> src;
+    ID2RuleStatistics rules;
+    vector<ID2RuleStatistics::const_iterator> vals;
+  };
+  enum { kBLOCK_RULES = 50000 };
+
+  // sets *vals to the top max_options_ rules by count.  partial_sort keeps
+  // a heap of the best max_options_ seen so far, so only that many options
+  // are ever ordered
+  void SelectOptions(const ID2RuleStatistics& rules, vector<ID2RuleStatistics::const_iterator>* vals) const {
+    static const int kCOUNT = FD::Convert("CFE");
+    vector<ID2RuleStatistics::const_iterator> its;
+    vector<pair<float, int> > opts;
+    its.reserve(rules.size());
+    opts.reserve(rules.size());
+    for (ID2RuleStatistics::const_iterator it = rules.begin(); it != rules.end(); ++it) {
+      opts.push_back(make_pair(it->second.counts.get(kCOUNT), its.size()));
+      its.push_back(it);
     }
-    cout << endl;
+    size_t n = opts.size();
+    if (max_options_ && max_options_ < n) n = max_options_;
+    partial_sort(opts.begin(), opts.begin() + n, opts.end(), ByCount());
+    vals->resize(n);
+    for (int i = 0; i < n; ++i)
+      (*vals)[i] = its[opts[i].second];
   }
+
+  void Write(WordID lhs, const vector<WordID>& src, const vector<ID2RuleStatistics::const_iterator>& vals) {
+    static const WordID kDIV = TD::Convert("|||");
+    key_.resize(src.size() + 2);
+    key_[0] = lhs;
+    key_[1] = kDIV;
+    copy(src.begin(), src.end(), key_.begin() + 2);
+    writer_->Write(key_, vals);
+  }
+
+  void SelectStripes(int t) {
+    for (int j = t; j < block_.size(); j += threads_)
+      SelectOptions(block_[j].rules, &block_[j].vals);
+  }
+
+  void FilterBlock() {
+    boost::thread_group workers;
+    for (int t = 0; t < threads_; ++t)
+      workers.create_thread(boost::bind(&Filterer::SelectStripes, this, t));
+    workers.join_all();
+    for (int j = 0; j < block_.size(); ++j)
+      Write(block_[j].lhs, block_[j].src, block_[j].vals);
+    block_.clear();
+    block_rules_ = 0;
+  }
+
+  const SourceFilter* filter_;
+  StripeWriter* writer_;
+  const size_t max_options_;
+  const int threads_;
+  deque<Stripe> block_;  // not a vector, which would copy the stripes as it grows
+  size_t block_rules_;
+  vector<WordID> key_;
+};
+
+void cb(WordID lhs, const vector<WordID>& src_rhs, const ID2RuleStatistics& rules, void* extra) {
+  static_cast<Filterer*>(extra)->Callback(lhs, src_rhs, rules);
 }
 
 int main(int argc, char** argv){
   po::variables_map conf;
   InitCommandLine(argc, argv, &conf);
-  max_options = conf["top_e_given_f"].as<size_t>();;
-  kCOUNT = FD::Convert("CFE");
+  const size_t max_options = conf["top_e_given_f"].as<size_t>();
+  const int threads = max(conf["threads"].as<int>(), 1);
   istream& unscored_grammar = cin;
   cerr << "Loading test set " << conf["test_set"].as<string>() << "...\n";
-  filter.reset(new DumbSuffixTreeFilter(conf["test_set"].as<string>()));
+  boost::shared_ptr<SourceFilter> filter(new TestSetIndex(conf["test_set"].as<string>()));
   cerr << "Filtering...\n";
-  StripedGrammarLexer::ReadStripedGrammar(&unscored_grammar, cb, NULL);
+  StripeWriter w(&cout, conf.count("binary") > 0);
+  Filterer filterer(filter.get(), &w, max_options, threads);
+  StripedGrammarLexer::ReadStripedGrammar(&unscored_grammar, cb, &filterer);
+  filterer.Finish();
 }
-
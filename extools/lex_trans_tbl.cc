@@ -0,0 +1,257 @@
+#include "lex_trans_tbl.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "filelib.h"
+#include "sentence_pair.h"
+#include "tdict.h"
+
+using namespace std;
+
+static const char kLT_MAGIC[8] = { 'c', 'd', 'e', 'c', 'L', 'E', 'X', 'T' };
+static const uint32_t kLT_VERSION = 1;
+static const uint32_t kLT_BYTE_ORDER = 0x01020304;
+
+// the file holds the header, the row of each foreign word in the pair
+// arrays, the totals of each word, the pairs sorted by foreign and then
+// English word, and the words themselves.  words are numbered in the
+// file in byte order, so the file does not depend on the WordIDs of the
+// process that wrote it
+struct LTHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t num_words;
+  uint64_t num_pairs;
+  // byte offsets from the start of the file
+  uint64_t row_begin_off;  // num_words + 1 uint64_t
+  uint64_t total_f_off;    // num_words int32_t
+  uint64_t total_e_off;    // num_words int32_t
+  uint64_t pair_e_off;     // num_pairs uint32_t
+  uint64_t pair_count_off; // num_pairs int32_t
+  uint64_t words_off;      // num_words + 1 uint64_t offsets, then the bytes
+  uint64_t file_size;
+};
+
+static void Fail(const string& file, const string& msg) {
+  cerr << "Bad lexical table " << file << ": " << msg << endl;
+  abort();
+}
+
+static void Pad(ostream* out, int align) {
+  while (out->tellp() % align) out->put(0);
+}
+
+template <typename T>
+static void WriteArray(ostream* out, const vector<T>& v) {
+  if (!v.empty()) out->write(reinterpret_cast<const char*>(&v[0]), v.size() * sizeof(T));
+}
+
+LexTranslationTable::LexTranslationTable() :
+    sent_(NULL), data_(MAP_FAILED), size_(0), header_(NULL), row_begin_(NULL), total_f_(NULL),
+    total_e_(NULL), pair_e_(NULL), pair_count_(NULL) {}
+
+LexTranslationTable::~LexTranslationTable() {
+  delete sent_;
+  if (data_ != MAP_FAILED) munmap(data_, size_);
+}
+
+void LexTranslationTable::createTTable(const char* buf){
+  if (!sent_) sent_ = new AnnotatedParallelSentence;
+  AnnotatedParallelSentence& sent = *sent_;
+  sent.ParseInputLine(buf);
+
+  //iterate over the alignment to compute aligned words
+  for(int i =0;i<sent.aligned.width();i++)
+    {
+      for (int j=0;j<sent.aligned.height();j++)
+        {
+          if( sent.aligned(i,j))
+            {
+              ++word_translation[pair<WordID,WordID> (sent.f[i], sent.e[j])];
+              ++total_foreign[sent.f[i]];
+              ++total_english[sent.e[j]];
+            }
+        }
+    }
+
+  const WordID NULL_ = TD::Convert("NULL");
+  //handle unaligned words - align them to null
+  for (int j =0; j < sent.e_len; j++) {
+    if (sent.e_aligned[j]) continue;
+    ++word_translation[pair<WordID,WordID> (NULL_, sent.e[j])];
+    ++total_foreign[NULL_];
+    ++total_english[sent.e[j]];
+  }
+
+  for (int i =0; i < sent.f_len; i++) {
+    if (sent.f_aligned[i]) continue;
+    ++word_translation[pair<WordID,WordID> (sent.f[i], NULL_)];
+    ++total_english[NULL_];
+    ++total_foreign[sent.f[i]];
+  }
+}
+
+void LexTranslationTable::WriteBinary(const string& fname) const {
+  // number the words in byte order
+  vector<pair<string, WordID> > words;
+  for (map<WordID, int>::const_iterator it = total_foreign.begin(); it != total_foreign.end(); ++it)
+    words.push_back(make_pair(TD::Convert(it->first), it->first));
+  for (map<WordID, int>::const_iterator it = total_english.begin(); it != total_english.end(); ++it)
+    words.push_back(make_pair(TD::Convert(it->first), it->first));
+  sort(words.begin(), words.end());
+  words.erase(unique(words.begin(), words.end()), words.end());
+  map<WordID, uint32_t> ids;
+  for (uint32_t i = 0; i < words.size(); ++i) ids[words[i].second] = i;
+
+  const uint64_t n = words.size();
+  vector<int32_t> total_f(n, 0), total_e(n, 0);
+  for (map<WordID, int>::const_iterator it = total_foreign.begin(); it != total_foreign.end(); ++it)
+    total_f[ids[it->first]] = it->second;
+  for (map<WordID, int>::const_iterator it = total_english.begin(); it != total_english.end(); ++it)
+    total_e[ids[it->first]] = it->second;
+
+  vector<pair<pair<uint32_t, uint32_t>, int32_t> > pairs;
+  pairs.reserve(word_translation.size());
+  for (map<pair<WordID,WordID>, int>::const_iterator it = word_translation.begin(); it != word_translation.end(); ++it)
+    pairs.push_back(make_pair(make_pair(ids[it->first.first], ids[it->first.second]), it->second));
+  sort(pairs.begin(), pairs.end());
+  vector<uint64_t> row_begin(n + 1, 0);
+  vector<uint32_t> pair_e(pairs.size());
+  vector<int32_t> pair_count(pairs.size());
+  for (uint64_t k = 0; k < pairs.size(); ++k) {
+    ++row_begin[pairs[k].first.first + 1];
+    pair_e[k] = pairs[k].first.second;
+    pair_count[k] = pairs[k].second;
+  }
+  for (uint64_t i = 0; i < n; ++i) row_begin[i + 1] += row_begin[i];
+  vector<uint64_t> word_off(n + 1, 0);
+  for (uint64_t i = 0; i < n; ++i) word_off[i + 1] = word_off[i] + words[i].first.size();
+
+  ofstream out(fname.c_str(), ios::binary);
+  if (!out) Fail(fname, "cannot write");
+  LTHeader h;
+  memset(&h, 0, sizeof(h));
+  out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+  memcpy(h.magic, kLT_MAGIC, sizeof(kLT_MAGIC));
+  h.version = kLT_VERSION;
+  h.byte_order = kLT_BYTE_ORDER;
+  h.num_words = n;
+  h.num_pairs = pairs.size();
+  h.row_begin_off = out.tellp();
+  WriteArray(&out, row_begin);
+  h.total_f_off = out.tellp();
+  WriteArray(&out, total_f);
+  h.total_e_off = out.tellp();
+  WriteArray(&out, total_e);
+  h.pair_e_off = out.tellp();
+  WriteArray(&out, pair_e);
+  h.pair_count_off = out.tellp();
+  WriteArray(&out, pair_count);
+  Pad(&out, 8);
+  h.words_off = out.tellp();
+  WriteArray(&out, word_off);
+  for (uint64_t i = 0; i < n; ++i)
+    out.write(words[i].first.data(), words[i].first.size());
+  h.file_size = out.tellp();
+  out.seekp(0);
+  out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+  if (!out) Fail(fname, "write failed");
+}
+
+void LexTranslationTable::ReadBinary(const string& fname) {
+  const int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0) Fail(fname, strerror(errno));
+  struct stat st;
+  if (fstat(fd, &st) < 0) Fail(fname, strerror(errno));
+  size_ = st.st_size;
+  if (size_ < sizeof(LTHeader)) Fail(fname, "file too short");
+  data_ = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data_ == MAP_FAILED) Fail(fname, strerror(errno));
+  const char* base = static_cast<const char*>(data_);
+  header_ = reinterpret_cast<const LTHeader*>(base);
+  if (memcmp(header_->magic, kLT_MAGIC, sizeof(kLT_MAGIC)) != 0) Fail(fname, "bad magic number");
+  if (header_->version != kLT_VERSION) Fail(fname, "unsupported version");
+  if (header_->byte_order != kLT_BYTE_ORDER) Fail(fname, "written on a machine with a different byte order");
+  if (header_->file_size != size_) Fail(fname, "truncated file");
+  row_begin_ = reinterpret_cast<const uint64_t*>(base + header_->row_begin_off);
+  total_f_ = reinterpret_cast<const int32_t*>(base + header_->total_f_off);
+  total_e_ = reinterpret_cast<const int32_t*>(base + header_->total_e_off);
+  pair_e_ = reinterpret_cast<const uint32_t*>(base + header_->pair_e_off);
+  pair_count_ = reinterpret_cast<const int32_t*>(base + header_->pair_count_off);
+
+  // the vocabulary is the only part of the file read up front
+  const uint64_t* word_off = reinterpret_cast<const uint64_t*>(base + header_->words_off);
+  const char* chars = reinterpret_cast<const char*>(word_off + header_->num_words + 1);
+  vector<WordID> lt2td(header_->num_words);
+  for (uint64_t i = 0; i < header_->num_words; ++i)
+    lt2td[i] = TD::Convert(string(chars + word_off[i], word_off[i + 1] - word_off[i]));
+  td2lt_.clear();
+  td2lt_.resize(TD::NumWords() + 1, -1);
+  for (uint64_t i = 0; i < lt2td.size(); ++i)
+    td2lt_[lt2td[i]] = i;
+}
+
+int LexTranslationTable::Count(WordID f, WordID e) const {
+  if (!header_) return Find(word_translation, make_pair(f, e));
+  const int64_t lf = FileId(f);
+  const int64_t le = FileId(e);
+  if (lf < 0 || le < 0) return 0;
+  const uint32_t* b = pair_e_ + row_begin_[lf];
+  const uint32_t* end = pair_e_ + row_begin_[lf + 1];
+  const uint32_t* it = lower_bound(b, end, static_cast<uint32_t>(le));
+  if (it == end || *it != le) return 0;
+  return pair_count_[it - pair_e_];
+}
+
+int LexTranslationTable::TotalForeign(WordID f) const {
+  if (!header_) return Find(total_foreign, f);
+  const int64_t lf = FileId(f);
+  return lf < 0 ? 0 : total_f_[lf];
+}
+
+int LexTranslationTable::TotalEnglish(WordID e) const {
+  if (!header_) return Find(total_english, e);
+  const int64_t le = FileId(e);
+  return le < 0 ? 0 : total_e_[le];
+}
+
+void LexTranslationTable::Load(const string& aligned_corpus, const string& binary) {
+  if (!binary.empty() && FileExists(binary)) {
+    cerr << "Mapping lexical translation table " << binary << "..." << endl;
+    ReadBinary(binary);
+    return;
+  }
+  if (aligned_corpus.empty()) {
+    cerr << "An aligned corpus is needed to compute " << binary << endl;
+    exit(1);
+  }
+  cerr << "Computing lexical translation probabilities from " << aligned_corpus << "..." << endl;
+  ReadFile rf(aligned_corpus);
+  istream& alignment = *rf.stream();
+  string line;
+  while (getline(alignment, line))
+    if (!line.empty()) createTTable(line.c_str());
+  if (binary.empty()) return;
+  ostringstream tmp;
+  tmp << binary << ".tmp." << getpid();
+  cerr << "Writing lexical translation table " << binary << "..." << endl;
+  WriteBinary(tmp.str());
+  if (rename(tmp.str().c_str(), binary.c_str()) != 0) {
+    cerr << "Cannot rename " << tmp.str() << " to " << binary << endl;
+    exit(1);
+  }
+}
@@ -10,16 +10,72 @@
 
 #include "wordid.h"
 #include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdint.h>
 
+struct LTHeader;
+struct AnnotatedParallelSentence;
+
+// counts of aligned word pairs and of the words on either side, with the
+// unaligned words aligned to NULL.  the counts are collected in the maps
+// below by createTTable, and can be saved with WriteBinary as a flat,
+// sorted table that ReadBinary maps into memory instead.  a mapped table
+// is shared through the page cache by all processes that read the same
+// file, and lookups binary search the (short) row of one foreign word
 class LexTranslationTable
 {
  public:
+  LexTranslationTable();
+  ~LexTranslationTable();
 
   std::map < std::pair<WordID,WordID>,int > word_translation;
   std::map <WordID, int> total_foreign;
   std::map <WordID, int> total_english;
   void createTTable(const char* buf);
-  
+
+  // writes the counts in the maps to fname
+  void WriteBinary(const std::string& fname) const;
+  // maps a table written by WriteBinary.  the maps above are ignored
+  // from then on
+  void ReadBinary(const std::string& fname);
+  // maps binary if it exists.  otherwise reads aligned_corpus and, unless
+  // binary is empty, saves the table there (written to a temporary file
+  // and renamed, so several jobs may start with the same file at once)
+  void Load(const std::string& aligned_corpus, const std::string& binary);
+
+  // counts, 0 if never seen.  unlike operator[] these do not insert, so
+  // several threads may call them at once
+  int Count(WordID f, WordID e) const;
+  int TotalForeign(WordID f) const;
+  int TotalEnglish(WordID e) const;
+
+ private:
+  LexTranslationTable(const LexTranslationTable&);
+  void operator=(const LexTranslationTable&);
+
+  template <typename K>
+  static int Find(const std::map<K, int>& m, const K& k) {
+    typename std::map<K, int>::const_iterator it = m.find(k);
+    return it == m.end() ? 0 : it->second;
+  }
+  // index of w in the mapped table, or -1
+  int64_t FileId(WordID w) const {
+    return (w > 0 && w < td2lt_.size()) ? td2lt_[w] : -1;
+  }
+
+  AnnotatedParallelSentence* sent_;  // createTTable's, reused for every line
+
+  void* data_;
+  size_t size_;
+  const LTHeader* header_;
+  const uint64_t* row_begin_;
+  const int32_t* total_f_;
+  const int32_t* total_e_;
+  const uint32_t* pair_e_;
+  const int32_t* pair_count_;
+  std::vector<int64_t> td2lt_;
 };
 
 #endif /* LEX_TRANS_TBL_H_ */
@@ -21,6 +21,7 @@ namespace po = boost::program_options;
 static const size_t MAX_LINE_LENGTH = 64000000;
 
 bool use_hadoop_counters = false;
+StripeWriter* writer = NULL;
 
 void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   po::options_description opts("Configuration options");
@@ -28,6 +29,7 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
         ("phrase_marginals,p", "Compute phrase marginals")
 	("use_hadoop_counters,C", "Enable this if running inside Hadoop")
         ("bidir,b", "Rules are tagged as being F->E or E->F, invert E rules in output")
+        ("binary", "Write binary stripes (see striped_grammar.h) instead of text")
         ("help,h", "Print this help message and exit");
   po::options_description clo("Command line options");
   po::options_description dcmdline_options;
@@ -54,13 +56,7 @@ void PlusEquals(const ID2RuleStatistics& v, ID2RuleStatistics* self) {
 }
 
 void WriteKeyValue(const vector<WordID>& key, const ID2RuleStatistics& val) {
-  cout << TD::GetString(key) << '\t';
-  bool needdiv = false;
-  for (ID2RuleStatistics::const_iterator it = val.begin(); it != val.end(); ++it) {
-    if (needdiv) cout << " ||| "; else needdiv = true;
-    cout << TD::GetString(it->first) << " ||| " << it->second;
-  }
-  cout << endl;
+  writer->Write(key, val);
   if (use_hadoop_counters) cerr << "reporter:counter:UserCounters,RuleCount," << val.size() << endl;
 }
 
@@ -165,8 +161,12 @@ int main(int argc, char** argv) {
   use_hadoop_counters = conf.count("use_hadoop_counters") > 0;
   const bool phrase_marginals = conf.count("phrase_marginals") > 0;
   const bool bidir = conf.count("bidir") > 0;
-  Reducer reducer(phrase_marginals, bidir);
-  StripedGrammarLexer::ReadContexts(&cin, cb, &reducer);
+  StripeWriter w(&cout, conf.count("binary") > 0);
+  writer = &w;
+  {
+    Reducer reducer(phrase_marginals, bidir);
+    StripedGrammarLexer::ReadContexts(&cin, cb, &reducer);
+  }
   return 0;
 }
 
@@ -0,0 +1,350 @@
+/*
+ * Extract, score and featurize a grammar for each sentence of a test set
+ * directly from an aligned corpus, using a suffix array over the source
+ * side to find and sample the training sentences that are relevant
+ * (Lopez, 2007). this replaces running extractor over the whole corpus
+ * followed by filter_grammar and featurize_grammar.
+ */
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cmath>
+#include <tr1/unordered_map>
+
+#include <boost/functional/hash.hpp>
+#include <boost/program_options.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "lex_trans_tbl.h"
+#include "sparse_vector.h"
+#include "sentence_pair.h"
+#include "suffix_array.h"
+#include "extract.h"
+#include "fdict.h"
+#include "tdict.h"
+#include "wordid.h"
+#include "filelib.h"
+#include "striped_grammar.h"
+
+using namespace std;
+using namespace std::tr1;
+namespace po = boost::program_options;
+
+static const size_t MAX_LINE_LENGTH = 100000;
+
+void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
+  po::options_description opts("Configuration options");
+  opts.add_options()
+        ("aligned_corpus,c", po::value<string>(), "Aligned corpus (single line format)")
+        ("test_set,t", po::value<string>()->default_value("-"), "Extract grammars for the sentences in this file")
+        ("output_dir,o", po::value<string>(), "Write per-sentence grammars to this directory")
+        ("sample_size,s", po::value<int>()->default_value(300), "Sample at most this many occurrences of each source phrase")
+        ("top_e_given_f,N", po::value<int>()->default_value(30), "Keep top N rules, according to p(e|f). 0 for all")
+        ("default_category,d", po::value<string>()->default_value("X"), "Default span type (use X for 'Hiero')")
+        ("loose", "Use loose phrase extraction heuristic for base phrases")
+        ("max_base_phrase_size,L", po::value<int>()->default_value(10), "Maximum starting phrase size")
+        ("max_syms,l", po::value<int>()->default_value(5), "Maximum number of symbols in final phrase size")
+        ("max_vars,v", po::value<int>()->default_value(2), "Maximum number of nonterminal variables in final phrase size")
+        ("permit_adjacent_nonterminals,A", "Permit adjacent nonterminals in source side of rules")
+        ("no_required_aligned_terminal,n", "Do not require an aligned terminal")
+        ("silent", "Write nothing to stderr except errors")
+        ("help,h", "Print this help message and exit");
+  po::options_description clo("Command line options");
+  po::options_description dcmdline_options;
+  dcmdline_options.add(opts);
+
+  po::store(parse_command_line(argc, argv, dcmdline_options), *conf);
+  po::notify(*conf);
+
+  if (conf->count("help") || conf->count("aligned_corpus") == 0 || conf->count("output_dir") == 0) {
+    cerr << "\nUsage: sa_extractor -c ALIGNED_CORPUS.fr-en-al -o GRAMMAR_DIR [-options] < TEST-SET.fr > TEST-SET.sgm\n";
+    cerr << dcmdline_options << endl;
+    exit(1);
+  }
+}
+
+void AddToLexTable(const AnnotatedParallelSentence& sent, const WordID null_word, LexTranslationTable* table) {
+  for (int i = 0; i < sent.f_len; ++i) {
+    for (int j = 0; j < sent.e_len; ++j) {
+      if (sent.aligned(i,j)) {
+        ++table->word_translation[make_pair(sent.f[i], sent.e[j])];
+        ++table->total_foreign[sent.f[i]];
+        ++table->total_english[sent.e[j]];
+      }
+    }
+  }
+  for (int j = 0; j < sent.e_len; ++j) {
+    if (sent.e_aligned[j]) continue;
+    ++table->word_translation[make_pair(null_word, sent.e[j])];
+    ++table->total_foreign[null_word];
+    ++table->total_english[sent.e[j]];
+  }
+  for (int i = 0; i < sent.f_len; ++i) {
+    if (sent.f_aligned[i]) continue;
+    ++table->word_translation[make_pair(sent.f[i], null_word)];
+    ++table->total_english[null_word];
+    ++table->total_foreign[sent.f[i]];
+  }
+}
+
+template <typename K>
+inline int Lookup(const map<K, int>& m, const K& k) {
+  typename map<K, int>::const_iterator it = m.find(k);
+  return it == m.end() ? 0 : it->second;
+}
+
+inline float safenlog(float v) {
+  if (v == 1.0f) return 0.0f;
+  float res = -log(v);
+  if (res > 100.0f) res = 100.0f;
+  return res;
+}
+
+// the LexE2F and LexF2E features, computed as featurize_grammar's LexProb
+void LexicalWeights(const LexTranslationTable& table,
+                    const WordID null_word,
+                    const vector<WordID>& src,
+                    const vector<WordID>& trg,
+                    const vector<pair<short,short> >& al,
+                    float* lex_e2f, float* lex_f2e) {
+  map<WordID, pair<int, float> > foreign_aligned, english_aligned;
+  for (int k = 0; k < al.size(); ++k) {
+    const WordID f = src[al[k].first];
+    const WordID e = trg[al[k].second];
+    const int c = Lookup(table.word_translation, make_pair(f, e));
+    const int tf = Lookup(table.total_foreign, f);
+    const int te = Lookup(table.total_english, e);
+    pair<int, float>& fa = foreign_aligned[f];
+    ++fa.first;
+    fa.second += te ? static_cast<float>(c) / te : 0;
+    pair<int, float>& ea = english_aligned[e];
+    ++ea.first;
+    ea.second += tf ? static_cast<float>(c) / tf : 0;
+  }
+  const int null_e = Lookup(table.total_english, null_word);
+  const int null_f = Lookup(table.total_foreign, null_word);
+  *lex_e2f = 1;
+  *lex_f2e = 1;
+  for (int i = 0; i < src.size(); ++i) {
+    if (!table.total_foreign.count(src[i])) continue;
+    map<WordID, pair<int, float> >::const_iterator it = foreign_aligned.find(src[i]);
+    if (it != foreign_aligned.end())
+      *lex_e2f *= it->second.second / it->second.first;
+    else
+      *lex_e2f *= null_e ? static_cast<float>(Lookup(table.word_translation, make_pair(src[i], null_word))) / null_e : 0;
+  }
+  for (int j = 0; j < trg.size(); ++j) {
+    if (!table.total_english.count(trg[j])) continue;
+    map<WordID, pair<int, float> >::const_iterator it = english_aligned.find(trg[j]);
+    if (it != english_aligned.end())
+      *lex_f2e *= it->second.second / it->second.first;
+    else
+      *lex_f2e *= null_f ? static_cast<float>(Lookup(table.word_translation, make_pair(null_word, trg[j]))) / null_f : 0;
+  }
+}
+
+// rules are keyed by [LHS] followed by the source side, with nonterminals
+// written as [X,1], [X,2], ... like extractor writes them
+typedef unordered_map<vector<WordID>, ID2RuleStatistics, boost::hash<vector<WordID> > > SentenceGrammar;
+
+// counts the rules whose source terminals all occur in the test sentence
+struct SampledRuleCounter : public Extract::RuleObserver {
+  SampledRuleCounter() : kCFE(FD::Convert("CFE")), kLB("["), kRB("]") {}
+
+  void Reset(const vector<WordID>* test_sentence, SentenceGrammar* grammar) {
+    test = test_sentence;
+    g = grammar;
+  }
+
+ protected:
+  virtual void CountRuleImpl(WordID lhs,
+                             const vector<WordID>& rhs_f,
+                             const vector<WordID>& rhs_e,
+                             const vector<pair<short,short> >& fe_terminal_alignments) {
+    if (!Matches(rhs_f)) return;
+    key.resize(rhs_f.size() + 1);
+    key[0] = lhs;
+    int nt = 1;
+    for (int i = 0; i < rhs_f.size(); ++i)
+      key[i + 1] = rhs_f[i] < 0 ? MapSym(rhs_f[i], nt++) : rhs_f[i];
+    RuleStatistics& s = (*g)[key][rhs_e];
+    s.counts.add_value(kCFE, 1.0f);
+    if (fe_terminal_alignments.size() > s.aligns.size())
+      s.aligns = fe_terminal_alignments;
+  }
+
+ private:
+  // every maximal run of terminals must be a substring of the test sentence
+  bool Matches(const vector<WordID>& rhs_f) const {
+    vector<WordID>::const_iterator run = rhs_f.begin();
+    while (run != rhs_f.end()) {
+      while (run != rhs_f.end() && *run < 0) ++run;
+      vector<WordID>::const_iterator run_end = run;
+      while (run_end != rhs_f.end() && *run_end > 0) ++run_end;
+      if (run != run_end && search(test->begin(), test->end(), run, run_end) == test->end())
+        return false;
+      run = run_end;
+    }
+    return true;
+  }
+
+  WordID MapSym(WordID sym, int ind) {
+    WordID& r = cat2ind2sym[sym][ind];
+    if (!r)
+      r = TD::Convert(kLB + TD::Convert(-sym) + "," + boost::lexical_cast<string>(ind) + kRB);
+    return r;
+  }
+
+  const int kCFE;
+  const string kLB, kRB;
+  const vector<WordID>* test;
+  SentenceGrammar* g;
+  vector<WordID> key;
+  map<WordID, map<int, WordID> > cat2ind2sym;
+};
+
+struct CountGreater {
+  CountGreater(int c) : kCFE(c) {}
+  bool operator()(const ID2RuleStatistics::const_iterator& a, const ID2RuleStatistics::const_iterator& b) const {
+    return a->second.counts.get(kCFE) > b->second.counts.get(kCFE);
+  }
+  const int kCFE;
+};
+
+int main(int argc, char** argv) {
+  po::variables_map conf;
+  InitCommandLine(argc, argv, &conf);
+  const string output_dir = conf["output_dir"].as<string>();
+  const int sample_size = conf["sample_size"].as<int>();
+  const int max_options = conf["top_e_given_f"].as<int>();
+  const WordID default_cat = -TD::Convert(conf["default_category"].as<string>());
+  const int max_base_phrase_size = conf["max_base_phrase_size"].as<int>();
+  const int max_syms = conf["max_syms"].as<int>();
+  const int max_vars = conf["max_vars"].as<int>();
+  const bool loose_phrases = conf.count("loose") > 0;
+  const bool permit_adjacent_nonterminals = conf.count("permit_adjacent_nonterminals") > 0;
+  const bool require_aligned_terminal = conf.count("no_required_aligned_terminal") == 0;
+  const bool silent = conf.count("silent") > 0;
+  const WordID kNULL = TD::Convert("NULL");
+  const int kCFE = FD::Convert("CFE");
+  const int kEGIVENF = FD::Convert("EGivenF");
+  const int kLOGRULECOUNT = FD::Convert("LogRuleCount");
+  const int kSINGLETON = FD::Convert("SingletonRule");
+  const int kLEXE2F = FD::Convert("LexE2F");
+  const int kLEXF2E = FD::Convert("LexF2E");
+  if (!DirectoryExists(output_dir)) MkDirP(output_dir);
+
+  // the corpus is kept as text and parsed again for each sampled sentence,
+  // which is much smaller than keeping the alignment matrices
+  vector<string> corpus;
+  SuffixArray sa;
+  LexTranslationTable lex;
+  {
+    const string& corpus_file = conf["aligned_corpus"].as<string>();
+    if (!silent) cerr << "Indexing " << corpus_file << "..." << endl;
+    ReadFile rf(corpus_file);
+    istream& in = *rf.stream();
+    char* buf = new char[MAX_LINE_LENGTH];
+    AnnotatedParallelSentence sent;
+    while(in) {
+      in.getline(buf, MAX_LINE_LENGTH);
+      if (buf[0] == 0) continue;
+      sent.ParseInputLine(buf);
+      corpus.push_back(buf);
+      sa.AddSentence(sent.f);
+      AddToLexTable(sent, kNULL, &lex);
+    }
+    delete[] buf;
+    sa.Build();
+    if (!silent) cerr << "  " << corpus.size() << " sentences, " << sa.size() << " suffixes" << endl;
+  }
+
+  ReadFile rf(conf["test_set"].as<string>());
+  istream& in = *rf.stream();
+  string line;
+  vector<WordID> test;
+  set<int> sampled;
+  AnnotatedParallelSentence sent;
+  vector<ParallelSpan> phrases;
+  vector<WordID> no_cats;
+  SampledRuleCounter counter;
+  vector<ID2RuleStatistics::const_iterator> options;
+  int id = 0;
+  for (; getline(in, line); ++id) {
+    test.clear();
+    TD::ConvertSentence(line, &test);
+
+    // sample up to sample_size occurrences of each test phrase, extending
+    // each phrase one word at a time while it still occurs in the corpus
+    sampled.clear();
+    for (int i = 0; i < test.size(); ++i) {
+      int begin = 0, end = sa.size();
+      for (int j = i; j < test.size() && j - i < max_base_phrase_size; ++j) {
+        if (!sa.Extend(j - i, test[j], &begin, &end)) break;
+        const int stride = max(1, (end - begin) / sample_size);
+        for (int k = begin, taken = 0; k < end && taken < sample_size; k += stride, ++taken)
+          sampled.insert(sa.SentenceAt(sa.Position(k)));
+      }
+    }
+
+    SentenceGrammar g;
+    counter.Reset(&test, &g);
+    for (set<int>::const_iterator it = sampled.begin(); it != sampled.end(); ++it) {
+      sent.ParseInputLine(corpus[*it].c_str());
+      phrases.clear();
+      Extract::ExtractBasePhrases(max_base_phrase_size, sent, &phrases);
+      if (loose_phrases)
+        Extract::LoosenPhraseBounds(sent, max_base_phrase_size, &phrases);
+      if (phrases.empty()) continue;
+      Extract::AnnotatePhrasesWithCategoryTypes(default_cat, sent.span_types, &phrases);
+      Extract::ExtractConsistentRules(sent, phrases, max_vars, max_syms, permit_adjacent_nonterminals, require_aligned_terminal, &counter, &no_cats);
+    }
+
+    const string gfile = output_dir + "/grammar." + boost::lexical_cast<string>(id) + ".gz";
+    WriteFile wf(gfile);
+    ostream& out = *wf.stream();
+    vector<WordID> src;
+    for (SentenceGrammar::const_iterator it = g.begin(); it != g.end(); ++it) {
+      const ID2RuleStatistics& trgs = it->second;
+      float c_f = 0;
+      options.clear();
+      for (ID2RuleStatistics::const_iterator ti = trgs.begin(); ti != trgs.end(); ++ti) {
+        c_f += ti->second.counts.get(kCFE);
+        options.push_back(ti);
+      }
+      sort(options.begin(), options.end(), CountGreater(kCFE));
+      if (max_options > 0 && options.size() > max_options)
+        options.resize(max_options);
+      src.assign(it->first.begin() + 1, it->first.end());
+      for (int i = 0; i < options.size(); ++i) {
+        const vector<WordID>& trg = options[i]->first;
+        const RuleStatistics& info = options[i]->second;
+        const float c = info.counts.get(kCFE);
+        SparseVector<float> feats;
+        feats.set_value(kEGIVENF, safenlog(c / c_f));
+        feats.set_value(kLOGRULECOUNT, log(c));
+        if (c == 1.0f) feats.set_value(kSINGLETON, 1);
+        float e2f, f2e;
+        LexicalWeights(lex, kNULL, src, trg, info.aligns, &e2f, &f2e);
+        feats.set_value(kLEXE2F, safenlog(e2f));
+        feats.set_value(kLEXF2E, safenlog(f2e));
+        out << '[' << TD::Convert(-it->first[0]) << "] ||| ";
+        WriteNamed(src, &out);
+        out << " ||| ";
+        WriteAnonymous(trg, &out);
+        out << " ||| ";
+        print(out, feats, "=");
+        out << '\n';
+      }
+    }
+    cout << "<seg id=\"" << id << "\" grammar=\"" << gfile << "\"> " << line << " </seg>" << endl;
+    if (!silent) cerr << "  sentence " << id << ": " << sampled.size() << " sampled sentences, " << g.size() << " source sides" << endl;
+  }
+  return 0;
+}
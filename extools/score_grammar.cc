@@ -1,6 +1,7 @@
 /*
  * Score a grammar in striped format
  * ./score_grammar <alignment> < filtered.grammar > scored.grammar
+ * ./score_grammar -T lex.bin -j 8 < filtered.grammar > scored.grammar
  */
 #include <iostream>
 #include <string>
@@ -9,15 +10,21 @@
 #include <utility>
 #include <cstdlib>
 #include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
 #include <tr1/unordered_map>
 
 #include "sentence_pair.h"
 #include "extract.h"
+#include "striped_grammar.h"
 #include "fdict.h"
 #include "tdict.h"
 #include "lex_trans_tbl.h"
 #include "filelib.h"
 
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
 #include <boost/functional/hash.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
@@ -25,8 +32,7 @@
 using namespace std;
 using namespace std::tr1;
 
-
-static const size_t MAX_LINE_LENGTH = 64000000;
+namespace po = boost::program_options;
 
 typedef unordered_map<vector<WordID>, RuleStatistics, boost::hash<vector<WordID> > > ID2RuleStatistics;
 
@@ -117,236 +123,207 @@ void ParseLine(const char* buf, vector<WordID>* cur_key, ID2RuleStatistics* coun
 
 
 
-void LexTranslationTable::createTTable(const char* buf){
-
-  bool DEBUG = false;
+inline float safenlog(float v) {
+  if (v == 1.0f) return 0.0f;
+  float res = -log(v);
+  if (res > 100.0f) res = 100.0f;
+  return res;
+}
 
-  AnnotatedParallelSentence sent;
-      
-  sent.ParseInputLine(buf);
-      
-  //iterate over the alignment to compute aligned words
-  
-  for(int i =0;i<sent.aligned.width();i++)
-    {
-      for (int j=0;j<sent.aligned.height();j++)
-	{
-	  if (DEBUG) cerr << sent.aligned(i,j) << " ";
-	  if( sent.aligned(i,j))
-	    {
-	      if (DEBUG) cerr << TD::Convert(sent.f[i])  << " aligned to " << TD::Convert(sent.e[j]);
-	      ++word_translation[pair<WordID,WordID> (sent.f[i], sent.e[j])];
-	      ++total_foreign[sent.f[i]];
-	      ++total_english[sent.e[j]];
-	    }
-	}
-      if (DEBUG)  cerr << endl;
-    }
-  if (DEBUG) cerr << endl;
-  
+// scores the rules of one line of the grammar.  the table is only read
+// through its const lookups, which don't insert, so any number of threads
+// may score lines at once, and a mapped table doesn't grow with the grammar
+void ScoreLine(const LexTranslationTable& table, const char* buf, ostream* out) {
+  static const int kCF = FD::Convert("CF");
+  static const int kCE = FD::Convert("CE");
+  static const int kCFE = FD::Convert("CFE");
   static const WordID NULL_ = TD::Convert("NULL");
-  //handle unaligned words - align them to null
-  for (int j =0; j < sent.e_len; j++)
-    {
-      if (sent.e_aligned[j]) continue;
-      ++word_translation[pair<WordID,WordID> (NULL_, sent.e[j])];
-      ++total_foreign[NULL_];
-      ++total_english[sent.e[j]];
-    }
-  
-  for (int i =0; i < sent.f_len; i++)
+
+  ID2RuleStatistics cur_counts;
+  vector<WordID> cur_key;
+  ParseLine(buf, &cur_key, &cur_counts);
+  const string lhs = TD::Convert(cur_key[0]);
+
+  //loop over all the Target side phrases that this source aligns to
+  for (ID2RuleStatistics::const_iterator it = cur_counts.begin(); it != cur_counts.end(); ++it)
     {
-      if (sent.f_aligned[i]) continue;
-      ++word_translation[pair<WordID,WordID> (sent.f[i], NULL_)];
-      ++total_english[NULL_];
-      ++total_foreign[sent.f[i]];
+
+     /*Compute phrase translation prob.
+       Print out scores in this format:
+       Phrase trnaslation prob P(F|E)
+       Phrase translation prob P(E|F)
+       Lexical weighting prob lex(F|E)
+       Lexical weighting prob lex(E|F)
+     */
+
+      float pEF_ = it->second.counts.value(kCFE) / it->second.counts.value(kCF);
+      float pFE_ = it->second.counts.value(kCFE) / it->second.counts.value(kCE);
+
+      map <WordID, pair<int, float> > foreign_aligned;
+      map <WordID, pair<int, float> > english_aligned;
+
+      //Loop over all the alignment points to compute lexical translation probability
+      const vector< pair<short,short> >& al = it->second.aligns;
+      for(vector< pair<short,short> >::const_iterator ita = al.begin(); ita != al.end(); ++ita)
+        {
+          const WordID f = cur_key[ita->first+2];
+          const WordID e = it->first[ita->second];
+
+          //Lookup this alignment probability in the table
+          int temp = table.Count(f, e);
+          float f2e=0, e2f=0;
+          if (const int tf = table.TotalForeign(f))
+            f2e = (float) temp / tf;
+          if (const int te = table.TotalEnglish(e))
+            e2f = (float) temp / te;
+
+          //local counts to keep track of which things haven't been aligned, to later compute their null alignment
+          pair<int, float>& fa = foreign_aligned.insert(make_pair(f, pair<int, float>(0, 0.0f))).first->second;
+          fa.first++;
+          fa.second += e2f;
+
+          pair<int, float>& ea = english_aligned.insert(make_pair(e, pair<int, float>(0, 0.0f))).first->second;
+          ea.first++;
+          ea.second += f2e;
+        }
+
+      float final_lex_f2e=1, final_lex_e2f=1;
+
+      //compute lexical weight P(F|E) and include unaligned foreign words
+      for(int i=0;i<cur_key.size(); i++)
+        {
+          //if we dont have it in the translation table, we won't know its lexical weight, unless it is aligned here
+          map <WordID, pair<int, float> >::const_iterator fa = foreign_aligned.find(cur_key[i]);
+          if (fa == foreign_aligned.end() && !table.TotalForeign(cur_key[i])) continue;
+
+          if (fa != foreign_aligned.end())
+            {
+              final_lex_e2f *= fa->second.second / fa->second.first;
+            }
+          else //dealing with null alignment
+            {
+              int temp_count = table.Count(cur_key[i], NULL_);
+              float temp_e2f = (float) temp_count / table.TotalEnglish(NULL_);
+              final_lex_e2f *= temp_e2f;
+            }
+        }
+
+      //compute P(E|F) unaligned english words
+      for(int j=0; j< it->first.size(); j++)
+        {
+          map <WordID, pair<int, float> >::const_iterator ea = english_aligned.find(it->first[j]);
+          if (ea == english_aligned.end() && !table.TotalEnglish(it->first[j])) continue;
+
+          if (ea != english_aligned.end())
+            {
+              final_lex_f2e *= ea->second.second / ea->second.first;
+            }
+          else //dealing with null
+            {
+              int temp_count = table.Count(NULL_, it->first[j]);
+              float temp_f2e = (float) temp_count / table.TotalForeign(NULL_);
+              final_lex_f2e *= temp_f2e;
+            }
+        }
+
+      *out << TD::GetString(cur_key);
+      *out << " " << TD::GetString(it->first) << " |||";
+      if(lhs.find('_')!=string::npos) {
+          *out << " Bkoff=" << safenlog(3.0f);
+      } else {
+          *out << " FGivenE=" << safenlog(pFE_) << " EGivenF=" << safenlog(pEF_);
+          *out << " LexE2F=" << safenlog(final_lex_e2f) << " LexF2E=" << safenlog(final_lex_f2e);
+      }
+      *out << '\n';
     }
- 
 }
 
+// with more than one thread the grammar is read in blocks of lines, which
+// the threads score in an interleaved slice each, and the scored lines are
+// written in the order they were read.  only one block is in memory at a
+// time
+struct BlockScorer {
+  BlockScorer(const LexTranslationTable& table, int threads) : table_(table), threads_(threads) {}
+
+  void ScoreBlock(const vector<string>& lines, vector<string>* scored) {
+    scored->resize(lines.size());
+    boost::thread_group workers;
+    for (int t = 0; t < threads_; ++t)
+      workers.create_thread(boost::bind(&BlockScorer::ScoreSlice, this, &lines, scored, t));
+    workers.join_all();
+  }
+
+ private:
+  void ScoreSlice(const vector<string>* lines, vector<string>* scored, int first) {
+    ostringstream out;
+    for (int i = first; i < lines->size(); i += threads_) {
+      out.str("");
+      ScoreLine(table_, (*lines)[i].c_str(), &out);
+      (*scored)[i] = out.str();
+    }
+  }
 
-inline float safenlog(float v) {
-  if (v == 1.0f) return 0.0f;
-  float res = -log(v);
-  if (res > 100.0f) res = 100.0f;
-  return res;
+  const LexTranslationTable& table_;
+  const int threads_;
+};
+
+bool InitCommandLine(int argc, char** argv, po::variables_map* conf) {
+  po::options_description opts("Configuration options");
+  opts.add_options()
+        ("aligned_corpus,c", po::value<string>(), "Aligned corpus (single line format)")
+        ("lex_table,T", po::value<string>(), "Binary lexical table. Mapped if the file exists, otherwise computed from the aligned corpus and saved there")
+        ("threads,j", po::value<int>()->default_value(1), "Score on this many threads")
+        ("block_lines,b", po::value<int>()->default_value(10000), "With more than one thread, score the grammar in blocks of this many lines")
+        ("help,h", "Print this help message and exit");
+  po::positional_options_description p;
+  p.add("aligned_corpus", 1);
+  po::store(po::command_line_parser(argc, argv).options(opts).positional(p).run(), *conf);
+  po::notify(*conf);
+
+  if (conf->count("help") || (conf->count("aligned_corpus") == 0 && conf->count("lex_table") == 0)) {
+    cerr << "Usage: " << argv[0] << " [-T lex.bin] [-j threads] corpus.al < filtered.grammar\n";
+    cerr << opts << endl;
+    return false;
+  }
+  return true;
 }
 
 int main(int argc, char** argv){
-  bool DEBUG= false;
-  if (argc != 2) {
-    cerr << "Usage: " << argv[0] << " corpus.al < filtered.grammar\n";
-    return 1;
-  }
-  ifstream alignment (argv[1]);
+  po::variables_map conf;
+  if (!InitCommandLine(argc, argv, &conf)) return 1;
   istream& unscored_grammar = cin;
   ostream& scored_grammar = cout;
 
   //create lexical translation table
-  cerr << "Creating table..." << endl;
-  char* buf = new char[MAX_LINE_LENGTH];
-
   LexTranslationTable table;
+  table.Load(conf.count("aligned_corpus") ? conf["aligned_corpus"].as<string>() : "",
+             conf.count("lex_table") ? conf["lex_table"].as<string>() : "");
 
-  while(!alignment.eof())
-    {
-      alignment.getline(buf, MAX_LINE_LENGTH);
-      if (buf[0] == 0) continue;
-      
-      table.createTTable(buf);      	
-    }
-  
-  bool PRINT_TABLE=false;
-  if (PRINT_TABLE)
-    {
-      ofstream trans_table;
-      trans_table.open("lex_trans_table.out");
-      for(map < pair<WordID,WordID>,int >::iterator it = table.word_translation.begin(); it != table.word_translation.end(); ++it)
-      {
-	trans_table <<  TD::Convert(it->first.first) <<  "|||" << TD::Convert(it->first.second) << "==" << it->second << "//" << table.total_foreign[it->first.first] << "//" << table.total_english[it->first.second] << endl;
-      } 
-
-      trans_table.close();
-    }
-  
- 
   //score unscored grammar
   cerr <<"Scoring grammar..." << endl;
-
-  ID2RuleStatistics acc, cur_counts;
-  vector<WordID> key, cur_key,temp_key;
-  vector< pair<short,short> > al;
-  vector< pair<short,short> >::iterator ita;
-  int line = 0;
-
-  static const int kCF = FD::Convert("CF");
-  static const int kCE = FD::Convert("CE");
-  static const int kCFE = FD::Convert("CFE");	
-
-  while(!unscored_grammar.eof())
-    {
-      ++line;
-      unscored_grammar.getline(buf, MAX_LINE_LENGTH);
-      if (buf[0] == 0) continue;
-      ParseLine(buf, &cur_key, &cur_counts);
-      
-      //loop over all the Target side phrases that this source aligns to
-      for (ID2RuleStatistics::const_iterator it = cur_counts.begin(); it != cur_counts.end(); ++it)
-	{
-	  
-	 /*Compute phrase translation prob.
-	   Print out scores in this format:
-	   Phrase trnaslation prob P(F|E)
-	   Phrase translation prob P(E|F)
-	   Lexical weighting prob lex(F|E)
-	   Lexical weighting prob lex(E|F)
-	 */      
-	  
-	  float pEF_ = it->second.counts.value(kCFE) / it->second.counts.value(kCF);
-	  float pFE_ = it->second.counts.value(kCFE) / it->second.counts.value(kCE);
-
-	  map <WordID, pair<int, float> > foreign_aligned;
-	  map <WordID, pair<int, float> > english_aligned;
-
-	  //Loop over all the alignment points to compute lexical translation probability
-	  al = it->second.aligns;	  
-	  for(ita = al.begin(); ita != al.end(); ++ita)
-	    {
-	     
-	      if (DEBUG)
-		{
-		  cerr << "\nA:" << ita->first << "," << ita->second << "::";
-		  cerr <<  TD::Convert(cur_key[ita->first + 2]) << "-" << TD::Convert(it->first[ita->second]);
-		}
-
-
-	      //Lookup this alignment probability in the table
-	      int temp = table.word_translation[pair<WordID,WordID> (cur_key[ita->first+2],it->first[ita->second])];
-	      float f2e=0, e2f=0;
-	      if ( table.total_foreign[cur_key[ita->first+2]] != 0)
-		f2e = (float) temp / table.total_foreign[cur_key[ita->first+2]];
-	      if ( table.total_english[it->first[ita->second]] !=0 )
-		e2f = (float) temp / table.total_english[it->first[ita->second]];
-	      if (DEBUG) printf (" %d %E %E\n", temp, f2e, e2f);
-	      
-	      
-	      //local counts to keep track of which things haven't been aligned, to later compute their null alignment	      
-	      if (foreign_aligned.count(cur_key[ita->first+2]))
-		{
-		  foreign_aligned[ cur_key[ita->first+2] ].first++;
-		  foreign_aligned[ cur_key[ita->first+2] ].second += e2f;
-		}
-	      else
-		foreign_aligned [ cur_key[ita->first+2] ] = pair<int,float> (1,e2f);
-		
-	      
-
-	      if (english_aligned.count( it->first[ ita->second] ))
-		{
-		  english_aligned[ it->first[ ita->second ]].first++;
-		  english_aligned[  it->first[ ita->second] ].second += f2e;
-		}
-	      else
-		english_aligned [ it->first[ ita->second] ] = pair<int,float> (1,f2e);
-		
-	      
-	    
-	   	      
-	    }
-
-	  float final_lex_f2e=1, final_lex_e2f=1;
-	  static const WordID NULL_ = TD::Convert("NULL");
-
-	  //compute lexical weight P(F|E) and include unaligned foreign words
-	   for(int i=0;i<cur_key.size(); i++)
-	     {
-	       
-	       if (!table.total_foreign.count(cur_key[i])) continue;      //if we dont have it in the translation table, we won't know its lexical weight
-	       
-	       if (foreign_aligned.count(cur_key[i])) 
-		 {
-		   pair<int, float> temp_lex_prob = foreign_aligned[cur_key[i]];
-		   final_lex_e2f *= temp_lex_prob.second / temp_lex_prob.first;
-		 }
-	       else //dealing with null alignment
-		 {
-		   int temp_count = table.word_translation[pair<WordID,WordID> (cur_key[i],NULL_)];
-		   float temp_e2f = (float) temp_count / table.total_english[NULL_];
-		   final_lex_e2f *= temp_e2f;
-		 }	       	       
-
-	     }
-
-	   //compute P(E|F) unaligned english words
-	   for(int j=0; j< it->first.size(); j++)
-	     {
-	       if (!table.total_english.count(it->first[j])) continue;
-	       
-	       if (english_aligned.count(it->first[j]))
-		 {
-		   pair<int, float> temp_lex_prob = english_aligned[it->first[j]];
-		   final_lex_f2e *= temp_lex_prob.second / temp_lex_prob.first;
-		 }
-	       else //dealing with null
-		 {
-		   int temp_count = table.word_translation[pair<WordID,WordID> (NULL_,it->first[j])];
-		   float temp_f2e = (float) temp_count / table.total_foreign[NULL_];
-		   final_lex_f2e *= temp_f2e;
-		 }
-	     }
-	   
-	   
-       scored_grammar << TD::GetString(cur_key);
-       string lhs = TD::Convert(cur_key[0]);
-	   scored_grammar << " " << TD::GetString(it->first) << " |||";
-	   if(lhs.find('_')!=string::npos) {
-	       scored_grammar << " Bkoff=" << safenlog(3.0f);
-	   } else {
-	       scored_grammar << " FGivenE=" << safenlog(pFE_) << " EGivenF=" << safenlog(pEF_);
-	       scored_grammar << " LexE2F=" << safenlog(final_lex_e2f) << " LexF2E=" << safenlog(final_lex_f2e);
-	   }  
-	   scored_grammar << endl;
-	}  
+  const int threads = max(conf["threads"].as<int>(), 1);
+  string line;
+  if (threads == 1) {
+    while(getline(unscored_grammar, line)) {
+      if (line.empty()) continue;
+      ScoreLine(table, line.c_str(), &scored_grammar);
     }
-}
+    return 0;
+  }
 
+  const int block_lines = max(conf["block_lines"].as<int>(), threads);
+  BlockScorer scorer(table, threads);
+  vector<string> lines, scored;
+  lines.reserve(block_lines);
+  bool more = true;
+  while (more) {
+    lines.clear();
+    while (lines.size() < block_lines && (more = !getline(unscored_grammar, line).fail()))
+      if (!line.empty()) lines.push_back(line);
+    if (lines.empty()) break;
+    scorer.ScoreBlock(lines, &scored);
+    for (int i = 0; i < scored.size(); ++i)
+      scored_grammar << scored[i];
+  }
+  return 0;
+}
@@ -23,23 +23,26 @@ namespace {
   }
 }
 
+// the vectors keep their storage from one sentence to the next
 void AnnotatedParallelSentence::Reset() {
   f.clear();
   e.clear();
   e_aligned.clear();
   f_aligned.clear();
-  aligns_by_fword.clear();
   aligned.clear();
   span_types.clear();
+  f_len = e_len = 0;
 }
 
 void AnnotatedParallelSentence::AllocateForAlignment() {
   f_len = f.size();
   e_len = e.size();
   aligned.resize(f_len, e_len, false);
-  f_aligned.resize(f_len, 0);
-  e_aligned.resize(e_len, 0);
-  aligns_by_fword.resize(f_len);
+  aligned.fill(false);
+  f_aligned.assign(f_len, 0);
+  e_aligned.assign(e_len, 0);
+  if (aligns_by_fword.size() < f_len) aligns_by_fword.resize(f_len);
+  for (int i = 0; i < f_len; ++i) aligns_by_fword[i].clear();
 }
 
 // read an alignment point of the form X-Y where X and Y are strings
@@ -151,49 +154,33 @@ void AnnotatedParallelSentence::ParseSpanLabel(const char* buf, int start, int e
     exit(1);
   }
   // cerr << a << " " << b << " " << string(buf,c,end-c) << endl;
-  span_types[make_tuple(a,b,c,d)].push_back(-TD::Convert(string(buf, ch, end-ch)));
+  span_types[make_tuple(a,b,c,d)].push_back(-TD::Convert(StringPiece(buf + ch, end - ch)));
 }
 
 // INPUT FORMAT
 // ein haus ||| a house ||| 0-0 1-1 ||| 0-0:DT 1-1:NN 0-1:NP
+// the line is read in one pass, and the words are looked up in place
 void AnnotatedParallelSentence::ParseInputLine(const char* buf) {
   Reset();
   int ptr = 0;
-  SkipWhitespace(buf, &ptr);
-  int start = ptr;
   int state = 0;  // 0 = French, 1 = English, 2 = Alignment, 3 = Spans
-  while(char c = buf[ptr]) {
-    if (!IsWhitespace(c)) { ++ptr; continue; } else {
-      if (ptr - start == 3 && buf[start] == '|' && buf[start+1] == '|' && buf[start+2] == '|') {
-        ++state;
-        if (state == 4) { cerr << "Too many fields (ignoring):\n  " << buf << endl; return; }
-        if (state == 2) {
-          // cerr << "FLEN=" << f->size() << " ELEN=" << e->size() << endl;
-          AllocateForAlignment();
-        }
-        SkipWhitespace(buf, &ptr);
-        start = ptr;
-        continue;
-      }
-      switch (state) {
-        case 0:  f.push_back(TD::Convert(string(buf, start, ptr-start))); break;
-        case 1:  e.push_back(TD::Convert(string(buf, start, ptr-start))); break;
-        case 2:  ParseAlignmentPoint(buf, start, ptr); break;
-        case 3:  ParseSpanLabel(buf, start, ptr); break;
-        default: cerr << "Can't happen\n"; abort();
-      }
-      SkipWhitespace(buf, &ptr);
-      start = ptr;
+  while (true) {
+    SkipWhitespace(buf, &ptr);
+    if (!buf[ptr]) break;
+    const int start = ptr;
+    while (buf[ptr] && !IsWhitespace(buf[ptr])) ++ptr;
+    if (ptr - start == 3 && buf[start] == '|' && buf[start+1] == '|' && buf[start+2] == '|') {
+      ++state;
+      if (state == 4) { cerr << "Too many fields (ignoring):\n  " << buf << endl; return; }
+      if (state == 2) AllocateForAlignment();
+      continue;
     }
-  }
-  if (ptr > start) {
     switch (state) {
-      case 0:  f.push_back(TD::Convert(string(buf, start, ptr-start))); break;
-      case 1:  e.push_back(TD::Convert(string(buf, start, ptr-start))); break;
+      case 0:  f.push_back(TD::Convert(StringPiece(buf + start, ptr - start))); break;
+      case 1:  e.push_back(TD::Convert(StringPiece(buf + start, ptr - start))); break;
       case 2:  ParseAlignmentPoint(buf, start, ptr); break;
       case 3:  ParseSpanLabel(buf, start, ptr); break;
       default: cerr << "Can't happen\n"; abort();
     }
   }
 }
-
@@ -11,7 +11,8 @@
 // represents a parallel sentence with a word alignment and category
 // annotations over subspans (currently in terms of f)
 // you should read one using ParseInputLine and then use the public
-// member variables to query things about it
+// member variables to query things about it.  reading the sentences of a
+// corpus into the same object reuses its storage
 struct AnnotatedParallelSentence {
   // read annotated parallel sentence from string
   void ParseInputLine(const char* buf);
@@ -21,7 +22,7 @@ struct AnnotatedParallelSentence {
   // word alignment information
   std::vector<int> e_aligned, f_aligned; // counts the number of times column/row x is aligned
   Array2D<bool> aligned;
-  std::vector<std::vector<std::pair<short, short> > > aligns_by_fword;
+  std::vector<std::vector<std::pair<short, short> > > aligns_by_fword;  // the first f_len are used
 
   // span type information
   std::map< boost::tuple<short,short,short,short>, std::vector<WordID> > span_types;
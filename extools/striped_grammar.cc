@@ -1,8 +1,12 @@
 #include "striped_grammar.h"
 
 #include <iostream>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
 
 #include "sentence_pair.h"
+#include "fdict.h"
 
 using namespace std;
 
@@ -65,3 +69,240 @@ ostream& operator<<(ostream& os, const RuleStatistics& s) {
   return os;
 }
 
+
+namespace {
+  const char kBinaryMagic[] = { '\0', 'S', 'G', 'B', '1' };
+
+  void PutVarint(size_t x, string* out) {
+    while (x >= 0x80) {
+      *out += static_cast<char>(x | 0x80);
+      x >>= 7;
+    }
+    *out += static_cast<char>(x);
+  }
+
+  // false if [*cur, end) does not start with a complete varint
+  bool GetVarint(const char** cur, const char* end, size_t* x) {
+    *x = 0;
+    for (unsigned shift = 0; *cur < end && shift < 64; shift += 7) {
+      const unsigned char c = *(*cur)++;
+      *x |= static_cast<size_t>(c & 0x7f) << shift;
+      if (!(c & 0x80)) return true;
+    }
+    return false;
+  }
+
+  bool GetVarint(istream* in, size_t* x) {
+    *x = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      const int c = in->get();
+      if (c == istream::traits_type::eof()) return false;
+      *x |= static_cast<size_t>(c & 0x7f) << shift;
+      if (!(c & 0x80)) return true;
+    }
+    return false;
+  }
+
+  void BadStripe(const char* what) {
+    cerr << "Binary stripe decoding error: " << what << endl;
+    exit(1);
+  }
+}
+
+StripeWriter::StripeWriter(ostream* out, bool binary) :
+    out_(*out), binary_(binary), next_word_(), next_feat_() {
+  if (binary_) out_.write(kBinaryMagic, sizeof(kBinaryMagic));
+}
+
+void StripeWriter::Write(const vector<WordID>& key, const ID2RuleStatistics& vals) {
+  vector<ID2RuleStatistics::const_iterator> its;
+  its.reserve(vals.size());
+  for (ID2RuleStatistics::const_iterator it = vals.begin(); it != vals.end(); ++it)
+    its.push_back(it);
+  Write(key, its);
+}
+
+void StripeWriter::Write(const vector<WordID>& key, const vector<ID2RuleStatistics::const_iterator>& vals) {
+  if (binary_) { WriteBinary(key, vals); return; }
+  WriteNamed(key, &out_);
+  out_ << '\t';
+  for (int i = 0; i < vals.size(); ++i) {
+    if (i) out_ << " ||| ";
+    WriteAnonymous(vals[i]->first, &out_);
+    out_ << " ||| " << vals[i]->second;
+  }
+  out_ << '\n';
+}
+
+void StripeWriter::PutRecord(char tag, const string& payload) {
+  string head(1, tag);
+  PutVarint(payload.size(), &head);
+  out_.write(head.data(), head.size());
+  out_.write(payload.data(), payload.size());
+}
+
+unsigned StripeWriter::Define(char tag, const string& name, unsigned* next) {
+  PutRecord(tag, name);
+  return ++*next;
+}
+
+unsigned StripeWriter::SymbolId(WordID w, bool target) {
+  if (w > 0) {
+    unsigned& id = words_[w];
+    if (!id) id = Define('W', TD::Convert(w), &next_word_);
+    return id;
+  }
+  unsigned& id = (target ? trg_nts_ : src_nts_)[w];
+  if (!id) {
+    ostringstream os;
+    if (target) os << '[' << (1 - w) << ']'; else os << '[' << TD::Convert(-w) << ']';
+    id = Define('W', os.str(), &next_word_);
+  }
+  return id;
+}
+
+unsigned StripeWriter::FeatureId(int fid) {
+  unsigned& id = feats_[fid];
+  if (!id) id = Define('F', FD::Convert(fid), &next_feat_);
+  return id;
+}
+
+void StripeWriter::WriteBinary(const vector<WordID>& key, const vector<ID2RuleStatistics::const_iterator>& vals) {
+  // ids are assigned (and their records written) before the stripe's record
+  rec_.clear();
+  PutVarint(key.size(), &rec_);
+  for (int i = 0; i < key.size(); ++i)
+    PutVarint(SymbolId(key[i], false), &rec_);
+  PutVarint(vals.size(), &rec_);
+  for (int i = 0; i < vals.size(); ++i) {
+    const vector<WordID>& trg = vals[i]->first;
+    const RuleStatistics& stats = vals[i]->second;
+    PutVarint(trg.size(), &rec_);
+    for (int j = 0; j < trg.size(); ++j)
+      PutVarint(SymbolId(trg[j], true), &rec_);
+    PutVarint(stats.counts.size(), &rec_);
+    for (SparseVector<float>::const_iterator it = stats.counts.begin(); it != stats.counts.end(); ++it) {
+      PutVarint(FeatureId(it->first), &rec_);
+      const float v = it->second;
+      rec_.append(reinterpret_cast<const char*>(&v), sizeof(float));
+    }
+    PutVarint(stats.aligns.size(), &rec_);
+    for (int j = 0; j < stats.aligns.size(); ++j) {
+      PutVarint(stats.aligns[j].first, &rec_);
+      PutVarint(stats.aligns[j].second, &rec_);
+    }
+  }
+  PutRecord('S', rec_);
+}
+
+// a word of the input and what it means in the key and target side of a
+// grammar stripe, as the text lexer reads them
+struct BinaryStripeSymbol {
+  WordID word;
+  WordID lhs;  // -category for [X], otherwise 0
+  WordID src;  // -category for [X] or [X,n], otherwise word
+  WordID trg;  // 1-n for [n], otherwise word
+};
+
+static BinaryStripeSymbol ReadSymbol(const string& s) {
+  BinaryStripeSymbol r;
+  r.word = r.src = r.trg = TD::Convert(s);
+  r.lhs = 0;
+  if (s.size() > 2 && s[0] == '[' && s[s.size() - 1] == ']') {
+    const string inner = s.substr(1, s.size() - 2);
+    if (inner.find_first_not_of("0123456789") == string::npos) {
+      r.trg = 1 - atoi(inner.c_str());
+    } else {
+      const size_t comma = inner.find(',');
+      r.src = -TD::Convert(inner.substr(0, comma));
+      if (comma == string::npos) r.lhs = r.src;
+    }
+  }
+  return r;
+}
+
+void StripedGrammarLexer::ReadBinary(istream* in, GrammarCallback gfunc, ContextCallback cfunc, void* extra) {
+  static const WordID kDIV = TD::Convert("|||");
+  vector<BinaryStripeSymbol> syms;
+  vector<int> feats;
+  string rec;
+  vector<WordID> key, trg;
+  ID2RuleStatistics rules;
+  while (true) {
+    const int tag = in->get();
+    if (tag == istream::traits_type::eof()) break;
+    if (tag == 0) {  // the header of a stream, possibly one of several concatenated
+      char magic[sizeof(kBinaryMagic) - 1];
+      if (!in->read(magic, sizeof(magic)) || memcmp(magic, kBinaryMagic + 1, sizeof(magic)))
+        BadStripe("bad header");
+      syms.clear();
+      feats.clear();
+      continue;
+    }
+    size_t size;
+    if (!GetVarint(in, &size)) BadStripe("truncated record");
+    rec.resize(size);
+    if (size && !in->read(&rec[0], size)) BadStripe("truncated record");
+    if (tag == 'W') {
+      syms.push_back(ReadSymbol(rec));
+      continue;
+    } else if (tag == 'F') {
+      feats.push_back(FD::Convert(rec));
+      continue;
+    } else if (tag != 'S') {
+      BadStripe("unknown record type");
+    }
+    const char* cur = rec.data();
+    const char* end = cur + size;
+    size_t n, id;
+    if (!GetVarint(&cur, end, &n)) BadStripe("bad key");
+    key.resize(n);
+    for (int i = 0; i < n; ++i) {
+      if (!GetVarint(&cur, end, &id) || id == 0 || id > syms.size()) BadStripe("bad word id");
+      key[i] = id;
+    }
+    size_t num_vals;
+    if (!GetVarint(&cur, end, &num_vals)) BadStripe("bad value count");
+    rules.clear();
+    for (int v = 0; v < num_vals; ++v) {
+      if (!GetVarint(&cur, end, &n)) BadStripe("bad value");
+      trg.resize(n);
+      for (int i = 0; i < n; ++i) {
+        if (!GetVarint(&cur, end, &id) || id == 0 || id > syms.size()) BadStripe("bad word id");
+        trg[i] = gfunc ? syms[id - 1].trg : syms[id - 1].word;
+      }
+      RuleStatistics& stats = rules[trg];
+      if (!GetVarint(&cur, end, &n)) BadStripe("bad count");
+      for (int i = 0; i < n; ++i) {
+        if (!GetVarint(&cur, end, &id) || id == 0 || id > feats.size() || end - cur < sizeof(float))
+          BadStripe("bad count");
+        float val;
+        memcpy(&val, cur, sizeof(float));
+        cur += sizeof(float);
+        stats.counts.add_value(feats[id - 1], val);
+      }
+      if (!GetVarint(&cur, end, &n)) BadStripe("bad alignment");
+      stats.aligns.resize(n);
+      for (int i = 0; i < n; ++i) {
+        size_t a, b;
+        if (!GetVarint(&cur, end, &a) || !GetVarint(&cur, end, &b)) BadStripe("bad alignment");
+        stats.aligns[i] = make_pair(static_cast<short>(a), static_cast<short>(b));
+      }
+    }
+    if (cur != end) BadStripe("trailing bytes");
+    if (gfunc) {
+      // [LHS] ||| source side
+      if (key.size() < 3 || !syms[key[0] - 1].lhs || syms[key[1] - 1].word != kDIV)
+        BadStripe("grammar stripe keys must have the form [LHS] ||| source");
+      const WordID lhs = syms[key[0] - 1].lhs;
+      for (int i = 2; i < key.size(); ++i)
+        key[i - 2] = syms[key[i] - 1].src;
+      key.resize(key.size() - 2);
+      gfunc(lhs, key, rules, extra);
+    } else {
+      for (int i = 0; i < key.size(); ++i)
+        key[i] = syms[key[i] - 1].word;
+      cfunc(key, rules, extra);
+    }
+  }
+}
@@ -2,6 +2,7 @@
 #define _STRIPED_GRAMMAR_H_
 
 #include <iostream>
+#include <string>
 #include <boost/functional/hash.hpp>
 #include <vector>
 #include <tr1/unordered_map>
@@ -46,11 +47,52 @@ inline void WriteAnonymous(const std::vector<WordID>& v, std::ostream* os) {
 
 typedef std::tr1::unordered_map<std::vector<WordID>, RuleStatistics, boost::hash<std::vector<WordID> > > ID2RuleStatistics;
 
+// both readers take text stripes or binary stripes (see StripeWriter),
+// telling them apart by the first byte of the input
 struct StripedGrammarLexer {
   typedef void (*GrammarCallback)(WordID lhs, const std::vector<WordID>& src_rhs, const ID2RuleStatistics& rules, void *extra);
   static void ReadStripedGrammar(std::istream* in, GrammarCallback func, void* extra);
   typedef void (*ContextCallback)(const std::vector<WordID>& phrase, const ID2RuleStatistics& rules, void *extra);
   static void ReadContexts(std::istream* in, ContextCallback func, void* extra);
+
+  // true if in starts with binary stripes
+  static bool IsBinary(std::istream* in) { return in->peek() == 0; }
+  // reads binary stripes for ReadStripedGrammar (gfunc) or ReadContexts (cfunc)
+  static void ReadBinary(std::istream* in, GrammarCallback gfunc, ContextCallback cfunc, void* extra);
+};
+
+// writes stripes: a key, a tab and the target sides with their statistics.
+// keys are written as WriteNamed and target sides as WriteAnonymous would
+// write them, so they may hold words or nonterminals.
+//
+// the binary form holds the same records without text: a stream starts
+// with a magic header, and every record is a tag byte, a varint byte count
+// and the payload.  a word or feature name gets a varint id in a record of
+// its own the first time it is used, and stripes refer to words and
+// features by these ids, with counts as 32-bit floats.  binary streams may
+// be concatenated.
+class StripeWriter {
+ public:
+  StripeWriter(std::ostream* out, bool binary);
+
+  void Write(const std::vector<WordID>& key, const ID2RuleStatistics& vals);
+  // writes the target sides in the order given
+  void Write(const std::vector<WordID>& key, const std::vector<ID2RuleStatistics::const_iterator>& vals);
+
+ private:
+  void WriteBinary(const std::vector<WordID>& key, const std::vector<ID2RuleStatistics::const_iterator>& vals);
+  // id of a key (target = false) or target side symbol
+  unsigned SymbolId(WordID w, bool target);
+  unsigned FeatureId(int fid);
+  unsigned Define(char tag, const std::string& name, unsigned* next);
+  void PutRecord(char tag, const std::string& payload);
+
+  std::ostream& out_;
+  const bool binary_;
+  std::tr1::unordered_map<WordID, unsigned> words_, src_nts_, trg_nts_;
+  std::tr1::unordered_map<int, unsigned> feats_;
+  unsigned next_word_, next_feat_;
+  std::string rec_;
 };
 
 #endif
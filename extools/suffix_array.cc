@@ -0,0 +1,78 @@
+#include "suffix_array.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+  // orders suffixes by their first 2k words, given the ranks of their
+  // first k words. suffixes running off the end of the text sort first
+  struct DoubledRankCmp {
+    DoubledRankCmp(const vector<int>& r, int pk) : rank(r), k(pk), n(r.size()) {}
+    bool operator()(int a, int b) const {
+      if (rank[a] != rank[b]) return rank[a] < rank[b];
+      const int ra = (a + k < n) ? rank[a + k] : -1;
+      const int rb = (b + k < n) ? rank[b + k] : -1;
+      return ra < rb;
+    }
+    const vector<int>& rank;
+    const int k;
+    const int n;
+  };
+}
+
+const WordID SuffixArray::kEND;
+
+void SuffixArray::AddSentence(const vector<WordID>& s) {
+  const int sent = sent_start_.size();
+  sent_start_.push_back(text_.size());
+  text_.insert(text_.end(), s.begin(), s.end());
+  text_.push_back(kEND);
+  sent_id_.resize(text_.size(), sent);
+}
+
+void SuffixArray::Build() {
+  const int n = text_.size();
+  sa_.resize(n);
+  if (n == 0) return;
+  vector<int> rank(n), tmp(n);
+  for (int i = 0; i < n; ++i) {
+    sa_[i] = i;
+    rank[i] = text_[i] - kEND;  // end markers rank lowest
+  }
+  for (int k = 1; ; k *= 2) {
+    DoubledRankCmp cmp(rank, k);
+    sort(sa_.begin(), sa_.end(), cmp);
+    tmp[sa_[0]] = 0;
+    for (int i = 1; i < n; ++i)
+      tmp[sa_[i]] = tmp[sa_[i-1]] + (cmp(sa_[i-1], sa_[i]) ? 1 : 0);
+    rank.swap(tmp);
+    if (rank[sa_[n-1]] == n - 1) break;  // all suffixes are distinct
+  }
+}
+
+bool SuffixArray::Extend(int len, WordID w, int* begin, int* end) const {
+  // within [*begin, *end) the word at offset len is sorted
+  int lo = *begin, hi = *end;
+  while (lo < hi) {
+    const int mid = lo + (hi - lo) / 2;
+    if (At(sa_[mid] + len) < w) lo = mid + 1; else hi = mid;
+  }
+  const int b = lo;
+  hi = *end;
+  while (lo < hi) {
+    const int mid = lo + (hi - lo) / 2;
+    if (At(sa_[mid] + len) <= w) lo = mid + 1; else hi = mid;
+  }
+  *begin = b;
+  *end = lo;
+  return b < lo;
+}
+
+bool SuffixArray::Lookup(const WordID* phrase, int len, int* begin, int* end) const {
+  *begin = 0;
+  *end = sa_.size();
+  for (int i = 0; i < len; ++i)
+    if (!Extend(i, phrase[i], begin, end)) return false;
+  return *begin < *end;
+}
@@ -0,0 +1,51 @@
+#ifndef _SUFFIX_ARRAY_H_
+#define _SUFFIX_ARRAY_H_
+
+#include <vector>
+#include "wordid.h"
+
+// suffix array over a corpus of sentences (Manber & Myers, 1993).
+// sentences are concatenated, each followed by an end-of-sentence marker
+// that no query phrase contains, so matches never cross sentences.
+// the index takes 3 ints per word and a phrase is found in
+// O(|phrase| log n), unlike the trie in suffix_tree.h which is
+// quadratic in sentence length.
+class SuffixArray {
+ public:
+  // add all sentences before calling Build()
+  void AddSentence(const std::vector<WordID>& s);
+
+  // sort the suffixes by prefix doubling, O(n log^2 n)
+  void Build();
+
+  // sets [*begin, *end) to the range of suffixes that start with
+  // phrase[0..len). returns false if there are none
+  bool Lookup(const WordID* phrase, int len, int* begin, int* end) const;
+
+  // narrows [*begin, *end), the range of a phrase of length len, to the
+  // suffixes that also have w at position len.  this extends a phrase one
+  // word at a time without searching the whole array again
+  bool Extend(int len, WordID w, int* begin, int* end) const;
+
+  // corpus position of the i'th smallest suffix
+  int Position(int i) const { return sa_[i]; }
+  // index of the sentence containing corpus position pos
+  int SentenceAt(int pos) const { return sent_id_[pos]; }
+  // position of the sentence start
+  int SentenceStart(int sent) const { return sent_start_[sent]; }
+
+  int size() const { return sa_.size(); }
+  int num_sentences() const { return sent_start_.size(); }
+
+ private:
+  // word at position pos, or the end marker past the end of the text
+  WordID At(int pos) const { return pos < text_.size() ? text_[pos] : kEND; }
+
+  static const WordID kEND = -1;
+  std::vector<WordID> text_;
+  std::vector<int> sa_;
+  std::vector<int> sent_id_;
+  std::vector<int> sent_start_;
+};
+
+#endif
@@ -25,6 +25,14 @@ void ShowTopWordsForTopic(const map<WordID, int>& counts) {
   cerr << endl;
 }
 
+// the parts of c.prob(dish, p0) that don't depend on the dish:
+// prob = (customers - *disc * tables + *r0) * *norm
+void CacheTopic(const CCRP<int>& c, double p0, double* disc, double* r0, double* norm) {
+  *disc = c.discount();
+  *r0 = (c.num_tables_ * c.discount() + c.concentration()) * p0;
+  *norm = 1.0 / (c.num_customers() + c.concentration());
+}
+
 int main(int argc, char** argv) {
   if (argc != 3) {
     cerr << "Usage: " << argv[0] << " num-classes num-samples\n";
@@ -77,6 +85,26 @@ int main(int argc, char** argv) {
       wr[random_topic].increment(word, uniform_word, &rng);
     }
   }
+  // the per-token loop over topics reads only contiguous arrays: the word
+  // restaurants' counts are mirrored word major (wcust/wtabs, kept in step
+  // with wr through the table deltas increment and decrement return), their
+  // parameters and denominators are cached per topic and refreshed when a
+  // topic changes, and the current document's counts are expanded into
+  // dense arrays.  The document's denominator is the same for every topic,
+  // so it is left out of the scores
+  const int num_word_ids = TD::NumWords() + 1;
+  vector<unsigned> wcust(num_word_ids * num_classes), wtabs(num_word_ids * num_classes);
+  for (int k = 0; k < num_classes; ++k) {
+    for (CCRP<int>::const_iterator it = wr[k].begin(); it != wr[k].end(); ++it) {
+      wcust[it->first * num_classes + k] = it->second.total_dish_count_;
+      wtabs[it->first * num_classes + k] = it->second.num_tables_;
+    }
+  }
+  vector<double> wdisc(num_classes), wr0(num_classes), wnorm(num_classes);
+  for (int k = 0; k < num_classes; ++k)
+    CacheTopic(wr[k], uniform_word, &wdisc[k], &wr0[k], &wnorm[k]);
+  vector<unsigned> dcust(num_classes), dtabs(num_classes);
+
   cerr << "SAMPLING\n";
   vector<map<WordID, int> > t2w(num_classes);
   Timer timer;
@@ -90,10 +118,10 @@ int main(int argc, char** argv) {
       timer.Reset();
       double llh = 0;
 #if 1
-      for (int j = 0; j < dr.size(); ++j)
-        dr[j].resample_hyperparameters(&rng);
-      for (int j = 0; j < wr.size(); ++j)
-        wr[j].resample_hyperparameters(&rng);
+      ResampleHyperparameters(dr.begin(), dr.end(), &rng, boost::thread::hardware_concurrency());
+      ResampleHyperparameters(wr.begin(), wr.end(), &rng, boost::thread::hardware_concurrency());
+      for (int k = 0; k < num_classes; ++k)
+        CacheTopic(wr[k], uniform_word, &wdisc[k], &wr0[k], &wnorm[k]);
 #endif
 
       for (int j = 0; j < dr.size(); ++j)
@@ -106,18 +134,36 @@ int main(int argc, char** argv) {
       const size_t num_words = wji[j].size();
       vector<int>& zj = zji[j];
       const vector<int>& wj = wji[j];
+      CCRP<int>& d = dr[j];
+      fill(dcust.begin(), dcust.end(), 0u);
+      fill(dtabs.begin(), dtabs.end(), 0u);
+      for (CCRP<int>::const_iterator it = d.begin(); it != d.end(); ++it) {
+        dcust[it->first] = it->second.total_dish_count_;
+        dtabs[it->first] = it->second.num_tables_;
+      }
       for (int i = 0; i < num_words; ++i) {
         const int word = wj[i];
         const int cur_topic = zj[i];
-        dr[j].decrement(cur_topic, &rng);
-        wr[cur_topic].decrement(word, &rng);
- 
+        --dcust[cur_topic];
+        dtabs[cur_topic] += d.decrement(cur_topic, &rng);
+        --wcust[word * num_classes + cur_topic];
+        wtabs[word * num_classes + cur_topic] += wr[cur_topic].decrement(word, &rng);
+        CacheTopic(wr[cur_topic], uniform_word, &wdisc[cur_topic], &wr0[cur_topic], &wnorm[cur_topic]);
+
+        const double ddisc = d.discount();
+        const double dr0 = (d.num_tables_ * ddisc + d.concentration()) * uniform_topic;
+        const unsigned* wc = &wcust[word * num_classes];
+        const unsigned* wt = &wtabs[word * num_classes];
         for (int k = 0; k < num_classes; ++k) {
-          ss[k]= dr[j].prob(k, uniform_topic) * wr[k].prob(word, uniform_word);
+          ss[k] = (dcust[k] - ddisc * dtabs[k] + dr0) *
+                  (wc[k] - wdisc[k] * wt[k] + wr0[k]) * wnorm[k];
         }
         const int new_topic = rng.SelectSample(ss);
-        dr[j].increment(new_topic, uniform_topic, &rng);
-        wr[new_topic].increment(word, uniform_word, &rng);
+        ++dcust[new_topic];
+        dtabs[new_topic] += d.increment(new_topic, uniform_topic, &rng);
+        ++wcust[word * num_classes + new_topic];
+        wtabs[word * num_classes + new_topic] += wr[new_topic].increment(word, uniform_word, &rng);
+        CacheTopic(wr[new_topic], uniform_word, &wdisc[new_topic], &wr0[new_topic], &wnorm[new_topic]);
         zj[i] = new_topic;
         if (iter > burnin_size) {
           ++t2w[cur_topic][word];
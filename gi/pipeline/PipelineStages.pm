@@ -0,0 +1,170 @@
+package PipelineStages;
+
+# Checkpointed, restartable pipeline stages.
+#
+# run_stage runs the commands producing a stage's outputs and, if they all
+# succeed, writes a stamp file next to the first output recording an MD5 of
+# the commands and of the contents of every input.  On a rerun the stage is
+# skipped only if its outputs and stamp exist and the commands and inputs
+# still hash the same, so a stage that died half way (no stamp) or whose
+# inputs or parameters changed is run again.  Input hashes are recorded
+# with the file's size and mtime and only recomputed when these change.
+#
+# run_stages runs a DAG of stages, forking up to a given number of
+# independent ones at a time.
+
+use strict;
+use warnings;
+
+use base 'Exporter';
+our @EXPORT = qw( run_stage run_stages );
+
+use Digest::MD5;
+
+sub file_md5 {
+  my ($file) = @_;
+  open my $fh, '<', $file or die "Can't read $file: $!";
+  binmode $fh;
+  my $md5 = Digest::MD5->new->addfile($fh)->hexdigest;
+  close $fh;
+  return $md5;
+}
+
+sub read_stamp {
+  my ($stamp) = @_;
+  my %s = ( inputs => {} );
+  open my $fh, '<', $stamp or return undef;
+  while (<$fh>) {
+    chomp;
+    my @f = split /\t/;
+    if ($f[0] eq 'commands') { $s{commands} = $f[1]; }
+    elsif ($f[0] eq 'input') { $s{inputs}->{$f[1]} = [ $f[2], $f[3], $f[4] ]; }
+  }
+  close $fh;
+  return \%s;
+}
+
+# [ size, mtime, md5 ] of $file, reusing the md5 in $old if size and mtime match
+sub input_signature {
+  my ($file, $old) = @_;
+  my @st = stat $file or die "Can't find stage input $file\n";
+  my ($size, $mtime) = ($st[7], $st[9]);
+  if ($old && $old->[0] == $size && $old->[1] == $mtime) { return [ $size, $mtime, $old->[2] ]; }
+  return [ $size, $mtime, file_md5($file) ];
+}
+
+# run_stage(\@outputs or $output, \@inputs, @commands)
+# returns true if the outputs are up to date (already, or after running the
+# commands), false if a command failed, in which case the outputs are removed
+sub run_stage {
+  my ($outputs, $inputs, @commands) = @_;
+  my @outputs = ref $outputs ? @$outputs : ($outputs);
+  my $stamp = "$outputs[0].done";
+  my $commands = Digest::MD5::md5_hex(join "\n", @commands);
+  my $old = read_stamp($stamp);
+  my %inputs;
+  for my $input (@$inputs) {
+    $inputs{$input} = input_signature($input, $old ? $old->{inputs}->{$input} : undef);
+  }
+
+  my $up_to_date = defined $old && defined $old->{commands} && $old->{commands} eq $commands
+                   && scalar(keys %{$old->{inputs}}) == scalar(keys %inputs);
+  for my $output (@outputs) { $up_to_date &&= -e $output; }
+  for my $input (keys %inputs) {
+    last unless $up_to_date;
+    my $o = $old->{inputs}->{$input};
+    $up_to_date = defined $o && $o->[2] eq $inputs{$input}->[2];
+  }
+  if ($up_to_date) {
+    print STDERR "@outputs up to date, reusing...\n";
+    return 1;
+  }
+
+  unlink $stamp;
+  for my $cmd (@commands) {
+    if (!run_command($cmd)) {
+      for my $output (@outputs) {
+        if (-e $output) { print STDERR "Removing $output\n"; `rm -rf $output`; }
+      }
+      return 0;
+    }
+  }
+
+  open my $fh, '>', "$stamp.tmp" or die "Can't write $stamp.tmp: $!";
+  print $fh "commands\t$commands\n";
+  for my $input (sort keys %inputs) { print $fh join("\t", 'input', $input, @{$inputs{$input}}), "\n"; }
+  close $fh or die "Can't write $stamp.tmp: $!";
+  rename "$stamp.tmp", $stamp or die "Can't rename $stamp.tmp: $!";
+  return 1;
+}
+
+sub run_command {
+  my ($cmd) = @_;
+  print STDERR "Executing: $cmd\n";
+  system($cmd);
+  if ($? == -1) {
+    print STDERR "ERROR: Failed to execute: $cmd\n  $!\n";
+    return 0;
+  } elsif ($? & 127) {
+    printf STDERR "ERROR: Execution of: $cmd\n  died with signal %d, %s coredump\n",
+        ($? & 127),  ($? & 128) ? 'with' : 'without';
+    return 0;
+  }
+  my $exitcode = $? >> 8;
+  print STDERR "Exit code: $exitcode\n" if $exitcode;
+  return ! $exitcode;
+}
+
+# run_stages($jobs, { name => { deps => [ names ], run => sub { ... } }, ... })
+# runs each stage's sub, which returns true on success, once all of its deps
+# have finished, with up to $jobs of them at once in forked processes (so a
+# stage can't pass anything but files on to the stages after it).  Dies if
+# a stage fails, after waiting for the running ones.
+sub run_stages {
+  my ($jobs, $stages) = @_;
+  $jobs = 1 if !$jobs || $jobs < 1;
+  my %pending = map { $_ => 1 } keys %$stages;
+  my %done;
+  my %running; # pid => name
+  my @failed;
+  for my $name (keys %$stages) {
+    for my $dep (@{$stages->{$name}->{deps} || []}) {
+      die "Stage $name depends on unknown stage $dep\n" unless exists $stages->{$dep};
+    }
+  }
+  while (%pending || %running) {
+    if (!@failed) {
+      for my $name (sort keys %pending) {
+        last if scalar(keys %running) >= $jobs;
+        next if grep { !$done{$_} } @{$stages->{$name}->{deps} || []};
+        delete $pending{$name};
+        print STDERR "\n!!!STARTING STAGE $name\n";
+        my $pid = fork;
+        die "Can't fork: $!" unless defined $pid;
+        if ($pid == 0) {
+          my $ok = eval { $stages->{$name}->{run}->() };
+          print STDERR $@ if $@;
+          exit($ok ? 0 : 1);
+        }
+        $running{$pid} = $name;
+      }
+    }
+    if (!%running) {
+      last if @failed;
+      die "Stages @{[sort keys %pending]} can't run: circular dependencies\n";
+    }
+    my $pid = wait;
+    next unless exists $running{$pid};
+    my $name = delete $running{$pid};
+    if ($? == 0) {
+      $done{$name} = 1;
+      print STDERR "\n!!!FINISHED STAGE $name\n";
+    } else {
+      print STDERR "\n!!!STAGE $name FAILED\n";
+      push @failed, $name;
+    }
+  }
+  die "Failed stages: @failed\n" if @failed;
+}
+
+1;
@@ -6,6 +6,7 @@ my $CWD = getcwd;
 
 my $SCRIPT_DIR; BEGIN { use Cwd qw/ abs_path /; use File::Basename; $SCRIPT_DIR = dirname(abs_path($0)); push @INC, $SCRIPT_DIR, "$SCRIPT_DIR/../../environment"; }
 use LocalConfig;
+use PipelineStages;
 
 my $JOBS = 15;
 my $PMEM = "9G";
@@ -202,19 +203,19 @@ if($gluegram) {
     safesystem(undef,"cp $gluegram $glue_grmr");
 }
 
-# MAKE DEV
-print STDERR "\nFILTERING FOR dev...\n";
+# MAKE DEV AND TEST (independent, so filtered in parallel)
+print STDERR "\nFILTERING FOR dev AND test...\n";
 print STDERR "DEV: $dev (REFS=$drefs)\n";
-my $devgrammar = filter($grammar, $dev, 'dev', $outdir);
+print STDERR "TEST: $test (EVAL=$teval)\n";
+run_stages($JOBS, {
+  'filter-dev' => { run => sub { filter($grammar, $dev, 'dev', $outdir); 1 } },
+  'filter-test' => { run => sub { filter($grammar, $test, 'test', $outdir); 1 } },
+});
+my $devgrammar = filtered_grammar('dev', $outdir);
 my $devini = mydircat($outdir, "cdec-dev.ini");
 write_cdec_ini($devini, $devgrammar);
 
-
-# MAKE TEST
-print STDERR "\nFILTERING FOR test...\n";
-print STDERR "TEST: $test (EVAL=$teval)\n";
-`mkdir -p $outdir`;
-my $testgrammar = filter($grammar, $test, 'test', $outdir);
+my $testgrammar = filtered_grammar('test', $outdir);
 my $testini = mydircat($outdir, "cdec-test.ini");
 write_cdec_ini($testini, $testgrammar);
 
@@ -270,19 +271,23 @@ sub write_random_weights_file {
   close F;
 }
 
+sub filtered_grammar {
+  my ($name, $outdir) = @_;
+  return mydircat($outdir, "$name.scfg.gz");
+}
+
+# each step is rerun only if its inputs or command line changed
 sub filter {
   my ($grammar, $set, $name, $outdir) = @_;
   my $out1 = mydircat($outdir, "$name.filt.gz");
   my $out2 = mydircat($outdir, "$name.f_feat.gz");
-  my $outgrammar = mydircat($outdir, "$name.scfg.gz");
-  if (-f $outgrammar) { print STDERR "$outgrammar exists - REUSING!\n"; } else {
-    my $cmd = "gunzip -c $grammar | $FILTER -t $set | gzip > $out1";
-    safesystem($out1, $cmd) or die "Filtering failed.";
-    $cmd = "gunzip -c $out1 | $FEATURIZE $FEATURIZER_OPTS -g $out1 -c $CORPUS | gzip > $out2";
-    safesystem($out2, $cmd) or die "Featurizing failed";
-    $cmd = "$FILTERBYF $NUM_TRANSLATIONS $out2 $outgrammar";
-    safesystem($outgrammar, $cmd) or die "Secondary filtering failed";
-  }
+  my $outgrammar = filtered_grammar($name, $outdir);
+  my $cmd = "gunzip -c $grammar | $FILTER -t $set | gzip > $out1";
+  run_stage($out1, [ $grammar, $set ], $cmd) or die "Filtering failed.";
+  $cmd = "gunzip -c $out1 | $FEATURIZE $FEATURIZER_OPTS -g $out1 -c $CORPUS | gzip > $out2";
+  run_stage($out2, [ $out1, $CORPUS ], $cmd) or die "Featurizing failed";
+  $cmd = "$FILTERBYF $NUM_TRANSLATIONS $out2 $outgrammar";
+  run_stage($outgrammar, [ $out2 ], $cmd) or die "Secondary filtering failed";
   return $outgrammar;
 }  
 
@@ -5,6 +5,7 @@ use File::Copy;
 my $SCRIPT_DIR; BEGIN { use Cwd qw/ abs_path cwd /; use File::Basename; $SCRIPT_DIR = dirname(abs_path($0)); push @INC, $SCRIPT_DIR; }
 
 use Getopt::Long "GetOptions";
+use PipelineStages;
 
 my $GZIP = 'gzip';
 my $ZCAT = 'gunzip -c';
@@ -29,6 +30,7 @@ my $PR_SCALE_P = 0;
 my $PR_SCALE_C = 0;
 my $PR_FLAGS = "";
 my $MORFMARK = "";
+my $JOBS = 1;   # independent stages run at once
 
 my $EXTOOLS = "$SCRIPT_DIR/../../extools";
 die "Can't find extools: $EXTOOLS" unless -e $EXTOOLS && -d $EXTOOLS;
@@ -85,6 +87,7 @@ usage() unless &GetOptions('base_phrase_max_size=i' => \$BASE_PHRASE_MAX_SIZE,
                            'get_name_only' => \$NAME_SHORTCUT,
                            'preserve_phrases' => \$PRESERVE_PHRASES,
                            'morf=s' => \$MORFMARK,
+                           'jobs=i' => \$JOBS,
                           );
 if ($NAME_SHORTCUT) {
   $NUM_TOPICS = $NUM_TOPICS_FINE;
@@ -136,68 +139,65 @@ if(-e $TOPICS_CONFIG) {
     copy($TOPICS_CONFIG, $CLUSTER_DIR) or die "Copy failed: $!";
 }
 
-setup_data();
-
-if (lc($MODEL) eq "blagree") {
-    extract_bilingual_context();
-} else {
-    extract_context();
-}
-
-if (lc($MODEL) eq "pyp") {
-    if($HIER_CAT) {
+# each stage is skipped if its outputs are up to date (see PipelineStages.pm);
+# stages that don't depend on each other run in parallel, up to --jobs
+my %stages = (
+  'data' => { run => sub { setup_data(); 1 } },
+  'context' => { deps => [ 'data' ],
+                 run => sub { lc($MODEL) eq "blagree" ? extract_bilingual_context() : extract_context(); 1 } },
+);
+die "Unsupported model type: $MODEL. Must be one of PYP or PREM.\n" unless lc($MODEL) eq "pyp" || lc($MODEL) =~ /pr|em|agree/;
+my $train = sub { if (lc($MODEL) eq "pyp") { topic_train(); } else { prem_train(); } 1 };
+if($HIER_CAT) {
+    # the coarse and fine clusterings are independent up to the frequencies
+    $stages{'cluster-coarse'} = { deps => [ 'context' ], run => sub {
         $NUM_TOPICS = $NUM_TOPICS_COARSE;
         $CLUSTER_DIR = $CLUSTER_DIR_C;
-        topic_train();
+        $train->(); } };
+    $stages{'cluster-fine'} = { deps => [ 'context' ], run => sub {
         $NUM_TOPICS = $NUM_TOPICS_FINE;
         $CLUSTER_DIR = $CLUSTER_DIR_F;
-        topic_train();
-    } else {
-        topic_train();
-    }
-} elsif (lc($MODEL) =~ /pr|em|agree/) {
-    prem_train();
-} else { die "Unsupported model type: $MODEL. Must be one of PYP or PREM.\n"; }
-if($HIER_CAT) {
-    $NUM_TOPICS = $NUM_TOPICS_COARSE;
-    $CLUSTER_DIR = $CLUSTER_DIR_C;
-    $LABELED_DIR = $LABELED_DIR_C;
-    label_spans_with_topics();
-    $NUM_TOPICS = $NUM_TOPICS_FINE;
-    $CLUSTER_DIR = $CLUSTER_DIR_F;
-    $LABELED_DIR = $LABELED_DIR_F;
-    label_spans_with_topics();
-    extract_freqs();
-} else {
-    label_spans_with_topics();
-}
-my $res;
-if ($BIDIR) {
-  $res = grammar_extract_bidir();
+        $train->(); } };
+    $stages{'label-coarse'} = { deps => [ 'cluster-coarse' ], run => sub {
+        $NUM_TOPICS = $NUM_TOPICS_COARSE;
+        $CLUSTER_DIR = $CLUSTER_DIR_C;
+        $LABELED_DIR = $LABELED_DIR_C;
+        label_spans_with_topics(); 1 } };
+    $stages{'label-fine'} = { deps => [ 'cluster-fine' ], run => sub {
+        $NUM_TOPICS = $NUM_TOPICS_FINE;
+        $CLUSTER_DIR = $CLUSTER_DIR_F;
+        $LABELED_DIR = $LABELED_DIR_F;
+        label_spans_with_topics(); 1 } };
+    $stages{'freqs'} = { deps => [ 'label-coarse', 'label-fine' ], run => sub { extract_freqs(); 1 } };
+    $stages{'grammar'} = { deps => [ 'freqs' ] };
 } else {
-  $res = grammar_extract();
+    $stages{'cluster'} = { deps => [ 'context' ], run => $train };
+    $stages{'label'} = { deps => [ 'cluster' ], run => sub { label_spans_with_topics(); 1 } };
+    $stages{'grammar'} = { deps => [ 'label' ] };
 }
+# (with the fine model's settings, which are the current ones)
+$stages{'grammar'}->{run} = sub { if ($BIDIR) { grammar_extract_bidir(); } else { grammar_extract(); } 1 };
+run_stages($JOBS, \%stages);
+my $res = ($BIDIR ? grammar_bidir_file() : grammar_file());
 print STDERR "\n!!!COMPLETE!!!\n";
 print STDERR "GRAMMAR: $res\nYou should probably run: $SCRIPT_DIR/evaluation-pipeline.pl LANGPAIR giwork/ct1s0.L10.PYP.t4.s20.grammar/grammar.gz -f FEAT1 -f FEAT2\n\n";
 exit 0;
 
 sub setup_data {
   print STDERR "\n!!!PREPARE CORPORA!!!\n";
-  if (-f $CORPUS_LEX && $CORPUS_CLUSTER) {
-    print STDERR "$CORPUS_LEX and $CORPUS_CLUSTER exist, reusing...\n";
-    return;
-  }
-  copy($CORPUS, $CORPUS_LEX);
+  my @cmds = ("cp $CORPUS $CORPUS_LEX");
+  my @inputs = ($CORPUS);
   if ($TAGGED_CORPUS) {
     die "Can't find $TAGGED_CORPUS" unless -f $TAGGED_CORPUS;
     my $opt="";
     $opt = "-s" if ($LANGUAGE eq "source");
     $opt = $opt . " -a" if ($PRESERVE_PHRASES);
-    my $cmd="$PATCH_CORPUS $opt $TAGGED_CORPUS $CORPUS_LEX > $CORPUS_CLUSTER";
-    safesystem($cmd) or die "Failed to extract contexts.";
+    push @cmds, "$PATCH_CORPUS $opt $TAGGED_CORPUS $CORPUS_LEX > $CORPUS_CLUSTER";
+    push @inputs, $TAGGED_CORPUS;
   } else {
-    symlink($LEX_NAME, $CORPUS_CLUSTER);
+    push @cmds, "ln -sf $LEX_NAME $CORPUS_CLUSTER";
   }
+  run_stage([ $CORPUS_LEX, $CORPUS_CLUSTER ], \@inputs, @cmds) or die "Failed to prepare corpora.";
 }
 
 sub context_dir {
@@ -265,9 +265,7 @@ sub assert_exec {
 sub extract_context {
  print STDERR "\n!!!CONTEXT EXTRACTION\n"; 
  my $OUT_CONTEXTS = "$CONTEXT_DIR/context.txt.gz";
- if (-e $OUT_CONTEXTS) {
-   print STDERR "$OUT_CONTEXTS exists, reusing...\n";
- } else {
+ {
    my $ccopt = "-c $ITEMS_IN_MEMORY";
    my $postsort = "| $REDUCER ";
    if ($COMPLETE_CACHE) {
@@ -283,7 +281,7 @@ sub extract_context {
    }
 
    my $cmd = "$EXTRACTOR -i $CORPUS_CLUSTER $ccopt -L $BASE_PHRASE_MAX_SIZE -C -S $CONTEXT_SIZE --phrase_language $LANGUAGE --context_language $LANGUAGE $presort | $SORT_KEYS $postsort | $GZIP > $OUT_CONTEXTS";
-   safesystem($cmd) or die "Failed to extract contexts.";
+   run_stage($OUT_CONTEXTS, [ $CORPUS_CLUSTER ], $cmd) or die "Failed to extract contexts.";
   }
 }
 
@@ -292,20 +290,18 @@ sub extract_bilingual_context {
  my $OUT_SRC_CONTEXTS = "$CONTEXT_DIR/context.source";
  my $OUT_TGT_CONTEXTS = "$CONTEXT_DIR/context.target";
 
- if (-e $OUT_SRC_CONTEXTS . ".gz" and -e $OUT_TGT_CONTEXTS . ".gz") {
-   print STDERR "$OUT_SRC_CONTEXTS.gz and $OUT_TGT_CONTEXTS.gz exist, reusing...\n";
- } else {
+ {
    my $OUT_BI_CONTEXTS = "$CONTEXT_DIR/context.bilingual.txt.gz";
    my $cmd = "$EXTRACTOR -i $CORPUS_CLUSTER -c $ITEMS_IN_MEMORY -L $BASE_PHRASE_MAX_SIZE -C -S $CONTEXT_SIZE --phrase_language both --context_language both | $SORT_KEYS | $REDUCER | $GZIP > $OUT_BI_CONTEXTS";
    if ($COMPLETE_CACHE) {
      print STDERR "COMPLETE_CACHE is set: removing memory limits on cache.\n";
      $cmd = "$EXTRACTOR -i $CORPUS_CLUSTER -c 0 -L $BASE_PHRASE_MAX_SIZE -C -S $CONTEXT_SIZE  --phrase_language both --context_language both  | $SORT_KEYS | $GZIP > $OUT_BI_CONTEXTS";
    }
-   safesystem($cmd) or die "Failed to extract contexts.";
-
-   safesystem("$ZCAT $OUT_BI_CONTEXTS | $SPLIT $OUT_SRC_CONTEXTS $OUT_TGT_CONTEXTS") or die "Failed to split contexts.\n";
-   safesystem("$GZIP -f $OUT_SRC_CONTEXTS") or die "Failed to zip output contexts.\n";
-   safesystem("$GZIP -f $OUT_TGT_CONTEXTS") or die "Failed to zip output contexts.\n";
+   run_stage([ "$OUT_SRC_CONTEXTS.gz", "$OUT_TGT_CONTEXTS.gz" ], [ $CORPUS_CLUSTER ],
+             $cmd,
+             "$ZCAT $OUT_BI_CONTEXTS | $SPLIT $OUT_SRC_CONTEXTS $OUT_TGT_CONTEXTS",
+             "$GZIP -f $OUT_SRC_CONTEXTS",
+             "$GZIP -f $OUT_TGT_CONTEXTS") or die "Failed to extract contexts.\n";
  }
 }
 
@@ -314,19 +310,16 @@ sub topic_train {
   print STDERR "\n!!!TRAIN PYP TOPICS\n";
   my $IN_CONTEXTS = "$CONTEXT_DIR/context.txt.gz";
   my $OUT_CLUSTERS = "$CLUSTER_DIR/docs.txt.gz";
-  if (-e $OUT_CLUSTERS) {
-    print STDERR "$OUT_CLUSTERS exists, reusing...\n";
-  } else {
-    safesystem("$TOPIC_TRAIN --data $IN_CONTEXTS --backoff-type simple -t $NUM_TOPICS -s $NUM_SAMPLES -o $OUT_CLUSTERS -c $TOPICS_CONFIG -w /dev/null") or die "Topic training failed.\n";
-  }
+  my @inputs = ($IN_CONTEXTS);
+  push @inputs, $TOPICS_CONFIG if -e $TOPICS_CONFIG;
+  run_stage($OUT_CLUSTERS, \@inputs, "$TOPIC_TRAIN --data $IN_CONTEXTS --backoff-type simple -t $NUM_TOPICS -s $NUM_SAMPLES -o $OUT_CLUSTERS -c $TOPICS_CONFIG -w /dev/null") or die "Topic training failed.\n";
 }
 
 sub prem_train {
   print STDERR "\n!!!TRAIN PR/EM model\n";
   my $OUT_CLUSTERS = "$CLUSTER_DIR/docs.txt.gz";
-  if (-e $OUT_CLUSTERS) {
-    print STDERR "$OUT_CLUSTERS exists, reusing...\n";
-  } else {
+  {
+    my @inputs = ("$CONTEXT_DIR/context.txt.gz");
     my $in = "--in $CONTEXT_DIR/context.txt.gz";
     my $opts = "";
     if (lc($MODEL) eq "pr") {
@@ -335,9 +328,10 @@ sub prem_train {
         $opts = "--agree-direction";
     } elsif (lc($MODEL) eq "blagree") {
         $in = "--in $CONTEXT_DIR/context.source.gz --in1 $CONTEXT_DIR/context.target.gz";
+        @inputs = ("$CONTEXT_DIR/context.source.gz", "$CONTEXT_DIR/context.target.gz");
         $opts = "--agree-language";
     }
-    safesystem("$PREM_TRAIN $in --topics $NUM_TOPICS --out $OUT_CLUSTERS --iterations $NUM_ITERS $opts $PR_FLAGS") or die "Topic training failed.\n";
+    run_stage($OUT_CLUSTERS, \@inputs, "$PREM_TRAIN $in --topics $NUM_TOPICS --out $OUT_CLUSTERS --iterations $NUM_ITERS $opts $PR_FLAGS") or die "Topic training failed.\n";
   }
 }
 
@@ -346,9 +340,7 @@ sub label_spans_with_topics {
   print STDERR "\n!!!LABEL SPANS\n";
   my $IN_CLUSTERS = "$CLUSTER_DIR/docs.txt.gz";
   my $OUT_SPANS = "$LABELED_DIR/labeled_spans.txt";
-  if (-e $OUT_SPANS) {
-    print STDERR "$OUT_SPANS exists, reusing...\n";
-  } else {
+  {
     my $extra = "tt";
     if ($LANGUAGE eq "source") {
         $extra = "ss";
@@ -356,10 +348,11 @@ sub label_spans_with_topics {
         $extra = "bb";
     } else { die "Invalid language specifier $LANGUAGE\n" unless $LANGUAGE eq "target" };
     $extra = $extra . " tok,tag" if ($PRESERVE_PHRASES);
-    safesystem("$ZCAT $IN_CLUSTERS > $CLUSTER_DIR/clusters.txt") or die "Failed to unzip";
-    safesystem("$EXTRACTOR --base_phrase_spans -i $CORPUS_CLUSTER -c $ITEMS_IN_MEMORY -L $BASE_PHRASE_MAX_SIZE -S $CONTEXT_SIZE | $S2L $CLUSTER_DIR/clusters.txt $CONTEXT_SIZE $LABEL_THRESHOLD $extra > $OUT_SPANS") or die "Failed to label spans";
-    unlink("$CLUSTER_DIR/clusters.txt") or warn "Failed to remove $CLUSTER_DIR/clusters.txt";
-    safesystem("paste -d ' ' $CORPUS_LEX $OUT_SPANS | sed 's/ *||| *\$//'  > $LABELED_DIR/corpus.src_trg_al_label") or die "Couldn't paste";
+    run_stage([ $OUT_SPANS, "$LABELED_DIR/corpus.src_trg_al_label" ], [ $IN_CLUSTERS, $CORPUS_CLUSTER, $CORPUS_LEX ],
+              "$ZCAT $IN_CLUSTERS > $CLUSTER_DIR/clusters.txt",
+              "$EXTRACTOR --base_phrase_spans -i $CORPUS_CLUSTER -c $ITEMS_IN_MEMORY -L $BASE_PHRASE_MAX_SIZE -S $CONTEXT_SIZE | $S2L $CLUSTER_DIR/clusters.txt $CONTEXT_SIZE $LABEL_THRESHOLD $extra > $OUT_SPANS",
+              "rm -f $CLUSTER_DIR/clusters.txt",
+              "paste -d ' ' $CORPUS_LEX $OUT_SPANS | sed 's/ *||| *\$//'  > $LABELED_DIR/corpus.src_trg_al_label") or die "Failed to label spans";
   }
 }
 
@@ -372,11 +365,7 @@ sub extract_freqs {
     my $COARSE_EXPR = "\'s/\\(X[0-9][0-9]*\\)/\\1c/g\'"; #'
     my $FINE_EXPR = "\'s/\\(X[0-9][0-9]*\\)/\\1f/g\'"; #'
     my %finehier = ();
-    if (-e $OUT_SPANS) {
-        print STDERR "$OUT_SPANS exists, reusing...\n";
-    } else {
-        safesystem("paste -d ' ' $IN_COARSE $IN_FINE > $OUT_SPANS");
-    }
+    run_stage($OUT_SPANS, [ $IN_COARSE, $IN_FINE ], "paste -d ' ' $IN_COARSE $IN_FINE > $OUT_SPANS") or die "Couldn't paste";
     open SPANS, $OUT_SPANS or die $!;
     while (<SPANS>) {
         my ($tmp, $coarse, $fine) = split /\|\|\|/;
@@ -416,17 +405,21 @@ sub extract_freqs {
     $CLUSTER_DIR = $CLUSTER_DIR_F;
 }
 
+sub grammar_file {
+  return "$GRAMMAR_DIR/grammar.gz";
+}
+
+sub grammar_bidir_file {
+  return "$GRAMMAR_DIR/grammar.bidir.gz";
+}
+
 sub grammar_extract {
   my $LABELED = "$LABELED_DIR/corpus.src_trg_al_label";
   print STDERR "\n!!!EXTRACTING GRAMMAR\n";
-  my $OUTGRAMMAR = "$GRAMMAR_DIR/grammar.gz";
-  if (-e $OUTGRAMMAR) {
-    print STDERR "$OUTGRAMMAR exists, reusing...\n";
-  } else {
-    my $BACKOFF_ARG = ($BACKOFF_GRAMMAR ? "-g" : "");
-    my $DEFAULT_CAT_ARG = ($DEFAULT_CAT ? "-d X" : "");
-    safesystem("$EXTRACTOR -i $LABELED -c $ITEMS_IN_MEMORY -L $BASE_PHRASE_MAX_SIZE -t $NUM_TOPICS $BACKOFF_ARG $DEFAULT_CAT_ARG | $SORT_KEYS | $REDUCER -p | $GZIP > $OUTGRAMMAR") or die "Couldn't extract grammar";
-  }
+  my $OUTGRAMMAR = grammar_file();
+  my $BACKOFF_ARG = ($BACKOFF_GRAMMAR ? "-g" : "");
+  my $DEFAULT_CAT_ARG = ($DEFAULT_CAT ? "-d X" : "");
+  run_stage($OUTGRAMMAR, [ $LABELED ], "$EXTRACTOR -i $LABELED -c $ITEMS_IN_MEMORY -L $BASE_PHRASE_MAX_SIZE -t $NUM_TOPICS $BACKOFF_ARG $DEFAULT_CAT_ARG | $SORT_KEYS | $REDUCER -p | $GZIP > $OUTGRAMMAR") or die "Couldn't extract grammar";
   return $OUTGRAMMAR;
 }
 
@@ -434,13 +427,9 @@ sub grammar_extract_bidir {
 #gzcat ex.output.gz | ./mr_stripe_rule_reduce -p -b | sort -t $'\t' -k 1 | ./mr_stripe_rule_reduce | gzip > phrase-table.gz
   my $LABELED = "$LABELED_DIR/corpus.src_trg_al_label";
   print STDERR "\n!!!EXTRACTING GRAMMAR\n";
-  my $OUTGRAMMAR = "$GRAMMAR_DIR/grammar.bidir.gz";
-  if (-e $OUTGRAMMAR) {
-    print STDERR "$OUTGRAMMAR exists, reusing...\n";
-  } else {
-    my $BACKOFF_ARG = ($BACKOFF_GRAMMAR ? "-g" : "");
-    safesystem("$EXTRACTOR -i $LABELED -c $ITEMS_IN_MEMORY -L $BASE_PHRASE_MAX_SIZE -b -t $NUM_TOPICS $BACKOFF_ARG | $SORT_KEYS | $REDUCER -p -b | $SORT_KEYS | $REDUCER | $GZIP > $OUTGRAMMAR") or die "Couldn't extract grammar";
-  }
+  my $OUTGRAMMAR = grammar_bidir_file();
+  my $BACKOFF_ARG = ($BACKOFF_GRAMMAR ? "-g" : "");
+  run_stage($OUTGRAMMAR, [ $LABELED ], "$EXTRACTOR -i $LABELED -c $ITEMS_IN_MEMORY -L $BASE_PHRASE_MAX_SIZE -b -t $NUM_TOPICS $BACKOFF_ARG | $SORT_KEYS | $REDUCER -p -b | $SORT_KEYS | $REDUCER | $GZIP > $OUTGRAMMAR") or die "Couldn't extract grammar";
   return $OUTGRAMMAR;
 }
 
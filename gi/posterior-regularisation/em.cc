@@ -2,6 +2,8 @@
 // " the phantom of the opera "    tickets for <PHRASE> tonight ? ||| C=1 ||| seats for <PHRASE> ? </s> ||| C=1 ||| i see <PHRASE> ? </s> ||| C=1
 //                      phrase TAB [context]+
 // where    context =   phrase ||| C=...        which are separated by |||
+//
+// Usage: em [threads] < concordance
 
 // Model parameterised as follows:
 // - each phrase, p, is allocated a latent state, t
@@ -17,6 +19,11 @@
 // - improve the generation of phrase internals, e.g., generate edge words from
 //   different distribution to central words
 
+// Threading:
+// - every pass over the (phrase, context) edges is split into numThreads
+//   contiguous shards of edges (or of phrases, contexts or tags), each
+//   reducing into its own partial sums, which are added up afterwards
+
 #include "alphabet.hh"
 #include "log_add.hh"
 #include <algorithm>
@@ -29,6 +36,8 @@
 #include <vector>
 #include <tr1/random>
 #include <tr1/tuple>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
 #include <nlopt.h>
 
 using namespace std;
@@ -40,6 +49,8 @@ const bool posterior_regularisation = true;
 const double PHRASE_VIOLATION_WEIGHT = 10;
 const double CONTEXT_VIOLATION_WEIGHT = 0;
 const bool includePhraseProb = false;
+const float POSTERIOR_THRESHOLD = 1e-6; // smaller posteriors aren't stored
+int numThreads = 1;
 
 // Data structures:
 Alphabet<string> lexicon;
@@ -56,6 +67,17 @@ typedef map<int, PhraseCounts> ContextToPhraseCounts;
 PhraseToContextCounts concordancePhraseToContexts;
 ContextToPhraseCounts concordanceContextToPhrases;
 
+// every (phrase, context) pair, ordered by phrase then context; edge e has
+// the lagrange multipliers lambda[e * numTags .. (e + 1) * numTags)
+struct Edge
+{
+    int phrase, context, count;
+};
+vector<Edge> edges;
+vector<int> phraseEdges;       // edges of phrase p are [phraseEdges[p], phraseEdges[p+1])
+vector<int> contextEdgeStart;  // edges of context c are contextEdges[contextEdgeStart[c] ..
+vector<int> contextEdges;      //                                     contextEdgeStart[c+1])
+
 typedef vector<double> Dist;
 typedef vector<Dist> ConditionalDist;
 Dist prior; // class -> P(class)
@@ -63,6 +85,17 @@ vector<ConditionalDist> probCtx; // word -> class -> P(word | class), for each p
 ConditionalDist probPhrase; // class -> P(word | class)
 Dist probPhraseLength; // class -> P(length | class) expressed as geometric distribution parameter
 
+// the (possibly penalised) posteriors q(t|p,c) of every edge, in single
+// precision, leaving out those below POSTERIOR_THRESHOLD
+struct Posteriors
+{
+    vector<int> start;            // entries of edge e are [start[e], start[e+1])
+    vector<int> tags;
+    vector<float> probs;
+    vector<double> logZ;          // log sum_t p_theta(t, c | p)
+    vector<double> logZPenalised; // log sum_t p_theta(t, c | p) exp(-lambda_{pct})
+};
+
 mt19937 randomGenerator((size_t) time(NULL));
 uniform_real<double> uniDist(0.0, 1e-1);
 variate_generator< mt19937, uniform_real<double> > rng(randomGenerator, uniDist);
@@ -71,21 +104,22 @@ void addRandomNoise(Dist &d);
 void normalise(Dist &d);
 void addTo(Dist &d, const Dist &e);
 int argmax(const Dist &d);
-
-map<Phrase, map<Context, int> > lambda_indices;
+int context_word(const Context &context, int j);
+void index_edges();
+template <typename Job> void run_shards(int n, Job &job);
 
 Dist conditional_probs(const Phrase &phrase, const Context &context, double *normalisation = 0);
 template <typename T>
 Dist
-penalised_conditionals(const Phrase &phrase, const Context &context, 
-                       const T &lambda, double *normalisation);
-//Dist penalised_conditionals(const Phrase &phrase, const Context &context, const double *lambda, double *normalisation = 0);
+penalised_conditionals(int edge, const T &lambda, double *normalisation);
+void compute_posteriors(const double *lambda, Posteriors &q);
 double penalised_log_likelihood(int n, const double *lambda, double *gradient, void *data);
 void optimise_lambda(double delta, double gamma, vector<double> &lambda);
-double expected_violation_phrases(const double *lambda);
-double expected_violation_contexts(const double *lambda);
-double primal_kl_divergence(const double *lambda);
-double dual(const double *lambda);
+double expected_violation_phrases(const Posteriors &q);
+double expected_violation_contexts(const Posteriors &q);
+double primal_likelihood(const Posteriors &q);
+double primal_kl_divergence(const double *lambda, const Posteriors &q);
+double dual(const Posteriors &q);
 void print_primal_dual(const double *lambda, double delta, double gamma);
 
 ostream &operator<<(ostream &, const Phrase &);
@@ -93,12 +127,111 @@ ostream &operator<<(ostream &, const Context &);
 ostream &operator<<(ostream &, const Dist &);
 ostream &operator<<(ostream &, const ConditionalDist &);
 
+// e-step over a shard of edges: posteriors (penalised by lambda, if given)
+// of each edge into the shard's own sparse buffers
+struct PosteriorJob
+{
+    PosteriorJob(const double *l, Posteriors &p)
+        : lambda(l), q(p), tags(numThreads), probs(numThreads), sizes(numThreads) {}
+
+    void operator()(int shard, int begin, int end)
+    {
+        vector<int> &t_out = tags[shard];
+        vector<float> &p_out = probs[shard];
+        vector<int> &s_out = sizes[shard];
+        for (int e = begin; e < end; ++e)
+        {
+            const Edge &edge = edges[e];
+            double z = 0, zp = 0;
+            Dist d = conditional_probs(phrases.type(edge.phrase), contexts.type(edge.context), &z);
+            if (lambda)
+            {
+                for (int t = 0; t < numTags; ++t)
+                {
+                    d[t] *= exp(-lambda[e * numTags + t]);
+                    zp += d[t];
+                }
+                for (int t = 0; t < numTags; ++t)
+                    d[t] /= zp;
+            }
+            else
+                zp = 1;
+            q.logZ[e] = log(z);
+            q.logZPenalised[e] = log(z * zp);
+
+            int n = 0;
+            for (int t = 0; t < numTags; ++t)
+            {
+                if (d[t] >= POSTERIOR_THRESHOLD)
+                {
+                    t_out.push_back(t);
+                    p_out.push_back(d[t]);
+                    ++n;
+                }
+            }
+            s_out.push_back(n);
+        }
+    }
+
+    const double *lambda;
+    Posteriors &q;
+    vector<vector<int> > tags;
+    vector<vector<float> > probs;
+    vector<vector<int> > sizes;
+};
+
+// m-step statistics for a shard of the tags, so that the shards never
+// write to the same counts
+struct CountsJob
+{
+    CountsJob(const Posteriors &p, Dist &cp, vector<ConditionalDist> &cc, ConditionalDist &cph,
+              Dist &cpl, Dist &np)
+        : q(p), countsPrior(cp), countsCtx(cc), countsPhrase(cph), countsPhraseLength(cpl), nPhrases(np) {}
+
+    void operator()(int, int begin, int end)
+    {
+        for (int e = 0; e < (int) edges.size(); ++e)
+        {
+            const Edge &edge = edges[e];
+            const Context &context = contexts.type(edge.context);
+            const Phrase &phrase = phrases.type(edge.phrase);
+            for (int i = q.start[e]; i < q.start[e+1]; ++i)
+            {
+                const int t = q.tags[i];
+                if (t < begin || t >= end) continue;
+                const double p = q.probs[i];
+
+                countsPrior[t] += p; // FIXME: times edge.count
+                for (int j = 0; j < 4; ++j)
+                    countsCtx[j][t][context_word(context, j)] += p * edge.count;
+
+                if (includePhraseProb)
+                {
+                    for (Phrase::const_iterator pit = phrase.begin(); pit != phrase.end(); ++pit)
+                        countsPhrase[t][*pit] += p * edge.count;
+                    countsPhraseLength[t] += phrase.size() * p * edge.count;
+                    nPhrases[t] += p * edge.count;
+                }
+            }
+        }
+    }
+
+    const Posteriors &q;
+    Dist &countsPrior;
+    vector<ConditionalDist> &countsCtx;
+    ConditionalDist &countsPhrase;
+    Dist &countsPhraseLength;
+    Dist &nPhrases;
+};
+
 int
 main(int argc, char *argv[])
 {
     randomGenerator.seed(time(NULL));
+    if (argc > 1)
+        numThreads = max(atoi(argv[1]), 1);
 
-    int edges = 0;
+    int edgeCount = 0;
     istream &input = cin;
     while (input.good())
     {
@@ -143,7 +276,7 @@ main(int argc, char *argv[])
                     concordanceContextToPhrases[contextId][phraseId] += count;
                     index = 0;
                     context = Context(-1, -1, -1, -1);
-                    edges += 1;
+                    edgeCount += 1;
                 }
             }
         }
@@ -154,9 +287,11 @@ main(int argc, char *argv[])
 
     cout << "Read in " << phrases.size() << " phrases"
          << " and " << contexts.size() << " contexts"
-         << " and " << edges << " edges"
+         << " and " << edgeCount << " edges"
          << " and " << lexicon.size() << " word types\n";
 
+    index_edges();
+
     // FIXME: filter out low count phrases and low count contexts (based on individual words?)
     // now populate model parameters with uniform + random noise
     prior.resize(numTags, 1.0);
@@ -191,6 +326,7 @@ main(int argc, char *argv[])
     //cout << "\tphraseLen: " << probPhraseLength << endl;
 
     vector<double> lambda;
+    Posteriors q;
 
     // now do EM training
     for (int iteration = 0; iteration < numIterations; ++iteration)
@@ -207,43 +343,13 @@ main(int argc, char *argv[])
         Dist countsPhraseLength(numTags, 0.0);
         Dist nPhrases(numTags, 0.0);
 
+        // e-step: estimate latent class probs; compile (class,word) stats for m-step
+        compute_posteriors(posterior_regularisation ? &lambda[0] : 0, q);
         double llh = 0;
-        for (PhraseToContextCounts::iterator pcit = concordancePhraseToContexts.begin();
-             pcit != concordancePhraseToContexts.end(); ++pcit)
-        {
-            const Phrase &phrase = phrases.type(pcit->first);
-
-            // e-step: estimate latent class probs; compile (class,word) stats for m-step
-            for (ContextCounts::iterator ccit = pcit->second.begin();
-                 ccit != pcit->second.end(); ++ccit)
-            {
-                const Context &context = contexts.type(ccit->first);
-
-                double z = 0;
-                Dist tagCounts;
-                if (!posterior_regularisation)
-                    tagCounts = conditional_probs(phrase, context, &z);
-                else
-                    tagCounts = penalised_conditionals(phrase, context, lambda, &z);
-
-                llh += log(z) * ccit->second;
-                addTo(countsPrior, tagCounts); // FIXME: times ccit->secon
-
-                for (int t = 0; t < numTags; ++t)
-                {
-                    for (int j = 0; j < 4; ++j)
-                        countsCtx[j][t][get<0>(context)] += tagCounts[t] * ccit->second;
-
-                    if (includePhraseProb)
-                    {
-                        for (Phrase::const_iterator pit = phrase.begin(); pit != phrase.end(); ++pit)
-                            countsPhrase[t][*pit] += tagCounts[t] * ccit->second;
-                        countsPhraseLength[t] += phrase.size() * tagCounts[t] * ccit->second;
-                        nPhrases[t] += tagCounts[t] * ccit->second;
-                    }
-                }
-            }
-        }
+        for (int e = 0; e < (int) edges.size(); ++e)
+            llh += q.logZPenalised[e] * edges[e].count;
+        CountsJob counts(q, countsPrior, countsCtx, countsPhrase, countsPhraseLength, nPhrases);
+        run_shards(numTags, counts);
 
         cout << "M-step\n";
 
@@ -268,10 +374,7 @@ main(int argc, char *argv[])
             probPhraseLength = countsPhraseLength;
         }
 
-        double *larray = new double[lambda.size()];
-        copy(lambda.begin(), lambda.end(), larray);
-        print_primal_dual(larray, PHRASE_VIOLATION_WEIGHT, CONTEXT_VIOLATION_WEIGHT);
-        delete [] larray;
+        print_primal_dual(lambda.empty() ? 0 : &lambda[0], PHRASE_VIOLATION_WEIGHT, CONTEXT_VIOLATION_WEIGHT);
 
         //cout << "\tllh " << llh << endl;
         //cout << "\tprior:     " << prior << "\n";
@@ -281,17 +384,12 @@ main(int argc, char *argv[])
     }
 
     // output class membership
-    for (PhraseToContextCounts::iterator pcit = concordancePhraseToContexts.begin();
-         pcit != concordancePhraseToContexts.end(); ++pcit)
+    for (int e = 0; e < (int) edges.size(); ++e)
     {
-        const Phrase &phrase = phrases.type(pcit->first);
-        for (ContextCounts::iterator ccit = pcit->second.begin();
-             ccit != pcit->second.end(); ++ccit)
-        {
-            const Context &context = contexts.type(ccit->first);
-            Dist tagCounts = conditional_probs(phrase, context, 0);
-            cout << phrase << " ||| " << context << " ||| " << argmax(tagCounts) << "\n";
-        }
+        const Phrase &phrase = phrases.type(edges[e].phrase);
+        const Context &context = contexts.type(edges[e].context);
+        Dist tagCounts = conditional_probs(phrase, context, 0);
+        cout << phrase << " ||| " << context << " ||| " << argmax(tagCounts) << "\n";
     }
 
     return 0;
@@ -334,6 +432,65 @@ int argmax(const Dist &d)
     return index;
 }
 
+int context_word(const Context &context, int j)
+{
+    switch (j)
+    {
+        case 0: return get<0>(context);
+        case 1: return get<1>(context);
+        case 2: return get<2>(context);
+        case 3: return get<3>(context);
+        default: assert(false);
+    }
+    return -1;
+}
+
+void index_edges()
+{
+    edges.clear();
+    phraseEdges.assign(phrases.size() + 1, 0);
+    for (int p = 0; p < phrases.size(); ++p)
+    {
+        phraseEdges[p] = edges.size();
+        PhraseToContextCounts::const_iterator pcit = concordancePhraseToContexts.find(p);
+        for (ContextCounts::const_iterator ccit = pcit->second.begin();
+             ccit != pcit->second.end(); ++ccit)
+        {
+            Edge edge = { p, ccit->first, ccit->second };
+            edges.push_back(edge);
+        }
+    }
+    phraseEdges[phrases.size()] = edges.size();
+
+    contextEdgeStart.assign(contexts.size() + 1, 0);
+    for (int e = 0; e < (int) edges.size(); ++e)
+        ++contextEdgeStart[edges[e].context + 1];
+    for (int c = 0; c < contexts.size(); ++c)
+        contextEdgeStart[c + 1] += contextEdgeStart[c];
+    contextEdges.resize(edges.size());
+    vector<int> next(contextEdgeStart.begin(), contextEdgeStart.end() - 1);
+    for (int e = 0; e < (int) edges.size(); ++e)
+        contextEdges[next[edges[e].context]++] = e;
+}
+
+// runs job(shard, begin, end) for numThreads contiguous shards of [0, n),
+// each on its own thread
+template <typename Job>
+void run_shards(int n, Job &job)
+{
+    if (numThreads == 1)
+    {
+        job(0, 0, n);
+        return;
+    }
+    boost::thread_group threads;
+    for (int s = 0; s < numThreads; ++s)
+        threads.create_thread(boost::bind<void>(boost::ref(job), s,
+                                                (long long) n * s / numThreads,
+                                                (long long) n * (s + 1) / numThreads));
+    threads.join_all();
+}
+
 ostream &operator<<(ostream &out, const Phrase &phrase)
 {
     for (Phrase::const_iterator pit = phrase.begin(); pit != phrase.end(); ++pit)
@@ -364,25 +521,16 @@ ostream &operator<<(ostream &out, const ConditionalDist &dist)
     return out;
 }
 
-// FIXME: slow - just use the phrase index, context index to do the mapping
-// (n.b. it's a sparse setup, not just equal to 3d array index)
-int
-lambda_index(const Phrase &phrase, const Context &context, int tag)
-{
-    return lambda_indices[phrase][context] + tag;
-}
-
 template <typename T>
 Dist
-penalised_conditionals(const Phrase &phrase, const Context &context, 
-                       const T &lambda, double *normalisation)
+penalised_conditionals(int edge, const T &lambda, double *normalisation)
 {
-    Dist d = conditional_probs(phrase, context, 0);
+    Dist d = conditional_probs(phrases.type(edges[edge].phrase), contexts.type(edges[edge].context), 0);
 
     double z = 0;
     for (int t = 0; t < numTags; ++t)
     {
-        d[t] *= exp(-lambda[lambda_index(phrase, context, t)]);
+        d[t] *= exp(-lambda[edge * numTags + t]);
         z += d[t];
     }
 
@@ -425,6 +573,59 @@ conditional_probs(const Phrase &phrase, const Context &context, double *normalis
     return tagCounts;
 }
 
+void
+compute_posteriors(const double *lambda, Posteriors &q)
+{
+    q.logZ.resize(edges.size());
+    q.logZPenalised.resize(edges.size());
+    PosteriorJob job(lambda, q);
+    run_shards(edges.size(), job);
+
+    q.start.resize(edges.size() + 1);
+    q.tags.clear();
+    q.probs.clear();
+    int e = 0;
+    q.start[0] = 0;
+    for (int s = 0; s < numThreads; ++s)
+    {
+        q.tags.insert(q.tags.end(), job.tags[s].begin(), job.tags[s].end());
+        q.probs.insert(q.probs.end(), job.probs[s].begin(), job.probs[s].end());
+        for (int i = 0; i < (int) job.sizes[s].size(); ++i, ++e)
+            q.start[e + 1] = q.start[e] + job.sizes[s][i];
+    }
+    assert(e == (int) edges.size());
+}
+
+// f and gradient of a shard of edges for penalised_log_likelihood
+struct PenalisedLikelihoodJob
+{
+    PenalisedLikelihoodJob(const double *l, double *g)
+        : lambda(l), grad(g), f(numThreads, 0.0) {}
+
+    void operator()(int shard, int begin, int end)
+    {
+        for (int e = begin; e < end; ++e)
+        {
+            double z = 0;
+            Dist scores = penalised_conditionals(e, lambda, &z);
+
+            f[shard] += edges[e].count * log(z);
+            //cout << "\tphrase: " << phrase << " context: " << context << " count: " << ccit->second << " z " << z << endl;
+            //cout << "\t\tscores: " << scores << "\n";
+
+            if (grad)
+            {
+                for (int t = 0; t < numTags; ++t)
+                    grad[e * numTags + t] = - edges[e].count * scores[t];
+            }
+        }
+    }
+
+    const double *lambda;
+    double *grad;
+    vector<double> f;
+};
+
 double 
 penalised_log_likelihood(int n, const double *lambda, double *grad, void *)
 {
@@ -444,39 +645,13 @@ penalised_log_likelihood(int n, const double *lambda, double *grad, void *)
     //copy(lambda, lambda+n, ostream_iterator<double>(cout, " "));
     //cout << "\n";
 
-    double f = 0;
-    if (grad)
-    {
-        for (int i = 0; i < n; ++i)
-            grad[i] = 0.0;
-    }
-
-    for (int p = 0; p < phrases.size(); ++p)
-    {
-        const Phrase &phrase = phrases.type(p);
-        PhraseToContextCounts::const_iterator pcit = concordancePhraseToContexts.find(p);
-        for (ContextCounts::const_iterator ccit = pcit->second.begin();
-             ccit != pcit->second.end(); ++ccit)
-        {
-            const Context &context = contexts.type(ccit->first);
-            double z = 0;
-            Dist scores = penalised_conditionals(phrase, context, lambda, &z);
+    assert(n == (int) edges.size() * numTags);
+    PenalisedLikelihoodJob job(lambda, grad);
+    run_shards(edges.size(), job);
 
-            f += ccit->second * log(z);
-            //cout << "\tphrase: " << phrase << " context: " << context << " count: " << ccit->second << " z " << z << endl;
-            //cout << "\t\tscores: " << scores << "\n";
-
-            if (grad)
-            {
-                for (int t = 0; t < numTags; ++t)
-                {
-                    int i = lambda_index(phrase, context, t); // FIXME: redundant lookups
-                    assert(grad[i] == 0.0);
-                    grad[i] = - ccit->second * scores[t];
-                }
-            }
-        }
-    }
+    double f = 0;
+    for (int s = 0; s < numThreads; ++s)
+        f += job.f[s];
 
     //cout << "penalised_log_likelihood returning " << f;
     //if (grad)
@@ -527,14 +702,9 @@ constraint_and_gradient(int n, const double *lambda, double *grad, void *data)
 
         double val = -d->threshold;
 
-        const Phrase &phrase = phrases.type(d->p);
-        PhraseToContextCounts::const_iterator pcit = concordancePhraseToContexts.find(d->p);
-        assert(pcit != concordancePhraseToContexts.end());
-        for (ContextCounts::const_iterator ccit = pcit->second.begin();
-             ccit != pcit->second.end(); ++ccit)
+        for (int e = phraseEdges[d->p]; e < phraseEdges[d->p + 1]; ++e)
         {
-            const Context &context = contexts.type(ccit->first);
-            int i = lambda_index(phrase, context, d->t);
+            int i = e * numTags + d->t;
             val += lambda[i];
             if (grad) grad[i] = 1;
         }
@@ -552,14 +722,9 @@ constraint_and_gradient(int n, const double *lambda, double *grad, void *data)
 
         double val = -d->threshold;
 
-        const Context &context = contexts.type(d->c);
-        ContextToPhraseCounts::iterator cpit = concordanceContextToPhrases.find(d->c);
-        assert(cpit != concordanceContextToPhrases.end());
-        for (PhraseCounts::iterator pcit = cpit->second.begin();
-             pcit != cpit->second.end(); ++pcit)
+        for (int k = contextEdgeStart[d->c]; k < contextEdgeStart[d->c + 1]; ++k)
         {
-            const Phrase &phrase = phrases.type(pcit->first);
-            int i = lambda_index(phrase, context, d->t);
+            int i = contextEdges[k] * numTags + d->t;
             val += lambda[i];
             if (grad) grad[i] = 1;
         }
@@ -572,28 +737,10 @@ constraint_and_gradient(int n, const double *lambda, double *grad, void *data)
 void
 optimise_lambda(double delta, double gamma, vector<double> &lambdav)
 {
-    int num_lambdas = lambdav.size();
-    if (lambda_indices.empty() || lambdav.empty())
-    {
-        lambda_indices.clear();
-        lambdav.clear();
-
-        int i = 0;
-        for (int p = 0; p < phrases.size(); ++p)
-        {
-            const Phrase &phrase = phrases.type(p);
-            PhraseToContextCounts::iterator pcit = concordancePhraseToContexts.find(p);
-            for (ContextCounts::iterator ccit = pcit->second.begin();
-                 ccit != pcit->second.end(); ++ccit)
-            {
-                const Context &context = contexts.type(ccit->first);
-                lambda_indices[phrase][context] = i;
-                i += numTags;
-            }
-        }
-        num_lambdas = i;
+    int num_lambdas = edges.size() * numTags;
+    if (lambdav.empty())
         lambdav.resize(num_lambdas);
-    }
+    assert((int) lambdav.size() == num_lambdas);
     //cout << "optimise_lambda: #langrange multipliers " << num_lambdas << endl;
 
     // FIXME: better to work with an implicit representation to save memory usage
@@ -669,88 +816,72 @@ optimise_lambda(double delta, double gamma, vector<double> &lambdav)
     lambdav = vector<double>(&lambda[0], &lambda[0] + num_lambdas);
 }
 
-// FIXME: inefficient - cache the scores
-double
-expected_violation_phrases(const double *lambda)
+// sum over a shard of phrases (or contexts) of max_e E_q[phi_et], where e
+// ranges over the phrase's (context's) edges
+struct ViolationJob
 {
-    // sum_pt max_c E_q[phi_pct]
-    double violation = 0;
+    ViolationJob(const Posteriors &p, const vector<int> &s, const vector<int> *m)
+        : q(p), start(s), members(m), violation(numThreads, 0.0) {}
 
-    for (int p = 0; p < phrases.size(); ++p)
+    void operator()(int shard, int begin, int end)
     {
-        const Phrase &phrase = phrases.type(p);
-        PhraseToContextCounts::const_iterator pcit = concordancePhraseToContexts.find(p);
-
-        for (int t = 0; t < numTags; ++t)
+        Dist best(numTags);
+        for (int g = begin; g < end; ++g)
         {
-            double best = 0;
-            for (ContextCounts::const_iterator ccit = pcit->second.begin();
-                 ccit != pcit->second.end(); ++ccit)
+            fill(best.begin(), best.end(), 0.0);
+            for (int k = start[g]; k < start[g + 1]; ++k)
             {
-                const Context &context = contexts.type(ccit->first);
-                Dist scores = penalised_conditionals(phrase, context, lambda, 0);
-                best = max(best, scores[t]);
+                const int e = members ? (*members)[k] : k;
+                for (int i = q.start[e]; i < q.start[e + 1]; ++i)
+                    best[q.tags[i]] = max(best[q.tags[i]], (double) q.probs[i]);
             }
-            violation += best;
+            for (int t = 0; t < numTags; ++t)
+                violation[shard] += best[t];
         }
     }
 
+    const Posteriors &q;
+    const vector<int> &start;
+    const vector<int> *members; // edges of group g are members[start[g] .. start[g+1]), or
+                                // start[g] .. start[g+1] themselves if NULL
+    vector<double> violation;
+};
+
+double
+expected_violation_phrases(const Posteriors &q)
+{
+    // sum_pt max_c E_q[phi_pct]
+    ViolationJob job(q, phraseEdges, 0);
+    run_shards(phrases.size(), job);
+    double violation = 0;
+    for (int s = 0; s < numThreads; ++s)
+        violation += job.violation[s];
     return violation;
 }
 
-// FIXME: inefficient - cache the scores
 double
-expected_violation_contexts(const double *lambda)
+expected_violation_contexts(const Posteriors &q)
 {
     // sum_ct max_p E_q[phi_pct]
+    ViolationJob job(q, contextEdgeStart, &contextEdges);
+    run_shards(contexts.size(), job);
     double violation = 0;
-
-    for (int c = 0; c < contexts.size(); ++c)
-    {
-        const Context &context = contexts.type(c);
-        ContextToPhraseCounts::iterator cpit = concordanceContextToPhrases.find(c);
-
-        for (int t = 0; t < numTags; ++t)
-        {
-            double best = 0;
-            for (PhraseCounts::iterator pit = cpit->second.begin();
-                 pit != cpit->second.end(); ++pit)
-            {
-                const Phrase &phrase = phrases.type(pit->first);
-                Dist scores = penalised_conditionals(phrase, context, lambda, 0);
-                best = max(best, scores[t]);
-            }
-            violation += best;
-        }
-    }
-
+    for (int s = 0; s < numThreads; ++s)
+        violation += job.violation[s];
     return violation;
 }
 
-// FIXME: possibly inefficient
 double 
-primal_likelihood() // FIXME: primal evaluation needs to use lambda and calculate l1linf terms
+primal_likelihood(const Posteriors &q) // FIXME: primal evaluation needs to use lambda and calculate l1linf terms
 {
     double llh = 0;
-    for (int p = 0; p < phrases.size(); ++p)
-    {
-        const Phrase &phrase = phrases.type(p);
-        PhraseToContextCounts::const_iterator pcit = concordancePhraseToContexts.find(p);
-        for (ContextCounts::const_iterator ccit = pcit->second.begin();
-             ccit != pcit->second.end(); ++ccit)
-        {
-            const Context &context = contexts.type(ccit->first);
-            double z = 0;
-            Dist scores = conditional_probs(phrase, context, &z);
-            llh += ccit->second * log(z);
-        }
-    }
+    for (int e = 0; e < (int) edges.size(); ++e)
+        llh += edges[e].count * q.logZ[e];
     return llh;
 }
 
-// FIXME: inefficient - cache the scores
 double 
-primal_kl_divergence(const double *lambda)
+primal_kl_divergence(const double *lambda, const Posteriors &q)
 {
     // return KL(q || p) = sum_y q(y) { log q(y) - log p(y | x) }
     //                   = sum_y q(y) { log p(y | x) - lambda . phi(x, y) - log Z - log p(y | x) }
@@ -758,66 +889,43 @@ primal_kl_divergence(const double *lambda)
     // and q(y) factors with each edge, ditto for Z
     
     double feature_sum = 0, log_z = 0;
-    for (int p = 0; p < phrases.size(); ++p)
+    for (int e = 0; e < (int) edges.size(); ++e)
     {
-        const Phrase &phrase = phrases.type(p);
-        PhraseToContextCounts::const_iterator pcit = concordancePhraseToContexts.find(p);
-        for (ContextCounts::const_iterator ccit = pcit->second.begin();
-             ccit != pcit->second.end(); ++ccit)
+        double local_f = 0;
+        if (lambda)
         {
-            const Context &context = contexts.type(ccit->first);
-
-            double local_z = 0;
-            double local_f = 0;
-            Dist d = conditional_probs(phrase, context, 0);
-            for (int t = 0; t < numTags; ++t)
-            {
-                int i = lambda_index(phrase, context, t);
-                double s = d[t] * exp(-lambda[i]);
-                local_f += lambda[i] * s;
-                local_z += s;
-            }
-
-            log_z += ccit->second * log(local_z);
-            feature_sum += ccit->second * (local_f / local_z);
+            for (int i = q.start[e]; i < q.start[e + 1]; ++i)
+                local_f += lambda[e * numTags + q.tags[i]] * q.probs[i];
         }
+        log_z += edges[e].count * (q.logZPenalised[e] - q.logZ[e]);
+        feature_sum += edges[e].count * local_f;
     }
 
     return -feature_sum - log_z;
 }
 
-// FIXME: inefficient - cache the scores
 double 
-dual(const double *lambda)
+dual(const Posteriors &q)
 {
     // return log(Z) = - log { sum_y p(y | x) exp( - lambda . phi(x, y) }
     // n.b. have flipped the sign as we're minimising
     
-    double z = 0;
-    for (int p = 0; p < phrases.size(); ++p)
-    {
-        const Phrase &phrase = phrases.type(p);
-        PhraseToContextCounts::const_iterator pcit = concordancePhraseToContexts.find(p);
-        for (ContextCounts::const_iterator ccit = pcit->second.begin();
-             ccit != pcit->second.end(); ++ccit)
-        {
-            const Context &context = contexts.type(ccit->first);
-            double lz = 0;
-            Dist scores = penalised_conditionals(phrase, context, lambda, &z);
-            z += lz * ccit->second;
-        }
-    }
-    return log(z);
+    double log_z = 0;
+    for (int e = 0; e < (int) edges.size(); ++e)
+        log_z += edges[e].count * q.logZPenalised[e];
+    return log_z;
 }
 
 void
 print_primal_dual(const double *lambda, double delta, double gamma)
 {
-    double likelihood = primal_likelihood();
-    double kl = primal_kl_divergence(lambda);
-    double sum_pt = expected_violation_phrases(lambda);
-    double sum_ct = expected_violation_contexts(lambda);
-    //double d = dual(lambda);
+    Posteriors q;
+    compute_posteriors(lambda, q);
+    double likelihood = primal_likelihood(q);
+    double kl = primal_kl_divergence(lambda, q);
+    double sum_pt = expected_violation_phrases(q);
+    double sum_ct = expected_violation_contexts(q);
+    //double d = dual(q);
 
     cout << "\tllh=" << likelihood
          << " kl=" << kl
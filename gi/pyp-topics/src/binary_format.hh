@@ -0,0 +1,70 @@
+#ifndef _BINARY_FORMAT_HH
+#define _BINARY_FORMAT_HH
+
+//
+// Helpers for the mmapped binary files (ContextsCorpus::write_binary,
+// TopicModel::write).  All sections are 8 byte aligned; strings are stored
+// as uint64_t end offsets followed by the characters
+//
+
+#include <ostream>
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+#include "dict.h"
+
+namespace binary_format {
+
+  template <class T>
+  inline void append(std::ostream* out, const std::vector<T>& v) {
+    if (!v.empty())
+      out->write(reinterpret_cast<const char*>(&v[0]), v.size() * sizeof(T));
+  }
+
+  inline void pad(std::ostream* out) {
+    while (out->tellp() % 8) out->put(0);
+  }
+
+  inline void write_strings(std::ostream* out, const std::vector<std::string>& strs) {
+    std::vector<uint64_t> ends;
+    ends.reserve(strs.size());
+    uint64_t off = 0;
+    for (int i = 0; i < (int)strs.size(); ++i)
+      ends.push_back(off += strs[i].size());
+    append(out, ends);
+    for (int i = 0; i < (int)strs.size(); ++i)
+      out->write(strs[i].data(), strs[i].size());
+    pad(out);
+  }
+
+  // string i of a section written by write_strings with n strings
+  inline const char* read_string(const char* section, uint32_t n, uint32_t i, uint64_t* len) {
+    const uint64_t* ends = reinterpret_cast<const uint64_t*>(section);
+    const uint64_t b = (i ? ends[i-1] : 0);
+    *len = ends[i] - b;
+    return section + n * sizeof(uint64_t) + b;
+  }
+
+  // the dictionary written as the n strings of section, whose ids must come
+  // out as they were written (1..n); false if they don't
+  inline bool read_dict(const char* section, uint32_t n, Dict* dict) {
+    std::string blob;
+    std::vector<unsigned> ends;
+    ends.reserve(n);
+    for (uint32_t i = 0; i < n; ++i) {
+      uint64_t len;
+      const char* w = read_string(section, n, i, &len);
+      blob.append(w, len);
+      ends.push_back(blob.size());
+    }
+    std::vector<WordID> ids;
+    dict->ConvertMany(blob, ends, &ids);
+    for (uint32_t i = 0; i < n; ++i)
+      if (ids[i] != (WordID)i+1) return false;
+    return true;
+  }
+
+}
+
+#endif // _BINARY_FORMAT_HH
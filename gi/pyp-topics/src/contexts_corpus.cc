@@ -1,8 +1,18 @@
 #include <sstream>
 #include <iostream>
+#include <fstream>
 #include <set>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "contexts_corpus.hh"
+#include "binary_format.hh"
 #include "gzstream.hh"
 #include "contexts_lexer.h"
 
@@ -11,6 +21,49 @@
 
 using namespace std;
 
+//////////////////////////////////////////////////
+// binary corpus format
+//////////////////////////////////////////////////
+
+static const char kCC_MAGIC[8] = { 'p', 'y', 'p', 'C', 'T', 'X', 'T', 'S' };
+static const uint32_t kCC_VERSION = 1;
+static const uint32_t kCC_BYTE_ORDER = 0x01020304;
+
+// sections as in binary_format.hh
+struct CCHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t num_documents;
+  uint32_t num_types;
+  uint32_t dict_size;      // ids 1..dict_size
+  uint32_t backoff_size;
+  uint32_t backoff_order;
+  uint32_t pad;
+  uint64_t num_terms;
+  // byte offsets from the start of the file
+  uint64_t levels_off;     // int32_t terms_at_level[backoff_order]
+  uint64_t backoff_off;    // int32_t backoff[backoff_size]
+  uint64_t counts_off;     // int32_t context_count[dict_size + 1], 0 = none
+  uint64_t doc_offsets_off;// uint64_t offsets[num_documents + 1]
+  uint64_t terms_off;      // int32_t terms[num_terms]
+  uint64_t dict_off;       // dict_size strings
+  uint64_t keys_off;       // num_documents strings
+  uint64_t file_size;
+};
+
+namespace {
+  using binary_format::append;
+  using binary_format::pad;
+  using binary_format::write_strings;
+  using binary_format::read_string;
+
+  void fail(const string& file, const string& msg) {
+    cerr << "Bad binary contexts corpus " << file << ": " << msg << endl;
+    abort();
+  }
+}
+
 //////////////////////////////////////////////////
 // ContextsCorpus
 //////////////////////////////////////////////////
@@ -162,3 +215,143 @@ unsigned ContextsCorpus::read_contexts(const string &filename,
 
   return m_documents.size();
 }
+
+bool ContextsCorpus::write_binary(const string &filename) const {
+  ofstream out(filename.c_str(), ios::binary);
+  if (!out) {
+    cerr << "Can't write " << filename << endl;
+    return false;
+  }
+  CCHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, kCC_MAGIC, sizeof(kCC_MAGIC));
+  h.version = kCC_VERSION;
+  h.byte_order = kCC_BYTE_ORDER;
+  h.num_documents = m_documents.size();
+  h.num_types = m_num_types;
+  h.dict_size = m_dict.max();
+  h.backoff_size = m_backoff->size();
+  h.backoff_order = m_backoff->order();
+  out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+
+  vector<int32_t> ints;
+  for (int o=0; o < m_backoff->order(); ++o)
+    ints.push_back(m_backoff->terms_at_level(o));
+  h.levels_off = out.tellp();
+  append(&out, ints);
+  pad(&out);
+
+  h.backoff_off = out.tellp();
+  ints.assign(m_backoff->begin(), m_backoff->end());
+  append(&out, ints);
+  pad(&out);
+
+  ints.assign(h.dict_size + 1, 0);
+  for (tr1::unordered_map<int,int>::const_iterator it=m_context_counts.begin();
+       it != m_context_counts.end(); ++it)
+    ints.at(it->first) = it->second;
+  h.counts_off = out.tellp();
+  append(&out, ints);
+  pad(&out);
+
+  vector<uint64_t> offsets(1, 0);
+  for (const_iterator it=begin(); it != end(); ++it)
+    offsets.push_back(offsets.back() + it->size());
+  h.num_terms = offsets.back();
+  h.doc_offsets_off = out.tellp();
+  append(&out, offsets);
+
+  h.terms_off = out.tellp();
+  for (const_iterator it=begin(); it != end(); ++it)
+    append(&out, *it);
+  pad(&out);
+
+  vector<string> strs;
+  strs.reserve(h.dict_size);
+  for (int id=1; id <= (int)h.dict_size; ++id)
+    strs.push_back(m_dict.Convert(id));
+  h.dict_off = out.tellp();
+  write_strings(&out, strs);
+
+  h.keys_off = out.tellp();
+  write_strings(&out, m_keys);
+
+  h.file_size = out.tellp();
+  out.seekp(0);
+  out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+  out.close();
+  if (!out) {
+    cerr << "Error writing " << filename << endl;
+    return false;
+  }
+  return true;
+}
+
+bool ContextsCorpus::is_binary(const string &filename) {
+  ifstream in(filename.c_str(), ios::binary);
+  char magic[sizeof(kCC_MAGIC)];
+  if (!in.read(magic, sizeof(magic))) return false;
+  return memcmp(magic, kCC_MAGIC, sizeof(kCC_MAGIC)) == 0;
+}
+
+unsigned ContextsCorpus::read_binary(const string &filename) {
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) fail(filename, strerror(errno));
+  struct stat st;
+  if (fstat(fd, &st) < 0) fail(filename, strerror(errno));
+  const size_t size = st.st_size;
+  if (size < sizeof(CCHeader)) fail(filename, "file too short");
+  void* data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) fail(filename, strerror(errno));
+  const char* base = static_cast<const char*>(data);
+  const CCHeader& h = *reinterpret_cast<const CCHeader*>(base);
+  if (memcmp(h.magic, kCC_MAGIC, sizeof(kCC_MAGIC)) != 0) fail(filename, "bad magic number");
+  if (h.version != kCC_VERSION) fail(filename, "unsupported version");
+  if (h.byte_order != kCC_BYTE_ORDER) fail(filename, "written on a machine with a different byte order");
+  if (h.file_size != size) fail(filename, "truncated file");
+
+  m_num_types = h.num_types;
+  m_num_terms = h.num_terms;
+
+  const int32_t* levels = reinterpret_cast<const int32_t*>(base + h.levels_off);
+  m_backoff->order(h.backoff_order);
+  for (int o=0; o < (int)h.backoff_order; ++o)
+    m_backoff->terms_at_level(o) = levels[o];
+  const int32_t* backoff = reinterpret_cast<const int32_t*>(base + h.backoff_off);
+  for (int t=h.backoff_size-1; t >= 0; --t)
+    (*m_backoff)[t] = backoff[t];
+
+  if (!binary_format::read_dict(base + h.dict_off, h.dict_size, &m_dict))
+    fail(filename, "duplicate context");
+
+  const int32_t* counts = reinterpret_cast<const int32_t*>(base + h.counts_off);
+  for (int id=1; id <= (int)h.dict_size; ++id)
+    if (counts[id]) m_context_counts[id] = counts[id];
+
+  const uint64_t* offsets = reinterpret_cast<const uint64_t*>(base + h.doc_offsets_off);
+  const int32_t* terms = reinterpret_cast<const int32_t*>(base + h.terms_off);
+  int start=0, end=0;
+  document_range(offsets, h.num_documents, &start, &end);
+  assert(0 <= start && start <= end && end <= (int)h.num_documents);
+
+  const char* keys = base + h.keys_off;
+  m_keys.resize(h.num_documents);
+  for (int i=0; i < (int)h.num_documents; ++i) {
+    Document* doc = new Document();
+    if (start <= i && i < end) {
+      doc->assign(terms + offsets[i], terms + offsets[i+1]);
+      uint64_t len;
+      const char* k = read_string(keys, h.num_documents, i, &len);
+      m_keys[i].assign(k, len);
+    }
+    m_documents.push_back(doc);
+  }
+  munmap(data, size);
+
+  cerr << "Read backoff with order " << m_backoff->order() << "\n";
+  for (int o=0; o<m_backoff->order(); o++)
+    cerr << "  Terms at " << o << " = " << m_backoff->terms_at_level(o) << endl;
+
+  return m_documents.size();
+}
@@ -5,6 +5,7 @@
 #include <string>
 #include <map>
 #include <tr1/unordered_map>
+#include <stdint.h>
 
 #include <boost/ptr_container/ptr_vector.hpp>
 
@@ -58,7 +59,19 @@ public:
                                    bool filter_singeltons=false,
                                    bool binary_contexts=false);
 
-    TermBackoffPtr backoff_index() {
+    // writes the corpus, as read by read_contexts, in the binary format read
+    // by read_binary.  The backoff and any binary counts are baked in
+    bool write_binary(const std::string &filename) const;
+
+    // loads a corpus written by write_binary.  The file is mmapped and only
+    // the documents chosen by document_range are copied out; the others are
+    // left empty
+    virtual unsigned read_binary(const std::string &filename);
+
+    // true if filename starts with the magic number of write_binary's format
+    static bool is_binary(const std::string &filename);
+
+    TermBackoffPtr backoff_index() const {
       return m_backoff;
     }
 
@@ -81,6 +94,15 @@ public:
     const Dict& dict() const { return m_dict; }
 
 protected:
+    // picks the documents [*start,*end) read_binary loads, given the offsets
+    // of the documents in the term array (offsets[num_documents] is the
+    // number of terms).  All of them by default
+    virtual void document_range(const uint64_t* /*offsets*/, int num_documents,
+                                int* start, int* end) {
+      *start = 0;
+      *end = num_documents;
+    }
+
     TermBackoffPtr m_backoff;
     Dict m_dict;
     std::vector<std::string> m_keys;
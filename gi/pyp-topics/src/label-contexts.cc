@@ -0,0 +1,183 @@
+// STL
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <iterator>
+#include <cmath>
+
+// Boost
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+// Local
+#include "topic_model.hh"
+#include "contexts_corpus.hh"
+#include "contexts_lexer.h"
+#include "gzstream.hh"
+#include "workers.hh"
+
+// Namespaces
+using namespace boost;
+using namespace boost::program_options;
+using namespace std;
+
+typedef vector<ContextsLexer::PhraseContextsType> Documents;
+typedef boost::function<double()> JobReturnsF;
+
+static void collect_callback(const ContextsLexer::PhraseContextsType& new_contexts, void* extra) {
+  static_cast<Documents*>(extra)->push_back(new_contexts);
+}
+
+// labels the documents [start, end) into out[start, end); returns the
+// number of contexts labeled.  Each document is given the topic posterior
+// of all its contexts having been drawn from one topic, P(k) prod_c P(c|k)^n_c
+// (which takes no sampling), and each context the topic of the largest
+// P(c|k) P(k|document), as pyp-contexts-train --document-topics-out does
+double label_documents(const TopicModel* model, const Documents* docs,
+                       int start, int end, bool binary_counts,
+                       BackoffGenerator* backoff_gen, bool posterior,
+                       vector<string>* out) {
+  const int K = model->num_topics();
+  vector<double> probs, log_post(K), post(K);
+  double labeled = 0;
+  for (int d=start; d < end; ++d) {
+    const ContextsLexer::PhraseContextsType& doc = (*docs)[d];
+    const int n = doc.counts.size();
+    probs.resize(n * K);
+    for (int k=0; k < K; ++k)
+      log_post[k] = log(model->topic_prob(k));
+    int size = 0;
+    for (int i=0; i < n; ++i) {
+      double* p = &probs[i * K];
+      model->context_probs(doc.contexts[doc.counts[i].first], backoff_gen, p);
+      const int count = (binary_counts ? 1 : doc.counts[i].second);
+      for (int k=0; k < K; ++k)
+        log_post[k] += count * log(p[k]);
+      size += count;
+    }
+    const double max_log_post = *max_element(log_post.begin(), log_post.end());
+    double z = 0;
+    for (int k=0; k < K; ++k)
+      z += (post[k] = exp(log_post[k] - max_log_post));
+    for (int k=0; k < K; ++k)
+      post[k] /= z;
+
+    ostringstream line;
+    line << doc.phrase << '\t';
+    if (posterior) {
+      for (int k=0; k < K; ++k)
+        line << (k ? " " : "") << post[k];
+    }
+    else {
+      line << (max_element(post.begin(), post.end()) - post.begin()) << " " << size << " ||| ";
+      for (int i=0; i < n; ++i) {
+        const double* p = &probs[i * K];
+        int max_k = 0;
+        for (int k=1; k < K; ++k)
+          if (p[k] * post[k] > p[max_k] * post[max_k]) max_k = k;
+        if (i) line << " ||| ";
+        const ContextsLexer::Context& c = doc.contexts[doc.counts[i].first];
+        copy(c.begin(), c.end(), ostream_iterator<std::string>(line, " "));
+        line << "||| C=" << max_k << " P=" << p[max_k] * post[max_k];
+      }
+    }
+    (*out)[d] = line.str();
+    labeled += n;
+  }
+  return labeled;
+}
+
+int main(int argc, char **argv)
+{
+  ////////////////////////////////////////////////////////////////////////////////////////////
+  // Command line processing
+  variables_map vm;
+
+  // Command line processing
+  {
+    options_description cmdline_specific("Command line specific options");
+    cmdline_specific.add_options()
+      ("help,h", "print help message")
+      ("config,c", value<string>(), "config file specifying additional command line options")
+      ;
+    options_description config_options("Allowed options");
+    config_options.add_options()
+      ("model,m", value<string>(), "topic model written by pyp-contexts-train --model-out")
+      ("data,d", value<string>(), "file containing the documents and context terms to label")
+      ("document-topics-out,o", value<string>(), "file to write the document topics to, in the format of pyp-contexts-train --document-topics-out")
+      ("posterior", "write each document's posterior over the topics instead of its labels")
+      ("backoff-type", value<string>(), "backoff type of the model, for contexts it hasn't seen: none|simple")
+      ("binary-counts,b", "Use binary rather than integer counts for contexts.")
+      ("max-threads", value<int>()->default_value(1), "maximum number of simultaneous threads allowed")
+      ;
+
+    cmdline_specific.add(config_options);
+
+    store(parse_command_line(argc, argv, cmdline_specific), vm);
+    notify(vm);
+
+    if (vm.count("config") > 0) {
+      ifstream config(vm["config"].as<string>().c_str());
+      store(parse_config_file(config, config_options), vm);
+    }
+
+    if (vm.count("help")) {
+      cout << cmdline_specific << "\n";
+      return 1;
+    }
+  }
+  ////////////////////////////////////////////////////////////////////////////////////////////
+
+  if (!vm.count("model") || !vm.count("data") || !vm.count("document-topics-out")) {
+    cerr << "Please specify --model, --data and --document-topics-out." << endl;
+    return 1;
+  }
+  const int max_threads = vm["max-threads"].as<int>();
+  assert(max_threads > 0);
+
+  SimpleBackoffGenerator simple_backoff;
+  BackoffGenerator* backoff_gen=0;
+  if (vm.count("backoff-type")) {
+    if (vm["backoff-type"].as<std::string>() == "simple")
+      backoff_gen = &simple_backoff;
+    else if (vm["backoff-type"].as<std::string>() != "none") {
+      cerr << "Backoff type (--backoff-type) must be one of none|simple." <<endl;
+      return(1);
+    }
+  }
+
+  TopicModel model;
+  model.read(vm["model"].as<string>());
+
+  Documents docs;
+  {
+    igzstream in(vm["data"].as<string>().c_str());
+    ContextsLexer::ReadContexts(&in, collect_callback, &docs);
+  }
+  cerr << "Labeling " << docs.size() << " documents" << endl;
+
+  vector<string> lines(docs.size());
+  {
+    WorkerPool<JobReturnsF, double> pool(max_threads);
+    const int sz = docs.size();
+    // several jobs a thread, as documents differ in size
+    const int num_jobs = (max_threads > 1 ? 4 * max_threads : 1);
+    for (int i=0; i < num_jobs; ++i) {
+      JobReturnsF job = boost::bind(&label_documents, &model, &docs,
+                                    (int) ((long long) sz * i / num_jobs),
+                                    (int) ((long long) sz * (i+1) / num_jobs),
+                                    vm.count("binary-counts") > 0, backoff_gen,
+                                    vm.count("posterior") > 0, &lines);
+      pool.addJob(job);
+    }
+    cerr << "  Labeled " << pool.get_result() << " contexts" << endl; //blocks
+  }
+
+  ogzstream documents_out(vm["document-topics-out"].as<string>().c_str());
+  for (int d=0; d < (int)lines.size(); ++d)
+    documents_out << lines[d] << endl;
+  documents_out.close();
+
+  return 0;
+}
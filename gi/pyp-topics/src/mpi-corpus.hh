@@ -34,34 +34,47 @@ public:
                                  bool binary_contexts=false) {
     unsigned result = ContextsCorpus::read_contexts(filename, backoff_gen, filter_singeltons, binary_contexts);
 
+    std::vector<uint64_t> offsets(1, 0);
+    for (int i=0; i < num_documents(); ++i)
+      offsets.push_back(offsets.back() + m_documents.at(i).size());
+    document_range(&offsets[0], num_documents(), &m_start, &m_end);
+
+    return result;
+  }
+
+  void
+  bounds(int* start, int* end) const {
+    *start = m_start;
+    *end = m_end;
+  }
+
+
+
+protected:
+  // splits the documents into contiguous segments of roughly equal numbers
+  // of terms, one per process
+  virtual void document_range(const uint64_t* offsets, int num_documents,
+                              int* start, int* end) {
     if (m_rank == 0) std::cerr << "\tLoad balancing terms per mpi segment:" << std::endl;
-    float segment_size = num_terms() / m_size;
+    const int total_terms = offsets[num_documents];
+    float segment_size = total_terms / m_size;
     float term_threshold = segment_size;
     int seen_terms = 0;
     std::vector<int> end_points;
-    for (int i=0; i < num_documents(); ++i) {
-      seen_terms += m_documents.at(i).size();
+    for (int i=0; i < num_documents; ++i) {
+      seen_terms += offsets[i+1] - offsets[i];
       if (seen_terms >= term_threshold) {
         end_points.push_back(i+1);
         term_threshold += segment_size;
-        if (m_rank == 0) std::cerr << "\t\t" << i+1 << ": " <<  seen_terms << " terms, " << 100*seen_terms / (float)num_terms() << "%" << std::endl;
+        if (m_rank == 0) std::cerr << "\t\t" << i+1 << ": " <<  seen_terms << " terms, " << 100*seen_terms / (float)total_terms << "%" << std::endl;
       }
     }
     m_start = (m_rank == 0 ? 0 : end_points.at(m_rank-1));
-    m_end = (m_rank == m_size-1 ? num_documents() : end_points.at(m_rank));
-
-    return result;
-  }
-
-  void
-  bounds(int* start, int* end) const {
+    m_end = (m_rank == m_size-1 ? num_documents : end_points.at(m_rank));
     *start = m_start;
     *end = m_end;
   }
 
-
-
-protected:
   int m_rank, m_size;
   int m_start, m_end;
 };
@@ -3,6 +3,33 @@
 #include "timing.h"
 #include "mpi-pyp-topics.hh"
 
+namespace {
+  const int kDeltaTag = 1;
+
+  // deltas are sent as varints: per changed restaurant its label and number
+  // of dishes, then per dish the gap from the previous dish and the
+  // zigzag encoded count
+  void put_varint(unsigned x, std::vector<unsigned char>* out) {
+    while (x >= 0x80) {
+      out->push_back((x & 0x7f) | 0x80);
+      x >>= 7;
+    }
+    out->push_back(x);
+  }
+
+  unsigned get_varint(const unsigned char** p) {
+    unsigned x = 0;
+    for (int shift = 0; ; shift += 7) {
+      const unsigned char c = *(*p)++;
+      x |= (c & 0x7f) << shift;
+      if (!(c & 0x80)) return x;
+    }
+  }
+
+  unsigned zigzag(int x) { return (unsigned(x) << 1) ^ unsigned(x >> 31); }
+  int unzigzag(unsigned x) { return (x >> 1) ^ -(int)(x & 1); }
+}
+
 //#include <boost/date_time/posix_time/posix_time_types.hpp>
 void MPIPYPTopics::sample_corpus(const MPICorpus& corpus, int samples,
                               int freq_cutoff_start, int freq_cutoff_end,
@@ -45,6 +72,17 @@ void MPIPYPTopics::sample_corpus(const MPICorpus& corpus, int samples,
   for (int j=0; j<local_documents; ++j)
     m_document_pyps.push_back(new PYP<int>(0.5, 1.0));
 
+  // one message after initialisation and one after each sweep
+  m_messages = samples + 1;
+  m_sent = 0;
+  m_outgoing.assign(m_num_topics+1, MPIPYP<int>::dish_delta_type());
+  m_received.assign(m_size, 0);
+  m_receive_buffers.resize(m_size);
+  m_receives.resize(m_size);
+  for (int p=0; p<m_size; ++p)
+    if (p != m_rank)
+      m_receives.at(p) = m_world.irecv(p, kDeltaTag, m_receive_buffers.at(p));
+
   m_topic_p0 = 1.0/m_num_topics;
   m_term_p0 = 1.0/corpus.num_types();
   m_backoff_p0 = 1.0/corpus.num_documents();
@@ -97,7 +135,7 @@ void MPIPYPTopics::sample_corpus(const MPICorpus& corpus, int samples,
   }
 
   // Synchronise the topic->word counds across the processes.
-  synchronise();
+  synchronise(samples ? m_max_staleness : 0);
 
   if (m_am_root) std::cerr << "  Initialized in " << timer.Elapsed() << " seconds\n";
 
@@ -179,11 +217,14 @@ void MPIPYPTopics::sample_corpus(const MPICorpus& corpus, int samples,
       if (document_id && document_id % 10000 == 0) {
         if (m_am_root) std::cerr << "."; std::cerr.flush();
       }
+      // apply any deltas that have arrived
+      if (rand_doc % 1000 == 999)
+        receive_deltas(0);
     }
     std::cerr << "|"; std::cerr.flush();  
 
     // Synchronise the topic->word counds across the processes.
-    synchronise();
+    synchronise(curr_sample == samples-1 ? 0 : m_max_staleness);
 
     if (m_am_root) std::cerr << " ||| sampled " << processed_terms << " terms.";
 
@@ -232,54 +273,113 @@ void MPIPYPTopics::sample_corpus(const MPICorpus& corpus, int samples,
     }
   }
   delete [] randomDocIndices;
+
+  // every message has been received; wait until ours have been too
+  for (std::list<PendingSend>::iterator it=m_sends.begin(); it != m_sends.end(); ++it)
+    boost::mpi::wait_all(it->requests.begin(), it->requests.end());
+  m_sends.clear();
 }
 
-void MPIPYPTopics::synchronise() {
-  // Synchronise the topic->word counds across the processes.
-  //for (std::vector<MPIPYPs>::iterator levelIt=m_word_pyps.begin();
-  //     levelIt != m_word_pyps.end(); ++levelIt) {
-//  std::vector<MPIPYPs>::iterator levelIt=m_word_pyps.begin(); 
-//  {
-//    for (MPIPYPs::iterator pypIt=levelIt->begin(); pypIt != levelIt->end(); ++pypIt) {
-    for (size_t label=0; label < m_word_pyps.at(0).size(); ++label) {
-      MPIPYP<int>& pyp = m_word_pyps.at(0).at(label);
-
-      //if (!m_am_root) boost::mpi::communicator().barrier();
-      //std::cerr << "Before Sync Process " << m_rank << ":";
-      //pyp.debug_info(std::cerr); std::cerr << std::endl;
-      //if (m_am_root) boost::mpi::communicator().barrier();
-
-      MPIPYP<int>::dish_delta_type delta;
-      pyp.synchronise(&delta);
-
-      for (MPIPYP<int>::dish_delta_type::const_iterator it=delta.begin(); it != delta.end(); ++it) {
-        int count = it->second;
-        if (count > 0)
-          for (int i=0; i < count; ++i) increment(it->first, label);
-        if (count < 0)
-          for (int i=0; i > count; --i) decrement(it->first, label);
-      }
-      pyp.reset_deltas();
+void MPIPYPTopics::synchronise(int max_staleness) {
+  collect_deltas();
+  send_deltas();
+  receive_deltas(m_sent - max_staleness);
+}
+
+void MPIPYPTopics::collect_deltas() {
+  for (int k=0; k<m_num_topics; ++k) {
+    const MPIPYP<int>::dish_delta_type& delta = m_word_pyps.front().at(k).count_deltas();
+    for (MPIPYP<int>::dish_delta_type::const_iterator it=delta.begin(); it != delta.end(); ++it)
+      m_outgoing.at(k)[it->first] += it->second;
+  }
+  const MPIPYP<int>::dish_delta_type& delta = m_topic_pyp.count_deltas();
+  for (MPIPYP<int>::dish_delta_type::const_iterator it=delta.begin(); it != delta.end(); ++it)
+    m_outgoing.back()[it->first] += it->second;
+  reset_deltas();
+}
+
+void MPIPYPTopics::reset_deltas() {
+  for (std::vector<MPIPYPs>::iterator levelIt=m_word_pyps.begin();
+       levelIt != m_word_pyps.end(); ++levelIt)
+    for (MPIPYPs::iterator pypIt=levelIt->begin(); pypIt != levelIt->end(); ++pypIt)
+      pypIt->reset_deltas();
+  m_topic_pyp.reset_deltas();
+}
 
-      //if (!m_am_root) boost::mpi::communicator().barrier();
-      //std::cerr << "After Sync Process " << m_rank << ":";
-      //pyp.debug_info(std::cerr); std::cerr << std::endl;
-      //if (m_am_root) boost::mpi::communicator().barrier();
+void MPIPYPTopics::send_deltas() {
+  boost::shared_ptr<std::vector<unsigned char> > message(new std::vector<unsigned char>);
+  for (int label=0; label < (int)m_outgoing.size(); ++label) {
+    MPIPYP<int>::dish_delta_type& delta = m_outgoing.at(label);
+    int changed=0;
+    for (MPIPYP<int>::dish_delta_type::const_iterator it=delta.begin(); it != delta.end(); ++it)
+      if (it->second) ++changed;
+    if (!changed) continue;
+    put_varint(label, message.get());
+    put_varint(changed, message.get());
+    int last=0;
+    for (MPIPYP<int>::dish_delta_type::const_iterator it=delta.begin(); it != delta.end(); ++it) {
+      if (!it->second) continue;
+      assert(it->first >= last);
+      put_varint(it->first - last, message.get());
+      put_varint(zigzag(it->second), message.get());
+      last = it->first;
     }
-//  }
-    // Synchronise the hierarchical topic pyp
-    MPIPYP<int>::dish_delta_type topic_delta;
-    m_topic_pyp.synchronise(&topic_delta);
-    for (MPIPYP<int>::dish_delta_type::const_iterator it=topic_delta.begin(); it != topic_delta.end(); ++it) {
-      int count = it->second;
-      if (count > 0)
-        for (int i=0; i < count; ++i) 
-          m_topic_pyp.increment(it->first, m_topic_p0, rnd);
-      if (count < 0)
-        for (int i=0; i > count; --i) 
-          m_topic_pyp.decrement(it->first, rnd);
+    delta.clear();
+  }
+
+  // drop the sends that have completed
+  for (std::list<PendingSend>::iterator it=m_sends.begin(); it != m_sends.end(); )
+    if (boost::mpi::test_all(it->requests.begin(), it->requests.end())) it = m_sends.erase(it);
+    else ++it;
+
+  m_sends.push_back(PendingSend());
+  PendingSend& send = m_sends.back();
+  send.message = message;
+  for (int p=0; p<m_size; ++p)
+    if (p != m_rank)
+      send.requests.push_back(m_world.isend(p, kDeltaTag, *message));
+  ++m_sent;
+}
+
+void MPIPYPTopics::receive_deltas(int min_received) {
+  for (int p=0; p<m_size; ++p) {
+    if (p == m_rank) continue;
+    while (m_received.at(p) < m_messages) {
+      if (m_received.at(p) < min_received) m_receives.at(p).wait();
+      else if (!m_receives.at(p).test()) break;
+
+      // keep our own changes apart from the ones we are about to apply
+      collect_deltas();
+      apply_deltas(m_receive_buffers.at(p));
+      reset_deltas();
+      if (++m_received.at(p) < m_messages)
+        m_receives.at(p) = m_world.irecv(p, kDeltaTag, m_receive_buffers.at(p));
     }
-    m_topic_pyp.reset_deltas();
+  }
+}
+
+void MPIPYPTopics::apply_deltas(const std::vector<unsigned char>& message) {
+  if (message.empty()) return;
+  const unsigned char* p = &message[0];
+  const unsigned char* end = p + message.size();
+  while (p < end) {
+    const int label = get_varint(&p);
+    const int changed = get_varint(&p);
+    int dish=0;
+    for (int i=0; i < changed; ++i) {
+      dish += get_varint(&p);
+      const int count = unzigzag(get_varint(&p));
+      if (label < m_num_topics) {
+        for (int c=0; c < count; ++c) increment(dish, label);
+        for (int c=0; c > count; --c) decrement(dish, label);
+      }
+      else {
+        for (int c=0; c < count; ++c) m_topic_pyp.increment(dish, m_topic_p0, rnd);
+        for (int c=0; c > count; --c) m_topic_pyp.decrement(dish, rnd);
+      }
+    }
+  }
+  assert(p == end);
 }
 
 void MPIPYPTopics::decrement(const Term& term, int topic, int level) {
@@ -452,7 +552,7 @@ std::ostream& MPIPYPTopics::print_document_topics(std::ostream& out) const {
 }
 
 std::ostream& MPIPYPTopics::print_topic_terms(std::ostream& out) const {
-  for (PYPs::const_iterator pypsIt=m_word_pyps.front().begin();
+  for (MPIPYPs::const_iterator pypsIt=m_word_pyps.front().begin();
        pypsIt != m_word_pyps.front().end(); ++pypsIt) {
     int term_index=0;
     for (PYP<int>::const_iterator termIt=pypsIt->begin();
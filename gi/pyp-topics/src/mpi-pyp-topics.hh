@@ -2,6 +2,7 @@
 #define MPI_PYP_TOPICS_HH
 
 #include <vector>
+#include <list>
 #include <iostream>
 
 #include <boost/ptr_container/ptr_vector.hpp>
@@ -13,6 +14,8 @@
 #include <boost/random/lagged_fibonacci.hpp>
 #include <boost/mpi/environment.hpp>
 #include <boost/mpi/communicator.hpp>
+#include <boost/mpi/nonblocking.hpp>
+#include <boost/shared_ptr.hpp>
 
 
 #include "mpi-pyp.hh"
@@ -30,7 +33,8 @@ public:
     m_topic_pyp(0.5,1.0), m_use_topic_pyp(use_topic_pyp),
     m_seed(seed),
     uni_dist(0,1), rng(seed == 0 ? (unsigned long)this : seed), 
-    rnd(rng, uni_dist), m_mpi_start(-1), m_mpi_end(-1) {
+    rnd(rng, uni_dist), m_mpi_start(-1), m_mpi_end(-1),
+    m_max_staleness(0), m_messages(0), m_sent(0) {
       boost::mpi::communicator m_world;
       m_rank = m_world.rank(); 
       m_size = m_world.size();
@@ -66,9 +70,24 @@ public:
   std::ostream& print_document_topics(std::ostream& out) const;
   std::ostream& print_topic_terms(std::ostream& out) const;
 
-  void synchronise();
+  // a process may start a sweep before the deltas of the last
+  // max_staleness sweeps of the other processes have reached it.  0 keeps
+  // every process's counts exact at the start of each sweep
+  void set_max_staleness(int max_staleness) { m_max_staleness = max_staleness; }
 
 private:
+  // the level 0 word restaurants and the topic restaurant are kept in sync
+  // by sending every other process the net change of their customers after
+  // each sweep.  Sends and receives are non-blocking, so sampling overlaps
+  // with the exchange; deltas that arrive during a sweep are applied
+  // between documents
+  void synchronise(int max_staleness);
+  void collect_deltas();
+  void send_deltas();
+  void receive_deltas(int min_received);
+  void apply_deltas(const std::vector<unsigned char>& message);
+  void reset_deltas();
+
   F word_pyps_p0(const Term& term, int topic, int level) const;
 
   int m_num_topics;
@@ -101,6 +120,19 @@ private:
   bool m_am_root;
   int m_rank, m_size;
   int m_mpi_start, m_mpi_end;
+
+  int m_max_staleness;
+  int m_messages;                         // messages each process sends
+  int m_sent;                             // messages sent to each process
+  std::vector<MPIPYP<int>::dish_delta_type> m_outgoing; // per topic, then the topic restaurant
+  std::vector<int> m_received;            // messages applied from each process
+  std::vector<std::vector<unsigned char> > m_receive_buffers;
+  std::vector<boost::mpi::request> m_receives;
+  struct PendingSend {
+    boost::shared_ptr<std::vector<unsigned char> > message;
+    std::vector<boost::mpi::request> requests;
+  };
+  std::list<PendingSend> m_sends;
 };
 
 #endif // PYP_TOPICS_HH
@@ -49,7 +49,7 @@ int main(int argc, char **argv)
     options_description config_options("Allowed options");
     config_options.add_options()
       ("help,h", "print help message")
-      ("data,d", value<string>(), "file containing the documents and context terms")
+      ("data,d", value<string>(), "file containing the documents and context terms, or a binary corpus written by pyp-contexts-train --write-binary-corpus")
       ("topics,t", value<int>()->default_value(50), "number of topics")
       ("document-topics-out,o", value<string>(), "file to write the document topics to")
       ("default-topics-out", value<string>(), "file to write default term topic assignments.")
@@ -63,6 +63,7 @@ int main(int argc, char **argv)
       ("freq-cutoff-end", value<int>()->default_value(0), "final frequency cutoff.")
       ("freq-cutoff-interval", value<int>()->default_value(0), "number of iterations between frequency decrement.")
       ("max-contexts-per-document", value<int>()->default_value(0), "Only sample the n most frequent contexts for a document.")
+      ("max-staleness", value<int>()->default_value(0), "number of sweeps a process may run ahead of the counts it has received from the others.")
       ;
 
     cmdline_specific.add(config_options);
@@ -108,12 +109,16 @@ int main(int argc, char **argv)
 
   //ContextsCorpus contexts_corpus;
   MPICorpus contexts_corpus;
-  contexts_corpus.read_contexts(vm["data"].as<string>(), backoff_gen, /*vm.count("filter-singleton-contexts")*/ false, vm.count("binary-counts"));
+  if (MPICorpus::is_binary(vm["data"].as<string>()))
+    contexts_corpus.read_binary(vm["data"].as<string>());
+  else
+    contexts_corpus.read_contexts(vm["data"].as<string>(), backoff_gen, /*vm.count("filter-singleton-contexts")*/ false, vm.count("binary-counts"));
   int mpi_start = 0, mpi_end = 0;
   contexts_corpus.bounds(&mpi_start, &mpi_end);
   std::cerr << "\tProcess " << rank << " has documents " << mpi_start << " -> " << mpi_end << "." << std::endl;
 
   model.set_backoff(contexts_corpus.backoff_index());
+  model.set_max_staleness(vm["max-staleness"].as<int>());
 
   if (backoff_gen) 
     delete backoff_gen;
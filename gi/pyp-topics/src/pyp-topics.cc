@@ -4,6 +4,25 @@
 
 //Dict const *dict;
 
+// a thread's share of a parallel sampling pass: its copies of the
+// topic-term (and topic) restaurants, its own random numbers, and the
+// customers it has moved, which merge() replays on the model
+struct PYPTopics::SamplerThread {
+  SamplerThread(const PYP<int>& topic_pyp, int num_topics, unsigned long seed)
+    : topic_pyp(topic_pyp), uni_dist(0,1), rng(seed), rnd(rng, uni_dist),
+      term_deltas(num_topics), topic_deltas(num_topics, 0) {}
+
+  std::vector<PYPs> word_pyps;
+  PYP<int> topic_pyp;
+  uni_dist_type uni_dist;
+  base_generator_type rng;
+  gen_type rnd;
+  std::vector< std::map<Term,int> > term_deltas; // topic -> term -> customers added at level 0
+  std::vector<int> topic_deltas;                 // topic -> customers added to topic_pyp
+  std::vector<F> probs;                          // scratch for sample
+};
+
+
 //#include <boost/date_time/posix_time/posix_time_types.hpp>
 void PYPTopics::sample_corpus(const Corpus& corpus, int samples,
                               int freq_cutoff_start, int freq_cutoff_end,
@@ -120,57 +139,74 @@ void PYPTopics::sample_corpus(const Corpus& corpus, int samples,
     }
     */
 
-    // for each document in the corpus
-    int document_id;
-    for (int i=0; i<corpus.num_documents(); ++i) {
-    	document_id = randomDocIndices[i];
-
-      // for each term in the document
-      int term_index=0;
-      Document::const_iterator docEnd = corpus.at(document_id).end();
-      for (Document::const_iterator docIt=corpus.at(document_id).begin();
-           docIt != docEnd; ++docIt, ++term_index) {
-        if (max_contexts_per_document && term_index > max_contexts_per_document)
-          break;
+    if (m_parallel_sampling && max_threads > 1) {
+      boost::ptr_vector<SamplerThread> threads;
+      WorkerPool<JobReturnsF, F> pool(max_threads);
+      const int sz = corpus.num_documents();
+      for (int i=0; i < max_threads; ++i) {
+        threads.push_back(new SamplerThread(m_topic_pyp, m_num_topics, (unsigned long) (rnd() * 4294967296.0)));
+        JobReturnsF job = boost::bind(&PYPTopics::sample_documents, this, &threads.back(),
+                                      boost::cref(corpus), (int) ((long long) sz * i / max_threads),
+                                      (int) ((long long) sz * (i+1) / max_threads),
+                                      frequency_cutoff, max_contexts_per_document, temp);
+        pool.addJob(job);
+      }
+      processed_terms = (int) pool.get_result(); //blocks
+      for (int i=0; i < max_threads; ++i)
+        merge(threads[i]);
+    } else {
+      // for each document in the corpus
+      int document_id;
+      for (int i=0; i<corpus.num_documents(); ++i) {
+      	document_id = randomDocIndices[i];
+
+        // for each term in the document
+        int term_index=0;
+        Document::const_iterator docEnd = corpus.at(document_id).end();
+        for (Document::const_iterator docIt=corpus.at(document_id).begin();
+             docIt != docEnd; ++docIt, ++term_index) {
+          if (max_contexts_per_document && term_index > max_contexts_per_document)
+            break;
         
-        Term term = *docIt;
-
-        int freq = corpus.context_count(term);
-        if (freq < frequency_cutoff)
-          continue;
-
-        processed_terms++;
-
-        // remove the prevous topic from the PYPs
-        int current_topic = m_corpus_topics[document_id][term_index];
-        // a negative label mean that term hasn't been sampled yet
-        if (current_topic >= 0) {
-          decrement(term, current_topic);
-
-          int table_delta = m_document_pyps[document_id].decrement(current_topic);
-          if (m_use_topic_pyp && table_delta < 0)
-            m_topic_pyp.decrement(current_topic);
+          Term term = *docIt;
+
+          int freq = corpus.context_count(term);
+          if (freq < frequency_cutoff)
+            continue;
+
+          processed_terms++;
+
+          // remove the prevous topic from the PYPs
+          int current_topic = m_corpus_topics[document_id][term_index];
+          // a negative label mean that term hasn't been sampled yet
+          if (current_topic >= 0) {
+            decrement(term, current_topic);
+
+            int table_delta = m_document_pyps[document_id].decrement(current_topic);
+            if (m_use_topic_pyp && table_delta < 0)
+              m_topic_pyp.decrement(current_topic);
+          }
+
+          // sample a new_topic
+          int new_topic = sample(document_id, term, temp);
+          //std::cerr << "TERM: " << dict->Convert(term) << " (" << term << ") " << " Old Topic: " 
+          //  << current_topic << " New Topic: " << new_topic << "\n" << std::endl;
+
+          // add the new topic to the PYPs
+          m_corpus_topics[document_id][term_index] = new_topic;
+          increment(term, new_topic);
+
+          if (m_use_topic_pyp) {
+            F p0 = m_topic_pyp.prob(new_topic, m_topic_p0);
+            int table_delta = m_document_pyps[document_id].increment(new_topic, p0);
+            if (table_delta)
+              m_topic_pyp.increment(new_topic, m_topic_p0);
+          }
+          else m_document_pyps[document_id].increment(new_topic, m_topic_p0);
         }
-
-        // sample a new_topic
-        int new_topic = sample(document_id, term, temp);
-        //std::cerr << "TERM: " << dict->Convert(term) << " (" << term << ") " << " Old Topic: " 
-        //  << current_topic << " New Topic: " << new_topic << "\n" << std::endl;
-
-        // add the new topic to the PYPs
-        m_corpus_topics[document_id][term_index] = new_topic;
-        increment(term, new_topic);
-
-        if (m_use_topic_pyp) {
-          F p0 = m_topic_pyp.prob(new_topic, m_topic_p0);
-          int table_delta = m_document_pyps[document_id].increment(new_topic, p0);
-          if (table_delta)
-            m_topic_pyp.increment(new_topic, m_topic_p0);
+        if (document_id && document_id % 10000 == 0) {
+          std::cerr << "."; std::cerr.flush();
         }
-        else m_document_pyps[document_id].increment(new_topic, m_topic_p0);
-      }
-      if (document_id && document_id % 10000 == 0) {
-        std::cerr << "."; std::cerr.flush();
       }
     }
     std::cerr << " ||| LLH= " << log_likelihood();
@@ -239,6 +275,80 @@ void PYPTopics::sample_corpus(const Corpus& corpus, int samples,
   delete [] randomDocIndices;
 }
 
+PYPTopics::F PYPTopics::sample_documents(SamplerThread* t, const Corpus& corpus, int start, int end,
+                                          int frequency_cutoff, int max_contexts_per_document, F inv_temp)
+{
+  // only this thread touches the documents' restaurants; the model's
+  // topic-term restaurants are read to make this thread's copy of them and
+  // aren't updated until every thread is done
+  t->word_pyps = m_word_pyps;
+  int processed_terms=0;
+  for (int document_id=start; document_id < end; ++document_id) {
+    int term_index=0;
+    Document::const_iterator docEnd = corpus.at(document_id).end();
+    for (Document::const_iterator docIt=corpus.at(document_id).begin();
+         docIt != docEnd; ++docIt, ++term_index) {
+      if (max_contexts_per_document && term_index > max_contexts_per_document)
+        break;
+
+      Term term = *docIt;
+      if (corpus.context_count(term) < frequency_cutoff)
+        continue;
+      processed_terms++;
+
+      int current_topic = m_corpus_topics[document_id][term_index];
+      if (current_topic >= 0) {
+        decrement(t->word_pyps, term, current_topic, 0, t->rnd);
+        --t->term_deltas[current_topic][term];
+
+        int table_delta = m_document_pyps[document_id].decrement(current_topic, t->rnd);
+        if (m_use_topic_pyp && table_delta < 0) {
+          t->topic_pyp.decrement(current_topic, t->rnd);
+          --t->topic_deltas[current_topic];
+        }
+      }
+
+      int new_topic = sample(t->word_pyps, t->topic_pyp, document_id, term, inv_temp, t->rnd, &t->probs);
+      m_corpus_topics[document_id][term_index] = new_topic;
+      increment(t->word_pyps, term, new_topic, 0, t->rnd);
+      ++t->term_deltas[new_topic][term];
+
+      if (m_use_topic_pyp) {
+        F p0 = t->topic_pyp.prob(new_topic, m_topic_p0);
+        int table_delta = m_document_pyps[document_id].increment(new_topic, p0, t->rnd);
+        if (table_delta) {
+          t->topic_pyp.increment(new_topic, m_topic_p0, t->rnd);
+          ++t->topic_deltas[new_topic];
+        }
+      }
+      else m_document_pyps[document_id].increment(new_topic, m_topic_p0, t->rnd);
+    }
+  }
+  return processed_terms;
+}
+
+// replays a thread's moves on the model's restaurants, which keeps their
+// table counts consistent with their customers.  All the removals come
+// first, so no restaurant is asked for a customer it doesn't have
+void PYPTopics::merge(const SamplerThread& t)
+{
+  for (int pass=0; pass < 2; ++pass) {
+    for (int k=0; k < m_num_topics; ++k) {
+      for (std::map<Term,int>::const_iterator it=t.term_deltas[k].begin();
+           it != t.term_deltas[k].end(); ++it) {
+        if (pass == 0)
+          for (int i=0; i > it->second; --i) decrement(it->first, k);
+        else
+          for (int i=0; i < it->second; ++i) increment(it->first, k);
+      }
+      if (pass == 0)
+        for (int i=0; i > t.topic_deltas[k]; --i) m_topic_pyp.decrement(k);
+      else
+        for (int i=0; i < t.topic_deltas[k]; ++i) m_topic_pyp.increment(k, m_topic_p0);
+    }
+  }
+}
+
 PYPTopics::F PYPTopics::hresample_docs(int start, int end)
 {
   int resample_counter=0;
@@ -307,59 +417,88 @@ PYPTopics::F PYPTopics::log_likelihood() const
 }
 
 void PYPTopics::decrement(const Term& term, int topic, int level) {
+  GlobalUniform01 rnd;
+  decrement(m_word_pyps, term, topic, level, rnd);
+}
+
+template <typename Uniform01>
+void PYPTopics::decrement(std::vector<PYPs>& word_pyps, const Term& term, int topic, int level, Uniform01& rnd) {
   //std::cerr << "PYPTopics::decrement(" << term << "," << topic << "," << level << ")" << std::endl;
-  int table_delta = m_word_pyps.at(level).at(topic).decrement(term);
+  int table_delta = word_pyps.at(level).at(topic).decrement(term, rnd);
   if (table_delta && m_backoff.get()) {
     Term backoff_term = (*m_backoff)[term];
     if (!m_backoff->is_null(backoff_term))
-      decrement(backoff_term, topic, level+1);
+      decrement(word_pyps, backoff_term, topic, level+1, rnd);
   }
 }
 
 void PYPTopics::increment(const Term& term, int topic, int level) {
+  GlobalUniform01 rnd;
+  increment(m_word_pyps, term, topic, level, rnd);
+}
+
+template <typename Uniform01>
+void PYPTopics::increment(std::vector<PYPs>& word_pyps, const Term& term, int topic, int level, Uniform01& rnd) {
   //std::cerr << "PYPTopics::increment(" << term << "," << topic << "," << level << ")" << std::endl;
-  int table_delta = m_word_pyps.at(level).at(topic).increment(term, word_pyps_p0(term, topic, level));
+  int table_delta = word_pyps.at(level).at(topic).increment(term, word_pyps_p0(word_pyps, term, topic, level), rnd);
 
   if (table_delta && m_backoff.get()) {
     Term backoff_term = (*m_backoff)[term];
     if (!m_backoff->is_null(backoff_term))
-      increment(backoff_term, topic, level+1);
+      increment(word_pyps, backoff_term, topic, level+1, rnd);
   }
 }
 
 int PYPTopics::sample(const DocumentId& doc, const Term& term, F inv_temp) {
-  // First pass: collect probs
+  return sample(m_word_pyps, m_topic_pyp, doc, term, inv_temp, rnd, &m_probs);
+}
+
+template <typename Uniform01>
+int PYPTopics::sample(const std::vector<PYPs>& word_pyps, const PYP<int>& topic_pyp,
+                      const DocumentId& doc, const Term& term, F inv_temp, Uniform01& rnd,
+                      std::vector<F>* probs) const {
+  // p(term|k) for all the topics, then the running sums of the scores
+  std::vector<F>& sums = *probs;
+  sums.resize(m_num_topics);
+  term_probs(word_pyps, term, 0, &sums[0]);
+
+  const PYP<int>& doc_pyp = m_document_pyps[doc];
   F sum=0.0;
-  std::vector<F> sums;
   for (int k=0; k<m_num_topics; ++k) {
-    F p_w_k = prob(term, k);
-
     F topic_prob = m_topic_p0;
-    if (m_use_topic_pyp) topic_prob = m_topic_pyp.prob(k, m_topic_p0);
-
-    //F p_k_d = m_document_pyps[doc].prob(k, topic_prob);
-    F p_k_d = m_document_pyps[doc].unnormalised_prob(k, topic_prob);
+    if (m_use_topic_pyp) topic_prob = topic_pyp.prob(k, m_topic_p0);
 
-    F prob = p_w_k*p_k_d;
-    /*
-    if (prob < 0.0) { std::cerr << "\n\n" << prob << " " << p_w_k << " " << p_k_d << std::endl; assert(false); }
-    if (prob > 1.0) { std::cerr << "\n\n" << prob << " " << p_w_k << " " << p_k_d << std::endl; assert(false); }
-    assert (pow(prob, inv_temp) >= 0.0);
-    assert (pow(prob, inv_temp) <= 1.0);
-    */
-    sum += pow(prob, inv_temp);
-    sums.push_back(sum);
+    F prob = sums[k]*doc_pyp.unnormalised_prob(k, topic_prob);
+    sum += (inv_temp == 1.0 ? prob : pow(prob, inv_temp));
+    sums[k] = sum;
   }
-  // Second pass: sample a topic
+  // sample a topic
   F cutoff = rnd() * sum;
-  for (int k=0; k<m_num_topics; ++k) {
-    if (cutoff <= sums[k])
-      return k;
+  int k = std::lower_bound(sums.begin(), sums.end(), cutoff) - sums.begin();
+  assert(k < m_num_topics);
+  return k;
+}
+
+void PYPTopics::term_probs(const std::vector<PYPs>& word_pyps, const Term& term, int level, F* probs) const {
+  // the same sums as prob(word_pyps, term, k, level) for each k, but one
+  // level at a time: each level's probabilities are the next level's p0s
+  const PYPs& pyps = word_pyps.at(level);
+  if (m_backoff.get()) {
+    Term backoff_term = (*m_backoff)[term];
+    if (!m_backoff->is_null(backoff_term)) {
+      assert (level < m_backoff->order());
+      term_probs(word_pyps, backoff_term, level+1, probs);
+      for (int k=0; k<m_num_topics; ++k)
+        probs[k] = pyps[k].prob(term, probs[k]);
+      return;
+    }
   }
-  assert(false);
+  F p0 = (m_backoff.get() ? 1.0/(F) m_backoff->terms_at_level(level) : m_term_p0);
+  for (int k=0; k<m_num_topics; ++k)
+    probs[k] = pyps[k].prob(term, p0);
 }
 
-PYPTopics::F PYPTopics::word_pyps_p0(const Term& term, int topic, int level) const {
+PYPTopics::F PYPTopics::word_pyps_p0(const std::vector<PYPs>& word_pyps, const Term& term, int topic, int level) const {
   //for (int i=0; i<level+1; ++i) std::cerr << "  ";
   //std::cerr << "PYPTopics::word_pyps_p0(" << term << "," << topic << "," << level << ")" << std::endl;
 
@@ -372,8 +511,7 @@ PYPTopics::F PYPTopics::word_pyps_p0(const Term& term, int topic, int level) con
     if (!m_backoff->is_null(backoff_term)) {
       assert (level < m_backoff->order());
       //p0 = (1.0/(F)m_backoff->terms_at_level(level))*prob(backoff_term, topic, level+1);
-      p0 = m_term_p0*prob(backoff_term, topic, level+1);
-      p0 = prob(backoff_term, topic, level+1);
+      p0 = prob(word_pyps, backoff_term, topic, level+1);
     }
     else
       p0 = (1.0/(F) m_backoff->terms_at_level(level));
@@ -385,11 +523,15 @@ PYPTopics::F PYPTopics::word_pyps_p0(const Term& term, int topic, int level) con
 }
 
 PYPTopics::F PYPTopics::prob(const Term& term, int topic, int level) const {
+  return prob(m_word_pyps, term, topic, level);
+}
+
+PYPTopics::F PYPTopics::prob(const std::vector<PYPs>& word_pyps, const Term& term, int topic, int level) const {
   //for (int i=0; i<level+1; ++i) std::cerr << "  ";
   //std::cerr << "PYPTopics::prob(" << dict->Convert(term) << "," << topic << "," << level << ")" << std::endl;
 
-  F p0 = word_pyps_p0(term, topic, level);
-  F p_w_k = m_word_pyps.at(level).at(topic).prob(term, p0);
+  F p0 = word_pyps_p0(word_pyps, term, topic, level);
+  F p_w_k = word_pyps.at(level).at(topic).prob(term, p0);
 
   /*
   for (int i=0; i<level+1; ++i) std::cerr << "  ";
@@ -26,7 +26,8 @@ public:
     m_topic_pyp(0.5,1.0,seed), m_use_topic_pyp(use_topic_pyp),
     m_seed(seed),
     uni_dist(0,1), rng(seed == 0 ? (unsigned long)this : seed), 
-    rnd(rng, uni_dist), max_threads(max_threads), num_jobs(num_jobs) {}
+    rnd(rng, uni_dist), max_threads(max_threads), num_jobs(num_jobs),
+    m_parallel_sampling(false) {}
 
   void sample_corpus(const Corpus& corpus, int samples,
                      int freq_cutoff_start=0, int freq_cutoff_end=0, 
@@ -51,7 +52,16 @@ public:
     m_word_pyps.resize(m_backoff->order(), PYPs());
   }
 
+  // sample the documents on max_threads threads, each against its own copy
+  // of the topic-term restaurants; the copies' changes are merged into the
+  // model after every pass (approximate distributed Gibbs sampling)
+  void set_parallel_sampling(bool parallel) { m_parallel_sampling = parallel; }
+
   F prob(const Term& term, int topic, int level=0) const;
+  // the prior probability of topic k, the topic p0 of a new document
+  F topic_prob(int k) const {
+    return m_use_topic_pyp ? F(m_topic_pyp.prob(k, m_topic_p0)) : m_topic_p0;
+  }
   void decrement(const Term& term, int topic, int level=0);
   void increment(const Term& term, int topic, int level=0);
 
@@ -60,16 +70,40 @@ public:
   std::ostream& print_document_topics(std::ostream& out) const;
   std::ostream& print_topic_terms(std::ostream& out) const;
 
+  // the topic-term restaurants, for writing a TopicModel
+  int num_topics() const { return m_num_topics; }
+  int num_levels() const { return m_word_pyps.size(); }
+  const PYP<int>& word_pyp(int level, int topic) const { return m_word_pyps.at(level).at(topic); }
+
 private:
-  F word_pyps_p0(const Term& term, int topic, int level) const;
+  typedef boost::ptr_vector< PYP<int> > PYPs;
+  struct SamplerThread;
+
+  F word_pyps_p0(const std::vector<PYPs>& word_pyps, const Term& term, int topic, int level) const;
+  F prob(const std::vector<PYPs>& word_pyps, const Term& term, int topic, int level) const;
+  // prob(word_pyps, term, k, level) for every topic k
+  void term_probs(const std::vector<PYPs>& word_pyps, const Term& term, int level, F* probs) const;
+  template <typename Uniform01>
+    void decrement(std::vector<PYPs>& word_pyps, const Term& term, int topic, int level, Uniform01& rnd);
+  template <typename Uniform01>
+    void increment(std::vector<PYPs>& word_pyps, const Term& term, int topic, int level, Uniform01& rnd);
+  template <typename Uniform01>
+    int sample(const std::vector<PYPs>& word_pyps, const PYP<int>& topic_pyp,
+               const DocumentId& doc, const Term& term, F inv_temp, Uniform01& rnd,
+               std::vector<F>* probs) const;
+
+  // one pass over the documents in [start, end), returns the number of terms sampled
+  F sample_documents(SamplerThread* t, const Corpus& corpus, int start, int end,
+                     int frequency_cutoff, int max_contexts_per_document, F inv_temp);
+  void merge(const SamplerThread& t);
 
   int m_num_topics;
   F m_term_p0, m_topic_p0, m_backoff_p0;
 
   CorpusTopics m_corpus_topics;
-  typedef boost::ptr_vector< PYP<int> > PYPs;
   PYPs m_document_pyps;
   std::vector<PYPs> m_word_pyps;
+  std::vector<F> m_probs; // scratch for sample
   PYP<int> m_topic_pyp;
   bool m_use_topic_pyp;
 
@@ -92,6 +126,7 @@ private:
   
   int max_threads;
   int num_jobs;
+  bool m_parallel_sampling;
   TermBackoffPtr m_backoff;
 };
 
@@ -3,9 +3,10 @@
 
 #include "slice-sampler.h"
 #include <math.h>
-#include <map>
-#include <tr1/unordered_map>
-//#include <google/sparse_hash_map>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <tr1/functional>
 
 #include <boost/random/uniform_real.hpp>
 #include <boost/random/variate_generator.hpp>
@@ -14,28 +15,157 @@
 #include "log_add.h"
 #include "mt19937ar.h"
 
+//
+// The tables of one dish, as (customers at a table, number of such tables)
+// pairs in a short array sorted by customers.  Nearly every dish has only a
+// few distinct table sizes, so this is one small allocation where a
+// std::map was a tree node per size.
+//
+class TableHistogram {
+public:
+  typedef std::vector< std::pair<int,int> >::const_iterator const_iterator;
+
+  const_iterator begin() const { return _h.begin(); }
+  const_iterator end() const { return _h.end(); }
+  bool empty() const { return _h.empty(); }
+  int size() const { return _h.size(); }
+
+  // adds n (which may be negative) tables of c customers; a size left with
+  // no tables is removed
+  void add(int c, int n) {
+    std::vector< std::pair<int,int> >::iterator it
+      = std::lower_bound(_h.begin(), _h.end(), std::make_pair(c, (int) -0x7fffffff));
+    if (it != _h.end() && it->first == c) {
+      it->second += n;
+      if (it->second == 0) _h.erase(it);
+    }
+    else if (n != 0)
+      _h.insert(it, std::make_pair(c, n));
+  }
+
+  template<class Archive>
+  void serialize(Archive& ar, const unsigned int version) { ar & _h; }
+
+private:
+  std::vector< std::pair<int,int> > _h;
+};
+
+//
+// Maps each dish of a restaurant to its position in the restaurant's dish
+// array.  Open addressing with linear probing over one flat array of
+// (dish, position) cells, so a lookup touches a cell or two of contiguous
+// memory; Hash's value is scrambled by a multiplicative hash, which spreads
+// the runs of consecutive ids that integer dishes come in.
+//
+template <typename Dish, typename Hash>
+class DishIndex {
+public:
+  DishIndex(Hash hash=Hash()) : _hash(hash), _bits(0), _size(0) {}
+
+  // the position of d, or -1
+  int find(const Dish& d) const {
+    if (_cells.empty()) return -1;
+    for (size_t i = bucket(d);; i = (i + 1) & mask()) {
+      const Cell& c = _cells[i];
+      if (c.second < 0) return -1;
+      if (c.first == d) return c.second;
+    }
+  }
+
+  // inserts d, or moves it to pos if it is already there
+  void set(const Dish& d, int pos) {
+    if (2 * (_size + 1) > _cells.size()) grow();
+    for (size_t i = bucket(d);; i = (i + 1) & mask()) {
+      Cell& c = _cells[i];
+      if (c.second < 0) { c.first = d; c.second = pos; ++_size; return; }
+      if (c.first == d) { c.second = pos; return; }
+    }
+  }
+
+  // removes d, which must be there, closing the gap it leaves in its run of
+  // cells so that find never needs tombstones
+  void erase(const Dish& d) {
+    size_t i = bucket(d);
+    while (!(_cells[i].first == d && _cells[i].second >= 0)) {
+      assert(_cells[i].second >= 0);
+      i = (i + 1) & mask();
+    }
+    for (size_t j = (i + 1) & mask(); _cells[j].second >= 0; j = (j + 1) & mask()) {
+      // the cell at j can fill the gap at i unless its bucket lies in (i, j]
+      const size_t k = bucket(_cells[j].first);
+      if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+      _cells[i] = _cells[j];
+      i = j;
+    }
+    _cells[i].second = -1;
+    --_size;
+  }
+
+  void clear() { _cells.clear(); _bits = 0; _size = 0; }
+
+private:
+  typedef std::pair<Dish, int> Cell; // a position < 0 marks an empty cell
+
+  size_t mask() const { return _cells.size() - 1; }
+  size_t bucket(const Dish& d) const {
+    return (static_cast<unsigned>(_hash(d)) * 2654435769U) >> (32 - _bits);
+  }
+  void grow() {
+    std::vector<Cell> old;
+    old.swap(_cells);
+    _bits = (_bits ? _bits + 1 : 3);
+    _cells.resize(size_t(1) << _bits, Cell(Dish(), -1));
+    _size = 0;
+    for (typename std::vector<Cell>::const_iterator it = old.begin(); it != old.end(); ++it)
+      if (it->second >= 0) set(it->first, it->second);
+  }
+
+  Hash _hash;
+  std::vector<Cell> _cells;
+  int _bits;
+  size_t _size;
+};
+
 //
 // Pitman-Yor process with customer and table tracking
 //
+// The dishes are kept in one array, each with its customer count and table
+// histogram, and a DishIndex finds a dish's entry; the counts a prob,
+// increment or decrement needs are all in that entry, so each costs a single
+// lookup.
+//
 
 template <typename Dish, typename Hash=std::tr1::hash<Dish> >
-class PYP : protected std::tr1::unordered_map<Dish, int, Hash>
-//class PYP : protected google::sparse_hash_map<Dish, int, Hash>
+class PYP
 {
+protected:
+  struct TableCounter {
+    TableCounter() : tables(0) {};
+    int tables;
+    TableHistogram table_histogram; // num customers at table -> number tables
+  };
+
 public:
-  using std::tr1::unordered_map<Dish,int>::const_iterator;
-  using std::tr1::unordered_map<Dish,int>::iterator;
-  using std::tr1::unordered_map<Dish,int>::begin;
-  using std::tr1::unordered_map<Dish,int>::end;
-//  using google::sparse_hash_map<Dish,int>::const_iterator;
-//  using google::sparse_hash_map<Dish,int>::iterator;
-//  using google::sparse_hash_map<Dish,int>::begin;
-//  using google::sparse_hash_map<Dish,int>::end;
+  // a dish (first), its number of customers (second) and its tables
+  struct DishEntry : public std::pair<Dish, int> {
+    DishEntry(const Dish& d) : std::pair<Dish, int>(d, 0) {}
+    TableCounter tc;
+  };
+  typedef typename std::vector<DishEntry>::const_iterator const_iterator;
+  typedef const_iterator iterator;
+  const_iterator begin() const { return _dishes.begin(); }
+  const_iterator end() const { return _dishes.end(); }
 
   PYP(double a, double b, unsigned long seed = 0, Hash hash=Hash());
 
   virtual int increment(Dish d, double p0);
   virtual int decrement(Dish d);
+  // as above, but seating draws from rnd instead of the global mt19937ar
+  // generator, so restaurants can be updated on several threads at once
+  template <typename Uniform01>
+    int increment(Dish d, double p0, Uniform01& rnd);
+  template <typename Uniform01>
+    int decrement(Dish d, Uniform01& rnd);
 
   // lookup functions
   int count(Dish d) const;
@@ -45,8 +175,7 @@ public:
   double unnormalised_prob(Dish dish, double p0) const;
 
   int num_customers() const { return _total_customers; }
-  int num_types() const { return std::tr1::unordered_map<Dish,int>::size(); }
-  //int num_types() const { return google::sparse_hash_map<Dish,int>::size(); }
+  int num_types() const { return _dishes.size(); }
   bool empty() const { return _total_customers == 0; }
 
   double log_prob(Dish dish, double log_p0) const;
@@ -83,16 +212,41 @@ protected:
   double _a_beta_a, _a_beta_b; // parameters of Beta prior on a
   double _b_gamma_s, _b_gamma_c; // parameters of Gamma prior on b
 
-  struct TableCounter {
-    TableCounter() : tables(0) {};
-    int tables;
-    std::map<int, int> table_histogram; // num customers at table -> number tables
-  };
-  typedef std::tr1::unordered_map<Dish, TableCounter, Hash> DishTableType;
-  //typedef google::sparse_hash_map<Dish, TableCounter, Hash> DishTableType;
-  DishTableType _dish_tables;
+  typedef std::vector<DishEntry> DishTableType;
+  DishTableType _dishes;
+  DishIndex<Dish, Hash> _index;
   int _total_customers, _total_tables;
 
+  // the entry of dish, or NULL
+  const DishEntry* find_dish(const Dish& dish) const {
+    const int i = _index.find(dish);
+    return i < 0 ? 0 : &_dishes[i];
+  }
+  // the entry of dish, added with no customers if it isn't there
+  DishEntry& dish_entry(const Dish& dish) {
+    int i = _index.find(dish);
+    if (i < 0) {
+      i = _dishes.size();
+      _dishes.push_back(DishEntry(dish));
+      _index.set(dish, i);
+    }
+    return _dishes[i];
+  }
+  // removes the i'th entry by moving the last one into its place
+  void erase_dish(int i) {
+    _index.erase(_dishes[i].first);
+    if (i + 1 != (int) _dishes.size()) {
+      std::swap(_dishes[i], _dishes.back());
+      _index.set(_dishes[i].first, i);
+    }
+    _dishes.pop_back();
+  }
+
+  // decrement, also giving the number of customers the table the customer
+  // left had before
+  template <typename Uniform01>
+    int decrement(Dish d, Uniform01& rnd, int* table_left);
+
   typedef boost::mt19937 base_generator_type;
   typedef boost::uniform_real<> uni_dist_type;
   typedef boost::variate_generator<base_generator_type&, uni_dist_type> gen_type;
@@ -116,8 +270,8 @@ protected:
       double log_prob = 0.0;
       double lgamma1a = lgamma(1.0 - proposed_a);
       for (typename DishTableType::const_iterator dish_it=dish_tables.begin(); dish_it != dish_tables.end(); ++dish_it) 
-        for (std::map<int, int>::const_iterator table_it=dish_it->second.table_histogram.begin(); 
-             table_it !=dish_it->second.table_histogram.end(); ++table_it) 
+        for (TableHistogram::const_iterator table_it=dish_it->tc.table_histogram.begin(); 
+             table_it !=dish_it->tc.table_histogram.end(); ++table_it) 
           log_prob += (table_it->second * (lgamma(table_it->first - proposed_a) - lgamma1a));
 
       log_prob += (proposed_a == 0.0 ? (m-1.0)*log(b) 
@@ -155,12 +309,11 @@ protected:
 };
 
 template <typename Dish, typename Hash>
-PYP<Dish,Hash>::PYP(double a, double b, unsigned long seed, Hash)
-: std::tr1::unordered_map<Dish, int, Hash>(10), _a(a), _b(b), 
-//: google::sparse_hash_map<Dish, int, Hash>(10), _a(a), _b(b), 
+PYP<Dish,Hash>::PYP(double a, double b, unsigned long seed, Hash hash)
+: _a(a), _b(b), 
   _a_beta_a(1), _a_beta_b(1), _b_gamma_s(1), _b_gamma_c(1),
   //_a_beta_a(1), _a_beta_b(1), _b_gamma_s(10), _b_gamma_c(0.1),
-  _total_customers(0), _total_tables(0)//,
+  _index(hash), _total_customers(0), _total_tables(0)//,
   //uni_dist(0,1), rng(seed == 0 ? (unsigned long)this : seed), rnd(rng, uni_dist)
 {
 //  std::cerr << "\t##PYP<Dish,Hash>::PYP(a=" << _a << ",b=" << _b << ")" << std::endl;
@@ -171,7 +324,8 @@ template <typename Dish, typename Hash>
 double 
 PYP<Dish,Hash>::prob(Dish dish, double p0) const
 {
-  int c = count(dish), t = num_tables(dish);
+  const DishEntry* de = find_dish(dish);
+  int c = de ? de->second : 0, t = de ? de->tc.tables : 0;
   double r = num_tables() * _a + _b;
   //std::cerr << "\t\t\t\tPYP<Dish,Hash>::prob(" << dish << "," << p0 << ") c=" << c << " r=" << r << std::endl;
   if (c > 0)
@@ -184,7 +338,8 @@ template <typename Dish, typename Hash>
 double 
 PYP<Dish,Hash>::unnormalised_prob(Dish dish, double p0) const
 {
-  int c = count(dish), t = num_tables(dish);
+  const DishEntry* de = find_dish(dish);
+  int c = de ? de->second : 0, t = de ? de->tc.tables : 0;
   double r = num_tables() * _a + _b;
   if (c > 0) return (c - _a * t + r * p0);
   else       return r * p0;
@@ -234,41 +389,52 @@ const
     return r + log_p0 - log(num_customers() + dca + b);
 }
 
+namespace {
+struct GlobalUniform01 {
+  double operator()() const { return mt_genrand_res53(); }
+};
+}
+
 template <typename Dish, typename Hash>
 int 
 PYP<Dish,Hash>::increment(Dish dish, double p0) {
+  GlobalUniform01 rnd;
+  return increment(dish, p0, rnd);
+}
+
+template <typename Dish, typename Hash>
+  template <typename Uniform01>
+int 
+PYP<Dish,Hash>::increment(Dish dish, double p0, Uniform01& rnd) {
   int delta = 0;
-  TableCounter &tc = _dish_tables[dish];
+  DishEntry &de = dish_entry(dish);
+  TableCounter &tc = de.tc;
 
   // seated on a new or existing table?
-  int c = count(dish), t = num_tables(dish), T = num_tables();
+  int c = de.second, t = tc.tables, T = num_tables();
   double pshare = (c > 0) ? (c - _a*t) : 0.0;
   double pnew = (_b + _a*T) * p0;
   assert (pshare >= 0.0);
   //assert (pnew > 0.0);
 
-  //if (rnd() < pnew / (pshare + pnew)) {
-  if (mt_genrand_res53() < pnew / (pshare + pnew)) {
+  if (rnd() < pnew / (pshare + pnew)) {
     // assign to a new table
     tc.tables += 1;
-    tc.table_histogram[1] += 1;
+    tc.table_histogram.add(1, 1);
     _total_tables += 1;
     delta = 1;
   }
   else {
     // randomly assign to an existing table
     // remove constant denominator from inner loop
-    //double r = rnd() * (c - _a*t);
-    double r = mt_genrand_res53() * (c - _a*t);
-    for (std::map<int,int>::iterator
+    double r = rnd() * (c - _a*t);
+    int joined = 0;
+    for (TableHistogram::const_iterator
          hit = tc.table_histogram.begin();
          hit != tc.table_histogram.end(); ++hit) {
       r -= ((hit->first - _a) * hit->second);
       if (r <= 0) {
-        tc.table_histogram[hit->first+1] += 1;
-        hit->second -= 1;
-        if (hit->second == 0)
-          tc.table_histogram.erase(hit);
+        joined = hit->first;
         break;
       }
     }
@@ -276,11 +442,12 @@ PYP<Dish,Hash>::increment(Dish dish, double p0) {
       std::cerr << r << " " << c << " " << _a << " " << t << std::endl;
       assert(false);
     }
+    tc.table_histogram.add(joined+1, 1);
+    tc.table_histogram.add(joined, -1);
     delta = 0;
   }
 
-  std::tr1::unordered_map<Dish,int,Hash>::operator[](dish) += 1;
-  //google::sparse_hash_map<Dish,int,Hash>::operator[](dish) += 1;
+  de.second += 1;
   _total_customers += 1;
 
   return delta;
@@ -290,61 +457,51 @@ template <typename Dish, typename Hash>
 int 
 PYP<Dish,Hash>::count(Dish dish) const
 {
-  typename std::tr1::unordered_map<Dish, int>::const_iterator 
-  //typename google::sparse_hash_map<Dish, int>::const_iterator 
-    dcit = find(dish);
-  if (dcit != end())
-    return dcit->second;
-  else
-    return 0;
+  const DishEntry* de = find_dish(dish);
+  return de ? de->second : 0;
 }
 
 template <typename Dish, typename Hash>
 int 
 PYP<Dish,Hash>::decrement(Dish dish)
 {
-  typename std::tr1::unordered_map<Dish, int>::iterator dcit = find(dish);
-  //typename google::sparse_hash_map<Dish, int>::iterator dcit = find(dish);
-  if (dcit == end()) {
-    std::cerr << dish << std::endl;
-    assert(false);
-  } 
+  GlobalUniform01 rnd;
+  return decrement(dish, rnd);
+}
 
-  int delta = 0;
+template <typename Dish, typename Hash>
+  template <typename Uniform01>
+int 
+PYP<Dish,Hash>::decrement(Dish dish, Uniform01& rnd)
+{
+  return decrement(dish, rnd, (int*) 0);
+}
 
-  typename std::tr1::unordered_map<Dish, TableCounter>::iterator dtit = _dish_tables.find(dish);
-  //typename google::sparse_hash_map<Dish, TableCounter>::iterator dtit = _dish_tables.find(dish);
-  if (dtit == _dish_tables.end()) {
+template <typename Dish, typename Hash>
+  template <typename Uniform01>
+int 
+PYP<Dish,Hash>::decrement(Dish dish, Uniform01& rnd, int* table_left)
+{
+  const int i = _index.find(dish);
+  if (i < 0) {
     std::cerr << dish << std::endl;
     assert(false);
   } 
-  TableCounter &tc = dtit->second;
 
-  //std::cerr << "\tdecrement for " << dish << "\n";
-  //std::cerr << "\tBEFORE histogram: " << tc.table_histogram << " ";
-  //std::cerr << "count: " << count(dish) << " ";
-  //std::cerr << "tables: " << tc.tables << "\n";
+  int delta = 0;
+  DishEntry &de = _dishes[i];
+  TableCounter &tc = de.tc;
 
-  //double r = rnd() * count(dish);
-  double r = mt_genrand_res53() * count(dish);
-  for (std::map<int,int>::iterator hit = tc.table_histogram.begin();
+  double r = rnd() * de.second;
+  int left = 0;
+  for (TableHistogram::const_iterator hit = tc.table_histogram.begin();
        hit != tc.table_histogram.end(); ++hit)
   {
     //r -= (hit->first - _a) * hit->second;
     r -= (hit->first) * hit->second;
     if (r <= 0)
     {
-      if (hit->first > 1)
-        tc.table_histogram[hit->first-1] += 1;
-      else
-      {
-        delta = -1;
-        tc.tables -= 1;
-        _total_tables -= 1;
-      }
-
-      hit->second -= 1;
-      if (hit->second == 0) tc.table_histogram.erase(hit);
+      left = hit->first;
       break;
     }
   }
@@ -352,21 +509,23 @@ PYP<Dish,Hash>::decrement(Dish dish)
     std::cerr << r << " " << count(dish) << " " << _a << " " << num_tables(dish) << std::endl;
     assert(false);
   }
+  if (left > 1)
+    tc.table_histogram.add(left-1, 1);
+  else
+  {
+    delta = -1;
+    tc.tables -= 1;
+    _total_tables -= 1;
+  }
+  tc.table_histogram.add(left, -1);
+  if (table_left) *table_left = left;
 
   // remove the customer
-  dcit->second -= 1;
+  de.second -= 1;
   _total_customers -= 1;
-  assert(dcit->second >= 0);
-  if (dcit->second == 0) {
-    erase(dcit);
-    _dish_tables.erase(dtit);
-    //std::cerr << "\tAFTER histogram: Empty\n";
-  }
-  else {
-    //std::cerr << "\tAFTER histogram: " << _dish_tables[dish].table_histogram << " ";
-    //std::cerr << "count: " << count(dish) << " ";
-    //std::cerr << "tables: " << _dish_tables[dish].tables << "\n";
-  }
+  assert(de.second >= 0);
+  if (de.second == 0)
+    erase_dish(i);
 
   return delta;
 }
@@ -375,15 +534,8 @@ template <typename Dish, typename Hash>
 int 
 PYP<Dish,Hash>::num_tables(Dish dish) const
 {
-  typename std::tr1::unordered_map<Dish, TableCounter, Hash>::const_iterator 
-  //typename google::sparse_hash_map<Dish, TableCounter, Hash>::const_iterator 
-    dtit = _dish_tables.find(dish);
-
-  //assert(dtit != _dish_tables.end());
-  if (dtit == _dish_tables.end())
-    return 0;
-
-  return dtit->second.tables;
+  const DishEntry* de = find_dish(dish);
+  return de ? de->tc.tables : 0;
 }
 
 template <typename Dish, typename Hash>
@@ -398,22 +550,22 @@ std::ostream&
 PYP<Dish,Hash>::debug_info(std::ostream& os) const
 {
   int hists = 0, tables = 0;
-  for (typename std::tr1::unordered_map<Dish, TableCounter, Hash>::const_iterator 
-  //for (typename google::sparse_hash_map<Dish, TableCounter, Hash>::const_iterator 
-       dtit = _dish_tables.begin(); dtit != _dish_tables.end(); ++dtit)
+  for (typename DishTableType::const_iterator 
+       dtit = _dishes.begin(); dtit != _dishes.end(); ++dtit)
   {
-    hists += dtit->second.table_histogram.size();
-    tables += dtit->second.tables;
+    hists += dtit->tc.table_histogram.size();
+    tables += dtit->tc.tables;
 
-//    if (dtit->second.tables <= 0)
+//    if (dtit->tc.tables <= 0)
 //      std::cerr << dtit->first << " " << count(dtit->first) << std::endl;
-    assert(dtit->second.tables > 0);
-    assert(!dtit->second.table_histogram.empty());
-
-//    os << "Dish " << dtit->first << " has " << count(dtit->first) << " customers, and is sitting at " << dtit->second.tables << " tables.\n"; 
-    for (std::map<int,int>::const_iterator 
-         hit = dtit->second.table_histogram.begin();
-         hit != dtit->second.table_histogram.end(); ++hit) {
+    assert(dtit->tc.tables > 0);
+    assert(!dtit->tc.table_histogram.empty());
+    assert(_index.find(dtit->first) == dtit - _dishes.begin());
+
+//    os << "Dish " << dtit->first << " has " << count(dtit->first) << " customers, and is sitting at " << dtit->tc.tables << " tables.\n"; 
+    for (TableHistogram::const_iterator 
+         hit = dtit->tc.table_histogram.begin();
+         hit != dtit->tc.table_histogram.end(); ++hit) {
 //      os << "    " << hit->second << " tables with " << hit->first << " customers." << std::endl; 
       assert(hit->second > 0);
     }
@@ -423,8 +575,7 @@ PYP<Dish,Hash>::debug_info(std::ostream& os) const
     << _total_customers << " customers; "
     << _total_tables << " tables; " 
     << tables << " tables'; " 
-    << num_types() << " dishes; "
-    << _dish_tables.size() << " dishes'; and "
+    << num_types() << " dishes; and "
     << hists << " histogram entries\n";
 
   return os;
@@ -434,9 +585,8 @@ template <typename Dish, typename Hash>
 void 
 PYP<Dish,Hash>::clear()
 {
-  this->std::tr1::unordered_map<Dish,int,Hash>::clear();
-  //this->google::sparse_hash_map<Dish,int,Hash>::clear();
-  _dish_tables.clear();
+  _dishes.clear();
+  _index.clear();
   _total_tables = _total_customers = 0;
 }
 
@@ -452,10 +602,10 @@ PYP<Dish,Hash>::log_restaurant_prob() const {
   double lgamma1a = lgamma(1.0-_a);
 
   //std::cerr << "-------------------\n" << std::endl;
-  for (typename DishTableType::const_iterator dish_it=_dish_tables.begin(); 
-       dish_it != _dish_tables.end(); ++dish_it) {
-    for (std::map<int, int>::const_iterator table_it=dish_it->second.table_histogram.begin(); 
-         table_it !=dish_it->second.table_histogram.end(); ++table_it) {
+  for (typename DishTableType::const_iterator dish_it=_dishes.begin(); 
+       dish_it != _dishes.end(); ++dish_it) {
+    for (TableHistogram::const_iterator table_it=dish_it->tc.table_histogram.begin(); 
+         table_it !=dish_it->tc.table_histogram.end(); ++table_it) {
       log_prob += (table_it->second * (lgamma(table_it->first - _a) - lgamma1a));
       //std::cerr << "|" << dish_it->first->parent << " --> " << dish_it->first->rhs << " " << table_it->first << " " << table_it->second << " " << log_prob;
     }
@@ -557,7 +707,7 @@ PYP<Dish,Hash>::resample_prior_a(Uniform01& rnd) {
   //int niterations = 10;
   int niterations = 5;
   //std::cerr << "\n## Initial a = " << _a << ", b = " << _b << std::endl;
-  resample_a_type a_log_prob(_total_customers, _total_tables, _b, _a_beta_a, _a_beta_b, _dish_tables);
+  resample_a_type a_log_prob(_total_customers, _total_tables, _b, _a_beta_a, _a_beta_b, _dishes);
   _a = slice_sampler1d(a_log_prob, _a, rnd, std::numeric_limits<double>::min(), 
   //_a = slice_sampler1d(a_log_prob, _a, mt_genrand_res53, std::numeric_limits<double>::min(), 
                        (double) 1.0, (double) 0.0, niterations, 100*niterations);
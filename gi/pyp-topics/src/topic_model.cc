@@ -0,0 +1,260 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "topic_model.hh"
+#include "binary_format.hh"
+#include "pyp-topics.hh"
+#include "contexts_corpus.hh"
+
+using namespace std;
+using binary_format::append;
+using binary_format::pad;
+
+//////////////////////////////////////////////////
+// binary model format
+//////////////////////////////////////////////////
+
+static const char kTM_MAGIC[8] = { 'p', 'y', 'p', 'M', 'O', 'D', 'E', 'L' };
+static const uint32_t kTM_VERSION = 1;
+static const uint32_t kTM_BYTE_ORDER = 0x01020304;
+
+// sections as in binary_format.hh
+struct TopicModel::Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t num_topics;
+  uint32_t num_levels;
+  uint32_t dict_size;        // ids 1..dict_size
+  uint32_t backoff_size;
+  uint64_t num_entries;
+  // byte offsets from the start of the file
+  uint64_t levels_off;       // int32_t terms_at_level[num_levels]
+  uint64_t backoff_off;      // int32_t backoff[backoff_size]
+  uint64_t topic_probs_off;  // double topic_prob[num_topics]
+  uint64_t restaurants_off;  // Restaurant [num_levels * num_topics], by level
+  uint64_t term_offsets_off; // uint64_t [num_levels * (dict_size + 2)]: the
+                             // entries of term t at level l are
+                             // [off[l*(dict_size+2)+t], off[l*(dict_size+2)+t+1])
+  uint64_t entries_off;      // Entry [num_entries], by level, term, topic
+  uint64_t dict_off;         // dict_size strings
+  uint64_t file_size;
+};
+
+struct TopicModel::Restaurant {
+  double a, b, customers, tables;
+};
+
+struct TopicModel::Entry {
+  int32_t topic, customers, tables;
+};
+
+namespace {
+  void fail(const string& file, const string& msg) {
+    cerr << "Bad topic model " << file << ": " << msg << endl;
+    abort();
+  }
+
+  struct TermEntry {
+    Term term;
+    int32_t topic, customers, tables;
+    bool operator<(const TermEntry& o) const {
+      return term < o.term || (term == o.term && topic < o.topic);
+    }
+  };
+}
+
+//////////////////////////////////////////////////
+// TopicModel
+//////////////////////////////////////////////////
+
+TopicModel::~TopicModel() {
+  if (m_data) munmap(m_data, m_size);
+}
+
+bool TopicModel::write(const string &filename, const PYPTopics& model,
+                       const ContextsCorpus& corpus) {
+  ofstream out(filename.c_str(), ios::binary);
+  if (!out) {
+    cerr << "Can't write " << filename << endl;
+    return false;
+  }
+  const TermBackoff& backoff = *corpus.backoff_index();
+  Header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, kTM_MAGIC, sizeof(kTM_MAGIC));
+  h.version = kTM_VERSION;
+  h.byte_order = kTM_BYTE_ORDER;
+  h.num_topics = model.num_topics();
+  h.num_levels = model.num_levels();
+  h.dict_size = corpus.dict().max();
+  h.backoff_size = backoff.size();
+  assert((int)h.num_levels == backoff.order());
+  out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+
+  vector<int32_t> ints;
+  for (int l=0; l < (int)h.num_levels; ++l)
+    ints.push_back(backoff.terms_at_level(l));
+  h.levels_off = out.tellp();
+  append(&out, ints);
+  pad(&out);
+
+  h.backoff_off = out.tellp();
+  ints.assign(backoff.begin(), backoff.end());
+  append(&out, ints);
+  pad(&out);
+
+  vector<double> topic_probs;
+  for (int k=0; k < (int)h.num_topics; ++k)
+    topic_probs.push_back(model.topic_prob(k));
+  h.topic_probs_off = out.tellp();
+  append(&out, topic_probs);
+
+  vector<Restaurant> restaurants;
+  vector<uint64_t> term_offsets;
+  vector<Entry> entries;
+  for (int l=0; l < (int)h.num_levels; ++l) {
+    vector<TermEntry> level;
+    for (int k=0; k < (int)h.num_topics; ++k) {
+      const PYP<int>& pyp = model.word_pyp(l, k);
+      Restaurant r = { pyp.a(), pyp.b(), (double) pyp.num_customers(), (double) pyp.num_tables() };
+      restaurants.push_back(r);
+      for (PYP<int>::const_iterator it=pyp.begin(); it != pyp.end(); ++it) {
+        if (!it->second) continue;
+        assert(it->first > 0 && it->first <= (int)h.dict_size);
+        TermEntry e = { it->first, k, it->second, it->tc.tables };
+        level.push_back(e);
+      }
+    }
+    sort(level.begin(), level.end());
+    vector<TermEntry>::const_iterator it = level.begin();
+    for (int t=0; t <= (int)h.dict_size + 1; ++t) {
+      term_offsets.push_back(entries.size());
+      for (; it != level.end() && it->term == t; ++it) {
+        Entry e = { it->topic, it->customers, it->tables };
+        entries.push_back(e);
+      }
+    }
+  }
+  h.num_entries = entries.size();
+  h.restaurants_off = out.tellp();
+  append(&out, restaurants);
+  h.term_offsets_off = out.tellp();
+  append(&out, term_offsets);
+  h.entries_off = out.tellp();
+  append(&out, entries);
+  pad(&out);
+
+  vector<string> strs;
+  strs.reserve(h.dict_size);
+  for (int id=1; id <= (int)h.dict_size; ++id)
+    strs.push_back(corpus.dict().Convert(id));
+  h.dict_off = out.tellp();
+  binary_format::write_strings(&out, strs);
+
+  h.file_size = out.tellp();
+  out.seekp(0);
+  out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+  out.close();
+  if (!out) {
+    cerr << "Error writing " << filename << endl;
+    return false;
+  }
+  return true;
+}
+
+void TopicModel::read(const string &filename) {
+  assert(!m_data);
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) fail(filename, strerror(errno));
+  struct stat st;
+  if (fstat(fd, &st) < 0) fail(filename, strerror(errno));
+  m_size = st.st_size;
+  if (m_size < sizeof(Header)) fail(filename, "file too short");
+  m_data = mmap(NULL, m_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m_data == MAP_FAILED) {
+    m_data = 0;
+    fail(filename, strerror(errno));
+  }
+  const char* base = static_cast<const char*>(m_data);
+  const Header& h = *reinterpret_cast<const Header*>(base);
+  if (memcmp(h.magic, kTM_MAGIC, sizeof(kTM_MAGIC)) != 0) fail(filename, "bad magic number");
+  if (h.version != kTM_VERSION) fail(filename, "unsupported version");
+  if (h.byte_order != kTM_BYTE_ORDER) fail(filename, "written on a machine with a different byte order");
+  if (h.file_size != m_size) fail(filename, "truncated file");
+
+  m_num_topics = h.num_topics;
+  m_num_levels = h.num_levels;
+  m_dict_size = h.dict_size;
+  m_backoff_size = h.backoff_size;
+  m_terms_at_level = reinterpret_cast<const int32_t*>(base + h.levels_off);
+  m_backoff = reinterpret_cast<const int32_t*>(base + h.backoff_off);
+  m_topic_probs = reinterpret_cast<const double*>(base + h.topic_probs_off);
+  m_restaurants = reinterpret_cast<const Restaurant*>(base + h.restaurants_off);
+  m_term_offsets = reinterpret_cast<const uint64_t*>(base + h.term_offsets_off);
+  m_entries = reinterpret_cast<const Entry*>(base + h.entries_off);
+
+  // the contexts are looked up by string, so the dictionary is the one part
+  // that is copied out
+  if (!binary_format::read_dict(base + h.dict_off, h.dict_size, &m_dict))
+    fail(filename, "duplicate context");
+
+  cerr << "Read topic model with " << m_num_topics << " topics and backoff order "
+       << m_num_levels << endl;
+}
+
+void TopicModel::context_probs(const ContextsLexer::Context& context,
+                               BackoffGenerator* backoff_gen, double* probs,
+                               int level) const {
+  assert(level < m_num_levels);
+  const Term term = m_dict.Convert(context, true);
+  if (term > 0) {
+    term_probs(term, level, probs);
+    return;
+  }
+  ContextsLexer::Context backoff_context;
+  if (backoff_gen && level + 1 < m_num_levels)
+    backoff_context = (*backoff_gen)(context);
+  if (backoff_context.empty())
+    fill(probs, probs + m_num_topics, 1.0 / m_terms_at_level[level]);
+  else
+    context_probs(backoff_context, backoff_gen, probs, level+1);
+  seat(0, level, probs);
+}
+
+void TopicModel::term_probs(Term term, int level, double* probs) const {
+  // as PYPTopics::term_probs
+  const Term backoff_term = (term < m_backoff_size ? m_backoff[term] : -1);
+  if (backoff_term >= 0) {
+    assert(level + 1 < m_num_levels);
+    term_probs(backoff_term, level+1, probs);
+  }
+  else
+    fill(probs, probs + m_num_topics, 1.0 / m_terms_at_level[level]);
+  seat(term, level, probs);
+}
+
+void TopicModel::seat(Term term, int level, double* probs) const {
+  // PYP::prob: (c - a*t + (a*T + b)*p0) / (N + b), where the terms a dish
+  // adds are only there for the topics it was seen with
+  const Restaurant* r = m_restaurants + level * m_num_topics;
+  for (int k=0; k < m_num_topics; ++k)
+    probs[k] = (r[k].a * r[k].tables + r[k].b) * probs[k] / (r[k].customers + r[k].b);
+  if (term <= 0) return;
+  assert(term <= m_dict_size);
+  const uint64_t* off = m_term_offsets + level * (m_dict_size + 2) + term;
+  for (const Entry* e = m_entries + off[0]; e != m_entries + off[1]; ++e) {
+    const Restaurant& rk = r[e->topic];
+    probs[e->topic] += (e->customers - rk.a * e->tables) / (rk.customers + rk.b);
+  }
+}
@@ -0,0 +1,77 @@
+#ifndef _TOPIC_MODEL_HH
+#define _TOPIC_MODEL_HH
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+#include "corpus.hh"
+#include "contexts_lexer.h"
+#include "dict.h"
+
+class PYPTopics;
+class ContextsCorpus;
+class BackoffGenerator;
+
+////////////////////////////////////////////////////////////////
+// TopicModel
+//
+// A trained model frozen for labeling new documents: the topic-term
+// restaurants of every backoff level (their hyperparameters, and the
+// customers and tables of each term), the topic prior, the backoff map and
+// the contexts dictionary, in a binary file that is mmapped and used in
+// place.  The counts are grouped by term, so the probabilities of one
+// context under all the topics come from one run of entries.
+////////////////////////////////////////////////////////////////
+
+class TopicModel {
+public:
+    TopicModel() : m_data(0), m_size(0) {}
+    ~TopicModel();
+
+    // writes model, trained on corpus, in the format read by read
+    static bool write(const std::string &filename, const PYPTopics& model,
+                      const ContextsCorpus& corpus);
+
+    // maps a model written by write; aborts if it isn't one
+    void read(const std::string &filename);
+
+    int num_topics() const { return m_num_topics; }
+    double topic_prob(int k) const { return m_topic_probs[k]; }
+
+    // P(context | k) for each topic k, as PYPTopics::prob gives it.  A
+    // context the model hasn't seen is a new dish of the level 0
+    // restaurants; its p0 comes from the context backoff_gen backs it off
+    // to, as when training, or is uniform without one.  Safe to call from
+    // several threads at once
+    void context_probs(const ContextsLexer::Context& context,
+                       BackoffGenerator* backoff_gen, double* probs,
+                       int level=0) const;
+
+private:
+    struct Header;
+    struct Restaurant;
+    struct Entry;
+
+    // probs of the known term at level and the levels it backs off to
+    void term_probs(Term term, int level, double* probs) const;
+    // turns the p0s in probs into the probabilities of term (0 for an
+    // unseen one) in the restaurants of level
+    void seat(Term term, int level, double* probs) const;
+
+    TopicModel(const TopicModel&);
+    void operator=(const TopicModel&);
+
+    void* m_data;
+    size_t m_size;
+    int m_num_topics, m_num_levels, m_dict_size, m_backoff_size;
+    const int32_t* m_terms_at_level;
+    const int32_t* m_backoff;
+    const double* m_topic_probs;
+    const Restaurant* m_restaurants;
+    const uint64_t* m_term_offsets;
+    const Entry* m_entries;
+    mutable Dict m_dict; // only looked up (frozen), which is const in effect
+};
+
+#endif // _TOPIC_MODEL_HH
@@ -13,6 +13,7 @@
 #include "pyp-topics.hh"
 #include "corpus.hh"
 #include "contexts_corpus.hh"
+#include "topic_model.hh"
 #include "gzstream.hh"
 
 static const char *REVISION = "$Rev$";
@@ -40,11 +41,13 @@ int main(int argc, char **argv)
       ;
     options_description config_options("Allowed options");
     config_options.add_options()
-      ("data,d", value<string>(), "file containing the documents and context terms")
+      ("data,d", value<string>(), "file containing the documents and context terms, or a binary corpus written by --write-binary-corpus")
+      ("write-binary-corpus", value<string>(), "write the corpus read from --data (with its backoff) to this file in binary form and exit")
       ("topics,t", value<int>()->default_value(50), "number of topics")
       ("document-topics-out,o", value<string>(), "file to write the document topics to")
       ("default-topics-out", value<string>(), "file to write default term topic assignments.")
       ("topic-words-out,w", value<string>(), "file to write the topic word distribution to")
+      ("model-out", value<string>(), "file to write the trained model to, for labeling new documents with pyp-contexts-label")
       ("samples,s", value<int>()->default_value(10), "number of sampling passes through the data")
       ("backoff-type", value<string>(), "backoff type: none|simple")
 //      ("filter-singleton-contexts", "filter singleton contexts")
@@ -55,6 +58,7 @@ int main(int argc, char **argv)
       ("max-threads", value<int>()->default_value(1), "maximum number of simultaneous threads allowed")
       ("max-contexts-per-document", value<int>()->default_value(0), "Only sample the n most frequent contexts for a document.")
       ("num-jobs", value<int>()->default_value(1), "allows finer control over parallelization")
+      ("parallel-sampling", "sample the documents on max-threads threads, merging their topic-term counts after each pass (approximate distributed Gibbs sampling)")
       ("temp-start", value<double>()->default_value(1.0), "starting annealing temperature.")
       ("temp-end", value<double>()->default_value(1.0), "end annealing temperature.")
       ;
@@ -102,8 +106,17 @@ int main(int argc, char **argv)
   }
 
   ContextsCorpus contexts_corpus;
-  contexts_corpus.read_contexts(vm["data"].as<string>(), backoff_gen, /*vm.count("filter-singleton-contexts")*/ false);
+  if (ContextsCorpus::is_binary(vm["data"].as<string>()))
+    contexts_corpus.read_binary(vm["data"].as<string>());
+  else
+    contexts_corpus.read_contexts(vm["data"].as<string>(), backoff_gen, /*vm.count("filter-singleton-contexts")*/ false);
+  if (vm.count("write-binary-corpus")) {
+    if (backoff_gen) 
+      delete backoff_gen;
+    return contexts_corpus.write_binary(vm["write-binary-corpus"].as<string>()) ? 0 : 1;
+  }
   model.set_backoff(contexts_corpus.backoff_index());
+  model.set_parallel_sampling(vm.count("parallel-sampling"));
 
   if (backoff_gen) 
     delete backoff_gen;
@@ -162,6 +175,10 @@ int main(int argc, char **argv)
     }
   }
 
+  if (vm.count("model-out")
+      && !TopicModel::write(vm["model-out"].as<string>(), model, contexts_corpus))
+    return 1;
+
   if (vm.count("topic-words-out")) {
     ogzstream topics_out(vm["topic-words-out"].as<string>().c_str());
     model.print_topic_terms(topics_out);
@@ -1,6 +1,8 @@
 #include <algorithm>
 #include <utility>
 #include <map>
+#include <set>
+#include <tr1/unordered_set>
 
 #include "rule_lexer.h"
 #include "filelib.h"
@@ -20,35 +22,22 @@ aTRule::aTRule(TRulePtr rule){
   ResetScore(0.00000001);
 }
 
-bool equal(TRulePtr const & rule1, TRulePtr const & rule2){
-  if (rule1->lhs_ != rule2->lhs_) return false;
-  if (rule1->f_.size() != rule2->f_.size()) return false;
-  if (rule1->e_.size() != rule2->e_.size()) return false;
-
-  for (int i=0; i<rule1->f_.size(); i++)
-    if (rule1->f_.at(i) != rule2->f_.at(i)) return false;
-  for (int i=0; i<rule1->e_.size(); i++)
-    if (rule1->e_.at(i) != rule2->e_.at(i)) return false;
-  return true;
-}
-
-
 //const vector<TRulePtr> Grammar::NO_RULES;
 
-void aRemoveRule(vector<TRulePtr> & v, const TRulePtr  & rule){ // remove rule from v if found
-  for (int i=0; i< v.size(); i++)
-    if (equal(v[i], rule )){
-      //      cout<<"erase rule from vector:"<<rule->AsString()<<endl;
-      v.erase(v.begin()+i);
-    }
-}
+// rules are shared between the trie and the indexes, so they're removed by
+// identity, a whole batch per pass over each container they're in
+typedef tr1::unordered_set<const TRule*> RuleSet;
 
-void aRemoveRule(vector<NTRule> & v, const NTRule  & ntrule){ // remove rule from v if found
-  for (int i=0; i< v.size(); i++)
-    if (equal(v[i].rule_, ntrule.rule_ )){
-      //      cout<<"erase rule from vector:"<<rule->AsString()<<endl;
-       v.erase(v.begin()+i);
-    }
+static const TRule* rulePtr(const TRulePtr & rule){ return rule.get(); }
+static const TRule* rulePtr(const NTRule & ntrule){ return ntrule.rule_.get(); }
+
+template <typename T>
+static void aRemoveRules(vector<T> & v, const RuleSet & dead){ // remove the rules in dead from v, keeping the order of the rest
+  typename vector<T>::iterator out = v.begin();
+  for (typename vector<T>::iterator it = v.begin(); it != v.end(); ++it)
+    if (dead.find(rulePtr(*it)) == dead.end())
+      *out++ = *it;
+  v.erase(out, v.end());
 }
 
 struct aTextRuleBin : public RuleBin {
@@ -62,10 +51,12 @@ struct aTextRuleBin : public RuleBin {
     rules_.push_back(t);
   }
 
-  void RemoveRule(const TRulePtr & rule ){
-    aRemoveRule(rules_, rule);
+  void RemoveRules(const RuleSet & dead){
+    aRemoveRules(rules_, dead);
   }
-      
+
+  bool empty() const { return rules_.empty(); }
+
 
   int Arity() const {
     return rules_.front()->Arity();
@@ -102,6 +93,23 @@ struct aTextGrammarNode : public GrammarIter {
   aTextRuleBin* rb_;
 };
 
+// removes the rules in dead from the bin at the end of path f, then drops
+// the bin and the nodes on the path if they're left empty
+static void RemoveFromTrie(aTextGrammarNode* node, const vector<WordID> & f, int i, const RuleSet & dead){
+  if (i == f.size()) {
+    if (node->rb_) {
+      node->rb_->RemoveRules(dead);
+      if (node->rb_->empty()) { delete node->rb_; node->rb_ = NULL; }
+    }
+    return;
+  }
+  map<WordID, aTextGrammarNode>::iterator child = node->tree_.find(f[i]);
+  if (child == node->tree_.end()) return;
+  RemoveFromTrie(&child->second, f, i + 1, dead);
+  if (child->second.rb_ == NULL && child->second.tree_.empty())
+    node->tree_.erase(child);
+}
+
 struct aTGImpl {
   aTextGrammarNode root_;
 };
@@ -160,39 +168,65 @@ void aTextGrammar::AddRule(const TRulePtr& rule) {
 }
 
 void aTextGrammar::RemoveRule(const TRulePtr & rule){
-  //  cout<<"Remove rule:  "<<rule->AsString()<<endl;
-  if (rule->IsUnary()) {
-    aRemoveRule(rhs2unaries_[rule->f().front()], rule);
-    aRemoveRule(unaries_, rule);
-  } else {
-    aTextGrammarNode* cur = &pimpl_->root_;
-    for (int i = 0; i < rule->f_.size(); ++i)
-      cur = &cur->tree_[rule->f_[i]];
-//     if (cur->rb_ == NULL)
-//       cur->rb_ = new aTextRuleBin;
-    cur->rb_->RemoveRule(rule);
-  }
-
-  //remove rules from lhs_rules_
-  
-  aRemoveRule(lhs_rules_[rule->lhs_ * -1] , rule);
-
+  RemoveRules(vector<TRulePtr>(1, rule));
+}
 
-  //remove the rule from nt_rules_
-  map<WordID, NTRule> ntrule_map;
-  getNTRule (rule, ntrule_map);
-  for (map<WordID,NTRule>::const_iterator it= ntrule_map.begin(); it != ntrule_map.end(); it++){
-    aRemoveRule(nt_rules_[it->first], it->second);
+// removes the rules from the trie and the indexes in place: each trie path,
+// unary list and per-nonterminal list the rules are in is filtered once, so
+// this costs time in the size of those, not of the grammar
+void aTextGrammar::RemoveRules(const vector<TRulePtr> & rules){
+  RuleSet dead;
+  set<vector<WordID> > paths;
+  set<WordID> unary_cats;
+  set<WordID> nts; // WordID >0
+  for (int i=0; i< rules.size(); i++){
+    const TRulePtr & rule = rules[i];
+    dead.insert(rule.get());
+    if (rule->IsUnary())
+      unary_cats.insert(rule->f().front());
+    else
+      paths.insert(rule->f_);
+    nts.insert(rule->lhs_ * -1);
+    for (int j=0; j< rule->f_.size(); j++)
+      if (rule->f_[j] < 0) nts.insert(rule->f_[j] * -1);
   }
 
+  if (!unary_cats.empty()) {
+    for (set<WordID>::const_iterator it = unary_cats.begin(); it != unary_cats.end(); ++it) {
+      Cat2Rules::iterator found = rhs2unaries_.find(*it);
+      if (found == rhs2unaries_.end()) continue;
+      aRemoveRules(found->second, dead);
+      if (found->second.empty()) rhs2unaries_.erase(found);
+    }
+    aRemoveRules(unaries_, dead);
+  }
+  for (set<vector<WordID> >::const_iterator it = paths.begin(); it != paths.end(); ++it)
+    RemoveFromTrie(&pimpl_->root_, *it, 0, dead);
+
+  for (set<WordID>::const_iterator it = nts.begin(); it != nts.end(); ++it) {
+    map<WordID, vector<TRulePtr> >::iterator lhs = lhs_rules_.find(*it);
+    if (lhs != lhs_rules_.end()) {
+      aRemoveRules(lhs->second, dead);
+      if (lhs->second.empty()) lhs_rules_.erase(lhs);
+    }
+    NTRules::iterator ntr = nt_rules_.find(*it);
+    if (ntr != nt_rules_.end()) {
+      aRemoveRules(ntr->second, dead);
+      if (ntr->second.empty()) nt_rules_.erase(ntr);
+    }
+  }
 }
 
 void aTextGrammar::RemoveNonterminal(WordID wordID){
-  vector<NTRule> rules = nt_rules_[wordID];
-//  //  remove the nonterminal from ntrules_
+  NTRules::const_iterator it = nt_rules_.find(wordID);
+  if (it != nt_rules_.end()) {
+    vector<TRulePtr> rules;
+    rules.reserve(it->second.size());
+    for (int i =0; i<it->second.size(); i++)
+      rules.push_back(it->second[i].rule_);
+    RemoveRules(rules);
+  }
   nt_rules_.erase(wordID);
-  for (int i =0; i<rules.size(); i++)
-    RemoveRule(rules[i].rule_);
   sum_probs_.erase(wordID);
   cnt_rules.erase(wordID);
 
@@ -404,12 +438,11 @@ void aTextGrammar::ResetScore(){
 
   map<WordID, vector<TRulePtr > >::const_iterator it;
   for (it= lhs_rules_.begin(); it != lhs_rules_.end(); it++){
-    vector<TRulePtr> v = it-> second;
+    const vector<TRulePtr> & v = it-> second;
     for (int i =0; i< v.size(); i++){
       //      cerr<<"Reset score of Rule "<<v[i]->AsString()<<endl;
-      boost::static_pointer_cast<aTRule>(v[i])->ResetScore(alpha_ /v.size());
+      static_cast<aTRule*>(v[i].get())->ResetScore(alpha_ /v.size());
     }
-    lhs_rules_[it->first] = v;
     sum_probs_[it->first] = alpha_;
   }
 
@@ -419,9 +452,10 @@ void aTextGrammar::UpdateScore(){
 
   map<WordID, vector<TRulePtr > >::const_iterator it;
   for (it= lhs_rules_.begin(); it != lhs_rules_.end(); it++){
-    vector<TRulePtr> v = it-> second;
+    const vector<TRulePtr> & v = it-> second;
+    const double sum_prob = sum_probs_[it->first];
     for (int i =0; i< v.size(); i++){
-      boost::static_pointer_cast<aTRule>(v[i])->UpdateScore(sum_probs_[it->first] );
+      static_cast<aTRule*>(v[i].get())->UpdateScore(sum_prob);
     }
 
     //    cerr<<"sum_probs_[it->first]  ="<<sum_probs_[it->first] <<endl;
@@ -461,12 +495,11 @@ void aTextGrammar::UpdateHgProsteriorProb(Hypergraph & hg){
 
 
 void aTextGrammar::PrintNonterminalRules(WordID nt) const{
-  vector< NTRule > v;   
-  map<WordID, vector<NTRule> >::const_iterator mit= nt_rules_.find(nt);
+  NTRules::const_iterator mit= nt_rules_.find(nt);
   if (mit == nt_rules_.end())
     return;
 
-  v = mit->second;
+  const vector<NTRule> & v = mit->second;
 
   for (vector<NTRule>::const_iterator it = v.begin(); it != v.end(); it++)
     cout<<it->rule_->AsString()<<endl;
@@ -1,6 +1,8 @@
 #ifndef AGRAMMAR_H_
 #define AGRAMMAR_H_
 
+#include <tr1/unordered_map>
+
 #include "grammar.h"
 #include "hg.h"
 
@@ -94,6 +96,7 @@ struct aTextGrammar : public Grammar {
  private:
 
   void RemoveRule(const TRulePtr & rule);
+  void RemoveRules(const vector<TRulePtr> & rules);
   void RemoveNonterminal(WordID wordID);
 
   int max_span_;
@@ -101,9 +104,11 @@ struct aTextGrammar : public Grammar {
   boost::shared_ptr<aTGImpl> pimpl_;
 
   map <WordID, vector<TRulePtr> > lhs_rules_;// WordID >0
-  map <WordID, vector<NTRule> > nt_rules_; 
+  // every rule mentioning each nt (WordID >0), only looked up by nt
+  typedef tr1::unordered_map<WordID, vector<NTRule> > NTRules;
+  NTRules nt_rules_;
 
-  map <WordID, double> sum_probs_;
+  tr1::unordered_map<WordID, double> sum_probs_;
   map <WordID, double> cnt_rules;
 
   double alpha_;
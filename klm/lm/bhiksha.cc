@@ -72,7 +72,22 @@ ArrayBhiksha::ArrayBhiksha(void *base, uint64_t max_offset, uint64_t max_next, c
     offset_begin_(reinterpret_cast<const uint64_t*>(AlignTo8(base)) + 1 /* 8-byte header */),
     offset_end_(offset_begin_ + ArrayCount(max_offset, max_next, config)),
     write_to_(reinterpret_cast<uint64_t*>(AlignTo8(base)) + 1 /* 8-byte header */ + 1 /* first entry is 0 */),
-    original_base_(base) {}
+    original_base_(base),
+    max_offset_(max_offset) {
+  if (static_cast<uint64_t>(offset_end_ - offset_begin_) > std::numeric_limits<uint32_t>::max())
+    UTIL_THROW(util::Exception, "Sorry, the pointer offset table has more than 2^32 entries; lower pointer_bhiksha_bits.");
+}
+
+void ArrayBhiksha::BuildDirectory() {
+  // One more block than entries need, so the block after any entry's exists.
+  directory_.resize((max_offset_ >> kDirectoryShift) + 2);
+  const uint64_t *at = offset_begin_;
+  for (uint64_t block = 0; block < directory_.size(); ++block) {
+    const uint64_t first = block << kDirectoryShift;
+    while (at + 1 < offset_end_ && *(at + 1) <= first) ++at;
+    directory_[block] = at - offset_begin_;
+  }
+}
 
 void ArrayBhiksha::FinishedLoading(const Config &config) {
   // *offset_begin_ = 0 but without a const_cast.
@@ -83,9 +98,11 @@ void ArrayBhiksha::FinishedLoading(const Config &config) {
   uint8_t *head_write = reinterpret_cast<uint8_t*>(original_base_);
   *(head_write++) = kArrayBhikshaVersion;
   *(head_write++) = config.pointer_bhiksha_bits;
+  BuildDirectory();
 }
 
 void ArrayBhiksha::LoadedBinary() {
+  BuildDirectory();
 }
 
 } // namespace trie
@@ -3,6 +3,7 @@
 #include "lm/lm_exception.hh"
 #include "util/file_piece.hh"
 
+#include <iostream>
 #include <limits>
 #include <string>
 
@@ -13,6 +14,7 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 namespace lm {
@@ -40,7 +42,7 @@ struct Sanity {
   }
 };
 
-const char *kModelNames[6] = {"hashed n-grams with probing", "hashed n-grams with sorted uniform find", "trie", "trie with quantization", "trie with array-compressed pointers", "trie with quantization and array-compressed pointers"};
+const char *kModelNames[7] = {"hashed n-grams with probing", "hashed n-grams with sorted uniform find", "trie", "trie with quantization", "trie with array-compressed pointers", "trie with quantization and array-compressed pointers", "hashed n-grams with group probing"};
 
 std::size_t Align8(std::size_t in) {
   std::size_t off = in % 8;
@@ -48,6 +50,12 @@ std::size_t Align8(std::size_t in) {
   return in + 8 - off;
 }
 
+double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
 std::size_t TotalHeaderSize(unsigned char order) {
   return Align8(sizeof(Sanity) + sizeof(FixedWidthParameters) + sizeof(uint64_t) * order);
 }
@@ -69,7 +77,8 @@ void WriteHeader(void *to, const Parameters &params) {
   memcpy(to, &header, sizeof(Sanity));
   char *out = reinterpret_cast<char*>(to) + sizeof(Sanity);
 
-  *reinterpret_cast<FixedWidthParameters*>(out) = params.fixed;
+  // memcpy rather than assignment so the (zeroed) padding is copied too.
+  memcpy(out, &params.fixed, sizeof(FixedWidthParameters));
   out += sizeof(FixedWidthParameters);
 
   uint64_t *counts = reinterpret_cast<uint64_t*>(out);
@@ -125,6 +134,8 @@ void FinishFile(const Config &config, ModelType model_type, const std::vector<ui
       UTIL_THROW(util::ErrnoException, "msync failed for " << config.write_mmap);
     // header and vocab share the same mmap.  The header is written here because we know the counts.  
     Parameters params;
+    // Zero the padding so the same model always gives the same bytes.
+    memset(&params.fixed, 0, sizeof(params.fixed));
     params.counts = counts;
     params.fixed.order = counts.size();
     params.fixed.probing_multiplier = config.probing_multiplier;
@@ -186,20 +197,28 @@ void SeekPastHeader(int fd, const Parameters &params) {
   SeekOrThrow(fd, TotalHeaderSize(params.counts.size()));
 }
 
-uint8_t *SetupBinary(const Config &config, const Parameters &params, std::size_t memory_size, Backing &backing) {
+uint8_t *SetupBinary(const Config &config, const Parameters &params, std::size_t memory_size, std::size_t mapped_size, Backing &backing) {
   const off_t file_size = util::SizeFile(backing.file.get());
   // The header is smaller than a page, so we have to map the whole header as well.  
-  std::size_t total_map = TotalHeaderSize(params.counts.size()) + memory_size;
-  if (file_size != util::kBadSize && static_cast<uint64_t>(file_size) < total_map)
-    UTIL_THROW(FormatLoadException, "Binary file has size " << file_size << " but the headers say it should be at least " << total_map);
-
-  util::MapRead(config.load_method, backing.file.get(), 0, total_map, backing.search);
+  const std::size_t total_size = TotalHeaderSize(params.counts.size()) + memory_size;
+  if (file_size != util::kBadSize && static_cast<uint64_t>(file_size) < total_size)
+    UTIL_THROW(FormatLoadException, "Binary file has size " << file_size << " but the headers say it should be at least " << total_size);
+  std::size_t total_map = TotalHeaderSize(params.counts.size()) + mapped_size;
+
+  const double start = Now();
+  util::MapRead(config.load_method, backing.file.get(), 0, total_map, backing.search, config.load_advice);
+  if (config.messages) {
+    *config.messages << "Loaded " << total_map << " bytes by " << util::LoadMethodName(config.load_method);
+    if (config.load_advice.huge_pages) *config.messages << ", huge pages";
+    if (config.load_advice.will_need) *config.messages << ", will need";
+    *config.messages << " in " << (Now() - start) << "s" << std::endl;
+  }
 
   if (config.enumerate_vocab && !params.fixed.has_vocabulary)
     UTIL_THROW(FormatLoadException, "The decoder requested all the vocabulary strings, but this binary file does not have them.  You may need to rebuild the binary file with an updated version of build_binary.");
 
   if (config.enumerate_vocab) {
-    SeekOrThrow(backing.file.get(), total_map);
+    SeekOrThrow(backing.file.get(), total_size);
   }
   return reinterpret_cast<uint8_t*>(backing.search.get()) + TotalHeaderSize(params.counts.size());
 }
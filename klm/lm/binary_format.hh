@@ -18,7 +18,7 @@ namespace ngram {
 
 /* Not the best numbering system, but it grew this way for historical reasons
  * and I want to preserve existing binary files. */
-typedef enum {HASH_PROBING=0, HASH_SORTED=1, TRIE_SORTED=2, QUANT_TRIE_SORTED=3, ARRAY_TRIE_SORTED=4, QUANT_ARRAY_TRIE_SORTED=5} ModelType;
+typedef enum {HASH_PROBING=0, HASH_SORTED=1, TRIE_SORTED=2, QUANT_TRIE_SORTED=3, ARRAY_TRIE_SORTED=4, QUANT_ARRAY_TRIE_SORTED=5, HASH_GROUP_PROBING=6} ModelType;
 
 const static ModelType kQuantAdd = static_cast<ModelType>(QUANT_TRIE_SORTED - TRIE_SORTED);
 const static ModelType kArrayAdd = static_cast<ModelType>(ARRAY_TRIE_SORTED - TRIE_SORTED);
@@ -62,6 +62,21 @@ uint8_t *SetupJustVocab(const Config &config, uint8_t order, std::size_t memory_
 // Grow the binary file for the search data structure and set backing.search, returning the memory address where the search data structure should begin.  
 uint8_t *GrowForSearch(const Config &config, std::size_t vocab_pad, std::size_t memory_size, Backing &backing);
 
+// The order of the n-grams that are loaded and queried: that of the model
+// (counts.size()), or config.max_order if that is lower.
+inline unsigned char LoadedOrder(const std::vector<uint64_t> &counts, const Config &config) {
+  if (config.max_order == 1) UTIL_THROW(ConfigException, "max_order must be at least 2 (or 0 for the whole model)");
+  return (config.max_order && config.max_order < counts.size()) ? config.max_order : static_cast<unsigned char>(counts.size());
+}
+
+// The number of middle orders that are loaded: 2 through the order of the
+// model - 1, or through max_order if it is lower, when the last middle takes
+// the place of the longest order (which is then not loaded).
+inline unsigned char LoadedMiddles(const std::vector<uint64_t> &counts, const Config &config) {
+  const unsigned char order = LoadedOrder(counts, config);
+  return (order < counts.size() ? order : counts.size() - 1) - 1;
+}
+
 // Write header to binary file.  This is done last to prevent incomplete files
 // from loading.   
 void FinishFile(const Config &config, ModelType model_type, const std::vector<uint64_t> &counts, Backing &backing);
@@ -76,7 +91,8 @@ void MatchCheck(ModelType model_type, const Parameters &params);
 
 void SeekPastHeader(int fd, const Parameters &params);
 
-uint8_t *SetupBinary(const Config &config, const Parameters &params, std::size_t memory_size, Backing &backing);
+// Maps the first mapped_size of the memory_size bytes after the header.
+uint8_t *SetupBinary(const Config &config, const Parameters &params, std::size_t memory_size, std::size_t mapped_size, Backing &backing);
 
 void ComplainAboutARPA(const Config &config, ModelType model_type);
 
@@ -96,8 +112,13 @@ template <class To> void LoadLM(const char *file, const Config &config, To &to)
       new_config.probing_multiplier = params.fixed.probing_multiplier;
       detail::SeekPastHeader(backing.file.get(), params);
       To::UpdateConfigFromBinary(backing.file.get(), params.counts, new_config);
-      std::size_t memory_size = To::Size(params.counts, new_config);
-      uint8_t *start = detail::SetupBinary(new_config, params, memory_size, backing);
+      // With a max_order, only a prefix of the search memory is mapped, but
+      // the vocabulary strings follow all of it.
+      Config full_config(new_config);
+      full_config.max_order = 0;
+      std::size_t memory_size = To::Size(params.counts, full_config);
+      std::size_t mapped_size = To::Size(params.counts, new_config);
+      uint8_t *start = detail::SetupBinary(new_config, params, memory_size, mapped_size, backing);
       to.InitializeFromBinary(start, params, new_config, backing.file.get());
     } else {
       detail::ComplainAboutARPA(config, To::kModelType);
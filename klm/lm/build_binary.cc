@@ -15,25 +15,34 @@ namespace ngram {
 namespace {
 
 void Usage(const char *name) {
-  std::cerr << "Usage: " << name << " [-u log10_unknown_probability] [-s] [-i] [-p probing_multiplier] [-t trie_temporary] [-m trie_building_megabytes] [-q bits] [-b bits] [-c bits] [type] input.arpa [output.mmap]\n\n"
+  std::cerr << "Usage: " << name << " [-u log10_unknown_probability] [-s] [-i] [-p probing_multiplier] [-t trie_temporary] [-m trie_building_megabytes] [-S trie_memory] [-T trie_threads] [-q bits] [-b bits] [-c bits] [type] input.arpa [output.mmap]\n\n"
 "-u sets the log10 probability for <unk> if the ARPA file does not have one.\n"
 "   Default is -100.  The ARPA file will always take precedence.\n"
 "-s allows models to be built even if they do not have <s> and </s>.\n"
 "-i allows buggy models from IRSTLM by mapping positive log probability to 0.\n\n"
-"type is either probing or trie.  Default is probing.\n\n"
+"type is probing, group, or trie.  Default is probing.\n\n"
 "probing uses a probing hash table.  It is the fastest but uses the most memory.\n"
 "-p sets the space multiplier and must be >1.0.  The default is 1.5.\n\n"
+"group is probing that compares 16 buckets at once using a control byte per\n"
+"bucket.  It holds up better than probing at low -p and takes -p the same way.\n\n"
 "trie is a straightforward trie with bit-level packing.  It uses the least\n"
 "memory and is still faster than SRI or IRST.  Building the trie format uses an\n"
 "on-disk sort to save memory.\n"
 "-t is the temporary directory prefix.  Default is the output file name.\n"
 "-m limits memory use for sorting.  Measured in MB.  Default is 1024MB.\n"
+"-S is -m with a K, M, G or T suffix, e.g. -S 8G.  Sorting is done in batches\n"
+"   of this size that are merged from disk, so any budget works.\n"
+"-T sets the number of threads for sorting, merging, and quantizer training.\n"
+"   Default is 1.  Threaded training holds every order's values at once.\n"
 "-q turns quantization on and sets the number of bits (e.g. -q 8).\n"
 "-b sets backoff quantization bits.  Requires -q and defaults to that value.\n"
 "-a compresses pointers using an array of offsets.  The parameter is the\n"
 "   maximum number of bits encoded by the array.  Memory is minimized subject\n"
 "   to the maximum, so pick 255 to minimize memory.\n\n"
-"Get a memory estimate by passing an ARPA file without an output file name.\n";
+"Get a memory estimate by passing an ARPA file without an output file name.\n\n"
+"An output name of the form shm:NAME writes the model into the POSIX shared\n"
+"memory object /NAME so that decoders loading shm:NAME share one copy.  It\n"
+"stays there until removed (rm /dev/shm/NAME on Linux).\n";
   exit(1);
 }
 
@@ -51,6 +60,25 @@ unsigned long int ParseUInt(const char *from) {
   return ret;
 }
 
+// Number of bytes with an optional K, M, G or T suffix.  A bare number is MB.
+std::size_t ParseSize(const char *from) {
+  char *end;
+  unsigned long long ret = strtoull(from, &end, 10);
+  if (end == from) throw util::ParseNumberException(from);
+  switch (*end) {
+    case 'T': case 't': ret <<= 10;
+    case 'G': case 'g': ret <<= 10;
+    case '\0':
+    case 'M': case 'm': ret <<= 10;
+    case 'K': case 'k': ret <<= 10;
+      break;
+    default:
+      throw util::ParseNumberException(from);
+  }
+  if (*end && end[1]) throw util::ParseNumberException(from);
+  return ret;
+}
+
 uint8_t ParseBitCount(const char *from) {
   unsigned long val = ParseUInt(from);
   if (val > 25) {
@@ -64,8 +92,9 @@ void ShowSizes(const char *file, const lm::ngram::Config &config) {
   std::vector<uint64_t> counts;
   util::FilePiece f(file);
   lm::ReadARPACounts(f, counts);
-  std::size_t sizes[5];
+  std::size_t sizes[6];
   sizes[0] = ProbingModel::Size(counts, config);
+  sizes[5] = GroupProbingModel::Size(counts, config);
   sizes[1] = TrieModel::Size(counts, config);
   sizes[2] = QuantTrieModel::Size(counts, config);
   sizes[3] = ArrayTrieModel::Size(counts, config);
@@ -93,6 +122,7 @@ void ShowSizes(const char *file, const lm::ngram::Config &config) {
   for (long int i = 0; i < length - 2; ++i) std::cout << ' ';
   std::cout << prefix << "B\n"
     "probing " << std::setw(length) << (sizes[0] / divide) << " assuming -p " << config.probing_multiplier << "\n"
+    "group   " << std::setw(length) << (sizes[5] / divide) << " assuming -p " << config.probing_multiplier << "\n"
     "trie    " << std::setw(length) << (sizes[1] / divide) << " without quantization\n"
     "trie    " << std::setw(length) << (sizes[2] / divide) << " assuming -q " << (unsigned)config.prob_bits << " -b " << (unsigned)config.backoff_bits << " quantization \n"
     "trie    " << std::setw(length) << (sizes[3] / divide) << " assuming -a " << (unsigned)config.pointer_bhiksha_bits << " array pointer compression\n"
@@ -115,7 +145,7 @@ int main(int argc, char *argv[]) {
     bool quantize = false, set_backoff_bits = false, bhiksha = false;
     lm::ngram::Config config;
     int opt;
-    while ((opt = getopt(argc, argv, "siu:p:t:m:q:b:a:")) != -1) {
+    while ((opt = getopt(argc, argv, "siu:p:t:m:S:T:q:b:a:")) != -1) {
       switch(opt) {
         case 'q':
           config.prob_bits = ParseBitCount(optarg);
@@ -141,6 +171,12 @@ int main(int argc, char *argv[]) {
         case 'm':
           config.building_memory = ParseUInt(optarg) * 1048576;
           break;
+        case 'S':
+          config.building_memory = ParseSize(optarg);
+          break;
+        case 'T':
+          config.build_threads = ParseUInt(optarg);
+          break;
         case 's':
           config.sentence_marker_missing = lm::SILENT;
           break;
@@ -168,6 +204,9 @@ int main(int argc, char *argv[]) {
       if (!strcmp(model_type, "probing")) {
         if (quantize || set_backoff_bits) ProbingQuantizationUnsupported();
         ProbingModel(from_file, config);
+      } else if (!strcmp(model_type, "group")) {
+        if (quantize || set_backoff_bits) ProbingQuantizationUnsupported();
+        GroupProbingModel(from_file, config);
       } else if (!strcmp(model_type, "trie")) {
         if (quantize) {
           if (bhiksha) {
@@ -8,12 +8,14 @@ namespace ngram {
 Config::Config() :
   messages(&std::cerr),
   enumerate_vocab(NULL),
+  max_order(0),
   unknown_missing(COMPLAIN),
   sentence_marker_missing(THROW_UP),
   positive_log_probability(THROW_UP),
   unknown_missing_logprob(-100.0),
   probing_multiplier(1.5),
   building_memory(1073741824ULL), // 1 GB
+  build_threads(1),
   temporary_directory_prefix(NULL),
   arpa_complain(ALL),
   write_mmap(NULL),
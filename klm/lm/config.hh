@@ -24,6 +24,12 @@ struct Config {
   // are still responsible for deleting it (or stack allocating).  
   EnumerateVocab *enumerate_vocab;
 
+  // If nonzero and lower than the order of the model, the model acts as if it
+  // had only the n-grams up to this order: Order() returns it and queries back
+  // off there.  Of a binary file, only the n-grams up to this order are mapped
+  // (or read), so one binary 5-gram can also serve as the 3-gram of a coarse
+  // pass without loading the rest.  
+  unsigned char max_order;
 
 
   // ONLY EFFECTIVE WHEN READING ARPA
@@ -54,6 +60,13 @@ struct Config {
   // models.
   std::size_t building_memory;
 
+  // Threads used to sort and merge when building a trie.  The ARPA file is
+  // still parsed by one thread, but with more than one thread parsing
+  // overlaps with sorting, and reading (and gunzipping) the ARPA file
+  // overlaps with parsing for all models.  The output does not depend on
+  // this.
+  unsigned int build_threads;
+
   // Template for temporary directory appropriate for passing to mkdtemp.  
   // The characters XXXXXX are appended before passing to mkdtemp.  Only
   // applies to trie.  If NULL, defaults to write_mmap.  If that's NULL,
@@ -87,6 +100,9 @@ struct Config {
   // See util/mmap.hh for details of MapMethod.  
   util::LoadMethod load_method;
 
+  // Huge page and readahead hints for the same array.  See util/mmap.hh.
+  util::MapAdvice load_advice;
+
 
 
   // Set defaults. 
@@ -114,6 +114,28 @@ template <class Search, class VocabularyT> class GenericModel : public base::Mod
      */
     void GetState(const WordIndex *context_rbegin, const WordIndex *context_rend, State &out_state) const;
 
+    /* Hint that the same word and context will soon be passed to FullScore
+     * (or FullScoreForgotState): issue software prefetches for the table
+     * entries it will probe.  Calling this for many queries before resolving
+     * any of them lets their cache misses overlap.  This never changes any
+     * result.
+     */
+    void Prefetch(const State &in_state, const WordIndex new_word) const {
+      search_.Prefetch(in_state.history_, in_state.history_ + in_state.valid_length_, new_word);
+    }
+    void Prefetch(const WordIndex *context_rbegin, const WordIndex *context_rend, const WordIndex new_word) const {
+      search_.Prefetch(context_rbegin, std::min(context_rend, context_rbegin + P::Order() - 1), new_word);
+    }
+
+    /* Batched FullScore: for i < count, ret[i] = FullScore(in_states[i],
+     * new_words[i], out_states[i]).  All the probes are prefetched before any
+     * of them is resolved.  out_states must not overlap in_states.
+     */
+    void FullScoreBatch(const State *in_states, const WordIndex *new_words, std::size_t count, State *out_states, FullScoreReturn *ret) const {
+      for (std::size_t i = 0; i < count; ++i) Prefetch(in_states[i], new_words[i]);
+      for (std::size_t i = 0; i < count; ++i) ret[i] = FullScore(in_states[i], new_words[i], out_states[i]);
+    }
+
   private:
     friend void LoadLM<>(const char *file, const Config &config, GenericModel<Search, VocabularyT> &to);
 
@@ -142,6 +164,9 @@ template <class Search, class VocabularyT> class GenericModel : public base::Mod
     typedef typename Search::Middle Middle;
 
     Search search_;
+
+    // LoadedOrder(): that of the file, or Config::max_order if it is lower
+    unsigned char order_;
 };
 
 } // namespace detail
@@ -151,6 +176,7 @@ typedef ::lm::ngram::ProbingVocabulary Vocabulary;
 typedef detail::GenericModel<detail::ProbingHashedSearch, Vocabulary> ProbingModel; // HASH_PROBING
 // Default implementation.  No real reason for it to be the default.  
 typedef ProbingModel Model;
+typedef detail::GenericModel<detail::GroupProbingHashedSearch, Vocabulary> GroupProbingModel; // HASH_GROUP_PROBING
 
 // Smaller implementation.
 typedef ::lm::ngram::SortedVocabulary SortedVocabulary;
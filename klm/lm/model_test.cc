@@ -201,6 +201,28 @@ template <class M> void NoUnkCheck(const M &model) {
   BOOST_CHECK_CLOSE(-100.0, ret.prob, 0.001);
 }
 
+// FullScoreBatch must agree with one FullScore call per query.
+template <class M> void Batch(const M &model) {
+  const char *words[] = {"looking", "on", "a", "little", "the", "this_is_not_found", "</s>"};
+  const std::size_t kCount = sizeof(words) / sizeof(const char*);
+  State in[kCount], out[kCount];
+  WordIndex indices[kCount];
+  FullScoreReturn ret[kCount];
+  in[0] = model.BeginSentenceState();
+  for (std::size_t i = 0; i < kCount; ++i) {
+    indices[i] = model.GetVocabulary().Index(words[i]);
+    if (i + 1 < kCount) model.FullScore(in[i], indices[i], in[i + 1]);
+  }
+  model.FullScoreBatch(in, indices, kCount, out, ret);
+  for (std::size_t i = 0; i < kCount; ++i) {
+    State expected_state;
+    FullScoreReturn expected = model.FullScore(in[i], indices[i], expected_state);
+    BOOST_CHECK_EQUAL(expected.prob, ret[i].prob);
+    BOOST_CHECK_EQUAL(static_cast<unsigned int>(expected.ngram_length), static_cast<unsigned int>(ret[i].ngram_length));
+    BOOST_CHECK_EQUAL(expected_state, out[i]);
+  }
+}
+
 template <class M> void Everything(const M &m) {
   Starters(m);
   Continuation(m);
@@ -208,6 +230,7 @@ template <class M> void Everything(const M &m) {
   Unknowns(m);
   MinimalState(m);
   Stateless(m);
+  Batch(m);
 }
 
 class ExpectEnumerateVocab : public EnumerateVocab {
@@ -259,6 +282,9 @@ template <class ModelT> void LoadingTest() {
 BOOST_AUTO_TEST_CASE(probing) {
   LoadingTest<Model>();
 }
+BOOST_AUTO_TEST_CASE(group_probing) {
+  LoadingTest<GroupProbingModel>();
+}
 BOOST_AUTO_TEST_CASE(trie) {
   LoadingTest<TrieModel>();
 }
@@ -318,9 +344,69 @@ template <class ModelT> void BinaryTest() {
   unlink("test_nounk.binary");
 }
 
+// With max_order 3, test.arpa must score as test_3gram.arpa, which is it
+// without the 4- and 5-grams.  States may keep more context (the blanks of
+// the higher orders are still there), so only the scores are compared.
+template <class M> void CappedMatches(const M &capped, const M &reference, const State &capped_begin, const State &reference_begin) {
+  const char *words[] = {"looking", "on", "a", "little", "more", "loin", ".", "</s>", "also", "would", "consider", "higher", "looking", "not_found", "however", "not_found3", "little", "more", "."};
+  State state = capped_begin, ref_state = reference_begin, out, ref_out;
+  for (std::size_t i = 0; i < sizeof(words) / sizeof(const char*); ++i) {
+    FullScoreReturn ret = capped.FullScore(state, capped.GetVocabulary().Index(words[i]), out);
+    FullScoreReturn ref = reference.FullScore(ref_state, reference.GetVocabulary().Index(words[i]), ref_out);
+    BOOST_CHECK_CLOSE(ref.prob, ret.prob, 0.001);
+    BOOST_CHECK_EQUAL(static_cast<unsigned int>(ref.ngram_length), static_cast<unsigned int>(ret.ngram_length));
+    BOOST_CHECK_GE(2, out.valid_length_);
+    state = out;
+    ref_state = ref_out;
+  }
+}
+
+template <class ModelT> void CappedTest() {
+  Config config;
+  config.messages = NULL;
+  config.arpa_complain = Config::NONE;
+  ModelT reference("test_3gram.arpa", config);
+  config.write_mmap = "test.binary";
+  config.max_order = 3;
+  {
+    ModelT from_arpa("test.arpa", config);
+    BOOST_CHECK_EQUAL(3, from_arpa.Order());
+    CappedMatches(from_arpa, reference, from_arpa.BeginSentenceState(), reference.BeginSentenceState());
+    CappedMatches(from_arpa, reference, from_arpa.NullContextState(), reference.NullContextState());
+  }
+  config.write_mmap = NULL;
+  {
+    ModelT binary("test.binary", config);
+    BOOST_CHECK_EQUAL(3, binary.Order());
+    CappedMatches(binary, reference, binary.BeginSentenceState(), reference.BeginSentenceState());
+    CappedMatches(binary, reference, binary.NullContextState(), reference.NullContextState());
+  }
+  // the binary file was written in full
+  config.max_order = 0;
+  {
+    ModelT binary("test.binary", config);
+    BOOST_CHECK_EQUAL(5, binary.Order());
+    Continuation(binary);
+  }
+  unlink("test.binary");
+}
+
+BOOST_AUTO_TEST_CASE(capped_probing) {
+  CappedTest<Model>();
+}
+BOOST_AUTO_TEST_CASE(capped_trie) {
+  CappedTest<TrieModel>();
+}
+BOOST_AUTO_TEST_CASE(capped_quant_array_trie) {
+  CappedTest<QuantArrayTrieModel>();
+}
+
 BOOST_AUTO_TEST_CASE(write_and_read_probing) {
   BinaryTest<Model>();
 }
+BOOST_AUTO_TEST_CASE(write_and_read_group_probing) {
+  BinaryTest<GroupProbingModel>();
+}
 BOOST_AUTO_TEST_CASE(write_and_read_trie) {
   BinaryTest<TrieModel>();
 }
@@ -1,18 +1,38 @@
 #include "lm/enumerate_vocab.hh"
 #include "lm/model.hh"
+#include "util/file_piece.hh"
+#include "util/mmap.hh"
+
+#include <boost/thread/thread.hpp>
 
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include <ctype.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <sys/resource.h>
 #include <sys/time.h>
 
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
 float FloatSec(const struct timeval &tv) {
-  return static_cast<float>(tv.tv_sec) + (static_cast<float>(tv.tv_usec) / 1000000000.0);
+  return static_cast<float>(tv.tv_sec) + (static_cast<float>(tv.tv_usec) / 1000000.0);
+}
+
+double WallSec() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
 }
 
 void PrintUsage(const char *message) {
@@ -24,7 +44,7 @@ void PrintUsage(const char *message) {
   std::cerr << message;
   std::cerr << "user\t" << FloatSec(usage.ru_utime) << "\nsys\t" << FloatSec(usage.ru_stime) << '\n';
 
-  // Linux doesn't set memory usage :-(.  
+  // Linux doesn't set memory usage :-(.
   std::ifstream status("/proc/self/status", std::ios::in);
   std::string line;
   while (getline(status, line)) {
@@ -77,36 +97,222 @@ template <class Model> void Query(const Model &model, bool sentence_context) {
   PrintUsage("After queries:\n");
 }
 
-template <class Model> void Query(const char *name) {
-  lm::ngram::Config config;
-  Model model(name, config);
-  Query(model);
+// Hardware cache miss and reference counts for this process and the threads
+// it starts after construction.  Unavailable when the kernel or a sandbox
+// does not allow perf events.
+class CacheCounters {
+  public:
+    CacheCounters() : misses_(-1), references_(-1) {
+#ifdef __linux__
+      misses_ = Open(PERF_COUNT_HW_CACHE_MISSES);
+      references_ = Open(PERF_COUNT_HW_CACHE_REFERENCES);
+#endif
+    }
+
+    ~CacheCounters() {
+      if (misses_ != -1) close(misses_);
+      if (references_ != -1) close(references_);
+    }
+
+    bool Available() const { return misses_ != -1 && references_ != -1; }
+
+    void Start() {
+#ifdef __linux__
+      if (!Available()) return;
+      ioctl(misses_, PERF_EVENT_IOC_RESET, 0);
+      ioctl(references_, PERF_EVENT_IOC_RESET, 0);
+      ioctl(misses_, PERF_EVENT_IOC_ENABLE, 0);
+      ioctl(references_, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+
+    // Share of cache references that missed since Start, or -1.
+    double StopMissShare() {
+      if (!Available()) return -1.0;
+#ifdef __linux__
+      ioctl(misses_, PERF_EVENT_IOC_DISABLE, 0);
+      ioctl(references_, PERF_EVENT_IOC_DISABLE, 0);
+#endif
+      uint64_t misses, references;
+      if (read(misses_, &misses, sizeof(misses)) != sizeof(misses) ||
+          read(references_, &references, sizeof(references)) != sizeof(references) ||
+          !references) return -1.0;
+      return static_cast<double>(misses) / static_cast<double>(references);
+    }
+
+  private:
+#ifdef __linux__
+    static int Open(uint64_t config) {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.size = sizeof(attr);
+      attr.config = config;
+      attr.disabled = 1;
+      attr.inherit = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+
+    int misses_, references_;
+};
+
+// A corpus mapped once and converted to vocabulary ids.  Sentence i is
+// words[starts[i]] to words[starts[i + 1]].
+struct Corpus {
+  std::vector<lm::WordIndex> words;
+  std::vector<std::size_t> starts;
+};
+
+template <class Vocab> void LoadCorpus(const char *name, const Vocab &vocab, Corpus &corpus) {
+  util::scoped_fd fd(util::OpenReadOrThrow(name));
+  const off_t size = util::SizeFile(fd.get());
+  if (size == util::kBadSize) UTIL_THROW(util::Exception, "Cannot size " << name << "; benchmark corpora must be regular files");
+  util::scoped_memory mem;
+  if (size) util::MapRead(util::POPULATE_OR_READ, fd.get(), 0, size, mem);
+  const char *i = mem.begin(), *end = mem.begin() + size;
+  corpus.words.clear();
+  corpus.starts.assign(1, 0);
+  while (i != end) {
+    if (*i == '\n') {
+      corpus.starts.push_back(corpus.words.size());
+      ++i;
+    } else if (isspace(*i)) {
+      ++i;
+    } else {
+      const char *word = i;
+      for (; i != end && !isspace(*i); ++i) {}
+      corpus.words.push_back(vocab.Index(StringPiece(word, i - word)));
+    }
+  }
+  if (corpus.starts.back() != corpus.words.size()) corpus.starts.push_back(corpus.words.size());
 }
 
-int main(int argc, char *argv[]) {
-  if (!(argc == 2 || (argc == 3 && !strcmp(argv[2], "null")))) {
-    std::cerr << "Usage: " << argv[0] << " lm_file [null]" << std::endl;
-    std::cerr << "Input is wrapped in <s> and </s> unless null is passed." << std::endl;
-    return 1;
+// Scores sentences [begin, end) of the corpus.
+template <class Model> class ScoreSentences {
+  public:
+    ScoreSentences(const Model &model, const Corpus &corpus, std::size_t begin, std::size_t end, bool sentence_context, double *total, uint64_t *queries)
+      : model_(model), corpus_(corpus), begin_(begin), end_(end), sentence_context_(sentence_context), total_(total), queries_(queries) {}
+
+    void operator()() const {
+      typename Model::State state, out;
+      double total = 0.0;
+      uint64_t queries = 0;
+      for (std::size_t s = begin_; s < end_; ++s) {
+        state = sentence_context_ ? model_.BeginSentenceState() : model_.NullContextState();
+        for (std::size_t w = corpus_.starts[s]; w < corpus_.starts[s + 1]; ++w) {
+          total += model_.FullScore(state, corpus_.words[w], out).prob;
+          state = out;
+        }
+        queries += corpus_.starts[s + 1] - corpus_.starts[s];
+        if (sentence_context_) {
+          total += model_.FullScore(state, model_.GetVocabulary().EndSentence(), out).prob;
+          ++queries;
+        }
+      }
+      *total_ = total;
+      *queries_ = queries;
+    }
+
+  private:
+    const Model &model_;
+    const Corpus &corpus_;
+    std::size_t begin_, end_;
+    bool sentence_context_;
+    double *total_;
+    uint64_t *queries_;
+};
+
+struct BenchmarkOptions {
+  BenchmarkOptions() : corpus(NULL), threads(1), sentence_context(true) {}
+  const char *corpus;
+  unsigned int threads;
+  bool sentence_context;
+};
+
+// Scores the corpus on options.threads threads sharing model and prints one
+// line of throughput numbers, with the size of the file (for a binary file,
+// the memory the model takes) to weigh them against.
+template <class Model> void Benchmark(const Model &model, const char *file, const char *type_name, const BenchmarkOptions &options) {
+  Corpus corpus;
+  LoadCorpus(options.corpus, model.GetVocabulary(), corpus);
+  const std::size_t sentences = corpus.starts.size() - 1;
+  std::vector<double> totals(options.threads);
+  std::vector<uint64_t> queries(options.threads);
+  CacheCounters counters;
+  counters.Start();
+  const double start = WallSec();
+  {
+    boost::thread_group threads;
+    for (unsigned int t = 0; t < options.threads; ++t) {
+      threads.create_thread(ScoreSentences<Model>(model, corpus,
+          sentences * t / options.threads, sentences * (t + 1) / options.threads,
+          options.sentence_context, &totals[t], &queries[t]));
+    }
+    threads.join_all();
+  }
+  const double seconds = WallSec() - start;
+  const double miss_share = counters.StopMissShare();
+  double total = 0.0;
+  uint64_t query_count = 0;
+  for (unsigned int t = 0; t < options.threads; ++t) {
+    total += totals[t];
+    query_count += queries[t];
+  }
+  util::scoped_fd fd(util::OpenReadOrThrow(file));
+  const off_t file_size = util::SizeFile(fd.get());
+  std::cout << file << '\t' << type_name << "\tMB ";
+  if (file_size == util::kBadSize) {
+    std::cout << "n/a";
+  } else {
+    std::cout << (file_size / 1048576.0);
   }
-  bool sentence_context = (argc == 2);
+  std::cout << "\tthreads " << options.threads << "\tqueries " << query_count
+            << "\tqueries/s " << (query_count / seconds)
+            << "\tns/query " << (seconds * 1e9 * options.threads / query_count)
+            << "\tcache miss share ";
+  if (miss_share < 0.0) {
+    std::cout << "n/a";
+  } else {
+    std::cout << (100.0 * miss_share) << '%';
+  }
+  std::cout << "\ttotal " << total << '\n';
+}
+
+template <class Model> void Run(const char *file, const char *type_name, const BenchmarkOptions &options) {
+  lm::ngram::Config config;
+  if (options.corpus) config.messages = NULL;
+  Model model(file, config);
+  if (options.corpus) {
+    Benchmark(model, file, type_name, options);
+  } else {
+    Query(model, options.sentence_context);
+  }
+}
+
+void Dispatch(const char *file, const BenchmarkOptions &options) {
   lm::ngram::ModelType model_type;
-  if (lm::ngram::RecognizeBinary(argv[1], model_type)) {
+  if (lm::ngram::RecognizeBinary(file, model_type)) {
     switch(model_type) {
       case lm::ngram::HASH_PROBING:
-        Query<lm::ngram::ProbingModel>(argv[1], sentence_context);
+        Run<lm::ngram::ProbingModel>(file, "probing", options);
+        break;
+      case lm::ngram::HASH_GROUP_PROBING:
+        Run<lm::ngram::GroupProbingModel>(file, "group_probing", options);
         break;
       case lm::ngram::TRIE_SORTED:
-        Query<lm::ngram::TrieModel>(argv[1], sentence_context);
+        Run<lm::ngram::TrieModel>(file, "trie", options);
         break;
       case lm::ngram::QUANT_TRIE_SORTED:
-        Query<lm::ngram::QuantTrieModel>(argv[1], sentence_context);
+        Run<lm::ngram::QuantTrieModel>(file, "quant_trie", options);
         break;
       case lm::ngram::ARRAY_TRIE_SORTED:
-        Query<lm::ngram::ArrayTrieModel>(argv[1], sentence_context);
+        Run<lm::ngram::ArrayTrieModel>(file, "array_trie", options);
         break;
       case lm::ngram::QUANT_ARRAY_TRIE_SORTED:
-        Query<lm::ngram::QuantArrayTrieModel>(argv[1], sentence_context);
+        Run<lm::ngram::QuantArrayTrieModel>(file, "quant_array_trie", options);
         break;
       case lm::ngram::HASH_SORTED:
       default:
@@ -114,9 +320,52 @@ int main(int argc, char *argv[]) {
         abort();
     }
   } else {
-    Query<lm::ngram::ProbingModel>(argv[1], sentence_context);
+    Run<lm::ngram::ProbingModel>(file, "probing (ARPA)", options);
+  }
+}
+
+void Usage(const char *name) {
+  std::cerr << "Usage: " << name << " lm_file [null]\n"
+    "       " << name << " -b corpus [-t threads] lm_file... [null]\n"
+    "Input is wrapped in <s> and </s> unless null is passed.\n\n"
+    "-b scores every line of corpus against each lm_file in turn and prints\n"
+    "   throughput and, where perf events are allowed, the cache miss share.\n"
+    "-t splits the corpus across this many threads sharing one model.\n";
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  BenchmarkOptions options;
+  int opt;
+  while ((opt = getopt(argc, argv, "b:t:")) != -1) {
+    switch (opt) {
+      case 'b':
+        options.corpus = optarg;
+        break;
+      case 't':
+        options.threads = atoi(optarg);
+        if (!options.threads) Usage(argv[0]);
+        break;
+      default:
+        Usage(argv[0]);
+    }
+  }
+  int files_end = argc;
+  if (files_end - optind >= 2 && !strcmp(argv[files_end - 1], "null")) {
+    options.sentence_context = false;
+    --files_end;
+  }
+  if (files_end == optind || (!options.corpus && files_end - optind != 1)) Usage(argv[0]);
+
+  try {
+    for (int i = optind; i < files_end; ++i) {
+      Dispatch(argv[i], options);
+    }
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
   }
 
-  PrintUsage("Total time including destruction:\n");
+  if (!options.corpus) PrintUsage("Total time including destruction:\n");
   return 0;
 }
@@ -5,6 +5,7 @@
 #include <algorithm>
 #include <numeric>
 
+#include <string.h>
 #include <unistd.h>
 
 namespace lm {
@@ -20,8 +21,58 @@ namespace ngram {
 
 namespace {
 
+// Unsigned integer that sorts in the same order as the float.
+inline uint32_t RadixKey(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(uint32_t));
+  return (bits & 0x80000000) ? ~bits : (bits | 0x80000000);
+}
+
+const std::size_t kRadixCutoff = 256;
+
+/* In-place most significant digit first radix sort on the bits
+ * [shift, shift + bits) of RadixKey.  This gives the same order as std::sort
+ * (up to the relative order of -0 and 0, which doesn't change any sum) in
+ * linear time and without a scratch copy of the values.  Buckets too small to
+ * be worth another pass go to std::sort.
+ */
+void RadixSort(float *begin, float *end, unsigned int shift, unsigned int bits) {
+  if (static_cast<std::size_t>(end - begin) < kRadixCutoff) {
+    std::sort(begin, end);
+    return;
+  }
+  const uint32_t buckets = 1 << bits, mask = buckets - 1;
+  std::vector<std::size_t> count(buckets);
+  for (const float *i = begin; i != end; ++i) ++count[(RadixKey(*i) >> shift) & mask];
+  std::vector<float*> head(buckets), tail(buckets);
+  float *at = begin;
+  for (uint32_t b = 0; b < buckets; ++b) {
+    head[b] = at;
+    at += count[b];
+    tail[b] = at;
+  }
+  // Cycle each misplaced value into the next free slot of its bucket.
+  for (uint32_t b = 0; b < buckets; ++b) {
+    while (head[b] != tail[b]) {
+      float value = *head[b];
+      uint32_t digit = (RadixKey(value) >> shift) & mask;
+      while (digit != b) {
+        std::swap(value, *head[digit]++);
+        digit = (RadixKey(value) >> shift) & mask;
+      }
+      *head[b]++ = value;
+    }
+  }
+  if (!shift) return;
+  for (uint32_t b = 0; b < buckets; ++b) {
+    if (count[b] > 1) RadixSort(tail[b] - count[b], tail[b], shift - 8, 8);
+  }
+}
+
 void MakeBins(float *values, float *values_end, float *centers, uint32_t bins) {
-  std::sort(values, values_end);
+  // Log probabilities and backoffs share a handful of exponents, so the first
+  // pass histograms sign, exponent, and 7 bits of mantissa together.
+  RadixSort(values, values_end, 16, 16);
   const float *start = values, *finish;
   for (uint32_t i = 0; i < bins; ++i, ++centers, start = finish) {
     finish = values + (((values_end - values) * static_cast<uint64_t>(i + 1)) / bins);
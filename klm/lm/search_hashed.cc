@@ -85,11 +85,13 @@ template <class MiddleT, class LongestT> uint8_t *TemplateHashedSearch<MiddleT,
   std::size_t allocated = Unigram::Size(counts[0]);
   unigram = Unigram(start, allocated);
   start += allocated;
-  for (unsigned int n = 2; n < counts.size(); ++n) {
+  const unsigned char middles = LoadedMiddles(counts, config);
+  for (unsigned int n = 2; n < middles + 2u; ++n) {
     allocated = Middle::Size(counts[n - 1], config.probing_multiplier);
     middle_.push_back(Middle(start, allocated));
     start += allocated;
   }
+  if (middles + 2u < counts.size()) return start;
   allocated = Longest::Size(counts.back(), config.probing_multiplier);
   longest = Longest(start, allocated);
   start += allocated;
@@ -135,6 +137,10 @@ template class TemplateHashedSearch<ProbingHashedSearch::Middle, ProbingHashedSe
 
 template void TemplateHashedSearch<ProbingHashedSearch::Middle, ProbingHashedSearch::Longest>::InitializeFromARPA(const char *, util::FilePiece &f, const     std::vector<uint64_t> &counts, const Config &, ProbingVocabulary &vocab, Backing &backing);
 
+template class TemplateHashedSearch<GroupProbingHashedSearch::Middle, GroupProbingHashedSearch::Longest>;
+
+template void TemplateHashedSearch<GroupProbingHashedSearch::Middle, GroupProbingHashedSearch::Longest>::InitializeFromARPA(const char *, util::FilePiece &f, const std::vector<uint64_t> &counts, const Config &, ProbingVocabulary &vocab, Backing &backing);
+
 } // namespace detail
 } // namespace ngram
 } // namespace lm
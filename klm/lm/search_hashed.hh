@@ -6,6 +6,7 @@
 #include "lm/read_arpa.hh"
 #include "lm/weights.hh"
 
+#include "util/group_probing_hash_table.hh"
 #include "util/key_value_packing.hh"
 #include "util/probing_hash_table.hh"
 
@@ -39,6 +40,12 @@ struct HashedSearch {
 
       const ProbBackoff &Lookup(WordIndex index) const { return unigram_[index]; }
 
+      void Prefetch(WordIndex index) const {
+#ifdef __GNUC__
+        __builtin_prefetch(unigram_ + index);
+#endif
+      }
+
       ProbBackoff &Unknown() { return unigram_[0]; }
 
       void LoadedBinary() {}
@@ -70,11 +77,15 @@ template <class MiddleT, class LongestT> class TemplateHashedSearch : public Has
     // TODO: move probing_multiplier here with next binary file format update.  
     static void UpdateConfigFromBinary(int, const std::vector<uint64_t> &, Config &) {}
 
+    // With config.max_order below the order of the model, the size of the
+    // prefix of the tables up to max_order (see LoadedMiddles).
     static std::size_t Size(const std::vector<uint64_t> &counts, const Config &config) {
       std::size_t ret = Unigram::Size(counts[0]);
-      for (unsigned char n = 1; n < counts.size() - 1; ++n) {
+      const unsigned char middles = LoadedMiddles(counts, config);
+      for (unsigned char n = 1; n <= middles; ++n) {
         ret += Middle::Size(counts[n], config.probing_multiplier);
       }
+      if (middles + 2 < counts.size()) return ret;
       return ret + Longest::Size(counts.back(), config.probing_multiplier);
     }
 
@@ -112,6 +123,23 @@ template <class MiddleT, class LongestT> class TemplateHashedSearch : public Has
       return true;
     }
 
+    // Prefetch everything the lookups for new_word following context (in
+    // reverse order, as for FullScoreForgotState) will probe.  All the keys
+    // are known in advance, so the probes can be in flight at the same time.
+    void Prefetch(const WordIndex *context_rbegin, const WordIndex *context_rend, const WordIndex new_word) const {
+      unigram.Prefetch(new_word);
+      Node node = static_cast<Node>(new_word);
+      const Middle *mid = MiddleBegin();
+      for (const WordIndex *i = context_rbegin; i != context_rend; ++i, ++mid) {
+        node = CombineWordHash(node, *i);
+        if (mid == MiddleEnd()) {
+          longest.Prefetch(node);
+          return;
+        }
+        mid->Prefetch(node);
+      }
+    }
+
     // Geenrate a node without necessarily checking that it actually exists.  
     // Optionally return false if it's know to not exist.  
     bool FastMakeNode(const WordIndex *begin, const WordIndex *end, Node &node) const {
@@ -139,6 +167,14 @@ struct ProbingHashedSearch : public TemplateHashedSearch<
   static const ModelType kModelType = HASH_PROBING;
 };
 
+// Same keys and values as ProbingHashedSearch, probed 16 buckets at a time.
+struct GroupProbingHashedSearch : public TemplateHashedSearch<
+  util::GroupProbingHashTable<util::ByteAlignedPacking<uint64_t, ProbBackoff>, IdentityHash>,
+  util::GroupProbingHashTable<util::ByteAlignedPacking<uint64_t, Prob>, IdentityHash> > {
+
+  static const ModelType kModelType = HASH_GROUP_PROBING;
+};
+
 } // namespace detail
 } // namespace ngram
 } // namespace lm
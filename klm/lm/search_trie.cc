@@ -26,6 +26,9 @@
 #include <numeric>
 #include <vector>
 
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -324,58 +327,63 @@ void CopyFullRecord(SortedFileReader &from, FILE *to, std::size_t weights_size)
   CopyOrThrow(from.File(), to, (weights_size + sizeof(WordIndex)) * count);
 }
 
-void MergeSortedFiles(const std::string &first_name, const std::string &second_name, const std::string &out, std::size_t weights_size, unsigned char order) {
-  SortedFileReader first, second;
-  first.Init(first_name.c_str(), order);
-  RemoveOrThrow(first_name.c_str());
-  second.Init(second_name.c_str(), order);
-  RemoveOrThrow(second_name.c_str());
+// Merge up to kMaxMergeFiles sorted files at a time.  Each pass reads and
+// writes every entry once, so a wide merge saves passes over the disk.
+const std::size_t kMaxMergeFiles = 16;
+
+void MergeSortedFiles(const std::vector<std::string> &names, const std::string &out, std::size_t weights_size, unsigned char order) {
+  std::vector<boost::shared_ptr<SortedFileReader> > inputs;
+  for (std::size_t i = 0; i < names.size(); ++i) {
+    inputs.push_back(boost::shared_ptr<SortedFileReader>(new SortedFileReader()));
+    inputs.back()->Init(names[i].c_str(), order);
+    RemoveOrThrow(names[i].c_str());
+  }
   util::scoped_FILE out_file(OpenOrThrow(out.c_str(), "w"));
-  while (!first.Ended() && !second.Ended()) {
-    if (first.HeaderVector() < second.HeaderVector()) {
-      CopyFullRecord(first, out_file.get(), weights_size);
-      first.NextHeader();
-      continue;
-    } 
-    if (first.HeaderVector() > second.HeaderVector()) {
-      CopyFullRecord(second, out_file.get(), weights_size);
-      second.NextHeader();
+  // Inputs whose current header is the lowest.  
+  std::vector<SortedFileReader*> lowest;
+  std::vector<WordIndex> remaining, words;
+  while (true) {
+    lowest.clear();
+    for (std::size_t i = 0; i < inputs.size(); ++i) {
+      SortedFileReader &in = *inputs[i];
+      if (in.Ended()) continue;
+      if (lowest.empty() || in.HeaderVector() < lowest[0]->HeaderVector()) {
+        lowest.assign(1, &in);
+      } else if (in.HeaderVector() == lowest[0]->HeaderVector()) {
+        lowest.push_back(&in);
+      }
+    }
+    if (lowest.empty()) break;
+    if (lowest.size() == 1) {
+      CopyFullRecord(*lowest[0], out_file.get(), weights_size);
+      lowest[0]->NextHeader();
       continue;
     }
     // Merge at the entry level.
-    WriteOrThrow(out_file.get(), first.Header(), first.HeaderBytes());
-    WordIndex first_count = first.ReadCount(), second_count = second.ReadCount();
-    WordIndex total_count = first_count + second_count;
+    WriteOrThrow(out_file.get(), lowest[0]->Header(), lowest[0]->HeaderBytes());
+    remaining.resize(lowest.size());
+    words.resize(lowest.size());
+    WordIndex total_count = 0;
+    for (std::size_t i = 0; i < lowest.size(); ++i) {
+      remaining[i] = lowest[i]->ReadCount();
+      total_count += remaining[i];
+    }
     WriteOrThrow(out_file.get(), &total_count, sizeof(WordIndex));
-
-    WordIndex first_word = first.ReadWord(), second_word = second.ReadWord();
-    WordIndex first_index = 0, second_index = 0;
-    while (true) {
-      if (first_word < second_word) {
-        WriteOrThrow(out_file.get(), &first_word, sizeof(WordIndex));
-        CopyOrThrow(first.File(), out_file.get(), weights_size);
-        if (++first_index == first_count) break;
-        first_word = first.ReadWord();
-      } else {
-        WriteOrThrow(out_file.get(), &second_word, sizeof(WordIndex));
-        CopyOrThrow(second.File(), out_file.get(), weights_size);
-        if (++second_index == second_count) break;
-        second_word = second.ReadWord();
+    for (std::size_t i = 0; i < lowest.size(); ++i) {
+      words[i] = lowest[i]->ReadWord();
+    }
+    for (WordIndex written = 0; written < total_count; ++written) {
+      std::size_t best = lowest.size();
+      for (std::size_t i = 0; i < lowest.size(); ++i) {
+        if (remaining[i] && (best == lowest.size() || words[i] < words[best])) best = i;
       }
+      WriteOrThrow(out_file.get(), &words[best], sizeof(WordIndex));
+      CopyOrThrow(lowest[best]->File(), out_file.get(), weights_size);
+      if (--remaining[best]) words[best] = lowest[best]->ReadWord();
     }
-    if (first_index == first_count) {
-      WriteOrThrow(out_file.get(), &second_word, sizeof(WordIndex));
-      CopyOrThrow(second.File(), out_file.get(), (second_count - second_index) * (weights_size + sizeof(WordIndex)) - sizeof(WordIndex));
-    } else {
-      WriteOrThrow(out_file.get(), &first_word, sizeof(WordIndex));
-      CopyOrThrow(first.File(), out_file.get(), (first_count - first_index) * (weights_size + sizeof(WordIndex)) - sizeof(WordIndex));
+    for (std::size_t i = 0; i < lowest.size(); ++i) {
+      lowest[i]->NextHeader();
     }
-    first.NextHeader();
-    second.NextHeader();
-  }
-
-  for (SortedFileReader &remaining = first.Ended() ? second : first; !remaining.Ended(); remaining.NextHeader()) {
-    CopyFullRecord(remaining, out_file.get(), weights_size);
   }
 }
 
@@ -447,53 +455,148 @@ class ContextReader {
     bool valid_;
 };
 
-void MergeContextFiles(const std::string &first_base, const std::string &second_base, const std::string &out_base, unsigned char order) {
+void MergeContextFiles(const std::vector<std::string> &bases, const std::string &out_base, unsigned char order) {
   const size_t context_size = sizeof(WordIndex) * (order - 1);
-  std::string first_name(first_base + kContextSuffix);
-  std::string second_name(second_base + kContextSuffix);
-  ContextReader first(first_name.c_str(), order - 1), second(second_name.c_str(), order - 1);
-  RemoveOrThrow(first_name.c_str());
-  RemoveOrThrow(second_name.c_str());
+  std::vector<boost::shared_ptr<ContextReader> > inputs;
+  for (std::size_t i = 0; i < bases.size(); ++i) {
+    std::string name(bases[i] + kContextSuffix);
+    inputs.push_back(boost::shared_ptr<ContextReader>(new ContextReader(name.c_str(), order - 1)));
+    RemoveOrThrow(name.c_str());
+  }
   std::string out_name(out_base + kContextSuffix);
   util::scoped_FILE out(OpenOrThrow(out_name.c_str(), "w"));
-  while (first && second) {
-    for (const WordIndex *f = *first, *s = *second; ; ++f, ++s) {
-      if (f == *first + order - 1) {
-        // Equal.  
-        WriteOrThrow(out.get(), *first, context_size);
-        ++first;
-        ++second;
-        break;
-      }
-      if (*f < *s) {
-        // First lower
-        WriteOrThrow(out.get(), *first, context_size);
-        ++first;
-        break;
-      } else if (*f > *s) {
-        WriteOrThrow(out.get(), *second, context_size);
-        ++second;
-        break;
+  std::vector<WordIndex> lowest(order - 1);
+  while (true) {
+    bool any = false;
+    for (std::size_t i = 0; i < inputs.size(); ++i) {
+      if (!*inputs[i]) continue;
+      if (!any || std::lexicographical_compare(**inputs[i], **inputs[i] + order - 1, lowest.begin(), lowest.end())) {
+        std::copy(**inputs[i], **inputs[i] + order - 1, lowest.begin());
+        any = true;
       }
     }
+    if (!any) break;
+    WriteOrThrow(out.get(), &*lowest.begin(), context_size);
+    // Contexts are unique within a file but can repeat across files.  
+    for (std::size_t i = 0; i < inputs.size(); ++i) {
+      if (*inputs[i] && !memcmp(**inputs[i], &*lowest.begin(), context_size)) ++*inputs[i];
+    }
   }
-  ContextReader &remaining = first ? first : second;
-  if (!remaining) return;
-  WriteOrThrow(out.get(), *remaining, context_size);
-  CopyRestOrThrow(remaining.GetFile(), out.get());
 }
 
-void ConvertToSorted(util::FilePiece &f, const SortedVocabulary &vocab, const std::vector<uint64_t> &counts, util::scoped_memory &mem, const std::string &file_prefix, unsigned char order, PositiveProbWarn &warn) {
+// Runs jobs on up to Config::build_threads threads.  With one thread, jobs
+// run inline in Start.  Wait joins them and rethrows the first failure.
+class JobGroup {
+  public:
+    explicit JobGroup(unsigned int threads) : threads_(threads) {}
+
+    ~JobGroup() {
+      for (std::size_t i = 0; i < running_.size(); ++i) running_[i]->join();
+    }
+
+    template <class Job> void Start(const Job &job) {
+      if (threads_ <= 1) {
+        job();
+        return;
+      }
+      errors_.push_back(std::string());
+      running_.push_back(boost::shared_ptr<boost::thread>(new boost::thread(Capture<Job>(job, &errors_.back()))));
+    }
+
+    void Wait() {
+      for (std::size_t i = 0; i < running_.size(); ++i) running_[i]->join();
+      running_.clear();
+      std::string error;
+      for (std::deque<std::string>::const_iterator i = errors_.begin(); i != errors_.end(); ++i) {
+        if (error.empty()) error = *i;
+      }
+      errors_.clear();
+      if (!error.empty()) UTIL_THROW(util::Exception, error);
+    }
+
+  private:
+    template <class Job> struct Capture {
+      Capture(const Job &job, std::string *error) : job_(job), error_(error) {}
+      void operator()() {
+        try {
+          job_();
+        } catch (const std::exception &e) {
+          *error_ = e.what();
+          if (error_->empty()) *error_ = "Exception in trie building thread";
+        }
+      }
+      Job job_;
+      std::string *error_;
+    };
+
+    unsigned int threads_;
+    std::vector<boost::shared_ptr<boost::thread> > running_;
+    // deque so the pointers handed to running threads stay valid
+    std::deque<std::string> errors_;
+};
+
+// Sorts part of a batch and writes its n-gram and context files.
+class SortAndFlush {
+  public:
+    SortAndFlush(uint8_t *begin, uint8_t *end, const std::string &file_prefix, std::size_t batch, unsigned char order, std::size_t weights_size, std::string *file_name)
+      : begin_(begin), end_(end), file_prefix_(file_prefix), batch_(batch), order_(order), weights_size_(weights_size), file_name_(file_name) {}
+
+    void operator()() const {
+      const std::size_t entry_size = sizeof(WordIndex) * order_ + weights_size_;
+      // Sort full records by full n-gram.  
+      EntryProxy proxy_begin(begin_, entry_size), proxy_end(end_, entry_size);
+      // parallel_sort uses too much RAM
+      std::sort(NGramIter(proxy_begin), NGramIter(proxy_end), CompareRecords<EntryProxy>(order_));
+      *file_name_ = DiskFlush(begin_, end_, file_prefix_, batch_, order_, weights_size_);
+      WriteContextFile(begin_, end_, *file_name_, entry_size, order_);
+    }
+
+  private:
+    uint8_t *begin_, *end_;
+    std::string file_prefix_;
+    std::size_t batch_;
+    unsigned char order_;
+    std::size_t weights_size_;
+    std::string *file_name_;
+};
+
+class MergeFiles {
+  public:
+    MergeFiles(const std::vector<std::string> &in, const std::string &out, std::size_t weights_size, unsigned char order)
+      : in_(in), out_(out), weights_size_(weights_size), order_(order) {}
+
+    void operator()() const {
+      MergeSortedFiles(in_, out_, weights_size_, order_);
+      MergeContextFiles(in_, out_, order_);
+    }
+
+  private:
+    std::vector<std::string> in_;
+    std::string out_;
+    std::size_t weights_size_;
+    unsigned char order_;
+};
+
+/* With more than one thread, the buffer is split in two so the next batch is
+ * parsed while the last one is sorted and written, and each batch is sorted
+ * in threads pieces that become separate files.  Merging then runs up to
+ * threads merges at once.  Since n-grams are unique, the merged file
+ * is the same however the entries were split.
+ */
+void ConvertToSorted(util::FilePiece &f, const SortedVocabulary &vocab, const std::vector<uint64_t> &counts, util::scoped_memory &mem, const std::string &file_prefix, unsigned char order, PositiveProbWarn &warn, unsigned int threads) {
   ReadNGramHeader(f, order);
   const size_t count = counts[order - 1];
   // Size of weights.  Does it include backoff?  
   const size_t words_size = sizeof(WordIndex) * order;
   const size_t weights_size = sizeof(float) + ((order == counts.size()) ? 0 : sizeof(float));
   const size_t entry_size = words_size + weights_size;
-  const size_t batch_size = std::min(count, mem.size() / entry_size);
-  uint8_t *const begin = reinterpret_cast<uint8_t*>(mem.get());
+  const size_t buffers = (threads > 1) ? 2 : 1;
+  const size_t batch_size = std::min(count, mem.size() / buffers / entry_size);
   std::deque<std::string> files;
+  JobGroup jobs(threads);
+  std::vector<std::string> flushed;
   for (std::size_t batch = 0, done = 0; done < count; ++batch) {
+    uint8_t *const begin = reinterpret_cast<uint8_t*>(mem.get()) + (batch % buffers) * batch_size * entry_size;
     uint8_t *out = begin;
     uint8_t *out_end = out + std::min(count - done, batch_size) * entry_size;
     if (order == counts.size()) {
@@ -505,27 +608,45 @@ void ConvertToSorted(util::FilePiece &f, const SortedVocabulary &vocab, const st
         ReadNGram(f, order, vocab, reinterpret_cast<WordIndex*>(out), *reinterpret_cast<ProbBackoff*>(out + words_size), warn);
       }
     }
-    // Sort full records by full n-gram.  
-    EntryProxy proxy_begin(begin, entry_size), proxy_end(out_end, entry_size);
-    // parallel_sort uses too much RAM
-    std::sort(NGramIter(proxy_begin), NGramIter(proxy_end), CompareRecords<EntryProxy>(order));
-    files.push_back(DiskFlush(begin, out_end, file_prefix, batch, order, weights_size));
-    WriteContextFile(begin, out_end, files.back(), entry_size, order);
+    // The previous batch used the other buffer.  
+    jobs.Wait();
+    files.insert(files.end(), flushed.begin(), flushed.end());
+    flushed.clear();
+
+    const size_t entries = (out_end - begin) / entry_size;
+    const size_t per_job = (entries + threads - 1) / threads;
+    flushed.resize((entries + per_job - 1) / per_job);
+    for (size_t j = 0; j < flushed.size(); ++j) {
+      uint8_t *job_begin = begin + j * per_job * entry_size;
+      uint8_t *job_end = std::min(job_begin + per_job * entry_size, out_end);
+      jobs.Start(SortAndFlush(job_begin, job_end, file_prefix, batch * threads + j, order, weights_size, &flushed[j]));
+    }
 
-    done += (out_end - begin) / entry_size;
+    done += entries;
   }
+  jobs.Wait();
+  files.insert(files.end(), flushed.begin(), flushed.end());
 
   // All individual files created.  Merge them.  
 
   std::size_t merge_count = 0;
   while (files.size() > 1) {
-    std::stringstream assembled;
-    assembled << file_prefix << static_cast<unsigned int>(order) << "_merge_" << (merge_count++);
-    files.push_back(assembled.str());
-    MergeSortedFiles(files[0], files[1], files.back(), weights_size, order);
-    MergeContextFiles(files[0], files[1], files.back(), order);
-    files.pop_front();
-    files.pop_front();
+    // Split the files into up to threads merges of at most kMaxMergeFiles.  
+    const std::size_t merges = std::min<std::size_t>(threads, (files.size() + kMaxMergeFiles - 1) / kMaxMergeFiles);
+    const std::size_t per_merge = (files.size() + merges - 1) / merges;
+    std::size_t used = 0;
+    std::vector<std::string> merged;
+    for (std::size_t m = 0; m < merges && files.size() - used >= 2; ++m) {
+      const std::size_t take = std::min(per_merge, files.size() - used);
+      std::stringstream assembled;
+      assembled << file_prefix << static_cast<unsigned int>(order) << "_merge_" << (merge_count++);
+      merged.push_back(assembled.str());
+      jobs.Start(MergeFiles(std::vector<std::string>(files.begin() + used, files.begin() + used + take), merged.back(), weights_size, order));
+      used += take;
+    }
+    jobs.Wait();
+    files.erase(files.begin(), files.begin() + used);
+    files.insert(files.end(), merged.begin(), merged.end());
   }
   if (!files.empty()) {
     std::stringstream assembled;
@@ -564,7 +685,7 @@ void ARPAToSortedFiles(const Config &config, util::FilePiece &f, std::vector<uin
   if (!mem.get()) UTIL_THROW(util::ErrnoException, "malloc failed for sort buffer size " << buffer);
 
   for (unsigned char order = 2; order <= counts.size(); ++order) {
-    ConvertToSorted(f, vocab, counts, mem, file_prefix, order, warn);
+    ConvertToSorted(f, vocab, counts, mem, file_prefix, order, warn, std::max(1U, config.build_threads));
   }
   ReadEnd(f);
 }
@@ -820,6 +941,33 @@ template <class Quant> void TrainProbQuantizer(uint8_t order, uint64_t count, So
   quant.TrainProb(order, probs);
 }
 
+// Train one order's bins.  Orders read separate files and write separate
+// tables, so they can run concurrently.  Progress is only reported when the
+// orders run one after another.
+template <class Quant> class TrainOrder {
+  public:
+    TrainOrder(uint8_t order, uint64_t count, bool highest, SortedFileReader &reader, util::ErsatzProgress *progress, Quant &quant)
+      : order_(order), count_(count), highest_(highest), reader_(&reader), progress_(progress), quant_(&quant) {}
+
+    void operator()() const {
+      util::ErsatzProgress silent;
+      util::ErsatzProgress &progress = progress_ ? *progress_ : silent;
+      if (highest_) {
+        TrainProbQuantizer(order_, count_, *reader_, progress, *quant_);
+      } else {
+        TrainQuantizer(order_, count_, *reader_, progress, *quant_);
+      }
+    }
+
+  private:
+    uint8_t order_;
+    uint64_t count_;
+    bool highest_;
+    SortedFileReader *reader_;
+    util::ErsatzProgress *progress_;
+    Quant *quant_;
+};
+
 } // namespace
 
 template <class Quant, class Bhiksha> void BuildTrie(const std::string &file_prefix, std::vector<uint64_t> &counts, const Config &config, TrieSearch<Quant, Bhiksha> &out, Quant &quant, const SortedVocabulary &vocab, Backing &backing) {
@@ -851,10 +999,13 @@ template <class Quant, class Bhiksha> void BuildTrie(const std::string &file_pre
 
   if (Quant::kTrain) {
     util::ErsatzProgress progress(config.messages, "Quantizing", std::accumulate(counts.begin() + 1, counts.end(), 0));
-    for (unsigned char i = 2; i < counts.size(); ++i) {
-      TrainQuantizer(i, counts[i-1], inputs[i-2], progress, quant);
+    util::ErsatzProgress *shared = config.build_threads > 1 ? NULL : &progress;
+    JobGroup jobs(config.build_threads);
+    for (unsigned char i = 2; i <= counts.size(); ++i) {
+      jobs.Start(TrainOrder<Quant>(i, counts[i-1], i == counts.size(), inputs[i-2], shared, quant));
     }
-    TrainProbQuantizer(counts.size(), counts.back(), inputs[counts.size() - 2], progress, quant);
+    jobs.Wait();
+    if (shared != &progress) progress.Finished();
     quant.FinishedLoading(config);
   }
 
@@ -915,24 +1066,28 @@ template <class Quant, class Bhiksha> uint8_t *TrieSearch<Quant, Bhiksha>::Setup
   unigram.Init(start);
   start += Unigram::Size(counts[0]);
   FreeMiddles();
-  middle_begin_ = static_cast<Middle*>(malloc(sizeof(Middle) * (counts.size() - 2)));
-  middle_end_ = middle_begin_ + (counts.size() - 2);
-  std::vector<uint8_t*> middle_starts(counts.size() - 2);
-  for (unsigned char i = 2; i < counts.size(); ++i) {
+  const unsigned char middles = LoadedMiddles(counts, config);
+  middle_begin_ = static_cast<Middle*>(malloc(sizeof(Middle) * middles));
+  middle_end_ = middle_begin_ + middles;
+  std::vector<uint8_t*> middle_starts(middles);
+  for (unsigned char i = 2; i < middles + 2; ++i) {
     middle_starts[i-2] = start;
     start += Middle::Size(Quant::MiddleBits(config), counts[i-1], counts[0], counts[i], config);
   }
   // Crazy backwards thing so we initialize using pointers to ones that have already been initialized
-  for (unsigned char i = counts.size() - 1; i >= 2; --i) {
+  // (the next source is only written to while building, so when max_order
+  // leaves out the higher orders the last middle can point at the unused longest)
+  for (unsigned char i = middles + 1; i >= 2; --i) {
     new (middle_begin_ + i - 2) Middle(
         middle_starts[i-2],
         quant_.Mid(i),
         counts[i-1],
         counts[0],
         counts[i],
-        (i == counts.size() - 1) ? static_cast<const BitPacked&>(longest) : static_cast<const BitPacked &>(middle_begin_[i-1]),
+        (i == middles + 1) ? static_cast<const BitPacked&>(longest) : static_cast<const BitPacked &>(middle_begin_[i-1]),
         config);
   }
+  if (middles + 2 < counts.size()) return start;
   longest.Init(start, quant_.Long(counts.size()), counts[0]);
   return start + Longest::Size(Quant::LongestBits(config), counts.back(), counts[0]);
 }
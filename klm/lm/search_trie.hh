@@ -36,11 +36,16 @@ template <class Quant, class Bhiksha> class TrieSearch {
       Bhiksha::UpdateConfigFromBinary(fd, config);
     }
 
+    // The arrays are laid out by order, so with config.max_order below the
+    // order of the model this is the size of a prefix: that of the middles
+    // up to max_order, the last of which takes the place of longest.
     static std::size_t Size(const std::vector<uint64_t> &counts, const Config &config) {
       std::size_t ret = Quant::Size(counts.size(), config) + Unigram::Size(counts[0]);
-      for (unsigned char i = 1; i < counts.size() - 1; ++i) {
+      const unsigned char middles = LoadedMiddles(counts, config);
+      for (unsigned char i = 1; i <= middles; ++i) {
         ret += Middle::Size(Quant::MiddleBits(config), counts[i], counts[0], counts[i+1], config);
       }
+      if (middles + 2 < counts.size()) return ret;
       return ret + Longest::Size(Quant::LongestBits(config), counts.back(), counts[0]);
     }
 
@@ -73,6 +78,12 @@ template <class Quant, class Bhiksha> class TrieSearch {
       return longest.Find(word, prob, node);
     }
 
+    // Only the unigram can be prefetched: the location of each higher order
+    // entry depends on the result of the lookup before it.
+    void Prefetch(const WordIndex * /*context_rbegin*/, const WordIndex * /*context_rend*/, const WordIndex new_word) const {
+      unigram.Prefetch(new_word);
+    }
+
     bool FastMakeNode(const WordIndex *begin, const WordIndex *end, Node &node) const {
       // TODO: don't decode backoff.
       assert(begin != end);
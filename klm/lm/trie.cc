@@ -30,9 +30,16 @@ class KeyAccessor {
     const uint8_t key_bits_, total_bits_;
 };
 
+// Entries left when the search switches from interpolation to a scan.  The
+// packed keys are consecutive bits, so 8 of them span at most two cache lines.
+#ifndef KLM_TRIE_SCAN
+#define KLM_TRIE_SCAN 8
+#endif
+const std::size_t kTrieScan = KLM_TRIE_SCAN;
+
 bool FindBitPacked(const void *base, uint64_t key_mask, uint8_t key_bits, uint8_t total_bits, uint64_t begin_index, uint64_t end_index, const uint64_t max_vocab, const uint64_t key, uint64_t &at_index) {
   KeyAccessor accessor(base, key_mask, key_bits, total_bits);
-  if (!util::BoundedSortedUniformFind<uint64_t, KeyAccessor, util::PivotSelect<sizeof(WordIndex)>::T>(accessor, begin_index - 1, (uint64_t)0, end_index, max_vocab, key, at_index)) return false;
+  if (!util::BoundedSortedUniformFindScan<kTrieScan, uint64_t, KeyAccessor, util::PivotSelect<sizeof(WordIndex)>::T>(accessor, begin_index - 1, (uint64_t)0, end_index, max_vocab, key, at_index)) return false;
   return true;
 }
 } // namespace
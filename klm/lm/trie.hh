@@ -38,6 +38,12 @@ class Unigram {
     }
     
     const ProbBackoff &Lookup(WordIndex index) const { return unigram_[index].weights; }
+
+    void Prefetch(WordIndex index) const {
+#ifdef __GNUC__
+      __builtin_prefetch(unigram_ + index);
+#endif
+    }
     
     ProbBackoff &Unknown() { return unigram_[0].weights; }
 
@@ -2,12 +2,18 @@
 
 #include "util/exception.hh"
 
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <limits>
 
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <sys/mman.h>
@@ -42,7 +48,7 @@ const bool kSpaces[256] = {0,0,0,0,0,0,0,0,0,1,1,1,1,1,0,0,0,0,0,0,0,0,0,0,0,0,0
 
 int OpenReadOrThrow(const char *name) {
   int ret;
-  UTIL_THROW_IF(-1 == (ret = open(name, O_RDONLY)), ErrnoException, "while opening " << name);
+  UTIL_THROW_IF(-1 == (ret = OpenFileOrShared(name, O_RDONLY)), ErrnoException, "while opening " << name);
   return ret;
 }
 
@@ -52,19 +58,153 @@ off_t SizeFile(int fd) {
   return sb.st_size;
 }
 
+/* Reads the rest of a stream on its own thread into a ring of blocks, which
+ * Read hands to the parser in order.  The stream (fd, or gz if not NULL) is
+ * the thread's until it is destroyed.
+ */
+class FilePiece::Background {
+  public:
+    Background(int fd, void *gz, bool report_offset, std::size_t block_size, std::size_t buffers)
+      : fd_(fd), gz_(gz), report_offset_(report_offset), blocks_(std::max<std::size_t>(buffers, 2)),
+        front_(0), filled_(0), consumed_(0), stop_(false), done_(false), errno_(0) {
+      for (std::size_t i = 0; i < blocks_.size(); ++i) blocks_[i].data.resize(block_size);
+      thread_.reset(new boost::thread(boost::ref(*this)));
+    }
+
+    ~Background() {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        stop_ = true;
+      }
+      changed_.notify_all();
+      thread_->join();
+    }
+
+    // Copies up to amount bytes of input to to, waiting for some if there
+    // are none.  Returns 0 at the end of the input.  offset is the position
+    // in the underlying file the thread had reached, or -1 if unknown.  
+    std::size_t Read(char *to, std::size_t amount, off_t &offset) {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        while (!filled_ && !done_) changed_.wait(lock);
+        if (!filled_) {
+          if (!error_.empty()) {
+            errno = errno_;
+            UTIL_THROW(ErrnoException, error_);
+          }
+          return 0;
+        }
+      }
+      // The thread leaves blocks that are filled alone.
+      Block &block = blocks_[front_];
+      std::size_t copy = std::min(amount, block.size - consumed_);
+      memcpy(to, &block.data[consumed_], copy);
+      offset = block.offset;
+      if ((consumed_ += copy) == block.size) {
+        consumed_ = 0;
+        {
+          boost::mutex::scoped_lock lock(mutex_);
+          front_ = (front_ + 1) % blocks_.size();
+          --filled_;
+        }
+        changed_.notify_all();
+      }
+      return copy;
+    }
+
+    // The thread.
+    void operator()() {
+      while (true) {
+        std::size_t index;
+        {
+          boost::mutex::scoped_lock lock(mutex_);
+          while (filled_ == blocks_.size() && !stop_) changed_.wait(lock);
+          if (stop_) return;
+          index = (front_ + filled_) % blocks_.size();
+        }
+        Block &block = blocks_[index];
+        ssize_t got;
+#ifdef HAVE_ZLIB
+        got = gzread(gz_, &block.data[0], block.data.size());
+#else
+        got = read(fd_, &block.data[0], block.data.size());
+#endif
+        {
+          boost::mutex::scoped_lock lock(mutex_);
+          if (got <= 0) {
+            if (got == -1) {
+              errno_ = errno;
+#ifdef HAVE_ZLIB
+              int num;
+              error_ = std::string(gzerror(gz_, &num)) + " from zlib";
+#else
+              error_ = "read failed";
+#endif
+            }
+            done_ = true;
+          } else {
+            block.size = got;
+            block.offset = report_offset_ ? lseek(fd_, 0, SEEK_CUR) : -1;
+            ++filled_;
+          }
+        }
+        changed_.notify_all();
+        if (got <= 0) return;
+      }
+    }
+
+  private:
+    struct Block {
+      std::vector<char> data;
+      std::size_t size;
+      off_t offset;
+    };
+
+    const int fd_;
+    void *const gz_;
+    const bool report_offset_;
+
+    std::vector<Block> blocks_;
+
+    // Guarded by mutex_: blocks [front_, front_ + filled_) in the ring are
+    // filled and belong to the parser, the rest to the thread.  
+    std::size_t front_, filled_;
+    // Bytes of the front block already returned.  Parser only.
+    std::size_t consumed_;
+    bool stop_, done_;
+    int errno_;
+    std::string error_;
+
+    boost::mutex mutex_;
+    boost::condition_variable changed_;
+
+    boost::scoped_ptr<boost::thread> thread_;
+};
+
 FilePiece::FilePiece(const char *name, std::ostream *show_progress, off_t min_buffer) : 
-  file_(OpenReadOrThrow(name)), total_size_(SizeFile(file_.get())), page_(sysconf(_SC_PAGE_SIZE)),
+  file_(OpenReadOrThrow(name)), total_size_(SizeFile(file_.get())), page_(sysconf(_SC_PAGE_SIZE)), ranged_(false),
   progress_(total_size_ == kBadSize ? NULL : show_progress, std::string("Reading ") + name, total_size_) {
-  Initialize(name, show_progress, min_buffer);
+  Initialize(name, show_progress, min_buffer, 0);
 }
 
 FilePiece::FilePiece(int fd, const char *name, std::ostream *show_progress, off_t min_buffer)  : 
-  file_(fd), total_size_(SizeFile(file_.get())), page_(sysconf(_SC_PAGE_SIZE)),
+  file_(fd), total_size_(SizeFile(file_.get())), page_(sysconf(_SC_PAGE_SIZE)), ranged_(false),
   progress_(total_size_ == kBadSize ? NULL : show_progress, std::string("Reading ") + name, total_size_) {
-  Initialize(name, show_progress, min_buffer);
+  Initialize(name, show_progress, min_buffer, 0);
+}
+
+FilePiece::FilePiece(const char *name, off_t begin, off_t end, std::ostream *show_progress, off_t min_buffer) :
+  file_(OpenReadOrThrow(name)), total_size_(end), page_(sysconf(_SC_PAGE_SIZE)), ranged_(true),
+  progress_(show_progress, std::string("Reading ") + name, end) {
+  const off_t size = SizeFile(file_.get());
+  UTIL_THROW_IF(size == kBadSize, Exception, "Can only read parts of a normal file, which " << name << " isn't.");
+  UTIL_THROW_IF(begin > end || end > size, Exception, "Range [" << begin << ", " << end << ") is not in " << name << " of size " << size);
+  Initialize(name, show_progress, min_buffer, begin);
 }
 
 FilePiece::~FilePiece() {
+  // Before zlib gets the file back.
+  background_.reset();
 #ifdef HAVE_ZLIB
   if (gz_file_) {
     // zlib took ownership
@@ -110,17 +250,70 @@ unsigned long int FilePiece::ReadULong() {
   return ReadNumber<unsigned long int>();
 }
 
-void FilePiece::Initialize(const char *name, std::ostream *show_progress, off_t min_buffer)  {
+void FilePiece::ReadAhead(std::size_t buffers) {
+  read_ahead_ = true;
+  if (!fallback_to_read_ || at_end_ || background_.get()) return;
+#ifdef HAVE_ZLIB
+  void *gz = gz_file_;
+#else
+  void *gz = NULL;
+#endif
+  background_.reset(new Background(file_.get(), gz, total_size_ != kBadSize, std::min<std::size_t>(default_map_size_, 1 << 22), buffers));
+}
+
+std::vector<off_t> FilePiece::SplitLines(int fd, off_t begin, off_t end, std::size_t pieces) {
+  pieces = std::max<std::size_t>(pieces, 1);
+  std::vector<off_t> ret(1, begin);
+  char buf[65536];
+  for (std::size_t i = 1; i < pieces; ++i) {
+    // Start looking at the byte before the even split, so a line that ends
+    // right there is not skipped.
+    off_t at = std::max(begin + static_cast<off_t>((end - begin) * i / pieces), ret.back());
+    if (at == begin) {
+      ret.push_back(begin);
+      continue;
+    }
+    --at;
+    off_t boundary = end;
+    while (at < end) {
+      ssize_t got = pread(fd, buf, std::min<off_t>(sizeof(buf), end - at), at);
+      UTIL_THROW_IF(got <= 0, ErrnoException, "pread failed while splitting a file");
+      const char *newline = static_cast<const char*>(memchr(buf, '\n', got));
+      if (newline) {
+        boundary = at + (newline - buf) + 1;
+        break;
+      }
+      at += got;
+    }
+    ret.push_back(boundary);
+  }
+  ret.push_back(end);
+  return ret;
+}
+
+void FilePiece::Initialize(const char *name, std::ostream *show_progress, off_t min_buffer, off_t begin)  {
 #ifdef HAVE_ZLIB
   gz_file_ = NULL;
 #endif
   file_name_ = name;
+  read_ahead_ = false;
 
   default_map_size_ = page_ * std::max<off_t>((min_buffer / page_ + 1), 2);
   position_ = NULL;
   position_end_ = NULL;
-  mapped_offset_ = 0;
+  mapped_offset_ = begin;
   at_end_ = false;
+  fallback_to_read_ = false;
+
+  if (ranged_) {
+    // Nothing to map for an empty range.
+    if (begin == total_size_) {
+      at_end_ = true;
+    } else {
+      Shift();
+    }
+    return;
+  }
 
   if (total_size_ == kBadSize) {
     // So the assertion passes.  
@@ -244,6 +437,7 @@ void FilePiece::MMapShift(off_t desired_begin) {
 #endif
         , *file_, mapped_offset), mapped_size, scoped_memory::MMAP_ALLOCATED);
   if (data_.get() == MAP_FAILED) {
+    UTIL_THROW_IF(ranged_, ErrnoException, "mmap failed for part of " << file_name_);
     if (desired_begin) {
       if (((off_t)-1) == lseek(*file_, desired_begin, SEEK_SET)) UTIL_THROW(ErrnoException, "mmap failed even though it worked before.  lseek failed too, so using read isn't an option either.");
     }
@@ -256,6 +450,12 @@ void FilePiece::MMapShift(off_t desired_begin) {
   position_ = data_.begin() + ignore;
   position_end_ = data_.begin() + mapped_size;
 
+#ifdef POSIX_FADV_WILLNEED
+  // Get the next block into the page cache while this one is parsed.
+  if (read_ahead_ && !at_end_)
+    posix_fadvise(*file_, mapped_offset + mapped_size, default_map_size_, POSIX_FADV_WILLNEED);
+#endif
+
   progress_.Set(desired_begin);
 }
 
@@ -307,9 +507,23 @@ void FilePiece::ReadShift() {
     }
   }
 
+  std::size_t read_return = ReadMore(static_cast<char*>(data_.get()) + already_read, default_map_size_ - already_read);
+  if (read_return == 0) {
+    at_end_ = true;
+  }
+  position_end_ += read_return;
+}
+
+std::size_t FilePiece::ReadMore(char *to, std::size_t amount) {
+  if (background_.get()) {
+    off_t offset;
+    std::size_t ret = background_->Read(to, amount, offset);
+    if (offset != -1) progress_.Set(offset);
+    return ret;
+  }
   ssize_t read_return;
 #ifdef HAVE_ZLIB
-  read_return = gzread(gz_file_, static_cast<char*>(data_.get()) + already_read, default_map_size_ - already_read);
+  read_return = gzread(gz_file_, to, amount);
   if (read_return == -1) throw GZException(gz_file_);
   if (total_size_ != kBadSize) {
     // Just get the position, don't actually seek.  Apparently this is how you do it. . . 
@@ -317,14 +531,11 @@ void FilePiece::ReadShift() {
     if (ret != -1) progress_.Set(ret);
   }
 #else
-  read_return = read(file_.get(), static_cast<char*>(data_.get()) + already_read, default_map_size_ - already_read);
+  read_return = read(file_.get(), to, amount);
   UTIL_THROW_IF(read_return == -1, ErrnoException, "read failed");
   progress_.Set(mapped_offset_);
 #endif
-  if (read_return == 0) {
-    at_end_ = true;
-  }
-  position_end_ += read_return;
+  return read_return;
 }
 
 } // namespace util
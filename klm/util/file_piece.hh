@@ -8,7 +8,10 @@
 #include "util/scoped.hh"
 #include "util/string_piece.hh"
 
+#include <boost/scoped_ptr.hpp>
+
 #include <string>
+#include <vector>
 
 #include <cstddef>
 
@@ -48,8 +51,24 @@ class FilePiece {
     explicit FilePiece(const char *file, std::ostream *show_progress = NULL, off_t min_buffer = 33554432);
     // Takes ownership of fd.  name is used for messages.  
     explicit FilePiece(int fd, const char *name, std::ostream *show_progress = NULL, off_t min_buffer = 33554432);
+    // Bytes [begin, end) of a plain (mmapable, uncompressed) file, which
+    // ends there as far as the reader is concerned.  Offset() is still from
+    // the start of the file.  Several of these can parse one file at once,
+    // with ranges from SplitLines.
+    FilePiece(const char *file, off_t begin, off_t end, std::ostream *show_progress, off_t min_buffer = 33554432);
 
     ~FilePiece();
+
+    // Reads compressed files and streams on a second thread, which keeps
+    // up to buffers blocks of input decompressed ahead of the parser.  For
+    // mmapped files, asks the kernel to read the next block while this one
+    // is parsed.  Call before reading; the output doesn't change.
+    void ReadAhead(std::size_t buffers = 3);
+
+    // Boundaries dividing bytes [begin, end) of fd into at most pieces
+    // ranges that each start at begin or just after a newline.  The result
+    // starts with begin and ends with end; ranges may be empty.  
+    static std::vector<off_t> SplitLines(int fd, off_t begin, off_t end, std::size_t pieces);
      
     char get() { 
       if (position_ == position_end_) {
@@ -89,7 +108,7 @@ class FilePiece {
     const std::string &FileName() const { return file_name_; }
     
   private:
-    void Initialize(const char *name, std::ostream *show_progress, off_t min_buffer);
+    void Initialize(const char *name, std::ostream *show_progress, off_t min_buffer, off_t begin);
 
     template <class T> T ReadNumber();
 
@@ -107,12 +126,17 @@ class FilePiece {
 
     void TransitionToRead();
     void ReadShift();
+    // read() or gzread() into the buffer, on this thread or from background_.
+    std::size_t ReadMore(char *to, std::size_t amount);
 
     const char *position_, *last_space_, *position_end_;
 
     scoped_fd file_;
+    // For a range, its end.
     const off_t total_size_;
     const off_t page_;
+    // Constructed with a range.
+    const bool ranged_;
 
     size_t default_map_size_;
     off_t mapped_offset_;
@@ -130,6 +154,12 @@ class FilePiece {
 #ifdef HAVE_ZLIB
     void *gz_file_;
 #endif // HAVE_ZLIB
+
+    // Set by ReadAhead.
+    bool read_ahead_;
+    // The thread reading ahead in read mode, declared in file_piece.cc.
+    class Background;
+    boost::scoped_ptr<Background> background_;
 };
 
 } // namespace util
@@ -54,6 +54,29 @@ BOOST_AUTO_TEST_CASE(StreamReadLine) {
 }
 #endif // __APPLE__
 
+/* Pieces from SplitLines read back the whole file, line by line */
+BOOST_AUTO_TEST_CASE(SplitReadLine) {
+  for (std::size_t pieces = 1; pieces < 8; ++pieces) {
+    std::fstream ref("file_piece.cc", std::ios::in);
+    scoped_fd fd(OpenReadOrThrow("file_piece.cc"));
+    std::vector<off_t> bounds(FilePiece::SplitLines(fd.get(), 0, SizeFile(fd.get()), pieces));
+    BOOST_REQUIRE_EQUAL(pieces + 1, bounds.size());
+    BOOST_CHECK_EQUAL(0, bounds.front());
+    BOOST_CHECK_EQUAL(SizeFile(fd.get()), bounds.back());
+    std::string ref_line;
+    for (std::size_t i = 0; i < pieces; ++i) {
+      BOOST_REQUIRE(bounds[i] <= bounds[i + 1]);
+      FilePiece test("file_piece.cc", bounds[i], bounds[i + 1], NULL, 1);
+      while (test.Offset() < bounds[i + 1]) {
+        BOOST_REQUIRE(getline(ref, ref_line));
+        BOOST_CHECK_EQUAL(ref_line, test.ReadLine());
+      }
+      BOOST_CHECK_THROW(test.get(), EndOfFileException);
+    }
+    BOOST_CHECK(!getline(ref, ref_line));
+  }
+}
+
 #ifdef HAVE_ZLIB
 
 // gzip file
@@ -94,6 +117,26 @@ BOOST_AUTO_TEST_CASE(StreamZipReadLine) {
   BOOST_CHECK_THROW(test.get(), EndOfFileException);
   BOOST_REQUIRE(!pclose(catter));
 }
+
+/* Same, reading ahead on another thread */
+BOOST_AUTO_TEST_CASE(StreamZipReadAhead) {
+  std::fstream ref("file_piece.cc", std::ios::in);
+
+  FILE * catter = popen("gzip <file_piece.cc", "r");
+  BOOST_REQUIRE(catter);
+  
+  FilePiece test(dup(fileno(catter)), "file_piece.cc", NULL, 1);
+  test.ReadAhead();
+  std::string ref_line;
+  while (getline(ref, ref_line)) {
+    StringPiece test_line(test.ReadLine());
+    if (!test_line.empty() || !ref_line.empty()) {
+      BOOST_CHECK_EQUAL(ref_line, test_line);
+    }
+  }
+  BOOST_CHECK_THROW(test.get(), EndOfFileException);
+  BOOST_REQUIRE(!pclose(catter));
+}
 #endif // __APPLE__
 
 #endif // HAVE_ZLIB
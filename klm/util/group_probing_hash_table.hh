@@ -0,0 +1,157 @@
+#ifndef UTIL_GROUP_PROBING_HASH_TABLE__
+#define UTIL_GROUP_PROBING_HASH_TABLE__
+
+#include "util/exception.hh"
+#include "util/probing_hash_table.hh"
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+
+#include <assert.h>
+#include <inttypes.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace util {
+
+/* Same interface and the same restrictions as ProbingHashTable, but probes a
+ * group of kGroup buckets at a time.  Each bucket has a control byte: 0 means
+ * empty and otherwise the high bit is set and the low 7 bits are a tag taken
+ * from the top of the hash.  The control bytes of a group are compared with
+ * the tag in one SSE2 instruction, so only buckets whose tag matches have
+ * their key read.  A group with an empty bucket ends the search because
+ * nothing is ever deleted.
+ *
+ * Memory is all the control bytes followed by all the entries.  Zeroed memory
+ * is an empty table, so the invalid key is unused and any key may be stored.
+ */
+template <class PackingT, class HashT, class EqualT = std::equal_to<typename PackingT::Key> > class GroupProbingHashTable {
+  public:
+    typedef PackingT Packing;
+    typedef typename Packing::Key Key;
+    typedef typename Packing::MutableIterator MutableIterator;
+    typedef typename Packing::ConstIterator ConstIterator;
+
+    typedef HashT Hash;
+    typedef EqualT Equal;
+
+    static const std::size_t kGroup = 16;
+
+    static std::size_t Size(std::size_t entries, float multiplier) {
+      std::size_t buckets = std::max(entries + 1, static_cast<std::size_t>(multiplier * static_cast<float>(entries)));
+      return (buckets + kGroup - 1) / kGroup * kGroup * (Packing::kBytes + 1);
+    }
+
+    // Must be assigned to later.
+    GroupProbingHashTable() : entries_(0) {}
+
+    GroupProbingHashTable(void *start, std::size_t allocated, const Key & /*invalid*/ = Key(), const Hash &hash_func = Hash(), const Equal &equal_func = Equal())
+      : groups_(allocated / (kGroup * (Packing::kBytes + 1))),
+        control_(static_cast<uint8_t*>(start)),
+        begin_(Packing::FromVoid(control_ + groups_ * kGroup)),
+        hash_(hash_func),
+        equal_(equal_func),
+        entries_(0) {}
+
+    template <class T> void Insert(const T &t) {
+      if (++entries_ >= groups_ * kGroup)
+        UTIL_THROW(ProbingSizeException, "Hash table with " << (groups_ * kGroup) << " buckets is full.");
+      std::size_t hash = hash_(t.GetKey());
+      for (std::size_t group = hash % groups_;;) {
+        unsigned int empty = Match(control_ + group * kGroup, 0);
+        if (empty) {
+          std::size_t bucket = group * kGroup + FirstBit(empty);
+          control_[bucket] = Tag(hash);
+          *(begin_ + bucket) = t;
+          return;
+        }
+        if (++group == groups_) group = 0;
+      }
+    }
+
+    void FinishedInserting() {}
+
+    void LoadedBinary() {}
+
+    // Don't change anything related to GetKey,
+    template <class Key> bool UnsafeMutableFind(const Key key, MutableIterator &out) {
+      std::size_t bucket;
+      if (!FindBucket(key, bucket)) return false;
+      out = begin_ + bucket;
+      return true;
+    }
+
+    template <class Key> bool Find(const Key key, ConstIterator &out) const {
+      std::size_t bucket;
+      if (!FindBucket(key, bucket)) return false;
+      out = begin_ + bucket;
+      return true;
+    }
+
+    // Hint that Find(key) will be called soon: fetch the group it starts at.
+    template <class Key> void Prefetch(const Key key) const {
+#ifdef __GNUC__
+      std::size_t group = hash_(key) % groups_;
+      __builtin_prefetch(control_ + group * kGroup);
+      __builtin_prefetch(begin_ + group * kGroup);
+#endif
+    }
+
+  private:
+    template <class Key> bool FindBucket(const Key key, std::size_t &bucket) const {
+      std::size_t hash = hash_(key);
+      const uint8_t tag = Tag(hash);
+      for (std::size_t group = hash % groups_;;) {
+        const uint8_t *control = control_ + group * kGroup;
+        for (unsigned int match = Match(control, tag); match; match &= match - 1) {
+          bucket = group * kGroup + FirstBit(match);
+          if (equal_((begin_ + bucket)->GetKey(), key)) return true;
+        }
+        if (Match(control, 0)) return false;
+        if (++group == groups_) group = 0;
+      }
+    }
+
+    static uint8_t Tag(std::size_t hash) {
+      return 0x80 | static_cast<uint8_t>(hash >> (sizeof(std::size_t) * 8 - 7));
+    }
+
+    // Bit i is set if control[i] == value.
+    static unsigned int Match(const uint8_t *control, uint8_t value) {
+#ifdef __SSE2__
+      __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(control));
+      return static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(static_cast<char>(value)))));
+#else
+      unsigned int ret = 0;
+      for (unsigned int i = 0; i < kGroup; ++i) {
+        ret |= static_cast<unsigned int>(control[i] == value) << i;
+      }
+      return ret;
+#endif
+    }
+
+    // Index of the lowest set bit; mask must not be zero.
+    static unsigned int FirstBit(unsigned int mask) {
+#ifdef __GNUC__
+      return __builtin_ctz(mask);
+#else
+      unsigned int ret = 0;
+      for (; !(mask & 1); mask >>= 1) ++ret;
+      return ret;
+#endif
+    }
+
+    std::size_t groups_;
+    uint8_t *control_;
+    MutableIterator begin_;
+    Hash hash_;
+    Equal equal_;
+    std::size_t entries_;
+};
+
+} // namespace util
+
+#endif // UTIL_GROUP_PROBING_HASH_TABLE__
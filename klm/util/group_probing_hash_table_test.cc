@@ -0,0 +1,49 @@
+#include "util/group_probing_hash_table.hh"
+
+#include "util/key_value_packing.hh"
+
+#define BOOST_TEST_MODULE GroupProbingHashTableTest
+#include <boost/test/unit_test.hpp>
+#include <boost/functional/hash.hpp>
+
+#include <vector>
+
+namespace util {
+namespace {
+
+typedef AlignedPacking<uint64_t, uint64_t> Packing;
+typedef GroupProbingHashTable<Packing, boost::hash<uint64_t> > Table;
+
+BOOST_AUTO_TEST_CASE(simple) {
+  char mem[Table::Size(10, 1.2)];
+  memset(mem, 0, sizeof(mem));
+
+  Table table(mem, sizeof(mem));
+  Packing::ConstIterator i = Packing::ConstIterator();
+  BOOST_CHECK(!table.Find(2, i));
+  table.Insert(Packing::Make(3, 328920));
+  BOOST_REQUIRE(table.Find(3, i));
+  BOOST_CHECK_EQUAL(static_cast<uint64_t>(3), i->GetKey());
+  BOOST_CHECK_EQUAL(static_cast<uint64_t>(328920), i->GetValue());
+  BOOST_CHECK(!table.Find(2, i));
+  // Zero is an ordinary key.
+  table.Insert(Packing::Make(0, 7));
+  BOOST_REQUIRE(table.Find(0, i));
+  BOOST_CHECK_EQUAL(static_cast<uint64_t>(7), i->GetValue());
+}
+
+// Fill past one group so probes have to move on to the next.
+BOOST_AUTO_TEST_CASE(full_groups) {
+  std::vector<char> mem(Table::Size(100, 1.05));
+  Table table(&mem[0], mem.size());
+  for (uint64_t k = 0; k < 100; ++k) table.Insert(Packing::Make(k * 977, k));
+  Packing::ConstIterator i;
+  for (uint64_t k = 0; k < 100; ++k) {
+    BOOST_REQUIRE(table.Find(k * 977, i));
+    BOOST_CHECK_EQUAL(k, i->GetValue());
+  }
+  BOOST_CHECK(!table.Find(1, i));
+}
+
+} // namespace
+} // namespace util
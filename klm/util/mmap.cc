@@ -3,12 +3,14 @@
 #include "util/scoped.hh"
 
 #include <iostream>
+#include <string>
 
 #include <assert.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 namespace util {
@@ -88,29 +90,89 @@ const int kFileFlags =
 #endif
   ;
 
-void MapRead(LoadMethod method, int fd, off_t offset, std::size_t size, scoped_memory &out) {
+namespace {
+void Advise(void *start, std::size_t size, const MapAdvice &advice) {
+#ifdef MADV_HUGEPAGE
+  if (advice.huge_pages) madvise(start, size, MADV_HUGEPAGE);
+#endif
+#ifdef MADV_WILLNEED
+  if (advice.will_need) madvise(start, size, MADV_WILLNEED);
+#endif
+}
+
+// Fault in every page of a mapping now rather than during the first queries.
+void Prefault(const void *start, std::size_t size) {
+#ifdef MADV_POPULATE_READ
+  if (!madvise(const_cast<void*>(start), size, MADV_POPULATE_READ)) return;
+#endif
+  const long page = sysconf(_SC_PAGE_SIZE);
+  const volatile uint8_t *byte = static_cast<const uint8_t*>(start);
+  uint8_t sum = 0;
+  for (std::size_t i = 0; i < size; i += page) sum += byte[i];
+  (void)sum;
+}
+} // namespace
+
+const char *LoadMethodName(LoadMethod method) {
+  switch (method) {
+    case LAZY: return "lazy mmap";
+    case POPULATE_OR_LAZY: return "populated mmap or lazy mmap";
+#ifdef MAP_POPULATE
+    case POPULATE_OR_READ: return "populated mmap";
+#else
+    case POPULATE_OR_READ: return "read";
+#endif
+    case READ: return "read";
+  }
+  return "unknown";
+}
+
+void MapRead(LoadMethod method, int fd, off_t offset, std::size_t size, scoped_memory &out, const MapAdvice &advice) {
   switch (method) {
     case LAZY:
       out.reset(MapOrThrow(size, false, kFileFlags, false, fd, offset), size, scoped_memory::MMAP_ALLOCATED);
+      Advise(out.get(), size, advice);
       break;
     case POPULATE_OR_LAZY:
 #ifdef MAP_POPULATE
     case POPULATE_OR_READ:
 #endif
-      out.reset(MapOrThrow(size, false, kFileFlags, true, fd, offset), size, scoped_memory::MMAP_ALLOCATED);
+      if (advice.huge_pages) {
+        // MAP_POPULATE would fault in small pages before the advice is seen.
+        out.reset(MapOrThrow(size, false, kFileFlags, false, fd, offset), size, scoped_memory::MMAP_ALLOCATED);
+        Advise(out.get(), size, advice);
+        Prefault(out.get(), size);
+      } else {
+        out.reset(MapOrThrow(size, false, kFileFlags, true, fd, offset), size, scoped_memory::MMAP_ALLOCATED);
+        Advise(out.get(), size, advice);
+      }
       break;
 #ifndef MAP_POPULATE
     case POPULATE_OR_READ:
 #endif
     case READ:
-      out.reset(malloc(size), size, scoped_memory::MALLOC_ALLOCATED);
-      if (!out.get()) UTIL_THROW(util::ErrnoException, "Allocating " << size << " bytes with malloc");
+      if (advice.huge_pages) {
+        // anonymous memory is page aligned and eligible for huge pages; malloc may be neither.
+        out.reset(MapAnonymous(size), size, scoped_memory::MMAP_ALLOCATED);
+        MapAdvice huge;
+        huge.huge_pages = true;
+        Advise(out.get(), size, huge);
+      } else {
+        out.reset(malloc(size), size, scoped_memory::MALLOC_ALLOCATED);
+        if (!out.get()) UTIL_THROW(util::ErrnoException, "Allocating " << size << " bytes with malloc");
+      }
       if (-1 == lseek(fd, offset, SEEK_SET)) UTIL_THROW(ErrnoException, "lseek to " << offset << " in fd " << fd << " failed.");
       ReadAll(fd, out.get(), size);
       break;
   }
 }
 
+int OpenFileOrShared(const char *name, int flags, mode_t mode) {
+  if (!strncmp(name, "shm:", 4))
+    return shm_open((std::string("/") + (name + 4)).c_str(), flags, mode);
+  return open(name, flags, mode);
+}
+
 void *MapAnonymous(std::size_t size) {
   return MapOrThrow(size, true,
 #ifdef MAP_ANONYMOUS
@@ -122,7 +184,7 @@ void *MapAnonymous(std::size_t size) {
 }
 
 void *MapZeroedWrite(const char *name, std::size_t size, scoped_fd &file) {
-  file.reset(open(name, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+  file.reset(OpenFileOrShared(name, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
   if (-1 == file.get())
     UTIL_THROW(ErrnoException, "Failed to open " << name << " for writing");
   if (-1 == ftruncate(file.get(), size))
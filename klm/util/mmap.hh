@@ -91,12 +91,35 @@ typedef enum {
   READ
 } LoadMethod;
 
+// Human-readable name of a LoadMethod, for load reports.
+const char *LoadMethodName(LoadMethod method);
+
+// Paging hints for MapRead.  They are advisory: platforms without madvise
+// or the specific flag just ignore them.
+struct MapAdvice {
+  MapAdvice() : huge_pages(false), will_need(false) {}
+  // Ask for transparent huge pages (madvise MADV_HUGEPAGE) to cut TLB
+  // misses.  Most kernels only give huge pages to anonymous memory, so this
+  // is reliable with READ; on a file mapping it depends on page cache THP
+  // support.  When prefaulting, the mapping is populated after the advice.
+  bool huge_pages;
+  // madvise(MADV_WILLNEED) on the whole region so the kernel starts reading
+  // it in before the first lookups.  Mostly useful with LAZY.
+  bool will_need;
+};
+
 extern const int kFileFlags;
 
+// open(2), except that "shm:NAME" opens the POSIX shared memory object
+// "/NAME" instead of a file.  A binary model written to shm:NAME (e.g. by
+// build_binary) stays in memory until it is removed, and every process that
+// loads shm:NAME maps the same physical pages read-only.
+int OpenFileOrShared(const char *name, int flags, mode_t mode = 0);
+
 // Wrapper around mmap to check it worked and hide some platform macros.  
 void *MapOrThrow(std::size_t size, bool for_write, int flags, bool prefault, int fd, off_t offset = 0);
 
-void MapRead(LoadMethod method, int fd, off_t offset, std::size_t size, scoped_memory &out);
+void MapRead(LoadMethod method, int fd, off_t offset, std::size_t size, scoped_memory &out, const MapAdvice &advice = MapAdvice());
 
 void *MapAnonymous(std::size_t size);
 
@@ -99,6 +99,13 @@ template <class PackingT, class HashT, class EqualT = std::equal_to<typename Pac
       }    
     }
 
+    // Hint that Find(key) will be called soon: fetch the bucket it starts probing at.
+    template <class Key> void Prefetch(const Key key) const {
+#ifdef __GNUC__
+      __builtin_prefetch(begin_ + (hash_(key) % buckets_));
+#endif
+    }
+
   private:
     MutableIterator begin_;
     std::size_t buckets_;
@@ -84,6 +84,43 @@ template <class Iterator, class Accessor, class Pivot> bool BoundedSortedUniform
   return false;
 }
 
+// BoundedSortedUniformFind that stops interpolating once at most kScan
+// entries are left and finds key among them by counting the entries below
+// it.  The count has no data-dependent branches, and the entries are
+// adjacent in memory, so this is faster than the last few pivots, each of
+// which costs a division and a mispredicted branch.
+template <std::size_t kScan, class Iterator, class Accessor, class Pivot> bool BoundedSortedUniformFindScan(
+    const Accessor &accessor,
+    Iterator before_it, typename Accessor::Key before_v,
+    Iterator after_it, typename Accessor::Key after_v,
+    const typename Accessor::Key key, Iterator &out) {
+  while (after_it - before_it > static_cast<std::ptrdiff_t>(kScan + 1)) {
+    Iterator pivot(before_it + (1 + Pivot::Calc(key - before_v, after_v - before_v, after_it - before_it - 1)));
+    typename Accessor::Key mid(accessor(pivot));
+    if (mid < key) {
+      before_it = pivot;
+      before_v = mid;
+    } else if (mid > key) {
+      after_it = pivot;
+      after_v = mid;
+    } else {
+      out = pivot;
+      return true;
+    }
+  }
+  Iterator at(before_it + 1);
+  std::size_t below = 0;
+  for (Iterator i(at); i < after_it; ++i) {
+    below += (accessor(i) < key);
+  }
+  at += below;
+  if (at < after_it && accessor(at) == key) {
+    out = at;
+    return true;
+  }
+  return false;
+}
+
 template <class Iterator, class Accessor, class Pivot> bool SortedUniformFind(const Accessor &accessor, Iterator begin, Iterator end, const typename Accessor::Key key, Iterator &out) {
   if (begin == end) return false;
   typename Accessor::Key below(accessor(begin));
@@ -3,10 +3,15 @@
 #include <vector>
 #include <cassert>
 #include <cmath>
+#include <algorithm>
+#include <tr1/unordered_set>
 
 #include "config.h"
 
+#include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
 
@@ -24,6 +29,8 @@
 #include "weights.h"
 #include "sparse_vector.h"
 #include "sampler.h"
+#include "null_deleter.h"
+#include "murmur_hash.h"
 
 using namespace std;
 using boost::shared_ptr;
@@ -85,6 +92,10 @@ bool InitCommandLine(int argc, char** argv, po::variables_map* conf) {
         ("mt_metric_scale,s", po::value<double>()->default_value(1.0), "Amount to scale MT loss function by")
         ("k_best_size,k", po::value<int>()->default_value(250), "Size of hypothesis list to search for oracles")
         ("random_seed,S", po::value<uint32_t>(), "Random seed (if not specified, /dev/random will be used)")
+        ("threads,j", po::value<int>()->default_value(1), "Number of decoding threads (each with its own decoder); more than one decodes the sentences in mini-batches")
+        ("batch_size,b", po::value<int>(), "Number of sentences per mini-batch (default: the number of threads); the weights change only between mini-batches")
+        ("decode_every,D", po::value<int>()->default_value(1), "Decode the sentences only every D-th pass; the passes in between choose the oracles and the best hypothesis from the distinct hypotheses of all the sentence's k-best lists so far, re-ranked under the current weights")
+        ("parameter_mixing,M", "Instead of averaging the updates of a mini-batch, let each thread update its own copy of the weights through its share of the batch, and average the copies (iterative parameter mixing)")
         ("decoder_config,c",po::value<string>(),"Decoder configuration file");
   po::options_description clo("Command line options");
   clo.add_options()
@@ -120,10 +131,35 @@ struct GoodBadOracle {
   shared_ptr<HypothesisInfo> bad;
 };
 
+// every distinct hypothesis (by feature vector) that the k-best lists of a
+// sentence have had, with its MT metric, so a pass that doesn't decode can
+// re-rank them under its weights
+struct HypothesisPool {
+  vector<shared_ptr<HypothesisInfo> > hyps;
+  tr1::unordered_set<uint64_t> seen;  // Hash() of the features of hyps
+
+  static uint64_t Hash(const SparseVector<double>& feats) {
+    uint64_t h = 0;
+    for (SparseVector<double>::const_iterator it = feats.begin(); it != feats.end(); ++it)
+      if (it->second) h += MurmurHash64(&it->second, sizeof(double), it->first);
+    return h;
+  }
+
+  void Add(const SparseVector<double>& feats, double score) {
+    if (!seen.insert(Hash(feats)).second) return;
+    shared_ptr<HypothesisInfo> h(new HypothesisInfo);
+    h->features = feats;
+    h->mt_metric = score;
+    hyps.push_back(h);
+  }
+};
+
 struct TrainingObserver : public DecoderObserver {
-  TrainingObserver(const int k, const DocScorer& d, vector<GoodBadOracle>* o) : ds(d), oracles(*o), kbest_size(k) {}
+  TrainingObserver(const int k, const DocScorer& d, vector<GoodBadOracle>* o, vector<HypothesisPool>* p) :
+      ds(d), oracles(*o), pools(p), kbest_size(k) {}
   const DocScorer& ds;
   vector<GoodBadOracle>& oracles;
+  vector<HypothesisPool>* pools;  // NULL unless some passes don't decode
   shared_ptr<HypothesisInfo> cur_best;
   const int kbest_size;
 
@@ -146,13 +182,23 @@ struct TrainingObserver : public DecoderObserver {
     shared_ptr<HypothesisInfo>& cur_good = oracles[sent_id].good;
     shared_ptr<HypothesisInfo>& cur_bad = oracles[sent_id].bad;
     cur_bad.reset();  // TODO get rid of??
-    KBest::KBestDerivations<vector<WordID>, ESentenceTraversal> kbest(forest, kbest_size);
+    typedef KBest::KBestDerivations<vector<WordID>, ESentenceTraversal> K;
+    K kbest(forest, kbest_size);
+    vector<const K::Derivation*> derivs;
+    vector<const vector<WordID>*> yields;
     for (int i = 0; i < kbest_size; ++i) {
-      const KBest::KBestDerivations<vector<WordID>, ESentenceTraversal>::Derivation* d =
-        kbest.LazyKthBest(forest.nodes_.size() - 1, i);
+      const K::Derivation* d = kbest.LazyKthBest(forest.nodes_.size() - 1, i);
       if (!d) break;
-      float sentscore = ds[sent_id]->ScoreCandidate(d->yield)->ComputeScore();
+      derivs.push_back(d);
+      yields.push_back(&d->yield);
+    }
+    vector<ScoreP> scores;
+    ds[sent_id]->ScoreCandidates(yields, &scores);
+    for (int i = 0; i < derivs.size(); ++i) {
+      const K::Derivation* d = derivs[i];
+      float sentscore = scores[i]->ComputeScore();
       if (invert_score) sentscore *= -1.0;
+      if (pools) (*pools)[sent_id].Add(d->feature_values, sentscore);
       // cerr << TD::GetString(d->yield) << " ||| " << d->score << " ||| " << sentscore << endl;
       if (i == 0)
         cur_best = MakeHypothesisInfo(d->feature_values, sentscore);
@@ -165,6 +211,27 @@ struct TrainingObserver : public DecoderObserver {
     //cerr << " CUR: " << cur_best->mt_metric << endl;
     //cerr << " BAD: " << cur_bad->mt_metric << endl;
   }
+
+  // as UpdateOracles, with the kbest_size hypotheses of the pool that score
+  // best under the weights w as the k-best list
+  void RerankPool(int sent_id, const vector<double>& w) {
+    const vector<shared_ptr<HypothesisInfo> >& hyps = (*pools)[sent_id].hyps;
+    assert(!hyps.empty());
+    vector<pair<double, int> > ranked(hyps.size());
+    for (int i = 0; i < hyps.size(); ++i)
+      ranked[i] = make_pair(-hyps[i]->features.dot(w), i);
+    const int k = min<int>(kbest_size, ranked.size());
+    partial_sort(ranked.begin(), ranked.begin() + k, ranked.end());
+    shared_ptr<HypothesisInfo>& cur_good = oracles[sent_id].good;
+    shared_ptr<HypothesisInfo>& cur_bad = oracles[sent_id].bad;
+    cur_bad.reset();
+    for (int i = 0; i < k; ++i) {
+      const shared_ptr<HypothesisInfo>& h = hyps[ranked[i].second];
+      if (i == 0) cur_best = h;
+      if (!cur_good || h->mt_metric > cur_good->mt_metric) cur_good = h;
+      if (!cur_bad || h->mt_metric < cur_bad->mt_metric) cur_bad = h;
+    }
+  }
 };
 
 void ReadTrainingCorpus(const string& fname, vector<string>* c) {
@@ -183,6 +250,151 @@ bool ApproxEqual(double a, double b) {
   return (fabs(a-b)/fabs(b)) < 0.000001;
 }
 
+// adds the MIRA update for a sentence decoded with weights w to *update,
+// unless the best hypothesis already is as good as the oracle or the
+// margin is large enough; returns the MT metric of the best hypothesis
+double MiraUpdate(const HypothesisInfo& cur_hyp,
+                  const GoodBadOracle& oracle,
+                  const vector<double>& w,
+                  double mt_metric_scale,
+                  double max_step_size,
+                  SparseVector<double>* update) {
+  const HypothesisInfo& cur_good = *oracle.good;
+  const HypothesisInfo& cur_bad = *oracle.bad;
+  if (!ApproxEqual(cur_hyp.mt_metric, cur_good.mt_metric)) {
+    const double loss = cur_bad.features.dot(w) - cur_good.features.dot(w) +
+        mt_metric_scale * (cur_good.mt_metric - cur_bad.mt_metric);
+    //cerr << "LOSS: " << loss << endl;
+    if (loss > 0.0) {
+      SparseVector<double> diff = cur_good.features;
+      diff -= cur_bad.features;
+      double step_size = loss / diff.l2norm_sq();
+      //cerr << loss << " " << step_size << " " << diff << endl;
+      if (step_size > max_step_size) step_size = max_step_size;
+      *update += (cur_good.features * step_size);
+      *update -= (cur_bad.features * step_size);
+      //cerr << "L: " << *update << endl;
+    }
+  }
+  return cur_hyp.mt_metric;
+}
+
+// decodes the sentences of a mini-batch on one thread per decoder, all
+// starting from the same weights (which the decoders must already have), or
+// re-ranks their hypothesis pools instead.
+// Without parameter mixing, the sentences go to whichever thread is free,
+// and their updates are averaged (in batch order, so the result does not
+// depend on the number of threads); with it, each thread takes every
+// threads-th sentence of the batch, updates its own copy of the weights
+// after each of them, and the copies are averaged.
+class BatchDecoding {
+ public:
+  BatchDecoding(const vector<string>& corpus,
+                const vector<int>& order,
+                const vector<GoodBadOracle>& oracles,
+                const vector<boost::shared_ptr<Decoder> >& decoders,
+                const vector<boost::shared_ptr<TrainingObserver> >& observers,
+                double mt_metric_scale,
+                double max_step_size,
+                bool mixing) :
+      corpus_(corpus), order_(order), oracles_(oracles), decoders_(decoders), observers_(observers),
+      mt_metric_scale_(mt_metric_scale), max_step_size_(max_step_size), mixing_(mixing) {}
+
+  // decodes (or re-ranks) order[begin, begin + n) and updates *lambdas
+  // (dense_weights are the same weights); returns the sum of the MT metric
+  // of the 1-bests
+  double Run(int begin, int n, bool decode, const vector<double>& dense_weights, SparseVector<double>* lambdas) {
+    begin_ = begin;
+    decode_ = decode;
+    next_ = 0;
+    dense_weights_ = &dense_weights;
+    metric_.assign(n, 0.0);
+    const int threads = decoders_.size();
+    if (mixing_) {
+      copies_.assign(min(threads, n), *lambdas);
+    } else {
+      updates_.clear();
+      updates_.resize(n);
+    }
+    if (threads == 1) {
+      RunThread(0);
+    } else {
+      boost::thread_group workers;
+      for (int t = 0; t < threads; ++t)
+        workers.create_thread(boost::bind(&BatchDecoding::RunThread, this, t));
+      workers.join_all();
+    }
+    SparseVector<double> sum;
+    const vector<SparseVector<double> >& parts = mixing_ ? copies_ : updates_;
+    for (int i = 0; i < parts.size(); ++i)
+      sum += parts[i];
+    sum /= static_cast<double>(parts.size());
+    if (mixing_) *lambdas = sum; else *lambdas += sum;
+    double tot = 0;
+    for (int i = 0; i < n; ++i) tot += metric_[i];
+    return tot;
+  }
+
+ private:
+  bool NextSentence(int t, int* i) {
+    if (mixing_) {
+      *i = (*i < 0) ? t : *i + decoders_.size();
+      return *i < metric_.size();
+    }
+    boost::mutex::scoped_lock l(mutex_);
+    if (next_ == metric_.size()) return false;
+    *i = next_++;
+    return true;
+  }
+
+  void RunThread(int t) {
+    Decoder& decoder = *decoders_[t];
+    TrainingObserver& observer = *observers_[t];
+    vector<double> w;
+    const vector<double>* cur_weights = dense_weights_;
+    int i = -1;
+    while (NextSentence(t, &i)) {
+      const int sent_id = order_[begin_ + i];
+      if (decode_) {
+        decoder.SetId(sent_id);
+        decoder.Decode(corpus_[sent_id], &observer);  // update oracles
+      } else {
+        observer.RerankPool(sent_id, *cur_weights);
+      }
+      SparseVector<double>* update = mixing_ ? &copies_[t] : &updates_[i];
+      metric_[i] = MiraUpdate(observer.GetCurrentBestHypothesis(), oracles_[sent_id], *cur_weights,
+                              mt_metric_scale_, max_step_size_, update);
+      if (mixing_) {
+        Weights weights;
+        weights.InitFromVector(*update);
+        w.clear();
+        weights.InitVector(&w);
+        decoder.SetWeights(w);
+        cur_weights = &w;
+      }
+    }
+  }
+
+  const vector<string>& corpus_;
+  const vector<int>& order_;
+  const vector<GoodBadOracle>& oracles_;
+  const vector<boost::shared_ptr<Decoder> >& decoders_;
+  const vector<boost::shared_ptr<TrainingObserver> >& observers_;
+  const double mt_metric_scale_;
+  const double max_step_size_;
+  const bool mixing_;
+
+  // the current Run()
+  int begin_;
+  bool decode_;
+  int next_;
+  const vector<double>* dense_weights_;
+  vector<double> metric_;
+  vector<SparseVector<double> > updates_;  // of each sentence
+  vector<SparseVector<double> > copies_;   // of the weights, of each thread
+  boost::mutex mutex_;
+};
+
 int main(int argc, char** argv) {
   register_feature_functions();
   SetSilent(true);  // turn off verbose decoder output
@@ -219,11 +431,35 @@ int main(int argc, char** argv) {
   Decoder decoder(ini_rf.stream());
   const double max_step_size = conf["max_step_size"].as<double>();
   const double mt_metric_scale = conf["mt_metric_scale"].as<double>();
+  const int threads = conf["threads"].as<int>();
+  const int batch_size = conf.count("batch_size") ? conf["batch_size"].as<int>() : threads;
+  const bool mixing = conf.count("parameter_mixing");
+  const int decode_every = conf["decode_every"].as<int>();
+  if (threads < 1 || batch_size < 1) {
+    cerr << "Bad number of threads (" << threads << ") or mini-batch size (" << batch_size << ")\n";
+    return 1;
+  }
+  if (decode_every < 1) {
+    cerr << "Bad --decode_every (" << decode_every << ")\n";
+    return 1;
+  }
 
   assert(corpus.size() > 0);
   vector<GoodBadOracle> oracles(corpus.size());
+  vector<HypothesisPool> pools(decode_every > 1 ? corpus.size() : 0);
+  vector<HypothesisPool>* ppools = decode_every > 1 ? &pools : NULL;
 
-  TrainingObserver observer(conf["k_best_size"].as<int>(), ds, &oracles);
+  TrainingObserver observer(conf["k_best_size"].as<int>(), ds, &oracles, ppools);
+  vector<boost::shared_ptr<Decoder> > decoders(1, boost::shared_ptr<Decoder>(&decoder, null_deleter()));
+  vector<boost::shared_ptr<TrainingObserver> > observers(1, boost::shared_ptr<TrainingObserver>(&observer, null_deleter()));
+  for (int i = 1; i < threads; ++i) {
+    ReadFile rf(conf["decoder_config"].as<string>());
+    decoders.push_back(boost::shared_ptr<Decoder>(new Decoder(rf.stream())));
+    observers.push_back(boost::shared_ptr<TrainingObserver>(new TrainingObserver(conf["k_best_size"].as<int>(), ds, &oracles, ppools)));
+  }
+  if (batch_size > 1 || mixing)
+    cerr << "Mini-batches of " << batch_size << " sentences on " << threads << " threads, "
+         << (mixing ? "mixing the weights of each thread" : "averaging their updates") << endl;
   int cur_sent = 0;
   int lcount = 0;
   int normalizer = 0;
@@ -239,11 +475,13 @@ int main(int argc, char** argv) {
   string msga = "# MIRA tuned weights AVERAGED";
   vector<int> order;
   RandomPermutation(corpus.size(), &order);
+  BatchDecoding batch(corpus, order, oracles, decoders, observers, mt_metric_scale, max_step_size, mixing);
   while (lcount <= max_iteration) {
     dense_weights.clear();
     weights.InitFromVector(lambdas);
     weights.InitVector(&dense_weights);
-    decoder.SetWeights(dense_weights);
+    for (int i = 0; i < decoders.size(); ++i)
+      decoders[i]->SetWeights(dense_weights);
     if ((cur_sent * 40 / corpus.size()) > dots) { ++dots; cerr << '.'; }
     if (corpus.size() == cur_sent) {
       cerr << " [AVG METRIC LAST PASS=" << (tot_loss / corpus.size()) << "]\n";
@@ -264,34 +502,28 @@ int main(int argc, char** argv) {
       ++cur_pass;
       RandomPermutation(corpus.size(), &order);
     }
+    const bool decode = (cur_pass % decode_every == 0);
     if (cur_sent == 0) {
-      cerr << "PASS " << (lcount / corpus.size() + 1) << endl;
+      cerr << "PASS " << (lcount / corpus.size() + 1) << (decode ? "" : " (re-ranking the hypothesis pools)") << endl;
     }
-    decoder.SetId(order[cur_sent]);
-    decoder.Decode(corpus[order[cur_sent]], &observer);  // update oracles
-    const HypothesisInfo& cur_hyp = observer.GetCurrentBestHypothesis();
-    const HypothesisInfo& cur_good = *oracles[order[cur_sent]].good;
-    const HypothesisInfo& cur_bad = *oracles[order[cur_sent]].bad;
-    tot_loss += cur_hyp.mt_metric;
-    if (!ApproxEqual(cur_hyp.mt_metric, cur_good.mt_metric)) {
-      const double loss = cur_bad.features.dot(dense_weights) - cur_good.features.dot(dense_weights) +
-          mt_metric_scale * (cur_good.mt_metric - cur_bad.mt_metric);
-      //cerr << "LOSS: " << loss << endl;
-      if (loss > 0.0) {
-        SparseVector<double> diff = cur_good.features;
-        diff -= cur_bad.features;
-        double step_size = loss / diff.l2norm_sq();
-        //cerr << loss << " " << step_size << " " << diff << endl;
-        if (step_size > max_step_size) step_size = max_step_size;
-        lambdas += (cur_good.features * step_size);
-        lambdas -= (cur_bad.features * step_size);
-        //cerr << "L: " << lambdas << endl;
+    const int n = min<int>(batch_size, corpus.size() - cur_sent);
+    if (n == 1 && !mixing) {
+      if (decode) {
+        decoder.SetId(order[cur_sent]);
+        decoder.Decode(corpus[order[cur_sent]], &observer);  // update oracles
+      } else {
+        observer.RerankPool(order[cur_sent], dense_weights);
       }
+      tot_loss += MiraUpdate(observer.GetCurrentBestHypothesis(), oracles[order[cur_sent]], dense_weights,
+                             mt_metric_scale, max_step_size, &lambdas);
+      tot += lambdas;
+    } else {
+      tot_loss += batch.Run(cur_sent, n, decode, dense_weights, &lambdas);
+      tot += lambdas * static_cast<double>(n);  // each sentence of the batch counts
     }
-    tot += lambdas;
-    ++normalizer;
-    ++lcount;
-    ++cur_sent;
+    normalizer += n;
+    lcount += n;
+    cur_sent += n;
   }
   cerr << endl;
   weights.WriteToFile("weights.mira-final.gz", true, &msg);
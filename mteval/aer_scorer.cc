@@ -1,5 +1,6 @@
 #include "aer_scorer.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cassert>
 #include <sstream>
@@ -85,42 +86,66 @@ AERScorer::AERScorer(const vector<vector<WordID> >& refs, const string& src) : s
     cerr << "AERScorer can only take a single reference!\n";
     abort();
   }
-  ref_ = AlignmentPharaoh::ReadPharaohAlignmentGrid(TD::GetString(refs.front()));
+  vector<AlignmentPharaoh::Link> links;
+  AlignmentPharaoh::ReadPharaohAlignmentLinks(TD::GetString(refs.front()), &links, &i_len_, &j_len_);
+  words_per_row_ = (j_len_ + 63) / 64;
+  ref_bits_.resize(i_len_ * words_per_row_);
+  num_in_ref_ = 0;
+  for (unsigned k = 0; k < links.size(); ++k) {
+    uint64_t& word = ref_bits_[links[k].first * words_per_row_ + links[k].second / 64];
+    const uint64_t bit = uint64_t(1) << (links[k].second % 64);
+    if (!(word & bit)) ++num_in_ref_;
+    word |= bit;
+  }
 }
 
-static inline bool Safe(const Array2D<bool>& a, int i, int j) {
-  if (i >= 0 && j >= 0 && i < a.width() && j < a.height())
-    return a(i,j);
-  else
-    return false;
+// "i-j" -> i, j; false if it isn't a link
+static bool ParseLink(const char* s, int* i, int* j) {
+  if (*s < '0' || *s > '9') return false;
+  for (*i = 0; *s >= '0' && *s <= '9'; ++s) *i = *i * 10 + (*s - '0');
+  if (*s++ != '-' || *s < '0' || *s > '9') return false;
+  for (*j = 0; *s >= '0' && *s <= '9'; ++s) *j = *j * 10 + (*s - '0');
+  return *s == 0;
 }
 
 ScoreP AERScorer::ScoreCCandidate(const vector<WordID>& shyp) const {
   return ScoreP();
 }
 
+// the links of shyp (after the last |||, if any) that fall in the
+// reference's grid go in a bitset like ref_bits_, so the matches are a
+// popcount of the AND; the few outside it only count as predicted
 ScoreP AERScorer::ScoreCandidate(const vector<WordID>& shyp) const {
-  boost::shared_ptr<Array2D<bool> > hyp =
-    AlignmentPharaoh::ReadPharaohAlignmentGrid(TD::GetString(shyp));
+  static const WordID kBAR = TD::Convert("|||");
+  unsigned start = 0;
+  for (unsigned k = 0; k < shyp.size(); ++k)
+    if (shyp[k] == kBAR) start = k + 1;
 
-  int m = 0;
-  int r = 0;
-  int p = 0;
-  int i_len = ref_->width();
-  int j_len = ref_->height();
-  for (int i = 0; i < i_len; ++i) {
-    for (int j = 0; j < j_len; ++j) {
-      if ((*ref_)(i,j)) {
-        ++r;
-        if (Safe(*hyp, i, j)) ++m;
-      }
+  vector<uint64_t> hyp(ref_bits_.size());
+  vector<pair<int, int> > outside;
+  for (unsigned k = start; k < shyp.size(); ++k) {
+    int i, j;
+    if (!ParseLink(TD::Convert(shyp[k]), &i, &j)) {
+      cerr << "BAD ALIGNMENT: " << TD::GetString(shyp) << endl;
+      abort();
     }
+    if (i < i_len_ && j < j_len_)
+      hyp[i * words_per_row_ + j / 64] |= uint64_t(1) << (j % 64);
+    else
+      outside.push_back(make_pair(i, j));
   }
-  for (int i = 0; i < hyp->width(); ++i)
-    for (int j = 0; j < hyp->height(); ++j)
-      if ((*hyp)(i,j)) ++p;
 
-  return ScoreP(new AERScore(m,p,r));
+  int m = 0;
+  int p = 0;
+  for (unsigned k = 0; k < hyp.size(); ++k) {
+    p += __builtin_popcountll(hyp[k]);
+    m += __builtin_popcountll(hyp[k] & ref_bits_[k]);
+  }
+  if (!outside.empty()) {
+    sort(outside.begin(), outside.end());
+    p += unique(outside.begin(), outside.end()) - outside.begin();
+  }
+  return ScoreP(new AERScore(m, p, num_in_ref_));
 }
 
 ScoreP AERScorer::ScoreFromString(const string& in) {
@@ -1,10 +1,10 @@
 #ifndef _AER_SCORER_
 #define _AER_SCORER_
 
-#include <boost/shared_ptr.hpp>
+#include <vector>
+#include <stdint.h>
 
 #include "scorer.h"
-#include "array2d.h"
 
 class AERScorer : public SentenceScorer {
  public:
@@ -17,7 +17,11 @@ class AERScorer : public SentenceScorer {
   const std::string* GetSource() const;
  private:
   std::string src_;
-  boost::shared_ptr<Array2D<bool> > ref_;
+  // the reference's links as a bitset over its (i, j) grid: row i takes
+  // words_per_row_ words, link (i, j) is bit j % 64 of word j / 64
+  int i_len_, j_len_, words_per_row_;
+  std::vector<uint64_t> ref_bits_;
+  int num_in_ref_;
 };
 
 #endif
@@ -0,0 +1,46 @@
+#ifndef _BLEU_STATS_H_
+#define _BLEU_STATS_H_
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+// the sufficient statistics of a BLEUScore (up to 4-grams) as a plain value,
+// for code that adds up many of them without going through Score's virtual
+// functions and heap allocated copies (see LineOptimizer).  They are padded
+// to a multiple of 4 floats, so adding two is three SSE additions.  The
+// arithmetic is the same float arithmetic BLEUScore does, so the scores are
+// exactly the same.
+struct BLEUStats {
+  enum { kMaxOrder = 4, kSize = 12 };
+  BLEUStats() {
+    for (int i = 0; i < kSize; ++i) v[i] = 0;
+  }
+
+  float& correct(int i) { return v[i]; }                // matched i+1-grams
+  float& hyp(int i) { return v[kMaxOrder + i]; }        // i+1-grams in the hypothesis
+  float& ref_len() { return v[2 * kMaxOrder]; }
+  float& hyp_len() { return v[2 * kMaxOrder + 1]; }
+  float correct(int i) const { return v[i]; }
+  float hyp(int i) const { return v[kMaxOrder + i]; }
+  float ref_len() const { return v[2 * kMaxOrder]; }
+  float hyp_len() const { return v[2 * kMaxOrder + 1]; }
+
+  BLEUStats& operator+=(const BLEUStats& other) {
+#ifdef __SSE__
+    for (int i = 0; i < kSize; i += 4)
+      _mm_storeu_ps(&v[i], _mm_add_ps(_mm_loadu_ps(&v[i]), _mm_loadu_ps(&other.v[i])));
+#else
+    for (int i = 0; i < kSize; ++i) v[i] += other.v[i];
+#endif
+    return *this;
+  }
+
+  // what BLEUScore::ComputeScore() gives for these statistics of n-grams up
+  // to order n
+  float ComputeScore(int n) const;
+
+  float v[kSize];
+};
+
+#endif
@@ -1,77 +1,93 @@
 #include "comb_scorer.h"
 
 #include <cstdio>
+#include <sstream>
+
+#include "bleu_stats.h"
+#include "ter.h"
 
 using namespace std;
 
 class BLEUTERCombinationScore : public ScoreBase<BLEUTERCombinationScore> {
   friend class BLEUTERCombinationScorer;
  public:
-  ~BLEUTERCombinationScore();
+  // the BLEUStats (up to 4-grams) first, then the TER statistics in the
+  // order of TERScorer::ComputeStats
+  enum { kTER = BLEUStats::kSize,
+         kUSED = kTER + TERScorer::kNUM_STATS,
+         kSize = (kUSED + 3) / 4 * 4 };
+
+  BLEUTERCombinationScore() {
+    for (int i = 0; i < kSize; ++i) v[i] = 0;
+  }
   float ComputePartialScore() const { return 0.0;}
   float ComputeScore() const {
-    return (bleu->ComputeScore() - ter->ComputeScore()) / 2.0f;
+    return (BLEU() - TER()) / 2.0f;
   }
   void ScoreDetails(string* details) const {
     char buf[160];
     sprintf(buf, "Combi = %.2f, BLEU = %.2f, TER = %.2f",
-      ComputeScore()*100.0f, bleu->ComputeScore()*100.0f, ter->ComputeScore()*100.0f);
+      ComputeScore()*100.0f, BLEU()*100.0f, TER()*100.0f);
     *details = buf;
   }
   void PlusPartialEquals(const Score& rhs, int oracle_e_cover, int oracle_f_cover, int src_len){}
 
   void PlusEquals(const Score& delta, const float scale) {
-    bleu->PlusEquals(*static_cast<const BLEUTERCombinationScore&>(delta).bleu, scale);
-    ter->PlusEquals(*static_cast<const BLEUTERCombinationScore&>(delta).ter, scale);
+    const float* d = static_cast<const BLEUTERCombinationScore&>(delta).v;
+    for (int i = 0; i < kSize; ++i) v[i] += d[i] * scale;
   }
   void PlusEquals(const Score& delta) {
-    bleu->PlusEquals(*static_cast<const BLEUTERCombinationScore&>(delta).bleu);
-    ter->PlusEquals(*static_cast<const BLEUTERCombinationScore&>(delta).ter);
+    const float* d = static_cast<const BLEUTERCombinationScore&>(delta).v;
+    for (int i = 0; i < kSize; ++i) v[i] += d[i];
   }
 
-
-
+  // BLEU's one has all the n-gram counts and lengths at 1, TER's is zero
   ScoreP GetOne() const {
     BLEUTERCombinationScore* res = new BLEUTERCombinationScore;
-    res->bleu = bleu->GetOne();
-    res->ter = ter->GetOne();
+    for (int i = 0; i < BLEUStats::kSize; ++i) res->v[i] = 1;
     return ScoreP(res);
   }
   ScoreP GetZero() const {
-    BLEUTERCombinationScore* res = new BLEUTERCombinationScore;
-    res->bleu = bleu->GetZero();
-    res->ter = ter->GetZero();
-    return ScoreP(res);
+    return ScoreP(new BLEUTERCombinationScore);
   }
   void Subtract(const Score& rhs, Score* res) const {
-    bleu->Subtract(*static_cast<const BLEUTERCombinationScore&>(rhs).bleu,
-                   static_cast<BLEUTERCombinationScore*>(res)->bleu.get());
-    ter->Subtract(*static_cast<const BLEUTERCombinationScore&>(rhs).ter,
-                  static_cast<BLEUTERCombinationScore*>(res)->ter.get());
+    const float* r = static_cast<const BLEUTERCombinationScore&>(rhs).v;
+    float* o = static_cast<BLEUTERCombinationScore*>(res)->v;
+    for (int i = 0; i < kSize; ++i) o[i] = v[i] - r[i];
   }
   void Encode(std::string* out) const {
-    string bs, ts;
-    bleu->Encode(&bs);
-    ter->Encode(&ts);
-    out->clear();
-    (*out) += static_cast<char>(bs.size());
-    (*out) += bs;
-    (*out) += ts;
+    ostringstream os;
+    for (int i = 0; i < kUSED; ++i) {
+      if (i) os << ' ';
+      os << v[i];
+    }
+    *out = os.str();
   }
   bool IsAdditiveIdentity() const {
-    return bleu->IsAdditiveIdentity() && ter->IsAdditiveIdentity();
+    for (int i = 0; i < kSize; ++i)
+      if (v[i] != 0) return false;
+    return true;
   }
  private:
-  ScoreP bleu;
-  ScoreP ter;
-};
+  float BLEU() const {
+    BLEUStats s;
+    for (int i = 0; i < BLEUStats::kSize; ++i) s.v[i] = v[i];
+    return s.ComputeScore(BLEUStats::kMaxOrder);
+  }
+  // the edit counts are integers, so their sum is the same as TERScore's
+  float TER() const {
+    const float* t = v + kTER;
+    const float edits = t[TERScorer::kINSERTIONS] + t[TERScorer::kDELETIONS] +
+                        t[TERScorer::kSUBSTITUTIONS] + t[TERScorer::kSHIFTS];
+    return edits / t[TERScorer::kREF_WORDCOUNT];
+  }
 
-BLEUTERCombinationScore::~BLEUTERCombinationScore() {
-}
+  float v[kSize];
+};
 
 BLEUTERCombinationScorer::BLEUTERCombinationScorer(const vector<vector<WordID> >& refs) {
   bleu_ = SentenceScorer::CreateSentenceScorer(IBM_BLEU, refs);
-  ter_ = SentenceScorer::CreateSentenceScorer(TER, refs);
+  ter_.reset(new TERScorer(refs));
 }
 
 BLEUTERCombinationScorer::~BLEUTERCombinationScorer() {
@@ -83,15 +99,21 @@ ScoreP BLEUTERCombinationScorer::ScoreCCandidate(const vector<WordID>& hyp) cons
 
 ScoreP BLEUTERCombinationScorer::ScoreCandidate(const std::vector<WordID>& hyp) const {
   BLEUTERCombinationScore* res = new BLEUTERCombinationScore;
-  res->bleu = bleu_->ScoreCandidate(hyp);
-  res->ter = ter_->ScoreCandidate(hyp);
+  BLEUStats bs;
+  int order;
+  bleu_->ScoreCandidate(hyp)->GetBLEUStats(&bs, &order);
+  for (int i = 0; i < BLEUStats::kSize; ++i) res->v[i] = bs.v[i];
+  int ts[TERScorer::kNUM_STATS];
+  ter_->ComputeStats(hyp, ts);
+  for (int i = 0; i < TERScorer::kNUM_STATS; ++i)
+    res->v[BLEUTERCombinationScore::kTER + i] = ts[i];
   return ScoreP(res);
 }
 
 ScoreP BLEUTERCombinationScorer::ScoreFromString(const std::string& in) {
-  int bss = in[0];
+  istringstream is(in);
   BLEUTERCombinationScore* r = new BLEUTERCombinationScore;
-  r->bleu = SentenceScorer::CreateScoreFromString(IBM_BLEU, in.substr(1, bss));
-  r->ter = SentenceScorer::CreateScoreFromString(TER, in.substr(1 + bss));
+  for (int i = 0; i < BLEUTERCombinationScore::kUSED; ++i)
+    is >> r->v[i];
   return ScoreP(r);
 }
@@ -3,6 +3,11 @@
 
 #include "scorer.h"
 
+class TERScorer;
+
+// (BLEU - TER) / 2.  The scores keep the BLEU n-gram counts and the TER edit
+// counts side by side in one fixed-size array, so there is one Score per
+// hypothesis and adding them up doesn't go through two more.
 class BLEUTERCombinationScorer : public SentenceScorer {
  public:
   BLEUTERCombinationScorer(const std::vector<std::vector<WordID> >& refs);
@@ -11,7 +16,8 @@ class BLEUTERCombinationScorer : public SentenceScorer {
   ScoreP ScoreCCandidate(const std::vector<WordID>& hyp) const;
   static ScoreP ScoreFromString(const std::string& in);
  private:
-  ScorerP bleu_,ter_;
+  ScorerP bleu_;
+  boost::shared_ptr<TERScorer> ter_;
 };
 
 #endif
@@ -15,16 +15,58 @@ using namespace std;
 
 map<string, boost::shared_ptr<ScoreServer> > ScoreServerManager::servers_;
 
+namespace {
+
+int ScoreServerProcesses() {
+  const char* n = getenv("CDEC_SCORE_SERVERS");
+  const int p = n ? atoi(n) : 1;
+  return p > 0 ? p : 1;
+}
+
+// "SCORE ||| ref1 ||| ref2 ... |||", the part of the requests for a sentence
+// that is the same for all hypotheses
+string RequestPrefix(const vector<vector<WordID> >& refs) {
+  ostringstream os;
+  os << "SCORE";
+  for (unsigned i = 0; i < refs.size(); ++i) {
+    os << " |||";
+    for (unsigned j = 0; j < refs[i].size(); ++j) {
+      os << ' ' << TD::Convert(refs[i][j]);
+    }
+  }
+  os << " |||";
+  return os.str();
+}
+
+string Request(const string& prefix, const vector<WordID>& hyp) {
+  string r = prefix;
+  for (unsigned i = 0; i < hyp.size(); ++i) {
+    r += ' ';
+    r += TD::Convert(hyp[i]);
+  }
+  return r;
+}
+
+void ParseFields(const string& response, vector<float>* fields) {
+  istringstream is(response);
+  float val;
+  fields->clear();
+  while(is >> val)
+    fields->push_back(val);
+}
+
+}
+
 class METEORServer : public ScoreServer {
  public:
-  METEORServer() : ScoreServer("java -Xmx1024m -jar /usr0/cdyer/meteor/meteor-1.3.jar - - -mira -lower -t tune -l en") {}
+  explicit METEORServer(int processes) : ScoreServer("java -Xmx1024m -jar /usr0/cdyer/meteor/meteor-1.3.jar - - -mira -lower -t tune -l en", processes) {}
 };
 
 ScoreServer* ScoreServerManager::Instance(const string& score_type) {
   boost::shared_ptr<ScoreServer>& s = servers_[score_type];
   if (!s) {
     if (score_type == "meteor") {
-      s.reset(new METEORServer);
+      s.reset(new METEORServer(ScoreServerProcesses()));
     } else {
       cerr << "Don't know how to create score server for type '" << score_type << "'\n";
       abort();
@@ -33,34 +75,42 @@ ScoreServer* ScoreServerManager::Instance(const string& score_type) {
   return s.get();
 }
 
-ScoreServer::ScoreServer(const string& cmd) {
+ScoreServer::ScoreServer(const string& cmd, int processes) : procs_(processes) {
+  if (processes > 1) cerr << "Starting " << processes << " score servers\n";
+  for (int i = 0; i < processes; ++i)
+    Start(cmd, &procs_[i]);
+  cerr << "Connection established.\n";
+}
+
+void ScoreServer::Start(const string& cmd, Process* p) {
   cerr << "Invoking " << cmd << " ..." << endl;
-  if (pipe(p2c) < 0) { perror("pipe"); exit(1); }
-  if (pipe(c2p) < 0) { perror("pipe"); exit(1); }
+  if (pipe(p->p2c) < 0) { perror("pipe"); exit(1); }
+  if (pipe(p->c2p) < 0) { perror("pipe"); exit(1); }
   pid_t cpid = fork();
   if (cpid < 0) { perror("fork"); exit(1); }
   if (cpid == 0) {  // child
-    close(p2c[1]);
-    close(c2p[0]);
-    dup2(p2c[0], 0);
-    close(p2c[0]);
-    dup2(c2p[1], 1);
-    close(c2p[1]);
+    close(p->p2c[1]);
+    close(p->c2p[0]);
+    dup2(p->p2c[0], 0);
+    close(p->p2c[0]);
+    dup2(p->c2p[1], 1);
+    close(p->c2p[1]);
     cerr << "Exec'ing from child " << cmd << endl;
     vector<string> vargs;
     SplitOnWhitespace(cmd, &vargs);
-    const char** cargv = static_cast<const char**>(malloc(sizeof(const char*) * vargs.size()));
-    for (unsigned i = 1; i < vargs.size(); ++i) cargv[i-1] = vargs[i].c_str();
-    cargv[vargs.size() - 1] = NULL;
+    const char** cargv = static_cast<const char**>(malloc(sizeof(const char*) * (vargs.size() + 1)));
+    for (unsigned i = 0; i < vargs.size(); ++i) cargv[i] = vargs[i].c_str();
+    cargv[vargs.size()] = NULL;
     execvp(vargs[0].c_str(), (char* const*)cargv);
+    perror("execvp");
+    _exit(1);
   } else { // parent
-    close(c2p[1]);
-    close(p2c[0]);
+    close(p->c2p[1]);
+    close(p->p2c[0]);
   }
   string dummy;
-  RequestResponse("SCORE ||| Reference initialization string . ||| Testing initialization string .", &dummy);
+  RequestResponse(p, "SCORE ||| Reference initialization string . ||| Testing initialization string .", &dummy);
   assert(dummy.size() > 0);
-  cerr << "Connection established.\n";
 }
 
 ScoreServer::~ScoreServer() {
@@ -73,48 +123,73 @@ float ScoreServer::ComputeScore(const vector<float>& fields) {
   for (unsigned i = 0; i < fields.size(); ++i)
     os << ' ' << fields[i];
   string sres;
-  RequestResponse(os.str(), &sres);
+  RequestResponse(&procs_[0], os.str(), &sres);
   return strtod(sres.c_str(), NULL);
 }
 
 void ScoreServer::Evaluate(const vector<vector<WordID> >& refs, const vector<WordID>& hyp, vector<float>* fields) {
-  ostringstream os;
-  os << "SCORE";
-  for (unsigned i = 0; i < refs.size(); ++i) {
-    os << " |||";
-    for (unsigned j = 0; j < refs[i].size(); ++j) {
-      os << ' ' << TD::Convert(refs[i][j]);
+  string sres;
+  RequestResponse(&procs_[0], Request(RequestPrefix(refs), hyp), &sres);
+  ParseFields(sres, fields);
+}
+
+void ScoreServer::EvaluateBatch(const vector<vector<WordID> >& refs,
+                                const vector<const vector<WordID>*>& hyps,
+                                vector<vector<float> >* fields) {
+  const string prefix = RequestPrefix(refs);
+  const int np = procs_.size();
+  fields->resize(hyps.size());
+  // the requests sent to process p are hyps p, p + np, p + 2 np, ..., and
+  // received[p] of their responses have been read
+  vector<int> sent(np), received(np);
+  string sres;
+  for (unsigned i = 0; i < hyps.size(); ++i) {
+    const int p = i % np;
+    if (sent[p] - received[p] == kWINDOW) {
+      Receive(&procs_[p], &sres);
+      ParseFields(sres, &(*fields)[p + received[p]++ * np]);
     }
+    Send(&procs_[p], Request(prefix, *hyps[i]));
+    ++sent[p];
   }
-  os << " |||";
-  for (unsigned i = 0; i < hyp.size(); ++i) {
-    os << ' ' << TD::Convert(hyp[i]);
+  for (int p = 0; p < np; ++p) {
+    while (received[p] < sent[p]) {
+      Receive(&procs_[p], &sres);
+      ParseFields(sres, &(*fields)[p + received[p]++ * np]);
+    }
   }
-  string sres;
-  RequestResponse(os.str(), &sres);
-  istringstream is(sres);
-  float val;
-  fields->clear();
-  while(is >> val)
-    fields->push_back(val);
 }
 
-#define MAX_BUF 16000
+void ScoreServer::RequestResponse(Process* p, const string& request, string* response) {
+  Send(p, request);
+  Receive(p, response);
+}
 
-void ScoreServer::RequestResponse(const string& request, string* response) {
+void ScoreServer::Send(Process* p, const string& request) {
 //  cerr << "@SERVER: " << request << endl;
-  string x = request + "\n";
-  write(p2c[1], x.c_str(), x.size());
-  char buf[MAX_BUF];
-  size_t n = read(c2p[0], buf, MAX_BUF);
-  while (n < MAX_BUF && buf[n-1] != '\n')
-    n += read(c2p[0], &buf[n], MAX_BUF - n);
-
-  buf[n-1] = 0;
-  if (n < 2) {
-    cerr << "Malformed response: " << buf << endl;
-  }
-  *response = Trim(buf, " \t\n");
+  const string x = request + "\n";
+  size_t done = 0;
+  while (done < x.size()) {
+    const ssize_t n = write(p->p2c[1], x.data() + done, x.size() - done);
+    if (n < 0) { perror("write to score server"); abort(); }
+    done += n;
+  }
+}
+
+void ScoreServer::Receive(Process* p, string* response) {
+  size_t nl;
+  while ((nl = p->pending.find('\n')) == string::npos) {
+    char buf[16000];
+    const ssize_t n = read(p->c2p[0], buf, sizeof(buf));
+    if (n <= 0) {
+      cerr << "Score server closed the connection\n";
+      abort();
+    }
+    p->pending.append(buf, n);
+  }
+  if (nl < 1) cerr << "Malformed response: " << p->pending.substr(0, nl) << endl;
+  *response = Trim(p->pending.substr(0, nl), " \t\n");
+  p->pending.erase(0, nl + 1);
 //  cerr << "@RESPONSE: '" << *response << "'\n";
 }
 
@@ -184,6 +259,14 @@ ScoreP ExternalSentenceScorer::ScoreCandidate(const Sentence& hyp) const {
   return ScoreP(res);
 }
 
+void ExternalSentenceScorer::ScoreCandidates(const vector<const Sentence*>& hyps, vector<ScoreP>* scores) const {
+  vector<vector<float> > fields;
+  eval_server->EvaluateBatch(refs, hyps, &fields);
+  scores->resize(hyps.size());
+  for (unsigned i = 0; i < hyps.size(); ++i)
+    (*scores)[i] = ScoreP(new ExternalScore(eval_server, fields[i]));
+}
+
 ScoreP ExternalSentenceScorer::ScoreCCandidate(const Sentence& hyp) const {
   assert(!"not implemented");
 }
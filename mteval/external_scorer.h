@@ -8,23 +8,43 @@
 
 #include "scorer.h"
 
+// Talks to an external scorer (e.g. METEOR in -mira mode) over pipes, one
+// request and one response line at a time.  cmd may be run as several
+// processes, which EvaluateBatch spreads its requests over.
 class ScoreServer {
   friend class ScoreServerManager;
  protected:
-  explicit ScoreServer(const std::string& cmd);
+  explicit ScoreServer(const std::string& cmd, int processes = 1);
   virtual ~ScoreServer();
 
  public:
   float ComputeScore(const std::vector<float>& fields);
   void Evaluate(const std::vector<std::vector<WordID> >& refs, const std::vector<WordID>& hyp, std::vector<float>* fields);
+  // the fields of each of hyps, as by Evaluate.  Instead of waiting for each
+  // response before sending the next request, up to kWINDOW requests are
+  // kept outstanding per process, round robin over the processes.
+  void EvaluateBatch(const std::vector<std::vector<WordID> >& refs,
+                     const std::vector<const std::vector<WordID>*>& hyps,
+                     std::vector<std::vector<float> >* fields);
 
  private:
-  void RequestResponse(const std::string& request, std::string* response);
-  int p2c[2];
-  int c2p[2];
+  // small enough that the responses to the outstanding requests fit in the
+  // pipe buffer, so the server never blocks writing while we are writing
+  static const int kWINDOW = 64;
+  struct Process {
+    int p2c[2];
+    int c2p[2];
+    std::string pending;  // read but not yet returned
+  };
+  void Start(const std::string& cmd, Process* p);
+  void Send(Process* p, const std::string& request);
+  void Receive(Process* p, std::string* response);
+  void RequestResponse(Process* p, const std::string& request, std::string* response);
+  std::vector<Process> procs_;
 };
 
 struct ScoreServerManager {
+  // the server is started as $CDEC_SCORE_SERVERS processes (default 1)
   static ScoreServer* Instance(const std::string& score_type);
  private:
   static std::map<std::string, boost::shared_ptr<ScoreServer> > servers_;
@@ -36,6 +56,7 @@ class ExternalSentenceScorer : public SentenceScorer {
     SentenceScorer("External", r), eval_server(server) {}
   virtual ScoreP ScoreCandidate(const Sentence& hyp) const;
   virtual ScoreP ScoreCCandidate(const Sentence& hyp) const;
+  virtual void ScoreCandidates(const std::vector<const Sentence*>& hyps, std::vector<ScoreP>* scores) const;
   static ScoreP ScoreFromString(ScoreServer* s, const std::string& data);
 
  protected:
@@ -1,12 +1,19 @@
 #include <iostream>
+#include <map>
 #include <vector>
+#include <algorithm>
 
+#include <boost/bind.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include "filelib.h"
 #include "tdict.h"
 #include "scorer.h"
+#include "bleu_stats.h"
+#include "sampler.h"
 
 using namespace std;
 namespace po = boost::program_options;
@@ -16,7 +23,11 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   opts.add_options()
         ("reference,r",po::value<vector<string> >(), "[REQD] Reference translation(s) (tokenized text file)")
         ("loss_function,l",po::value<string>()->default_value("ibm_bleu"), "Scoring metric (ibm_bleu, nist_bleu, koehn_bleu, ter, combi)")
-        ("in_file,i", po::value<string>()->default_value("-"), "Input file")
+        ("in_file,i", po::value<vector<string> >(), "Input file (default: - for STDIN); several are each scored against the same references")
+        ("threads,j", po::value<int>()->default_value(1), "Number of threads to score the sentences with")
+        ("bootstrap,b", po::value<int>()->default_value(0), "Number of bootstrap resamplings of the sentences to compute a confidence interval from (0 for none)")
+        ("confidence,c", po::value<double>()->default_value(0.95), "Confidence level of the bootstrap interval")
+        ("random_seed,S", po::value<uint32_t>(), "Random seed for the bootstrap (if not specified, /dev/random will be used)")
         ("help,h", "Help");
   po::options_description dcmdline_options;
   dcmdline_options.add(opts);
@@ -32,6 +43,110 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   }
 }
 
+static const int kCHUNK_SIZE = 500;
+
+// hands out the lines of a hypothesis file in chunks to the threads that
+// score them, and collects the score of each sentence in input order
+class ParallelScoring {
+ public:
+  ParallelScoring(const DocScorer& ds, istream* in) : ds_(ds), in_(in), next_line_(0), too_many_(false) {}
+
+  // false if there are more hypotheses than references
+  bool Run(int threads, vector<ScoreP>* scores) {
+    if (threads > 1) {
+      boost::thread_group workers;
+      for (int i = 0; i < threads; ++i)
+        workers.create_thread(boost::bind(&ParallelScoring::RunThread, this));
+      workers.join_all();
+    } else {
+      RunThread();
+    }
+    scores->clear();
+    for (map<int, vector<ScoreP> >::iterator it = done_.begin(); it != done_.end(); ++it)
+      scores->insert(scores->end(), it->second.begin(), it->second.end());
+    return !too_many_;
+  }
+
+ private:
+  bool NextChunk(int* begin, vector<string>* lines) {
+    boost::mutex::scoped_lock l(in_mutex_);
+    lines->clear();
+    *begin = next_line_;
+    while(*in_ && !too_many_ && lines->size() < kCHUNK_SIZE) {
+      string line;
+      getline(*in_, line);
+      if (line.empty() && !*in_) break;
+      if (next_line_ == ds_.size()) {
+        cerr << "Too many (" << (next_line_ + 1) << ") translations in input, expected " << ds_.size() << endl;
+        too_many_ = true;
+        break;
+      }
+      lines->push_back(line);
+      ++next_line_;
+    }
+    return !lines->empty();
+  }
+
+  void RunThread() {
+    int begin;
+    vector<string> lines;
+    while (NextChunk(&begin, &lines)) {
+      vector<ScoreP> scores(lines.size());
+      for (int i = 0; i < lines.size(); ++i) {
+        vector<WordID> sent;
+        TD::ConvertSentence(lines[i], &sent);
+        scores[i] = ds_[begin + i]->ScoreCandidate(sent);
+      }
+      boost::mutex::scoped_lock l(out_mutex_);
+      done_[begin].swap(scores);
+    }
+  }
+
+  const DocScorer& ds_;
+  istream* in_;
+  int next_line_;
+  bool too_many_;
+  map<int, vector<ScoreP> > done_;  // the scores of each chunk
+  boost::mutex in_mutex_;
+  boost::mutex out_mutex_;
+};
+
+// the (1 - confidence) / 2 and (1 + confidence) / 2 quantiles of the corpus
+// scores of samples resamplings (with replacement) of the sentences.  The
+// same seed resamples the same sentences of files of the same size, so
+// the intervals of several systems are paired.
+void BootstrapInterval(const vector<ScoreP>& scores, int samples, double confidence, uint32_t seed,
+                       float* lo, float* hi) {
+  const int n = scores.size();
+  // BLEU statistics are added up as values
+  vector<BLEUStats> stats(n);
+  int order = 0;
+  bool bleu = true;
+  for (int i = 0; i < n && bleu; ++i) {
+    int o;
+    bleu = scores[i]->GetBLEUStats(&stats[i], &o) && (!i || o == order);
+    order = o;
+  }
+  MT19937 rng(seed);
+  MT19937::IntRNG pick = rng.inclusive(0, n - 1);
+  vector<float> sampled(samples);
+  for (int s = 0; s < samples; ++s) {
+    if (bleu) {
+      BLEUStats acc;
+      for (int i = 0; i < n; ++i) acc += stats[pick()];
+      sampled[s] = acc.ComputeScore(order);
+    } else {
+      ScoreP acc = scores[0]->GetZero();
+      for (int i = 0; i < n; ++i) acc->PlusEquals(*scores[pick()]);
+      sampled[s] = acc->ComputeScore();
+    }
+  }
+  sort(sampled.begin(), sampled.end());
+  const double tail = (1.0 - confidence) / 2.0;
+  *lo = sampled[static_cast<int>(tail * (samples - 1) + 0.5)];
+  *hi = sampled[static_cast<int>((1.0 - tail) * (samples - 1) + 0.5)];
+}
+
 int main(int argc, char** argv) {
   po::variables_map conf;
   InitCommandLine(argc, argv, &conf);
@@ -39,34 +154,52 @@ int main(int argc, char** argv) {
   ScoreType type = ScoreTypeFromString(loss_function);
   DocScorer ds(type, conf["reference"].as<vector<string> >(), "");
   cerr << "Loaded " << ds.size() << " references for scoring with " << loss_function << endl;
-
-  ReadFile rf(conf["in_file"].as<string>());
-  ScoreP acc;
-  istream& in = *rf.stream();
-  int lc = 0;
-  while(in) {
-    string line;
-    getline(in, line);
-    if (line.empty() && !in) break;
-    vector<WordID> sent;
-    TD::ConvertSentence(line, &sent);
-    ScoreP sentscore = ds[lc]->ScoreCandidate(sent);
-    if (!acc) { acc = sentscore->GetZero(); }
-    acc->PlusEquals(*sentscore);
-    ++lc;
+  int threads = conf["threads"].as<int>();
+  if (type == METEOR && threads > 1) {
+    cerr << "METEOR scores are computed by a server, not using threads\n";
+    threads = 1;
   }
-  assert(lc > 0);
-  if (lc > ds.size()) {
-    cerr << "Too many (" << lc << ") translations in input, expected " << ds.size() << endl;
+  const int samples = conf["bootstrap"].as<int>();
+  const double confidence = conf["confidence"].as<double>();
+  if (samples && (confidence <= 0.0 || confidence >= 1.0)) {
+    cerr << "Bad confidence level: " << confidence << endl;
     return 1;
   }
-  if (lc != ds.size())
-    cerr << "Fewer sentences in hyp (" << lc << ") than refs ("
-         << ds.size() << "): scoring partial set!\n";
-  float score = acc->ComputeScore();
-  string details;
-  acc->ScoreDetails(&details);
-  cerr << details << endl;
-  cout << score << endl;
+  uint32_t seed = 0;
+  if (samples)
+    seed = conf.count("random_seed") ? conf["random_seed"].as<uint32_t>() : MT19937::GetTrulyRandomSeed();
+  vector<string> files(1, "-");
+  if (conf.count("in_file")) files = conf["in_file"].as<vector<string> >();
+
+  for (int f = 0; f < files.size(); ++f) {
+    ReadFile rf(files[f]);
+    vector<ScoreP> scores;
+    ParallelScoring ps(ds, rf.stream());
+    if (!ps.Run(threads, &scores)) return 1;
+    const int lc = scores.size();
+    assert(lc > 0);
+    if (lc != ds.size())
+      cerr << "Fewer sentences in hyp (" << lc << ") than refs ("
+           << ds.size() << "): scoring partial set!\n";
+    ScoreP acc = scores[0]->GetZero();
+    for (int i = 0; i < lc; ++i)
+      acc->PlusEquals(*scores[i]);
+    float score = acc->ComputeScore();
+    string details;
+    acc->ScoreDetails(&details);
+    if (files.size() > 1) {
+      cerr << files[f] << ": ";
+      cout << files[f] << '\t';
+    }
+    cerr << details << endl;
+    cout << score;
+    if (samples) {
+      float lo, hi;
+      BootstrapInterval(scores, samples, confidence, seed, &lo, &hi);
+      cerr << confidence * 100 << "% bootstrap interval (" << samples << " samples): [" << lo << ", " << hi << "]\n";
+      cout << '\t' << lo << '\t' << hi;
+    }
+    cout << endl;
+  }
   return 0;
 }
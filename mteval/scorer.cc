@@ -8,9 +8,12 @@
 #include <cstdio>
 #include <valarray>
 #include <algorithm>
+#include <stdint.h>
+#include <tr1/unordered_map>
 
 #include <boost/shared_ptr.hpp>
 
+#include "bleu_stats.h"
 #include "filelib.h"
 #include "ter.h"
 #include "aer_scorer.h"
@@ -26,6 +29,10 @@ void Score::TimesEquals(float /*scale*/) {
   cerr<<"UNIMPLEMENTED except for BLEU (for MIRA): Score::TimesEquals"<<endl;abort();
 }
 
+bool Score::GetBLEUStats(BLEUStats* /*stats*/, int* /*order*/) const {
+  return false;
+}
+
 ScoreType ScoreTypeFromString(const string& st) {
   const string sl = LowercaseString(st);
   if (sl == "ser")
@@ -63,6 +70,12 @@ std::string StringFromScoreType(ScoreType st) {
 Score::~Score() {}
 SentenceScorer::~SentenceScorer() {}
 
+void SentenceScorer::ScoreCandidates(const vector<const Sentence*>& hyps, vector<ScoreP>* scores) const {
+  scores->resize(hyps.size());
+  for (int i = 0; i < hyps.size(); ++i)
+    (*scores)[i] = ScoreCandidate(*hyps[i]);
+}
+
 struct length_accum {
   template <class S>
   float operator()(float sum,S const& ref) const {
@@ -160,6 +173,7 @@ class BLEUScore : public ScoreBase<BLEUScore> {
   float ComputePartialScore() const;
   void ScoreDetails(string* details) const;
   void TimesEquals(float scale);
+  bool GetBLEUStats(BLEUStats* stats, int* order) const;
   void PlusEquals(const Score& delta);
   void PlusEquals(const Score& delta, const float scale);
   void PlusPartialEquals(const Score& delta, int oracle_e_cover, int oracle_f_cover, int src_len);
@@ -193,73 +207,89 @@ class BLEUScorerBase : public SentenceScorer {
              );
   ScoreP ScoreCandidate(const vector<WordID>& hyp) const;
   ScoreP ScoreCCandidate(const vector<WordID>& hyp) const;
+  void ScoreCandidates(const vector<const Sentence*>& hyps, vector<ScoreP>* scores) const;
   static ScoreP ScoreFromString(const string& in);
 
   virtual float ComputeRefLength(const vector<WordID>& hyp) const = 0;
  private:
-  struct NGramCompare {
-    int operator() (const vector<WordID>& a, const vector<WordID>& b) {
-      size_t as = a.size();
-      size_t bs = b.size();
-      const size_t s = (as < bs ? as : bs);
-      for (size_t i = 0; i < s; ++i) {
-         int d = a[i] - b[i];
-         if (d < 0) return true;
-	 if (d > 0) return false;
-      }
-      return as < bs;
-    }
-  };
-  typedef map<vector<WordID>, pair<int,int>, NGramCompare> NGramCountMap;
+  // the reference n-grams are numbered as a trie: the n-gram that extends
+  // the one numbered p (-1 for the empty n-gram) by word w is numbered
+  // ngram_ids_[Key(p, w)]
+  static uint64_t Key(int p, WordID w) {
+    return (static_cast<uint64_t>(p + 1) << 32) | static_cast<uint32_t>(w);
+  }
   void CountRef(const vector<WordID>& ref) {
-    NGramCountMap tc;
-    vector<WordID> ngram(n_);
+    vector<int> tc;
     int s = ref.size();
     for (int j=0; j<s; ++j) {
       int remaining = s-j;
       int k = (n_ < remaining ? n_ : remaining);
-      ngram.clear();
-      for (int i=1; i<=k; ++i) {
-	ngram.push_back(ref[j + i - 1]);
-        tc[ngram].first++;
+      int p = -1;
+      for (int i=0; i<k; ++i) {
+        pair<NGramIds::iterator, bool> r = ngram_ids_.insert(make_pair(Key(p, ref[j + i]), int(ref_counts_.size())));
+        if (r.second) ref_counts_.push_back(0);
+        p = r.first->second;
+        if (p >= tc.size()) tc.resize(p + 1, 0);
+        tc[p]++;
       }
     }
-    for (NGramCountMap::iterator i = tc.begin(); i != tc.end(); ++i) {
-      pair<int,int>& p = ngrams_[i->first];
-      if (p.first < i->second.first)
-        p = i->second;
+    for (int i = 0; i < tc.size(); ++i)
+      if (ref_counts_[i] < tc[i])
+        ref_counts_[i] = tc[i];
+  }
+
+  // the ids of the n-grams starting at each position of sent, n_ per
+  // position, -1 from the first one that is not in a reference on (none of
+  // its extensions can be).  Positions whose n-grams lie within the first
+  // reuse words keep the ids *ids already has.
+  void FindNgrams(const vector<WordID>& sent, int reuse, vector<int>* ids) const {
+    int s = sent.size();
+    ids->resize(s * n_);
+    for (int j = (reuse >= n_ ? reuse - n_ + 1 : 0); j<s; ++j) {
+      int remaining = s-j;
+      int k = (n_ < remaining ? n_ : remaining);
+      int* id = &(*ids)[j * n_];
+      int p = -1;
+      for (int i=0; i<k; ++i) {
+        if (p >= 0 || i == 0) {
+          NGramIds::const_iterator it = ngram_ids_.find(Key(p, sent[j + i]));
+          p = (it == ngram_ids_.end() ? -1 : it->second);
+        }
+        id[i] = p;
+      }
     }
   }
 
+  // hits counts how often each reference n-gram has been matched; it must
+  // be all 0 and is all 0 again afterwards
   void ComputeNgramStats(const vector<WordID>& sent,
+                         const vector<int>& ids,
 			 valarray<float>* correct,
 			 valarray<float>* hyp,
-			 bool clip_counts)
+			 bool clip_counts,
+                         vector<int>* hits)
     const {
     assert(correct->size() == n_);
     assert(hyp->size() == n_);
-    vector<WordID> ngram(n_);
     (*correct) *= 0;
     (*hyp) *= 0;
     int s = sent.size();
     for (int j=0; j<s; ++j) {
       int remaining = s-j;
       int k = (n_ < remaining ? n_ : remaining);
-      ngram.clear();
+      const int* id = &ids[j * n_];
       for (int i=1; i<=k; ++i) {
-	ngram.push_back(sent[j + i - 1]);
-        pair<int,int>& p = ngrams_[ngram];
+        const int p = id[i-1];
 	if(clip_counts){
-	  if (p.second < p.first) {
-	    ++p.second;
+	  if (p >= 0 && (*hits)[p] < ref_counts_[p]) {
+	    ++(*hits)[p];
 	    (*correct)[i-1]++;
 	  }}
 	else {
-	  ++p.second;
 	  (*correct)[i-1]++;
 	}
 	// if the 1 gram isn't found, don't try to match don't need to match any 2- 3- .. grams:
-	if (!p.first) {
+	if (p < 0) {
 	  for (; i<=k; ++i)
 	    (*hyp)[i-1]++;
 	} else {
@@ -267,9 +297,17 @@ class BLEUScorerBase : public SentenceScorer {
         }
       }
     }
+    if (clip_counts)
+      for (int j=0; j<s; ++j)
+        for (int i=0; i<n_ && i<s-j && ids[j * n_ + i] >= 0; ++i)
+          (*hits)[ids[j * n_ + i]] = 0;
   }
 
-  mutable NGramCountMap ngrams_;
+  ScoreP MakeScore(const vector<WordID>& sent, const vector<int>& ids, bool clip_counts, vector<int>* hits) const;
+
+  typedef tr1::unordered_map<uint64_t, int> NGramIds;
+  NGramIds ngram_ids_;
+  vector<int> ref_counts_;  // the most times each n-gram is in one reference
   int n_;
   vector<int> lengths_;
 };
@@ -426,12 +464,16 @@ void BLEUScore::ScoreDetails(string* details) const {
   *details = buf;
 }
 
-float BLEUScore::ComputeScore(vector<float>* precs, float* bp) const {
+// shared by BLEUScore and BLEUStats, so that they give the same scores; the
+// counts are valarray<float>s or indexed views of a BLEUStats
+template <class C, class H>
+static float ComputeBLEU(const C& correct_ngram_hit_counts, const H& hyp_ngram_counts, const int n,
+                         const float ref_len, const float hyp_len, vector<float>* precs, float* bp) {
   float log_bleu = 0;
   if (precs) precs->clear();
   int count = 0;
-  vector<float> total_precs(N());
-  for (int i = 0; i < N(); ++i) {
+  vector<float> total_precs(n);
+  for (int i = 0; i < n; ++i) {
     if (hyp_ngram_counts[i] > 0) {
       float cor_count = correct_ngram_hit_counts[i];
       // smooth bleu
@@ -443,14 +485,14 @@ float BLEUScore::ComputeScore(vector<float>* precs, float* bp) const {
     }
     total_precs[i] = log_bleu;
   }
-  vector<float> bleus(N());
+  vector<float> bleus(n);
   float lbp = 0.0;
   if (hyp_len < ref_len)
     lbp = (hyp_len - ref_len) / hyp_len;
   log_bleu += lbp;
   if (bp) *bp = exp(lbp);
   float wb = 0;
-  for (int i = 0; i < N(); ++i) {
+  for (int i = 0; i < n; ++i) {
     bleus[i] = exp(total_precs[i] / (i+1) + lbp);
     wb += bleus[i] / pow(2.0, 4.0 - i);
   }
@@ -458,6 +500,41 @@ float BLEUScore::ComputeScore(vector<float>* precs, float* bp) const {
   return bleus.back();
 }
 
+float BLEUScore::ComputeScore(vector<float>* precs, float* bp) const {
+  return ComputeBLEU(correct_ngram_hit_counts, hyp_ngram_counts, N(), ref_len, hyp_len, precs, bp);
+}
+
+namespace {
+// BLEUStats as the arrays ComputeBLEU indexes
+struct StatsCorrect {
+  explicit StatsCorrect(const BLEUStats& s) : s_(s) {}
+  float operator[](int i) const { return s_.correct(i); }
+  const BLEUStats& s_;
+};
+struct StatsHyp {
+  explicit StatsHyp(const BLEUStats& s) : s_(s) {}
+  float operator[](int i) const { return s_.hyp(i); }
+  const BLEUStats& s_;
+};
+}
+
+float BLEUStats::ComputeScore(int n) const {
+  return ComputeBLEU(StatsCorrect(*this), StatsHyp(*this), n, ref_len(), hyp_len(), NULL, NULL);
+}
+
+bool BLEUScore::GetBLEUStats(BLEUStats* stats, int* order) const {
+  if (N() > BLEUStats::kMaxOrder) return false;
+  *stats = BLEUStats();
+  for (int i = 0; i < N(); ++i) {
+    stats->correct(i) = correct_ngram_hit_counts[i];
+    stats->hyp(i) = hyp_ngram_counts[i];
+  }
+  stats->ref_len() = ref_len;
+  stats->hyp_len() = hyp_len;
+  *order = N();
+  return true;
+}
+
 
 //comptue scaled score for oracle retrieval
 float BLEUScore::ComputePartialScore(vector<float>* precs, float* bp) const {
@@ -565,27 +642,53 @@ BLEUScorerBase::BLEUScorerBase(const vector<vector<WordID> >& references,
   }
 }
 
-ScoreP BLEUScorerBase::ScoreCandidate(const vector<WordID>& hyp) const {
+ScoreP BLEUScorerBase::MakeScore(const vector<WordID>& sent, const vector<int>& ids, bool clip_counts, vector<int>* hits) const {
   BLEUScore* bs = new BLEUScore(n_);
-  for (NGramCountMap::iterator i=ngrams_.begin(); i != ngrams_.end(); ++i)
-    i->second.second = 0;
-  ComputeNgramStats(hyp, &bs->correct_ngram_hit_counts, &bs->hyp_ngram_counts, true);
-  bs->ref_len = ComputeRefLength(hyp);
-  bs->hyp_len = hyp.size();
+  ComputeNgramStats(sent, ids, &bs->correct_ngram_hit_counts, &bs->hyp_ngram_counts, clip_counts, hits);
+  bs->ref_len = ComputeRefLength(sent);
+  bs->hyp_len = sent.size();
   return ScoreP(bs);
 }
 
+ScoreP BLEUScorerBase::ScoreCandidate(const vector<WordID>& hyp) const {
+  vector<int> ids, hits(ref_counts_.size(), 0);
+  FindNgrams(hyp, 0, &ids);
+  return MakeScore(hyp, ids, true, &hits);
+}
+
 ScoreP BLEUScorerBase::ScoreCCandidate(const vector<WordID>& hyp) const {
-  BLEUScore* bs = new BLEUScore(n_);
-  for (NGramCountMap::iterator i=ngrams_.begin(); i != ngrams_.end(); ++i)
-    i->second.second = 0;
-  bool clip = false;
-  ComputeNgramStats(hyp, &bs->correct_ngram_hit_counts, &bs->hyp_ngram_counts,clip);
-  bs->ref_len = ComputeRefLength(hyp);
-  bs->hyp_len = hyp.size();
-  return ScoreP(bs);
+  vector<int> ids;
+  FindNgrams(hyp, 0, &ids);
+  return MakeScore(hyp, ids, false, NULL);
 }
 
+struct HypothesisLess {
+  explicit HypothesisLess(const vector<const SentenceScorer::Sentence*>& s) : sents(s) {}
+  bool operator()(int a, int b) const { return *sents[a] < *sents[b]; }
+  const vector<const SentenceScorer::Sentence*>& sents;
+};
+
+// in sorted order, so that each hypothesis shares as long a prefix with
+// the one before as any, and only the n-grams after it are looked up
+void BLEUScorerBase::ScoreCandidates(const vector<const Sentence*>& hyps, vector<ScoreP>* scores) const {
+  vector<int> order(hyps.size());
+  for (int i = 0; i < order.size(); ++i) order[i] = i;
+  sort(order.begin(), order.end(), HypothesisLess(hyps));
+  scores->resize(hyps.size());
+  vector<int> ids, hits(ref_counts_.size(), 0);
+  const Sentence* prev = NULL;
+  for (int i = 0; i < order.size(); ++i) {
+    const Sentence& hyp = *hyps[order[i]];
+    int reuse = 0;
+    if (prev) {
+      const int m = min(hyp.size(), prev->size());
+      while (reuse < m && hyp[reuse] == (*prev)[reuse]) ++reuse;
+    }
+    FindNgrams(hyp, reuse, &ids);
+    (*scores)[order[i]] = MakeScore(hyp, ids, true, &hits);
+    prev = &hyp;
+  }
+}
 
 DocScorer::~DocScorer() {
 }
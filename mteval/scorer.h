@@ -14,6 +14,7 @@ typedef boost::shared_ptr<SentenceScorer> ScorerP;
 
 class ViterbiEnvelope;
 class ErrorSurface;
+struct BLEUStats;
 class Hypergraph;  // needed for alignment
 
 //TODO: BLEU N (N separate arg, not part of enum)?
@@ -33,6 +34,9 @@ class Score : public boost::intrusive_refcount<Score> {
     return d;
   }
   virtual void TimesEquals(float scale); // only for bleu; for mira oracle
+  // only for bleu (up to 4-grams): the statistics as a value and the n-gram
+  // order, for fast accumulation; false for other scores
+  virtual bool GetBLEUStats(BLEUStats* stats, int* order) const;
   /// same as rhs.TimesEquals(scale);PlusEquals(rhs) except doesn't modify rhs.
   virtual void PlusEquals(const Score& rhs, const float scale) = 0;
   virtual void PlusEquals(const Score& rhs) = 0;
@@ -74,6 +78,9 @@ class SentenceScorer {
   virtual ScoreP GetZero() const;
   virtual ScoreP ScoreCandidate(const Sentence& hyp) const = 0;
   virtual ScoreP ScoreCCandidate(const Sentence& hyp) const =0;
+  // the same as ScoreCandidate of each of hyps (e.g. a k-best list);
+  // BLEU looks up the n-grams hypotheses have in common only once
+  virtual void ScoreCandidates(const std::vector<const Sentence*>& hyps, std::vector<ScoreP>* scores) const;
   virtual const std::string* GetSource() const;
   static ScoreP CreateScoreFromString(const ScoreType type, const std::string& in);
   static ScorerP CreateSentenceScorer(const ScoreType type,
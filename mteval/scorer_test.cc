@@ -5,6 +5,7 @@
 
 #include "tdict.h"
 #include "scorer.h"
+#include "bleu_stats.h"
 #include "aer_scorer.h"
 
 using namespace std;
@@ -70,6 +71,58 @@ TEST_F(ScorerTest, TestBLEUScorer) {
   EXPECT_TRUE(bz->IsAdditiveIdentity());
 }
 
+TEST_F(ScorerTest, TestBLEUStats) {
+  const ScoreType types[] = { IBM_BLEU, IBM_BLEU_3, Koehn_BLEU, NIST_BLEU };
+  for (int t = 0; t < 4; ++t) {
+    ScorerP s1 = SentenceScorer::CreateSentenceScorer(types[t], refs0);
+    ScorerP s2 = SentenceScorer::CreateSentenceScorer(types[t], refs1);
+    ScoreP b1 = s1->ScoreCandidate(hyp1);
+    ScoreP b2 = s2->ScoreCandidate(hyp2);
+    BLEUStats v1, v2;
+    int o1, o2;
+    ASSERT_TRUE(b1->GetBLEUStats(&v1, &o1));
+    ASSERT_TRUE(b2->GetBLEUStats(&v2, &o2));
+    EXPECT_EQ(o1, o2);
+    EXPECT_EQ(b1->ComputeScore(), v1.ComputeScore(o1));
+    b1->PlusEquals(*b2);
+    v1 += v2;
+    EXPECT_EQ(b1->ComputeScore(), v1.ComputeScore(o1));
+    BLEUStats v3;
+    b1->GetBLEUStats(&v3, &o1);
+    for (int i = 0; i < BLEUStats::kSize; ++i) EXPECT_EQ(v3.v[i], v1.v[i]);
+  }
+  ScorerP ter = SentenceScorer::CreateSentenceScorer(TER, refs0);
+  BLEUStats v;
+  int order;
+  EXPECT_FALSE(ter->ScoreCandidate(hyp1)->GetBLEUStats(&v, &order));
+}
+
+TEST_F(ScorerTest, TestScoreCandidates) {
+  // a k-best list: repeated, shared prefixes, an empty one
+  vector<vector<WordID> > list(hyp1.size() + 2, hyp1);
+  for (int i = 1; i < hyp1.size(); ++i) {
+    list[i][i] = refs0[0][i % refs0[0].size()];
+    if (i % 3 == 0) list[i].resize(i + 1);
+  }
+  list.back().clear();
+  list.push_back(refs0[1]);
+  vector<const SentenceScorer::Sentence*> hyps;
+  for (int i = 0; i < list.size(); ++i) hyps.push_back(&list[i]);
+  const ScoreType types[] = { IBM_BLEU, IBM_BLEU_3, TER };
+  for (int t = 0; t < 3; ++t) {
+    ScorerP s1 = SentenceScorer::CreateSentenceScorer(types[t], refs0);
+    vector<ScoreP> scores;
+    s1->ScoreCandidates(hyps, &scores);
+    ASSERT_EQ(list.size(), scores.size());
+    for (int i = 0; i < list.size(); ++i) {
+      string a, b;
+      scores[i]->Encode(&a);
+      s1->ScoreCandidate(list[i])->Encode(&b);
+      EXPECT_EQ(b, a);
+    }
+  }
+}
+
 TEST_F(ScorerTest, TestTERScorer) {
   ScorerP s1 = SentenceScorer::CreateSentenceScorer(TER, refs0);
   ScorerP s2 = SentenceScorer::CreateSentenceScorer(TER, refs1);
@@ -98,6 +151,20 @@ TEST_F(ScorerTest, TestTERScorer) {
   EXPECT_TRUE(tz->IsAdditiveIdentity());
 }
 
+TEST_F(ScorerTest, TestTERScorerLong) {
+  // more than 128 reference words, to use several blocks of 64
+  vector<vector<WordID> > ref(1, refs1[0]);
+  ref[0].insert(ref[0].end(), refs1[3].begin(), refs1[3].end());
+  ref[0].insert(ref[0].end(), refs1[0].begin(), refs1[0].end());
+  vector<WordID> hyp = hyp1;
+  hyp.insert(hyp.end(), refs1[3].begin(), refs1[3].end());
+  hyp.insert(hyp.end(), hyp2.begin(), hyp2.end());
+  ScorerP s1 = SentenceScorer::CreateSentenceScorer(TER, ref);
+  string details;
+  s1->ScoreCandidate(hyp)->ScoreDetails(&details);
+  EXPECT_EQ("TER = 49.17,   0| 57| 27|  5 (len=181)", details);
+}
+
 TEST_F(ScorerTest, TestTERScorerSimple) {
   vector<vector<WordID> > ref(1);
   TD::ConvertSentence("1 2 3 A B", &ref[0]);
@@ -153,6 +220,23 @@ TEST_F(ScorerTest, TestCombiScorer) {
   EXPECT_EQ(d2, details);
 }
 
+TEST_F(ScorerTest, TestCombiScorerMatchesParts) {
+  ScorerP c = SentenceScorer::CreateSentenceScorer(BLEU_minus_TER_over_2, refs0);
+  ScorerP b = SentenceScorer::CreateSentenceScorer(IBM_BLEU, refs0);
+  ScorerP t = SentenceScorer::CreateSentenceScorer(TER, refs0);
+  ScoreP cs = c->ScoreCandidate(hyp1);
+  ScoreP bs = b->ScoreCandidate(hyp1);
+  ScoreP ts = t->ScoreCandidate(hyp1);
+  EXPECT_FLOAT_EQ((bs->ComputeScore() - ts->ComputeScore()) / 2, cs->ComputeScore());
+  cs->PlusEquals(*c->ScoreCandidate(hyp2));
+  bs->PlusEquals(*b->ScoreCandidate(hyp2));
+  ts->PlusEquals(*t->ScoreCandidate(hyp2));
+  EXPECT_FLOAT_EQ((bs->ComputeScore() - ts->ComputeScore()) / 2, cs->ComputeScore());
+  ScoreP d = cs->GetZero();
+  cs->Subtract(*c->ScoreCandidate(hyp2), d.get());
+  EXPECT_FLOAT_EQ(c->ScoreCandidate(hyp1)->ComputeScore(), d->ComputeScore());
+}
+
 TEST_F(ScorerTest, AERTest) {
   vector<vector<WordID> > refs0(1);
   TD::ConvertSentence("0-0 2-1 1-2 3-3", &refs0[0]);
@@ -175,6 +259,27 @@ TEST_F(ScorerTest, AERTest) {
   EXPECT_EQ(d2, details);
 }
 
+static string AERCounts(const string& ref, const string& hyp) {
+  vector<vector<WordID> > refs(1);
+  TD::ConvertSentence(ref, &refs[0]);
+  vector<WordID> h;
+  TD::ConvertSentence(hyp, &h);
+  AERScorer as(refs);
+  string details;
+  as.ScoreCandidate(h)->ScoreDetails(&details);
+  return details.substr(details.find('['));
+}
+
+TEST_F(ScorerTest, AERCounts) {
+  // [matches predicted in_ref]
+  EXPECT_EQ("[1 2 4]", AERCounts("0-0 2-1 1-2 3-3", "0-0 1-1"));
+  // links outside the reference grid, repeated links, a prefix to skip
+  EXPECT_EQ("[2 4 4]", AERCounts("0-0 2-1 1-2 3-3", "x ||| 3-3 0-0 0-0 7-1 0-9 7-1"));
+  EXPECT_EQ("[0 0 4]", AERCounts("0-0 2-1 1-2 3-3", ""));
+  // rows over several words
+  EXPECT_EQ("[2 3 3]", AERCounts("0-0 1-64 2-130", "1-64 2-130 2-129"));
+}
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -7,6 +7,7 @@
 #include <sstream>
 #include <tr1/unordered_map>
 #include <set>
+#include <stdint.h>
 #include <valarray>
 #include <boost/functional/hash.hpp>
 #include <stdexcept>
@@ -72,9 +73,13 @@ class TERScorerImpl {
  public:
   enum TransType { MATCH, SUBSTITUTION, INSERTION, DELETION };
 
-  explicit TERScorerImpl(const vector<WordID>& ref) : ref_(ref) {
-    for (int i = 0; i < ref.size(); ++i)
-      rwexists_.insert(ref[i]);
+  explicit TERScorerImpl(const vector<WordID>& ref) : ref_(ref), blocks_((ref.size() + 63) / 64) {
+    for (int i = 0; i < ref.size(); ++i) {
+      vector<uint64_t>& eq = peq_[ref[i]];
+      if (eq.empty()) eq.resize(blocks_, 0);
+      eq[i / 64] |= static_cast<uint64_t>(1) << (i % 64);
+    }
+    BuildWordMatches();
   }
 
   float Calculate(const vector<WordID>& hyp, int* subs, int* ins, int* dels, int* shifts) const {
@@ -87,10 +92,24 @@ class TERScorerImpl {
 
  private:
   vector<WordID> ref_;
-  set<WordID> rwexists_;
-
-  typedef unordered_map<vector<WordID>, set<int>, boost::hash<vector<WordID> > > NgramToIntsMap;
-  mutable NgramToIntsMap nmap_;
+  // for EditDistance: the 64-bit blocks of the reference, and for each
+  // reference word, the positions it is at, as bits of blocks_ words
+  int blocks_;
+  typedef unordered_map<WordID, vector<uint64_t> > PeqMap;
+  PeqMap peq_;
+
+  // the n-grams of the reference (of up to MAX_SHIFT_SIZE words) as a
+  // trie: the one extending n-gram p (-1 for the empty one) by word w is
+  // numbered nids_[NgramKey(p, w)] and starts at positions nstarts_[id]
+  static uint64_t NgramKey(int p, WordID w) {
+    return (static_cast<uint64_t>(p + 1) << 32) | static_cast<uint32_t>(w);
+  }
+  int FindNgram(int p, WordID w) const {
+    unordered_map<uint64_t, int>::const_iterator it = nids_.find(NgramKey(p, w));
+    return it == nids_.end() ? -1 : it->second;
+  }
+  unordered_map<uint64_t, int> nids_;
+  vector<vector<int> > nstarts_;
 
   static float MinimumEditDistance(
       const vector<WordID>& hyp,
@@ -158,20 +177,59 @@ class TERScorerImpl {
     return cmat[hyp.size()][ref.size()];
   }
 
-  void BuildWordMatches(const vector<WordID>& hyp, NgramToIntsMap* nmap) const {
-    nmap->clear();
-    set<WordID> exists_both;
-    for (int i = 0; i < hyp.size(); ++i)
-      if (rwexists_.find(hyp[i]) != rwexists_.end())
-        exists_both.insert(hyp[i]);
+  // the unit cost edit distance of hyp and the reference, with Myers'
+  // bit-parallel algorithm (in Hyyro's formulation, with a block of 64
+  // reference words per machine word).  Once the distance is certain to be
+  // more than limit, returns a lower bound on it that is more than limit.
+  int EditDistance(const vector<WordID>& hyp, int limit) const {
+    const int m = ref_.size();
+    const int n = hyp.size();
+    if (!m) return n;
+    const uint64_t kHigh = static_cast<uint64_t>(1) << 63;
+    const uint64_t last_high = static_cast<uint64_t>(1) << ((m - 1) % 64);
+    vector<uint64_t> pv(blocks_, ~static_cast<uint64_t>(0)), mv(blocks_, 0);
+    int score = m;
+    for (int j = 0; j < n; ++j) {
+      PeqMap::const_iterator it = peq_.find(hyp[j]);
+      const uint64_t* peq = (it == peq_.end() ? NULL : &it->second[0]);
+      int hin = 1;  // the first row goes up by one per hypothesis word
+      for (int b = 0; b < blocks_; ++b) {
+        uint64_t eq = peq ? peq[b] : 0;
+        const uint64_t hin_neg = (hin < 0 ? 1 : 0);
+        const uint64_t xv = eq | mv[b];
+        eq |= hin_neg;
+        const uint64_t xh = (((eq & pv[b]) + pv[b]) ^ pv[b]) | eq;
+        uint64_t ph = mv[b] | ~(xh | pv[b]);
+        uint64_t mh = pv[b] & xh;
+        const uint64_t high = (b == blocks_ - 1 ? last_high : kHigh);
+        const int hout = (ph & high ? 1 : 0) - (mh & high ? 1 : 0);
+        ph <<= 1;
+        mh <<= 1;
+        mh |= hin_neg;
+        if (hin > 0) ph |= 1;
+        pv[b] = mh | ~(xv | ph);
+        mv[b] = ph & xv;
+        hin = hout;
+      }
+      score += hin;
+      // each remaining word can take the distance down by at most one
+      if (score - (n - j - 1) > limit) return score - (n - j - 1);
+    }
+    return score;
+  }
+
+  // hypotheses are only ever looked up with n-grams of their own words, so
+  // this does not have to be filtered by the words of each hypothesis
+  void BuildWordMatches() {
     for (int start=0; start<ref_.size(); ++start) {
-      if (exists_both.find(ref_[start]) == exists_both.end()) continue;
-      vector<WordID> cp;
+      int p = -1;
       int mlen = min(MAX_SHIFT_SIZE, static_cast<int>(ref_.size() - start));
       for (int len=0; len<mlen; ++len) {
-        if (len && exists_both.find(ref_[start + len]) == exists_both.end()) break;
-        cp.push_back(ref_[start + len]);
-	(*nmap)[cp].insert(start);
+        pair<unordered_map<uint64_t, int>::iterator, bool> r =
+            nids_.insert(make_pair(NgramKey(p, ref_[start + len]), static_cast<int>(nstarts_.size())));
+        if (r.second) nstarts_.push_back(vector<int>());
+        p = r.first->second;
+	nstarts_[p].push_back(start);
       }
     }
   }
@@ -231,12 +289,11 @@ class TERScorerImpl {
       const int min_size,
       vector<vector<Shift> >* shifts) const {
     for (int start = 0; start < hyp.size(); ++start) {
-      vector<WordID> cp(1, hyp[start]);
-      NgramToIntsMap::iterator niter = nmap_.find(cp);
-      if (niter == nmap_.end()) continue;
+      const int first = FindNgram(-1, hyp[start]);
+      if (first < 0) continue;
       bool ok = false;
       int moveto;
-      for (set<int>::iterator i = niter->second.begin(); i != niter->second.end(); ++i) {
+      for (vector<int>::const_iterator i = nstarts_[first].begin(); i != nstarts_[first].end(); ++i) {
         moveto = *i;
         int rm = ralign[moveto];
         ok = (start != rm &&
@@ -245,14 +302,13 @@ class TERScorerImpl {
         if (ok) break;
       }
       if (!ok) continue;
-      cp.clear();
+      int id = -1;
       for (int end = start + min_size - 1;
            ok && end < hyp.size() && end < (start + MAX_SHIFT_SIZE); ++end) {
-        cp.push_back(hyp[end]);
+        id = FindNgram(id, hyp[end]);
 	vector<Shift>& sshifts = (*shifts)[end - start];
         ok = false;
-        NgramToIntsMap::iterator niter = nmap_.find(cp);
-        if (niter == nmap_.end()) break;
+        if (id < 0) break;
         bool any_herr = false;
         for (int i = start; i <= end && !any_herr; ++i)
           any_herr = herr[i];
@@ -260,8 +316,8 @@ class TERScorerImpl {
           ok = true;
           continue;
         }
-        for (set<int>::iterator mi = niter->second.begin();
-             mi != niter->second.end(); ++mi) {
+        for (vector<int>::const_iterator mi = nstarts_[id].begin();
+             mi != nstarts_[id].end(); ++mi) {
           int moveto = *mi;
 	  int rm = ralign[moveto];
 	  if (! ((rm != start) &&
@@ -349,8 +405,18 @@ class TERScorerImpl {
 	curfix = curerr - (cur_best_shift_cost + *newerr);
 	maxfix = 2.0f * (1 + i) - COSTS::shift;  // TODO remove?
         if ((curfix > maxfix) || ((cur_best_shift_cost == 0) && (curfix == maxfix))) continue;
+	// the largest cost of the shifted hypothesis that would be taken
+	const float limit = (*newerr + cur_best_shift_cost) - COSTS::shift - (cur_best_shift_cost == 0.0f ? 0.0f : 1.0f);
+	// moving the words over less than 2 * their number of words apart
+	// changes the cost of cur by at most twice that
+	const int dest = ralign[s.moveto()];
+	const int len = s.end() - s.begin() + 1;
+	const int dist = (dest < s.begin()) ? s.begin() - dest - 1 : (dest > s.end() ? dest - s.end() : dest - s.begin());
+	if (curerr - 2 * min(len, dist) > limit) continue;
 	vector<WordID> shifted(cur.size());
-	PerformShift(cur, s.begin(), s.end(), ralign[s.moveto()], &shifted);
+	PerformShift(cur, s.begin(), s.end(), dest, &shifted);
+	// only the shifts that are better get the complete alignment
+	if (EditDistance(shifted, static_cast<int>(limit)) > limit) continue;
 	vector<TransType> try_path;
 	float try_cost = MinimumEditDistance(shifted, ref_, &try_path);
 	float gain = (*newerr + cur_best_shift_cost) - (try_cost + COSTS::shift);
@@ -386,7 +452,6 @@ class TERScorerImpl {
 
   float CalculateAllShifts(const vector<WordID>& hyp,
       int* subs, int* ins, int* dels, int* shifts) const {
-    BuildWordMatches(hyp, &nmap_);
     vector<TransType> path;
     float med_cost = MinimumEditDistance(hyp, ref_, &path);
     float edits = 0;
@@ -497,39 +562,46 @@ TERScorer::~TERScorer() {
     delete *i;
 }
 
-TERScorer::TERScorer(const vector<vector<WordID> >& refs) : impl_(refs.size()) {
-  for (int i = 0; i < refs.size(); ++i)
+TERScorer::TERScorer(const vector<vector<WordID> >& refs) : impl_(refs.size()), avg_len_(0) {
+  for (int i = 0; i < refs.size(); ++i) {
     impl_[i] = new TERScorerImpl(refs[i]);
+    avg_len_ += refs[i].size();
+  }
+  if (!refs.empty()) avg_len_ /= static_cast<int>(refs.size());
 }
 
 ScoreP TERScorer::ScoreCCandidate(const vector<WordID>& hyp) const {
   return ScoreP();
 }
 
-ScoreP TERScorer::ScoreCandidate(const std::vector<WordID>& hyp) const {
+void TERScorer::ComputeStats(const vector<WordID>& hyp, int* stats) const {
   float best_score = numeric_limits<float>::max();
-  TERScore* res = new TERScore;
-  int avg_len = 0;
-  for (int i = 0; i < impl_.size(); ++i)
-    avg_len += impl_[i]->GetRefLength();
-  avg_len /= impl_.size();
+  for (int i = 0; i < kNUM_STATS; ++i) stats[i] = 0;
   for (int i = 0; i < impl_.size(); ++i) {
     int subs, ins, dels, shifts;
     float score = impl_[i]->Calculate(hyp, &subs, &ins, &dels, &shifts);
     // cerr << "Component TER cost: " << score << endl;
     if (score < best_score) {
-      res->stats[TERScore::kINSERTIONS] = ins;
-      res->stats[TERScore::kDELETIONS] = dels;
-      res->stats[TERScore::kSUBSTITUTIONS] = subs;
-      res->stats[TERScore::kSHIFTS] = shifts;
+      stats[kINSERTIONS] = ins;
+      stats[kDELETIONS] = dels;
+      stats[kSUBSTITUTIONS] = subs;
+      stats[kSHIFTS] = shifts;
       if (ter_use_average_ref_len) {
-        res->stats[TERScore::kREF_WORDCOUNT] = avg_len;
+        stats[kREF_WORDCOUNT] = avg_len_;
       } else {
-        res->stats[TERScore::kREF_WORDCOUNT] = impl_[i]->GetRefLength();
+        stats[kREF_WORDCOUNT] = impl_[i]->GetRefLength();
       }
 
       best_score = score;
     }
   }
+}
+
+ScoreP TERScorer::ScoreCandidate(const std::vector<WordID>& hyp) const {
+  int stats[kNUM_STATS];
+  ComputeStats(hyp, stats);
+  TERScore* res = new TERScore;
+  for (int i = 0; i < kNUM_STATS; ++i)
+    res->stats[i] = stats[i];
   return ScoreP(res);
 }
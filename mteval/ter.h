@@ -12,8 +12,15 @@ class TERScorer : public SentenceScorer {
   ScoreP ScoreCandidate(const std::vector<WordID>& hyp) const;
   ScoreP ScoreCCandidate(const std::vector<WordID>& hyp) const;
   static ScoreP ScoreFromString(const std::string& data);
+
+  enum { kINSERTIONS, kDELETIONS, kSUBSTITUTIONS, kSHIFTS, kREF_WORDCOUNT, kNUM_STATS };
+  // the edit counts of hyp against the closest reference and the reference
+  // length, indexed as above, without making a Score (for scorers that
+  // combine them with other statistics)
+  void ComputeStats(const std::vector<WordID>& hyp, int* stats) const;
  private:
   std::vector<TERScorerImpl*> impl_;
+  int avg_len_;
 };
 
 #endif
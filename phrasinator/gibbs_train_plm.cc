@@ -3,10 +3,16 @@
 
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
+#include <boost/thread/thread.hpp>
 
 #include "filelib.h"
 #include "dict.h"
 #include "sampler.h"
+#include "prob.h"
+
+// declared before ccrp.h so that CCRP<vector<int> >::Print can find it
+std::ostream& operator<<(std::ostream& os, const std::vector<int>& phrase);
+
 #include "ccrp.h"
 
 using namespace std;
@@ -53,6 +59,8 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
         ("write_cdec_grammar,g", po::value<string>(), "Write cdec grammar to this file")
         ("write_cdec_weights,w", po::value<string>(), "Write cdec weights to this file")
         ("poisson_length,p", "Use a Poisson distribution as the length of a phrase in the base distribuion")
+        ("blocked_sampling,b", "Resample each sentence's whole segmentation at once (forward filtering, backward sampling)")
+        ("threads,t",po::value<unsigned>()->default_value(1), "Sample blocks of sentences on this many threads, merging the counts after every sweep")
         ("no_hyperparameter_inference,N", "Disable hyperparameter inference");
   po::options_description clo("Command line options");
   clo.add_options()
@@ -110,19 +118,29 @@ struct UniphraseLM {
     uniform_word_(1.0 / vocab.size()),
     gen_p0_(0.5),
     p_end_(0.5),
-    use_poisson_(conf.count("poisson_length") > 0) {}
+    use_poisson_(conf.count("poisson_length") > 0),
+    blocked_(conf.count("blocked_sampling") > 0),
+    num_threads_(max(conf["threads"].as<unsigned>(), 1u)) {
+    // p0 only depends on the length of the phrase, so it's computed up front
+    // for every length in the corpus (which also makes it safe to call from
+    // the sampling threads)
+    size_t max_len = 1;
+    for (int i = 0; i < corpus_.size(); ++i)
+      max_len = max(max_len, corpus_[i].size());
+    p0s_.resize(max_len + 1);
+    for (size_t len = 1; len <= max_len; ++len) {
+      double& p = p0s_[len];
+      p = exp(log_p0(vector<int>(len)));
+      if (!p) {
+        cerr << "0 prob phrase of length " << len << "\nAssigning std::numeric_limits<double>::min()\n";
+        p = std::numeric_limits<double>::min();
+      }
+    }
+  }
 
   double p0(const vector<int>& phrase) const {
-    static vector<double> p0s(10000, 0.0);
-    assert(phrase.size() < 10000);
-    double& p = p0s[phrase.size()];
-    if (p) return p;
-    p = exp(log_p0(phrase));
-    if (!p) {
-      cerr << "0 prob phrase: " << phrase << "\nAssigning std::numeric_limits<double>::min()\n";
-      p = std::numeric_limits<double>::min();
-    }
-    return p;
+    assert(phrase.size() < p0s_.size());
+    return p0s_[phrase.size()];
   }
 
   double log_p0(const vector<int>& phrase) const {
@@ -191,54 +209,175 @@ struct UniphraseLM {
         //for (int j = 0; j < z.size(); ++j) z[j] = z_[0][j];
         //SegCorpus::Write(corpus_[0], z, d);
       }
-      for (int i = 0; i < corpus_.size(); ++i) {
-        const vector<int>& line = corpus_[i];
-        const int ls = line.size();
-        const int last_pos = ls - 1;
-        vector<bool>& z = z_[i];
-        int prev = 0;
-        for (int j = 0; j < last_pos; ++j) { // don't resample last position
-          int next = j+1;  while(!z[next]) { ++next; }
-          const vector<int> p1p2(line.begin() + prev, line.begin() + next + 1);
-          const vector<int> p1(line.begin() + prev, line.begin() + j + 1);
-          const vector<int> p2(line.begin() + j + 1, line.begin() + next + 1);
-
-          if (z[j]) {
-            phrases_.decrement(p1, rng);
-            phrases_.decrement(p2, rng);
-            gen_.decrement(false, rng);
-            gen_.decrement(false, rng);
-          } else {
-            phrases_.decrement(p1p2, rng);
-            gen_.decrement(false, rng);
-          }
-
-          const double d1 = phrases_.prob(p1p2, p0(p1p2)) * gen_.prob(false, gen_p0_);
-          double d2 = phrases_.prob(p1, p0(p1)) * gen_.prob(false, gen_p0_);
-          phrases_.increment(p1, p0(p1), rng);
-          gen_.increment(false, gen_p0_, rng);
-          d2 *= phrases_.prob(p2, p0(p2)) * gen_.prob(false, gen_p0_);
-          phrases_.decrement(p1, rng);
-          gen_.decrement(false, rng);
-          z[j] = rng->SelectSample(d1, d2);
-
-          if (z[j]) {
-            phrases_.increment(p1, p0(p1), rng);
-            phrases_.increment(p2, p0(p2), rng);
-            gen_.increment(false, gen_p0_, rng);
-            gen_.increment(false, gen_p0_, rng);
-            prev = j + 1;
-          } else {
-            phrases_.increment(p1p2, p0(p1p2), rng);
-            gen_.increment(false, gen_p0_, rng);
-          }
-        }
+      if (num_threads_ > 1) {
+        ParallelSweep(rng);
+      } else {
+        for (int i = 0; i < corpus_.size(); ++i)
+          ResampleSentence(i, &phrases_, &gen_, rng);
       }
     }
 //    cerr << endl << endl << gen_ << endl << phrases_ << endl;
     cerr << gen_.prob(false, gen_p0_) << " " << gen_.prob(true, 1 - gen_p0_) << endl;
   }
 
+  void ResampleSentence(int i, CCRP<vector<int> >* phrases, CCRP<bool>* gen, MT19937* rng) {
+    if (blocked_)
+      ResampleSegmentation(i, phrases, gen, rng);
+    else
+      ResampleBoundaries(i, phrases, gen, rng);
+  }
+
+  // resamples the boundaries of sentence i one position at a time
+  void ResampleBoundaries(int i, CCRP<vector<int> >* phrases, CCRP<bool>* gen, MT19937* rng) {
+    const vector<int>& line = corpus_[i];
+    const int ls = line.size();
+    const int last_pos = ls - 1;
+    vector<bool>& z = z_[i];
+    int prev = 0;
+    for (int j = 0; j < last_pos; ++j) { // don't resample last position
+      int next = j+1;  while(!z[next]) { ++next; }
+      const vector<int> p1p2(line.begin() + prev, line.begin() + next + 1);
+      const vector<int> p1(line.begin() + prev, line.begin() + j + 1);
+      const vector<int> p2(line.begin() + j + 1, line.begin() + next + 1);
+
+      if (z[j]) {
+        phrases->decrement(p1, rng);
+        phrases->decrement(p2, rng);
+        gen->decrement(false, rng);
+        gen->decrement(false, rng);
+      } else {
+        phrases->decrement(p1p2, rng);
+        gen->decrement(false, rng);
+      }
+
+      const double d1 = phrases->prob(p1p2, p0(p1p2)) * gen->prob(false, gen_p0_);
+      double d2 = phrases->prob(p1, p0(p1)) * gen->prob(false, gen_p0_);
+      phrases->increment(p1, p0(p1), rng);
+      gen->increment(false, gen_p0_, rng);
+      d2 *= phrases->prob(p2, p0(p2)) * gen->prob(false, gen_p0_);
+      phrases->decrement(p1, rng);
+      gen->decrement(false, rng);
+      z[j] = rng->SelectSample(d1, d2);
+
+      if (z[j]) {
+        phrases->increment(p1, p0(p1), rng);
+        phrases->increment(p2, p0(p2), rng);
+        gen->increment(false, gen_p0_, rng);
+        gen->increment(false, gen_p0_, rng);
+        prev = j + 1;
+      } else {
+        phrases->increment(p1p2, p0(p1p2), rng);
+        gen->increment(false, gen_p0_, rng);
+      }
+    }
+  }
+
+  // takes sentence i's phrases out of the restaurants and draws its whole
+  // segmentation at once by forward filtering, backward sampling.  The
+  // phrase probabilities are those of the rest of the corpus, i.e. phrases
+  // repeated within the sentence don't see each other
+  void ResampleSegmentation(int i, CCRP<vector<int> >* phrases, CCRP<bool>* gen, MT19937* rng) {
+    const vector<int>& line = corpus_[i];
+    const int ls = line.size();
+    vector<bool>& z = z_[i];
+    Unseat(line, z, phrases, gen, rng);
+    const double p_cont = gen->prob(false, gen_p0_);
+    // pp[j * ls + k] = p(line[k..j) is a phrase), alpha[j] = p(line[0..j))
+    vector<prob_t> pp(ls * (ls + 1));
+    vector<prob_t> alpha(ls + 1);
+    alpha[0] = prob_t::One();
+    vector<int> p;
+    for (int j = 1; j <= ls; ++j) {
+      for (int k = 0; k < j; ++k) {
+        p.assign(line.begin() + k, line.begin() + j);
+        pp[j * ls + k] = prob_t(phrases->prob(p, p0(p)) * p_cont);
+        alpha[j] += alpha[k] * pp[j * ls + k];
+      }
+    }
+    z.assign(ls, false);
+    SampleSet<prob_t> ss;
+    for (int j = ls; j > 0; ) {
+      ss.clear();
+      for (int k = 0; k < j; ++k)
+        ss.add(alpha[k] * pp[j * ls + k]);
+      z[j - 1] = true;
+      j = rng->SelectSample(ss);
+    }
+    Seat(line, z, phrases, gen, rng);
+  }
+
+  // adds (removes) the phrases of line, segmented by z, to (from) the
+  // restaurants.  The end of utterance isn't touched
+  void Seat(const vector<int>& line, const vector<bool>& z, CCRP<vector<int> >* phrases, CCRP<bool>* gen, MT19937* rng) const {
+    int prev = 0;
+    for (int j = 0; j < line.size(); ++j) {
+      if (z[j]) {
+        const vector<int> p(line.begin() + prev, line.begin() + j + 1);
+        phrases->increment(p, p0(p), rng);
+        gen->increment(false, gen_p0_, rng);
+        prev = j + 1;
+      }
+    }
+  }
+
+  void Unseat(const vector<int>& line, const vector<bool>& z, CCRP<vector<int> >* phrases, CCRP<bool>* gen, MT19937* rng) const {
+    int prev = 0;
+    for (int j = 0; j < line.size(); ++j) {
+      if (z[j]) {
+        const vector<int> p(line.begin() + prev, line.begin() + j + 1);
+        phrases->decrement(p, rng);
+        gen->decrement(false, rng);
+        prev = j + 1;
+      }
+    }
+  }
+
+  // samples sentences [begin, end) against a private copy of the restaurants
+  // as they were at the start of the sweep
+  struct BlockSampler {
+    BlockSampler(UniphraseLM* lm, int begin, int end, uint32_t seed) :
+      lm_(lm), begin_(begin), end_(end), seed_(seed) {}
+    void operator()() const {
+      CCRP<vector<int> > phrases(lm_->phrases_);
+      CCRP<bool> gen(lm_->gen_);
+      MT19937 rng(seed_);
+      for (int i = begin_; i < end_; ++i)
+        lm_->ResampleSentence(i, &phrases, &gen, &rng);
+    }
+    UniphraseLM* lm_;
+    int begin_, end_;
+    uint32_t seed_;
+  };
+
+  // one sweep with the corpus split into num_threads_ blocks of about the
+  // same number of words.  Every sentence is sampled exactly given the counts
+  // of the start of the sweep plus the changes made earlier in its own block
+  // (but not in the other blocks).  The global restaurants are then rebuilt
+  // from the new segmentations
+  void ParallelSweep(MT19937* rng) {
+    size_t words = 0;
+    for (int i = 0; i < corpus_.size(); ++i) words += corpus_[i].size();
+    boost::thread_group threads;
+    size_t seen = 0;
+    int begin = 0;
+    for (unsigned t = 0; t < num_threads_; ++t) {
+      int end = begin;
+      const size_t target = words * (t + 1) / num_threads_;
+      while (end < corpus_.size() && (seen < target || t + 1 == num_threads_))
+        seen += corpus_[end++].size();
+      uint32_t seed = rng->gen()();
+      threads.create_thread(BlockSampler(this, begin, end, seed ? seed : 1));
+      begin = end;
+    }
+    threads.join_all();
+    phrases_.clear();
+    gen_.clear();
+    for (int i = 0; i < corpus_.size(); ++i) {
+      Seat(corpus_[i], z_[i], &phrases_, &gen_, rng);
+      gen_.increment(true, 1.0 - gen_p0_, rng); // end of utterance
+    }
+  }
+
   void WriteCdecGrammarForCurrentSample(ostream* os) const {
     CCRP<vector<int> >::const_iterator it = phrases_.begin();
     for (; it != phrases_.end(); ++it) {
@@ -267,6 +406,9 @@ struct UniphraseLM {
   const double gen_p0_;
   const double p_end_; // in base length distribution, p of the end of a phrase
   const bool use_poisson_;
+  const bool blocked_;
+  const unsigned num_threads_;
+  vector<double> p0s_;   // p0s_[n] is p0 of a phrase of length n
 };
 
 
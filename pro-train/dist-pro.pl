@@ -24,6 +24,7 @@ die "Can't execute $FAST_SCORE" unless -x $FAST_SCORE;
 my $MAPINPUT = "$bin_dir/mr_pro_generate_mapper_input.pl";
 my $MAPPER = "$bin_dir/mr_pro_map";
 my $REDUCER = "$bin_dir/mr_pro_reduce";
+my $TRAINER = "$bin_dir/pro_train";
 my $parallelize = "$VEST_DIR/parallelize.pl";
 my $libcall = "$VEST_DIR/libcall.pl";
 my $sentserver = "$VEST_DIR/sentserver";
@@ -38,6 +39,8 @@ die "Can't find $parallelize" unless -x $parallelize;
 die "Can't find $libcall" unless -e $libcall;
 my $decoder = $cdec;
 my $lines_per_mapper = 30;
+my $mapper_threads = 1;
+my $in_process = 0;
 my $iteration = 1;
 my $run_local = 0;
 my $best_weights;
@@ -78,6 +81,8 @@ if (GetOptions(
 	"tune-regularizer" => \$tune_regularizer,
 	"reg=f" => \$reg,
 	"local" => \$run_local,
+	"mapper-threads=i" => \$mapper_threads,
+	"in-process" => \$in_process,
 	"use-make=i" => \$use_make,
 	"max-iterations=i" => \$max_iterations,
 	"pmem=s" => \$pmem,
@@ -92,10 +97,13 @@ if (GetOptions(
 }
 
 if ($usefork) { $usefork = "--use-fork"; } else { $usefork = ''; }
+die "Can't find $TRAINER" if $in_process && ! -x $TRAINER;
 
 if ($metric =~ /^(combi|ter)$/i) {
   $lines_per_mapper = 5;
 }
+# each mapper samples the pairs of several sentences in parallel
+$lines_per_mapper *= $mapper_threads if $mapper_threads > 1;
 
 ($iniFile) = @ARGV;
 
@@ -252,9 +260,9 @@ while (1){
 		$pcmd = "cat $srcFile |";
 	} elsif ($use_make) {
 	    # TODO: Throw error when decode_nodes is specified along with use_make
-		$pcmd = "cat $srcFile | $parallelize --use-fork -p $pmem -e $logdir -j $use_make --";
+		$pcmd = "cat $srcFile | $parallelize --use-fork --longest-first --speculate -p $pmem -e $logdir -j $use_make --";
 	} else {
-		$pcmd = "cat $srcFile | $parallelize $usefork -p $pmem -e $logdir -j $decode_nodes --";
+		$pcmd = "cat $srcFile | $parallelize $usefork --longest-first --speculate -p $pmem -e $logdir -j $decode_nodes --";
 	}
 	my $cmd = "$pcmd $decoder_cmd 2> $decoderLog 1> $runFile";
 	print STDERR "COMMAND:\n$cmd\n";
@@ -296,128 +304,136 @@ while (1){
 	$cmd="$MAPINPUT $dir/hgs > $dir/agenda.$im1";
 	print STDERR "COMMAND:\n$cmd\n";
 	check_call($cmd);
-	check_call("mkdir -p $dir/splag.$im1");
-	$cmd="split -a 3 -l $lines_per_mapper $dir/agenda.$im1 $dir/splag.$im1/mapinput.";
-	print STDERR "COMMAND:\n$cmd\n";
-	check_call($cmd);
-	opendir(DIR, "$dir/splag.$im1") or die "Can't open directory: $!";
-	my @shards = grep { /^mapinput\./ } readdir(DIR);
-	closedir DIR;
-	die "No shards!" unless scalar @shards > 0;
-	my $joblist = "";
-	my $nmappers = 0;
-	@cleanupcmds = ();
-	my %o2i = ();
-	my $first_shard = 1;
-	my $mkfile; # only used with makefiles
-	my $mkfilename;
-	if ($use_make) {
-		$mkfilename = "$dir/splag.$im1/domap.mk";
-		open $mkfile, ">$mkfilename" or die "Couldn't write $mkfilename: $!";
-		print $mkfile "all: $dir/splag.$im1/map.done\n\n";
-	}
-	my @mkouts = ();  # only used with makefiles
-	my @mapoutputs = ();
-	for my $shard (@shards) {
-		my $mapoutput = $shard;
-		my $client_name = $shard;
-		$client_name =~ s/mapinput.//;
-		$client_name = "pro.$client_name";
-		$mapoutput =~ s/mapinput/mapoutput/;
-		push @mapoutputs, "$dir/splag.$im1/$mapoutput";
-		$o2i{"$dir/splag.$im1/$mapoutput"} = "$dir/splag.$im1/$shard";
-		my $script = "$MAPPER -s $srcFile -l $metric $refs_comma_sep -w $inweights -K $dir/kbest < $dir/splag.$im1/$shard > $dir/splag.$im1/$mapoutput";
+	if ($in_process) {
+		$cmd="$TRAINER -s $srcFile -l $metric -j $mapper_threads $refs_comma_sep -w $inweights -K $dir/kbest --sigma_squared $reg";
+		$cmd .= " -T" if $tune_regularizer;
+		$cmd .= " < $dir/agenda.$im1 > $dir/weights.$iteration 2> $logdir/pro_train.log";
+		print STDERR "COMMAND:\n$cmd\n";
+		check_bash_call($cmd);
+	} else {
+		check_call("mkdir -p $dir/splag.$im1");
+		$cmd="split -a 3 -l $lines_per_mapper $dir/agenda.$im1 $dir/splag.$im1/mapinput.";
+		print STDERR "COMMAND:\n$cmd\n";
+		check_call($cmd);
+		opendir(DIR, "$dir/splag.$im1") or die "Can't open directory: $!";
+		my @shards = grep { /^mapinput\./ } readdir(DIR);
+		closedir DIR;
+		die "No shards!" unless scalar @shards > 0;
+		my $joblist = "";
+		my $nmappers = 0;
+		@cleanupcmds = ();
+		my %o2i = ();
+		my $first_shard = 1;
+		my $mkfile; # only used with makefiles
+		my $mkfilename;
+		if ($use_make) {
+			$mkfilename = "$dir/splag.$im1/domap.mk";
+			open $mkfile, ">$mkfilename" or die "Couldn't write $mkfilename: $!";
+			print $mkfile "all: $dir/splag.$im1/map.done\n\n";
+		}
+		my @mkouts = ();  # only used with makefiles
+		my @mapoutputs = ();
+		for my $shard (@shards) {
+			my $mapoutput = $shard;
+			my $client_name = $shard;
+			$client_name =~ s/mapinput.//;
+			$client_name = "pro.$client_name";
+			$mapoutput =~ s/mapinput/mapoutput/;
+			push @mapoutputs, "$dir/splag.$im1/$mapoutput";
+			$o2i{"$dir/splag.$im1/$mapoutput"} = "$dir/splag.$im1/$shard";
+			my $script = "$MAPPER -s $srcFile -l $metric -j $mapper_threads $refs_comma_sep -w $inweights -K $dir/kbest < $dir/splag.$im1/$shard > $dir/splag.$im1/$mapoutput";
+			if ($run_local) {
+				print STDERR "COMMAND:\n$script\n";
+				check_bash_call($script);
+			} elsif ($use_make) {
+				my $script_file = "$dir/scripts/map.$shard";
+				open F, ">$script_file" or die "Can't write $script_file: $!";
+				print F "#!/bin/bash\n";
+				print F "$script\n";
+				close F;
+				my $output = "$dir/splag.$im1/$mapoutput";
+				push @mkouts, $output;
+				chmod(0755, $script_file) or die "Can't chmod $script_file: $!";
+				if ($first_shard) { print STDERR "$script\n"; $first_shard=0; }
+				print $mkfile "$output: $dir/splag.$im1/$shard\n\t$script_file\n\n";
+			} else {
+				my $script_file = "$dir/scripts/map.$shard";
+				open F, ">$script_file" or die "Can't write $script_file: $!";
+				print F "$script\n";
+				close F;
+				if ($first_shard) { print STDERR "$script\n"; $first_shard=0; }
+
+				$nmappers++;
+				my $qcmd = "$QSUB_CMD -N $client_name -o /dev/null -e $logdir/$client_name.ER $script_file";
+				my $jobid = check_output("$qcmd");
+				chomp $jobid;
+				$jobid =~ s/^(\d+)(.*?)$/\1/g;
+				$jobid =~ s/^Your job (\d+) .*$/\1/;
+			 	push(@cleanupcmds, "qdel $jobid 2> /dev/null");
+				print STDERR " $jobid";
+				if ($joblist == "") { $joblist = $jobid; }
+				else {$joblist = $joblist . "\|" . $jobid; }
+			}
+		}
+		my @dev_outs = ();
+		my @devtest_outs = ();
+		if ($tune_regularizer) {
+			for (my $i = 0; $i < scalar @mapoutputs; $i++) {
+				if ($i % 3 == 1) {
+					push @devtest_outs, $mapoutputs[$i];
+				} else {
+					push @dev_outs, $mapoutputs[$i];
+				}
+			}
+			if (scalar @devtest_outs == 0) {
+				die "Not enough training instances for regularization tuning! Rerun without --tune-regularizer\n";
+			}
+		} else {
+			@dev_outs = @mapoutputs;
+		}
 		if ($run_local) {
-			print STDERR "COMMAND:\n$script\n";
-			check_bash_call($script);
+			print STDERR "\nCompleted extraction of training exemplars.\n";
 		} elsif ($use_make) {
-			my $script_file = "$dir/scripts/map.$shard";
-			open F, ">$script_file" or die "Can't write $script_file: $!";
-			print F "#!/bin/bash\n";
-			print F "$script\n";
-			close F;
-			my $output = "$dir/splag.$im1/$mapoutput";
-			push @mkouts, $output;
-			chmod(0755, $script_file) or die "Can't chmod $script_file: $!";
-			if ($first_shard) { print STDERR "$script\n"; $first_shard=0; }
-			print $mkfile "$output: $dir/splag.$im1/$shard\n\t$script_file\n\n";
+			print $mkfile "$dir/splag.$im1/map.done: @mkouts\n\ttouch $dir/splag.$im1/map.done\n\n";
+			close $mkfile;
+			my $mcmd = "make -j $use_make -f $mkfilename";
+			print STDERR "\nExecuting: $mcmd\n";
+			check_call($mcmd);
 		} else {
-			my $script_file = "$dir/scripts/map.$shard";
-			open F, ">$script_file" or die "Can't write $script_file: $!";
-			print F "$script\n";
-			close F;
-			if ($first_shard) { print STDERR "$script\n"; $first_shard=0; }
-
-			$nmappers++;
-			my $qcmd = "$QSUB_CMD -N $client_name -o /dev/null -e $logdir/$client_name.ER $script_file";
-			my $jobid = check_output("$qcmd");
-			chomp $jobid;
-			$jobid =~ s/^(\d+)(.*?)$/\1/g;
-			$jobid =~ s/^Your job (\d+) .*$/\1/;
-		 	push(@cleanupcmds, "qdel $jobid 2> /dev/null");
-			print STDERR " $jobid";
-			if ($joblist == "") { $joblist = $jobid; }
-			else {$joblist = $joblist . "\|" . $jobid; }
-		}
-	}
-	my @dev_outs = ();
-	my @devtest_outs = ();
-	if ($tune_regularizer) {
-		for (my $i = 0; $i < scalar @mapoutputs; $i++) {
-			if ($i % 3 == 1) {
-				push @devtest_outs, $mapoutputs[$i];
-			} else {
-				push @dev_outs, $mapoutputs[$i];
+			print STDERR "\nLaunched $nmappers mappers.\n";
+	      		sleep 8;
+			print STDERR "Waiting for mappers to complete...\n";
+			while ($nmappers > 0) {
+			  sleep 5;
+			  my @livejobs = grep(/$joblist/, split(/\n/, unchecked_output("qstat | grep -v ' C '")));
+			  $nmappers = scalar @livejobs;
 			}
+			print STDERR "All mappers complete.\n";
 		}
-		if (scalar @devtest_outs == 0) {
-			die "Not enough training instances for regularization tuning! Rerun without --tune-regularizer\n";
+		my $tol = 0;
+		my $til = 0;
+		my $dev_test_file = "$dir/splag.$im1/devtest.gz";
+		if ($tune_regularizer) {
+			my $cmd = "cat @devtest_outs | gzip > $dev_test_file";
+			check_bash_call($cmd);
+			die "Can't find file $dev_test_file" unless -f $dev_test_file;
 		}
-	} else {
-		@dev_outs = @mapoutputs;
-	}
-	if ($run_local) {
-		print STDERR "\nCompleted extraction of training exemplars.\n";
-	} elsif ($use_make) {
-		print $mkfile "$dir/splag.$im1/map.done: @mkouts\n\ttouch $dir/splag.$im1/map.done\n\n";
-		close $mkfile;
-		my $mcmd = "make -j $use_make -f $mkfilename";
-		print STDERR "\nExecuting: $mcmd\n";
-		check_call($mcmd);
-	} else {
-		print STDERR "\nLaunched $nmappers mappers.\n";
-      		sleep 8;
-		print STDERR "Waiting for mappers to complete...\n";
-		while ($nmappers > 0) {
-		  sleep 5;
-		  my @livejobs = grep(/$joblist/, split(/\n/, unchecked_output("qstat | grep -v ' C '")));
-		  $nmappers = scalar @livejobs;
+	        #print STDERR "MO: @mapoutputs\n";
+		for my $mo (@mapoutputs) {
+			#my $olines = get_lines($mo);
+			#my $ilines = get_lines($o2i{$mo});
+			#die "$mo: no training instances generated!" if $olines == 0;
 		}
-		print STDERR "All mappers complete.\n";
-	}
-	my $tol = 0;
-	my $til = 0;
-	my $dev_test_file = "$dir/splag.$im1/devtest.gz";
-	if ($tune_regularizer) {
-		my $cmd = "cat @devtest_outs | gzip > $dev_test_file";
+		print STDERR "\nRUNNING CLASSIFIER (REDUCER)\n";
+		print STDERR unchecked_output("date");
+		$cmd="cat @dev_outs | $REDUCER -w $dir/weights.$im1 -s $reg";
+		if ($tune_regularizer) {
+			$cmd .= " -T -t $dev_test_file";
+		}
+	        $cmd .= " > $dir/weights.$iteration";
+		print STDERR "COMMAND:\n$cmd\n";
 		check_bash_call($cmd);
-		die "Can't find file $dev_test_file" unless -f $dev_test_file;
 	}
-        #print STDERR "MO: @mapoutputs\n";
-	for my $mo (@mapoutputs) {
-		#my $olines = get_lines($mo);
-		#my $ilines = get_lines($o2i{$mo});
-		#die "$mo: no training instances generated!" if $olines == 0;
-	}
-	print STDERR "\nRUNNING CLASSIFIER (REDUCER)\n";
-	print STDERR unchecked_output("date");
-	$cmd="cat @dev_outs | $REDUCER -w $dir/weights.$im1 -s $reg";
-	if ($tune_regularizer) {
-		$cmd .= " -T -t $dev_test_file";
-	}
-        $cmd .= " > $dir/weights.$iteration";
-	print STDERR "COMMAND:\n$cmd\n";
-	check_bash_call($cmd);
 	$lastWeightsFile = "$dir/weights.$iteration";
 	if ($tune_regularizer) {
 		open W, "<$lastWeightsFile" or die "Can't read $lastWeightsFile: $!";
@@ -576,6 +592,16 @@ General options:
 	--help
 		Print this message and exit.
 
+	--in-process
+		Sample the training pairs and fit the weights in one local
+		pro_train process (using --mapper-threads threads), instead of
+		running mappers and a reducer that pass the pairs as text.
+
+	--mapper-threads <I>
+		Threads each mapper uses to sample the training pairs of its
+		sentences in parallel; mappers are given I times as many input
+		lines. [default=1]
+
 	--max-iterations <M>
 		Maximum number of iterations to run.  If not specified, defaults
 		to 10.
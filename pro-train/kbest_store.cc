@@ -0,0 +1,218 @@
+#include "kbest_store.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <unistd.h>
+
+#include "fdict.h"
+#include "filelib.h"
+#include "murmur_hash.h"
+
+using namespace std;
+
+namespace {
+
+// clears the low 32 bits of x, rounding to nearest
+uint64_t RoundedBits(double x) {
+  const uint64_t kMask = 0xFFFFFFFFull;
+  uint64_t i;
+  memcpy(&i, &x, sizeof(i));
+  const uint64_t r = i & kMask;
+  if ((r << 1) > kMask)
+    i += kMask - r + 1;
+  else
+    i &= ~kMask;
+  return i;
+}
+
+template <typename T>
+void Put(const T& x, string* out) {
+  out->append(reinterpret_cast<const char*>(&x), sizeof(T));
+}
+
+void PutString(const string& s, string* out) {
+  Put<uint32_t>(s.size(), out);
+  out->append(s);
+}
+
+// reads records from the contents of a file; every Get fails once the data
+// runs out
+struct RecordReader {
+  RecordReader(const char* begin, const char* end) : p(begin), e(end) {}
+  template <typename T>
+  bool Get(T* x) {
+    if (e - p < static_cast<ptrdiff_t>(sizeof(T))) return false;
+    memcpy(x, p, sizeof(T));
+    p += sizeof(T);
+    return true;
+  }
+  bool GetString(string* s) {
+    uint32_t len;
+    if (!Get(&len) || static_cast<uint32_t>(e - p) < len) return false;
+    s->assign(p, len);
+    p += len;
+    return true;
+  }
+  const char* p;
+  const char* e;
+};
+
+}  // namespace
+
+KBestStore::KBestStore(const string& file) : file_(file) {
+  if (FileExists(file_) && !Read()) {
+    cerr << "[ERROR] " << file_ << " is not a k-best repository file\n";
+    abort();
+  }
+}
+
+uint64_t KBestStore::Hash(const string& text, const SparseVector<double>& feats) {
+  uint64_t h = MurmurHash64(text.data(), text.size());
+  // summed, since feature ids (and so the order of feats) differ from run to run
+  for (SparseVector<double>::const_iterator it = feats.begin(); it != feats.end(); ++it) {
+    if (!it->second) continue;
+    const string& name = FD::Convert(it->first);
+    const uint64_t bits = RoundedBits(it->second);
+    h += MurmurHash64(name.data(), name.size(), static_cast<uint32_t>(bits >> 32) ^ static_cast<uint32_t>(bits));
+  }
+  return h;
+}
+
+int KBestStore::Find(uint64_t h) const {
+  tr1::unordered_map<uint64_t, int>::const_iterator it = index_.find(h);
+  return it == index_.end() ? -1 : it->second;
+}
+
+void KBestStore::Add(const KBestEntry& e) {
+  const int i = Find(e.hash);
+  if (i < 0) {
+    index_[e.hash] = entries_.size();
+    pending_.push_back(entries_.size());
+    entries_.push_back(e);
+  } else {
+    entries_[i] = e;
+    pending_.push_back(i);
+  }
+}
+
+int KBestStore::FeatureIndex(int fid, string* out) {
+  tr1::unordered_map<int, int>::iterator it = feature_index_.find(fid);
+  if (it != feature_index_.end()) return it->second;
+  out->push_back('F');
+  PutString(FD::Convert(fid), out);
+  feature_index_[fid] = fids_.size();
+  fids_.push_back(fid);
+  return fids_.size() - 1;
+}
+
+int KBestStore::LossIndex(const string& loss, string* out) {
+  for (unsigned i = 0; i < losses_.size(); ++i)
+    if (losses_[i] == loss) return i;
+  out->push_back('L');
+  PutString(loss, out);
+  losses_.push_back(loss);
+  return losses_.size() - 1;
+}
+
+void KBestStore::Write() {
+  if (pending_.empty()) return;
+  sort(pending_.begin(), pending_.end());
+  pending_.erase(unique(pending_.begin(), pending_.end()), pending_.end());
+  string out;
+  for (unsigned i = 0; i < pending_.size(); ++i) {
+    const KBestEntry& e = entries_[pending_[i]];
+    const uint32_t loss = LossIndex(e.loss, &out);
+    vector<pair<uint32_t, double> > feats;
+    feats.reserve(e.feats.size());
+    for (SparseVector<double>::const_iterator it = e.feats.begin(); it != e.feats.end(); ++it)
+      feats.push_back(make_pair(FeatureIndex(it->first, &out), it->second));
+    out.push_back('H');
+    Put(e.hash, &out);
+    Put(e.score, &out);
+    Put(loss, &out);
+    PutString(e.text, &out);
+    PutString(e.stats, &out);
+    Put<uint32_t>(feats.size(), &out);
+    for (unsigned j = 0; j < feats.size(); ++j) {
+      Put(feats[j].first, &out);
+      Put(feats[j].second, &out);
+    }
+  }
+  pending_.clear();
+  ofstream f(file_.c_str(), ios::out | ios::app | ios::binary);
+  f.write(out.data(), out.size());
+  if (!f) {
+    cerr << "[ERROR] can't write to " << file_ << endl;
+    abort();
+  }
+}
+
+bool KBestStore::Read() {
+  string data;
+  {
+    ifstream f(file_.c_str(), ios::in | ios::binary);
+    if (!f) return false;
+    f.seekg(0, ios::end);
+    data.resize(f.tellg());
+    f.seekg(0, ios::beg);
+    if (!data.empty()) f.read(&data[0], data.size());
+    if (!f) return false;
+  }
+  RecordReader r(data.data(), data.data() + data.size());
+  const char* last_complete = r.p;
+  string name;
+  KBestEntry e;
+  bool ok = true;
+  while (ok && r.p < r.e) {
+    const char type = *r.p++;
+    switch (type) {
+      case 'L':
+        if ((ok = r.GetString(&name))) losses_.push_back(name);
+        break;
+      case 'F':
+        if ((ok = r.GetString(&name))) {
+          const int fid = FD::Convert(name);
+          feature_index_[fid] = fids_.size();
+          fids_.push_back(fid);
+        }
+        break;
+      case 'H': {
+        uint32_t loss, n;
+        ok = r.Get(&e.hash) && r.Get(&e.score) && r.Get(&loss) && r.GetString(&e.text) &&
+             r.GetString(&e.stats) && r.Get(&n);
+        e.feats.clear();
+        for (uint32_t i = 0; ok && i < n; ++i) {
+          uint32_t f;
+          double v;
+          if ((ok = r.Get(&f) && r.Get(&v))) {
+            if (f >= fids_.size()) return false;
+            e.feats.set_value(fids_[f], v);
+          }
+        }
+        if (ok) {
+          if (loss >= losses_.size()) return false;
+          e.loss = losses_[loss];
+          Add(e);
+        }
+        break;
+      }
+      default:
+        return false;
+    }
+    if (ok) last_complete = r.p;
+  }
+  pending_.clear();
+  if (!ok) {
+    const size_t size = last_complete - data.data();
+    cerr << "  " << file_ << " was cut short, dropping its last " << (data.size() - size) << " bytes\n";
+    if (truncate(file_.c_str(), size) != 0) {
+      cerr << "[ERROR] can't truncate " << file_ << endl;
+      abort();
+    }
+  }
+  return true;
+}
@@ -0,0 +1,71 @@
+#ifndef _KBEST_STORE_H_
+#define _KBEST_STORE_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <tr1/unordered_map>
+
+#include "sparse_vector.h"
+
+// a hypothesis of a k-best repository, with its features and what its
+// (sentence level) score was under loss function loss
+struct KBestEntry {
+  uint64_t hash;              // KBestStore::Hash(text, feats)
+  std::string text;           // the hypothesis as TD::GetString writes it
+  std::string loss;           // e.g. ibm_bleu
+  std::string stats;          // Score::Encode() of its score
+  double score;               // Score::ComputeScore() of its score
+  SparseVector<double> feats;
+};
+
+// every distinct hypothesis the k-best lists of all iterations have had for
+// one sentence, in an append-only binary file, so an iteration only has to
+// score and write the hypotheses that are new.  Nothing is tokenized when
+// reading, and feature names are converted once per file.
+//
+// The file is a sequence of records, in native byte order:
+//   'L' <uint32 len> <name>    the next loss function in the table
+//   'F' <uint32 len> <name>    the next feature in the table
+//   'H' <uint64 hash> <double score> <uint32 loss>
+//       <uint32 len> <text> <uint32 len> <stats>
+//       <uint32 n> n * (<uint32 feature> <double value>)
+// where loss and feature are indices into the tables.  A later 'H' record
+// replaces an earlier one with the same hash (this is how hypotheses are
+// rescored when the loss function changes).  If the last record was cut
+// short, e.g. by a killed mapper, it is dropped.
+class KBestStore {
+ public:
+  // the hypotheses in file, if it exists
+  explicit KBestStore(const std::string& file);
+
+  // hypotheses with the same words and approximately the same features
+  // (all but the low 32 bits of the doubles) have the same hash
+  static uint64_t Hash(const std::string& text, const SparseVector<double>& feats);
+
+  // the index of the hypothesis with hash h, or -1
+  int Find(uint64_t h) const;
+  // adds e, or replaces the hypothesis with the same hash
+  void Add(const KBestEntry& e);
+  // appends what Add() has added since the last Write() to the file
+  void Write();
+
+  size_t size() const { return entries_.size(); }
+  const KBestEntry& operator[](size_t i) const { return entries_[i]; }
+
+ private:
+  bool Read();
+  int FeatureIndex(int fid, std::string* out);
+  int LossIndex(const std::string& loss, std::string* out);
+
+  const std::string file_;
+  std::vector<KBestEntry> entries_;
+  std::tr1::unordered_map<uint64_t, int> index_;  // hash -> entries_ index
+  std::vector<unsigned> pending_;                 // entries_ not written yet
+  // the tables of the file
+  std::vector<int> fids_;                                    // index -> FD id
+  std::tr1::unordered_map<int, int> feature_index_;          // FD id -> index
+  std::vector<std::string> losses_;
+};
+
+#endif
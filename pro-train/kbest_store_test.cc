@@ -0,0 +1,107 @@
+#include <cstdio>
+#include <fstream>
+#include <unistd.h>
+#include <gtest/gtest.h>
+
+#include "fdict.h"
+#include "kbest_store.h"
+
+using namespace std;
+
+class KBestStoreTest : public testing::Test {
+ protected:
+  virtual void SetUp() {
+    file = "kbest_store_test.tmp.bin";
+    unlink(file.c_str());
+  }
+  virtual void TearDown() {
+    unlink(file.c_str());
+  }
+
+  static KBestEntry Entry(const string& text, double lm, double tm, double score) {
+    KBestEntry e;
+    e.text = text;
+    e.feats.set_value(FD::Convert("LanguageModel"), lm);
+    if (tm) e.feats.set_value(FD::Convert("PhraseModel_0"), tm);
+    e.hash = KBestStore::Hash(e.text, e.feats);
+    e.loss = "ibm_bleu";
+    e.stats = "4 1 0 0 0 2 1 0 0 5 2";
+    e.score = score;
+    return e;
+  }
+
+  string file;
+};
+
+TEST_F(KBestStoreTest, Hash) {
+  const KBestEntry a = Entry("a b c", -10.5, 2, 0.1);
+  EXPECT_EQ(a.hash, Entry("a b c", -10.5 + 1e-12, 2, 0.7).hash);
+  EXPECT_NE(a.hash, Entry("a b c", -10.6, 2, 0.1).hash);
+  EXPECT_NE(a.hash, Entry("a c b", -10.5, 2, 0.1).hash);
+  EXPECT_NE(a.hash, Entry("a b c", -10.5, 0, 0.1).hash);
+}
+
+TEST_F(KBestStoreTest, AppendAndRead) {
+  {
+    KBestStore s(file);
+    EXPECT_EQ(0u, s.size());
+    s.Add(Entry("a b c", -10.5, 2, 0.1));
+    s.Add(Entry("a c b", -11, 0, 0.2));
+    s.Write();
+  }
+  {
+    KBestStore s(file);
+    ASSERT_EQ(2u, s.size());
+    EXPECT_EQ("a c b", s[1].text);
+    EXPECT_EQ(0.2, s[1].score);
+    EXPECT_EQ("ibm_bleu", s[1].loss);
+    EXPECT_EQ("4 1 0 0 0 2 1 0 0 5 2", s[1].stats);
+    EXPECT_EQ(-10.5, s[0].feats.value(FD::Convert("LanguageModel")));
+    EXPECT_EQ(2, s[0].feats.value(FD::Convert("PhraseModel_0")));
+    EXPECT_EQ(1u, s[1].feats.size());
+    EXPECT_EQ(1, s.Find(Entry("a c b", -11, 0, 0).hash));
+    EXPECT_EQ(-1, s.Find(Entry("c b a", -11, 0, 0).hash));
+    // a new one, and a rescored one
+    KBestEntry e = Entry("a b c", -10.5, 2, 0.3);
+    e.loss = "ter";
+    s.Add(e);
+    s.Add(Entry("c b a", -12, 1, 0.4));
+    EXPECT_EQ(3u, s.size());
+    s.Write();
+  }
+  KBestStore s(file);
+  ASSERT_EQ(3u, s.size());
+  EXPECT_EQ("ter", s[0].loss);
+  EXPECT_EQ(0.3, s[0].score);
+  EXPECT_EQ("ibm_bleu", s[1].loss);
+  EXPECT_EQ("c b a", s[2].text);
+  EXPECT_EQ(1, s[2].feats.value(FD::Convert("PhraseModel_0")));
+}
+
+TEST_F(KBestStoreTest, CutShort) {
+  {
+    KBestStore s(file);
+    s.Add(Entry("a b c", -10.5, 2, 0.1));
+    s.Add(Entry("a c b", -11, 0, 0.2));
+    s.Write();
+  }
+  ifstream in(file.c_str(), ios::binary | ios::ate);
+  const size_t size = in.tellg();
+  in.close();
+  ASSERT_EQ(0, truncate(file.c_str(), size - 3));
+  {
+    KBestStore s(file);
+    ASSERT_EQ(1u, s.size());
+    EXPECT_EQ("a b c", s[0].text);
+    s.Add(Entry("a c b", -11, 0, 0.2));
+    s.Write();
+  }
+  KBestStore s(file);
+  ASSERT_EQ(2u, s.size());
+  EXPECT_EQ("a c b", s[1].text);
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
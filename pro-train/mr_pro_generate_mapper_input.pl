@@ -6,13 +6,13 @@ my $d = shift @ARGV;
 die "Can't find directory $d" unless -d $d;
 
 opendir(DIR, $d) or die "Can't read $d: $!";
-my @hgs = grep { /\.gz$/ } readdir(DIR);
+my @hgs = grep { /\.(gz|hgb)$/ } readdir(DIR);
 closedir DIR;
 
 for my $hg (@hgs) {
   my $file = $hg;
   my $id = $hg;
-  $id =~ s/(\.json)?\.gz//;
+  $id =~ s/((\.json)?\.gz|\.hgb)$//;
   print "$d/$file $id\n";
 }
 
@@ -0,0 +1,234 @@
+#include "pro_classifier.h"
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "fdict.h"
+#include "weights.h"
+#include "optimize.h"
+
+using namespace std;
+
+// since this is a ranking model, there should be equal numbers of
+// positive and negative examples, so the bias should be 0
+static const double MAX_BIAS = 1e-10;
+
+void PROCorpus::Add(bool y, const SparseVector<double>& x) {
+  y_.push_back(y);
+  for (SparseVector<double>::const_iterator it = x.begin(); it != x.end(); ++it) {
+    fids_.push_back(it->first);
+    vals_.push_back(it->second);
+  }
+  start_.push_back(fids_.size());
+}
+
+void PROCorpus::Clear() {
+  y_.clear();
+  start_.assign(1, 0);
+  fids_.clear();
+  vals_.clear();
+}
+
+static void InferenceChunk(const vector<double>* px, const PROCorpus* pcorpus, size_t begin, size_t end,
+                           vector<double>* g, double* pcll) {
+  const vector<double>& x = *px;
+  const PROCorpus& corpus = *pcorpus;
+  double cll = 0;
+  for (size_t i = begin; i < end; ++i) {
+    const double dotprod = corpus.Dot(i, x) + x[0]; // x[0] is bias
+    double lp_false = dotprod;
+    double lp_true = -dotprod;
+    if (0 < lp_true) {
+      lp_true += log1p(exp(-lp_true));
+      lp_false = log1p(exp(lp_false));
+    } else {
+      lp_true = log1p(exp(lp_true));
+      lp_false += log1p(exp(-lp_false));
+    }
+    lp_true*=-1;
+    lp_false*=-1;
+    if (corpus.y(i)) {  // true label
+      cll -= lp_true;
+      if (g) {
+        // g -= corpus[i].second * exp(lp_false);
+        corpus.GradAdd(i, -exp(lp_false), g);
+        (*g)[0] -= exp(lp_false); // bias
+      }
+    } else {                  // false label
+      cll -= lp_false;
+      if (g) {
+        // g += corpus[i].second * exp(lp_true);
+        corpus.GradAdd(i, exp(lp_true), g);
+        (*g)[0] += exp(lp_true); // bias
+      }
+    }
+  }
+  *pcll = cll;
+}
+
+double TrainingInference(const vector<double>& x,
+                         const PROCorpus& corpus,
+                         int threads,
+                         vector<double>* g) {
+  if (threads <= 1 || corpus.size() < 1000 * static_cast<size_t>(threads)) {
+    double cll;
+    InferenceChunk(&x, &corpus, 0, corpus.size(), g, &cll);
+    return cll;
+  }
+  vector<double> clls(threads);
+  vector<vector<double> > gs(g ? threads : 0, vector<double>(g ? g->size() : 0, 0.0));
+  {
+    boost::thread_group workers;
+    for (int t = 0; t < threads; ++t)
+      workers.create_thread(boost::bind(&InferenceChunk, &x, &corpus,
+        corpus.size() * t / threads, corpus.size() * (t + 1) / threads, g ? &gs[t] : NULL, &clls[t]));
+    workers.join_all();
+  }
+  double cll = 0;
+  for (int t = 0; t < threads; ++t) {
+    cll += clls[t];
+    if (g)
+      for (size_t i = 0; i < g->size(); ++i) (*g)[i] += gs[t][i];
+  }
+  return cll;
+}
+
+// return held-out log likelihood
+static double LearnParameters(const PROCorpus& training,
+                              const PROCorpus& testing,
+                              const double sigsq,
+                              const unsigned memory_buffers,
+                              const int threads,
+                              vector<double>* px) {
+  vector<double>& x = *px;
+  vector<double> vg(FD::NumFeats(), 0.0);
+  bool converged = false;
+  LBFGSOptimizer opt(FD::NumFeats(), memory_buffers, threads);
+  double tppl = 0.0;
+  while(!converged) {
+    fill(vg.begin(), vg.end(), 0.0);
+    double cll = TrainingInference(x, training, threads, &vg);
+    double ppl = cll / log(2);
+    ppl /= training.size();
+    ppl = pow(2.0, ppl);
+
+    // evaluate optional held-out test set
+    if (testing.size()) {
+      tppl = TrainingInference(x, testing, threads) / log(2);
+      tppl /= testing.size();
+      tppl = pow(2.0, tppl);
+    }
+
+    // handle regularizer
+#if 1
+    double norm = 0;
+    for (int i = 1; i < x.size(); ++i) {
+      const double mean_i = 0.0;
+      const double param = (x[i] - mean_i);
+      norm += param * param;
+      vg[i] += param / sigsq;
+    }
+    const double reg = norm / (2.0 * sigsq);
+#else
+    double reg = 0;
+#endif
+    cll += reg;
+    cerr << cll << " (REG=" << reg << ")\tPPL=" << ppl << "\t TEST_PPL=" << tppl << "\t";
+    try {
+      vector<double> old_x = x;
+      do {
+        opt.Optimize(cll, vg, &x);
+        converged = opt.HasConverged();
+      } while (!converged && x == old_x);
+    } catch (...) {
+      cerr << "Exception caught, assuming convergence is close enough...\n";
+      converged = true;
+    }
+    if (fabs(x[0]) > MAX_BIAS) {
+      cerr << "Biased model learned. Are your training instances wrong?\n";
+      cerr << "  BIAS: " << x[0] << endl;
+    }
+  }
+  return tppl;
+}
+
+double TrainClassifier(const PROCorpus& training,
+                       const PROCorpus& testing,
+                       const PROClassifierOptions& opts,
+                       vector<double>* px,
+                       double* psigsq,
+                       vector<pair<double, double> >* psp,
+                       vector<double>* psmoothed) {
+  double& sigsq = *psigsq;
+  vector<pair<double,double> >& sp = *psp;
+  vector<double>& smoothed = *psmoothed;
+  const double min_reg = opts.min_reg;
+  const double max_reg = opts.max_reg;
+  sigsq = opts.sigsq;
+  assert(sigsq > 0.0);
+  assert(min_reg > 0.0);
+  assert(max_reg > 0.0);
+  assert(max_reg > min_reg);
+  sp.clear();
+  smoothed.clear();
+  if (opts.tune_regularizer) {
+    sigsq = min_reg;
+    const double steps = 18;
+    double sweep_factor = exp((log(max_reg) - log(min_reg)) / steps);
+    cerr << "SWEEP FACTOR: " << sweep_factor << endl;
+    while(sigsq < max_reg) {
+      const double tppl = LearnParameters(training, testing, sigsq, opts.memory_buffers, opts.threads, px);
+      sp.push_back(make_pair(sigsq, tppl));
+      sigsq *= sweep_factor;
+    }
+    smoothed.resize(sp.size(), 0);
+    smoothed[0] = sp[0].second;
+    smoothed.back() = sp.back().second;
+    for (int i = 1; i < sp.size()-1; ++i) {
+      double prev = sp[i-1].second;
+      double next = sp[i+1].second;
+      double cur = sp[i].second;
+      smoothed[i] = (prev*0.2) + cur * 0.6 + (0.2*next);
+    }
+    double best_ppl = 9999999;
+    unsigned best_i = 0;
+    for (unsigned i = 0; i < sp.size(); ++i) {
+      if (smoothed[i] < best_ppl) {
+        best_ppl = smoothed[i];
+        best_i = i;
+      }
+    }
+    sigsq = sp[best_i].first;
+  }
+  return LearnParameters(training, testing, sigsq, opts.memory_buffers, opts.threads, px);
+}
+
+void WriteWeights(const vector<double>& weights,
+                  const SparseVector<double>* old_weights,
+                  double psi,
+                  double sigsq,
+                  double tppl,
+                  const vector<pair<double, double> >& sp,
+                  const vector<double>& smoothed) {
+  vector<double> x = weights;
+  Weights w;
+  if (old_weights) {
+    for (int i = 1; i < x.size(); ++i)
+      x[i] = (x[i] * psi) + old_weights->get(i) * (1.0 - psi);
+  }
+  cout.precision(15);
+  cout << "# sigma^2=" << sigsq << "\theld out perplexity=";
+  if (tppl) { cout << tppl << endl; } else { cout << "N/A\n"; }
+  if (sp.size()) {
+    cout << "# Parameter sweep:\n";
+    for (int i = 0; i < sp.size(); ++i) {
+      cout << "# " << sp[i].first << "\t" << sp[i].second << "\t" << smoothed[i] << endl;
+    }
+  }
+  w.InitFromVector(x);
+  w.WriteToFile("-");
+}
@@ -0,0 +1,83 @@
+#ifndef _PRO_CLASSIFIER_H_
+#define _PRO_CLASSIFIER_H_
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "sparse_vector.h"
+
+// the training instances of the ranking classifier, with the features of
+// all of them packed into two flat arrays
+class PROCorpus {
+ public:
+  PROCorpus() : start_(1, 0) {}
+  void Add(bool y, const SparseVector<double>& x);
+  void Clear();
+  size_t size() const { return y_.size(); }
+  bool y(size_t i) const { return y_[i]; }
+  // x_i . w; features w doesn't have count as 0
+  double Dot(size_t i, const std::vector<double>& w) const {
+    double res = 0;
+    for (size_t j = start_[i]; j < start_[i + 1]; ++j)
+      if (fids_[j] < w.size()) res += vals_[j] * w[fids_[j]];
+    return res;
+  }
+  // g += x_i * scale
+  void GradAdd(size_t i, double scale, std::vector<double>* g) const {
+    for (size_t j = start_[i]; j < start_[i + 1]; ++j)
+      (*g)[fids_[j]] += vals_[j] * scale;
+  }
+
+ private:
+  std::vector<char> y_;
+  std::vector<size_t> start_;   // x_i is [start_[i], start_[i + 1]) of
+  std::vector<unsigned> fids_;  // these
+  std::vector<double> vals_;    // and these
+};
+
+struct PROClassifierOptions {
+  PROClassifierOptions() : sigsq(0.1), memory_buffers(200), tune_regularizer(false),
+                           min_reg(1e-8), max_reg(10.0), threads(1) {}
+  double sigsq;             // of the Gaussian prior
+  unsigned memory_buffers;  // of LBFGS
+  bool tune_regularizer;    // pick sigsq between min_reg and max_reg on the test set
+  double min_reg;
+  double max_reg;
+  int threads;              // to compute the objective and gradient with
+};
+
+// the negative conditional log likelihood of the labels of corpus under
+// the logistic regression model x (x[0] is the bias), and if g is given,
+// adds its gradient to g.  With threads, each adds up a part of the corpus,
+// and the parts are added up in order.
+double TrainingInference(const std::vector<double>& x,
+                         const PROCorpus& corpus,
+                         int threads,
+                         std::vector<double>* g = NULL);
+
+// fits x (initialized with the weights it has) to training with LBFGS, and
+// if opts.tune_regularizer, picks the regularization strength with the
+// best (smoothed) perplexity on testing.  Returns the held-out perplexity
+// (0 without a test set) and sets *sigsq to the strength used; *sweep gets
+// the (strength, perplexity) pairs tried, and *smoothed their smoothed
+// perplexities.
+double TrainClassifier(const PROCorpus& training,
+                       const PROCorpus& testing,
+                       const PROClassifierOptions& opts,
+                       std::vector<double>* x,
+                       double* sigsq,
+                       std::vector<std::pair<double, double> >* sweep,
+                       std::vector<double>* smoothed);
+
+// writes x to stdout, interpolated as psi * x + (1 - psi) * old_weights
+// if old_weights is given, after comments on what TrainClassifier did
+void WriteWeights(const std::vector<double>& x,
+                  const SparseVector<double>* old_weights,
+                  double psi,
+                  double sigsq,
+                  double tppl,
+                  const std::vector<std::pair<double, double> >& sweep,
+                  const std::vector<double>& smoothed);
+
+#endif
@@ -0,0 +1,253 @@
+#include "pro_sampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <sstream>
+#include <tr1/unordered_set>
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "sampler.h"
+#include "filelib.h"
+#include "weights.h"
+#include "hg_io.h"
+#include "kbest.h"
+#include "viterbi.h"
+#include "kbest_store.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+PairWriter::~PairWriter() {}
+
+// the scores of hypotheses hyps under loss, into *entries
+static void ScoreEntries(const SentenceScorer& scorer, const vector<const vector<WordID>*>& hyps, const string& loss, vector<KBestEntry>* entries) {
+  vector<ScoreP> scores;
+  scorer.ScoreCandidates(hyps, &scores);
+  for (unsigned i = 0; i < scores.size(); ++i) {
+    KBestEntry* e = &(*entries)[i];
+    e->loss = loss;
+    e->stats.clear();
+    scores[i]->Encode(&e->stats);
+    e->score = scores[i]->ComputeScore();
+  }
+}
+
+struct ThresholdAlpha {
+  explicit ThresholdAlpha(double t = 0.05) : threshold(t) {}
+  double operator()(double mag) const {
+    if (mag < threshold) return 0.0; else return 1.0;
+  }
+  const double threshold;
+};
+
+#ifdef DEBUGGING_PRO
+ostream& operator<<(ostream& os, const TrainingInstance& d) {
+  return os << d.gdiff << " y=" << d.y << "\tA:" << d.a << "\n\tB: " << d.b << "\n\tX: " << d.x;
+}
+#endif
+
+struct DiffOrder {
+  bool operator()(const TrainingInstance& a, const TrainingInstance& b) const {
+    return a.gdiff > b.gdiff;
+  }
+};
+
+static void Sample(const unsigned gamma, const unsigned xi, const KBestStore& J_i, const bool invert_score, MT19937* rng, vector<TrainingInstance>* pv) {
+  vector<TrainingInstance> v1, v2;
+  double avg_diff = 0;
+  for (unsigned i = 0; i < gamma; ++i) {
+    const size_t a = rng->inclusive(0, J_i.size() - 1)();
+    const size_t b = rng->inclusive(0, J_i.size() - 1)();
+    if (a == b) continue;
+    double ga = J_i[a].score;
+    double gb = J_i[b].score;
+    bool positive = gb < ga;
+    if (invert_score) positive = !positive;
+    const double gdiff = fabs(ga - gb);
+    if (!gdiff) continue;
+    avg_diff += gdiff;
+    SparseVector<double> xdiff = (J_i[a].feats - J_i[b].feats).erase_zeros();
+    if (xdiff.empty()) {
+      cerr << "Empty diff:\n  " << J_i[a].text << endl << "x=" << J_i[a].feats << endl;
+      cerr << "  " << J_i[b].text << endl << "x=" << J_i[b].feats << endl;
+      continue;
+    }
+    v1.push_back(TrainingInstance(xdiff, positive, gdiff));
+#ifdef DEBUGGING_PRO
+    v1.back().a = J_i[a].text;
+    v1.back().b = J_i[b].text;
+    cerr << "N: " << v1.back() << endl;
+#endif
+  }
+  avg_diff /= v1.size();
+
+  for (unsigned i = 0; i < v1.size(); ++i) {
+    double p = 1.0 / (1.0 + exp(-avg_diff - v1[i].gdiff));
+    // cerr << "avg_diff=" << avg_diff << "  gdiff=" << v1[i].gdiff << "  p=" << p << endl;
+    if (rng->next() < p) v2.push_back(v1[i]);
+  }
+  // the xi largest differences, in order
+  vector<TrainingInstance>::iterator mid = v2.end();
+  if (xi < v2.size()) {
+    mid = v2.begin() + xi;
+    nth_element(v2.begin(), mid, v2.end(), DiffOrder());
+  }
+  sort(v2.begin(), mid, DiffOrder());
+  copy(v2.begin(), mid, back_inserter(*pv));
+#ifdef DEBUGGING_PRO
+  if (v2.size() >= 5) {
+    for (int i =0; i < (mid - v2.begin()); ++i) {
+      cerr << v2[i] << endl;
+    }
+    cerr << pv->back() << endl;
+  }
+#endif
+}
+
+void PairSampler::AddOptions(po::options_description* opts) {
+  opts->add_options()
+        ("reference,r",po::value<vector<string> >(), "[REQD] Reference translation (tokenized text)")
+        ("weights,w",po::value<string>(), "[REQD] Weights files from current iterations")
+        ("kbest_repository,K",po::value<string>()->default_value("./kbest"),"K-best list repository (directory)")
+        ("source,s",po::value<string>()->default_value(""), "Source file (ignored, except for AER)")
+        ("loss_function,l",po::value<string>()->default_value("ibm_bleu"), "Loss function being optimized")
+        ("kbest_size,k",po::value<unsigned>()->default_value(1500u), "Top k-hypotheses to extract")
+        ("candidate_pairs,G", po::value<unsigned>()->default_value(5000u), "Number of pairs to sample per hypothesis (Gamma)")
+        ("best_pairs,X", po::value<unsigned>()->default_value(50u), "Number of pairs, ranked by magnitude of objective delta, to retain (Xi)")
+        ("random_seed,S", po::value<uint32_t>(), "Random seed (if not specified, /dev/random will be used)")
+        ("threads,j", po::value<int>()->default_value(1), "Number of sentences to map at once");
+}
+
+PairSampler::PairSampler(const po::variables_map& conf) :
+    loss_function_(conf["loss_function"].as<string>()),
+    type_(ScoreTypeFromString(loss_function_)),
+    kbest_repo_(conf["kbest_repository"].as<string>()),
+    kbest_size_(conf["kbest_size"].as<unsigned>()),
+    gamma_(conf["candidate_pairs"].as<unsigned>()),
+    xi_(conf["best_pairs"].as<unsigned>()),
+    seed_(conf.count("random_seed") ? conf["random_seed"].as<uint32_t>() : MT19937::GetTrulyRandomSeed()),
+    threads_(conf["threads"].as<int>()) {
+  ds_.reset(new DocScorer(type_, conf["reference"].as<vector<string> >(), conf["source"].as<string>()));
+  cerr << "Loaded " << ds_->size() << " references for scoring with " << loss_function_ << endl;
+  Weights w;
+  w.InitFromFile(conf["weights"].as<string>());
+  w.InitVector(&weights_);
+  MkDirP(kbest_repo_);
+  if (type_ == METEOR && threads_ > 1) {
+    cerr << "METEOR scores are computed by a server, not using threads\n";
+    threads_ = 1;
+  }
+}
+
+void PairSampler::Run(istream* in, PairWriter* out) {
+  in_ = in;
+  out_ = out;
+  next_id_ = 0;
+  next_out_ = 0;
+  seen_.clear();
+  if (threads_ > 1) {
+    boost::thread_group workers;
+    for (int i = 0; i < threads_; ++i)
+      workers.create_thread(boost::bind(&PairSampler::RunThread, this));
+    workers.join_all();
+  } else {
+    RunThread();
+  }
+}
+
+void PairSampler::RunThread() {
+  int id, sent_id;
+  string file;
+  while (NextInput(&id, &file, &sent_id)) {
+    vector<TrainingInstance> pairs;
+    SampleSentence(file, sent_id, &pairs);
+    WriteOutput(id, pairs);
+  }
+}
+
+bool PairSampler::NextInput(int* id, string* file, int* sent_id) {
+  boost::mutex::scoped_lock l(in_mutex_);
+  string line;
+  while (*in_) {
+    getline(*in_, line);
+    if (line.empty()) continue;
+    istringstream is(line);
+    // path-to-file (JSON or binary) sent_id
+    is >> *file >> *sent_id;
+    // two threads must not update one repository file
+    if (threads_ > 1 && !seen_.insert(*sent_id).second) {
+      cerr << "[ERROR] sentence " << *sent_id << " occurs more than once in the input\n";
+      abort();
+    }
+    *id = next_id_++;
+    return true;
+  }
+  return false;
+}
+
+void PairSampler::WriteOutput(int id, const vector<TrainingInstance>& pairs) {
+  boost::mutex::scoped_lock l(out_mutex_);
+  pending_[id] = pairs;
+  map<int, vector<TrainingInstance> >::iterator it;
+  while ((it = pending_.find(next_out_)) != pending_.end()) {
+    out_->Write(it->second);
+    pending_.erase(it);
+    ++next_out_;
+  }
+}
+
+void PairSampler::SampleSentence(const string& file, int sent_id, vector<TrainingInstance>* pairs) {
+  ostringstream os;
+  os << kbest_repo_ << "/kbest." << sent_id << ".bin";
+  KBestStore J_i(os.str());
+  const SentenceScorer& scorer = *(*ds_)[sent_id];
+  // hypotheses of earlier iterations keep their scores, unless the loss
+  // function has changed
+  vector<KBestEntry> entries;
+  vector<vector<WordID> > texts;
+  for (unsigned i = 0; i < J_i.size(); ++i) {
+    if (J_i[i].loss == loss_function_) continue;
+    entries.push_back(J_i[i]);
+    texts.push_back(vector<WordID>());
+    TD::ConvertSentence(J_i[i].text, &texts.back());
+  }
+  vector<const vector<WordID>*> hyps;
+  for (unsigned i = 0; i < texts.size(); ++i) hyps.push_back(&texts[i]);
+  ScoreEntries(scorer, hyps, loss_function_, &entries);
+  for (unsigned i = 0; i < entries.size(); ++i) J_i.Add(entries[i]);
+  const unsigned old_size = J_i.size();
+  Hypergraph hg;
+  HypergraphIO::ReadFromFile(file, &hg);
+  hg.Reweight(weights_);
+  KBest::KBestDerivations<vector<WordID>, ESentenceTraversal> kbest(hg, kbest_size_);
+
+  // the new hypotheses are scored together
+  entries.clear();
+  hyps.clear();
+  tr1::unordered_set<uint64_t> added;
+  for (int i = 0; i < kbest_size_; ++i) {
+    const KBest::KBestDerivations<vector<WordID>, ESentenceTraversal>::Derivation* d =
+      kbest.LazyKthBest(hg.nodes_.size() - 1, i);
+    if (!d) break;
+    KBestEntry e;
+    e.text = TD::GetString(d->yield);
+    e.hash = KBestStore::Hash(e.text, d->feature_values);
+    if (J_i.Find(e.hash) >= 0 || !added.insert(e.hash).second) continue;
+    e.feats = d->feature_values;
+    entries.push_back(e);
+    hyps.push_back(&d->yield);
+  }
+  ScoreEntries(scorer, hyps, loss_function_, &entries);
+  for (unsigned i = 0; i < entries.size(); ++i) J_i.Add(entries[i]);
+  cerr << "Sentence " << sent_id << ": " << (J_i.size() - old_size) << " new hypotheses, "
+       << J_i.size() << " in total\n";
+  J_i.Write();
+
+  uint32_t seed = seed_ ^ (static_cast<uint32_t>(sent_id) * 2654435761u);
+  if (!seed) seed = 1;  // 0 would mean /dev/urandom
+  MT19937 rng(seed);
+  Sample(gamma_, xi_, J_i, type_ == TER, &rng, pairs);
+}
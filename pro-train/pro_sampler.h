@@ -0,0 +1,83 @@
+#ifndef _PRO_SAMPLER_H_
+#define _PRO_SAMPLER_H_
+
+#include <iosfwd>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "sparse_vector.h"
+#include "scorer.h"
+
+// This is Figure 4 (Algorithm Sampler) from Hopkins&May (2011)
+
+struct TrainingInstance {
+  TrainingInstance(const SparseVector<double>& feats, bool positive, double diff) : x(feats), y(positive), gdiff(diff) {}
+  SparseVector<double> x;
+#undef DEBUGGING_PRO
+#ifdef DEBUGGING_PRO
+  std::string a;
+  std::string b;
+#endif
+  bool y;
+  double gdiff;
+};
+
+// receives the training pairs of each sentence, in input order
+struct PairWriter {
+  virtual ~PairWriter();
+  virtual void Write(const std::vector<TrainingInstance>& pairs) = 0;
+};
+
+// samples the training pairs of one sentence at a time, on any number of
+// threads, keeping the k-best lists of every sentence in a KBestStore.
+// Each sentence gets its own random number generator, seeded from the
+// random seed and its sent_id, so the pairs do not depend on the number of
+// threads.
+class PairSampler {
+ public:
+  // the options the constructor reads
+  static void AddOptions(boost::program_options::options_description* opts);
+  // loads the references and weights
+  explicit PairSampler(const boost::program_options::variables_map& conf);
+
+  // the loss function's type
+  ScoreType type() const { return type_; }
+  // for the "path-to-forest sent_id" lines of in
+  void Run(std::istream* in, PairWriter* out);
+
+ private:
+  void RunThread();
+  bool NextInput(int* id, std::string* file, int* sent_id);
+  void WriteOutput(int id, const std::vector<TrainingInstance>& pairs);
+  void SampleSentence(const std::string& file, int sent_id, std::vector<TrainingInstance>* pairs);
+
+  std::string loss_function_;
+  ScoreType type_;
+  boost::shared_ptr<DocScorer> ds_;
+  std::vector<double> weights_;
+  std::string kbest_repo_;
+  unsigned kbest_size_;
+  unsigned gamma_;
+  unsigned xi_;
+  uint32_t seed_;
+  int threads_;
+
+  // the current Run()
+  std::istream* in_;
+  PairWriter* out_;
+  int next_id_;
+  int next_out_;
+  std::map<int, std::vector<TrainingInstance> > pending_;
+  std::set<int> seen_;
+  boost::mutex in_mutex_;
+  boost::mutex out_mutex_;
+};
+
+#endif
@@ -0,0 +1,107 @@
+#include <iostream>
+#include <vector>
+
+#include <boost/program_options.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+#include "filelib.h"
+#include "weights.h"
+#include "pro_sampler.h"
+#include "pro_classifier.h"
+
+// one PRO iteration in one process: samples the training pairs of every
+// sentence (like mr_pro_map) and fits the classifier to them (like
+// mr_pro_reduce), without writing the pairs out and reading them back
+
+using namespace std;
+namespace po = boost::program_options;
+
+void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
+  po::options_description opts("Configuration options");
+  PairSampler::AddOptions(&opts);
+  opts.add_options()
+        ("input,i",po::value<string>()->default_value("-"), "Input file (path-to-forest sent_id lines, - is STDIN)")
+        ("interpolation,p",po::value<double>()->default_value(0.9), "Output weights are p*w + (1-p)*w_prev")
+        ("memory_buffers,m",po::value<unsigned>()->default_value(200), "Number of memory buffers (LBFGS)")
+        ("sigma_squared",po::value<double>()->default_value(0.1), "Sigma squared for Gaussian prior")
+        ("min_reg",po::value<double>()->default_value(1e-8), "When tuning (-T) regularization strength, minimum regularization strength")
+        ("max_reg",po::value<double>()->default_value(10.0), "When tuning (-T) regularization strength, maximum regularization strength")
+        ("tune_regularizer,T", "Hold out the pairs of every third sentence to tune the regularization strength")
+        ("help,h", "Help");
+  po::options_description dcmdline_options;
+  dcmdline_options.add(opts);
+  po::store(parse_command_line(argc, argv, dcmdline_options), *conf);
+  bool flag = false;
+  if (!conf->count("reference")) {
+    cerr << "Please specify one or more references using -r <REF.TXT>\n";
+    flag = true;
+  }
+  if (!conf->count("weights")) {
+    cerr << "Please specify weights using -w <WEIGHTS.TXT>\n";
+    flag = true;
+  }
+  if (flag || conf->count("help")) {
+    cerr << dcmdline_options << endl;
+    exit(1);
+  }
+}
+
+// each pair as the two training instances mr_pro_map would write, into
+// testing for every third sentence if there is a test set
+struct CorpusPairWriter : public PairWriter {
+  CorpusPairWriter(PROCorpus* tr, PROCorpus* te) : training(tr), testing(te), sentences() {}
+  void Write(const vector<TrainingInstance>& v) {
+    PROCorpus* corpus = (testing && sentences % 3 == 1) ? testing : training;
+    ++sentences;
+    for (unsigned i = 0; i < v.size(); ++i) {
+      corpus->Add(v[i].y, v[i].x);
+      corpus->Add(!v[i].y, v[i].x * -1.0);
+    }
+  }
+  PROCorpus* training;
+  PROCorpus* testing;
+  int sentences;
+};
+
+int main(int argc, char** argv) {
+  po::variables_map conf;
+  InitCommandLine(argc, argv, &conf);
+  PROClassifierOptions opts;
+  opts.tune_regularizer = conf.count("tune_regularizer");
+  opts.min_reg = conf["min_reg"].as<double>();
+  opts.max_reg = conf["max_reg"].as<double>();
+  opts.sigsq = conf["sigma_squared"].as<double>();
+  opts.memory_buffers = conf["memory_buffers"].as<unsigned>();
+  opts.threads = conf["threads"].as<int>();
+  const double psi = conf["interpolation"].as<double>();
+  if (psi < 0.0 || psi > 1.0) { cerr << "Invalid interpolation weight: " << psi << endl; }
+
+  PROCorpus training, testing;
+  {
+    PairSampler sampler(conf);
+    ReadFile in_read(conf["input"].as<string>());
+    CorpusPairWriter out(&training, opts.tune_regularizer ? &testing : NULL);
+    sampler.Run(in_read.stream(), &out);
+  }
+  if (opts.tune_regularizer && !testing.size()) {
+    cerr << "Not enough training instances for regularization tuning! Rerun without --tune_regularizer\n";
+    return 1;
+  }
+  cerr << "Training instances: " << training.size() << ", held out: " << testing.size() << endl;
+
+  SparseVector<double> old_weights;
+  Weights w;
+  w.InitFromFile(conf["weights"].as<string>());
+  w.InitSparseVector(&old_weights);
+  cerr << "Number of features: " << FD::NumFeats() << endl;
+  vector<double> x(FD::NumFeats(), 0.0);  // x[0] is bias
+  for (SparseVector<double>::const_iterator it = old_weights.begin();
+       it != old_weights.end(); ++it)
+    x[it->first] = it->second;
+  double sigsq;
+  vector<pair<double,double> > sp;
+  vector<double> smoothed;
+  const double tppl = TrainClassifier(training, testing, opts, &x, &sigsq, &sp, &smoothed);
+  WriteWeights(x, &old_weights, psi, sigsq, tppl, sp, smoothed);
+  return 0;
+}
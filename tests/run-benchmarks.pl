@@ -0,0 +1,429 @@
+#!/usr/bin/perl -w
+use strict;
+my $script_dir; BEGIN { use Cwd qw/ abs_path cwd /; use File::Basename; $script_dir = dirname(abs_path($0)); push @INC, $script_dir; }
+
+# Times each stage of the decoder (parsing, rescoring with each intersection
+# strategy, inside/outside, pruning, k-best) on the benchmarks in
+# benchmarks/, using the per input profiles cdec writes with
+# --profile_output.
+#
+# A benchmark is a directory holding a cdec.ini, optionally weights, and
+# either input.txt (the decoder runs in that directory, so the ini may refer
+# to data elsewhere in the tree) or a file named synthetic, whose first word
+# names a generator (scfg, pb, fst, lextrans, tagger) that writes a grammar, a
+# bigram LM and inputs of the size given by the --synthetic-* options into
+# a scratch directory, which the decoder runs in.  An optional variants
+# file lists one variant per line: a name followed by extra cdec options,
+# e.g. "cube_growing --intersection_strategy cube_growing"; without it the
+# benchmark is run as configured.  Lines starting with # are comments.
+#
+# Every variant is run --repeat times.  The results are written as JSON
+# lines: a "run" record describing the decoder and the options, then for
+# each benchmark, variant, stage (the Timer path, e.g.
+# "Decode/Pass1/Rescoring") and bucket of source sentence lengths a
+# "stage" record with the median over the runs of the summed wall clock and
+# CPU seconds, and likewise "counter" records for the ProfileCounters
+# (edges, pops, LM queries).  A summary of the totals goes to STDERR.
+
+use Getopt::Long;
+use IPC::Run3;
+use File::Temp qw ( tempdir );
+use File::Copy;
+use JSON::PP;
+use POSIX qw ( strftime );
+
+my $DECODER = "$script_dir/../decoder/cdec";
+my $BENCH_DIR = "$script_dir/benchmarks";
+my $REPEAT = 3;
+my $BUCKET = 10;
+my $OUTPUT = '-';
+my $MEMORY = 0;
+my $FEATURES = 0;
+my $SENTENCES = 50;
+my $MAX_LENGTH = 40;
+my $VOCAB = 2000;
+my $RULES = 20000;
+my $TRANSLATIONS = 5;
+my $SEED = 1;
+my $KEEP = 0;
+my $help;
+
+my $usage = <<EOT;
+Usage: $0 [options] [benchmark ...]
+
+Runs the named benchmarks in $BENCH_DIR (all of them by default).
+
+  --decoder PATH           cdec binary (default: $DECODER)
+  --benchmarks DIR         directory of benchmarks (default: $BENCH_DIR)
+  --repeat N               runs of every variant (default: $REPEAT)
+  --bucket N               width of the sentence length buckets (default: $BUCKET)
+  --output FILE            write the JSON lines here (default: STDOUT)
+  --memory                 also record what each stage does to memory use
+  --features               also time every feature function (stages ".../FF <name>")
+  --synthetic-sentences N  inputs of synthetic benchmarks (default: $SENTENCES)
+  --synthetic-length N     their lengths are uniform in 1..N (default: $MAX_LENGTH)
+  --synthetic-vocab N      source and target vocabulary size (default: $VOCAB)
+  --synthetic-rules N      phrase and hierarchical rules (default: $RULES)
+  --synthetic-translations N  translations of every source word (default: $TRANSLATIONS)
+  --seed N                 random seed of the generators (default: $SEED)
+  --keep                   keep the scratch directory
+EOT
+
+die $usage unless GetOptions(
+  'decoder=s' => \$DECODER,
+  'benchmarks=s' => \$BENCH_DIR,
+  'repeat=i' => \$REPEAT,
+  'bucket=i' => \$BUCKET,
+  'output=s' => \$OUTPUT,
+  'memory' => \$MEMORY,
+  'features' => \$FEATURES,
+  'synthetic-sentences=i' => \$SENTENCES,
+  'synthetic-length=i' => \$MAX_LENGTH,
+  'synthetic-vocab=i' => \$VOCAB,
+  'synthetic-rules=i' => \$RULES,
+  'synthetic-translations=i' => \$TRANSLATIONS,
+  'seed=i' => \$SEED,
+  'keep' => \$KEEP,
+  'help' => \$help);
+die $usage if $help;
+die "--repeat and --bucket must be positive\n" unless $REPEAT > 0 && $BUCKET > 0;
+die "Can't execute $DECODER\n" unless -x $DECODER;
+$DECODER = abs_path($DECODER);
+$BENCH_DIR = abs_path($BENCH_DIR);
+
+my $TEMP_DIR = tempdir( CLEANUP => !$KEEP );
+
+my @benchmarks = @ARGV;
+unless (@benchmarks) {
+  opendir DIR, $BENCH_DIR or die "Can't open $BENCH_DIR: $!";
+  @benchmarks = sort grep { !/^\./ && -d "$BENCH_DIR/$_" } readdir(DIR);
+  closedir DIR;
+}
+
+my $json = JSON::PP->new->canonical;
+my $out;
+if ($OUTPUT eq '-') { $out = \*STDOUT; } else { open $out, '>', $OUTPUT or die "Can't write $OUTPUT: $!"; }
+
+print STDERR "  DECODER: $DECODER\n";
+print STDERR "BENCHMARKS: @benchmarks\n";
+print STDERR " TEMP DIR: $TEMP_DIR\n";
+
+my $revision = `cd $script_dir && git rev-parse HEAD 2>/dev/null`;
+chomp $revision;
+my $host = `uname -a`;
+chomp $host;
+print $out $json->encode({
+  type => 'run',
+  date => strftime('%Y-%m-%dT%H:%M:%S', localtime),
+  host => $host,
+  decoder => $DECODER,
+  revision => $revision,
+  repeat => $REPEAT,
+  bucket => $BUCKET,
+  synthetic => { sentences => $SENTENCES, max_length => $MAX_LENGTH, vocab => $VOCAB,
+                 rules => $RULES, translations => $TRANSLATIONS, seed => $SEED },
+}), "\n";
+
+my $FAIL = 0;
+for my $bench (@benchmarks) {
+  my $dir = "$BENCH_DIR/$bench";
+  unless (-f "$dir/cdec.ini") {
+    print STDERR "$bench: missing cdec.ini -- SKIPPING\n";
+    $FAIL++;
+    next;
+  }
+  my $workdir = $dir;
+  if (-f "$dir/synthetic") {
+    $workdir = "$TEMP_DIR/$bench";
+    mkdir $workdir or die "Can't create $workdir: $!";
+    copy("$dir/cdec.ini", $workdir) or die "Can't copy $dir/cdec.ini: $!";
+    copy("$dir/weights", $workdir) or die "Can't copy $dir/weights: $!" if -f "$dir/weights";
+    my ($kind) = split /\s+/, read_first_line("$dir/synthetic");
+    generate($kind, $workdir);
+  }
+  unless (-f "$workdir/input.txt") {
+    print STDERR "$bench: missing input.txt -- SKIPPING\n";
+    $FAIL++;
+    next;
+  }
+  my $formalism = formalism("$dir/cdec.ini");
+  my @lengths = input_lengths("$workdir/input.txt");
+  my @variants = variants($dir);
+
+  for my $v (@variants) {
+    my ($variant, $extra) = @$v;
+    my $CMD = "$DECODER -c cdec.ini";
+    $CMD .= ' -w weights' if -f "$workdir/weights";
+    $CMD .= ' -i input.txt';
+    $CMD .= ' --profile_memory' if $MEMORY;
+    $CMD .= ' --profile_features' if $FEATURES;
+    $CMD .= " $extra" if length $extra;
+    print STDERR "\n$bench/$variant: $CMD\n";
+
+    my @runs;  # per run: { stage => { bucket => [ wall, cpu, calls ] } }
+    my @counts;  # per run: { counter => { bucket => n } }
+    my %sentences;  # bucket => inputs
+    my $ok = 1;
+    for my $r (1..$REPEAT) {
+      my $profile = "$TEMP_DIR/$bench.$variant.$r.profile";
+      chdir $workdir or die "Can't chdir to $workdir: $!";
+      run3 "$CMD --profile_output $profile", \undef, "$TEMP_DIR/stdout", "$TEMP_DIR/stderr";
+      chdir $script_dir;
+      if ($? != 0) {
+        print STDERR "  non-zero exit! last lines of STDERR:\n";
+        system("tail -5 $TEMP_DIR/stderr 1>&2");
+        $ok = 0;
+        last;
+      }
+      my (%t, %c);
+      %sentences = ();
+      open my $pf, '<', $profile or die "Can't read $profile: $!";
+      while (<$pf>) {
+        my $p = $json->decode($_);
+        my $b = bucket($lengths[$p->{id}]);
+        $sentences{$b}++;
+        for my $stage (keys %{$p->{timers}}) {
+          my $s = $p->{timers}->{$stage};
+          my $acc = ($t{$stage}->{$b} ||= [0, 0, 0]);
+          $acc->[0] += $s->{wall};
+          $acc->[1] += $s->{cpu};
+          $acc->[2] += $s->{calls};
+        }
+        for my $counter (keys %{$p->{counters}}) {
+          my $n = $p->{counters}->{$counter};
+          if ($counter =~ /_peak$/) {  # PEAK counters, e.g. cube_heap_peak
+            $c{$counter}->{$b} = $n if !defined $c{$counter}->{$b} || $n > $c{$counter}->{$b};
+          } else {
+            $c{$counter}->{$b} += $n;
+          }
+        }
+      }
+      close $pf;
+      push @runs, \%t;
+      push @counts, \%c;
+      print STDERR "  run $r: " . sprintf('%.3f', total_wall(\%t)) . " secs\n";
+    }
+    unless ($ok) { $FAIL++; next; }
+
+    my %stages = map { %$_ } @runs;
+    my %totals;
+    for my $stage (sort keys %stages) {
+      for my $b (sort { bucket_order($a) <=> bucket_order($b) } keys %sentences) {
+        my @w = map { $_->{$stage}->{$b} ? $_->{$stage}->{$b}->[0] : 0 } @runs;
+        my @c = map { $_->{$stage}->{$b} ? $_->{$stage}->{$b}->[1] : 0 } @runs;
+        my $calls = $runs[0]->{$stage}->{$b} ? $runs[0]->{$stage}->{$b}->[2] : 0;
+        next unless $calls;
+        my $wall = median(@w);
+        print $out $json->encode({
+          type => 'stage', benchmark => $bench, formalism => $formalism, variant => $variant,
+          stage => $stage, lengths => $b, sentences => $sentences{$b}, calls => $calls,
+          wall => $wall, cpu => median(@c), wall_min => min(@w),
+          wall_per_sentence => $wall / $sentences{$b},
+        }), "\n";
+        $totals{$stage} += $wall;
+      }
+    }
+    my %counters = map { %$_ } @counts;
+    for my $counter (sort keys %counters) {
+      for my $b (sort { bucket_order($a) <=> bucket_order($b) } keys %sentences) {
+        my $n = $counts[0]->{$counter}->{$b};
+        next unless $n;
+        print $out $json->encode({
+          type => 'counter', benchmark => $bench, formalism => $formalism, variant => $variant,
+          counter => $counter, lengths => $b, sentences => $sentences{$b}, value => $n,
+        }), "\n";
+      }
+    }
+    for my $stage (sort keys %totals) {
+      printf STDERR "  %-40s %10.3f secs\n", $stage, $totals{$stage};
+    }
+  }
+}
+
+my $TOT = scalar @benchmarks;
+print STDERR "\nDONE: $TOT benchmarks" . ($FAIL ? ", $FAIL FAILED\n" : "\n");
+exit($FAIL ? 1 : 0);
+
+sub read_first_line {
+  my ($f) = @_;
+  open my $fh, '<', $f or die "Can't read $f: $!";
+  my $l = <$fh>;
+  close $fh;
+  $l = '' unless defined $l;
+  chomp $l;
+  $l =~ s/^\s+//;
+  return $l;
+}
+
+sub formalism {
+  my ($ini) = @_;
+  open my $fh, '<', $ini or die "Can't read $ini: $!";
+  while (<$fh>) {
+    return lc $1 if /^\s*formalism\s*=\s*(\S+)/;
+  }
+  return 'unknown';
+}
+
+sub variants {
+  my ($dir) = @_;
+  return ([ 'default', '' ]) unless -f "$dir/variants";
+  my @v;
+  open my $fh, '<', "$dir/variants" or die "Can't read $dir/variants: $!";
+  while (<$fh>) {
+    chomp;
+    next if /^\s*(#|$)/;
+    my ($name, $extra) = /^\s*(\S+)\s*(.*)$/;
+    push @v, [ $name, $extra ];
+  }
+  close $fh;
+  return @v;
+}
+
+# source lengths of the inputs, -1 where the input is a lattice or a forest
+sub input_lengths {
+  my ($f) = @_;
+  my @l;
+  open my $fh, '<', $f or die "Can't read $f: $!";
+  while (<$fh>) {
+    chomp;
+    s/<seg[^>]*>\s*//; s/\s*<\/seg>//;
+    s/ \|\|\| .*$//;
+    if (/^\s*[({]/) { push @l, -1; next; }
+    my @w = split;
+    push @l, scalar @w;
+  }
+  close $fh;
+  return @l;
+}
+
+sub bucket {
+  my ($len) = @_;
+  return 'all' unless defined $len && $len >= 0;
+  my $lo = int(($len > 0 ? $len - 1 : 0) / $BUCKET) * $BUCKET + 1;
+  return $lo . '-' . ($lo + $BUCKET - 1);
+}
+
+sub bucket_order {
+  my ($b) = @_;
+  return $b =~ /^(\d+)/ ? $1 : -1;
+}
+
+sub total_wall {
+  my ($t) = @_;
+  my $w = 0;
+  return 0 unless $t->{Decode};
+  $w += $_->[0] for values %{$t->{Decode}};
+  return $w;
+}
+
+sub median {
+  my @s = sort { $a <=> $b } @_;
+  return 0 unless @s;
+  return @s % 2 ? $s[$#s / 2] : ($s[@s / 2 - 1] + $s[@s / 2]) / 2;
+}
+
+sub min {
+  my $m = shift;
+  for (@_) { $m = $_ if $_ < $m; }
+  return $m;
+}
+
+################################################################
+# synthetic data
+
+# Zipf-like choice of 0..n-1
+sub zipf {
+  my ($n) = @_;
+  return int($n * rand() ** 2);
+}
+
+sub sentence {
+  my $len = 1 + int(rand($MAX_LENGTH));
+  return map { 'f' . zipf($VOCAB) } 1..$len;
+}
+
+sub trg { my ($f) = @_; $f =~ s/^f//; return 'e' . (($f * 7 + int(rand($TRANSLATIONS)) * 13) % $VOCAB); }
+
+sub feats { return sprintf('Egf=%.3f Efg=%.3f', rand(5), rand(5)); }
+
+sub write_file {
+  my ($f, @lines) = @_;
+  open my $fh, '>', $f or die "Can't write $f: $!";
+  print $fh map { "$_\n" } @lines;
+  close $fh;
+}
+
+# bigram ARPA LM over the target vocabulary
+sub write_lm {
+  my ($f) = @_;
+  my @uni = ('<s>', '</s>', '<unk>', map { "e$_" } 0..$VOCAB-1);
+  my %bi;
+  for (1..$VOCAB * 10) {
+    my $a = $uni[rand() < 0.05 ? 0 : 3 + zipf($VOCAB)];
+    my $b = $uni[rand() < 0.05 ? 1 : 3 + zipf($VOCAB)];
+    $bi{"$a $b"} = 1;
+  }
+  my @bi = sort keys %bi;
+  open my $fh, '>', $f or die "Can't write $f: $!";
+  print $fh "\n\\data\\\nngram 1=" . scalar(@uni) . "\nngram 2=" . scalar(@bi) . "\n\n\\1-grams:\n";
+  for my $w (@uni) {
+    my $p = $w eq '<s>' ? -99 : -1 - 3 * rand();
+    printf $fh "%.4f\t%s\t%.4f\n", $p, $w, -0.5 * rand();
+  }
+  print $fh "\n\\2-grams:\n";
+  printf $fh "%.4f\t%s\n", -0.1 - 2 * rand(), $_ for @bi;
+  print $fh "\n\\end\\\n";
+  close $fh;
+}
+
+sub generate {
+  my ($kind, $dir) = @_;
+  srand($SEED);
+  my @input = map { join ' ', sentence() } 1..$SENTENCES;
+  if ($kind eq 'tagger') {
+    write_file("$dir/input.txt", @input);
+    write_file("$dir/tagset", join ' ', map { "t$_" } 0..$TRANSLATIONS-1);
+    return;
+  }
+  my @lex;
+  my %seen;
+  for my $i (0..$VOCAB-1) {
+    for (1..$TRANSLATIONS) {
+      my $e = trg("f$i");
+      push @lex, [ "f$i", $e ] unless $seen{"f$i $e"}++;
+    }
+  }
+  write_lm("$dir/lm.arpa");
+  write_file("$dir/input.txt", @input);
+  if ($kind eq 'lextrans') {
+    # lexical translation needs the target length, so it aligns the inputs
+    # to translations of them
+    write_file("$dir/input.txt", map { "$_ ||| " . join(' ', map { trg($_) } split) } @input);
+    write_file("$dir/grammar", map { "$_->[0] ||| $_->[1] ||| " . feats() } @lex);
+    return;
+  }
+  # phrases (and for scfg, phrases with gaps) from spans of the inputs, so
+  # that they apply
+  my @rules = map { ($kind eq 'scfg' ? '[X] ||| ' : '') . "$_->[0] ||| $_->[1] ||| " . feats() } @lex;
+  my @sents = map { [ split ] } @input;
+  my $n = 0;
+  while ($n < $RULES) {
+    my $s = $sents[int(rand(@sents))];
+    next if @$s < 2;
+    my $len = 2 + int(rand(@$s < 5 ? @$s - 1 : 4));
+    my $i = int(rand(@$s - $len + 1));
+    my @f = @$s[$i..$i+$len-1];
+    my @e = map { trg($_) } @f;
+    if ($kind eq 'scfg' && $len >= 3 && rand() < 0.5) {
+      # gap over the middle, reordered half of the time
+      my $g = 1 + int(rand($len - 2));
+      my @ff = (@f[0..$g-1], '[X,1]', @f[$g+1..$#f]);
+      my @ee = rand() < 0.5 ? (@e[0..$g-1], '[X,1]', @e[$g+1..$#e]) : ('[X,1]', @e[0..$g-1], @e[$g+1..$#e]);
+      push @rules, "[X] ||| @ff ||| @ee ||| " . feats();
+    } else {
+      push @rules, ($kind eq 'scfg' ? '[X] ||| ' : '') . "@f ||| @e ||| " . feats();
+    }
+    $n++;
+  }
+  write_file("$dir/grammar", @rules);
+}
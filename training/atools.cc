@@ -4,8 +4,13 @@
 
 #include <queue>
 #include <map>
+#include <algorithm>
+#include <iterator>
 #include <boost/program_options.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include "filelib.h"
 #include "aligner.h"
@@ -15,7 +20,19 @@ namespace po = boost::program_options;
 using namespace std;
 using boost::shared_ptr;
 
+typedef AlignmentPharaoh::Link Link;
+
+// an alignment as its links sorted by (i, j) and the size of the grid they
+// are on
+struct Alignment {
+  Alignment() : i_len(), j_len() {}
+  int i_len;
+  int j_len;
+  vector<Link> links;
+};
+
 struct Command {
+  Command() : out(&cout) {}
   virtual ~Command() {}
   virtual string Name() const = 0;
 
@@ -24,17 +41,17 @@ struct Command {
   virtual int Result() const { return 1; }
 
   virtual bool RequiresTwoOperands() const { return true; }
-  virtual void Apply(const Array2D<bool>& a, const Array2D<bool>& b, Array2D<bool>* x) = 0;
-  void EnsureSize(const Array2D<bool>& a, const Array2D<bool>& b, Array2D<bool>* x) {
-    x->resize(max(a.width(), b.width()), max(a.height(), b.height()));
-  }
-  static bool Safe(const Array2D<bool>& a, int i, int j) {
-    if (i >= 0 && j >= 0 && i < a.width() && j < a.height())
-      return a(i,j);
-    else
-      return false;
+  virtual void Apply(const Alignment& a, const Alignment& b, Alignment* x) = 0;
+  void EnsureSize(const Alignment& a, const Alignment& b, Alignment* x) {
+    x->i_len = max(a.i_len, b.i_len);
+    x->j_len = max(a.j_len, b.j_len);
   }
   virtual void Summary() { assert(!"Summary should have been overridden"); }
+  // adds the statistics of other (a command of the same type) to the ones
+  // Summary reports
+  virtual void Merge(const Command& other) { (void) other; assert(!"Merge should have been overridden"); }
+  // where the alignments are written, for commands that write more
+  ostream* out;
 };
 
 // compute fmeasure, second alignment is reference, first is hyp
@@ -43,21 +60,15 @@ struct FMeasureCommand : public Command {
   int Result() const { return 2; }
   string Name() const { return "fmeasure"; }
   bool RequiresTwoOperands() const { return true; }
-  void Apply(const Array2D<bool>& hyp, const Array2D<bool>& ref, Array2D<bool>* x) {
+  void Apply(const Alignment& hyp, const Alignment& ref, Alignment* x) {
     (void) x;   // AER just computes statistics, not an alignment
-    int i_len = ref.width();
-    int j_len = ref.height();
-    for (int i = 0; i < i_len; ++i) {
-      for (int j = 0; j < j_len; ++j) {
-        if (ref(i,j)) {
-          ++num_in_ref;
-          if (Safe(hyp, i, j)) ++matches;
-        } 
-      }
+    vector<Link>::const_iterator h = hyp.links.begin();
+    for (vector<Link>::const_iterator r = ref.links.begin(); r != ref.links.end(); ++r) {
+      while (h != hyp.links.end() && *h < *r) ++h;
+      if (h != hyp.links.end() && *h == *r) ++matches;
     }
-    for (int i = 0; i < hyp.width(); ++i)
-      for (int j = 0; j < hyp.height(); ++j)
-        if (hyp(i,j)) ++num_predicted;
+    num_in_ref += ref.links.size();
+    num_predicted += hyp.links.size();
   }
   void Summary() {
     if (num_predicted == 0 || num_in_ref == 0) {
@@ -71,6 +82,12 @@ struct FMeasureCommand : public Command {
     const double f = (2.0 * prec * rec) / (rec + prec);
     cout << "F: " << f << endl;
   }
+  void Merge(const Command& other) {
+    const FMeasureCommand& o = static_cast<const FMeasureCommand&>(other);
+    matches += o.matches;
+    num_predicted += o.num_predicted;
+    num_in_ref += o.num_in_ref;
+  }
   int matches;
   int num_predicted;
   int num_in_ref;
@@ -79,16 +96,19 @@ struct FMeasureCommand : public Command {
 struct DisplayCommand : public Command {
   string Name() const { return "display"; }
   bool RequiresTwoOperands() const { return false; }
-  void Apply(const Array2D<bool>& in, const Array2D<bool>&not_used, Array2D<bool>* x) {
+  void Apply(const Alignment& in, const Alignment&not_used, Alignment* x) {
     *x = in;
-    cout << *x << endl;
+    Array2D<bool> grid(in.i_len, in.j_len);
+    for (int k = 0; k < in.links.size(); ++k)
+      grid(in.links[k].first, in.links[k].second) = true;
+    (*out) << grid << endl;
   }
 };
 
 struct ConvertCommand : public Command {
   string Name() const { return "convert"; }
   bool RequiresTwoOperands() const { return false; }
-  void Apply(const Array2D<bool>& in, const Array2D<bool>&not_used, Array2D<bool>* x) {
+  void Apply(const Alignment& in, const Alignment&not_used, Alignment* x) {
     *x = in;
   }
 };
@@ -96,37 +116,61 @@ struct ConvertCommand : public Command {
 struct InvertCommand : public Command {
   string Name() const { return "invert"; }
   bool RequiresTwoOperands() const { return false; }
-  void Apply(const Array2D<bool>& in, const Array2D<bool>&not_used, Array2D<bool>* x) {
-    Array2D<bool>& res = *x;
-    res.resize(in.height(), in.width());
-    for (int i = 0; i < in.height(); ++i)
-      for (int j = 0; j < in.width(); ++j)
-        res(i, j) = in(j, i);
+  void Apply(const Alignment& in, const Alignment&not_used, Alignment* x) {
+    x->i_len = in.j_len;
+    x->j_len = in.i_len;
+    x->links.resize(in.links.size());
+    for (int k = 0; k < in.links.size(); ++k)
+      x->links[k] = Link(in.links[k].second, in.links[k].first);
+    sort(x->links.begin(), x->links.end());
   }
 };
 
 struct IntersectCommand : public Command {
   string Name() const { return "intersect"; }
   bool RequiresTwoOperands() const { return true; }
-  void Apply(const Array2D<bool>& a, const Array2D<bool>& b, Array2D<bool>* x) {
+  void Apply(const Alignment& a, const Alignment& b, Alignment* x) {
     EnsureSize(a, b, x);
-    Array2D<bool>& res = *x;
-    for (int i = 0; i < a.width(); ++i)
-      for (int j = 0; j < a.height(); ++j)
-        res(i, j) = Safe(a, i, j) && Safe(b, i, j);
+    x->links.clear();
+    set_intersection(a.links.begin(), a.links.end(), b.links.begin(), b.links.end(),
+                     back_inserter(x->links));
   }
 };
 
 struct UnionCommand : public Command {
   string Name() const { return "union"; }
   bool RequiresTwoOperands() const { return true; }
-  void Apply(const Array2D<bool>& a, const Array2D<bool>& b, Array2D<bool>* x) {
+  void Apply(const Alignment& a, const Alignment& b, Alignment* x) {
     EnsureSize(a, b, x);
-    Array2D<bool>& res = *x;
-    for (int i = 0; i < res.width(); ++i)
-      for (int j = 0; j < res.height(); ++j)
-        res(i, j) = Safe(a, i, j) || Safe(b, i, j);
+    x->links.clear();
+    set_union(a.links.begin(), a.links.end(), b.links.begin(), b.links.end(),
+              back_inserter(x->links));
+  }
+};
+
+// i_len x j_len grid of bits, stored as a row of 64 bit words per i
+class BitGrid {
+ public:
+  BitGrid() : i_len_(), j_len_(), stride_() {}
+  void Reset(int i_len, int j_len) {
+    i_len_ = i_len;
+    j_len_ = j_len;
+    stride_ = (j_len + 63) / 64;
+    bits_.assign(i_len * stride_, 0);
+  }
+  bool operator()(int i, int j) const {
+    return bits_[i * stride_ + j / 64] & (1ull << (j % 64));
+  }
+  // false outside the grid
+  bool Safe(int i, int j) const {
+    return i >= 0 && j >= 0 && i < i_len_ && j < j_len_ && (*this)(i, j);
   }
+  void Set(int i, int j) { bits_[i * stride_ + j / 64] |= 1ull << (j % 64); }
+ private:
+  int i_len_;
+  int j_len_;
+  int stride_;
+  vector<uint64_t> bits_;
 };
 
 struct RefineCommand : public Command {
@@ -139,7 +183,8 @@ struct RefineCommand : public Command {
   bool RequiresTwoOperands() const { return true; }
 
   void Align(int i, int j) {
-    res_(i, j) = true;
+    res_.Set(i, j);
+    res_links_.push_back(Link(i, j));
     is_i_aligned_[i] = true;
     is_j_aligned_[j] = true;
   }
@@ -148,7 +193,7 @@ struct RefineCommand : public Command {
     for (int k = 0; k < neighbors_.size(); ++k) {
       const int di = neighbors_[k].first;
       const int dj = neighbors_[k].second;
-      if (Safe(res_, i + di, j + dj))
+      if (res_.Safe(i + di, j + dj))
         return true;
     }
     return false;
@@ -169,55 +214,61 @@ struct RefineCommand : public Command {
   typedef bool (RefineCommand::*Predicate)(int i, int j) const;
 
  protected:
-  void InitRefine(
-      const Array2D<bool>& a,
-      const Array2D<bool>& b) {
-    res_.clear();
-    EnsureSize(a, b, &res_);
-    in_.clear(); un_.clear(); is_i_aligned_.clear(); is_j_aligned_.clear();
-    EnsureSize(a, b, &in_);
-    EnsureSize(a, b, &un_);
-    is_i_aligned_.resize(res_.width(), false);
-    is_j_aligned_.resize(res_.height(), false);
-    for (int i = 0; i < in_.width(); ++i)
-      for (int j = 0; j < in_.height(); ++j) {
-        un_(i, j) = Safe(a, i, j) || Safe(b, i, j);
-        in_(i, j) = Safe(a, i, j) && Safe(b, i, j);
-        if (in_(i, j)) Align(i, j);
-    }
+  void InitRefine(const Alignment& a, const Alignment& b) {
+    Alignment size;
+    EnsureSize(a, b, &size);
+    res_.Reset(size.i_len, size.j_len);
+    res_links_.clear();
+    is_i_aligned_.assign(size.i_len, false);
+    is_j_aligned_.assign(size.j_len, false);
+    un_.clear();
+    set_union(a.links.begin(), a.links.end(), b.links.begin(), b.links.end(),
+              back_inserter(un_));
+    in_.clear();
+    set_intersection(a.links.begin(), a.links.end(), b.links.begin(), b.links.end(),
+                     back_inserter(in_));
+    for (int k = 0; k < in_.size(); ++k)
+      Align(in_[k].first, in_[k].second);
   }
-  // "grow" the resulting alignment using the points in adds
+  // "grow" the resulting alignment using the links in adds (in order)
   // if they match the constraints determined by pred
-  void Grow(Predicate pred, bool idempotent, const Array2D<bool>& adds) {
+  void Grow(Predicate pred, bool idempotent, const vector<Link>& adds) {
     if (idempotent) {
-      for (int i = 0; i < adds.width(); ++i)
-        for (int j = 0; j < adds.height(); ++j) {
-          if (adds(i, j) && !res_(i, j) &&
-              (this->*pred)(i, j)) Align(i, j);
-        }
+      for (int k = 0; k < adds.size(); ++k) {
+        const int i = adds[k].first, j = adds[k].second;
+        if (!res_(i, j) && (this->*pred)(i, j)) Align(i, j);
+      }
       return;
     }
-    set<pair<int, int> > p;
-    for (int i = 0; i < adds.width(); ++i)
-      for (int j = 0; j < adds.height(); ++j)
-        if (adds(i, j) && !res_(i, j))
-          p.insert(make_pair(i, j));
+    vector<Link> p;
+    for (int k = 0; k < adds.size(); ++k)
+      if (!res_(adds[k].first, adds[k].second)) p.push_back(adds[k]);
+    // until a pass over the remaining links aligns none of them
     bool keep_going = !p.empty();
     while (keep_going) {
       keep_going = false;
-      for (set<pair<int, int> >::iterator pi = p.begin();
-           pi != p.end(); ++pi) {
-        if ((this->*pred)(pi->first, pi->second)) {
-          Align(pi->first, pi->second);
-          p.erase(pi);
+      int kept = 0;
+      for (int k = 0; k < p.size(); ++k) {
+        if ((this->*pred)(p[k].first, p[k].second)) {
+          Align(p[k].first, p[k].second);
           keep_going = true;
+        } else {
+          p[kept++] = p[k];
         }
       }
+      p.resize(kept);
     }
   }
-  Array2D<bool> res_;  // refined alignment
-  Array2D<bool> in_;   // intersection alignment
-  Array2D<bool> un_;   // union alignment
+  void Result(Alignment* x) {
+    x->i_len = is_i_aligned_.size();
+    x->j_len = is_j_aligned_.size();
+    x->links = res_links_;
+    sort(x->links.begin(), x->links.end());
+  }
+  BitGrid res_;              // refined alignment
+  vector<Link> res_links_;   // its links, in the order they were added
+  vector<Link> in_;          // intersection alignment
+  vector<Link> un_;          // union alignment
   vector<bool> is_i_aligned_;
   vector<bool> is_j_aligned_;
   vector<pair<int,int> > neighbors_;
@@ -234,36 +285,38 @@ struct DiagCommand : public RefineCommand {
 
 struct GDCommand : public DiagCommand {
   string Name() const { return "grow-diag"; }
-  void Apply(const Array2D<bool>& a, const Array2D<bool>& b, Array2D<bool>* x) {
+  void Apply(const Alignment& a, const Alignment& b, Alignment* x) {
     InitRefine(a, b);
     Grow(&RefineCommand::KoehnAligned, false, un_);
-    *x = res_;
+    Result(x);
   }
 };
 
 struct GDFCommand : public DiagCommand {
   string Name() const { return "grow-diag-final"; }
-  void Apply(const Array2D<bool>& a, const Array2D<bool>& b, Array2D<bool>* x) {
+  void Apply(const Alignment& a, const Alignment& b, Alignment* x) {
     InitRefine(a, b);
     Grow(&RefineCommand::KoehnAligned, false, un_);
-    Grow(&RefineCommand::IsOneOrBothUnaligned, true, a);
-    Grow(&RefineCommand::IsOneOrBothUnaligned, true, b);
-    *x = res_;
+    Grow(&RefineCommand::IsOneOrBothUnaligned, true, a.links);
+    Grow(&RefineCommand::IsOneOrBothUnaligned, true, b.links);
+    Result(x);
   }
 };
 
 struct GDFACommand : public DiagCommand {
   string Name() const { return "grow-diag-final-and"; }
-  void Apply(const Array2D<bool>& a, const Array2D<bool>& b, Array2D<bool>* x) {
+  void Apply(const Alignment& a, const Alignment& b, Alignment* x) {
     InitRefine(a, b);
     Grow(&RefineCommand::KoehnAligned, false, un_);
-    Grow(&RefineCommand::IsNeitherAligned, true, a);
-    Grow(&RefineCommand::IsNeitherAligned, true, b);
-    *x = res_;
+    Grow(&RefineCommand::IsNeitherAligned, true, a.links);
+    Grow(&RefineCommand::IsNeitherAligned, true, b.links);
+    Result(x);
   }
 };
 
 map<string, boost::shared_ptr<Command> > commands;
+typedef Command* (*CommandFactory)();
+map<string, CommandFactory> factories;
 
 void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   po::options_description opts("Configuration options");
@@ -278,6 +331,7 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
         ("input_1,i", po::value<string>(), "[REQ] Alignment 1 file, - for STDIN")
         ("input_2,j", po::value<string>(), "[OPT] Alignment 2 file, - for STDIN")
 	("command,c", po::value<string>()->default_value("convert"), cstr.c_str())
+        ("threads,t", po::value<int>()->default_value(1), "Number of threads to process the alignments with")
         ("help,h", "Print this help message and exit");
   po::options_description clo("Command line options");
   po::options_description dcmdline_options;
@@ -312,11 +366,107 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   }
 }
 
+template<class C> static Command* NewCommand() { return new C; }
+
 template<class C> static void AddCommand() {
   C* c = new C;
   commands[c->Name()].reset(c);
+  factories[c->Name()] = &NewCommand<C>;
 }
 
+static const int kCHUNK_SIZE = 2000;
+
+// hands out the lines of the alignment file(s) in chunks to the threads,
+// each with its own instance of the command, and writes the alignments
+// they produce to out in input order as soon as all earlier chunks are done
+class ParallelApply {
+ public:
+  ParallelApply(CommandFactory factory, istream* in1, istream* in2, ostream* out) :
+      factory_(factory), in1_(in1), in2_(in2), out_(out), next_chunk_(), next_out_(), mismatched_() {}
+
+  // adds the statistics of all threads to summary; false if the inputs
+  // have different numbers of lines
+  bool Run(int threads, Command* summary) {
+    vector<boost::shared_ptr<Command> > cmds(threads);
+    for (int i = 0; i < threads; ++i)
+      cmds[i].reset(factory_());
+    if (threads > 1) {
+      boost::thread_group workers;
+      for (int i = 0; i < threads; ++i)
+        workers.create_thread(boost::bind(&ParallelApply::RunThread, this, cmds[i].get()));
+      workers.join_all();
+    } else {
+      RunThread(cmds[0].get());
+    }
+    if (summary->Result() == 2)
+      for (int i = 0; i < threads; ++i)
+        summary->Merge(*cmds[i]);
+    return !mismatched_;
+  }
+
+ private:
+  bool NextChunk(int* chunk, vector<string>* lines1, vector<string>* lines2) {
+    boost::mutex::scoped_lock l(in_mutex_);
+    lines1->clear();
+    lines2->clear();
+    *chunk = next_chunk_++;
+    while(*in1_ && !mismatched_ && lines1->size() < kCHUNK_SIZE) {
+      string line1;
+      string line2;
+      getline(*in1_, line1);
+      if (in2_) {
+        getline(*in2_, line2);
+        if ((*in1_ && !*in2_) || (*in2_ && !*in1_)) {
+          mismatched_ = true;
+          break;
+        }
+      }
+      if (line1.empty() && !*in1_) break;
+      lines1->push_back(line1);
+      lines2->push_back(line2);
+    }
+    return !lines1->empty();
+  }
+
+  void RunThread(Command* cmd) {
+    int chunk;
+    vector<string> lines1, lines2;
+    Alignment a1, a2, res;
+    while (NextChunk(&chunk, &lines1, &lines2)) {
+      ostringstream os;
+      cmd->out = &os;
+      for (int i = 0; i < lines1.size(); ++i) {
+        AlignmentPharaoh::ReadPharaohAlignmentLinks(lines1[i], &a1.links, &a1.i_len, &a1.j_len);
+        if (in2_)
+          AlignmentPharaoh::ReadPharaohAlignmentLinks(lines2[i], &a2.links, &a2.i_len, &a2.j_len);
+        cmd->Apply(a1, a2, &res);
+        if (cmd->Result() == 1)
+          AlignmentPharaoh::SerializePharaohFormat(res.links, &os);
+      }
+      boost::mutex::scoped_lock l(out_mutex_);
+      done_[chunk] = os.str();
+      map<int, string>::iterator it;
+      while ((it = done_.find(next_out_)) != done_.end()) {
+        (*out_) << it->second;
+        done_.erase(it);
+        ++next_out_;
+      }
+    }
+    cmd->out = &cout;
+  }
+
+  const CommandFactory factory_;
+  istream* in1_;
+  istream* in2_;
+  ostream* out_;
+  int next_chunk_;
+  int next_out_;
+  bool mismatched_;
+  map<int, string> done_;  // output of the finished chunks not written yet
+  boost::mutex in_mutex_;
+  boost::mutex out_mutex_;
+};
+
 int main(int argc, char **argv) {
   AddCommand<ConvertCommand>();
   AddCommand<DisplayCommand>();
@@ -329,7 +479,8 @@ int main(int argc, char **argv) {
   AddCommand<FMeasureCommand>();
   po::variables_map conf;
   InitCommandLine(argc, argv, &conf);
-  Command& cmd = *commands[conf["command"].as<string>()];
+  const string name = conf["command"].as<string>();
+  Command& cmd = *commands[name];
   boost::shared_ptr<ReadFile> rf1(new ReadFile(conf["input_1"].as<string>()));
   boost::shared_ptr<ReadFile> rf2;
   if (cmd.RequiresTwoOperands())
@@ -337,34 +488,13 @@ int main(int argc, char **argv) {
   istream* in1 = rf1->stream();
   istream* in2 = NULL;
   if (rf2) in2 = rf2->stream();
-  while(*in1) {
-    string line1;
-    string line2;
-    getline(*in1, line1);
-    if (in2) {
-      getline(*in2, line2);
-      if ((*in1 && !*in2) || (*in2 && !*in1)) {
-        cerr << "Mismatched number of lines!\n";
-        exit(1);
-      }
-    }
-    if (line1.empty() && !*in1) break;
-    shared_ptr<Array2D<bool> > out(new Array2D<bool>);
-    shared_ptr<Array2D<bool> > a1 = AlignmentPharaoh::ReadPharaohAlignmentGrid(line1);
-    if (in2) {
-      shared_ptr<Array2D<bool> > a2 = AlignmentPharaoh::ReadPharaohAlignmentGrid(line2);
-      cmd.Apply(*a1, *a2, out.get());
-    } else {
-      Array2D<bool> dummy;
-      cmd.Apply(*a1, dummy, out.get());
-    }
-    
-    if (cmd.Result() == 1) {
-      AlignmentPharaoh::SerializePharaohFormat(*out, &cout);
-    }
+  const int threads = max(1, conf["threads"].as<int>());
+  ParallelApply pa(factories[name], in1, in2, &cout);
+  if (!pa.Run(threads, &cmd)) {
+    cerr << "Mismatched number of lines!\n";
+    exit(1);
   }
   if (cmd.Result() == 2)
     cmd.Summary();
   return 0;
 }
-
@@ -1,9 +1,18 @@
+#include <cstdio>
 #include <iostream>
+#include <map>
+#include <sstream>
 #include <vector>
 
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
 
+#include "bounded_queue.h"
 #include "weights.h"
 #include "rule_lexer.h"
 #include "trule.h"
@@ -38,7 +47,8 @@ bool InitCommandLine(int argc, char** argv, po::variables_map* conf) {
         ("clear_features_after_collapse,c", "After collapse_weights, clear the features except for X")
         ("add_shape_types,s", "Add rule shape types")
         ("extra_lex_feature,x", "Experimental nonlinear lexical weighting feature")
-        ("replace_files,r", "Replace files with transformed variants (requires loading full grammar into memory)")
+        ("replace_files,r", "Replace files with transformed variants (written to a temporary file that is then renamed over the original)")
+        ("threads,j", po::value<int>()->default_value(1), "Number of threads to augment the rules with")
         ("grammar,g", po::value<vector<string> >(), "Input (also output) grammar file(s)");
   po::options_description clo("Command line options");
   clo.add_options()
@@ -88,19 +98,16 @@ template <class Model> float Score(const vector<WordID>& str, const Model &model
 }
 
 bool extra_feature;
-int kSrcLM;
 vector<double> col_weights;
-bool gather_rules;
 bool clear_features = false;
-vector<TRulePtr> rules;
-
-static void RuleHelper(const TRulePtr& new_rule, const unsigned int ctf_level, const TRulePtr& coarse_rule, void* extra) {
-  static const int kSrcLM = FD::Convert("SrcLM");
-  static const int kPC = FD::Convert("PC");
-  static const int kX = FD::Convert("X");
-  static const int kPhraseModel2 = FD::Convert("PhraseModel_1");
-  static const int kNewLex = FD::Convert("NewLex");
-  TRulePtr r; r.reset(new TRule(*new_rule));
+int kSrcLM;
+int kPC;
+int kX;
+int kPhraseModel2;
+int kNewLex;
+
+// thread safe: the LM and the weights are only read
+static void AugmentRule(TRule* r) {
   if (ngram) r->scores_.set_value(kSrcLM, Score(r->f_, *ngram));
   r->scores_.set_value(kPC, 1.0);
   if (extra_feature) {
@@ -112,13 +119,101 @@ static void RuleHelper(const TRulePtr& new_rule, const unsigned int ctf_level, c
     if (clear_features) r->scores_.clear();
     r->scores_.set_value(kX, score);
   }
-  if (gather_rules) {
-    rules.push_back(r);
-  } else {
-    cout << *r << endl;
-  }
 }
 
+static const unsigned kBLOCK_SIZE = 5000;
+
+// reads the rules of a grammar in blocks on the calling thread (the rule
+// lexer isn't reentrant), augments the blocks on the worker threads and has
+// a writer thread put them out in input order.  The reader stays at most
+// window blocks ahead of the writer, so memory use doesn't depend on the
+// size of the grammar.
+class ParallelAugment {
+ public:
+  typedef boost::shared_ptr<vector<TRulePtr> > RuleBlock;
+  typedef pair<int, RuleBlock> Input;
+  typedef pair<int, string> Output;
+
+  ParallelAugment(istream* in, ostream* out, unsigned threads) :
+    in_(in), out_(out), threads_(threads), inputs_(2 * threads), outputs_(2 * threads),
+    window_(8 * threads), next_id_(0), written_(0), block_(new vector<TRulePtr>) {}
+
+  void Run() {
+    boost::thread writer(boost::bind(&ParallelAugment::Write, this));
+    boost::thread_group workers;
+    for (unsigned i = 0; i < threads_; ++i)
+      workers.create_thread(boost::bind(&ParallelAugment::Augment, this));
+    RuleLexer::ReadRules(in_, &ParallelAugment::RuleCallback, this);
+    if (!block_->empty()) Flush();
+    inputs_.Close();
+    workers.join_all();
+    outputs_.Close();
+    writer.join();
+  }
+
+ private:
+  static void RuleCallback(const TRulePtr& new_rule, const unsigned int ctf_level, const TRulePtr& coarse_rule, void* extra) {
+    (void) ctf_level;
+    (void) coarse_rule;
+    ParallelAugment* pa = static_cast<ParallelAugment*>(extra);
+    pa->block_->push_back(TRulePtr(new TRule(*new_rule)));
+    if (pa->block_->size() == kBLOCK_SIZE) pa->Flush();
+  }
+
+  void Flush() {
+    {
+      boost::mutex::scoped_lock l(window_mutex_);
+      while (next_id_ - written_ >= window_)
+        window_cond_.wait(l);
+    }
+    inputs_.Push(Input(next_id_++, block_));
+    block_.reset(new vector<TRulePtr>);
+  }
+
+  void Augment() {
+    Input in;
+    while (inputs_.Pop(&in)) {
+      ostringstream os;
+      const vector<TRulePtr>& rules = *in.second;
+      for (unsigned i = 0; i < rules.size(); ++i) {
+        AugmentRule(rules[i].get());
+        os << *rules[i] << '\n';
+      }
+      outputs_.Push(Output(in.first, os.str()));
+    }
+  }
+
+  void Write() {
+    map<int, string> pending;
+    int next_out = 0;
+    Output item;
+    while (outputs_.Pop(&item)) {
+      pending[item.first].swap(item.second);
+      map<int, string>::iterator it;
+      while ((it = pending.find(next_out)) != pending.end()) {
+        (*out_) << it->second;
+        pending.erase(it);
+        ++next_out;
+      }
+      boost::mutex::scoped_lock l(window_mutex_);
+      written_ = next_out;
+      window_cond_.notify_one();
+    }
+    out_->flush();
+  }
+
+  istream* in_;
+  ostream* out_;
+  const unsigned threads_;
+  BoundedQueue<Input> inputs_;
+  BoundedQueue<Output> outputs_;
+  const int window_;
+  int next_id_;
+  int written_;
+  boost::mutex window_mutex_;
+  boost::condition_variable window_cond_;
+  RuleBlock block_;  // being filled by the reader
+};
 
 int main(int argc, char** argv) {
   po::variables_map conf;
@@ -139,22 +234,36 @@ int main(int argc, char** argv) {
     w.InitVector(&col_weights);
   }
   clear_features = conf.count("clear_features_after_collapse") > 0;
-  gather_rules = false;
-  bool replace_files = conf.count("replace_files");
-  if (replace_files) gather_rules = true;
+  kSrcLM = FD::Convert("SrcLM");
+  kPC = FD::Convert("PC");
+  kX = FD::Convert("X");
+  kPhraseModel2 = FD::Convert("PhraseModel_1");
+  kNewLex = FD::Convert("NewLex");
+  const bool replace_files = conf.count("replace_files");
+  const int threads = max(1, conf["threads"].as<int>());
   vector<string> files = conf["grammar"].as<vector<string> >();
   for (int i=0; i < files.size(); ++i) {
     cerr << "Processing " << files[i] << " ..." << endl;
-    if (true) {
-      ReadFile rf(files[i]);
-      rules.clear();
-      RuleLexer::ReadRules(rf.stream(), &RuleHelper, NULL);
-    }
+    ReadFile rf(files[i]);
     if (replace_files) {
-      WriteFile wf(files[i]);
-      for (int i = 0; i < rules.size(); ++i) { (*wf.stream()) << *rules[i] << endl; }
+      // keep the .gz suffix so the temporary file is compressed like the original
+      const bool gz = files[i].size() > 3 && files[i].compare(files[i].size() - 3, 3, ".gz") == 0;
+      const string tmp = files[i] + (gz ? ".tmp.gz" : ".tmp");
+      {
+        WriteFile wf(tmp);
+        ParallelAugment(rf.stream(), wf.stream(), threads).Run();
+        if (!*wf.stream()) {
+          cerr << "Error writing " << tmp << endl;
+          return 1;
+        }
+      }
+      if (rename(tmp.c_str(), files[i].c_str()) != 0) {
+        cerr << "Failed to rename " << tmp << " to " << files[i] << endl;
+        return 1;
+      }
+    } else {
+      ParallelAugment(rf.stream(), &cout, threads).Run();
     }
   }
   return 0;
 }
-
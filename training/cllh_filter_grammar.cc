@@ -1,9 +1,17 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <vector>
+#include <map>
+#include <limits>
 #include <cassert>
+#include <tr1/unordered_map>
 #include <unistd.h>   // fork
 #include <sys/wait.h> // waitpid
 
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
 
@@ -11,10 +19,13 @@
 #include "ff_register.h"
 #include "verbose.h"
 #include "hg.h"
+#include "hg_io.h"
 #include "decoder.h"
 #include "filelib.h"
+#include "weights.h"
 
 using namespace std;
+using namespace std::tr1;
 namespace po = boost::program_options;
 
 void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
@@ -25,7 +36,11 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
         ("shards,s",po::value<unsigned>()->default_value(1),"Number of shards")
         ("starting_shard,S",po::value<unsigned>()->default_value(0), "In this invocation only process shards >= S")
         ("work_limit,l",po::value<unsigned>()->default_value(9999), "Process maximially this many shards")
-        ("ncpus,C",po::value<unsigned>()->default_value(1),"Number of CPUs to use");
+        ("ncpus,C",po::value<unsigned>()->default_value(1),"Number of CPUs to use")
+        ("forest_dir,F",po::value<string>(),"When decoding, also write the reference forest of each reachable sentence to this directory. With --threshold, filter the grammar using the forests written there instead of decoding")
+        ("threshold,T",po::value<vector<double> >()->multitoken(),"Write the rules whose posterior in some cached reference forest is at least this value (0 keeps every rule on a reference derivation), and the sentences still reachable with them. Several thresholds may be given")
+        ("weights,w",po::value<string>(),"Feature weights to compute the posteriors with (the default weighs all reference derivations equally)")
+        ("threads",po::value<unsigned>()->default_value(1),"Number of threads to scan the cached forests with");
   po::options_description clo("Command line options");
   clo.add_options()
         ("config", po::value<string>(), "Configuration file")
@@ -41,7 +56,12 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   }
   po::notify(*conf);
 
-  if (conf->count("help") || !conf->count("training_data") || !conf->count("decoder_config")) {
+  const bool filter = conf->count("threshold");
+  if (filter && !conf->count("forest_dir")) {
+    cerr << "--threshold requires the --forest_dir written by an earlier run\n";
+    exit(1);
+  }
+  if (conf->count("help") || !conf->count("training_data") || (!filter && !conf->count("decoder_config"))) {
     cerr << dcmdline_options << endl;
     exit(1);
   }
@@ -65,8 +85,20 @@ void ReadTrainingCorpus(const string& fname, int rank, int size, vector<string>*
   }
 }
 
+// fragile hack to filter out glue rules
+inline bool IsGlueRule(const TRule* rule) {
+  static const int s_lhs = -TD::Convert("S");
+  static const int goal_lhs = -TD::Convert("Goal");
+  return rule->lhs_ == s_lhs || rule->lhs_ == goal_lhs;
+}
+
+string ForestFile(const string& dir, int sent_id) {
+  ostringstream os;
+  os << dir << "/ref." << sent_id << ".bin";
+  return os.str();
+}
+
 struct TrainingObserver : public DecoderObserver {
-  TrainingObserver() : s_lhs(-TD::Convert("S")), goal_lhs(-TD::Convert("Goal")) {}
 
   void Reset() {
     total_complete = 0;
@@ -82,8 +114,7 @@ struct TrainingObserver : public DecoderObserver {
     assert(state == 1);
     for (int i = 0; i < hg->edges_.size(); ++i) {
       const TRule* rule = hg->edges_[i].rule_.get();
-      if (rule->lhs_ == s_lhs || rule->lhs_ == goal_lhs)  // fragile hack to filter out glue rules
-        continue;
+      if (IsGlueRule(rule)) continue;
       used.insert(rule);
     }
     state = 2;
@@ -92,6 +123,20 @@ struct TrainingObserver : public DecoderObserver {
   virtual void NotifyAlignmentForest(const SentenceMetadata& smeta, Hypergraph* hg) {
     assert(state == 2);
     state = 3;
+    if (!forest_file.empty()) {
+      // the edges of the constrained forest have rules made by the
+      // intersection, the filtering pass needs the grammar rules
+      Hypergraph ref(*hg);
+      for (int i = 0; i < ref.edges_.size(); ++i) {
+        TRulePtr& rule = ref.edges_[i].rule_;
+        while (rule->parent_rule_) rule = rule->parent_rule_;
+      }
+      ofstream out(forest_file.c_str(), ios::binary);
+      if (!HypergraphIO::WriteToBinary(ref, false, &out) || !out) {
+        cerr << "Can't write forest to " << forest_file << endl;
+        abort();
+      }
+    }
   }
 
   virtual void NotifyDecodingComplete(const SentenceMetadata& smeta) {
@@ -103,15 +148,14 @@ struct TrainingObserver : public DecoderObserver {
   }
 
   set<const TRule*> used;
+  string forest_file;  // where to write the reference forest, if not empty
 
-  const int s_lhs;
-  const int goal_lhs;
   bool failed;
   int total_complete;
   int state;
 };
 
-void work(const string& fname, int rank, int size, Decoder* decoder) {
+void work(const string& fname, int rank, int size, const string& forest_dir, Decoder* decoder) {
   cerr << "Worker " << rank << '/' << size << " starting.\n";
   vector<string> corpus;
   vector<int> ids;
@@ -130,6 +174,7 @@ void work(const string& fname, int rank, int size, Decoder* decoder) {
     const int sent_id = ids[i];
     const string& input = corpus[i];
     decoder->SetId(sent_id);
+    if (!forest_dir.empty()) observer.forest_file = ForestFile(forest_dir, sent_id);
     decoder->Decode(input, &observer);
     if (observer.failed) {
       // do nothing
@@ -143,12 +188,259 @@ void work(const string& fname, int rank, int size, Decoder* decoder) {
   }
 }
 
+static const int kCHUNK_SIZE = 200;
+
+// reads the cached reference forests of the sentences ids in chunks on
+// several threads, reweighted with weights (all edges weigh the same if it is
+// empty), passes each to
+// scan and hands the results to merge in sentence order
+template <class Result>
+class ParallelScan {
+ public:
+  typedef boost::function<void (const Hypergraph&, Result*)> ScanFn;
+  typedef boost::function<void (int, const Result&)> MergeFn;
+
+  ParallelScan(const string& dir, const vector<int>& ids, const vector<double>& weights, ScanFn scan, MergeFn merge) :
+      dir_(dir), ids_(ids), weights_(weights), scan_(scan), merge_(merge), next_chunk_(), next_merge_() {}
+
+  void Run(unsigned threads) {
+    if (threads > 1) {
+      boost::thread_group workers;
+      for (unsigned i = 0; i < threads; ++i)
+        workers.create_thread(boost::bind(&ParallelScan::RunThread, this));
+      workers.join_all();
+    } else {
+      RunThread();
+    }
+  }
+
+ private:
+  void RunThread() {
+    Hypergraph hg;
+    while (true) {
+      int chunk;
+      {
+        boost::mutex::scoped_lock l(in_mutex_);
+        chunk = next_chunk_++;
+      }
+      const int begin = chunk * kCHUNK_SIZE;
+      if (begin >= ids_.size()) break;
+      const int end = min<int>(begin + kCHUNK_SIZE, ids_.size());
+      vector<Result> res(end - begin);
+      for (int i = begin; i < end; ++i) {
+        const string file = ForestFile(dir_, ids_[i]);
+        if (!HypergraphIO::ReadFromFile(file, &hg)) {
+          cerr << "Can't read cached forest " << file << endl;
+          abort();
+        }
+        hg.Reweight(weights_);
+        scan_(hg, &res[i - begin]);
+      }
+      boost::mutex::scoped_lock l(out_mutex_);
+      done_[chunk].swap(res);
+      typename map<int, vector<Result> >::iterator it;
+      while ((it = done_.find(next_merge_)) != done_.end()) {
+        const vector<Result>& r = it->second;
+        for (int i = 0; i < r.size(); ++i)
+          merge_(next_merge_ * kCHUNK_SIZE + i, r[i]);
+        done_.erase(it);
+        ++next_merge_;
+      }
+    }
+  }
+
+  const string dir_;
+  const vector<int>& ids_;
+  const vector<double>& weights_;
+  ScanFn scan_;
+  MergeFn merge_;
+  int next_chunk_;
+  int next_merge_;
+  map<int, vector<Result> > done_;  // results of the finished chunks not merged yet
+  boost::mutex in_mutex_;
+  boost::mutex out_mutex_;
+};
+
+// the posterior statistics of the rules of one reference forest
+struct SentenceRules {
+  vector<string> rules;
+  vector<double> max_post;  // highest posterior of an edge with the rule
+  vector<double> count;     // expected number of uses
+};
+
+void ScanRules(const Hypergraph& hg, SentenceRules* res) {
+  Hypergraph::EdgeProbs posts;
+  const prob_t z = hg.ComputeEdgePosteriors(1.0, &posts);
+  // edges share the rule objects of the forest file
+  map<const TRule*, int> idx;
+  for (int i = 0; i < hg.edges_.size(); ++i) {
+    const TRule* rule = hg.edges_[i].rule_.get();
+    if (IsGlueRule(rule)) continue;
+    const double p = (posts[i] / z).as_float();
+    int& j = idx.insert(make_pair(rule, res->rules.size())).first->second;
+    if (j == res->rules.size()) {
+      res->rules.push_back(rule->AsString());
+      res->max_post.push_back(p);
+      res->count.push_back(p);
+    } else {
+      res->max_post[j] = max(res->max_post[j], p);
+      res->count[j] += p;
+    }
+  }
+}
+
+struct RuleStats {
+  RuleStats() : sentences(), max_post(), count() {}
+  int sentences;
+  double max_post;
+  double count;
+};
+
+// aggregates the statistics of all forests, keeping the rules in the order
+// they are first seen in
+struct RuleStatsMerger {
+  void operator()(int, const SentenceRules& r) {
+    for (int i = 0; i < r.rules.size(); ++i) {
+      int& j = idx->insert(make_pair(r.rules[i], stats->size())).first->second;
+      if (j == stats->size()) stats->push_back(make_pair(r.rules[i], RuleStats()));
+      RuleStats& s = (*stats)[j].second;
+      ++s.sentences;
+      s.max_post = max(s.max_post, r.max_post[i]);
+      s.count += r.count[i];
+    }
+  }
+  unordered_map<string, int>* idx;
+  vector<pair<string, RuleStats> >* stats;
+};
+
+// whether the goal of a forest can still be derived with the rules each
+// threshold keeps
+struct ReachabilityScanner {
+  void operator()(const Hypergraph& hg, vector<bool>* res) const {
+    const int goal = hg.nodes_.size() - 1;
+    res->resize(thresholds->size());
+    // the highest posterior of the rule of each edge, infinite for glue rules
+    map<const TRule*, double> rule_post;
+    vector<double> edge_post(hg.edges_.size(), numeric_limits<double>::infinity());
+    for (int i = 0; i < hg.edges_.size(); ++i) {
+      const TRule* rule = hg.edges_[i].rule_.get();
+      if (IsGlueRule(rule)) continue;
+      const map<const TRule*, double>::iterator it = rule_post.find(rule);
+      if (it != rule_post.end()) {
+        edge_post[i] = it->second;
+      } else {
+        const unordered_map<string, double>::const_iterator mit = max_post->find(rule->AsString());
+        assert(mit != max_post->end());
+        edge_post[i] = rule_post[rule] = mit->second;
+      }
+    }
+    vector<bool> derivable(hg.nodes_.size());
+    for (int t = 0; t < thresholds->size(); ++t) {
+      derivable.assign(hg.nodes_.size(), false);
+      for (int i = 0; i < hg.nodes_.size(); ++i) {
+        const Hypergraph::Node& node = hg.nodes_[i];
+        for (int j = 0; j < node.in_edges_.size() && !derivable[i]; ++j) {
+          const Hypergraph::Edge& edge = hg.edges_[node.in_edges_[j]];
+          if (edge_post[edge.id_] < (*thresholds)[t]) continue;
+          bool ok = true;
+          for (int k = 0; k < edge.tail_nodes_.size() && ok; ++k)
+            ok = derivable[edge.tail_nodes_[k]];
+          derivable[i] = ok;
+        }
+      }
+      (*res)[t] = goal >= 0 && derivable[goal];
+    }
+  }
+  const vector<double>* thresholds;
+  const unordered_map<string, double>* max_post;
+};
+
+struct ReachabilityMerger {
+  void operator()(int i, const vector<bool>& reachable) {
+    for (int t = 0; t < reachable.size(); ++t)
+      if (reachable[t]) (*corpora[t]->stream()) << (*corpus)[i] << endl;
+  }
+  const vector<string>* corpus;
+  vector<boost::shared_ptr<WriteFile> > corpora;
+};
+
+// filters the grammar with the forests cached in forest_dir: writes the
+// statistics of every rule to rule_stats.gz and, for each threshold T, the
+// rules whose highest posterior is at least T to grammar.T.gz and the
+// sentences still reachable with them to corpus.T
+void filter(const string& fname, const string& forest_dir, const vector<double>& thresholds,
+            const vector<double>& weights, unsigned threads) {
+  vector<string> all, corpus;
+  vector<int> all_ids, ids;
+  ReadTrainingCorpus(fname, 0, 1, &all, &all_ids);
+  for (int i = 0; i < all.size(); ++i) {
+    if (FileExists(ForestFile(forest_dir, all_ids[i]))) {
+      corpus.push_back(all[i]);
+      ids.push_back(all_ids[i]);
+    }
+  }
+  cerr << "Found cached reference forests for " << ids.size() << " of " << all.size() << " sentences\n";
+
+  unordered_map<string, int> idx;
+  vector<pair<string, RuleStats> > stats;
+  RuleStatsMerger sm;
+  sm.idx = &idx;
+  sm.stats = &stats;
+  ParallelScan<SentenceRules>(forest_dir, ids, weights, &ScanRules, sm).Run(threads);
+  cerr << "Collected the statistics of " << stats.size() << " rules\n";
+
+  unordered_map<string, double> max_post;
+  {
+    WriteFile fs("rule_stats.gz");
+    for (int i = 0; i < stats.size(); ++i) {
+      const RuleStats& s = stats[i].second;
+      (*fs.stream()) << stats[i].first << " ||| sentences=" << s.sentences << " max_posterior=" << s.max_post
+                     << " expected_count=" << s.count << endl;
+      max_post[stats[i].first] = s.max_post;
+    }
+  }
+  for (int t = 0; t < thresholds.size(); ++t) {
+    ostringstream og; og << "grammar." << thresholds[t] << ".gz";
+    WriteFile fog(og.str());
+    int kept = 0;
+    for (int i = 0; i < stats.size(); ++i) {
+      if (stats[i].second.max_post >= thresholds[t]) {
+        (*fog.stream()) << stats[i].first << endl;
+        ++kept;
+      }
+    }
+    cerr << "Threshold " << thresholds[t] << ": kept " << kept << " rules\n";
+  }
+
+  ReachabilityScanner rs;
+  rs.thresholds = &thresholds;
+  rs.max_post = &max_post;
+  ReachabilityMerger rm;
+  rm.corpus = &corpus;
+  for (int t = 0; t < thresholds.size(); ++t) {
+    ostringstream oc; oc << "corpus." << thresholds[t];
+    rm.corpora.push_back(boost::shared_ptr<WriteFile>(new WriteFile(oc.str())));
+  }
+  ParallelScan<vector<bool> >(forest_dir, ids, weights, rs, rm).Run(threads);
+}
+
 int main(int argc, char** argv) {
   register_feature_functions();
 
   po::variables_map conf;
   InitCommandLine(argc, argv, &conf);
   const string fname = conf["training_data"].as<string>();
+  const string forest_dir = conf.count("forest_dir") ? conf["forest_dir"].as<string>() : "";
+  if (conf.count("threshold")) {
+    vector<double> weights;
+    if (conf.count("weights")) {
+      Weights w;
+      w.InitFromFile(conf["weights"].as<string>());
+      w.InitVector(&weights);
+    }
+    filter(fname, forest_dir, conf["threshold"].as<vector<double> >(), weights, max(1u, conf["threads"].as<unsigned>()));
+    return 0;
+  }
   const unsigned ncpus = conf["ncpus"].as<unsigned>();
   const unsigned shards = conf["shards"].as<unsigned>();
   const unsigned start = conf["starting_shard"].as<unsigned>();
@@ -163,6 +455,7 @@ int main(int argc, char** argv) {
     abort();
   }
   SetSilent(true);  // turn off verbose decoder output
+  if (!forest_dir.empty() && !DirectoryExists(forest_dir)) MkDirP(forest_dir);
   cerr << "Forking " << ncpus << " time(s)\n";
   vector<pid_t> children;
   for (int i = 0; i < ncpus; ++i) {
@@ -177,7 +470,7 @@ int main(int argc, char** argv) {
       for (int j = start; j < eff_shards; ++j) {
         if (j % ncpus == i) {
           cerr << "  CPU " << i << " processing shard " << j << endl;
-          work(fname, j, shards, &decoder);
+          work(fname, j, shards, forest_dir, &decoder);
           cerr << "  Shard " << j << "/" << shards << " finished.\n";
         }
       }
@@ -88,12 +88,17 @@ while ($iter < $max_iteration) {
   my $next_iter = $iter + 1;
   my $WSTR = "-w $dir/weights.$iter.gz";
   if ($iter == 1) { $WSTR = ''; }
-  my $dec_cmd="$DECODER --feature_expectations -c $config $WSTR $CFLAG < $training_corpus 2> $dir/deco.log.$iter";
+  # without the cluster, counts go through in binary and the reducer groups
+  # them itself, so there is nothing to sort
+  my $FORMAT = $parallel ? "b64" : "binary";
+  my $dec_cmd="$DECODER --feature_expectations --vector_format $FORMAT -c $config $WSTR $CFLAG < $training_corpus 2> $dir/deco.log.$iter";
   my $pcmd = "$PARALLEL -e $dir/err -p $pmem --nodelist \"$nodelist\" -- ";
   my $cmd = "";
   if ($parallel) { $cmd = $pcmd; }
   $cmd .= "$dec_cmd";
-  $cmd .= "| $ADAPTER | sort -k1 | $REDUCER | $REDUCE2WEIGHTS -o $dir/weights.$next_iter.gz";
+  $cmd .= "| $ADAPTER -b $COMBINER_CACHE_SIZE -f $FORMAT -o $FORMAT";
+  $cmd .= " | sort -k1" if $parallel;
+  $cmd .= " | $REDUCER -f $FORMAT | $REDUCE2WEIGHTS -f $FORMAT -o $dir/weights.$next_iter.gz";
   print STDERR "EXECUTING: $cmd\n";
   my $result = `$cmd`;
   if ($? != 0) {
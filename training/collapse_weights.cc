@@ -11,8 +11,8 @@ char const* NOTES =
 
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
-#include <boost/functional/hash.hpp>
 
+#include "hash.h"
 #include "prob.h"
 #include "filelib.h"
 #include "trule.h"
@@ -21,7 +21,7 @@ char const* NOTES =
 namespace po = boost::program_options;
 using namespace std;
 
-typedef std::tr1::unordered_map<vector<WordID>, prob_t, boost::hash<vector<WordID> > > MarginalMap;
+typedef std::tr1::unordered_map<vector<WordID>, prob_t, murmur_hash_array<vector<WordID> > > MarginalMap;
 
 void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   po::options_description opts("Configuration options");
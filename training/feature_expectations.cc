@@ -21,6 +21,7 @@
 #include "weights.h"
 #include "sparse_vector.h"
 #include "sampler.h"
+#include "sorted_feature_stream.h"
 
 #ifdef HAVE_MPI
 #include <boost/mpi/timer.hpp>
@@ -39,13 +40,13 @@ struct FComp {
   }
 };
 
-void ShowFeatures(const vector<double>& w) {
+void ShowFeatures(const vector<double>& w, ostream* out) {
   vector<int> fnums(w.size());
   for (int i = 0; i < w.size(); ++i)
     fnums[i] = i;
   sort(fnums.begin(), fnums.end(), FComp(w));
   for (vector<int>::iterator i = fnums.begin(); i != fnums.end(); ++i) {
-    if (w[*i]) cout << FD::Convert(*i) << ' ' << w[*i] << endl;
+    if (w[*i]) (*out) << FD::Convert(*i) << ' ' << w[*i] << endl;
   }
 }
 
@@ -71,7 +72,9 @@ bool InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   opts.add_options()
         ("input,i",po::value<string>(),"Corpus of source language sentences")
         ("weights,w",po::value<string>(),"Input feature weights file")
-        ("decoder_config,c",po::value<string>(), "cdec.ini file");
+        ("decoder_config,c",po::value<string>(), "cdec.ini file")
+        ("output_format,f",po::value<string>()->default_value("text"), "Format of the expectations: text (\"feature value\" lines, largest first) or sorted (a binary sorted feature stream, which merge_expectations sums with those of other shards)")
+        ("output,o",po::value<string>()->default_value("-"), "Write the expectations to");
   po::options_description clo("Command line options");
   clo.add_options()
         ("config", po::value<string>(), "Configuration file")
@@ -87,7 +90,9 @@ bool InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   }
   po::notify(*conf);
 
-  if (conf->count("help") || !conf->count("input") || !conf->count("decoder_config")) {
+  const string f = (*conf)["output_format"].as<string>();
+  if (conf->count("help") || !conf->count("input") || !conf->count("decoder_config") ||
+      (f != "text" && f != "sorted")) {
     cerr << dcmdline_options << endl;
     return false;
   }
@@ -224,9 +229,17 @@ int main(int argc, char** argv) {
   exps.swap(local_exps);
 #endif
 
-  weights.InitFromVector(exps);
-  weights.InitVector(&lambdas);
-  ShowFeatures(lambdas);
+  if (rank == 0) {
+    WriteFile wf(conf["output"].as<string>());
+    if (conf["output_format"].as<string>() == "sorted") {
+      SortedFeatureWriter out(wf.stream());
+      out.Write(exps);
+    } else {
+      weights.InitFromVector(exps);
+      weights.InitVector(&lambdas);
+      ShowFeatures(lambdas, wf.stream());
+    }
+  }
 
   return 0;
 }
@@ -3,9 +3,12 @@
   what are: json, split ?
  */
 #include <iostream>
+#include <fstream>
 #include <algorithm>
 #include <sstream>
 
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/program_options.hpp>
 
@@ -26,8 +29,10 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   po::options_description opts("Configuration options");
   opts.add_options()
         ("input,i", po::value<string>()->default_value("-"), "Input file")
-        ("format,f", po::value<string>()->default_value("cfg"), "Input format. Values: cfg, json, split")
-        ("output,o", po::value<string>()->default_value("json"), "Output command. Values: json, 1best")
+        ("format,f", po::value<string>()->default_value("cfg"), "Input format. Values: cfg, json, split, binary (a list of binary forest files, one per line, optionally followed by ||| and a reference)")
+        ("output,o", po::value<string>()->default_value("json"), "Output command. Values: json, 1best, binary (writes the forests to --forest_dir and lists them in the format -f binary reads)")
+        ("forest_dir,d", po::value<string>(), "Directory to write binary forests to, named by their position in the input")
+        ("threads,t", po::value<int>()->default_value(1), "Number of threads to convert forests with; the output stays in input order")
         ("reorder,r", "Add Yamada & Knight (2002) reorderings")
         ("weights,w", po::value<string>(), "Feature weights for k-best derivations [optional]")
         ("collapse_weights,C", "Collapse order features into a single feature whose value is all of the locally applying feature weights")
@@ -41,6 +46,10 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   po::store(parse_command_line(argc, argv, dcmdline_options), *conf);
   po::notify(*conf);
 
+  if ((*conf)["output"].as<string>() == "binary" && !conf->count("forest_dir")) {
+    cerr << "-o binary requires --forest_dir\n";
+    exit(1);
+  }
   if (conf->count("help") || conf->count("input") == 0) {
     cerr << "\nUsage: grammar_convert [-options]\n\nConverts a grammar file (in Hiero format) into JSON hypergraph.\n";
     cerr << dcmdline_options << endl;
@@ -214,21 +223,35 @@ void CollapseWeights(Hypergraph* hg) {
   }
 }
 
-void ProcessHypergraph(const vector<double>& w, const po::variables_map& conf, const string& ref, Hypergraph* hg) {
+// writes the results for the forest with index id to out and err
+void ProcessHypergraph(const vector<double>& w, const po::variables_map& conf, int id, const string& ref,
+                       Hypergraph* hg, ostream* out, ostream* err) {
   if (conf.count("reorder"))
     PermuteYamadaAndKnight(hg, conf["max_reorder"].as<int>());
   if (w.size() > 0) { hg->Reweight(w); }
   if (conf.count("collapse_weights")) CollapseWeights(hg);
-  if (conf["output"].as<string>() == "json") {
-    HypergraphIO::WriteToJSON(*hg, false, &cout);
-    if (!ref.empty()) { cerr << "REF: " << ref << endl; }
+  const string& output = conf["output"].as<string>();
+  if (output == "json") {
+    HypergraphIO::WriteToJSON(*hg, false, out);
+    if (!ref.empty()) { (*err) << "REF: " << ref << endl; }
+  } else if (output == "binary") {
+    ostringstream fname;
+    fname << conf["forest_dir"].as<string>() << '/' << id << ".bin";
+    ofstream f(fname.str().c_str(), ios::binary);
+    if (!HypergraphIO::WriteToBinary(*hg, false, &f) || !f) {
+      cerr << "Can't write forest to " << fname.str() << endl;
+      exit(1);
+    }
+    (*out) << fname.str();
+    if (!ref.empty()) (*out) << " ||| " << ref;
+    (*out) << endl;
   } else {
     vector<WordID> onebest;
     ViterbiESentence(*hg, &onebest);
     if (ref.empty()) {
-      cout << TD::GetString(onebest) << endl;
+      (*out) << TD::GetString(onebest) << endl;
     } else {
-      cout << TD::GetString(onebest) << " ||| " << ref << endl;
+      (*out) << TD::GetString(onebest) << " ||| " << ref << endl;
     }
   }
   if (conf.count("k_derivations")) {
@@ -238,70 +261,100 @@ void ProcessHypergraph(const vector<double>& w, const po::variables_map& conf, c
       const KBest::KBestDerivations<vector<WordID>, ESentenceTraversal>::Derivation* d =
         kbest.LazyKthBest(hg->nodes_.size() - 1, i);
       if (!d) break;
-      cerr << log(d->score) << " ||| " << TD::GetString(d->yield) << " ||| " << d->feature_values << endl;
+      (*err) << log(d->score) << " ||| " << TD::GetString(d->yield) << " ||| " << d->feature_values << endl;
     }
   }
 }
 
-int main(int argc, char **argv) {
-  kSTART = TD::Convert("S") * -1;
-  po::variables_map conf;
-  InitCommandLine(argc, argv, &conf);
-  string infile = conf["input"].as<string>();
-  const bool is_split_input = (conf["format"].as<string>() == "split");
-  const bool is_json_input = is_split_input || (conf["format"].as<string>() == "json");
-  const bool collapse_weights = conf.count("collapse_weights");
-  Weights wts;
-  vector<double> w;
-  if (conf.count("weights")) {
-    wts.InitFromFile(conf["weights"].as<string>());
-    wts.InitVector(&w);
+// one forest of the input: a JSON line or binary forest file name, which the
+// thread converting it reads, or a forest already built from a CFG
+struct Forest {
+  int lc;  // line it ends on
+  string text;
+  string ref;
+  Hypergraph hg;
+};
+
+static const int kCHUNK_SIZE = 50;
+
+// reads the forests in chunks (the JSON and binary ones are only parsed by
+// the threads), has the threads process them and writes what they produce
+// to cout and cerr in input order
+class ForestConverter {
+ public:
+  ForestConverter(const vector<double>& w, const po::variables_map& conf, istream* in) :
+      w_(w), conf_(conf), in_(in), lc_(), num_forests_(), next_chunk_(), next_out_() {
+    const string& format = conf["format"].as<string>();
+    is_split_input_ = format == "split";
+    is_json_input_ = is_split_input_ || format == "json";
+    is_binary_input_ = format == "binary";
   }
-  if (collapse_weights && !w.size()) {
-    cerr << "--collapse_weights requires a weights file to be specified!\n";
-    exit(1);
+
+  void Run(int threads) {
+    if (threads > 1) {
+      boost::thread_group workers;
+      for (int i = 0; i < threads; ++i)
+        workers.create_thread(boost::bind(&ForestConverter::RunThread, this));
+      workers.join_all();
+    } else {
+      RunThread();
+    }
   }
-  ReadFile rf(infile);
-  istream* in = rf.stream();
-  assert(*in);
-  int lc = 0;
-  Hypergraph hg;
-  map<WordID, int> lhs2node;
-  while(*in) {
+
+ private:
+  // the forests of the next chunk and the index of the first one
+  bool NextChunk(int* chunk, int* first_id, vector<Forest>* forests) {
+    boost::mutex::scoped_lock l(in_mutex_);
+    forests->clear();
+    *chunk = next_chunk_++;
+    *first_id = num_forests_;
+    while (forests->size() < kCHUNK_SIZE && ReadForest(forests)) {}
+    num_forests_ += forests->size();
+    return !forests->empty();
+  }
+
+  // adds the next forest of the input to forests; false at the end of it
+  bool ReadForest(vector<Forest>* forests) {
     string line;
-    ++lc;
-    getline(*in, line);
-    if (is_json_input) {
-      if (line.empty() || line[0] == '#') continue;
-      string ref;
-      if (is_split_input) {
-        size_t pos = line.rfind("}}");
-        assert(pos != string::npos);
-        size_t rstart = line.find("||| ", pos);
-        assert(rstart != string::npos);
-        ref = line.substr(rstart + 4);
-        line = line.substr(0, pos + 2);
-      }
-      istringstream is(line);
-      if (HypergraphIO::ReadFromJSON(&is, &hg)) {
-        ProcessHypergraph(w, conf, ref, &hg);
-        hg.clear();
-      } else {
-        cerr << "Error reading grammar from JSON: line " << lc << endl;
-        exit(1);
+    while(*in_) {
+      ++lc_;
+      getline(*in_, line);
+      if (is_json_input_ || is_binary_input_) {
+        if (line.empty() || line[0] == '#') continue;
+        forests->resize(forests->size() + 1);
+        Forest& f = forests->back();
+        f.lc = lc_;
+        if (is_split_input_) {
+          size_t pos = line.rfind("}}");
+          assert(pos != string::npos);
+          size_t rstart = line.find("||| ", pos);
+          assert(rstart != string::npos);
+          f.ref = line.substr(rstart + 4);
+          line = line.substr(0, pos + 2);
+        } else if (is_binary_input_) {
+          const size_t pos = line.find(" ||| ");
+          if (pos != string::npos) {
+            f.ref = line.substr(pos + 5);
+            line = line.substr(0, pos);
+          }
+        }
+        f.text.swap(line);
+        return true;
       }
-    } else {
       if (line.empty()) {
-        int goal = lhs2node[kSTART] - 1;
-        FilterAndCheckCorrectness(goal, &hg);
-        ProcessHypergraph(w, conf, "", &hg);
-        hg.clear();
-        lhs2node.clear();
-        continue;
+        if (!*in_ && hg_.edges_.empty()) return false;
+        int goal = lhs2node_[kSTART] - 1;
+        FilterAndCheckCorrectness(goal, &hg_);
+        forests->resize(forests->size() + 1);
+        forests->back().lc = lc_;
+        forests->back().hg = hg_;
+        hg_.clear();
+        lhs2node_.clear();
+        return true;
       }
       if (line[0] == '#') continue;
       if (line[0] != '[') {
-        cerr << "Line " << lc << ": bad format\n";
+        cerr << "Line " << lc_ << ": bad format\n";
         exit(1);
       }
       TRulePtr tr(TRule::CreateRuleMonolingual(line));
@@ -309,15 +362,89 @@ int main(int argc, char **argv) {
       for (int i = 0; i < tr->f_.size(); ++i) {
         WordID var_cat = tr->f_[i];
         if (var_cat < 0)
-          tail.push_back(GetOrCreateNode(var_cat, &lhs2node, &hg));
+          tail.push_back(GetOrCreateNode(var_cat, &lhs2node_, &hg_));
       }
       const WordID lhs = tr->GetLHS();
-      int head = GetOrCreateNode(lhs, &lhs2node, &hg);
-      Hypergraph::Edge* edge = hg.AddEdge(tr, tail);
+      int head = GetOrCreateNode(lhs, &lhs2node_, &hg_);
+      Hypergraph::Edge* edge = hg_.AddEdge(tr, tail);
       edge->feature_values_ = tr->scores_;
-      Hypergraph::Node* node = &hg.nodes_[head];
-      hg.ConnectEdgeToHeadNode(edge, node);
+      Hypergraph::Node* node = &hg_.nodes_[head];
+      hg_.ConnectEdgeToHeadNode(edge, node);
     }
+    return false;
   }
-}
 
+  void RunThread() {
+    int chunk, first_id;
+    vector<Forest> forests;
+    while (NextChunk(&chunk, &first_id, &forests)) {
+      ostringstream out, err;
+      for (int i = 0; i < forests.size(); ++i) {
+        Forest& f = forests[i];
+        if (is_json_input_) {
+          istringstream is(f.text);
+          if (!HypergraphIO::ReadFromJSON(&is, &f.hg)) {
+            cerr << "Error reading grammar from JSON: line " << f.lc << endl;
+            exit(1);
+          }
+        } else if (is_binary_input_) {
+          if (!HypergraphIO::ReadFromFile(f.text, &f.hg)) {
+            cerr << "Error reading forest " << f.text << ": line " << f.lc << endl;
+            exit(1);
+          }
+        }
+        ProcessHypergraph(w_, conf_, first_id + i, f.ref, &f.hg, &out, &err);
+        f.hg.clear();
+      }
+      boost::mutex::scoped_lock l(out_mutex_);
+      done_[chunk] = make_pair(out.str(), err.str());
+      map<int, pair<string, string> >::iterator it;
+      while ((it = done_.find(next_out_)) != done_.end()) {
+        cout << it->second.first << flush;
+        cerr << it->second.second;
+        done_.erase(it);
+        ++next_out_;
+      }
+    }
+  }
+
+  const vector<double>& w_;
+  const po::variables_map& conf_;
+  istream* in_;
+  bool is_split_input_;
+  bool is_json_input_;
+  bool is_binary_input_;
+  int lc_;
+  int num_forests_;
+  Hypergraph hg_;  // the CFG forest being read
+  map<WordID, int> lhs2node_;
+  int next_chunk_;
+  int next_out_;
+  map<int, pair<string, string> > done_;  // output of the finished chunks not written yet
+  boost::mutex in_mutex_;
+  boost::mutex out_mutex_;
+};
+
+int main(int argc, char **argv) {
+  kSTART = TD::Convert("S") * -1;
+  po::variables_map conf;
+  InitCommandLine(argc, argv, &conf);
+  string infile = conf["input"].as<string>();
+  const bool collapse_weights = conf.count("collapse_weights");
+  Weights wts;
+  vector<double> w;
+  if (conf.count("weights")) {
+    wts.InitFromFile(conf["weights"].as<string>());
+    wts.InitVector(&w);
+  }
+  if (collapse_weights && !w.size()) {
+    cerr << "--collapse_weights requires a weights file to be specified!\n";
+    exit(1);
+  }
+  if (conf.count("forest_dir") && !DirectoryExists(conf["forest_dir"].as<string>()))
+    MkDirP(conf["forest_dir"].as<string>());
+  ReadFile rf(infile);
+  istream* in = rf.stream();
+  assert(*in);
+  ForestConverter(w, conf, in).Run(max(1, conf["threads"].as<int>()));
+}
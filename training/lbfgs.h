@@ -11,6 +11,9 @@
 #include <iostream>
 #include <sstream>
 
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+
 namespace scitbx {
 
 //! Limited-memory Broyden-Fletcher-Goldfarb-Shanno (LBFGS) %minimizer.
@@ -147,6 +150,133 @@ namespace lbfgs {
       return x;
     }
 
+    // The vector kernels of the two-loop recursion and the line search,
+    // on vectors of length n split in blocks of kBlock elements.  A dot
+    // product sums each block in four interleaved partial sums (which the
+    // compiler can keep in vector registers) and then adds the block sums
+    // in order, so its result is the same for any number of threads.
+    // Vectors shorter than kMinThreaded are done on the calling thread, as
+    // starting threads would take longer.  The operands may be float or
+    // double; arithmetic is done in FloatType.
+    template <typename FloatType, typename SizeType>
+    class vector_ops {
+      public:
+        enum { kBlock = 4096, kMinThreaded = 1 << 17 };
+
+        explicit vector_ops(int threads = 1) : threads_(threads) {}
+        void set_threads(int threads) { threads_ = threads; }
+        int threads() const { return threads_; }
+
+        // x . y
+        template <typename A, typename B>
+        FloatType dot(SizeType n, const A* x, const B* y) const {
+          std::vector<FloatType> sums(num_blocks(n));
+          for_blocks(n, boost::bind(&dot_blocks<A, B>, n, x, y, &sums[0], _1, _2));
+          FloatType r(0);
+          for (SizeType b = 0; b < sums.size(); ++b) r += sums[b];
+          return r;
+        }
+
+        // y += a * x
+        template <typename A, typename B>
+        void axpy(SizeType n, FloatType a, const A* x, B* y) const {
+          for_blocks(n, boost::bind(&axpy_blocks<A, B>, n, a, x, y, _1, _2));
+        }
+
+        // z = x + a * y
+        template <typename A, typename B, typename C>
+        void add_scaled(SizeType n, const A* x, FloatType a, const B* y, C* z) const {
+          for_blocks(n, boost::bind(&add_scaled_blocks<A, B, C>, n, x, a, y, z, _1, _2));
+        }
+
+        // z = a * x
+        template <typename A, typename B>
+        void scale(SizeType n, FloatType a, const A* x, B* z) const {
+          for_blocks(n, boost::bind(&scale_blocks<A, B>, n, a, x, z, _1, _2));
+        }
+
+        // x *= d, elementwise
+        template <typename A, typename B>
+        void multiply(SizeType n, const A* d, B* x) const {
+          for_blocks(n, boost::bind(&multiply_blocks<A, B>, n, d, x, _1, _2));
+        }
+
+      private:
+        static SizeType num_blocks(SizeType n) { return (n + kBlock - 1) / kBlock; }
+
+        // the elements [*i, *end) of the blocks [b, e)
+        static void elements(SizeType n, SizeType b, SizeType e, SizeType* i, SizeType* end) {
+          *i = b * kBlock;
+          *end = std::min(n, e * SizeType(kBlock));
+        }
+
+        // runs f(b, e) on ranges of the blocks, one per thread
+        template <typename F>
+        void for_blocks(SizeType n, F f) const {
+          const SizeType blocks = num_blocks(n);
+          SizeType t = threads_ > 1 && n >= SizeType(kMinThreaded) ? threads_ : 1;
+          if (t > blocks) t = blocks;
+          if (t <= 1) {
+            f(SizeType(0), blocks);
+            return;
+          }
+          boost::thread_group workers;
+          for (SizeType i = 1; i < t; ++i)
+            workers.create_thread(boost::bind<void>(f, blocks * i / t, blocks * (i + 1) / t));
+          f(SizeType(0), blocks / t);
+          workers.join_all();
+        }
+
+        template <typename A, typename B>
+        static void dot_blocks(SizeType n, const A* x, const B* y, FloatType* sums,
+                               SizeType b, SizeType e) {
+          for (; b < e; ++b) {
+            SizeType i, end;
+            elements(n, b, b + 1, &i, &end);
+            FloatType s0(0), s1(0), s2(0), s3(0);
+            for (; i + 4 <= end; i += 4) {
+              s0 += FloatType(x[i]) * FloatType(y[i]);
+              s1 += FloatType(x[i+1]) * FloatType(y[i+1]);
+              s2 += FloatType(x[i+2]) * FloatType(y[i+2]);
+              s3 += FloatType(x[i+3]) * FloatType(y[i+3]);
+            }
+            for (; i < end; ++i) s0 += FloatType(x[i]) * FloatType(y[i]);
+            sums[b] = (s0 + s1) + (s2 + s3);
+          }
+        }
+
+        template <typename A, typename B>
+        static void axpy_blocks(SizeType n, FloatType a, const A* x, B* y, SizeType b, SizeType e) {
+          SizeType i, end;
+          elements(n, b, e, &i, &end);
+          for (; i < end; ++i) y[i] = B(y[i] + a * FloatType(x[i]));
+        }
+
+        template <typename A, typename B, typename C>
+        static void add_scaled_blocks(SizeType n, const A* x, FloatType a, const B* y, C* z,
+                                      SizeType b, SizeType e) {
+          SizeType i, end;
+          elements(n, b, e, &i, &end);
+          for (; i < end; ++i) z[i] = C(FloatType(x[i]) + a * FloatType(y[i]));
+        }
+
+        template <typename A, typename B>
+        static void scale_blocks(SizeType n, FloatType a, const A* x, B* z, SizeType b, SizeType e) {
+          SizeType i, end;
+          elements(n, b, e, &i, &end);
+          for (; i < end; ++i) z[i] = B(a * FloatType(x[i]));
+        }
+
+        template <typename A, typename B>
+        static void multiply_blocks(SizeType n, const A* d, B* x, SizeType b, SizeType e) {
+          SizeType i, end;
+          elements(n, b, e, &i, &end);
+          for (; i < end; ++i) x[i] = B(x[i] * FloatType(d[i]));
+        }
+
+        int threads_;
+    };
+
     // This class implements an algorithm for multi-dimensional line search.
     template <typename FloatType, typename SizeType = std::size_t>
     class mcsrch
@@ -287,7 +417,8 @@ namespace lbfgs {
           SizeType maxfev,
           int& info,
           SizeType& nfev,
-          FloatType* wa);
+          FloatType* wa,
+          const vector_ops<FloatType, SizeType>& ops);
 
         /* The purpose of this function is to compute a safeguarded step
            for a linesearch and to update an interval of uncertainty for
@@ -418,7 +549,8 @@ namespace lbfgs {
       SizeType maxfev,
       int& info,
       SizeType& nfev,
-      FloatType* wa)
+      FloatType* wa,
+      const vector_ops<FloatType, SizeType>& ops)
     {
       if (info != -1) {
         infoc = 1;
@@ -435,10 +567,7 @@ namespace lbfgs {
         }
         // Compute the initial gradient in the search direction
         // and check that s is a descent direction.
-        dginit = FloatType(0);
-        for (SizeType j = 0; j < n; j++) {
-          dginit += g[j] * s[is0+j];
-        }
+        dginit = ops.dot(n, g, s + is0);
         if (dginit >= FloatType(0)) {
           throw error_search_direction_not_descent();
         }
@@ -489,18 +618,13 @@ namespace lbfgs {
           // Evaluate the function and gradient at stp
           // and compute the directional derivative.
           // We return to main program to obtain F and G.
-          for (SizeType j = 0; j < n; j++) {
-            x[j] = wa[j] + stp * s[is0+j];
-          }
+          ops.add_scaled(n, wa, stp, s + is0, x);
           info=-1;
           break;
         }
         info = 0;
         nfev++;
-        FloatType dg(0);
-        for (SizeType j = 0; j < n; j++) {
-          dg += g[j] * s[is0+j];
-        }
+        FloatType dg = ops.dot(n, g, s + is0);
         FloatType ftest1 = finit + stp*dgtest;
         // Test for convergence.
         if ((brackt && (stp <= stmin || stp >= stmax)) || infoc == 0) {
@@ -987,7 +1111,7 @@ namespace lbfgs {
           iter_(0), nfun_(0), stp_(0),
           stp1(0), ftol(0.0001), ys(0), point(0), npt(0),
           ispt(n+2*m), iypt((n+2*m)+n*m),
-          info(0), bound(0), nfev(0)
+          info(0), bound(0), nfev(0), float_history_(false)
       {
         if (n_ == 0) {
           throw error_improper_input_parameter("n = 0.");
@@ -1091,6 +1215,39 @@ namespace lbfgs {
       //! Current stepsize.
       FloatType stp() const { return stp_; }
 
+      //! Number of threads for the vector operations (default 1).
+      /*! Only vectors of at least detail::vector_ops::kMinThreaded
+          elements are split between threads.  The result does not
+          depend on the number of threads.
+       */
+      void set_threads(int threads) { ops_.set_threads(threads); }
+
+      //! Keeps the <code>2m</code> correction vectors in single precision.
+      /*! This halves the memory of the minimizer for large n, at the
+          cost of rounding the corrections (all arithmetic is still done
+          in FloatType).  It must be set before the first call of run(),
+          and before deserialize() of a minimizer that had it set.
+       */
+      void set_float_history(bool float_history) {
+        if (iter_ != 0 || iflag_ != 0) {
+          throw error_improper_input_parameter(
+            "float history set after the minimization started.");
+        }
+        float_history_ = float_history;
+        if (float_history_) {
+          w_.resize(n_+2*m_);
+          hist_.assign(2*m_*n_, 0.0f);
+          dir_.resize(n_);
+        }
+        else {
+          w_.resize(n_*(2*m_+1)+2*m_);
+          std::vector<float>().swap(hist_);
+          std::vector<FloatType>().swap(dir_);
+        }
+      }
+
+      bool float_history() const { return float_history_; }
+
       //! Execution of one step of the minimization.
       /*! @param x On initial entry this must be set by the user to
              the values of the initial estimate of the solution vector.
@@ -1176,6 +1333,10 @@ namespace lbfgs {
         out->write((const char*)&nfev, sizeof(nfev));
         out->write((const char*)&w_[0], sizeof(FloatType) * w_.size());
         out->write((const char*)&scratch_array_[0], sizeof(FloatType) * scratch_array_.size());
+        if (float_history_) {
+          out->write((const char*)&hist_[0], sizeof(float) * hist_.size());
+          out->write((const char*)&dir_[0], sizeof(FloatType) * dir_.size());
+        }
       }
 
       void deserialize(std::istream* in) {
@@ -1204,6 +1365,10 @@ namespace lbfgs {
         in->read((char*)&nfev, sizeof(nfev));
         in->read((char*)&w_[0], sizeof(FloatType) * w_.size());
         in->read((char*)&scratch_array_[0], sizeof(FloatType) * scratch_array_.size());
+        if (float_history_) {
+          in->read((char*)&hist_[0], sizeof(float) * hist_.size());
+          in->read((char*)&dir_[0], sizeof(FloatType) * dir_.size());
+        }
       }
 
     protected:
@@ -1220,6 +1385,20 @@ namespace lbfgs {
         bool diagco,
         const FloatType* diag);
 
+      // the iteration with the correction vectors s_k at s + k*n and
+      // y_k at y + k*n, and the search direction at dir (or in the s
+      // vector of the current point if dir is 0)
+      template <typename H>
+      bool generic_run(
+        FloatType* x,
+        FloatType f,
+        const FloatType* g,
+        bool diagco,
+        const FloatType* diag,
+        H* s,
+        H* y,
+        FloatType* dir);
+
       detail::mcsrch<FloatType, SizeType> mcsrch_instance;
       const SizeType n_;
       const SizeType m_;
@@ -1246,6 +1425,10 @@ namespace lbfgs {
       SizeType nfev;
       std::vector<FloatType> w_;
       std::vector<FloatType> scratch_array_;
+      detail::vector_ops<FloatType, SizeType> ops_;
+      bool float_history_;
+      std::vector<float> hist_;   // s_k, then y_k, if float_history_
+      std::vector<FloatType> dir_;  // the search direction, if float_history_
   };
 
   template <typename FloatType, typename SizeType>
@@ -1255,6 +1438,27 @@ namespace lbfgs {
     const FloatType* g,
     bool diagco,
     const FloatType* diag)
+  {
+    if (float_history_) {
+      return generic_run(x, f, g, diagco, diag,
+        &hist_[0], &hist_[m_*n_], &dir_[0]);
+    }
+    FloatType* w = &(*(w_.begin()));
+    return generic_run(x, f, g, diagco, diag,
+      w + ispt, w + iypt, static_cast<FloatType*>(0));
+  }
+
+  template <typename FloatType, typename SizeType>
+  template <typename H>
+  bool minimizer<FloatType, SizeType>::generic_run(
+    FloatType* x,
+    FloatType f,
+    const FloatType* g,
+    bool diagco,
+    const FloatType* diag,
+    H* s,
+    H* y,
+    FloatType* dir)
   {
     bool execute_entire_while_loop = false;
     if (!(requests_f_and_g_ || requests_diag_)) {
@@ -1276,10 +1480,16 @@ namespace lbfgs {
         std::fill_n(scratch_array_.begin(), n_, FloatType(1));
         diag = &(*(scratch_array_.begin()));
       }
-      for (SizeType i = 0; i < n_; i++) {
-        w[ispt + i] = -g[i] * diag[i];
+      // The first direction is -g * diag.
+      if (dir) {
+        ops_.scale(n_, FloatType(-1), g, dir);
+        ops_.multiply(n_, diag, dir);
+      }
+      else {
+        ops_.scale(n_, FloatType(-1), g, s);
+        ops_.multiply(n_, diag, s);
       }
-      FloatType gnorm = std::sqrt(detail::ddot(n_, g, g));
+      FloatType gnorm = std::sqrt(ops_.dot(n_, g, g));
       if (gnorm == FloatType(0)) return false;
       stp1 = FloatType(1) / gnorm;
       execute_entire_while_loop = true;
@@ -1290,11 +1500,9 @@ namespace lbfgs {
       info = 0;
       if (iter_ != 1) {
         if (iter_ > m_) bound = m_;
-        ys = detail::ddot(
-          n_, w, iypt + npt, SizeType(1), w, ispt + npt, SizeType(1));
+        ys = ops_.dot(n_, y + npt, s + npt);
         if (!diagco) {
-          FloatType yy = detail::ddot(
-            n_, w, iypt + npt, SizeType(1), w, iypt + npt, SizeType(1));
+          FloatType yy = ops_.dot(n_, y + npt, y + npt);
           std::fill_n(scratch_array_.begin(), n_, ys / yy);
           diag = &(*(scratch_array_.begin()));
         }
@@ -1320,44 +1528,45 @@ namespace lbfgs {
         SizeType cp = point;
         if (point == 0) cp = m_;
         w[n_ + cp -1] = 1 / ys;
+        ops_.scale(n_, FloatType(-1), g, w);
         SizeType i;
-        for (i = 0; i < n_; i++) {
-          w[i] = -g[i];
-        }
         cp = point;
         for (i = 0; i < bound; i++) {
           if (cp == 0) cp = m_;
           cp--;
-          FloatType sq = detail::ddot(
-            n_, w, ispt + cp * n_, SizeType(1), w, SizeType(0), SizeType(1));
+          FloatType sq = ops_.dot(n_, s + cp * n_, w);
           SizeType inmc=n_+m_+cp;
-          SizeType iycn=iypt+cp*n_;
           w[inmc] = w[n_ + cp] * sq;
-          detail::daxpy(n_, -w[inmc], w, iycn, w);
-        }
-        for (i = 0; i < n_; i++) {
-          w[i] *= diag[i];
+          ops_.axpy(n_, -w[inmc], y + cp * n_, w);
         }
+        ops_.multiply(n_, diag, w);
         for (i = 0; i < bound; i++) {
-          FloatType yr = detail::ddot(
-            n_, w, iypt + cp * n_, SizeType(1), w, SizeType(0), SizeType(1));
+          FloatType yr = ops_.dot(n_, y + cp * n_, w);
           FloatType beta = w[n_ + cp] * yr;
           SizeType inmc=n_+m_+cp;
           beta = w[inmc] - beta;
-          SizeType iscn=ispt+cp*n_;
-          detail::daxpy(n_, beta, w, iscn, w);
+          ops_.axpy(n_, beta, s + cp * n_, w);
           cp++;
           if (cp == m_) cp = 0;
         }
-        std::copy(w, w+n_, w+(ispt + point * n_));
+        if (dir) {
+          std::copy(w, w+n_, dir);
+        }
+        else {
+          std::copy(w, w+n_, s + point * n_);
+        }
       }
       stp_ = FloatType(1);
       if (iter_ == 1) stp_ = stp1;
       std::copy(g, g+n_, w);
     }
+    // The line search is along dir, or s of the current point itself
+    // (which has the type FloatType then).
+    FloatType* search = dir ? dir : reinterpret_cast<FloatType*>(s + point * n_);
     mcsrch_instance.run(
-      gtol_, stpmin_, stpmax_, n_, x, f, g, w, ispt + point * n_,
-      stp_, ftol, xtol_, maxfev_, info, nfev, &(*(scratch_array_.begin())));
+      gtol_, stpmin_, stpmax_, n_, x, f, g, search, SizeType(0),
+      stp_, ftol, xtol_, maxfev_, info, nfev, &(*(scratch_array_.begin())),
+      ops_);
     if (info == -1) {
       iflag_ = 1;
       requests_f_and_g_ = true;
@@ -1368,10 +1577,8 @@ namespace lbfgs {
     }
     nfun_ += nfev;
     npt = point*n_;
-    for (SizeType i = 0; i < n_; i++) {
-      w[ispt + npt + i] = stp_ * w[ispt + npt + i];
-      w[iypt + npt + i] = g[i] - w[i];
-    }
+    ops_.scale(n_, stp_, search, s + npt);
+    ops_.add_scaled(n_, g, FloatType(-1), w, y + npt);
     point++;
     if (point == m_) point = 0;
     return false;
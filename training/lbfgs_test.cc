@@ -1,6 +1,7 @@
 #include <cassert>
 #include <iostream>
 #include <sstream>
+#include <vector>
 #include "lbfgs.h"
 #include "sparse_vector.h"
 #include "fdict.h"
@@ -72,6 +73,33 @@ double TestPersistentOptimizer() {
   return obj;
 }
 
+// minimizes sum_i a_i (x_i - c_i)^2 over enough variables for the
+// minimizer to split its vector operations between threads
+double TestLargeOptimizer(int threads, bool float_history, vector<double>* px) {
+  cerr << "\nTESTING LARGE OPTIMIZER, threads=" << threads << " float_history=" << float_history << endl;
+  const int n = 300000;
+  vector<double>& x = *px;
+  x.assign(n, 0.0);
+  vector<double> g(n);
+  scitbx::lbfgs::minimizer<double> opt(n);
+  opt.set_threads(threads);
+  opt.set_float_history(float_history);
+  scitbx::lbfgs::traditional_convergence_test<double> converged(n);
+  double obj = 0;
+  do {
+    obj = 0;
+    for (int i = 0; i < n; ++i) {
+      const double a = 1 + i % 7;
+      const double d = x[i] - (i % 5 - 2);
+      obj += a * d * d;
+      g[i] = 2 * a * d;
+    }
+    opt.run(&x[0], obj, &g[0]);
+  } while (!converged(&x[0], &g[0]));
+  cerr << opt << "\tobj=" << obj << endl;
+  return obj;
+}
+
 void TestSparseVector() {
   cerr << "Testing SparseVector<double> serialization.\n";
   int f1 = FD::Convert("Feature_1");
@@ -96,6 +124,19 @@ void TestSparseVector() {
   cerr << obj << "\t" << v << endl;
   assert(obj == iobj);
   assert(g.size() == v.size());
+
+  ostringstream bs;
+  BinaryVector::Encode(iobj, g, &bs);
+  BinaryVector::Encode(-iobj, v, &bs);
+  istringstream is(bs.str());
+  SparseVector<double> v1, v2, v3;
+  double obj1, obj2, obj3;
+  assert(BinaryVector::Decode(&obj1, &v1, &is));
+  assert(BinaryVector::Decode(&obj2, &v2, &is));
+  assert(!BinaryVector::Decode(&obj3, &v3, &is));  // end of input
+  assert(obj1 == iobj && obj2 == -iobj);
+  assert(v1 == g);
+  assert(v2 == v);
 }
 
 int main() {
@@ -105,6 +146,18 @@ int main() {
     cerr << "OPTIMIZERS PERFORMED DIFFERENTLY!\n" << o1 << " vs. " << o2 << endl;
     return 1;
   }
+  vector<double> x1, x4, xf;
+  const double l1 = TestLargeOptimizer(1, false, &x1);
+  const double l4 = TestLargeOptimizer(4, false, &x4);
+  if (l1 != l4 || x1 != x4) {
+    cerr << "THREADED OPTIMIZER PERFORMED DIFFERENTLY!\n" << l1 << " vs. " << l4 << endl;
+    return 1;
+  }
+  const double lf = TestLargeOptimizer(4, true, &xf);
+  if (lf > 1e-3) {
+    cerr << "FLOAT HISTORY OPTIMIZER DID NOT CONVERGE!\n" << lf << endl;
+    return 1;
+  }
   TestSparseVector();
   cerr << "SUCCESS\n";
   return 0;
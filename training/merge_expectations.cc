@@ -0,0 +1,84 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <tr1/memory>
+
+#include <boost/program_options.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+#include "filelib.h"
+#include "sorted_feature_stream.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
+  po::options_description opts("Configuration options");
+  opts.add_options()
+        ("input,i",po::value<vector<string> >(),"Sorted feature streams to sum (written by feature_expectations -f sorted, or by this program); default: - for STDIN")
+        ("output,o",po::value<string>()->default_value("-"),"Write the sum to")
+        ("output_format,f",po::value<string>()->default_value("sorted"),"Format of the sum: sorted (a sorted feature stream, to merge in a later stage) or text (\"feature value\" lines)");
+  po::positional_options_description p;
+  p.add("input", -1);
+  po::options_description clo("Command line options");
+  clo.add_options()
+        ("config", po::value<string>(), "Configuration file")
+        ("help,h", "Print this help message and exit");
+  po::options_description dconfig_options, dcmdline_options;
+  dconfig_options.add(opts);
+  dcmdline_options.add(opts).add(clo);
+
+  po::store(po::command_line_parser(argc, argv).options(dcmdline_options).positional(p).run(), *conf);
+  if (conf->count("config")) {
+    ifstream config((*conf)["config"].as<string>().c_str());
+    po::store(po::parse_config_file(config, dconfig_options), *conf);
+  }
+  po::notify(*conf);
+
+  const string f = (*conf)["output_format"].as<string>();
+  if (conf->count("help") || (f != "sorted" && f != "text")) {
+    cerr << "Sums sorted feature streams in one pass, holding one record of each\n"
+            "in memory.  Hadoop reducers can merge the outputs of mappers, and\n"
+            "the reducers of a later stage the outputs of these.\n\n";
+    cerr << dcmdline_options << endl;
+    exit(1);
+  }
+}
+
+struct TextFeatureWriter : public SortedFeatureSink {
+  explicit TextFeatureWriter(ostream* out) : out_(out) { out_->precision(17); }
+  void Write(const string& name, double value) {
+    (*out_) << name << ' ' << value << '\n';
+  }
+  ostream* out_;
+};
+
+int main(int argc, char** argv) {
+  po::variables_map conf;
+  InitCommandLine(argc, argv, &conf);
+  vector<string> files(1, "-");
+  if (conf.count("input")) files = conf["input"].as<vector<string> >();
+
+  vector<tr1::shared_ptr<ReadFile> > rfs;
+  vector<tr1::shared_ptr<SortedFeatureReader> > readers;
+  vector<SortedFeatureReader*> in;
+  for (int i = 0; i < files.size(); ++i) {
+    rfs.push_back(tr1::shared_ptr<ReadFile>(new ReadFile(files[i])));
+    readers.push_back(tr1::shared_ptr<SortedFeatureReader>(new SortedFeatureReader(rfs.back()->stream(), files[i])));
+    in.push_back(readers.back().get());
+  }
+  WriteFile wf(conf["output"].as<string>());
+  if (conf["output_format"].as<string>() == "text") {
+    TextFeatureWriter out(wf.stream());
+    MergeSortedFeatures(in, &out);
+  } else {
+    SortedFeatureWriter out(wf.stream());
+    MergeSortedFeatures(in, &out);
+  }
+  if (!*wf.stream()) {
+    cerr << "Error writing " << conf["output"].as<string>() << endl;
+    return 1;
+  }
+  cerr << "Merged " << files.size() << " streams\n";
+  return 0;
+}
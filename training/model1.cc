@@ -1,13 +1,16 @@
 #include <iostream>
 #include <cmath>
 
+#include <boost/bind.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
 
-#include "lattice.h"
 #include "stringlib.h"
 #include "filelib.h"
 #include "ttables.h"
+#include "parallel_corpus.h"
 #include "tdict.h"
 #include "em_utils.h"
 
@@ -22,6 +25,8 @@ bool InitCommandLine(int argc, char** argv, po::variables_map* conf) {
         ("no_null_word,N","Do not generate from the null token")
         ("variational_bayes,v","Add a symmetric Dirichlet prior and infer VB estimate of weights")
         ("alpha,a", po::value<double>()->default_value(0.01), "Hyperparameter for optional Dirichlet prior")
+        ("threads,j", po::value<int>()->default_value(1), "Number of threads for the E-step")
+        ("corpus_cache,c", po::value<string>(), "Write the corpus to this binary cache, which can be given instead of corpus.fr-en next time")
         ("no_add_viterbi,V","Do not add Viterbi alignment points (may generate a grammar where some training sentence pairs are unreachable)");
   po::options_description clo("Command line options");
   clo.add_options()
@@ -46,6 +51,134 @@ bool InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   return true;
 }
 
+// one pass of EM over the corpus on any number of threads: each adds up
+// the expected counts (or on the final iteration, the Viterbi links) of a
+// slice of the sentences on its own, and they are added to the table's in
+// order when all are done, so the result does not depend on timing
+class EStep {
+ public:
+  EStep(const ParallelCorpus& corpus, const TTable& tt, bool final_iteration, bool use_null, bool add_viterbi) :
+      corpus_(corpus), tt_(tt), final_iteration_(final_iteration), use_null_(use_null),
+      add_viterbi_(add_viterbi), kNULL_(TD::Convert("<eps>")), lc_(0), flag_(false) {}
+
+  void Run(int threads, TTable* tt, TTable::Word2Word2Double* was_viterbi,
+           double* likelihood, double* denom) {
+    vector<Totals> totals(threads);
+    if (threads > 1) {
+      boost::thread_group workers;
+      for (int i = 0; i < threads; ++i)
+        workers.create_thread(boost::bind(&EStep::RunThread, this,
+          corpus_.size() * i / threads, corpus_.size() * (i + 1) / threads, &totals[i]));
+      workers.join_all();
+    } else {
+      RunThread(0, corpus_.size(), &totals[0]);
+    }
+    if (flag_) { cerr << endl; }
+    *likelihood = 0;
+    *denom = 0;
+    for (int i = 0; i < threads; ++i) {
+      *likelihood += totals[i].likelihood;
+      *denom += totals[i].denom;
+      if (final_iteration_) {
+        for (TTable::Word2Word2Double::iterator it = totals[i].viterbi.begin(); it != totals[i].viterbi.end(); ++it) {
+          TTable::Word2Double& tgt = (*was_viterbi)[it->first];
+          for (TTable::Word2Double::iterator j = it->second.begin(); j != it->second.end(); ++j)
+            tgt[j->first] = 1.0;
+        }
+      } else {
+        tt->AddCounts(&totals[i].counts);
+      }
+    }
+  }
+
+ private:
+  struct Totals {
+    Totals() : likelihood(), denom() {}
+    TTable::Counts counts;
+    TTable::Word2Word2Double viterbi;
+    double likelihood;
+    double denom;
+  };
+
+  // prints the progress dots for another 1000 sentences
+  void Progress() {
+    boost::mutex::scoped_lock l(progress_mutex_);
+    lc_ += 1000;
+    cerr << '.'; flag_ = true;
+    if (lc_ %50000 == 0) { cerr << " [" << lc_ << "]\n" << flush; flag_ = false; }
+  }
+
+  void RunThread(unsigned begin, unsigned end, Totals* totals) {
+    if (!final_iteration_) tt_.InitCounts(&totals->counts);
+    vector<double> probs;
+    vector<int> index;
+    for (unsigned s = begin; s < end; ++s) {
+      AddSentence(s, &probs, &index, totals);
+      if ((s - begin + 1) % 1000 == 0) Progress();
+    }
+  }
+
+  void AddSentence(unsigned s, vector<double>* pprobs, vector<int>* pindex, Totals* totals) const {
+    const WordID* src = corpus_.src(s);
+    const unsigned src_size = corpus_.src_size(s);
+    const WordID* trg = corpus_.trg(s);
+    const unsigned trg_size = corpus_.trg_size(s);
+    totals->denom += trg_size;
+    vector<double>& probs = *pprobs;
+    vector<int>& index = *pindex;
+    probs.resize(src_size + 1);
+    index.resize(src_size + 1);
+    const double src_logprob = -log(src_size + 1);
+    for (int j = 0; j < trg_size; ++j) {
+      const WordID& f_j = trg[j];
+      double sum = 0;
+      if (use_null_) {
+        index[0] = tt_.index(kNULL_, f_j);
+        probs[0] = tt_.prob(index[0]);
+        sum += probs[0];
+      }
+      for (int i = 1; i <= src_size; ++i) {
+        index[i] = tt_.index(src[i-1], f_j);
+        probs[i] = tt_.prob(index[i]);
+        sum += probs[i];
+      }
+      if (final_iteration_) {
+        if (add_viterbi_) {
+          WordID max_i = 0;
+          double max_p = -1;
+          if (use_null_) {
+            max_i = kNULL_;
+            max_p = probs[0];
+          }
+          for (int i = 1; i <= src_size; ++i) {
+            if (probs[i] > max_p) {
+              max_p = probs[i];
+              max_i = src[i-1];
+            }
+          }
+          totals->viterbi[max_i][f_j] = 1.0;
+        }
+      } else {
+        if (use_null_)
+          tt_.Increment(index[0], kNULL_, f_j, probs[0] / sum, &totals->counts);
+        for (int i = 1; i <= src_size; ++i)
+          tt_.Increment(index[i], src[i-1], f_j, probs[i] / sum, &totals->counts);
+      }
+      totals->likelihood += log(sum) + src_logprob;
+    }
+  }
+
+  const ParallelCorpus& corpus_;
+  const TTable& tt_;
+  const bool final_iteration_;
+  const bool use_null_;
+  const bool add_viterbi_;
+  const WordID kNULL_;
+  int lc_;
+  bool flag_;
+  boost::mutex progress_mutex_;
+};
+
 int main(int argc, char** argv) {
   po::variables_map conf;
   if (!InitCommandLine(argc, argv, &conf)) return 1;
@@ -53,87 +186,32 @@ int main(int argc, char** argv) {
   const int ITERATIONS = conf["iterations"].as<unsigned>();
   const double BEAM_THRESHOLD = pow(10.0, conf["beam_threshold"].as<double>());
   const bool use_null = (conf.count("no_null_word") == 0);
-  const WordID kNULL = TD::Convert("<eps>");
   const bool add_viterbi = (conf.count("no_add_viterbi") == 0);
   const bool variational_bayes = (conf.count("variational_bayes") > 0);
   const double alpha = conf["alpha"].as<double>();
+  const int threads = conf["threads"].as<int>();
   if (variational_bayes && alpha <= 0.0) {
     cerr << "--alpha must be > 0\n";
     return 1;
   }
 
+  TD::Convert("<eps>");  // the NULL word, which caches can then start with
+  ParallelCorpus corpus;
+  corpus.Read(fname);
+  if (conf.count("corpus_cache")) corpus.WriteCache(conf["corpus_cache"].as<string>());
+
   TTable tt;
   TTable::Word2Word2Double was_viterbi;
   for (int iter = 0; iter < ITERATIONS; ++iter) {
     const bool final_iteration = (iter == (ITERATIONS - 1));
     cerr << "ITERATION " << (iter + 1) << (final_iteration ? " (FINAL)" : "") << endl;
-    ReadFile rf(fname);
-    istream& in = *rf.stream();
-    double likelihood = 0;
-    double denom = 0.0;
-    int lc = 0;
-    bool flag = false;
-    string line;
-    while(true) {
-      getline(in, line);
-      if (!in) break;
-      ++lc;
-      if (lc % 1000 == 0) { cerr << '.'; flag = true; }
-      if (lc %50000 == 0) { cerr << " [" << lc << "]\n" << flush; flag = false; }
-      string ssrc, strg;
-      ParseTranslatorInput(line, &ssrc, &strg);
-      Lattice src, trg;
-      LatticeTools::ConvertTextToLattice(ssrc, &src);
-      LatticeTools::ConvertTextToLattice(strg, &trg);
-      if (src.size() == 0 || trg.size() == 0) {
-        cerr << "Error: " << lc << "\n" << line << endl;
-        assert(src.size() > 0);
-        assert(trg.size() > 0);
-      }
-      denom += trg.size();
-      vector<double> probs(src.size() + 1);
-      const double src_logprob = -log(src.size() + 1);
-      for (int j = 0; j < trg.size(); ++j) {
-        const WordID& f_j = trg[j][0].label;
-        double sum = 0;
-        if (use_null) {
-          probs[0] = tt.prob(kNULL, f_j);
-          sum += probs[0];
-        }
-        for (int i = 1; i <= src.size(); ++i) {
-          probs[i] = tt.prob(src[i-1][0].label, f_j);
-          sum += probs[i];
-        }
-        if (final_iteration) {
-          if (add_viterbi) {
-            WordID max_i = 0;
-            double max_p = -1;
-            if (use_null) {
-              max_i = kNULL;
-              max_p = probs[0];
-            }
-            for (int i = 1; i <= src.size(); ++i) {
-              if (probs[i] > max_p) {
-                max_p = probs[i];
-                max_i = src[i-1][0].label;
-              }
-            }
-            was_viterbi[max_i][f_j] = 1.0;
-          }
-        } else {
-          if (use_null)
-            tt.Increment(kNULL, f_j, probs[0] / sum);
-          for (int i = 1; i <= src.size(); ++i)
-            tt.Increment(src[i-1][0].label, f_j, probs[i] / sum);
-        }
-        likelihood += log(sum) + src_logprob;
-      }
-    }
+    double likelihood;
+    double denom;
+    EStep(corpus, tt, final_iteration, use_null, add_viterbi).Run(threads, &tt, &was_viterbi, &likelihood, &denom);
 
     // log(e) = 1.0
     double base2_likelihood = likelihood / log(2);
 
-    if (flag) { cerr << endl; }
     cerr << "  log_e likelihood: " << likelihood << endl;
     cerr << "  log_2 likelihood: " << base2_likelihood << endl;
     cerr << "   cross entropy: " << (-base2_likelihood / denom) << endl;
@@ -145,19 +223,19 @@ int main(int argc, char** argv) {
         tt.Normalize();
     }
   }
-  for (TTable::Word2Word2Double::iterator ei = tt.ttable.begin(); ei != tt.ttable.end(); ++ei) {
-    const TTable::Word2Double& cpd = ei->second;
-    const TTable::Word2Double& vit = was_viterbi[ei->first];
-    const string& esym = TD::Convert(ei->first);
+  for (WordID e = 0; e < tt.rows(); ++e) {
+    if (tt.row_begin(e) == tt.row_end(e)) continue;
+    const TTable::Word2Double& vit = was_viterbi[e];
+    const string& esym = TD::Convert(e);
     double max_p = -1;
-    for (TTable::Word2Double::const_iterator fi = cpd.begin(); fi != cpd.end(); ++fi)
-      if (fi->second > max_p) max_p = fi->second;
+    for (int i = tt.row_begin(e); i < tt.row_end(e); ++i)
+      if (tt.prob(i) > max_p) max_p = tt.prob(i);
     const double threshold = max_p * BEAM_THRESHOLD;
-    for (TTable::Word2Double::const_iterator fi = cpd.begin(); fi != cpd.end(); ++fi) {
-      if (fi->second > threshold || (vit.count(fi->first) > 0)) {
-        cout << esym << ' ' << TD::Convert(fi->first) << ' ' << log(fi->second) << endl;
+    for (int i = tt.row_begin(e); i < tt.row_end(e); ++i) {
+      if (tt.prob(i) > threshold || (vit.count(tt.f(i)) > 0)) {
+        cout << esym << ' ' << TD::Convert(tt.f(i)) << ' ' << log(tt.prob(i)) << endl;
       }
-    } 
+    }
   }
   return 0;
 }
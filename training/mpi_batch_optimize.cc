@@ -1,8 +1,10 @@
 #include <sstream>
 #include <iostream>
+#include <fstream>
 #include <vector>
 #include <cassert>
 #include <cmath>
+#include <algorithm>
 
 #include "config.h"
 #ifdef HAVE_MPI
@@ -11,12 +13,15 @@
 namespace mpi = boost::mpi;
 #endif
 
+#include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
+#include <boost/thread/thread.hpp>
 
 #include "verbose.h"
 #include "hg.h"
+#include "hg_io.h"
 #include "prob.h"
 #include "inside_outside.h"
 #include "ff_register.h"
@@ -26,6 +31,8 @@ namespace mpi = boost::mpi;
 #include "fdict.h"
 #include "weights.h"
 #include "sparse_vector.h"
+#include "sentence_metadata.h"
+#include "null_deleter.h"
 
 using namespace std;
 using boost::shared_ptr;
@@ -68,8 +75,14 @@ bool InitCommandLine(int argc, char** argv, po::variables_map* conf) {
         ("decoder_config,d",po::value<string>(),"Decoder configuration file")
         ("sharded_input,s",po::value<string>(), "Corpus and grammar files are 'sharded' so each processor loads its own input and grammar file. Argument is the directory containing the shards.")
         ("output_weights,o",po::value<string>()->default_value("-"),"Output feature weights file")
+        ("write_snapshots","Also write each iteration's weights as a binary snapshot (weights.cur.snapshot, weights.final.snapshot), which loads faster than a weights file")
         ("optimization_method,m", po::value<string>()->default_value("lbfgs"), "Optimization method (sgd, lbfgs, rprop)")
 	("correction_buffers,M", po::value<int>()->default_value(10), "Number of gradients for LBFGS to maintain in memory")
+        ("float_history", "Keep the LBFGS corrections in single precision, which halves the memory of the optimizer")
+        ("compress_gradient,C", "Send the gradient between processes as single precision floats")
+        ("threads,j", po::value<int>()->default_value(1), "Number of decoding threads in each process (they share its grammars and language models), also used for the LBFGS step")
+        ("cache_forests,c", "Keep the translation and reference forests of the first iteration in memory, and only reweight them in later ones. Only use this if the forests do not depend on the weights: no stateful features (such as language models), pruning or rescoring passes")
+        ("forest_cache_dir", po::value<string>(), "Like --cache_forests, but keep the forests in files in this (local) directory")
         ("gaussian_prior,p","Use a Gaussian prior on the weights")
         ("means,u", po::value<string>(), "File containing the means for Gaussian prior")
         ("sigma_squared", po::value<double>()->default_value(1.0), "Sigma squared term for spherical Gaussian prior");
@@ -127,6 +140,27 @@ struct TrainingObserver : public DecoderObserver {
       (*g)[it->first] = it->second;
   }
 
+  // adds the gradient and objective of another thread's observer
+  void Add(const TrainingObserver& o) {
+    acc_grad += o.acc_grad;
+    acc_obj += o.acc_obj;
+    total_complete += o.total_complete;
+  }
+
+  // the nonzero entries of the local gradient, sorted by feature id
+  void GetLocalGradient(vector<int>* fids, vector<double>* vals) const {
+    vector<pair<int, double> > g;
+    for (SparseVector<prob_t>::const_iterator it = acc_grad.begin(); it != acc_grad.end(); ++it)
+      g.push_back(pair<int, double>(it->first, it->second));
+    sort(g.begin(), g.end());
+    fids->resize(g.size());
+    vals->resize(g.size());
+    for (int i = 0; i < g.size(); ++i) {
+      (*fids)[i] = g[i].first;
+      (*vals)[i] = g[i].second;
+    }
+  }
+
   virtual void NotifyDecodingStart(const SentenceMetadata& smeta) {
     cur_model_exp.clear();
     cur_obj = 0;
@@ -210,6 +244,124 @@ void StoreConfig(const vector<string>& cfg, istringstream* o) {
   o->str(os.str());
 }
 
+// the translation and reference forests of the sentences of the first
+// iteration, in memory or in files in a directory, so that later
+// iterations only need to reweight them
+class ForestCache {
+ public:
+  ForestCache(int size, const string& dir, int rank) :
+      dir_(dir), rank_(rank), filled_(false), stored_(size, false), trans_(dir.empty() ? size : 0), ref_(dir.empty() ? size : 0) {
+    if (dir_.size() && !DirectoryExists(dir_)) MkDirP(dir_);
+  }
+  // whether the first iteration is done
+  bool filled() const { return filled_; }
+  void SetFilled() { filled_ = true; }
+  // whether sentence i had a reference forest
+  bool Has(int i) const { return stored_[i]; }
+  void Store(int i, const Hypergraph& trans, const Hypergraph& ref) {
+    if (dir_.empty()) {
+      trans_[i] = trans;
+      ref_[i] = ref;
+    } else {
+      Write(FileName(i, "trans"), trans);
+      Write(FileName(i, "ref"), ref);
+    }
+    stored_[i] = true;
+  }
+  // the forests of sentence i, which the caller may reweight and must not
+  // keep after the next call
+  void Get(int i, Hypergraph** trans, Hypergraph** ref, Hypergraph* trans_buf, Hypergraph* ref_buf) {
+    if (dir_.empty()) {
+      *trans = &trans_[i];
+      *ref = &ref_[i];
+    } else {
+      Read(FileName(i, "trans"), trans_buf);
+      Read(FileName(i, "ref"), ref_buf);
+      *trans = trans_buf;
+      *ref = ref_buf;
+    }
+  }
+
+ private:
+  string FileName(int i, const char* what) const {
+    ostringstream os;
+    os << dir_ << '/' << what << '.' << rank_ << '.' << i << ".bin";
+    return os.str();
+  }
+  static void Write(const string& fname, const Hypergraph& hg) {
+    ofstream out(fname.c_str(), ios::binary);
+    if (!HypergraphIO::WriteToBinary(hg, true, &out) || !out) {
+      cerr << "Can't write forest to " << fname << endl;
+      abort();
+    }
+  }
+  static void Read(const string& fname, Hypergraph* hg) {
+    if (!HypergraphIO::ReadFromFile(fname, hg)) {
+      cerr << "Can't read cached forest " << fname << endl;
+      abort();
+    }
+  }
+
+  const string dir_;
+  const int rank_;
+  bool filled_;
+  vector<bool> stored_;
+  vector<Hypergraph> trans_;
+  vector<Hypergraph> ref_;
+};
+
+// passes everything on to obs, and keeps the forests of sentence i in cache
+struct CachingObserver : public DecoderObserver {
+  CachingObserver(int i, ForestCache* cache, DecoderObserver* obs) : i_(i), cache_(cache), obs_(obs) {}
+  virtual void NotifyDecodingStart(const SentenceMetadata& smeta) { obs_->NotifyDecodingStart(smeta); }
+  virtual void NotifySourceParseFailure(const SentenceMetadata& smeta) { obs_->NotifySourceParseFailure(smeta); }
+  virtual void NotifyTranslationForest(const SentenceMetadata& smeta, Hypergraph* hg) {
+    trans_ = *hg;
+    obs_->NotifyTranslationForest(smeta, hg);
+  }
+  virtual void NotifyAlignmentFailure(const SentenceMetadata& smeta) { obs_->NotifyAlignmentFailure(smeta); }
+  virtual void NotifyAlignmentForest(const SentenceMetadata& smeta, Hypergraph* hg) {
+    cache_->Store(i_, trans_, *hg);
+    obs_->NotifyAlignmentForest(smeta, hg);
+  }
+  virtual void NotifyDecodingComplete(const SentenceMetadata& smeta) { obs_->NotifyDecodingComplete(smeta); }
+  const int i_;
+  ForestCache* cache_;
+  DecoderObserver* obs_;
+  Hypergraph trans_;
+};
+
+// adds up the gradient of sentences [begin, end) of the corpus in observer:
+// decodes them, or once the cache is filled, reweights their cached forests
+static void ComputeGradient(Decoder* decoder, const vector<string>* corpus, int begin, int end,
+                            const vector<double>* lambdas, ForestCache* cache, TrainingObserver* observer) {
+  if (!cache) {
+    for (int i = begin; i < end; ++i)
+      decoder->Decode((*corpus)[i], observer);
+  } else if (!cache->filled()) {
+    for (int i = begin; i < end; ++i) {
+      CachingObserver o(i, cache, observer);
+      decoder->Decode((*corpus)[i], &o);
+    }
+  } else {
+    const Lattice ref;
+    Hypergraph trans_buf, ref_buf;
+    for (int i = begin; i < end; ++i) {
+      if (!cache->Has(i)) continue;
+      Hypergraph* trans;
+      Hypergraph* ref_forest;
+      cache->Get(i, &trans, &ref_forest, &trans_buf, &ref_buf);
+      const SentenceMetadata smeta(i, ref);
+      observer->NotifyDecodingStart(smeta);
+      trans->Reweight(*lambdas);
+      observer->NotifyTranslationForest(smeta, trans);
+      ref_forest->Reweight(*lambdas);
+      observer->NotifyAlignmentForest(smeta, ref_forest);
+      observer->NotifyDecodingComplete(smeta);
+    }
+  }
+}
+
 template <typename T>
 struct VectorPlus : public binary_function<vector<T>, vector<T>, vector<T> >  {
   vector<T> operator()(const vector<int>& a, const vector<int>& b) const {
@@ -220,6 +372,104 @@ struct VectorPlus : public binary_function<vector<T>, vector<T>, vector<T> >  {
   } 
 }; 
 
+#ifdef HAVE_MPI
+static const int kTAG_SIZE = 1;
+static const int kTAG_OBJECTIVE = 2;
+static const int kTAG_FIDS = 3;
+static const int kTAG_VALS = 4;
+
+// (af, av) += (bf, bv), both sorted by feature id
+static void MergeSparse(const vector<int>& bf, const vector<double>& bv, vector<int>* af, vector<double>* av) {
+  vector<int> f;
+  vector<double> v;
+  f.reserve(af->size() + bf.size());
+  v.reserve(af->size() + bf.size());
+  size_t i = 0, j = 0;
+  while (i < af->size() || j < bf.size()) {
+    if (j == bf.size() || (i < af->size() && (*af)[i] < bf[j])) {
+      f.push_back((*af)[i]);
+      v.push_back((*av)[i++]);
+    } else if (i == af->size() || bf[j] < (*af)[i]) {
+      f.push_back(bf[j]);
+      v.push_back(bv[j++]);
+    } else {
+      f.push_back(bf[j]);
+      v.push_back((*av)[i++] + bv[j++]);
+    }
+  }
+  af->swap(f);
+  av->swap(v);
+}
+
+// adds up the sparse gradients (sorted by feature id) and objectives of all
+// ranks at rank 0 over a binomial tree: in the round with step 2^r, ranks
+// that are odd multiples of 2^r send what they have added up to the rank
+// 2^r below them, which merges it into its own.  So each message carries
+// only the features with a nonzero gradient in the ranks it adds up rather
+// than all of them, and with compress the values go as floats (they are
+// still added up as doubles).
+static void ReduceSparseGradient(const mpi::communicator& world, bool compress,
+                                 vector<int>* fids, vector<double>* vals, double* objective) {
+  const int rank = world.rank();
+  for (int step = 1; step < world.size(); step <<= 1) {
+    if (rank & step) {
+      const int dest = rank - step;
+      const int n = fids->size();
+      world.send(dest, kTAG_SIZE, n);
+      world.send(dest, kTAG_OBJECTIVE, *objective);
+      if (n) {
+        world.send(dest, kTAG_FIDS, &(*fids)[0], n);
+        if (compress) {
+          const vector<float> f(vals->begin(), vals->end());
+          world.send(dest, kTAG_VALS, &f[0], n);
+        } else {
+          world.send(dest, kTAG_VALS, &(*vals)[0], n);
+        }
+      }
+      return;
+    }
+    const int src = rank + step;
+    if (src < world.size()) {
+      int n;
+      double o;
+      world.recv(src, kTAG_SIZE, n);
+      world.recv(src, kTAG_OBJECTIVE, o);
+      *objective += o;
+      vector<int> f(n);
+      vector<double> v(n);
+      if (n) {
+        world.recv(src, kTAG_FIDS, &f[0], n);
+        if (compress) {
+          vector<float> c(n);
+          world.recv(src, kTAG_VALS, &c[0], n);
+          copy(c.begin(), c.end(), v.begin());
+        } else {
+          world.recv(src, kTAG_VALS, &v[0], n);
+        }
+      }
+      MergeSparse(f, v, fids, vals);
+    }
+  }
+}
+
+// sets lambdas[fids[i]] = vals[i] on every rank to what they are on rank 0,
+// where they are the weights the optimizer changed, so the other weights
+// are not sent again
+static void BroadcastChangedWeights(const mpi::communicator& world, vector<int>* fids, vector<double>* vals,
+                                    vector<double>* lambdas) {
+  int n = fids->size();
+  mpi::broadcast(world, n, 0);
+  fids->resize(n);
+  vals->resize(n);
+  if (n) {
+    mpi::broadcast(world, &(*fids)[0], n, 0);
+    mpi::broadcast(world, &(*vals)[0], n, 0);
+  }
+  for (int i = 0; i < n; ++i)
+    (*lambdas)[(*fids)[i]] = (*vals)[i];
+}
+#endif
+
 int main(int argc, char** argv) {
 #ifdef HAVE_MPI
   mpi::environment env(argc, argv);
@@ -235,6 +485,14 @@ int main(int argc, char** argv) {
 
   po::variables_map conf;
   if (!InitCommandLine(argc, argv, &conf)) return 1;
+#ifdef HAVE_MPI
+  const bool compress_gradient = conf.count("compress_gradient");
+#else
+  if (conf.count("compress_gradient")) {
+    cerr << "--compress_gradient needs a build with MPI\n";
+    return 1;
+  }
+#endif
 
   string shard_dir;
   if (conf.count("sharded_input")) {
@@ -280,6 +538,17 @@ int main(int argc, char** argv) {
     cerr << "cdec.ini must not set an input file\n";
     return 1;
   }
+  const int threads = conf["threads"].as<int>();
+  if (threads < 1) {
+    cerr << "Bad number of threads: " << threads << endl;
+    return 1;
+  }
+  vector<boost::shared_ptr<Decoder> > decoders(1, boost::shared_ptr<Decoder>(decoder, null_deleter()));
+  for (int i = 1; i < threads; ++i) {
+    istringstream ini_i;
+    StoreConfig(cdec_ini, &ini_i);
+    decoders.push_back(boost::shared_ptr<Decoder>(new Decoder(&ini_i)));
+  }
   if (rank == 0) cerr << "Done loading grammar!\n";
 
   const int num_feats = FD::NumFeats();
@@ -305,7 +574,8 @@ int main(int argc, char** argv) {
     if (omethod == "rprop")
       o.reset(new RPropOptimizer(num_feats));  // TODO add configuration
     else
-      o.reset(new LBFGSOptimizer(num_feats, conf["correction_buffers"].as<int>()));
+      o.reset(new LBFGSOptimizer(num_feats, conf["correction_buffers"].as<int>(), threads,
+                                 conf.count("float_history")));
     cerr << "Optimizer: " << o->Name() << endl;
   }
   double objective = 0;
@@ -317,7 +587,6 @@ int main(int argc, char** argv) {
     lambdas.resize(num_feats, 0.0);
   }
   vector<double> gradient(num_feats, 0.0);
-  vector<double> rcv_grad(num_feats, 0.0);
   bool converged = false;
 
   vector<string> corpus;
@@ -331,9 +600,14 @@ int main(int argc, char** argv) {
   }
   assert(corpus.size() > 0);
 
-  TrainingObserver observer;
+  boost::shared_ptr<ForestCache> cache;
+  if (conf.count("cache_forests") || conf.count("forest_cache_dir"))
+    cache.reset(new ForestCache(corpus.size(), conf.count("forest_cache_dir") ? conf["forest_cache_dir"].as<string>() : "", rank));
+  vector<TrainingObserver> observers(threads);
+  TrainingObserver& observer = observers[0];
   while (!converged) {
-    observer.Reset();
+    for (int i = 0; i < threads; ++i)
+      observers[i].Reset();
 #ifdef HAVE_MPI
     mpi::timer timer;
     world.barrier();
@@ -341,20 +615,35 @@ int main(int argc, char** argv) {
     if (rank == 0) {
       cerr << "Starting decoding... (~" << corpus.size() << " sentences / proc)\n";
     }
-    decoder->SetWeights(lambdas);
-    for (int i = 0; i < corpus.size(); ++i)
-      decoder->Decode(corpus[i], &observer);
+    if (!cache || !cache->filled())
+      for (int i = 0; i < threads; ++i)
+        decoders[i]->SetWeights(lambdas);
+    if (threads > 1) {
+      boost::thread_group workers;
+      for (int i = 0; i < threads; ++i)
+        workers.create_thread(boost::bind(&ComputeGradient, decoders[i].get(), &corpus,
+          corpus.size() * i / threads, corpus.size() * (i + 1) / threads, &lambdas, cache.get(), &observers[i]));
+      workers.join_all();
+      for (int i = 1; i < threads; ++i)
+        observer.Add(observers[i]);
+    } else {
+      ComputeGradient(decoder, &corpus, 0, corpus.size(), &lambdas, cache.get(), &observer);
+    }
+    if (cache) cache->SetFilled();
     cerr << "  process " << rank << '/' << size << " done\n";
     fill(gradient.begin(), gradient.end(), 0);
-    fill(rcv_grad.begin(), rcv_grad.end(), 0);
-    observer.SetLocalGradientAndObjective(&gradient, &objective);
-
-    double to = 0;
 #ifdef HAVE_MPI
-    mpi::reduce(world, &gradient[0], gradient.size(), &rcv_grad[0], plus<double>(), 0);
-    mpi::reduce(world, objective, to, plus<double>(), 0);
-    swap(gradient, rcv_grad);
-    objective = to;
+    vector<int> gfids;
+    vector<double> gvals;
+    observer.GetLocalGradient(&gfids, &gvals);
+    objective = observer.acc_obj;
+    ReduceSparseGradient(world, compress_gradient, &gfids, &gvals, &objective);
+    if (rank == 0)
+      for (int i = 0; i < gfids.size(); ++i) gradient[gfids[i]] = gvals[i];
+    vector<int> changed;
+    vector<double> changed_vals;
+#else
+    observer.SetLocalGradientAndObjective(&gradient, &objective);
 #endif
 
     if (rank == 0) {  // run optimizer only on rank=0 node
@@ -386,6 +675,14 @@ int main(int argc, char** argv) {
         o->Optimize(objective, gradient, &lambdas);
         assert(c < 5);
       }
+#ifdef HAVE_MPI
+      for (int k = 0; k < lambdas.size(); ++k) {
+        if (lambdas[k] != old[k]) {
+          changed.push_back(k);
+          changed_vals.push_back(lambdas[k]);
+        }
+      }
+#endif
       old.clear();
       SanityCheck(lambdas);
       ShowLargestFeatures(lambdas);
@@ -400,10 +697,12 @@ int main(int argc, char** argv) {
       vv << "Objective = " << objective << "  (eval count=" << o->EvaluationCount() << ")";
       const string svv = vv.str();
       weights.WriteToFile(fname, true, &svv);
+      if (conf.count("write_snapshots"))
+        weights.WriteSnapshot(converged ? "weights.final.snapshot" : "weights.cur.snapshot");
     }  // rank == 0
     int cint = converged;
 #ifdef HAVE_MPI
-    mpi::broadcast(world, &lambdas[0], lambdas.size(), 0);
+    BroadcastChangedWeights(world, &changed, &changed_vals, &lambdas);
     mpi::broadcast(world, cint, 0);
     if (rank == 0) { cerr << "  ELAPSED TIME THIS ITERATION=" << timer.elapsed() << endl; }
 #endif
@@ -3,12 +3,17 @@
 #include <vector>
 #include <cassert>
 #include <cmath>
+#include <cstring>
 
+#include "config.h"
 #ifdef HAVE_MPI
-#include <mpi.h>
+#include <boost/mpi.hpp>
+namespace mpi = boost::mpi;
 #endif
 
+#include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
 
@@ -23,6 +28,7 @@
 #include "fdict.h"
 #include "weights.h"
 #include "sparse_vector.h"
+#include "null_deleter.h"
 
 using namespace std;
 using boost::shared_ptr;
@@ -57,12 +63,13 @@ void ShowLargestFeatures(const vector<double>& w) {
   cerr << endl;
 }
 
-void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
+bool InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   po::options_description opts("Configuration options");
   opts.add_options()
         ("input_weights,w",po::value<string>(),"Input feature weights file")
         ("training_data,t",po::value<string>(),"Training data")
         ("decoder_config,c",po::value<string>(),"Decoder configuration file")
+        ("threads,j", po::value<int>()->default_value(1), "Number of decoding threads in each process (they share its grammars), each with its own counts")
         ("output_weights,o",po::value<string>()->default_value("-"),"Output feature weights file");
   po::options_description clo("Command line options");
   clo.add_options()
@@ -81,11 +88,9 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
 
   if (conf->count("help") || !(conf->count("training_data")) || !conf->count("decoder_config")) {
     cerr << dcmdline_options << endl;
-#ifdef HAVE_MPI
-    MPI::Finalize();
-#endif
-    exit(1);
+    return false;
   }
+  return true;
 }
 
 void ReadTrainingCorpus(const string& fname, int rank, int size, vector<string>* c) {
@@ -116,6 +121,13 @@ struct TrainingObserver : public DecoderObserver {
     *g = tot;
   }
 
+  // adds the counts and objective of another thread's observer
+  void Add(const TrainingObserver& o) {
+    tot += o.tot;
+    tot_obj += o.tot_obj;
+    total_complete += o.total_complete;
+  }
+
   virtual void NotifyDecodingStart(const SentenceMetadata& smeta) {
     cur_obj = 0;
     state = 1;
@@ -284,11 +296,120 @@ void TaggerCountManager::AddCounts(const SparseVector<double>& c) {
   }
 }
 
+// decodes sentences [begin, end) of the corpus, adding their expected
+// counts to observer
+static void ComputeCounts(Decoder* decoder, const vector<string>* corpus, int begin, int end,
+                          TrainingObserver* observer) {
+  for (int i = begin; i < end; ++i)
+    decoder->Decode((*corpus)[i], observer);
+}
+
+#ifdef HAVE_MPI
+static const int kTAG_SIZE = 1;
+static const int kTAG_OBJECTIVE = 2;
+static const int kTAG_NAMES = 3;
+static const int kTAG_VALS = 4;
+
+// the features of EM's counts come up while decoding, so each process
+// numbers them in its own order: counts and weights go between processes
+// with the names of their features, NUL-terminated one after the other
+static void PackFeatures(const SparseVector<double>& v, string* names, vector<double>* vals) {
+  names->clear();
+  vals->clear();
+  for (SparseVector<double>::const_iterator it = v.begin(); it != v.end(); ++it) {
+    const string& name = FD::Convert(it->first);
+    names->append(name.c_str(), name.size() + 1);
+    vals->push_back(it->second);
+  }
+}
+
+// adds the packed features to v
+static void UnpackFeatures(const string& names, const vector<double>& vals, SparseVector<double>* v) {
+  const char* p = names.c_str();
+  for (int i = 0; i < vals.size(); ++i) {
+    const size_t len = strlen(p);
+    v->add_value(FD::Convert(string(p, len)), vals[i]);
+    p += len + 1;
+  }
+}
+
+static void SendFeatures(const mpi::communicator& world, int dest, const SparseVector<double>& v) {
+  string names;
+  vector<double> vals;
+  PackFeatures(v, &names, &vals);
+  const int n = vals.size();
+  const int bytes = names.size();
+  world.send(dest, kTAG_SIZE, n);
+  world.send(dest, kTAG_SIZE, bytes);
+  if (n) {
+    world.send(dest, kTAG_NAMES, names.data(), bytes);
+    world.send(dest, kTAG_VALS, &vals[0], n);
+  }
+}
+
+static void RecvFeatures(const mpi::communicator& world, int src, SparseVector<double>* v) {
+  int n, bytes;
+  world.recv(src, kTAG_SIZE, n);
+  world.recv(src, kTAG_SIZE, bytes);
+  if (!n) return;
+  vector<char> names(bytes);
+  vector<double> vals(n);
+  world.recv(src, kTAG_NAMES, &names[0], bytes);
+  world.recv(src, kTAG_VALS, &vals[0], n);
+  UnpackFeatures(string(&names[0], bytes), vals, v);
+}
+
+// adds up the counts and objectives of all ranks at rank 0 over a binomial
+// tree: in the round with step 2^r, ranks that are odd multiples of 2^r send
+// what they have added up to the rank 2^r below them.  each message has
+// only the counts that are nonzero in the ranks it adds up
+static void ReduceSparseCounts(const mpi::communicator& world, SparseVector<double>* counts, double* objective) {
+  const int rank = world.rank();
+  for (int step = 1; step < world.size(); step <<= 1) {
+    if (rank & step) {
+      const int dest = rank - step;
+      world.send(dest, kTAG_OBJECTIVE, *objective);
+      SendFeatures(world, dest, *counts);
+      return;
+    }
+    const int src = rank + step;
+    if (src < world.size()) {
+      double o;
+      world.recv(src, kTAG_OBJECTIVE, o);
+      *objective += o;
+      RecvFeatures(world, src, counts);
+    }
+  }
+}
+
+// sets w on every rank to what it is on rank 0
+static void BroadcastWeights(const mpi::communicator& world, SparseVector<double>* w) {
+  string names;
+  vector<double> vals;
+  if (world.rank() == 0) PackFeatures(*w, &names, &vals);
+  int n = vals.size();
+  int bytes = names.size();
+  mpi::broadcast(world, n, 0);
+  mpi::broadcast(world, bytes, 0);
+  names.resize(bytes);
+  vals.resize(n);
+  if (n) {
+    mpi::broadcast(world, &names[0], bytes, 0);
+    mpi::broadcast(world, &vals[0], n, 0);
+  }
+  if (world.rank() != 0) {
+    w->clear();
+    UnpackFeatures(names, vals, w);
+  }
+}
+#endif
+
 int main(int argc, char** argv) {
 #ifdef HAVE_MPI
-  MPI::Init(argc, argv);
-  const int size = MPI::COMM_WORLD.Get_size(); 
-  const int rank = MPI::COMM_WORLD.Get_rank();
+  mpi::environment env(argc, argv);
+  mpi::communicator world;
+  const int size = world.size();
+  const int rank = world.rank();
 #else
   const int size = 1;
   const int rank = 0;
@@ -297,7 +418,7 @@ int main(int argc, char** argv) {
   register_feature_functions();
 
   po::variables_map conf;
-  InitCommandLine(argc, argv, &conf);
+  if (!InitCommandLine(argc, argv, &conf)) return 1;
 
   TaggerCountManager tcm;
 
@@ -310,9 +431,18 @@ int main(int argc, char** argv) {
   Decoder* decoder = new Decoder(&ini);
   if (decoder->GetConf()["input"].as<string>() != "-") {
     cerr << "cdec.ini must not set an input file\n";
-#ifdef HAVE_MPI
-    MPI::COMM_WORLD.Abort(1);
-#endif
+    return 1;
+  }
+  const int threads = conf["threads"].as<int>();
+  if (threads < 1) {
+    cerr << "Bad number of threads: " << threads << endl;
+    return 1;
+  }
+  vector<boost::shared_ptr<Decoder> > decoders(1, boost::shared_ptr<Decoder>(decoder, null_deleter()));
+  for (int i = 1; i < threads; ++i) {
+    istringstream ini_i;
+    StoreConfig(cdec_ini, &ini_i);
+    decoders.push_back(boost::shared_ptr<Decoder>(new Decoder(&ini_i)));
   }
   if (rank == 0) cerr << "Done loading grammar!\n";
   Weights w;
@@ -329,34 +459,41 @@ int main(int argc, char** argv) {
   assert(corpus.size() > 0);
 
   int iteration = 0;
-  TrainingObserver observer;
+  // one observer per thread, so each collects its counts on its own
+  vector<TrainingObserver> observers(threads);
+  TrainingObserver& observer = observers[0];
   while (!converged) {
     ++iteration;
-    observer.Reset();
+    for (int i = 0; i < threads; ++i)
+      observers[i].Reset();
     if (rank == 0) {
       cerr << "Starting decoding... (~" << corpus.size() << " sentences / proc)\n";
     }
-    decoder->SetWeights(lambdas);
-    for (int i = 0; i < corpus.size(); ++i)
-      decoder->Decode(corpus[i], &observer);
+    for (int i = 0; i < threads; ++i)
+      decoders[i]->SetWeights(lambdas);
+    if (threads > 1) {
+      boost::thread_group workers;
+      for (int i = 0; i < threads; ++i)
+        workers.create_thread(boost::bind(&ComputeCounts, decoders[i].get(), &corpus,
+          corpus.size() * i / threads, corpus.size() * (i + 1) / threads, &observers[i]));
+      workers.join_all();
+      for (int i = 1; i < threads; ++i)
+        observer.Add(observers[i]);
+    } else {
+      ComputeCounts(decoder, &corpus, 0, corpus.size(), &observer);
+    }
 
     SparseVector<double> x;
     observer.SetLocalGradientAndObjective(&x, &objective);
     cerr << "COUNTS = " << x << endl;
     cerr << "   OBJ = " << objective << endl;
-    tcm.AddCounts(x);
-
-#if 0
 #ifdef HAVE_MPI
-    MPI::COMM_WORLD.Reduce(const_cast<double*>(&gradient.data()[0]), &rcv_grad[0], num_feats, MPI::DOUBLE, MPI::SUM, 0);
-    MPI::COMM_WORLD.Reduce(&objective, &to, 1, MPI::DOUBLE, MPI::SUM, 0);
-    swap(gradient, rcv_grad);
-    objective = to;
-#endif
+    ReduceSparseCounts(world, &x, &objective);
 #endif
 
+    SparseVector<double> wsv;
     if (rank == 0) {
-      SparseVector<double> wsv;
+      tcm.AddCounts(x);
       tcm.Optimize(&wsv);
 
       w.InitFromVector(wsv);
@@ -376,14 +513,14 @@ int main(int argc, char** argv) {
     }  // rank == 0
     int cint = converged;
 #ifdef HAVE_MPI
-    MPI::COMM_WORLD.Bcast(const_cast<double*>(&lambdas.data()[0]), num_feats, MPI::DOUBLE, 0);
-    MPI::COMM_WORLD.Bcast(&cint, 1, MPI::INT, 0);
-    MPI::COMM_WORLD.Barrier();
+    BroadcastWeights(world, &wsv);
+    if (rank != 0) {
+      w.InitFromVector(wsv);
+      w.InitVector(&lambdas);
+    }
+    mpi::broadcast(world, cint, 0);
 #endif
     converged = cint;
   }
-#ifdef HAVE_MPI
-  MPI::Finalize(); 
-#endif
   return 0;
 }
@@ -6,8 +6,11 @@
 #include <cmath>
 #include <tr1/memory>
 
+#include <boost/bind.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
 
 #include "verbose.h"
 #include "hg.h"
@@ -71,6 +74,8 @@ bool InitCommandLine(int argc, char** argv, po::variables_map* conf) {
         ("optimization_method,m", po::value<string>()->default_value("sgd"), "Optimization method (sgd)")
         ("random_seed,S", po::value<uint32_t>(), "Random seed (if not specified, /dev/random will be used)")
         ("eta_0,e", po::value<double>()->default_value(0.2), "Initial learning rate for SGD (eta_0)")
+        ("threads,j", po::value<int>()->default_value(1), "Number of decoding threads in each process. With more than one, each thread decodes its own minibatches and updates the weights of its process without locks (Hogwild), and the processes mix their updates every mix_interval minibatches per thread")
+        ("mix_interval,I", po::value<int>()->default_value(1), "With threads, the number of minibatches each thread decodes between mixes. An iteration of the agenda is then one such interval")
         ("L1,1","Use L1 regularization")
         ("regularization_strength,C", po::value<double>()->default_value(1.0), "Regularization strength (C)");
   po::options_description clo("Command line options");
@@ -206,6 +211,125 @@ namespace boost { namespace mpi {
 } } // end namespace boost::mpi
 #endif
 
+void ReadConfig(const string& ini, vector<string>* out) {
+  ReadFile rf(ini);
+  istream& in = *rf.stream();
+  while(in) {
+    string line;
+    getline(in, line);
+    if (!in) continue;
+    out->push_back(line);
+  }
+}
+
+void StoreConfig(const vector<string>& cfg, istringstream* o) {
+  ostringstream os;
+  for (int i = 0; i < cfg.size(); ++i) { os << cfg[i] << endl; }
+  o->str(os.str());
+}
+
+// decodes minibatches of size_per_proc sentences sampled from corpus, each
+// with the weights of o as they are when it starts, and applies the
+// gradient of each to o, while other threads do the same
+static void HogwildWorker(Decoder* decoder, const vector<string>* corpus, const vector<int>* ids,
+                          unsigned size_per_proc, int minibatches, uint32_t seed,
+                          HogwildL1Optimizer* o) {
+  MT19937 rng(seed);
+  TrainingObserver observer;
+  SparseVector<double> g;
+  for (int b = 0; b < minibatches; ++b) {
+    decoder->SetWeights(o->weights());
+    observer.Reset();
+    for (int i = 0; i < size_per_proc; ++i) {
+      int ei = corpus->size() * rng.next();
+      decoder->SetId((*ids)[ei]);
+      decoder->Decode((*corpus)[ei], &observer);
+    }
+    observer.GetGradient(&g);
+    g /= size_per_proc;
+    o->UpdateWeights(g);
+  }
+}
+
+#ifdef HAVE_MPI
+// the state of a HogwildL1Optimizer at the last mix
+struct MixPoint {
+  MixPoint() : k(), u() {}
+  vector<double> w;
+  vector<double> q;
+  int k;
+  double u;
+};
+
+static void Change(const vector<double>& cur, const vector<double>& last, SparseVector<double>* d) {
+  d->clear();
+  for (int i = 0; i < cur.size(); ++i) {
+    const double x = cur[i] - (i < last.size() ? last[i] : 0.0);
+    if (x) d->set_value(i, x);
+  }
+}
+
+static void AddTo(const SparseVector<double>& d, vector<double>* v) {
+  for (SparseVector<double>::const_iterator it = d.begin(); it != d.end(); ++it) {
+    if (it->first >= v->size()) v->resize(it->first + 1, 0.0);
+    (*v)[it->first] += it->second;
+  }
+}
+
+// sets v to d, with zeros for the features not in it
+static void Assign(const SparseVector<double>& d, vector<double>* v) {
+  fill(v->begin(), v->end(), 0.0);
+  AddTo(d, v);
+}
+
+// adds the changes of the weights, applied penalties and steps of the
+// optimizers of all processes since the last mix to the state at the last
+// mix, so that each process has the updates of all, applies the penalty
+// to all weights, and makes that the new mix point.  The weights are sent
+// as sparse vectors, which have the feature names, as the processes may
+// have given new features different ids.
+static void MixOptimizers(mpi::communicator& world, HogwildL1Optimizer* o, MixPoint* last) {
+  SparseVector<double> dw, dq, sum_dw, sum_dq;
+  Change(o->weights(), last->w, &dw);
+  Change(o->applied_penalties(), last->q, &dq);
+  reduce(world, dw, sum_dw, std::plus<SparseVector<double> >(), 0);
+  reduce(world, dq, sum_dq, std::plus<SparseVector<double> >(), 0);
+  int dk = o->steps() - last->k, sum_dk = 0;
+  double du = o->total_penalty() - last->u, sum_du = 0;
+  reduce(world, dk, sum_dk, std::plus<int>(), 0);
+  reduce(world, du, sum_du, std::plus<double>(), 0);
+  SparseVector<double> w, q;
+  if (world.rank() == 0) {
+    AddTo(sum_dw, &last->w);
+    AddTo(sum_dq, &last->q);
+    o->weights().swap(last->w);
+    o->applied_penalties().swap(last->q);
+    o->SetSteps(last->k + sum_dk, last->u + sum_du);
+    o->Resize(FD::NumFeats());
+    o->ApplyPenaltyToAll();
+    Change(o->weights(), vector<double>(), &w);
+    Change(o->applied_penalties(), vector<double>(), &q);
+  }
+  mpi::broadcast(world, w, 0);
+  mpi::broadcast(world, q, 0);
+  int k = o->steps();
+  double u = o->total_penalty();
+  mpi::broadcast(world, k, 0);
+  mpi::broadcast(world, u, 0);
+  if (world.rank() != 0) {
+    o->Resize(FD::NumFeats());
+    Assign(w, &o->weights());
+    Assign(q, &o->applied_penalties());
+    o->SetSteps(k, u);
+    o->Resize(FD::NumFeats());
+  }
+  last->w = o->weights();
+  last->q = o->applied_penalties();
+  last->k = k;
+  last->u = u;
+}
+#endif
+
 bool LoadAgenda(const string& file, vector<pair<string, int> >* a) {
   ReadFile rf(file);
   istream& in = *rf.stream();
@@ -285,12 +409,32 @@ int main(int argc, char** argv) {
 
   size_t total_corpus_size = 0;
 #ifdef HAVE_MPI
-  reduce(world, corpus.size(), total_corpus_size, std::plus<size_t>(), 0);
+  all_reduce(world, corpus.size(), total_corpus_size, std::plus<size_t>());
 #else
   total_corpus_size = corpus.size();
 #endif
 
-  if (rank == 0) {
+  const int threads = conf["threads"].as<int>();
+  const int mix_interval = conf["mix_interval"].as<int>();
+  if (threads < 1 || mix_interval < 1) {
+    cerr << "Bad number of threads or mix interval\n";
+    return 1;
+  }
+  const bool hogwild = threads > 1;
+  if (hogwild) SetSilent(true);
+  std::tr1::shared_ptr<HogwildL1Optimizer> ho;
+  if (hogwild) {
+    // every process updates its own weights, with the steps of
+    // one thread's minibatch
+    if (conf["optimization_method"].as<string>() != "sgd") {
+      cerr << "Threads only work with sgd\n";
+      return 1;
+    }
+    lr.reset(new ExponentialDecayLearningRate(size_per_proc, conf["eta_0"].as<double>()));
+    ho.reset(new HogwildL1Optimizer(lr, total_corpus_size, conf["regularization_strength"].as<double>(),
+                                    frozen_fids, FD::NumFeats()));
+    if (rank == 0) cerr << "Total corpus size: " << total_corpus_size << endl;
+  } else if (rank == 0) {
     cerr << "Total corpus size: " << total_corpus_size << endl;
     const unsigned batch_size = size_per_proc * size;
     // TODO config
@@ -312,6 +456,14 @@ int main(int argc, char** argv) {
   SparseVector<double> x;
   weights.InitSparseVector(&x);
   TrainingObserver observer;
+  if (hogwild) {
+    weights.InitVector(&ho->weights());
+    ho->Resize(FD::NumFeats());
+  }
+#ifdef HAVE_MPI
+  MixPoint mix_point;
+  if (hogwild) mix_point.w = ho->weights();
+#endif
 
   int write_weights_every_ith = 100; // TODO configure
   int titer = -1;
@@ -329,6 +481,59 @@ int main(int argc, char** argv) {
     if (rank == 0)
       cerr << "STARTING TRAINING EPOCH " << (ai+1) << ". CONFIG=" << cur_config << endl;
     // load cdec.ini and set up decoder
+    if (hogwild) {
+      vector<string> ini;
+      ReadConfig(cur_config, &ini);
+      vector<boost::shared_ptr<Decoder> > decoders;
+      for (int i = 0; i < threads; ++i) {
+        istringstream ini_i;
+        StoreConfig(ini, &ini_i);
+        decoders.push_back(boost::shared_ptr<Decoder>(new Decoder(&ini_i)));
+      }
+      ho->ResetEpoch();
+#ifdef HAVE_MPI
+      mix_point.k = 0;
+      mix_point.u = 0;
+#endif
+      for (int iter = 0; iter <= max_iteration; ++iter) {
+        ++titer;
+#ifdef HAVE_MPI
+        mpi::timer timer;
+#endif
+        if (rank == 0) {
+          const bool last = (iter == max_iteration);
+          weights.InitFromVector(ho->weights());
+          weights.InitVector(&lambdas);
+          SanityCheck(lambdas);
+          ShowLargestFeatures(lambdas);
+          string fname = "weights.cur.gz";
+          if (iter % write_weights_every_ith == 0) {
+            ostringstream o; o << "weights.epoch_" << (ai+1) << '.' << iter << ".gz";
+            fname = o.str();
+          }
+          if (last && ((ai+1)==agenda.size())) { fname = "weights.final.gz"; }
+          ostringstream vv;
+          vv << "total iter=" << titer << " (of current config iter=" << iter << ")  minibatch=" << size_per_proc << " sentences x " << mix_interval << " x " << threads << " threads/proc x " << size << " procs.   num_feats=" << FD::NumFeats() << "   passes_thru_data=" << (titer * mix_interval * threads * size_per_proc / static_cast<double>(corpus.size())) << "   eta=" << lr->eta(ho->steps());
+          const string svv = vv.str();
+          cerr << svv << endl;
+          weights.WriteToFile(fname, true, &svv);
+        }
+        if (iter == max_iteration) break;
+        boost::thread_group workers;
+        for (int i = 0; i < threads; ++i)
+          workers.create_thread(boost::bind(&HogwildWorker, decoders[i].get(), &corpus, &ids,
+            size_per_proc, mix_interval, rng->inclusive(1, 0x7fffffff)(), ho.get()));
+        workers.join_all();
+        ho->Resize(FD::NumFeats());
+#ifdef HAVE_MPI
+        if (size > 1) MixOptimizers(world, ho.get(), &mix_point);
+        world.barrier();
+        if (rank == 0) { cerr << "  ELAPSED TIME THIS ITERATION=" << timer.elapsed() << endl; }
+#endif
+      }
+      continue;
+    }
+
     ReadFile ini_rf(cur_config);
     Decoder decoder(ini_rf.stream());
 
@@ -2,6 +2,7 @@
 #include <vector>
 #include <cassert>
 #include <cmath>
+#include <map>
 
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
@@ -19,7 +20,7 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   po::options_description opts("Configuration options");
   opts.add_options()
         ("optimization_method,m", po::value<string>()->default_value("em"), "Optimization method (em, vb)")
-        ("input_format,f",po::value<string>()->default_value("b64"),"Encoding of the input (b64 or text)");
+        ("input_format,f",po::value<string>()->default_value("b64"),"Encoding of the input and output (b64, text, or binary). Binary input need not be sorted by key, it is grouped in memory");
   po::options_description clo("Command line options");
   clo.add_options()
         ("config", po::value<string>(), "Configuration file")
@@ -83,6 +84,33 @@ void Maximize(const bool use_vb,
 #endif
 }
 
+// sums the unsorted binary records of each key and writes them normalized,
+// in key order
+void ReduceBinary(const bool use_vb, const double alpha) {
+  map<string, SparseVector<double> > acc;
+  double logprob = 0;
+  // key<TAB>record<NEWLINE>, see BinaryVector
+  string key;
+  SparseVector<double> g;
+  while (getline(cin, key, '\t')) {
+    double obj;
+    if (!BinaryVector::Decode(&obj, &g, &cin) || cin.get() != '\n') {
+      cerr << "Binary vector decoder returned error, giving up!\n";
+      exit(1);
+    }
+    logprob += obj;
+    acc[key] += g;
+  }
+  for (map<string, SparseVector<double> >::iterator it = acc.begin(); it != acc.end(); ++it) {
+    Maximize(use_vb, alpha, it->second.size(), &it->second);
+    cout << it->first << '\t';
+    BinaryVector::Encode(0.0, it->second, &cout);
+    cout << '\n';
+  }
+  cout << flush;
+  cerr << "LOGPROB: " << logprob << endl;
+}
+
 int main(int argc, char** argv) {
   po::variables_map conf;
   InitCommandLine(argc, argv, &conf);
@@ -92,6 +120,10 @@ int main(int argc, char** argv) {
   const double alpha = 1e-09;
   if (use_vb)
     cerr << "Using variational Bayes, make sure alphas are set\n";
+  if (conf["input_format"].as<string>() == "binary") {
+    ReduceBinary(use_vb, alpha);
+    return 0;
+  }
 
   const string s_obj = "**OBJ**";
   // E-step
@@ -2,6 +2,7 @@
 #include <fstream>
 #include <cassert>
 #include <cmath>
+#include <tr1/unordered_map>
 
 #include <boost/utility.hpp>
 #include <boost/program_options.hpp>
@@ -12,18 +13,22 @@
 #include "sparse_vector.h"
 
 using namespace std;
+using namespace std::tr1;
 namespace po = boost::program_options;
 
 // useful for EM models parameterized by a bunch of multinomials
 // this converts event counts (returned from cdec as feature expectations)
 // into different keys and values (which are lists of all the events,
-// conditioned on the key) for summing and normalization by a reducer
+// conditioned on the key) for summing and normalization by a reducer.
+// Counts are combined in memory until buffer_size distinct events are held,
+// so each key is emitted once per buffer rather than once per input record.
 
 void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   po::options_description opts("Configuration options");
   opts.add_options()
-        ("buffer_size,b", po::value<int>()->default_value(1), "Buffer size (in # of counts) before emitting counts")
-        ("format,f",po::value<string>()->default_value("b64"), "Encoding of the input (b64 or text)");
+        ("buffer_size,b", po::value<int>()->default_value(1000000), "Number of distinct events to combine in memory before emitting counts")
+        ("format,f",po::value<string>()->default_value("b64"), "Encoding of the input (b64, text, or binary)")
+        ("output_format,o",po::value<string>()->default_value("b64"), "Encoding of the output (b64, or binary: BinaryVector records, which are not newline free, so they can't go through sort; mr_em_adapted_reduce -f binary groups them itself)");
   po::options_description clo("Command line options");
   clo.add_options()
         ("config", po::value<string>(), "Configuration file")
@@ -54,10 +59,11 @@ struct EventMapper {
     return cv;
   }
   void Clear() { map_.clear(); }
+  virtual ~EventMapper() {}
  protected:
   virtual int GetConditioningVariable(int fid) const = 0;
  private:
-  map<int, int> map_;
+  unordered_map<int, int> map_;
 };
 
 struct LexAlignEventMapper : public EventMapper {
@@ -73,88 +79,120 @@ struct LexAlignEventMapper : public EventMapper {
   }
 };
 
+// parses the text encoding of a feature vector, **OBJ** is the objective
+bool ParseText(const string& line, size_t i, double* obj, SparseVector<double>* g) {
+  static const string s_obj = "**OBJ**";
+  while (i < line.size()) {
+    size_t start = i;
+    while (line[i] != '=' && i < line.size()) ++i;
+    if (i == line.size()) { cerr << "FORMAT ERROR\n"; return false; }
+    const string fname = line.substr(start, i - start);
+    ++i;
+    start = i;
+    while (line[i] != ';' && i < line.size()) ++i;
+    if (i - start == 0) continue;
+    const double val = atof(line.substr(start, i - start).c_str());
+    ++i;
+    if (fname == s_obj)
+      *obj = val;
+    else
+      g->set_value(FD::Convert(fname), val);
+  }
+  return true;
+}
+
+// event counts summed by conditioning variable
+class CountCombiner {
+ public:
+  CountCombiner(EventMapper* mapper, int buffer_size, bool binary, ostream* out) :
+      mapper_(mapper), buffer_size_(buffer_size), binary_(binary), out_(out), obj_(), total_() {}
+
+  void Add(double obj, const SparseVector<double>& g) {
+    obj_ += obj;
+    for (SparseVector<double>::const_iterator it = g.begin(); it != g.end(); ++it) {
+      SparseVector<double>& cond_counts = counts_[mapper_->Map(it->first)];
+      const int before = cond_counts.size();
+      cond_counts.add_value(it->first, it->second);
+      total_ += cond_counts.size() - before;
+    }
+    if (total_ > buffer_size_) Flush();
+  }
+
+  // the objective goes with the first record, for the reducer to report
+  void Flush() {
+    for (unordered_map<int, SparseVector<double> >::iterator it = counts_.begin(); it != counts_.end(); ++it) {
+      (*out_) << FD::Convert(it->first) << '\t';
+      if (binary_)
+        BinaryVector::Encode(obj_, it->second, out_);
+      else
+        B64::Encode(obj_, it->second, out_);
+      (*out_) << '\n';
+      obj_ = 0;
+    }
+    out_->flush();
+    total_ = 0;
+    counts_.clear();
+  }
+
+ private:
+  EventMapper* mapper_;
+  const size_t buffer_size_;
+  const bool binary_;
+  ostream* out_;
+  double obj_;
+  size_t total_;  // distinct events in counts_
+  unordered_map<int, SparseVector<double> > counts_;
+};
+
 int main(int argc, char** argv) {
   po::variables_map conf;
   InitCommandLine(argc, argv, &conf);
 
-  const bool use_b64 = conf["format"].as<string>() == "b64";
-  const int buffer_size = conf["buffer_size"].as<int>();
+  const string format = conf["format"].as<string>();
+  const string output_format = conf["output_format"].as<string>();
+  if ((format != "b64" && format != "text" && format != "binary") ||
+      (output_format != "b64" && output_format != "binary")) {
+    cerr << "Unknown input or output format\n";
+    return 1;
+  }
 
-  const string s_obj = "**OBJ**";
   // 0<TAB>**OBJ**=12.2;Feat1=2.3;Feat2=-0.2;
   // 0<TAB>**OBJ**=1.1;Feat1=1.0;
 
-  EventMapper* event_mapper = new LexAlignEventMapper;
-  map<int, SparseVector<double> > counts;
-  size_t total = 0;
-  while(cin) {
-    string line;
-    getline(cin, line);
+  LexAlignEventMapper event_mapper;
+  CountCombiner combiner(&event_mapper, conf["buffer_size"].as<int>(), output_format == "binary", &cout);
+  if (format == "binary") {
+    // 0<TAB>record<NEWLINE>, see BinaryVector
+    string key;
+    while (getline(cin, key, '\t')) {
+      SparseVector<double> g;
+      double obj;
+      if (!BinaryVector::Decode(&obj, &g, &cin) || cin.get() != '\n') {
+        cerr << "Binary vector decoder returned error, giving up!\n";
+        return 1;
+      }
+      combiner.Add(obj, g);
+    }
+  }
+  string line;
+  while(format != "binary" && getline(cin, line)) {
     if (line.empty()) continue;
-    int feat;
-    double val;
     size_t i = line.find("\t");
     assert(i != string::npos);
     ++i;
     SparseVector<double> g;
     double obj = 0;
-    if (use_b64) {
+    if (format == "b64") {
       if (!B64::Decode(&obj, &g, &line[i], line.size() - i)) {
         cerr << "B64 decoder returned error, skipping!\n";
         continue;
       }
     } else {       // text encoding - your counts will not be accurate!
-      while (i < line.size()) {
-        size_t start = i;
-        while (line[i] != '=' && i < line.size()) ++i;
-        if (i == line.size()) { cerr << "FORMAT ERROR\n"; break; }
-        string fname = line.substr(start, i - start);
-        if (fname == s_obj) {
-          feat = -1;
-        } else {
-          feat = FD::Convert(line.substr(start, i - start));
-        }
-        ++i;
-        start = i;
-        while (line[i] != ';' && i < line.size()) ++i;
-        if (i - start == 0) continue;
-        val = atof(line.substr(start, i - start).c_str());
-        ++i;
-        if (feat == -1) {
-          obj = val;
-        } else {
-          g.set_value(feat, val);
-        }
-      }
-    }
-    //cerr << "OBJ: " << obj << endl;
-    const SparseVector<double>& cg = g;
-    for (SparseVector<double>::const_iterator it = cg.begin(); it != cg.end(); ++it) {
-      const int cond_var = event_mapper->Map(it->first);
-      SparseVector<double>& cond_counts = counts[cond_var];
-      int delta = cond_counts.size();
-      cond_counts.add_value(it->first, it->second);
-      delta = cond_counts.size() - delta;
-      total += delta;
-    }
-    if (total > buffer_size) {
-      for (map<int, SparseVector<double> >::iterator it = counts.begin();
-           it != counts.end(); ++it) {
-        const SparseVector<double>& cc = it->second;
-        cout << FD::Convert(it->first) << '\t';
-        if (use_b64) {
-          B64::Encode(0.0, cc, &cout);
-        } else {
-          abort();
-        }
-        cout << endl;
-      }
-      cout << flush;
-      total = 0;
-      counts.clear();
+      ParseText(line, i, &obj, &g);
     }
+    combiner.Add(obj, g);
   }
+  combiner.Flush();
 
   return 0;
 }
-
@@ -47,16 +47,29 @@ void ShowLargestFeatures(const vector<double>& w) {
   cerr << endl;
 }
 
+void SubtractGradient(const SparseVector<double>& g, vector<double>* gradient) {
+  for (SparseVector<double>::const_iterator it = g.begin(); it != g.end(); ++it) {
+    if (it->first >= gradient->size()) {
+      cerr << "Unexpected feature in gradient: " << FD::Convert(it->first) << endl;
+      abort();
+    }
+    (*gradient)[it->first] -= it->second;
+  }
+}
+
 void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   po::options_description opts("Configuration options");
   opts.add_options()
         ("input_weights,i",po::value<string>(),"Input feature weights file")
         ("output_weights,o",po::value<string>()->default_value("-"),"Output feature weights file")
+        ("output_snapshot",po::value<string>(),"Also write the output weights as a binary snapshot, which loads faster than a weights file")
         ("optimization_method,m", po::value<string>()->default_value("lbfgs"), "Optimization method (sgd, lbfgs, rprop)")
         ("state,s",po::value<string>(),"Read (and write if output_state is not set) optimizer state from this state file. In the first iteration, the file should not exist.")
-        ("input_format,f",po::value<string>()->default_value("b64"),"Encoding of the input (b64 or text)")
+        ("input_format,f",po::value<string>()->default_value("b64"),"Encoding of the input (b64, text, or binary)")
         ("output_state,S", po::value<string>(), "Output state file (optional override)")
 	("correction_buffers,M", po::value<int>()->default_value(10), "Number of gradients for LBFGS to maintain in memory")
+        ("threads,j", po::value<int>()->default_value(1), "Number of threads for the vector operations of the LBFGS step")
+        ("float_history", "Keep the LBFGS corrections in single precision, which halves the memory of the optimizer (the state file must always be used with it)")
         ("eta,e", po::value<double>()->default_value(0.1), "Learning rate for SGD (eta)")
         ("gaussian_prior,p","Use a Gaussian prior on the weights")
         ("means,u", po::value<string>(), "File containing the means for Gaussian prior")
@@ -87,6 +100,7 @@ int main(int argc, char** argv) {
   InitCommandLine(argc, argv, &conf);
 
   const bool use_b64 = conf["input_format"].as<string>() == "b64";
+  const bool use_binary = conf["input_format"].as<string>() == "binary";
 
   Weights weights;
   weights.InitFromFile(conf["input_weights"].as<string>());
@@ -113,7 +127,8 @@ int main(int argc, char** argv) {
   if (omethod == "rprop")
     o.reset(new RPropOptimizer(num_feats));  // TODO add configuration
   else
-    o.reset(new LBFGSOptimizer(num_feats, conf["correction_buffers"].as<int>()));
+    o.reset(new LBFGSOptimizer(num_feats, conf["correction_buffers"].as<int>(), conf["threads"].as<int>(),
+                               conf.count("float_history")));
   cerr << "Optimizer: " << o->Name() << endl;
   string state_file = conf["state"].as<string>();
   {
@@ -132,7 +147,23 @@ int main(int argc, char** argv) {
   // 0<TAB>**OBJ**=1.1;Feat1=1.0;
   int total_lines = 0;  // TODO - this should be a count of the
                         // training instances!!
-  while(cin) {
+  if (use_binary) {
+    // 0<TAB>record<NEWLINE>, see BinaryVector
+    string key;
+    while (getline(cin, key, '\t')) {
+      ++total_lines;
+      SparseVector<double> g;
+      double obj;
+      if (!BinaryVector::Decode(&obj, &g, &cin) || cin.get() != '\n') {
+        cerr << "Binary vector decoder returned error, skipping gradient!\n";
+        cout << "-1\tRESTART\n";
+        exit(99);
+      }
+      objective += obj;
+      SubtractGradient(g, &gradient);
+    }
+  }
+  while(!use_binary && cin) {
     string line;
     getline(cin, line);
     if (line.empty()) continue;
@@ -154,14 +185,7 @@ int main(int argc, char** argv) {
         exit(99);
       }
       objective += obj;
-      const SparseVector<double>& cg = g;
-      for (SparseVector<double>::const_iterator it = cg.begin(); it != cg.end(); ++it) {
-        if (it->first >= num_feats) {
-	  cerr << "Unexpected feature in gradient: " << FD::Convert(it->first) << endl;
-	  abort();
-        }
-        gradient[it->first] -= it->second;
-      }
+      SubtractGradient(g, &gradient);
     } else {       // text encoding - your gradients will not be accurate!
       while (i < line.size()) {
         size_t start = i;
@@ -225,6 +249,8 @@ int main(int argc, char** argv) {
   ShowLargestFeatures(lambdas);
   weights.InitFromVector(lambdas);
   weights.WriteToFile(conf["output_weights"].as<string>(), false);
+  if (conf.count("output_snapshot"))
+    weights.WriteSnapshot(conf["output_snapshot"].as<string>(), false);
 
   const bool conv = o->HasConverged();
   if (conv) { cerr << "OPTIMIZER REPORTS CONVERGENCE!\n"; }
@@ -17,7 +17,7 @@ namespace po = boost::program_options;
 void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   po::options_description opts("Configuration options");
   opts.add_options()
-        ("input_format,f",po::value<string>()->default_value("b64"),"Encoding of the input (b64 or text)")
+        ("input_format,f",po::value<string>()->default_value("b64"),"Encoding of the input (b64, text, or binary)")
         ("input,i",po::value<string>()->default_value("-"),"Read file from")
         ("output,o",po::value<string>()->default_value("-"),"Write weights to");
   po::options_description clo("Command line options");
@@ -53,6 +53,7 @@ int main(int argc, char** argv) {
   InitCommandLine(argc, argv, &conf);
 
   const bool use_b64 = conf["input_format"].as<string>() == "b64";
+  const bool use_binary = conf["input_format"].as<string>() == "binary";
 
   const string s_obj = "**OBJ**";
   // E-step
@@ -62,7 +63,20 @@ int main(int argc, char** argv) {
   WriteFile wf(conf["output"].as<string>());
   ostream* out = wf.stream();
   out->precision(17);
-  while(*in) {
+  if (use_binary) {
+    // 0<TAB>record<NEWLINE>, see BinaryVector
+    string key;
+    while (getline(*in, key, '\t')) {
+      SparseVector<double> g;
+      double obj;
+      if (!BinaryVector::Decode(&obj, &g, in) || in->get() != '\n') {
+        cerr << "Binary vector decoder returned error, giving up!\n";
+        return 1;
+      }
+      WriteWeights(g, out);
+    }
+  }
+  while(!use_binary && *in) {
     string line;
     getline(*in, line);
     if (line.empty()) continue;
@@ -14,3 +14,51 @@ OnlineOptimizer::~OnlineOptimizer() {}
 
 void OnlineOptimizer::ResetEpochImpl() {}
 
+
+HogwildL1Optimizer::HogwildL1Optimizer(const std::tr1::shared_ptr<LearningRateSchedule>& s,
+                                       size_t training_instances, double C,
+                                       const std::vector<int>& frozen, int num_feats) :
+    schedule_(s), C_(C), N_(training_instances), w_(num_feats), q_(num_feats), k_(), u_() {
+  for (int i = 0; i < frozen.size(); ++i) {
+    if (frozen[i] >= frozen_.size()) frozen_.resize(frozen[i] + 1);
+    frozen_[frozen[i]] = true;
+  }
+}
+
+void HogwildL1Optimizer::UpdateWeights(const SparseVector<double>& approx_g) {
+  double eta, u;
+  {
+    boost::mutex::scoped_lock l(step_mutex_);
+    ++k_;
+    eta = schedule_->eta(k_);
+    u_ += eta * C_ / N_;
+    u = u_;
+  }
+  const int n = w_.size();
+  for (SparseVector<double>::const_iterator it = approx_g.begin(); it != approx_g.end(); ++it) {
+    const int i = it->first;
+    if (i < frozen_.size() && frozen_[i]) continue;
+    if (i >= n) {
+      boost::mutex::scoped_lock l(pending_mutex_);
+      pending_.add_value(i, eta * it->second);
+      continue;
+    }
+    w_[i] += eta * it->second;
+    ApplyPenalty(i, u);
+  }
+}
+
+void HogwildL1Optimizer::Resize(int num_feats) {
+  if (w_.size() < num_feats) w_.resize(num_feats, 0.0);
+  if (q_.size() < w_.size()) q_.resize(w_.size(), 0.0);
+  for (SparseVector<double>::const_iterator it = pending_.begin(); it != pending_.end(); ++it) {
+    w_[it->first] += it->second;
+    ApplyPenalty(it->first, u_);
+  }
+  pending_.clear();
+}
+
+void HogwildL1Optimizer::ApplyPenaltyToAll() {
+  for (int i = 1; i < w_.size(); ++i)
+    if (i >= frozen_.size() || !frozen_[i]) ApplyPenalty(i, u_);
+}
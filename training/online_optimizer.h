@@ -5,6 +5,8 @@
 #include <set>
 #include <string>
 #include <cmath>
+#include <vector>
+#include <boost/thread/mutex.hpp>
 #include "sparse_vector.h"
 
 struct LearningRateSchedule {
@@ -126,4 +128,61 @@ class CumulativeL1OnlineOptimizer : public OnlineOptimizer {
   SparseVector<double> q_;
 };
 
+// The updates of CumulativeL1OnlineOptimizer applied by several threads,
+// each after its own minibatch, to one dense weight vector without locks
+// (Hogwild!, Niu et al., NIPS 2011).  Concurrent updates of the same weight
+// may lose one of them, which sparse gradients make rare enough not to
+// hurt convergence.  Only the step count and the total penalty u are
+// updated under a lock, once per update; the penalty is applied lazily,
+// to the weights of the features in each gradient (as Tsuruoka et al. do),
+// and to all weights by ApplyPenaltyToAll().  Features that are new since
+// the last Resize() are kept aside until the next one.
+class HogwildL1Optimizer {
+ public:
+  HogwildL1Optimizer(const std::tr1::shared_ptr<LearningRateSchedule>& s,
+                     size_t training_instances, double C,
+                     const std::vector<int>& frozen, int num_feats);
+  void ResetEpoch() { k_ = 0; u_ = 0; }
+  // a step of the minibatch gradient approx_g; thread safe
+  void UpdateWeights(const SparseVector<double>& approx_g);
+
+  // the rest must not be called while threads are updating
+  // grows the vectors to num_feats features, applying the updates of the
+  // features that didn't fit
+  void Resize(int num_feats);
+  void ApplyPenaltyToAll();
+  std::vector<double>& weights() { return w_; }
+  // the penalty applied to each weight so far (q of Tsuruoka et al.)
+  std::vector<double>& applied_penalties() { return q_; }
+  int steps() const { return k_; }
+  double total_penalty() const { return u_; }
+  // sets them, to merge the steps of several optimizers
+  void SetSteps(int k, double u) { k_ = k; u_ = u; }
+
+ private:
+  void ApplyPenalty(int i, double u) {
+    const double z = w_[i];
+    double w_i = z;
+    const double q_i = q_[i];
+    if (w_i > 0.0)
+      w_i = std::max(0.0, w_i - (u + q_i));
+    else if (w_i < 0.0)
+      w_i = std::min(0.0, w_i + (u - q_i));
+    q_[i] = q_i + (w_i - z);
+    w_[i] = w_i;
+  }
+
+  const std::tr1::shared_ptr<LearningRateSchedule> schedule_;
+  const double C_;
+  const double N_;
+  std::vector<bool> frozen_;  // by feature id
+  std::vector<double> w_;
+  std::vector<double> q_;
+  int k_;
+  double u_;
+  boost::mutex step_mutex_;   // for k_ and u_
+  SparseVector<double> pending_;  // updates of features >= w_.size()
+  boost::mutex pending_mutex_;
+};
+
 #endif
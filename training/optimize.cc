@@ -81,8 +81,12 @@ string LBFGSOptimizer::Name() const {
   return "LBFGSOptimizer";
 }
 
-LBFGSOptimizer::LBFGSOptimizer(int num_feats, int memory_buffers) :
-  opt_(num_feats, memory_buffers) {}
+LBFGSOptimizer::LBFGSOptimizer(int num_feats, int memory_buffers, int threads,
+                               bool float_history) :
+  opt_(num_feats, memory_buffers) {
+  opt_.set_threads(threads);
+  if (float_history) opt_.set_float_history(true);
+}
 
 void LBFGSOptimizer::SaveImpl(ostream* out) const {
   opt_.serialize(out);
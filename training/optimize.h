@@ -78,7 +78,10 @@ class RPropOptimizer : public BatchOptimizer {
 
 class LBFGSOptimizer : public BatchOptimizer {
  public:
-  explicit LBFGSOptimizer(int num_vars, int memory_buffers = 10);
+  // threads do the vector operations of each step, and float_history keeps
+  // the memory_buffers corrections in single precision (half the memory)
+  explicit LBFGSOptimizer(int num_vars, int memory_buffers = 10, int threads = 1,
+                          bool float_history = false);
   std::string Name() const;
   void SaveImpl(std::ostream* out) const;
   void LoadImpl(std::istream* in);
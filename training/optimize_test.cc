@@ -108,11 +108,35 @@ void TestOnline() {
   assert(r->eta(10) < r->eta(1));
 }
 
+// with one thread and gradients of all features, the lazy penalty of
+// HogwildL1Optimizer is the same as the penalty of all weights
+void TestHogwild() {
+  size_t N = 20;
+  double C = 1.0;
+  shared_ptr<LearningRateSchedule> r(new ExponentialDecayLearningRate(N, 0.2, 0.85));
+  CumulativeL1OnlineOptimizer opt(r, N, C, std::vector<int>());
+  HogwildL1Optimizer hopt(r, N, C, std::vector<int>(), 4);
+  SparseVector<double> x;
+  for (int k = 0; k < 10; ++k) {
+    SparseVector<double> g;
+    g.set_value(1, 1.0 - 0.1 * k);
+    g.set_value(2, -0.5);
+    g.set_value(3, 0.05 * (k % 3));
+    g.set_value(5, 0.2);  // a feature that is new to hopt
+    opt.UpdateWeights(g, 6, &x);
+    hopt.UpdateWeights(g);
+    hopt.Resize(6);
+    for (int i = 1; i < 6; ++i)
+      assert(fabs(x.value(i) - hopt.weights()[i]) < 1e-12);
+  }
+}
+
 int main() {
   int n = 3;
   TestOptimizerVariants<LBFGSOptimizer>(n);
   TestOptimizerVariants<RPropOptimizer>(n);
   TestOnline();
+  TestHogwild();
   return 0;
 }
 
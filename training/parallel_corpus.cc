@@ -0,0 +1,208 @@
+#include "parallel_corpus.h"
+
+#include <iostream>
+#include <fstream>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "filelib.h"
+#include "stringlib.h"
+#include "tdict.h"
+
+using namespace std;
+
+// cache layout: header, uint32 vocab_ends[num_words] (end of each word in
+// the vocabulary blob), the words of ids 1..num_words back to back, then
+// padding to 8 bytes, uint64 src_ends[num_sents], WordID
+// src[src_ends[num_sents-1]], padding, uint64 trg_ends[num_sents], WordID
+// trg[trg_ends[num_sents-1]]
+static const char kPC_MAGIC[8] = { 'c', 'd', 'e', 'c', 'P', 'C', 'R', 'P' };
+static const uint32_t kPC_VERSION = 1;
+static const uint32_t kPC_BYTE_ORDER = 0x01020304;
+
+struct PCHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t num_words;
+  uint64_t num_sents;
+  // byte offsets from the start of the file
+  uint64_t vocab_ends_off;
+  uint64_t vocab_off;
+  uint64_t src_ends_off;
+  uint64_t src_off;
+  uint64_t trg_ends_off;
+  uint64_t trg_off;
+  uint64_t file_size;
+};
+
+static void CacheFail(const string& file, const string& msg) {
+  cerr << "Bad corpus cache " << file << ": " << msg << endl;
+  abort();
+}
+
+static uint64_t Align8(uint64_t off) {
+  return (off + 7) & ~static_cast<uint64_t>(7);
+}
+
+ParallelCorpus::~ParallelCorpus() {
+  if (data_) munmap(data_, size_);
+}
+
+bool ParallelCorpus::IsCache(const string& fname) {
+  if (fname == "-") return false;
+  const int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  char magic[sizeof(kPC_MAGIC)];
+  const bool res = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+                   memcmp(magic, kPC_MAGIC, sizeof(magic)) == 0;
+  close(fd);
+  return res;
+}
+
+void ParallelCorpus::Read(const string& fname) {
+  if (IsCache(fname))
+    ReadCache(fname);
+  else
+    ReadText(fname);
+}
+
+void ParallelCorpus::UseOwnArrays() {
+  num_sents_ = src_word_ends_.size();
+  src_ = src_words_.empty() ? NULL : &src_words_[0];
+  src_ends_ = src_word_ends_.empty() ? NULL : &src_word_ends_[0];
+  trg_ = trg_words_.empty() ? NULL : &trg_words_[0];
+  trg_ends_ = trg_word_ends_.empty() ? NULL : &trg_word_ends_[0];
+}
+
+void ParallelCorpus::ReadText(const string& fname) {
+  ReadFile rf(fname);
+  istream& in = *rf.stream();
+  string line, ssrc, strg;
+  vector<WordID> ids;
+  int lc = 0;
+  while(getline(in, line)) {
+    ++lc;
+    ParseTranslatorInput(line, &ssrc, &strg);
+    TD::ConvertSentence(ssrc, &ids);
+    src_words_.insert(src_words_.end(), ids.begin(), ids.end());
+    src_word_ends_.push_back(src_words_.size());
+    const bool empty_src = ids.empty();
+    TD::ConvertSentence(strg, &ids);
+    trg_words_.insert(trg_words_.end(), ids.begin(), ids.end());
+    trg_word_ends_.push_back(trg_words_.size());
+    if (empty_src || ids.empty()) {
+      cerr << "Error: " << lc << "\n" << line << endl;
+      abort();
+    }
+  }
+  UseOwnArrays();
+}
+
+void ParallelCorpus::ReadCache(const string& fname) {
+  const int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0) CacheFail(fname, strerror(errno));
+  struct stat st;
+  if (fstat(fd, &st) < 0) CacheFail(fname, strerror(errno));
+  size_ = st.st_size;
+  if (size_ < sizeof(PCHeader)) CacheFail(fname, "file too short");
+  data_ = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data_ == MAP_FAILED) CacheFail(fname, strerror(errno));
+  const char* base = static_cast<const char*>(data_);
+  const PCHeader* h = reinterpret_cast<const PCHeader*>(base);
+  if (h->version != kPC_VERSION) CacheFail(fname, "unsupported version");
+  if (h->byte_order != kPC_BYTE_ORDER) CacheFail(fname, "written on a machine with a different byte order");
+  if (h->file_size != size_) CacheFail(fname, "truncated file");
+  const uint64_t nw = h->num_words;
+  const uint64_t n = h->num_sents;
+  const uint32_t* vocab_ends = reinterpret_cast<const uint32_t*>(base + h->vocab_ends_off);
+  src_ends_ = reinterpret_cast<const uint64_t*>(base + h->src_ends_off);
+  trg_ends_ = reinterpret_cast<const uint64_t*>(base + h->trg_ends_off);
+  if (h->vocab_ends_off + nw * sizeof(uint32_t) > size_ || (nw && h->vocab_off + vocab_ends[nw - 1] > size_) ||
+      h->src_ends_off + n * sizeof(uint64_t) > size_ || h->trg_ends_off + n * sizeof(uint64_t) > size_ ||
+      (n && h->src_off + src_ends_[n - 1] * sizeof(WordID) > size_) ||
+      (n && h->trg_off + trg_ends_[n - 1] * sizeof(WordID) > size_))
+    CacheFail(fname, "corrupt offsets");
+  num_sents_ = n;
+  src_ = reinterpret_cast<const WordID*>(base + h->src_off);
+  trg_ = reinterpret_cast<const WordID*>(base + h->trg_off);
+
+  const string words(base + h->vocab_off, nw ? vocab_ends[nw - 1] : 0);
+  const vector<unsigned> word_ends(vocab_ends, vocab_ends + nw);
+  vector<WordID> ids;
+  TD::ConvertMany(words, word_ends, &ids);
+  bool same_ids = true;
+  for (uint64_t i = 0; same_ids && i < nw; ++i)
+    same_ids = (ids[i] == i + 1);
+  if (same_ids) return;
+  // Convert() had other words before, so copy the arrays with this
+  // process's ids
+  ids.insert(ids.begin(), 0);
+  src_words_.resize(n ? src_ends_[n - 1] : 0);
+  for (uint64_t i = 0; i < src_words_.size(); ++i) {
+    if (src_[i] <= 0 || src_[i] > nw) CacheFail(fname, "corrupt word ids");
+    src_words_[i] = ids[src_[i]];
+  }
+  trg_words_.resize(n ? trg_ends_[n - 1] : 0);
+  for (uint64_t i = 0; i < trg_words_.size(); ++i) {
+    if (trg_[i] <= 0 || trg_[i] > nw) CacheFail(fname, "corrupt word ids");
+    trg_words_[i] = ids[trg_[i]];
+  }
+  src_word_ends_.assign(src_ends_, src_ends_ + n);
+  trg_word_ends_.assign(trg_ends_, trg_ends_ + n);
+  munmap(data_, size_);
+  data_ = NULL;
+  UseOwnArrays();
+}
+
+void ParallelCorpus::WriteCache(const string& fname) const {
+  vector<uint32_t> vocab_ends;
+  string vocab;
+  const unsigned nw = TD::NumWords();
+  for (unsigned i = 1; i <= nw; ++i) {
+    vocab += TD::Convert(i);
+    vocab_ends.push_back(vocab.size());
+  }
+  const uint64_t n = num_sents_;
+  const uint64_t src_len = n ? src_ends_[n - 1] : 0;
+  const uint64_t trg_len = n ? trg_ends_[n - 1] : 0;
+  PCHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, kPC_MAGIC, sizeof(kPC_MAGIC));
+  h.version = kPC_VERSION;
+  h.byte_order = kPC_BYTE_ORDER;
+  h.num_words = nw;
+  h.num_sents = n;
+  h.vocab_ends_off = sizeof(PCHeader);
+  h.vocab_off = h.vocab_ends_off + nw * sizeof(uint32_t);
+  h.src_ends_off = Align8(h.vocab_off + vocab.size());
+  h.src_off = h.src_ends_off + n * sizeof(uint64_t);
+  h.trg_ends_off = Align8(h.src_off + src_len * sizeof(WordID));
+  h.trg_off = h.trg_ends_off + n * sizeof(uint64_t);
+  h.file_size = h.trg_off + trg_len * sizeof(WordID);
+  ofstream out(fname.c_str(), ios::binary);
+  if (!out) {
+    cerr << "Can't write corpus cache " << fname << endl;
+    abort();
+  }
+  const char pad[8] = { 0 };
+  out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+  if (nw) out.write(reinterpret_cast<const char*>(&vocab_ends[0]), nw * sizeof(uint32_t));
+  out.write(vocab.data(), vocab.size());
+  out.write(pad, h.src_ends_off - (h.vocab_off + vocab.size()));
+  out.write(reinterpret_cast<const char*>(src_ends_), n * sizeof(uint64_t));
+  out.write(reinterpret_cast<const char*>(src_), src_len * sizeof(WordID));
+  out.write(pad, h.trg_ends_off - (h.src_off + src_len * sizeof(WordID)));
+  out.write(reinterpret_cast<const char*>(trg_ends_), n * sizeof(uint64_t));
+  out.write(reinterpret_cast<const char*>(trg_), trg_len * sizeof(WordID));
+  if (!out) {
+    cerr << "Error writing corpus cache " << fname << endl;
+    abort();
+  }
+}
@@ -0,0 +1,54 @@
+#ifndef _PARALLEL_CORPUS_H_
+#define _PARALLEL_CORPUS_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "wordid.h"
+
+// the sentence pairs of a "source ||| target" corpus as arrays of WordIDs,
+// read once from the text, or from a binary cache written by WriteCache.
+// The cache holds the vocabulary in TD id order, then the words of all
+// source sentences back to back and the end of each sentence, and the same
+// for the targets.  It is mapped into memory, and its arrays are used in
+// place if its words get the same ids in this process (as they do when
+// the same words were converted before, as in another run of the program
+// that wrote it), or copied with the ids of this process if not.
+class ParallelCorpus {
+ public:
+  ParallelCorpus() : num_sents_(0), src_(NULL), src_ends_(NULL), trg_(NULL), trg_ends_(NULL),
+                     data_(NULL), size_(0) {}
+  ~ParallelCorpus();
+  static bool IsCache(const std::string& fname);
+  // reads the text or cache fname, aborting on sentences with no words
+  void Read(const std::string& fname);
+  void WriteCache(const std::string& fname) const;
+
+  unsigned size() const { return num_sents_; }
+  // the words of sentence i are [src(i), src(i) + src_size(i))
+  const WordID* src(unsigned i) const { return src_ + (i ? src_ends_[i - 1] : 0); }
+  unsigned src_size(unsigned i) const { return src_ends_[i] - (i ? src_ends_[i - 1] : 0); }
+  const WordID* trg(unsigned i) const { return trg_ + (i ? trg_ends_[i - 1] : 0); }
+  unsigned trg_size(unsigned i) const { return trg_ends_[i] - (i ? trg_ends_[i - 1] : 0); }
+
+ private:
+  void ReadText(const std::string& fname);
+  void ReadCache(const std::string& fname);
+  void UseOwnArrays();
+
+  unsigned num_sents_;
+  const WordID* src_;
+  const uint64_t* src_ends_;
+  const WordID* trg_;
+  const uint64_t* trg_ends_;
+  // what they point to, unless it is the cache
+  std::vector<WordID> src_words_;
+  std::vector<uint64_t> src_word_ends_;
+  std::vector<WordID> trg_words_;
+  std::vector<uint64_t> trg_word_ends_;
+  void* data_;  // the mapped cache
+  size_t size_;
+};
+
+#endif
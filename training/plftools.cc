@@ -1,11 +1,20 @@
 char const* NOTES =
   "Process (PLF format) lattice: sharpen distribution, nbest, graphviz, push weights\n"
+  "Lattices are read into flat lattices (arc cost = weighted sum of the arc's\n"
+  "values), optionally epsilon-free and pruned, and streamed through --threads\n"
+  "threads in chunks; only nbest and graphviz build a hypergraph\n"
   ;
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <vector>
+#include <map>
+#include <cmath>
+#include <limits>
 
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/program_options.hpp>
 
@@ -14,6 +23,7 @@ char const* NOTES =
 #include "prob.h"
 #include "hg.h"
 #include "hg_io.h"
+#include "lattice.h"
 #include "viterbi.h"
 #include "kbest.h"
 
@@ -27,7 +37,11 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
         ("prior_scale,p", po::value<double>()->default_value(1.0), "Scale path probabilities by this amount < 1 flattens, > 1 sharpens")
         ("weight,w", po::value<vector<double> >(), "Weight(s) for arc features")
 	("output,o", po::value<string>()->default_value("plf"), "Output format (text, plf)")
-	("command,c", po::value<string>()->default_value("push"), "Operation to perform: push, graphviz, 1best, 2best ...")
+	("command,c", po::value<string>()->default_value("push"), "Operation to perform: push, plf, graphviz, 1best, 2best ...")
+        ("remove_epsilons,e", "Remove epsilon arcs first, folding their costs into the arcs that follow them (or, before the final column, precede them)")
+        ("epsilon", po::value<string>()->default_value("*EPS*"), "Label of epsilon arcs")
+        ("prune_posterior,P", po::value<double>(), "Then remove the arcs whose posterior (with the prior scale) is below this, keeping the best path")
+        ("threads,t", po::value<int>()->default_value(1), "Number of threads to process lattices with (graphviz uses one)")
         ("help,h", "Print this help message and exit");
   po::options_description clo("Command line options");
   po::options_description dcmdline_options;
@@ -42,6 +56,311 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   }
 }
 
+static const double kLOG0 = -numeric_limits<double>::infinity();
+
+inline double LogAdd(double a, double b) {
+  if (a < b) swap(a, b);
+  if (b == kLOG0) return a;
+  return a + log1p(exp(b - a));
+}
+
+// arcs leave column i for column i + dist2next, the final node is l.size()
+// fwd: log of the summed (cost * scale) of the paths from node 0 to each node
+// bwd: the same for the paths from each node to the final node
+void ForwardBackward(const Lattice& l, double scale, vector<double>* fwd, vector<double>* bwd) {
+  const int n = l.size() + 1;
+  fwd->assign(n, kLOG0);
+  bwd->assign(n, kLOG0);
+  (*fwd)[0] = 0;
+  (*bwd)[n - 1] = 0;
+  for (int i = 0; i < l.size(); ++i)
+    for (int j = 0; j < l[i].size(); ++j) {
+      const LatticeArc& a = l[i][j];
+      double& f = (*fwd)[i + a.dist2next];
+      f = LogAdd(f, (*fwd)[i] + scale * a.cost);
+    }
+  for (int i = l.size() - 1; i >= 0; --i)
+    for (int j = 0; j < l[i].size(); ++j) {
+      const LatticeArc& a = l[i][j];
+      (*bwd)[i] = LogAdd((*bwd)[i], scale * a.cost + (*bwd)[i + a.dist2next]);
+    }
+}
+
+// removes the arcs that are not on a path from node 0 to the final node
+// (keep, if not NULL, says which arcs may stay at all) and the columns no
+// path goes through
+void Trim(const vector<vector<bool> >* keep, Lattice* pl) {
+  Lattice& l = *pl;
+  const int n = l.size() + 1;
+  vector<bool> from_start(n, false), to_end(n, false);
+  from_start[0] = true;
+  to_end[n - 1] = true;
+  for (int i = 0; i < l.size(); ++i)
+    for (int j = 0; j < l[i].size(); ++j)
+      if (from_start[i] && (!keep || (*keep)[i][j])) from_start[i + l[i][j].dist2next] = true;
+  for (int i = l.size() - 1; i >= 0; --i)
+    for (int j = 0; j < l[i].size() && !to_end[i]; ++j)
+      if (to_end[i + l[i][j].dist2next] && (!keep || (*keep)[i][j])) to_end[i] = true;
+  vector<int> new_id(n, -1);
+  int live = 0;
+  for (int i = 0; i < n; ++i)
+    if (from_start[i] && to_end[i]) new_id[i] = live++;
+  if (new_id[0] < 0) { l.clear(); return; }  // no path at all
+  Lattice res(live - 1);
+  for (int i = 0; i < l.size(); ++i) {
+    if (new_id[i] < 0) continue;
+    for (int j = 0; j < l[i].size(); ++j) {
+      LatticeArc a = l[i][j];
+      const int t = new_id[i + a.dist2next];
+      if (t < 0 || (keep && !(*keep)[i][j])) continue;
+      a.dist2next = t - new_id[i];
+      res[new_id[i]].push_back(a);
+    }
+  }
+  l.swap(res);
+}
+
+// adds arc to the arcs leaving a column, summing (in the log domain) the
+// costs of arcs with the same label and target; index maps those to arcs
+void AddArc(const LatticeArc& arc, map<pair<WordID, int>, int>* index, vector<LatticeArc>* arcs) {
+  const pair<map<pair<WordID, int>, int>::iterator, bool> r =
+    index->insert(make_pair(make_pair(arc.label, arc.dist2next), arcs->size()));
+  if (r.second)
+    arcs->push_back(arc);
+  else
+    (*arcs)[r.first->second].cost = LogAdd((*arcs)[r.first->second].cost, arc.cost);
+}
+
+// an epsilon arc i->j is replaced by copies of the arcs leaving j (which are
+// epsilon free already, going right to left) with its cost added. Epsilon
+// arcs into the final node are replaced by copies of the arcs entering
+// their source instead; only one leaving node 0 can't be removed.
+void RemoveEpsilons(WordID eps, Lattice* pl) {
+  Lattice& l = *pl;
+  const int final = l.size();
+  bool to_final = false;
+  for (int i = l.size() - 1; i >= 0; --i) {
+    bool has_eps = false;
+    for (int j = 0; j < l[i].size() && !has_eps; ++j)
+      has_eps = l[i][j].label == eps && i + l[i][j].dist2next != final;
+    if (!has_eps) continue;
+    vector<LatticeArc> arcs;
+    map<pair<WordID, int>, int> index;
+    for (int j = 0; j < l[i].size(); ++j) {
+      const LatticeArc& a = l[i][j];
+      const int t = i + a.dist2next;
+      if (a.label != eps || t == final) {
+        AddArc(a, &index, &arcs);
+        continue;
+      }
+      for (int k = 0; k < l[t].size(); ++k) {
+        const LatticeArc& b = l[t][k];
+        AddArc(LatticeArc(b.label, a.cost + b.cost, b.dist2next + a.dist2next), &index, &arcs);
+      }
+    }
+    l[i].swap(arcs);
+  }
+  for (int i = 1; i < l.size() && !to_final; ++i)
+    for (int j = 0; j < l[i].size() && !to_final; ++j)
+      to_final = l[i][j].label == eps;  // only those into the final node are left
+  if (to_final) {
+    // eps_cost[i]: the (summed) cost of the epsilon arcs from i to the end
+    vector<double> eps_cost(l.size(), kLOG0);
+    for (int i = 1; i < l.size(); ++i) {
+      vector<LatticeArc> arcs;
+      for (int j = 0; j < l[i].size(); ++j) {
+        if (l[i][j].label == eps)
+          eps_cost[i] = LogAdd(eps_cost[i], l[i][j].cost);
+        else
+          arcs.push_back(l[i][j]);
+      }
+      l[i].swap(arcs);
+    }
+    for (int h = 0; h < l.size(); ++h) {
+      vector<LatticeArc> arcs;
+      map<pair<WordID, int>, int> index;
+      for (int j = 0; j < l[h].size(); ++j) {
+        const LatticeArc& a = l[h][j];
+        AddArc(a, &index, &arcs);
+        const int t = h + a.dist2next;
+        if (t < final && eps_cost[t] != kLOG0 && a.label != eps)
+          AddArc(LatticeArc(a.label, a.cost + eps_cost[t], final - h), &index, &arcs);
+      }
+      l[h].swap(arcs);
+    }
+  }
+  Trim(NULL, pl);
+}
+
+// keeps the arcs with a posterior of at least threshold and those of the
+// best path
+void PrunePosterior(double threshold, double scale, Lattice* pl) {
+  Lattice& l = *pl;
+  if (l.empty()) return;
+  vector<double> fwd, bwd;
+  ForwardBackward(l, scale, &fwd, &bwd);
+  const double log_z = fwd.back();
+  const double log_threshold = log(threshold);
+  vector<vector<bool> > keep(l.size());
+  for (int i = 0; i < l.size(); ++i) {
+    keep[i].resize(l[i].size());
+    for (int j = 0; j < l[i].size(); ++j) {
+      const LatticeArc& a = l[i][j];
+      keep[i][j] = fwd[i] + scale * a.cost + bwd[i + a.dist2next] - log_z >= log_threshold;
+    }
+  }
+  // Viterbi, right to left, then follow the best arcs from node 0
+  vector<double> best(l.size() + 1, kLOG0);
+  vector<int> best_arc(l.size(), -1);
+  best.back() = 0;
+  for (int i = l.size() - 1; i >= 0; --i)
+    for (int j = 0; j < l[i].size(); ++j) {
+      const double s = l[i][j].cost + best[i + l[i][j].dist2next];
+      if (best_arc[i] < 0 || s > best[i]) { best[i] = s; best_arc[i] = j; }
+    }
+  for (int i = 0; i < l.size() && best_arc[i] >= 0; i += l[i][best_arc[i]].dist2next)
+    keep[i][best_arc[i]] = true;
+  Trim(&keep, pl);
+}
+
+// replaces the costs by their (scaled) posteriors given the source node, as
+// Hypergraph::PushWeightsToSource does
+void PushWeightsToSource(double scale, Lattice* pl) {
+  Lattice& l = *pl;
+  vector<double> fwd, bwd;
+  ForwardBackward(l, scale, &fwd, &bwd);
+  for (int i = 0; i < l.size(); ++i)
+    for (int j = 0; j < l[i].size(); ++j) {
+      LatticeArc& a = l[i][j];
+      a.cost = scale * a.cost + bwd[i + a.dist2next] - bwd[i];
+    }
+}
+
+// the lattice as a hypergraph with edge probabilities exp(cost), as
+// HypergraphIO::ReadFromPLF reads it, plus an empty axiom edge into node 0,
+// which k-best extraction needs to start its derivations from
+void LatticeToHypergraph(const Lattice& l, Hypergraph* hg) {
+  static const int kFEATURE_0 = FD::Convert("Feature_0");
+  hg->clear();
+  hg->ResizeNodes(l.size() + 1);
+  Hypergraph::Edge* axiom = hg->AddEdge(TRulePtr(new TRule(vector<WordID>())), Hypergraph::TailNodeVector());
+  hg->ConnectEdgeToHeadNode(axiom, &hg->nodes_[0]);
+  axiom->edge_prob_ = prob_t::One();
+  vector<WordID> ewords(2, 0);
+  for (int i = 0; i < l.size(); ++i) {
+    for (int j = 0; j < l[i].size(); ++j) {
+      const LatticeArc& a = l[i][j];
+      ewords[1] = a.label;
+      TRulePtr r(new TRule(ewords));
+      r->ComputeArity();
+      Hypergraph::TailNodeVector tail(1, i);
+      Hypergraph::Edge* edge = hg->AddEdge(r, tail);
+      hg->ConnectEdgeToHeadNode(edge, &hg->nodes_[i + a.dist2next]);
+      edge->feature_values_.set_value(kFEATURE_0, a.cost);
+      edge->edge_prob_.logeq(a.cost);
+    }
+  }
+}
+
+struct PLFOptions {
+  vector<double> weights;
+  double scale;
+  bool remove_epsilons;
+  WordID eps;
+  double prune_threshold;  // none if <= 0
+  bool push_weights;
+  bool output_plf;
+  bool graphviz;
+  int k;
+};
+
+// processes one lattice, writing the results to out
+void ProcessLattice(const PLFOptions& opts, int lc, const string& plf, ostream* out) {
+  Lattice l;
+  HypergraphIO::PLFtoLattice(plf, &l, &opts.weights);
+  if (opts.remove_epsilons) RemoveEpsilons(opts.eps, &l);
+  if (opts.prune_threshold > 0) PrunePosterior(opts.prune_threshold, opts.scale, &l);
+  if (opts.push_weights) PushWeightsToSource(opts.scale, &l);
+  if (opts.output_plf) {
+    (*out) << HypergraphIO::AsPLF(l) << endl;
+    return;
+  }
+  Hypergraph hg;
+  LatticeToHypergraph(l, &hg);
+  if (opts.graphviz) hg.PrintGraphviz();
+  KBest::KBestDerivations<vector<WordID>, ESentenceTraversal> kbest(hg, opts.k);
+  for (int i = 0; i < opts.k; ++i) {
+    const KBest::KBestDerivations<vector<WordID>, ESentenceTraversal>::Derivation* d =
+      kbest.LazyKthBest(hg.nodes_.size() - 1, i);
+    if (!d) break;
+    (*out) << lc << " ||| " << TD::GetString(d->yield) << " ||| " << d->score << endl;
+  }
+}
+
+// hands out the lattices in chunks to the threads and writes their output
+// in input order
+class ParallelLattices {
+ public:
+  ParallelLattices(const PLFOptions& opts, int chunk_size, istream* in, ostream* out) :
+      opts_(opts), chunk_size_(chunk_size), in_(in), out_(out), lc_(), next_chunk_(), next_out_() {}
+
+  void Run(int threads) {
+    if (threads > 1) {
+      boost::thread_group workers;
+      for (int i = 0; i < threads; ++i)
+        workers.create_thread(boost::bind(&ParallelLattices::RunThread, this));
+      workers.join_all();
+    } else {
+      RunThread();
+    }
+  }
+
+ private:
+  // the non-empty lines of the next chunk, with their line numbers
+  bool NextChunk(int* chunk, vector<pair<int, string> >* lines) {
+    boost::mutex::scoped_lock l(in_mutex_);
+    lines->clear();
+    *chunk = next_chunk_++;
+    string plf;
+    while (lines->size() < chunk_size_ && getline(*in_, plf)) {
+      ++lc_;
+      if (!plf.empty()) lines->push_back(make_pair(lc_, plf));
+    }
+    return !lines->empty();
+  }
+
+  void RunThread() {
+    int chunk;
+    vector<pair<int, string> > lines;
+    while (NextChunk(&chunk, &lines)) {
+      ostringstream os;
+      for (int i = 0; i < lines.size(); ++i)
+        ProcessLattice(opts_, lines[i].first, lines[i].second, &os);
+      boost::mutex::scoped_lock l(out_mutex_);
+      done_[chunk] = os.str();
+      map<int, string>::iterator it;
+      while ((it = done_.find(next_out_)) != done_.end()) {
+        (*out_) << it->second << flush;
+        done_.erase(it);
+        ++next_out_;
+      }
+    }
+  }
+
+  const PLFOptions& opts_;
+  const int chunk_size_;
+  istream* in_;
+  ostream* out_;
+  int lc_;
+  int next_chunk_;
+  int next_out_;
+  map<int, string> done_;  // output of the finished chunks not written yet
+  boost::mutex in_mutex_;
+  boost::mutex out_mutex_;
+};
+
+static const int kCHUNK_SIZE = 100;
+
 int main(int argc, char **argv) {
   po::variables_map conf;
   InitCommandLine(argc, argv, &conf);
@@ -49,49 +368,27 @@ int main(int argc, char **argv) {
   ReadFile rf(infile);
   istream* in = rf.stream();
   assert(*in);
-  SparseVector<double> wts;
-  vector<double> wv;
-  if (conf.count("weight") > 0) wv = conf["weight"].as<vector<double> >();
-  if (wv.empty()) wv.push_back(1.0);
-  for (int i = 0; i < wv.size(); ++i) {
-    const string fname = "Feature_" + boost::lexical_cast<string>(i);
-    cerr << "[INFO] Arc weight " << (i+1) << " = " << wv[i] << endl;
-    wts.set_value(FD::Convert(fname), wv[i]);
-  }
+  PLFOptions opts;
+  if (conf.count("weight") > 0) opts.weights = conf["weight"].as<vector<double> >();
+  if (opts.weights.empty()) opts.weights.push_back(1.0);
+  for (int i = 0; i < opts.weights.size(); ++i)
+    cerr << "[INFO] Arc weight " << (i+1) << " = " << opts.weights[i] << endl;
   const string cmd = conf["command"].as<string>();
-  const bool push_weights = cmd == "push";
-  const bool output_plf = cmd == "plf";
-  const bool graphviz = cmd == "graphviz";
+  opts.push_weights = cmd == "push";
+  opts.output_plf = cmd == "plf";
+  opts.graphviz = cmd == "graphviz";
   const bool kbest = cmd.rfind("best") == (cmd.size() - 4) && cmd.size() > 4;
-  int k = 1;
+  opts.k = 1;
   if (kbest) {
-    k = boost::lexical_cast<int>(cmd.substr(0, cmd.size() - 4));
-    cerr << "KBEST = " << k << endl;
-  }
-  const double scale = conf["prior_scale"].as<double>();
-  int lc = 0;
-  while(*in) {
-    ++lc;
-    string plf;
-    getline(*in, plf);
-    if (plf.empty()) continue;
-    Hypergraph hg;
-    HypergraphIO::ReadFromPLF(plf, &hg);
-    hg.Reweight(wts);
-    if (graphviz) hg.PrintGraphviz();
-    if (push_weights) hg.PushWeightsToSource(scale);
-    if (output_plf) {
-      cout << HypergraphIO::AsPLF(hg) << endl;
-    } else {
-      KBest::KBestDerivations<vector<WordID>, ESentenceTraversal> kbest(hg, k);
-      for (int i = 0; i < k; ++i) {
-        const KBest::KBestDerivations<vector<WordID>, ESentenceTraversal>::Derivation* d =
-          kbest.LazyKthBest(hg.nodes_.size() - 1, i);
-        if (!d) break;
-        cout << lc << " ||| " << TD::GetString(d->yield) << " ||| " << d->score << endl;
-      }
-    }
+    opts.k = boost::lexical_cast<int>(cmd.substr(0, cmd.size() - 4));
+    cerr << "KBEST = " << opts.k << endl;
   }
+  opts.scale = conf["prior_scale"].as<double>();
+  opts.remove_epsilons = conf.count("remove_epsilons");
+  opts.eps = TD::Convert(conf["epsilon"].as<string>());
+  opts.prune_threshold = conf.count("prune_posterior") ? conf["prune_posterior"].as<double>() : 0;
+  // graphviz output goes straight to cout, so it is done lattice by lattice
+  const int threads = opts.graphviz ? 1 : max(1, conf["threads"].as<int>());
+  ParallelLattices(opts, opts.graphviz ? 1 : kCHUNK_SIZE, in, &cout).Run(threads);
   return 0;
 }
-
@@ -0,0 +1,363 @@
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/program_options.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+#include "bounded_queue.h"
+#include "weights.h"
+#include "filelib.h"
+#include "stringlib.h"
+#include "tdict.h"
+#include "fdict.h"
+#include "sparse_vector.h"
+#include "hg.h"
+#include "ff.h"
+#include "ff_register.h"
+#include "apply_models.h"
+#include "sentence_metadata.h"
+#include "viterbi.h"
+#include "ttables.h"
+#include "verbose.h"
+
+namespace po = boost::program_options;
+using namespace std;
+
+bool InitCommandLine(int argc, char** argv, po::variables_map* conf) {
+  po::options_description opts("Configuration options");
+  opts.add_options()
+        ("feature_function,F", po::value<vector<string> >()->composing(), "Feature function(s) to score the hypotheses with, as for cdec (stateless features and language models)")
+        ("source,s", po::value<string>(), "Source sentences, one per line, numbered from 0 as the k-best list ids; needed by source dependent features and --model1")
+        ("model1,m", po::value<string>(), "Add the log probability of the source given the hypothesis under this Model 1 (e f log_p lines, as written by model1)")
+        ("model1_feature_name", po::value<string>()->default_value("M1SrcGivenTrg"), "Name of the --model1 feature")
+        ("weights,w", po::value<string>(), "Rerank with these weights and write the 1-best hypotheses (or, with --kbest, the reranked lists)")
+        ("kbest,k", "With --weights, write the reranked k-best lists with their new scores instead of the 1-best")
+        ("threads,j", po::value<int>()->default_value(1), "Number of threads to rescore sentences with")
+        ("input,i", po::value<string>()->default_value("-"), "k-best lists (id ||| hypothesis ||| features), grouped by sentence");
+  po::options_description clo("Command line options");
+  clo.add_options()
+        ("config,c", po::value<string>(), "Configuration file; may be a cdec.ini, whose options this tool doesn't have are ignored")
+        ("help,h", "Print this help message and exit");
+  po::options_description dconfig_options, dcmdline_options;
+  po::positional_options_description p;
+  p.add("input", 1);
+
+  dconfig_options.add(opts);
+  dcmdline_options.add(opts).add(clo);
+
+  po::store(po::command_line_parser(argc, argv).options(dcmdline_options).positional(p).run(), *conf);
+  if (conf->count("config")) {
+    ifstream config((*conf)["config"].as<string>().c_str());
+    po::store(po::parse_config_file(config, dconfig_options, true), *conf);
+  }
+  po::notify(*conf);
+
+  if (conf->count("help") || (!conf->count("feature_function") && !conf->count("model1") && !conf->count("weights"))) {
+    cerr << "Usage " << argv[0] << " [OPTIONS] [kbest.txt]\n"
+            "Adds the features of cdec feature functions and Model 1 to k-best lists,\n"
+            "and optionally reranks them.\n";
+    cerr << dcmdline_options << endl;
+    return false;
+  }
+  if (conf->count("model1") && !conf->count("source")) {
+    cerr << "--model1 requires --source\n";
+    return false;
+  }
+  return true;
+}
+
+struct Hyp {
+  string text;
+  SparseVector<double> feats;
+  double score;
+};
+
+struct ByScore {
+  bool operator()(const Hyp* a, const Hyp* b) const { return a->score > b->score; }
+};
+
+// log P(src | hyp) under Model 1, with a NULL word in hyp and uniform
+// alignment probabilities; pairs not in the table get log_p = -100
+static double Model1LogProb(const TTable& tt, const vector<WordID>& src, vector<WordID> hyp) {
+  hyp.push_back(TD::Convert("<eps>"));
+  const double log_len = log(static_cast<double>(hyp.size()));
+  double lp = 0;
+  for (unsigned j = 0; j < src.size(); ++j) {
+    double sum = 0;
+    for (unsigned i = 0; i < hyp.size(); ++i) {
+      const int k = tt.index(hyp[i], src[j]);
+      sum += exp(k < 0 ? -100.0 : tt.prob(k));
+    }
+    lp += log(sum) - log_len;
+  }
+  return lp;
+}
+
+// what each rescoring thread has of its own: feature functions keep
+// per-sentence state, so every thread creates them (language models loaded
+// from the same file are still shared).
+struct Rescorer {
+  Rescorer(const vector<string>& ffs, const vector<double>& weights) :
+      goal_rule_(new TRule("[Goal] ||| [X,1] ||| [1]")), kX_(-TD::Convert("X")) {
+    for (unsigned i = 0; i < ffs.size(); ++i) {
+      string ff, param;
+      SplitCommandAndParam(ffs[i], &ff, &param);
+      boost::shared_ptr<FeatureFunction> pf = ff_registry.Create(ff, param);
+      if (!pf) exit(1);
+      ffs_.push_back(pf);
+      models_.push_back(pf.get());
+    }
+    model_set_.reset(new ModelSet(weights, models_));
+  }
+
+  // the features the models give to hyp as a translation of src: hyp is
+  // made into the only derivation of a two node forest, which the models
+  // are applied to exactly as in decoding
+  void Score(int id, const vector<WordID>& src, const vector<WordID>& hyp, SparseVector<double>* feats) const {
+    if (models_.empty()) return;
+    Hypergraph hg;
+    TRulePtr rule(new TRule(hyp, src, kX_));
+    Hypergraph::TailNodeVector tail;
+    Hypergraph::Edge* edge = hg.AddEdge(rule, tail);
+    edge->i_ = 0;
+    edge->j_ = src.size();
+    hg.ConnectEdgeToHeadNode(edge, hg.AddNode(kX_));
+    tail.push_back(0);
+    edge = hg.AddEdge(goal_rule_, tail);
+    edge->i_ = 0;
+    edge->j_ = src.size();
+    hg.ConnectEdgeToHeadNode(edge, hg.AddNode(-TD::Convert("Goal")));
+
+    SentenceMetadata smeta(id, Lattice());
+    smeta.SetSourceLength(src.size());
+    smeta.src_lattice_.resize(src.size());
+    for (unsigned j = 0; j < src.size(); ++j)
+      smeta.src_lattice_[j].push_back(LatticeArc(src[j], 0.0, 1));
+    Hypergraph out;
+    ApplyModelSet(hg, smeta, *model_set_, IntersectionConfiguration(exhaustive_t()), &out);
+    const SparseVector<double> fired = ViterbiFeatures(out);
+    for (SparseVector<double>::const_iterator it = fired.begin(); it != fired.end(); ++it)
+      feats->set_value(it->first, it->second);
+  }
+
+  const TRulePtr goal_rule_;
+  const WordID kX_;
+  vector<boost::shared_ptr<FeatureFunction> > ffs_;
+  vector<const FeatureFunction*> models_;
+  boost::shared_ptr<ModelSet> model_set_;
+};
+
+// reads the k-best lists on the calling thread, one sentence at a time, has
+// the worker threads rescore (and rerank) them and a writer thread put them
+// out in input order.  As with augment_grammar, the reader stays at most
+// window sentences ahead of the writer.
+class ParallelRescore {
+ public:
+  typedef boost::shared_ptr<vector<Hyp> > HypList;
+  struct Input {
+    int n;
+    string id;
+    HypList hyps;
+  };
+  typedef pair<int, string> Output;
+
+  ParallelRescore(istream* in, ostream* out, unsigned threads) :
+    tt_(NULL), m1_fid_(0), weights_(NULL), kbest_(false),
+    in_(in), out_(out), threads_(threads), inputs_(2 * threads), outputs_(2 * threads),
+    window_(8 * threads), next_id_(0), written_(0) {}
+
+  void Run() {
+    boost::thread writer(boost::bind(&ParallelRescore::Write, this));
+    boost::thread_group workers;
+    vector<boost::shared_ptr<Rescorer> > rescorers;
+    static const vector<double> kNO_WEIGHTS;
+    for (unsigned i = 0; i < threads_; ++i) {
+      rescorers.push_back(boost::shared_ptr<Rescorer>(new Rescorer(ffs_, weights_ ? *weights_ : kNO_WEIGHTS)));
+      workers.create_thread(boost::bind(&ParallelRescore::Rescore, this, rescorers.back().get()));
+    }
+    Read();
+    inputs_.Close();
+    workers.join_all();
+    outputs_.Close();
+    writer.join();
+  }
+
+  vector<string> ffs_;
+  vector<string> source_;
+  const TTable* tt_;
+  int m1_fid_;
+  const vector<double>* weights_;
+  bool kbest_;
+
+ private:
+  void Read() {
+    Input cur;
+    string line;
+    while(getline(*in_, line)) {
+      if (line.empty()) continue;
+      const size_t p1 = line.find(" ||| ");
+      const size_t p2 = p1 == string::npos ? p1 : line.find(" ||| ", p1 + 5);
+      if (p2 == string::npos) {
+        cerr << "Bad format: " << line << endl;
+        exit(1);
+      }
+      const string id = line.substr(0, p1);
+      if (cur.hyps && id != cur.id) Flush(&cur);
+      if (!cur.hyps) {
+        cur.id = id;
+        cur.hyps.reset(new vector<Hyp>);
+      }
+      cur.hyps->push_back(Hyp());
+      Hyp& h = cur.hyps->back();
+      h.text = line.substr(p1 + 5, p2 - p1 - 5);
+      // the features are the third field; a fourth (the model score) is dropped
+      const size_t p3 = line.find(" ||| ", p2 + 5);
+      const string feats = line.substr(p2 + 5, p3 == string::npos ? string::npos : p3 - p2 - 5);
+      vector<string> pairs;
+      SplitOnWhitespace(feats, &pairs);
+      for (unsigned i = 0; i < pairs.size(); ++i) {
+        const size_t eq = pairs[i].rfind('=');
+        if (eq == string::npos) {
+          cerr << "Bad feature " << pairs[i] << " in: " << line << endl;
+          exit(1);
+        }
+        h.feats.set_value(FD::Convert(pairs[i].substr(0, eq)), strtod(pairs[i].c_str() + eq + 1, NULL));
+      }
+    }
+    if (cur.hyps) Flush(&cur);
+  }
+
+  void Flush(Input* cur) {
+    {
+      boost::mutex::scoped_lock l(window_mutex_);
+      while (next_id_ - written_ >= window_)
+        window_cond_.wait(l);
+    }
+    cur->n = next_id_++;
+    inputs_.Push(*cur);
+    cur->hyps.reset();
+  }
+
+  void Rescore(const Rescorer* rescorer) {
+    Input in;
+    while (inputs_.Pop(&in)) {
+      const int sent = atoi(in.id.c_str());
+      vector<WordID> src;
+      if (!source_.empty()) {
+        if (sent < 0 || sent >= static_cast<int>(source_.size())) {
+          cerr << "Sentence id " << in.id << " is not in the source (" << source_.size() << " sentences)\n";
+          exit(1);
+        }
+        TD::ConvertSentence(source_[sent], &src);
+      }
+      vector<Hyp>& hyps = *in.hyps;
+      // k-best lists of derivations repeat strings, which get the same features
+      map<string, SparseVector<double> > cache;
+      vector<WordID> hyp;
+      for (unsigned i = 0; i < hyps.size(); ++i) {
+        map<string, SparseVector<double> >::iterator it = cache.find(hyps[i].text);
+        if (it == cache.end()) {
+          it = cache.insert(make_pair(hyps[i].text, SparseVector<double>())).first;
+          TD::ConvertSentence(hyps[i].text, &hyp);
+          rescorer->Score(sent, src, hyp, &it->second);
+          if (tt_) it->second.set_value(m1_fid_, Model1LogProb(*tt_, src, hyp));
+        }
+        for (SparseVector<double>::const_iterator f = it->second.begin(); f != it->second.end(); ++f)
+          hyps[i].feats.set_value(f->first, f->second);
+      }
+
+      ostringstream os;
+      if (!weights_) {
+        for (unsigned i = 0; i < hyps.size(); ++i)
+          os << in.id << " ||| " << hyps[i].text << " ||| " << hyps[i].feats << '\n';
+      } else {
+        vector<Hyp*> sorted(hyps.size());
+        for (unsigned i = 0; i < hyps.size(); ++i) {
+          hyps[i].score = hyps[i].feats.dot(*weights_);
+          sorted[i] = &hyps[i];
+        }
+        stable_sort(sorted.begin(), sorted.end(), ByScore());
+        if (kbest_) {
+          for (unsigned i = 0; i < sorted.size(); ++i)
+            os << in.id << " ||| " << sorted[i]->text << " ||| " << sorted[i]->feats << " ||| " << sorted[i]->score << '\n';
+        } else {
+          os << sorted[0]->text << '\n';
+        }
+      }
+      outputs_.Push(Output(in.n, os.str()));
+    }
+  }
+
+  void Write() {
+    map<int, string> pending;
+    int next_out = 0;
+    Output item;
+    while (outputs_.Pop(&item)) {
+      pending[item.first].swap(item.second);
+      map<int, string>::iterator it;
+      while ((it = pending.find(next_out)) != pending.end()) {
+        (*out_) << it->second;
+        pending.erase(it);
+        ++next_out;
+      }
+      boost::mutex::scoped_lock l(window_mutex_);
+      written_ = next_out;
+      window_cond_.notify_one();
+    }
+    out_->flush();
+  }
+
+  istream* in_;
+  ostream* out_;
+  const unsigned threads_;
+  BoundedQueue<Input> inputs_;
+  BoundedQueue<Output> outputs_;
+  const int window_;
+  int next_id_;
+  int written_;
+  boost::mutex window_mutex_;
+  boost::condition_variable window_cond_;
+};
+
+int main(int argc, char** argv) {
+  po::variables_map conf;
+  if (!InitCommandLine(argc, argv, &conf)) return 1;
+  register_feature_functions();
+  SetSilent(true);  // turn off verbose decoder output
+  const int threads = max(1, conf["threads"].as<int>());
+  ReadFile rf(conf["input"].as<string>());
+  ParallelRescore pr(rf.stream(), &cout, threads);
+  if (conf.count("feature_function"))
+    pr.ffs_ = conf["feature_function"].as<vector<string> >();
+  if (conf.count("source")) {
+    ReadFile sf(conf["source"].as<string>());
+    string line;
+    while(getline(*sf.stream(), line)) pr.source_.push_back(line);
+    cerr << "Read " << pr.source_.size() << " source sentences\n";
+  }
+  TTable tt;
+  if (conf.count("model1")) {
+    ReadFile mf(conf["model1"].as<string>());
+    tt.DeserializeProbsFromText(mf.stream());
+    pr.tt_ = &tt;
+    pr.m1_fid_ = FD::Convert(conf["model1_feature_name"].as<string>());
+  }
+  vector<double> weights;
+  if (conf.count("weights")) {
+    Weights w;
+    w.InitFromFile(conf["weights"].as<string>());
+    w.InitVector(&weights);
+    pr.weights_ = &weights;
+    pr.kbest_ = conf.count("kbest") > 0;
+  }
+  pr.Run();
+  return 0;
+}
@@ -0,0 +1,93 @@
+#include "sorted_feature_stream.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <stdint.h>
+
+#include "fdict.h"
+
+using namespace std;
+
+static const char kSFS_MAGIC[8] = { 'c', 'd', 'e', 'c', 'S', 'F', 'S', '1' };
+
+SortedFeatureSink::~SortedFeatureSink() {}
+
+SortedFeatureWriter::SortedFeatureWriter(ostream* out) : out_(out), first_(true) {
+  out_->write(kSFS_MAGIC, sizeof(kSFS_MAGIC));
+}
+
+void SortedFeatureWriter::Write(const string& name, double value) {
+  if (!first_ && !(last_ < name)) {
+    cerr << "SortedFeatureWriter: " << name << " written after " << last_ << endl;
+    abort();
+  }
+  const uint32_t len = name.size();
+  out_->write(reinterpret_cast<const char*>(&len), sizeof(len));
+  out_->write(name.data(), len);
+  out_->write(reinterpret_cast<const char*>(&value), sizeof(value));
+  last_ = name;
+  first_ = false;
+}
+
+void SortedFeatureWriter::Write(const SparseVector<double>& v) {
+  vector<pair<string, double> > feats;
+  for (SparseVector<double>::const_iterator it = v.begin(); it != v.end(); ++it)
+    if (it->first && it->second) feats.push_back(make_pair(FD::Convert(it->first), it->second));
+  sort(feats.begin(), feats.end());
+  for (int i = 0; i < feats.size(); ++i)
+    Write(feats[i].first, feats[i].second);
+}
+
+SortedFeatureReader::SortedFeatureReader(istream* in, const string& name) : in_(in), file_(name) {
+  char magic[sizeof(kSFS_MAGIC)];
+  if (!in_->read(magic, sizeof(magic)) || memcmp(magic, kSFS_MAGIC, sizeof(magic)) != 0) {
+    cerr << file_ << " is not a sorted feature stream\n";
+    abort();
+  }
+}
+
+bool SortedFeatureReader::Next(string* name, double* value) {
+  uint32_t len;
+  if (!in_->read(reinterpret_cast<char*>(&len), sizeof(len))) {
+    if (in_->gcount() == 0) return false;
+    cerr << file_ << ": truncated record\n";
+    abort();
+  }
+  name->resize(len);
+  if ((len && !in_->read(&(*name)[0], len)) ||
+      !in_->read(reinterpret_cast<char*>(value), sizeof(*value))) {
+    cerr << file_ << ": truncated record\n";
+    abort();
+  }
+  return true;
+}
+
+void MergeSortedFeatures(const vector<SortedFeatureReader*>& in, SortedFeatureSink* out) {
+  // the next name of each stream, with its index
+  typedef pair<string, int> Head;
+  priority_queue<Head, vector<Head>, greater<Head> > heads;
+  vector<double> values(in.size());
+  string name;
+  for (int i = 0; i < in.size(); ++i)
+    if (in[i]->Next(&name, &values[i])) heads.push(Head(name, i));
+  while (!heads.empty()) {
+    const string cur = heads.top().first;
+    double sum = 0;
+    while (!heads.empty() && heads.top().first == cur) {
+      const int i = heads.top().second;
+      heads.pop();
+      sum += values[i];
+      if (in[i]->Next(&name, &values[i])) {
+        if (!(cur < name)) {
+          cerr << "Stream " << i << " is not sorted: " << name << " after " << cur << endl;
+          abort();
+        }
+        heads.push(Head(name, i));
+      }
+    }
+    if (sum) out->Write(cur, sum);
+  }
+}
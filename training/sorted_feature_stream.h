@@ -0,0 +1,53 @@
+#ifndef _SORTED_FEATURE_STREAM_H_
+#define _SORTED_FEATURE_STREAM_H_
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "sparse_vector.h"
+
+// A binary stream of (feature name, value) records sorted by name, with
+// each name at most once, so that streams written by different processes
+// can be summed by merging them (see merge_expectations.cc) with one record
+// per stream in memory, and the sum is a stream of the same kind.  Names
+// and not feature ids are the keys, since every process gives features
+// its own ids.
+//   stream: magic "cdecSFS1", then records
+//   record: uint32 name length, name bytes, double value (host order)
+
+// gets features in increasing order of their names
+struct SortedFeatureSink {
+  virtual ~SortedFeatureSink();
+  virtual void Write(const std::string& name, double value) = 0;
+};
+
+class SortedFeatureWriter : public SortedFeatureSink {
+ public:
+  explicit SortedFeatureWriter(std::ostream* out);
+  // names must be written in increasing (byte) order
+  void Write(const std::string& name, double value);
+  // writes the nonzero features of v (sorting them by name)
+  void Write(const SparseVector<double>& v);
+ private:
+  std::ostream* out_;
+  std::string last_;
+  bool first_;
+};
+
+class SortedFeatureReader {
+ public:
+  // reads the magic; aborts if in is not a stream of this kind
+  explicit SortedFeatureReader(std::istream* in, const std::string& name = "input");
+  // false at the end of the stream; aborts if it is malformed
+  bool Next(std::string* name, double* value);
+ private:
+  std::istream* in_;
+  const std::string file_;
+};
+
+// sums the streams into *out in one pass, reading one record of each at a
+// time
+void MergeSortedFeatures(const std::vector<SortedFeatureReader*>& in, SortedFeatureSink* out);
+
+#endif
@@ -1,14 +1,110 @@
 #include "ttables.h"
 
 #include <cassert>
+#include <cmath>
 
 #include "dict.h"
 
 using namespace std;
 using namespace std::tr1;
 
+typedef vector<vector<pair<WordID, double> > > Rows;
+
+// adds the pairs of sparse to rows, sorting the rows that get some
+static void AddSparse(const TTable::Word2Word2Double& sparse, Rows* rows) {
+  vector<bool> added(rows->size(), false);
+  for (TTable::Word2Word2Double::const_iterator it = sparse.begin(); it != sparse.end(); ++it) {
+    if (it->first >= rows->size()) {
+      rows->resize(it->first + 1);
+      added.resize(it->first + 1, false);
+    }
+    vector<pair<WordID, double> >& row = (*rows)[it->first];
+    for (TTable::Word2Double::const_iterator j = it->second.begin(); j != it->second.end(); ++j)
+      row.push_back(*j);
+    added[it->first] = true;
+  }
+  for (int e = 0; e < rows->size(); ++e)
+    if (added[e]) sort((*rows)[e].begin(), (*rows)[e].end());
+}
+
+void TTable::SetRows(const Rows& rows) {
+  row_start_.resize(rows.size() + 1);
+  f_.clear();
+  probs_.clear();
+  row_start_[0] = 0;
+  for (int e = 0; e < rows.size(); ++e) {
+    for (int i = 0; i < rows[e].size(); ++i) {
+      f_.push_back(rows[e][i].first);
+      probs_.push_back(rows[e][i].second);
+    }
+    row_start_[e + 1] = f_.size();
+  }
+}
+
+void TTable::AddCounts(Counts* pc) {
+  Counts& c = *pc;
+  assert(c.dense.size() == counts_.dense.size());
+  for (int i = 0; i < c.dense.size(); ++i)
+    counts_.dense[i] += c.dense[i];
+  if (counts_.sparse.empty()) {
+    counts_.sparse.swap(c.sparse);
+    return;
+  }
+  for (Word2Word2Double::const_iterator it = c.sparse.begin(); it != c.sparse.end(); ++it) {
+    Word2Double& tgt = counts_.sparse[it->first];
+    for (Word2Double::const_iterator j = it->second.begin(); j != it->second.end(); ++j)
+      tgt[j->first] += j->second;
+  }
+}
+
+void TTable::Normalize(bool variational_bayes, double alpha) {
+  bool same_pairs = counts_.sparse.empty();
+  for (int i = 0; same_pairs && i < counts_.dense.size(); ++i)
+    same_pairs = (counts_.dense[i] != 0);
+  if (same_pairs) {
+    probs_.swap(counts_.dense);
+  } else {
+    Rows rows(this->rows());
+    for (WordID e = 0; e < this->rows(); ++e)
+      for (int i = row_begin(e); i < row_end(e); ++i)
+        if (counts_.dense[i]) rows[e].push_back(make_pair(f_[i], counts_.dense[i]));
+    AddSparse(counts_.sparse, &rows);
+    SetRows(rows);
+  }
+  for (WordID e = 0; e < rows(); ++e) {
+    double tot = 0;
+    for (int i = row_begin(e); i < row_end(e); ++i)
+      tot += probs_[i] + alpha;
+    for (int i = row_begin(e); i < row_end(e); ++i) {
+      if (variational_bayes)
+        probs_[i] = exp(digamma(probs_[i] + alpha) - digamma(tot));
+      else
+        probs_[i] /= tot;
+    }
+  }
+  InitCounts(&counts_);
+}
+
+void TTable::ShowTTable() const {
+  for (WordID e = 0; e < rows(); ++e)
+    for (int i = row_begin(e); i < row_end(e); ++i)
+      cerr << "P(" << TD::Convert(f_[i]) << '|' << TD::Convert(e) << ") = " << probs_[i] << endl;
+}
+
+void TTable::ShowCounts() const {
+  for (WordID e = 0; e < rows(); ++e)
+    for (int i = row_begin(e); i < row_end(e); ++i)
+      cerr << "c(" << TD::Convert(f_[i]) << '|' << TD::Convert(e) << ") = " << counts_.dense[i] << endl;
+  for (Word2Word2Double::const_iterator it = counts_.sparse.begin(); it != counts_.sparse.end(); ++it) {
+    const Word2Double& cpd = it->second;
+    for (Word2Double::const_iterator j = cpd.begin(); j != cpd.end(); ++j)
+      cerr << "c(" << TD::Convert(j->first) << '|' << TD::Convert(it->first) << ") = " << j->second << endl;
+  }
+}
+
 void TTable::DeserializeProbsFromText(std::istream* in) {
   int c = 0;
+  Word2Word2Double probs;
   while(*in) {
     string e;
     string f;
@@ -16,16 +112,11 @@ void TTable::DeserializeProbsFromText(std::istream* in) {
     (*in) >> e >> f >> p;
     if (e.empty()) break;
     ++c;
-    ttable[TD::Convert(e)][TD::Convert(f)] = p;
+    probs[TD::Convert(e)][TD::Convert(f)] = p;
   }
+  Rows rows;
+  AddSparse(probs, &rows);
+  SetRows(rows);
+  InitCounts(&counts_);
   cerr << "Loaded " << c << " translation parameters.\n";
 }
-
-void TTable::SerializeHelper(string* out, const Word2Word2Double& o) {
-  assert(!"not implemented");
-}
-
-void TTable::DeserializeHelper(const string& in, Word2Word2Double* o) {
-  assert(!"not implemented");
-}
-
@@ -1,100 +1,92 @@
 #ifndef _TTABLES_H_
 #define _TTABLES_H_
 
+#include <algorithm>
 #include <iostream>
+#include <vector>
 #include <tr1/unordered_map>
 
 #include "wordid.h"
 #include "tdict.h"
 #include "em_utils.h"
 
+// P(f|e), for EM.  The pairs with a probability are fixed by each
+// Normalize(), as those that got counts, and stored in compressed sparse
+// row layout: the f of each e's row sorted, with the probabilities and the
+// counts of the next iteration in arrays parallel to them.  So index()
+// finds a pair once for both, and counts of pairs not in the table (as
+// all are in the first iteration) go to hash tables.
 class TTable {
  public:
-  TTable() {}
+  TTable() : row_start_(1, 0) {}
   typedef std::tr1::unordered_map<WordID, double> Word2Double;
   typedef std::tr1::unordered_map<WordID, Word2Double> Word2Word2Double;
-  inline double prob(const int& e, const int& f) const {
-    const Word2Word2Double::const_iterator cit = ttable.find(e);
-    if (cit != ttable.end()) {
-      const Word2Double& cpd = cit->second;
-      const Word2Double::const_iterator it = cpd.find(f);
-      if (it == cpd.end()) return 1e-9;
-      return it->second;
-    } else {
-      return 1e-9;
-    }
-  }
-  inline void Increment(const int& e, const int& f) {
-    counts[e][f] += 1.0;
+  // expected counts, such as those of one thread
+  struct Counts {
+    std::vector<double> dense;  // of the pairs in the table
+    Word2Word2Double sparse;    // of the others
+  };
+
+  // the position of (e, f) in the table, or -1 if it is not in it
+  inline int index(const WordID& e, const WordID& f) const {
+    if (e < 0 || e >= rows()) return -1;
+    const std::vector<WordID>::const_iterator b = f_.begin() + row_start_[e];
+    const std::vector<WordID>::const_iterator end = f_.begin() + row_start_[e + 1];
+    const std::vector<WordID>::const_iterator it = std::lower_bound(b, end, f);
+    if (it == end || *it != f) return -1;
+    return it - f_.begin();
   }
-  inline void Increment(const int& e, const int& f, double x) {
-    counts[e][f] += x;
+  inline double prob(int i) const {
+    if (i < 0) return 1e-9;
+    return probs_[i];
   }
-  void NormalizeVB(const double alpha) {
-    ttable.swap(counts);
-    for (Word2Word2Double::iterator cit = ttable.begin();
-         cit != ttable.end(); ++cit) {
-      double tot = 0;
-      Word2Double& cpd = cit->second;
-      for (Word2Double::iterator it = cpd.begin(); it != cpd.end(); ++it)
-        tot += it->second + alpha;
-      for (Word2Double::iterator it = cpd.begin(); it != cpd.end(); ++it)
-        it->second = exp(digamma(it->second + alpha) - digamma(tot));
-    }
-    counts.clear();
+  inline double prob(const int& e, const int& f) const {
+    return prob(index(e, f));
   }
-  void Normalize() {
-    ttable.swap(counts);
-    for (Word2Word2Double::iterator cit = ttable.begin();
-         cit != ttable.end(); ++cit) {
-      double tot = 0;
-      Word2Double& cpd = cit->second;
-      for (Word2Double::iterator it = cpd.begin(); it != cpd.end(); ++it)
-        tot += it->second;
-      for (Word2Double::iterator it = cpd.begin(); it != cpd.end(); ++it)
-        it->second /= tot;
-    }
-    counts.clear();
+  // starts counts for this table at 0
+  void InitCounts(Counts* c) const {
+    c->dense.assign(probs_.size(), 0.0);
+    c->sparse.clear();
   }
-  // adds counts from another TTable - probabilities remain unchanged
-  TTable& operator+=(const TTable& rhs) {
-    for (Word2Word2Double::const_iterator it = rhs.counts.begin();
-         it != rhs.counts.end(); ++it) {
-      const Word2Double& cpd = it->second;
-      Word2Double& tgt = counts[it->first];
-      for (Word2Double::const_iterator j = cpd.begin(); j != cpd.end(); ++j) {
-        tgt[j->first] += j->second;
-      }
-    }
-    return *this;
+  // adds x to the count of (e, f), which is at i = index(e, f) in c
+  inline void Increment(int i, const int& e, const int& f, double x, Counts* c) const {
+    if (i < 0)
+      c->sparse[e][f] += x;
+    else
+      c->dense[i] += x;
   }
-  void ShowTTable() {
-    for (Word2Word2Double::iterator it = ttable.begin(); it != ttable.end(); ++it) {
-      Word2Double& cpd = it->second;
-      for (Word2Double::iterator j = cpd.begin(); j != cpd.end(); ++j) {
-        std::cerr << "P(" << TD::Convert(j->first) << '|' << TD::Convert(it->first) << ") = " << j->second << std::endl;
-      }
-    }
+  inline void Increment(const int& e, const int& f) {
+    Increment(e, f, 1.0);
   }
-  void ShowCounts() {
-    for (Word2Word2Double::iterator it = counts.begin(); it != counts.end(); ++it) {
-      Word2Double& cpd = it->second;
-      for (Word2Double::iterator j = cpd.begin(); j != cpd.end(); ++j) {
-        std::cerr << "c(" << TD::Convert(j->first) << '|' << TD::Convert(it->first) << ") = " << j->second << std::endl;
-      }
-    }
+  inline void Increment(const int& e, const int& f, double x) {
+    Increment(index(e, f), e, f, x, &counts_);
   }
+  // adds counts started with InitCounts() to the table's (*c may be
+  // emptied)
+  void AddCounts(Counts* c);
+  void NormalizeVB(const double alpha) { Normalize(true, alpha); }
+  void Normalize() { Normalize(false, 0.0); }
+
+  // e has the pairs [row_begin(e), row_end(e)) for e < rows()
+  WordID rows() const { return row_start_.size() - 1; }
+  int row_begin(const WordID& e) const { return row_start_[e]; }
+  int row_end(const WordID& e) const { return row_start_[e + 1]; }
+  WordID f(int i) const { return f_[i]; }
+
+  void ShowTTable() const;
+  void ShowCounts() const;
   void DeserializeProbsFromText(std::istream* in);
-  void SerializeCounts(std::string* out) const { SerializeHelper(out, counts); }
-  void DeserializeCounts(const std::string& in) { DeserializeHelper(in, &counts); }
-  void SerializeProbs(std::string* out) const { SerializeHelper(out, ttable); }
-  void DeserializeProbs(const std::string& in) { DeserializeHelper(in, &ttable); }
  private:
-  static void SerializeHelper(std::string*, const Word2Word2Double& o);
-  static void DeserializeHelper(const std::string&, Word2Word2Double* o);
- public:
-  Word2Word2Double ttable;
-  Word2Word2Double counts;
+  // the probabilities from counts_ (which get back to 0), with the pairs
+  // that have counts
+  void Normalize(bool variational_bayes, double alpha);
+  // sets the pairs, and probs_ to their values in rows, whose f are sorted
+  void SetRows(const std::vector<std::vector<std::pair<WordID, double> > >& rows);
+
+  std::vector<int> row_start_;
+  std::vector<WordID> f_;
+  std::vector<double> probs_;
+  Counts counts_;
 };
 
 #endif
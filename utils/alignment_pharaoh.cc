@@ -1,5 +1,6 @@
 #include "utils/alignment_pharaoh.h"
 
+#include <algorithm>
 #include <set>
 
 using namespace std;
@@ -75,3 +76,53 @@ void AlignmentPharaoh::SerializePharaohFormat(const Array2D<bool>& alignment, os
   (*out) << endl;
 }
 
+
+void AlignmentPharaoh::ReadPharaohAlignmentLinks(const string& al, vector<Link>* links, int* i_len, int* j_len) {
+  links->clear();
+  int max_x = 0;
+  int max_y = 0;
+  int i = 0;
+  size_t pos = al.rfind(" ||| ");
+  if (pos != string::npos) { i = pos + 5; }
+  bool sorted = true;
+  while (i < al.size()) {
+    if (al[i] == '\n' || al[i] == '\r') break;
+    int x = 0;
+    while(i < al.size() && is_digit(al[i])) {
+      x *= 10;
+      x += al[i] - '0';
+      ++i;
+    }
+    if (x > max_x) max_x = x;
+    if(i == al.size() || al[i] != '-') {
+      cerr << "BAD ALIGNMENT: " << al << endl;
+      abort();
+    }
+    ++i;
+    int y = 0;
+    while(i < al.size() && is_digit(al[i])) {
+      y *= 10;
+      y += al[i] - '0';
+      ++i;
+    }
+    if (y > max_y) max_y = y;
+    const Link l(x, y);
+    if (sorted && !links->empty() && !(links->back() < l)) sorted = false;
+    links->push_back(l);
+    while(i < al.size() && al[i] == ' ') { ++i; }
+  }
+  if (!sorted) {
+    sort(links->begin(), links->end());
+    links->erase(unique(links->begin(), links->end()), links->end());
+  }
+  *i_len = max_x + 1;
+  *j_len = max_y + 1;
+}
+
+void AlignmentPharaoh::SerializePharaohFormat(const vector<Link>& links, ostream* out) {
+  for (int k = 0; k < links.size(); ++k) {
+    if (k) (*out) << ' ';
+    (*out) << links[k].first << '-' << links[k].second;
+  }
+  (*out) << endl;
+}
@@ -3,12 +3,22 @@
 
 #include <string>
 #include <iostream>
+#include <utility>
+#include <vector>
 #include <boost/shared_ptr.hpp>
 #include "array2d.h"
 
 struct AlignmentPharaoh {
   static boost::shared_ptr<Array2D<bool> > ReadPharaohAlignmentGrid(const std::string& al);
   static void SerializePharaohFormat(const Array2D<bool>& alignment, std::ostream* out);
+
+  // sparse alternative to the grid: the (i, j) links of al, sorted and
+  // without duplicates, and in *i_len and *j_len the size of the grid
+  // ReadPharaohAlignmentGrid would make for it
+  typedef std::pair<int, int> Link;
+  static void ReadPharaohAlignmentLinks(const std::string& al, std::vector<Link>* links, int* i_len, int* j_len);
+  // links must be sorted
+  static void SerializePharaohFormat(const std::vector<Link>& links, std::ostream* out);
 };
 
 #endif
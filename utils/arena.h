@@ -0,0 +1,152 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+// MonotonicArena hands out memory carved from large blocks; individual
+// deallocations are no-ops and everything is released at once by Reset(),
+// which keeps the blocks around so that the next round of allocations
+// (e.g., the next sentence) does not touch malloc at all.
+//
+// ArenaAllocator<T> is a stateless STL allocator that draws from the arena
+// installed for the current thread by an ArenaScope, and from the heap when
+// no arena is installed, so containers that use it behave exactly like their
+// std::allocator counterparts outside of an ArenaScope.
+//
+// IMPORTANT: containers that allocated inside an ArenaScope must be destroyed
+// before the scope ends.
+
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <limits>
+#include <new>
+#include <vector>
+
+class MonotonicArena {
+  struct Block {
+    Block(char* m, size_t s) : mem(m), size(s) {}
+    char* mem;
+    size_t size;
+  };
+  enum { kALIGN = 16 };
+ public:
+  explicit MonotonicArena(size_t block_size = 1 << 20) :
+    block_size_(block_size), cur_(0), pos_(0), allocated_(0) {}
+  ~MonotonicArena() {
+    for (unsigned i = 0; i < blocks_.size(); ++i)
+      std::free(blocks_[i].mem);
+  }
+
+  void* Allocate(size_t n) {
+    n = (n + kALIGN - 1) & ~static_cast<size_t>(kALIGN - 1);
+    if (cur_ == blocks_.size() || pos_ + n > blocks_[cur_].size)
+      NextBlock(n);
+    void* p = blocks_[cur_].mem + pos_;
+    pos_ += n;
+    allocated_ += n;
+    return p;
+  }
+
+  bool Owns(const void* p) const {
+    const char* c = static_cast<const char*>(p);
+    for (unsigned i = 0; i < blocks_.size(); ++i)
+      if (c >= blocks_[i].mem && c < blocks_[i].mem + blocks_[i].size) return true;
+    return false;
+  }
+
+  // release everything allocated so far but keep the blocks for reuse
+  void Reset() { cur_ = 0; pos_ = 0; allocated_ = 0; }
+
+  size_t BytesAllocated() const { return allocated_; }
+  size_t BytesReserved() const {
+    size_t r = 0;
+    for (unsigned i = 0; i < blocks_.size(); ++i) r += blocks_[i].size;
+    return r;
+  }
+
+  // the arena installed for this thread by ArenaScope (NULL if none)
+  static MonotonicArena*& Current() {
+    static __thread MonotonicArena* current = NULL;
+    return current;
+  }
+
+ private:
+  void NextBlock(size_t n) {
+    if (cur_ < blocks_.size()) ++cur_;
+    pos_ = 0;
+    // reuse blocks kept by Reset() if they are large enough
+    while (cur_ < blocks_.size() && blocks_[cur_].size < n) ++cur_;
+    if (cur_ == blocks_.size()) {
+      const size_t s = (n > block_size_ ? n : block_size_);
+      char* mem = static_cast<char*>(std::malloc(s));
+      if (!mem) throw std::bad_alloc();
+      blocks_.push_back(Block(mem, s));
+    }
+  }
+
+  MonotonicArena(const MonotonicArena&);
+  void operator=(const MonotonicArena&);
+
+  const size_t block_size_;
+  std::vector<Block> blocks_;
+  unsigned cur_;
+  size_t pos_;
+  size_t allocated_;
+};
+
+// installs arena for the current thread; when the scope ends, the previous
+// arena is restored and everything allocated from arena is released.
+// arena may be NULL, in which case allocations go to the heap as usual.
+class ArenaScope {
+ public:
+  explicit ArenaScope(MonotonicArena* arena) : arena_(arena), prev_(MonotonicArena::Current()) {
+    MonotonicArena::Current() = arena;
+  }
+  ~ArenaScope() {
+    MonotonicArena::Current() = prev_;
+    if (arena_) arena_->Reset();
+  }
+ private:
+  ArenaScope(const ArenaScope&);
+  void operator=(const ArenaScope&);
+  MonotonicArena* arena_;
+  MonotonicArena* prev_;
+};
+
+template <typename T>
+struct ArenaAllocator {
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef std::size_t size_type;
+  typedef std::ptrdiff_t difference_type;
+  template <typename U> struct rebind { typedef ArenaAllocator<U> other; };
+
+  ArenaAllocator() {}
+  template <typename U> ArenaAllocator(const ArenaAllocator<U>&) {}
+
+  pointer address(reference x) const { return &x; }
+  const_pointer address(const_reference x) const { return &x; }
+  size_type max_size() const { return std::numeric_limits<size_type>::max() / sizeof(T); }
+  void construct(pointer p, const T& v) { new(static_cast<void*>(p)) T(v); }
+  void destroy(pointer p) { p->~T(); }
+
+  pointer allocate(size_type n, const void* = 0) {
+    MonotonicArena* a = MonotonicArena::Current();
+    if (a) return static_cast<pointer>(a->Allocate(n * sizeof(T)));
+    return static_cast<pointer>(::operator new(n * sizeof(T)));
+  }
+  void deallocate(pointer p, size_type) {
+    MonotonicArena* a = MonotonicArena::Current();
+    if (a && a->Owns(p)) return;
+    ::operator delete(p);
+  }
+};
+
+template <typename T, typename U>
+inline bool operator==(const ArenaAllocator<T>&, const ArenaAllocator<U>&) { return true; }
+template <typename T, typename U>
+inline bool operator!=(const ArenaAllocator<T>&, const ArenaAllocator<U>&) { return false; }
+
+#endif
@@ -0,0 +1,59 @@
+#include "arena.h"
+
+#include <gtest/gtest.h>
+#include <vector>
+
+using namespace std;
+
+class ArenaTest : public testing::Test {
+ protected:
+  virtual void SetUp() { }
+  virtual void TearDown() { }
+};
+
+typedef vector<int, ArenaAllocator<int> > ArenaVector;
+
+TEST_F(ArenaTest, HeapWithoutScope) {
+  ArenaVector v;
+  for (int i = 0; i < 100; ++i) v.push_back(i);
+  EXPECT_EQ(100, v.size());
+  EXPECT_EQ(99, v.back());
+  EXPECT_TRUE(MonotonicArena::Current() == NULL);
+}
+
+TEST_F(ArenaTest, AllocatesFromArena) {
+  MonotonicArena arena(256);
+  {
+    ArenaScope scope(&arena);
+    ArenaVector v;
+    for (int i = 0; i < 1000; ++i) v.push_back(i);
+    EXPECT_TRUE(arena.Owns(&v[0]));
+    EXPECT_EQ(999, v[999]);
+    EXPECT_GE(arena.BytesAllocated(), 1000 * sizeof(int));
+  }
+  EXPECT_EQ(0, arena.BytesAllocated());
+  EXPECT_TRUE(MonotonicArena::Current() == NULL);
+  const size_t reserved = arena.BytesReserved();
+  {
+    // second round reuses the blocks kept by Reset()
+    ArenaScope scope(&arena);
+    ArenaVector v(500, 1);
+    EXPECT_TRUE(arena.Owns(&v[0]));
+  }
+  EXPECT_EQ(reserved, arena.BytesReserved());
+}
+
+TEST_F(ArenaTest, HeapMemoryFreedInsideScope) {
+  MonotonicArena arena;
+  ArenaVector* v = new ArenaVector(10, 2);
+  {
+    ArenaScope scope(&arena);
+    EXPECT_FALSE(arena.Owns(&(*v)[0]));
+    delete v;
+  }
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -1,28 +1,101 @@
 #include <iostream>
 #include <cassert>
 
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
 using namespace std;
 
 namespace B64 {
 
 static const char cb64[]="ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-static const char cd64[]="|$$$}rstuvwxyz{$$$$$$$>?@ABCDEFGHIJKLMNOPQRSTUVW$$$$$$XYZ[\\]^_`abcdefghijklmnopq";
 
-static void encodeblock(const unsigned char* in, ostream* os, int len) {
-  char out[4];
+// 6-bit value of each character + 1, 0 for characters that are not base64.
+// '=' (padding) decodes to 0.
+struct DecodeTable {
+  DecodeTable() {
+    for (int i = 0; i < 256; ++i) v[i] = 0;
+    for (int i = 0; i < 64; ++i) v[static_cast<unsigned char>(cb64[i])] = i + 1;
+    v[static_cast<unsigned char>('=')] = 1;
+  }
+  unsigned char v[256];
+};
+static const DecodeTable cd64;
+
+static void encodeblock(const unsigned char* in, char* out, int len) {
   out[0] = cb64[ in[0] >> 2 ];
-  out[1] = cb64[ ((in[0] & 0x03) << 4) | ((in[1] & 0xf0) >> 4) ];
-  out[2] = (len > 1 ? cb64[ ((in[1] & 0x0f) << 2) | ((in[2] & 0xc0) >> 6) ] : '=');
+  out[1] = cb64[ ((in[0] & 0x03) << 4) | (len > 1 ? in[1] >> 4 : 0) ];
+  out[2] = (len > 1 ? cb64[ ((in[1] & 0x0f) << 2) | (len > 2 ? in[2] >> 6 : 0) ] : '=');
   out[3] = (len > 2 ? cb64[ in[2] & 0x3f ] : '=');
-  os->write(out, 4);
 }
 
+#ifdef __SSSE3__
+// 12 bytes of in[] (16 must be readable) to 16 characters, see W. Mula and
+// D. Lemire, "Faster Base64 Encoding and Decoding using AVX2 Instructions"
+static inline void encode12(const unsigned char* in, char* out) {
+  __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+  x = _mm_shuffle_epi8(x, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+  const __m128i t0 = _mm_mulhi_epu16(_mm_and_si128(x, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+  const __m128i t1 = _mm_mullo_epi16(_mm_and_si128(x, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+  const __m128i indices = _mm_or_si128(t0, t1);
+  // map 0..25, 26..51, 52..61, 62, 63 to the offset added to get the character
+  __m128i r = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+  r = _mm_or_si128(r, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+  const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                      '/' - 63, 'A', 0, 0);
+  r = _mm_add_epi8(_mm_shuffle_epi8(shift, r), indices);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(out), r);
+}
+
+// 16 characters to 12 bytes, writing 16 bytes to out[].  Returns false
+// (and writes nothing) if any of them is not in the base64 alphabet,
+// including '=', so padding is left to the scalar code.
+static inline bool decode16(const unsigned char* in, unsigned char* out) {
+  const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  const __m128i hi = _mm_and_si128(_mm_srli_epi32(x, 4), mask);
+  const __m128i lo = _mm_and_si128(x, mask);
+  const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                       0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+  const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                       0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m128i bad = _mm_and_si128(_mm_shuffle_epi8(lut_lo, lo), _mm_shuffle_epi8(lut_hi, hi));
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(bad, _mm_setzero_si128())) != 0xffff) return false;
+  const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8('/')), hi));
+  const __m128i v = _mm_add_epi8(x, roll);   // 6-bit values
+  __m128i r = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+  r = _mm_madd_epi16(r, _mm_set1_epi32(0x00011000));
+  r = _mm_shuffle_epi8(r, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(out), r);
+  return true;
+}
+#endif
+
 void b64encode(const char* data, const size_t size, ostream* out) {
+  const unsigned char* in = reinterpret_cast<const unsigned char*>(data);
+  // encode into buf and write it out a few KB at a time
+  const size_t kBufSize = 4096;
+  char buf[kBufSize];
   size_t cur = 0;
   while(cur < size) {
-    int len = min(static_cast<size_t>(3), size - cur);
-    encodeblock(reinterpret_cast<const unsigned char*>(&data[cur]), out, len);
-    cur += len;
+    size_t pos = 0;
+#ifdef __SSSE3__
+    while (cur + 16 <= size && pos + 16 <= kBufSize) {
+      encode12(&in[cur], &buf[pos]);
+      cur += 12;
+      pos += 16;
+    }
+#endif
+    while (cur < size && pos + 4 <= kBufSize) {
+      const int len = min(static_cast<size_t>(3), size - cur);
+      encodeblock(&in[cur], &buf[pos], len);
+      cur += len;
+      pos += 4;
+    }
+    out->write(buf, pos);
   }
 }
 
@@ -33,27 +106,31 @@ static void decodeblock(const unsigned char* in, unsigned char* out) {
 }
 
 bool b64decode(const unsigned char* data, const size_t insize, char* out, const size_t outsize) {
+  unsigned char* o = reinterpret_cast<unsigned char*>(out);
   size_t cur = 0;
   size_t ocur = 0;
+#ifdef __SSSE3__
+  while (cur + 16 <= insize && ocur + 16 <= outsize && decode16(&data[cur], &o[ocur])) {
+    cur += 16;
+    ocur += 12;
+  }
+#endif
   unsigned char in[4];
   while(cur < insize) {
     assert(ocur < outsize);
     for (int i = 0; i < 4; ++i) {
-      unsigned char v = data[cur];
-      v = (unsigned char) ((v < 43 || v > 122) ? '\0' : cd64[ v - 43 ]);
+      const unsigned char v = cd64.v[data[cur]];
       if (!v) {
         cerr << "B64 decode error at offset " << cur << " offending character: " << (int)data[cur] << endl;
         return false;
       }
-      v = (unsigned char) ((v == '$') ? '\0' : v - 61);
-      if (v) in[i] = v - 1; else in[i] = 0;
+      in[i] = v - 1;
       ++cur;
     }
-    decodeblock(in, reinterpret_cast<unsigned char*>(&out[ocur]));
+    decodeblock(in, &o[ocur]);
     ocur += 3;
   }
   return true;
 }
 
 }
-
@@ -17,6 +17,14 @@ void batched_append_swap(Vector &v,SRange & s) {
   using namespace std; // to find the right swap via ADL
   size_t i=v.size();
   size_t news=i+s.size();
+  if (news>v.capacity()) { // grow by swapping, not copying, the old elements
+    Vector grown;
+    grown.reserve(std::max(news,2*i));
+    grown.resize(i);
+    for (size_t j=0;j<i;++j)
+      swap(grown[j],v[j]);
+    v.swap(grown);
+  }
   v.resize(news);
   typename SRange::iterator si=s.begin();
   for (;i<news;++i,++si)
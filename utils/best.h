@@ -19,13 +19,13 @@ struct BetterP {
 };
 
 inline void maybe_improve(best_t &a,best_t const& b) {
-  if (a.v_>b.v_)
+  if (b.v_>a.v_)
     a.v_=b.v_;
 }
 
 template <class O>
 inline void maybe_improve(best_t &a,O const& b) {
-  if (a.v_>b.v_)
+  if (b.v_>a.v_)
     a.v_=b.v_;
 }
 
@@ -0,0 +1,65 @@
+#ifndef BOUNDED_QUEUE_H_
+#define BOUNDED_QUEUE_H_
+
+// FIFO for handing work between threads.  Push blocks while the queue holds
+// capacity items, so a fast producer can't run arbitrarily far ahead of its
+// consumers; Pop blocks while it is empty.  Close() ends the stream: pushes
+// fail, and pops return what is left and then false.
+
+#include <cassert>
+#include <deque>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(unsigned capacity) : capacity_(capacity), closed_(false) {
+    assert(capacity > 0);
+  }
+
+  // false (and x is dropped) if the queue was closed
+  bool Push(const T& x) {
+    boost::mutex::scoped_lock l(mutex_);
+    while (!closed_ && items_.size() >= capacity_)
+      not_full_.wait(l);
+    if (closed_) return false;
+    items_.push_back(x);
+    not_empty_.notify_one();
+    return true;
+  }
+
+  // false once the queue is closed and empty
+  bool Pop(T* x) {
+    boost::mutex::scoped_lock l(mutex_);
+    while (!closed_ && items_.empty())
+      not_empty_.wait(l);
+    if (items_.empty()) return false;
+    *x = items_.front();
+    items_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  void Close() {
+    boost::mutex::scoped_lock l(mutex_);
+    closed_ = true;
+    not_full_.notify_all();
+    not_empty_.notify_all();
+  }
+
+  unsigned capacity() const { return capacity_; }
+
+ private:
+  BoundedQueue(const BoundedQueue&);
+  void operator=(const BoundedQueue&);
+
+  const unsigned capacity_;
+  bool closed_;
+  std::deque<T> items_;
+  boost::mutex mutex_;
+  boost::condition_variable not_full_;
+  boost::condition_variable not_empty_;
+};
+
+#endif
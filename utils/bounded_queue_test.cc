@@ -0,0 +1,74 @@
+#include "bounded_queue.h"
+
+#include <vector>
+#include <gtest/gtest.h>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+using namespace std;
+
+class BoundedQueueTest : public testing::Test {
+ protected:
+  virtual void SetUp() { }
+  virtual void TearDown() { }
+};
+
+TEST_F(BoundedQueueTest, Fifo) {
+  BoundedQueue<int> q(3);
+  EXPECT_TRUE(q.Push(1));
+  EXPECT_TRUE(q.Push(2));
+  EXPECT_TRUE(q.Push(3));
+  int x = 0;
+  EXPECT_TRUE(q.Pop(&x));
+  EXPECT_EQ(1, x);
+  EXPECT_TRUE(q.Push(4));
+  q.Close();
+  EXPECT_FALSE(q.Push(5));
+  EXPECT_TRUE(q.Pop(&x)); EXPECT_EQ(2, x);
+  EXPECT_TRUE(q.Pop(&x)); EXPECT_EQ(3, x);
+  EXPECT_TRUE(q.Pop(&x)); EXPECT_EQ(4, x);
+  EXPECT_FALSE(q.Pop(&x));
+}
+
+static void Produce(BoundedQueue<int>* q, int from, int n) {
+  for (int i = from; i < from + n; ++i)
+    q->Push(i);
+}
+
+static void Consume(BoundedQueue<int>* q, vector<int>* seen) {
+  int x;
+  while (q->Pop(&x))
+    seen->push_back(x);
+}
+
+TEST_F(BoundedQueueTest, Threads) {
+  const int kPRODUCERS = 4, kCONSUMERS = 3, kN = 10000;
+  BoundedQueue<int> q(2);
+  boost::thread_group producers, consumers;
+  vector<vector<int> > seen(kCONSUMERS);
+  for (int i = 0; i < kCONSUMERS; ++i)
+    consumers.create_thread(boost::bind(Consume, &q, &seen[i]));
+  for (int i = 0; i < kPRODUCERS; ++i)
+    producers.create_thread(boost::bind(Produce, &q, i * kN, kN));
+  producers.join_all();
+  q.Close();
+  consumers.join_all();
+  vector<int> count(kPRODUCERS * kN);
+  for (int i = 0; i < kCONSUMERS; ++i) {
+    // each producer's items come out in the order it pushed them
+    vector<int> last(kPRODUCERS, -1);
+    for (unsigned j = 0; j < seen[i].size(); ++j) {
+      const int x = seen[i][j];
+      EXPECT_LT(last[x / kN], x);
+      last[x / kN] = x;
+      ++count[x];
+    }
+  }
+  for (unsigned i = 0; i < count.size(); ++i)
+    EXPECT_EQ(1, count[i]);
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
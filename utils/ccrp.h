@@ -1,18 +1,26 @@
 #ifndef _CCRP_H_
 #define _CCRP_H_
 
+#include <algorithm>
 #include <numeric>
 #include <cassert>
 #include <cmath>
-#include <list>
 #include <iostream>
+#include <utility>
 #include <vector>
 #include <tr1/unordered_map>
 #include <boost/functional/hash.hpp>
+#include <boost/thread/thread.hpp>
 #include "sampler.h"
 #include "slice_sampler.h"
 
 // Chinese restaurant process (Pitman-Yor parameters) with table tracking.
+//
+// The tables of a dish are kept as a histogram of table sizes, sorted by
+// size, rather than one entry per table.  log_crp_prob only depends on the
+// restaurant's table sizes, so resample_hyperparameters collects them into a
+// single histogram once and every evaluation of the slice sampler costs one
+// term per distinct table size.
 
 template <typename Dish, typename DishHash = boost::hash<Dish> >
 class CCRP {
@@ -61,7 +69,7 @@ class CCRP {
   unsigned num_tables(const Dish& dish) const {
     const typename std::tr1::unordered_map<Dish, DishLocations, DishHash>::const_iterator it = dish_locs_.find(dish);
     if (it == dish_locs_.end()) return 0;
-    return it->second.table_counts_.size();
+    return it->second.num_tables_;
   }
 
   unsigned num_customers() const {
@@ -71,7 +79,7 @@ class CCRP {
   unsigned num_customers(const Dish& dish) const {
     const typename std::tr1::unordered_map<Dish, DishLocations, DishHash>::const_iterator it = dish_locs_.find(dish);
     if (it == dish_locs_.end()) return 0;
-    return it->total_dish_count_;
+    return it->second.total_dish_count_;
   }
 
   // returns +1 or 0 indicating whether a new table was opened
@@ -80,26 +88,27 @@ class CCRP {
     bool share_table = false;
     if (loc.total_dish_count_) {
       const double p_empty = (concentration_ + num_tables_ * discount_) * p0;
-      const double p_share = (loc.total_dish_count_ - loc.table_counts_.size() * discount_);
+      const double p_share = (loc.total_dish_count_ - loc.num_tables_ * discount_);
       share_table = rng->SelectSample(p_empty, p_share);
     }
     if (share_table) {
-      double r = rng->next() * (loc.total_dish_count_ - loc.table_counts_.size() * discount_);
-      for (typename std::list<unsigned>::iterator ti = loc.table_counts_.begin();
-           ti != loc.table_counts_.end(); ++ti) {
-        r -= (*ti - discount_);
-        if (r <= 0.0) {
-          ++(*ti);
-          break;
-        }
+      double r = rng->next() * (loc.total_dish_count_ - loc.num_tables_ * discount_);
+      TableHistogram& h = loc.table_sizes_;
+      unsigned i = 0;
+      for (; i < h.size(); ++i) {
+        r -= h[i].second * (h[i].first - discount_);
+        if (r <= 0.0) break;
       }
-      if (r > 0.0) {
+      if (i == h.size()) {
         std::cerr << "Serious error: r=" << r << std::endl;
         Print(&std::cerr);
         assert(r <= 0.0);
+        --i;
       }
+      loc.move_table(i, +1);
     } else {
-      loc.table_counts_.push_back(1u);
+      loc.add_tables(1, 1);
+      ++loc.num_tables_;
       ++num_tables_;
     }
     ++loc.total_dish_count_;
@@ -122,22 +131,25 @@ class CCRP {
       // here. if you do, it will introduce (unwanted) bias!
       double r = rng->next() * loc.total_dish_count_;
       --loc.total_dish_count_;
-      for (typename std::list<unsigned>::iterator ti = loc.table_counts_.begin();
-           ti != loc.table_counts_.end(); ++ti) {
-        r -= *ti;
-        if (r <= 0.0) {
-          if ((--(*ti)) == 0) {
-            --num_tables_;
-            delta = -1;
-            loc.table_counts_.erase(ti);
-          }
-          break;
-        }
+      TableHistogram& h = loc.table_sizes_;
+      unsigned i = 0;
+      for (; i < h.size(); ++i) {
+        r -= h[i].second * h[i].first;
+        if (r <= 0.0) break;
       }
-      if (r > 0.0) {
+      if (i == h.size()) {
         std::cerr << "Serious error: r=" << r << std::endl;
         Print(&std::cerr);
         assert(r <= 0.0);
+        --i;
+      }
+      if (h[i].first == 1) {
+        loc.add_tables(1, -1);
+        --loc.num_tables_;
+        --num_tables_;
+        delta = -1;
+      } else {
+        loc.move_table(i, -1);
       }
       --num_customers_;
       return delta;
@@ -150,7 +162,7 @@ class CCRP {
     if (it == dish_locs_.end()) {
       return r * p0 / (num_customers_ + concentration_);
     } else {
-      return (it->second.total_dish_count_ - discount_ * it->second.table_counts_.size() + r * p0) /
+      return (it->second.total_dish_count_ - discount_ * it->second.num_tables_ + r * p0) /
                (num_customers_ + concentration_);
     }
   }
@@ -179,6 +191,27 @@ class CCRP {
   // taken from http://en.wikipedia.org/wiki/Chinese_restaurant_process
   // does not include P_0's
   double log_crp_prob(const double& discount, const double& concentration) const {
+    TableHistogram sizes;
+    table_sizes(&sizes);
+    return log_crp_prob(discount, concentration, sizes);
+  }
+
+  // the number of tables of each size, over all dishes, sorted by size
+  typedef std::vector<std::pair<unsigned, unsigned> > TableHistogram;
+  void table_sizes(TableHistogram* sizes) const {
+    std::tr1::unordered_map<unsigned, unsigned> counts;
+    for (typename std::tr1::unordered_map<Dish, DishLocations, DishHash>::const_iterator it = dish_locs_.begin();
+         it != dish_locs_.end(); ++it) {
+      const TableHistogram& h = it->second.table_sizes_;
+      for (unsigned i = 0; i < h.size(); ++i)
+        counts[h[i].first] += h[i].second;
+    }
+    sizes->assign(counts.begin(), counts.end());
+    std::sort(sizes->begin(), sizes->end());
+  }
+
+  // log_crp_prob given this restaurant's table_sizes
+  double log_crp_prob(const double& discount, const double& concentration, const TableHistogram& sizes) const {
     double lp = 0.0;
     if (has_discount_prior())
       lp = log_beta_density(discount, discount_prior_alpha_, discount_prior_beta_);
@@ -192,13 +225,8 @@ class CCRP {
              + num_tables_ * log(discount) + lgamma(concentration / discount + num_tables_)
              - lgamma(concentration / discount);
         assert(std::isfinite(lp));
-        for (typename std::tr1::unordered_map<Dish, DishLocations, DishHash>::const_iterator it = dish_locs_.begin();
-             it != dish_locs_.end(); ++it) {
-          const DishLocations& cur = it->second;
-          for (std::list<unsigned>::const_iterator ti = cur.table_counts_.begin(); ti != cur.table_counts_.end(); ++ti) {
-            lp += lgamma(*ti - discount) - r;
-          }
-        }
+        for (unsigned i = 0; i < sizes.size(); ++i)
+          lp += sizes[i].second * (lgamma(sizes[i].first - discount) - r);
       } else {
         assert(!"not implemented yet");
       }
@@ -209,8 +237,10 @@ class CCRP {
 
   void resample_hyperparameters(MT19937* rng, const unsigned nloop = 5, const unsigned niterations = 10) {
     assert(has_discount_prior() || has_concentration_prior());
-    DiscountResampler dr(*this);
-    ConcentrationResampler cr(*this);
+    TableHistogram sizes;
+    table_sizes(&sizes);
+    DiscountResampler dr(*this, sizes);
+    ConcentrationResampler cr(*this, sizes);
     for (int iter = 0; iter < nloop; ++iter) {
       if (has_concentration_prior()) {
         concentration_ = slice_sampler1d(cr, concentration_, *rng, 0.0,
@@ -226,37 +256,58 @@ class CCRP {
   }
 
   struct DiscountResampler {
-    DiscountResampler(const CCRP& crp) : crp_(crp) {}
+    DiscountResampler(const CCRP& crp, const TableHistogram& sizes) : crp_(crp), sizes_(sizes) {}
     const CCRP& crp_;
+    const TableHistogram& sizes_;
     double operator()(const double& proposed_discount) const {
-      return crp_.log_crp_prob(proposed_discount, crp_.concentration_);
+      return crp_.log_crp_prob(proposed_discount, crp_.concentration_, sizes_);
     }
   };
 
   struct ConcentrationResampler {
-    ConcentrationResampler(const CCRP& crp) : crp_(crp) {}
+    ConcentrationResampler(const CCRP& crp, const TableHistogram& sizes) : crp_(crp), sizes_(sizes) {}
     const CCRP& crp_;
+    const TableHistogram& sizes_;
     double operator()(const double& proposed_concentration) const {
-      return crp_.log_crp_prob(crp_.discount_, proposed_concentration);
+      return crp_.log_crp_prob(crp_.discount_, proposed_concentration, sizes_);
     }
   };
 
   struct DishLocations {
-    DishLocations() : total_dish_count_() {}
+    DishLocations() : total_dish_count_(), num_tables_() {}
     unsigned total_dish_count_;        // customers at all tables with this dish
-    std::list<unsigned> table_counts_; // list<> gives O(1) deletion and insertion, which we want
-                                       // .size() is the number of tables for this dish
+    unsigned num_tables_;              // tables with this dish
+    TableHistogram table_sizes_;       // (size, number of tables of that size), by size
+
+    // n more (or, if n < 0, fewer) tables of the given size
+    void add_tables(unsigned size, int n) {
+      typename TableHistogram::iterator it = std::lower_bound(table_sizes_.begin(), table_sizes_.end(),
+                                                              std::make_pair(size, 0u));
+      if (it != table_sizes_.end() && it->first == size) {
+        it->second += n;
+        if (!it->second) table_sizes_.erase(it);
+      } else {
+        assert(n > 0);
+        table_sizes_.insert(it, std::make_pair(size, unsigned(n)));
+      }
+    }
+    // one table of the size in table_sizes_[i] gains (+1) or loses (-1) a customer
+    void move_table(unsigned i, int d) {
+      const unsigned size = table_sizes_[i].first;
+      add_tables(size + d, 1);
+      add_tables(size, -1);
+    }
   };
 
   void Print(std::ostream* out) const {
-    std::cerr << "PYP(d=" << discount_ << ",c=" << concentration_ << ") customers=" << num_customers_ << std::endl;
+    (*out) << "PYP(d=" << discount_ << ",c=" << concentration_ << ") customers=" << num_customers_ << std::endl;
     for (typename std::tr1::unordered_map<Dish, DishLocations, DishHash>::const_iterator it = dish_locs_.begin();
          it != dish_locs_.end(); ++it) {
-      (*out) << it->first << " (" << it->second.total_dish_count_ << " on " << it->second.table_counts_.size() << " tables): ";
-      for (typename std::list<unsigned>::const_iterator i = it->second.table_counts_.begin();
-           i != it->second.table_counts_.end(); ++i) {
-        (*out) << " " << *i;
-      }
+      (*out) << it->first << " (" << it->second.total_dish_count_ << " on " << it->second.num_tables_ << " tables): ";
+      const TableHistogram& h = it->second.table_sizes_;
+      for (unsigned i = 0; i < h.size(); ++i)
+        for (unsigned j = 0; j < h[i].second; ++j)
+          (*out) << " " << h[i].first;
       (*out) << std::endl;
     }
   }
@@ -291,4 +342,47 @@ std::ostream& operator<<(std::ostream& o, const CCRP<T,H>& c) {
   return o;
 }
 
+// resamples restaurants first, first + stride, ...
+template <typename Iterator>
+struct ResampleHyperparametersJob {
+  ResampleHyperparametersJob(const std::vector<Iterator>* crps, const std::vector<uint32_t>* seeds,
+                             unsigned first, unsigned stride) :
+    crps_(crps), seeds_(seeds), first_(first), stride_(stride) {}
+  void operator()() const {
+    for (unsigned i = first_; i < crps_->size(); i += stride_) {
+      MT19937 rng((*seeds_)[i]);
+      (*crps_)[i]->resample_hyperparameters(&rng);
+    }
+  }
+  const std::vector<Iterator>* crps_;
+  const std::vector<uint32_t>* seeds_;
+  unsigned first_, stride_;
+};
+
+// Resamples the hyperparameters of every restaurant in [begin, end) (CCRP,
+// CCRP_NoTable or anything else with resample_hyperparameters(MT19937*)) on
+// up to num_threads threads.  Given the seating, the restaurants'
+// hyperparameters are independent, so each restaurant is resampled with its
+// own generator seeded from rng, and the result doesn't depend on
+// num_threads.
+template <typename Iterator>
+void ResampleHyperparameters(Iterator begin, Iterator end, MT19937* rng, unsigned num_threads = 1) {
+  std::vector<Iterator> crps;
+  std::vector<uint32_t> seeds;
+  for (Iterator it = begin; it != end; ++it) {
+    crps.push_back(it);
+    uint32_t seed = rng->gen()();
+    seeds.push_back(seed ? seed : 1);
+  }
+  if (num_threads > crps.size()) num_threads = crps.size();
+  if (num_threads <= 1) {
+    ResampleHyperparametersJob<Iterator>(&crps, &seeds, 0, 1)();
+    return;
+  }
+  boost::thread_group threads;
+  for (unsigned i = 0; i < num_threads; ++i)
+    threads.create_thread(ResampleHyperparametersJob<Iterator>(&crps, &seeds, i, num_threads));
+  threads.join_all();
+}
+
 #endif
@@ -12,7 +12,7 @@
 #include "sampler.h"
 #include "slice_sampler.h"
 
-// Chinese restaurant process (Pitman-Yor parameters) with table tracking.
+// Chinese restaurant process (Dirichlet process) without table tracking.
 
 template <typename Dish, typename DishHash = boost::hash<Dish> >
 class CCRP_NoTable {
@@ -81,6 +81,21 @@ class CCRP_NoTable {
   // taken from http://en.wikipedia.org/wiki/Chinese_restaurant_process
   // does not include P_0's
   double log_crp_prob(const double& concentration) const {
+    return log_crp_prob(concentration, log_dish_counts());
+  }
+
+  // the part of log_crp_prob that doesn't depend on the concentration
+  double log_dish_counts() const {
+    double lp = 0.0;
+    for (typename std::tr1::unordered_map<Dish, unsigned, DishHash>::const_iterator it = custs_.begin();
+           it != custs_.end(); ++it) {
+        lp += lgamma(it->second);
+    }
+    return lp;
+  }
+
+  // log_crp_prob given this restaurant's log_dish_counts
+  double log_crp_prob(const double& concentration, const double& log_dish_counts) const {
     double lp = 0.0;
     if (has_concentration_prior())
       lp += log_gamma_density(concentration, concentration_prior_shape_, concentration_prior_rate_);
@@ -89,10 +104,7 @@ class CCRP_NoTable {
       lp += lgamma(concentration) - lgamma(concentration + num_customers_) +
         custs_.size() * log(concentration);
       assert(std::isfinite(lp));
-      for (typename std::tr1::unordered_map<Dish, unsigned, DishHash>::const_iterator it = custs_.begin();
-             it != custs_.end(); ++it) {
-          lp += lgamma(it->second);
-      }
+      lp += log_dish_counts;
     }
     assert(std::isfinite(lp));
     return lp;
@@ -100,7 +112,7 @@ class CCRP_NoTable {
 
   void resample_hyperparameters(MT19937* rng, const unsigned nloop = 5, const unsigned niterations = 10) {
     assert(has_concentration_prior());
-    ConcentrationResampler cr(*this);
+    ConcentrationResampler cr(*this, log_dish_counts());
     for (int iter = 0; iter < nloop; ++iter) {
         concentration_ = slice_sampler1d(cr, concentration_, *rng, 0.0,
                                std::numeric_limits<double>::infinity(), 0.0, niterations, 100*niterations);
@@ -108,10 +120,12 @@ class CCRP_NoTable {
   }
 
   struct ConcentrationResampler {
-    ConcentrationResampler(const CCRP_NoTable& crp) : crp_(crp) {}
+    ConcentrationResampler(const CCRP_NoTable& crp, double log_dish_counts) :
+      crp_(crp), log_dish_counts_(log_dish_counts) {}
     const CCRP_NoTable& crp_;
+    const double log_dish_counts_;
     double operator()(const double& proposed_concentration) const {
-      return crp_.log_crp_prob(proposed_concentration);
+      return crp_.log_crp_prob(proposed_concentration, log_dish_counts_);
     }
   };
 
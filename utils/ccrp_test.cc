@@ -0,0 +1,100 @@
+#include "ccrp.h"
+#include "ccrp_nt.h"
+
+#include <cmath>
+#include <vector>
+#include <gtest/gtest.h>
+
+using namespace std;
+
+class CCRPTest : public testing::Test {
+ protected:
+  virtual void SetUp() { }
+  virtual void TearDown() { }
+  MT19937 rng;
+};
+
+// seats and unseats customers of a few dishes at random
+static void Shuffle(CCRP<int>* crp, MT19937* rng, int n) {
+  vector<int> seated;
+  for (int i = 0; i < n; ++i) {
+    if (seated.size() > 5 && rng->next() < 0.3) {
+      const int j = rng->next() * seated.size();
+      crp->decrement(seated[j], rng);
+      seated[j] = seated.back();
+      seated.pop_back();
+    } else {
+      const int dish = rng->next() * 7;
+      crp->increment(dish, 0.1, rng);
+      seated.push_back(dish);
+    }
+  }
+}
+
+TEST_F(CCRPTest, TableHistograms) {
+  CCRP<int> crp(0.5, 1.0);
+  Shuffle(&crp, &rng, 2000);
+  unsigned tables = 0, customers = 0;
+  for (CCRP<int>::const_iterator it = crp.begin(); it != crp.end(); ++it) {
+    const CCRP<int>::TableHistogram& h = it->second.table_sizes_;
+    unsigned t = 0, c = 0;
+    for (unsigned i = 0; i < h.size(); ++i) {
+      EXPECT_LT(0u, h[i].first);
+      EXPECT_LT(0u, h[i].second);
+      if (i) { EXPECT_LT(h[i-1].first, h[i].first); }
+      t += h[i].second;
+      c += h[i].first * h[i].second;
+    }
+    EXPECT_EQ(it->second.num_tables_, t);
+    EXPECT_EQ(it->second.total_dish_count_, c);
+    tables += t;
+    customers += c;
+  }
+  EXPECT_EQ(crp.num_tables(), tables);
+  EXPECT_EQ(crp.num_customers(), customers);
+}
+
+TEST_F(CCRPTest, LogProbMatchesPerTableSum) {
+  CCRP<int> crp(1, 1, 1, 1, 0.3, 2.0);
+  Shuffle(&crp, &rng, 500);
+  const double d = crp.discount(), c = crp.concentration();
+  double lp = CCRP<int>::log_beta_density(d, 1, 1) + CCRP<int>::log_gamma_density(c, 1, 1);
+  lp += lgamma(c) - lgamma(c + crp.num_customers()) + crp.num_tables() * log(d)
+      + lgamma(c / d + crp.num_tables()) - lgamma(c / d);
+  for (CCRP<int>::const_iterator it = crp.begin(); it != crp.end(); ++it) {
+    const CCRP<int>::TableHistogram& h = it->second.table_sizes_;
+    for (unsigned i = 0; i < h.size(); ++i)
+      for (unsigned j = 0; j < h[i].second; ++j)
+        lp += lgamma(h[i].first - d) - lgamma(1.0 - d);
+  }
+  EXPECT_NEAR(lp, crp.log_crp_prob(), 1e-8);
+}
+
+TEST_F(CCRPTest, ResampleIndependentOfThreads) {
+  vector<CCRP<int> > a(9, CCRP<int>(1, 1, 1, 1));
+  for (unsigned i = 0; i < a.size(); ++i)
+    Shuffle(&a[i], &rng, 100 + 50 * i);
+  vector<CCRP<int> > b(a);
+  MT19937 r1(17), r2(17);
+  ResampleHyperparameters(a.begin(), a.end(), &r1, 1);
+  ResampleHyperparameters(b.begin(), b.end(), &r2, 4);
+  for (unsigned i = 0; i < a.size(); ++i) {
+    EXPECT_EQ(a[i].discount(), b[i].discount());
+    EXPECT_EQ(a[i].concentration(), b[i].concentration());
+  }
+}
+
+TEST_F(CCRPTest, NoTableLogProb) {
+  CCRP_NoTable<int> crp(1, 1, 3.0);
+  for (int i = 0; i < 50; ++i)
+    crp.increment(i % 4);
+  EXPECT_NEAR(crp.log_crp_prob(2.0), crp.log_crp_prob(2.0, crp.log_dish_counts()), 1e-12);
+  vector<CCRP_NoTable<int> > v(3, crp);
+  ResampleHyperparameters(v.begin(), v.end(), &rng, 2);
+  EXPECT_LT(0.0, v[0].concentration());
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -76,6 +76,7 @@
 #include <cstddef>
 #include <algorithm>
 #include <utility>
+#include <functional>
 #include <cassert>
 #include <boost/static_assert.hpp>
 #include <boost/shared_array.hpp>
@@ -565,4 +566,118 @@
 
   };
 
+  // (key, pointer) pair for heaps of objects ordered by a key they hold:
+  // comparing two entries reads the keys inline instead of following the
+  // pointers to them.  The key is a copy, so it must not change while the
+  // entry is in the heap.
+  template <typename Key, typename T>
+  struct keyed_ptr {
+    keyed_ptr() {}
+    keyed_ptr(Key const& key, T* ptr) : key(key), ptr(ptr) {}
+    bool operator<(keyed_ptr const& o) const { return key < o.key; }
+    bool operator>(keyed_ptr const& o) const { return o.key < key; }
+    Key key;
+    T* ptr;
+  };
+
+  // D-ary heap of small values (e.g. keyed_ptr) stored inline and compared
+  // directly, without the index and distance maps of d_ary_heap_indirect (so
+  // there is no update()).  better(a,b) means a comes out before b, so use
+  // std::greater for a max-heap.  Filling the heap with push_back() and then
+  // calling heapify() is faster than one push() at a time.  Moves use a hole
+  // rather than swaps.
+  template <typename Value,
+            std::size_t Arity = 4,
+            typename Better = std::less<Value> >
+  class d_ary_heap {
+    BOOST_STATIC_ASSERT (Arity >= 2);
+    public:
+    typedef std::vector<Value> container_type;
+    typedef typename container_type::size_type size_type;
+    typedef Value value_type;
+    typedef typename container_type::const_iterator const_iterator;
+    typedef const_iterator iterator;
+
+    explicit d_ary_heap(Better const& better = Better()) : better(better) {}
+
+    void reserve(size_type s) { data.reserve(s); }
+    size_type size() const { return data.size(); }
+    bool empty() const { return data.empty(); }
+    // in heap order, not sorted
+    const_iterator begin() const { return data.begin(); }
+    const_iterator end() const { return data.end(); }
+    void clear() { data.clear(); }
+
+    Value const& top() const { return data[0]; }
+
+    void push(Value const& v) {
+      const Value copy = v; // v may be one of ours
+      data.push_back(copy);
+      move_up(data.size() - 1, copy);
+    }
+
+    void pop() {
+      const Value last = data.back();
+      data.pop_back();
+      if (!data.empty()) move_down(0, last);
+    }
+
+    // adds v without restoring the heap property; call heapify() before
+    // using the heap again
+    void push_back(Value const& v) { data.push_back(v); }
+
+    // Floyd's method: adjusts every subtree from the last parent up to the root
+    void heapify() {
+      if (data.size() < 2) return;
+      for (size_type i = parent(data.size() - 1) + 1; i-- > 0;) {
+        const Value v = data[i];
+        move_down(i, v);
+      }
+    }
+
+    private:
+    Better better;
+    container_type data;
+
+    static inline size_type parent(size_type index) {
+      return (index - 1) / Arity;
+    }
+
+    static inline size_type first_child(size_type index) {
+      return index * Arity + 1;
+    }
+
+    // v belongs at the hole i or above it
+    void move_up(size_type i, Value const& v) {
+      while (i > 0) {
+        const size_type p = parent(i);
+        if (!better(v, data[p])) break;
+        data[i] = data[p];
+        i = p;
+      }
+      data[i] = v;
+    }
+
+    // v belongs at the hole i or below it
+    void move_down(size_type i, Value const& v) {
+      const size_type n = data.size();
+      for (;;) {
+        const size_type c = first_child(i);
+        if (c >= n) break;
+        size_type best = c;
+        if (c + Arity <= n) { // all children present; unrolled for constant Arity
+          for (std::size_t j = 1; j < Arity; ++j)
+            if (better(data[c + j], data[best])) best = c + j;
+        } else {
+          for (size_type j = c + 1; j < n; ++j)
+            if (better(data[j], data[best])) best = j;
+        }
+        if (!better(data[best], v)) break;
+        data[i] = data[best];
+        i = best;
+      }
+      data[i] = v;
+    }
+  };
+
 #endif
@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <cstdlib>
+#include <ctime>
+#include <functional>
+#include <iostream>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "d_ary_heap.h"
+#include "timing_stats.h"
+
+using namespace std;
+
+struct Item {
+  double score;
+  int id;
+};
+
+typedef keyed_ptr<double, Item> KeyedItem;
+
+template <size_t Arity>
+void PopAll(const vector<double>& keys, vector<double>* out) {
+  vector<Item> items(keys.size());
+  d_ary_heap<KeyedItem, Arity, greater<KeyedItem> > heap;
+  // half by heapify, half by push, with pops in between
+  const size_t half = keys.size() / 2;
+  for (size_t i = 0; i < half; ++i) {
+    items[i].score = keys[i];
+    heap.push_back(KeyedItem(keys[i], &items[i]));
+  }
+  heap.heapify();
+  out->clear();
+  for (size_t i = half; i < keys.size(); ++i) {
+    items[i].score = keys[i];
+    heap.push(KeyedItem(keys[i], &items[i]));
+    if (i % 3 == 0) {
+      EXPECT_EQ(heap.top().key, heap.top().ptr->score);
+      out->push_back(heap.top().key);
+      heap.pop();
+    }
+  }
+  while (!heap.empty()) {
+    out->push_back(heap.top().key);
+    heap.pop();
+  }
+}
+
+// what std::push_heap/pop_heap give for the same sequence of operations
+void StdPopAll(const vector<double>& keys, vector<double>* out) {
+  vector<double> heap(keys.begin(), keys.begin() + keys.size() / 2);
+  make_heap(heap.begin(), heap.end());
+  out->clear();
+  for (size_t i = keys.size() / 2; i < keys.size(); ++i) {
+    heap.push_back(keys[i]);
+    push_heap(heap.begin(), heap.end());
+    if (i % 3 == 0) {
+      pop_heap(heap.begin(), heap.end());
+      out->push_back(heap.back());
+      heap.pop_back();
+    }
+  }
+  while (!heap.empty()) {
+    pop_heap(heap.begin(), heap.end());
+    out->push_back(heap.back());
+    heap.pop_back();
+  }
+}
+
+TEST(DAryHeapTest, SameOrderAsStdHeap) {
+  srand(7);
+  for (int n = 0; n < 200; n += 7) {
+    vector<double> keys(n);
+    for (int i = 0; i < n; ++i) keys[i] = rand() % 50;  // plenty of ties
+    vector<double> expected, actual;
+    StdPopAll(keys, &expected);
+    PopAll<2>(keys, &actual);
+    EXPECT_EQ(expected, actual);
+    PopAll<3>(keys, &actual);
+    EXPECT_EQ(expected, actual);
+    PopAll<4>(keys, &actual);
+    EXPECT_EQ(expected, actual);
+    PopAll<8>(keys, &actual);
+    EXPECT_EQ(expected, actual);
+  }
+}
+
+TEST(DAryHeapTest, MinHeap) {
+  d_ary_heap<int, 4> heap;
+  EXPECT_TRUE(heap.empty());
+  heap.push(5);
+  heap.push(1);
+  heap.push(3);
+  heap.push(heap.top());
+  EXPECT_EQ(4u, heap.size());
+  EXPECT_EQ(1, heap.top()); heap.pop();
+  EXPECT_EQ(1, heap.top()); heap.pop();
+  EXPECT_EQ(3, heap.top()); heap.pop();
+  EXPECT_EQ(5, heap.top()); heap.pop();
+  EXPECT_TRUE(heap.empty());
+}
+
+// a cube pruning like workload: pop the best candidate and push up to 3
+// successors that are slightly worse, until the pop limit is reached
+template <size_t Arity>
+double TimeInline(const vector<double>& init, const vector<double>& deltas, int pops, double* checksum) {
+  vector<Item> items(init.size() + 3 * pops);
+  const double start = Timer::WallTime();
+  d_ary_heap<KeyedItem, Arity, greater<KeyedItem> > heap;
+  size_t next = 0;
+  for (; next < init.size(); ++next) {
+    items[next].score = init[next];
+    heap.push_back(KeyedItem(init[next], &items[next]));
+  }
+  heap.heapify();
+  for (int i = 0; i < pops && !heap.empty(); ++i) {
+    const Item* item = heap.top().ptr;
+    heap.pop();
+    *checksum += item->score;
+    for (int j = 0; j < 3; ++j, ++next) {
+      items[next].score = item->score - deltas[(i * 3 + j) % deltas.size()];
+      heap.push(KeyedItem(items[next].score, &items[next]));
+    }
+  }
+  return Timer::WallTime() - start;
+}
+
+struct ItemPtrCompare {
+  bool operator()(const Item* a, const Item* b) const { return a->score < b->score; }
+};
+
+// what the candidate heaps did before: std heap algorithms over pointers
+double TimeStdPointers(const vector<double>& init, const vector<double>& deltas, int pops, double* checksum) {
+  vector<Item> items(init.size() + 3 * pops);
+  const double start = Timer::WallTime();
+  vector<Item*> heap;
+  size_t next = 0;
+  for (; next < init.size(); ++next) {
+    items[next].score = init[next];
+    heap.push_back(&items[next]);
+  }
+  make_heap(heap.begin(), heap.end(), ItemPtrCompare());
+  for (int i = 0; i < pops && !heap.empty(); ++i) {
+    pop_heap(heap.begin(), heap.end(), ItemPtrCompare());
+    const Item* item = heap.back();
+    heap.pop_back();
+    *checksum += item->score;
+    for (int j = 0; j < 3; ++j, ++next) {
+      items[next].score = item->score - deltas[(i * 3 + j) % deltas.size()];
+      heap.push_back(&items[next]);
+      push_heap(heap.begin(), heap.end(), ItemPtrCompare());
+    }
+  }
+  return Timer::WallTime() - start;
+}
+
+// prints timings to compare branching factors; only checks that all of
+// them pop the same candidates
+TEST(DAryHeapTest, Benchmark) {
+  srand(11);
+  const int kPops = 200000;
+  vector<double> init(20000), deltas(1000);
+  for (int i = 0; i < init.size(); ++i) init[i] = -(rand() % 100000) / 1000.0;
+  for (int i = 0; i < deltas.size(); ++i) deltas[i] = (rand() % 1000) / 1000.0;
+  double c_std = 0, c2 = 0, c4 = 0, c8 = 0;
+  const double t_std = TimeStdPointers(init, deltas, kPops, &c_std);
+  const double t2 = TimeInline<2>(init, deltas, kPops, &c2);
+  const double t4 = TimeInline<4>(init, deltas, kPops, &c4);
+  const double t8 = TimeInline<8>(init, deltas, kPops, &c8);
+  cerr << "std heap of pointers: " << t_std << " secs\n"
+       << "inline 2-ary heap:    " << t2 << " secs\n"
+       << "inline 4-ary heap:    " << t4 << " secs\n"
+       << "inline 8-ary heap:    " << t8 << " secs\n";
+  EXPECT_EQ(c_std, c2);
+  EXPECT_EQ(c_std, c4);
+  EXPECT_EQ(c_std, c8);
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -25,3 +25,72 @@ void Dict::AsVector(const WordID& id, std::vector<std::string>* results) const {
   TokenizeStringSeparator(Convert(id), " ||| ", results);
 }
 
+
+Dict::~Dict() {
+  for (unsigned c = 0; c < MAX_CHUNKS; ++c) delete[] chunks_[c];
+  delete table_;
+  for (unsigned i = 0; i < retired_.size(); ++i) delete retired_[i];
+}
+
+void Dict::ConvertMany(const std::string& blob, const std::vector<unsigned>& ends, std::vector<WordID>* ids, bool frozen) {
+  ids->resize(ends.size());
+  boost::mutex::scoped_lock l(mutex_);
+  if (!frozen) Reserve(size_ + ends.size());
+  unsigned start = 0;
+  for (unsigned i = 0; i < ends.size(); start = ends[i++]) {
+    const StringPiece word(blob.data() + start, ends[i] - start);
+    const uint64_t h = Hash(word);
+    WordID id = Find(table_, h, word);
+    (*ids)[i] = (id || frozen) ? id : Insert(h, word);
+  }
+}
+
+void Dict::clear() {
+  boost::mutex::scoped_lock l(mutex_);
+  std::memset(table_->slots, 0, (table_->mask + 1) * sizeof(Slot));
+  size_ = 0;
+}
+
+WordID Dict::Insert(uint64_t h, const StringPiece& word) {
+  // another thread may have added it since the lock-free lookup
+  if (WordID id = Find(table_, h, word)) return id;
+  const unsigned i = size_;
+  const unsigned c = ChunkOf(i);
+  assert(c < MAX_CHUNKS);
+  if (!chunks_[c]) chunks_[c] = new std::string[FIRST_CHUNK << c];
+  chunks_[c][i - FIRST_CHUNK * ((1u << c) - 1)].assign(word.data(), word.size());
+  Reserve(i + 1);
+  const WordID id = i + 1;
+  Table* t = table_;
+  size_t s = h & t->mask;
+  while (t->slots[s].id) s = (s + 1) & t->mask;
+  t->slots[s].hash = h;
+#ifdef __GNUC__
+  __sync_synchronize();
+#endif
+  t->slots[s].id = id;
+  size_ = id;
+  return id;
+}
+
+// keeps the table at most half full
+void Dict::Reserve(size_t words) {
+  size_t n = table_->mask + 1;
+  if (words * 2 <= n) return;
+  while (words * 2 > n) n *= 2;
+  Table* t = new Table(n);
+  Table* old = table_;
+  for (size_t i = 0; i <= old->mask; ++i) {
+    const Slot& from = old->slots[i];
+    if (!from.id) continue;
+    size_t s = from.hash & t->mask;
+    while (t->slots[s].id) s = (s + 1) & t->mask;
+    t->slots[s].hash = from.hash;
+    t->slots[s].id = from.id;
+  }
+#ifdef __GNUC__
+  __sync_synchronize();
+#endif
+  retired_.push_back(old);
+  table_ = t;
+}
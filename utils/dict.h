@@ -4,22 +4,48 @@
 
 #include <cassert>
 #include <cstring>
+#include <stdint.h>
 
 #include <string>
 #include <vector>
-#include "hash.h"
+#include <boost/thread/mutex.hpp>
+#include "murmur_hash.h"
 #include "wordid.h"
+#include "util/string_piece.hh"
 
+/* string <-> id map shared by every thread (TD and FD are global).  Ids are
+   assigned 1, 2, ... in order of first Convert; 0 is reserved.
+
+   Looking up a word that is already present and Convert(WordID) take no lock.
+   Adding a word takes mutex_.  Words live in chunks that double in size and
+   are never moved, so the reference returned by Convert(WordID) stays valid
+   for the life of the Dict.  The index is an open addressing table of
+   (hash, id) slots; a writer fills a slot's hash before its id and publishes
+   a grown table only once it is complete.  Replaced tables are kept until
+   the Dict is destroyed since a reader may still be probing them.
+ */
 class Dict {
- typedef
- HASH_MAP<std::string, WordID, boost::hash<std::string> > Map;
+  enum { FIRST_CHUNK = 256, MAX_CHUNKS = 24 };
+  struct Slot {
+    uint64_t hash;
+    volatile WordID id; // 0 = empty
+  };
+  struct Table {
+    explicit Table(size_t n) : mask(n - 1), slots(new Slot[n]()) {}
+    ~Table() { delete[] slots; }
+    size_t mask;
+    Slot* slots;
+  };
+
  public:
-  Dict() : b0_("<bad0>") {
-    HASH_MAP_EMPTY(d_,"<bad1>");
-    words_.reserve(1000);
+  Dict() : b0_("<bad0>"), size_(0), table_(new Table(1024)) {
+    std::memset(chunks_, 0, sizeof(chunks_));
   }
+  ~Dict();
 
-  inline int max() const { return words_.size(); }
+  inline int max() const {
+    return size_;
+  }
 
   static bool is_ws(char x) {
     return (x == ' ' || x == '\t');
@@ -33,7 +59,7 @@ class Dict {
     while(cur < line.size()) {
       if (is_ws(line[cur++])) {
         if (state == 0) continue;
-        out->push_back(Convert(line.substr(last, cur - last - 1)));
+        out->push_back(Convert(StringPiece(line.data() + last, cur - last - 1)));
         state = 0;
       } else {
         if (state == 1) continue;
@@ -42,21 +68,28 @@ class Dict {
       }
     }
     if (state == 1)
-      out->push_back(Convert(line.substr(last, cur - last)));
+      out->push_back(Convert(StringPiece(line.data() + last, cur - last)));
   }
 
-  inline WordID Convert(const std::string& word, bool frozen = false) {
-    Map::iterator i = d_.find(word);
-    if (i == d_.end()) {
-      if (frozen)
-        return 0;
-      words_.push_back(word);
-      d_[word] = words_.size();
-      return words_.size();
-    } else {
-      return i->second;
-    }
+  // thread safe; only adding a new word locks.  a piece is hashed and
+  // compared in place, so only a new word is ever copied
+  inline WordID Convert(const StringPiece& word, bool frozen = false) {
+    const uint64_t h = Hash(word);
+    const WordID id = Find(table_, h, word);
+    if (id || frozen) return id;
+    boost::mutex::scoped_lock l(mutex_);
+    return Insert(h, word);
   }
+  inline WordID Convert(const std::string& word, bool frozen = false)
+  { return Convert(StringPiece(word), frozen); }
+  inline WordID Convert(const char* word, bool frozen = false)
+  { return Convert(StringPiece(word), frozen); }
+
+  // converts the words blob[ends[i-1],ends[i]) (the first starts at 0) under
+  // one lock, growing the table once for all of them.  ids[i] is the id of
+  // word i; new words get ids in order, just as with one Convert per word
+  // (or 0 if frozen)
+  void ConvertMany(const std::string& blob, const std::vector<unsigned>& ends, std::vector<WordID>* ids, bool frozen = false);
 
   inline WordID Convert(const std::vector<std::string>& words, bool frozen = false)
   { return Convert(toString(words), frozen); }
@@ -73,18 +106,56 @@ class Dict {
 
   inline const std::string& Convert(const WordID& id) const {
     if (id == 0) return b0_;
-    assert(id <= (int)words_.size());
-    return words_[id-1];
+    assert(id <= size_);
+    return Word(id - 1);
   }
 
   void AsVector(const WordID& id, std::vector<std::string>* results) const;
 
-  void clear() { words_.clear(); d_.clear(); }
+  // not safe while other threads are using the Dict
+  void clear();
 
  private:
+  static uint64_t Hash(const StringPiece& word) {
+    return MurmurHash64(word.data(), word.size());
+  }
+
+  // chunk c holds words [FIRST_CHUNK * (2^c - 1), FIRST_CHUNK * (2^(c+1) - 1))
+  static unsigned ChunkOf(unsigned i) {
+    unsigned x = i / FIRST_CHUNK + 1, c = 0;
+#ifdef __GNUC__
+    c = 31 - __builtin_clz(x);
+#else
+    while (x >>= 1) ++c;
+#endif
+    return c;
+  }
+  const std::string& Word(unsigned i) const {
+    const unsigned c = ChunkOf(i);
+    return chunks_[c][i - FIRST_CHUNK * ((1u << c) - 1)];
+  }
+
+  WordID Find(const Table* t, uint64_t h, const StringPiece& word) const {
+    for (size_t i = h & t->mask; ; i = (i + 1) & t->mask) {
+      const WordID id = t->slots[i].id;
+      if (!id) return 0;
+      if (t->slots[i].hash == h) {
+        const std::string& w = Word(id - 1);
+        if (w.size() == word.size() && !std::memcmp(w.data(), word.data(), w.size())) return id;
+      }
+    }
+  }
+
+  // callers hold mutex_
+  WordID Insert(uint64_t h, const StringPiece& word);
+  void Reserve(size_t words);
+
   const std::string b0_;
-  std::vector<std::string> words_;
-  Map d_;
+  std::string* chunks_[MAX_CHUNKS];
+  volatile int size_;
+  Table* volatile table_;
+  std::vector<Table*> retired_;
+  boost::mutex mutex_;
 };
 
 #endif
@@ -3,7 +3,9 @@
 #include "fdict.h"
 
 #include <iostream>
+#include <sstream>
 #include <gtest/gtest.h>
+#include <boost/thread/thread.hpp>
 #include <cassert>
 
 using namespace std;
@@ -28,6 +30,79 @@ TEST_F(DTest, Convert) {
   EXPECT_EQ(d.Convert(b), "bar");
 }
 
+TEST_F(DTest, ConvertMany) {
+  Dict d;
+  WordID bar = d.Convert("bar");
+  vector<unsigned> ends;
+  string blob = "foo";
+  ends.push_back(blob.size());
+  blob += "bar";
+  ends.push_back(blob.size());
+  blob += "baz";
+  ends.push_back(blob.size());
+  blob += "foo";
+  ends.push_back(blob.size());
+  vector<WordID> ids;
+  d.ConvertMany(blob, ends, &ids);
+  ASSERT_EQ(4, ids.size());
+  EXPECT_EQ(bar + 1, ids[0]);
+  EXPECT_EQ(bar, ids[1]);
+  EXPECT_EQ(bar + 2, ids[2]);
+  EXPECT_EQ(ids[0], ids[3]);
+  EXPECT_EQ("baz", d.Convert(ids[2]));
+  EXPECT_EQ(ids[2], d.Convert("baz"));
+}
+
+TEST_F(DTest, Grow) {
+  Dict d;
+  vector<string> words;
+  for (int i = 0; i < 20000; ++i) {
+    ostringstream o;
+    o << "w" << i;
+    words.push_back(o.str());
+    EXPECT_EQ(i + 1, d.Convert(words.back()));
+  }
+  const string& first = d.Convert(1);
+  for (int i = 0; i < 20000; ++i) {
+    EXPECT_EQ(i + 1, d.Convert(words[i], true));
+    EXPECT_EQ(words[i], d.Convert(i + 1));
+  }
+  EXPECT_EQ(&first, &d.Convert(1));
+  EXPECT_EQ(0, d.Convert("missing", true));
+  EXPECT_EQ(20000, d.max());
+}
+
+struct ConvertRange {
+  ConvertRange(Dict* d, int offset, vector<WordID>* ids) : d_(d), offset_(offset), ids_(ids) {}
+  void operator()() {
+    for (int i = 0; i < 5000; ++i) {
+      ostringstream o;
+      o << "w" << (i + offset_) % 5000;
+      ids_->push_back(d_->Convert(o.str()));
+    }
+  }
+  Dict* d_;
+  int offset_;
+  vector<WordID>* ids_;
+};
+
+TEST_F(DTest, Threads) {
+  Dict d;
+  vector<vector<WordID> > ids(4);
+  boost::thread_group threads;
+  for (int t = 0; t < 4; ++t)
+    threads.create_thread(ConvertRange(&d, t * 1250, &ids[t]));
+  threads.join_all();
+  EXPECT_EQ(5000, d.max());
+  for (int t = 0; t < 4; ++t) {
+    for (int i = 0; i < 5000; ++i) {
+      ostringstream o;
+      o << "w" << (i + t * 1250) % 5000;
+      EXPECT_EQ(o.str(), d.Convert(ids[t][i]));
+    }
+  }
+}
+
 TEST_F(DTest, FDictTest) {
   int fid = FD::Convert("First");
   EXPECT_GT(fid, 0);
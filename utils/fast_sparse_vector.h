@@ -6,9 +6,16 @@
 // fast operations when the sizes are large.
 // important: indexes are integers
 // important: iterators may return elements in any order
+//
+// vectors that outgrow the local array are moved to a std::map, or, if the
+// SORTED template argument is true, to a sorted contiguous array
+// (SortedPairArray below), which is faster to copy and iterate for mid-size
+// vectors and supports merge-based +=, -= and dot. SparseVector<T> uses the
+// sorted array if configure was run with --enable-sorted-sparse-vectors.
 
 #include "config.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cstring>
 #include <climits>
@@ -16,6 +23,7 @@
 #include <cassert>
 #include <vector>
 
+#include <boost/mpl/if.hpp>
 #include <boost/static_assert.hpp>
 
 #if HAVE_BOOST_ARCHIVE_TEXT_OARCHIVE_HPP
@@ -62,11 +70,127 @@ struct PairIntT {
 };
 BOOST_STATIC_ASSERT(sizeof(PairIntT<float>) == sizeof(std::pair<int,float>));
 
-template <typename T, int LOCAL_MAX = (sizeof(T) == sizeof(float) ? 15 : 7)>
+// the subset of the std::map<int, T> interface used by FastSparseVector,
+// implemented as an array sorted by index. Lookups are binary searches,
+// inserting in the middle is linear.
+template <typename T>
+class SortedPairArray {
+  typedef std::pair<int, T> Pair;
+ public:
+  typedef std::pair<const int, T> value_type;
+  typedef value_type* iterator;
+  typedef const value_type* const_iterator;
+
+  SortedPairArray() {}
+  SortedPairArray(const PairIntT<T>* b, const PairIntT<T>* e) {
+    v_.reserve(2 * (e - b));
+    for (; b != e; ++b) v_.push_back(Pair(b->first(), b->second()));
+    std::sort(v_.begin(), v_.end(), Less());
+  }
+
+  iterator begin() { return v_.empty() ? NULL : reinterpret_cast<iterator>(&v_[0]); }
+  iterator end() { return begin() + v_.size(); }
+  const_iterator begin() const { return v_.empty() ? NULL : reinterpret_cast<const_iterator>(&v_[0]); }
+  const_iterator end() const { return begin() + v_.size(); }
+  size_t size() const { return v_.size(); }
+
+  const_iterator find(int k) const {
+    const typename std::vector<Pair>::const_iterator it = LowerBound(k);
+    if (it == v_.end() || it->first != k) return end();
+    return begin() + (it - v_.begin());
+  }
+  T& operator[](int k) {
+    if (v_.empty() || v_.back().first < k) {  // appending is the common case
+      v_.push_back(Pair(k, T()));
+      return v_.back().second;
+    }
+    typename std::vector<Pair>::iterator it = v_.begin() + (LowerBound(k) - v_.begin());
+    if (it == v_.end() || it->first != k) it = v_.insert(it, Pair(k, T()));
+    return it->second;
+  }
+  void erase(int k) {
+    const typename std::vector<Pair>::const_iterator it = LowerBound(k);
+    if (it != v_.end() && it->first == k) v_.erase(v_.begin() + (it - v_.begin()));
+  }
+
+  // this += sign * o, in one pass over both arrays
+  void Merge(const SortedPairArray& o, bool subtract) {
+    std::vector<Pair> res;
+    res.reserve(v_.size() + o.v_.size());
+    typename std::vector<Pair>::const_iterator a = v_.begin(), b = o.v_.begin();
+    const typename std::vector<Pair>::const_iterator ae = v_.end(), be = o.v_.end();
+    while (a != ae && b != be) {
+      if (a->first < b->first) { res.push_back(*a); ++a; }
+      else if (b->first < a->first) {
+        res.push_back(subtract ? Pair(b->first, T() - b->second) : *b);
+        ++b;
+      } else {
+        res.push_back(*a);
+        if (subtract) res.back().second -= b->second; else res.back().second += b->second;
+        ++a; ++b;
+      }
+    }
+    res.insert(res.end(), a, ae);
+    for (; b != be; ++b)
+      res.push_back(subtract ? Pair(b->first, T() - b->second) : *b);
+    v_.swap(res);
+  }
+  T Dot(const SortedPairArray& o) const {
+    T res = T();
+    typename std::vector<Pair>::const_iterator a = v_.begin(), b = o.v_.begin();
+    const typename std::vector<Pair>::const_iterator ae = v_.end(), be = o.v_.end();
+    while (a != ae && b != be) {
+      if (a->first < b->first) ++a;
+      else if (b->first < a->first) ++b;
+      else { res += a->second * b->second; ++a; ++b; }
+    }
+    return res;
+  }
+
+ private:
+  struct Less {
+    bool operator()(const Pair& a, const Pair& b) const { return a.first < b.first; }
+    bool operator()(const Pair& a, int k) const { return a.first < k; }
+  };
+  typename std::vector<Pair>::const_iterator LowerBound(int k) const {
+    return std::lower_bound(v_.begin(), v_.end(), k, Less());
+  }
+  std::vector<Pair> v_;
+};
+
+// merging is only possible if both vectors are sorted arrays
+template <typename T>
+inline bool MergeRemote(std::map<int, T>*, const std::map<int, T>&, bool) { return false; }
+template <typename T>
+inline bool MergeRemote(SortedPairArray<T>* a, const SortedPairArray<T>& b, bool subtract) {
+  a->Merge(b, subtract);
+  return true;
+}
+
+template <typename T>
+inline T DotRemote(const std::map<int, T>& a, const std::map<int, T>& b) {
+  T res = T();
+  for (typename std::map<int, T>::const_iterator it = a.begin(); it != a.end(); ++it) {
+    const typename std::map<int, T>::const_iterator j = b.find(it->first);
+    if (j != b.end()) res += it->second * j->second;
+  }
+  return res;
+}
+template <typename T>
+inline T DotRemote(const SortedPairArray<T>& a, const SortedPairArray<T>& b) { return a.Dot(b); }
+
+#ifdef FSV_SORTED_REMOTE
+#define FSV_SORTED_DEFAULT true
+#else
+#define FSV_SORTED_DEFAULT false
+#endif
+
+template <typename T, int LOCAL_MAX = (sizeof(T) == sizeof(float) ? 15 : 7), bool SORTED = FSV_SORTED_DEFAULT>
 class FastSparseVector {
+  typedef typename boost::mpl::if_c<SORTED, SortedPairArray<T>, std::map<int, T> >::type Remote;
  public:
   struct const_iterator {
-    const_iterator(const FastSparseVector<T>& v, const bool is_end) : local_(!v.is_remote_) {
+    const_iterator(const FastSparseVector& v, const bool is_end) : local_(!v.is_remote_) {
       if (local_) {
         local_it_ = &v.data_.local[is_end ? v.local_size_ : 0];
       } else {
@@ -78,10 +202,10 @@ class FastSparseVector {
     }
     const bool local_;
     const PairIntT<T>* local_it_;
-    typename std::map<int, T>::const_iterator remote_it_;
+    typename Remote::const_iterator remote_it_;
     const std::pair<const int, T>& operator*() const {
       if (local_)
-        return *reinterpret_cast<const std::pair<const int, float>*>(local_it_);
+        return *reinterpret_cast<const std::pair<const int, T>*>(local_it_);
       else
         return *remote_it_;
     }
@@ -117,7 +241,7 @@ class FastSparseVector {
   }
   FastSparseVector(const FastSparseVector& other) {
     std::memcpy(this, &other, sizeof(FastSparseVector));
-    if (is_remote_) data_.rbmap = new std::map<int, T>(*data_.rbmap);
+    if (is_remote_) data_.rbmap = new Remote(*data_.rbmap);
   }
   void erase(int k) {
     if (is_remote_) {
@@ -129,16 +253,18 @@ class FastSparseVector {
             data_.local[j-1].first() = data_.local[j].first();
             data_.local[j-1].second() = data_.local[j].second();
           }
+          --local_size_;
+          return;
         }
       }
     }
   }
-  const FastSparseVector<T>& operator=(const FastSparseVector<T>& other) {
+  const FastSparseVector& operator=(const FastSparseVector& other) {
     if (&other == this) return *this;
     clear();
     std::memcpy(this, &other, sizeof(FastSparseVector));
     if (is_remote_)
-      data_.rbmap = new std::map<int, T>(*data_.rbmap);
+      data_.rbmap = new Remote(*data_.rbmap);
     return *this;
   }
   T const& get_singleton() const {
@@ -159,7 +285,7 @@ class FastSparseVector {
   }
   inline T value(int k) const {
     if (is_remote_) {
-      typename std::map<int, T>::const_iterator it = data_.rbmap->find(k);
+      typename Remote::const_iterator it = data_.rbmap->find(k);
       if (it != data_.rbmap->end()) return it->second;
     } else {
       for (int i = 0; i < local_size_; ++i) {
@@ -200,6 +326,8 @@ class FastSparseVector {
   }
   inline FastSparseVector& operator+=(const FastSparseVector& other) {
     if (empty()) { *this = other; return *this; }
+    if (is_remote_ && other.is_remote_ && MergeRemote(data_.rbmap, *other.data_.rbmap, false))
+      return *this;
     const typename FastSparseVector::const_iterator end = other.end();
     for (typename FastSparseVector::const_iterator it = other.begin(); it != end; ++it) {
       get_or_create_bin(it->first) += it->second;
@@ -215,6 +343,8 @@ class FastSparseVector {
     return *this;
   }
   inline FastSparseVector& operator-=(const FastSparseVector& other) {
+    if (is_remote_ && other.is_remote_ && MergeRemote(data_.rbmap, *other.data_.rbmap, true))
+      return *this;
     const typename FastSparseVector::const_iterator end = other.end();
     for (typename FastSparseVector::const_iterator it = other.begin(); it != end; ++it) {
       get_or_create_bin(it->first) -= it->second;
@@ -223,8 +353,8 @@ class FastSparseVector {
   }
   inline FastSparseVector& operator*=(const T& scalar) {
     if (is_remote_) {
-      const typename std::map<int, T>::iterator end = data_.rbmap->end();
-      for (typename std::map<int, T>::iterator it = data_.rbmap->begin(); it != end; ++it)
+      const typename Remote::iterator end = data_.rbmap->end();
+      for (typename Remote::iterator it = data_.rbmap->begin(); it != end; ++it)
         it->second *= scalar;
     } else {
       for (int i = 0; i < local_size_; ++i)
@@ -234,8 +364,8 @@ class FastSparseVector {
   }
   inline FastSparseVector& operator/=(const T& scalar) {
     if (is_remote_) {
-      const typename std::map<int, T>::iterator end = data_.rbmap->end();
-      for (typename std::map<int, T>::iterator it = data_.rbmap->begin(); it != end; ++it)
+      const typename Remote::iterator end = data_.rbmap->end();
+      for (typename Remote::iterator it = data_.rbmap->begin(); it != end; ++it)
         it->second /= scalar;
     } else {
       for (int i = 0; i < local_size_; ++i)
@@ -243,8 +373,8 @@ class FastSparseVector {
     }
     return *this;
   }
-  FastSparseVector<T> erase_zeros(const T& EPSILON = 1e-4) const {
-    FastSparseVector<T> o;
+  FastSparseVector erase_zeros(const T& EPSILON = 1e-4) const {
+    FastSparseVector o;
     for (const_iterator it = begin(); it != end(); ++it) {
       if (fabs(it->second) > EPSILON) o.set_value(it->first, it->second);
     }
@@ -270,20 +400,22 @@ class FastSparseVector {
       if (it->first < v.size()) res += it->second * v[it->first];
     return res;
   }
-  T dot(const FastSparseVector<T>& other) const {
+  T dot(const FastSparseVector& other) const {
+    if (is_remote_ && other.is_remote_)
+      return DotRemote(*data_.rbmap, *other.data_.rbmap);
     T res = T();
     for (const_iterator it = begin(), e = end(); it != e; ++it)
       res += other.value(it->first) * it->second;
     return res;
   }
-  bool operator==(const FastSparseVector<T>& other) const {
+  bool operator==(const FastSparseVector& other) const {
     if (other.size() != size()) return false;
     for (const_iterator it = begin(), e = end(); it != e; ++it) {
       if (other.value(it->first) != it->second) return false;
     }
     return true;
   }
-  void swap(FastSparseVector<T>& other) {
+  void swap(FastSparseVector& other) {
     char t[sizeof(data_)];
     std::swap(other.is_remote_, is_remote_);
     std::swap(other.local_size_, local_size_);
@@ -320,17 +452,17 @@ class FastSparseVector {
   void swap_local_rbmap() {
     if (is_remote_) { // data is in rbmap, move to local
       assert(data_.rbmap->size() < LOCAL_MAX);
-      const std::map<int, T>* m = data_.rbmap;
+      const Remote* m = data_.rbmap;
       local_size_ = m->size();
       int i = 0;
-      for (typename std::map<int, T>::const_iterator it = m->begin();
+      for (typename Remote::const_iterator it = m->begin();
            it != m->end(); ++it) {
         data_.local[i] = *it;
         ++i;
       }
       is_remote_ = false;
     } else { // data is local, move to rbmap
-      std::map<int, T>* m = new std::map<int, T>(&data_.local[0], &data_.local[local_size_]);
+      Remote* m = new Remote(&data_.local[0], &data_.local[local_size_]);
       data_.rbmap = m;
       is_remote_ = true;
     }
@@ -338,7 +470,7 @@ class FastSparseVector {
 
   union {
     PairIntT<T> local[LOCAL_MAX];
-    std::map<int, T>* rbmap;
+    Remote* rbmap;  // a std::map or a SortedPairArray
   } data_;
   unsigned char local_size_;
   bool is_remote_;
@@ -381,22 +513,22 @@ class FastSparseVector {
 BOOST_CLASS_TRACKING(FastSparseVector<double>,track_never)
 #endif
 
-template <typename T>
-const FastSparseVector<T> operator+(const FastSparseVector<T>& x, const FastSparseVector<T>& y) {
+template <typename T, int L, bool S>
+const FastSparseVector<T, L, S> operator+(const FastSparseVector<T, L, S>& x, const FastSparseVector<T, L, S>& y) {
   if (x.size() > y.size()) {
-    FastSparseVector<T> res(x);
+    FastSparseVector<T, L, S> res(x);
     res += y;
     return res;
   } else {
-    FastSparseVector<T> res(y);
+    FastSparseVector<T, L, S> res(y);
     res += x;
     return res;
   }
 }
 
-template <typename T>
-const FastSparseVector<T> operator-(const FastSparseVector<T>& x, const FastSparseVector<T>& y) {
-  FastSparseVector<T> res(x);
+template <typename T, int L, bool S>
+const FastSparseVector<T, L, S> operator-(const FastSparseVector<T, L, S>& x, const FastSparseVector<T, L, S>& y) {
+  FastSparseVector<T, L, S> res(x);
   res -= y;
   return res;
 }
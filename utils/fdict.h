@@ -17,9 +17,19 @@ struct FD {
   static inline WordID Convert(const std::string& s) {
     return dict_.Convert(s, frozen_);
   }
+  static inline WordID Convert(const StringPiece& s) {
+    return dict_.Convert(s, frozen_);
+  }
+  static inline WordID Convert(const char* s) {
+    return dict_.Convert(s, frozen_);
+  }
   static inline const std::string& Convert(const WordID& w) {
     return dict_.Convert(w);
   }
+  // see Dict::ConvertMany
+  static inline void ConvertMany(const std::string& blob, const std::vector<unsigned>& ends, std::vector<WordID>* ids) {
+    dict_.ConvertMany(blob, ends, ids, frozen_);
+  }
   static std::string Convert(WordID const *i,WordID const* e);
   static std::string Convert(std::vector<WordID> const& v);
 
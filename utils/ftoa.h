@@ -65,14 +65,14 @@ struct ftoa_traits<FLOATT> { \
   typedef u ## INTT uint_t; \
   typedef FLOATT float_t; \
   enum { digits10=std::numeric_limits<INTT>::digits10, chars_block=P10, usedig=used, sigdig=sigd, roundtripdig=roundtripd, bufsize=roundtripdig+7 }; \
-  static const double pow10_block = 1e ## P10; \
-  static const float_t small_f = small; \
-  static const float_t large_f = large; \
+  static inline double pow10_block() { return 1e ## P10; } \
+  static inline float_t small_f() { return small; } \
+  static inline float_t large_f() { return large; } \
   static inline int sprintf(char *buf,double f) { return std::sprintf(buf,"%." #used "g",f); } \
   static inline int sprintf_sci(char *buf,double f) { return std::sprintf(buf,"%." #used "e",f); } \
   static inline int sprintf_nonsci(char *buf,double f) { return std::sprintf(buf,"%." #used "f",f); } \
-  static inline uint_t fracblock(double frac) { FTOAassert(frac>=0 && frac<1); double f=frac*pow10_block;uint_t i=(uint_t)f;FTOAassert(i<pow10_block);return i; } \
-  static inline uint_t rounded_fracblock(double frac) { FTOAassert(frac>=0 && frac<1); double f=frac*pow10_block;uint_t i=(uint_t)(f+.5);FTOAassert(i<pow10_block);return i; }  \
+  static inline uint_t fracblock(double frac) { FTOAassert(frac>=0 && frac<1); double f=frac*pow10_block();uint_t i=(uint_t)f;FTOAassert(i<pow10_block());return i; } \
+  static inline uint_t rounded_fracblock(double frac) { FTOAassert(frac>=0 && frac<1); double f=frac*pow10_block();uint_t i=(uint_t)(f+.5);FTOAassert(i<pow10_block());return i; }  \
   static inline float_t mantexp10(float_t f,int &exp) { float_t e=std::log10(f); float_t ef=std::floor(e); exp=ef;  return f/std::pow((float_t)10,ef); } \
   static inline bool use_sci_abs(float_t fa) { return fa<small || fa>large; } \
   static inline bool use_sci(float_t f) { return use_sci_abs(std::fabs(f)); }   \
@@ -212,6 +212,9 @@ inline char *append_frac(char *p,F f,bool positive_sign=false) {
 
 //append_frac, append_pos_sci, append_sci.  notice these are all composed according to a pattern (but reversing order of composition in pre vs app).  or can implement with copy through buffer
 
+template <class F>
+inline char *prepend_pos_sci(char *p,F f,bool positive_sign_exp=false);
+
 /* will switch to sci notation if integer part is too big for the int type. but for very small values, will simply display 0 (i.e. //TODO: find out log10 and leftpad 0s then convert rest) */
 template <class F>
 char *prepend_pos_nonsci(char *p,F f) {
@@ -288,7 +291,7 @@ inline char *prepend_nonsci(char *p,F f,bool positive_sign=false) {
 }
 
 template <class F>
-inline char *prepend_pos_sci(char *p,F f,bool positive_sign_exp=false) {
+inline char *prepend_pos_sci(char *p,F f,bool positive_sign_exp) {
   FTOAassert(f>0);
   typedef ftoa_traits<F> FT;
   int e10;
@@ -400,4 +403,63 @@ inline char *static_ftoa(float f)
 }
 
 
+// writes f exactly as printf("%.*g",precision,f) (and so ostream<<f at that
+// precision) would, returns the end; no nul.  p needs room for 32 chars.
+// Fixed notation with at most 9 significant digits - nearly every feature
+// value and score we print - takes one multiply by an exact power of 10 and
+// an integer conversion.  Values whose rounding is too close to call that
+// way, scientific notation, inf and nan go through snprintf.
+inline char *append_printf_g(char *p,double f,int precision=6) {
+  static const double pow10[]={1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,1e12};
+  static const double neg_pow10[]={1e-1,1e-2,1e-3,1e-4}; // all slightly above 10^-k
+  if (precision==0) precision=1;
+  const double a=std::fabs(f);
+  if (precision<=9 && a>=neg_pow10[3] && a<pow10[precision]) {
+    int e10=-4;  // 10^e10 <= a < 10^(e10+1)
+    while (e10<-1 && a>=neg_pow10[-e10-2]) ++e10;
+    if (e10==-1 && a>=1) e10=0;
+    while (e10>=0 && a>=pow10[e10+1]) ++e10;
+    const double scaled=a*pow10[precision-1-e10];  // in [10^(P-1),10^P), one rounding
+    const double r=std::floor(scaled);
+    const double frac=scaled-r;
+    if (std::fabs(frac-.5)>1e-6) {
+      uint64_t digits=(uint64_t)r+(frac>.5);
+      if (digits==(uint64_t)pow10[precision]) {  // rounded up to the next power of 10
+        digits/=10;
+        ++e10;
+      }
+      if (e10<precision) {
+        char d[10];
+        char *de=d+precision;
+        utoa(de,digits);
+        if (std::signbit(f)) *p++='-';
+        // [d,de) are the significant digits; drop trailing 0s after the point
+        const int int_digits=e10+1;
+        while (de>d+(int_digits>0?int_digits:0) && de[-1]=='0') --de;
+        if (int_digits>0) {
+          std::memcpy(p,d,int_digits);
+          p+=int_digits;
+          if (de>d+int_digits) {
+            *p++='.';
+            std::memcpy(p,d+int_digits,de-d-int_digits);
+            p+=de-d-int_digits;
+          }
+        } else {
+          *p++='0';
+          *p++='.';
+          for (int i=int_digits;i<0;++i) *p++='0';
+          std::memcpy(p,d,de-d);
+          p+=de-d;
+        }
+        return p;
+      }
+    }
+  } else if (f==0) {
+    if (std::signbit(f)) *p++='-';
+    *p++='0';
+    return p;
+  }
+  return p+std::snprintf(p,32,"%.*g",precision,f);
+}
+
 #endif
@@ -30,6 +30,9 @@
 #include <iostream>
 #include <cstring>  // for memcpy
 #include <stdexcept>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 
 #ifdef GZSTREAM_NAMESPACE
 namespace GZSTREAM_NAMESPACE {
@@ -39,10 +42,143 @@ namespace GZSTREAM_NAMESPACE {
 // Internal classes to implement gzstream. See header file for user classes.
 // ----------------------------------------------------------------------------
 
+// --------------------------------------
+// class gzreadahead:
+// --------------------------------------
+
+// Inflates into one buffer on its own thread while the reader consumes the
+// other.  The thread owns the gzFile until it finishes: it stops after end
+// of file, an error, or a request from the reader.
+struct gzreadahead {
+    gzreadahead(gzFile f, int size)
+        : file(f), size(size), owned(new char[size]), buffer(owned),
+          full(false), num(0), eof(false), stop(false) {
+        thread = new boost::thread(Runner(this));
+    }
+    ~gzreadahead() {
+        {
+            boost::mutex::scoped_lock l(mutex);
+            stop = true;
+        }
+        changed.notify_all();
+        thread->join();
+        delete thread;
+        delete[] owned;
+    }
+
+    struct Runner {
+        explicit Runner(gzreadahead* a) : a(a) {}
+        void operator()() { a->run(); }
+        gzreadahead* a;
+    };
+
+    void run() {
+        for (;;) {
+            {
+                boost::mutex::scoped_lock l(mutex);
+                while (full && !stop) changed.wait(l);
+                if (stop) return;
+            }
+            int n = gzread(file, buffer + 4, size - 4);
+            boost::mutex::scoped_lock l(mutex);
+            full = true;
+            num = n;
+            if (n <= 0) {
+                int errnum = Z_OK;
+                const char* msg = gzerror(file, &errnum);
+                eof = gzeof(file);
+                if (!eof) error = (errnum == Z_DATA_ERROR) ? "CRC error reading gzip" : msg;
+            }
+            changed.notify_all();
+            if (n <= 0) return;
+        }
+    }
+
+    gzFile file;
+    const int size;
+    char* owned;  // the second buffer, wherever it is now
+    char* buffer; // the thread fills buffer + 4; swapped with the reader's
+    bool full;    // buffer holds num bytes the reader hasn't taken
+    int num;
+    bool eof;
+    std::string error;
+    bool stop;
+    boost::mutex mutex;
+    boost::condition_variable changed;
+    boost::thread* thread;
+};
+
+// --------------------------------------
+// class gzwritebehind:
+// --------------------------------------
+
+// Deflates one buffer on its own thread while the writer fills the other.
+// The thread writes to the gzFile until it is destroyed, which waits for the
+// last buffer; the first error stops it.
+struct gzwritebehind {
+    gzwritebehind(gzFile f, int size)
+        : file(f), owned(new char[size]), buffer(owned),
+          full(false), num(0), stop(false) {
+        thread = new boost::thread(Runner(this));
+    }
+    ~gzwritebehind() {
+        {
+            boost::mutex::scoped_lock l(mutex);
+            stop = true;
+        }
+        changed.notify_all();
+        thread->join();
+        delete thread;
+        delete[] owned;
+    }
+
+    struct Runner {
+        explicit Runner(gzwritebehind* b) : b(b) {}
+        void operator()() { b->run(); }
+        gzwritebehind* b;
+    };
+
+    void run() {
+        for (;;) {
+            {
+                boost::mutex::scoped_lock l(mutex);
+                while (!full && !stop) changed.wait(l);
+                if (!full) return;
+            }
+            int n = gzwrite(file, buffer, num);
+            boost::mutex::scoped_lock l(mutex);
+            full = false;
+            if (n != num) {
+                int errnum = Z_OK;
+                error = gzerror(file, &errnum);
+                if (error.empty()) error = "write failed";
+            }
+            changed.notify_all();
+            if (n != num) return;
+        }
+    }
+
+    gzFile file;
+    char* owned;  // the second buffer, wherever it is now
+    char* buffer; // the thread writes num bytes from buffer; swapped with the writer's
+    bool full;    // buffer holds num bytes the thread hasn't written
+    int num;
+    std::string error;
+    bool stop;
+    boost::mutex mutex;
+    boost::condition_variable changed;
+    boost::thread* thread;
+};
+
 // --------------------------------------
 // class gzstreambuf:
 // --------------------------------------
 
+bool gzstreambuf::background_inflate = true;
+bool gzstreambuf::background_deflate = true;
+int gzstreambuf::compression_level = -1;
+char gzstreambuf::compression_strategy = 0;
+
 gzstreambuf* gzstreambuf::open( const char* name, int open_mode) {
     if ( is_open())
         return (gzstreambuf*)0;
@@ -59,6 +195,12 @@ gzstreambuf* gzstreambuf::open( const char* name, int open_mode) {
     else if ( mode & std::ios::out)
         *fmodeptr++ = 'w';
     *fmodeptr++ = 'b';
+    if (mode & std::ios::out) {
+        if (compression_level >= 0 && compression_level <= 9)
+            *fmodeptr++ = '0' + compression_level;
+        if (compression_strategy)
+            *fmodeptr++ = compression_strategy;
+    }
     while (fmodeptr<fmode+Nmode) // hopefully wil help valgrind
       *fmodeptr++ = '\0';
     file = gzopen( name, fmode);
@@ -66,6 +208,10 @@ gzstreambuf* gzstreambuf::open( const char* name, int open_mode) {
     if (file == 0)
         return (gzstreambuf*)0;
     opened = 1;
+    if ((mode & std::ios::in) && background_inflate)
+        ahead = new gzreadahead(file, bufferSize);
+    if ((mode & std::ios::out) && background_deflate)
+        behind = new gzwritebehind(file, bufferSize);
     return this;
 }
 
@@ -73,6 +219,19 @@ gzstreambuf * gzstreambuf::close() {
     if ( is_open()) {
         sync();
         opened = 0;
+        if (ahead) {
+            delete ahead;
+            ahead = 0;
+            get_buffer = buffer;
+            setg( buffer + 4, buffer + 4, buffer + 4);
+        }
+        if (behind) {
+            const std::string error = finish_write_behind();
+            if (!error.empty()) {
+                gzclose( file);
+                throw std::runtime_error(std::string("gzstreambuf error: ") + error);
+            }
+        }
         if ( gzclose( file) == Z_OK)
             return this;
         else
@@ -98,29 +257,96 @@ int gzstreambuf::underflow() { // used for input buffer only
     int n_putback = gptr() - eback();
     if ( n_putback > 4)
         n_putback = 4;
-    std::memcpy( buffer + (4 - n_putback), gptr() - n_putback, n_putback);
 
-    int num = gzread( file, buffer+4, bufferSize-4);
-    if (num <= 0) // ERROR or EOF
-    {
-        if (gzeof(file))
+    int num;
+    if (ahead) {
+        // save the putback bytes first: the thread refills their buffer
+        char putback[4];
+        std::memcpy( putback, gptr() - n_putback, n_putback);
+        num = read_ahead(get_buffer);
+        if (num <= 0)
             return EOF;
-        handle_gzerror();
+        std::memcpy( get_buffer + (4 - n_putback), putback, n_putback);
+    } else {
+        std::memcpy( buffer + (4 - n_putback), gptr() - n_putback, n_putback);
+        num = gzread( file, buffer+4, bufferSize-4);
+        if (num <= 0) // ERROR or EOF
+        {
+            if (gzeof(file))
+                return EOF;
+            handle_gzerror();
+        }
     }
 
     // reset buffer pointers
-    setg( buffer + (4 - n_putback),   // beginning of putback area
-          buffer + 4,                 // read position
-          buffer + 4 + num);          // end of buffer
+    setg( get_buffer + (4 - n_putback),   // beginning of putback area
+          get_buffer + 4,                 // read position
+          get_buffer + 4 + num);          // end of buffer
 
     // return next character
     return * reinterpret_cast<unsigned char *>( gptr());
 }
 
+// waits for the background thread's next buffer and swaps it for `to',
+// which the thread refills.  returns the bytes now at get_buffer + 4
+int gzstreambuf::read_ahead(char* to) {
+    boost::mutex::scoped_lock l(ahead->mutex);
+    while (!ahead->full) ahead->changed.wait(l);
+    if (ahead->num <= 0) {
+        if (ahead->eof)
+            return EOF;
+        throw std::runtime_error(std::string("gzstreambuf error: ") + ahead->error);
+    }
+    get_buffer = ahead->buffer;
+    ahead->buffer = to;
+    ahead->full = false;
+    ahead->changed.notify_all();
+    return ahead->num;
+}
+
+// waits for the background thread to finish its buffer, hands it `from'
+// to write and returns the thread's old buffer, for the writer to fill
+char* gzstreambuf::write_behind(char* from, int num) {
+    boost::mutex::scoped_lock l(behind->mutex);
+    while (behind->full) behind->changed.wait(l);
+    if (!behind->error.empty())
+        throw std::runtime_error(std::string("gzstreambuf error: ") + behind->error);
+    char* to = behind->buffer;
+    behind->buffer = from;
+    behind->num = num;
+    behind->full = true;
+    behind->changed.notify_all();
+    return to;
+}
+
+// waits for the background thread to write everything, stops it and
+// returns its error, if any.  the put area, empty after sync(), goes back to
+// buffer: the other one was the thread's
+std::string gzstreambuf::finish_write_behind() {
+    std::string error;
+    {
+        boost::mutex::scoped_lock l(behind->mutex);
+        while (behind->full) behind->changed.wait(l);
+        error = behind->error;
+    }
+    delete behind;
+    behind = 0;
+    put_buffer = buffer;
+    setp( buffer, buffer + (bufferSize-1));
+    return error;
+}
+
 int gzstreambuf::flush_buffer() {
     // Separate the writing of the buffer from overflow() and
     // sync() operation.
     int w = pptr() - pbase();
+    if (behind) {
+        if (w) {
+            put_buffer = write_behind(pbase(), w);
+            setp( put_buffer, put_buffer + (bufferSize-1));
+        }
+        return w;
+    }
     if ( gzwrite( file, pbase(), w) != w)
         handle_gzerror();
     pbump( -w);
@@ -32,6 +32,7 @@
 // standard C++ with new header file names and std:: namespace
 #include <iostream>
 #include <fstream>
+#include <string>
 #include <zlib.h>
 
 #ifdef GZSTREAM_NAMESPACE
@@ -42,6 +43,9 @@ namespace GZSTREAM_NAMESPACE {
 // Internal classes to implement gzstream. See below for user classes.
 // ----------------------------------------------------------------------------
 
+struct gzreadahead;
+struct gzwritebehind;
+
 class gzstreambuf : public std::streambuf {
 private:
   static const int bufferSize = 47+(1024*256);    // size of data buff
@@ -51,16 +55,36 @@ private:
     char             buffer[bufferSize]; // data buffer
     char             opened;             // open/close state of stream
     int              mode;               // I/O mode
+    char*            get_buffer;         // buffer the get area is in
+    char*            put_buffer;         // buffer the put area is in
+    gzreadahead*     ahead;              // background inflate, or 0
+    gzwritebehind*   behind;             // background deflate, or 0
 
     int flush_buffer();
     void handle_gzerror(); // throws exception
+    int read_ahead(char* to);
+    char* write_behind(char* from, int num);
+    std::string finish_write_behind();
 public:
+    // when true (the default), files opened for reading are inflated on a
+    // background thread one buffer ahead of the reader
+    static bool background_inflate;
+    // when true (the default), files opened for writing are deflated on a
+    // background thread while the writer fills the next buffer
+    static bool background_deflate;
+    // zlib level (0-9) for files opened for writing; -1 is zlib's default (6)
+    static int compression_level;
+    // zlib strategy for files opened for writing, as in gzopen's mode: 0
+    // for the default, 'f' filtered, 'h' Huffman coding only (much faster,
+    // larger files) or 'R' run-length encoding
+    static char compression_strategy;
+
 #if defined(_WIN32) && !defined(CYGWIN) && !defined(EOF)
 	enum {
 		EOF = -1
 	};
 #endif
-    gzstreambuf() : opened(0) {
+    gzstreambuf() : opened(0), get_buffer(buffer), put_buffer(buffer), ahead(0), behind(0) {
         setp( buffer, buffer + (bufferSize-1));
         setg( buffer + 4,     // beginning of putback area
               buffer + 4,     // read position
@@ -0,0 +1,96 @@
+#include "gzstream.h"
+
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <gtest/gtest.h>
+
+using namespace std;
+
+class GzstreamTest : public testing::Test {
+ protected:
+  virtual void SetUp() {
+    char name[] = "/tmp/gzstream_test.XXXXXX";
+    close(mkstemp(name));
+    file = string(name) + ".gz";
+    unlink(name);
+    // several buffers' worth, so the background thread swaps a few times
+    ostringstream o;
+    for (int i = 0; i < 200000; ++i)
+      o << "line " << i << " " << (i * 7919 % 1000) << '\n';
+    text = o.str();
+  }
+  virtual void TearDown() {
+    unlink(file.c_str());
+    gzstreambuf::background_deflate = true;
+    gzstreambuf::compression_level = -1;
+    gzstreambuf::compression_strategy = 0;
+  }
+
+  // writes text in pieces and with flushes, like output code does
+  void Write() {
+    ogzstream out(file.c_str());
+    ASSERT_TRUE(out.good());
+    for (size_t i = 0; i < text.size(); i += 1000) {
+      out << text.substr(i, 1000);
+      if (i % 100000 == 0) out << flush;
+    }
+    out.close();
+    ASSERT_TRUE(out.good());
+  }
+
+  string Read() {
+    igzstream in(file.c_str());
+    ostringstream o;
+    o << in.rdbuf();
+    return o.str();
+  }
+
+  off_t Size() {
+    struct stat sb;
+    return stat(file.c_str(), &sb) ? -1 : sb.st_size;
+  }
+
+  string file;
+  string text;
+};
+
+TEST_F(GzstreamTest, RoundTrip) {
+  gzstreambuf::background_deflate = false;
+  Write();
+  EXPECT_EQ(text, Read());
+  const off_t foreground = Size();
+  gzstreambuf::background_deflate = true;
+  Write();
+  EXPECT_EQ(text, Read());
+  EXPECT_EQ(foreground, Size());
+}
+
+TEST_F(GzstreamTest, Levels) {
+  gzstreambuf::compression_level = 0;
+  Write();
+  EXPECT_EQ(text, Read());
+  const off_t stored = Size();
+  EXPECT_GT(stored, static_cast<off_t>(text.size()));
+  gzstreambuf::compression_level = 1;
+  Write();
+  EXPECT_EQ(text, Read());
+  const off_t fast = Size();
+  EXPECT_LT(fast, stored);
+  gzstreambuf::compression_level = 9;
+  Write();
+  EXPECT_EQ(text, Read());
+  EXPECT_LE(Size(), fast);
+  gzstreambuf::compression_level = 1;
+  gzstreambuf::compression_strategy = 'h';
+  Write();
+  EXPECT_EQ(text, Read());
+  EXPECT_LT(Size(), stored);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
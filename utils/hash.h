@@ -13,6 +13,7 @@
 # define HASH_SET google::dense_hash_set
 # define HASH_MAP_RESERVED(h,empty,deleted) do { h.set_empty_key(empty); h.set_deleted_key(deleted); } while(0)
 # define HASH_MAP_EMPTY(h,empty) do { h.set_empty_key(empty); } while(0)
+# define HASH_MAP_RESIZE(h,n) h.resize(n)
 #else
 # include <tr1/unordered_map>
 # include <tr1/unordered_set>
@@ -20,6 +21,7 @@
 # define HASH_SET std::tr1::unordered_set
 # define HASH_MAP_RESERVED(h,empty,deleted)
 # define HASH_MAP_EMPTY(h,empty)
+# define HASH_MAP_RESIZE(h,n) h.rehash(n)
 #endif
 
 #define BOOST_HASHED_MAP(k,v) HASH_MAP<k,v,boost::hash<k> >
@@ -50,15 +52,32 @@ struct murmur_hash<std::string>
   }
 };
 
-// uses begin(),size() assuming contiguous layout and POD
+// hash of PODs laid out contiguously.  Use this (or murmur_hash_array)
+// instead of boost::hash_range for WordID sequences and the like: it reads
+// the bytes a word at a time where hash_range combines element by element
+inline MurmurInt hash_pod_array(void const* p, std::size_t n_bytes, uint32_t seed=DEFAULT_SEED) {
+  return MurmurHash(p, (int)n_bytes, seed);
+}
+
+template <class T>
+inline MurmurInt hash_pod_array(T const* b, T const* e, uint32_t seed=DEFAULT_SEED) {
+  return hash_pod_array((void const*)b, (e - b) * sizeof(T), seed);
+}
+
+// uses begin(),size() assuming contiguous layout and POD, e.g.
+// unordered_map<std::vector<WordID>, V, murmur_hash_array<std::vector<WordID> > >.
+// Empty containers are fine.  Give different seeds to tables whose hashes
+// must not be correlated
 template <class C>
 struct murmur_hash_array
 {
   typedef MurmurInt result_type;
   typedef C /*const&*/ argument_type;
+  explicit murmur_hash_array(uint32_t seed=DEFAULT_SEED) : seed(seed) {}
   result_type operator()(argument_type const& c) const {
-    return MurmurHash(&*c.begin(),c.size()*sizeof(*c.begin()));
+    return c.empty() ? MurmurHash(NULL, 0, seed) : hash_pod_array(&*c.begin(), c.size()*sizeof(*c.begin()), seed);
   }
+  uint32_t seed;
 };
 
 
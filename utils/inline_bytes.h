@@ -0,0 +1,137 @@
+#ifndef _INLINE_BYTES_H_
+#define _INLINE_BYTES_H_
+
+/* fixed size byte array (same interface as ValueArray<uint8_t>) that stores
+   up to INLINE_MAX bytes inside the object and only goes to the heap for
+   larger arrays.  storage is always a whole number of 64-bit words, and the
+   bytes past size() are kept zero, so equality and hashing work a word at a
+   time instead of a byte at a time.
+
+   only code that writes through operator[]/begin() within [0,size()) is
+   supported - writing past size() would break the zero padding.
+ */
+
+#include <cstddef>
+#include <cstring>
+#include <cassert>
+#include <stdint.h>
+#include <iostream>
+#include "murmur_hash.h"
+
+template <int INLINE_MAX=64>
+class InlineBytes {
+  typedef InlineBytes<INLINE_MAX> Self;
+  enum { INLINE_WORDS = (INLINE_MAX + 7) / 8 };
+  static unsigned Words(unsigned s) { return (s + 7) / 8; }
+  bool is_inline() const { return size_ <= INLINE_WORDS * 8; }
+  uint64_t* words() { return is_inline() ? data_.words : data_.ptr; }
+  const uint64_t* words() const { return is_inline() ? data_.words : data_.ptr; }
+
+  // leaves size_ == s with all storage (contents and padding) zero
+  void Alloc(unsigned s) {
+    size_ = s;
+    if (is_inline())
+      std::memset(data_.words, 0, sizeof(data_.words));
+    else
+      data_.ptr = new uint64_t[Words(s)]();
+  }
+  void Free() {
+    if (!is_inline()) delete[] data_.ptr;
+  }
+
+ public:
+  typedef uint8_t value_type;
+  typedef uint8_t& reference;
+  typedef const uint8_t& const_reference;
+  typedef uint8_t* iterator;
+  typedef const uint8_t* const_iterator;
+  typedef std::size_t size_type;
+
+  InlineBytes() { Alloc(0); }
+  explicit InlineBytes(size_type s) { Alloc(s); }
+  InlineBytes(size_type s, uint8_t v) {
+    Alloc(s);
+    if (v) std::memset(begin(), v, s);
+  }
+  InlineBytes(const Self& o) {
+    Alloc(o.size_);
+    std::memcpy(words(), o.words(), Words(size_) * 8);
+  }
+  ~InlineBytes() { Free(); }
+
+  Self& operator=(const Self& o) {
+    if (this != &o) {
+      if (o.size_ != size_) {
+        Free();
+        Alloc(o.size_);
+      }
+      std::memcpy(words(), o.words(), Words(size_) * 8);
+    }
+    return *this;
+  }
+
+  void swap(Self& o) {
+    std::swap(data_, o.data_);
+    std::swap(size_, o.size_);
+  }
+
+  // keeps the first min(s, size()) bytes; new bytes are zero
+  void resize(size_type s) {
+    if (s == size_) return;
+    Self n(s);
+    std::memcpy(n.begin(), begin(), s < size_ ? s : size_);
+    swap(n);
+  }
+  void clear() { resize(0); }
+
+  size_type size() const { return size_; }
+  bool empty() const { return !size_; }
+
+  iterator begin() { return reinterpret_cast<uint8_t*>(words()); }
+  iterator end() { return begin() + size_; }
+  const_iterator begin() const { return reinterpret_cast<const uint8_t*>(words()); }
+  const_iterator end() const { return begin() + size_; }
+
+  reference operator[](size_type i) { return begin()[i]; }
+  const_reference operator[](size_type i) const { return begin()[i]; }
+
+  bool operator==(const Self& o) const {
+    if (size_ != o.size_) return false;
+    const uint64_t* a = words();
+    const uint64_t* b = o.words();
+    for (unsigned i = 0, n = Words(size_); i < n; ++i)
+      if (a[i] != b[i]) return false;
+    return true;
+  }
+  bool operator!=(const Self& o) const { return !(*this == o); }
+
+  bool operator<(const Self& o) const {
+    if (size_ != o.size_) return size_ < o.size_;
+    return std::memcmp(begin(), o.begin(), size_) < 0;
+  }
+
+  friend inline std::size_t hash_value(const Self& x) {
+    return MurmurHash64(x.words(), Words(x.size_) * 8);
+  }
+
+  friend inline std::ostream& operator<<(std::ostream& o, const Self& s) {
+    o << '[';
+    for (unsigned i = 0; i < s.size_; ++i) {
+      if (i) o << ' ';
+      o << static_cast<int>(s[i]);
+    }
+    return o << ']';
+  }
+
+ private:
+  union {
+    uint64_t words[INLINE_WORDS];
+    uint64_t* ptr;
+  } data_;
+  uint32_t size_;
+};
+
+template <int N>
+inline void swap(InlineBytes<N>& a, InlineBytes<N>& b) { a.swap(b); }
+
+#endif
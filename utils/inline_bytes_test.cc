@@ -0,0 +1,66 @@
+#include "inline_bytes.h"
+
+#include <gtest/gtest.h>
+#include <boost/functional/hash.hpp>
+
+using namespace std;
+
+typedef InlineBytes<16> IB;
+
+class InlineBytesTest : public testing::Test {
+ protected:
+  virtual void SetUp() { }
+  virtual void TearDown() { }
+};
+
+TEST_F(InlineBytesTest, Inline) {
+  IB a(5);
+  EXPECT_EQ(5, a.size());
+  for (int i = 0; i < 5; ++i) EXPECT_EQ(0, a[i]);
+  a[0] = 1; a[4] = 9;
+  IB b(a);
+  EXPECT_TRUE(a == b);
+  EXPECT_EQ(hash_value(a), hash_value(b));
+  b[4] = 8;
+  EXPECT_FALSE(a == b);
+  EXPECT_TRUE(b < a);
+  b = a;
+  EXPECT_TRUE(a == b);
+  EXPECT_FALSE(IB(4) == IB(5));
+}
+
+TEST_F(InlineBytesTest, Heap) {
+  IB a(40, 3);
+  IB b(40);
+  EXPECT_FALSE(a == b);
+  b = a;
+  EXPECT_TRUE(a == b);
+  EXPECT_EQ(hash_value(a), hash_value(b));
+  EXPECT_EQ(3, b[39]);
+  IB c(3, 7);
+  c.swap(b);
+  EXPECT_EQ(40, c.size());
+  EXPECT_EQ(3, b.size());
+  EXPECT_TRUE(c == a);
+  EXPECT_EQ(7, b[2]);
+}
+
+TEST_F(InlineBytesTest, Resize) {
+  IB a(3, 5);
+  a.resize(30);
+  EXPECT_EQ(30, a.size());
+  EXPECT_EQ(5, a[2]);
+  EXPECT_EQ(0, a[3]);
+  a.resize(2);
+  IB b(2, 5);
+  EXPECT_TRUE(a == b);
+  EXPECT_EQ(hash_value(a), hash_value(b));
+  b.resize(0);
+  EXPECT_TRUE(b.empty());
+  EXPECT_TRUE(b == IB());
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,90 @@
+#ifndef INT_MAP_H_
+#define INT_MAP_H_
+
+// hash map from integer keys (WordIDs, packed pairs of them, node ids) to
+// small values, for the tables in inner loops that unordered_map serves
+// badly: the entries live in one array probed linearly, so a lookup is a
+// multiply, a shift and usually one cache line, and nothing is allocated
+// per entry.  One key, given to the constructor, marks empty slots and can't
+// be stored.  There is no erase; Clear() keeps the slots for reuse.  Pointers
+// to values are good until the next insertion.
+
+#include <cassert>
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+template <typename K, typename V>
+class IntMap {
+ public:
+  explicit IntMap(K empty_key, size_t expected = 0) : empty_(empty_key), size_(0), shift_(64) {
+    Rehash(expected);
+  }
+
+  // NULL if k isn't there
+  const V* Find(K k) const {
+    for (size_t i = Slot(k); ; i = (i + 1) & mask_) {
+      if (slots_[i].first == empty_) return NULL;
+      if (slots_[i].first == k) return &slots_[i].second;
+    }
+  }
+  V* Find(K k) {
+    return const_cast<V*>(static_cast<const IntMap*>(this)->Find(k));
+  }
+
+  // the value for k, inserting v if k isn't there; second is true if it
+  // was inserted
+  std::pair<V*, bool> Insert(K k, const V& v) {
+    assert(k != empty_);
+    if ((size_ + 1) * 4 > slots_.size() * 3) Rehash(slots_.size());
+    size_t i = Slot(k);
+    for (; slots_[i].first != empty_; i = (i + 1) & mask_)
+      if (slots_[i].first == k) return std::make_pair(&slots_[i].second, false);
+    slots_[i].first = k;
+    slots_[i].second = v;
+    ++size_;
+    return std::make_pair(&slots_[i].second, true);
+  }
+
+  V& operator[](K k) { return *Insert(k, V()).first; }
+
+  void Clear() {
+    if (!size_) return;
+    for (size_t i = 0; i < slots_.size(); ++i) slots_[i] = Entry(empty_, V());
+    size_ = 0;
+  }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+ private:
+  typedef std::pair<K, V> Entry;
+
+  // Fibonacci hashing: the top bits of k times 2^64 / golden ratio, which
+  // spreads runs of consecutive keys over the whole table
+  size_t Slot(K k) const {
+    return static_cast<size_t>((static_cast<uint64_t>(k) * 0x9E3779B97F4A7C15ULL) >> shift_);
+  }
+
+  // room for at least n entries at a load factor of at most 3/4
+  void Rehash(size_t n) {
+    int bits = 4;
+    while ((size_t(1) << bits) * 3 < (n + 1) * 4) ++bits;
+    std::vector<Entry> old(size_t(1) << bits, Entry(empty_, V()));
+    old.swap(slots_);
+    mask_ = slots_.size() - 1;
+    shift_ = 64 - bits;
+    size_ = 0;
+    for (size_t i = 0; i < old.size(); ++i)
+      if (old[i].first != empty_) Insert(old[i].first, old[i].second);
+  }
+
+  const K empty_;
+  std::vector<Entry> slots_;
+  size_t mask_;
+  size_t size_;
+  int shift_;
+};
+
+#endif
@@ -0,0 +1,58 @@
+#include "int_map.h"
+#include "hash.h"
+
+#include <map>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "sampler.h"
+
+using namespace std;
+
+TEST(IntMapTest, MatchesStdMap) {
+  IntMap<int, int> m(-1);
+  map<int, int> ref;
+  MT19937 rng(7);
+  for (int i = 0; i < 20000; ++i) {
+    const int k = static_cast<int>(rng.next() * 5000);
+    const pair<int*, bool> r = m.Insert(k, i);
+    EXPECT_EQ(ref.insert(make_pair(k, i)).second, r.second);
+    EXPECT_EQ(ref[k], *r.first);
+  }
+  EXPECT_EQ(ref.size(), m.size());
+  for (int k = -5; k < 5005; ++k) {
+    const int* v = m.Find(k);
+    const map<int, int>::iterator it = ref.find(k);
+    if (it == ref.end()) {
+      EXPECT_TRUE(v == NULL);
+    } else {
+      ASSERT_TRUE(v != NULL);
+      EXPECT_EQ(it->second, *v);
+    }
+  }
+}
+
+TEST(IntMapTest, ClearAndWideKeys) {
+  IntMap<uint64_t, unsigned> m(0, 3);
+  for (uint64_t i = 1; i <= 1000; ++i) m[i << 32 | 7] = i;
+  EXPECT_EQ(1000u, m.size());
+  EXPECT_EQ(500u, *m.Find(uint64_t(500) << 32 | 7));
+  EXPECT_TRUE(m.Find(500) == NULL);
+  m.Clear();
+  EXPECT_TRUE(m.empty());
+  EXPECT_TRUE(m.Find(uint64_t(500) << 32 | 7) == NULL);
+  m[9] = 3;
+  EXPECT_EQ(3u, *m.Find(9));
+}
+
+TEST(IntMapTest, PodArrayHash) {
+  vector<int> a, b;
+  murmur_hash_array<vector<int> > h, h2(17);
+  EXPECT_EQ(h(a), h(b));  // empty is fine
+  for (int i = 0; i < 5; ++i) { a.push_back(i); b.push_back(i); }
+  EXPECT_EQ(h(a), h(b));
+  EXPECT_EQ(h(a), hash_pod_array(&a[0], &a[0] + a.size()));
+  EXPECT_NE(h(a), h2(a));
+  b[4] = 5;
+  EXPECT_NE(h(a), h(b));
+}
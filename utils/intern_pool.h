@@ -11,6 +11,8 @@
 #include "hash.h"
 //#include "null_traits.h"
 #include <functional>
+#include <cstring>
+#include <vector>
 
 template <class I>
 struct get_key { // default accessor for I = like pair<key,val>
@@ -155,4 +157,64 @@ struct intern_pool : Pool {
 
 
 
+// interns fixed-width arrays of POD T (e.g. the feature function states of a
+// ModelSet, which all have the same size) into a single contiguous buffer.
+// each distinct array is hashed once and stored once; the handles returned by
+// intern() are small ints, so equal arrays can be compared and hashed by
+// handle.  handles stay valid until reset(), but the pointers returned by
+// operator[] are invalidated by the next intern().
+template <class T>
+struct fixed_array_intern_pool {
+  typedef int Handle;
+  struct HashDeep {
+    explicit HashDeep(fixed_array_intern_pool const* p) : p(p) {}
+    fixed_array_intern_pool const* p;
+    std::size_t operator()(Handle h) const { return p->hashes[h]; }
+  };
+  struct EqDeep {
+    explicit EqDeep(fixed_array_intern_pool const* p) : p(p) {}
+    fixed_array_intern_pool const* p;
+    bool operator()(Handle a,Handle b) const {
+      return a==b||(a>=0&&b>=0&&p->hashes[a]==p->hashes[b]&&
+                    std::memcmp(p->get(a),p->get(b),p->width*sizeof(T))==0);
+    }
+  };
+  typedef HASH_SET<Handle,HashDeep,EqDeep> Canonical;
+
+  explicit fixed_array_intern_pool(unsigned width=0)
+    : width(width),canonical(0,HashDeep(this),EqDeep(this)) {
+    HASH_MAP_EMPTY(canonical,(Handle)-1);
+  }
+  // forget all interned arrays; new arrays will have the given width
+  void reset(unsigned w) {
+    width=w;
+    buf.clear();
+    hashes.clear();
+    canonical.clear();
+  }
+  // a must have width elements and must not point into this pool
+  Handle intern(T const* a) {
+    Handle h=hashes.size();
+    buf.insert(buf.end(),a,a+width);
+    hashes.push_back(MurmurHash(a,width*sizeof(T)));
+    std::pair<typename Canonical::iterator,bool> i_new=canonical.insert(h);
+    if (!i_new.second) { // already interned
+      buf.resize(buf.size()-width);
+      hashes.pop_back();
+    }
+    return *i_new.first;
+  }
+  T const* operator[](Handle h) const { return get(h); }
+  unsigned size() const { return hashes.size(); }
+  unsigned array_width() const { return width; }
+ private:
+  T const* get(Handle h) const { return width ? &buf[h*width] : 0; }
+  fixed_array_intern_pool(fixed_array_intern_pool const&);
+  void operator=(fixed_array_intern_pool const&);
+  unsigned width;
+  std::vector<T> buf;
+  std::vector<std::size_t> hashes; // by handle
+  Canonical canonical;
+};
+
 #endif
@@ -0,0 +1,46 @@
+#include "intern_pool.h"
+
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <cstring>
+
+using namespace std;
+
+class InternPoolTest : public testing::Test {
+ protected:
+  virtual void SetUp() { }
+  virtual void TearDown() { }
+};
+
+TEST_F(InternPoolTest, FixedArrayDedup) {
+  fixed_array_intern_pool<uint8_t> pool(4);
+  const uint8_t a[] = {1, 2, 3, 4};
+  const uint8_t b[] = {1, 2, 3, 5};
+  const uint8_t a2[] = {1, 2, 3, 4};
+  const int ha = pool.intern(a);
+  const int hb = pool.intern(b);
+  EXPECT_NE(ha, hb);
+  EXPECT_EQ(ha, pool.intern(a2));
+  EXPECT_EQ(2, pool.size());
+  EXPECT_EQ(0, memcmp(pool[ha], a, 4));
+  EXPECT_EQ(0, memcmp(pool[hb], b, 4));
+}
+
+TEST_F(InternPoolTest, FixedArrayGrowAndReset) {
+  fixed_array_intern_pool<int> pool(2);
+  for (int i = 0; i < 1000; ++i) {
+    const int x[] = {i, i % 7};
+    EXPECT_EQ(i, pool.intern(x));
+  }
+  for (int i = 0; i < 1000; ++i) {
+    const int x[] = {i, i % 7};
+    EXPECT_EQ(i, pool.intern(x));
+  }
+  EXPECT_EQ(1000, pool.size());
+  EXPECT_EQ(999, pool[999][0]);
+  pool.reset(3);
+  EXPECT_EQ(0, pool.size());
+  const int y[] = {7, 8, 9};
+  EXPECT_EQ(0, pool.intern(y));
+  EXPECT_EQ(9, pool[0][2]);
+}
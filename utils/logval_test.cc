@@ -2,6 +2,7 @@
 
 #include <gtest/gtest.h>
 #include <iostream>
+#include <vector>
 
 class LogValTest : public testing::Test {
  protected:
@@ -66,6 +67,43 @@ TEST_F(LogValTest,TestOps) {
   EXPECT_FLOAT_EQ((aa + bb), -0.1);
 }
 
+TEST_F(LogValTest,LogAddTable) {
+  LogAddTable t;
+  for (double x = 0; x > -40; x -= 0.0173)
+    EXPECT_NEAR(log1p(exp(x)), t(x), 2e-6);
+  EXPECT_EQ(0, t(-numeric_limits<double>::infinity()));
+  EXPECT_FLOAT_EQ(log(2.0), t(0));
+}
+
+TEST_F(LogValTest,LogSumExp) {
+  vector<LogVal<double> > v;
+  EXPECT_TRUE(LogSumExp(v.begin(), v.end()).is_0());
+  v.push_back(LogVal<double>());
+  EXPECT_TRUE(LogSumExp(v.begin(), v.end()).is_0());
+  v.push_back(LogVal<double>(0.5));
+  v.push_back(LogVal<double>(1e-200));
+  v.push_back(LogVal<double>(-1000, init_lnx()));
+  v.push_back(LogVal<double>(2.25));
+  EXPECT_FLOAT_EQ(2.75, LogSumExp(v.begin(), v.end()));
+  v.push_back(LogVal<double>(-1.5));
+  // (with LOGVAL_FAST_LOGADD, 2.75 is off by 2e-6 relative to it)
+  EXPECT_NEAR(1.25, LogSumExp(v.begin(), v.end()), 1e-5);
+}
+
+TEST_F(LogValTest,AddProduct) {
+  LogVal<double> a(0.5);
+  add_product(&a, LogVal<double>(2), LogVal<double>(3));
+  EXPECT_FLOAT_EQ(6.5, a);
+  add_product(&a, LogVal<double>(-2), LogVal<double>(3));
+  EXPECT_NEAR(0.5, a, 1e-5);
+  const LogVal<double> b = a;
+  add_product(&a, LogVal<double>(), LogVal<double>(3));
+  EXPECT_EQ(b, a);
+  double d = 0.5;
+  add_product(&d, 2.0, 3.0);
+  EXPECT_FLOAT_EQ(6.5, d);
+}
+
 TEST_F(LogValTest,TestSizes) {
   cerr << sizeof(LogVal<double>) << endl;
   cerr << sizeof(LogVal<float>) << endl;
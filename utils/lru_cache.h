@@ -0,0 +1,69 @@
+#ifndef LRU_CACHE_H_
+#define LRU_CACHE_H_
+
+// map of at most capacity entries: inserting into a full cache evicts the
+// least recently used one, where Find and Insert both count as a use.
+// Counts hits and misses of Find.  Not thread safe.
+
+#include <cassert>
+#include <list>
+#include <utility>
+#include <tr1/unordered_map>
+#include <boost/functional/hash.hpp>
+
+template <typename K, typename V, typename H = boost::hash<K> >
+class LRUCache {
+ public:
+  explicit LRUCache(unsigned capacity) : capacity_(capacity), hits_(0), misses_(0) {
+    assert(capacity > 0);
+  }
+
+  // NULL if k isn't cached.  The pointer is good until the next Insert or Clear
+  const V* Find(const K& k) {
+    typename Index::iterator it = index_.find(k);
+    if (it == index_.end()) { ++misses_; return NULL; }
+    ++hits_;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return &it->second->second;
+  }
+
+  // replaces any value already cached for k
+  void Insert(const K& k, const V& v) {
+    typename Index::iterator it = index_.find(k);
+    if (it != index_.end()) {
+      it->second->second = v;
+      entries_.splice(entries_.begin(), entries_, it->second);
+      return;
+    }
+    if (index_.size() >= capacity_) {
+      index_.erase(entries_.back().first);
+      entries_.pop_back();
+    }
+    entries_.push_front(Entry(k, v));
+    index_[k] = entries_.begin();
+  }
+
+  // drops the entries but keeps the hit and miss counts
+  void Clear() {
+    index_.clear();
+    entries_.clear();
+  }
+
+  unsigned size() const { return index_.size(); }
+  unsigned capacity() const { return capacity_; }
+  unsigned long hits() const { return hits_; }
+  unsigned long misses() const { return misses_; }
+
+ private:
+  typedef std::pair<K, V> Entry;
+  typedef std::list<Entry> Entries; // most recently used first
+  typedef std::tr1::unordered_map<K, typename Entries::iterator, H> Index;
+
+  const unsigned capacity_;
+  Entries entries_;
+  Index index_;
+  unsigned long hits_;
+  unsigned long misses_;
+};
+
+#endif
@@ -0,0 +1,61 @@
+#include "lru_cache.h"
+
+#include <string>
+#include <gtest/gtest.h>
+
+using namespace std;
+
+class LRUCacheTest : public testing::Test {
+ protected:
+  virtual void SetUp() { }
+  virtual void TearDown() { }
+};
+
+TEST_F(LRUCacheTest, FindAndInsert) {
+  LRUCache<string, int> c(3);
+  EXPECT_TRUE(c.Find("a") == NULL);
+  c.Insert("a", 1);
+  c.Insert("b", 2);
+  ASSERT_TRUE(c.Find("a") != NULL);
+  EXPECT_EQ(1, *c.Find("a"));
+  c.Insert("a", 3);
+  EXPECT_EQ(3, *c.Find("a"));
+  EXPECT_EQ(2u, c.size());
+  EXPECT_EQ(3ul, c.hits());
+  EXPECT_EQ(1ul, c.misses());
+}
+
+TEST_F(LRUCacheTest, EvictsLeastRecentlyUsed) {
+  LRUCache<int, int> c(2);
+  c.Insert(1, 10);
+  c.Insert(2, 20);
+  EXPECT_TRUE(c.Find(1) != NULL);  // 2 is now the oldest
+  c.Insert(3, 30);
+  EXPECT_EQ(2u, c.size());
+  EXPECT_TRUE(c.Find(2) == NULL);
+  EXPECT_TRUE(c.Find(1) != NULL);
+  EXPECT_TRUE(c.Find(3) != NULL);
+  c.Insert(1, 11);                 // 3 is now the oldest
+  c.Insert(4, 40);
+  EXPECT_TRUE(c.Find(3) == NULL);
+  EXPECT_EQ(11, *c.Find(1));
+  EXPECT_EQ(40, *c.Find(4));
+}
+
+TEST_F(LRUCacheTest, Clear) {
+  LRUCache<int, int> c(2);
+  c.Insert(1, 10);
+  EXPECT_TRUE(c.Find(1) != NULL);
+  c.Clear();
+  EXPECT_EQ(0u, c.size());
+  EXPECT_TRUE(c.Find(1) == NULL);
+  EXPECT_EQ(1ul, c.hits());
+  EXPECT_EQ(1ul, c.misses());
+  c.Insert(2, 20);
+  EXPECT_EQ(20, *c.Find(2));
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,145 @@
+#include "numa.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <dirent.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+static const char* kNODE_DIR = "/sys/devices/system/node";
+
+static bool ReadLine(const string& file, string* line) {
+  ifstream in(file.c_str());
+  return !getline(in, *line).fail();
+}
+
+static bool ById(const NumaNode& a, const NumaNode& b) {
+  return a.id < b.id;
+}
+
+static vector<NumaNode> ReadNodes() {
+  vector<NumaNode> nodes;
+#ifdef __linux__
+  if (DIR* dir = opendir(kNODE_DIR)) {
+    while (dirent* e = readdir(dir)) {
+      const string name = e->d_name;
+      if (name.compare(0, 4, "node") || name.size() == 4 ||
+          name.find_first_not_of("0123456789", 4) != string::npos)
+        continue;
+      string list;
+      if (!ReadLine(string(kNODE_DIR) + '/' + name + "/cpulist", &list)) continue;
+      NumaNode n;
+      n.id = atoi(name.c_str() + 4);
+      n.cpus = Numa::ParseCpuList(list);
+      if (!n.cpus.empty()) nodes.push_back(n);
+    }
+    closedir(dir);
+  }
+  sort(nodes.begin(), nodes.end(), ById);
+#endif
+  if (nodes.empty()) {
+    NumaNode n;
+    n.id = 0;
+    const long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long i = 0; i < ncpus; ++i) n.cpus.push_back(i);
+    nodes.push_back(n);
+  }
+  return nodes;
+}
+
+const vector<NumaNode>& Numa::Nodes() {
+  static const vector<NumaNode> nodes = ReadNodes();
+  return nodes;
+}
+
+bool Numa::Available() {
+  return Nodes().size() > 1;
+}
+
+bool Numa::BindThread(const NumaNode& node) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (unsigned i = 0; i < node.cpus.size(); ++i)
+    if (node.cpus[i] < CPU_SETSIZE) CPU_SET(node.cpus[i], &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;  // 0 = calling thread
+#else
+  return false;
+#endif
+}
+
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+// from <numaif.h>, which comes with libnuma
+static const int kMPOL_DEFAULT = 0;
+static const int kMPOL_INTERLEAVE = 3;
+static const unsigned kMAX_NODES = 1024;
+static const unsigned kBITS = 8 * sizeof(unsigned long);
+
+static bool SetMemPolicy(int mode, const vector<int>& nodes) {
+  unsigned long mask[kMAX_NODES / kBITS] = {};
+  for (unsigned i = 0; i < nodes.size(); ++i)
+    if (nodes[i] >= 0 && nodes[i] < static_cast<int>(kMAX_NODES))
+      mask[nodes[i] / kBITS] |= 1ul << (nodes[i] % kBITS);
+  // the kernel reads maxnode - 1 bits
+  return syscall(SYS_set_mempolicy, mode, nodes.empty() ? NULL : mask,
+                 nodes.empty() ? 0ul : static_cast<unsigned long>(kMAX_NODES + 1)) == 0;
+}
+#endif
+
+bool Numa::InterleaveMemory() {
+  if (!Available()) return false;
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+  // all nodes with memory, which may include nodes without CPUs
+  string list;
+  vector<int> nodes;
+  if (ReadLine(string(kNODE_DIR) + "/has_memory", &list)) nodes = ParseCpuList(list);
+  if (nodes.empty())
+    for (unsigned i = 0; i < Nodes().size(); ++i) nodes.push_back(Nodes()[i].id);
+  return SetMemPolicy(kMPOL_INTERLEAVE, nodes);
+#else
+  return false;
+#endif
+}
+
+bool Numa::LocalMemory() {
+  if (!Available()) return false;
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+  return SetMemPolicy(kMPOL_DEFAULT, vector<int>());
+#else
+  return false;
+#endif
+}
+
+vector<int> Numa::ParseCpuList(const string& list) {
+  vector<int> cpus;
+  istringstream in(list);
+  string range;
+  while (getline(in, range, ',')) {
+    if (range.find_first_not_of(" \t\n") == string::npos) continue;
+    const string::size_type dash = range.find('-');
+    const int from = atoi(range.c_str());
+    const int to = dash == string::npos ? from : atoi(range.c_str() + dash + 1);
+    for (int i = from; i <= to; ++i) cpus.push_back(i);
+  }
+  return cpus;
+}
+
+string Numa::CpuListString(const vector<int>& cpus) {
+  ostringstream o;
+  for (unsigned i = 0; i < cpus.size(); ) {
+    unsigned j = i;
+    while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) ++j;
+    if (i) o << ',';
+    o << cpus[i];
+    if (j > i) o << '-' << cpus[j];
+    i = j + 1;
+  }
+  return o.str();
+}
@@ -0,0 +1,42 @@
+#ifndef _NUMA_H_
+#define _NUMA_H_
+
+// what a multi-threaded decoder needs of the NUMA layout of the machine,
+// without depending on libnuma: the nodes and their CPUs (read from sysfs),
+// binding a thread to the CPUs of a node, and the memory policy of the
+// calling thread.  Memory a thread touches first is placed on the node it
+// runs on, so a thread bound to a node gets its per-sentence structures
+// (hypergraphs, candidates, arenas) in local memory without asking for it.
+// Large structures that every thread reads are better interleaved over all
+// nodes, so no node is the bottleneck: set InterleaveMemory() while they are
+// loaded and LocalMemory() afterwards.  Threads inherit the policy of the
+// thread that creates them.  On systems without NUMA support this all
+// describes a single node and does nothing.
+
+#include <string>
+#include <vector>
+
+struct NumaNode {
+  int id;
+  std::vector<int> cpus;
+};
+
+struct Numa {
+  // the nodes that have CPUs, by id
+  static const std::vector<NumaNode>& Nodes();
+  // true if there is more than one node
+  static bool Available();
+  // restricts the calling thread to the CPUs of node; false on failure
+  static bool BindThread(const NumaNode& node);
+  // allocate the calling thread's new pages round robin on all nodes
+  static bool InterleaveMemory();
+  // back to allocating them on the node the thread runs on
+  static bool LocalMemory();
+
+  // "0-3,8,10-11" (the sysfs cpulist format) -> 0 1 2 3 8 10 11
+  static std::vector<int> ParseCpuList(const std::string& list);
+  // the reverse, e.g. for reporting placement
+  static std::string CpuListString(const std::vector<int>& cpus);
+};
+
+#endif
@@ -0,0 +1,39 @@
+#include "numa.h"
+
+#include <vector>
+#include <gtest/gtest.h>
+
+using namespace std;
+
+class NumaTest : public testing::Test {
+ protected:
+  virtual void SetUp() { }
+  virtual void TearDown() { }
+};
+
+TEST_F(NumaTest, CpuLists) {
+  const vector<int> cpus = Numa::ParseCpuList("0-3,8,10-11\n");
+  const int expected[] = { 0, 1, 2, 3, 8, 10, 11 };
+  EXPECT_EQ(vector<int>(expected, expected + 7), cpus);
+  EXPECT_EQ("0-3,8,10-11", Numa::CpuListString(cpus));
+  EXPECT_TRUE(Numa::ParseCpuList("\n").empty());
+  EXPECT_EQ("", Numa::CpuListString(vector<int>()));
+}
+
+TEST_F(NumaTest, Nodes) {
+  const vector<NumaNode>& nodes = Numa::Nodes();
+  ASSERT_FALSE(nodes.empty());
+  for (unsigned i = 0; i < nodes.size(); ++i) {
+    EXPECT_FALSE(nodes[i].cpus.empty());
+    if (i) {
+      EXPECT_LT(nodes[i - 1].id, nodes[i].id);
+    }
+  }
+  EXPECT_EQ(nodes.size() > 1, Numa::Available());
+  // changes nothing but the calling thread's placement
+  EXPECT_TRUE(Numa::BindThread(nodes[0]));
+  if (Numa::Available()) {
+    EXPECT_TRUE(Numa::InterleaveMemory());
+    EXPECT_TRUE(Numa::LocalMemory());
+  }
+}
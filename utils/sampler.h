@@ -2,6 +2,7 @@
 #define SAMPLER_H_
 
 #include <algorithm>
+#include <cassert>
 #include <functional>
 #include <numeric>
 #include <iostream>
@@ -151,4 +152,70 @@ size_t RandomNumberGenerator<RNG>::SelectSample(const SampleSet<F>& ss, double T
   return position-1;
 }
 
+// Walker's alias method, in Vose's formulation: after O(n) setup from n
+// nonnegative weights, a draw costs one uniform variate and one table
+// lookup, where SelectSample scans the weights.  For distributions that are
+// drawn from many times, e.g. the in-edges of the nodes of a forest.
+class AliasSampler {
+ public:
+  AliasSampler() {}
+  explicit AliasSampler(const std::vector<double>& weights) { Init(weights); }
+  explicit AliasSampler(const std::vector<prob_t>& weights) { Init(weights); }
+
+  // the weights need not be normalized, but one must be > 0
+  void Init(const std::vector<double>& weights) {
+    const unsigned n = weights.size();
+    const double sum = std::accumulate(weights.begin(), weights.end(), 0.0);
+    assert(n > 0 && sum > 0);
+    prob_.resize(n);
+    alias_.resize(n);
+    std::vector<double> scaled(n);
+    std::vector<unsigned> small, large;
+    unsigned positive = 0;
+    for (unsigned i = 0; i < n; ++i) {
+      scaled[i] = weights[i] * n / sum;
+      (scaled[i] < 1 ? small : large).push_back(i);
+      if (weights[i] > 0) positive = i;
+    }
+    while (!small.empty() && !large.empty()) {
+      const unsigned s = small.back(), l = large.back();
+      small.pop_back();
+      prob_[s] = scaled[s];
+      alias_[s] = l;
+      scaled[l] -= 1 - scaled[s];
+      if (scaled[l] < 1) { large.pop_back(); small.push_back(l); }
+    }
+    // what is left is 1 up to rounding, except for weights of 0
+    for (unsigned i = 0; i < large.size(); ++i) { prob_[large[i]] = 1; alias_[large[i]] = large[i]; }
+    for (unsigned i = 0; i < small.size(); ++i) {
+      const unsigned s = small[i];
+      prob_[s] = weights[s] > 0 ? 1 : 0;
+      alias_[s] = weights[s] > 0 ? s : positive;
+    }
+  }
+
+  void Init(const std::vector<prob_t>& weights) {
+    assert(!weights.empty());
+    const prob_t max = *std::max_element(weights.begin(), weights.end());
+    std::vector<double> w(weights.size());
+    for (unsigned i = 0; i < w.size(); ++i)
+      w[i] = (weights[i] / max).as_float();
+    Init(w);
+  }
+
+  template <typename RNG>
+  size_t Draw(RandomNumberGenerator<RNG>* rng) const {
+    const double u = rng->next() * prob_.size();
+    size_t i = static_cast<size_t>(u);
+    if (i >= prob_.size()) i = prob_.size() - 1;
+    return u - i < prob_[i] ? i : alias_[i];
+  }
+
+  size_t size() const { return prob_.size(); }
+
+ private:
+  std::vector<double> prob_;     // of keeping column i
+  std::vector<unsigned> alias_;  // drawn otherwise
+};
+
 #endif
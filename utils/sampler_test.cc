@@ -0,0 +1,53 @@
+#include "sampler.h"
+
+#include <gtest/gtest.h>
+
+using namespace std;
+
+class SamplerTest : public testing::Test {
+ protected:
+  SamplerTest() : rng(1) {}
+  MT19937 rng;
+};
+
+TEST_F(SamplerTest, AliasMatchesWeights) {
+  vector<double> w;
+  w.push_back(1); w.push_back(0); w.push_back(3); w.push_back(0.5); w.push_back(5.5);
+  const AliasSampler alias(w);
+  ASSERT_EQ(w.size(), alias.size());
+  const int kDRAWS = 200000;
+  vector<int> counts(w.size());
+  for (int i = 0; i < kDRAWS; ++i) ++counts[alias.Draw(&rng)];
+  EXPECT_EQ(0, counts[1]);
+  for (int i = 0; i < w.size(); ++i)
+    EXPECT_NEAR(w[i] / 10, static_cast<double>(counts[i]) / kDRAWS, 0.005);
+}
+
+TEST_F(SamplerTest, AliasAgreesWithSelectSample) {
+  SampleSet<prob_t> ss;
+  vector<prob_t> w;
+  for (int i = 0; i < 7; ++i) {
+    // far below 1, as the inside scores of a forest are
+    const prob_t p(-500 - 0.7 * i, init_lnx());
+    ss.add(p);
+    w.push_back(p);
+  }
+  const AliasSampler alias(w);
+  const int kDRAWS = 100000;
+  vector<int> a(w.size()), s(w.size());
+  for (int i = 0; i < kDRAWS; ++i) {
+    ++a[alias.Draw(&rng)];
+    ++s[rng.SelectSample(ss)];
+  }
+  for (int i = 0; i < w.size(); ++i)
+    EXPECT_NEAR(static_cast<double>(s[i]) / kDRAWS, static_cast<double>(a[i]) / kDRAWS, 0.01);
+}
+
+TEST_F(SamplerTest, AliasSingleAndUniform) {
+  const AliasSampler one(vector<double>(1, 0.3));
+  for (int i = 0; i < 10; ++i) EXPECT_EQ(0, one.Draw(&rng));
+  const AliasSampler uniform(vector<double>(4, 2.0));
+  vector<int> counts(4);
+  for (int i = 0; i < 40000; ++i) ++counts[uniform.Draw(&rng)];
+  for (int i = 0; i < 4; ++i) EXPECT_NEAR(10000, counts[i], 500);
+}
@@ -39,8 +39,16 @@ struct init_lnx {  };
    signbit(a) := a<0
    pow(a,2) := a*a
    pow(a,2.3)
+   add_product(&a,b,c) := a+=b*c (overloaded where it can be done faster)
 */
 
+template <class K>
+inline void add_product(K* a, const K& b, const K& c) {
+  K p = b;
+  p *= c;
+  *a += p;
+}
+
 template <class T>
 struct default_semiring_traits {
   static const T One;
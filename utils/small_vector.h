@@ -4,6 +4,10 @@
 /* REQUIRES that T is POD (can be memcpy).  won't work (yet) due to union with SMALL_VECTOR_POD==0 - may be possible to handle movable types that have ctor/dtor, by using  explicit allocation, ctor/dtor calls.  but for now JUST USE THIS FOR no-meaningful ctor/dtor POD types.
 
    stores small element (<=SV_MAX items) vectors inline.  recommend SV_MAX=sizeof(T)/sizeof(T*)>1?sizeof(T)/sizeof(T*):1.  may not work if SV_MAX==0.
+
+   pick SV_MAX per use so that nearly all instances stay inline; e.g. an int
+   SmallVector is 16 bytes for SV_MAX<=2 and 24 bytes for SV_MAX 3 or 4.
+   elements are copied with memcpy.
  */
 
 #define SMALL_VECTOR_POD 1
@@ -32,6 +36,12 @@ class SmallVector {
     }
   }
 
+  // storage for s elements without initializing them
+  void AllocCopy(const T* from, size_t s) {
+    Alloc(s);
+    if (s) std::memcpy(begin(), from, s * sizeof(T));
+  }
+
  public:
   typedef SmallVector<T,SV_MAX> Self;
   SmallVector() : size_(0) {}
@@ -68,23 +78,46 @@ class SmallVector {
   SmallVector(I const* begin,I const* end) {
     int s=end-begin;
     Alloc(s);
-    if (s <= SV_MAX) {
-      for (int i = 0; i < s; ++i,++begin) data_.vals[i] = *begin;
-    } else
-      for (int i = 0; i < s; ++i,++begin) data_.ptr[i] = *begin;
+    T* out = this->begin();
+    for (int i = 0; i < s; ++i,++begin) out[i] = *begin;
+  }
+
+  SmallVector(T const* begin,T const* end) {
+    AllocCopy(begin, end - begin);
   }
 
+  // inline elements are copied as a fixed size block, which is cheaper than
+  // copying exactly size_ of them
   SmallVector(const Self& o) : size_(o.size_) {
     if (size_ <= SV_MAX) {
-      std::memcpy(data_.vals,o.data_.vals,size_*sizeof(T));
-//      for (int i = 0; i < size_; ++i) data_.vals[i] = o.data_.vals[i];
+      std::memcpy(data_.vals, o.data_.vals, sizeof(data_.vals));
     } else {
-      capacity_ = size_ = o.size_;
+      capacity_ = size_;
       data_.ptr = new T[capacity_];
       std::memcpy(data_.ptr, o.data_.ptr, size_ * sizeof(T));
     }
   }
 
+#if __cplusplus >= 201103L
+  // takes o's heap storage (or copies its inline elements) and leaves it empty
+  SmallVector(Self&& o) : size_(o.size_) {
+    std::memcpy(&data_, &o.data_, sizeof(data_));
+    if (size_ > SV_MAX) capacity_ = o.capacity_;
+    o.size_ = 0;
+  }
+
+  Self& operator=(Self&& o) {
+    if (this != &o) {
+      if (size_ > SV_MAX) delete[] data_.ptr;
+      size_ = o.size_;
+      std::memcpy(&data_, &o.data_, sizeof(data_));
+      if (size_ > SV_MAX) capacity_ = o.capacity_;
+      o.size_ = 0;
+    }
+    return *this;
+  }
+#endif
+
   //TODO: test.  this invalidates more iterators than std::vector since resize may move from ptr to vals.
   T *erase(T *b) {
     return erase(b,b+1);
@@ -103,32 +136,48 @@ class SmallVector {
   }
 
   const Self& operator=(const Self& o) {
-    if (size_ <= SV_MAX) {
-      if (o.size_ <= SV_MAX) {
-        size_ = o.size_;
-        for (int i = 0; i < SV_MAX; ++i) data_.vals[i] = o.data_.vals[i];
-      } else {
-        capacity_ = size_ = o.size_;
-        data_.ptr = new T[capacity_];
-        std::memcpy(data_.ptr, o.data_.ptr, size_ * sizeof(T));
-      }
+    if (o.size_ <= SV_MAX) {
+      if (size_ > SV_MAX) delete[] data_.ptr;
+      size_ = o.size_;
+      std::memcpy(data_.vals, o.data_.vals, sizeof(data_.vals));
+    } else if (this != &o) {
+      assign(o.data_.ptr, o.data_.ptr + o.size_);
+    }
+    return *this;
+  }
+
+  // replaces the contents with [b,e), which must not point into this vector.
+  // keeps the heap storage if it is large enough
+  void assign(T const* b, T const* e) {
+    const size_t s = e - b;
+    if (s <= SV_MAX) {
+      if (size_ > SV_MAX) delete[] data_.ptr;
+      size_ = s;
+      if (s) std::memcpy(data_.vals, b, s * sizeof(T));
     } else {
-      if (o.size_ <= SV_MAX) {
+      if (size_ <= SV_MAX) {
+        Alloc(s);
+      } else if (capacity_ < s) {
         delete[] data_.ptr;
-        size_ = o.size_;
-        for (int i = 0; i < size_; ++i) data_.vals[i] = o.data_.vals[i];
-      } else {
-        if (capacity_ < o.size_) {
-          delete[] data_.ptr;
-          capacity_ = o.size_;
-          data_.ptr = new T[capacity_];
-        }
-        size_ = o.size_;
-        for (int i = 0; i < size_; ++i)
-          data_.ptr[i] = o.data_.ptr[i];
+        Alloc(s);
       }
+      size_ = s;
+      std::memcpy(data_.ptr, b, s * sizeof(T));
     }
-    return *this;
+  }
+
+  // adds [b,e), which must not point into this vector, at the end
+  void append(T const* b, T const* e) {
+    const size_t n = e - b;
+    if (!n) return;
+    const size_t s = size_ + n;
+    if (s <= SV_MAX) {
+      std::memcpy(data_.vals + size_, b, n * sizeof(T));
+    } else {
+      grow_for(s);
+      std::memcpy(data_.ptr + size_, b, n * sizeof(T));
+    }
+    size_ = s;
   }
 
   ~SmallVector() {
@@ -150,30 +199,40 @@ class SmallVector {
 
   bool empty() const { return size_ == 0; }
   size_t size() const { return size_; }
+  size_t capacity() const { return size_ > SV_MAX ? capacity_ : SV_MAX; }
 
+  // only valid when the elements are on the heap (size() > SV_MAX)
   inline void ensure_capacity(uint16_t min_size) {
     assert(min_size > SV_MAX);
-    if (min_size < capacity_) return;
+    if (min_size <= capacity_) return;
     uint16_t new_cap = std::max(static_cast<uint16_t>(capacity_ << 1), min_size);
     T* tmp = new T[new_cap];
-    std::memcpy(tmp, data_.ptr, capacity_ * sizeof(T));
+    std::memcpy(tmp, data_.ptr, size_ * sizeof(T));
     delete[] data_.ptr;
     data_.ptr = tmp;
     capacity_ = new_cap;
   }
 
 private:
-  inline void copy_vals_to_ptr() {
-    capacity_ = SV_MAX * 2;
+  // makes heap storage for s > SV_MAX elements, moving the inline ones
+  // there if necessary; the caller sets size_ to s
+  inline void grow_for(size_t s) {
+    assert(s > SV_MAX && s < 0xA000);
+    if (size_ <= SV_MAX)
+      vals_to_ptr(s);
+    else if (s > capacity_)
+      ensure_capacity(s);
+  }
+  inline void vals_to_ptr(size_t min_size) {
+    capacity_ = std::max(static_cast<size_t>(SV_MAX * 2), min_size);
     T* tmp = new T[capacity_];
-    for (int i = 0; i < SV_MAX; ++i) tmp[i] = data_.vals[i];
+    if (size_) std::memcpy(tmp, data_.vals, size_ * sizeof(T));
     data_.ptr = tmp;
   }
   inline void ptr_to_small() {
     assert(size_<=SV_MAX);
-    int *tmp=data_.ptr;
-    for (int i=0;i<size_;++i)
-      data_.vals[i]=tmp[i];
+    T *tmp=data_.ptr;
+    if (size_) std::memcpy(data_.vals, tmp, size_ * sizeof(T));
     delete[] tmp;
   }
 
@@ -185,7 +244,7 @@ public:
       ++size_;
       return;
     } else if (size_ == SV_MAX) {
-      copy_vals_to_ptr();
+      vals_to_ptr(SV_MAX + 1);
     } else if (size_ == capacity_) {
       ensure_capacity(size_ + 1);
     }
@@ -220,13 +279,11 @@ public:
       size_=size;
   }
 
-  void resize(size_t s, int v = 0) {
+  void resize(size_t s, T const& v = T()) {
     if (s <= SV_MAX) {
       if (size_ > SV_MAX) {
-        T *tmp=data_.ptr;
-        for (int i = 0; i < s; ++i) data_.vals[i] = tmp[i];
-        delete[] tmp;
         size_ = s;
+        ptr_to_small();
         return;
       }
       if (s <= size_) {
@@ -239,10 +296,7 @@ public:
         return;
       }
     } else {
-      if (size_ <= SV_MAX)
-        copy_vals_to_ptr();
-      if (s > capacity_)
-        ensure_capacity(s);
+      grow_for(s);
       if (s > size_) {
         for (int i = size_; i < s; ++i)
           data_.ptr[i] = v;
@@ -1,9 +1,11 @@
 #include "small_vector.h"
+#include "timing_stats.h"
 
 #include <gtest/gtest.h>
 #include <iostream>
 #include <cassert>
 #include <vector>
+#include <cstdlib>
 
 using namespace std;
 
@@ -122,6 +124,91 @@ TEST_F(SVTest, Small) {
   cerr << sizeof(vector<int>) << endl;
 }
 
+TEST_F(SVTest, Bulk) {
+  const int a[] = { 1, 2, 3, 4, 5, 6, 7 };
+  SmallVectorInt v(a, a + 2);
+  EXPECT_EQ(2u, v.size());
+  EXPECT_EQ(2u, v.capacity());
+  v.append(a + 2, a + 7);
+  EXPECT_EQ(7u, v.size());
+  for (int i = 0; i < 7; ++i) EXPECT_EQ(a[i], v[i]);
+  v.assign(a + 5, a + 7);
+  EXPECT_EQ(2u, v.size());
+  EXPECT_EQ(6, v[0]);
+  EXPECT_EQ(7, v[1]);
+  v.append(a, a + 1);
+  EXPECT_EQ(3u, v.size());
+  EXPECT_EQ(1, v[2]);
+  v.assign(a, a + 4);
+  EXPECT_EQ(SmallVectorInt(a, a + 4), v);
+  v.resize(1);
+  EXPECT_EQ(1, v[0]);
+  v.append(a, a);
+  EXPECT_EQ(1u, v.size());
+  SmallVector<int, 3> three(a, a + 3);
+  EXPECT_EQ(3u, three.capacity());
+  EXPECT_EQ(3, three.back());
+}
+
+#if __cplusplus >= 201103L
+TEST_F(SVTest, Move) {
+  const int a[] = { 1, 2, 3, 4 };
+  SmallVectorInt big(a, a + 4);
+  const int* storage = big.begin();
+  SmallVectorInt moved(std::move(big));
+  EXPECT_TRUE(big.empty());
+  EXPECT_EQ(storage, moved.begin());
+  EXPECT_EQ(4, moved[3]);
+  SmallVectorInt small(a, a + 1);
+  moved = std::move(small);
+  EXPECT_TRUE(small.empty());
+  EXPECT_EQ(1u, moved.size());
+  EXPECT_EQ(1, moved[0]);
+}
+#endif
+
+// cube pruning's use of j vectors and tail vectors: build one per edge,
+// then copy it and bump one position for every successor
+template <class V>
+double TimeSuccessors(const vector<int>& arities, long long* checksum) {
+  const double start = Timer::WallTime();
+  for (int rep = 0; rep < 20; ++rep) {
+    for (int e = 0; e < arities.size(); ++e) {
+      V tail;
+      for (int i = 0; i < arities[e]; ++i) tail.push_back(e + i);
+      const V j(tail.size(), 0);
+      for (int i = 0; i < j.size(); ++i) {
+        V succ = j;
+        ++succ[i];
+        V copy;
+        copy = succ;
+        *checksum += copy[i] + tail[i];
+      }
+    }
+  }
+  return Timer::WallTime() - start;
+}
+
+// prints timings; only checks that all of them compute the same thing
+TEST_F(SVTest, Benchmark) {
+  srand(3);
+  vector<int> arities(200000);
+  // mostly binary and unary rules, with a few lexical and ternary ones
+  for (int i = 0; i < arities.size(); ++i) {
+    const int r = rand() % 100;
+    arities[i] = r < 10 ? 0 : (r < 50 ? 1 : (r < 95 ? 2 : 3));
+  }
+  long long c2 = 0, c3 = 0, cv = 0;
+  const double t2 = TimeSuccessors<SmallVector<int, 2> >(arities, &c2);
+  const double t3 = TimeSuccessors<SmallVector<int, 3> >(arities, &c3);
+  const double tv = TimeSuccessors<vector<int> >(arities, &cv);
+  cerr << "SmallVector<int,2>: " << t2 << " secs\n"
+       << "SmallVector<int,3>: " << t3 << " secs\n"
+       << "vector<int>:        " << tv << " secs\n";
+  EXPECT_EQ(cv, c2);
+  EXPECT_EQ(cv, c3);
+}
+
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
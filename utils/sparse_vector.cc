@@ -97,3 +97,90 @@ bool Decode(double* objective, SparseVector<double>* v, const char* in, size_t s
 }
 
 }
+
+namespace BinaryVector {
+
+static void PutVarint(size_t x, string* out) {
+  while (x >= 0x80) {
+    *out += static_cast<char>(x | 0x80);
+    x >>= 7;
+  }
+  *out += static_cast<char>(x);
+}
+
+static void PutDouble(double x, string* out) {
+  out->append(reinterpret_cast<const char*>(&x), sizeof(double));
+}
+
+// false if [*cur, end) does not start with a complete varint
+static bool GetVarint(const char** cur, const char* end, size_t* x) {
+  *x = 0;
+  for (unsigned shift = 0; *cur < end && shift < 64; shift += 7) {
+    const unsigned char c = *(*cur)++;
+    *x |= static_cast<size_t>(c & 0x7f) << shift;
+    if (!(c & 0x80)) return true;
+  }
+  return false;
+}
+
+static bool GetVarint(istream* in, size_t* x) {
+  *x = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    const int c = in->get();
+    if (c == istream::traits_type::eof()) return false;
+    *x |= static_cast<size_t>(c & 0x7f) << shift;
+    if (!(c & 0x80)) return true;
+  }
+  return false;
+}
+
+void Encode(double objective, const SparseVector<double>& v, ostream* out) {
+  string rec;
+  PutDouble(objective, &rec);
+  PutVarint(v.size(), &rec);
+  for (SparseVector<double>::const_iterator it = v.begin(); it != v.end(); ++it) {
+    const string& fname = FD::Convert(it->first);
+    PutVarint(fname.size(), &rec);
+    rec += fname;
+    PutDouble(it->second, &rec);
+  }
+  string len;
+  PutVarint(rec.size(), &len);
+  out->write(len.data(), len.size());
+  out->write(rec.data(), rec.size());
+}
+
+bool Decode(double* objective, SparseVector<double>* v, istream* in) {
+  v->clear();
+  size_t size;
+  if (!GetVarint(in, &size)) return false;
+  string rec(size, '\0');
+  if (size && !in->read(&rec[0], size)) {
+    cerr << "BinaryVector decoding error: truncated record!\n";
+    return false;
+  }
+  const char* cur = rec.data();
+  const char* end = cur + size;
+  size_t num_feats;
+  if (size < sizeof(double)) { cerr << "BinaryVector decoding error: too short!\n"; return false; }
+  memcpy(objective, cur, sizeof(double));
+  cur += sizeof(double);
+  if (!GetVarint(&cur, end, &num_feats)) { cerr << "BinaryVector decoding error: bad feature count!\n"; return false; }
+  for (size_t fc = 0; fc < num_feats; ++fc) {
+    size_t fname_len;
+    if (!GetVarint(&cur, end, &fname_len) || static_cast<size_t>(end - cur) < fname_len + sizeof(double)) {
+      cerr << "Expected " << num_feats << " but only decoded " << fc << "!\n";
+      return false;
+    }
+    const int fid = FD::Convert(StringPiece(cur, fname_len));
+    cur += fname_len;
+    double val;
+    memcpy(&val, cur, sizeof(double));
+    cur += sizeof(double);
+    v->set_value(fid, val);
+  }
+  if (cur != end) { cerr << "BinaryVector decoding error: trailing bytes!\n"; return false; }
+  return true;
+}
+
+}
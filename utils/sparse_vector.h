@@ -56,4 +56,15 @@ namespace B64 {
   bool Decode(double* objective, SparseVector<double>* v, const char* data, size_t size);
 }
 
+// the same (objective, vector) pairs as B64 without the text encoding: a
+// varint byte count of the rest of the record, the objective, a varint
+// feature count and, for each feature, a varint name length, the name and
+// its value.  Records are not newline free; readers take them one after
+// the other from a stream (see --vector_format binary).
+namespace BinaryVector {
+  void Encode(double objective, const SparseVector<double>& v, std::ostream* out);
+  // reads one record; returns false at end of input or if it is malformed
+  bool Decode(double* objective, SparseVector<double>* v, std::istream* in);
+}
+
 #endif
@@ -11,6 +11,7 @@
 #include <map>
 #include <vector>
 #include <cctype>
+#include <cstdlib>
 #include <cstring>
 #include <string>
 #include <sstream>
@@ -137,6 +138,48 @@ inline int CountSubstrings(const std::string& str, const std::string& sub) {
   return res;
 }
 
+// atof(std::string(b, e)) without the copy.  plain decimals (optional sign,
+// digits, optional fraction, up to 15 significant digits) are converted
+// directly: the digits and the power of ten dividing them are both exact
+// doubles, so the one division is correctly rounded and gives the same
+// value as strtod.  anything else (exponents, inf, long mantissas) goes
+// through strtod
+inline double ParseDouble(const char* b, const char* e) {
+  static const double kPOW10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8,
+    1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15 };
+  const char* p = b;
+  const bool neg = (p != e && *p == '-');
+  if (p != e && (*p == '-' || *p == '+')) ++p;
+  unsigned long long m = 0;
+  int digits = 0, frac = -1;
+  bool any = false;
+  for (; p != e; ++p) {
+    if (*p >= '0' && *p <= '9') {
+      any = true;
+      m = m * 10 + (*p - '0');
+      if (frac >= 0) ++frac;
+      if (m) ++digits;
+    } else if (*p == '.' && frac < 0) {
+      frac = 0;
+    } else {
+      break;
+    }
+  }
+  if (any && digits <= 15 && frac <= 15 &&
+      (p == e || !std::isalnum(static_cast<unsigned char>(*p)))) {
+    const double v = (frac > 0 ? m / kPOW10[frac] : double(m));
+    return neg ? -v : v;
+  }
+  char buf[64];
+  const size_t n = e - b;
+  if (n < sizeof(buf)) {
+    std::memcpy(buf, b, n);
+    buf[n] = 0;
+    return std::strtod(buf, NULL);
+  }
+  return std::strtod(std::string(b, e).c_str(), NULL);
+}
+
 inline int SplitOnWhitespace(const std::string& in, std::vector<std::string>* out) {
   out->clear();
   int i = 0;
@@ -18,13 +18,25 @@ WordID TD::Convert(const std::string& s) {
 }
 
 WordID TD::Convert(char const* s) {
-  return dict_.Convert(string(s));
+  return dict_.Convert(StringPiece(s));
+}
+
+WordID TD::Convert(const StringPiece& s) {
+  return dict_.Convert(s);
+}
+
+void TD::ConvertMany(const std::string& blob, const std::vector<unsigned>& ends, std::vector<WordID>* ids) {
+  dict_.ConvertMany(blob, ends, ids);
 }
 
 const char* TD::Convert(WordID w) {
   return dict_.Convert(w).c_str();
 }
 
+unsigned int TD::NumWords() {
+  return dict_.max();
+}
+
 void TD::GetWordIDs(const std::vector<std::string>& strings, std::vector<WordID>* ids) {
   ids->clear();
   for (vector<string>::const_iterator i = strings.begin(); i != strings.end(); ++i)
@@ -65,23 +77,17 @@ int TD::AppendString(const WordID& w, int pos, int bufsize, char* buffer)
 }
 
 
-namespace {
-struct add_wordids {
-  typedef std::vector<WordID> Ws;
-  Ws *ids;
-  explicit add_wordids(Ws *i) : ids(i) {  }
-  add_wordids(const add_wordids& o) : ids(o.ids) {  }
-  void operator()(char const* s) {
-    ids->push_back(TD::Convert(s));
-  }
-  void operator()(std::string const& s) {
-    ids->push_back(TD::Convert(s));
-  }
-};
-
-}
-
+// tokens are looked up in place as pieces of s, so no copy of s or its
+// words is made (the same ' ' and '\t' separators as VisitTokens)
 void TD::ConvertSentence(std::string const& s, std::vector<WordID>* ids) {
   ids->clear();
-  VisitTokens(s,add_wordids(ids));
+  const char* p = s.data();
+  const char* const end = p + s.size();
+  for (;;) {
+    while (p != end && IsWordSep(*p)) ++p;
+    if (p == end) return;
+    const char* word = p;
+    while (p != end && !IsWordSep(*p)) ++p;
+    ids->push_back(dict_.Convert(StringPiece(word, p - word)));
+  }
 }
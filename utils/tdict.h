@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include "wordid.h"
+#include "util/string_piece.hh"
 #include <assert.h>
 
 class Dict;
@@ -18,6 +19,9 @@ struct TD {
   static unsigned int NumWords();
   static WordID Convert(const std::string& s);
   static WordID Convert(char const* s);
+  static WordID Convert(const StringPiece& s);
+  // see Dict::ConvertMany
+  static void ConvertMany(const std::string& blob, const std::vector<unsigned>& ends, std::vector<WordID>* ids);
   static const char* Convert(WordID w);
  private:
   static Dict dict_;
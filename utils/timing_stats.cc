@@ -1,29 +1,268 @@
 #include "timing_stats.h"
 
+#include <algorithm>
+#include <cstdio>
 #include <iostream>
 #include "time.h" //cygwin needs
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
 
 #include "verbose.h"
 
 using namespace std;
 
-map<string, TimerInfo> Timer::stats;
+void Profile::Clear() {
+  timers.clear();
+  counters.clear();
+}
+
+void Profile::Add(const Profile& other) {
+  for (map<string, TimerInfo>::const_iterator it = other.timers.begin(); it != other.timers.end(); ++it) {
+    TimerInfo& info = timers[it->first];
+    info.calls += it->second.calls;
+    info.total_time += it->second.total_time;
+    info.cpu_time += it->second.cpu_time;
+    info.rss_growth += it->second.rss_growth;
+    info.heap_growth += it->second.heap_growth;
+    info.peak_growth += it->second.peak_growth;
+    info.max_rss = max(info.max_rss, it->second.max_rss);
+  }
+  if (counters.size() < other.counters.size())
+    counters.resize(other.counters.size());
+  for (unsigned i = 0; i < other.counters.size(); ++i) {
+    if (ProfileCounter::IsPeak(i))
+      counters[i] = max(counters[i], other.counters[i]);
+    else
+      counters[i] += other.counters[i];
+  }
+}
+
+// Timers and counters only touch the state of their own thread, so nothing
+// is locked until Summarize() adds it to the totals
+struct TimerThreadState {
+  Profile profile;
+  string current;  // path of the innermost running Timer
+};
+
+namespace {
+
+boost::thread_specific_ptr<TimerThreadState> thread_state;
+
+TimerThreadState* GetThreadState() {
+  TimerThreadState* s = thread_state.get();
+  if (!s) {
+    s = new TimerThreadState;
+    thread_state.reset(s);
+  }
+  return s;
+}
+
+boost::mutex totals_mutex;
+Profile totals;
+
+bool sample_memory = false;
+
+boost::mutex& CounterNamesMutex() {
+  static boost::mutex m;
+  return m;
+}
+
+vector<string>& CounterNames() {
+  static vector<string> names;
+  return names;
+}
+
+// indexed like CounterNames()
+vector<bool>& PeakCounters() {
+  static vector<bool> peak;
+  return peak;
+}
+
+// the kind of a counter is the one it was first registered with
+int RegisterCounter(const char* name, bool peak) {
+  boost::mutex::scoped_lock l(CounterNamesMutex());
+  vector<string>& names = CounterNames();
+  for (unsigned i = 0; i < names.size(); ++i)
+    if (names[i] == name) return i;
+  names.push_back(name);
+  PeakCounters().push_back(peak);
+  return names.size() - 1;
+}
 
-Timer::Timer(const string& timername) : start_t(clock()), cur(stats[timername]) {}
+}  // namespace
+
+MemoryUsage MemoryUsage::Now() {
+  MemoryUsage m;
+#ifdef __linux__
+  if (FILE* f = fopen("/proc/self/statm", "r")) {
+    unsigned long size, resident;
+    if (fscanf(f, "%lu %lu", &size, &resident) == 2)
+      m.rss = static_cast<size_t>(resident) * sysconf(_SC_PAGESIZE);
+    fclose(f);
+  }
+#endif
+  rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) == 0) {
+#ifdef __APPLE__
+    m.peak_rss = ru.ru_maxrss;         // bytes
+#else
+    m.peak_rss = ru.ru_maxrss * 1024;  // kilobytes
+#endif
+  }
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 33)
+  const struct mallinfo2 mi = mallinfo2();
+  m.heap = mi.uordblks + mi.hblkhd;
+#else
+  // these are ints, so this wraps past 4GB
+  const struct mallinfo mi = mallinfo();
+  m.heap = static_cast<unsigned>(mi.uordblks) + static_cast<unsigned>(mi.hblkhd);
+#endif
+#endif
+  return m;
+}
+
+void Timer::SampleMemory(bool sample) {
+  sample_memory = sample;
+}
+
+bool Timer::SamplingMemory() {
+  return sample_memory;
+}
+
+double Timer::WallTime() {
+#ifdef CLOCK_MONOTONIC
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+double Timer::ThreadCpuTime() {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+  return clock() / static_cast<double>(CLOCKS_PER_SEC);  // whole process
+#endif
+}
+
+Timer::Timer(const string& timername) : state_(GetThreadState()) {
+  string& cur = state_->current;
+  parent_len_ = cur.size();
+  if (parent_len_) cur += '/';
+  cur += timername;
+  path_ = cur;
+  if (sample_memory) start_mem_ = MemoryUsage::Now();
+  start_wall_ = WallTime();
+  start_cpu_ = ThreadCpuTime();
+}
 
 Timer::~Timer() {
+  const double cpu = ThreadCpuTime() - start_cpu_;
+  const double wall = WallTime() - start_wall_;
+  TimerInfo& cur = state_->profile.timers[path_];
   ++cur.calls;
-  const clock_t end_t = clock();
-  const double elapsed = (end_t - start_t) / 1000000.0;
-  cur.total_time += elapsed;
+  cur.total_time += wall;
+  cur.cpu_time += cpu;
+  if (sample_memory) {
+    const MemoryUsage end = MemoryUsage::Now();
+    cur.rss_growth += static_cast<long long>(end.rss) - static_cast<long long>(start_mem_.rss);
+    cur.heap_growth += static_cast<long long>(end.heap) - static_cast<long long>(start_mem_.heap);
+    cur.peak_growth += static_cast<long long>(end.peak_rss) - static_cast<long long>(start_mem_.peak_rss);
+    cur.max_rss = max(cur.max_rss, end.rss);
+  }
+  state_->current.resize(parent_len_);
+}
+
+void Timer::Add(const string& name, int calls, double wall, double cpu) {
+  TimerThreadState* s = GetThreadState();
+  TimerInfo& info = s->profile.timers[s->current.empty() ? name : s->current + '/' + name];
+  info.calls += calls;
+  info.total_time += wall;
+  info.cpu_time += cpu;
+}
+
+const Profile& Timer::ThreadProfile() {
+  return GetThreadState()->profile;
+}
+
+Profile Timer::Totals() {
+  boost::mutex::scoped_lock l(totals_mutex);
+  return totals;
+}
+
+static double MB(double bytes) {
+  return bytes / (1024 * 1024);
+}
+
+static void Print(const Profile& p) {
+  for (map<string, TimerInfo>::const_iterator it = p.timers.begin(); it != p.timers.end(); ++it) {
+    const TimerInfo& t = it->second;
+    if (t.calls == 0) continue;
+    cerr << it->first << ": " << t.total_time << " secs, " << t.cpu_time
+         << " CPU secs (" << t.calls << " calls)";
+    if (sample_memory)
+      cerr << ", RSS " << showpos << MB(t.rss_growth) << noshowpos << " MB (max " << MB(t.max_rss)
+           << " MB), heap " << showpos << MB(t.heap_growth) << " MB, peak " << MB(t.peak_growth)
+           << noshowpos << " MB";
+    cerr << '\n';
+  }
+  const vector<string>& names = ProfileCounter::Names();
+  for (unsigned i = 0; i < p.counters.size(); ++i)
+    if (p.counters[i]) cerr << names[i] << ": " << p.counters[i] << endl;
 }
 
 void Timer::Summarize() {
-  if (!SILENT) {
-    for (map<string, TimerInfo>::iterator it = stats.begin(); it != stats.end(); ++it) {
-      cerr << it->first << ": " << it->second.total_time << " secs (" << it->second.calls << " calls)\n";
-    }
+  Profile& p = GetThreadState()->profile;
+  if (!SILENT) Print(p);
+  boost::mutex::scoped_lock l(totals_mutex);
+  totals.Add(p);
+  p.Clear();
+}
+
+void Timer::SummarizeTotals() {
+  if (SILENT) return;
+  const Profile p = Totals();
+  if (p.timers.empty() && p.counters.empty()) return;
+  cerr << "Totals:\n";
+  Print(p);
+  if (sample_memory) {
+    const MemoryUsage m = MemoryUsage::Now();
+    cerr << "Memory: RSS " << MB(m.rss) << " MB, peak RSS " << MB(m.peak_rss) << " MB, heap "
+         << MB(m.heap) << " MB\n";
   }
-  stats.clear();
 }
 
+ProfileCounter::ProfileCounter(const char* name, Kind k) :
+    id(RegisterCounter(name, k == PEAK)),
+    kind(IsPeak(id) ? PEAK : SUM) {}
+
+void ProfileCounter::Add(long long n) const {
+  vector<long long>& c = GetThreadState()->profile.counters;
+  if (c.size() <= static_cast<unsigned>(id)) c.resize(id + 1);
+  if (kind == PEAK)
+    c[id] = max(c[id], n);
+  else
+    c[id] += n;
+}
+
+bool ProfileCounter::IsPeak(int id) {
+  boost::mutex::scoped_lock l(CounterNamesMutex());
+  return PeakCounters()[id];
+}
+
+const vector<string>& ProfileCounter::Names() {
+  return CounterNames();
+}
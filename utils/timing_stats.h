@@ -3,23 +3,99 @@
 
 #include <string>
 #include <map>
+#include <vector>
+#include <ctime>
+#include <cstddef>
+
+// memory use of the whole process (0 where the platform doesn't say)
+struct MemoryUsage {
+  std::size_t rss;       // resident set size, bytes
+  std::size_t peak_rss;  // high water mark of rss
+  std::size_t heap;      // bytes malloc has handed out and not freed
+  MemoryUsage() : rss(), peak_rss(), heap() {}
+  static MemoryUsage Now();
+};
 
 struct TimerInfo {
   int calls;
-  double total_time;
-  TimerInfo() : calls(), total_time() {}
+  double total_time;  // wall clock seconds
+  double cpu_time;    // CPU seconds used by the thread the timer ran on
+  // only with Timer::SampleMemory(true); summed over calls, in bytes.  They
+  // are process wide, so they include what other threads did meanwhile.
+  long long rss_growth;
+  long long heap_growth;
+  long long peak_growth;  // how much the calls raised the high water mark
+  std::size_t max_rss;    // largest rss at the end of a call
+  TimerInfo() : calls(), total_time(), cpu_time(), rss_growth(), heap_growth(), peak_growth(), max_rss() {}
+};
+
+// what the Timers and ProfileCounters of one thread have recorded since the
+// last Timer::Summarize() on that thread.  Nested timers are recorded under
+// their full path, e.g. "Decode/Pass1/Rescoring"; counters[i] belongs to the
+// ProfileCounter with id i.
+struct Profile {
+  std::map<std::string, TimerInfo> timers;
+  std::vector<long long> counters;
+  void Clear();
+  void Add(const Profile& other);
 };
 
+struct TimerThreadState;
+
+// times the scope it lives in, both on a steady wall clock and in CPU time
+// of the calling thread.  A Timer created while another one is running on
+// the same thread is nested under it.
 struct Timer {
-  Timer(const std::string& info);
+  explicit Timer(const std::string& info);
   ~Timer();
+  // print (unless SILENT) and reset what this thread has recorded; the
+  // totals over all threads and calls keep accumulating
   static void Summarize();
+  // the calling thread's record since its last Summarize()
+  static const Profile& ThreadProfile();
+  // everything Summarize() has reset so far, summed over all threads
+  static Profile Totals();
+  static double WallTime();
+  static double ThreadCpuTime();
+  // also record the memory use of the process when each Timer starts and
+  // stops (see TimerInfo).  Off by default since reading it takes system
+  // calls; set it before starting threads.
+  static void SampleMemory(bool sample);
+  static bool SamplingMemory();
+  // print the totals (see Totals()) unless SILENT
+  static void SummarizeTotals();
+  // record calls that were timed by the caller (e.g. too many and too short
+  // to construct a Timer for each) as a timer named name, nested under the
+  // running one
+  static void Add(const std::string& name, int calls, double wall, double cpu);
  private:
-  static std::map<std::string, TimerInfo> stats;
-  clock_t start_t;
-  TimerInfo& cur;
+  std::string path_;
+  TimerThreadState* state_;
+  std::string::size_type parent_len_;  // length of the enclosing Timer's path
+  double start_wall_;
+  double start_cpu_;
+  MemoryUsage start_mem_;
   Timer(const Timer& other);
   const Timer& operator=(const Timer& other);
 };
 
+// counts events (e.g. edges created, cube pruning pops) into the profile of
+// the thread that reports them.  Define these at namespace scope:
+//   static const ProfileCounter pops("cube_pops");
+// and report in bulk where the events happen often: pops.Add(num_pops);
+// Counters constructed with the same name share their id.  A PEAK counter
+// (e.g. the largest heap) keeps the largest value it is given instead, and
+// so do the totals; their names end in _peak, which is how
+// tests/run-benchmarks.pl tells them apart.
+struct ProfileCounter {
+  enum Kind { SUM, PEAK };
+  explicit ProfileCounter(const char* name, Kind kind = SUM);
+  void Add(long long n = 1) const;
+  // names of all counters, indexed by id
+  static const std::vector<std::string>& Names();
+  static bool IsPeak(int id);
+  const int id;
+  const Kind kind;
+};
+
 #endif
@@ -0,0 +1,139 @@
+#include "timing_stats.h"
+
+#include <cstring>
+#include <gtest/gtest.h>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "verbose.h"
+
+using namespace std;
+
+static const ProfileCounter test_events("test_events");
+
+class TimingStatsTest : public testing::Test {
+ protected:
+  virtual void SetUp() { SetSilent(true); Timer::Summarize(); }
+  virtual void TearDown() { }
+};
+
+static long long Count(const Profile& p, const ProfileCounter& c) {
+  return c.id < p.counters.size() ? p.counters[c.id] : 0;
+}
+
+TEST_F(TimingStatsTest, Nesting) {
+  {
+    Timer a("A");
+    { Timer b("B"); }
+    { Timer b("B"); Timer c("C"); }
+  }
+  { Timer b("B"); }
+  const Profile& p = Timer::ThreadProfile();
+  EXPECT_EQ(4, p.timers.size());
+  EXPECT_EQ(1, p.timers.find("A")->second.calls);
+  EXPECT_EQ(2, p.timers.find("A/B")->second.calls);
+  EXPECT_EQ(1, p.timers.find("A/B/C")->second.calls);
+  EXPECT_EQ(1, p.timers.find("B")->second.calls);
+  EXPECT_GE(p.timers.find("A")->second.total_time, p.timers.find("A/B")->second.total_time);
+  EXPECT_GE(p.timers.find("A/B")->second.cpu_time, 0);
+}
+
+TEST_F(TimingStatsTest, Counters) {
+  EXPECT_EQ("test_events", ProfileCounter::Names()[test_events.id]);
+  test_events.Add();
+  test_events.Add(4);
+  EXPECT_EQ(5, Count(Timer::ThreadProfile(), test_events));
+  const long long before = Count(Timer::Totals(), test_events);
+  Timer::Summarize();
+  EXPECT_EQ(0, Count(Timer::ThreadProfile(), test_events));
+  EXPECT_EQ(before + 5, Count(Timer::Totals(), test_events));
+}
+
+TEST_F(TimingStatsTest, AddTimedElsewhere) {
+  {
+    Timer a("A");
+    Timer::Add("Calls", 10, 0.5, 0.25);
+    Timer::Add("Calls", 5, 0.5, 0.25);
+  }
+  Timer::Add("Top", 1, 1.0, 1.0);
+  const Profile& p = Timer::ThreadProfile();
+  ASSERT_TRUE(p.timers.find("A/Calls") != p.timers.end());
+  EXPECT_EQ(15, p.timers.find("A/Calls")->second.calls);
+  EXPECT_DOUBLE_EQ(1.0, p.timers.find("A/Calls")->second.total_time);
+  EXPECT_DOUBLE_EQ(0.5, p.timers.find("A/Calls")->second.cpu_time);
+  EXPECT_EQ(1, p.timers.find("Top")->second.calls);
+}
+
+TEST_F(TimingStatsTest, CountersShareIdsByName) {
+  const ProfileCounter again("test_events");
+  EXPECT_EQ(test_events.id, again.id);
+  const ProfileCounter other("other_test_events");
+  EXPECT_NE(test_events.id, other.id);
+  again.Add(3);
+  EXPECT_EQ(3, Count(Timer::ThreadProfile(), test_events));
+}
+
+TEST_F(TimingStatsTest, PeakCounters) {
+  const ProfileCounter peak("test_peak", ProfileCounter::PEAK);
+  EXPECT_TRUE(ProfileCounter::IsPeak(peak.id));
+  EXPECT_FALSE(ProfileCounter::IsPeak(test_events.id));
+  peak.Add(7);
+  peak.Add(3);
+  EXPECT_EQ(7, Count(Timer::ThreadProfile(), peak));
+  Timer::Summarize();
+  peak.Add(5);
+  Timer::Summarize();
+  EXPECT_EQ(7, Count(Timer::Totals(), peak));
+}
+
+static void CountInThread(int n) {
+  {
+    Timer t("Thread");
+    test_events.Add(n);
+  }
+  EXPECT_EQ(n, Count(Timer::ThreadProfile(), test_events));
+  Timer::Summarize();
+}
+
+TEST_F(TimingStatsTest, Threads) {
+  test_events.Add(1);
+  const long long before = Count(Timer::Totals(), test_events);
+  boost::thread_group threads;
+  for (int i = 1; i <= 4; ++i)
+    threads.create_thread(boost::bind(&CountInThread, 10 * i));
+  threads.join_all();
+  // the other threads neither see nor disturb this thread's profile
+  EXPECT_EQ(1, Count(Timer::ThreadProfile(), test_events));
+  EXPECT_TRUE(Timer::ThreadProfile().timers.empty());
+  const Profile totals = Timer::Totals();
+  EXPECT_EQ(before + 100, Count(totals, test_events));
+  EXPECT_EQ(4, totals.timers.find("Thread")->second.calls);
+}
+
+TEST_F(TimingStatsTest, Memory) {
+  const size_t kBytes = 32 << 20;
+  Timer::SampleMemory(true);
+  char* block;
+  {
+    Timer t("Allocate");
+    block = new char[kBytes];
+    memset(block, 1, kBytes);  // so that it is resident
+  }
+  Timer::SampleMemory(false);
+  const TimerInfo& t = Timer::ThreadProfile().timers.find("Allocate")->second;
+#ifdef __linux__
+  EXPECT_GT(MemoryUsage::Now().rss, 0);
+  EXPECT_GE(t.rss_growth, static_cast<long long>(kBytes / 2));
+  EXPECT_GE(t.max_rss, kBytes);
+#endif
+#ifdef __GLIBC__
+  EXPECT_GE(t.heap_growth, static_cast<long long>(kBytes));
+#endif
+  EXPECT_GE(t.peak_growth, 0);
+  delete[] block;
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -1,6 +1,8 @@
 #include <iostream>
 #include <map>
 #include <cassert>
+#include <cstdlib>
+#include <ctime>
 
 #include <boost/static_assert.hpp>
 
@@ -55,12 +57,100 @@ void test_logv() {
   MPrint(y);
 }
 
+typedef FastSparseVector<double, 7, false> MapFSV;
+typedef FastSparseVector<double, 7, true> SortedFSV;
+
+template <typename A, typename B>
+bool same(const A& a, const B& b) {
+  if (a.size() != b.size()) return false;
+  for (typename A::const_iterator it = a.begin(); it != a.end(); ++it)
+    if (b.value(it->first) != it->second) return false;
+  return true;
+}
+
+void test_sorted() {
+  MapFSV m, mo;
+  SortedFSV s, so;
+  for (int i = 0; i < 50; ++i) {
+    const int k = rand() % 300;
+    const double v = (rand() % 1000) / 7.0;
+    m.set_value(k, v); s.set_value(k, v);
+    const int ko = rand() % 300;
+    mo.add_value(ko, v); so.add_value(ko, v);
+  }
+  assert(same(m, s));
+  int last = -1;
+  for (SortedFSV::const_iterator it = s.begin(); it != s.end(); ++it) {
+    assert(it->first > last);
+    last = it->first;
+  }
+  assert(m.dot(mo) == s.dot(so));
+  m += mo; s += so;
+  assert(same(m, s));
+  m -= mo; s -= so;
+  assert(same(m, s));
+  SortedFSV t = s;
+  assert(same(t, s));
+  t.erase(s.begin()->first);
+  assert(t.size() + 1 == s.size());
+  t += t;
+  s *= 2;
+  s.erase(s.begin()->first);
+  assert(same(t, s));
+  t -= t;
+  for (SortedFSV::const_iterator it = t.begin(); it != t.end(); ++it)
+    assert(it->second == 0);
+}
+
+template <typename V>
+double time_edges(int n) {
+  const clock_t start = clock();
+  V w;
+  for (int i = 0; i < 5000; ++i) w.set_value(i, 1.0 / (i + 1));
+  double tot = 0;
+  srand(17);
+  for (int i = 0; i < n; ++i) {
+    V x;
+    const int nf = 10 + rand() % 90;
+    for (int j = 0; j < nf; ++j) x.set_value(rand() % 5000, 1.0);
+    V y = x;
+    tot += y.dot(w) + y.dot(x);
+  }
+  cerr << "  (" << tot << ")";
+  return (clock() - start) / static_cast<double>(CLOCKS_PER_SEC);
+}
+
+template <typename V>
+double time_gradient(int n) {
+  const clock_t start = clock();
+  V g;
+  srand(17);
+  for (int i = 0; i < n; ++i) {
+    V x;
+    for (int j = 0; j < 40; ++j) x.set_value(rand() % 20000, 0.5);
+    g += x;
+  }
+  cerr << "  (" << g.size() << ")";
+  return (clock() - start) / static_cast<double>(CLOCKS_PER_SEC);
+}
+
+void bench_sorted() {
+  cerr << "edges: map"; const double em = time_edges<MapFSV>(20000);
+  cerr << " sorted"; const double es = time_edges<SortedFSV>(20000);
+  cerr << "\n  map=" << em << "s sorted=" << es << "s\n";
+  cerr << "gradient: map"; const double gm = time_gradient<MapFSV>(5000);
+  cerr << " sorted"; const double gs = time_gradient<SortedFSV>(5000);
+  cerr << "\n  map=" << gm << "s sorted=" << gs << "s\n";
+}
+
 int main() {
   cerr << sizeof(prob_t) << " " << sizeof(LogVal<float>) << endl;
   cerr << " sizeof(FSV<float>) = " << sizeof(FastSparseVector<float>) << endl;
   cerr << "sizeof(FSV<double>) = " << sizeof(FastSparseVector<double>) << endl;
   test_unique<FastSparseVector<float> >();
   test_logv();
+  test_sorted();
+  bench_sorted();
 //  sranddev();
   int c = 0;
   FastSparseVector<float> p;
@@ -0,0 +1,465 @@
+// Microbenchmarks of the containers and algorithms the decoder spends most
+// of its time in.  Each benchmark is a function in the style of Google
+// Benchmark: it repeats the operation under test state->iterations times,
+// and the driver raises the count until a run takes --min_time seconds and
+// reports the time per iteration.  The inputs are drawn from the size
+// distributions of real forests (see the fixtures below).
+//
+//   utils_bench [--min_time SECS] [substring of benchmark names ...]
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "b64tools.h"
+#include "d_ary_heap.h"
+#include "dict.h"
+#include "fast_sparse_vector.h"
+#include "fdict.h"
+#include "intern_pool.h"
+#include "prob.h"
+#include "small_vector.h"
+#include "sparse_vector.h"
+#include "timing_stats.h"
+#include "value_array.h"
+
+using namespace std;
+
+struct BenchState {
+  long long iterations;
+  long long items;      // things processed in all iterations, for items/sec
+  double checksum;      // keeps the work from being optimized away
+  BenchState() : iterations(1), items(), checksum() {}
+};
+
+typedef void (*BenchFn)(BenchState*);
+
+struct Benchmark {
+  const char* name;
+  BenchFn fn;
+};
+
+static vector<Benchmark>& Benchmarks() {
+  static vector<Benchmark> b;
+  return b;
+}
+
+struct RegisterBenchmark {
+  RegisterBenchmark(const char* name, BenchFn fn) {
+    Benchmark b = { name, fn };
+    Benchmarks().push_back(b);
+  }
+};
+
+#define BENCHMARK(f) static RegisterBenchmark register_##f(#f, f)
+
+////////////////////////////////////////////////////////////////
+// fixtures
+
+// Zipf-like choice of 0..n-1, as word and feature frequencies are
+static int Zipf(int n) {
+  const double r = rand() / (RAND_MAX + 1.0);
+  return static_cast<int>(n * r * r * r);
+}
+
+typedef FastSparseVector<double> FSV;
+
+// Edge feature vectors of a translation forest without sparse features:
+// most edges of test_data/urdu.json.gz carry 6 or 7 of a dozen features,
+// a few carry 2 or 3 (pass through and glue rules).
+static void DenseEdgeFeatures(int n, vector<FSV>* out) {
+  out->resize(n);
+  for (int i = 0; i < n; ++i) {
+    const int r = rand() % 100;
+    const int size = r < 5 ? 2 : (r < 15 ? 3 : (r < 60 ? 6 : 7));
+    FSV& v = (*out)[i];
+    v.clear();
+    for (int j = 0; j < size; ++j) v.set_value(rand() % 12, rand() / (RAND_MAX + 1.0));
+  }
+}
+
+// Edge feature vectors with rule indicator and lexical features: 10 to 30
+// features whose ids follow a Zipf distribution over a million features.
+static void SparseEdgeFeatures(int n, vector<FSV>* out) {
+  out->resize(n);
+  for (int i = 0; i < n; ++i) {
+    const int size = 10 + rand() % 21;
+    FSV& v = (*out)[i];
+    v.clear();
+    for (int j = 0; j < size; ++j) v.set_value(Zipf(1000000), 1.0);
+  }
+}
+
+// tail sizes of edges: mostly binary and unary rules, with a few lexical
+// and ternary ones
+static void Arities(int n, vector<int>* out) {
+  out->resize(n);
+  for (int i = 0; i < n; ++i) {
+    const int r = rand() % 100;
+    (*out)[i] = r < 10 ? 0 : (r < 50 ? 1 : (r < 95 ? 2 : 3));
+  }
+}
+
+// words of a 50k word vocabulary, in running text order
+static void Words(int n, vector<string>* out) {
+  out->resize(n);
+  for (int i = 0; i < n; ++i) {
+    ostringstream os;
+    os << "w" << Zipf(50000);
+    (*out)[i] = os.str();
+  }
+}
+
+////////////////////////////////////////////////////////////////
+// FastSparseVector
+
+static void BM_FSV_PlusEq_Dense(BenchState* state) {
+  srand(1);
+  vector<FSV> edges;
+  DenseEdgeFeatures(1000, &edges);
+  for (long long it = 0; it < state->iterations; ++it) {
+    FSV sum;
+    for (int i = 0; i < edges.size(); ++i) sum += edges[i];
+    state->checksum += sum.size();
+  }
+  state->items = state->iterations * edges.size();
+}
+BENCHMARK(BM_FSV_PlusEq_Dense);
+
+static void BM_FSV_PlusEq_Sparse(BenchState* state) {
+  srand(2);
+  vector<FSV> edges;
+  SparseEdgeFeatures(1000, &edges);
+  for (long long it = 0; it < state->iterations; ++it) {
+    FSV sum;
+    for (int i = 0; i < edges.size(); ++i) sum += edges[i];
+    state->checksum += sum.size();
+  }
+  state->items = state->iterations * edges.size();
+}
+BENCHMARK(BM_FSV_PlusEq_Sparse);
+
+// Hypergraph::Reweight: every edge's features dotted with the weights
+static void BM_FSV_DotWeights_Dense(BenchState* state) {
+  srand(3);
+  vector<FSV> edges;
+  DenseEdgeFeatures(10000, &edges);
+  vector<double> w(100, 0.5);
+  for (long long it = 0; it < state->iterations; ++it)
+    for (int i = 0; i < edges.size(); ++i) state->checksum += edges[i].dot(w);
+  state->items = state->iterations * edges.size();
+}
+BENCHMARK(BM_FSV_DotWeights_Dense);
+
+static void BM_FSV_DotWeights_Sparse(BenchState* state) {
+  srand(4);
+  vector<FSV> edges;
+  SparseEdgeFeatures(10000, &edges);
+  vector<double> w(1000000, 0.5);
+  for (long long it = 0; it < state->iterations; ++it)
+    for (int i = 0; i < edges.size(); ++i) state->checksum += edges[i].dot(w);
+  state->items = state->iterations * edges.size();
+}
+BENCHMARK(BM_FSV_DotWeights_Sparse);
+
+static void BM_FSV_Iterate_Sparse(BenchState* state) {
+  srand(5);
+  vector<FSV> edges;
+  SparseEdgeFeatures(10000, &edges);
+  for (long long it = 0; it < state->iterations; ++it)
+    for (int i = 0; i < edges.size(); ++i)
+      for (FSV::const_iterator f = edges[i].begin(); f != edges[i].end(); ++f)
+        state->checksum += f->first;
+  state->items = state->iterations * edges.size();
+}
+BENCHMARK(BM_FSV_Iterate_Sparse);
+
+// copying rule features onto a new edge, as ApplyModelSet does
+static void BM_FSV_Copy_Dense(BenchState* state) {
+  srand(6);
+  vector<FSV> edges;
+  DenseEdgeFeatures(10000, &edges);
+  for (long long it = 0; it < state->iterations; ++it)
+    for (int i = 0; i < edges.size(); ++i) {
+      FSV copy(edges[i]);
+      state->checksum += copy.size();
+    }
+  state->items = state->iterations * edges.size();
+}
+BENCHMARK(BM_FSV_Copy_Dense);
+
+////////////////////////////////////////////////////////////////
+// SmallVector
+
+template <class V>
+static void TailsAndSuccessors(BenchState* state) {
+  srand(7);
+  vector<int> arities;
+  Arities(10000, &arities);
+  for (long long it = 0; it < state->iterations; ++it)
+    for (int e = 0; e < arities.size(); ++e) {
+      V tail;
+      for (int i = 0; i < arities[e]; ++i) tail.push_back(e + i);
+      const V j(tail.size(), 0);
+      for (int i = 0; i < j.size(); ++i) {
+        V succ = j;
+        ++succ[i];
+        state->checksum += succ[i] + tail[i];
+      }
+    }
+  state->items = state->iterations * arities.size();
+}
+
+static void BM_SmallVector_PushCopy(BenchState* state) {
+  TailsAndSuccessors<SmallVector<int, 2> >(state);
+}
+BENCHMARK(BM_SmallVector_PushCopy);
+
+static void BM_StdVector_PushCopy(BenchState* state) {
+  TailsAndSuccessors<vector<int> >(state);
+}
+BENCHMARK(BM_StdVector_PushCopy);
+
+////////////////////////////////////////////////////////////////
+// ValueArray: feature function states, copied whenever an item is built
+
+static void BM_ValueArray_CopyState(BenchState* state) {
+  srand(8);
+  const int kSTATES = 1000;
+  vector<ValueArray<char> > states(kSTATES);
+  for (int i = 0; i < kSTATES; ++i) {
+    // trigram LM context plus left words: 8 to 24 bytes
+    states[i] = ValueArray<char>(8 + 4 * (rand() % 5), static_cast<char>(i));
+  }
+  for (long long it = 0; it < state->iterations; ++it)
+    for (int i = 0; i < kSTATES; ++i) {
+      ValueArray<char> copy(states[i]);
+      state->checksum += copy[0] + copy.size();
+    }
+  state->items = state->iterations * kSTATES;
+}
+BENCHMARK(BM_ValueArray_CopyState);
+
+////////////////////////////////////////////////////////////////
+// d_ary_heap: a cube pruning candidate queue, popping the best candidate
+// and pushing up to 3 slightly worse successors until the pop limit
+
+struct Candidate {
+  double score;
+};
+typedef keyed_ptr<double, Candidate> KeyedCandidate;
+
+template <size_t Arity>
+static void CubePops(BenchState* state) {
+  srand(9);
+  const int kPOP_LIMIT = 200;
+  vector<double> init(300), deltas(1000);
+  for (int i = 0; i < init.size(); ++i) init[i] = -(rand() % 100000) / 1000.0;
+  for (int i = 0; i < deltas.size(); ++i) deltas[i] = (rand() % 1000) / 1000.0;
+  vector<Candidate> items(init.size() + 3 * kPOP_LIMIT);
+  for (long long it = 0; it < state->iterations; ++it) {
+    d_ary_heap<KeyedCandidate, Arity, greater<KeyedCandidate> > heap;
+    size_t next = 0;
+    for (; next < init.size(); ++next) {
+      items[next].score = init[next];
+      heap.push_back(KeyedCandidate(init[next], &items[next]));
+    }
+    heap.heapify();
+    for (int pop = 0; pop < kPOP_LIMIT && !heap.empty(); ++pop) {
+      const double best = heap.top().key;
+      state->checksum += best;
+      heap.pop();
+      for (int s = 0; s < 3; ++s, ++next) {
+        items[next].score = best - deltas[(pop * 3 + s) % deltas.size()];
+        heap.push(KeyedCandidate(items[next].score, &items[next]));
+      }
+    }
+  }
+  state->items = state->iterations * kPOP_LIMIT;
+}
+
+static void BM_DAryHeap2_CubePops(BenchState* state) { CubePops<2>(state); }
+BENCHMARK(BM_DAryHeap2_CubePops);
+
+static void BM_DAryHeap4_CubePops(BenchState* state) { CubePops<4>(state); }
+BENCHMARK(BM_DAryHeap4_CubePops);
+
+////////////////////////////////////////////////////////////////
+// Dict
+
+// looking up words already in the dictionary, as while reading grammars
+static void BM_Dict_ConvertKnown(BenchState* state) {
+  srand(10);
+  vector<string> words;
+  Words(100000, &words);
+  Dict d;
+  for (int i = 0; i < words.size(); ++i) d.Convert(words[i]);
+  for (long long it = 0; it < state->iterations; ++it)
+    for (int i = 0; i < words.size(); ++i) state->checksum += d.Convert(words[i]);
+  state->items = state->iterations * words.size();
+}
+BENCHMARK(BM_Dict_ConvertKnown);
+
+static void BM_Dict_ConvertNew(BenchState* state) {
+  srand(11);
+  vector<string> words;
+  Words(100000, &words);
+  for (long long it = 0; it < state->iterations; ++it) {
+    Dict d;
+    for (int i = 0; i < words.size(); ++i) state->checksum += d.Convert(words[i]);
+  }
+  state->items = state->iterations * words.size();
+}
+BENCHMARK(BM_Dict_ConvertNew);
+
+static void BM_Dict_ConvertId(BenchState* state) {
+  srand(12);
+  vector<string> words;
+  Words(100000, &words);
+  Dict d;
+  vector<WordID> ids(words.size());
+  for (int i = 0; i < words.size(); ++i) ids[i] = d.Convert(words[i]);
+  for (long long it = 0; it < state->iterations; ++it)
+    for (int i = 0; i < ids.size(); ++i) state->checksum += d.Convert(ids[i]).size();
+  state->items = state->iterations * ids.size();
+}
+BENCHMARK(BM_Dict_ConvertId);
+
+////////////////////////////////////////////////////////////////
+// fixed_array_intern_pool: interning LM states (two context words) of the
+// items built for a sentence, most of which are seen before
+
+static void BM_InternPool_LMStates(BenchState* state) {
+  srand(13);
+  const int kITEMS = 50000;
+  vector<int> contexts(2 * kITEMS);
+  for (int i = 0; i < contexts.size(); ++i) contexts[i] = Zipf(5000);
+  for (long long it = 0; it < state->iterations; ++it) {
+    fixed_array_intern_pool<int> pool(2);
+    for (int i = 0; i < kITEMS; ++i) state->checksum += pool.intern(&contexts[2 * i]);
+    state->checksum += pool.size();
+  }
+  state->items = state->iterations * kITEMS;
+}
+BENCHMARK(BM_InternPool_LMStates);
+
+////////////////////////////////////////////////////////////////
+// LogVal: the inside algorithm's sums of products
+
+static void BM_LogVal_SumOfProducts(BenchState* state) {
+  srand(14);
+  const int kEDGES = 10000;
+  vector<prob_t> edge(kEDGES), tail(kEDGES);
+  for (int i = 0; i < kEDGES; ++i) {
+    edge[i] = prob_t(rand() / (RAND_MAX + 1.0));
+    tail[i].logeq(-(rand() % 100000) / 100.0);
+  }
+  for (long long it = 0; it < state->iterations; ++it) {
+    prob_t sum;
+    for (int i = 0; i < kEDGES; ++i) sum += edge[i] * tail[i];
+    state->checksum += log(sum);
+  }
+  state->items = state->iterations * kEDGES;
+}
+BENCHMARK(BM_LogVal_SumOfProducts);
+
+static void BM_LogVal_LogSumExp(BenchState* state) {
+  srand(15);
+  const int kEDGES = 10000;
+  vector<prob_t> v(kEDGES);
+  for (int i = 0; i < kEDGES; ++i) v[i].logeq(-(rand() % 100000) / 100.0);
+  for (long long it = 0; it < state->iterations; ++it)
+    state->checksum += log(LogSumExp(v.begin(), v.end()));
+  state->items = state->iterations * kEDGES;
+}
+BENCHMARK(BM_LogVal_LogSumExp);
+
+////////////////////////////////////////////////////////////////
+// B64: gradients and weight vectors sent between training processes
+
+static void BM_B64_EncodeDecode(BenchState* state) {
+  srand(16);
+  vector<double> w(100000);
+  for (int i = 0; i < w.size(); ++i) w[i] = rand() / (RAND_MAX + 1.0);
+  const size_t bytes = w.size() * sizeof(double);
+  vector<double> back(w.size() + 1);
+  for (long long it = 0; it < state->iterations; ++it) {
+    ostringstream os;
+    B64::b64encode(reinterpret_cast<const char*>(&w[0]), bytes, &os);
+    const string enc = os.str();
+    B64::b64decode(reinterpret_cast<const unsigned char*>(enc.data()), enc.size(),
+                   reinterpret_cast<char*>(&back[0]), back.size() * sizeof(double));
+    state->checksum += back[it % w.size()];
+  }
+  state->items = state->iterations * bytes;
+}
+BENCHMARK(BM_B64_EncodeDecode);
+
+static void BM_B64_SparseVector(BenchState* state) {
+  srand(17);
+  SparseVector<double> v;
+  for (int i = 0; i < 10000; ++i) {
+    ostringstream os;
+    os << "F" << i;
+    v.set_value(FD::Convert(os.str()), rand() / (RAND_MAX + 1.0));
+  }
+  for (long long it = 0; it < state->iterations; ++it) {
+    ostringstream os;
+    B64::Encode(1.0, v, &os);
+    const string enc = os.str();
+    double obj;
+    SparseVector<double> back;
+    B64::Decode(&obj, &back, enc.data(), enc.size());
+    state->checksum += back.size();
+  }
+  state->items = state->iterations * v.size();
+}
+BENCHMARK(BM_B64_SparseVector);
+
+////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv) {
+  double min_time = 0.5;
+  vector<string> filters;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--min_time") && i + 1 < argc)
+      min_time = atof(argv[++i]);
+    else if (argv[i][0] == '-') {
+      fprintf(stderr, "Usage: %s [--min_time SECS] [substring of benchmark names ...]\n", argv[0]);
+      return 1;
+    } else
+      filters.push_back(argv[i]);
+  }
+  printf("%-28s %12s %14s %14s\n", "benchmark", "iterations", "ns/iteration", "items/sec");
+  double checksum = 0;
+  const vector<Benchmark>& bs = Benchmarks();
+  for (int b = 0; b < bs.size(); ++b) {
+    bool match = filters.empty();
+    for (int f = 0; f < filters.size() && !match; ++f)
+      match = strstr(bs[b].name, filters[f].c_str()) != NULL;
+    if (!match) continue;
+    BenchState state;
+    double secs = 0;
+    while (true) {
+      state.checksum = 0;
+      const double start = Timer::WallTime();
+      bs[b].fn(&state);
+      secs = Timer::WallTime() - start;
+      if (secs >= min_time || state.iterations >= (1LL << 40)) break;
+      // aim a bit past min_time, growing at most 10x at a time
+      const double scale = secs > 0 ? min(10.0, 1.2 * min_time / secs) : 10.0;
+      state.iterations = max(state.iterations + 1, static_cast<long long>(state.iterations * scale));
+    }
+    checksum += state.checksum;
+    printf("%-28s %12lld %14.1f %14.4g\n", bs[b].name, state.iterations,
+           secs * 1e9 / state.iterations, state.items / secs);
+  }
+  fflush(stdout);
+  fprintf(stderr, "(checksum %g)\n", checksum);
+  return 0;
+}
@@ -1,6 +1,14 @@
 #include "weights.h"
 
 #include <sstream>
+#include <fstream>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "fdict.h"
 #include "filelib.h"
@@ -8,8 +16,128 @@
 
 using namespace std;
 
+// snapshot layout: header, double weights[num_feats], uint32 ends[num_feats]
+// (end of each name in the name blob), then the names back to back.
+// Entry i is the feature with the i+1th smallest FD id when it was written.
+static const char kWS_MAGIC[8] = { 'c', 'd', 'e', 'c', 'W', 'S', 'N', 'P' };
+static const uint32_t kWS_VERSION = 1;
+static const uint32_t kWS_BYTE_ORDER = 0x01020304;
+
+struct WSHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t num_feats;
+  // byte offsets from the start of the file
+  uint64_t weights_off;
+  uint64_t ends_off;
+  uint64_t names_off;
+  uint64_t file_size;
+};
+
+static void SnapshotFail(const string& file, const string& msg) {
+  cerr << "Bad weights snapshot " << file << ": " << msg << endl;
+  abort();
+}
+
+bool Weights::IsSnapshot(const string& fname) {
+  if (fname == "-") return false;
+  const int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  char magic[sizeof(kWS_MAGIC)];
+  const bool res = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+                   memcmp(magic, kWS_MAGIC, sizeof(magic)) == 0;
+  close(fd);
+  return res;
+}
+
+void Weights::InitFromSnapshot(const string& filename, vector<string>* feature_list) {
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) SnapshotFail(filename, strerror(errno));
+  struct stat st;
+  if (fstat(fd, &st) < 0) SnapshotFail(filename, strerror(errno));
+  const size_t size = st.st_size;
+  if (size < sizeof(WSHeader)) SnapshotFail(filename, "file too short");
+  void* data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) SnapshotFail(filename, strerror(errno));
+  const char* base = static_cast<const char*>(data);
+  const WSHeader* h = reinterpret_cast<const WSHeader*>(base);
+  if (h->version != kWS_VERSION) SnapshotFail(filename, "unsupported version");
+  if (h->byte_order != kWS_BYTE_ORDER) SnapshotFail(filename, "written on a machine with a different byte order");
+  if (h->file_size != size) SnapshotFail(filename, "truncated file");
+  const uint64_t n = h->num_feats;
+  const double* weights = reinterpret_cast<const double*>(base + h->weights_off);
+  const uint32_t* ends = reinterpret_cast<const uint32_t*>(base + h->ends_off);
+  if (h->ends_off + n * sizeof(uint32_t) > size || (n && h->names_off + ends[n - 1] > size))
+    SnapshotFail(filename, "corrupt offsets");
+  const string names(base + h->names_off, n ? ends[n - 1] : 0);
+  const vector<unsigned> name_ends(ends, ends + n);
+  vector<WordID> fids;
+  FD::ConvertMany(names, name_ends, &fids);
+  WordID max_fid = 0;
+  for (uint64_t i = 0; i < n; ++i)
+    if (fids[i] > max_fid) max_fid = fids[i];
+  if (wv_.size() <= max_fid)
+    wv_.resize(max_fid + 1);
+  unsigned start = 0;
+  for (uint64_t i = 0; i < n; start = ends[i++]) {
+    if (isnan(weights[i])) {
+      cerr << names.substr(start, ends[i] - start) << " has weight NaN!\n";
+      abort();
+    }
+    wv_[fids[i]] = weights[i];
+    if (feature_list) feature_list->push_back(names.substr(start, ends[i] - start));
+  }
+  munmap(data, size);
+  if (!SILENT) cerr << "Loaded " << n << " feature weights\n";
+}
+
+void Weights::WriteSnapshot(const string& fname, bool hide_zero_value_features) const {
+  vector<double> weights;
+  vector<uint32_t> ends;
+  string names;
+  const int num_feats = FD::NumFeats();
+  for (int i = 1; i < num_feats; ++i) {
+    const double val = (i < wv_.size() ? wv_[i] : 0.0);
+    if (hide_zero_value_features && val == 0.0) continue;
+    weights.push_back(val);
+    names += FD::Convert(i);
+    ends.push_back(names.size());
+  }
+  WSHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, kWS_MAGIC, sizeof(kWS_MAGIC));
+  h.version = kWS_VERSION;
+  h.byte_order = kWS_BYTE_ORDER;
+  h.num_feats = weights.size();
+  h.weights_off = sizeof(WSHeader);
+  h.ends_off = h.weights_off + weights.size() * sizeof(double);
+  h.names_off = h.ends_off + ends.size() * sizeof(uint32_t);
+  h.file_size = h.names_off + names.size();
+  ofstream out(fname.c_str(), ios::binary);
+  if (!out) {
+    cerr << "Can't write weights snapshot " << fname << endl;
+    abort();
+  }
+  out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+  if (!weights.empty()) {
+    out.write(reinterpret_cast<const char*>(&weights[0]), weights.size() * sizeof(double));
+    out.write(reinterpret_cast<const char*>(&ends[0]), ends.size() * sizeof(uint32_t));
+  }
+  out.write(names.data(), names.size());
+  if (!out) {
+    cerr << "Error writing weights snapshot " << fname << endl;
+    abort();
+  }
+}
+
 void Weights::InitFromFile(const std::string& filename, vector<string>* feature_list) {
   if (!SILENT) cerr << "Reading weights from " << filename << endl;
+  if (IsSnapshot(filename)) {
+    InitFromSnapshot(filename, feature_list);
+    return;
+  }
   ReadFile in_file(filename);
   istream& in = *in_file.stream();
   assert(in);
@@ -9,13 +9,20 @@
 class Weights {
  public:
   Weights() {}
+  // fname may also be a snapshot written by WriteSnapshot
   void InitFromFile(const std::string& fname, std::vector<std::string>* feature_list = NULL);
   void WriteToFile(const std::string& fname, bool hide_zero_value_features = true, const std::string* extra = NULL) const;
+  // writes the features (in FD order) and their weights as an uncompressed
+  // binary file that InitFromFile maps and registers with one FD lock
+  // instead of parsing it line by line
+  void WriteSnapshot(const std::string& fname, bool hide_zero_value_features = true) const;
+  static bool IsSnapshot(const std::string& fname);
   void InitVector(std::vector<double>* w) const;
   void InitSparseVector(SparseVector<double>* w) const;
   void InitFromVector(const std::vector<double>& w);
   void InitFromVector(const SparseVector<double>& w);
  private:
+  void InitFromSnapshot(const std::string& fname, std::vector<std::string>* feature_list);
   std::vector<double> wv_;
 };
 
@@ -2,6 +2,7 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <unistd.h>
 #include <gtest/gtest.h>
 #include "weights.h"
 #include "tdict.h"
@@ -21,6 +22,24 @@ TEST_F(WeightsTest,Load) {
   w.WriteToFile("-");
 }
 
+TEST_F(WeightsTest,Snapshot) {
+  Weights w;
+  vector<string> text_feats;
+  w.InitFromFile("test_data/weights", &text_feats);
+  EXPECT_FALSE(Weights::IsSnapshot("test_data/weights"));
+  w.WriteSnapshot("test_data/weights.snapshot");
+  EXPECT_TRUE(Weights::IsSnapshot("test_data/weights.snapshot"));
+  Weights w2;
+  vector<string> snap_feats;
+  w2.InitFromFile("test_data/weights.snapshot", &snap_feats);
+  EXPECT_EQ(text_feats, snap_feats);
+  vector<double> v, v2;
+  w.InitVector(&v);
+  w2.InitVector(&v2);
+  EXPECT_EQ(v, v2);
+  unlink("test_data/weights.snapshot");
+}
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
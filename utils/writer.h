@@ -2,6 +2,10 @@
 #define WRITER_H
 
 #include <iostream>
+#include <string>
+#include <cstring>
+#include "ftoa.h"
+#include "utoa.h"
 
 struct Writer
 {
@@ -152,4 +156,95 @@ make_bound_writer(W const& w)
 
 
 
+// collects output and hands it to an ostream a block at a time, with the
+// numbers formatted by the routines in utoa.h/ftoa.h rather than by the
+// stream.  What is written is exactly what out << ... would have written:
+// doubles use out's precision (printf %g) unless out has fixed, scientific,
+// showpos or showpoint set, in which case they go through out itself.
+// Anything still buffered is written when the BufferedWriter is destroyed.
+class BufferedWriter {
+ public:
+  explicit BufferedWriter(std::ostream* out, std::size_t size = 1 << 16)
+    : out_(out), buf_(new char[size]), pos_(buf_), end_(buf_ + size),
+      precision_(out->precision()),
+      stream_floats_(out->flags() & (std::ios_base::floatfield | std::ios_base::showpos | std::ios_base::showpoint | std::ios_base::uppercase)) {}
+  ~BufferedWriter() {
+    flush();
+    delete[] buf_;
+  }
+
+  void write(const char* s, std::size_t n) {
+    if (n > static_cast<std::size_t>(end_ - pos_)) {
+      flush();
+      if (n > static_cast<std::size_t>(end_ - buf_)) {  // too big to be worth copying
+        out_->write(s, n);
+        return;
+      }
+    }
+    std::memcpy(pos_, s, n);
+    pos_ += n;
+  }
+
+  void flush() {
+    if (pos_ > buf_) out_->write(buf_, pos_ - buf_);
+    pos_ = buf_;
+  }
+
+  BufferedWriter& operator<<(char c) {
+    if (pos_ == end_) flush();
+    *pos_++ = c;
+    return *this;
+  }
+  BufferedWriter& operator<<(const char* s) { write(s, std::strlen(s)); return *this; }
+  BufferedWriter& operator<<(const std::string& s) { write(s.data(), s.size()); return *this; }
+  BufferedWriter& operator<<(short i) { return AppendInt<int32_t>(i); }
+  BufferedWriter& operator<<(int i) { return AppendInt<int32_t>(i); }
+  BufferedWriter& operator<<(long i) { return AppendInt<int64_t>(i); }
+  BufferedWriter& operator<<(long long i) { return AppendInt<int64_t>(i); }
+  BufferedWriter& operator<<(unsigned short i) { return AppendUInt<uint32_t>(i); }
+  BufferedWriter& operator<<(unsigned i) { return AppendUInt<uint32_t>(i); }
+  BufferedWriter& operator<<(unsigned long i) { return AppendUInt<uint64_t>(i); }
+  BufferedWriter& operator<<(unsigned long long i) { return AppendUInt<uint64_t>(i); }
+  BufferedWriter& operator<<(float f) { return *this << static_cast<double>(f); }
+  BufferedWriter& operator<<(double f) {
+    if (stream_floats_) {
+      flush();
+      *out_ << f;
+      return *this;
+    }
+    Reserve(32);
+    pos_ = append_printf_g(pos_, f, precision_);
+    return *this;
+  }
+
+ private:
+  void Reserve(std::size_t n) {
+    if (static_cast<std::size_t>(end_ - pos_) < n) flush();
+  }
+  template <class T> BufferedWriter& AppendInt(T i) {
+    char buf[signed_for_int<T>::toa_bufsize];
+    char* e = buf + sizeof(buf);
+    char* b = itoa(e, i);
+    write(b, e - b);
+    return *this;
+  }
+  template <class T> BufferedWriter& AppendUInt(T i) {
+    char buf[signed_for_int<T>::toa_bufsize];
+    char* e = buf + sizeof(buf);
+    char* b = utoa(e, i);
+    write(b, e - b);
+    return *this;
+  }
+
+  std::ostream* out_;
+  char* buf_;
+  char* pos_;
+  char* end_;
+  int precision_;
+  bool stream_floats_;
+
+  BufferedWriter(const BufferedWriter&);
+  void operator=(const BufferedWriter&);
+};
+
 #endif
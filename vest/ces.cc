@@ -2,23 +2,57 @@
 
 #include <vector>
 #include <sstream>
+#include <tr1/unordered_map>
 #include <boost/shared_ptr.hpp>
 
 #include "aligner.h"
 #include "lattice.h"
 #include "viterbi_envelope.h"
 #include "error_surface.h"
+#include "hash.h"
 
 using boost::shared_ptr;
 using namespace std;
 
 const bool minimize_segments = true;    // if adjacent segments have equal scores, merge them
 
+namespace {
+
+// the segments of an envelope share most of their sub-derivations, so the
+// yield of each one is built once and substituted into all its parents
+// (as Segment::ConstructTranslation would, but without rebuilding them)
+typedef std::tr1::unordered_map<const Segment*, vector<WordID> > YieldCache;
+
+const vector<WordID>& Yield(const Segment* seg, YieldCache* cache) {
+  const YieldCache::iterator it = cache->find(seg);
+  if (it != cache->end()) return it->second;
+  vector<const Segment*> ants;
+  const Segment* cur = seg;
+  while (!cur->edge) {
+    ants.push_back(cur->p2);
+    cur = cur->p1;
+  }
+  assert(ants.size() == cur->edge->tail_nodes_.size());
+  vector<const vector<WordID>*> pants(ants.size());
+  for (int i = 0; i < ants.size(); ++i)
+    pants[ants.size() - 1 - i] = &Yield(ants[i], cache);
+  vector<WordID>& trans = (*cache)[seg];  // references to values stay valid
+  cur->edge->rule_->ESubstitute(pants, &trans);
+  return trans;
+}
+
+// translations that come back after other ones in between are not rescored
+typedef std::tr1::unordered_map<vector<WordID>, ScoreP, murmur_hash_array<vector<WordID> > > ScoreCache;
+
+}
+
 void ComputeErrorSurface(const SentenceScorer& ss, const ViterbiEnvelope& ve, ErrorSurface* env, const ScoreType type, const Hypergraph& hg) {
   vector<WordID> prev_trans;
-  const vector<shared_ptr<Segment> >& ienv = ve.GetSortedSegs();
+  const vector<Segment*>& ienv = ve.GetSortedSegs();
   env->resize(ienv.size());
   ScoreP prev_score;
+  YieldCache yields;
+  ScoreCache scores;
   int j = 0;
   for (int i = 0; i < ienv.size(); ++i) {
     const Segment& seg = *ienv[i];
@@ -46,7 +80,7 @@ void ComputeErrorSurface(const SentenceScorer& ss, const ViterbiEnvelope& ve, Er
       string tstr = os.str();
       TD::ConvertSentence(tstr.substr(tstr.rfind(" ||| ") + 5), &trans);
     } else {
-      seg.ConstructTranslation(&trans);
+      trans = Yield(&seg, &yields);
     }
     // cerr << "Scoring: " << TD::GetString(trans) << endl;
     if (trans == prev_trans) {
@@ -60,7 +94,8 @@ void ComputeErrorSurface(const SentenceScorer& ss, const ViterbiEnvelope& ve, Er
       }
       // cerr << "Identical translation, skipping scoring\n";
     } else {
-      ScoreP score = ss.ScoreCandidate(trans);
+      ScoreP& score = scores[trans];
+      if (!score) score = ss.ScoreCandidate(trans);
       // cerr << "score= " << score->ComputeScore() << "\n";
       ScoreP cur_delta_p = score->GetZero();
       Score* cur_delta = cur_delta_p.get();
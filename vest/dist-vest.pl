@@ -37,6 +37,8 @@ die "Can't find $parallelize" unless -x $parallelize;
 die "Can't find $libcall" unless -e $libcall;
 my $decoder = $cdec;
 my $lines_per_mapper = 400;
+my $mapper_threads = 1;
+my $reducer_threads = 1;
 my $rand_directions = 15;
 my $iteration = 1;
 my $run_local = 0;
@@ -63,6 +65,8 @@ my $noprimary;
 my $maxsim=0;
 my $oraclen=0;
 my $oracleb=20;
+my $oracle_threads=1;
+my $oracle_cache_change=0;
 my $bleu_weight=1;
 my $use_make;  # use make to parallelize line search
 my $dirargs='';
@@ -75,6 +79,8 @@ Getopt::Long::Configure("no_auto_abbrev");
 if (GetOptions(
 	"decoder=s" => \$decoderOpt,
 	"decode-nodes=i" => \$decode_nodes,
+	"mapper-threads=i" => \$mapper_threads,
+	"reducer-threads=i" => \$reducer_threads,
 	"density-prune=f" => \$density_prune,
 	"dont-clean" => \$disable_clean,
 	"pass-suffix=s" => \$pass_suffix,
@@ -98,6 +104,8 @@ if (GetOptions(
         "oracle-directions=i" => \$oraclen,
         "n-oracle=i" => \$oraclen,
         "oracle-batch=i" => \$oracleb,
+        "oracle-threads=i" => \$oracle_threads,
+        "oracle-cache-change=f" => \$oracle_cache_change,
         "directions-args=s" => \$dirargs,
 	"ref-files=s" => \$refFiles,
 	"metric=s" => \$metric,
@@ -121,6 +129,8 @@ if ($metric =~ /^(combi|ter)$/i) {
 } elsif ($metric =~ /^meteor$/i) {
   $lines_per_mapper = 2000;   # start up time is really high
 }
+# each mapper computes the envelopes of a forest's directions in parallel
+$lines_per_mapper *= $mapper_threads if $mapper_threads > 1;
 
 ($iniFile) = @ARGV;
 
@@ -284,9 +294,9 @@ while (1){
 		$pcmd = "cat $srcFile |";
 	} elsif ($use_make) {
 	    # TODO: Throw error when decode_nodes is specified along with use_make
-		$pcmd = "cat $srcFile | $parallelize --use-fork -p $pmem -e $logdir -j $use_make --";
+		$pcmd = "cat $srcFile | $parallelize --use-fork --longest-first --speculate -p $pmem -e $logdir -j $use_make --";
 	} else {
-		$pcmd = "cat $srcFile | $parallelize $usefork -p $pmem -e $logdir -j $decode_nodes --";
+		$pcmd = "cat $srcFile | $parallelize $usefork --longest-first --speculate -p $pmem -e $logdir -j $decode_nodes --";
 	}
 	my $cmd = "$pcmd $decoder_cmd 2> $decoderLog 1> $runFile";
 	print STDERR "COMMAND:\n$cmd\n";
@@ -295,7 +305,7 @@ while (1){
         my $num_topbest;
         my $retries = 0;
 	while($retries < 5) {
-	    $num_hgs = check_output("ls $dir/hgs/*.gz | wc -l");
+	    $num_hgs = check_output("ls $dir/hgs/*.gz $dir/hgs/*.hgb 2> /dev/null | wc -l");
 	    $num_topbest = check_output("wc -l < $runFile");
 	    print STDERR "NUMBER OF HGs: $num_hgs\n";
 	    print STDERR "NUMBER OF TOP-BEST HYPs: $num_topbest\n";
@@ -331,6 +341,10 @@ while (1){
 		my $nop=$noprimary?"--no_primary":"";
 		my $targs=$oraclen ? "--decoder_translations='$runFile.gz' ".get_comma_sep_refs('-references',$refFiles):"";
 		my $bwargs=$bleu_weight!=1 ? "--bleu_weight=$bleu_weight":"";
+		if ($oraclen) {
+			$targs .= " -j $oracle_threads" if $oracle_threads > 1;
+			$targs .= " --oracle_cache=$dir/oracle.cache.gz --oracle_cache_max_change=$oracle_cache_change" if $oracle_cache_change > 0;
+		}
 		$cmd="$MAPINPUT -w $inweights -r $dir/hgs $bwargs -s $devSize -d $rand_directions --max_similarity=$maxsim --oracle_directions=$oraclen --oracle_batch=$oracleb $targs $dirargs > $dir/agenda.$im1-$opt_iter";
 		print STDERR "COMMAND:\n$cmd\n";
 		check_call($cmd);
@@ -364,7 +378,7 @@ while (1){
 			$mapoutput =~ s/mapinput/mapoutput/;
 			push @mapoutputs, "$dir/splag.$im1/$mapoutput";
 			$o2i{"$dir/splag.$im1/$mapoutput"} = "$dir/splag.$im1/$shard";
-			my $script = "$MAPPER -s $srcFile -l $metric $refs_comma_sep < $dir/splag.$im1/$shard | sort -t \$'\\t' -k 1 > $dir/splag.$im1/$mapoutput";
+			my $script = "$MAPPER -s $srcFile -l $metric -j $mapper_threads $refs_comma_sep < $dir/splag.$im1/$shard | sort -t \$'\\t' -k 1 > $dir/splag.$im1/$mapoutput";
 			if ($run_local) {
 				print STDERR "COMMAND:\n$script\n";
 				check_bash_call($script);
@@ -429,7 +443,7 @@ while (1){
 		print STDERR "Results for $tol/$til lines\n";
 		print STDERR "\nSORTING AND RUNNING VEST REDUCER\n";
 		print STDERR unchecked_output("date");
-		$cmd="sort -t \$'\\t' -k 1 @mapoutputs | $REDUCER -l $metric > $dir/redoutput.$im1";
+		$cmd="sort -t \$'\\t' -k 1 @mapoutputs | $REDUCER -l $metric -j $reducer_threads > $dir/redoutput.$im1";
 		print STDERR "COMMAND:\n$cmd\n";
 		check_bash_call($cmd);
 		$cmd="sort -nk3 $DIR_FLAG '-t|' $dir/redoutput.$im1 | head -1";
@@ -633,6 +647,24 @@ Options:
 	--decoder <decoder path>
 		Decoder binary to use.
 
+	--mapper-threads <I>
+		Threads each line search mapper uses to search the directions
+		through one forest in parallel; mappers are given I times as
+		many input lines. [default=1]
+
+	--reducer-threads <I>
+		Threads the reducer uses to merge and search the error surfaces
+		of each direction. [default=1]
+
+	--oracle-threads <I>
+		Threads finding the hope and fear translations for
+		--oracle-directions. [default=1]
+
+	--oracle-cache-change <D>
+		Keep the oracles of --oracle-directions between iterations, and
+		use them again while the weights are within a relative change of
+		D of those they were found with. [default=0, off]
+
 	--density-prune <N>
 		Limit the density of the hypergraph on each iteration to N times
 		the number of edges on the Viterbi path.
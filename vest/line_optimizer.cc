@@ -3,6 +3,10 @@
 #include <limits>
 #include <algorithm>
 
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "bleu_stats.h"
 #include "sparse_vector.h"
 #include "scorer.h"
 
@@ -17,63 +21,262 @@ struct IntervalComp {
   }
 };
 
-double LineOptimizer::LineOptimize(
-    const vector<ErrorSurface>& surfaces,
-    const LineOptimizer::ScoreType type,
-    float* best_score,
-    const double epsilon) {
-  // cerr << "MIN=" << MINIMIZE_SCORE << " MAX=" << MAXIMIZE_SCORE << "  MINE=" << type << endl;
-  vector<ErrorIter> all_ints;
-  for (vector<ErrorSurface>::const_iterator i = surfaces.begin();
-       i != surfaces.end(); ++i) {
-    const ErrorSurface& surface = *i;
-    for (ErrorIter j = surface.begin(); j != surface.end(); ++j)
-      all_ints.push_back(j);
+// a point of (lo, hi), preferring pos
+static double PointIn(double lo, double hi, double pos) {
+  if (pos > lo && pos < hi) return pos;
+  if (lo == -numeric_limits<double>::infinity()) return hi - 0.1;
+  if (hi == numeric_limits<double>::infinity()) return lo + 1000.0;
+  return lo + (hi - lo) / 2;
+}
+
+static inline bool Better(LineOptimizer::ScoreType type, float a, float b) {
+  return (type == LineOptimizer::MAXIMIZE_SCORE && a > b) ||
+         (type == LineOptimizer::MINIMIZE_SCORE && a < b);
+}
+
+namespace {
+
+void SortGroup(const vector<ErrorSurface>* surfaces, size_t begin, size_t end, vector<ErrorIter>* run) {
+  for (size_t i = begin; i < end; ++i)
+    for (ErrorIter j = (*surfaces)[i].begin(); j != (*surfaces)[i].end(); ++j)
+      run->push_back(j);
+  sort(run->begin(), run->end(), IntervalComp());
+}
+
+void MergeRuns(const vector<ErrorIter>* a, const vector<ErrorIter>* b, vector<ErrorIter>* out) {
+  out->resize(a->size() + b->size());
+  merge(a->begin(), a->end(), b->begin(), b->end(), out->begin(), IntervalComp());
+}
+
+// all segments sorted by x.  With threads, each sorts the segments of a
+// group of surfaces and the sorted runs are merged pairwise.
+void SortSegments(const vector<ErrorSurface>& surfaces, int threads, vector<ErrorIter>* ints) {
+  if (threads == 1) {
+    SortGroup(&surfaces, 0, surfaces.size(), ints);
+    return;
+  }
+  vector<vector<ErrorIter> > runs(threads);
+  {
+    boost::thread_group workers;
+    for (int t = 0; t < threads; ++t)
+      workers.create_thread(boost::bind(&SortGroup, &surfaces,
+        surfaces.size() * t / threads, surfaces.size() * (t + 1) / threads, &runs[t]));
+    workers.join_all();
   }
-  sort(all_ints.begin(), all_ints.end(), IntervalComp());
-  double last_boundary = all_ints.front()->x;
-  ScoreP accp = all_ints.front()->delta->GetZero();
-  Score *acc=accp.get();
-  float& cur_best_score = *best_score;
-  cur_best_score = (type == MAXIMIZE_SCORE ?
-    -numeric_limits<float>::max() : numeric_limits<float>::max());
-  bool left_edge = true;
-  double pos = numeric_limits<double>::quiet_NaN();
-  for (vector<ErrorIter>::iterator i = all_ints.begin();
-       i != all_ints.end(); ++i) {
-    const ErrorSegment& seg = **i;
-    assert(seg.delta);
-    if (seg.x - last_boundary > epsilon) {
-      float sco = acc->ComputeScore();
-      if ((type == MAXIMIZE_SCORE && sco > cur_best_score) ||
-          (type == MINIMIZE_SCORE && sco < cur_best_score) ) {
-        cur_best_score = sco;
-	if (left_edge) {
-	  pos = seg.x - 0.1;
-	  left_edge = false;
-	} else {
-	  pos = last_boundary + (seg.x - last_boundary) / 2;
-	}
-	// cerr << "NEW BEST: " << pos << "  (score=" << cur_best_score << ")\n";
+  while (runs.size() > 1) {
+    vector<vector<ErrorIter> > merged((runs.size() + 1) / 2);
+    boost::thread_group workers;
+    for (unsigned i = 0; i + 1 < runs.size(); i += 2)
+      workers.create_thread(boost::bind(&MergeRuns, &runs[i], &runs[i + 1], &merged[i / 2]));
+    if (runs.size() % 2) merged.back().swap(runs.back());
+    workers.join_all();
+    runs.swap(merged);
+  }
+  ints->swap(runs[0]);
+}
+
+// how the sweep adds up and scores the deltas: through the Score interface,
+// which works for every metric ...
+struct ScoreOps {
+  typedef const Score* Delta;
+  typedef ScoreP Stats;
+  explicit ScoreOps(const Score& s) : zero(s.GetZero()) {}
+  Stats Zero() const { return zero->Clone(); }
+  static Stats Copy(const Stats& s) { return s->Clone(); }
+  static void Add(Stats& acc, const Score* d) { acc->PlusEquals(*d); }
+  static void AddStats(Stats& acc, const Stats& s) { acc->PlusEquals(*s); }
+  float ComputeScore(const Stats& s) const { return s->ComputeScore(); }
+  ScoreP zero;
+};
+
+// ... or, for BLEU, as values
+struct BLEUOps {
+  typedef BLEUStats Delta;
+  typedef BLEUStats Stats;
+  explicit BLEUOps(int n) : order(n) {}
+  Stats Zero() const { return BLEUStats(); }
+  static Stats Copy(const Stats& s) { return s; }
+  static void Add(Stats& acc, const BLEUStats& d) { acc += d; }
+  static void AddStats(Stats& acc, const Stats& s) { acc += s; }
+  float ComputeScore(const Stats& s) const { return s.ComputeScore(order); }
+  int order;
+};
+
+// finds the best point on the line given the sorted x's and deltas of all
+// segments.  The sweep is split into a chunk per thread; each chunk starts
+// from the prefix sum of the deltas of the chunks before it.  The result is
+// the same as a serial sweep (as long as adding up the deltas is exact).
+template <class Ops>
+class Sweep {
+  typedef typename Ops::Delta Delta;
+  typedef typename Ops::Stats Stats;
+ public:
+  Sweep(const Ops& ops, const vector<double>& xs, const vector<Delta>& deltas,
+        LineOptimizer::ScoreType type, double epsilon, double xmin, double xmax, int threads) :
+    ops_(ops), xs_(xs), deltas_(deltas), type_(type), x_min_(xmin), x_max_(xmax),
+    restricted_(xmin > -numeric_limits<double>::infinity() || xmax < numeric_limits<double>::infinity()),
+    eval_(xs.size()), last_boundary_(xs.size()), chunks_(threads) {
+    // where scores are evaluated only depends on the x's
+    double lb = xs.front();
+    for (size_t i = 0; i < xs.size(); ++i) {
+      eval_[i] = (xs[i] - lb > epsilon);
+      last_boundary_[i] = lb;
+      if (eval_[i]) lb = xs[i];
+    }
+    final_boundary_ = lb;
+    for (int t = 0; t < threads; ++t) {
+      chunks_[t].begin = xs.size() * t / threads;
+      chunks_[t].end = xs.size() * (t + 1) / threads;
+    }
+  }
+
+  double Run(float* best_score) {
+    RunChunks(&Sweep::SumChunk);
+    Stats acc = ops_.Zero();
+    for (unsigned t = 0; t < chunks_.size(); ++t) {
+      chunks_[t].start = Ops::Copy(acc);
+      if (chunks_[t].begin < chunks_[t].end) Ops::AddStats(acc, chunks_[t].sum);
+    }
+    RunChunks(&Sweep::SweepChunk);
+
+    // the first evaluation with the best score wins, and the first one that
+    // improves on no score at all is at the left edge
+    float& cur_best_score = *best_score;
+    cur_best_score = Worst();
+    long best = -1;
+    long first_improving = -1;
+    for (unsigned t = 0; t < chunks_.size(); ++t) {
+      const Chunk& c = chunks_[t];
+      if (first_improving < 0) first_improving = c.first_improving;
+      if (c.best >= 0 && Better(type_, c.best_score, cur_best_score)) {
+        cur_best_score = c.best_score;
+        best = c.best;
       }
-      // string xx; acc->ScoreDetails(&xx); cerr << "---- " << xx;
-      // cerr << "---- s=" << sco << "\n";
-      last_boundary = seg.x;
     }
-    // cerr << "x-boundary=" << seg.x << "\n";
-    acc->PlusEquals(*seg.delta);
+    double pos = numeric_limits<double>::quiet_NaN();
+    if (best >= 0) {
+      const double x = xs_[best];
+      const double from = last_boundary_[best];
+      if (best == first_improving)
+        pos = x - 0.1;
+      else
+        pos = from + (x - from) / 2;
+      if (restricted_) pos = PointIn(max(from, x_min_), min(x, x_max_), pos);
+    }
+    const float sco = ops_.ComputeScore(acc);
+    const double from = max(final_boundary_, x_min_);
+    if ((!restricted_ || from < x_max_) && Better(type_, sco, cur_best_score)) {
+      cur_best_score = sco;
+      pos = (first_improving < 0 ? 0 : final_boundary_ + 1000.0);
+      if (restricted_) pos = PointIn(from, x_max_, pos);
+    }
+    return pos;
+  }
+
+ private:
+  struct Chunk {
+    Chunk() : best(-1), first_improving(-1) {}
+    size_t begin, end;   // of the segments
+    Stats start;         // statistics before the first segment
+    Stats sum;           // of the deltas in the chunk
+    long best;           // first evaluation reaching the chunk's best score
+    float best_score;
+    long first_improving;  // first evaluation better than no score at all
+  };
+
+  float Worst() const {
+    return (type_ == LineOptimizer::MAXIMIZE_SCORE ?
+      -numeric_limits<float>::max() : numeric_limits<float>::max());
   }
-  float sco = acc->ComputeScore();
-  if ((type == MAXIMIZE_SCORE && sco > cur_best_score) ||
-      (type == MINIMIZE_SCORE && sco < cur_best_score) ) {
-    cur_best_score = sco;
-    if (left_edge) {
-      pos = 0;
-    } else {
-      pos = last_boundary + 1000.0;
+
+  void RunChunks(void (Sweep::*f)(Chunk*)) {
+    if (chunks_.size() == 1) {
+      (this->*f)(&chunks_[0]);
+      return;
     }
+    boost::thread_group workers;
+    for (unsigned t = 0; t < chunks_.size(); ++t)
+      if (chunks_[t].begin < chunks_[t].end)
+        workers.create_thread(boost::bind(f, this, &chunks_[t]));
+    workers.join_all();
+  }
+
+  void SumChunk(Chunk* c) {
+    c->sum = ops_.Zero();
+    for (size_t i = c->begin; i < c->end; ++i)
+      Ops::Add(c->sum, deltas_[i]);
+  }
+
+  void SweepChunk(Chunk* c) {
+    Stats acc = Ops::Copy(c->start);
+    const float worst = Worst();
+    c->best_score = worst;
+    for (size_t i = c->begin; i < c->end; ++i) {
+      if (eval_[i]) {
+        // the score of (last_boundary_[i], xs_[i])
+        const float sco = ops_.ComputeScore(acc);
+        if (!restricted_ || max(last_boundary_[i], x_min_) < min(xs_[i], x_max_)) {
+          if (c->first_improving < 0 && Better(type_, sco, worst)) c->first_improving = i;
+          if (Better(type_, sco, c->best_score)) {
+            c->best_score = sco;
+            c->best = i;
+          }
+        }
+      }
+      Ops::Add(acc, deltas_[i]);
+    }
+  }
+
+  const Ops& ops_;
+  const vector<double>& xs_;
+  const vector<Delta>& deltas_;
+  const LineOptimizer::ScoreType type_;
+  const double x_min_, x_max_;
+  const bool restricted_;
+  vector<char> eval_;             // is the score evaluated before segment i
+  vector<double> last_boundary_;  // where the interval ending at segment i starts
+  double final_boundary_;
+  vector<Chunk> chunks_;
+};
+
+}  // namespace
+
+double LineOptimizer::LineOptimize(
+    const vector<ErrorSurface>& surfaces,
+    const LineOptimizer::ScoreType type,
+    float* best_score,
+    const double epsilon,
+    const double x_min,
+    const double x_max,
+    int threads) {
+  size_t n = 0;
+  for (unsigned i = 0; i < surfaces.size(); ++i) n += surfaces[i].size();
+  // not worth starting threads for less
+  if (n < 1000 * static_cast<size_t>(threads) || surfaces.size() < static_cast<size_t>(threads))
+    threads = 1;
+  vector<ErrorIter> ints;
+  SortSegments(surfaces, threads, &ints);
+  vector<double> xs(ints.size());
+  for (size_t i = 0; i < ints.size(); ++i) xs[i] = ints[i]->x;
+
+  // BLEU deltas are added up as values if they all can be
+  int order = 0;
+  vector<BLEUStats> bleu(ints.size());
+  bool is_bleu = true;
+  for (size_t i = 0; is_bleu && i < ints.size(); ++i) {
+    int o;
+    is_bleu = ints[i]->delta->GetBLEUStats(&bleu[i], &o) && (i == 0 || o == order);
+    order = o;
+  }
+  if (is_bleu) {
+    const BLEUOps ops(order);
+    return Sweep<BLEUOps>(ops, xs, bleu, type, epsilon, x_min, x_max, threads).Run(best_score);
   }
-  return pos;
+  vector<BLEUStats>().swap(bleu);
+  vector<const Score*> deltas(ints.size());
+  for (size_t i = 0; i < ints.size(); ++i) deltas[i] = ints[i]->delta.get();
+  const ScoreOps ops(*ints.front()->delta);
+  return Sweep<ScoreOps>(ops, xs, deltas, type, epsilon, x_min, x_max, threads).Run(best_score);
 }
 
 void LineOptimizer::RandomUnitVector(const vector<int>& features_to_optimize,
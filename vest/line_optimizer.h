@@ -1,6 +1,7 @@
 #ifndef LINE_OPTIMIZER_H_
 #define LINE_OPTIMIZER_H_
 
+#include <limits>
 #include <vector>
 
 #include "sparse_vector.h"
@@ -16,12 +17,21 @@ struct LineOptimizer {
   enum ScoreType { MAXIMIZE_SCORE, MINIMIZE_SCORE };
 
   // merge all the error surfaces together into a global
-  // error surface and find (the middle of) the best segment
+  // error surface and find (the middle of) the best segment.
+  // Only points in [x_min, x_max] are considered (the surfaces may have been
+  // computed from envelopes restricted to it).  With threads > 1, large
+  // problems are merged and swept in parallel; the result is the same as long
+  // as adding up the score deltas is exact (e.g. counts, as for BLEU and
+  // TER), and the scores must be safe to compute concurrently (scores
+  // computed by an external server are not).
   static double LineOptimize(
      const std::vector<ErrorSurface>& envs,
      const LineOptimizer::ScoreType type,
      float* best_score,
-     const double epsilon = 1.0/65536.0);
+     const double epsilon = 1.0/65536.0,
+     const double x_min = -std::numeric_limits<double>::infinity(),
+     const double x_max = std::numeric_limits<double>::infinity(),
+     int threads = 1);
 
   // return a random vector of length 1 where all dimensions
   // not listed in dimensions will be 0.
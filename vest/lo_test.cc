@@ -2,10 +2,10 @@
 #include <iostream>
 #include <fstream>
 
-#include <boost/shared_ptr.hpp>
 #include <gtest/gtest.h>
 
 #include "ces.h"
+#include "arena.h"
 #include "fdict.h"
 #include "hg.h"
 #include "kbest.h"
@@ -18,7 +18,6 @@
 #include "scorer.h"
 
 using namespace std;
-using boost::shared_ptr;
 
 class OptTest : public testing::Test {
  protected:
@@ -43,12 +42,14 @@ TEST_F(OptTest, TestCheckNaN) {
 }
 
 TEST_F(OptTest,TestViterbiEnvelope) {
-  shared_ptr<Segment> a1(new Segment(-1, 0));
-  shared_ptr<Segment> b1(new Segment(1, 0));
-  shared_ptr<Segment> a2(new Segment(-1, 1));
-  shared_ptr<Segment> b2(new Segment(1, -1));
-  vector<shared_ptr<Segment> > sa; sa.push_back(a1); sa.push_back(b1);
-  vector<shared_ptr<Segment> > sb; sb.push_back(a2); sb.push_back(b2);
+  MonotonicArena arena;
+  ArenaScope scope(&arena);
+  Segment* a1 = new Segment(-1, 0);
+  Segment* b1 = new Segment(1, 0);
+  Segment* a2 = new Segment(-1, 1);
+  Segment* b2 = new Segment(1, -1);
+  vector<Segment*> sa; sa.push_back(a1); sa.push_back(b1);
+  vector<Segment*> sb; sb.push_back(a2); sb.push_back(b2);
   ViterbiEnvelope a(sa);
   cerr << a << endl;
   ViterbiEnvelope b(sb);
@@ -56,6 +57,11 @@ TEST_F(OptTest,TestViterbiEnvelope) {
   c *= b;
   cerr << a << " (*) " << b << " = " << c << endl;
   EXPECT_EQ(3, c.size());
+  EXPECT_EQ(a1, c.GetSortedSegs()[0]->p1);
+  EXPECT_EQ(a2, c.GetSortedSegs()[0]->p2);
+  EXPECT_EQ(b1, c.GetSortedSegs()[2]->p1);
+  EXPECT_EQ(b2, c.GetSortedSegs()[2]->p2);
+  EXPECT_TRUE(arena.Owns(c.GetSortedSegs()[1]));
 }
 
 TEST_F(OptTest,TestViterbiEnvelopeInside) {
@@ -78,9 +84,11 @@ TEST_F(OptTest,TestViterbiEnvelopeInside) {
   }
   SparseVector<double> dir; dir.set_value(FD::Convert("f1"), 1.0);
   ViterbiEnvelopeWeightFunction wf(wts, dir);
+  MonotonicArena arena;
+  ArenaScope scope(&arena);
   ViterbiEnvelope env = Inside<ViterbiEnvelope, ViterbiEnvelopeWeightFunction>(hg, NULL, wf);
   cerr << env << endl;
-  const vector<boost::shared_ptr<Segment> >& segs = env.GetSortedSegs();
+  const vector<Segment*>& segs = env.GetSortedSegs();
   dir *= segs[1]->x;
   wts += dir;
   hg.Reweight(wts);
@@ -144,6 +152,8 @@ TEST_F(OptTest, TestS1) {
   ScoreType type = ScoreTypeFromString("ibm_bleu");
   ScorerP scorer1 = SentenceScorer::CreateSentenceScorer(type, refs1);
   ScorerP scorer2 = SentenceScorer::CreateSentenceScorer(type, refs2);
+  MonotonicArena arena;
+  ArenaScope scope(&arena);
   vector<ViterbiEnvelope> envs(2);
 
   RandomNumberGenerator<boost::mt19937> rng;
@@ -193,6 +203,106 @@ TEST_F(OptTest, TestS1) {
   cerr << TD::GetString(t2) << endl;
 }
 
+// restricting the envelope to an interval keeps exactly the segments of the
+// full envelope that are the maximum somewhere in it
+TEST_F(OptTest,TestRestrictedEnvelope) {
+  Hypergraph hg;
+  ReadFile rf("./test_data/1.json.gz");
+  HypergraphIO::ReadFromJSON(rf.stream(), &hg);
+  SparseVector<double> wts;
+  wts.set_value(FD::Convert("WordPenalty"), 4.25);
+  wts.set_value(FD::Convert("LanguageModel"), -1.1165);
+  wts.set_value(FD::Convert("PhraseModel_0"), -0.96);
+  wts.set_value(FD::Convert("PhraseModel_1"), -0.65);
+  wts.set_value(FD::Convert("PhraseModel_2"), -0.77);
+  SparseVector<double> axis;
+  axis.set_value(FD::Convert("LanguageModel"), 1.0);
+  axis.set_value(FD::Convert("PhraseModel_0"), -0.5);
+  MonotonicArena arena;
+  ArenaScope scope(&arena);
+  ViterbiEnvelopeWeightFunction wf(wts, axis);
+  const ViterbiEnvelope full = Inside<ViterbiEnvelope, ViterbiEnvelopeWeightFunction>(hg, NULL, wf);
+  const vector<Segment*>& fsegs = full.GetSortedSegs();
+  ASSERT_LT(4, fsegs.size());
+  wf.x_min = fsegs[1]->x + 0.01;
+  wf.x_max = fsegs[fsegs.size() - 2]->x;
+  const ViterbiEnvelope restricted = Inside<ViterbiEnvelope, ViterbiEnvelopeWeightFunction>(hg, NULL, wf);
+  const vector<Segment*>& rsegs = restricted.GetSortedSegs();
+  ASSERT_EQ(fsegs.size() - 3, rsegs.size());
+  EXPECT_EQ(kMinusInfinity, rsegs[0]->x);
+  for (int i = 0; i < rsegs.size(); ++i) {
+    const Segment& f = *fsegs[i + 1];
+    if (i) {
+      EXPECT_FLOAT_EQ(f.x, rsegs[i]->x);
+    }
+    EXPECT_FLOAT_EQ(f.m, rsegs[i]->m);
+    EXPECT_FLOAT_EQ(f.b, rsegs[i]->b);
+    vector<WordID> ft, rt;
+    f.ConstructTranslation(&ft);
+    rsegs[i]->ConstructTranslation(&rt);
+    EXPECT_EQ(TD::GetString(ft), TD::GetString(rt));
+  }
+
+  // the line search stays in the interval
+  vector<vector<WordID> > refs(1);
+  TD::ConvertSentence(ref12, &refs[0]);
+  ScorerP scorer = SentenceScorer::CreateSentenceScorer(IBM_BLEU, refs);
+  vector<ErrorSurface> es(1);
+  ComputeErrorSurface(*scorer, restricted, &es[0], IBM_BLEU, hg);
+  float score;
+  double x = LineOptimizer::LineOptimize(es, LineOptimizer::MAXIMIZE_SCORE, &score, 1.0/65536.0, wf.x_min, wf.x_max);
+  EXPECT_LE(wf.x_min, x);
+  EXPECT_GE(wf.x_max, x);
+}
+
+// the parallel merge and sweep find the same point and score as the serial one
+TEST_F(OptTest,TestParallelLineOptimize) {
+  Hypergraph hg;
+  ReadFile rf("./test_data/1.json.gz");
+  HypergraphIO::ReadFromJSON(rf.stream(), &hg);
+  vector<vector<WordID> > refs(2);
+  TD::ConvertSentence(ref12, &refs[0]);
+  TD::ConvertSentence(ref22, &refs[1]);
+  ScorerP scorer = SentenceScorer::CreateSentenceScorer(IBM_BLEU, refs);
+  vector<int> fids;
+  fids.push_back(FD::Convert("WordPenalty"));
+  fids.push_back(FD::Convert("LanguageModel"));
+  fids.push_back(FD::Convert("PhraseModel_0"));
+  fids.push_back(FD::Convert("PhraseModel_1"));
+  fids.push_back(FD::Convert("PhraseModel_2"));
+  SparseVector<double> wts;
+  for (int i = 0; i < fids.size(); ++i) wts.set_value(fids[i], -0.5);
+  RandomNumberGenerator<boost::mt19937> rng(15);
+  vector<SparseVector<double> > axes;
+  LineOptimizer::CreateOptimizationDirections(fids, 40, &rng, &axes);
+  // stand in for the surfaces of many sentences along one direction
+  vector<ErrorSurface> es(axes.size());
+  size_t segments = 0;
+  MonotonicArena arena;
+  for (int i = 0; i < axes.size(); ++i) {
+    ArenaScope scope(&arena);
+    ViterbiEnvelopeWeightFunction wf(wts, axes[i]);
+    const ViterbiEnvelope env = Inside<ViterbiEnvelope, ViterbiEnvelopeWeightFunction>(hg, NULL, wf);
+    ComputeErrorSurface(*scorer, env, &es[i], IBM_BLEU, hg);
+    segments += es[i].size();
+  }
+  // with copies, many segments have equal x's
+  for (int i = 0; segments < 4000; ++i) {  // enough for 4 threads to be used
+    es.push_back(es[i]);
+    segments += es[i].size();
+  }
+  float score1, score4;
+  const double x1 = LineOptimizer::LineOptimize(es, LineOptimizer::MAXIMIZE_SCORE, &score1);
+  const double x4 = LineOptimizer::LineOptimize(es, LineOptimizer::MAXIMIZE_SCORE, &score4,
+    1.0/65536.0, -numeric_limits<double>::infinity(), numeric_limits<double>::infinity(), 4);
+  EXPECT_EQ(score1, score4);
+  EXPECT_EQ(x1, x4);
+  const double r1 = LineOptimizer::LineOptimize(es, LineOptimizer::MINIMIZE_SCORE, &score1, 1.0/65536.0, -0.3, 0.2);
+  const double r4 = LineOptimizer::LineOptimize(es, LineOptimizer::MINIMIZE_SCORE, &score4, 1.0/65536.0, -0.3, 0.2, 4);
+  EXPECT_EQ(score1, score4);
+  EXPECT_EQ(r1, r4);
+}
+
 TEST_F(OptTest,TestZeroOrigin) {
   const string json = "{\"rules\":[1,\"[X7] ||| blA ||| without ||| LHSProb=3.92173 LexE2F=2.90799 LexF2E=1.85003 GenerativeProb=10.5381 RulePenalty=1 XFE=2.77259 XEF=0.441833 LabelledEF=2.63906 LabelledFE=4.96981 LogRuleCount=0.693147\",2,\"[X7] ||| blA ||| except ||| LHSProb=4.92173 LexE2F=3.90799 LexF2E=1.85003 GenerativeProb=11.5381 RulePenalty=1 XFE=2.77259 XEF=1.44183 LabelledEF=2.63906 LabelledFE=4.96981 LogRuleCount=1.69315\",3,\"[S] ||| [X7,1] ||| [1] ||| GlueTop=1\",4,\"[X28] ||| EnwAn ||| title ||| LHSProb=3.96802 LexE2F=2.22462 LexF2E=1.83258 GenerativeProb=10.0863 RulePenalty=1 XFE=0 XEF=1.20397 LabelledEF=1.20397 LabelledFE=-1.98341e-08 LogRuleCount=1.09861\",5,\"[X0] ||| EnwAn ||| funny ||| LHSProb=3.98479 LexE2F=1.79176 LexF2E=3.21888 GenerativeProb=11.1681 RulePenalty=1 XFE=0 XEF=2.30259 LabelledEF=2.30259 LabelledFE=0 LogRuleCount=0 SingletonRule=1\",6,\"[X8] ||| [X7,1] EnwAn ||| entitled [1] ||| LHSProb=3.82533 LexE2F=3.21888 LexF2E=2.52573 GenerativeProb=11.3276 RulePenalty=1 XFE=1.20397 XEF=1.20397 LabelledEF=2.30259 LabelledFE=2.30259 LogRuleCount=0 SingletonRule=1\",7,\"[S] ||| [S,1] [X28,2] ||| [1] [2] ||| Glue=1\",8,\"[S] ||| [S,1] [X0,2] ||| [1] [2] ||| Glue=1\",9,\"[S] ||| [X8,1] ||| [1] ||| GlueTop=1\",10,\"[Goal] ||| [S,1] ||| [1]\"],\"features\":[\"PassThrough\",\"Glue\",\"GlueTop\",\"LanguageModel\",\"WordPenalty\",\"LHSProb\",\"LexE2F\",\"LexF2E\",\"GenerativeProb\",\"RulePenalty\",\"XFE\",\"XEF\",\"LabelledEF\",\"LabelledFE\",\"LogRuleCount\",\"SingletonRule\"],\"edges\":[{\"tail\":[],\"spans\":[0,1,-1,-1],\"feats\":[5,3.92173,6,2.90799,7,1.85003,8,10.5381,9,1,10,2.77259,11,0.441833,12,2.63906,13,4.96981,14,0.693147],\"rule\":1},{\"tail\":[],\"spans\":[0,1,-1,-1],\"feats\":[5,4.92173,6,3.90799,7,1.85003,8,11.5381,9,1,10,2.77259,11,1.44183,12,2.63906,13,4.96981,14,1.69315],\"rule\":2}],\"node\":{\"in_edges\":[0,1],\"cat\":\"X7\"},\"edges\":[{\"tail\":[0],\"spans\":[0,1,-1,-1],\"feats\":[2,1],\"rule\":3}],\"node\":{\"in_edges\":[2],\"cat\":\"S\"},\"edges\":[{\"tail\":[],\"spans\":[1,2,-1,-1],\"feats\":[5,3.96802,6,2.22462,7,1.83258,8,10.0863,9,1,11,1.20397,12,1.20397,13,-1.98341e-08,14,1.09861],\"rule\":4}],\"node\":{\"in_edges\":[3],\"cat\":\"X28\"},\"edges\":[{\"tail\":[],\"spans\":[1,2,-1,-1],\"feats\":[5,3.98479,6,1.79176,7,3.21888,8,11.1681,9,1,11,2.30259,12,2.30259,15,1],\"rule\":5}],\"node\":{\"in_edges\":[4],\"cat\":\"X0\"},\"edges\":[{\"tail\":[0],\"spans\":[0,2,-1,-1],\"feats\":[5,3.82533,6,3.21888,7,2.52573,8,11.3276,9,1,10,1.20397,11,1.20397,12,2.30259,13,2.30259,15,1],\"rule\":6}],\"node\":{\"in_edges\":[5],\"cat\":\"X8\"},\"edges\":[{\"tail\":[1,2],\"spans\":[0,2,-1,-1],\"feats\":[1,1],\"rule\":7},{\"tail\":[1,3],\"spans\":[0,2,-1,-1],\"feats\":[1,1],\"rule\":8},{\"tail\":[4],\"spans\":[0,2,-1,-1],\"feats\":[2,1],\"rule\":9}],\"node\":{\"in_edges\":[6,7,8],\"cat\":\"S\"},\"edges\":[{\"tail\":[5],\"spans\":[0,2,-1,-1],\"feats\":[],\"rule\":10}],\"node\":{\"in_edges\":[9],\"cat\":\"Goal\"}}";
   Hypergraph hg;
@@ -214,6 +324,8 @@ TEST_F(OptTest,TestZeroOrigin) {
  
   SparseVector<double> axis; axis.set_value(FD::Convert("Glue"),1.0);
   ViterbiEnvelopeWeightFunction wf(wts, axis);  // wts = starting point, axis = search direction
+  MonotonicArena arena;
+  ArenaScope scope(&arena);
   vector<ViterbiEnvelope> envs(1);
   envs[0] = Inside<ViterbiEnvelope, ViterbiEnvelopeWeightFunction>(hg, NULL, wf);
 
@@ -1,7 +1,15 @@
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <stdint.h>
+#include <tr1/unordered_map>
 
+#include <boost/bind.hpp>
 #include <boost/program_options.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include "prob.h"
 #include "tdict.h"
@@ -20,6 +28,10 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
         ("loss_function,l",po::value<string>()->default_value("bleu"), "Loss function")
         ("input,i",po::value<string>()->default_value("-"), "File to read k-best lists from")
         ("output_list,L", "Show reranked list as output")
+        ("mbr_mode,m",po::value<string>()->default_value("exact"), "exact: expected loss from scoring every hypothesis against every other with the loss function (quadratic in k); linear: the linear BLEU gain of Tromble et al. (2008) with expected n-gram counts (linear in k)")
+        ("unigram_precision,p",po::value<double>()->default_value(0.85), "For linear MBR, the unigram precision the n-gram weights are derived from")
+        ("precision_ratio,R",po::value<double>()->default_value(0.72), "For linear MBR, the ratio of the precisions of successive n-gram orders")
+        ("threads,j",po::value<int>()->default_value(1), "For exact MBR, the number of threads to score the hypotheses with")
         ("help,h", "Help");
   po::options_description dcmdline_options;
   dcmdline_options.add(opts);
@@ -72,6 +84,157 @@ bool ReadKBestList(istream* in, string* sent_id, vector<pair<vector<WordID>, pro
   return !list->empty();
 }
 
+typedef vector<pair<vector<WordID>, prob_t> > KBestList;
+
+// for exact MBR: the expected loss of each hypothesis, added up in list
+// order as it always was, from the losses of each pair of distinct strings
+// of the list, which threads compute one reference string at a time.
+// Unless all losses are needed, a hypothesis stops being added up (and
+// losses computed for it) once it is worse than the best found so far; as
+// losses are not negative, that is never one of the best.
+class ExpectedLosses {
+ public:
+  ExpectedLosses(ScoreType type, const KBestList& list, const vector<prob_t>& joints, prob_t marginal) :
+      type_(type), list_(list), next_(0), best_(numeric_limits<double>::max()) {
+    map<vector<WordID>, int> ids;
+    for (int i = 0; i < list.size(); ++i) {
+      map<vector<WordID>, int>::iterator it = ids.insert(make_pair(list[i].first, int(distinct_.size()))).first;
+      if (it->second == distinct_.size()) {
+        distinct_.push_back(&list[i].first);
+        copies_.push_back(vector<int>());
+      }
+      uid_.push_back(it->second);
+      copies_[it->second].push_back(i);
+      posteriors_.push_back(joints[i] / marginal);
+    }
+  }
+
+  // all of *losses if all, otherwise the best ones (and more than those
+  // for the others)
+  void Run(int threads, bool all, vector<double>* losses) {
+    all_ = all;
+    losses_ = losses;
+    losses->resize(list_.size());
+    if (threads > 1) {
+      boost::thread_group workers;
+      for (int i = 0; i < threads; ++i)
+        workers.create_thread(boost::bind(&ExpectedLosses::RunThread, this));
+      workers.join_all();
+    } else {
+      RunThread();
+    }
+  }
+
+ private:
+  bool Next(int* u, double* best) {
+    boost::mutex::scoped_lock l(mutex_);
+    if (*best < best_) best_ = *best;
+    *best = best_;
+    if (next_ == distinct_.size()) return false;
+    *u = next_++;
+    return true;
+  }
+
+  double Loss(const Score& s) const {
+    double loss = 1.0 - s.ComputeScore();
+    if (type_ == TER || type_ == AER) loss = 1.0 - loss;
+    return loss;
+  }
+
+  void RunThread() {
+    int u;
+    double best = numeric_limits<double>::max();
+    while (Next(&u, &best)) {
+      vector<vector<WordID> > refs(1, *distinct_[u]);
+      ScorerP scorer = SentenceScorer::CreateSentenceScorer(type_, refs);
+      // the loss of each distinct string against this one, or -1 if not
+      // computed yet
+      vector<double> row(distinct_.size(), -1.0);
+      if (all_) {
+        vector<ScoreP> scores;
+        scorer->ScoreCandidates(distinct_, &scores);
+        for (int v = 0; v < scores.size(); ++v) row[v] = Loss(*scores[v]);
+      }
+      for (int c = 0; c < copies_[u].size(); ++c) {
+        const int i = copies_[u][c];
+        //cerr << i << ": " << list_[i].second <<"\t" << TD::GetString(list_[i].first) << endl;
+        double wl_acc = 0;
+        for (int j = 0; j < list_.size(); ++j) {
+          if (i != j) {
+            double& loss = row[uid_[j]];
+            if (loss < 0) loss = Loss(*scorer->ScoreCandidate(list_[j].first));
+            double weighted_loss = loss * posteriors_[j];
+            wl_acc += weighted_loss;
+            if ((!all_) && wl_acc > best) break;
+          }
+        }
+        (*losses_)[i] = wl_acc;
+        if (wl_acc < best) best = wl_acc;
+      }
+    }
+  }
+
+  const ScoreType type_;
+  const KBestList& list_;
+  vector<const vector<WordID>*> distinct_;  // the distinct strings of list_
+  vector<vector<int> > copies_;             // where each is in list_
+  vector<int> uid_;                         // which one each of list_ is
+  vector<prob_t> posteriors_;
+  int next_;
+  double best_;
+  bool all_;
+  vector<double>* losses_;
+  boost::mutex mutex_;
+};
+
+// for linear MBR: the linear BLEU gain of Tromble et al. (2008) of each
+// hypothesis e, -|e| + sum over the occurrences of n-grams w in e of
+// p(w) / (4 prec ratio^(|w| - 1)), where p(w) is the posterior probability
+// that a hypothesis contains w
+void LinearGains(const KBestList& list, const vector<prob_t>& joints, prob_t marginal,
+                 double prec, double ratio, vector<double>* gains) {
+  const int kORDER = 4;
+  double theta[kORDER];
+  for (int n = 0; n < kORDER; ++n)
+    theta[n] = 1.0 / (kORDER * prec * pow(ratio, n));
+  // the n-grams of the list as a trie: the one extending the n-gram
+  // numbered p (-1 for the empty one) by w is ids[(p + 1) << 32 | w]
+  tr1::unordered_map<uint64_t, int> ids;
+  vector<int> orders;
+  vector<vector<int> > occurrences(list.size());
+  for (int i = 0; i < list.size(); ++i) {
+    const vector<WordID>& e = list[i].first;
+    for (int j = 0; j < e.size(); ++j) {
+      int p = -1;
+      for (int n = 0; n < kORDER && j + n < e.size(); ++n) {
+        const uint64_t key = (static_cast<uint64_t>(p + 1) << 32) | static_cast<uint32_t>(e[j + n]);
+        pair<tr1::unordered_map<uint64_t, int>::iterator, bool> r = ids.insert(make_pair(key, int(orders.size())));
+        if (r.second) orders.push_back(n);
+        p = r.first->second;
+        occurrences[i].push_back(p);
+      }
+    }
+  }
+  vector<double> posteriors(orders.size(), 0.0);
+  for (int i = 0; i < list.size(); ++i) {
+    vector<int> distinct = occurrences[i];
+    sort(distinct.begin(), distinct.end());
+    distinct.erase(unique(distinct.begin(), distinct.end()), distinct.end());
+    const double p = (joints[i] / marginal).as_float();
+    for (int k = 0; k < distinct.size(); ++k)
+      posteriors[distinct[k]] += p;
+  }
+  gains->resize(list.size());
+  for (int i = 0; i < list.size(); ++i) {
+    double gain = -static_cast<double>(list[i].first.size());
+    for (int k = 0; k < occurrences[i].size(); ++k) {
+      const int w = occurrences[i][k];
+      gain += theta[orders[w]] * posteriors[w];
+    }
+    (*gains)[i] = gain;
+  }
+}
+
 int main(int argc, char** argv) {
   po::variables_map conf;
   InitCommandLine(argc, argv, &conf);
@@ -82,7 +245,20 @@ int main(int argc, char** argv) {
   cerr << "Posterior scaling factor (alpha) = " << mbr_scale << endl;
 
   ScoreType type = ScoreTypeFromString(metric);
-  vector<pair<vector<WordID>, prob_t> > list;
+  const string mode = conf["mbr_mode"].as<string>();
+  if (mode != "exact" && mode != "linear") {
+    cerr << "Unknown MBR mode: " << mode << endl;
+    return 1;
+  }
+  const bool linear = (mode == "linear");
+  const double prec = conf["unigram_precision"].as<double>();
+  const double ratio = conf["precision_ratio"].as<double>();
+  int threads = conf["threads"].as<int>();
+  if (type == METEOR && threads > 1) {
+    cerr << "METEOR scores are computed by a server, not using threads\n";
+    threads = 1;
+  }
+  KBestList list;
   ReadFile rf(file);
   string sent_id;
   while(ReadKBestList(rf.stream(), &sent_id, &list)) {
@@ -95,27 +271,19 @@ int main(int argc, char** argv) {
       // cerr << "list[" << i << "] joint=" << log(joint) << endl;
       marginal += joint;
     }
+    // the expected loss of each hypothesis (for linear MBR, minus its gain)
+    vector<double> mbr_scores;
+    if (linear) {
+      LinearGains(list, joints, marginal, prec, ratio, &mbr_scores);
+      for (int i = 0; i < mbr_scores.size(); ++i) mbr_scores[i] = -mbr_scores[i];
+    } else {
+      ExpectedLosses(type, list, joints, marginal).Run(threads, output_list, &mbr_scores);
+    }
     int mbr_idx = -1;
-    vector<double> mbr_scores(output_list ? list.size() : 0);
     double mbr_loss = numeric_limits<double>::max();
     for (int i = 0 ; i < list.size(); ++i) {
-      vector<vector<WordID> > refs(1, list[i].first);
-      //cerr << i << ": " << list[i].second <<"\t" << TD::GetString(list[i].first) << endl;
-      ScorerP scorer = SentenceScorer::CreateSentenceScorer(type, refs);
-      double wl_acc = 0;
-      for (int j = 0; j < list.size(); ++j) {
-        if (i != j) {
-          ScoreP s = scorer->ScoreCandidate(list[j].first);
-          double loss = 1.0 - s->ComputeScore();
-          if (type == TER || type == AER) loss = 1.0 - loss;
-          double weighted_loss = loss * (joints[j] / marginal);
-          wl_acc += weighted_loss;
-          if ((!output_list) && wl_acc > mbr_loss) break;
-        }
-      }
-      if (output_list) mbr_scores[i] = wl_acc;
-      if (wl_acc < mbr_loss) {
-        mbr_loss = wl_acc;
+      if (mbr_scores[i] < mbr_loss) {
+        mbr_loss = mbr_scores[i];
         mbr_idx = i;
       }
     }
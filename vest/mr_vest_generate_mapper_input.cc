@@ -3,8 +3,10 @@
 #include <vector>
 #include <sstream>
 
+#include <boost/bind.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
+#include <boost/thread/thread.hpp>
 
 #include "sampler.h"
 #include "filelib.h"
@@ -90,6 +92,8 @@ struct oracle_directions {
         print(cout,origin,"=",";");
         cout<<" ";
         print(cout,directions[j],"=",";");
+        if (line_search_max > 0)
+          cout << ' ' << line_search_min << ' ' << line_search_max;
         cout<<"\n";
       }
   }
@@ -110,6 +114,11 @@ struct oracle_directions {
       ("fear_to_hope,f",po::bool_switch(&fear_to_hope),"for each of the oracle_directions, also include a direction from fear to hope (as well as origin to hope)")
       ("no_old_to_hope","don't emit the usual old -> hope oracle")
       ("decoder_translations",po::value<string>(&decoder_translations_file)->default_value(""),"one per line decoder 1best translations for computing document BLEU vs. sentences-seen-so-far BLEU")
+      ("line_search_max",po::value<double>(&line_search_max)->default_value(0),"if > 0, only search for the best point between line_search_min and this along each direction; the mappers then drop the parts of the envelopes outside that interval")
+      ("line_search_min",po::value<double>(&line_search_min),"lower end of the line search interval (defaults to -line_search_max); pass negative values as --line_search_min=-x")
+      ("threads,j",po::value<unsigned>(&threads)->default_value(1),"load forests and compute oracles on this many threads.  the oracles of up to this many sentences at a time are found against the same pseudo-document score, so the directions change a little with the number of threads")
+      ("oracle_cache",po::value<string>(&oracle_cache_file)->default_value(""),"file keeping the oracles between iterations.  if it was written with weights within --oracle_cache_max_change of the current ones, the oracles in it are used instead of decoding those forests again; otherwise it is rewritten with the oracles found now")
+      ("oracle_cache_max_change",po::value<double>(&oracle_cache_max_change)->default_value(0.05),"largest relative change |w - w_cache| / |w_cache| of the weights at which --oracle_cache is used")
       ;
   }
   void InitCommandLine(int argc, char *argv[], po::variables_map *conf) {
@@ -172,6 +181,12 @@ struct oracle_directions {
     oracle.UseConf(conf);
     include_primary=!conf.count("no_primary");
     old_to_hope=!conf.count("no_old_to_hope");
+    if (!conf.count("line_search_min"))
+      line_search_min = -line_search_max;
+    if (line_search_max > 0 && !(line_search_min < line_search_max)) {
+      cerr << "--line_search_min must be less than --line_search_max\n";
+      exit(1);
+    }
 
     if (conf.count("optimize_feature") > 0)
       optimize_features=conf["optimize_feature"].as<vector<string> >();
@@ -179,14 +194,23 @@ struct oracle_directions {
   }
 
   string weights_file;
+  unsigned threads;
+  string oracle_cache_file;
+  double oracle_cache_max_change;
   double max_similarity;
+  double line_search_min, line_search_max;
   unsigned n_oracle, oracle_batch;
   string forest_repository;
   unsigned dev_set_size;
   vector<Oracle> oracles;
+  vector<double> src_lengths; // of the sentences with oracles, for the cache
+  vector<bool> cached; // oracles[i] was read from the cache
   vector<int> fids;
   string forest_file(unsigned i) const {
     ostringstream o;
+    o << forest_repository << '/' << i << ".hgb";
+    if (FileExists(o.str())) return o.str();
+    o.str("");
     o << forest_repository << '/' << i << ".json.gz";
     return o.str();
   }
@@ -230,6 +254,8 @@ struct oracle_directions {
     fids.clear();
     AddFeatureIds(features);
     oracles.resize(dev_set_size);
+    src_lengths.resize(dev_set_size);
+    cached.resize(dev_set_size);
   }
 
   Weights weights;
@@ -258,11 +284,10 @@ struct oracle_directions {
         if (verbose()) cerr<<"Before removing i="<<i<<" "<<ds().ScoreDetails()<<"\n";
         adjust_doc(i,-1);
       }
-      ReadFile rf(forest_file(i));
       Hypergraph hg;
       {
-        Timer t("Loading forest from JSON "+forest_file(i));
-        HypergraphIO::ReadFromJSON(rf.stream(), &hg);
+        Timer t("Loading forest "+forest_file(i));
+        HypergraphIO::ReadFromFile(forest_file(i), &hg);
       }
       if (verbose()) cerr<<"Before oracle["<<i<<"]: "<<ds().ScoreDetails()<<endl;
       o=oracle.ComputeOracle(oracle.MakeMetadata(hg,i),&hg,origin);
@@ -278,6 +303,7 @@ struct oracle_directions {
         if (have_doc)
           cerr<<" doc (should = model): "<<model_scores[i]->ScoreDetails()<<endl;
       }
+      src_lengths[i]=oracle.tmp_src_length;
       if (have_doc) {
         adjust_doc(i,1);
       } else
@@ -286,15 +312,174 @@ struct oracle_directions {
     return o;
   }
 
+  // the pseudo-document score after sentence i as if its oracle had been
+  // computed now, for oracles computed elsewhere (by a thread, or in an
+  // earlier iteration).  with decoder translations the document doesn't
+  // change.
+  void IncludeOracle(unsigned i,ScoreP const& model_score) {
+    if (have_doc) return;
+    oracle.sentscore=model_score;
+    oracle.tmp_src_length=src_lengths[i];
+    oracle.IncludeLastScore();
+  }
+
+  // one thread's sentence: its own BLEUModel (which keeps buffers) and copy
+  // of the pseudo-document score
+  struct OracleJob {
+    OracleBleu bleu;
+    unsigned sent;
+    Oracle result;
+    ScoreP model_score;
+    double src_length;
+  };
+  void RunJob(OracleJob *job) {
+    Hypergraph hg;
+    HypergraphIO::ReadFromFile(forest_file(job->sent), &hg);
+    job->result=job->bleu.ComputeOracle(job->bleu.MakeMetadata(hg,job->sent),&hg,origin);
+    job->model_score=job->bleu.sentscore;
+    job->src_length=job->bleu.tmp_src_length;
+  }
+
+  // the oracles of sents, in this order, threads at a time.  those from the
+  // cache are only added to the pseudo-document
+  void ComputeOracles(vector<unsigned> const& sents) {
+    vector<OracleJob> jobs(max(threads,1u));
+    for (unsigned t=0;t<jobs.size() && threads>1;++t) {
+      jobs[t].bleu=oracle;
+      jobs[t].bleu.init_loss();
+    }
+    vector<bool> seen(dev_set_size,false);
+    vector<unsigned> group;
+    for (unsigned k=0;k<=sents.size();++k) {
+      const bool end=(k==sents.size());
+      if (!end) {
+        const unsigned i=sents[k];
+        if (seen[i]) continue;
+        seen[i]=true;
+        if (!cached[i]) {
+          if (threads<=1) ComputeOracle(i);
+          else group.push_back(i);
+        }
+      }
+      if (group.size()==threads || (!group.empty() && (end || cached[sents[k]])))
+        RunGroup(group,jobs);
+      if (!end && cached[sents[k]])
+        IncludeOracle(sents[k],oracle.GetScore(oracles[sents[k]].model.sentence,sents[k]));
+    }
+  }
+
+  // the oracles of group at once, against the pseudo-document as it is
+  void RunGroup(vector<unsigned> &group,vector<OracleJob> &jobs) {
+    boost::thread_group running;
+    for (unsigned t=0;t<group.size();++t) {
+      OracleJob &job=jobs[t];
+      job.sent=group[t];
+      job.bleu.doc_score=ds().Clone();
+      if (have_doc) job.bleu.doc_score->PlusEquals(*model_scores[job.sent],-1);
+      job.bleu.doc_src_length=oracle.doc_src_length;
+      running.create_thread(boost::bind(&oracle_directions::RunJob,this,&job));
+    }
+    running.join_all();
+    for (unsigned t=0;t<group.size();++t) {
+      OracleJob &job=jobs[t];
+      oracles[job.sent]=job.result;
+      src_lengths[job.sent]=job.src_length;
+      if (verbose()) cerr<<"oracle["<<job.sent<<"]:\n"<<job.result;
+      IncludeOracle(job.sent,job.model_score);
+    }
+    group.clear();
+  }
+
+  // the oracles in oracle_cache_file, if its weights are close enough to
+  // origin.  true if they were used
+  bool ReadOracleCache() {
+    if (oracle_cache_file.empty() || !FileExists(oracle_cache_file)) return false;
+    ReadFile in(oracle_cache_file);
+    string line;
+    double obj;
+    Point cache_weights;
+    if (!getline(*in,line) || line.compare(0,8,"weights ") ||
+        !B64::Decode(&obj,&cache_weights,line.c_str()+8,line.size()-8)) {
+      cerr<<"Ignoring malformed oracle cache "<<oracle_cache_file<<endl;
+      return false;
+    }
+    const double change=(origin-cache_weights).l2norm()/max(cache_weights.l2norm(),1e-10);
+    if (change>oracle_cache_max_change) {
+      cerr<<"Weights changed by "<<change<<" since the oracle cache; computing the oracles again"<<endl;
+      return false;
+    }
+    unsigned n=0;
+    while (getline(*in,line)) {
+      istringstream fields(line);
+      unsigned i;
+      double src_length;
+      string feats[3];
+      fields>>i>>src_length>>feats[0]>>feats[1]>>feats[2];
+      const size_t bar=line.find(" ||| ");
+      if (!fields || i>=dev_set_size || bar==string::npos) {
+        cerr<<"Ignoring malformed oracle cache "<<oracle_cache_file<<endl;
+        return false;
+      }
+      Translation *t[3]={&oracles[i].hope,&oracles[i].model,&oracles[i].fear};
+      size_t from=bar+5;
+      for (unsigned k=0;k<3;++k) {
+        size_t to=line.find(" ||| ",from);
+        if (to==string::npos) to=line.size();
+        TD::ConvertSentence(line.substr(from,to-from),&t[k]->sentence);
+        from=to+5;
+        B64::Decode(&obj,&t[k]->features,feats[k].c_str(),feats[k].size());
+      }
+      src_lengths[i]=src_length;
+      cached[i]=true;
+      ++n;
+    }
+    cerr<<"Using "<<n<<" oracles from "<<oracle_cache_file<<" (weights changed by "<<change<<")"<<endl;
+    return true;
+  }
+
+  void WriteOracleCache() {
+    WriteFile out(oracle_cache_file);
+    *out<<"weights ";
+    B64::Encode(0,origin,out.stream());
+    *out<<'\n';
+    for (unsigned i=0;i<dev_set_size;++i) {
+      Oracle &o=oracles[i];
+      if (o.is_null()) continue;
+      *out<<i<<' '<<src_lengths[i];
+      Translation const* t[3]={&o.hope,&o.model,&o.fear};
+      for (unsigned k=0;k<3;++k) {
+        // feature 0 (the loss) has no name to write it under; the
+        // directions ignore it
+        FeatureVector features=t[k]->features;
+        features.erase(0);
+        *out<<' ';
+        B64::Encode(0,features,out.stream());
+      }
+      for (unsigned k=0;k<3;++k)
+        *out<<" ||| "<<TD::GetString(t[k]->sentence);
+      *out<<'\n';
+    }
+  }
+
   // if start_random is true, immediately sample w/ replacement from src sentences; otherwise, consume them sequentially until exhausted, then random.  oracle vectors are summed
   void AddOracleDirections() {
+    if (!n_oracle) return;
+    // which sentences, in order, doesn't depend on the oracles, so they can
+    // be computed first and in parallel
     MT19937::IntRNG rsg=rng.inclusive(0,dev_set_size-1);
+    vector<unsigned> sents;
+    for (unsigned b=0;b<n_oracle*oracle_batch;++b)
+      sents.push_back((start_random||b>=dev_set_size) ? rsg() : b);
+    const bool from_cache=ReadOracleCache();
+    ComputeOracles(sents);
+    if (!oracle_cache_file.empty() && !from_cache)
+      WriteOracleCache();
     unsigned b=0;
     for(unsigned i=0;i<n_oracle;++i) {
       Dir o2hope;
       Dir fear2hope;
       for (unsigned j=0;j<oracle_batch;++j,++b) {
-        Oracle const& o=ComputeOracle((start_random||b>=dev_set_size) ? rsg() : b);
+        Oracle const& o=oracles[sents[b]];
 
         if (old_to_hope)
           o2hope+=o.ModelHopeGradient();
@@ -1,8 +1,12 @@
+#include <cstdlib>
 #include <sstream>
 #include <iostream>
 #include <fstream>
 #include <vector>
 
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
 
@@ -11,6 +15,7 @@
 #include "stringlib.h"
 #include "sparse_vector.h"
 #include "scorer.h"
+#include "arena.h"
 #include "viterbi_envelope.h"
 #include "inside_outside.h"
 #include "error_surface.h"
@@ -27,6 +32,7 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
         ("source,s",po::value<string>(), "Source file (ignored, except for AER)")
         ("loss_function,l",po::value<string>()->default_value("ibm_bleu"), "Loss function being optimized")
         ("input,i",po::value<string>()->default_value("-"), "Input file to map (- is STDIN)")
+        ("threads,j",po::value<int>()->default_value(1), "Compute the envelopes for the directions of a forest on this many threads")
         ("help,h", "Help");
   po::options_description dcmdline_options;
   dcmdline_options.add(opts);
@@ -64,6 +70,91 @@ bool ReadSparseVectorString(const string& s, SparseVector<double>* v) {
 #endif
 }
 
+// one line of mapper input: a search direction through the forest
+struct MapJob {
+  string s_origin, s_axis;   // as read, they are copied to the output
+  string s_interval;         // "x_min x_max", or empty if unrestricted
+  SparseVector<double> origin, axis;
+  double x_min, x_max;
+  string result;             // serialized ErrorSurface
+};
+
+// computes the error surfaces of all directions read for one forest.  The
+// envelopes are computed concurrently; scoring takes a lock since the
+// sentence scorers keep internal state (e.g. BLEU's n-gram counts).
+struct ForestMapper {
+  ForestMapper(const Hypergraph& hg, const PackedEdgeFeatures& packed, const SentenceScorer& ss,
+               ScoreType type, vector<MapJob>* jobs) :
+    hg_(hg), packed_(packed), ss_(ss), type_(type), jobs_(*jobs), next_(0) {}
+
+  void Run() {
+    MonotonicArena arena;  // segments of the envelopes, reused for each job
+    size_t i;
+    while (NextJob(&i)) Map(&jobs_[i], &arena);
+  }
+
+  void Map(MapJob* job, MonotonicArena* arena) {
+    ViterbiEnvelopeWeightFunction wf(job->origin, job->axis, &packed_);
+    wf.x_min = job->x_min;
+    wf.x_max = job->x_max;
+    ErrorSurface es;
+    {
+      ArenaScope scope(arena);
+      ViterbiEnvelope ve = Inside<ViterbiEnvelope, ViterbiEnvelopeWeightFunction>(hg_, NULL, wf);
+      boost::mutex::scoped_lock l(score_mutex_);
+      ComputeErrorSurface(ss_, ve, &es, type_, hg_);
+    }
+    //cerr << "Viterbi envelope has " << ve.size() << " segments\n";
+    // cerr << "Error surface has " << es.size() << " segments\n";
+    es.Serialize(&job->result);
+  }
+
+ private:
+  bool NextJob(size_t* i) {
+    boost::mutex::scoped_lock l(next_mutex_);
+    if (next_ == jobs_.size()) return false;
+    *i = next_++;
+    return true;
+  }
+
+  const Hypergraph& hg_;
+  const PackedEdgeFeatures& packed_;
+  const SentenceScorer& ss_;
+  const ScoreType type_;
+  vector<MapJob>& jobs_;
+  size_t next_;
+  boost::mutex next_mutex_;
+  boost::mutex score_mutex_;
+};
+
+void MapForest(const string& file, const SentenceScorer& ss, ScoreType type, int threads,
+               vector<MapJob>* jobs) {
+  Hypergraph hg;
+  HypergraphIO::ReadFromFile(file, &hg);
+  PackedEdgeFeatures packed;
+  packed.Init(hg);
+  ForestMapper mapper(hg, packed, ss, type, jobs);
+  threads = min<int>(threads, jobs->size());
+  if (threads > 1) {
+    boost::thread_group workers;
+    for (int i = 0; i < threads; ++i)
+      workers.create_thread(boost::bind(&ForestMapper::Run, &mapper));
+    workers.join_all();
+  } else {
+    mapper.Run();
+  }
+  for (int i = 0; i < jobs->size(); ++i) {
+    const MapJob& job = (*jobs)[i];
+    cout << 'M' << ' ' << job.s_origin << ' ' << job.s_axis;
+    // the reducer needs the interval too, so it is part of the key
+    if (!job.s_interval.empty()) cout << ' ' << job.s_interval;
+    cout << '\t';
+    B64::b64encode(job.result.c_str(), job.result.size(), &cout);
+    cout << endl;
+  }
+  cout << flush;
+}
+
 int main(int argc, char** argv) {
   po::variables_map conf;
   InitCommandLine(argc, argv, &conf);
@@ -71,8 +162,12 @@ int main(int argc, char** argv) {
   ScoreType type = ScoreTypeFromString(loss_function);
   DocScorer ds(type, conf["reference"].as<vector<string> >(), conf["source"].as<string>());
   cerr << "Loaded " << ds.size() << " references for scoring with " << loss_function << endl;
-  Hypergraph hg;
+  const int threads = max(1, conf["threads"].as<int>());
+  // consecutive lines for the same forest are mapped together, so each
+  // forest is read once however many directions are searched through it
+  vector<MapJob> jobs;
   string last_file;
+  int last_sent_id = -1;
   ReadFile in_read(conf["input"].as<string>());
   istream &in=*in_read.stream();
   while(in) {
@@ -81,30 +176,30 @@ int main(int argc, char** argv) {
     if (line.empty()) continue;
     istringstream is(line);
     int sent_id;
-    string file, s_origin, s_axis;
-    // path-to-file (JSON) sent_ed starting-point search-direction
-    is >> file >> sent_id >> s_origin >> s_axis;
-    SparseVector<double> origin;
-    assert(ReadSparseVectorString(s_origin, &origin));
-    SparseVector<double> axis;
-    assert(ReadSparseVectorString(s_axis, &axis));
-    // cerr << "File: " << file << "\nAxis: " << axis << "\n   X: " << origin << endl;
-    if (last_file != file) {
+    string file;
+    MapJob job;
+    // path-to-file (JSON or binary) sent_ed starting-point search-direction
+    // [x-min x-max]
+    is >> file >> sent_id >> job.s_origin >> job.s_axis;
+    string s_min, s_max;
+    job.x_min = kMinusInfinity;
+    job.x_max = kPlusInfinity;
+    if (is >> s_min >> s_max) {
+      job.x_min = strtod(s_min.c_str(), NULL);
+      job.x_max = strtod(s_max.c_str(), NULL);
+      job.s_interval = s_min + ' ' + s_max;
+    }
+    assert(ReadSparseVectorString(job.s_origin, &job.origin));
+    assert(ReadSparseVectorString(job.s_axis, &job.axis));
+    // cerr << "File: " << file << "\nAxis: " << job.axis << "\n   X: " << job.origin << endl;
+    if (file != last_file || sent_id != last_sent_id) {
+      if (!jobs.empty()) MapForest(last_file, *ds[last_sent_id], type, threads, &jobs);
+      jobs.clear();
       last_file = file;
-      ReadFile rf(file);
-      HypergraphIO::ReadFromJSON(rf.stream(), &hg);
+      last_sent_id = sent_id;
     }
-    ViterbiEnvelopeWeightFunction wf(origin, axis);
-    ViterbiEnvelope ve = Inside<ViterbiEnvelope, ViterbiEnvelopeWeightFunction>(hg, NULL, wf);
-    ErrorSurface es;
-    ComputeErrorSurface(*ds[sent_id], ve, &es, type, hg);
-    //cerr << "Viterbi envelope has " << ve.size() << " segments\n";
-    // cerr << "Error surface has " << es.size() << " segments\n";
-    string val;
-    es.Serialize(&val);
-    cout << 'M' << ' ' << s_origin << ' ' << s_axis << '\t';
-    B64::b64encode(val.c_str(), val.size(), &cout);
-    cout << endl << flush;
+    jobs.push_back(job);
   }
+  if (!jobs.empty()) MapForest(last_file, *ds[last_sent_id], type, threads, &jobs);
   return 0;
 }
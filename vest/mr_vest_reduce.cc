@@ -1,3 +1,5 @@
+#include <cstdlib>
+#include <limits>
 #include <sstream>
 #include <iostream>
 #include <fstream>
@@ -18,6 +20,7 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   po::options_description opts("Configuration options");
   opts.add_options()
         ("loss_function,l",po::value<string>(), "Loss function being optimized")
+        ("threads,j",po::value<int>()->default_value(1), "Merge the error surfaces of each direction and search them on this many threads")
         ("help,h", "Help");
   po::options_description dcmdline_options;
   dcmdline_options.add(opts);
@@ -29,6 +32,22 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   }
 }
 
+// the key is "origin axis [x-min x-max]" (see mr_vest_map), the line search
+// stays in the interval if there is one
+double Optimize(const string& key, const vector<ErrorSurface>& esv,
+                LineOptimizer::ScoreType opt_type, int threads, float* score) {
+  istringstream is(key);
+  string origin, axis, s_min, s_max;
+  is >> origin >> axis;
+  double x_min = -numeric_limits<double>::infinity();
+  double x_max = numeric_limits<double>::infinity();
+  if (is >> s_min >> s_max) {
+    x_min = strtod(s_min.c_str(), NULL);
+    x_max = strtod(s_max.c_str(), NULL);
+  }
+  return LineOptimizer::LineOptimize(esv, opt_type, score, 1.0/65536.0, x_min, x_max, threads);
+}
+
 int main(int argc, char** argv) {
   po::variables_map conf;
   InitCommandLine(argc, argv, &conf);
@@ -38,6 +57,11 @@ int main(int argc, char** argv) {
   if (type == TER || type == AER) {
     opt_type = LineOptimizer::MINIMIZE_SCORE;
   }
+  int threads = conf["threads"].as<int>();
+  if (type == METEOR && threads > 1) {
+    cerr << "METEOR scores are computed by a server, not using threads\n";
+    threads = 1;
+  }
   string last_key;
   vector<ErrorSurface> esv;
   while(cin) {
@@ -52,7 +76,7 @@ int main(int argc, char** argv) {
     if (key != last_key) {
       if (!last_key.empty()) {
 	float score;
-        double x = LineOptimizer::LineOptimize(esv, opt_type, &score);
+        double x = Optimize(last_key, esv, opt_type, threads, &score);
 	cout << last_key << "|" << x << "|" << score << endl;
       }
       last_key = key;
@@ -74,7 +98,7 @@ int main(int argc, char** argv) {
     // cerr << "ESV=" << esv.size() << endl;
     // for (int i = 0; i < esv.size(); ++i) { cerr << esv[i].size() << endl; }
     float score;
-    double x = LineOptimizer::LineOptimize(esv, opt_type, &score);
+    double x = Optimize(last_key, esv, opt_type, threads, &score);
     cout << last_key << "|" << x << "|" << score << endl;
   }
   return 0;
@@ -37,6 +37,8 @@ require "libcall.pl";
 my $tailn=5; # +0 = concatenate all the client logs.  5 = last 5 lines
 my $recycle_clients;    # spawn new clients when previous ones terminate
 my $stay_alive;      # dont let server die when having zero clients
+my $longest_first;   # hand out the longest lines (up to the next ===SYNCH===) first
+my $speculate;       # rerun stragglers on idle clients once the input is exhausted
 my $joblist = "";
 my $errordir="";
 my $multiline;
@@ -125,6 +127,8 @@ my @pids;
 # Process command-line options
 unless (GetOptions(
       "stay-alive" => \$stay_alive,
+      "longest-first" => \$longest_first,
+      "speculate" => \$speculate,
       "recycle-clients" => \$recycle_clients,
       "error-dir=s" => \$errordir,
       "multi-line" => \$multiline,
@@ -235,6 +239,9 @@ my $multiflag = "";
 if ($multiline){ $multiflag = "-m"; print STDERR "expecting multiline output.\n"; }
 my $stay_alive_flag = "";
 if ($stay_alive){ $stay_alive_flag = "--stay-alive"; print STDERR "staying alive while no clients are connected.\n"; }
+my $schedule_flags = "";
+if ($longest_first){ $schedule_flags .= " -l"; print STDERR "handing out the longest lines first.\n"; }
+if ($speculate){ $schedule_flags .= " -s"; print STDERR "rerunning stragglers on idle clients.\n"; }
 
 my $node_count = 0;
 my $script = "";
@@ -274,7 +281,7 @@ $cdcmd$sentclient $host:$port:$key $cmd
   cleanup();
 } else {
 #  my $todo = "$sentserver -k $key $multiflag $port ";
-  my $todo = "$sentserver -k $key $multiflag $port $stay_alive_flag ";
+  my $todo = "$sentserver -k $key $multiflag $port $stay_alive_flag$schedule_flags ";
   if ($verbose){ print STDERR "Running: $todo\n"; }
   check_call($todo);
 }
@@ -407,6 +414,16 @@ options:
   -v, --verbose
     Print diagnostic informatoin on stderr.
 
+  --longest-first
+    Read the input up to the next ===SYNCH=== line (or the end)
+    and hand out the longest lines first, so a long sentence
+    does not start last.  Output is still in input order.
+
+  --speculate
+    Once all input has been handed out, give idle clients a
+    copy of the first unfinished line, and use whichever copy
+    finishes first.
+
   -j, --jobs
     Number of jobs to use.
 
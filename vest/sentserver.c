@@ -26,6 +26,8 @@ struct line {
   int id;
   char *s;
   int status;
+  int running;   /* clients working on it; more than one when speculating */
+  int flushed;   /* written out and off the queue, but still running */
   struct line *next;
 } *head, **ptail;
 
@@ -34,6 +36,7 @@ int n_sent = 0, n_received=0, n_flushed=0;
 #define STATUS_RUNNING 0
 #define STATUS_ABORTED 1
 #define STATUS_FINISHED 2
+#define STATUS_WAITING 3   /* read, not yet handed to a client */
 
 pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -44,97 +47,135 @@ int s;
 int expect_multiline_output = 0;
 int log_mutex = 0;
 int stay_alive = 0;		/* dont panic and die with zero clients */
+int longest_first = 0;		/* read ahead to the next ===SYNCH=== and hand out long lines first */
+int speculate = 0;		/* give idle clients copies of running lines once the input is exhausted */
+int input_eof = 0;
 
 void queue_finish(struct line *node, char *s, int fid);
 char * read_line(int fd, int multiline);
 void done (int code);
 
-struct line * queue_get(int fid) {
-	struct line *cur;
-	char *s, *synch;
-
-	if (log_mutex) fprintf(stderr, "Getting for data for fid %d\n", fid);
-	if (log_mutex) fprintf(stderr, "Locking queue mutex (%d)\n", fid);
-	pthread_mutex_lock(&queue_mutex);
-
-	/* First, check for aborted sentences. */
-
-	if (log_mutex) fprintf(stderr, "  Checking queue for aborted jobs (fid %d)\n", fid);
-	for (cur = head; cur != NULL; cur = cur->next) {
-		if (cur->status == STATUS_ABORTED) {
-			cur->status = STATUS_RUNNING;
-
-			if (log_mutex) fprintf(stderr, "Unlocking queue mutex (%d)\n", fid);
-			pthread_mutex_unlock(&queue_mutex);
+/* The next line for a client, with the queue locked: an aborted line, else a
+   waiting one -- the first or, with -l, the longest.  NULL if there is none. */
+struct line * queue_next() {
+	struct line *cur, *best = NULL;
 
+	for (cur = head; cur != NULL; cur = cur->next)
+		if (cur->status == STATUS_ABORTED)
 			return cur;
-		}
+	for (cur = head; cur != NULL; cur = cur->next) {
+		if (cur->status != STATUS_WAITING) continue;
+		if (!longest_first) return cur;
+		if (best == NULL || strlen(cur->s) > strlen(best->s)) best = cur;
 	}
-	if (log_mutex) fprintf(stderr, "Unlocking queue mutex (%d)\n", fid);
-	pthread_mutex_unlock(&queue_mutex);
-
-	/* Otherwise, read a new one. */
-	if (log_mutex) fprintf(stderr, "Locking input mutex (%d)\n", fid);
-	if (log_mutex) fprintf(stderr, "  Reading input for new data (fid %d)\n", fid);
-	pthread_mutex_lock(&input_mutex);
-	s = read_line(0,0);
-
-	while (s) {
-		if (log_mutex) fprintf(stderr, "Locking queue mutex (%d)\n", fid);
-		pthread_mutex_lock(&queue_mutex);
-		if (log_mutex) fprintf(stderr, "Unlocking input mutex (%d)\n", fid);
-		pthread_mutex_unlock(&input_mutex);
+	return best;
+}
 
-		cur = malloc(sizeof (struct line));
-		cur->id = n_sent;
-		cur->s = s;
-		cur->next = NULL;
+/* With -s, a second copy of the first line that is running on only one
+   client.  Output is written in order, so that is the line holding up the
+   most finished ones; whichever copy finishes first is used. */
+struct line * queue_speculate() {
+	struct line *cur;
 
-		*ptail = cur;
-		ptail = &cur->next;
+	for (cur = head; cur != NULL; cur = cur->next)
+		if (cur->status == STATUS_RUNNING && cur->running == 1)
+			return cur;
+	return NULL;
+}
 
-		n_sent++;
+struct line * queue_append(char *s) {
+	struct line *cur = malloc(sizeof (struct line));
+	cur->id = n_sent;
+	cur->s = s;
+	cur->status = STATUS_WAITING;
+	cur->running = 0;
+	cur->flushed = 0;
+	cur->next = NULL;
 
-		if (strcmp(s,"===SYNCH===\n")==0){
-			fprintf(stderr, "Received ===SYNCH=== signal (fid %d)\n", fid);
-			// Note: queue_finish calls free(cur->s).
-			// Therefore we need to create a new string here.
-			synch = malloc((strlen("===SYNCH===\n")+2) * sizeof (char));
-			synch = strcpy(synch, s);
+	*ptail = cur;
+	ptail = &cur->next;
 
-			if (log_mutex) fprintf(stderr, "Unlocking queue mutex (%d)\n", fid);
-			pthread_mutex_unlock(&queue_mutex);
-			queue_finish(cur, synch, fid); /* handles its own lock */
+	n_sent++;
+	return cur;
+}
 
-			if (log_mutex) fprintf(stderr, "Locking input mutex (%d)\n", fid);
-			if (log_mutex) fprintf(stderr, "  Reading input for new data (fid %d)\n", fid);
-			pthread_mutex_lock(&input_mutex);
+struct line * queue_get(int fid) {
+	struct line *cur;
+	char *s;
+	int synch = 0;
 
-			s = read_line(0,0);
-		} else {
-			if (log_mutex) fprintf(stderr, "  Received new data %d (fid %d)\n", cur->id, fid);
+	if (log_mutex) fprintf(stderr, "Getting for data for fid %d\n", fid);
+	for (;;) {
+		if (log_mutex) fprintf(stderr, "Locking queue mutex (%d)\n", fid);
+		pthread_mutex_lock(&queue_mutex);
+		cur = queue_next();
+		if (cur) {
+			if (log_mutex) fprintf(stderr, "  Handing out data %d (fid %d)\n", cur->id, fid);
 			cur->status = STATUS_RUNNING;
+			cur->running = 1;
 			if (log_mutex) fprintf(stderr, "Unlocking queue mutex (%d)\n", fid);
 			pthread_mutex_unlock(&queue_mutex);
 			return cur;
 		}
-	}
+		if (log_mutex) fprintf(stderr, "Unlocking queue mutex (%d)\n", fid);
+		pthread_mutex_unlock(&queue_mutex);
 
-	if (log_mutex) fprintf(stderr, "Unlocking input mutex (%d)\n", fid);
-	pthread_mutex_unlock(&input_mutex);
-	/* Only way to reach this point: no more output */
+		/* Otherwise, read new input: a line, or with -l every line up to
+		   the next ===SYNCH=== */
+		if (log_mutex) fprintf(stderr, "Locking input mutex (%d)\n", fid);
+		pthread_mutex_lock(&input_mutex);
+		pthread_mutex_lock(&queue_mutex);
+		cur = queue_next();  /* read by the client that held the input */
+		pthread_mutex_unlock(&queue_mutex);
+		if (cur) {
+			pthread_mutex_unlock(&input_mutex);
+			continue;
+		}
+		if (log_mutex) fprintf(stderr, "  Reading input for new data (fid %d)\n", fid);
+		do {
+			s = input_eof ? NULL : read_line(0,0);
+			if (s == NULL) {
+				input_eof = 1;
+				break;
+			}
+			synch = strcmp(s,"===SYNCH===\n")==0;
+			pthread_mutex_lock(&queue_mutex);
+			cur = queue_append(s);
+			if (synch) cur->running = 1;
+			pthread_mutex_unlock(&queue_mutex);
+			if (synch) {
+				fprintf(stderr, "Received ===SYNCH=== signal (fid %d)\n", fid);
+				// Note: queue_finish calls free(cur->s).
+				// Therefore we need to create a new string here.
+				queue_finish(cur, strdup(s), fid); /* handles its own lock */
+			}
+		} while (longest_first ? !synch : synch);
+		if (log_mutex) fprintf(stderr, "Unlocking input mutex (%d)\n", fid);
+		pthread_mutex_unlock(&input_mutex);
+		if (s == NULL) break;
+	}
 
+	/* Only way to reach this point: no more input */
 	if (log_mutex) fprintf(stderr, "Locking queue mutex (%d)\n", fid);
 	pthread_mutex_lock(&queue_mutex);
-	if (head == NULL) {
+	cur = queue_next();  /* read by another client while we waited */
+	if (cur) {
+		cur->status = STATUS_RUNNING;
+		cur->running = 1;
+	} else if (head == NULL) {
 		fprintf(stderr, "Reached end of file. Exiting.\n");
 		done(0);
-	} else
+	} else {
 		ptail = NULL; /* This serves as a signal that there is no more input */
+		if (speculate && (cur = queue_speculate()) != NULL) {
+			fprintf(stderr, "Speculatively rerunning data %d (fid %d)\n", cur->id, fid);
+			cur->running++;
+		}
+	}
 	if (log_mutex) fprintf(stderr, "Unlocking queue mutex (%d)\n", fid);
 	pthread_mutex_unlock(&queue_mutex);
 
-	return NULL;
+	return cur;
 }
 
 void queue_panic() {
@@ -166,7 +207,12 @@ void queue_panic() {
 void queue_abort(struct line *node, int fid) {
 	if (log_mutex) fprintf(stderr, "Locking queue mutex (%d)\n", fid);
 	pthread_mutex_lock(&queue_mutex);
-	node->status = STATUS_ABORTED;
+	node->running--;
+	if (node->flushed) {
+		if (node->running == 0) free(node);
+	} else if (node->status == STATUS_RUNNING && node->running == 0) {
+		node->status = STATUS_ABORTED;
+	}
 	if (n_clients == 0) {
 		if (stay_alive) {
 			fprintf(stderr, "Warning! No live clients detected! Staying alive, will retry soon.\n");
@@ -204,6 +250,15 @@ void queue_finish(struct line *node, char *s, int fid) {
   if (log_mutex) fprintf(stderr, "Locking queue mutex (%d)\n", fid);
   pthread_mutex_lock(&queue_mutex);
 
+  node->running--;
+  if (node->status == STATUS_FINISHED) {
+    /* the other copy of a speculatively rerun line finished first */
+    free(s);
+    if (node->flushed && node->running == 0) free(node);
+    if (log_mutex) fprintf(stderr, "Unlocking queue mutex (%d)\n", fid);
+    pthread_mutex_unlock(&queue_mutex);
+    return;
+  }
   free(node->s);
   node->s = s;
   node->status = STATUS_FINISHED;
@@ -218,9 +273,13 @@ void queue_finish(struct line *node, char *s, int fid) {
     fflush(stdout);
     if (log_mutex) fprintf(stderr, "  Flushed node %d\n", head->id);
     free(head->s);
+    head->s = NULL;
 
     next = head->next;
-    free(head);
+    if (head->running == 0)
+      free(head);
+    else
+      head->flushed = 1; /* freed when its last copy finishes or dies */
 
     head = next;
 
@@ -428,6 +487,10 @@ int main (int argc, char *argv[]) {
       use_key = 1;
     } else if (strcmp(argv[argi], "--stay-alive")==0){
       stay_alive = 1;    /* dont panic and die with zero clients */
+    } else if (strcmp(argv[argi], "-l")==0){
+      longest_first = 1;
+    } else if (strcmp(argv[argi], "-s")==0){
+      speculate = 1;
     } else {
       port = atoi(argv[argi]);
     }
@@ -1,24 +1,34 @@
 #include "viterbi_envelope.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstdlib>
 #include <limits>
 
 using namespace std;
-using boost::shared_ptr;
+
+void* Segment::operator new(size_t size) {
+  MonotonicArena* arena = MonotonicArena::Current();
+  if (!arena) {
+    cerr << "Segments of a ViterbiEnvelope can only be created inside an ArenaScope\n";
+    abort();
+  }
+  return arena->Allocate(size);
+}
 
 ostream& operator<<(ostream& os, const ViterbiEnvelope& env) {
   os << '<';
-  const vector<shared_ptr<Segment> >& segs = env.GetSortedSegs();
+  const vector<Segment*>& segs = env.GetSortedSegs();
   for (int i = 0; i < segs.size(); ++i)
     os << (i==0 ? "" : "|") << "x=" << segs[i]->x << ",b=" << segs[i]->b << ",m=" << segs[i]->m << ",p1=" << segs[i]->p1 << ",p2=" << segs[i]->p2;
   return os << '>';
 }
 
-ViterbiEnvelope::ViterbiEnvelope(int i) {
+ViterbiEnvelope::ViterbiEnvelope(int i) : x_min(kMinusInfinity), x_max(kPlusInfinity) {
   if (i == 0) {
     // do nothing - <>
   } else if (i == 1) {
-    segs.push_back(shared_ptr<Segment>(new Segment(0, 0, 0, shared_ptr<Segment>(), shared_ptr<Segment>())));
+    segs.push_back(new Segment(0, 0, 0, NULL, NULL));
     assert(this->IsMultiplicativeIdentity());
   } else {
     cerr << "Only can create ViterbiEnvelope semiring 0 and 1 with this constructor!\n";
@@ -27,28 +37,35 @@ ViterbiEnvelope::ViterbiEnvelope(int i) {
 }
 
 struct SlopeCompare {
-  bool operator() (const shared_ptr<Segment>& a, const shared_ptr<Segment>& b) const {
+  bool operator() (const Segment* a, const Segment* b) const {
     return a->m < b->m;
   }
 };
 
 const ViterbiEnvelope& ViterbiEnvelope::operator+=(const ViterbiEnvelope& other) {
   if (!other.is_sorted) other.Sort();
+  IntersectInterval(other);
   if (segs.empty()) {
     segs = other.segs;
+    if (x_min != other.x_min || x_max != other.x_max) RemoveOutside();
     return *this;
   }
-  is_sorted = false;
-  int j = segs.size();
-  segs.resize(segs.size() + other.segs.size());
-  for (int i = 0; i < other.segs.size(); ++i)
-    segs[j++] = other.segs[i];
-  assert(j == segs.size());
+  if (!is_sorted) Sort();
+  // both are sorted by slope already, so merging them is linear rather than
+  // sorting the union
+  vector<Segment*> merged(segs.size() + other.segs.size());
+  merge(segs.begin(), segs.end(), other.segs.begin(), other.segs.end(), merged.begin(), SlopeCompare());
+  segs.swap(merged);
+  UpperEnvelope();
   return *this;
 }
 
 void ViterbiEnvelope::Sort() const {
   sort(segs.begin(), segs.end(), SlopeCompare());
+  UpperEnvelope();
+}
+
+void ViterbiEnvelope::UpperEnvelope() const {
   const int k = segs.size();
   int j = 0;
   for (int i = 0; i < k; ++i) {
@@ -71,6 +88,31 @@ void ViterbiEnvelope::Sort() const {
   }
   segs.resize(j);
   is_sorted = true;
+  RemoveOutside();
+}
+
+void ViterbiEnvelope::RemoveOutside() const {
+  if (segs.size() < 2) return;
+  size_t first = 0;
+  while (first + 1 < segs.size() && segs[first + 1]->x <= x_min) ++first;
+  size_t last = segs.size();
+  while (last > first + 1 && segs[last - 1]->x >= x_max) --last;
+  if (first == 0 && last == segs.size()) return;
+  segs.erase(segs.begin() + last, segs.end());
+  if (first) {
+    segs.erase(segs.begin(), segs.begin() + first);
+    // segments may be shared with other envelopes, so copy the one whose x
+    // changes
+    Segment* seg = new Segment(*segs[0]);
+    seg->x = kMinusInfinity;
+    segs[0] = seg;
+  }
+}
+
+void ViterbiEnvelope::Restrict(double xmin, double xmax) {
+  if (xmin > x_min) x_min = xmin;
+  if (xmax < x_max) x_max = xmax;
+  if (!is_sorted) Sort(); else RemoveOutside();
 }
 
 const ViterbiEnvelope& ViterbiEnvelope::operator*=(const ViterbiEnvelope& other) {
@@ -79,11 +121,12 @@ const ViterbiEnvelope& ViterbiEnvelope::operator*=(const ViterbiEnvelope& other)
 
   if (!is_sorted) Sort();
   if (!other.is_sorted) other.Sort();
+  IntersectInterval(other);
 
   if (this->IsEdgeEnvelope()) {
 //    if (other.size() > 1)
 //      cerr << *this << " (TIMES) " << other << endl;
-    shared_ptr<Segment> edge_parent = segs[0];
+    const Segment* edge_parent = segs[0];
     const double& edge_b = edge_parent->b;
     const double& edge_m = edge_parent->m;
     segs.clear();
@@ -92,13 +135,13 @@ const ViterbiEnvelope& ViterbiEnvelope::operator*=(const ViterbiEnvelope& other)
       const double m = seg.m + edge_m;
       const double b = seg.b + edge_b;
       const double& x = seg.x;       // x's don't change with *
-      segs.push_back(shared_ptr<Segment>(new Segment(x, m, b, edge_parent, other.segs[i])));
+      segs.push_back(new Segment(x, m, b, edge_parent, other.segs[i]));
       assert(segs.back()->p1->edge);
     }
 //    if (other.size() > 1)
 //      cerr << " = " << *this << endl;
   } else {
-    vector<shared_ptr<Segment> > new_segs;
+    vector<Segment*> new_segs;
     int this_i = 0;
     int other_i = 0;
     const int this_size  = segs.size();
@@ -114,7 +157,7 @@ const ViterbiEnvelope& ViterbiEnvelope::operator*=(const ViterbiEnvelope& other)
       const double m = this_seg.m + other_seg.m;
       const double b = this_seg.b + other_seg.b;
  
-      new_segs.push_back(shared_ptr<Segment>(new Segment(cur_x, m, b, segs[this_i], other.segs[other_i])));
+      new_segs.push_back(new Segment(cur_x, m, b, segs[this_i], other.segs[other_i]));
       int comp = 0;
       if (this_next_val < other_next_val) comp = -1; else
         if (this_next_val > other_next_val) comp = 1;
@@ -138,6 +181,7 @@ const ViterbiEnvelope& ViterbiEnvelope::operator*=(const ViterbiEnvelope& other)
     }
     segs.swap(new_segs);
   }
+  RemoveOutside();
   //cerr << "Multiply: result=" << (*this) << endl;
   return *this;
 }
@@ -149,7 +193,7 @@ void Segment::ConstructTranslation(vector<WordID>* trans) const {
   while(!cur->edge) {
     ant_trans.resize(ant_trans.size() + 1);
     cur->p2->ConstructTranslation(&ant_trans.back());
-    cur = cur->p1.get();
+    cur = cur->p1;
   }
   size_t ant_size = ant_trans.size();
   vector<const vector<WordID>*> pants(ant_size);
@@ -168,10 +212,22 @@ void Segment::CollectEdgesUsed(std::vector<bool>* edges_used) const {
   if (p2) p2->CollectEdgesUsed(edges_used);
 }
 
+ViterbiEnvelopeWeightFunction::ViterbiEnvelopeWeightFunction(const SparseVector<double>& ori,
+                                                             const SparseVector<double>& dir,
+                                                             const PackedEdgeFeatures* p) :
+    origin(ori), direction(dir), packed(p), x_min(kMinusInfinity), x_max(kPlusInfinity) {
+  ori.init_vector(&dense_origin);
+  dir.init_vector(&dense_direction);
+  packed->PadWeights(&dense_origin);
+  packed->PadWeights(&dense_direction);
+}
+
 ViterbiEnvelope ViterbiEnvelopeWeightFunction::operator()(const Hypergraph::Edge& e) const {
-  const double m = direction.dot(e.feature_values_);
-  const double b = origin.dot(e.feature_values_);
+  const double m = packed ? packed->Dot(e.id_, dense_direction) : direction.dot(e.feature_values_);
+  const double b = packed ? packed->Dot(e.id_, dense_origin) : origin.dot(e.feature_values_);
   Segment* seg = new Segment(m, b, e);
-  return ViterbiEnvelope(1, seg);
+  ViterbiEnvelope env(1, seg);
+  if (x_min > kMinusInfinity || x_max < kPlusInfinity) env.Restrict(x_min, x_max);
+  return env;
 }
 
@@ -3,22 +3,34 @@
 
 #include <vector>
 #include <iostream>
-#include <boost/shared_ptr.hpp>
 
+#include "arena.h"
 #include "hg.h"
 #include "sparse_vector.h"
 
 static const double kMinusInfinity = -std::numeric_limits<double>::infinity();
 static const double kPlusInfinity = std::numeric_limits<double>::infinity();
 
+// Segments are allocated with new from the arena installed (for the calling
+// thread) by an ArenaScope and are never deleted; they are all released when
+// the scope ends, so envelopes must not outlive it:
+//   MonotonicArena arena;
+//   {
+//     ArenaScope scope(&arena);
+//     ViterbiEnvelope env = Inside<ViterbiEnvelope, ViterbiEnvelopeWeightFunction>(hg, NULL, wf);
+//     ...
+//   }
 struct Segment {
-  Segment() : x(), m(), b(), edge() {}
+  Segment() : x(), m(), b(), p1(), p2(), edge() {}
   Segment(double _m, double _b) :
-    x(kMinusInfinity), m(_m), b(_b), edge() {}
-  Segment(double _x, double _m, double _b, const boost::shared_ptr<Segment>& p1_, const boost::shared_ptr<Segment>& p2_) :
+    x(kMinusInfinity), m(_m), b(_b), p1(), p2(), edge() {}
+  Segment(double _x, double _m, double _b, const Segment* p1_, const Segment* p2_) :
     x(_x), m(_m), b(_b), p1(p1_), p2(p2_), edge() {}
   Segment(double _m, double _b, const Hypergraph::Edge& edge) :
-    x(kMinusInfinity), m(_m), b(_b), edge(&edge) {}
+    x(kMinusInfinity), m(_m), b(_b), p1(), p2(), edge(&edge) {}
+
+  static void* operator new(std::size_t size);
+  static void operator delete(void*) {}
 
   double x;                   // x intersection with previous segment in env, or -inf if none
   double m;                   // this line's slope
@@ -26,8 +38,8 @@ struct Segment {
 
   // we keep a pointer to the "parents" of this segment so we can reconstruct
   // the Viterbi translation corresponding to this segment
-  boost::shared_ptr<Segment> p1;
-  boost::shared_ptr<Segment> p2;
+  const Segment* p1;
+  const Segment* p2;
 
   // only Segments created from an edge using the ViterbiEnvelopeWeightFunction
   // have rules
@@ -45,17 +57,24 @@ struct Segment {
 // it defines constructors for 0, 1, and the operations + and *
 struct ViterbiEnvelope {
   // create semiring zero
-  ViterbiEnvelope() : is_sorted(true) {}  // zero
+  ViterbiEnvelope() : is_sorted(true), x_min(kMinusInfinity), x_max(kPlusInfinity) {}  // zero
   // for debugging:
-  ViterbiEnvelope(const std::vector<boost::shared_ptr<Segment> >& s) : segs(s) { Sort(); }
+  ViterbiEnvelope(const std::vector<Segment*>& s) :
+    segs(s), x_min(kMinusInfinity), x_max(kPlusInfinity) { Sort(); }
   // create semiring 1 or 0
   explicit ViterbiEnvelope(int i);
-  ViterbiEnvelope(int n, Segment* seg) : is_sorted(true), segs(n, boost::shared_ptr<Segment>(seg)) {}
+  ViterbiEnvelope(int n, Segment* seg) :
+    is_sorted(true), segs(n, seg), x_min(kMinusInfinity), x_max(kPlusInfinity) {}
   const ViterbiEnvelope& operator+=(const ViterbiEnvelope& other);
   const ViterbiEnvelope& operator*=(const ViterbiEnvelope& other);
+  // only the part of the envelope over [xmin, xmax] is needed: segments that
+  // are the maximum only outside it are dropped, here and in all envelopes
+  // computed from this one (the first segment kept extends to -inf and the
+  // last one to +inf, as usual)
+  void Restrict(double xmin, double xmax);
   bool IsMultiplicativeIdentity() const {
     return size() == 1 && (segs[0]->b == 0.0 && segs[0]->m == 0.0) && (!segs[0]->edge) && (!segs[0]->p1) && (!segs[0]->p2); }
-  const std::vector<boost::shared_ptr<Segment> >& GetSortedSegs() const {
+  const std::vector<Segment*>& GetSortedSegs() const {
     if (!is_sorted) Sort();
     return segs;
   }
@@ -65,17 +84,38 @@ struct ViterbiEnvelope {
   bool IsEdgeEnvelope() const {
     return segs.size() == 1 && segs[0]->edge; }
   void Sort() const;
+  // segs are sorted by slope; keep the lines of the upper envelope and set
+  // the x where each one starts being the maximum
+  void UpperEnvelope() const;
+  void RemoveOutside() const;
+  void IntersectInterval(const ViterbiEnvelope& other) {
+    if (other.x_min > x_min) x_min = other.x_min;
+    if (other.x_max < x_max) x_max = other.x_max;
+  }
   mutable bool is_sorted;
-  mutable std::vector<boost::shared_ptr<Segment> > segs;
+  mutable std::vector<Segment*> segs;
+  double x_min, x_max;  // see Restrict()
 };
 std::ostream& operator<<(std::ostream& os, const ViterbiEnvelope& env);
 
 struct ViterbiEnvelopeWeightFunction {
   ViterbiEnvelopeWeightFunction(const SparseVector<double>& ori,
-                                const SparseVector<double>& dir) : origin(ori), direction(dir) {}
+                                const SparseVector<double>& dir) :
+    origin(ori), direction(dir), packed(), x_min(kMinusInfinity), x_max(kPlusInfinity) {}
+  // computes the edge lines from packed (which must have been built from the
+  // forest the envelope is computed for) instead of the edge feature vectors
+  ViterbiEnvelopeWeightFunction(const SparseVector<double>& ori,
+                                const SparseVector<double>& dir,
+                                const PackedEdgeFeatures* p);
   ViterbiEnvelope operator()(const Hypergraph::Edge& e) const;
   const SparseVector<double> origin;
   const SparseVector<double> direction;
+  const PackedEdgeFeatures* packed;
+  // the line search interval the envelopes are restricted to (by default
+  // the whole line, see ViterbiEnvelope::Restrict)
+  double x_min, x_max;
+  std::vector<double> dense_origin;
+  std::vector<double> dense_direction;
 };
 
 #endif
@@ -115,10 +115,8 @@ lextrans_use_null=true
 intersection_strategy=full
 
 grammar=$align_dir/grammars/corpus.$direction.lex-grammar.gz
-# grammar=$align_dir/grammars/freq_grammar.$direction.gz
-# per_sentence_grammar_file=$align_dir/grammars/psg.$direction
 
-feature_function=WordPairFeatures $align_dir/grammars/wordpairs.$direction.features.gz
+lextrans_word_pair_features=$align_dir/grammars/wordpairs.$direction.features.gz
 feature_function=LexicalPairIndicator
 # stem translation
 feature_function=LexicalPairIndicator S $align_dir/grammars/corpus.stemmed.$first $align_dir/grammars/${second}stem.map